@@ -1,11 +1,15 @@
 
 """Ledger Nano Bitcoin app client"""
 
-from .client_base import Client, TransportClient, PartialSignature
-from .client import createClient
+from .client_base import AppInfo, Client, TransportClient, PartialSignature, SignPsbtProgress, invalidate_app_info
+from .client_command import ProgressPhase
+from .client import ClientPool, createClient
+from .async_client import AsyncNewClient, AsyncTcpTransportClient, ExecutorTransportClient
 from .common import Chain
+from .signature_verification import InvalidSignatureError
 
 from .wallet import AddressType, WalletPolicy, MultisigWallet, WalletType
+from .address import WalletAddressDeriver
 
 __version__ = '0.2.0'
 
@@ -13,10 +17,20 @@ __all__ = [
     "Client",
     "TransportClient",
     "PartialSignature",
+    "SignPsbtProgress",
+    "ProgressPhase",
     "createClient",
+    "ClientPool",
+    "AppInfo",
+    "invalidate_app_info",
+    "AsyncNewClient",
+    "AsyncTcpTransportClient",
+    "ExecutorTransportClient",
     "Chain",
+    "InvalidSignatureError",
     "AddressType",
     "WalletPolicy",
     "MultisigWallet",
-    "WalletType"
+    "WalletType",
+    "WalletAddressDeriver"
 ]
@@ -0,0 +1,81 @@
+"""
+Derivation on the host of the addresses of a wallet policy, in order to cross-check the addresses returned by the
+device, for example by get_wallet_addresses.
+
+The two descriptors of the wallet policy (receive and change) are parsed once, and each key caches its node at the
+change step of the derivation; therefore, each address only derives the last step of each key, and a range of
+addresses is derived incrementally from the same nodes.
+"""
+
+from typing import List
+
+from . import _base58 as base58
+from . import _segwit_addr as segwit_addr
+from .common import Chain
+from .descriptor import Descriptor, parse_descriptor
+from .wallet import WalletPolicy
+
+
+def script_to_address(script: bytes, chain: Chain) -> str:
+    """Returns the address of an output script on the given chain.
+
+    Raises ValueError if the script is not a p2pkh, p2sh or segwit output script.
+    """
+
+    if chain == Chain.MAIN:
+        p2pkh_version, p2sh_version, hrp = b"\x00", b"\x05", "bc"
+    elif chain == Chain.REGTEST:
+        p2pkh_version, p2sh_version, hrp = b"\x6f", b"\xc4", "bcrt"
+    else:
+        p2pkh_version, p2sh_version, hrp = b"\x6f", b"\xc4", "tb"
+
+    if len(script) == 25 and script[:3] == b"\x76\xa9\x14" and script[23:] == b"\x88\xac":
+        return base58.to_address(script[3:23], p2pkh_version)
+    if len(script) == 23 and script[:2] == b"\xa9\x14" and script[22:] == b"\x87":
+        return base58.to_address(script[2:22], p2sh_version)
+    # segwit: OP_0 or OP_1..OP_16, followed by a push of 2 to 40 bytes
+    if 4 <= len(script) <= 42 and (script[0] == 0 or 0x51 <= script[0] <= 0x60) and script[1] == len(script) - 2:
+        witver = 0 if script[0] == 0 else script[0] - 0x50
+        return segwit_addr.encode(hrp, witver, script[2:])
+    raise ValueError("The script has no address")
+
+
+class WalletAddressDeriver:
+    """
+    Derives the receive and change addresses of a wallet policy on the host.
+
+    Only the policies supported by the descriptor module can be derived: pkh, wpkh, sh, wsh, multi and sortedmulti, and
+    tr with pk leaves; the constructor raises ValueError for the others, like the miniscript policies.
+    """
+
+    def __init__(self, wallet: WalletPolicy, chain: Chain = Chain.MAIN) -> None:
+        """
+        Parameters
+        ----------
+        wallet : WalletPolicy
+            The wallet policy; it is parsed at construction, so later changes to it are ignored.
+        chain : Chain
+            The chain of the addresses.
+        """
+        self.chain = chain
+        self._descriptors: List[Descriptor] = [parse_descriptor(wallet.get_descriptor(change)) for change in [False, True]]
+
+    def get_script(self, change: int, address_index: int) -> bytes:
+        """Returns the output script at the given change and address index."""
+
+        if change not in [0, 1]:
+            raise ValueError("change must be 0 or 1")
+        if not 0 <= address_index < 0x80000000:
+            raise ValueError("The address index must be an unhardened index")
+        return self._descriptors[change].expand(address_index).output_script
+
+    def get_address(self, change: int, address_index: int) -> str:
+        """Returns the address at the given change and address index, like get_wallet_address."""
+
+        return script_to_address(self.get_script(change, address_index), self.chain)
+
+    def get_addresses(self, change: int, first_address_index: int, n_addresses: int) -> List[str]:
+        """Returns the addresses of `n_addresses` consecutive address indexes starting at `first_address_index`, like
+        get_wallet_addresses."""
+
+        return [self.get_address(change, i) for i in range(first_address_index, first_address_index + n_addresses)]
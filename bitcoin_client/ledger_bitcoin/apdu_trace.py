@@ -0,0 +1,367 @@
+"""Instrumentation of the APDUs exchanged with the hardware wallet.
+
+A `TracingTransportClient` wraps the transport client of a `Client`, and reports each APDU exchange to an
+`ApduTracer`. The `TraceCollector` records them, in order to compute statistics on the signing sessions, or to
+export a trace that can be replayed with a `ReplayTransportClient`.
+
+A `SessionRecording` keeps the client commands of a session with the data known to the client interpreter, so that
+the host side of the session can be replayed (and benchmarked) without a device, by the interpreters of the Python,
+Rust and JS clients:
+
+    python -m ledger_bitcoin.apdu_trace session.json --repeat 100
+"""
+
+import argparse
+import json
+import threading
+import time
+from dataclasses import dataclass
+from typing import Dict, Iterable, List, Optional, TextIO, Tuple
+
+from .client_base import ApduException
+from .client_command import ClientCommandCode, ClientCommandInterpreter
+from .command_builder import BitcoinCommandBuilder, BitcoinInsType, DefaultInsType, FrameworkInsType
+from .merkle import MerkleTree
+
+
+def serialize_apdu(cla: int, ins: int, p1: int, p2: int, data: bytes) -> bytes:
+    return bytes([cla, ins, p1, p2, len(data)]) + data
+
+
+@dataclass(frozen=True)
+class ApduExchange:
+    """An APDU sent to the hardware wallet, with its response.
+
+    The `client_command` is set for the CONTINUE_INTERRUPTED APDUs, and is the code of the client command (one of
+    `ClientCommandCode`) that the APDU responds to. The `host_time` is the time spent by the host between the previous
+    response of the hardware wallet and this APDU, that is, executing the client command; it is 0 for the first APDU
+    of a command.
+    """
+    cla: int
+    ins: int
+    client_command: Optional[int]
+    request: bytes
+    response: bytes
+    sw: int
+    device_time: float
+    host_time: float
+
+    @property
+    def name(self) -> str:
+        """The name of the client command if any, otherwise the name of the instruction."""
+        try:
+            if self.client_command is not None:
+                return ClientCommandCode(self.client_command).name
+            if self.cla == BitcoinCommandBuilder.CLA_BITCOIN:
+                return BitcoinInsType(self.ins).name
+            if self.cla == BitcoinCommandBuilder.CLA_DEFAULT:
+                return DefaultInsType(self.ins).name
+        except ValueError:
+            pass
+        return f"{self.cla:02x}{self.ins:02x}"
+
+
+class ApduTracer:
+    """Interface of the objects that are notified of each APDU exchange of a `TracingTransportClient`."""
+
+    def on_exchange(self, exchange: ApduExchange) -> None:
+        raise NotImplementedError
+
+
+class TracingTransportClient:
+    """Wraps a transport client (a `TransportClient`, or any object with the same `apdu_exchange` method, like the
+    speculos client), reporting each APDU exchange to `tracer`."""
+
+    def __init__(self, transport_client, tracer: ApduTracer):
+        self.transport_client = transport_client
+        self.tracer = tracer
+
+        # the client command requested by the last response, and the time it was received
+        self._pending_command: Optional[int] = None
+        self._last_response_time: float = 0.0
+
+    def apdu_exchange(
+        self, cla: int, ins: int, data: bytes = b"", p1: int = 0, p2: int = 0
+    ) -> bytes:
+        start = time.perf_counter()
+
+        if cla == BitcoinCommandBuilder.CLA_FRAMEWORK and ins == FrameworkInsType.CONTINUE_INTERRUPTED:
+            client_command = self._pending_command
+            host_time = start - self._last_response_time
+        else:
+            client_command = None
+            host_time = 0.0
+
+        try:
+            response = self.transport_client.apdu_exchange(cla, ins, data, p1, p2)
+            sw = 0x9000
+        except ApduException as e:
+            response = e.data
+            sw = e.sw
+
+        end = time.perf_counter()
+
+        self._pending_command = response[0] if sw == 0xE000 and len(response) > 0 else None
+        self._last_response_time = end
+
+        self.tracer.on_exchange(ApduExchange(
+            cla=cla,
+            ins=ins,
+            client_command=client_command,
+            request=serialize_apdu(cla, ins, p1, p2, data),
+            response=response,
+            sw=sw,
+            device_time=end - start,
+            host_time=host_time,
+        ))
+
+        if sw != 0x9000:
+            raise ApduException(sw, response)
+
+        return response
+
+    def apdu_exchange_nowait(
+        self, cla: int, ins: int, data: bytes = b"", p1: int = 0, p2: int = 0
+    ):
+        raise NotImplementedError()
+
+    def stop(self) -> None:
+        self.transport_client.stop()
+
+
+@dataclass
+class CommandStats:
+    """Statistics of the APDU exchanges of one type, as computed by `histogram`."""
+    count: int = 0
+    bytes_sent: int = 0
+    bytes_received: int = 0
+    device_time: float = 0.0
+    host_time: float = 0.0
+
+
+def histogram(exchanges: Iterable[ApduExchange]) -> Dict[str, CommandStats]:
+    """Returns the statistics of `exchanges`, grouped by the name of the instruction or client command.
+
+    The bytes received include the status word.
+    """
+
+    result: Dict[str, CommandStats] = {}
+    for exchange in exchanges:
+        stats = result.setdefault(exchange.name, CommandStats())
+        stats.count += 1
+        stats.bytes_sent += len(exchange.request)
+        stats.bytes_received += len(exchange.response) + 2
+        stats.device_time += exchange.device_time
+        stats.host_time += exchange.host_time
+    return result
+
+
+class TraceCollector(ApduTracer):
+    """An `ApduTracer` that records all the APDU exchanges.
+
+    A collector can be shared by the transport clients of several hardware wallets.
+    """
+
+    def __init__(self):
+        self.exchanges: List[ApduExchange] = []
+        self._lock = threading.Lock()
+
+    def on_exchange(self, exchange: ApduExchange) -> None:
+        with self._lock:
+            self.exchanges.append(exchange)
+
+    def sessions(self) -> List[List[ApduExchange]]:
+        """Returns the recorded exchanges split by command: each session starts with a command, followed by the
+        exchanges of the client commands it requested."""
+
+        result: List[List[ApduExchange]] = []
+        for exchange in self.exchanges:
+            if exchange.client_command is None or len(result) == 0:
+                result.append([])
+            result[-1].append(exchange)
+        return result
+
+    def histogram(self) -> Dict[str, CommandStats]:
+        """Returns the statistics of all the recorded exchanges, as computed by `histogram`."""
+        return histogram(self.exchanges)
+
+    def export(self, f: TextIO) -> None:
+        """Writes the recorded exchanges to `f` as a JSON list of "=> <apdu>" and "<= <response><sw>" strings, the
+        format of the recorded exchanges in the tests of the Rust client, that can be replayed with a
+        `ReplayTransportClient`."""
+
+        json.dump(self.exchange_lines(), f, indent=2)
+
+    def exchange_lines(self) -> List[str]:
+        lines: List[str] = []
+        for exchange in self.exchanges:
+            lines.append(f"=> {exchange.request.hex()}")
+            lines.append(f"<= {exchange.response.hex()}{exchange.sw:04x}")
+        return lines
+
+
+def load_trace(f: TextIO) -> List[str]:
+    """Reads a trace written by `TraceCollector.export`."""
+    return json.load(f)
+
+
+class ReplayTransportClient:
+    """A transport client that replays the responses of a recorded trace, checking that the APDUs are the recorded
+    ones."""
+
+    def __init__(self, exchange_lines: List[str]):
+        self.exchanges: List[Tuple[bytes, bytes]] = []
+        request = b""
+        for line in exchange_lines:
+            line = line.replace(" ", "")
+            if line.startswith("=>"):
+                request = bytes.fromhex(line[2:])
+            elif line.startswith("<="):
+                self.exchanges.append((request, bytes.fromhex(line[2:])))
+        self.current = 0
+
+    def apdu_exchange(
+        self, cla: int, ins: int, data: bytes = b"", p1: int = 0, p2: int = 0
+    ) -> bytes:
+        request = serialize_apdu(cla, ins, p1, p2, data)
+        if self.current >= len(self.exchanges) or self.exchanges[self.current][0] != request:
+            raise ValueError(f"Unexpected APDU at position {self.current}: {request.hex()}")
+
+        response = self.exchanges[self.current][1]
+        self.current += 1
+
+        sw = int.from_bytes(response[-2:], byteorder="big")
+        if sw != 0x9000:
+            raise ApduException(sw, response[:-2])
+        return response[:-2]
+
+    def apdu_exchange_nowait(
+        self, cla: int, ins: int, data: bytes = b"", p1: int = 0, p2: int = 0
+    ):
+        raise NotImplementedError()
+
+    def stop(self) -> None:
+        pass
+
+
+@dataclass
+class SessionRecording:
+    """The client commands of a session, with everything the client interpreter needs to answer them.
+
+    The `client_commands` are the pairs of a request of the hardware wallet (the data of a SW_INTERRUPTED_EXECUTION
+    response, including the queued YIELD messages if `queued_yields` is set) and the response of the host (the data
+    of the following CONTINUE_INTERRUPTED APDU). The known data is a snapshot of the preimages and of the Merkleized
+    lists (by their elements) known to the interpreter.
+
+    The recordings are exported as JSON objects with the same fields, the bytes being hex strings; the interpreters
+    of the Rust and JS clients replay them in their tests, and can only do so with the default `max_response_len`.
+    """
+    queued_yields: bool
+    max_response_len: int
+    preimages: List[bytes]
+    lists: List[List[bytes]]
+    client_commands: List[Tuple[bytes, bytes]]
+
+    @classmethod
+    def record(cls, session: List[ApduExchange], interpreter: ClientCommandInterpreter) -> "SessionRecording":
+        """Returns the recording of a session traced by a `TraceCollector` (one of its `sessions`).
+
+        :param session: The APDU exchanges of the session.
+        :param interpreter: The interpreter of the session, or one that knows the same data, for example one returned
+            by `MerkleizedPsbt.new_client_interpreter`. The Merkle trees of streams are not supported.
+        """
+
+        lists: List[List[bytes]] = []
+        leaf_preimages = set()
+        for mt in interpreter.known_trees.values():
+            if not isinstance(mt, MerkleTree):
+                raise ValueError("The Merkle trees of streams cannot be recorded")
+            leaves = [mt.get(i) for i in range(len(mt))]
+            lists.append([interpreter.known_preimages[leaf][1:] for leaf in leaves])
+            leaf_preimages.update(leaves)
+        preimages = [preimage for hash, preimage in interpreter.known_preimages.items() if hash not in leaf_preimages]
+
+        client_commands: List[Tuple[bytes, bytes]] = []
+        for exchange, next_exchange in zip(session, session[1:]):
+            if exchange.sw == 0xE000:
+                # the data of the CONTINUE_INTERRUPTED APDU, after its 5-byte header
+                client_commands.append((exchange.response, next_exchange.request[5:]))
+
+        return cls(
+            queued_yields=interpreter.queued_yields,
+            max_response_len=interpreter.max_response_len,
+            preimages=preimages,
+            lists=lists,
+            client_commands=client_commands,
+        )
+
+    def new_interpreter(self) -> ClientCommandInterpreter:
+        """Returns a new interpreter with the known data and the settings of the recorded one."""
+
+        interpreter = ClientCommandInterpreter()
+        for preimage in self.preimages:
+            interpreter.add_known_preimage(preimage)
+        for elements in self.lists:
+            interpreter.add_known_list(elements)
+        interpreter.queued_yields = self.queued_yields
+        interpreter.max_response_len = self.max_response_len
+        return interpreter
+
+    def replay(self, interpreter: Optional[ClientCommandInterpreter] = None) -> None:
+        """Feeds the recorded requests to `interpreter` (by default, a new one), checking that its responses are the
+        recorded ones."""
+
+        if interpreter is None:
+            interpreter = self.new_interpreter()
+
+        for i, (request, response) in enumerate(self.client_commands):
+            if interpreter.execute(request) != response:
+                raise ValueError(f"Unexpected response to the client command at position {i}: {request.hex()}")
+
+    def export(self, f: TextIO) -> None:
+        json.dump({
+            "queued_yields": self.queued_yields,
+            "max_response_len": self.max_response_len,
+            "preimages": [preimage.hex() for preimage in self.preimages],
+            "lists": [[el.hex() for el in elements] for elements in self.lists],
+            "client_commands": [[request.hex(), response.hex()] for request, response in self.client_commands],
+        }, f, indent=2)
+
+    @classmethod
+    def load(cls, f: TextIO) -> "SessionRecording":
+        """Reads a recording written by `export`."""
+
+        obj = json.load(f)
+        return cls(
+            queued_yields=obj["queued_yields"],
+            max_response_len=obj["max_response_len"],
+            preimages=[bytes.fromhex(preimage) for preimage in obj["preimages"]],
+            lists=[[bytes.fromhex(el) for el in elements] for elements in obj["lists"]],
+            client_commands=[(bytes.fromhex(request), bytes.fromhex(response))
+                             for request, response in obj["client_commands"]],
+        )
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description="Replays the client commands of session recordings, and reports "
+                                                 "the throughput of the client interpreter.")
+    parser.add_argument("recordings", nargs="+", help="the files written by SessionRecording.export")
+    parser.add_argument("--repeat", type=int, default=10, help="the number of replays of each recording")
+    args = parser.parse_args()
+
+    for path in args.recordings:
+        with open(path, "r") as f:
+            recording = SessionRecording.load(f)
+
+        start = time.perf_counter()
+        for _ in range(args.repeat):
+            recording.replay()
+        elapsed = time.perf_counter() - start
+
+        n_commands = args.repeat * len(recording.client_commands)
+        print(f"{path}: {n_commands / elapsed:.0f} client commands/s "
+              f"({elapsed / args.repeat * 1000:.2f} ms per replay, including the interpreter setup)")
+
+
+if __name__ == "__main__":
+    main()
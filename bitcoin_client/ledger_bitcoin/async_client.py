@@ -0,0 +1,260 @@
+"""Asynchronous client of the app, for asyncio applications.
+
+`AsyncNewClient` has the same commands as `NewClient`, as coroutines: as it runs the same command flows (see
+`CommandFlow`) with an asynchronous transport, a single event loop can drive the signing sessions of many hardware
+wallets at the same time, without a thread for each of them:
+
+    transport_client = await AsyncTcpTransportClient.connect("127.0.0.1", 9999)
+    async with AsyncNewClient(transport_client, chain=Chain.TEST) as client:
+        signatures = await client.sign_psbt(psbt, wallet, None)
+
+The speculos emulator is reached natively over TCP by `AsyncTcpTransportClient`, while the blocking transports, like
+the HID one of `TransportClient`, are wrapped by `ExecutorTransportClient`, that only uses a thread of an executor
+during each exchange.
+"""
+
+import asyncio
+import struct
+from concurrent.futures import Executor
+from typing import BinaryIO, Callable, List, Optional, Sequence, Tuple, Union
+
+from .client import CommandFlow, NewClientFlows, T
+from .client_base import ApduException, PartialSignature, SignPsbtProgress, print_apdu, print_response
+from .client_command import ClientCommandInterpreter, ProgressPhase, WalletDataCache
+from .command_builder import AppFeature
+from .common import Chain
+from .merkleized_psbt import MerkleizedPsbt
+from .psbt import PSBT
+from .raw_psbt import RawPsbt
+from .transport import Transport
+from .wallet import WalletPolicy
+
+
+class AsyncTransportClient:
+    """Interface of the asynchronous transports of `AsyncNewClient`, the counterpart of `TransportClient`."""
+
+    async def apdu_exchange(self, cla: int, ins: int, data: bytes = b"", p1: int = 0, p2: int = 0) -> bytes:
+        """Sends an APDU, and returns the data of its response; raises an `ApduException` if the status word of the
+        response is not 0x9000."""
+        raise NotImplementedError
+
+    async def stop(self) -> None:
+        """Closes the transport."""
+        raise NotImplementedError
+
+
+class AsyncTcpTransportClient(AsyncTransportClient):
+    """Asynchronous transport to the APDU port of the speculos emulator, with the framing of the TCP client of
+    `TransportClient`: each APDU is prefixed by its length as a big-endian 32-bit integer, and each response is the
+    length of its data as a big-endian 32-bit integer, the data, then the 2-byte status word."""
+
+    def __init__(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+        self.reader = reader
+        self.writer = writer
+
+    @classmethod
+    async def connect(cls, server: str = "127.0.0.1", port: int = 9999) -> "AsyncTcpTransportClient":
+        reader, writer = await asyncio.open_connection(server, port)
+        return cls(reader, writer)
+
+    async def apdu_exchange(self, cla: int, ins: int, data: bytes = b"", p1: int = 0, p2: int = 0) -> bytes:
+        apdu = Transport.apdu_header(cla, ins, p1, p2, None, len(data)) + data
+        self.writer.write(struct.pack(">I", len(apdu)) + apdu)
+        await self.writer.drain()
+
+        length = struct.unpack(">I", await self.reader.readexactly(4))[0]
+        response = await self.reader.readexactly(length)
+        sw = int.from_bytes(await self.reader.readexactly(2), byteorder="big")
+
+        if sw != 0x9000:
+            raise ApduException(sw, response)
+
+        return response
+
+    async def stop(self) -> None:
+        self.writer.close()
+        await self.writer.wait_closed()
+
+
+class ExecutorTransportClient(AsyncTransportClient):
+    """Asynchronous transport that wraps a blocking transport client (a `TransportClient`, or any object with the same
+    `apdu_exchange` and `stop` methods, like the speculos client), whose exchanges are run in `executor`; by default,
+    in the default executor of the event loop. A thread is only used during each exchange, so many hardware wallets
+    can share a small pool of threads."""
+
+    def __init__(self, transport_client, executor: Optional[Executor] = None) -> None:
+        self.transport_client = transport_client
+        self.executor = executor
+
+    async def apdu_exchange(self, cla: int, ins: int, data: bytes = b"", p1: int = 0, p2: int = 0) -> bytes:
+        loop = asyncio.get_running_loop()
+        return await loop.run_in_executor(
+            self.executor, lambda: self.transport_client.apdu_exchange(cla, ins, data, p1, p2))
+
+    async def stop(self) -> None:
+        self.transport_client.stop()
+
+
+class AsyncNewClient(NewClientFlows):
+    """Asynchronous client of the app from version 2.1.0, the counterpart of `NewClient`; see the documentation of the
+    methods of `Client`, that are coroutines here.
+
+    The commands of the same client are run one at a time, in the order in which they are awaited, as a hardware wallet
+    only runs one command at a time; the commands of different clients run concurrently. Unlike `NewClient`, the
+    responses to the client commands are never computed speculatively, as that would require a thread for each
+    session. The callback `on_progress` is called in the event loop, and must not block it; the signatures are also
+    verified in the event loop, if `verify_signatures` is set (see `NewClient`).
+    """
+
+    def __init__(self, transport_client: AsyncTransportClient, chain: Chain = Chain.MAIN, debug: bool = False,
+                 wallet_cache: Optional[WalletDataCache] = None,
+                 on_progress: Optional[Callable[[ProgressPhase, int, int], None]] = None,
+                 verify_signatures: Union[bool, Executor] = False) -> None:
+        super().__init__(wallet_cache, on_progress, verify_signatures=verify_signatures)
+        self.transport_client = transport_client
+        self.chain = chain
+        self.debug = debug
+        # created in the event loop of the first command, as the locks of Python 3.9 and older bind to a loop
+        self._lock: Optional[asyncio.Lock] = None
+
+    async def __aenter__(self):
+        return self
+
+    async def __aexit__(self, exc_type, exc_val, exc_tb):
+        await self.transport_client.stop()
+
+    async def stop(self) -> None:
+        """Stops the transport_client."""
+
+        await self.transport_client.stop()
+
+    async def _apdu_exchange(self, apdu: dict) -> Tuple[int, bytes]:
+        try:
+            if self.debug:
+                print_apdu(apdu)
+
+            response = await self.transport_client.apdu_exchange(**apdu)
+            if self.debug:
+                print_response(0x9000, response)
+
+            return 0x9000, response
+        except ApduException as e:
+            if self.debug:
+                print_response(e.sw, e.data)
+
+            return e.sw, e.data
+
+    async def _make_request(
+        self, apdu: dict, client_intepreter: Optional[ClientCommandInterpreter] = None
+    ) -> Tuple[int, bytes]:
+        if client_intepreter is not None:
+            self._prepare_interpreter(client_intepreter)
+
+        sw, response = await self._apdu_exchange(apdu)
+
+        while sw == 0xE000:
+            if not client_intepreter:
+                raise RuntimeError("Unexpected SW_INTERRUPTED_EXECUTION received.")
+
+            command_response = client_intepreter.execute(response)
+            sw, response = await self._apdu_exchange(
+                self.builder.continue_interrupted(command_response)
+            )
+
+        return sw, response
+
+    async def _drive(self, flow: CommandFlow[T]) -> T:
+        # the exceptions of the requests, including the cancellation of the task, are raised in the flow, so that it
+        # can handle them
+        try:
+            request = next(flow)
+            while True:
+                try:
+                    result = await self._make_request(*request)
+                except BaseException as e:
+                    request = flow.throw(e)
+                else:
+                    request = flow.send(result)
+        except StopIteration as e:
+            return e.value
+
+    async def _run(self, flow: CommandFlow[T], needs_app_features: bool = True) -> T:
+        if self._lock is None:
+            self._lock = asyncio.Lock()
+
+        async with self._lock:
+            # the flows query the features of the app without I/O
+            if needs_app_features and self._app_features is None:
+                await self._drive(self._get_app_features_flow())
+            return await self._drive(flow)
+
+    async def get_version(self) -> Tuple[str, str, bytes]:
+        return await self._run(self._get_version_flow(), needs_app_features=False)
+
+    async def get_app_features(self) -> Tuple[int, AppFeature]:
+        return await self._run(self._get_app_features_flow(), needs_app_features=False)
+
+    async def get_extended_pubkey(self, path: str, display: bool = False) -> str:
+        return await self._run(self._get_extended_pubkey_flow(path, display))
+
+    async def get_extended_pubkeys(self, paths: List[str]) -> List[str]:
+        return await self._run(self._get_extended_pubkeys_flow(paths))
+
+    async def register_wallet(self, wallet: WalletPolicy) -> Tuple[bytes, bytes]:
+        wallet_id, wallet_hmac, _ = await self._run(self._register_wallet_flow(wallet, False))
+        return wallet_id, wallet_hmac
+
+    async def register_wallet_with_compiled_policy(self, wallet: WalletPolicy) -> Tuple[bytes, bytes, bytes]:
+        return await self._run(self._register_wallet_flow(wallet, True))
+
+    async def register_and_store_wallet(self, wallet: WalletPolicy) -> Tuple[bytes, bytes]:
+        wallet_id, wallet_hmac, _ = await self._run(self._register_wallet_flow(wallet, False, store=True))
+        return wallet_id, wallet_hmac
+
+    async def get_wallet_address(
+        self,
+        wallet: WalletPolicy,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        address_index: int,
+        display: bool,
+    ) -> str:
+        return await self._run(self._get_wallet_address_flow(wallet, wallet_hmac, change, address_index, display))
+
+    async def get_wallet_addresses(
+        self,
+        wallet: WalletPolicy,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        first_address_index: int,
+        n_addresses: int,
+    ) -> List[str]:
+        return await self._run(self._get_wallet_addresses_flow(wallet, wallet_hmac, change, first_address_index,
+                                                               n_addresses))
+
+    async def register_payee_list(self, scripts: List[bytes]) -> Tuple[bytes, bytes]:
+        return await self._run(self._register_payee_list_flow(scripts))
+
+    async def sign_psbt(self, psbt: Union[PSBT, RawPsbt, bytes, str, MerkleizedPsbt], wallet: WalletPolicy,
+                        wallet_hmac: Optional[bytes],
+                        additional_wallets: Sequence[Tuple[WalletPolicy, Optional[bytes]]] = (),
+                        progress: Optional[SignPsbtProgress] = None) -> List[Tuple[int, PartialSignature]]:
+        return await self._run(self._sign_psbt_flow(psbt, wallet, wallet_hmac, additional_wallets, progress))
+
+    async def sign_psbt_batch(self, psbts: Sequence[Union[PSBT, RawPsbt, bytes, str, MerkleizedPsbt]],
+                              wallet: WalletPolicy,
+                              wallet_hmac: Optional[bytes]) -> List[Tuple[int, int, PartialSignature]]:
+        return await self._run(self._sign_psbt_batch_flow(psbts, wallet, wallet_hmac))
+
+    async def get_master_fingerprint(self) -> bytes:
+        return await self._run(self._get_master_fingerprint_flow())
+
+    async def open_wallet_session(self, wallet: WalletPolicy, wallet_hmac: bytes,
+                                  compiled_policy: Optional[bytes] = None) -> None:
+        await self._run(self._open_wallet_session_flow(wallet, wallet_hmac, compiled_policy))
+
+    async def sign_message(self, message: Union[str, bytes, BinaryIO], bip32_path: str) -> str:
+        return await self._run(self._sign_message_flow(message, bip32_path))
+
+    async def sign_messages(self, messages: List[Tuple[Union[str, bytes], str]], account_path: str) -> List[str]:
+        return await self._run(self._sign_messages_flow(messages, account_path))
@@ -1,38 +1,28 @@
 from packaging.version import parse as parse_version
-from typing import Tuple, List, Mapping, Optional, Union
+from typing import BinaryIO, Callable, Dict, Generator, Tuple, List, Mapping, Optional, Sequence, TypeVar, Union
 import base64
-from io import BytesIO, BufferedReader
+import threading
+from concurrent.futures import Executor, ThreadPoolExecutor
+from io import BytesIO
 
 from bitcoin_client.ledger_bitcoin.errors import UnknownDeviceError
 
-from .command_builder import BitcoinCommandBuilder, BitcoinInsType
-from .common import Chain, read_uint, read_varint
-from .client_command import ClientCommandInterpreter
-from .client_base import Client, TransportClient, PartialSignature
+from .command_builder import (ACCESS_PLAN_PROTOCOL_VERSION, AppFeature, BitcoinCommandBuilder, BitcoinInsType,
+                              CURRENT_PROTOCOL_VERSION, HASH_REFS_PROTOCOL_VERSION, HASHED_MESSAGE_PROTOCOL_VERSION,
+                              MAX_EXTENDED_APDU_DATA_LEN, PROGRESS_PROTOCOL_VERSION, QUEUED_YIELDS_PROTOCOL_VERSION,
+                              TREE_STREAM_PROTOCOL_VERSION, serialize_additional_wallets)
+from .common import Chain, bip32_path_from_string, read_uint, read_varint, write_varint
+from .client_command import ClientCommandInterpreter, ProgressPhase, WalletDataCache
+from .client_base import (GET_VERSION_APDU, AppInfo, Client, TransportClient, PartialSignature, SignPsbtProgress,
+                          get_app_info, invalidate_app_info, parse_get_version_response, set_app_info)
 from .client_legacy import LegacyClient
 from .exception import DeviceException
-from .merkle import get_merkleized_map_commitment
+from .merkle import StreamedMerkleTree, element_hash
+from .merkleized_psbt import MerkleizedPsbt
+from .raw_psbt import RawPsbt
+from .signature_verification import verify_partial_signatures
 from .wallet import WalletPolicy, WalletType
-from .psbt import PSBT, normalize_psbt
-from ._serialize import deser_string
-
-
-def parse_stream_to_map(f: BufferedReader) -> Mapping[bytes, bytes]:
-    result = {}
-    while True:
-        try:
-            key = deser_string(f)
-        except Exception:
-            break
-
-        # Check for separator
-        if len(key) == 0:
-            break
-
-        value = deser_string(f)
-
-        result[key] = value
-    return result
+from .psbt import PSBT
 
 
 def _make_partial_signature(pubkey_augm: bytes, signature: bytes) -> PartialSignature:
@@ -52,53 +42,111 @@ def _make_partial_signature(pubkey_augm: bytes, signature: bytes) -> PartialSign
         return PartialSignature(signature=signature, pubkey=pubkey_augm)
 
 
-class NewClient(Client):
+T = TypeVar("T")
+
+# A command of the client, as a generator that yields each APDU of the command with the interpreter of the client
+# commands of its interrupted execution (or None), receives the final status word and response of the APDU, and returns
+# the result of the command. The flows do no I/O: the same commands are run by the blocking driver of `NewClient`, and
+# by the asynchronous one of `AsyncNewClient`.
+CommandFlow = Generator[Tuple[dict, Optional[ClientCommandInterpreter]], Tuple[int, bytes], T]
+
+
+class NewClientFlows:
+    """The state and the command flows of the clients of the app from version 2.1.0, shared by `NewClient` and
+    `AsyncNewClient`."""
+
     # internal use for testing: if set to True, sign_psbt will not clone the psbt before converting to psbt version 2
     _no_clone_psbt: bool = False
 
-    def __init__(self, comm_client: TransportClient, chain: Chain = Chain.MAIN, debug: bool = False) -> None:
-        super().__init__(comm_client, chain, debug)
+    # internal use for testing: if set, the protocol version used for sign_psbt, instead of the highest one
+    # supported by the app
+    _sign_psbt_protocol_version: Optional[int] = None
+
+    def __init__(self, wallet_cache: Optional[WalletDataCache] = None,
+                 on_progress: Optional[Callable[[ProgressPhase, int, int], None]] = None,
+                 app_info: Optional[AppInfo] = None, verify_signatures: Union[bool, Executor] = False) -> None:
+        self._wallet_cache = wallet_cache if wallet_cache is not None else WalletDataCache()
         self.builder = BitcoinCommandBuilder()
+        # the features of the app are shared with the next clients of the same transport through app_info, if any
+        self._app_info = app_info
+        self._app_features: Optional[Tuple[int, AppFeature]] = app_info.features if app_info is not None else None
+        self.on_progress = on_progress
+        self.verify_signatures = verify_signatures
 
-    # Modifies the behavior of the base method by taking care of SW_INTERRUPTED_EXECUTION responses
-    def _make_request(
-        self, apdu: dict, client_intepreter: ClientCommandInterpreter = None
-    ) -> Tuple[int, bytes]:
-        sw, response = self._apdu_exchange(apdu)
+    def _has_app_feature(self, feature: AppFeature) -> bool:
+        # the drivers fetch the features of the app before running the flows that need them
+        if self._app_features is None:
+            raise RuntimeError("The features of the app are not known yet")
+        return feature in self._app_features[1]
 
-        while sw == 0xE000:
-            if not client_intepreter:
-                raise RuntimeError("Unexpected SW_INTERRUPTED_EXECUTION received.")
+    def _prepare_interpreter(self, client_intepreter: ClientCommandInterpreter) -> None:
+        if self._has_app_feature(AppFeature.EXTENDED_APDUS):
+            # fewer, larger responses to the client commands
+            client_intepreter.max_response_len = MAX_EXTENDED_APDU_DATA_LEN
 
-            command_response = client_intepreter.execute(response)
-            sw, response = self._apdu_exchange(
-                self.builder.continue_interrupted(command_response)
-            )
+    def _get_version_flow(self) -> CommandFlow[Tuple[str, str, bytes]]:
+        sw, response = yield GET_VERSION_APDU, None
 
-        return sw, response
+        return parse_get_version_response(sw, response)
 
-    def get_extended_pubkey(self, path: str, display: bool = False) -> str:
-        sw, response = self._make_request(self.builder.get_extended_pubkey(path, display))
+    def _get_extended_pubkey_flow(self, path: str, display: bool) -> CommandFlow[str]:
+        sw, response = yield self.builder.get_extended_pubkey(path, display), None
 
         if sw != 0x9000:
             raise DeviceException(error_code=sw, ins=BitcoinInsType.GET_EXTENDED_PUBKEY)
 
         return response.decode()
 
-    def register_wallet(self, wallet: WalletPolicy) -> Tuple[bytes, bytes]:
+    def _get_app_features_flow(self) -> CommandFlow[Tuple[int, AppFeature]]:
+        if self._app_features is None:
+            sw, response = yield self.builder.get_app_features(), None
+
+            if sw == 0x6D00:
+                # SW_INS_NOT_SUPPORTED: the app predates GET_APP_FEATURES
+                self._app_features = (CURRENT_PROTOCOL_VERSION, AppFeature(0))
+            elif sw != 0x9000:
+                raise DeviceException(error_code=sw, ins=BitcoinInsType.GET_APP_FEATURES)
+            else:
+                if len(response) != 5:
+                    raise RuntimeError(f"Invalid response length: {len(response)}")
+
+                self._app_features = (response[0], AppFeature(int.from_bytes(response[1:5], byteorder="big")))
+
+            if self._app_info is not None:
+                self._app_info.features = self._app_features
+
+        return self._app_features
+
+    def _get_extended_pubkeys_flow(self, paths: List[str]) -> CommandFlow[List[str]]:
+        if not self._has_app_feature(AppFeature.GET_EXTENDED_PUBKEYS):
+            pubkeys: List[str] = []
+            for path in paths:
+                pubkeys.append((yield from self._get_extended_pubkey_flow(path, False)))
+            return pubkeys
+
+        client_intepreter = ClientCommandInterpreter()
+
+        sw, _ = yield self.builder.get_extended_pubkeys(paths), client_intepreter
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.GET_EXTENDED_PUBKEYS)
+
+        return [pubkey.decode() for pubkey in client_intepreter.yielded]
+
+    def _register_wallet_flow(self, wallet: WalletPolicy, compiled_policy: bool,
+                              store: bool = False) -> CommandFlow[Tuple[bytes, bytes, bytes]]:
+        if compiled_policy and not self._has_app_feature(AppFeature.COMPILED_POLICIES):
+            raise NotImplementedError("Compiled policies are not supported by this version of the app")
+        if store and not self._has_app_feature(AppFeature.WALLET_REGISTRY):
+            raise NotImplementedError("Storing wallets is not supported by this version of the app")
+
         if wallet.version not in [WalletType.WALLET_POLICY_V1, WalletType.WALLET_POLICY_V2]:
             raise ValueError("invalid wallet policy version")
 
         client_intepreter = ClientCommandInterpreter()
-        client_intepreter.add_known_preimage(wallet.serialize())
-        client_intepreter.add_known_list([k.encode() for k in wallet.keys_info])
-
-        # necessary for version 1 of the protocol (introduced in version 2.1.0)
-        client_intepreter.add_known_preimage(wallet.descriptor_template.encode())
+        client_intepreter.add_known_wallet(wallet, self._wallet_cache)
 
-        sw, response = self._make_request(
-            self.builder.register_wallet(wallet), client_intepreter
-        )
+        sw, response = yield self.builder.register_wallet(wallet, compiled_policy, store), client_intepreter
 
         if sw != 0x9000:
             raise DeviceException(error_code=sw, ins=BitcoinInsType.REGISTER_WALLET)
@@ -109,16 +157,17 @@ class NewClient(Client):
         wallet_id = response[0:32]
         wallet_hmac = response[32:64]
 
-        return wallet_id, wallet_hmac
+        # the compiled policy is the concatenation of the yielded values
+        return wallet_id, wallet_hmac, b''.join(client_intepreter.yielded)
 
-    def get_wallet_address(
+    def _get_wallet_address_flow(
         self,
         wallet: WalletPolicy,
         wallet_hmac: Optional[bytes],
         change: int,
         address_index: int,
         display: bool,
-    ) -> str:
+    ) -> CommandFlow[str]:
 
         if not isinstance(wallet, WalletPolicy) or wallet.version not in [WalletType.WALLET_POLICY_V1, WalletType.WALLET_POLICY_V2]:
             raise ValueError("wallet type must be WalletPolicy, with version either WALLET_POLICY_V1 or WALLET_POLICY_V2")
@@ -127,13 +176,9 @@ class NewClient(Client):
             raise ValueError("Invalid change")
 
         client_intepreter = ClientCommandInterpreter()
-        client_intepreter.add_known_list([k.encode() for k in wallet.keys_info])
-        client_intepreter.add_known_preimage(wallet.serialize())
-
-        # necessary for version 1 of the protocol (introduced in version 2.1.0)
-        client_intepreter.add_known_preimage(wallet.descriptor_template.encode())
+        client_intepreter.add_known_wallet(wallet, self._wallet_cache)
 
-        sw, response = self._make_request(
+        sw, response = yield (
             self.builder.get_wallet_address(
                 wallet, wallet_hmac, address_index, change, display
             ),
@@ -145,70 +190,170 @@ class NewClient(Client):
 
         return response.decode()
 
-    def sign_psbt(self, psbt: Union[PSBT, bytes, str], wallet: WalletPolicy, wallet_hmac: Optional[bytes]) -> List[Tuple[int, PartialSignature]]:
-        psbt = normalize_psbt(psbt)
+    def _get_wallet_addresses_flow(
+        self,
+        wallet: WalletPolicy,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        first_address_index: int,
+        n_addresses: int,
+    ) -> CommandFlow[List[str]]:
 
-        if psbt.version != 2:
-            if self._no_clone_psbt:
-                psbt.convert_to_v2()
-                psbt_v2 = psbt
-            else:
-                psbt_v2 = PSBT()
-                psbt_v2.deserialize(psbt.serialize())  # clone psbt
-                psbt_v2.convert_to_v2()
-        else:
-            psbt_v2 = psbt
+        if not isinstance(wallet, WalletPolicy) or wallet.version not in [WalletType.WALLET_POLICY_V1, WalletType.WALLET_POLICY_V2]:
+            raise ValueError("wallet type must be WalletPolicy, with version either WALLET_POLICY_V1 or WALLET_POLICY_V2")
 
-        psbt_bytes = base64.b64decode(psbt_v2.serialize())
-        f = BytesIO(psbt_bytes)
+        if change != 0 and change != 1:
+            raise ValueError("Invalid change")
 
-        # We parse the individual maps (global map, each input map, and each output map) from the psbt serialized as a
-        # sequence of bytes, in order to produce the serialized Merkleized map commitments. Moreover, we prepare the
-        # client interpreter to respond on queries on all the relevant Merkle trees and pre-images in the psbt.
+        if not self._has_app_feature(AppFeature.GET_WALLET_ADDRESSES):
+            addresses: List[str] = []
+            for address_index in range(first_address_index, first_address_index + n_addresses):
+                addresses.append((yield from self._get_wallet_address_flow(
+                    wallet, wallet_hmac, change, address_index, False)))
+            return addresses
 
-        assert f.read(5) == b"psbt\xff"
+        client_intepreter = ClientCommandInterpreter()
+        client_intepreter.add_known_wallet(wallet, self._wallet_cache)
+
+        sw, _ = yield (
+            self.builder.get_wallet_addresses(
+                wallet, wallet_hmac, change, first_address_index, n_addresses
+            ),
+            client_intepreter,
+        )
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.GET_WALLET_ADDRESSES)
+
+        return [address.decode() for address in client_intepreter.yielded]
+
+    def _register_payee_list_flow(self, scripts: List[bytes]) -> CommandFlow[Tuple[bytes, bytes]]:
+        if not self._has_app_feature(AppFeature.PAYEE_LISTS):
+            raise NotImplementedError("Payee lists are not supported by this app")
 
         client_intepreter = ClientCommandInterpreter()
-        client_intepreter.add_known_list([k.encode() for k in wallet.keys_info])
-        client_intepreter.add_known_preimage(wallet.serialize())
+        client_intepreter.add_known_list(scripts)
+
+        sw, response = yield self.builder.register_payee_list(scripts), client_intepreter
 
-        # necessary for version 1 of the protocol (introduced in version 2.1.0)
-        client_intepreter.add_known_preimage(wallet.descriptor_template.encode())
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.REGISTER_PAYEE_LIST)
 
-        global_map: Mapping[bytes, bytes] = parse_stream_to_map(f)
-        client_intepreter.add_known_mapping(global_map)
+        if len(response) != 64:
+            raise RuntimeError(f"Invalid response length: {len(response)}")
 
-        input_maps: List[Mapping[bytes, bytes]] = []
-        for _ in range(len(psbt_v2.inputs)):
-            input_maps.append(parse_stream_to_map(f))
-        for m in input_maps:
-            client_intepreter.add_known_mapping(m)
+        return response[0:32], response[32:64]
+
+    def _get_sign_psbt_protocol_version(self) -> int:
+        # with version 2 of the protocol, the signatures are queued in the responses, saving a round trip for each;
+        # with version 4, the Merkle roots and proof hashes already exchanged are referenced instead of sent again;
+        # with version 5, the values of the maps that the app reads next are sent in as few responses as possible;
+        # with version 6, the keys of the small maps are streamed without Merkle proofs;
+        # with version 7, the progress of each phase is queued in the responses
+        if self._sign_psbt_protocol_version is not None:
+            return self._sign_psbt_protocol_version
+        if self._has_app_feature(AppFeature.PROGRESS_EVENTS):
+            return PROGRESS_PROTOCOL_VERSION
+        elif self._has_app_feature(AppFeature.TREE_STREAMS):
+            return TREE_STREAM_PROTOCOL_VERSION
+        elif self._has_app_feature(AppFeature.ACCESS_PLANS):
+            return ACCESS_PLAN_PROTOCOL_VERSION
+        elif self._has_app_feature(AppFeature.HASH_REFS):
+            return HASH_REFS_PROTOCOL_VERSION
+        elif self._has_app_feature(AppFeature.QUEUED_YIELDS):
+            return QUEUED_YIELDS_PROTOCOL_VERSION
+        else:
+            return CURRENT_PROTOCOL_VERSION
+
+    def _merkleize_psbt(self, psbt: Union[PSBT, RawPsbt, bytes, str, MerkleizedPsbt],
+                        wallet: WalletPolicy) -> MerkleizedPsbt:
+        if isinstance(psbt, MerkleizedPsbt):
+            if psbt.wallet.id != wallet.id:
+                raise ValueError("The PSBT was merkleized for a different wallet policy")
+            merkleized_psbt = psbt
+        elif isinstance(psbt, (bytes, str)):
+            # the PSBT is only signed: its maps are merkleized without deserializing their values
+            merkleized_psbt = MerkleizedPsbt(RawPsbt.from_bytes(psbt), wallet, wallet_cache=self._wallet_cache)
+        else:
+            merkleized_psbt = MerkleizedPsbt(psbt, wallet, clone=not self._no_clone_psbt,
+                                             wallet_cache=self._wallet_cache)
 
-        output_maps: List[Mapping[bytes, bytes]] = []
-        for _ in range(len(psbt_v2.outputs)):
-            output_maps.append(parse_stream_to_map(f))
-        for m in output_maps:
-            client_intepreter.add_known_mapping(m)
+        if merkleized_psbt.input_subset is not None and not self._has_app_feature(AppFeature.INPUT_SUBSETS):
+            # the app would ignore the subset, and sign all the inputs
+            raise NotImplementedError("Input subsets are not supported by this version of the app")
 
-        # We also add the Merkle tree of the input (resp. output) map commitments as a known tree
-        input_commitments = [get_merkleized_map_commitment(m_in) for m_in in input_maps]
-        output_commitments = [get_merkleized_map_commitment(m_out) for m_out in output_maps]
+        return merkleized_psbt
 
-        client_intepreter.add_known_list(input_commitments)
-        client_intepreter.add_known_list(output_commitments)
+    def _verify_signatures(self, merkleized_psbt: MerkleizedPsbt,
+                           signatures: Sequence[Tuple[int, PartialSignature]]) -> None:
+        if self.verify_signatures is not False:
+            executor = self.verify_signatures if isinstance(self.verify_signatures, Executor) else None
+            verify_partial_signatures(merkleized_psbt, signatures, executor)
 
-        sw, _ = self._make_request(
-            self.builder.sign_psbt(
-                global_map, input_maps, output_maps, wallet, wallet_hmac
-            ),
-            client_intepreter,
-        )
+    def _sign_psbt_flow(self, psbt: Union[PSBT, RawPsbt, bytes, str, MerkleizedPsbt], wallet: WalletPolicy,
+                        wallet_hmac: Optional[bytes],
+                        additional_wallets: Sequence[Tuple[WalletPolicy, Optional[bytes]]],
+                        progress: Optional[SignPsbtProgress]) -> CommandFlow[List[Tuple[int, PartialSignature]]]:
+        if progress is not None and not self._has_app_feature(AppFeature.RESUMABLE_SIGNING):
+            raise NotImplementedError("Resumable signing is not supported by this version of the app")
 
-        if sw != 0x9000:
-            raise DeviceException(error_code=sw, ins=BitcoinInsType.SIGN_PSBT)
+        merkleized_psbt = self._merkleize_psbt(psbt, wallet)
+
+        client_intepreter = merkleized_psbt.new_client_interpreter()
+
+        if len(additional_wallets) > 0:
+            if not self._has_app_feature(AppFeature.MULTI_WALLET_SIGNING):
+                raise NotImplementedError("Signing with additional wallets is not supported by this version of the app")
+
+            # the app would ignore the inputs of the additional wallets, as they have no hints
+            if merkleized_psbt.derivation_hints:
+                raise ValueError("Derivation hints are not supported with additional wallets")
+
+            for additional_wallet, _ in additional_wallets:
+                client_intepreter.add_known_wallet(additional_wallet, self._wallet_cache)
+            client_intepreter.add_known_preimage(serialize_additional_wallets(additional_wallets))
+
+        protocol_version = self._get_sign_psbt_protocol_version()
+
+        resume = None
+        if progress is not None:
+            if progress.token is None:
+                resume = (0, b'\0' * 16)
+            else:
+                resume = (len(progress.yielded), progress.token)
+
+        client_intepreter.queued_yields = protocol_version >= QUEUED_YIELDS_PROTOCOL_VERSION
+        client_intepreter.progress_callback = self.on_progress
+        try:
+            sw, response = yield (
+                self.builder.sign_psbt_from_commitments(
+                    merkleized_psbt.global_map_commitment,
+                    len(merkleized_psbt.input_maps), merkleized_psbt.input_commitments_root,
+                    len(merkleized_psbt.output_maps), merkleized_psbt.output_commitments_root,
+                    wallet, wallet_hmac, p2=protocol_version, additional_wallets=additional_wallets,
+                    resume=resume
+                ),
+                client_intepreter,
+            )
+
+            if sw != 0x9000:
+                raise DeviceException(error_code=sw, ins=BitcoinInsType.SIGN_PSBT)
+
+            # the last signatures are queued in the final response
+            if client_intepreter.queued_yields and len(client_intepreter.extract_queued_yields(response)) != 0:
+                raise RuntimeError("Invalid response")
+        finally:
+            # the first message yielded after the approval is the token of the session; it is the same when the
+            # session is resumed, while a new token means that the session started from scratch
+            if progress is not None and len(client_intepreter.yielded) > 0:
+                token, *signatures = client_intepreter.yielded
+                if token != progress.token:
+                    progress.token = token
+                    progress.yielded = []
+                progress.yielded += signatures
 
         # parse results and return a structured version instead
-        results = client_intepreter.yielded
+        results = progress.yielded if progress is not None else client_intepreter.yielded
 
         if any(len(x) <= 1 for x in results):
             raise RuntimeError("Invalid response")
@@ -225,50 +370,406 @@ class NewClient(Client):
 
             results_list.append((input_index, _make_partial_signature(pubkey_augm, signature)))
 
+        self._verify_signatures(merkleized_psbt, results_list)
+
         return results_list
 
-    def get_master_fingerprint(self) -> bytes:
-        sw, response = self._make_request(self.builder.get_master_fingerprint())
+    def _sign_psbt_batch_flow(self, psbts: Sequence[Union[PSBT, RawPsbt, bytes, str, MerkleizedPsbt]],
+                              wallet: WalletPolicy,
+                              wallet_hmac: Optional[bytes]) -> CommandFlow[List[Tuple[int, int, PartialSignature]]]:
+        if not self._has_app_feature(AppFeature.PSBT_BATCHES):
+            raise NotImplementedError("Batches of PSBTs are not supported by this version of the app")
+
+        if len(psbts) == 0:
+            raise ValueError("The batch must contain at least one PSBT")
+
+        # the batch is a Merkle list of the commitments of the PSBTs, as in the request of SIGN_PSBT
+        client_intepreter = ClientCommandInterpreter()
+        psbt_commitments: List[bytes] = []
+        merkleized_psbts: List[MerkleizedPsbt] = []
+        for psbt in psbts:
+            merkleized_psbt = self._merkleize_psbt(psbt, wallet)
+            merkleized_psbts.append(merkleized_psbt)
+            client_intepreter.add_known_data(merkleized_psbt.new_client_interpreter())
+            psbt_commitments.append(
+                merkleized_psbt.global_map_commitment
+                + write_varint(len(merkleized_psbt.input_maps)) + merkleized_psbt.input_commitments_root
+                + write_varint(len(merkleized_psbt.output_maps)) + merkleized_psbt.output_commitments_root
+            )
+        psbt_commitments_tree = client_intepreter.add_known_list(psbt_commitments)
+
+        protocol_version = self._get_sign_psbt_protocol_version()
+        client_intepreter.queued_yields = protocol_version >= QUEUED_YIELDS_PROTOCOL_VERSION
+        client_intepreter.progress_callback = self.on_progress
+
+        sw, response = yield (
+            self.builder.sign_psbt_batch(len(psbts), psbt_commitments_tree.root, wallet, wallet_hmac,
+                                         p2=protocol_version),
+            client_intepreter,
+        )
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.SIGN_PSBT_BATCH)
+
+        # the last signatures are queued in the final response
+        if client_intepreter.queued_yields and len(client_intepreter.extract_queued_yields(response)) != 0:
+            raise RuntimeError("Invalid response")
+
+        results_list: List[Tuple[int, int, PartialSignature]] = []
+        for res in client_intepreter.yielded:
+            res_buffer = BytesIO(res)
+            psbt_index = read_varint(res_buffer)
+            input_index = read_varint(res_buffer)
+
+            pubkey_augm_len = read_uint(res_buffer, 8)
+            pubkey_augm = res_buffer.read(pubkey_augm_len)
+
+            signature = res_buffer.read()
+            if psbt_index >= len(psbts) or len(signature) == 0:
+                raise RuntimeError("Invalid response")
+
+            results_list.append((psbt_index, input_index, _make_partial_signature(pubkey_augm, signature)))
+
+        for psbt_index, merkleized_psbt in enumerate(merkleized_psbts):
+            self._verify_signatures(merkleized_psbt, [(input_index, part_sig)
+                                                      for index, input_index, part_sig in results_list
+                                                      if index == psbt_index])
+
+        return results_list
+
+    def _get_master_fingerprint_flow(self) -> CommandFlow[bytes]:
+        sw, response = yield self.builder.get_master_fingerprint(), None
 
         if sw != 0x9000:
             raise DeviceException(error_code=sw, ins=BitcoinInsType.GET_EXTENDED_PUBKEY)
 
         return response
 
-    def sign_message(self, message: Union[str, bytes], bip32_path: str) -> str:
-        if isinstance(message, str):
-            message_bytes = message.encode("utf-8")
-        else:
-            message_bytes = message
+    def _open_wallet_session_flow(self, wallet: WalletPolicy, wallet_hmac: bytes,
+                                  compiled_policy: Optional[bytes]) -> CommandFlow[None]:
+        if not isinstance(wallet, WalletPolicy) or wallet.version not in [WalletType.WALLET_POLICY_V1, WalletType.WALLET_POLICY_V2]:
+            raise ValueError("wallet type must be WalletPolicy, with version either WALLET_POLICY_V1 or WALLET_POLICY_V2")
+
+        if len(wallet_hmac) != 32:
+            raise ValueError("Invalid wallet_hmac")
+
+        client_intepreter = ClientCommandInterpreter()
+        client_intepreter.add_known_wallet(wallet, self._wallet_cache)
+
+        if compiled_policy is not None:
+            client_intepreter.add_known_preimage(compiled_policy)
+
+        sw, _ = yield (
+            self.builder.open_wallet_session(wallet, wallet_hmac, compiled_policy),
+            client_intepreter,
+        )
 
-        chunks = [message_bytes[64 * i: 64 * i + 64] for i in range((len(message_bytes) + 63) // 64)]
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.OPEN_WALLET_SESSION)
 
+    def _sign_message_flow(self, message: Union[str, bytes, BinaryIO], bip32_path: str) -> CommandFlow[str]:
         client_intepreter = ClientCommandInterpreter()
-        client_intepreter.add_known_list(chunks)
 
-        sw, response = self._make_request(self.builder.sign_message(message_bytes, bip32_path), client_intepreter)
+        if isinstance(message, (str, bytes, bytearray)):
+            message_bytes = message.encode("utf-8") if isinstance(message, str) else bytes(message)
+
+            if self._has_app_feature(AppFeature.HASHED_MESSAGES):
+                # the device streams the whole message with GET_PREIMAGE, without Merkle proofs
+                client_intepreter.add_known_preimage(b'\x00' + message_bytes)
+
+                request = self.builder.sign_message(message_bytes, bip32_path, HASHED_MESSAGE_PROTOCOL_VERSION)
+            else:
+                chunks = [message_bytes[64 * i: 64 * i + 64] for i in range((len(message_bytes) + 63) // 64)]
+                client_intepreter.add_known_list(chunks)
+
+                request = self.builder.sign_message(message_bytes, bip32_path)
+        else:
+            # the chunks of the message are read from the stream when requested, instead of being kept in memory
+            message_tree = StreamedMerkleTree(message)
+            client_intepreter.add_known_stream(message_tree)
+
+            request = self.builder.sign_message(message_tree, bip32_path)
+
+        sw, response = yield request, client_intepreter
 
         if sw != 0x9000:
             raise DeviceException(error_code=sw, ins=BitcoinInsType.SIGN_MESSAGE)
 
         return base64.b64encode(response).decode('utf-8')
 
+    def _sign_messages_flow(self, messages: List[Tuple[Union[str, bytes], str]],
+                            account_path: str) -> CommandFlow[List[str]]:
+        if not self._has_app_feature(AppFeature.SIGN_MESSAGES):
+            signatures: List[str] = []
+            for message, path in messages:
+                signatures.append((yield from self._sign_message_flow(message, path)))
+            return signatures
+
+        client_intepreter = ClientCommandInterpreter()
+
+        hashed_messages = self._has_app_feature(AppFeature.HASHED_MESSAGES)
+
+        entries: List[bytes] = []
+        for message, path in messages:
+            message_bytes = message.encode("utf-8") if isinstance(message, str) else bytes(message)
+
+            if hashed_messages:
+                client_intepreter.add_known_preimage(b'\x00' + message_bytes)
+                commitment = element_hash(message_bytes)
+            else:
+                chunks = [message_bytes[64 * i: 64 * i + 64] for i in range((len(message_bytes) + 63) // 64)]
+                commitment = client_intepreter.add_known_list(chunks).root
+
+            bip32_path = bip32_path_from_string(path)
+            entries.append(len(bip32_path).to_bytes(1, byteorder="big") + b''.join(bip32_path)
+                           + write_varint(len(message_bytes)) + commitment)
+
+        client_intepreter.add_known_list(entries)
+
+        protocol_version = HASHED_MESSAGE_PROTOCOL_VERSION if hashed_messages else CURRENT_PROTOCOL_VERSION
+        sw, _ = yield self.builder.sign_messages(entries, account_path, protocol_version), client_intepreter
+
+        if sw != 0x9000:
+            raise DeviceException(error_code=sw, ins=BitcoinInsType.SIGN_MESSAGES)
+
+        return [base64.b64encode(sig).decode('utf-8') for sig in client_intepreter.yielded]
+
+
+class NewClient(NewClientFlows, Client):
+    def __init__(self, comm_client: TransportClient, chain: Chain = Chain.MAIN, debug: bool = False,
+                 speculative: bool = False, wallet_cache: Optional[WalletDataCache] = None,
+                 on_progress: Optional[Callable[[ProgressPhase, int, int], None]] = None,
+                 app_info: Optional[AppInfo] = None, verify_signatures: Union[bool, Executor] = False) -> None:
+        """
+        If `speculative` is True, the responses to the client commands that the hardware wallet is likely to request
+        next are computed in a background thread while it processes the previous response, which hides the time that
+        the host spends on them on slow hosts (see `ClientCommandInterpreter.start_speculation`). It can also be
+        changed with the `speculative` attribute.
+
+        The data of the wallet policies used in the commands is kept in `wallet_cache`, that can be shared by several
+        clients; if it is not given, each client has its own cache.
+
+        If the app reports the progress of sign_psbt and sign_psbt_batch, `on_progress` is called with the phase, the
+        number of items processed so far and the total number of items, as soon as each report is received; for
+        example, to measure the time of each phase. It can also be changed with the `on_progress` attribute.
+
+        The `app_info` is the app detected on the device by `createClient`; the features of the app are stored in it
+        once fetched, so that the next clients created for the same transport do not fetch them again.
+
+        If `verify_signatures` is True, the signatures returned by sign_psbt and sign_psbt_batch are verified against
+        the sighashes recomputed from the PSBT, and an `InvalidSignatureError` is raised if one of them is invalid; if
+        it is an `Executor`, the signatures are verified concurrently by its workers (see
+        `signature_verification.verify_partial_signatures`). It can also be changed with the `verify_signatures`
+        attribute.
+        """
+        Client.__init__(self, comm_client, chain, debug)
+        NewClientFlows.__init__(self, wallet_cache, on_progress, app_info, verify_signatures)
+        self.speculative = speculative
+
+    def _has_app_feature(self, feature: AppFeature) -> bool:
+        # the features are fetched the first time they are needed
+        return feature in self.get_app_features()[1]
+
+    # Modifies the behavior of the base method by taking care of SW_INTERRUPTED_EXECUTION responses
+    def _make_request(
+        self, apdu: dict, client_intepreter: ClientCommandInterpreter = None
+    ) -> Tuple[int, bytes]:
+        if client_intepreter is not None:
+            self._prepare_interpreter(client_intepreter)
+
+        if client_intepreter is None or not self.speculative:
+            return self._exchange_with_interpreter(apdu, client_intepreter)
+
+        with ThreadPoolExecutor(max_workers=1) as executor:
+            client_intepreter.start_speculation(executor)
+            try:
+                return self._exchange_with_interpreter(apdu, client_intepreter)
+            finally:
+                client_intepreter.stop_speculation()
+
+    def _exchange_with_interpreter(
+        self, apdu: dict, client_intepreter: Optional[ClientCommandInterpreter]
+    ) -> Tuple[int, bytes]:
+        sw, response = self._apdu_exchange(apdu)
+
+        while sw == 0xE000:
+            if not client_intepreter:
+                raise RuntimeError("Unexpected SW_INTERRUPTED_EXECUTION received.")
+
+            command_response = client_intepreter.execute(response)
+            sw, response = self._apdu_exchange(
+                self.builder.continue_interrupted(command_response)
+            )
+
+        return sw, response
+
+    def _run(self, flow: CommandFlow[T]) -> T:
+        # the exceptions of the requests are raised in the flow, so that it can handle them
+        try:
+            request = next(flow)
+            while True:
+                try:
+                    result = self._make_request(*request)
+                except BaseException as e:
+                    request = flow.throw(e)
+                else:
+                    request = flow.send(result)
+        except StopIteration as e:
+            return e.value
+
+    def get_extended_pubkey(self, path: str, display: bool = False) -> str:
+        return self._run(self._get_extended_pubkey_flow(path, display))
+
+    def get_app_features(self) -> Tuple[int, AppFeature]:
+        return self._run(self._get_app_features_flow())
+
+    def get_extended_pubkeys(self, paths: List[str]) -> List[str]:
+        return self._run(self._get_extended_pubkeys_flow(paths))
+
+    def register_wallet(self, wallet: WalletPolicy) -> Tuple[bytes, bytes]:
+        wallet_id, wallet_hmac, _ = self._run(self._register_wallet_flow(wallet, False))
+        return wallet_id, wallet_hmac
+
+    def register_wallet_with_compiled_policy(self, wallet: WalletPolicy) -> Tuple[bytes, bytes, bytes]:
+        return self._run(self._register_wallet_flow(wallet, True))
+
+    def register_and_store_wallet(self, wallet: WalletPolicy) -> Tuple[bytes, bytes]:
+        wallet_id, wallet_hmac, _ = self._run(self._register_wallet_flow(wallet, False, store=True))
+        return wallet_id, wallet_hmac
+
+    def get_wallet_address(
+        self,
+        wallet: WalletPolicy,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        address_index: int,
+        display: bool,
+    ) -> str:
+        return self._run(self._get_wallet_address_flow(wallet, wallet_hmac, change, address_index, display))
+
+    def get_wallet_addresses(
+        self,
+        wallet: WalletPolicy,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        first_address_index: int,
+        n_addresses: int,
+    ) -> List[str]:
+        return self._run(self._get_wallet_addresses_flow(wallet, wallet_hmac, change, first_address_index,
+                                                         n_addresses))
+
+    def register_payee_list(self, scripts: List[bytes]) -> Tuple[bytes, bytes]:
+        return self._run(self._register_payee_list_flow(scripts))
+
+    def sign_psbt(self, psbt: Union[PSBT, RawPsbt, bytes, str, MerkleizedPsbt], wallet: WalletPolicy,
+                  wallet_hmac: Optional[bytes],
+                  additional_wallets: Sequence[Tuple[WalletPolicy, Optional[bytes]]] = (),
+                  progress: Optional[SignPsbtProgress] = None) -> List[Tuple[int, PartialSignature]]:
+        return self._run(self._sign_psbt_flow(psbt, wallet, wallet_hmac, additional_wallets, progress))
+
+    def sign_psbt_batch(self, psbts: Sequence[Union[PSBT, RawPsbt, bytes, str, MerkleizedPsbt]], wallet: WalletPolicy,
+                        wallet_hmac: Optional[bytes]) -> List[Tuple[int, int, PartialSignature]]:
+        return self._run(self._sign_psbt_batch_flow(psbts, wallet, wallet_hmac))
+
+    def get_master_fingerprint(self) -> bytes:
+        return self._run(self._get_master_fingerprint_flow())
+
+    def open_wallet_session(self, wallet: WalletPolicy, wallet_hmac: bytes,
+                            compiled_policy: Optional[bytes] = None) -> None:
+        self._run(self._open_wallet_session_flow(wallet, wallet_hmac, compiled_policy))
+
+    def sign_message(self, message: Union[str, bytes, BinaryIO], bip32_path: str) -> str:
+        return self._run(self._sign_message_flow(message, bip32_path))
+
+    def sign_messages(self, messages: List[Tuple[Union[str, bytes], str]], account_path: str) -> List[str]:
+        return self._run(self._sign_messages_flow(messages, account_path))
+
 
 def createClient(comm_client: Optional[TransportClient] = None, chain: Chain = Chain.MAIN, debug: bool = False) -> Union[LegacyClient, NewClient]:
     if comm_client is None:
         comm_client = TransportClient("hid")
 
-    base_client = Client(comm_client, chain, debug)
-    app_name, app_version, _ = base_client.get_version()
+    # the app is only queried once per transport client, until the transport fails or the app stops (see AppInfo)
+    app_info = get_app_info(comm_client)
+    if app_info is None:
+        base_client = Client(comm_client, chain, debug)
+        app_info = AppInfo(*base_client.get_version())
+        set_app_info(comm_client, app_info)
 
-    version = parse_version(app_version)
+    version = parse_version(app_info.version)
 
     # Use the legacy client if either:
     # - the name of the app is "Bitcoin Legacy" or "Bitcoin Test Legacy" (regardless of the version)
     # - the version is strictly less than 2.1
-    use_legacy = app_name in ["Bitcoin Legacy", "Bitcoin Test Legacy"] or version.major < 2 or (version.major == 2 and version.minor == 0)
+    use_legacy = app_info.name in ["Bitcoin Legacy", "Bitcoin Test Legacy"] or version.major < 2 or (version.major == 2 and version.minor == 0)
 
     if use_legacy:
         return LegacyClient(comm_client, chain, debug)
     else:
-        return NewClient(comm_client, chain, debug)
+        return NewClient(comm_client, chain, debug, app_info=app_info)
+
+
+class ClientPool:
+    """The clients of the devices connected via USB, keyed by the HID path of the device, that are reused by the
+    successive requests of a tool instead of opening the device and detecting its app each time.
+
+    A client is replaced by a new one, on a newly opened transport, once the app detected on its device is invalidated:
+    after an exchange fails, or the device reports that the app is not running, or the client is stopped. The pool can
+    be used by several threads, but each client must only be used by one of them at a time.
+    """
+
+    def __init__(self, chain: Chain = Chain.MAIN, debug: bool = False) -> None:
+        self.chain = chain
+        self.debug = debug
+        self._clients: Dict[Optional[str], Union[LegacyClient, NewClient]] = {}
+        self._lock = threading.Lock()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        self.close()
+
+    def get(self, path: Optional[str] = None) -> Union[LegacyClient, NewClient]:
+        """Returns the client of the device with the given HID path, or of the first device found if `path` is None,
+        opening the device the first time."""
+
+        with self._lock:
+            client = self._clients.get(path)
+            if client is not None and get_app_info(client.transport_client) is None:
+                self._discard(path)
+                client = None
+
+            if client is None:
+                comm_client = TransportClient("hid", path=path)
+                try:
+                    client = createClient(comm_client, self.chain, self.debug)
+                except BaseException:
+                    comm_client.stop()
+                    raise
+                self._clients[path] = client
+
+            return client
+
+    def discard(self, path: Optional[str] = None) -> None:
+        """Stops the client of the device with the given HID path, if any; the next `get` opens the device again."""
+
+        with self._lock:
+            self._discard(path)
+
+    def close(self) -> None:
+        """Stops all the clients of the pool."""
+
+        with self._lock:
+            for path in list(self._clients):
+                self._discard(path)
+
+    def _discard(self, path: Optional[str]) -> None:
+        client = self._clients.pop(path, None)
+        if client is not None:
+            invalidate_app_info(client.transport_client)
+            try:
+                client.transport_client.stop()
+            except Exception:
+                # the transport may already be stopped or broken
+                pass
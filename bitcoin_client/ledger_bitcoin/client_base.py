@@ -1,5 +1,6 @@
-from dataclasses import dataclass
-from typing import List, Tuple, Optional, Union, Literal
+import weakref
+from dataclasses import dataclass, field
+from typing import BinaryIO, List, Tuple, Optional, Sequence, Union, Literal
 from io import BytesIO
 
 from ledgercomm.interfaces.hid_device import HID
@@ -8,7 +9,7 @@ from .transport import Transport
 
 from .common import Chain
 
-from .command_builder import DefaultInsType
+from .command_builder import AppFeature, DefaultInsType
 from .exception import DeviceException
 
 from .wallet import WalletPolicy
@@ -65,6 +66,77 @@ def print_response(sw: int, data: bytes) -> None:
     print(f"<= {data.hex()}{sw.to_bytes(2, byteorder='big').hex()}")
 
 
+GET_VERSION_APDU = {"cla": 0xB0, "ins": DefaultInsType.GET_VERSION, "p1": 0, "p2": 0, "data": b''}
+
+
+def parse_get_version_response(sw: int, response: bytes) -> Tuple[str, str, bytes]:
+    """Parses the response to `GET_VERSION_APDU`, as returned by `Client.get_version`."""
+
+    if sw != 0x9000:
+        raise DeviceException(
+            error_code=sw, ins=DefaultInsType.GET_VERSION)
+
+    r = BytesIO(response)
+
+    format = r.read(1)
+
+    app_name = deser_string(r)
+    app_version = deser_string(r)
+    app_flags = deser_string(r)
+
+    if format != b'\1' or app_name == b'' or app_version == b'' or app_flags == b'':
+        raise DeviceException(error_code=sw, ins=DefaultInsType.GET_VERSION,
+                              message="Invalid format returned by GET_VERSION")
+
+    return app_name.decode(), app_version.decode(), app_flags
+
+
+@dataclass
+class AppInfo:
+    """The app detected by `createClient` on the device of a transport client."""
+    name: str
+    version: str
+    flags: bytes
+    # the protocol version and the features of the app, once fetched by a `NewClient`
+    features: Optional[Tuple[int, AppFeature]] = None
+
+
+# the app detected on the device of each transport client; the entries are dropped with their transport client
+_app_info_cache: "weakref.WeakKeyDictionary[object, AppInfo]" = weakref.WeakKeyDictionary()
+
+# status words of a device that is not running the app anymore: either another app or the dashboard is running
+APP_CHANGED_SWS = (0x6E00, 0x6E01, 0x6511)
+
+
+def get_app_info(transport_client) -> Optional[AppInfo]:
+    """Returns the app detected on the device of `transport_client`, if it is still valid."""
+    try:
+        return _app_info_cache.get(transport_client)
+    except TypeError:
+        # not weak-referenceable: nothing is cached for the transport client
+        return None
+
+
+def set_app_info(transport_client, app_info: AppInfo) -> None:
+    try:
+        _app_info_cache[transport_client] = app_info
+    except TypeError:
+        pass
+
+
+def invalidate_app_info(transport_client) -> None:
+    """Forgets the app detected on the device of `transport_client`, so that the next `createClient` queries it again.
+
+    It is called by the clients when an exchange fails, when the device reports that the app is not running, and when
+    the transport is stopped; it must be called after reopening the same transport client, or restarting the app by
+    other means.
+    """
+    try:
+        _app_info_cache.pop(transport_client, None)
+    except TypeError:
+        pass
+
+
 @dataclass(frozen=True)
 class PartialSignature:
     """Represents a partial signature returned by sign_psbt.
@@ -79,6 +151,18 @@ class PartialSignature:
     tapleaf_hash: Optional[bytes] = None
 
 
+@dataclass
+class SignPsbtProgress:
+    """The progress of a sign_psbt session, that allows to resume it if it is interrupted.
+
+    It is updated by sign_psbt, also when it fails; passing it again to sign_psbt for the same PSBT and wallets
+    resumes the session without a new approval of the user, as long as the app was not restarted.
+    """
+    token: Optional[bytes] = None
+    # the signatures received so far, as yielded by the app
+    yielded: List[bytes] = field(default_factory=list)
+
+
 class Client:
     def __init__(self, transport_client: TransportClient, chain: Chain = Chain.MAIN, debug: bool = False) -> None:
         self.transport_client = transport_client
@@ -99,7 +183,14 @@ class Client:
             if self.debug:
                 print_response(e.sw, e.data)
 
+            if e.sw in APP_CHANGED_SWS:
+                invalidate_app_info(self.transport_client)
+
             return e.sw, e.data
+        except Exception:
+            # the transport is broken, and must be reopened
+            invalidate_app_info(self.transport_client)
+            raise
 
     def _make_request(self, apdu: dict) -> Tuple[int, bytes]:
         return self._apdu_exchange(apdu)
@@ -108,11 +199,12 @@ class Client:
         return self
 
     def __exit__(self, exc_type, exc_val, exc_tb):
-        self.transport_client.stop()
+        self.stop()
 
     def stop(self) -> None:
         """Stops the transport_client."""
 
+        invalidate_app_info(self.transport_client)
         self.transport_client.stop()
 
     def get_version(self) -> Tuple[str, str, bytes]:
@@ -126,26 +218,9 @@ class Client:
             The third element is a binary string representing the platform's global state (pin lock etc).
         """
 
-        sw, response = self._make_request(
-            {"cla": 0xB0, "ins": DefaultInsType.GET_VERSION, "p1": 0, "p2": 0, "data": b''})
+        sw, response = self._make_request(GET_VERSION_APDU)
 
-        if sw != 0x9000:
-            raise DeviceException(
-                error_code=sw, ins=DefaultInsType.GET_VERSION)
-
-        r = BytesIO(response)
-
-        format = r.read(1)
-
-        app_name = deser_string(r)
-        app_version = deser_string(r)
-        app_flags = deser_string(r)
-
-        if format != b'\1' or app_name == b'' or app_version == b'' or app_flags == b'':
-            raise DeviceException(error_code=sw, ins=DefaultInsType.GET_VERSION,
-                                  message="Invalid format returned by GET_VERSION")
-
-        return app_name.decode(), app_version.decode(), app_flags
+        return parse_get_version_response(sw, response)
 
     def get_extended_pubkey(self, path: str, display: bool = False) -> str:
         """Gets the serialized extended public key for certain BIP32 path. Optionally, validate with the user.
@@ -165,6 +240,23 @@ class Client:
 
         raise NotImplementedError
 
+    def get_extended_pubkeys(self, paths: List[str]) -> List[str]:
+        """Gets the serialized extended public keys for multiple BIP32 paths, in a single command.
+        The public keys are not shown on the device, therefore only standard paths are supported.
+
+        Parameters
+        ----------
+        paths : List[str]
+            BIP32 paths of the public keys you want.
+
+        Returns
+        -------
+        List[str]
+            The requested serialized extended public keys, in the same order as `paths`.
+        """
+
+        raise NotImplementedError
+
     def register_wallet(self, wallet: WalletPolicy) -> Tuple[bytes, bytes]:
         """Registers a wallet policy with the user. After approval returns the wallet id and hmac to be stored on the client.
 
@@ -182,6 +274,53 @@ class Client:
 
         raise NotImplementedError
 
+    def register_wallet_with_compiled_policy(self, wallet: WalletPolicy) -> Tuple[bytes, bytes, bytes]:
+        """Registers a wallet policy with the user, like `register_wallet`, and also returns its compiled policy.
+
+        The compiled policy is opaque, and can be stored on the client alongside the hmac; it can be passed to
+        `open_wallet_session` to skip parsing the wallet policy again. Requires the `COMPILED_POLICIES` feature of
+        the app; not supported on Nano S.
+
+        Parameters
+        ----------
+        wallet : WalletPolicy
+            The Wallet policy to register on the device.
+
+        Returns
+        -------
+        Tuple[bytes, bytes, bytes]
+            The first element the tuple is the 32-bytes wallet id.
+            The second element is the hmac.
+            The third element is the compiled policy.
+        """
+
+        raise NotImplementedError
+
+    def register_and_store_wallet(self, wallet: WalletPolicy) -> Tuple[bytes, bytes]:
+        """Registers a wallet policy with the user, like `register_wallet`, and stores it on the device after a further
+        approval of the user.
+
+        `get_wallet_address` and `sign_psbt` then load the stored wallet policy by its id, without transferring and
+        verifying it again; the hmac is not checked, and can be None. The client should still keep the hmac, as the
+        wallet policy is only loaded from the device with the same seed, and the oldest stored wallet policy is
+        replaced when the registry of the device is full; moreover, the client must still know the wallet policy.
+        All the keys of the wallet policy are stored, therefore it can have at most 8 keys. Requires the
+        `WALLET_REGISTRY` feature of the app; not supported on Nano S.
+
+        Parameters
+        ----------
+        wallet : WalletPolicy
+            The Wallet policy to register and store on the device.
+
+        Returns
+        -------
+        Tuple[bytes, bytes]
+            The first element the tuple is the 32-bytes wallet id.
+            The second element is the hmac.
+        """
+
+        raise NotImplementedError
+
     def get_wallet_address(
         self,
         wallet: WalletPolicy,
@@ -218,7 +357,46 @@ class Client:
 
         raise NotImplementedError
 
-    def sign_psbt(self, psbt: Union[PSBT, bytes, str], wallet: WalletPolicy, wallet_hmac: Optional[bytes]) -> List[Tuple[int, PartialSignature]]:
+    def get_wallet_addresses(
+        self,
+        wallet: WalletPolicy,
+        wallet_hmac: Optional[bytes],
+        change: int,
+        first_address_index: int,
+        n_addresses: int,
+    ) -> List[str]:
+        """For a given wallet that was already registered on the device (or a standard wallet that does not need registration),
+        returns the addresses for the `n_addresses` consecutive address indexes starting at `first_address_index`.
+        The addresses are not shown on the device.
+
+        Parameters
+        ----------
+        wallet : WalletPolicy
+            The registered wallet policy, or a standard wallet policy.
+
+        wallet_hmac: Optional[bytes]
+            For a registered wallet, the hmac obtained at wallet registration. `None` for a standard wallet policy.
+
+        change: int
+            0 for standard receive addresses, 1 for change addresses. Other values are invalid.
+
+        first_address_index: int
+            The address index of the first address in the last step of the BIP32 derivation.
+
+        n_addresses: int
+            The number of addresses; must be at least 1.
+
+        Returns
+        -------
+        List[str]
+            The requested addresses, in order of address index.
+        """
+
+        raise NotImplementedError
+
+    def sign_psbt(self, psbt: Union[PSBT, bytes, str], wallet: WalletPolicy, wallet_hmac: Optional[bytes],
+                  additional_wallets: Sequence[Tuple[WalletPolicy, Optional[bytes]]] = (),
+                  progress: Optional[SignPsbtProgress] = None) -> List[Tuple[int, PartialSignature]]:
         """Signs a PSBT using a registered wallet (or a standard wallet that does not need registration).
 
         Signature requires explicit approval from the user.
@@ -230,7 +408,9 @@ class Client:
             required fields changes depending on the type of input.
             The non-witness UTXO must be present for both legacy and SegWit inputs, or the hardware wallet will reject
             signing (this will change for Taproot inputs).
-            The argument can be either a `PSBT` object, or `bytes`, or a base64-encoded `str`.
+            The argument can be either a `PSBT` object, or `bytes`, or a base64-encoded `str`. On `NewClient`, a
+            serialized PSBT is merkleized without deserializing the values of its maps (see `RawPsbt`), and a `RawPsbt`
+            can also be given directly, for example read from a file with `RawPsbt.from_file`.
 
         wallet : WalletPolicy
             The registered wallet policy, or a standard wallet policy.
@@ -238,6 +418,15 @@ class Client:
         wallet_hmac: Optional[bytes]
             For a registered wallet, the hmac obtained at wallet registration. `None` for a standard wallet policy.
 
+        additional_wallets: Sequence[Tuple[WalletPolicy, Optional[bytes]]]
+            Other wallet policies, each with its hmac (or `None`), whose inputs are also signed; the user validates
+            the transaction only once. Requires the `MULTI_WALLET_SIGNING` feature of the app.
+
+        progress: Optional[SignPsbtProgress]
+            If given, the session can be resumed: the object is updated with the token of the session and the
+            signatures received, and a session interrupted while signing (for example, by a disconnection) is resumed
+            by calling sign_psbt again with the same arguments. Requires the `RESUMABLE_SIGNING` feature of the app.
+
         Returns
         -------
         List[Tuple[int, PartialSignature]]
@@ -248,6 +437,34 @@ class Client:
 
         raise NotImplementedError
 
+    def sign_psbt_batch(self, psbts: Sequence[Union[PSBT, bytes, str]], wallet: WalletPolicy,
+                        wallet_hmac: Optional[bytes]) -> List[Tuple[int, int, PartialSignature]]:
+        """Signs several PSBTs of the same registered wallet (or standard wallet), with a single approval of the user
+        for all of them: the device shows the external outputs of each transaction, then the number of transactions,
+        their total amount and their total fees. Requires the `PSBT_BATCHES` feature of the app.
+
+        Parameters
+        ----------
+        psbts : Sequence[PSBT | bytes | str]
+            The PSBTs, each as in `sign_psbt`.
+
+        wallet : WalletPolicy
+            The registered wallet policy, or a standard wallet policy, that signs all the PSBTs.
+
+        wallet_hmac: Optional[bytes]
+            For a registered wallet, the hmac obtained at wallet registration. `None` for a standard wallet policy.
+
+        Returns
+        -------
+        List[Tuple[int, int, PartialSignature]]
+            A list of tuples returned by the hardware wallets, where each element is a tuple of:
+            - an integer, the index of the PSBT in `psbts`;
+            - an integer, the index of the input being signed;
+            - an instance of `PartialSignature`.
+        """
+
+        raise NotImplementedError
+
     def get_master_fingerprint(self) -> bytes:
         """Gets the fingerprint of the master public key, as per BIP-32.
 
@@ -259,13 +476,84 @@ class Client:
 
         raise NotImplementedError
 
-    def sign_message(self, message: Union[str, bytes], bip32_path: str) -> str:
+    def get_app_features(self) -> Tuple[int, AppFeature]:
+        """Gets the highest protocol version and the optional features supported by the app.
+
+        Apps that predate the GET_APP_FEATURES command are reported as supporting version 1 of the
+        protocol, and none of the features.
+
+        Returns
+        -------
+        Tuple[int, AppFeature]
+            The first element is the highest protocol version supported by the app.
+            The second element is the bitmap of the supported features.
+        """
+
+        raise NotImplementedError
+
+    def open_wallet_session(self, wallet: WalletPolicy, wallet_hmac: bytes,
+                            compiled_policy: Optional[bytes] = None) -> None:
+        """Parses and verifies a registered wallet policy once, and keeps it in the device's memory.
+
+        Subsequent calls to `get_wallet_address` and `sign_psbt` for the same wallet and hmac reuse it, instead of
+        fetching and verifying the wallet policy again. Opening a session closes the previous one, if any.
+
+        Not supported on Nano S.
+
+        Parameters
+        ----------
+        wallet : WalletPolicy
+            The registered wallet policy.
+
+        wallet_hmac: bytes
+            The hmac obtained at wallet registration.
+
+        compiled_policy: Optional[bytes]
+            The compiled policy obtained with `register_wallet_with_compiled_policy`, if any. It is ignored by the
+            device if it is not valid, for example after an update of the app.
+        """
+
+        raise NotImplementedError
+
+    def sign_message(self, message: Union[str, bytes, BinaryIO], bip32_path: str) -> str:
         """
         Sign a message (bitcoin message signing).
         Signs a message using the legacy Bitcoin Core signed message format.
         The message is signed with the key at the given path.
-        :param message: The message to be signed. First encoded as bytes if not already.
+        :param message: The message to be signed. First encoded as bytes if not already. It can also be a seekable
+        binary stream, whose content from the current position is signed; the stream is read on demand, so the
+        message does not need to fit in memory.
         :param bip32_path: The BIP 32 derivation for the key to sign the message with.
         :return: The signature
         """
         raise NotImplementedError
+
+    def register_payee_list(self, scripts: List[bytes]) -> Tuple[bytes, bytes]:
+        """Registers a list of payees with the user, who validates the address of each of them. After approval returns
+        the payee list id and hmac to be stored on the client; they are passed to MerkleizedPsbt in order to sign
+        transactions whose outputs to the payees are validated with a single screen.
+
+        Parameters
+        ----------
+        scripts : List[bytes]
+            The scriptPubKeys of the payees.
+
+        Returns
+        -------
+        Tuple[bytes, bytes]
+            The first element the tuple is the 32-bytes payee list id.
+            The second element is the hmac.
+        """
+
+        raise NotImplementedError
+
+    def sign_messages(self, messages: List[Tuple[Union[str, bytes], str]], account_path: str) -> List[str]:
+        """
+        Sign multiple messages (bitcoin message signing) with keys of the same account, with a single confirmation.
+        The device shows the account path, the number of messages and the Merkle root of the list of messages.
+        :param messages: The messages to be signed, each with the BIP 32 derivation for the key to sign it with; all the
+        derivations must start with `account_path`.
+        :param account_path: The BIP 32 derivation of the account.
+        :return: The signatures, in the same order as `messages`
+        """
+        raise NotImplementedError
@@ -1,21 +1,49 @@
+import threading
 from enum import IntEnum
-from typing import List, Mapping
-from collections import deque
+from typing import Callable, Dict, List, Mapping, Optional, Tuple, Union
+from collections import OrderedDict, deque
+from concurrent.futures import Executor, Future
 from hashlib import sha256
 
 from .common import ByteStreamParser, sha256, write_varint
-from .merkle import MerkleTree, element_hash
+from .merkle import MerkleTree, StreamedMerkleTree, element_hash
+from .wallet import WalletPolicy
 
 
 class ClientCommandCode(IntEnum):
     YIELD = 0x10
+    PROGRESS = 0x11
     GET_PREIMAGE = 0x40
     GET_MERKLE_LEAF_PROOF = 0x41
     GET_MERKLE_LEAF_INDEX = 0x42
+    GET_MERKLE_LEAF_PROOFS = 0x43
+    GET_MERKLE_LEAF_ELEMENTS = 0x44
+    GET_MERKLE_LEAF_PROOF_REFS = 0x45
+    ANNOUNCE_ACCESS_PLAN = 0x46
+    GET_ACCESS_PLAN_DATA = 0x47
+    STREAM_MERKLE_TREE = 0x48
+    GET_TREE_STREAM_DATA = 0x49
+    PUT_RECORD = 0x50
+    GET_RECORD = 0x51
     GET_MORE_ELEMENTS = 0xA0
 
 
+class ProgressPhase(IntEnum):
+    """The phases of SIGN_PSBT reported by the PROGRESS messages, with the items they process."""
+    INPUTS = 1         # the inputs are verified
+    SEGWIT_HASHES = 2  # the inputs are hashed for the segwit sighashes
+    OUTPUTS = 3        # the outputs are verified, and shown to the user
+    SIGNING = 4        # the internal inputs are signed
+
+
+# Maximum length of the data of a CONTINUE sent as a short APDU
+MAX_SHORT_APDU_DATA_LEN = 255
+
+
 class ClientCommand:
+    # Maximum length of the responses; it is set by the interpreter
+    max_response_len: int = MAX_SHORT_APDU_DATA_LEN
+
     def execute(self, request: bytes) -> bytes:
         raise NotImplementedError("Subclasses should implement this method.")
 
@@ -24,6 +52,93 @@ class ClientCommand:
         raise NotImplementedError("Subclasses should implement this method.")
 
 
+class ElementQueue:
+    """The queue of the elements that do not fit in the responses of the client commands, that the hardware wallet
+    reads with GET_MORE_ELEMENTS.
+
+    The elements are not stored one by one: each push adds a view into a buffer of consecutive elements of the same
+    length (for example, the rest of a preimage, whose elements are its bytes), without copying it, and a cursor
+    marks the first byte of the oldest buffer that was not returned yet.
+    """
+
+    def __init__(self):
+        # the buffers, with the length of their elements
+        self._buffers: "deque[Tuple[memoryview, int]]" = deque()
+        self._cursor = 0
+        self._n_elements = 0
+
+    def __len__(self) -> int:
+        return self._n_elements
+
+    @property
+    def element_len(self) -> int:
+        """The length of the next element; the queue must not be empty."""
+
+        return self._buffers[0][1]
+
+    def has_uniform_element_len(self) -> bool:
+        """Returns True if all the elements in the queue have the same length."""
+
+        return all(element_len == self.element_len for _, element_len in self._buffers)
+
+    def push(self, data: Union[bytes, bytearray, memoryview], element_len: int) -> None:
+        """Adds the elements of `data`, split into elements of `element_len` bytes. `data` is not copied; therefore,
+        it must not be modified while it is in the queue."""
+
+        if len(data) % element_len != 0:
+            raise ValueError("The data is not a list of elements of the given length.")
+        if len(data) > 0:
+            self._buffers.append((memoryview(data), element_len))
+            self._n_elements += len(data) // element_len
+
+    def push_queue(self, other: "ElementQueue") -> None:
+        """Adds the elements of `other`, that must not be used afterwards."""
+
+        other._trim()
+        self._buffers.extend(other._buffers)
+        self._n_elements += len(other)
+
+    def pop_into(self, out: bytearray, offset: int, n_elements: int) -> None:
+        """Removes the next `n_elements` elements, that must have the same length, and writes them into `out`
+        starting at `offset`."""
+
+        if n_elements > self._n_elements:
+            raise ValueError("Not enough elements in the queue.")
+        self._n_elements -= n_elements
+
+        n_bytes = n_elements * self.element_len if n_elements > 0 else 0
+        while n_bytes > 0:
+            buffer, _ = self._buffers[0]
+            chunk_len = min(n_bytes, len(buffer) - self._cursor)
+            out[offset:offset + chunk_len] = buffer[self._cursor:self._cursor + chunk_len]
+            offset += chunk_len
+            n_bytes -= chunk_len
+            self._cursor += chunk_len
+            if self._cursor == len(buffer):
+                self._buffers.popleft()
+                self._cursor = 0
+
+    def take(self) -> "ElementQueue":
+        """Removes all the elements, and returns them in a new queue."""
+
+        result = ElementQueue()
+        result.push_queue(self)
+        self.clear()
+        return result
+
+    def clear(self) -> None:
+        self._buffers.clear()
+        self._cursor = 0
+        self._n_elements = 0
+
+    def _trim(self) -> None:
+        # replaces the first buffer with the view of the part that was not returned yet
+        if self._cursor > 0:
+            buffer, element_len = self._buffers[0]
+            self._buffers[0] = (buffer[self._cursor:], element_len)
+            self._cursor = 0
+
+
 class YieldCommand(ClientCommand):
     def __init__(self, results: List[bytes]):
         self.results = results
@@ -38,9 +153,11 @@ class YieldCommand(ClientCommand):
 
 
 class GetPreimageCommand(ClientCommand):
-    def __init__(self, known_preimages: Mapping[bytes, bytes], queue: "deque[bytes]"):
+    def __init__(self, known_preimages: Mapping[bytes, bytes], known_streams: List[StreamedMerkleTree],
+                 queue: ElementQueue):
         self.queue = queue
         self.known_preimages = known_preimages
+        self.known_streams = known_streams
 
     @property
     def code(self) -> int:
@@ -55,41 +172,53 @@ class GetPreimageCommand(ClientCommand):
         req_hash = req.read_bytes(32)
         req.assert_empty()
 
-        if req_hash in self.known_preimages:
-            known_preimage = self.known_preimages[req_hash]
-
+        known_preimage = self.find_preimage(req_hash)
+        if known_preimage is not None:
             preimage_len_out = write_varint(len(known_preimage))
 
-            # We can send at most 255 - len(preimage_len_out) - 1 bytes in a single message;
-            # the rest will be stored for GET_MORE_ELEMENTS
+            # We can send at most max_response_len - len(preimage_len_out) - 1 bytes in a single
+            # message, and at most 255 as the length is 1 byte; the rest will be stored for
+            # GET_MORE_ELEMENTS
 
-            max_payload_size = 255 - len(preimage_len_out) - 1
+            max_payload_size = min(self.max_response_len - len(preimage_len_out) - 1, 255)
 
             payload_size = min(max_payload_size, len(known_preimage))
 
-            if payload_size < len(known_preimage):
-                # split into list of length-1 bytes elements
-                extra_elements = [
-                    known_preimage[i: i + 1]
-                    for i in range(payload_size, len(known_preimage))
-                ]
-                # add to the queue any remaining extra bytes
-                self.queue.extend(extra_elements)
-
-            return (
-                preimage_len_out
-                + payload_size.to_bytes(1, byteorder="big")
-                + known_preimage[:payload_size]
-            )
+            # add to the queue any remaining extra bytes, as length-1 elements, without copying them
+            preimage_view = memoryview(known_preimage)
+            self.queue.push(preimage_view[payload_size:], 1)
+
+            response = bytearray(len(preimage_len_out) + 1 + payload_size)
+            response[:len(preimage_len_out)] = preimage_len_out
+            response[len(preimage_len_out)] = payload_size
+            response[len(preimage_len_out) + 1:] = preimage_view[:payload_size]
+            return response
 
         # not found
         raise RuntimeError(f"Requested unknown preimage for: {req_hash.hex()}")
 
+    def find_preimage(self, req_hash: bytes) -> Optional[bytes]:
+        if req_hash in self.known_preimages:
+            return self.known_preimages[req_hash]
+
+        # the leaves of streamed lists are not stored, but the last leaf that was read can be returned
+        for stream in self.known_streams:
+            preimage = stream.find_preimage(req_hash)
+            if preimage is not None:
+                return preimage
+
+        return None
+
 
 class GetMerkleLeafProofCommand(ClientCommand):
-    def __init__(self, known_trees: Mapping[bytes, MerkleTree], queue: "deque[bytes]"):
+    def __init__(self, known_trees: Mapping[bytes, Union[MerkleTree, StreamedMerkleTree]], queue: ElementQueue):
         self.queue = queue
         self.known_trees = known_trees
+        # The hardware wallet requests the same leaves many times (for example, the input commitments in
+        # SIGN_PSBT), so the responses are memoized as (response, elements for GET_MORE_ELEMENTS), keyed by
+        # (root, leaf_index, max_response_len), the latter being the concatenation of the proof elements that do not
+        # fit the response. Streamed trees are not memoized, in order to keep their memory usage bounded.
+        self.cached_responses: Dict[Tuple[bytes, int, int], Tuple[bytes, bytes]] = {}
 
     @property
     def code(self) -> int:
@@ -106,7 +235,125 @@ class GetMerkleLeafProofCommand(ClientCommand):
         if not root in self.known_trees:
             raise ValueError(f"Unknown Merkle root: {root.hex()}.")
 
-        mt: MerkleTree = self.known_trees[root]
+        mt = self.known_trees[root]
+
+        if leaf_index >= tree_size or len(mt) != tree_size:
+            raise ValueError(f"Invalid index or tree size.")
+
+        if len(self.queue) != 0:
+            raise RuntimeError(
+                "This command should not execute when the queue is not empty."
+            )
+
+        cached = self.cached_responses.get((root, leaf_index, self.max_response_len))
+        if cached is None:
+            proof = mt.prove_leaf(leaf_index)
+
+            # Compute how many elements we can fit in max_response_len - 32 - 1 - 1 bytes
+            n_response_elements = min((self.max_response_len - 32 - 1 - 1) // 32, len(proof))
+
+            response = bytearray(32 + 1 + 1 + 32 * n_response_elements)
+            response[:32] = mt.get(leaf_index)
+            response[32] = len(proof)
+            response[33] = n_response_elements
+            for i in range(n_response_elements):
+                response[34 + 32 * i:66 + 32 * i] = proof[i]
+            cached = (bytes(response), b"".join(proof[n_response_elements:]))
+
+            if isinstance(mt, MerkleTree):
+                self.cached_responses[(root, leaf_index, self.max_response_len)] = cached
+
+        response, leftover_elements = cached
+
+        # Add to the queue any proof elements that do not fit the response
+        self.queue.push(leftover_elements, 32)
+
+        return response
+
+
+class HashRefTable:
+    """The table of the hashes exchanged in the GET_MERKLE_LEAF_PROOF_REFS commands of an APDU, kept identically by
+    the hardware wallet, which references its entries by their index.
+
+    In each exchange, the hashes are used in this order: the Merkle root, the referenced proof hashes, then the proof
+    hashes sent in full. Using a hash that is in the table marks its entry as the most recently used; otherwise, a
+    hash sent in full replaces the least recently used entry (the empty entries first, with the lowest index first)
+    among the ones not used yet in the same exchange, or it is not stored if all of them were. The first FRONTIER_LEVELS
+    hashes of each proof are never stored.
+    """
+
+    SIZE = 16
+
+    # number of levels below the nodes kept by the hardware wallet after verifying a proof
+    FRONTIER_LEVELS = 3
+
+    # reference used in the requests when the root is sent in full
+    NONE = 0xFF
+
+    def __init__(self):
+        self.hashes: List[Optional[bytes]] = [None] * self.SIZE
+        self.last_used: List[int] = [0] * self.SIZE
+        self.clock = 0
+        self.exchange_start = 0
+
+    def start_exchange(self) -> None:
+        self.exchange_start = self.clock
+
+    def find(self, h: bytes) -> Optional[int]:
+        for i, entry in enumerate(self.hashes):
+            if entry == h:
+                return i
+        return None
+
+    def use(self, index: int) -> bytes:
+        if index >= self.SIZE or self.hashes[index] is None:
+            raise ValueError(f"Invalid hash reference: {index}")
+        self.clock += 1
+        self.last_used[index] = self.clock
+        return self.hashes[index]
+
+    def add(self, h: bytes) -> None:
+        index = self.find(h)
+        if index is None:
+            candidates = [i for i in range(self.SIZE) if self.last_used[i] <= self.exchange_start]
+            if len(candidates) == 0:
+                return
+            index = min(candidates, key=lambda i: self.last_used[i])
+            self.hashes[index] = h
+        self.use(index)
+
+
+class GetMerkleLeafProofRefsCommand(ClientCommand):
+    def __init__(self, known_trees: Mapping[bytes, Union[MerkleTree, StreamedMerkleTree]], queue: ElementQueue,
+                 hash_refs: HashRefTable):
+        self.queue = queue
+        self.known_trees = known_trees
+        self.hash_refs = hash_refs
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_MERKLE_LEAF_PROOF_REFS
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        self.hash_refs.start_exchange()
+
+        root_ref = req.read_uint(1)
+        if root_ref == HashRefTable.NONE:
+            root = req.read_bytes(32)
+            self.hash_refs.add(root)
+        else:
+            root = self.hash_refs.use(root_ref)
+        tree_size = req.read_varint()
+        leaf_index = req.read_varint()
+        n_known = req.read_uint(1)
+        req.assert_empty()
+
+        if not root in self.known_trees:
+            raise ValueError(f"Unknown Merkle root: {root.hex()}.")
+
+        mt = self.known_trees[root]
 
         if leaf_index >= tree_size or len(mt) != tree_size:
             raise ValueError(f"Invalid index or tree size.")
@@ -117,18 +364,90 @@ class GetMerkleLeafProofCommand(ClientCommand):
             )
 
         proof = mt.prove_leaf(leaf_index)
+        if n_known > len(proof):
+            raise ValueError(f"Invalid number of known hashes.")
+
+        # the hardware wallet already knows the node at the level of the last n_known hashes
+        proof = proof[:len(proof) - n_known]
+
+        # the last hashes of the proof that are in the table are referenced; they are the ones closer to the root,
+        # shared with the proofs of the neighbouring leaves
+        refs: List[int] = []
+        while len(refs) < len(proof):
+            index = self.hash_refs.find(proof[len(proof) - 1 - len(refs)])
+            if index is None:
+                break
+            refs.append(index)
+        refs.reverse()
+
+        full_proof = proof[:len(proof) - len(refs)]
+        for index in refs:
+            self.hash_refs.use(index)
+        # the lowest hashes, below the level of the nodes kept by the hardware wallet, are not stored
+        for h in full_proof[HashRefTable.FRONTIER_LEVELS:]:
+            self.hash_refs.add(h)
+
+        # Compute how many elements we can fit in the rest of the response
+        n_response_elements = min((self.max_response_len - 32 - 1 - 1 - len(refs) - 1) // 32, len(full_proof))
+
+        # Add to the queue any proof elements that do not fit the response
+        self.queue.push(b"".join(full_proof[n_response_elements:]), 32)
+
+        return b"".join(
+            [
+                mt.get(leaf_index),
+                len(proof).to_bytes(1, byteorder="big"),
+                len(refs).to_bytes(1, byteorder="big"),
+                bytes(refs),
+                n_response_elements.to_bytes(1, byteorder="big"),
+                *full_proof[:n_response_elements],
+            ]
+        )
+
+
+class GetMerkleLeafProofsCommand(ClientCommand):
+    def __init__(self, known_trees: Mapping[bytes, Union[MerkleTree, StreamedMerkleTree]], queue: ElementQueue):
+        self.queue = queue
+        self.known_trees = known_trees
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_MERKLE_LEAF_PROOFS
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        root = req.read_bytes(32)
+        tree_size = req.read_varint()
+        first_leaf_index = req.read_varint()
+        n_leaves = req.read_varint()
+        req.assert_empty()
 
-        # Compute how many elements we can fit in 255 - 32 - 1 - 1 = 221 bytes
-        n_response_elements = min((255 - 32 - 1 - 1) // 32, len(proof))
+        if not root in self.known_trees:
+            raise ValueError(f"Unknown Merkle root: {root.hex()}.")
+
+        mt = self.known_trees[root]
+
+        if n_leaves == 0 or first_leaf_index + n_leaves > tree_size or len(mt) != tree_size:
+            raise ValueError(f"Invalid leaf indexes or tree size.")
+
+        if len(self.queue) != 0:
+            raise RuntimeError(
+                "This command should not execute when the queue is not empty."
+            )
+
+        proof = mt.prove_leaves(first_leaf_index, n_leaves)
+
+        # Compute how many elements we can fit in max_response_len - 1 - 1 bytes
+        n_response_elements = min((self.max_response_len - 1 - 1) // 32, len(proof))
         n_leftover_elements = len(proof) - n_response_elements
 
         # Add to the queue any proof elements that do not fit the response
         if (n_leftover_elements > 0):
-            self.queue.extend(proof[-n_leftover_elements:])
+            self.queue.push(b"".join(proof[-n_leftover_elements:]), 32)
 
         return b"".join(
             [
-                mt.get(leaf_index),
                 len(proof).to_bytes(1, byteorder="big"),
                 n_response_elements.to_bytes(1, byteorder="big"),
                 *proof[:n_response_elements],
@@ -136,8 +455,75 @@ class GetMerkleLeafProofCommand(ClientCommand):
         )
 
 
+class GetMerkleLeafElementsCommand(ClientCommand):
+    def __init__(self, known_trees: Mapping[bytes, Union[MerkleTree, StreamedMerkleTree]],
+                 known_preimages: Mapping[bytes, bytes], queue: ElementQueue):
+        self.queue = queue
+        self.known_trees = known_trees
+        self.known_preimages = known_preimages
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_MERKLE_LEAF_ELEMENTS
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        root = req.read_bytes(32)
+        tree_size = req.read_varint()
+        n_leaves = req.read_uint(1)
+        leaf_indexes = [req.read_varint() for _ in range(n_leaves)]
+        req.assert_empty()
+
+        if not root in self.known_trees:
+            raise ValueError(f"Unknown Merkle root: {root.hex()}.")
+
+        mt = self.known_trees[root]
+
+        if not isinstance(mt, MerkleTree):
+            raise ValueError(f"Unsupported Merkle tree.")
+
+        if len(mt) != tree_size:
+            raise ValueError(f"Invalid tree size.")
+
+        if len(self.queue) != 0:
+            raise RuntimeError(
+                "This command should not execute when the queue is not empty."
+            )
+
+        # raises ValueError if the leaf indexes are not valid
+        proof = mt.prove_leaf_set(leaf_indexes)
+
+        data = bytearray(b"".join(proof))
+        for leaf_index in leaf_indexes:
+            leaf_hash = mt.get(leaf_index)
+            if leaf_hash not in self.known_preimages:
+                raise RuntimeError(f"Requested unknown preimage for: {leaf_hash.hex()}")
+            preimage = self.known_preimages[leaf_hash]
+            data += write_varint(len(preimage)) + preimage
+
+        data_len_out = write_varint(len(data))
+
+        # We can send at most max_response_len - len(data_len_out) - 1 bytes in a single message,
+        # and at most 255 as the length is 1 byte; the rest will be stored for GET_MORE_ELEMENTS
+
+        max_payload_size = min(self.max_response_len - len(data_len_out) - 1, 255)
+
+        payload_size = min(max_payload_size, len(data))
+
+        # add to the queue any remaining extra bytes, as length-1 elements, without copying them
+        data_view = memoryview(data)
+        self.queue.push(data_view[payload_size:], 1)
+
+        response = bytearray(len(data_len_out) + 1 + payload_size)
+        response[:len(data_len_out)] = data_len_out
+        response[len(data_len_out)] = payload_size
+        response[len(data_len_out) + 1:] = data_view[:payload_size]
+        return response
+
+
 class GetMerkleLeafIndexCommand(ClientCommand):
-    def __init__(self, known_trees: Mapping[bytes, MerkleTree]):
+    def __init__(self, known_trees: Mapping[bytes, Union[MerkleTree, StreamedMerkleTree]]):
         self.known_trees = known_trees
 
     @property
@@ -164,8 +550,218 @@ class GetMerkleLeafIndexCommand(ClientCommand):
         return found.to_bytes(1, byteorder="big") + write_varint(leaf_index)
 
 
+def take_data_chunk(data: bytearray, max_response_len: int) -> bytes:
+    """Removes from `data` the first bytes that fit in a response, and returns them prefixed by their length."""
+
+    # the length takes 3 bytes if the response is longer than 252 bytes
+    n_bytes = max_response_len - 1
+    if n_bytes > 0xFC:
+        n_bytes = max_response_len - 3
+    n_bytes = min(n_bytes, len(data))
+
+    response = write_varint(n_bytes) + bytes(data[:n_bytes])
+    del data[:n_bytes]
+    return response
+
+
+class AccessPlan:
+    """The data of the access plan announced by the hardware wallet in the current command: for each map of the
+    list and each key of the plan that is in the map, the value preimage prefixed by its length, followed by the
+    hashes of its Merkle proof in the values tree, from the leaf to the root."""
+
+    def __init__(self):
+        self.data = bytearray()
+
+
+class AnnounceAccessPlanCommand(ClientCommand):
+    def __init__(self, known_trees: Mapping[bytes, Union[MerkleTree, StreamedMerkleTree]],
+                 known_preimages: Mapping[bytes, bytes], plan: AccessPlan):
+        self.known_trees = known_trees
+        self.known_preimages = known_preimages
+        self.plan = plan
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.ANNOUNCE_ACCESS_PLAN
+
+    def get_tree(self, root: bytes, size: int) -> MerkleTree:
+        if root not in self.known_trees:
+            raise ValueError(f"Unknown Merkle root: {root.hex()}.")
+
+        mt = self.known_trees[root]
+        if not isinstance(mt, MerkleTree):
+            raise ValueError(f"Unsupported Merkle tree.")
+
+        if len(mt) != size:
+            raise ValueError(f"Invalid tree size.")
+        return mt
+
+    def get_preimage(self, h: bytes) -> bytes:
+        if h not in self.known_preimages:
+            raise RuntimeError(f"Requested unknown preimage for: {h.hex()}")
+        return self.known_preimages[h]
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        maps_root = req.read_bytes(32)
+        n_maps = req.read_varint()
+        n_keys = req.read_uint(1)
+        keys = [req.read_bytes(req.read_uint(1)) for _ in range(n_keys)]
+        req.assert_empty()
+
+        maps_tree = self.get_tree(maps_root, n_maps)
+
+        data = bytearray()
+        for i in range(n_maps):
+            commitment = ByteStreamParser(self.get_preimage(maps_tree.get(i))[1:])
+            map_size = commitment.read_varint()
+            keys_tree = self.get_tree(commitment.read_bytes(32), map_size)
+            values_tree = self.get_tree(commitment.read_bytes(32), map_size)
+            commitment.assert_empty()
+
+            for key in keys:
+                try:
+                    index = keys_tree.leaf_index(element_hash(key))
+                except ValueError:
+                    continue  # nothing for the keys that are not in the map
+
+                preimage = self.get_preimage(values_tree.get(index))
+                data += write_varint(len(preimage)) + preimage + b"".join(values_tree.prove_leaf(index))
+
+        # the data of the previous plan, if any, is discarded
+        self.plan.data = data
+        return b""
+
+
+class GetAccessPlanDataCommand(ClientCommand):
+    def __init__(self, plan: AccessPlan):
+        self.plan = plan
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_ACCESS_PLAN_DATA
+
+    def execute(self, request: bytes) -> bytes:
+        if len(request) != 1:
+            raise ValueError("Wrong request length.")
+
+        if len(self.plan.data) == 0:
+            raise ValueError("No access plan data to get.")
+
+        return take_data_chunk(self.plan.data, self.max_response_len)
+
+
+class TreeStream:
+    """The data of the tree stream started by the hardware wallet in the current command: the preimage of each leaf
+    of the tree, in order, prefixed by its length."""
+
+    def __init__(self):
+        self.data = bytearray()
+
+
+class StreamMerkleTreeCommand(ClientCommand):
+    def __init__(self, known_trees: Mapping[bytes, Union[MerkleTree, StreamedMerkleTree]],
+                 known_preimages: Mapping[bytes, bytes], stream: TreeStream):
+        self.known_trees = known_trees
+        self.known_preimages = known_preimages
+        self.stream = stream
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.STREAM_MERKLE_TREE
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        root = req.read_bytes(32)
+        tree_size = req.read_varint()
+        req.assert_empty()
+
+        if root not in self.known_trees:
+            raise ValueError(f"Unknown Merkle root: {root.hex()}.")
+
+        mt = self.known_trees[root]
+        if not isinstance(mt, MerkleTree):
+            raise ValueError(f"Unsupported Merkle tree.")
+
+        if len(mt) != tree_size or tree_size == 0:
+            raise ValueError(f"Invalid tree size.")
+
+        data = bytearray()
+        for i in range(tree_size):
+            leaf_hash = mt.get(i)
+            if leaf_hash not in self.known_preimages:
+                raise RuntimeError(f"Requested unknown preimage for: {leaf_hash.hex()}")
+            preimage = self.known_preimages[leaf_hash]
+            data += write_varint(len(preimage)) + preimage
+
+        # the data of the previous stream, if any, is discarded
+        self.stream.data = data
+        return take_data_chunk(self.stream.data, self.max_response_len)
+
+
+class GetTreeStreamDataCommand(ClientCommand):
+    def __init__(self, stream: TreeStream):
+        self.stream = stream
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_TREE_STREAM_DATA
+
+    def execute(self, request: bytes) -> bytes:
+        if len(request) != 1:
+            raise ValueError("Wrong request length.")
+
+        if len(self.stream.data) == 0:
+            raise ValueError("No tree stream data to get.")
+
+        return take_data_chunk(self.stream.data, self.max_response_len)
+
+
+class PutRecordCommand(ClientCommand):
+    def __init__(self, records: Dict[int, bytes]):
+        self.records = records
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.PUT_RECORD
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        index = req.read_varint()
+        record_len = req.read_uint(1)
+        record = req.read_bytes(record_len)
+        req.assert_empty()
+
+        self.records[index] = record
+        return b""
+
+
+class GetRecordCommand(ClientCommand):
+    def __init__(self, records: Dict[int, bytes]):
+        self.records = records
+
+    @property
+    def code(self) -> int:
+        return ClientCommandCode.GET_RECORD
+
+    def execute(self, request: bytes) -> bytes:
+        req = ByteStreamParser(request[1:])
+
+        index = req.read_varint()
+        req.assert_empty()
+
+        if index not in self.records:
+            raise ValueError(f"Unknown record: {index}.")
+
+        record = self.records[index]
+        return len(record).to_bytes(1, byteorder="big") + record
+
+
 class GetMoreElementsCommand(ClientCommand):
-    def __init__(self, queue: "deque[bytes]"):
+    def __init__(self, queue: ElementQueue):
         self.queue = queue
 
     @property
@@ -179,28 +775,64 @@ class GetMoreElementsCommand(ClientCommand):
         if len(self.queue) == 0:
             raise ValueError("No elements to get.")
 
-        element_len = len(self.queue[0])
-        if any(len(el) != element_len for el in self.queue):
+        if not self.queue.has_uniform_element_len():
             raise ValueError(
                 "The queue contains elements of different byte length, which is not expected."
             )
+        element_len = self.queue.element_len
 
-        # pop from the queue, keeping the total response length at most 255
+        # pop from the queue, keeping the total response length at most max_response_len, and the
+        # number of elements at most 255
 
-        response_elements = bytearray()
+        n_added_elements = min(len(self.queue), 255, (self.max_response_len - 2) // element_len)
 
-        n_added_elements = 0
-        while len(self.queue) > 0 and len(response_elements) + element_len <= 253:
-            response_elements.extend(self.queue.popleft())
-            n_added_elements += 1
+        response = bytearray(2 + n_added_elements * element_len)
+        response[0] = n_added_elements
+        response[1] = element_len
+        self.queue.pop_into(response, 2, n_added_elements)
+        return response
 
-        return b"".join(
-            [
-                n_added_elements.to_bytes(1, byteorder="big"),
-                element_len.to_bytes(1, byteorder="big"),
-                bytes(response_elements),
-            ]
-        )
+
+class WalletDataCache:
+    """A cache of the data that the client serves for each wallet policy: the Merkle tree of its keys, and the
+    preimages of its serialization, of its descriptor template and of the leaves of the keys tree.
+
+    The wallet policies are identified by their fields, so that they are not hashed again for each command that uses
+    the same policy, even with a different `WalletPolicy` object. The least recently used wallet policy is evicted
+    when more than `max_wallets` are cached. The cache can be used from several threads.
+    """
+
+    def __init__(self, max_wallets: int = 64):
+        self.max_wallets = max_wallets
+        self._entries: "OrderedDict[tuple, Tuple[Dict[bytes, bytes], MerkleTree]]" = OrderedDict()
+        self._lock = threading.Lock()
+
+    def __len__(self) -> int:
+        """Returns the number of wallet policies in the cache."""
+        with self._lock:
+            return len(self._entries)
+
+    def get(self, wallet: WalletPolicy) -> Tuple[Dict[bytes, bytes], MerkleTree]:
+        """Returns the known preimages and the Merkle tree of the keys of `wallet`, computing them if they are not
+        cached. They must not be modified."""
+
+        key = wallet.cache_key()
+        with self._lock:
+            entry = self._entries.get(key)
+            if entry is not None:
+                self._entries.move_to_end(key)
+                return entry
+
+        interpreter = ClientCommandInterpreter()
+        interpreter.add_known_wallet(wallet)
+        entry = (interpreter.known_preimages, next(iter(interpreter.known_trees.values())))
+
+        with self._lock:
+            self._entries[key] = entry
+            self._entries.move_to_end(key)
+            while len(self._entries) > self.max_wallets:
+                self._entries.popitem(last=False)
+        return entry
 
 
 class ClientCommandInterpreter:
@@ -209,6 +841,7 @@ class ClientCommandInterpreter:
     This class keeps has methods to keep track of:
     - known preimages
     - known Merkle trees from lists of elements
+    - known Merkle trees from the chunks of a stream, that is not kept in memory
 
     Moreover, it containes the state that is relevant for the interpreted client side commands:
     - a queue of bytes that contains any bytes that could not fit in a response from the
@@ -216,6 +849,8 @@ class ClientCommandInterpreter:
       GET_MERKLE_LEAF_PROOF command (which returns a Merkle proof, which might be too long to fit
       in a single message). The data in the queue is returned in one (or more) successive
       GET_MORE_ELEMENTS commands from the hardware wallet.
+    - the records stored by the hardware wallet with the PUT_RECORD client command, and returned
+      with GET_RECORD.
 
     Finally, it keeps track of the yielded values (that is, the values sent from the hardware
     wallet with a YIELD client command).
@@ -225,26 +860,99 @@ class ClientCommandInterpreter:
     yielded: list[bytes]
         A list of all the value sent by the Hardware Wallet with a YIELD client command during thw
         processing of an APDU.
+    queued_yields: bool
+        If True, the responses from the hardware wallet are expected to start with YIELD messages
+        prefixed by their length, as in version 2 of the protocol for SIGN_PSBT.
+    progress_callback: Optional[Callable[[ProgressPhase, int, int], None]]
+        If set, it is called with the phase, the number of items processed and the total number of
+        items of each PROGRESS message queued in the responses, as in version 7 of the protocol for
+        SIGN_PSBT, as soon as the response is received.
+    max_response_len: int
+        The maximum length of the responses; it is 255 by default, and can be raised if the hardware
+        wallet accepts extended-length APDUs for CONTINUE.
     """
 
-    def __init__(self):
-        self.known_preimages: Mapping[bytes, bytes] = {}
-        self.known_trees: Mapping[bytes, MerkleTree] = {}
+    def __init__(self, shared: Optional["ClientCommandInterpreter"] = None):
+        if shared is None:
+            self.known_preimages: Mapping[bytes, bytes] = {}
+            self.known_trees: Mapping[bytes, Union[MerkleTree, StreamedMerkleTree]] = {}
+            self.known_streams: List[StreamedMerkleTree] = []
+            # the known data is content-addressed: the leaf hash of each element, and the commitment of each
+            # mapping (keyed by its sorted items), are only computed once
+            self._element_leaves: Dict[bytes, bytes] = {}
+            self._mapping_commitments: Dict[Tuple[Tuple[bytes, bytes], ...], bytes] = {}
+        else:
+            self.known_preimages = shared.known_preimages
+            self.known_trees = shared.known_trees
+            self.known_streams = shared.known_streams
+            self._element_leaves = shared._element_leaves
+            self._mapping_commitments = shared._mapping_commitments
 
         self.yielded: List[bytes] = []
+        self.queued_yields = False
+        self.progress_callback: Optional[Callable[[ProgressPhase, int, int], None]] = None
 
-        queue = deque()
+        queue = ElementQueue()
+        records: Dict[int, bytes] = {}
+        access_plan = AccessPlan()
+        tree_stream = TreeStream()
+        self._queue = queue
+        self._speculator: Optional[ResponseSpeculator] = None
 
         commands = [
             YieldCommand(self.yielded),
-            GetPreimageCommand(self.known_preimages, queue),
+            GetPreimageCommand(self.known_preimages, self.known_streams, queue),
             GetMerkleLeafIndexCommand(self.known_trees),
             GetMerkleLeafProofCommand(self.known_trees, queue),
+            GetMerkleLeafProofRefsCommand(self.known_trees, queue, HashRefTable()),
+            GetMerkleLeafProofsCommand(self.known_trees, queue),
+            GetMerkleLeafElementsCommand(self.known_trees, self.known_preimages, queue),
+            AnnounceAccessPlanCommand(self.known_trees, self.known_preimages, access_plan),
+            GetAccessPlanDataCommand(access_plan),
+            StreamMerkleTreeCommand(self.known_trees, self.known_preimages, tree_stream),
+            GetTreeStreamDataCommand(tree_stream),
+            PutRecordCommand(records),
+            GetRecordCommand(records),
             GetMoreElementsCommand(queue),
         ]
 
         self.commands = {cmd.code: cmd for cmd in commands}
 
+        self.max_response_len = MAX_SHORT_APDU_DATA_LEN
+
+    @property
+    def max_response_len(self) -> int:
+        return self._max_response_len
+
+    @max_response_len.setter
+    def max_response_len(self, value: int) -> None:
+        if value < MAX_SHORT_APDU_DATA_LEN:
+            raise ValueError(f"The maximum response length must be at least {MAX_SHORT_APDU_DATA_LEN}.")
+
+        self._max_response_len = value
+        for cmd in self.commands.values():
+            cmd.max_response_len = value
+
+    def fork(self) -> "ClientCommandInterpreter":
+        """Returns a new interpreter with an empty state, that shares the known preimages and Merkle trees
+        of this one without copying them.
+
+        The forks can serve the same data to several hardware wallets at the same time, as long as no more
+        preimages or trees are added.
+        """
+
+        return ClientCommandInterpreter(shared=self)
+
+    def add_known_data(self, other: "ClientCommandInterpreter") -> None:
+        """Adds the known preimages and Merkle trees of `other` to the ones of this interpreter, for example in order
+        to serve the data of several PSBTs in the same command."""
+
+        self.known_preimages.update(other.known_preimages)
+        self.known_trees.update(other.known_trees)
+        self.known_streams.extend(stream for stream in other.known_streams if stream not in self.known_streams)
+        self._element_leaves.update(other._element_leaves)
+        self._mapping_commitments.update(other._mapping_commitments)
+
     def execute(self, hw_response: bytes) -> bytes:
         """Interprets the client command requested by the hardware wallet, returning the appropriate
         response and updating the client interpreter's internal state if needed.
@@ -261,6 +969,12 @@ class ClientCommandInterpreter:
             to be sent via INS_CONTINUE.
         """
 
+        if self.queued_yields:
+            hw_response = self.extract_queued_yields(hw_response)
+            if len(hw_response) == 0:
+                # the interruption only contained queued YIELD messages
+                return b""
+
         if len(hw_response) == 0:
             raise RuntimeError(
                 "Unexpected empty SW_INTERRUPTED_EXECUTION response from hardware wallet."
@@ -272,7 +986,80 @@ class ClientCommandInterpreter:
                 "Unexpected command code: 0x{:02X}".format(cmd_code)
             )
 
-        return self.commands[cmd_code].execute(hw_response)
+        if self._speculator is None:
+            return self.commands[cmd_code].execute(hw_response)
+
+        speculated = self._speculator.take(hw_response) if len(self._queue) == 0 else None
+        if speculated is not None:
+            response, leftover_elements = speculated
+            self._queue.push_queue(leftover_elements)
+        else:
+            response = self.commands[cmd_code].execute(hw_response)
+
+        self._speculator.speculate(hw_response)
+        return response
+
+    def start_speculation(self, executor: Executor) -> None:
+        """Starts computing in advance the responses to the requests that the hardware wallet is likely
+        to send next, with `executor`, while the hardware wallet processes the previous response.
+
+        The requests are predicted from the previous ones: after a Merkle proof or leaf elements are
+        requested, the same request for the next leaves of the same tree is likely to follow, as the
+        hardware wallet reads the inputs, outputs and maps of a psbt in order. The predicted responses
+        are computed by a fork of this interpreter, so they do not modify its state until they are used.
+
+        Parameters
+        ----------
+        executor : Executor
+            The executor of the computations, for example a `ThreadPoolExecutor` with one thread.
+        """
+
+        fork = self.fork()
+        fork.max_response_len = self.max_response_len
+        self._speculator = ResponseSpeculator(fork, executor)
+
+    def stop_speculation(self) -> None:
+        """Stops the computations started with `start_speculation`, and discards their results."""
+
+        if self._speculator is not None:
+            self._speculator.cancel()
+            self._speculator = None
+
+    def extract_queued_yields(self, hw_response: bytes) -> bytes:
+        """Removes the YIELD and PROGRESS messages queued at the beginning of a response from the hardware
+        wallet, each encoded as the command code, followed by a 1-byte length and the message; the YIELD
+        messages are added to the yielded values, and the PROGRESS messages are reported to the
+        `progress_callback`, if any.
+
+        Parameters
+        ----------
+        hw_response : bytes
+            The data content of a response sent by the hardware wallet.
+
+        Returns
+        -------
+        bytes
+            The rest of the response after the queued YIELD messages.
+        """
+
+        while len(hw_response) > 0 and hw_response[0] in (ClientCommandCode.YIELD, ClientCommandCode.PROGRESS):
+            if len(hw_response) < 2 or len(hw_response) < 2 + hw_response[1]:
+                raise RuntimeError("Invalid queued YIELD message.")
+
+            msg_len = hw_response[1]
+            msg = hw_response[2:2 + msg_len]
+            if hw_response[0] == ClientCommandCode.YIELD:
+                self.yielded.append(msg)
+            elif self.progress_callback is not None:
+                parser = ByteStreamParser(msg)
+                phase = ProgressPhase(parser.read_uint(1))
+                n_done = parser.read_varint()
+                n_total = parser.read_varint()
+                parser.assert_empty()
+                self.progress_callback(phase, n_done, n_total)
+            hw_response = hw_response[2 + msg_len:]
+
+        return hw_response
 
     def add_known_preimage(self, element: bytes) -> None:
         """Adds a preimage to the list of known preimages.
@@ -288,47 +1075,271 @@ class ClientCommandInterpreter:
 
         self.known_preimages[sha256(element)] = element
 
-    def add_known_list(self, elements: List[bytes]) -> None:
+    def add_known_wallet(self, wallet: WalletPolicy, cache: Optional[WalletDataCache] = None) -> None:
+        """Adds the data of a wallet policy that the hardware wallet requests: the Merkle tree of its keys, and the
+        preimages of its serialization and of its descriptor template (the latter is necessary for version 1 of the
+        protocol, introduced in version 2.1.0).
+
+        Parameters
+        ----------
+        wallet : WalletPolicy
+            The wallet policy.
+        cache : Optional[WalletDataCache]
+            If given, the data is taken from the cache, which only copies the references to the preimages and to the
+            Merkle tree instead of hashing them again.
+        """
+
+        if cache is None:
+            self.add_known_list([k.encode() for k in wallet.keys_info])
+            self.add_known_preimage(wallet.serialize())
+            self.add_known_preimage(wallet.descriptor_template.encode())
+        else:
+            preimages, keys_tree = cache.get(wallet)
+            self.known_preimages.update(preimages)
+            self.known_trees[keys_tree.root] = keys_tree
+
+    def add_known_list(self, elements: List[bytes]) -> MerkleTree:
         """Adds a known Merkleized list.
 
         Builds the Merkle tree of `elements`, and adds it to the Merkle trees known to the client
-        (mapped by Merkle root `mt_root`).
+        (mapped by Merkle root `mt_root`), unless a tree with the same root is already known.
         moreover, adds all the leafs (after adding the b'\0' prefix) to the list of known preimages.
 
         If `el` is one of `elements`, the client must respond with b'\0' + `el` when a GET_PREIMAGE
         client command is sent with `sha256(b'\0' + el)`.
-        Moreover, the commands GET_MERKLE_LEAF_INDEX and GET_MERKLE_LEAF_PROOF must correctly answer
-        queries relative to the Merkle whose root is `mt_root`.
+        Moreover, the commands GET_MERKLE_LEAF_INDEX, GET_MERKLE_LEAF_PROOF, GET_MERKLE_LEAF_PROOFS
+        and GET_MERKLE_LEAF_ELEMENTS must correctly answer queries relative to the Merkle whose root
+        is `mt_root`.
 
         Parameters
         ----------
         elements : List[bytes]
             A list of `bytes` corresponding to the leafs of the Merkle tree.
+
+        Returns
+        -------
+        MerkleTree
+            The Merkle tree of the list, that can be passed to `update_known_list`.
         """
 
-        for el in elements:
-            self.add_known_preimage(b"\x00" + el)
+        mt = MerkleTree(self._add_known_element(el) for el in elements)
+
+        self.known_trees.setdefault(mt.root, mt)
+        return mt
 
-        mt = MerkleTree(element_hash(el) for el in elements)
+    def _add_known_element(self, element: bytes) -> bytes:
+        # adds the preimage of the leaf of `element`, and returns the leaf hash; both are computed only the first
+        # time a given element is added, so that the repeated elements are neither hashed nor stored again
+        leaf = self._element_leaves.get(element)
+        if leaf is None:
+            preimage = b"\x00" + element
+            leaf = sha256(preimage)
+            self.known_preimages.setdefault(leaf, preimage)
+            self._element_leaves[element] = leaf
+        return leaf
+
+    def update_known_list(self, mt: MerkleTree, index: int, element: bytes) -> None:
+        """Replaces the element at position `index` of a known Merkleized list.
+
+        Only the path from the leaf to the root of `mt` is recomputed; the tree is then known to the
+        client by its new Merkle root, and `b'\0' + element` is added to the known preimages.
+
+        Parameters
+        ----------
+        mt : MerkleTree
+            The Merkle tree of the list, as returned by `add_known_list`.
+        index : int
+            The index of the element to replace.
+        element : bytes
+            The new element.
+        """
+
+        if self.known_trees.get(mt.root) is mt:
+            del self.known_trees[mt.root]
+
+        mt.set(index, self._add_known_element(element))
 
         self.known_trees[mt.root] = mt
 
-    def add_known_mapping(self, mapping: Mapping[bytes, bytes]) -> None:
+    def add_known_stream(self, tree: StreamedMerkleTree) -> None:
+        """Adds a known Merkleized list whose elements are the chunks of a stream.
+
+        The client answers the same queries as for `add_known_list` applied to the list of chunks, but the chunks
+        are read again from the stream when needed instead of being kept in memory. The preimage of a leaf is only
+        known after the leaf was returned by a GET_MERKLE_LEAF_PROOF command, which is how the hardware wallet
+        requests the elements of a Merkleized list.
+
+        Parameters
+        ----------
+        tree : StreamedMerkleTree
+            The Merkle tree of the chunks of the stream.
+        """
+
+        self.known_trees[tree.root] = tree
+        self.known_streams.append(tree)
+
+    def add_known_mapping(self, mapping: Mapping[bytes, bytes]) -> bytes:
         """Adds the Merkle trees of keys, and the Merkle tree of values (ordered by key)
         of a mapping of bytes to bytes.
 
         Adds the Merkle tree of the list of keys, and the Merkle tree of the list of corresponding
-        values, with the same semantics as the `add_known_list` applied separately to the two lists. 
+        values, with the same semantics as the `add_known_list` applied separately to the two lists.
+        Nothing is computed again for a mapping with the same items as one that was already added.
 
         Parameters
         ----------
         mapping : Mapping[bytes, bytes]
             A mapping whose keys and values are `bytes`.
+
+        Returns
+        -------
+        bytes
+            The serialized Merkleized map commitment of `mapping`, as computed by `get_merkleized_map_commitment`.
+        """
+
+        items_sorted = mapping_key(mapping)
+        commitment = self._mapping_commitments.get(items_sorted)
+        if commitment is None:
+            keys_tree = self.add_known_list([i[0] for i in items_sorted])
+            values_tree = self.add_known_list([i[1] for i in items_sorted])
+            commitment = write_varint(len(items_sorted)) + keys_tree.root + values_tree.root
+            self._mapping_commitments[items_sorted] = commitment
+        return commitment
+
+    def add_merkleized_mapping(self, preimages: Mapping[bytes, bytes], trees: List[MerkleTree]) -> None:
+        """Adds the preimages and the Merkle trees of a mapping computed by `merkleize_mapping`, which makes the
+        interpreter know the same data as `add_known_mapping`.
+
+        Parameters
+        ----------
+        preimages : Mapping[bytes, bytes]
+            The preimages of the leaves of the trees, keyed by their hash.
+        trees : List[MerkleTree]
+            The Merkle trees of the keys and of the values of the mapping.
         """
 
-        items_sorted = list(sorted(mapping.items()))
+        for leaf, preimage in preimages.items():
+            self.known_preimages.setdefault(leaf, preimage)
+        for mt in trees:
+            self.known_trees.setdefault(mt.root, mt)
+
+
+def mapping_key(mapping: Mapping[bytes, bytes]) -> Tuple[Tuple[bytes, bytes], ...]:
+    """Returns the items of `mapping` sorted by key, which identify the mapping and its Merkleized map commitment."""
+
+    return tuple(sorted(mapping.items()))
+
+
+def merkleize_mapping(mapping: Mapping[bytes, bytes]) -> Tuple[bytes, Dict[bytes, bytes], List[MerkleTree]]:
+    """Computes the data that `ClientCommandInterpreter.add_known_mapping` adds for `mapping`, without an
+    interpreter, so that several mappings can be hashed concurrently (for example with `Executor.map`); the result
+    is then added with `ClientCommandInterpreter.add_merkleized_mapping`.
+
+    Returns
+    -------
+    Tuple[bytes, Dict[bytes, bytes], List[MerkleTree]]
+        The serialized Merkleized map commitment of `mapping`, the preimages of the leaves keyed by their hash, and
+        the Merkle trees of the keys and of the values.
+    """
 
-        keys = [i[0] for i in items_sorted]
-        values = [i[1] for i in items_sorted]
-        self.add_known_list(keys)
-        self.add_known_list(values)
+    items_sorted = mapping_key(mapping)
+
+    preimages: Dict[bytes, bytes] = {}
+    trees: List[MerkleTree] = []
+    for elements in ([i[0] for i in items_sorted], [i[1] for i in items_sorted]):
+        leaves = []
+        for el in elements:
+            leaf = element_hash(el)
+            preimages[leaf] = b"\x00" + el
+            leaves.append(leaf)
+        trees.append(MerkleTree(leaves))
+
+    commitment = write_varint(len(mapping)) + trees[0].root + trees[1].root
+    return commitment, preimages, trees
+
+
+class ResponseSpeculator:
+    """Computes in advance the responses to the requests that the hardware wallet is likely to send
+    next. See `ClientCommandInterpreter.start_speculation`.
+    """
+
+    # maximum number of speculated responses kept at the same time; one per tree being read is enough
+    MAX_PENDING = 8
+
+    def __init__(self, interpreter: ClientCommandInterpreter, executor: Executor):
+        self.interpreter = interpreter
+        self.executor = executor
+        self.pending: Dict[bytes, Future] = {}
+
+    def take(self, request: bytes) -> Optional[Tuple[bytes, ElementQueue]]:
+        """Returns the speculated response to `request` and the elements to add to the queue for
+        GET_MORE_ELEMENTS, or None if the request was not predicted."""
+
+        future = self.pending.pop(request, None)
+        if future is None:
+            return None
+        try:
+            return future.result()
+        except Exception:
+            # the request is executed again, and fails with the same error
+            return None
+
+    def speculate(self, request: bytes) -> None:
+        """Starts the computation of the response to the request likely to follow `request`."""
+
+        predicted = self._predict_next(request)
+        if predicted is None or predicted in self.pending:
+            return
+
+        if len(self.pending) >= self.MAX_PENDING:
+            oldest = next(iter(self.pending))
+            self.pending.pop(oldest).cancel()
+
+        self.pending[predicted] = self.executor.submit(self._compute, predicted)
+
+    def cancel(self) -> None:
+        for future in self.pending.values():
+            future.cancel()
+        self.pending.clear()
+
+    def _compute(self, request: bytes) -> Tuple[bytes, ElementQueue]:
+        # the computations are run one at a time by the executor, so the fork and its queue are not shared
+        response = self.interpreter.execute(request)
+        return response, self.interpreter._queue.take()
+
+    def _predict_next(self, request: bytes) -> Optional[bytes]:
+        # only the requests on the trees of lists kept in memory are predicted: the trees of streams are
+        # read sequentially, and can not be read from another thread
+        if len(request) < 33 or request[0] not in [ClientCommandCode.GET_MERKLE_LEAF_PROOF,
+                                                   ClientCommandCode.GET_MERKLE_LEAF_ELEMENTS]:
+            return None
+
+        req = ByteStreamParser(request[1:])
+        try:
+            root = req.read_bytes(32)
+            if not isinstance(self.interpreter.known_trees.get(root), MerkleTree):
+                return None
+            tree_size = req.read_varint()
+
+            if request[0] == ClientCommandCode.GET_MERKLE_LEAF_PROOF:
+                leaf_index = req.read_varint()
+                req.assert_empty()
+                if leaf_index + 1 >= tree_size:
+                    return None
+                return b"".join([request[:33], write_varint(tree_size), write_varint(leaf_index + 1)])
+
+            # GET_MERKLE_LEAF_ELEMENTS: the next consecutive leaves, in the same number
+            n_leaves = req.read_uint(1)
+            leaf_indexes = [req.read_varint() for _ in range(n_leaves)]
+            req.assert_empty()
+        except Exception:
+            return None
+
+        if n_leaves == 0 or leaf_indexes != list(range(leaf_indexes[0], leaf_indexes[0] + n_leaves)):
+            return None
+        first = leaf_indexes[-1] + 1
+        n_next = min(n_leaves, tree_size - first)
+        if n_next <= 0:
+            return None
+        return b"".join([request[:33], write_varint(tree_size), n_next.to_bytes(1, byteorder="big"),
+                         *(write_varint(i) for i in range(first, first + n_next))])
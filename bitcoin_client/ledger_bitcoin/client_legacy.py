@@ -10,10 +10,10 @@ import struct
 import re
 import base64
 
-from .client_base import PartialSignature
+from .client_base import PartialSignature, SignPsbtProgress
 from .client import Client, TransportClient
 
-from typing import List, Tuple, Optional, Union
+from typing import BinaryIO, List, Tuple, Optional, Sequence, Union
 
 from .common import AddressType, Chain, hash160
 from .key import ExtendedKey, parse_path
@@ -156,8 +156,13 @@ class LegacyClient(Client):
         assert isinstance(output["address"], str)
         return output['address'][12:-2]  # HACK: A bug in getWalletPublicKey results in the address being returned as the string "bytearray(b'<address>')". This extracts the actual address to work around this.
 
-    def sign_psbt(self, psbt: Union[PSBT, bytes, str], wallet: WalletPolicy, wallet_hmac: Optional[bytes]) -> List[Tuple[int, PartialSignature]]:
-        if wallet_hmac is not None or wallet.n_keys != 1:
+    def sign_psbt(self, psbt: Union[PSBT, bytes, str], wallet: WalletPolicy, wallet_hmac: Optional[bytes],
+                  additional_wallets: Sequence[Tuple[WalletPolicy, Optional[bytes]]] = (),
+                  progress: Optional[SignPsbtProgress] = None) -> List[Tuple[int, PartialSignature]]:
+        if progress is not None:
+            raise NotImplementedError("Resumable signing is not supported by this version of the app")
+
+        if wallet_hmac is not None or wallet.n_keys != 1 or len(additional_wallets) > 0:
             raise NotImplementedError("Policy wallets are only supported from version 2.0.0. Please update your Ledger hardware wallet")
 
         if not isinstance(wallet, WalletPolicy):
@@ -331,13 +336,16 @@ class LegacyClient(Client):
         master_pubkey = self.app.getWalletPublicKey("")
         return hash160(compress_public_key(master_pubkey["publicKey"]))[:4]
 
-    def sign_message(self, message: Union[str, bytes], keypath: str) -> str:
+    def sign_message(self, message: Union[str, bytes, BinaryIO], keypath: str) -> str:
         # copied verbatim from HWI
 
         if not check_keypath(keypath):
             raise ValueError("Invalid keypath")
         if isinstance(message, str):
             message = bytearray(message, 'utf-8')
+        elif not isinstance(message, (bytes, bytearray)):
+            # the legacy protocol needs the whole message
+            message = bytearray(message.read())
         else:
             message = bytearray(message)
         keypath = keypath[2:]
@@ -1,13 +1,42 @@
 import enum
-from typing import List, Tuple, Mapping, Union, Iterator, Optional
+from typing import List, Tuple, Mapping, Sequence, Union, Iterator, Optional
 
-from .common import bip32_path_from_string, write_varint
-from .merkle import get_merkleized_map_commitment, MerkleTree, element_hash
+from .common import bip32_path_from_string, sha256, write_varint
+from .merkle import get_merkleized_map_commitment, MerkleTree, StreamedMerkleTree, element_hash
 from .wallet import WalletPolicy
 
 # p2 encodes the protocol version implemented
 CURRENT_PROTOCOL_VERSION = 1
 
+# version 2 of the protocol only changes SIGN_PSBT, which queues the YIELD messages in the responses
+QUEUED_YIELDS_PROTOCOL_VERSION = 2
+
+# version 3 of the protocol only changes SIGN_MESSAGE, which commits to the hash of the message
+HASHED_MESSAGE_PROTOCOL_VERSION = 3
+
+# version 4 of the protocol lets the hardware wallet reference the hashes already exchanged in the current command,
+# with the GET_MERKLE_LEAF_PROOF_REFS client command
+HASH_REFS_PROTOCOL_VERSION = 4
+
+# version 5 of the protocol lets the hardware wallet announce the values it reads next, with the ANNOUNCE_ACCESS_PLAN
+# client command
+ACCESS_PLAN_PROTOCOL_VERSION = 5
+
+# version 6 of the protocol lets the hardware wallet stream all the leaves of the small Merkle trees without proofs,
+# with the STREAM_MERKLE_TREE client command
+TREE_STREAM_PROTOCOL_VERSION = 6
+
+# version 7 of the protocol lets the hardware wallet report the progress of the phases of SIGN_PSBT, with PROGRESS
+# messages queued in the responses as the YIELD messages
+PROGRESS_PROTOCOL_VERSION = 7
+
+def serialize_additional_wallets(additional_wallets: Sequence[Tuple[WalletPolicy, Optional[bytes]]]) -> bytes:
+    """Returns the concatenation of the id and the hmac of each of the additional wallets of SIGN_PSBT, whose hash
+    is sent in the request."""
+    return b''.join(wallet.id + (wallet_hmac if wallet_hmac is not None else b'\0' * 32)
+                    for wallet, wallet_hmac in additional_wallets)
+
+
 def chunkify(data: bytes, chunk_len: int) -> Iterator[Tuple[bool, bytes]]:
     size: int = len(data)
 
@@ -36,7 +65,42 @@ class BitcoinInsType(enum.IntEnum):
     GET_WALLET_ADDRESS = 0x03
     SIGN_PSBT = 0x04
     GET_MASTER_FINGERPRINT = 0x05
+    OPEN_WALLET_SESSION = 0x06
+    GET_WALLET_ADDRESSES = 0x07
+    GET_EXTENDED_PUBKEYS = 0x08
+    GET_APP_FEATURES = 0x09
     SIGN_MESSAGE = 0x10
+    SIGN_MESSAGES = 0x11
+    REGISTER_PAYEE_LIST = 0x12
+    SIGN_PSBT_BATCH = 0x13
+
+class AppFeature(enum.IntFlag):
+    """Bits of the feature bitmap returned by GET_APP_FEATURES."""
+    MERKLE_LEAF_PROOFS = 1 << 0    # the app uses the GET_MERKLE_LEAF_PROOFS client command
+    GET_WALLET_ADDRESSES = 1 << 1  # GET_WALLET_ADDRESSES is supported
+    GET_EXTENDED_PUBKEYS = 1 << 2  # GET_EXTENDED_PUBKEYS is supported
+    WALLET_SESSIONS = 1 << 3       # OPEN_WALLET_SESSION is supported
+    QUEUED_YIELDS = 1 << 4         # SIGN_PSBT supports version 2 of the protocol
+    MERKLE_LEAF_ELEMENTS = 1 << 5  # the app uses the GET_MERKLE_LEAF_ELEMENTS client command
+    EXTENDED_APDUS = 1 << 6        # CONTINUE accepts extended-length APDUs
+    HASHED_MESSAGES = 1 << 7       # SIGN_MESSAGE supports version 3 of the protocol
+    SIGN_MESSAGES = 1 << 8         # SIGN_MESSAGES is supported
+    PAYEE_LISTS = 1 << 9           # REGISTER_PAYEE_LIST is supported
+    OFFLOADED_RECORDS = 1 << 10    # SIGN_PSBT supports more than 512 inputs
+    MULTI_WALLET_SIGNING = 1 << 11  # SIGN_PSBT accepts additional wallet policies
+    INPUT_SUBSETS = 1 << 12         # SIGN_PSBT can sign a subset of the inputs
+    RESUMABLE_SIGNING = 1 << 13     # SIGN_PSBT sessions can be resumed
+    COMPILED_POLICIES = 1 << 14     # REGISTER_WALLET returns the compiled policy
+    HASH_REFS = 1 << 15             # version 4 of the protocol references hashes
+    ACCESS_PLANS = 1 << 16          # version 5 of the protocol announces access plans
+    PSBT_BATCHES = 1 << 17          # SIGN_PSBT_BATCH is supported
+    TREE_STREAMS = 1 << 18          # version 6 of the protocol streams Merkle trees
+    PROGRESS_EVENTS = 1 << 19       # version 7 of the protocol reports the progress
+    WALLET_REGISTRY = 1 << 20       # REGISTER_WALLET can store the wallet on the device
+
+# Maximum length of the data of a CONTINUE sent as an extended-length APDU, if the app has the
+# EXTENDED_APDUS feature
+MAX_EXTENDED_APDU_DATA_LEN = 512
 
 class FrameworkInsType(enum.IntEnum):
     CONTINUE_INTERRUPTED = 0x01
@@ -96,13 +160,43 @@ class BitcoinCommandBuilder:
             cdata=cdata,
         )
 
-    def register_wallet(self, wallet: WalletPolicy):
+    def get_extended_pubkeys(self, bip32_paths: List[str]):
+        paths: List[List[bytes]] = [bip32_path_from_string(path) for path in bip32_paths]
+
+        cdata: bytes = b"".join([
+            len(paths).to_bytes(1, byteorder="big"),
+            *[len(path).to_bytes(1, byteorder="big") + b"".join(path) for path in paths]
+        ])
+
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.GET_EXTENDED_PUBKEYS,
+            cdata=cdata,
+        )
+
+    def register_wallet(self, wallet: WalletPolicy, compiled_policy: bool = False, store: bool = False):
         wallet_bytes = wallet.serialize()
 
+        cdata = write_varint(len(wallet_bytes)) + wallet_bytes
+        # the flags of the request: the compiled policy is returned with YIELD, and the wallet is stored in the
+        # registry of the device
+        flags = (0x01 if compiled_policy else 0) | (0x02 if store else 0)
+        if flags != 0:
+            cdata += bytes([flags])
+
         return self.serialize(
             cla=self.CLA_BITCOIN,
             ins=BitcoinInsType.REGISTER_WALLET,
-            cdata=write_varint(len(wallet_bytes)) + wallet_bytes,
+            cdata=cdata,
+        )
+
+    def register_payee_list(self, scripts: List[bytes]):
+        cdata = write_varint(len(scripts)) + MerkleTree(element_hash(s) for s in scripts).root
+
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.REGISTER_PAYEE_LIST,
+            cdata=cdata,
         )
 
     def get_wallet_address(
@@ -129,6 +223,30 @@ class BitcoinCommandBuilder:
             cdata=cdata,
         )
 
+    def get_wallet_addresses(
+        self,
+        wallet: WalletPolicy,
+        wallet_hmac: Optional[bytes],
+        change: bool,
+        first_address_index: int,
+        n_addresses: int,
+    ):
+        cdata: bytes = b"".join(
+            [
+                wallet.id,                                              # 32 bytes
+                wallet_hmac if wallet_hmac is not None else b'\0' * 32, # 32 bytes
+                b"\1" if change else b"\0",                             # 1 byte
+                first_address_index.to_bytes(4, byteorder="big"),       # 4 bytes
+                n_addresses.to_bytes(4, byteorder="big"),               # 4 bytes
+            ]
+        )
+
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.GET_WALLET_ADDRESSES,
+            cdata=cdata,
+        )
+
     def sign_psbt(
         self,
         global_mapping: Mapping[bytes, bytes],
@@ -136,32 +254,91 @@ class BitcoinCommandBuilder:
         output_mappings: List[Mapping[bytes, bytes]],
         wallet: WalletPolicy,
         wallet_hmac: Optional[bytes],
+        p2: int = CURRENT_PROTOCOL_VERSION,
+    ):
+
+        return self.sign_psbt_from_commitments(
+            get_merkleized_map_commitment(global_mapping),
+            len(input_mappings),
+            MerkleTree(
+                [
+                    element_hash(get_merkleized_map_commitment(m_in))
+                    for m_in in input_mappings
+                ]
+            ).root,
+            len(output_mappings),
+            MerkleTree(
+                [
+                    element_hash(get_merkleized_map_commitment(m_out))
+                    for m_out in output_mappings
+                ]
+            ).root,
+            wallet,
+            wallet_hmac,
+            p2,
+        )
+
+    def sign_psbt_from_commitments(
+        self,
+        global_map_commitment: bytes,
+        n_inputs: int,
+        input_commitments_root: bytes,
+        n_outputs: int,
+        output_commitments_root: bytes,
+        wallet: WalletPolicy,
+        wallet_hmac: Optional[bytes],
+        p2: int = CURRENT_PROTOCOL_VERSION,
+        additional_wallets: Sequence[Tuple[WalletPolicy, Optional[bytes]]] = (),
+        resume: Optional[Tuple[int, bytes]] = None,
     ):
 
         cdata = bytearray()
-        cdata += get_merkleized_map_commitment(global_mapping)
+        cdata += global_map_commitment
 
-        cdata += write_varint(len(input_mappings))
-        cdata += MerkleTree(
-            [
-                element_hash(get_merkleized_map_commitment(m_in))
-                for m_in in input_mappings
-            ]
-        ).root
+        cdata += write_varint(n_inputs)
+        cdata += input_commitments_root
 
-        cdata += write_varint(len(output_mappings))
-        cdata += MerkleTree(
-            [
-                element_hash(get_merkleized_map_commitment(m_out))
-                for m_out in output_mappings
-            ]
-        ).root
+        cdata += write_varint(n_outputs)
+        cdata += output_commitments_root
+
+        cdata += wallet.id
+        cdata += wallet_hmac if wallet_hmac is not None else b'\0' * 32
+
+        if len(additional_wallets) > 0:
+            cdata += write_varint(len(additional_wallets))
+            cdata += sha256(serialize_additional_wallets(additional_wallets))
+        elif resume is not None:
+            # the fields are positional
+            cdata += write_varint(0) + b'\0' * 32
+
+        if resume is not None:
+            n_received_signatures, resume_token = resume
+            if len(resume_token) != 16:
+                raise ValueError("The resume token must be 16 bytes long")
+            cdata += write_varint(n_received_signatures)
+            cdata += resume_token
+
+        return self.serialize(
+            cla=self.CLA_BITCOIN, ins=BitcoinInsType.SIGN_PSBT, p2=p2, cdata=bytes(cdata)
+        )
+
+    def sign_psbt_batch(
+        self,
+        n_psbts: int,
+        psbt_commitments_root: bytes,
+        wallet: WalletPolicy,
+        wallet_hmac: Optional[bytes],
+        p2: int = CURRENT_PROTOCOL_VERSION,
+    ):
+        cdata = bytearray()
+        cdata += write_varint(n_psbts)
+        cdata += psbt_commitments_root
 
         cdata += wallet.id
         cdata += wallet_hmac if wallet_hmac is not None else b'\0' * 32
 
         return self.serialize(
-            cla=self.CLA_BITCOIN, ins=BitcoinInsType.SIGN_PSBT, cdata=bytes(cdata)
+            cla=self.CLA_BITCOIN, ins=BitcoinInsType.SIGN_PSBT_BATCH, p2=p2, cdata=bytes(cdata)
         )
 
     def get_master_fingerprint(self):
@@ -170,25 +347,72 @@ class BitcoinCommandBuilder:
             ins=BitcoinInsType.GET_MASTER_FINGERPRINT
         )
 
-    def sign_message(self, message: bytes, bip32_path: str):
+    def get_app_features(self):
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.GET_APP_FEATURES
+        )
+
+    def open_wallet_session(self, wallet: WalletPolicy, wallet_hmac: bytes,
+                            compiled_policy: Optional[bytes] = None):
+        cdata = wallet.id + wallet_hmac
+        if compiled_policy is not None:
+            cdata += sha256(compiled_policy)
+
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.OPEN_WALLET_SESSION,
+            cdata=cdata,
+        )
+
+    def sign_message(self, message: Union[bytes, StreamedMerkleTree], bip32_path: str,
+                     p2: int = CURRENT_PROTOCOL_VERSION):
         cdata = bytearray()
 
         bip32_path: List[bytes] = bip32_path_from_string(bip32_path)
 
-        # split message in 64-byte chunks (last chunk can be smaller)
-        n_chunks = (len(message) + 63) // 64
-        chunks = [message[64 * i: 64 * i + 64] for i in range(n_chunks)]
+        if isinstance(message, StreamedMerkleTree):
+            message_length = message.stream_length
+            message_root = message.root
+        elif p2 >= HASHED_MESSAGE_PROTOCOL_VERSION:
+            # the message is committed to with its hash, and sent as a single preimage
+            message_length = len(message)
+            message_root = element_hash(message)
+        else:
+            # split message in 64-byte chunks (last chunk can be smaller)
+            n_chunks = (len(message) + 63) // 64
+            chunks = [message[64 * i: 64 * i + 64] for i in range(n_chunks)]
+
+            message_length = len(message)
+            message_root = MerkleTree(element_hash(c) for c in chunks).root
 
         cdata += len(bip32_path).to_bytes(1, byteorder="big")
         cdata += b''.join(bip32_path)
 
-        cdata += write_varint(len(message))
+        cdata += write_varint(message_length)
 
-        cdata += MerkleTree(element_hash(c) for c in chunks).root
+        cdata += message_root
 
         return self.serialize(
             cla=self.CLA_BITCOIN,
             ins=BitcoinInsType.SIGN_MESSAGE,
+            p2=p2,
+            cdata=bytes(cdata)
+        )
+
+    def sign_messages(self, entries: List[bytes], account_path: str, p2: int = CURRENT_PROTOCOL_VERSION):
+        account_path: List[bytes] = bip32_path_from_string(account_path)
+
+        cdata = bytearray()
+        cdata += len(account_path).to_bytes(1, byteorder="big")
+        cdata += b''.join(account_path)
+        cdata += write_varint(len(entries))
+        cdata += MerkleTree(element_hash(e) for e in entries).root
+
+        return self.serialize(
+            cla=self.CLA_BITCOIN,
+            ins=BitcoinInsType.SIGN_MESSAGES,
+            p2=p2,
             cdata=bytes(cdata)
         )
 
@@ -10,12 +10,13 @@ Output Script Descriptors
 HWI has a more limited implementation of descriptors.
 See `Bitcoin Core's documentation <https://github.com/bitcoin/bitcoin/blob/master/doc/descriptors.md>`_ for more details on descriptors.
 
-This implementation only supports ``sh()``, ``wsh()``, ``pkh()``, ``wpkh()``, ``multi()``, and ``sortedmulti()`` descriptors.
-Descriptors can be parsed, however the actual scripts are not generated.
+This implementation only supports ``sh()``, ``wsh()``, ``pkh()``, ``wpkh()``, ``multi()``, ``sortedmulti()``, and ``tr()``
+descriptors, the latter only with ``pk()`` leaves. The output scripts are generated by ``Descriptor.expand``.
 """
 
 
-from .key import ExtendedKey, KeyOriginInfo, parse_path
+from .key import ExtendedKey, KeyOriginInfo, parse_path, tagged_hash, taproot_tweak_pubkey
+from ._serialize import ser_string
 from .common import hash160, sha256
 
 from binascii import unhexlify
@@ -127,6 +128,11 @@ class PubkeyProvider(object):
             # Not hex, maybe xpub
             self.extkey = ExtendedKey.deserialize(self.pubkey)
 
+        # The derivations from extkey are cached, as deriv_path is not expected to change: for a ranged path, the node
+        # before the final wildcard, so that each position only derives its last step; otherwise, the derived pubkey.
+        self._range_parent: Optional[ExtendedKey] = None
+        self._fixed_pubkey: Optional[bytes] = None
+
     @classmethod
     def parse(cls, s: str) -> 'PubkeyProvider':
         """
@@ -164,17 +170,18 @@ class PubkeyProvider(object):
         return s
 
     def get_pubkey_bytes(self, pos: int) -> bytes:
-        if self.extkey is not None:
-            if self.deriv_path is not None:
-                path_str = self.deriv_path[1:]
-                if path_str[-1] == "*":
-                    path_str = path_str[-1] + str(pos)
-                path = parse_path(path_str)
-                child_key = self.extkey.derive_pub_path(path)
-                return child_key.pubkey
-            else:
-                return self.extkey.pubkey
-        return unhexlify(self.pubkey)
+        if self.extkey is None:
+            return unhexlify(self.pubkey)
+        if self.deriv_path is None:
+            return self.extkey.pubkey
+        if self.deriv_path[-1] == "*":
+            if self._range_parent is None:
+                # "/a/b/*" => "a/b"
+                self._range_parent = self.extkey.derive_pub_path(parse_path(self.deriv_path[1:-2]))
+            return self._range_parent.derive_child_pubkey(pos)
+        if self._fixed_pubkey is None:
+            self._fixed_pubkey = self.extkey.derive_pub_path(parse_path(self.deriv_path[1:])).pubkey
+        return self._fixed_pubkey
 
     def get_full_derivation_path(self, pos: int) -> str:
         """
@@ -432,6 +439,30 @@ class TRDescriptor(Descriptor):
         r += ")"
         return r
 
+    def _leaf_hash(self, leaf: 'Descriptor', pos: int) -> bytes:
+        if not isinstance(leaf, PKDescriptor):
+            raise NotImplementedError("Only pk() leaves are supported in tr()")
+        script = b"\x20" + leaf.pubkeys[0].get_pubkey_bytes(pos)[1:] + b"\xac"
+        return tagged_hash("TapLeaf", b"\xc0" + ser_string(script))
+
+    def expand(self, pos: int) -> "ExpandedScripts":
+        # The leaves are in depth-first order, with their depths: the root of the tree is computed by combining the
+        # last two nodes on the stack, as long as they are at the same depth.
+        stack: List[Tuple[int, bytes]] = []
+        for leaf, depth in zip(self.subdescriptors, self.depths):
+            node = self._leaf_hash(leaf, pos)
+            while len(stack) > 0 and stack[-1][0] == depth:
+                _, left = stack.pop()
+                node = tagged_hash("TapBranch", min(left, node) + max(left, node))
+                depth -= 1
+            stack.append((depth, node))
+        assert len(stack) <= 1
+        merkle_root = stack[0][1] if len(stack) > 0 else b""
+
+        internal_key = self.pubkeys[0].get_pubkey_bytes(pos)[1:]
+        _, output_key = taproot_tweak_pubkey(internal_key, merkle_root)
+        return ExpandedScripts(b"\x51\x20" + output_key, None, None)
+
 def _get_func_expr(s: str) -> Tuple[str, str]:
     """
     Get the function name and then the expression inside
@@ -473,8 +504,8 @@ def _get_expr(s: str) -> Tuple[str, str]:
         elif level > 0 and c in [")", "}"]:
             level -= 1
         elif level == 0 and c in [")", "}", ","]:
-            break
-    return s[0:i], s[i:]
+            return s[0:i], s[i:]
+    return s, ""
 
 def parse_pubkey(expr: str) -> Tuple['PubkeyProvider', str]:
     """
@@ -111,17 +111,66 @@ def lift_x(x: int) -> 'Point':
 
     return (x, p - y if y & 1 else y)
 
+def _py_pubkey_from_secret(secret: bytes) -> bytes:
+    return point_to_bytes(point_mul(G, int_from_bytes(secret)))
+
+
+def _py_pubkey_tweak_add(pubkey: bytes, tweak: bytes) -> bytes:
+    return point_to_bytes(point_add(point_mul(G, int_from_bytes(tweak)), bytes_to_point(pubkey)))
+
+
+# The scalar multiplications of the key derivations use libsecp256k1, which is orders of magnitude
+# faster than the Python implementation above, if one of its bindings is installed (coincurve, that
+# is installed with the extra dependency `ledger_bitcoin[secp256k1]`, or python-secp256k1);
+# otherwise, the Python implementation is used. SECP256K1_BACKEND is the name of the one in use.
+# pubkey_from_secret returns the compressed public key of a 32-byte secret key; pubkey_tweak_add
+# returns the compressed public key pubkey + tweak*G. Both raise ValueError if the result is the
+# point at infinity.
+try:
+    import coincurve
+
+    SECP256K1_BACKEND = "coincurve"
+
+    def pubkey_from_secret(secret: bytes) -> bytes:
+        return coincurve.PublicKey.from_secret(secret).format()
+
+    def pubkey_tweak_add(pubkey: bytes, tweak: bytes) -> bytes:
+        return coincurve.PublicKey(pubkey).add(tweak).format()
+except ImportError:
+    try:
+        import secp256k1
+
+        SECP256K1_BACKEND = "secp256k1"
+
+        def pubkey_from_secret(secret: bytes) -> bytes:
+            try:
+                return secp256k1.PrivateKey(secret).pubkey.serialize()
+            except Exception as e:
+                raise ValueError(str(e))
+
+        def pubkey_tweak_add(pubkey: bytes, tweak: bytes) -> bytes:
+            try:
+                return secp256k1.PublicKey(pubkey, raw=True).tweak_add(tweak).serialize()
+            except Exception as e:
+                raise ValueError(str(e))
+    except ImportError:
+        SECP256K1_BACKEND = "python"
+        pubkey_from_secret = _py_pubkey_from_secret
+        pubkey_tweak_add = _py_pubkey_tweak_add
+
+
 def tagged_hash(tag: str, data: bytes) -> bytes:
     hashtag = hashlib.sha256(tag.encode()).digest()
     return hashlib.sha256(hashtag + hashtag + data).digest()
 
 
 def taproot_tweak_pubkey(pubkey: bytes, h: bytes) -> Tuple[int, bytes]:
-    t = int_from_bytes(tagged_hash("TapTweak", pubkey + h))
-    if t >= p:
+    t = tagged_hash("TapTweak", pubkey + h)
+    if int_from_bytes(t) >= n:
         raise ValueError
-    Q = point_add(lift_x(int_from_bytes(pubkey)), point_mul(G, t))
-    return 0 if Q[1] & 1 == 0 else 1, Q[0].to_bytes(32, byteorder="big")
+    # lift_x(pubkey) is the point with x-coordinate pubkey and an even y-coordinate
+    Q = pubkey_tweak_add(b'\x02' + pubkey, t)
+    return Q[0] & 1, Q[1:]
 
 
 def get_taproot_output_key(derived_key: bytes) -> bytes:
@@ -273,17 +322,15 @@ class ExtendedKey(object):
             return None
 
         privkey = k_int.to_bytes(32, byteorder="big")
-        pubkey = point_to_bytes(point_mul(G, k_int))
+        pubkey = pubkey_from_secret(privkey)
 
         chaincode = Ir
         fingerprint = hash160(self.pubkey)[0:4]
         return ExtendedKey(ExtendedKey.TESTNET_PRIVATE if self.is_testnet else ExtendedKey.MAINNET_PRIVATE, self.depth + 1, fingerprint, i, chaincode, privkey, pubkey)
 
-    def derive_pub(self, i: int) -> 'ExtendedKey':
+    def _ckd_pub(self, i: int) -> Tuple[bytes, bytes]:
         """
-        Derive the public key at the given child index.
-
-        :param i: The child index of the pubkey to derive
+        Returns the public key and the chaincode of the child at the given index.
         """
         if is_hardened(i):
             raise ValueError("Index cannot be larger than 2^31")
@@ -297,15 +344,30 @@ class ExtendedKey(object):
         Ir = Ihmac[32:]
 
         # Construct curve point Il*G+K
-        Il_int = int(binascii.hexlify(Il), 16)
-        child_pubkey = point_add(point_mul(G, Il_int), bytes_to_point(self.pubkey))
+        return pubkey_tweak_add(self.pubkey, Il), Ir
+
+    def derive_pub(self, i: int) -> 'ExtendedKey':
+        """
+        Derive the public key at the given child index.
+
+        :param i: The child index of the pubkey to derive
+        """
+        pubkey, chaincode = self._ckd_pub(i)
 
         # Construct and return a new BIP32Key
-        pubkey = point_to_bytes(child_pubkey)
-        chaincode = Ir
         fingerprint = hash160(self.pubkey)[0:4]
         return ExtendedKey(ExtendedKey.TESTNET_PUBLIC if self.is_testnet else ExtendedKey.MAINNET_PUBLIC, self.depth + 1, fingerprint, i, chaincode, None, pubkey)
 
+    def derive_child_pubkey(self, i: int) -> bytes:
+        """
+        Derive the public key at the given child index, without building its extended key: unlike
+        derive_pub, the fingerprint of this key is not computed. This is the cheap last step for the
+        leaves of a derivation, like the addresses derived from the same change node.
+
+        :param i: The child index of the pubkey to derive
+        """
+        return self._ckd_pub(i)[0]
+
     def derive_priv_path(self, path: Sequence[int]) -> 'ExtendedKey':
         """
         Derive the private key at the given path
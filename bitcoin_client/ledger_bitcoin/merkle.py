@@ -1,4 +1,8 @@
-from typing import List, Iterable, Mapping
+from bisect import bisect_left, insort
+from typing import BinaryIO, Dict, List, Iterable, Iterator, Mapping, Optional, Tuple
+
+import hashlib
+import io
 
 from .common import write_varint, sha256
 
@@ -63,53 +67,6 @@ def combine_hashes(left: bytes, right: bytes) -> bytes:
     return sha256(b'\x01' + left + right)
 
 
-# root is the only node with parent == None
-# leaves have left == right == None
-class Node:
-    def __init__(self, left, right, parent, value: bytes):
-        self.left = left
-        self.right = right
-        self.parent = parent
-        self.value = value
-
-    def recompute_value(self):
-        assert self.left is not None
-        assert self.right is not None
-        self.value = combine_hashes(self.left.value, self.right.value)
-
-    def sibling(self):
-        if self.parent is None:
-            raise IndexError("The root does not have a sibling.")
-
-        if self.parent.left == self:
-            return self.parent.right
-        elif self.parent.right == self:
-            return self.parent.left
-        else:
-            raise IndexError("Invalid state: not a child of his parent.")
-
-
-def make_tree(leaves: List[Node], begin: int, size: int) -> Node:
-    """Given a list of nodes, builds the left-complete Merkle tree on top of it.
-    The nodes in `leaves` are modified by setting their `parent` field appropriately.
-    It returns the root of the newly built tree.
-    """
-
-    if size == 0:
-        return []
-    if size == 1:
-        return leaves[begin]
-
-    lchild_size = largest_power_of_2_less_than(size)
-
-    lchild = make_tree(leaves, begin, lchild_size)
-    rchild = make_tree(leaves, begin + lchild_size, size - lchild_size)
-    root = Node(lchild, rchild, None, None)
-    root.recompute_value()
-    lchild.parent = rchild.parent = root
-    return root
-
-
 class MerkleTree:
     """
     Maintains a dynamic vector of values and the Merkle tree built on top of it. The elements of the vector are stored
@@ -125,30 +82,75 @@ class MerkleTree:
     - There are always n - 1 internal nodes; all the internal nodes have exactly two children.
     - If a subtree has n > 1 leaves, then the left subchild is a complete subtree with p leaves, where p is the largest
       power of 2 smaller than n.
+
+    The tree is stored level by level, each level as a flat bytearray of 32-byte values. The j-th node of level k
+    covers the leaves with indexes in [j * 2^k, (j + 1) * 2^k); if it only has a left child (which happens at most
+    once per level, for the last node), then it is not an actual node of the tree above, and it just holds a copy
+    of the value of its left child. Level 0 contains the leaves, and the last level only contains the root.
+
+    The indexes of the leaves are also kept in a dictionary keyed by the leaf value, so that `leaf_index` costs O(1).
     """
 
     def __init__(self, elements: Iterable[bytes] = []):
-        self.leaves = [Node(None, None, None, el) for el in elements]
-        n_elements = len(self.leaves)
-        if n_elements > 0:
-            self.root_node = make_tree(self.leaves, 0, n_elements)
-            self.depth = ceil_lg(n_elements)
-        else:
-            self.root_node = None
-            self.depth = None
+        leaves = bytearray()
+        # indexes of the leaves with each value, in increasing order
+        self.leaf_indexes: Dict[bytes, List[int]] = {}
+        for index, el in enumerate(elements):
+            if len(el) != 32:
+                raise ValueError("Inserted elements must be exactly 32 bytes long")
+            leaves += el
+            self.leaf_indexes.setdefault(bytes(el), []).append(index)
+
+        self.levels: List[bytearray] = [leaves]
+
+        # build the tree bottom-up
+        level = leaves
+        while len(level) > 32:
+            parent_level = bytearray()
+            for pos in range(0, len(level) - 32, 64):
+                parent_level += hashlib.sha256(b'\x01' + level[pos:pos + 64]).digest()
+            if len(level) % 64 != 0:
+                parent_level += level[-32:]
+            self.levels.append(parent_level)
+            level = parent_level
 
     def __len__(self) -> int:
         """Return the total number of leaves in the tree."""
-        return len(self.leaves)
+        return len(self.levels[0]) // 32
+
+    @property
+    def depth(self) -> Optional[int]:
+        """Return the depth of the tree, or None if the tree is empty."""
+        return None if len(self) == 0 else len(self.levels) - 1
 
     @property
     def root(self) -> bytes:
         """Return the Merkle root, or None if the tree is empty."""
-        return NIL if self.root_node is None else self.root_node.value
+        return NIL if len(self) == 0 else bytes(self.levels[-1])
 
     def copy(self):
         """Return an identical copy of this Merkle tree."""
-        return MerkleTree([leaf.value for leaf in self.leaves])
+        result = MerkleTree()
+        result.levels = [bytearray(level) for level in self.levels]
+        result.leaf_indexes = {value: list(indexes) for value, indexes in self.leaf_indexes.items()}
+        return result
+
+    def _get_node(self, level: int, j: int) -> bytes:
+        return bytes(self.levels[level][32 * j:32 * (j + 1)])
+
+    def _fix_up(self, index: int) -> None:
+        """Recompute the values of all the ancestors of the leaf with the given index. Cost O(log n)."""
+
+        for k in range(1, len(self.levels)):
+            child_level = self.levels[k - 1]
+            level = self.levels[k]
+            j = index >> k
+            pos = 64 * j
+            if pos + 32 < len(child_level):
+                value = hashlib.sha256(b'\x01' + child_level[pos:pos + 64]).digest()
+            else:
+                value = child_level[pos:pos + 32]
+            level[32 * j:32 * (j + 1)] = value
 
     def add(self, x: bytes) -> None:
         """Add an element as new leaf, and recompute the tree accordingly. Cost O(log n)."""
@@ -156,41 +158,19 @@ class MerkleTree:
         if len(x) != 32:
             raise ValueError("Inserted elements must be exactly 32 bytes long")
 
-        new_leaf = Node(None, None, None, x)
-        self.leaves.append(new_leaf)
-        if len(self.leaves) == 1:
-            self.root_node = new_leaf
-            self.depth = 0
-            return
+        index = len(self)
+        self.leaf_indexes.setdefault(bytes(x), []).append(index)
+        self.levels[0] += x
 
-        # add a new leaf
-        if self.depth == 0:
-            ltree_size = 0
-        else:
-            # number of leaves of the left subtree of cur_root
-            ltree_size = 1 << (self.depth - 1)
-
-        cur_root = self.root_node
-        cur_root_size = len(self.leaves) - 1
-
-        while not is_power_of_2(cur_root_size):
-            cur_root = cur_root.right
-            cur_root_size -= ltree_size
-            ltree_size /= 2
-
-        # node value will be computed later
-        new_node = Node(cur_root, new_leaf, cur_root.parent, None)
-        if cur_root.parent is None:
-            # replacing the root
-            self.depth += 1
-            self.root_node = new_node
-        else:
-            assert cur_root.parent.right == cur_root
-            cur_root.parent.right = new_node
-        cur_root.parent = new_node
-        new_leaf.parent = new_node
+        # make room for the new ancestors, whose value is computed in _fix_up
+        for k in range(1, len(self.levels)):
+            if (index >> k) == len(self.levels[k]) // 32:
+                self.levels[k] += NIL
+        if len(self.levels[-1]) > 32:
+            # the old root and the new leaf are the children of the new root
+            self.levels.append(bytearray(NIL))
 
-        self.fix_up(new_node)
+        self._fix_up(index)
 
     def set(self, index: int, x: bytes) -> None:
         """
@@ -199,53 +179,248 @@ class MerkleTree:
 
         Cost: Worst case O(log n).
         """
-        assert 0 <= index <= len(self.leaves)
+        assert 0 <= index <= len(self)
 
-        if not (0 <= index <= len(self.leaves)):
+        if not (0 <= index <= len(self)):
             raise ValueError(
                 "The index must be at least 0, and at most the current number of leaves.")
 
         if len(x) != 32:
             raise ValueError("Inserted elements must be exactly 32 bytes long.")
 
-        if index == len(self.leaves):
+        if index == len(self):
             self.add(x)
         else:
-            self.leaves[index].value = x
-            self.fix_up(self.leaves[index].parent)
+            old_value = self.get(index)
+            old_indexes = self.leaf_indexes[old_value]
+            old_indexes.remove(index)
+            if len(old_indexes) == 0:
+                del self.leaf_indexes[old_value]
+            insort(self.leaf_indexes.setdefault(bytes(x), []), index)
 
-    def fix_up(self, node: Node):
-        while node is not None:
-            node.recompute_value()
-            node = node.parent
+            self.levels[0][32 * index:32 * (index + 1)] = x
+            self._fix_up(index)
 
     def get(self, i: int) -> bytes:
         """Return the value of the leaf with index `i`, where 0 <= i < len(self)."""
-        return self.leaves[i].value
+        if not (0 <= i < len(self)):
+            raise IndexError("Leaf index out of range")
+        return self._get_node(0, i)
 
     def leaf_index(self, x: bytes) -> int:
-        """Return the index of the leaf with hash `x`. Raises `ValueError` if not found."""
-        idx = 0
-        while idx < len(self):
-            if self.leaves[idx].value == x:
-                return idx
-            idx += 1
-        raise ValueError("Leaf not found")
+        """Return the index of the first leaf with hash `x`. Raises `ValueError` if not found. Cost O(1)."""
+        indexes = self.leaf_indexes.get(x)
+        if indexes is None:
+            raise ValueError("Leaf not found")
+        return indexes[0]
 
     def prove_leaf(self, index: int) -> List[bytes]:
         """Produce the Merkle proof of membership for the leaf with the given index where 0 <= index < len(self)."""
-        node = self.leaves[index]
+        if not (0 <= index < len(self)):
+            raise IndexError("Leaf index out of range")
+
         proof = []
-        while node.parent is not None:
-            sibling = node.sibling()
-            assert sibling is not None
+        for k in range(len(self.levels) - 1):
+            sibling = (index >> k) ^ 1
+            # if the sibling is missing, the parent is just a copy of the node, and it is not part of the proof
+            if sibling < len(self.levels[k]) // 32:
+                proof.append(self._get_node(k, sibling))
+        return proof
+
+    def prove_leaves(self, first_index: int, n_leaves: int) -> List[bytes]:
+        """Produce the multiproof for the consecutive leaves with indexes first_index, ..., first_index + n_leaves - 1.
+
+        The multiproof is the list, in left-to-right order, of the values of the requested leaves and of the roots of
+        the maximal subtrees that do not contain any of the requested leaves."""
+
+        if n_leaves <= 0 or first_index < 0 or first_index + n_leaves > len(self):
+            raise ValueError("Invalid range of leaves.")
+
+        end_index = first_index + n_leaves
+
+        def prove(k: int, j: int) -> List[bytes]:
+            begin = j << k
+            end = min((j + 1) << k, len(self))
+            if end - begin == 1 or begin >= end_index or end <= first_index:
+                return [self._get_node(k, j)]
+
+            if (2 * j + 1) << (k - 1) >= len(self):
+                # only the left child is present, the node is just a copy of it
+                return prove(k - 1, 2 * j)
+            return prove(k - 1, 2 * j) + prove(k - 1, 2 * j + 1)
+
+        return prove(len(self.levels) - 1, 0)
+
+    def prove_leaf_set(self, indexes: List[int]) -> List[bytes]:
+        """Produce the multiproof for the leaves with the given strictly increasing indexes, in the same format as
+        `prove_leaves`."""
+
+        if len(indexes) == 0 or indexes[0] < 0 or indexes[-1] >= len(self) or \
+                any(indexes[i] >= indexes[i + 1] for i in range(len(indexes) - 1)):
+            raise ValueError("Invalid set of leaves.")
+
+        def prove(k: int, j: int) -> List[bytes]:
+            begin = j << k
+            end = min((j + 1) << k, len(self))
+            # index of the first requested leaf that is not before this subtree
+            pos = bisect_left(indexes, begin)
+            if end - begin == 1 or pos == len(indexes) or indexes[pos] >= end:
+                return [self._get_node(k, j)]
+
+            if (2 * j + 1) << (k - 1) >= len(self):
+                # only the left child is present, the node is just a copy of it
+                return prove(k - 1, 2 * j)
+            return prove(k - 1, 2 * j) + prove(k - 1, 2 * j + 1)
+
+        return prove(len(self.levels) - 1, 0)
+
+
+class StreamedMerkleTree:
+    """
+    Merkle tree of the list of chunks of a seekable binary stream, read from its current position to its end. Each
+    chunk is `chunk_size` bytes long, except possibly the last one. The tree has the same structure as the
+    `MerkleTree` of the element hashes of the chunks, but the chunks are not kept in memory.
+
+    The root is computed in a single pass over the stream, keeping only O(log n) hashes for the roots of the complete
+    subtrees seen so far. Leaves and proofs are computed on demand by reading the chunks again from the stream. The
+    last computed node of each level is cached, so that proving all the leaves in increasing order (as in
+    SIGN_MESSAGE) costs O(n log n) hashes in total.
+
+    The stream must not be modified while the tree is in use.
+    """
+
+    def __init__(self, stream: BinaryIO, chunk_size: int = 64):
+        if chunk_size <= 0:
+            raise ValueError("The chunk size must be positive.")
+
+        self.stream = stream
+        self.chunk_size = chunk_size
+
+        self.stream_start = stream.tell()
+        self.stream_length = stream.seek(0, io.SEEK_END) - self.stream_start
+        self.n_leaves = (self.stream_length + chunk_size - 1) // chunk_size
+
+        # for each level, the last computed node as an (index, value) pair
+        self.cached_nodes: Dict[int, Tuple[int, bytes]] = {}
+
+        # the last chunk returned by get_chunk, with its element hash
+        self.last_chunk: Optional[Tuple[bytes, bytes]] = None
+
+        self._root = NIL if self.n_leaves == 0 else self._range_root(0, self.n_leaves)
+
+    def __len__(self) -> int:
+        """Return the total number of leaves in the tree."""
+        return self.n_leaves
+
+    @property
+    def depth(self) -> Optional[int]:
+        """Return the depth of the tree, or None if the tree is empty."""
+        return None if self.n_leaves == 0 else ceil_lg(self.n_leaves)
+
+    @property
+    def root(self) -> bytes:
+        """Return the Merkle root, or None if the tree is empty."""
+        return self._root
+
+    def _read_chunks(self, begin: int, end: int) -> Iterator[bytes]:
+        """Yield the chunks with indexes begin, ..., end - 1, reading them sequentially from the stream."""
+
+        self.stream.seek(self.stream_start + begin * self.chunk_size)
+        for i in range(begin, end):
+            chunk_len = min(self.chunk_size, self.stream_length - i * self.chunk_size)
+            chunk = self.stream.read(chunk_len)
+            if len(chunk) != chunk_len:
+                raise RuntimeError("Unexpected end of stream.")
+            yield chunk
+
+    def _range_root(self, begin: int, end: int) -> bytes:
+        """Return the root of the Merkle tree of the chunks with indexes begin, ..., end - 1. Cost O(end - begin)."""
+
+        # (height, root) of the complete subtrees of the chunks read so far, from left to right
+        frontier: List[Tuple[int, bytes]] = []
+        for chunk in self._read_chunks(begin, end):
+            height, value = 0, element_hash(chunk)
+            while len(frontier) > 0 and frontier[-1][0] == height:
+                value = combine_hashes(frontier.pop()[1], value)
+                height += 1
+            frontier.append((height, value))
+
+        # the remaining subtrees have decreasing sizes, and are merged from the right
+        value = frontier.pop()[1]
+        while len(frontier) > 0:
+            value = combine_hashes(frontier.pop()[1], value)
+        return value
+
+    def _get_node(self, level: int, j: int) -> bytes:
+        """Return the value of the j-th node of the given level, as in the level-by-level layout of `MerkleTree`."""
+
+        cached = self.cached_nodes.get(level)
+        if cached is None or cached[0] != j:
+            cached = (j, self._range_root(j << level, min((j + 1) << level, self.n_leaves)))
+            self.cached_nodes[level] = cached
+        return cached[1]
+
+    def get_chunk(self, i: int) -> bytes:
+        """Return the chunk with index `i`, where 0 <= i < len(self)."""
+        if not (0 <= i < self.n_leaves):
+            raise IndexError("Leaf index out of range")
+
+        chunk = next(self._read_chunks(i, i + 1))
+        self.last_chunk = (element_hash(chunk), chunk)
+        return chunk
 
-            proof.append(sibling.value)
+    def get(self, i: int) -> bytes:
+        """Return the value of the leaf with index `i`, where 0 <= i < len(self)."""
+        self.get_chunk(i)
+        return self.last_chunk[0]
 
-            node = node.parent
+    def find_preimage(self, x: bytes) -> Optional[bytes]:
+        """If `x` is the hash of the last leaf returned by `get`, return its preimage; otherwise, return None."""
+        if self.last_chunk is None or self.last_chunk[0] != x:
+            return None
+        return b'\x00' + self.last_chunk[1]
 
+    def leaf_index(self, x: bytes) -> int:
+        """Return the index of the first leaf with hash `x`. Raises `ValueError` if not found. Cost O(n)."""
+        for index, chunk in enumerate(self._read_chunks(0, self.n_leaves)):
+            if element_hash(chunk) == x:
+                return index
+        raise ValueError("Leaf not found")
+
+    def prove_leaf(self, index: int) -> List[bytes]:
+        """Produce the Merkle proof of membership for the leaf with the given index where 0 <= index < len(self)."""
+        if not (0 <= index < self.n_leaves):
+            raise IndexError("Leaf index out of range")
+
+        proof = []
+        for k in range(self.depth):
+            sibling = (index >> k) ^ 1
+            if sibling << k < self.n_leaves:
+                proof.append(self._get_node(k, sibling))
         return proof
 
+    def prove_leaves(self, first_index: int, n_leaves: int) -> List[bytes]:
+        """Produce the multiproof for the consecutive leaves with indexes first_index, ..., first_index + n_leaves - 1,
+        in the same format as `MerkleTree.prove_leaves`."""
+
+        if n_leaves <= 0 or first_index < 0 or first_index + n_leaves > self.n_leaves:
+            raise ValueError("Invalid range of leaves.")
+
+        end_index = first_index + n_leaves
+
+        def prove(k: int, j: int) -> List[bytes]:
+            begin = j << k
+            end = min((j + 1) << k, self.n_leaves)
+            if end - begin == 1 or begin >= end_index or end <= first_index:
+                return [self._get_node(k, j)]
+
+            if (2 * j + 1) << (k - 1) >= self.n_leaves:
+                # only the left child is present, the node is just a copy of it
+                return prove(k - 1, 2 * j)
+            return prove(k - 1, 2 * j) + prove(k - 1, 2 * j + 1)
+
+        return prove(self.depth, 0)
+
 
 def get_merkleized_map_commitment(mapping: Mapping[bytes, bytes]) -> bytes:
     """Returns a serialized Merkleized map commitment, encoded as the concatenation of:
@@ -0,0 +1,345 @@
+import copy
+import re
+import struct
+from concurrent.futures import Executor
+from io import BytesIO, BufferedReader
+from typing import Dict, Iterable, List, Mapping, Optional, Tuple, Union
+
+from .client_command import ClientCommandInterpreter, WalletDataCache, mapping_key, merkleize_mapping
+from .key import KeyOriginInfo, is_hardened
+from .merkle import MerkleTree
+from .psbt import PSBT, PartiallySignedInput, PartiallySignedOutput, normalize_psbt
+from .raw_psbt import RawPsbt, serialize_without_witness
+from .wallet import WalletPolicy
+from ._serialize import deser_string, ser_compact_size, ser_uint256
+
+
+# Proprietary keys of the derivation hints; see the documentation of SIGN_PSBT
+PSBT_LEDGER_GLOBAL_DERIVATION_HINTS = b"\xfc\x06LEDGER\x00"
+PSBT_LEDGER_IN_OUT_DERIVATION_HINT = b"\xfc\x06LEDGER\x00"
+
+# Proprietary key of the payee list; see the documentation of SIGN_PSBT
+PSBT_LEDGER_GLOBAL_PAYEE_LIST = b"\xfc\x06LEDGER\x01"
+
+# Proprietary key of the subset of the inputs to sign; see the documentation of SIGN_PSBT
+PSBT_LEDGER_GLOBAL_INPUT_SUBSET = b"\xfc\x06LEDGER\x02"
+
+
+def parse_stream_to_map(f: BufferedReader) -> Mapping[bytes, bytes]:
+    result = {}
+    while True:
+        try:
+            key = deser_string(f)
+        except Exception:
+            break
+
+        # Check for separator
+        if len(key) == 0:
+            break
+
+        value = deser_string(f)
+
+        result[key] = value
+    return result
+
+
+def get_v2_global_map(psbt: Union[PSBT, RawPsbt]) -> Dict[bytes, bytes]:
+    """Returns the global map of `psbt` in version 2.
+
+    For a PSBT in version 0, the fields of version 2 are taken from the global unsigned transaction, without
+    converting (or copying) the PSBT.
+    """
+
+    if isinstance(psbt, RawPsbt):
+        return psbt.get_v2_global_map()
+
+    global_map = parse_stream_to_map(BytesIO(psbt.serialize_global_map()))
+
+    if psbt.version == 0:
+        tx = psbt.tx
+        del global_map[ser_compact_size(PSBT.PSBT_GLOBAL_UNSIGNED_TX)]
+        global_map[ser_compact_size(PSBT.PSBT_GLOBAL_TX_VERSION)] = struct.pack("<I", tx.nVersion)
+        global_map[ser_compact_size(PSBT.PSBT_GLOBAL_FALLBACK_LOCKTIME)] = struct.pack("<I", tx.nLockTime)
+        global_map[ser_compact_size(PSBT.PSBT_GLOBAL_INPUT_COUNT)] = ser_compact_size(len(psbt.inputs))
+        global_map[ser_compact_size(PSBT.PSBT_GLOBAL_OUTPUT_COUNT)] = ser_compact_size(len(psbt.outputs))
+        global_map[ser_compact_size(PSBT.PSBT_GLOBAL_VERSION)] = struct.pack("<I", 2)
+
+    return global_map
+
+
+def get_v2_input_map(psbt: Union[PSBT, RawPsbt], index: int) -> Dict[bytes, bytes]:
+    """Returns the map of the input at position `index` of `psbt` in version 2, as `get_v2_global_map` does for the
+    global map."""
+
+    if isinstance(psbt, RawPsbt):
+        return psbt.get_v2_input_map(index)
+
+    input_map = parse_stream_to_map(BytesIO(psbt.inputs[index].serialize()))
+
+    if psbt.version == 0:
+        txin = psbt.tx.vin[index]
+        input_map[ser_compact_size(PartiallySignedInput.PSBT_IN_PREVIOUS_TXID)] = ser_uint256(txin.prevout.hash)
+        input_map[ser_compact_size(PartiallySignedInput.PSBT_IN_OUTPUT_INDEX)] = struct.pack("<I", txin.prevout.n)
+        input_map[ser_compact_size(PartiallySignedInput.PSBT_IN_SEQUENCE)] = struct.pack("<I", txin.nSequence)
+
+    return input_map
+
+
+def get_v2_output_map(psbt: Union[PSBT, RawPsbt], index: int) -> Dict[bytes, bytes]:
+    """Returns the map of the output at position `index` of `psbt` in version 2, as `get_v2_global_map` does for the
+    global map."""
+
+    if isinstance(psbt, RawPsbt):
+        return psbt.get_v2_output_map(index)
+
+    output_map = parse_stream_to_map(BytesIO(psbt.outputs[index].serialize()))
+
+    if psbt.version == 0:
+        txout = psbt.tx.vout[index]
+        output_map[ser_compact_size(PartiallySignedOutput.PSBT_OUT_AMOUNT)] = struct.pack("<q", txout.nValue)
+        if len(txout.scriptPubKey) != 0:
+            output_map[ser_compact_size(PartiallySignedOutput.PSBT_OUT_SCRIPT)] = txout.scriptPubKey
+
+    return output_map
+
+
+def get_derivation_hint(
+    wallet: WalletPolicy,
+    psbt_map: Union[PartiallySignedInput, PartiallySignedOutput, List[KeyOriginInfo]]
+) -> Optional[bytes]:
+    """Returns the value of the derivation hint of an input or output for `wallet`, or None if none of its BIP32
+    derivations is a `<change>/<address_index>` derivation of a key of the wallet policy with a key origin. The BIP32
+    derivations can also be given directly, as for the maps of a `RawPsbt`."""
+
+    origins: List[KeyOriginInfo] = []
+    for key_info in wallet.keys_info:
+        if key_info.startswith("["):
+            origins.append(KeyOriginInfo.from_string(key_info[1:key_info.index("]")]))
+
+    if isinstance(psbt_map, list):
+        derivations = psbt_map
+    else:
+        derivations = (list(psbt_map.hd_keypaths.values())
+                       + [origin for _, origin in psbt_map.tap_bip32_paths.values()])
+    for der in derivations:
+        for origin in origins:
+            n = len(origin.path)
+            if der.fingerprint == origin.fingerprint and len(der.path) == n + 2 and der.path[:n] == origin.path:
+                change, address_index = der.path[n:]
+                if change in (0, 1) and not is_hardened(address_index):
+                    return struct.pack("<BI", change, address_index)
+    return None
+
+
+def supports_derivation_hints(wallet: WalletPolicy) -> bool:
+    """Returns True if all the key placeholders of `wallet` use the standard `/**` (or `/<0;1>/*`) derivations, the
+    only ones for which the derivation hints are computed."""
+
+    return "@" not in re.sub(r"@\d+/(\*\*|<0;1>/\*)", "", wallet.descriptor_template)
+
+
+class MerkleizedPsbt:
+    """
+    A PSBT, with the maps it is made of in version 2 and a client interpreter that knows all the Merkle trees and
+    preimages that the hardware wallet requests while signing it with a given wallet policy.
+
+    It is built once, and can then be signed several times, or with several hardware wallets at the same time: each
+    signing session uses its own fork of the interpreter. After modifying an input or an output of `psbt`, call
+    `update_input` (resp. `update_output`) so that only the Merkle trees of that map and the leaf of its commitment
+    are recomputed; `update_global` does the same for the global map. Updates must not happen while a signing session
+    is in progress.
+
+    Attributes
+    ----------
+    psbt: PSBT | RawPsbt
+        The PSBT. If it is in version 0, it is not converted: the maps in version 2 are derived from its global
+        unsigned transaction.
+    wallet: WalletPolicy
+        The wallet policy the PSBT is signed with.
+    global_map: Mapping[bytes, bytes]
+        The global map of the PSBT.
+    input_maps: List[Mapping[bytes, bytes]]
+        The map of each input of the PSBT.
+    output_maps: List[Mapping[bytes, bytes]]
+        The map of each output of the PSBT.
+    derivation_hints: bool
+        Whether the maps include the derivation hints for the wallet policy.
+    payee_list: Optional[Tuple[List[bytes], bytes]]
+        The scriptPubKeys and the hmac of the registered payee list included in the global map, if any.
+    input_subset: Optional[List[int]]
+        The indexes of the inputs that the device signs, included in the global map, if any; see `with_input_subset`.
+    """
+
+    def __init__(self, psbt: Union[PSBT, RawPsbt, bytes, str], wallet: WalletPolicy, clone: bool = True,
+                 derivation_hints: bool = False, payee_list: Optional[Tuple[List[bytes], bytes]] = None,
+                 executor: Optional[Executor] = None, wallet_cache: Optional[WalletDataCache] = None):
+        """
+        :param psbt: The PSBT, in any version. If it is only needed for signing, a `RawPsbt` spares parsing the values
+            of its maps; a serialized PSBT (as `bytes` or a base64 `str`) is still deserialized to a `PSBT` object.
+        :param wallet: The wallet policy the PSBT is signed with.
+        :param clone: If False and `psbt` is a PSBT object in version 0, it is converted to version 2 in place.
+        :param derivation_hints: If True, the derivation hints for `wallet` are added to the maps, unless its key
+            placeholders use non-standard derivations. They are not added to `psbt`.
+        :param payee_list: The scriptPubKeys and the hmac of a payee list registered with `register_payee_list`. The
+            outputs to its payees are validated on the device with a single screen. It is not added to `psbt`.
+        :param executor: If given, the input and output maps are hashed concurrently by its workers. As `hashlib`
+            only releases the GIL for long data, a `ProcessPoolExecutor` is faster than threads for the PSBTs with
+            many inputs.
+        :param wallet_cache: If given, the data of `wallet` served to the device is taken from it.
+        """
+        if not isinstance(psbt, RawPsbt):
+            psbt = normalize_psbt(psbt)
+
+            if psbt.version != 2 and not clone:
+                psbt.convert_to_v2()
+
+        self.psbt = psbt
+        self.wallet = wallet
+        self.derivation_hints = derivation_hints and supports_derivation_hints(wallet)
+        self.payee_list = payee_list
+        self.input_subset: Optional[List[int]] = None
+
+        # We parse the individual maps (global map, each input map, and each output map) from their serialization, in
+        # order to produce the serialized Merkleized map commitments. Moreover, we prepare the client interpreter to
+        # respond on queries on all the relevant Merkle trees and pre-images in the psbt.
+
+        client_intepreter = ClientCommandInterpreter()
+        client_intepreter.add_known_wallet(wallet, wallet_cache)
+
+        if payee_list is not None:
+            self._payee_list_tree = client_intepreter.add_known_list(payee_list[0])
+
+        self.global_map: Mapping[bytes, bytes] = self._get_global_map()
+        self.global_map_commitment = client_intepreter.add_known_mapping(self.global_map)
+
+        if isinstance(psbt, RawPsbt):
+            n_inputs, n_outputs = len(psbt.input_maps), len(psbt.output_maps)
+        else:
+            n_inputs, n_outputs = len(psbt.inputs), len(psbt.outputs)
+        self.input_maps: List[Mapping[bytes, bytes]] = [self._get_input_map(i) for i in range(n_inputs)]
+        self.output_maps: List[Mapping[bytes, bytes]] = [self._get_output_map(i) for i in range(n_outputs)]
+
+        # We also add the Merkle tree of the input (resp. output) map commitments as a known tree
+        if executor is None:
+            input_commitments = [client_intepreter.add_known_mapping(m_in) for m_in in self.input_maps]
+            output_commitments = [client_intepreter.add_known_mapping(m_out) for m_out in self.output_maps]
+        else:
+            maps = self.input_maps + self.output_maps
+            map_keys = [mapping_key(m) for m in maps]
+            # identical maps (for example, the empty output maps) are only merkleized once
+            unique_maps: Dict[Tuple[Tuple[bytes, bytes], ...], Mapping[bytes, bytes]] = {}
+            for key, m in zip(map_keys, maps):
+                unique_maps.setdefault(key, m)
+            # the chunks amortize the cost of sending the maps to the processes of a ProcessPoolExecutor
+            chunksize = max(1, len(unique_maps) // 64)
+            commitments: Dict[Tuple[Tuple[bytes, bytes], ...], bytes] = {}
+            results = executor.map(merkleize_mapping, unique_maps.values(), chunksize=chunksize)
+            for key, (commitment, preimages, trees) in zip(unique_maps, results):
+                client_intepreter.add_merkleized_mapping(preimages, trees)
+                commitments[key] = commitment
+            input_commitments = [commitments[key] for key in map_keys[:len(self.input_maps)]]
+            output_commitments = [commitments[key] for key in map_keys[len(self.input_maps):]]
+
+        self._input_commitments_tree: MerkleTree = client_intepreter.add_known_list(input_commitments)
+        self._output_commitments_tree: MerkleTree = client_intepreter.add_known_list(output_commitments)
+
+        self._client_interpreter = client_intepreter
+
+    def _get_global_map(self) -> Dict[bytes, bytes]:
+        global_map = get_v2_global_map(self.psbt)
+        if self.derivation_hints:
+            global_map[PSBT_LEDGER_GLOBAL_DERIVATION_HINTS] = b""
+        if self.payee_list is not None:
+            scripts, hmac = self.payee_list
+            global_map[PSBT_LEDGER_GLOBAL_PAYEE_LIST] = (ser_compact_size(len(scripts)) + self._payee_list_tree.root
+                                                         + hmac)
+        if self.input_subset is not None:
+            global_map[PSBT_LEDGER_GLOBAL_INPUT_SUBSET] = (ser_compact_size(len(self.input_subset))
+                                                           + self._input_subset_tree.root)
+        return global_map
+
+    def _get_input_map(self, index: int) -> Dict[bytes, bytes]:
+        input_map = get_v2_input_map(self.psbt, index)
+        # The witnesses do not contribute to the txid, which is all the device verifies; the serialization without
+        # witnesses spares streaming (and parsing) them.
+        key = ser_compact_size(PartiallySignedInput.PSBT_IN_NON_WITNESS_UTXO)
+        if isinstance(self.psbt, RawPsbt):
+            if key in input_map:
+                input_map[key] = serialize_without_witness(input_map[key])
+            derivations = self.psbt.get_input_derivations(index) if self.derivation_hints else []
+        else:
+            utxo = self.psbt.inputs[index].non_witness_utxo
+            if utxo is not None and not utxo.wit.is_null():
+                input_map[key] = utxo.serialize_without_witness()
+            derivations = self.psbt.inputs[index]
+        hint = get_derivation_hint(self.wallet, derivations) if self.derivation_hints else None
+        if hint is not None:
+            input_map[PSBT_LEDGER_IN_OUT_DERIVATION_HINT] = hint
+        return input_map
+
+    def _get_output_map(self, index: int) -> Dict[bytes, bytes]:
+        output_map = get_v2_output_map(self.psbt, index)
+        if isinstance(self.psbt, RawPsbt):
+            derivations = self.psbt.get_output_derivations(index) if self.derivation_hints else []
+        else:
+            derivations = self.psbt.outputs[index]
+        hint = get_derivation_hint(self.wallet, derivations) if self.derivation_hints else None
+        if hint is not None:
+            output_map[PSBT_LEDGER_IN_OUT_DERIVATION_HINT] = hint
+        return output_map
+
+    @property
+    def input_commitments_root(self) -> bytes:
+        """The root of the Merkle tree of the input map commitments."""
+        return self._input_commitments_tree.root
+
+    @property
+    def output_commitments_root(self) -> bytes:
+        """The root of the Merkle tree of the output map commitments."""
+        return self._output_commitments_tree.root
+
+    def update_global(self) -> None:
+        """Recomputes the Merkle trees of the global map, after `psbt` was modified."""
+        global_map = self._get_global_map()
+        if global_map != self.global_map:
+            self.global_map = global_map
+            self.global_map_commitment = self._client_interpreter.add_known_mapping(global_map)
+
+    def update_input(self, index: int) -> None:
+        """Recomputes the Merkle trees of the map of the input at position `index`, after it was modified in `psbt`."""
+        input_map = self._get_input_map(index)
+        if input_map != self.input_maps[index]:
+            self.input_maps[index] = input_map
+            commitment = self._client_interpreter.add_known_mapping(input_map)
+            self._client_interpreter.update_known_list(self._input_commitments_tree, index, commitment)
+
+    def update_output(self, index: int) -> None:
+        """Recomputes the Merkle trees of the map of the output at position `index`, after it was modified in `psbt`."""
+        output_map = self._get_output_map(index)
+        if output_map != self.output_maps[index]:
+            self.output_maps[index] = output_map
+            commitment = self._client_interpreter.add_known_mapping(output_map)
+            self._client_interpreter.update_known_list(self._output_commitments_tree, index, commitment)
+
+    def with_input_subset(self, input_indexes: Iterable[int]) -> "MerkleizedPsbt":
+        """Returns a copy of the merkleized PSBT whose global map restricts the inputs signed by the device to
+        `input_indexes` (on apps with the `INPUT_SUBSETS` feature), for example to split the signing of a PSBT with many
+        inputs among several hardware wallets with the same seed.
+
+        The maps of the inputs and outputs, and their Merkle trees, are shared with the copy: they must not be updated
+        while the copy is in use."""
+        indexes = sorted(set(input_indexes))
+        if len(indexes) == 0 or indexes[0] < 0 or indexes[-1] >= len(self.input_maps):
+            raise ValueError("Invalid input subset")
+
+        subset = copy.copy(self)
+        subset.input_subset = indexes
+        subset._input_subset_tree = self._client_interpreter.add_known_list(
+            [struct.pack("<I", index) for index in indexes])
+        subset.global_map = subset._get_global_map()
+        subset.global_map_commitment = self._client_interpreter.add_known_mapping(subset.global_map)
+        return subset
+
+    def new_client_interpreter(self) -> ClientCommandInterpreter:
+        """Returns a new client interpreter for a signing session of the PSBT."""
+        return self._client_interpreter.fork()
@@ -0,0 +1,117 @@
+import asyncio
+from typing import List, Optional, Sequence, Tuple, Union
+
+from .client import NewClient
+from .client_base import PartialSignature
+from .merkleized_psbt import MerkleizedPsbt
+from .psbt import PSBT, normalize_psbt
+from .wallet import WalletPolicy
+
+
+def add_partial_signatures(psbt: PSBT, signatures: List[Tuple[int, PartialSignature]]) -> None:
+    """Adds to the inputs of `psbt` the partial signatures returned by `sign_psbt`."""
+
+    for input_index, part_sig in signatures:
+        psbt_in = psbt.inputs[input_index]
+        if part_sig.tapleaf_hash is not None:
+            # signature for a script spend
+            psbt_in.tap_script_sigs[(part_sig.pubkey, part_sig.tapleaf_hash)] = part_sig.signature
+        elif len(part_sig.pubkey) == 32:
+            # taproot key path spend
+            psbt_in.tap_key_sig = part_sig.signature
+        else:
+            psbt_in.partial_sigs[part_sig.pubkey] = part_sig.signature
+
+
+async def sign_psbt_with_devices(
+    signers: Sequence[Tuple[NewClient, Optional[bytes]]],
+    psbt: Union[PSBT, bytes, str],
+    wallet: WalletPolicy
+) -> PSBT:
+    """Signs a PSBT with several hardware wallets at the same time, for example the cosigners of a multisig policy.
+
+    The PSBT is merkleized only once, and each hardware wallet is driven in its own thread with a fork of the same
+    client interpreter.
+
+    Parameters
+    ----------
+    signers : Sequence[Tuple[NewClient, Optional[bytes]]]
+        The client of each hardware wallet, with the hmac of the registration of `wallet` on it, if any.
+    psbt : PSBT | bytes | str
+        The PSBT to sign, as in `Client.sign_psbt`.
+    wallet : WalletPolicy
+        The wallet policy the PSBT is signed with.
+
+    Returns
+    -------
+    PSBT
+        The PSBT with the partial signatures of all the hardware wallets added to its inputs. If `psbt` is a PSBT
+        object, the signatures are added to it, and it is returned.
+    """
+
+    psbt = normalize_psbt(psbt)
+    merkleized_psbt = MerkleizedPsbt(psbt, wallet)
+
+    loop = asyncio.get_running_loop()
+    results = await asyncio.gather(*[
+        loop.run_in_executor(None, client.sign_psbt, merkleized_psbt, wallet, wallet_hmac)
+        for client, wallet_hmac in signers
+    ])
+
+    for signatures in results:
+        add_partial_signatures(psbt, signatures)
+
+    return psbt
+
+
+async def sign_psbt_sharded(
+    clients: Sequence[NewClient],
+    psbt: Union[PSBT, bytes, str],
+    wallet: WalletPolicy,
+    wallet_hmac: Optional[bytes]
+) -> PSBT:
+    """Signs a PSBT with several hardware wallets with the same seed at the same time, each signing a disjoint range
+    of the inputs, which divides the signing time of PSBTs with many internal inputs. Each hardware wallet validates
+    the whole transaction with its user.
+
+    The PSBT is merkleized only once; the hardware wallets must support the `INPUT_SUBSETS` feature.
+
+    Parameters
+    ----------
+    clients : Sequence[NewClient]
+        The client of each hardware wallet.
+    psbt : PSBT | bytes | str
+        The PSBT to sign, as in `Client.sign_psbt`.
+    wallet : WalletPolicy
+        The wallet policy the PSBT is signed with.
+    wallet_hmac : Optional[bytes]
+        The hmac of the registration of `wallet`, that must be the same on all the hardware wallets, or `None`.
+
+    Returns
+    -------
+    PSBT
+        The PSBT with the partial signatures of all the hardware wallets added to its inputs. If `psbt` is a PSBT
+        object, the signatures are added to it, and it is returned.
+    """
+
+    psbt = normalize_psbt(psbt)
+    merkleized_psbt = MerkleizedPsbt(psbt, wallet)
+
+    n_inputs = len(merkleized_psbt.input_maps)
+    n_shards = min(len(clients), n_inputs)
+    # the subsets are prepared before any signing session starts, as they add data to the shared interpreter
+    shards = [
+        merkleized_psbt.with_input_subset(range(n_inputs * k // n_shards, n_inputs * (k + 1) // n_shards))
+        for k in range(n_shards)
+    ]
+
+    loop = asyncio.get_running_loop()
+    results = await asyncio.gather(*[
+        loop.run_in_executor(None, client.sign_psbt, shard, wallet, wallet_hmac)
+        for client, shard in zip(clients, shards)
+    ])
+
+    for signatures in results:
+        add_partial_signatures(psbt, signatures)
+
+    return psbt
@@ -884,17 +884,14 @@ class PSBT(object):
 
         self.cache_unsigned_tx_pieces()
 
-    def serialize(self) -> str:
+    def serialize_global_map(self) -> bytes:
         """
-        Serialize the PSBT as a base 64 encoded string.
+        Serialize the global map of the PSBT, including the separator.
 
-        :returns: The base 64 encoded string.
+        :returns: The serialized global map.
         """
         r = b""
 
-        # magic bytes
-        r += b"psbt\xff"
-
         if self.version == 0:
             # unsigned tx flag
             r += ser_string(ser_compact_size(PSBT.PSBT_GLOBAL_UNSIGNED_TX))
@@ -938,6 +935,21 @@ class PSBT(object):
         # separator
         r += b"\x00"
 
+        return r
+
+    def serialize(self) -> str:
+        """
+        Serialize the PSBT as a base 64 encoded string.
+
+        :returns: The base 64 encoded string.
+        """
+        r = b""
+
+        # magic bytes
+        r += b"psbt\xff"
+
+        r += self.serialize_global_map()
+
         # inputs
         for input in self.inputs:
             r += input.serialize()
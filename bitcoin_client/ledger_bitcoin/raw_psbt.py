@@ -0,0 +1,221 @@
+"""
+A lightweight reader of serialized PSBTs, that only splits them into their key/value maps.
+
+Unlike `PSBT.deserialize`, the values of the maps are not parsed (in particular, the previous transactions of the
+inputs are not deserialized): that is all that is needed to merkleize a PSBT in order to sign it with the device.
+"""
+
+import base64
+import os
+import struct
+from io import BytesIO
+from typing import BinaryIO, Dict, Iterator, List, Optional, Tuple, Union
+
+from .errors import PSBTSerializationError
+from .key import KeyOriginInfo
+from .psbt import PSBT, PartiallySignedInput, PartiallySignedOutput
+from .tx import CTransaction
+from ._serialize import deser_compact_size, deser_string, ser_compact_size, ser_uint256
+
+
+PSBT_MAGIC = b"psbt\xff"
+
+
+def read_psbt_map(f: BinaryIO) -> Dict[bytes, bytes]:
+    """Reads from `f` a key/value map of a serialized PSBT, up to and including its separator."""
+
+    result: Dict[bytes, bytes] = {}
+    while True:
+        try:
+            key = deser_string(f)
+            if len(key) == 0:
+                return result
+            value = deser_string(f)
+        except struct.error:
+            raise PSBTSerializationError("Unexpected end of the PSBT")
+
+        if key in result:
+            raise PSBTSerializationError("Duplicate key in a map of the PSBT")
+        result[key] = value
+
+
+def _get_unsigned_tx(global_map: Dict[bytes, bytes]) -> Optional[CTransaction]:
+    # the global unsigned transaction of a PSBT in version 0, the only value that is parsed
+    value = global_map.get(ser_compact_size(PSBT.PSBT_GLOBAL_UNSIGNED_TX))
+    if value is None:
+        return None
+    tx = CTransaction()
+    tx.deserialize(BytesIO(value))
+    return tx
+
+
+def _get_counts(global_map: Dict[bytes, bytes], tx: Optional[CTransaction]) -> Tuple[int, int]:
+    if tx is not None:
+        return len(tx.vin), len(tx.vout)
+
+    try:
+        n_inputs = deser_compact_size(BytesIO(global_map[ser_compact_size(PSBT.PSBT_GLOBAL_INPUT_COUNT)]))
+        n_outputs = deser_compact_size(BytesIO(global_map[ser_compact_size(PSBT.PSBT_GLOBAL_OUTPUT_COUNT)]))
+    except (KeyError, struct.error):
+        raise PSBTSerializationError("The PSBT has neither an unsigned tx nor the input and output counts")
+    return n_inputs, n_outputs
+
+
+def iter_psbt_maps(f: BinaryIO) -> Iterator[Dict[bytes, bytes]]:
+    """Yields the maps of the binary serialized PSBT read from `f`, in order: the global map, the map of each input,
+    then the map of each output. Each map is only read from `f` when it is reached, so that the PSBT can be processed
+    without keeping all of it in memory."""
+
+    if f.read(len(PSBT_MAGIC)) != PSBT_MAGIC:
+        raise PSBTSerializationError("invalid magic")
+
+    global_map = read_psbt_map(f)
+    yield global_map
+
+    n_inputs, n_outputs = _get_counts(global_map, _get_unsigned_tx(global_map))
+    for _ in range(n_inputs + n_outputs):
+        yield read_psbt_map(f)
+
+
+def serialize_without_witness(tx: bytes) -> bytes:
+    """Returns the serialization without witnesses of the serialized transaction `tx`, which has the same txid; `tx`
+    is returned unchanged if it has no witnesses."""
+
+    # the segwit marker and flag, where a legacy serialization has the number of inputs
+    if len(tx) < 6 or tx[4] != 0 or tx[5] == 0:
+        return tx
+
+    f = BytesIO(tx)
+    f.seek(6)
+    try:
+        for _ in range(deser_compact_size(f)):
+            f.seek(36, os.SEEK_CUR)  # prevout
+            f.seek(deser_compact_size(f) + 4, os.SEEK_CUR)  # scriptSig and nSequence
+        for _ in range(deser_compact_size(f)):
+            f.seek(8, os.SEEK_CUR)  # nValue
+            f.seek(deser_compact_size(f), os.SEEK_CUR)  # scriptPubKey
+    except struct.error:
+        raise PSBTSerializationError("Invalid previous transaction")
+
+    end_of_outputs = f.tell()
+    if end_of_outputs + 4 > len(tx):
+        raise PSBTSerializationError("Invalid previous transaction")
+    return tx[:4] + tx[6:end_of_outputs] + tx[-4:]
+
+
+def _get_derivations(psbt_map: Dict[bytes, bytes], bip32_type: int, tap_bip32_type: int) -> List[KeyOriginInfo]:
+    derivations: List[KeyOriginInfo] = []
+    for key, value in psbt_map.items():
+        if key[0] == bip32_type:
+            derivations.append(KeyOriginInfo.deserialize(value))
+        elif key[0] == tap_bip32_type:
+            # the origin follows the hashes of the leaves
+            f = BytesIO(value)
+            n_leaf_hashes = deser_compact_size(f)
+            derivations.append(KeyOriginInfo.deserialize(value[f.tell() + 32 * n_leaf_hashes:]))
+    return derivations
+
+
+class RawPsbt:
+    """
+    The key/value maps of a serialized PSBT, whose values are not parsed, except the global unsigned transaction of a
+    PSBT in version 0.
+
+    It can be used instead of a `PSBT` object in `MerkleizedPsbt`, and therefore in `NewClient.sign_psbt`, when the
+    PSBT only needs to be signed: the maps in version 2 are derived from it in the same way.
+
+    Attributes
+    ----------
+    global_map: Dict[bytes, bytes]
+        The global map, as serialized.
+    input_maps: List[Dict[bytes, bytes]]
+        The map of each input, as serialized.
+    output_maps: List[Dict[bytes, bytes]]
+        The map of each output, as serialized.
+    tx: Optional[CTransaction]
+        The global unsigned transaction, for a PSBT in version 0; None otherwise.
+    """
+
+    def __init__(self, f: BinaryIO):
+        """
+        :param f: The binary serialization of the PSBT, that is read up to the end of its last map.
+        """
+        maps = iter_psbt_maps(f)
+        self.global_map: Dict[bytes, bytes] = next(maps)
+        self.tx = _get_unsigned_tx(self.global_map)
+        n_inputs, _ = _get_counts(self.global_map, self.tx)
+
+        psbt_maps = list(maps)
+        self.input_maps: List[Dict[bytes, bytes]] = psbt_maps[:n_inputs]
+        self.output_maps: List[Dict[bytes, bytes]] = psbt_maps[n_inputs:]
+
+    @classmethod
+    def from_bytes(cls, psbt: Union[bytes, str]) -> "RawPsbt":
+        """Reads a PSBT from its binary serialization, or from its base64 encoding (as `bytes` or `str`)."""
+        if isinstance(psbt, str):
+            psbt = psbt.encode()
+        if not psbt.startswith(PSBT_MAGIC):
+            psbt = base64.b64decode(psbt.strip())
+        return cls(BytesIO(psbt))
+
+    @classmethod
+    def from_file(cls, path: Union[str, os.PathLike]) -> "RawPsbt":
+        """Reads a PSBT from a file with its binary serialization, or with its base64 encoding; a binary file is read
+        as a stream."""
+        with open(path, "rb") as f:
+            if f.peek(len(PSBT_MAGIC))[:len(PSBT_MAGIC)] == PSBT_MAGIC:
+                return cls(f)
+            return cls.from_bytes(f.read())
+
+    @property
+    def version(self) -> int:
+        value = self.global_map.get(ser_compact_size(PSBT.PSBT_GLOBAL_VERSION))
+        return 0 if value is None else struct.unpack("<I", value)[0]
+
+    def get_v2_global_map(self) -> Dict[bytes, bytes]:
+        """Returns the global map in version 2; for a PSBT in version 0, the fields of version 2 are taken from the
+        global unsigned transaction."""
+
+        global_map = dict(self.global_map)
+        if self.tx is not None:
+            del global_map[ser_compact_size(PSBT.PSBT_GLOBAL_UNSIGNED_TX)]
+            global_map[ser_compact_size(PSBT.PSBT_GLOBAL_TX_VERSION)] = struct.pack("<I", self.tx.nVersion)
+            global_map[ser_compact_size(PSBT.PSBT_GLOBAL_FALLBACK_LOCKTIME)] = struct.pack("<I", self.tx.nLockTime)
+            global_map[ser_compact_size(PSBT.PSBT_GLOBAL_INPUT_COUNT)] = ser_compact_size(len(self.input_maps))
+            global_map[ser_compact_size(PSBT.PSBT_GLOBAL_OUTPUT_COUNT)] = ser_compact_size(len(self.output_maps))
+            global_map[ser_compact_size(PSBT.PSBT_GLOBAL_VERSION)] = struct.pack("<I", 2)
+        return global_map
+
+    def get_v2_input_map(self, index: int) -> Dict[bytes, bytes]:
+        """Returns the map of the input at position `index` in version 2, as `get_v2_global_map` does for the global
+        map."""
+
+        input_map = dict(self.input_maps[index])
+        if self.tx is not None:
+            txin = self.tx.vin[index]
+            input_map[ser_compact_size(PartiallySignedInput.PSBT_IN_PREVIOUS_TXID)] = ser_uint256(txin.prevout.hash)
+            input_map[ser_compact_size(PartiallySignedInput.PSBT_IN_OUTPUT_INDEX)] = struct.pack("<I", txin.prevout.n)
+            input_map[ser_compact_size(PartiallySignedInput.PSBT_IN_SEQUENCE)] = struct.pack("<I", txin.nSequence)
+        return input_map
+
+    def get_v2_output_map(self, index: int) -> Dict[bytes, bytes]:
+        """Returns the map of the output at position `index` in version 2, as `get_v2_global_map` does for the global
+        map."""
+
+        output_map = dict(self.output_maps[index])
+        if self.tx is not None:
+            txout = self.tx.vout[index]
+            output_map[ser_compact_size(PartiallySignedOutput.PSBT_OUT_AMOUNT)] = struct.pack("<q", txout.nValue)
+            if len(txout.scriptPubKey) != 0:
+                output_map[ser_compact_size(PartiallySignedOutput.PSBT_OUT_SCRIPT)] = txout.scriptPubKey
+        return output_map
+
+    def get_input_derivations(self, index: int) -> List[KeyOriginInfo]:
+        """Returns the BIP32 derivations (including the taproot ones) of the input at position `index`."""
+        return _get_derivations(self.input_maps[index], PartiallySignedInput.PSBT_IN_BIP32_DERIVATION,
+                                PartiallySignedInput.PSBT_IN_TAP_BIP32_DERIVATION)
+
+    def get_output_derivations(self, index: int) -> List[KeyOriginInfo]:
+        """Returns the BIP32 derivations (including the taproot ones) of the output at position `index`."""
+        return _get_derivations(self.output_maps[index], PartiallySignedOutput.PSBT_OUT_BIP32_DERIVATION,
+                                PartiallySignedOutput.PSBT_OUT_TAP_BIP32_DERIVATION)
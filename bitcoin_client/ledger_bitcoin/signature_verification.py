@@ -0,0 +1,501 @@
+"""
+Verification on the host of the partial signatures returned by sign_psbt.
+
+The sighash of each signature is recomputed from the maps of the PSBT in version 2. The hashes of BIP143 and BIP341
+that are shared by all the inputs are computed only once per PSBT; the legacy sighashes still hash the whole
+transaction for each input, as their definition requires, but its serialized inputs and outputs are reused.
+
+The Schnorr signatures are checked together with the batch verification of BIP340, that costs about half of the
+individual verifications with the Python arithmetic below; the ECDSA signatures, that cannot be batched, are checked
+with a single multi-scalar multiplication each. If the bindings of libsecp256k1 (coincurve) are installed, each
+signature is verified with them instead, which is much faster than even the batch verification in Python. Either way,
+the signatures can be split in chunks that are verified concurrently by the workers of an executor.
+"""
+
+import secrets
+import struct
+from concurrent.futures import Executor
+from hashlib import sha256
+from io import BytesIO
+from typing import Dict, List, Mapping, Optional, Sequence, Tuple, Union
+
+from .client_base import PartialSignature
+from .common import hash256
+from .key import G, int_from_bytes, n, p, tagged_hash
+from .merkleized_psbt import MerkleizedPsbt, get_v2_global_map, get_v2_input_map, get_v2_output_map
+from .psbt import PSBT, PartiallySignedInput, PartiallySignedOutput, normalize_psbt
+from .raw_psbt import RawPsbt
+from .tx import CTransaction, CTxOut
+from ._serialize import ser_compact_size, ser_string
+
+try:
+    import coincurve
+except ImportError:
+    coincurve = None
+
+
+SIGHASH_DEFAULT = 0x00
+SIGHASH_ALL = 0x01
+SIGHASH_NONE = 0x02
+SIGHASH_SINGLE = 0x03
+SIGHASH_ANYONECANPAY = 0x80
+
+# the number of signatures of each chunk verified by a worker of the executor
+VERIFICATION_CHUNK_SIZE = 64
+
+
+class InvalidSignatureError(ValueError):
+    """Raised when a partial signature returned by the device is not valid for the sighash of its input."""
+
+    def __init__(self, input_index: int, part_sig: PartialSignature) -> None:
+        super().__init__(f"Invalid signature for input {input_index} with pubkey {part_sig.pubkey.hex()}")
+        self.input_index = input_index
+        self.part_sig = part_sig
+
+
+def _key(key_type: int) -> bytes:
+    return ser_compact_size(key_type)
+
+
+def _get_locktime(global_map: Mapping[bytes, bytes], input_maps: Sequence[Mapping[bytes, bytes]]) -> int:
+    """Returns the locktime of the transaction, as determined in BIP370."""
+
+    time_key = _key(PartiallySignedInput.PSBT_IN_REQUIRED_TIME_LOCKTIME)
+    height_key = _key(PartiallySignedInput.PSBT_IN_REQUIRED_HEIGHT_LOCKTIME)
+
+    constrained = [m for m in input_maps if time_key in m or height_key in m]
+    if len(constrained) == 0:
+        fallback = global_map.get(_key(PSBT.PSBT_GLOBAL_FALLBACK_LOCKTIME))
+        return struct.unpack("<I", fallback)[0] if fallback is not None else 0
+
+    # a height is used if all the inputs with a requirement accept one
+    key = height_key if all(height_key in m for m in constrained) else time_key
+    return max(struct.unpack("<I", m[key])[0] for m in constrained if key in m)
+
+
+class SighashCache:
+    """
+    The transaction of a PSBT, with the parts of its sighashes that are shared by all its inputs.
+
+    The shared hashes are computed the first time they are needed; the spent outputs of all the inputs are only
+    required for the taproot sighashes.
+    """
+
+    def __init__(self, global_map: Mapping[bytes, bytes], input_maps: Sequence[Mapping[bytes, bytes]],
+                 output_maps: Sequence[Mapping[bytes, bytes]]) -> None:
+        self.input_maps = input_maps
+        self.version = struct.unpack("<i", global_map[_key(PSBT.PSBT_GLOBAL_TX_VERSION)])[0]
+        self.locktime = _get_locktime(global_map, input_maps)
+
+        self.outpoints = [
+            m[_key(PartiallySignedInput.PSBT_IN_PREVIOUS_TXID)] + m[_key(PartiallySignedInput.PSBT_IN_OUTPUT_INDEX)]
+            for m in input_maps
+        ]
+        self.sequences = [
+            m.get(_key(PartiallySignedInput.PSBT_IN_SEQUENCE), b"\xff\xff\xff\xff") for m in input_maps
+        ]
+        self.outputs = [
+            m[_key(PartiallySignedOutput.PSBT_OUT_AMOUNT)] + ser_string(m[_key(PartiallySignedOutput.PSBT_OUT_SCRIPT)])
+            for m in output_maps
+        ]
+
+        self._spent_outputs: Dict[int, CTxOut] = {}
+        self._bip143: Optional[Tuple[bytes, bytes, bytes]] = None
+        self._bip341: Optional[Tuple[bytes, bytes, bytes, bytes, bytes]] = None
+        self._legacy_inputs: Optional[List[bytes]] = None
+
+    def spent_output(self, input_index: int) -> CTxOut:
+        """Returns the output spent by an input, from its witness or non-witness UTXO."""
+
+        txout = self._spent_outputs.get(input_index)
+        if txout is not None:
+            return txout
+
+        input_map = self.input_maps[input_index]
+        txout = CTxOut()
+        if _key(PartiallySignedInput.PSBT_IN_WITNESS_UTXO) in input_map:
+            txout.deserialize(BytesIO(input_map[_key(PartiallySignedInput.PSBT_IN_WITNESS_UTXO)]))
+        elif _key(PartiallySignedInput.PSBT_IN_NON_WITNESS_UTXO) in input_map:
+            tx = CTransaction()
+            tx.deserialize(BytesIO(input_map[_key(PartiallySignedInput.PSBT_IN_NON_WITNESS_UTXO)]))
+            txout = tx.vout[struct.unpack("<I", self.outpoints[input_index][32:])[0]]
+        else:
+            raise ValueError(f"The output spent by input {input_index} is not in the PSBT")
+
+        self._spent_outputs[input_index] = txout
+        return txout
+
+    def legacy(self, input_index: int, script_code: bytes, sighash_type: int) -> bytes:
+        """Returns the sighash of a legacy input, as in the original SignatureHash of Bitcoin Core."""
+
+        base_type = sighash_type & 0x1f
+        if base_type == SIGHASH_SINGLE and input_index >= len(self.outputs):
+            # the hash signed in this case, for compatibility with the original implementation
+            return (1).to_bytes(32, byteorder="little")
+
+        if self._legacy_inputs is None:
+            self._legacy_inputs = [outpoint + b"\x00" + sequence
+                                   for outpoint, sequence in zip(self.outpoints, self.sequences)]
+
+        current_input = self.outpoints[input_index] + ser_string(script_code) + self.sequences[input_index]
+        if sighash_type & SIGHASH_ANYONECANPAY:
+            inputs = [current_input]
+        elif base_type in (SIGHASH_NONE, SIGHASH_SINGLE):
+            # the other inputs are signed with a null sequence
+            inputs = [outpoint + b"\x00" + b"\x00" * 4 for outpoint in self.outpoints]
+            inputs[input_index] = current_input
+        else:
+            inputs = self._legacy_inputs[:input_index] + [current_input] + self._legacy_inputs[input_index + 1:]
+
+        if base_type == SIGHASH_NONE:
+            outputs: List[bytes] = []
+        elif base_type == SIGHASH_SINGLE:
+            outputs = [b"\xff" * 8 + b"\x00"] * input_index + [self.outputs[input_index]]
+        else:
+            outputs = self.outputs
+
+        return hash256(b"".join([
+            struct.pack("<i", self.version),
+            ser_compact_size(len(inputs)), *inputs,
+            ser_compact_size(len(outputs)), *outputs,
+            struct.pack("<I", self.locktime),
+            struct.pack("<I", sighash_type),
+        ]))
+
+    def segwit_v0(self, input_index: int, script_code: bytes, amount: int, sighash_type: int) -> bytes:
+        """Returns the sighash of a segwit version 0 input, as in BIP143."""
+
+        if self._bip143 is None:
+            self._bip143 = (hash256(b"".join(self.outpoints)), hash256(b"".join(self.sequences)),
+                            hash256(b"".join(self.outputs)))
+        hash_prevouts, hash_sequence, hash_outputs = self._bip143
+
+        base_type = sighash_type & 0x1f
+        if sighash_type & SIGHASH_ANYONECANPAY:
+            hash_prevouts = b"\x00" * 32
+        if sighash_type & SIGHASH_ANYONECANPAY or base_type in (SIGHASH_NONE, SIGHASH_SINGLE):
+            hash_sequence = b"\x00" * 32
+        if base_type == SIGHASH_SINGLE and input_index < len(self.outputs):
+            hash_outputs = hash256(self.outputs[input_index])
+        elif base_type in (SIGHASH_NONE, SIGHASH_SINGLE):
+            hash_outputs = b"\x00" * 32
+
+        return hash256(b"".join([
+            struct.pack("<i", self.version),
+            hash_prevouts,
+            hash_sequence,
+            self.outpoints[input_index],
+            ser_string(script_code),
+            struct.pack("<q", amount),
+            self.sequences[input_index],
+            hash_outputs,
+            struct.pack("<I", self.locktime),
+            struct.pack("<I", sighash_type),
+        ]))
+
+    def taproot(self, input_index: int, sighash_type: int, tapleaf_hash: Optional[bytes] = None) -> bytes:
+        """Returns the sighash of a taproot input, as in BIP341 (key path) or BIP342 (script path, if tapleaf_hash is
+        given). Inputs with an annex are not supported."""
+
+        if sighash_type not in (0x00, 0x01, 0x02, 0x03, 0x81, 0x82, 0x83):
+            raise ValueError(f"Invalid sighash type for input {input_index}: {sighash_type}")
+
+        base_type = sighash_type & 0x03
+        anyone_can_pay = sighash_type & SIGHASH_ANYONECANPAY != 0
+
+        parts = [b"\x00", bytes([sighash_type]), struct.pack("<i", self.version), struct.pack("<I", self.locktime)]
+
+        if not anyone_can_pay:
+            if self._bip341 is None:
+                spent_outputs = [self.spent_output(i) for i in range(len(self.input_maps))]
+                self._bip341 = (
+                    sha256(b"".join(self.outpoints)).digest(),
+                    sha256(b"".join(struct.pack("<q", txout.nValue) for txout in spent_outputs)).digest(),
+                    sha256(b"".join(ser_string(txout.scriptPubKey) for txout in spent_outputs)).digest(),
+                    sha256(b"".join(self.sequences)).digest(),
+                    sha256(b"".join(self.outputs)).digest(),
+                )
+            parts += self._bip341[:4]
+        if base_type not in (SIGHASH_NONE, SIGHASH_SINGLE):
+            if self._bip341 is None:
+                # only the outputs are committed to with SIGHASH_ANYONECANPAY
+                parts.append(sha256(b"".join(self.outputs)).digest())
+            else:
+                parts.append(self._bip341[4])
+
+        parts.append(bytes([0 if tapleaf_hash is None else 2]))  # spend_type, with no annex
+
+        if anyone_can_pay:
+            txout = self.spent_output(input_index)
+            parts += [self.outpoints[input_index], struct.pack("<q", txout.nValue), ser_string(txout.scriptPubKey),
+                      self.sequences[input_index]]
+        else:
+            parts.append(struct.pack("<I", input_index))
+
+        if base_type == SIGHASH_SINGLE:
+            if input_index >= len(self.outputs):
+                raise ValueError(f"No output corresponding to input {input_index} for SIGHASH_SINGLE")
+            parts.append(sha256(self.outputs[input_index]).digest())
+
+        if tapleaf_hash is not None:
+            # key_version 0, and no OP_CODESEPARATOR executed
+            parts += [tapleaf_hash, b"\x00", b"\xff\xff\xff\xff"]
+
+        return tagged_hash("TapSighash", b"".join(parts))
+
+
+def _is_p2sh(script: bytes) -> bool:
+    return len(script) == 23 and script[0] == 0xa9 and script[1] == 0x14 and script[22] == 0x87
+
+
+def get_signature_message(sighash_cache: SighashCache, input_index: int, part_sig: PartialSignature) -> bytes:
+    """Returns the 32-byte message signed by a partial signature of an input, according to the script it spends."""
+
+    if part_sig.tapleaf_hash is not None or len(part_sig.pubkey) == 32:
+        sighash_type = part_sig.signature[64] if len(part_sig.signature) == 65 else SIGHASH_DEFAULT
+        return sighash_cache.taproot(input_index, sighash_type, part_sig.tapleaf_hash)
+
+    sighash_type = part_sig.signature[-1]
+    input_map = sighash_cache.input_maps[input_index]
+    txout = sighash_cache.spent_output(input_index)
+
+    script = txout.scriptPubKey
+    if _is_p2sh(script):
+        script = input_map.get(_key(PartiallySignedInput.PSBT_IN_REDEEM_SCRIPT))
+        if script is None:
+            raise ValueError(f"The redeem script of input {input_index} is not in the PSBT")
+
+    if len(script) == 22 and script[0:2] == b"\x00\x14":
+        # P2WPKH
+        script_code = b"\x76\xa9\x14" + script[2:] + b"\x88\xac"
+        return sighash_cache.segwit_v0(input_index, script_code, txout.nValue, sighash_type)
+    elif len(script) == 34 and script[0:2] == b"\x00\x20":
+        script_code = input_map.get(_key(PartiallySignedInput.PSBT_IN_WITNESS_SCRIPT))
+        if script_code is None:
+            raise ValueError(f"The witness script of input {input_index} is not in the PSBT")
+        return sighash_cache.segwit_v0(input_index, script_code, txout.nValue, sighash_type)
+    else:
+        return sighash_cache.legacy(input_index, script, sighash_type)
+
+
+# Jacobian coordinates (X, Y, Z) of the points of secp256k1, for the affine point (X/Z^2, Y/Z^3); Z is 0 for the point
+# at infinity. They spare the modular inversion of each addition of the affine coordinates.
+
+_INFINITY = (1, 1, 0)
+
+
+def _jacobian_double(P: Tuple[int, int, int]) -> Tuple[int, int, int]:
+    X, Y, Z = P
+    if Z == 0 or Y == 0:
+        return _INFINITY
+    YY = Y * Y % p
+    S = 4 * X * YY % p
+    M = 3 * X * X % p
+    X3 = (M * M - 2 * S) % p
+    return (X3, (M * (S - X3) - 8 * YY * YY) % p, 2 * Y * Z % p)
+
+
+def _jacobian_add_affine(P: Tuple[int, int, int], Q: Tuple[int, int]) -> Tuple[int, int, int]:
+    X1, Y1, Z1 = P
+    if Z1 == 0:
+        return (Q[0], Q[1], 1)
+    Z1Z1 = Z1 * Z1 % p
+    H = (Q[0] * Z1Z1 - X1) % p
+    r = (Q[1] * Z1 * Z1Z1 - Y1) % p
+    if H == 0:
+        return _jacobian_double(P) if r == 0 else _INFINITY
+    HH = H * H % p
+    HHH = H * HH % p
+    V = X1 * HH % p
+    X3 = (r * r - HHH - 2 * V) % p
+    return (X3, (r * (V - X3) - Y1 * HHH) % p, Z1 * H % p)
+
+
+def _multi_mul(terms: Sequence[Tuple[Tuple[int, int], int]]) -> Tuple[int, int, int]:
+    """Returns the sum of the products k*P of the terms (P, k), with the doublings shared by all of them (Straus)."""
+
+    terms = [(P, k % n) for P, k in terms if k % n != 0]
+    R = _INFINITY
+    for bit in reversed(range(max((k.bit_length() for _, k in terms), default=0))):
+        R = _jacobian_double(R)
+        for P, k in terms:
+            if (k >> bit) & 1:
+                R = _jacobian_add_affine(R, P)
+    return R
+
+
+def _lift_x(x: int) -> Optional[Tuple[int, int]]:
+    if x >= p:
+        return None
+    c = (pow(x, 3, p) + 7) % p
+    y = pow(c, (p + 1) // 4, p)
+    if y * y % p != c:
+        return None
+    return (x, y if y & 1 == 0 else p - y)
+
+
+def _decompress(pubkey: bytes) -> Optional[Tuple[int, int]]:
+    if len(pubkey) != 33 or pubkey[0] not in (2, 3):
+        return None
+    P = _lift_x(int_from_bytes(pubkey[1:]))
+    if P is None:
+        return None
+    return P if P[1] & 1 == pubkey[0] & 1 else (P[0], p - P[1])
+
+
+def _parse_der_signature(der: bytes) -> Optional[Tuple[int, int]]:
+    """Returns (r, s) of a DER-encoded ECDSA signature, or None if it is malformed."""
+
+    if len(der) < 8 or der[0] != 0x30 or der[1] != len(der) - 2 or der[2] != 0x02:
+        return None
+    r_len = der[3]
+    if 4 + r_len + 2 > len(der) or der[4 + r_len] != 0x02:
+        return None
+    s_len = der[5 + r_len]
+    if 6 + r_len + s_len != len(der):
+        return None
+    return int_from_bytes(der[4:4 + r_len]), int_from_bytes(der[6 + r_len:])
+
+
+def _encode_der_signature(r: int, s: int) -> bytes:
+    def encode_int(x: int) -> bytes:
+        b = x.to_bytes(33, byteorder="big").lstrip(b"\x00")
+        if len(b) == 0 or b[0] & 0x80:
+            b = b"\x00" + b
+        return b"\x02" + bytes([len(b)]) + b
+
+    body = encode_int(r) + encode_int(s)
+    return b"\x30" + bytes([len(body)]) + body
+
+
+def _verify_ecdsa(msg: bytes, pubkey: bytes, der: bytes) -> bool:
+    rs = _parse_der_signature(der)
+    if rs is None:
+        return False
+    r, s = rs
+    if not (0 < r < n and 0 < s < n):
+        return False
+
+    if coincurve is not None:
+        # libsecp256k1 only accepts the signatures normalized to a low s
+        try:
+            return coincurve.PublicKey(pubkey).verify(_encode_der_signature(r, min(s, n - s)), msg, hasher=None)
+        except ValueError:
+            return False
+
+    P = _decompress(pubkey)
+    if P is None:
+        return False
+    s_inv = pow(s, n - 2, n)
+    X, _, Z = _multi_mul([(G, int_from_bytes(msg) * s_inv), (P, r * s_inv)])
+    if Z == 0:
+        return False
+    return X * pow(Z * Z, p - 2, p) % p % n == r
+
+
+def _schnorr_challenge(msg: bytes, pubkey: bytes, sig: bytes) -> int:
+    return int_from_bytes(tagged_hash("BIP0340/challenge", sig[0:32] + pubkey + msg)) % n
+
+
+def _verify_schnorr(msg: bytes, pubkey: bytes, sig: bytes) -> bool:
+    if coincurve is not None:
+        try:
+            return coincurve.PublicKeyXOnly(pubkey).verify(sig, msg)
+        except ValueError:
+            return False
+
+    P = _lift_x(int_from_bytes(pubkey))
+    r, s = int_from_bytes(sig[0:32]), int_from_bytes(sig[32:64])
+    if P is None or r >= p or s >= n:
+        return False
+    X, Y, Z = _multi_mul([(G, s), (P, n - _schnorr_challenge(msg, pubkey, sig))])
+    if Z == 0:
+        return False
+    z_inv = pow(Z, p - 2, p)
+    z_inv2 = z_inv * z_inv % p
+    return Y * z_inv2 * z_inv % p % 2 == 0 and X * z_inv2 % p == r
+
+
+def _batch_verify_schnorr(items: Sequence[Tuple[bytes, bytes, bytes]]) -> bool:
+    """Returns True if all the (msg, pubkey, signature) are valid BIP340 signatures, with the batch verification of
+    BIP340: with random a_i (and a_1 = 1), (sum a_i * s_i) * G == sum a_i * R_i + sum (a_i * e_i) * P_i."""
+
+    terms: List[Tuple[Tuple[int, int], int]] = []
+    s_sum = 0
+    for i, (msg, pubkey, sig) in enumerate(items):
+        P = _lift_x(int_from_bytes(pubkey))
+        R = _lift_x(int_from_bytes(sig[0:32]))
+        s = int_from_bytes(sig[32:64])
+        if P is None or R is None or s >= n:
+            return False
+
+        # 128-bit coefficients are enough for a probability of 2^-128 of accepting an invalid batch
+        a = 1 if i == 0 else 1 + secrets.randbits(128)
+        s_sum += a * s
+        terms += [(R, a), (P, a * _schnorr_challenge(msg, pubkey, sig))]
+
+    terms.append((G, n - s_sum % n))
+    return _multi_mul(terms)[2] == 0
+
+
+def _verify_chunk(items: Sequence[Tuple[bytes, bytes, bytes]]) -> List[bool]:
+    """Returns whether each (msg, pubkey, signature) is valid; 33-byte pubkeys are ECDSA, 32-byte ones BIP340."""
+
+    schnorr_items = [item for item in items if len(item[1]) == 32]
+    if coincurve is None and len(schnorr_items) > 1 and _batch_verify_schnorr(schnorr_items):
+        return [len(pubkey) == 32 or _verify_ecdsa(msg, pubkey, sig) for msg, pubkey, sig in items]
+
+    # the signatures are verified one by one, which also finds the invalid ones when the batch fails
+    return [_verify_schnorr(msg, pubkey, sig) if len(pubkey) == 32 else _verify_ecdsa(msg, pubkey, sig)
+            for msg, pubkey, sig in items]
+
+
+def verify_partial_signatures(psbt: Union[PSBT, RawPsbt, bytes, str, MerkleizedPsbt],
+                              signatures: Sequence[Tuple[int, PartialSignature]],
+                              executor: Optional[Executor] = None) -> None:
+    """
+    Verifies the partial signatures returned by sign_psbt for `psbt`, against the sighashes recomputed from it.
+
+    :param psbt: The PSBT that was signed, as in `sign_psbt`.
+    :param signatures: The input index and the partial signature of each signature.
+    :param executor: If given, the signatures are verified in chunks by its workers; with the Python arithmetic, a
+        `ProcessPoolExecutor` is needed to use several cores.
+    :raises InvalidSignatureError: for the first invalid signature.
+    :raises ValueError: if a sighash cannot be computed, for example if the output spent by an input is missing.
+    """
+
+    if isinstance(psbt, MerkleizedPsbt):
+        global_map, input_maps, output_maps = psbt.global_map, psbt.input_maps, psbt.output_maps
+    else:
+        if isinstance(psbt, (bytes, str)):
+            psbt = normalize_psbt(psbt)
+        n_inputs = len(psbt.input_maps) if isinstance(psbt, RawPsbt) else len(psbt.inputs)
+        n_outputs = len(psbt.output_maps) if isinstance(psbt, RawPsbt) else len(psbt.outputs)
+        global_map = get_v2_global_map(psbt)
+        input_maps = [get_v2_input_map(psbt, i) for i in range(n_inputs)]
+        output_maps = [get_v2_output_map(psbt, i) for i in range(n_outputs)]
+
+    sighash_cache = SighashCache(global_map, input_maps, output_maps)
+
+    items: List[Tuple[bytes, bytes, bytes]] = []
+    for input_index, part_sig in signatures:
+        if input_index >= len(input_maps):
+            raise InvalidSignatureError(input_index, part_sig)
+
+        if len(part_sig.pubkey) == 32:
+            if len(part_sig.signature) not in (64, 65):
+                raise InvalidSignatureError(input_index, part_sig)
+            sig = part_sig.signature[0:64]
+        else:
+            sig = part_sig.signature[:-1]
+        items.append((get_signature_message(sighash_cache, input_index, part_sig), part_sig.pubkey, sig))
+
+    chunks = [items[i:i + VERIFICATION_CHUNK_SIZE] for i in range(0, len(items), VERIFICATION_CHUNK_SIZE)]
+    if executor is None or len(chunks) <= 1:
+        results = [valid for chunk in chunks for valid in _verify_chunk(chunk)]
+    else:
+        results = [valid for chunk_results in executor.map(_verify_chunk, chunks) for valid in chunk_results]
+
+    for (input_index, part_sig), valid in zip(signatures, results):
+        if not valid:
+            raise InvalidSignatureError(input_index, part_sig)
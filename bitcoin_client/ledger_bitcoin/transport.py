@@ -101,7 +101,8 @@ class Transport:
         opt : Optional[int]
             Optional parameter: Opt (1 byte).
         lc : int
-            Number of bytes in the payload: Lc (1 byte).
+            Number of bytes in the payload: Lc (1 byte, or 3 bytes for extended-length APDUs if it
+            is larger than 255).
 
         Returns
         -------
@@ -112,6 +113,12 @@ class Transport:
         ins = cast(int, ins.value) if isinstance(
             ins, enum.IntEnum) else cast(int, ins)
 
+        length = 1 + lc if opt else lc  # add option to length
+        if length > 255:
+            # extended-length APDU: 0x00, followed by the length as a big-endian 16-bit integer
+            header = struct.pack(">BBBBBH", cla, ins, p1, p2, 0, length)
+            return header + bytes([opt]) if opt else header
+
         if opt:
             return struct.pack("BBBBBB",
                                cla,
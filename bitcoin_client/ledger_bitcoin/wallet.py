@@ -1,7 +1,7 @@
 import re
 
 from enum import IntEnum
-from typing import List
+from typing import List, Optional, Tuple
 
 from hashlib import sha256
 
@@ -19,18 +19,36 @@ class WalletPolicyBase:
         self.name = name
         self.version = version
 
+        # the last serialization and its id, recomputed if a field changes
+        self._serialization: Optional[Tuple[tuple, bytes]] = None
+        self._id: Optional[Tuple[bytes, bytes]] = None
+
         if (version != WalletType.WALLET_POLICY_V1 and version != WalletType.WALLET_POLICY_V2):
             raise ValueError("Invalid wallet policy version")
 
-    def serialize(self) -> bytes:
+    def cache_key(self) -> tuple:
+        """Returns a hashable value of all the fields that the serialization depends on; unlike the id, it is
+        computed without hashing."""
+        return (self.version, self.name)
+
+    def _serialize(self) -> bytes:
         return b"".join([
             self.version.value.to_bytes(1, byteorder="big"),
             serialize_str(self.name)
         ])
 
+    def serialize(self) -> bytes:
+        key = self.cache_key()
+        if self._serialization is None or self._serialization[0] != key:
+            self._serialization = (key, self._serialize())
+        return self._serialization[1]
+
     @property
     def id(self) -> bytes:
-        return sha256(self.serialize()).digest()
+        serialization = self.serialize()
+        if self._id is None or self._id[0] is not serialization:
+            self._id = (serialization, sha256(serialization).digest())
+        return self._id[1]
 
 
 class WalletPolicy(WalletPolicyBase):
@@ -46,6 +64,8 @@ class WalletPolicy(WalletPolicyBase):
        - 32-bytes : root of the Merkle tree of all the keys information.
 
     The specific format of the keys is deferred to subclasses.
+
+    The serialization and the id are memoized, and only recomputed after one of the fields changes.
     """
 
     def __init__(self, name: str, descriptor_template: str, keys_info: List[str], version: WalletType = WalletType.WALLET_POLICY_V2):
@@ -57,13 +77,16 @@ class WalletPolicy(WalletPolicyBase):
     def n_keys(self) -> int:
         return len(self.keys_info)
 
-    def serialize(self) -> bytes:
+    def cache_key(self) -> tuple:
+        return (super().cache_key(), self.descriptor_template, tuple(self.keys_info))
+
+    def _serialize(self) -> bytes:
         keys_info_hashes = map(lambda k: element_hash(k.encode()), self.keys_info)
 
         descriptor_template_sha256 = sha256(self.descriptor_template.encode()).digest()
 
         return b"".join([
-            super().serialize(),
+            super()._serialize(),
             write_varint(len(self.descriptor_template.encode())),
             self.descriptor_template.encode() if self.version == WalletType.WALLET_POLICY_V1 else descriptor_template_sha256,
             write_varint(len(self.keys_info)),
@@ -0,0 +1,51 @@
+import Transport from "@ledgerhq/hw-transport";
+
+import { TraceCollector } from "../lib/apduTrace";
+import { AppClient } from "../lib/appClient";
+import { hashLeaf } from "../lib/merkle";
+
+// a transport returning the given responses in order, and recording the APDUs
+function fakeTransport(responses: Buffer[]): [Transport, Buffer[]] {
+  const apdus: Buffer[] = [];
+  const transport = {
+    send: async (cla: number, ins: number, p1: number, p2: number, data: Buffer) => {
+      apdus.push(Buffer.concat([Buffer.from([cla, ins, p1, p2, data.length]), data]));
+      return responses.shift();
+    },
+  };
+  return [transport as unknown as Transport, apdus];
+}
+
+describe("TraceCollector", () => {
+  it("records the APDUs and the client commands of a session", async () => {
+    const message = Buffer.from("hello", "ascii");
+    const signature = Buffer.alloc(65, 1);
+
+    const [transport, apdus] = fakeTransport([
+      // GET_PREIMAGE of the only chunk of the message
+      Buffer.concat([Buffer.from([0x40, 0x00]), hashLeaf(message), Buffer.from([0xe0, 0x00])]),
+      Buffer.concat([signature, Buffer.from([0x90, 0x00])]),
+    ]);
+
+    const collector = new TraceCollector();
+    const client = new AppClient(transport, collector);
+    expect(await client.signMessage(message, "m/44'/1'/0'")).toEqual(signature.toString("base64"));
+
+    const sessions = collector.sessions();
+    expect(sessions.length).toEqual(1);
+    expect(sessions[0].map((e) => e.name)).toEqual(["SIGN_MESSAGE", "GET_PREIMAGE"]);
+    expect(sessions[0][1].clientCommand).toEqual(0x40);
+    expect(sessions[0].map((e) => e.request)).toEqual(apdus);
+
+    const histogram = collector.histogram();
+    expect(histogram.get("SIGN_MESSAGE")?.count).toEqual(1);
+    expect(histogram.get("GET_PREIMAGE")?.bytesReceived).toEqual(2 + 32 + 2);
+
+    expect(collector.exportTrace().split("\n")).toEqual([
+      `=> ${apdus[0].toString("hex")}`,
+      `<= 4000${hashLeaf(message).toString("hex")}e000`,
+      `=> ${apdus[1].toString("hex")}`,
+      `<= ${signature.toString("hex")}9000`,
+    ]);
+  });
+});
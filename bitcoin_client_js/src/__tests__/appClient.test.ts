@@ -13,7 +13,7 @@ import { listen } from "@ledgerhq/logs";
 import type { Log } from "@ledgerhq/logs";
 
 
-import { AppClient, DefaultWalletPolicy, PsbtV2, WalletPolicy } from ".."
+import { AppClient, AppFeature, DefaultWalletPolicy, PsbtV2, WalletPolicy } from ".."
 
 jest.setTimeout(10000);
 
@@ -134,6 +134,12 @@ describe("test AppClient", () => {
     expect(result).toEqual("f5acc2fd");
   });
 
+  it("can get the app features", async () => {
+    const [maxProtocolVersion, features] = await app.getAppFeatures();
+    expect(maxProtocolVersion).toEqual(2);
+    expect(features & AppFeature.QUEUED_YIELDS).not.toEqual(0);
+  });
+
   it("can get an extended pubkey", async () => {
     const result = await app.getExtendedPubkey("m/49'/1'/1'/1/3", false);
 
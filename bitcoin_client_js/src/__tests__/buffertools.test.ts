@@ -0,0 +1,44 @@
+import { BufferReader, BufferWriter, unsafeTo64bitLE } from "../lib/buffertools";
+import { createVarint } from "../lib/varint";
+
+describe("BufferWriter", () => {
+  it("serializes the same bytes as the separate encodings", async () => {
+    const values = [0, 1, 0xfc, 0xfd, 0xffff, 0x10000, 0xffffffff, 0x100000000, Number.MAX_SAFE_INTEGER];
+    const slice = Buffer.alloc(1000, 7);
+
+    const buf = new BufferWriter(1);
+    const expected: Buffer[] = [];
+    for (const value of values) {
+      buf.writeVarInt(value);
+      buf.writeUInt64(value);
+      expected.push(createVarint(value), unsafeTo64bitLE(value));
+    }
+    buf.writeInt32(-5);
+    buf.writeUInt32(0xdeadbeef);
+    buf.writeVarSlice(slice);
+    expected.push(Buffer.from("fbffffffefbeadde", "hex"), createVarint(slice.length), slice);
+
+    expect(buf.buffer()).toEqual(Buffer.concat(expected));
+  });
+
+  it("returns results that are not modified by the later writes", async () => {
+    const buf = new BufferWriter(4);
+    buf.writeUInt32(1);
+    const first = buf.buffer();
+    buf.writeUInt32(2);
+    buf.writeSlice(Buffer.alloc(100, 3));
+
+    expect(first).toEqual(Buffer.from([1, 0, 0, 0]));
+    const reader = new BufferReader(buf.buffer());
+    expect(reader.readUInt32()).toEqual(1);
+    expect(reader.readUInt32()).toEqual(2);
+    expect(reader.available()).toEqual(100);
+  });
+
+  it("throws for varints out of range", async () => {
+    const buf = new BufferWriter();
+    expect(() => buf.writeVarInt(-1)).toThrow(RangeError);
+    expect(() => buf.writeVarInt(Number.MAX_SAFE_INTEGER + 1)).toThrow(RangeError);
+    expect(buf.buffer().length).toEqual(0);
+  });
+});
@@ -0,0 +1,85 @@
+import { crypto } from "bitcoinjs-lib";
+import { MessageChannel } from "worker_threads";
+
+import {
+  ClientCommandWorker,
+  prepareSignPsbtInterpreter,
+  serveClientCommands,
+} from "../lib/clientCommandWorker";
+import { ClientCommandCode, ClientCommandInterpreter } from "../lib/clientCommands";
+import { MerkelizedPsbt } from "../lib/merkelizedPsbt";
+import { DefaultWalletPolicy } from "../lib/policy";
+import { PsbtV2 } from "../lib/psbtv2";
+
+describe("ClientCommandWorker", () => {
+  const psbtBuf = Buffer.from(
+    "cHNidP8BAAoBAAAAAAAAAAAAAQIEAgAAAAEDBAAAAAABBAECAQUBAgH7BAIAAAAAAQBxAgAAAAGTarLgEHL3k8/kyXdU3hth/gPn22U2yLLyHdC1dCxIRQEAAAAA/v///wLe4ccAAAAAABYAFOt418QL8QY7Dj/OKcNWW2ichVmrECcAAAAAAAAWABQjGNZvhP71xIdfkzsDjcY4MfjaE/mXHgABAR8QJwAAAAAAABYAFCMY1m+E/vXEh1+TOwONxjgx+NoTIgYDRV7nztyXsLpDW4AGb8ksljo0xgAxeYHRNTMMTuQ6x6MY9azC/VQAAIABAACAAAAAgAAAAAABAAAAAQ4gniz+J/Cth7eKI31ddAXUowZmyjYdWFpGew3+QiYrTbQBDwQBAAAAARAE/f///wESBAAAAAAAAQBxAQAAAAEORx706Sway1HvyGYPjT9pk26pybK/9y/5vIHFHvz0ZAEAAAAAAAAAAAJgrgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsrwYyAAAAAAAWABTcKG4M0ua9N86+nsNJ+18IkFZy/AAAAAABAR9grgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsIgYCcbW3ea2HCDhYd5e89vDHrsWr52pwnXJPSNLibPh08KAY9azC/VQAAIABAACAAAAAgAEAAAAAAAAAAQ4gr7+uBlkPdB/xr1m2rEYRJjNqTEqC21U99v76tzesM/MBDwQAAAAAARAE/f///wESBAAAAAAAIgICKexHcnEx7SWIogxG7amrt9qm9J/VC6/nC5xappYcTswY9azC/VQAAIABAACAAAAAgAEAAAAKAAAAAQMIqDoGAAAAAAABBBYAFOs4+puBKPgfJule2wxf+uqDaQ/kAAEDCOCTBAAAAAAAAQQiACA/qWbJ3c3C/ZbkpeG8dlufr2zos+tPEQSq1r33cyTlvgA=",
+    "base64"
+  );
+  const walletPolicy = new DefaultWalletPolicy(
+    "wpkh(@0/**)",
+    "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+  );
+
+  let channel: MessageChannel;
+  let worker: ClientCommandWorker;
+
+  beforeEach(() => {
+    channel = new MessageChannel();
+    serveClientCommands(channel.port2);
+    worker = new ClientCommandWorker(channel.port1);
+  });
+
+  afterEach(() => {
+    channel.port1.close();
+    channel.port2.close();
+  });
+
+  it("answers the client commands like the local interpreter", async () => {
+    const psbt = new PsbtV2();
+    psbt.deserialize(psbtBuf);
+
+    const localInterpreter = new ClientCommandInterpreter();
+    const localRequestData = prepareSignPsbtInterpreter(
+      localInterpreter,
+      new MerkelizedPsbt(psbt),
+      walletPolicy,
+      null
+    );
+
+    const commands: ClientCommandCode[] = [];
+    const [interpreter, requestData] = await worker.prepareSignPsbt(
+      psbt,
+      walletPolicy,
+      null,
+      false,
+      undefined,
+      (code) => commands.push(code)
+    );
+    expect(requestData).toEqual(localRequestData);
+
+    const request = Buffer.concat([
+      Buffer.from([ClientCommandCode.GET_PREIMAGE, 0x00]),
+      crypto.sha256(walletPolicy.serialize()),
+    ]);
+    expect(await interpreter.execute(request)).toEqual(
+      localInterpreter.execute(request)
+    );
+
+    // the yielded results are kept in the main thread
+    await interpreter.execute(Buffer.from([ClientCommandCode.YIELD, 1, 2, 3]));
+    expect(interpreter.getYielded()).toEqual([Buffer.from([1, 2, 3])]);
+
+    expect(commands).toEqual([ClientCommandCode.GET_PREIMAGE, ClientCommandCode.YIELD]);
+  });
+
+  it("rejects the requests that fail in the worker", async () => {
+    const psbt = new PsbtV2();
+    psbt.deserialize(psbtBuf);
+
+    const [interpreter] = await worker.prepareSignPsbt(psbt, walletPolicy, null, false);
+    await expect(interpreter.execute(Buffer.from([0x7f]))).rejects.toThrow(
+      "Unexpected command code 127"
+    );
+  });
+});
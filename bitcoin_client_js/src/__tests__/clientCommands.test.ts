@@ -0,0 +1,91 @@
+import { crypto } from "bitcoinjs-lib";
+
+import { ClientCommandCode, ClientCommandInterpreter, KnownData } from "../lib/clientCommands";
+import { hashLeaf, Merkle } from "../lib/merkle";
+import { WalletPolicy } from "../lib/policy";
+
+describe("GetMerkleLeafIndexCommand", () => {
+  const elements = ["a", "b", "c", "b"].map((s) => Buffer.from(s, "ascii"));
+  const root = new Merkle(elements.map((el) => hashLeaf(el))).getRoot();
+
+  const interpreter = new ClientCommandInterpreter();
+  interpreter.addKnownList(elements);
+
+  const getLeafIndex = (el: Buffer) =>
+    interpreter.execute(Buffer.concat([Buffer.from([0x42]), root, hashLeaf(el)]));
+
+  it("returns the index of the first leaf with the requested hash", async () => {
+    expect(getLeafIndex(elements[0])).toEqual(Buffer.from([1, 0]));
+    expect(getLeafIndex(elements[1])).toEqual(Buffer.from([1, 1]));
+    expect(getLeafIndex(elements[2])).toEqual(Buffer.from([1, 2]));
+  });
+
+  it("returns not found for unknown leaves", async () => {
+    expect(getLeafIndex(Buffer.from("d", "ascii"))).toEqual(Buffer.from([0, 0]));
+  });
+});
+
+describe("GetPreimageCommand", () => {
+  it("returns the known preimages", async () => {
+    const interpreter = new ClientCommandInterpreter();
+    const preimage = Buffer.from("preimage", "ascii");
+    interpreter.addKnownPreimage(preimage);
+
+    const response = interpreter.execute(
+      Buffer.concat([Buffer.from([0x40, 0x00]), crypto.sha256(preimage)])
+    );
+    expect(response).toEqual(
+      Buffer.concat([Buffer.from([preimage.length, preimage.length]), preimage])
+    );
+  });
+});
+
+describe("KnownData", () => {
+  it("shares the known data of a wallet policy among interpreters", async () => {
+    const walletPolicy = new WalletPolicy("Cold storage", "wsh(sortedmulti(2,@0/**,@1/**))", [
+      "[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF",
+      "[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK",
+    ]);
+    const known = KnownData.ofWalletPolicy(walletPolicy);
+
+    for (let i = 0; i < 2; i++) {
+      const interpreter = new ClientCommandInterpreter();
+      interpreter.addKnownData(known);
+
+      const serialized = walletPolicy.serialize();
+      const response = interpreter.execute(
+        Buffer.concat([Buffer.from([0x40, 0x00]), crypto.sha256(serialized)])
+      );
+      expect(response).toEqual(
+        Buffer.concat([Buffer.from([serialized.length, serialized.length]), serialized])
+      );
+
+      const keysRoot = walletPolicy.getKeysTree().getRoot();
+      const keyHash = hashLeaf(Buffer.from(walletPolicy.keys[1], "ascii"));
+      expect(
+        interpreter.execute(Buffer.concat([Buffer.from([0x42]), keysRoot, keyHash]))
+      ).toEqual(Buffer.from([1, 1]));
+    }
+    expect(walletPolicy.getId()).toEqual(crypto.sha256(walletPolicy.serialize()));
+  });
+});
+
+describe("YieldCommand", () => {
+  it("returns the results yielded so far, and reports the commands", async () => {
+    const codes: ClientCommandCode[] = [];
+    const interpreter = new ClientCommandInterpreter(undefined, (code) => codes.push(code));
+    interpreter.setQueuedYields(true);
+
+    interpreter.execute(Buffer.from([0x10, 0x01, 0xaa, 0x10, 0x01, 0xbb]));
+    expect(interpreter.takeYielded()).toEqual([Buffer.from([0xaa]), Buffer.from([0xbb])]);
+    expect(interpreter.takeYielded()).toEqual([]);
+
+    const preimage = Buffer.from("preimage", "ascii");
+    interpreter.addKnownPreimage(preimage);
+    interpreter.execute(
+      Buffer.concat([Buffer.from([0x10, 0x01, 0xcc, 0x40, 0x00]), crypto.sha256(preimage)])
+    );
+    expect(interpreter.takeYielded()).toEqual([Buffer.from([0xcc])]);
+    expect(codes).toEqual([ClientCommandCode.YIELD, ClientCommandCode.GET_PREIMAGE]);
+  });
+});
@@ -0,0 +1,52 @@
+import { MerkelizedPsbt } from "../lib/merkelizedPsbt";
+import { PsbtV2 } from "../lib/psbtv2";
+
+function expectSameCommitments(a: MerkelizedPsbt, b: MerkelizedPsbt) {
+  expect(a.getGlobalKeysValuesRoot()).toEqual(b.getGlobalKeysValuesRoot());
+  expect(a.inputMapCommitments).toEqual(b.inputMapCommitments);
+  expect(a.outputMapCommitments).toEqual(b.outputMapCommitments);
+  expect(a.inputMapsTree.getRoot()).toEqual(b.inputMapsTree.getRoot());
+  expect(a.outputMapsTree.getRoot()).toEqual(b.outputMapsTree.getRoot());
+}
+
+describe("MerkelizedPsbt", () => {
+  const psbtBuf = Buffer.from(
+    "cHNidP8BAAoBAAAAAAAAAAAAAQIEAgAAAAEDBAAAAAABBAECAQUBAgH7BAIAAAAAAQBxAgAAAAGTarLgEHL3k8/kyXdU3hth/gPn22U2yLLyHdC1dCxIRQEAAAAA/v///wLe4ccAAAAAABYAFOt418QL8QY7Dj/OKcNWW2ichVmrECcAAAAAAAAWABQjGNZvhP71xIdfkzsDjcY4MfjaE/mXHgABAR8QJwAAAAAAABYAFCMY1m+E/vXEh1+TOwONxjgx+NoTIgYDRV7nztyXsLpDW4AGb8ksljo0xgAxeYHRNTMMTuQ6x6MY9azC/VQAAIABAACAAAAAgAAAAAABAAAAAQ4gniz+J/Cth7eKI31ddAXUowZmyjYdWFpGew3+QiYrTbQBDwQBAAAAARAE/f///wESBAAAAAAAAQBxAQAAAAEORx706Sway1HvyGYPjT9pk26pybK/9y/5vIHFHvz0ZAEAAAAAAAAAAAJgrgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsrwYyAAAAAAAWABTcKG4M0ua9N86+nsNJ+18IkFZy/AAAAAABAR9grgoAAAAAABYAFDXG4N1tPISxa6iF3Kc6yGPQtZPsIgYCcbW3ea2HCDhYd5e89vDHrsWr52pwnXJPSNLibPh08KAY9azC/VQAAIABAACAAAAAgAEAAAAAAAAAAQ4gr7+uBlkPdB/xr1m2rEYRJjNqTEqC21U99v76tzesM/MBDwQAAAAAARAE/f///wESBAAAAAAAIgICKexHcnEx7SWIogxG7amrt9qm9J/VC6/nC5xappYcTswY9azC/VQAAIABAACAAAAAgAEAAAAKAAAAAQMIqDoGAAAAAAABBBYAFOs4+puBKPgfJule2wxf+uqDaQ/kAAEDCOCTBAAAAAAAAQQiACA/qWbJ3c3C/ZbkpeG8dlufr2zos+tPEQSq1r33cyTlvgA=",
+    "base64"
+  );
+
+  it("only merkelizes again the modified maps on update", async () => {
+    const psbt = new PsbtV2();
+    psbt.deserialize(psbtBuf);
+    const merkelizedPsbt = new MerkelizedPsbt(psbt);
+    const inputCommitment0 = merkelizedPsbt.inputMapCommitments[0];
+
+    merkelizedPsbt.setInputPartialSig(
+      1,
+      Buffer.from(
+        "0271b5b779ad8708385877977bcf6f0c7aec5abe76a709d724f48d2e26cf874f0a",
+        "hex"
+      ),
+      Buffer.alloc(71, 1)
+    );
+    merkelizedPsbt.setOutputAmount(0, 1000);
+    merkelizedPsbt.setGlobalFallbackLocktime(42);
+    merkelizedPsbt.update();
+
+    expect(merkelizedPsbt.inputMapCommitments[0]).toBe(inputCommitment0);
+    expectSameCommitments(merkelizedPsbt, new MerkelizedPsbt(merkelizedPsbt));
+  });
+
+  it("merkelizes again all the maps if an input is added", async () => {
+    const psbt = new PsbtV2();
+    psbt.deserialize(psbtBuf);
+    const merkelizedPsbt = new MerkelizedPsbt(psbt);
+
+    merkelizedPsbt.setGlobalInputCount(3);
+    merkelizedPsbt.setInputOutputIndex(2, 5);
+    merkelizedPsbt.update();
+
+    expect(merkelizedPsbt.inputMerkleMaps.length).toBe(3);
+    expectSameCommitments(merkelizedPsbt, new MerkelizedPsbt(merkelizedPsbt));
+  });
+});
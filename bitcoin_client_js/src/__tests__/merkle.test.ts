@@ -0,0 +1,75 @@
+import { crypto } from "bitcoinjs-lib";
+
+import { hashLeaf, Merkle } from "../lib/merkle";
+
+// the recursive definition of the root in doc/merkle.md
+function root(leaves: Buffer[]): Buffer {
+  if (leaves.length == 1) {
+    return leaves[0];
+  }
+  let leftCount = 1;
+  while (2 * leftCount < leaves.length) leftCount *= 2;
+  return crypto.sha256(
+    Buffer.concat([
+      Buffer.from([1]),
+      root(leaves.slice(0, leftCount)),
+      root(leaves.slice(leftCount)),
+    ])
+  );
+}
+
+// computes the root from a leaf and its proof, as the app does
+function rootFromProof(size: number, index: number, leaf: Buffer, proof: Buffer[]): Buffer {
+  if (size == 1) {
+    expect(proof).toEqual([]);
+    return leaf;
+  }
+  let leftCount = 1;
+  while (2 * leftCount < size) leftCount *= 2;
+  const sibling = proof[proof.length - 1];
+  const rest = proof.slice(0, -1);
+  return index < leftCount
+    ? crypto.sha256(
+        Buffer.concat([Buffer.from([1]), rootFromProof(leftCount, index, leaf, rest), sibling])
+      )
+    : crypto.sha256(
+        Buffer.concat([
+          Buffer.from([1]),
+          sibling,
+          rootFromProof(size - leftCount, index - leftCount, leaf, rest),
+        ])
+      );
+}
+
+describe("Merkle", () => {
+  const makeLeaves = (n: number) =>
+    [...Array(n).keys()].map((i) => hashLeaf(Buffer.from([i])));
+
+  it("computes the root and the proofs of the leaves", async () => {
+    for (let n = 1; n <= 40; n++) {
+      const leaves = makeLeaves(n);
+      const mt = new Merkle(leaves);
+      expect(mt.size()).toBe(n);
+      expect(mt.getRoot()).toEqual(root(leaves));
+      for (let i = 0; i < n; i++) {
+        expect(rootFromProof(n, i, leaves[i], mt.getProof(i))).toEqual(mt.getRoot());
+      }
+    }
+  });
+
+  it("returns a zero root for an empty tree", async () => {
+    expect(new Merkle([]).getRoot()).toEqual(Buffer.alloc(32, 0));
+  });
+
+  it("updates the root when a leaf is replaced", async () => {
+    for (const n of [1, 2, 5, 8, 13]) {
+      const leaves = makeLeaves(n);
+      const mt = new Merkle(leaves);
+      const oldRoot = mt.getRoot();
+      leaves[n - 1] = hashLeaf(Buffer.from("new", "ascii"));
+      mt.setLeaf(n - 1, leaves[n - 1]);
+      expect(mt.getRoot()).toEqual(root(leaves));
+      expect(oldRoot).not.toEqual(mt.getRoot());
+    }
+  });
+});
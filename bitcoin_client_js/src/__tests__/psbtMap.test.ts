@@ -0,0 +1,32 @@
+import { PsbtMap } from "../lib/psbtMap";
+
+describe("PsbtMap", () => {
+  it("keeps the keys sorted on insertion", async () => {
+    const map = new PsbtMap();
+    map.set(0x10, Buffer.from([]), Buffer.from("a"));
+    map.set(0x06, Buffer.from("0345", "hex"), Buffer.from("b"));
+    map.setKey(Buffer.from("0602", "hex"), Buffer.from("c"));
+    map.set(0x00, Buffer.from([]), Buffer.from("d"));
+    map.set(0x06, Buffer.from("0345", "hex"), Buffer.from("e"));
+
+    expect(map.size).toEqual(4);
+    expect(map.keys().map((k) => k.toString("hex"))).toEqual(["00", "0602", "060345", "10"]);
+    expect(map.values().map((v) => v.toString())).toEqual(["d", "c", "e", "a"]);
+    expect(map.get(0x06, Buffer.from("02", "hex"))).toEqual(Buffer.from("c"));
+    expect(map.get(0x06, Buffer.from([]))).toBeUndefined();
+  });
+
+  it("deletes the entries of the given key types", async () => {
+    const map = new PsbtMap();
+    map.set(0x01, Buffer.from([]), Buffer.from("a"));
+    map.set(0x02, Buffer.from("aa", "hex"), Buffer.from("b"));
+    map.set(0x02, Buffer.from("bb", "hex"), Buffer.from("c"));
+    map.set(0x03, Buffer.from([]), Buffer.from("d"));
+    const copy = map.copy();
+
+    map.deleteKeyTypes([0x02, 0x03]);
+
+    expect(map.keys()).toEqual([Buffer.from([0x01])]);
+    expect(copy.size).toEqual(4);
+  });
+});
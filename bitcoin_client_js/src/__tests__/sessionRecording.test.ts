@@ -0,0 +1,42 @@
+import fs from "fs";
+import path from "path";
+
+import {
+  createSessionInterpreter,
+  parseSessionRecording,
+  replaySession,
+} from "../lib/sessionRecording";
+
+// recorded with the Python client, and also replayed by its tests and by the ones of the Rust client
+const recordingPath = path.resolve(
+  process.cwd(),
+  "..",
+  "tests/sessions/sign_psbt_sh_wpkh.json"
+);
+
+describe("sessionRecording", () => {
+  const recording = parseSessionRecording(
+    fs.readFileSync(recordingPath).toString()
+  );
+
+  it("replays the recorded client commands", () => {
+    expect(recording.clientCommands.length).toBeGreaterThan(0);
+    replaySession(recording);
+  });
+
+  it("detects a different response", () => {
+    const [request, response] = recording.clientCommands[3];
+    const modified = Buffer.from(response);
+    modified[0] ^= 1;
+    const altered = {
+      ...recording,
+      clientCommands: [
+        ...recording.clientCommands.slice(0, 3),
+        [request, modified] as [Buffer, Buffer],
+      ],
+    };
+    expect(() =>
+      replaySession(altered, createSessionInterpreter(altered))
+    ).toThrow("Unexpected response to the client command at position 3");
+  });
+});
@@ -1,14 +1,45 @@
-import AppClient from './lib/appClient';
+import {
+  ApduExchange,
+  ApduTracer,
+  CommandStats,
+  TraceCollector
+} from './lib/apduTrace';
+import AppClient, { AppFeature } from './lib/appClient';
+import {
+  ClientCommandWorker,
+  serveClientCommands,
+  WorkerEndpoint,
+} from './lib/clientCommandWorker';
+import { ClientCommandCode } from './lib/clientCommands';
+import { MerkelizedPsbt } from './lib/merkelizedPsbt';
 import {
   DefaultDescriptorTemplate,
   DefaultWalletPolicy,
   WalletPolicy
 } from './lib/policy';
 import { PsbtV2 } from './lib/psbtv2';
+import {
+  parseSessionRecording,
+  replaySession,
+  SessionRecording
+} from './lib/sessionRecording';
 
 export {
+  ApduExchange,
+  ApduTracer,
   AppClient,
+  AppFeature,
+  ClientCommandCode,
+  ClientCommandWorker,
+  CommandStats,
+  MerkelizedPsbt,
+  TraceCollector,
   PsbtV2,
+  parseSessionRecording,
+  replaySession,
+  serveClientCommands,
+  SessionRecording,
+  WorkerEndpoint,
   DefaultDescriptorTemplate,
   DefaultWalletPolicy,
   WalletPolicy
@@ -0,0 +1,123 @@
+/**
+ * An APDU sent to the device, with its response.
+ */
+export interface ApduExchange {
+  readonly cla: number;
+  readonly ins: number;
+  /** For the CONTINUE_INTERRUPTED APDUs, the code of the client command that the APDU responds to. */
+  readonly clientCommand?: number;
+  /** The name of the client command if any, otherwise the name of the instruction. */
+  readonly name: string;
+  /** The encoded APDU. */
+  readonly request: Buffer;
+  /** The response data, without the status word. */
+  readonly response: Buffer;
+  readonly sw: number;
+  /** Milliseconds from sending the APDU to receiving its response. */
+  readonly deviceTime: number;
+  /**
+   * Milliseconds spent by the host since the previous response of the device, executing the client command;
+   * 0 for the first APDU of a command.
+   */
+  readonly hostTime: number;
+}
+
+/**
+ * Receives each APDU exchange of an `AppClient`.
+ */
+export interface ApduTracer {
+  onExchange(exchange: ApduExchange): void;
+}
+
+/**
+ * Statistics of the APDU exchanges of one type.
+ */
+export interface CommandStats {
+  count: number;
+  bytesSent: number;
+  bytesReceived: number; // including the status words
+  deviceTime: number;
+  hostTime: number;
+}
+
+/**
+ * Returns the current time in milliseconds, with sub-millisecond resolution where available.
+ */
+export function now(): number {
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  const performance = (globalThis as any).performance;
+  return performance !== undefined ? performance.now() : Date.now();
+}
+
+/**
+ * Returns the statistics of the exchanges, by name of the instruction or client command.
+ */
+export function histogram(
+  exchanges: Iterable<ApduExchange>
+): Map<string, CommandStats> {
+  const result = new Map<string, CommandStats>();
+  for (const exchange of exchanges) {
+    let stats = result.get(exchange.name);
+    if (stats === undefined) {
+      stats = {
+        count: 0,
+        bytesSent: 0,
+        bytesReceived: 0,
+        deviceTime: 0,
+        hostTime: 0,
+      };
+      result.set(exchange.name, stats);
+    }
+    stats.count += 1;
+    stats.bytesSent += exchange.request.length;
+    stats.bytesReceived += exchange.response.length + 2;
+    stats.deviceTime += exchange.deviceTime;
+    stats.hostTime += exchange.hostTime;
+  }
+  return result;
+}
+
+/**
+ * An `ApduTracer` that records all the APDU exchanges. It can be shared by the clients of several devices.
+ */
+export class TraceCollector implements ApduTracer {
+  readonly exchanges: ApduExchange[] = [];
+
+  onExchange(exchange: ApduExchange): void {
+    this.exchanges.push(exchange);
+  }
+
+  /**
+   * Returns the recorded exchanges split by command: each session starts with a command, followed by the exchanges
+   * of the client commands it requested.
+   */
+  sessions(): ApduExchange[][] {
+    const result: ApduExchange[][] = [];
+    for (const exchange of this.exchanges) {
+      if (exchange.clientCommand === undefined || result.length === 0) {
+        result.push([]);
+      }
+      result[result.length - 1].push(exchange);
+    }
+    return result;
+  }
+
+  histogram(): Map<string, CommandStats> {
+    return histogram(this.exchanges);
+  }
+
+  /**
+   * Returns the recorded exchanges as "=> <apdu>" and "<= <response><sw>" lines, the format of the `RecordStore` of
+   * @ledgerhq/hw-transport-mocker, that can replay them.
+   */
+  exportTrace(): string {
+    const lines: string[] = [];
+    for (const exchange of this.exchanges) {
+      const sw = Buffer.alloc(2);
+      sw.writeUInt16BE(exchange.sw);
+      lines.push(`=> ${exchange.request.toString('hex')}`);
+      lines.push(`<= ${exchange.response.toString('hex')}${sw.toString('hex')}`);
+    }
+    return lines.join('\n');
+  }
+}
@@ -1,7 +1,17 @@
 import Transport from '@ledgerhq/hw-transport';
 
+import { ApduTracer, now } from './apduTrace';
 import { pathElementsToBuffer, pathStringToArray } from './bip32';
-import { ClientCommandInterpreter } from './clientCommands';
+import {
+  ClientCommandWorker,
+  prepareSignPsbtInterpreter,
+} from './clientCommandWorker';
+import {
+  ClientCommandCode,
+  ClientCommandExecutor,
+  ClientCommandInterpreter,
+  KnownData,
+} from './clientCommands';
 import { MerkelizedPsbt } from './merkelizedPsbt';
 import { hashLeaf, Merkle } from './merkle';
 import { WalletPolicy } from './policy';
@@ -13,12 +23,44 @@ const CLA_FRAMEWORK = 0xf8;
 
 const CURRENT_PROTOCOL_VERSION = 1; // from supported from version 2.1.0 of the app
 
+// version 2 of the protocol only changes SIGN_PSBT, which queues the YIELD messages in the responses
+const QUEUED_YIELDS_PROTOCOL_VERSION = 2;
+
+const SW_OK = 0x9000;
+const SW_INS_NOT_SUPPORTED = 0x6d00;
+
+/**
+ * Bits of the feature bitmap returned by GET_APP_FEATURES.
+ */
+export enum AppFeature {
+  MERKLE_LEAF_PROOFS = 1 << 0, // the app uses the GET_MERKLE_LEAF_PROOFS client command
+  GET_WALLET_ADDRESSES = 1 << 1, // GET_WALLET_ADDRESSES is supported
+  GET_EXTENDED_PUBKEYS = 1 << 2, // GET_EXTENDED_PUBKEYS is supported
+  WALLET_SESSIONS = 1 << 3, // OPEN_WALLET_SESSION is supported
+  QUEUED_YIELDS = 1 << 4, // SIGN_PSBT supports version 2 of the protocol
+  MERKLE_LEAF_ELEMENTS = 1 << 5, // the app uses the GET_MERKLE_LEAF_ELEMENTS client command
+  EXTENDED_APDUS = 1 << 6, // CONTINUE accepts extended-length APDUs
+  HASHED_MESSAGES = 1 << 7, // SIGN_MESSAGE supports version 3 of the protocol
+  SIGN_MESSAGES = 1 << 8, // SIGN_MESSAGES is supported
+  PAYEE_LISTS = 1 << 9, // REGISTER_PAYEE_LIST is supported
+  OFFLOADED_RECORDS = 1 << 10, // SIGN_PSBT supports more than 512 inputs
+  MULTI_WALLET_SIGNING = 1 << 11, // SIGN_PSBT accepts additional wallet policies
+  INPUT_SUBSETS = 1 << 12, // SIGN_PSBT can sign a subset of the inputs
+  RESUMABLE_SIGNING = 1 << 13, // SIGN_PSBT sessions can be resumed
+  COMPILED_POLICIES = 1 << 14, // REGISTER_WALLET returns the compiled policy
+  HASH_REFS = 1 << 15, // version 4 of the protocol references hashes
+  ACCESS_PLANS = 1 << 16, // version 5 of the protocol announces access plans
+  PSBT_BATCHES = 1 << 17, // SIGN_PSBT_BATCH is supported
+  TREE_STREAMS = 1 << 18, // version 6 of the protocol streams Merkle trees
+}
+
 enum BitcoinIns {
   GET_PUBKEY = 0x00,
   REGISTER_WALLET = 0x02,
   GET_WALLET_ADDRESS = 0x03,
   SIGN_PSBT = 0x04,
   GET_MASTER_FINGERPRINT = 0x05,
+  GET_APP_FEATURES = 0x09,
   SIGN_MESSAGE = 0x10,
 }
 
@@ -26,27 +68,125 @@ enum FrameworkIns {
   CONTINUE_INTERRUPTED = 0x01,
 }
 
+/**
+ * Parses a result yielded by the device during SIGN_PSBT.
+ *
+ * @returns the index of the input, the pubkey and the signature
+ */
+function parseSignPsbtYield(inputAndSig: Buffer): [number, Buffer, Buffer] {
+  // inputAndSig contains:
+  // <inputIndex : varint> <pubkeyLen : 1 byte> <pubkey : pubkeyLen bytes (32 or 33)> <signature : variable length>
+  const [inputIndex, inputIndexLen] = parseVarint(inputAndSig, 0);
+  const pubkeyLen = inputAndSig[inputIndexLen];
+  const pubkey = inputAndSig.subarray(inputIndexLen + 1, inputIndexLen + 1 + pubkeyLen);
+  const signature = inputAndSig.subarray(inputIndexLen + 1 + pubkeyLen)
+
+  return [Number(inputIndex), pubkey, signature];
+}
+
 /**
  * This class encapsulates the APDU protocol documented at
  * https://github.com/LedgerHQ/app-bitcoin-new/blob/master/doc/bitcoin.md
  */
 export class AppClient {
   readonly transport: Transport;
+  readonly tracer?: ApduTracer;
+  readonly worker?: ClientCommandWorker;
+
+  private appFeatures?: readonly [number, number];
 
-  constructor(transport: Transport) {
+  // the client command requested by the last response, and the time it was received
+  private pendingCommand?: number;
+  private lastResponseTime = 0;
+
+  // the known data of the wallet policies of the previous requests, keyed by the hex encoding of
+  // their id
+  private readonly walletPolicyData: Map<string, KnownData> = new Map();
+
+  /**
+   * @param transport the transport to the device
+   * @param tracer if given, it is notified of each APDU exchanged with the device
+   * @param worker if given, the psbts are merkelized and the client commands of SIGN_PSBT are
+   * answered in this worker, instead of in the main thread
+   */
+  constructor(
+    transport: Transport,
+    tracer?: ApduTracer,
+    worker?: ClientCommandWorker
+  ) {
     this.transport = transport;
+    this.tracer = tracer;
+    this.worker = worker;
+  }
+
+  private async send(
+    cla: number,
+    ins: number,
+    p1: number,
+    p2: number,
+    data: Buffer,
+    statusList: number[]
+  ): Promise<Buffer> {
+    if (this.tracer === undefined) {
+      return this.transport.send(cla, ins, p1, p2, data, statusList);
+    }
+
+    const start = now();
+    const response = await this.transport.send(
+      cla,
+      ins,
+      p1,
+      p2,
+      data,
+      statusList
+    );
+    const end = now();
+
+    const sw = response.readUInt16BE(response.length - 2);
+    const isContinue =
+      cla === CLA_FRAMEWORK && ins === FrameworkIns.CONTINUE_INTERRUPTED;
+    const clientCommand = isContinue ? this.pendingCommand : undefined;
+
+    let name: string | undefined;
+    if (clientCommand !== undefined) {
+      name = ClientCommandCode[clientCommand];
+    } else if (cla === CLA_BTC) {
+      name = BitcoinIns[ins];
+    }
+
+    this.tracer.onExchange({
+      cla,
+      ins,
+      clientCommand,
+      name: name ?? Buffer.from([cla, ins]).toString('hex'),
+      request: Buffer.concat([
+        Buffer.from([cla, ins, p1, p2, data.length]),
+        data,
+      ]),
+      response: response.subarray(0, -2),
+      sw,
+      deviceTime: end - start,
+      hostTime: isContinue ? start - this.lastResponseTime : 0,
+    });
+
+    this.pendingCommand =
+      sw === 0xe000 && response.length > 2 ? response[0] : undefined;
+    this.lastResponseTime = end;
+
+    return response;
   }
 
   private async makeRequest(
     ins: BitcoinIns,
     data: Buffer,
-    cci?: ClientCommandInterpreter
+    cci?: ClientCommandExecutor,
+    protocolVersion: number = CURRENT_PROTOCOL_VERSION
   ): Promise<Buffer> {
-    let response: Buffer = await this.transport.send(
+    let response: Buffer = await this.send(
       CLA_BTC,
       ins,
       0,
-      CURRENT_PROTOCOL_VERSION,
+      protocolVersion,
       data,
       [0x9000, 0xe000]
     );
@@ -56,9 +196,9 @@ export class AppClient {
       }
 
       const hwRequest = response.slice(0, -2);
-      const commandResponse = cci.execute(hwRequest);
+      const commandResponse = await cci.execute(hwRequest);
 
-      response = await this.transport.send(
+      response = await this.send(
         CLA_FRAMEWORK,
         FrameworkIns.CONTINUE_INTERRUPTED,
         0,
@@ -70,6 +210,36 @@ export class AppClient {
     return response.slice(0, -2); // drop the status word (can only be 0x9000 at this point)
   }
 
+  /**
+   * Returns the highest protocol version and the bitmap of optional features supported by the app
+   * (see `AppFeature`). Apps that predate the GET_APP_FEATURES command are reported as supporting
+   * version 1 of the protocol, and none of the features. The result is cached.
+   *
+   * @returns a pair with the highest supported protocol version and the feature bitmap
+   */
+  async getAppFeatures(): Promise<readonly [number, number]> {
+    if (this.appFeatures === undefined) {
+      const response = await this.send(
+        CLA_BTC,
+        BitcoinIns.GET_APP_FEATURES,
+        0,
+        CURRENT_PROTOCOL_VERSION,
+        Buffer.from([]),
+        [SW_OK, SW_INS_NOT_SUPPORTED]
+      );
+
+      if (response.readUInt16BE(response.length - 2) === SW_INS_NOT_SUPPORTED) {
+        this.appFeatures = [CURRENT_PROTOCOL_VERSION, 0];
+      } else {
+        if (response.length !== 5 + 2) {
+          throw new Error(`Invalid response length: ${response.length - 2}`);
+        }
+        this.appFeatures = [response[0], response.readUInt32BE(1)];
+      }
+    }
+    return this.appFeatures;
+  }
+
   /**
    * Requests the BIP-32 extended pubkey to the hardware wallet.
    * If `display` is `false`, only standard paths will be accepted; an error is returned if an unusual path is
@@ -114,7 +284,7 @@ export class AppClient {
 
     const clientInterpreter = new ClientCommandInterpreter();
 
-    clientInterpreter.addKnownWalletPolicy(walletPolicy);
+    clientInterpreter.addKnownData(this.getWalletPolicyData(walletPolicy));
 
     const serializedWalletPolicy = walletPolicy.serialize();
     const response = await this.makeRequest(
@@ -164,7 +334,7 @@ export class AppClient {
 
     const clientInterpreter = new ClientCommandInterpreter();
 
-    clientInterpreter.addKnownWalletPolicy(walletPolicy);
+    clientInterpreter.addKnownData(this.getWalletPolicyData(walletPolicy));
 
     const addressIndexBuffer = Buffer.alloc(4);
     addressIndexBuffer.writeUInt32BE(addressIndex, 0);
@@ -188,7 +358,8 @@ export class AppClient {
    * Signs a psbt using a (standard or registered) `WalletPolicy`. This is an interactive command, as user validation
    * is necessary using the device's secure screen.
    * On success, a map of input indexes and signatures is returned.
-   * @param psbt an instance of `PsbtV2`
+   * @param psbt an instance of `PsbtV2`. A `MerkelizedPsbt` can be passed instead, and kept between signing rounds:
+   * only the maps modified since the previous round are merkelized again.
    * @param walletPolicy the `WalletPolicy` to use for signing
    * @param walletHMAC the 32-byte hmac obtained during wallet policy registration, or `null` for a standard policy
    * @param progressCallback optionally, a callback that will be called every time a signature is produced during
@@ -204,62 +375,161 @@ export class AppClient {
     walletHMAC: Buffer | null,
     progressCallback?: () => void
   ): Promise<[number, Buffer, Buffer][]> {
-    const merkelizedPsbt = new MerkelizedPsbt(psbt);
+    const [clientInterpreter, requestData, protocolVersion] =
+      await this.prepareSignPsbt(psbt, walletPolicy, walletHMAC, progressCallback);
 
-    if (walletHMAC != null && walletHMAC.length != 32) {
-      throw new Error('Invalid HMAC length');
+    const response = await this.makeRequest(
+      BitcoinIns.SIGN_PSBT,
+      requestData,
+      clientInterpreter,
+      protocolVersion
+    );
+
+    if (
+      protocolVersion >= QUEUED_YIELDS_PROTOCOL_VERSION &&
+      clientInterpreter.extractQueuedYields(response).length !== 0
+    ) {
+      throw new Error('Unexpected data in the response');
     }
 
-    const clientInterpreter = new ClientCommandInterpreter(progressCallback);
+    return clientInterpreter.getYielded().map(parseSignPsbtYield);
+  }
 
-    // prepare ClientCommandInterpreter
-    clientInterpreter.addKnownWalletPolicy(walletPolicy);
+  /**
+   * Like `signPsbt`, but returns the signatures as they are yielded by the device, instead of when
+   * the signing process is complete; the iteration ends when the device is done.
+   * The next request to the device is only sent once the signatures received so far are consumed.
+   * @param psbt an instance of `PsbtV2`
+   * @param walletPolicy the `WalletPolicy` to use for signing
+   * @param walletHMAC the 32-byte hmac obtained during wallet policy registration, or `null` for a standard policy
+   * @param commandCallback optionally, a callback that is called with the code of each client command requested by
+   * the device (see `ClientCommandCode`), which tells the current phase of the signing process.
+   * @returns an async iterable of tuples with the same 3 elements as the ones returned by `signPsbt`.
+   */
+  async *signPsbtStream(
+    psbt: PsbtV2,
+    walletPolicy: WalletPolicy,
+    walletHMAC: Buffer | null,
+    commandCallback?: (clientCommand: ClientCommandCode) => void
+  ): AsyncGenerator<[number, Buffer, Buffer], void, undefined> {
+    const [clientInterpreter, requestData, protocolVersion] =
+      await this.prepareSignPsbt(
+        psbt,
+        walletPolicy,
+        walletHMAC,
+        undefined,
+        commandCallback
+      );
 
-    clientInterpreter.addKnownMapping(merkelizedPsbt.globalMerkleMap);
-    for (const map of merkelizedPsbt.inputMerkleMaps) {
-      clientInterpreter.addKnownMapping(map);
-    }
-    for (const map of merkelizedPsbt.outputMerkleMaps) {
-      clientInterpreter.addKnownMapping(map);
+    let response: Buffer = await this.send(
+      CLA_BTC,
+      BitcoinIns.SIGN_PSBT,
+      0,
+      protocolVersion,
+      requestData,
+      [0x9000, 0xe000]
+    );
+    while (response.readUInt16BE(response.length - 2) === 0xe000) {
+      const commandResponse = await clientInterpreter.execute(
+        response.slice(0, -2)
+      );
+
+      for (const inputAndSig of clientInterpreter.takeYielded()) {
+        yield parseSignPsbtYield(inputAndSig);
+      }
+
+      response = await this.send(
+        CLA_FRAMEWORK,
+        FrameworkIns.CONTINUE_INTERRUPTED,
+        0,
+        0,
+        commandResponse,
+        [0x9000, 0xe000]
+      );
     }
 
-    clientInterpreter.addKnownList(merkelizedPsbt.inputMapCommitments);
-    const inputMapsRoot = new Merkle(
-      merkelizedPsbt.inputMapCommitments.map((m) => hashLeaf(m))
-    ).getRoot();
-    clientInterpreter.addKnownList(merkelizedPsbt.outputMapCommitments);
-    const outputMapsRoot = new Merkle(
-      merkelizedPsbt.outputMapCommitments.map((m) => hashLeaf(m))
-    ).getRoot();
+    if (
+      protocolVersion >= QUEUED_YIELDS_PROTOCOL_VERSION &&
+      clientInterpreter.extractQueuedYields(response.slice(0, -2)).length !== 0
+    ) {
+      throw new Error('Unexpected data in the response');
+    }
 
-    await this.makeRequest(
-      BitcoinIns.SIGN_PSBT,
-      Buffer.concat([
-        merkelizedPsbt.getGlobalKeysValuesRoot(),
-        createVarint(merkelizedPsbt.getGlobalInputCount()),
-        inputMapsRoot,
-        createVarint(merkelizedPsbt.getGlobalOutputCount()),
-        outputMapsRoot,
-        walletPolicy.getId(),
-        walletHMAC || Buffer.alloc(32, 0),
-      ]),
-      clientInterpreter
-    );
+    for (const inputAndSig of clientInterpreter.takeYielded()) {
+      yield parseSignPsbtYield(inputAndSig);
+    }
+  }
 
-    const yielded = clientInterpreter.getYielded();
+  /**
+   * Returns the preimages and the Merkle tree of keys of `walletPolicy`, which are only computed
+   * for the first request with it.
+   */
+  private getWalletPolicyData(walletPolicy: WalletPolicy): KnownData {
+    const id = walletPolicy.getId().toString('hex');
+    let known = this.walletPolicyData.get(id);
+    if (!known) {
+      known = KnownData.ofWalletPolicy(walletPolicy);
+      this.walletPolicyData.set(id, known);
+    }
+    return known;
+  }
 
-    const ret: [number, Buffer, Buffer][] = [];
-    for (const inputAndSig of yielded) {
-      // inputAndSig contains:
-      // <inputIndex : varint> <pubkeyLen : 1 byte> <pubkey : pubkeyLen bytes (32 or 33)> <signature : variable length>
-      const [inputIndex, inputIndexLen] = parseVarint(inputAndSig, 0);
-      const pubkeyLen = inputAndSig[inputIndexLen];
-      const pubkey = inputAndSig.subarray(inputIndexLen + 1, inputIndexLen + 1 + pubkeyLen);
-      const signature = inputAndSig.subarray(inputIndexLen + 1 + pubkeyLen)
+  /**
+   * Prepares the client command interpreter for the SIGN_PSBT request, and chooses the version of
+   * the protocol.
+   *
+   * @returns the interpreter, the data of the SIGN_PSBT request, and the version of the protocol
+   */
+  private async prepareSignPsbt(
+    psbt: PsbtV2,
+    walletPolicy: WalletPolicy,
+    walletHMAC: Buffer | null,
+    progressCallback?: () => void,
+    commandCallback?: (clientCommand: ClientCommandCode) => void
+  ): Promise<readonly [ClientCommandExecutor, Buffer, number]> {
+    if (walletHMAC != null && walletHMAC.length != 32) {
+      throw new Error('Invalid HMAC length');
+    }
 
-      ret.push([Number(inputIndex), pubkey, signature]);
+    // with version 2 of the protocol, the signatures are queued in the responses, saving a round
+    // trip for each of them
+    const [, features] = await this.getAppFeatures();
+    const protocolVersion =
+      (features & AppFeature.QUEUED_YIELDS) !== 0
+        ? QUEUED_YIELDS_PROTOCOL_VERSION
+        : CURRENT_PROTOCOL_VERSION;
+    const queuedYields = protocolVersion >= QUEUED_YIELDS_PROTOCOL_VERSION;
+
+    if (this.worker) {
+      const [clientInterpreter, requestData] = await this.worker.prepareSignPsbt(
+        psbt,
+        walletPolicy,
+        walletHMAC,
+        queuedYields,
+        progressCallback,
+        commandCallback
+      );
+      return [clientInterpreter, requestData, protocolVersion];
     }
-    return ret;
+
+    // a MerkelizedPsbt from a previous round only merkelizes again the maps that changed
+    const merkelizedPsbt =
+      psbt instanceof MerkelizedPsbt ? psbt.update() : new MerkelizedPsbt(psbt);
+
+    const clientInterpreter = new ClientCommandInterpreter(
+      progressCallback,
+      commandCallback
+    );
+    clientInterpreter.setQueuedYields(queuedYields);
+    const requestData = prepareSignPsbtInterpreter(
+      clientInterpreter,
+      merkelizedPsbt,
+      walletPolicy,
+      walletHMAC,
+      this.getWalletPolicyData(walletPolicy)
+    );
+
+    return [clientInterpreter, requestData, protocolVersion];
   }
 
   /**
@@ -1,4 +1,4 @@
-import { createVarint, parseVarint, sanitizeBigintToNumber } from './varint';
+import { parseVarint, sanitizeBigintToNumber } from './varint';
 
 export function unsafeTo64bitLE(n: number): Buffer {
   // we want to represent the input as a 8-bytes array
@@ -31,38 +31,88 @@ export function unsafeFrom64bitLE(byteArray: Buffer): number {
   return value;
 }
 
+/**
+ * Serializes data in a single growable buffer, whose capacity is doubled when it is full, so that
+ * each write only copies its bytes in place.
+ *
+ * The result of `buffer()` is a view of the written bytes, not a copy: it is not modified by the
+ * later writes.
+ */
 export class BufferWriter {
-  private bufs: Buffer[] = [];
+  private buf: Buffer;
+  private length = 0;
+
+  /**
+   * @param capacity the number of bytes allocated initially, for example the expected size of the
+   * result.
+   */
+  constructor(capacity = 64) {
+    this.buf = Buffer.alloc(Math.max(capacity, 1));
+  }
+
+  // makes room for n more bytes after the ones written so far
+  private reserve(n: number): void {
+    if (this.length + n > this.buf.length) {
+      let capacity = 2 * this.buf.length;
+      while (capacity < this.length + n) capacity *= 2;
+      const buf = Buffer.alloc(capacity);
+      this.buf.copy(buf, 0, 0, this.length);
+      this.buf = buf;
+    }
+  }
 
   write(alloc: number, fn: (b: Buffer) => void): void {
-    const b = Buffer.alloc(alloc);
-    fn(b);
-    this.bufs.push(b);
+    this.reserve(alloc);
+    fn(this.buf.subarray(this.length, this.length + alloc));
+    this.length += alloc;
   }
 
   writeUInt8(i: number): void {
-    this.write(1, (b) => b.writeUInt8(i, 0));
+    this.reserve(1);
+    this.length = this.buf.writeUInt8(i, this.length);
   }
 
   writeInt32(i: number): void {
-    this.write(4, (b) => b.writeInt32LE(i, 0));
+    this.reserve(4);
+    this.length = this.buf.writeInt32LE(i, this.length);
   }
 
   writeUInt32(i: number): void {
-    this.write(4, (b) => b.writeUInt32LE(i, 0));
+    this.reserve(4);
+    this.length = this.buf.writeUInt32LE(i, this.length);
   }
 
   writeUInt64(i: number): void {
-    const bytes = unsafeTo64bitLE(i);
-    this.writeSlice(bytes);
+    if (i > Number.MAX_SAFE_INTEGER) {
+      throw new Error("Can't convert numbers > MAX_SAFE_INT");
+    }
+    this.reserve(8);
+    this.buf.writeUInt32LE(Math.floor(i / 0x100000000), this.length + 4);
+    this.length = this.buf.writeUInt32LE(i % 0x100000000, this.length) + 4;
   }
 
   writeVarInt(i: number): void {
-    this.bufs.push(createVarint(i));
+    i = sanitizeBigintToNumber(i);
+    if (i < 0xfd) {
+      this.writeUInt8(i);
+    } else if (i <= 0xffff) {
+      this.reserve(3);
+      this.buf[this.length] = 0xfd;
+      this.length = this.buf.writeUInt16LE(i, this.length + 1);
+    } else if (i <= 0xffffffff) {
+      this.reserve(5);
+      this.buf[this.length] = 0xfe;
+      this.length = this.buf.writeUInt32LE(i, this.length + 1);
+    } else {
+      this.writeUInt8(0xff);
+      this.writeUInt64(i);
+    }
   }
 
   writeSlice(slice: Buffer): void {
-    this.bufs.push(Buffer.from(slice));
+    this.reserve(slice.length);
+    this.buf.set(slice, this.length);
+    this.length += slice.length;
   }
 
   writeVarSlice(slice: Buffer): void {
@@ -71,7 +121,7 @@ export class BufferWriter {
   }
 
   buffer(): Buffer {
-    return Buffer.concat(this.bufs);
+    return this.buf.subarray(0, this.length);
   }
 }
 
@@ -0,0 +1,286 @@
+import {
+  ClientCommandCode,
+  ClientCommandExecutor,
+  ClientCommandInterpreter,
+  KnownData,
+} from './clientCommands';
+import { MerkelizedPsbt } from './merkelizedPsbt';
+import { WalletPolicy } from './policy';
+import { PsbtV2 } from './psbtv2';
+import { createVarint } from './varint';
+
+/**
+ * The side of a message channel used to communicate with a worker: a Web `Worker` or `MessagePort`
+ * (with `addEventListener`), or a Node `worker_threads` `Worker` or `MessagePort` (with `on`).
+ * Inside the worker, it is `self` or `parentPort` respectively.
+ */
+export interface WorkerEndpoint {
+  postMessage(message: unknown, transfer?: ArrayBuffer[]): void;
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  on?(event: 'message', listener: (data: any) => void): unknown;
+  addEventListener?(
+    type: 'message',
+    // eslint-disable-next-line @typescript-eslint/no-explicit-any
+    listener: (event: { data: any }) => void
+  ): void;
+}
+
+type WorkerRequest =
+  | {
+      type: 'signPsbt';
+      psbt: ArrayBuffer;
+      walletPolicy: [string, string, readonly string[]];
+      walletHMAC: ArrayBuffer | null;
+    }
+  | { type: 'execute'; request: ArrayBuffer };
+
+type WorkerResponse = { result: ArrayBuffer } | { error: string };
+
+function onMessage(endpoint: WorkerEndpoint, listener: (data: unknown) => void) {
+  if (endpoint.on) {
+    endpoint.on('message', listener);
+  } else if (endpoint.addEventListener) {
+    endpoint.addEventListener('message', (event) => listener(event.data));
+  } else {
+    throw new Error('Unsupported worker endpoint');
+  }
+}
+
+// Copies the content of buf in a new ArrayBuffer, that can be transferred to the other thread
+// (the ArrayBuffer of a Buffer can be shared with other Buffers).
+function toTransferable(buf: Buffer): ArrayBuffer {
+  const ab = new ArrayBuffer(buf.length);
+  new Uint8Array(ab).set(buf);
+  return ab;
+}
+
+/**
+ * Adds the psbt and the wallet policy to the known data of the interpreter.
+ *
+ * @param walletPolicyData the known data of `walletPolicy`, if it was already computed
+ * @returns the data of the SIGN_PSBT request
+ */
+export function prepareSignPsbtInterpreter(
+  clientInterpreter: ClientCommandInterpreter,
+  merkelizedPsbt: MerkelizedPsbt,
+  walletPolicy: WalletPolicy,
+  walletHMAC: Buffer | null,
+  walletPolicyData: KnownData = KnownData.ofWalletPolicy(walletPolicy)
+): Buffer {
+  clientInterpreter.addKnownData(walletPolicyData);
+
+  clientInterpreter.addKnownMapping(merkelizedPsbt.globalMerkleMap);
+  for (const map of merkelizedPsbt.inputMerkleMaps) {
+    clientInterpreter.addKnownMapping(map);
+  }
+  for (const map of merkelizedPsbt.outputMerkleMaps) {
+    clientInterpreter.addKnownMapping(map);
+  }
+
+  clientInterpreter.addKnownTree(
+    merkelizedPsbt.inputMapCommitments,
+    merkelizedPsbt.inputMapsTree
+  );
+  clientInterpreter.addKnownTree(
+    merkelizedPsbt.outputMapCommitments,
+    merkelizedPsbt.outputMapsTree
+  );
+
+  return Buffer.concat([
+    merkelizedPsbt.getGlobalKeysValuesRoot(),
+    createVarint(merkelizedPsbt.getGlobalInputCount()),
+    merkelizedPsbt.inputMapsTree.getRoot(),
+    createVarint(merkelizedPsbt.getGlobalOutputCount()),
+    merkelizedPsbt.outputMapsTree.getRoot(),
+    walletPolicy.getId(),
+    walletHMAC || Buffer.alloc(32, 0),
+  ]);
+}
+
+/**
+ * Answers the requests of a `ClientCommandWorker` on the given endpoint. It is called by the
+ * script of the worker, for example `serveClientCommands(self)` in a Web Worker, or
+ * `serveClientCommands(parentPort)` in a Node worker thread.
+ *
+ * The worker merkelizes the psbt of each SIGN_PSBT session, and answers all the client commands
+ * except YIELD, which is handled by the main thread.
+ */
+export function serveClientCommands(endpoint: WorkerEndpoint): void {
+  let clientInterpreter: ClientCommandInterpreter | undefined;
+  // the known data of the wallet policies of the previous sessions, keyed by the hex encoding of
+  // their id
+  const walletPolicyData: Map<string, KnownData> = new Map();
+
+  const handle = (req: WorkerRequest): Buffer => {
+    switch (req.type) {
+      case 'signPsbt': {
+        const psbt = new PsbtV2();
+        psbt.deserialize(Buffer.from(req.psbt));
+        const [name, descriptorTemplate, keys] = req.walletPolicy;
+        const walletPolicy = new WalletPolicy(name, descriptorTemplate, keys);
+        const id = walletPolicy.getId().toString('hex');
+        if (!walletPolicyData.has(id)) {
+          walletPolicyData.set(id, KnownData.ofWalletPolicy(walletPolicy));
+        }
+        clientInterpreter = new ClientCommandInterpreter();
+        return prepareSignPsbtInterpreter(
+          clientInterpreter,
+          new MerkelizedPsbt(psbt),
+          walletPolicy,
+          req.walletHMAC && Buffer.from(req.walletHMAC),
+          walletPolicyData.get(id)
+        );
+      }
+      case 'execute':
+        if (!clientInterpreter) {
+          throw new Error('No SIGN_PSBT session');
+        }
+        return clientInterpreter.execute(Buffer.from(req.request));
+      default:
+        throw new Error('Unexpected worker request');
+    }
+  };
+
+  onMessage(endpoint, (data) => {
+    let response: WorkerResponse;
+    try {
+      response = { result: toTransferable(handle(data as WorkerRequest)) };
+    } catch (e) {
+      response = { error: e instanceof Error ? e.message : String(e) };
+    }
+    endpoint.postMessage(
+      response,
+      'result' in response ? [response.result] : []
+    );
+  });
+}
+
+/**
+ * Runs the merkelization of the psbt and the answers to the client commands of SIGN_PSBT in a
+ * worker (see `serveClientCommands`), so that they do not block the main thread with large psbts.
+ * The data is exchanged with transferable `ArrayBuffer`s.
+ *
+ * The worker answers the requests in order, and only one SIGN_PSBT session is active at a time.
+ */
+export class ClientCommandWorker {
+  private readonly pending: {
+    resolve: (result: Buffer) => void;
+    reject: (error: Error) => void;
+  }[] = [];
+
+  /**
+   * @param endpoint the endpoint to communicate with the worker
+   */
+  constructor(private readonly endpoint: WorkerEndpoint) {
+    onMessage(endpoint, (data) => {
+      const request = this.pending.shift();
+      if (!request) {
+        return; // not a response to a request
+      }
+      const response = data as WorkerResponse;
+      if ('error' in response) {
+        request.reject(new Error(response.error));
+      } else {
+        request.resolve(Buffer.from(response.result));
+      }
+    });
+  }
+
+  private request(message: WorkerRequest, transfer: ArrayBuffer[]): Promise<Buffer> {
+    return new Promise((resolve, reject) => {
+      this.pending.push({ resolve, reject });
+      this.endpoint.postMessage(message, transfer);
+    });
+  }
+
+  /**
+   * Starts a SIGN_PSBT session in the worker.
+   *
+   * @returns the interpreter for the client commands of the session, and the data of the SIGN_PSBT
+   * request
+   */
+  async prepareSignPsbt(
+    psbt: PsbtV2,
+    walletPolicy: WalletPolicy,
+    walletHMAC: Buffer | null,
+    queuedYields: boolean,
+    progressCallback?: () => void,
+    commandCallback?: (clientCommand: ClientCommandCode) => void
+  ): Promise<readonly [WorkerClientCommandInterpreter, Buffer]> {
+    const psbtData = toTransferable(psbt.serialize());
+    const requestData = await this.request(
+      {
+        type: 'signPsbt',
+        psbt: psbtData,
+        walletPolicy: [
+          walletPolicy.name,
+          walletPolicy.descriptorTemplate,
+          walletPolicy.keys,
+        ],
+        walletHMAC: walletHMAC && toTransferable(walletHMAC),
+      },
+      [psbtData]
+    );
+
+    const clientInterpreter = new WorkerClientCommandInterpreter(
+      (request) => {
+        const data = toTransferable(request);
+        return this.request({ type: 'execute', request: data }, [data]);
+      },
+      progressCallback,
+      commandCallback
+    );
+    clientInterpreter.setQueuedYields(queuedYields);
+    return [clientInterpreter, requestData];
+  }
+}
+
+/**
+ * The interpreter of a SIGN_PSBT session run by a `ClientCommandWorker`. The yielded results and
+ * the callbacks are handled in the main thread, while the other commands are forwarded to the
+ * worker.
+ */
+export class WorkerClientCommandInterpreter implements ClientCommandExecutor {
+  // it has no known data, and only answers the YIELD command
+  private readonly local: ClientCommandInterpreter;
+  private queuedYields = false;
+
+  constructor(
+    private readonly forward: (request: Buffer) => Promise<Buffer>,
+    progressCallback?: () => void,
+    private readonly commandCallback?: (code: ClientCommandCode) => void
+  ) {
+    this.local = new ClientCommandInterpreter(progressCallback, commandCallback);
+  }
+
+  getYielded(): readonly Buffer[] {
+    return this.local.getYielded();
+  }
+
+  takeYielded(): Buffer[] {
+    return this.local.takeYielded();
+  }
+
+  setQueuedYields(queuedYields: boolean): void {
+    this.queuedYields = queuedYields;
+    this.local.setQueuedYields(queuedYields);
+  }
+
+  extractQueuedYields(response: Buffer): Buffer {
+    return this.local.extractQueuedYields(response);
+  }
+
+  async execute(request: Buffer): Promise<Buffer> {
+    if (this.queuedYields) {
+      request = this.local.extractQueuedYields(request);
+    }
+    if (request.length == 0 || request[0] == ClientCommandCode.YIELD) {
+      return this.local.execute(request);
+    }
+
+    if (this.commandCallback) {
+      this.commandCallback(request[0]);
+    }
+    return this.forward(request);
+  }
+}
@@ -6,11 +6,15 @@ import { MerkleMap } from './merkleMap';
 import { WalletPolicy } from './policy';
 import { createVarint, sanitizeBigintToNumber } from './varint';
 
-enum ClientCommandCode {
+export enum ClientCommandCode {
   YIELD = 0x10,
   GET_PREIMAGE = 0x40,
   GET_MERKLE_LEAF_PROOF = 0x41,
   GET_MERKLE_LEAF_INDEX = 0x42,
+  GET_MERKLE_LEAF_PROOFS = 0x43,
+  GET_MERKLE_LEAF_ELEMENTS = 0x44,
+  PUT_RECORD = 0x50,
+  GET_RECORD = 0x51,
   GET_MORE_ELEMENTS = 0xa0,
 }
 
@@ -66,11 +70,7 @@ export class GetPreimageCommand extends ClientCommand {
     }
 
     // read the hash
-    const hash = Buffer.alloc(32);
-    for (let i = 0; i < 32; i++) {
-      hash[i] = req[1 + i];
-    }
-    const req_hash_hex = hash.toString('hex');
+    const req_hash_hex = req.toString('hex', 1, 1 + 32);
 
     const known_preimage = this.known_preimages.get(req_hash_hex);
     if (known_preimage != undefined) {
@@ -102,6 +102,12 @@ export class GetPreimageCommand extends ClientCommand {
 export class GetMerkleLeafProofCommand extends ClientCommand {
   private readonly known_trees: ReadonlyMap<string, Merkle>;
   private queue: Buffer[];
+  // The device requests the same leaves many times, so the responses and the
+  // proof elements that do not fit them are memoized, keyed by root and index.
+  private readonly cachedResponses: Map<
+    string,
+    { response: Buffer; leftover: Buffer[] }
+  > = new Map();
 
   readonly code = ClientCommandCode.GET_MERKLE_LEAF_PROOF;
 
@@ -148,10 +154,94 @@ export class GetMerkleLeafProofCommand extends ClientCommand {
       );
     }
 
-    const proof = mt.getProof(leaf_index);
+    const cacheKey = `${hash_hex}:${leaf_index}`;
+    let cached = this.cachedResponses.get(cacheKey);
+    if (!cached) {
+      const proof = mt.getProof(leaf_index);
+
+      const n_response_elements = Math.min(
+        Math.floor((255 - 32 - 1 - 1) / 32),
+        proof.length
+      );
+
+      cached = {
+        response: Buffer.concat([
+          mt.getLeafHash(leaf_index),
+          Buffer.from([proof.length]),
+          Buffer.from([n_response_elements]),
+          ...proof.slice(0, n_response_elements),
+        ]),
+        leftover: proof.slice(n_response_elements),
+      };
+      this.cachedResponses.set(cacheKey, cached);
+    }
+
+    // Add to the queue any proof elements that do not fit the response
+    this.queue.push(...cached.leftover);
+
+    return cached.response;
+  }
+}
+
+export class GetMerkleLeafProofsCommand extends ClientCommand {
+  private readonly known_trees: ReadonlyMap<string, Merkle>;
+  private queue: Buffer[];
+
+  readonly code = ClientCommandCode.GET_MERKLE_LEAF_PROOFS;
+
+  constructor(known_trees: ReadonlyMap<string, Merkle>, queue: Buffer[]) {
+    super();
+    this.known_trees = known_trees;
+    this.queue = queue;
+  }
+
+  execute(request: Buffer): Buffer {
+    const req = Buffer.from(request.subarray(1));
+
+    if (req.length < 32 + 1 + 1 + 1) {
+      throw new Error('Invalid request, expected at least 35 bytes');
+    }
+
+    const reqBuf = new BufferReader(req);
+    const hash = reqBuf.readSlice(32);
+    const hash_hex = hash.toString('hex');
+
+    let tree_size: number;
+    let first_leaf_index: number;
+    let n_leaves: number;
+    try {
+      tree_size = sanitizeBigintToNumber(reqBuf.readVarInt());
+      first_leaf_index = sanitizeBigintToNumber(reqBuf.readVarInt());
+      n_leaves = sanitizeBigintToNumber(reqBuf.readVarInt());
+    } catch (e) {
+      throw new Error(
+        "Invalid request, couldn't parse tree_size, first_leaf_index or n_leaves"
+      );
+    }
+
+    const mt = this.known_trees.get(hash_hex);
+    if (!mt) {
+      throw Error(`Requested Merkle leaf proofs for unknown tree: ${hash_hex}`);
+    }
+
+    if (
+      n_leaves == 0 ||
+      first_leaf_index + n_leaves > tree_size ||
+      mt.size() != tree_size
+    ) {
+      throw Error('Invalid leaf indexes or tree size.');
+    }
+
+    if (this.queue.length != 0) {
+      throw Error(
+        'This command should not execute when the queue is not empty.'
+      );
+    }
+
+    const proof = mt.getMultiProof(first_leaf_index, n_leaves);
 
     const n_response_elements = Math.min(
-      Math.floor((255 - 32 - 1 - 1) / 32),
+      Math.floor((255 - 1 - 1) / 32),
       proof.length
     );
     const n_leftover_elements = proof.length - n_response_elements;
@@ -162,7 +252,6 @@ export class GetMerkleLeafProofCommand extends ClientCommand {
     }
 
     return Buffer.concat([
-      mt.getLeafHash(leaf_index),
       Buffer.from([proof.length]),
       Buffer.from([n_response_elements]),
       ...proof.slice(0, n_response_elements),
@@ -170,6 +259,103 @@ export class GetMerkleLeafProofCommand extends ClientCommand {
   }
 }
 
+export class GetMerkleLeafElementsCommand extends ClientCommand {
+  private readonly known_trees: ReadonlyMap<string, Merkle>;
+  private readonly known_preimages: ReadonlyMap<string, Buffer>;
+  private queue: Buffer[];
+
+  readonly code = ClientCommandCode.GET_MERKLE_LEAF_ELEMENTS;
+
+  constructor(
+    known_trees: ReadonlyMap<string, Merkle>,
+    known_preimages: ReadonlyMap<string, Buffer>,
+    queue: Buffer[]
+  ) {
+    super();
+    this.known_trees = known_trees;
+    this.known_preimages = known_preimages;
+    this.queue = queue;
+  }
+
+  execute(request: Buffer): Buffer {
+    const req = Buffer.from(request.subarray(1));
+
+    if (req.length < 32 + 1 + 1) {
+      throw new Error('Invalid request, expected at least 34 bytes');
+    }
+
+    const reqBuf = new BufferReader(req);
+    const hash = reqBuf.readSlice(32);
+    const hash_hex = hash.toString('hex');
+
+    let tree_size: number;
+    const leaf_indexes: number[] = [];
+    try {
+      tree_size = sanitizeBigintToNumber(reqBuf.readVarInt());
+      const n_leaves = reqBuf.readUInt8();
+      for (let i = 0; i < n_leaves; i++) {
+        leaf_indexes.push(sanitizeBigintToNumber(reqBuf.readVarInt()));
+      }
+    } catch (e) {
+      throw new Error(
+        "Invalid request, couldn't parse tree_size or the leaf indexes"
+      );
+    }
+
+    if (reqBuf.available() != 0) {
+      throw new Error('Invalid request, unexpected trailing data');
+    }
+
+    const mt = this.known_trees.get(hash_hex);
+    if (!mt) {
+      throw Error(
+        `Requested Merkle leaf elements for unknown tree: ${hash_hex}`
+      );
+    }
+
+    if (mt.size() != tree_size) {
+      throw Error('Invalid tree size.');
+    }
+
+    if (this.queue.length != 0) {
+      throw Error(
+        'This command should not execute when the queue is not empty.'
+      );
+    }
+
+    // throws if the leaf indexes are not valid
+    const proof = mt.getLeafSetMultiProof(leaf_indexes);
+
+    const preimages = leaf_indexes.map((leaf_index) => {
+      const leaf_hash_hex = mt.getLeafHash(leaf_index).toString('hex');
+      const preimage = this.known_preimages.get(leaf_hash_hex);
+      if (preimage == undefined) {
+        throw Error(`Requested unknown preimage for: ${leaf_hash_hex}`);
+      }
+      return Buffer.concat([createVarint(preimage.length), preimage]);
+    });
+
+    const data = Buffer.concat([...proof, ...preimages]);
+    const data_len_varint = createVarint(data.length);
+
+    // We can send at most 255 - len(data_len_varint) - 1 bytes in a single message;
+    // the rest will be stored in the queue for GET_MORE_ELEMENTS
+    const max_payload_size = 255 - data_len_varint.length - 1;
+
+    const payload_size = Math.min(max_payload_size, data.length);
+
+    for (let i = payload_size; i < data.length; i++) {
+      this.queue.push(Buffer.from([data[i]]));
+    }
+
+    return Buffer.concat([
+      data_len_varint,
+      Buffer.from([payload_size]),
+      Buffer.from(data.subarray(0, payload_size)),
+    ]);
+  }
+}
+
 export class GetMerkleLeafIndexCommand extends ClientCommand {
   private readonly known_trees: ReadonlyMap<string, Merkle>;
 
@@ -187,19 +373,9 @@ export class GetMerkleLeafIndexCommand extends ClientCommand {
       throw new Error('Invalid request, unexpected trailing data');
     }
 
-    // read the root hash
-    const root_hash = Buffer.alloc(32);
-    for (let i = 0; i < 32; i++) {
-      root_hash[i] = req.readUInt8(i);
-    }
-    const root_hash_hex = root_hash.toString('hex');
-
-    // read the leaf hash
-    const leef_hash = Buffer.alloc(32);
-    for (let i = 0; i < 32; i++) {
-      leef_hash[i] = req.readUInt8(32 + i);
-    }
-    const leef_hash_hex = leef_hash.toString('hex');
+    // read the root hash and the leaf hash
+    const root_hash_hex = req.toString('hex', 0, 32);
+    const leaf_hash_hex = req.toString('hex', 32, 64);
 
     const mt = this.known_trees.get(root_hash_hex);
     if (!mt) {
@@ -208,16 +384,74 @@ export class GetMerkleLeafIndexCommand extends ClientCommand {
       );
     }
 
-    let leaf_index = 0;
-    let found = 0;
-    for (let i = 0; i < mt.size(); i++) {
-      if (mt.getLeafHash(i).toString('hex') == leef_hash_hex) {
-        found = 1;
-        leaf_index = i;
-        break;
-      }
+    const leaf_index = mt.getLeafIndex(leaf_hash_hex);
+    if (leaf_index === undefined) {
+      return Buffer.concat([Buffer.from([0]), createVarint(0)]);
     }
-    return Buffer.concat([Buffer.from([found]), createVarint(leaf_index)]);
+    return Buffer.concat([Buffer.from([1]), createVarint(leaf_index)]);
+  }
+}
+
+export class PutRecordCommand extends ClientCommand {
+  private records: Map<number, Buffer>;
+
+  readonly code = ClientCommandCode.PUT_RECORD;
+
+  constructor(records: Map<number, Buffer>) {
+    super();
+    this.records = records;
+  }
+
+  execute(request: Buffer): Buffer {
+    const reqBuf = new BufferReader(Buffer.from(request.subarray(1)));
+
+    let index: number;
+    let record: Buffer;
+    try {
+      index = sanitizeBigintToNumber(reqBuf.readVarInt());
+      record = reqBuf.readSlice(reqBuf.readUInt8());
+    } catch (e) {
+      throw new Error("Invalid request, couldn't parse the record");
+    }
+
+    if (reqBuf.available() != 0) {
+      throw new Error('Invalid request, unexpected trailing data');
+    }
+
+    this.records.set(index, Buffer.from(record));
+    return Buffer.from([]);
+  }
+}
+
+export class GetRecordCommand extends ClientCommand {
+  private readonly records: ReadonlyMap<number, Buffer>;
+
+  readonly code = ClientCommandCode.GET_RECORD;
+
+  constructor(records: ReadonlyMap<number, Buffer>) {
+    super();
+    this.records = records;
+  }
+
+  execute(request: Buffer): Buffer {
+    const reqBuf = new BufferReader(Buffer.from(request.subarray(1)));
+
+    let index: number;
+    try {
+      index = sanitizeBigintToNumber(reqBuf.readVarInt());
+    } catch (e) {
+      throw new Error("Invalid request, couldn't parse the record index");
+    }
+
+    if (reqBuf.available() != 0) {
+      throw new Error('Invalid request, unexpected trailing data');
+    }
+
+    const record = this.records.get(index);
+    if (!record) {
+      throw new Error(`Requested unknown record: ${index}`);
+    }
+    return Buffer.concat([Buffer.from([record.length]), record]);
   }
 }
 
@@ -274,24 +508,92 @@ export class GetMoreElementsCommand extends ClientCommand {
  *
  * If the command yelds results to the client, as signPsbt does, the yielded
  * data will be accessible after the command completed by calling getYielded(),
- * which will return the yields in the same order as they came in.
+ * which will return the yields in the same order as they came in; takeYielded()
+ * returns the ones received so far, while the command is still running.
+ */
+/**
+ * Answers the client commands requested by the hardware wallet, possibly asynchronously.
+ */
+export interface ClientCommandExecutor {
+  execute(request: Buffer): Buffer | Promise<Buffer>;
+  getYielded(): readonly Buffer[];
+  takeYielded(): Buffer[];
+  extractQueuedYields(response: Buffer): Buffer;
+}
+
+/**
+ * Preimages and Merkle trees known to the client, keyed by the hex encoding of
+ * their hash (respectively, root). It is computed once and then added to the
+ * interpreters with `ClientCommandInterpreter.addKnownData`, for example for a
+ * wallet policy used by many requests, without hashing anything again.
  */
-export class ClientCommandInterpreter {
-  private readonly roots: Map<string, Merkle> = new Map();
-  private readonly preimages: Map<string, Buffer> = new Map();
+export class KnownData {
+  readonly preimages: Map<string, Buffer> = new Map();
+  readonly roots: Map<string, Merkle> = new Map();
+
+  /**
+   * Returns the known data of a wallet policy: its serialization, its
+   * descriptor template, and the Merkle tree of its keys.
+   */
+  static ofWalletPolicy(wp: WalletPolicy): KnownData {
+    const result = new KnownData();
+    result.addKnownPreimage(wp.serialize());
+    result.addKnownTree(
+      wp.keys.map((k) => Buffer.from(k, 'ascii')),
+      wp.getKeysTree()
+    );
+    result.addKnownPreimage(Buffer.from(wp.descriptorTemplate));
+    return result;
+  }
+
+  addKnownPreimage(preimage: Buffer): void {
+    this.preimages.set(crypto.sha256(preimage).toString('hex'), preimage);
+  }
+
+  addKnownTree(elements: readonly Buffer[], tree: Merkle): void {
+    elements.forEach((el, i) => {
+      this.preimages.set(
+        tree.getLeafHash(i).toString('hex'),
+        Buffer.concat([Buffer.from([0]), el])
+      );
+    });
+    this.roots.set(tree.getRoot().toString('hex'), tree);
+  }
+}
+
+export class ClientCommandInterpreter implements ClientCommandExecutor {
+  private readonly known = new KnownData();
+  private readonly roots = this.known.roots;
+  private readonly preimages = this.known.preimages;
 
   private yielded: Buffer[] = [];
 
   private queue: Buffer[] = [];
 
+  private readonly records: Map<number, Buffer> = new Map();
+
+  private queuedYields = false;
+
   private readonly commands: Map<ClientCommandCode, ClientCommand> = new Map();
 
-  constructor(progressCallback?: () => void) {
+  /**
+   * @param progressCallback if given, it is called for each yielded result
+   * @param commandCallback if given, it is called with the code of each client command requested
+   * by the hardware wallet
+   */
+  constructor(
+    private readonly progressCallback?: () => void,
+    private readonly commandCallback?: (code: ClientCommandCode) => void
+  ) {
     const commands = [
       new YieldCommand(this.yielded, progressCallback),
       new GetPreimageCommand(this.preimages, this.queue),
       new GetMerkleLeafIndexCommand(this.roots),
       new GetMerkleLeafProofCommand(this.roots, this.queue),
+      new GetMerkleLeafProofsCommand(this.roots, this.queue),
+      new GetMerkleLeafElementsCommand(this.roots, this.preimages, this.queue),
+      new PutRecordCommand(this.records),
+      new GetRecordCommand(this.records),
       new GetMoreElementsCommand(this.queue),
     ];
 
@@ -307,33 +609,88 @@ export class ClientCommandInterpreter {
     return this.yielded;
   }
 
+  /**
+   * Returns the results yielded since the last call, and removes them from the yielded values.
+   */
+  takeYielded(): Buffer[] {
+    return this.yielded.splice(0);
+  }
+
+  /**
+   * If `queuedYields` is true, the responses from the hardware wallet are expected to start with
+   * YIELD messages prefixed by their length, as in version 2 of the protocol for SIGN_PSBT.
+   */
+  setQueuedYields(queuedYields: boolean): void {
+    this.queuedYields = queuedYields;
+  }
+
+  /**
+   * Removes the YIELD messages queued at the beginning of a response from the hardware wallet,
+   * each encoded as the YIELD command code, followed by a 1-byte length and the message, and adds
+   * them to the yielded values.
+   *
+   * @returns the rest of the response after the queued YIELD messages
+   */
+  extractQueuedYields(response: Buffer): Buffer {
+    while (response.length > 0 && response[0] == ClientCommandCode.YIELD) {
+      if (response.length < 2 || response.length < 2 + response[1]) {
+        throw new Error('Invalid queued YIELD message');
+      }
+      const msgLen = response[1];
+      this.yielded.push(Buffer.from(response.subarray(2, 2 + msgLen)));
+      if (this.progressCallback) {
+        this.progressCallback();
+      }
+      response = response.subarray(2 + msgLen);
+    }
+    return response;
+  }
+
   addKnownPreimage(preimage: Buffer): void {
-    this.preimages.set(crypto.sha256(preimage).toString('hex'), preimage);
+    this.known.addKnownPreimage(preimage);
   }
 
   addKnownList(elements: readonly Buffer[]): void {
-    for (const el of elements) {
-      const preimage = Buffer.concat([Buffer.from([0]), el]);
-      this.addKnownPreimage(preimage);
-    }
-    const mt = new Merkle(elements.map((el) => hashLeaf(el)));
-    this.roots.set(mt.getRoot().toString('hex'), mt);
+    this.addKnownTree(elements, new Merkle(elements.map((el) => hashLeaf(el))));
+  }
+
+  /**
+   * Like addKnownList, but with the Merkle tree of the elements, which is not
+   * built again.
+   */
+  addKnownTree(elements: readonly Buffer[], tree: Merkle): void {
+    this.known.addKnownTree(elements, tree);
   }
 
   addKnownMapping(mm: MerkleMap): void {
-    this.addKnownList(mm.keys);
-    this.addKnownList(mm.values);
+    this.addKnownTree(mm.keys, mm.keysTree);
+    this.addKnownTree(mm.values, mm.valuesTree);
   }
 
   addKnownWalletPolicy(wp: WalletPolicy): void {
-    this.addKnownPreimage(wp.serialize());
-    this.addKnownList(
-      wp.keys.map((k) => Buffer.from(k, 'ascii'))
-    );
-    this.addKnownPreimage(Buffer.from(wp.descriptorTemplate));
+    this.addKnownData(KnownData.ofWalletPolicy(wp));
+  }
+
+  /**
+   * Adds the preimages and Merkle trees of `known`, which are shared, not copied.
+   */
+  addKnownData(known: KnownData): void {
+    known.preimages.forEach((preimage, hash) => this.preimages.set(hash, preimage));
+    known.roots.forEach((tree, root) => this.roots.set(root, tree));
   }
 
   execute(request: Buffer): Buffer {
+    if (this.queuedYields) {
+      request = this.extractQueuedYields(request);
+      if (request.length == 0) {
+        // the interruption only contained queued YIELD messages
+        if (this.commandCallback) {
+          this.commandCallback(ClientCommandCode.YIELD);
+        }
+        return Buffer.from([]);
+      }
+    }
+
     if (request.length == 0) {
       throw new Error('Unexpected empty command');
     }
@@ -344,6 +701,10 @@ export class ClientCommandInterpreter {
       throw new Error(`Unexpected command code ${cmdCode}`);
     }
 
+    if (this.commandCallback) {
+      this.commandCallback(cmdCode);
+    }
+
     return cmd.execute(request);
   }
 }
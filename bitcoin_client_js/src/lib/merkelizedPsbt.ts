@@ -1,4 +1,6 @@
+import { hashLeaf, Merkle } from './merkle';
 import { MerkleMap } from './merkleMap';
+import { PsbtMap } from './psbtMap';
 import { PsbtV2 } from './psbtv2';
 
 /**
@@ -9,20 +11,94 @@ import { PsbtV2 } from './psbtv2';
  * The reason for this is the limited amount of memory available to the app,
  * so it can't always store the full psbt in memory.
  *
+ * The maps modified with the setters of `PsbtV2` are tracked, so that `update`
+ * only merkelizes them again, for example after adding the signatures of a
+ * cosigner between two signing rounds.
+ *
  * The signing process is documented at
  * https://github.com/LedgerHQ/app-bitcoin-new/blob/master/doc/bitcoin.md#sign_psbt
  */
 export class MerkelizedPsbt extends PsbtV2 {
-  public readonly globalMerkleMap: MerkleMap;
+  public globalMerkleMap: MerkleMap;
   public inputMerkleMaps: MerkleMap[] = [];
   public outputMerkleMaps: MerkleMap[] = [];
-  public inputMapCommitments: Buffer[];
-  public outputMapCommitments: Buffer[];
+  public inputMapCommitments: Buffer[] = [];
+  public outputMapCommitments: Buffer[] = [];
+  // Merkle trees of the input and output map commitments
+  public inputMapsTree: Merkle;
+  public outputMapsTree: Merkle;
+
+  // the maps modified since they were last merkelized
+  private globalMapChanged = false;
+  private changedInputs: Set<number> = new Set();
+  private changedOutputs: Set<number> = new Set();
+
   constructor(psbt: PsbtV2) {
     super();
     psbt.copy(this);
+    this.merkelizeAll();
+  }
+
+  /**
+   * Merkelizes again the maps modified since the last call (or since the psbt
+   * was merkelized), and updates the corresponding leaves of the trees of the
+   * map commitments, in O(log n) each. If the number of inputs or outputs
+   * changed, all the maps are merkelized again.
+   *
+   * @returns this
+   */
+  update(): MerkelizedPsbt {
+    if (
+      this.getGlobalInputCount() != this.inputMerkleMaps.length ||
+      this.getGlobalOutputCount() != this.outputMerkleMaps.length
+    ) {
+      this.merkelizeAll();
+      return this;
+    }
+
+    if (this.globalMapChanged) {
+      this.globalMerkleMap = MerkelizedPsbt.createMerkleMap(this.globalMap);
+    }
+    this.changedInputs.forEach((i) => {
+      this.inputMerkleMaps[i] = MerkelizedPsbt.createMerkleMap(
+        this.inputMaps[i]
+      );
+      this.inputMapCommitments[i] = this.inputMerkleMaps[i].commitment();
+      this.inputMapsTree.setLeaf(i, hashLeaf(this.inputMapCommitments[i]));
+    });
+    this.changedOutputs.forEach((i) => {
+      this.outputMerkleMaps[i] = MerkelizedPsbt.createMerkleMap(
+        this.outputMaps[i]
+      );
+      this.outputMapCommitments[i] = this.outputMerkleMaps[i].commitment();
+      this.outputMapsTree.setLeaf(i, hashLeaf(this.outputMapCommitments[i]));
+    });
+    this.clearChanges();
+    return this;
+  }
+
+  // These public functions are for MerkelizedPsbt.
+  getGlobalSize(): number {
+    return this.globalMap.size;
+  }
+  getGlobalKeysValuesRoot(): Buffer {
+    return this.globalMerkleMap.commitment();
+  }
+
+  protected onGlobalMapChanged(): void {
+    this.globalMapChanged = true;
+  }
+  protected onInputMapChanged(inputIndex: number): void {
+    this.changedInputs.add(inputIndex);
+  }
+  protected onOutputMapChanged(outputIndex: number): void {
+    this.changedOutputs.add(outputIndex);
+  }
+
+  private merkelizeAll() {
     this.globalMerkleMap = MerkelizedPsbt.createMerkleMap(this.globalMap);
 
+    this.inputMerkleMaps = [];
     for (let i = 0; i < this.getGlobalInputCount(); i++) {
       this.inputMerkleMaps.push(
         MerkelizedPsbt.createMerkleMap(this.inputMaps[i])
@@ -31,7 +107,11 @@ export class MerkelizedPsbt extends PsbtV2 {
     this.inputMapCommitments = [...this.inputMerkleMaps.values()].map((v) =>
       v.commitment()
     );
+    this.inputMapsTree = new Merkle(
+      this.inputMapCommitments.map((m) => hashLeaf(m))
+    );
 
+    this.outputMerkleMaps = [];
     for (let i = 0; i < this.getGlobalOutputCount(); i++) {
       this.outputMerkleMaps.push(
         MerkelizedPsbt.createMerkleMap(this.outputMaps[i])
@@ -40,26 +120,21 @@ export class MerkelizedPsbt extends PsbtV2 {
     this.outputMapCommitments = [...this.outputMerkleMaps.values()].map((v) =>
       v.commitment()
     );
-  }
-  // These public functions are for MerkelizedPsbt.
-  getGlobalSize(): number {
-    return this.globalMap.size;
-  }
-  getGlobalKeysValuesRoot(): Buffer {
-    return this.globalMerkleMap.commitment();
+    this.outputMapsTree = new Merkle(
+      this.outputMapCommitments.map((m) => hashLeaf(m))
+    );
+
+    this.clearChanges();
   }
 
-  private static createMerkleMap(map: ReadonlyMap<string, Buffer>): MerkleMap {
-    const sortedKeysStrings = [...map.keys()].sort();
-    const values = sortedKeysStrings.map((k) => {
-      const v = map.get(k);
-      if (!v) {
-        throw new Error('No value for key ' + k);
-      }
-      return v;
-    });
-    const sortedKeys = sortedKeysStrings.map((k) => Buffer.from(k, 'hex'));
+  private clearChanges() {
+    this.globalMapChanged = false;
+    this.changedInputs.clear();
+    this.changedOutputs.clear();
+  }
 
-    return new MerkleMap(sortedKeys, values);
+  private static createMerkleMap(map: PsbtMap): MerkleMap {
+    // the keys of the map are already sorted
+    return new MerkleMap(map.keys(), map.values());
   }
 }
@@ -1,72 +1,239 @@
 import { crypto } from 'bitcoinjs-lib';
 
+const HASH_LEN = 32;
+
 /**
  * This class implements the merkle tree used by Ledger Bitcoin app v2+,
  * which is documented at
  * https://github.com/LedgerHQ/app-bitcoin-new/blob/master/doc/merkle.md
+ *
+ * The hashes of all the levels of the tree are stored contiguously in one
+ * array, starting from the leaves. The node with index j of a level is the
+ * parent of the nodes 2j and 2j + 1 of the level below; when the last node of
+ * a level has no sibling, it is copied unchanged in the level above. The node
+ * for the leaves begin, ..., begin + size - 1 of a subtree is therefore at the
+ * level ceil(log2(size)), with index begin >> level.
  */
 export class Merkle {
-  private leaves: Buffer[];
-  private rootNode: Node;
-  private leafNodes: Node[];
+  private nLeaves: number;
+  private nodes: Uint8Array;
+  // index of the first node of each level in nodes
+  private levelOffsets: number[] = [];
+  // index of the first leaf with each hash, keyed by its hex encoding; built
+  // when first needed, and again after a leaf is replaced
+  private leafIndexes?: Map<string, number>;
   private h: (buf: Buffer) => Buffer;
+  // the data hashed for an internal node: 0x01, then the two children
+  private nodePreimage = Buffer.alloc(1 + 2 * HASH_LEN, 1);
   constructor(
     leaves: Buffer[],
     hasher: (buf: Buffer) => Buffer = crypto.sha256
   ) {
-    this.leaves = leaves;
+    this.nLeaves = leaves.length;
     this.h = hasher;
-    const nodes = this.calculateRoot(leaves);
-    this.rootNode = nodes.root;
-    this.leafNodes = nodes.leaves;
+
+    let nNodes = 0;
+    for (let levelSize = leaves.length; ; levelSize = (levelSize + 1) >> 1) {
+      this.levelOffsets.push(nNodes);
+      nNodes += levelSize;
+      if (levelSize <= 1) break;
+    }
+    this.nodes = new Uint8Array(Math.max(nNodes, 1) * HASH_LEN);
+
+    leaves.forEach((leaf, i) => {
+      if (leaf.length != HASH_LEN) throw Error('Invalid leaf length');
+      this.nodes.set(leaf, i * HASH_LEN);
+    });
+    for (let level = 1; level < this.levelOffsets.length; level++) {
+      const levelSize = this.levelSize(level);
+      for (let j = 0; j < levelSize; j++) {
+        this.computeNode(level, j);
+      }
+    }
   }
   getRoot(): Buffer {
-    return this.rootNode.hash;
+    return this.getNode(this.levelOffsets.length - 1, 0);
   }
   size(): number {
-    return this.leaves.length;
+    return this.nLeaves;
   }
   getLeaves(): Buffer[] {
-    return this.leaves;
+    const leaves: Buffer[] = [];
+    for (let i = 0; i < this.nLeaves; i++) {
+      leaves.push(this.getNode(0, i));
+    }
+    return leaves;
   }
   getLeafHash(index: number): Buffer {
-    return this.leafNodes[index].hash;
+    return this.getNode(0, index);
+  }
+  /**
+   * Returns the index of the first leaf with the given hash, hex-encoded, or
+   * undefined if there is no such leaf.
+   */
+  getLeafIndex(leafHashHex: string): number | undefined {
+    if (this.leafIndexes === undefined) {
+      const leafIndexes = new Map<string, number>();
+      for (let i = 0; i < this.nLeaves; i++) {
+        const leafHex = this.getNode(0, i).toString('hex');
+        if (!leafIndexes.has(leafHex)) {
+          leafIndexes.set(leafHex, i);
+        }
+      }
+      this.leafIndexes = leafIndexes;
+    }
+    return this.leafIndexes.get(leafHashHex);
+  }
+  /**
+   * Replaces the leaf with the given index, and updates the hashes of its
+   * ancestors, in O(log n).
+   */
+  setLeaf(index: number, leaf: Buffer): void {
+    if (index >= this.nLeaves) throw Error('Index out of bounds');
+    if (leaf.length != HASH_LEN) throw Error('Invalid leaf length');
+    this.nodes.set(leaf, index * HASH_LEN);
+    this.leafIndexes = undefined;
+
+    for (let level = 1; level < this.levelOffsets.length; level++) {
+      index >>= 1;
+      this.computeNode(level, index);
+    }
   }
   getProof(index: number): Buffer[] {
-    if (index >= this.leaves.length) throw Error('Index out of bounds');
-    return proveNode(this.leafNodes[index]);
-  }
-
-  calculateRoot(leaves: Buffer[]): {
-    root: Node;
-    leaves: Node[];
-  } {
-    const n = leaves.length;
-    if (n == 0) {
-      return {
-        root: new Node(undefined, undefined, Buffer.alloc(32, 0)),
-        leaves: [],
-      };
+    if (index >= this.nLeaves) throw Error('Index out of bounds');
+    const proof: Buffer[] = [];
+    for (let level = 0; level < this.levelOffsets.length - 1; level++) {
+      const sibling = index ^ 1;
+      if (sibling < this.levelSize(level)) {
+        proof.push(this.getNode(level, sibling));
+      }
+      index >>= 1;
     }
-    if (n == 1) {
-      const newNode = new Node(undefined, undefined, leaves[0]);
-      return { root: newNode, leaves: [newNode] };
+    return proof;
+  }
+  /**
+   * Returns the multiproof for the leaves with indexes firstIndex, ...,
+   * firstIndex + nLeaves - 1: the hashes, in left-to-right order, of the
+   * requested leaves and of the maximal subtrees that do not contain any of
+   * the requested leaves.
+   */
+  getMultiProof(firstIndex: number, nLeaves: number): Buffer[] {
+    if (
+      nLeaves <= 0 ||
+      firstIndex < 0 ||
+      firstIndex + nLeaves > this.nLeaves
+    )
+      throw Error('Index out of bounds');
+    const proof: Buffer[] = [];
+    this.proveRange(0, this.nLeaves, firstIndex, firstIndex + nLeaves, proof);
+    return proof;
+  }
+
+  /**
+   * Returns the multiproof for the leaves with the given strictly increasing
+   * indexes, in the same format as getMultiProof.
+   */
+  getLeafSetMultiProof(indexes: readonly number[]): Buffer[] {
+    if (
+      indexes.length == 0 ||
+      indexes[0] < 0 ||
+      indexes[indexes.length - 1] >= this.nLeaves
+    )
+      throw Error('Index out of bounds');
+    for (let i = 1; i < indexes.length; i++) {
+      if (indexes[i] <= indexes[i - 1])
+        throw Error('Indexes must be strictly increasing');
     }
-    const leftCount = highestPowerOf2LessThan(n);
-    const leftBranch = this.calculateRoot(leaves.slice(0, leftCount));
-    const rightBranch = this.calculateRoot(leaves.slice(leftCount));
-    const leftChild = leftBranch.root;
-    const rightChild = rightBranch.root;
-    const hash = this.hashNode(leftChild.hash, rightChild.hash);
-    const node = new Node(leftChild, rightChild, hash);
-    leftChild.parent = node;
-    rightChild.parent = node;
-    return { root: node, leaves: leftBranch.leaves.concat(rightBranch.leaves) };
+    const proof: Buffer[] = [];
+    this.proveSet(0, this.nLeaves, indexes, 0, proof);
+    return proof;
   }
 
   hashNode(left: Buffer, right: Buffer): Buffer {
     return this.h(Buffer.concat([Buffer.from([1]), left, right]));
   }
+
+  private levelSize(level: number): number {
+    const next = this.levelOffsets[level + 1];
+    return (
+      (next === undefined ? this.levelOffsets[level] + 1 : next) -
+      this.levelOffsets[level]
+    );
+  }
+
+  // Returns a copy of the hash of a node, so that it is not modified by setLeaf
+  private getNode(level: number, index: number): Buffer {
+    if (this.nLeaves == 0) {
+      return Buffer.alloc(HASH_LEN, 0);
+    }
+    const start = (this.levelOffsets[level] + index) * HASH_LEN;
+    return Buffer.from(this.nodes.subarray(start, start + HASH_LEN));
+  }
+
+  // Returns the hash of the subtree for the leaves begin, ..., begin + size - 1
+  private getSubtree(begin: number, size: number): Buffer {
+    const level = size <= 1 ? 0 : 32 - Math.clz32(size - 1);
+    return this.getNode(level, begin >> level);
+  }
+
+  private computeNode(level: number, index: number) {
+    const children = this.levelOffsets[level - 1] + 2 * index;
+    const start = (this.levelOffsets[level] + index) * HASH_LEN;
+    if (2 * index + 1 >= this.levelSize(level - 1)) {
+      // no sibling, the node is copied
+      this.nodes.copyWithin(
+        start,
+        children * HASH_LEN,
+        (children + 1) * HASH_LEN
+      );
+      return;
+    }
+    this.nodePreimage.set(
+      this.nodes.subarray(children * HASH_LEN, (children + 2) * HASH_LEN),
+      1
+    );
+    this.nodes.set(this.h(this.nodePreimage), start);
+  }
+
+  private proveRange(
+    begin: number,
+    size: number,
+    first: number,
+    end: number,
+    proof: Buffer[]
+  ) {
+    if (size == 1 || begin >= end || begin + size <= first) {
+      proof.push(this.getSubtree(begin, size));
+      return;
+    }
+    const leftCount = highestPowerOf2LessThan(size);
+    this.proveRange(begin, leftCount, first, end, proof);
+    this.proveRange(begin + leftCount, size - leftCount, first, end, proof);
+  }
+
+  // indexes[from], ... are the requested indexes that are not before begin
+  private proveSet(
+    begin: number,
+    size: number,
+    indexes: readonly number[],
+    from: number,
+    proof: Buffer[]
+  ): number {
+    while (from < indexes.length && indexes[from] < begin) from++;
+    if (size == 1 || from == indexes.length || indexes[from] >= begin + size) {
+      proof.push(this.getSubtree(begin, size));
+      return from;
+    }
+    const leftCount = highestPowerOf2LessThan(size);
+    from = this.proveSet(begin, leftCount, indexes, from, proof);
+    return this.proveSet(
+      begin + leftCount,
+      size - leftCount,
+      indexes,
+      from,
+      proof
+    );
+  }
 }
 
 export function hashLeaf(
@@ -84,38 +251,6 @@ function hashConcat(
   return hashFunction(Buffer.concat([bufA, bufB]));
 }
 
-class Node {
-  leftChild?: Node;
-  rightChild?: Node;
-  parent?: Node;
-  hash: Buffer;
-  constructor(left: Node | undefined, right: Node | undefined, hash: Buffer) {
-    this.leftChild = left;
-    this.rightChild = right;
-    this.hash = hash;
-  }
-  isLeaf(): boolean {
-    return this.leftChild == undefined;
-  }
-}
-
-function proveNode(node: Node): Buffer[] {
-  if (!node.parent) {
-    return [];
-  }
-  if (node.parent.leftChild == node) {
-    if (!node.parent.rightChild) {
-      throw new Error('Expected right child to exist');
-    }
-    return [node.parent.rightChild.hash, ...proveNode(node.parent)];
-  } else {
-    if (!node.parent.leftChild) {
-      throw new Error('Expected left child to exist');
-    }
-    return [node.parent.leftChild.hash, ...proveNode(node.parent)];
-  }
-}
-
 function highestPowerOf2LessThan(n: number) {
   if (n < 2) {
     throw Error('Expected n >= 2');
@@ -27,7 +27,7 @@ export class MerkleMap {
 
     // Sanity check: verify that keys are actually sorted and with no duplicates
     for (let i = 0; i < keys.length - 1; i++) {
-      if (keys[i].toString('hex') >= keys[i + 1].toString('hex')) {
+      if (Buffer.compare(keys[i], keys[i + 1]) >= 0) {
         throw new Error('keys must be in strictly increasing order');
       }
     }
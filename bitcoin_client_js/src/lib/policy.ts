@@ -12,11 +12,17 @@ const WALLET_POLICY_V2 = 2;
  * a serialized BIP32 extended public key with some added derivation path
  * information. This is documented at
  * https://github.com/LedgerHQ/app-bitcoin-new/blob/master/doc/wallet.md
+ *
+ * A wallet policy is immutable: its serialization, its id and the Merkle tree
+ * of its keys are computed once, when first needed.
  */
 export class WalletPolicy {
   readonly name: string;
   readonly descriptorTemplate: string;
   readonly keys: readonly string[];
+  private serialized?: Buffer;
+  private id?: Buffer;
+  private keysTree?: Merkle;
   /**
    * Creates and instance of a wallet policy.
    * @param name an ascii string, up to 16 bytes long; it must be an empty string for default wallet policies
@@ -37,7 +43,22 @@ export class WalletPolicy {
    * Returns the unique 32-bytes id of this wallet policy.
    */
   getId(): Buffer {
-    return crypto.sha256(this.serialize());
+    if (!this.id) {
+      this.id = crypto.sha256(this.serialize());
+    }
+    return Buffer.from(this.id);
+  }
+
+  /**
+   * Returns the Merkle tree of the keys, which must not be modified.
+   */
+  getKeysTree(): Merkle {
+    if (!this.keysTree) {
+      this.keysTree = new Merkle(
+        this.keys.map((k) => hashLeaf(Buffer.from(k, 'ascii')))
+      );
+    }
+    return this.keysTree;
   }
 
   /**
@@ -45,11 +66,13 @@ export class WalletPolicy {
    * @returns the serialized wallet policy
    */
   serialize(): Buffer {
-    const keyBuffers = this.keys.map((k) => {
-      return Buffer.from(k, 'ascii');
-    });
-    const m = new Merkle(keyBuffers.map((k) => hashLeaf(k)));
+    if (!this.serialized) {
+      this.serialized = this.computeSerialization();
+    }
+    return Buffer.from(this.serialized);
+  }
 
+  private computeSerialization(): Buffer {
     const buf = new BufferWriter();
     buf.writeUInt8(WALLET_POLICY_V2); // wallet version
 
@@ -64,7 +87,7 @@ export class WalletPolicy {
     // number of keys
     buf.writeVarInt(this.keys.length);
     // root of Merkle tree of keys
-    buf.writeSlice(m.getRoot());
+    buf.writeSlice(this.getKeysTree().getRoot());
     return buf.buffer();
   }
 }
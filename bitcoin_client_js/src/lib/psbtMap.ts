@@ -0,0 +1,115 @@
+/**
+ * A key/value map of a PSBT, whose keys are the binary serialization of the
+ * key type followed by the key data.
+ *
+ * The keys are kept sorted on insertion, which is both the order in which the
+ * map is serialized and the order of the keys of its Merkleized map (see
+ * `MerkleMap`), so neither of them needs to sort or to decode the keys. A
+ * PSBT map only has a few entries; therefore, keys are searched by bisection
+ * in a sorted array, which is inserted into in linear time.
+ */
+export class PsbtMap {
+  private keyList: Buffer[] = [];
+  private valueList: Buffer[] = [];
+
+  get size(): number {
+    return this.keyList.length;
+  }
+
+  /**
+   * Returns the keys, in increasing order; the returned array is not modified
+   * by the later changes to the map.
+   */
+  keys(): Buffer[] {
+    return this.keyList.slice();
+  }
+
+  /**
+   * Returns the values, in the same order as the keys returned by `keys`.
+   */
+  values(): Buffer[] {
+    return this.valueList.slice();
+  }
+
+  get(keyType: number, keyData: Buffer): Buffer | undefined {
+    const index = this.find(keyType, keyData);
+    return index >= 0 ? this.valueList[index] : undefined;
+  }
+
+  set(keyType: number, keyData: Buffer, value: Buffer): void {
+    const index = this.find(keyType, keyData);
+    if (index >= 0) {
+      this.valueList[index] = value;
+      return;
+    }
+    const key = Buffer.alloc(1 + keyData.length);
+    key[0] = keyType;
+    keyData.copy(key, 1);
+    this.keyList.splice(-index - 1, 0, key);
+    this.valueList.splice(-index - 1, 0, value);
+  }
+
+  /**
+   * Sets the value of a serialized key, that must not be empty.
+   */
+  setKey(key: Buffer, value: Buffer): void {
+    const keyData = key.subarray(1);
+    const index = this.find(key[0], keyData);
+    if (index >= 0) {
+      this.valueList[index] = value;
+      return;
+    }
+    this.keyList.splice(-index - 1, 0, key);
+    this.valueList.splice(-index - 1, 0, value);
+  }
+
+  /**
+   * Removes the entries whose key type is one of `keyTypes`.
+   */
+  deleteKeyTypes(keyTypes: readonly number[]): void {
+    for (let i = this.keyList.length - 1; i >= 0; i--) {
+      if (keyTypes.includes(this.keyList[i][0])) {
+        this.keyList.splice(i, 1);
+        this.valueList.splice(i, 1);
+      }
+    }
+  }
+
+  /**
+   * Calls `fn` on each entry, in the order of the keys.
+   */
+  forEach(fn: (value: Buffer, key: Buffer) => void): void {
+    for (let i = 0; i < this.keyList.length; i++) {
+      fn(this.valueList[i], this.keyList[i]);
+    }
+  }
+
+  /**
+   * Returns a copy of the map, whose values are copied as well.
+   */
+  copy(): PsbtMap {
+    const result = new PsbtMap();
+    result.keyList = this.keyList.slice();
+    result.valueList = this.valueList.map((v) => Buffer.from(v));
+    return result;
+  }
+
+  // Returns the index of the key if it is in the map, or -(i + 1) where i is
+  // the index where it would be inserted otherwise.
+  private find(keyType: number, keyData: Buffer): number {
+    let lo = 0;
+    let hi = this.keyList.length;
+    while (lo < hi) {
+      const mid = (lo + hi) >>> 1;
+      const key = this.keyList[mid];
+      const cmp =
+        key[0] != keyType
+          ? key[0] - keyType
+          : key.compare(keyData, 0, keyData.length, 1);
+      if (cmp == 0) return mid;
+      if (cmp < 0) lo = mid + 1;
+      else hi = mid;
+    }
+    return -lo - 1;
+  }
+}
@@ -8,6 +8,7 @@ import {
   unsafeFrom64bitLE,
   unsafeTo64bitLE,
 } from './buffertools';
+import { PsbtMap } from './psbtMap';
 import { sanitizeBigintToNumber } from './varint';
 
 export enum psbtGlobal {
@@ -65,9 +66,9 @@ export class NoSuchEntry extends Error {}
  * complemantary fields as needed in the future.
  */
 export class PsbtV2 {
-  protected globalMap: Map<string, Buffer> = new Map();
-  protected inputMaps: Map<string, Buffer>[] = [];
-  protected outputMaps: Map<string, Buffer>[] = [];
+  protected globalMap: PsbtMap = new PsbtMap();
+  protected inputMaps: PsbtMap[] = [];
+  protected outputMaps: PsbtMap[] = [];
 
   setGlobalTxVersion(version: number) {
     this.setGlobal(psbtGlobal.TX_VERSION, uint32LE(version));
@@ -323,32 +324,42 @@ export class PsbtV2 {
   }
 
   deleteInputEntries(inputIndex: number, keyTypes: readonly psbtIn[]) {
-    const map = this.inputMaps[inputIndex];
-    map.forEach((_v, k, m) => {
-      if (this.isKeyType(k, keyTypes)) {
-        m.delete(k);
-      }
-    });
+    this.inputMaps[inputIndex].deleteKeyTypes(keyTypes);
+    this.onInputMapChanged(inputIndex);
+  }
+
+  /**
+   * Called after the global map is modified with one of the setters; subclasses can override it
+   * to track the changes.
+   */
+  protected onGlobalMapChanged(): void {
+    // nothing to do
+  }
+  /**
+   * Called after the map of the input with the given index is modified with one of the setters or
+   * with `deleteInputEntries`; subclasses can override it to track the changes.
+   */
+  protected onInputMapChanged(_inputIndex: number): void {
+    // nothing to do
+  }
+  /**
+   * Called after the map of the output with the given index is modified with one of the setters;
+   * subclasses can override it to track the changes.
+   */
+  protected onOutputMapChanged(_outputIndex: number): void {
+    // nothing to do
   }
 
   copy(to: PsbtV2) {
-    this.copyMap(this.globalMap, to.globalMap);
+    to.globalMap = this.globalMap.copy();
     this.copyMaps(this.inputMaps, to.inputMaps);
     this.copyMaps(this.outputMaps, to.outputMaps);
   }
-  copyMaps(
-    from: readonly ReadonlyMap<string, Buffer>[],
-    to: Map<string, Buffer>[]
-  ) {
+  copyMaps(from: readonly PsbtMap[], to: PsbtMap[]) {
     from.forEach((m, index) => {
-      const to_index = new Map();
-      this.copyMap(m, to_index);
-      to[index] = to_index;
+      to[index] = m.copy();
     });
   }
-  copyMap(from: ReadonlyMap<string, Buffer>, to: Map<string, Buffer>) {
-    from.forEach((v, k) => to.set(k, Buffer.from(v)));
-  }
   serialize(): Buffer {
     const buf = new BufferWriter();
     buf.writeSlice(Buffer.from([0x70, 0x73, 0x62, 0x74, 0xff]));
@@ -368,11 +379,11 @@ export class PsbtV2 {
     }
     while (this.readKeyPair(this.globalMap, buf));
     for (let i = 0; i < this.getGlobalInputCount(); i++) {
-      this.inputMaps[i] = new Map();
+      this.inputMaps[i] = new PsbtMap();
       while (this.readKeyPair(this.inputMaps[i], buf));
     }
     for (let i = 0; i < this.getGlobalOutputCount(); i++) {
-      this.outputMaps[i] = new Map();
+      this.outputMaps[i] = new PsbtMap();
       while (this.readKeyPair(this.outputMaps[i], buf));
     }
   }
@@ -458,36 +469,28 @@ export class PsbtV2 {
     });
     return this;
   }
-  private readKeyPair(map: Map<string, Buffer>, buf: BufferReader): boolean {
+  private readKeyPair(map: PsbtMap, buf: BufferReader): boolean {
     const keyLen = sanitizeBigintToNumber(buf.readVarInt());
     if (keyLen == 0) {
       return false;
     }
-    const keyType = buf.readUInt8();
-    const keyData = buf.readSlice(keyLen - 1);
+    const key = buf.readSlice(keyLen);
     const value = buf.readVarSlice();
-    set(map, keyType, keyData, value);
+    map.setKey(key, value);
     return true;
   }
-  private getKeyDatas(
-    map: ReadonlyMap<string, Buffer>,
-    keyType: KeyType
-  ): readonly Buffer[] {
+  private getKeyDatas(map: PsbtMap, keyType: KeyType): readonly Buffer[] {
     const result: Buffer[] = [];
     map.forEach((_v, k) => {
-      if (this.isKeyType(k, [keyType])) {
-        result.push(Buffer.from(k.substring(2), 'hex'));
+      if (k[0] == keyType) {
+        result.push(Buffer.from(k.subarray(1)));
       }
     });
     return result;
   }
-  private isKeyType(hexKey: string, keyTypes: readonly KeyType[]): boolean {
-    const keyType = Buffer.from(hexKey.substring(0, 2), 'hex').readUInt8(0);
-    return keyTypes.some((k) => k == keyType);
-  }
   private setGlobal(keyType: KeyType, value: Buffer) {
-    const key = new Key(keyType, Buffer.from([]));
-    this.globalMap.set(key.toString(), value);
+    this.globalMap.set(keyType, b(), value);
+    this.onGlobalMapChanged();
   }
   private getGlobal(keyType: KeyType): Buffer {
     return get(this.globalMap, keyType, b(), false)!;
@@ -501,7 +504,8 @@ export class PsbtV2 {
     keyData: Buffer,
     value: Buffer
   ) {
-    set(this.getMap(index, this.inputMaps), keyType, keyData, value);
+    this.getMap(index, this.inputMaps).set(keyType, keyData, value);
+    this.onInputMapChanged(index);
   }
   private getInput(index: number, keyType: KeyType, keyData: Buffer): Buffer {
     return get(this.inputMaps[index], keyType, keyData, false)!;
@@ -519,19 +523,17 @@ export class PsbtV2 {
     keyData: Buffer,
     value: Buffer
   ) {
-    set(this.getMap(index, this.outputMaps), keyType, keyData, value);
+    this.getMap(index, this.outputMaps).set(keyType, keyData, value);
+    this.onOutputMapChanged(index);
   }
   private getOutput(index: number, keyType: KeyType, keyData: Buffer): Buffer {
     return get(this.outputMaps[index], keyType, keyData, false)!;
   }
-  private getMap(
-    index: number,
-    maps: Map<string, Buffer>[]
-  ): Map<string, Buffer> {
+  private getMap(index: number, maps: PsbtMap[]): PsbtMap {
     if (maps[index]) {
       return maps[index];
     }
-    return (maps[index] = new Map());
+    return (maps[index] = new PsbtMap());
   }
   private encodeBip32Derivation(
     masterFingerprint: Buffer,
@@ -598,82 +600,36 @@ export class PsbtV2 {
   }
 }
 function get(
-  map: ReadonlyMap<string, Buffer>,
+  map: PsbtMap,
   keyType: KeyType,
   keyData: Buffer,
   acceptUndefined: boolean
 ): Buffer | undefined {
   if (!map) throw Error('No such map');
-  const key = new Key(keyType, keyData);
-  const value = map.get(key.toString());
+  const value = map.get(keyType, keyData);
   if (!value) {
     if (acceptUndefined) {
       return undefined;
     }
-    throw new NoSuchEntry(key.toString());
+    const key = Buffer.concat([Buffer.from([keyType]), keyData]);
+    throw new NoSuchEntry(key.toString('hex'));
   }
   // Make sure to return a copy, to protect the underlying data.
   return Buffer.from(value);
 }
 type KeyType = number;
 
-class Key {
-  readonly keyType: KeyType;
-  readonly keyData: Buffer;
-  constructor(keyType: KeyType, keyData: Buffer) {
-    this.keyType = keyType;
-    this.keyData = keyData;
-  }
-  toString(): string {
-    const buf = new BufferWriter();
-    this.toBuffer(buf);
-    return buf.buffer().toString('hex');
-  }
-  serialize(buf: BufferWriter) {
-    buf.writeVarInt(1 + this.keyData.length);
-    this.toBuffer(buf);
-  }
-  private toBuffer(buf: BufferWriter) {
-    buf.writeUInt8(this.keyType);
-    buf.writeSlice(this.keyData);
-  }
-}
-class KeyPair {
-  readonly key: Key;
-  readonly value: Buffer;
-  constructor(key: Key, value: Buffer) {
-    this.key = key;
-    this.value = value;
-  }
-  serialize(buf: BufferWriter) {
-    this.key.serialize(buf);
-    buf.writeVarSlice(this.value);
-  }
-}
-function createKey(buf: Buffer): Key {
-  return new Key(buf.readUInt8(0), buf.slice(1));
-}
-function serializeMap(buf: BufferWriter, map: ReadonlyMap<string, Buffer>) {
-  for (const key of map.keys()) {
-    const value = map.get(key)!;
-    const keyPair = new KeyPair(createKey(Buffer.from(key, 'hex')), value);
-    keyPair.serialize(buf);
-  }
+function serializeMap(buf: BufferWriter, map: PsbtMap) {
+  map.forEach((value, key) => {
+    buf.writeVarSlice(key);
+    buf.writeVarSlice(value);
+  });
   buf.writeUInt8(0);
 }
 
 function b(): Buffer {
   return Buffer.from([]);
 }
-function set(
-  map: Map<string, Buffer>,
-  keyType: KeyType,
-  keyData: Buffer,
-  value: Buffer
-) {
-  const key = new Key(keyType, keyData);
-  map.set(key.toString(), value);
-}
 function uint32LE(n: number): Buffer {
   const buf = Buffer.alloc(4);
   buf.writeUInt32LE(n, 0);
@@ -0,0 +1,74 @@
+import { ClientCommandInterpreter } from './clientCommands';
+
+// the only maximum length of the responses of the interpreter
+const MAX_RESPONSE_LEN = 255;
+
+/**
+ * The client commands of a session recorded with the Python client (`SessionRecording` in its
+ * apdu_trace module), with the data known to its interpreter.
+ */
+export type SessionRecording = {
+  queuedYields: boolean;
+  preimages: Buffer[];
+  lists: Buffer[][];
+  // the requests of the hardware wallet, with the responses of the host
+  clientCommands: [Buffer, Buffer][];
+};
+
+/**
+ * Parses a session recording exported by the Python client.
+ */
+export function parseSessionRecording(json: string): SessionRecording {
+  const obj = JSON.parse(json);
+  if (obj.max_response_len != MAX_RESPONSE_LEN) {
+    throw new Error('Unsupported max_response_len: ' + obj.max_response_len);
+  }
+  const fromHex = (s: string) => Buffer.from(s, 'hex');
+  return {
+    queuedYields: obj.queued_yields,
+    preimages: obj.preimages.map(fromHex),
+    lists: obj.lists.map((elements: string[]) => elements.map(fromHex)),
+    clientCommands: obj.client_commands.map(
+      ([request, response]: [string, string]) => [
+        fromHex(request),
+        fromHex(response),
+      ]
+    ),
+  };
+}
+
+/**
+ * Returns a new interpreter with the known data and the settings of the recorded one.
+ */
+export function createSessionInterpreter(
+  recording: SessionRecording
+): ClientCommandInterpreter {
+  const interpreter = new ClientCommandInterpreter();
+  for (const preimage of recording.preimages) {
+    interpreter.addKnownPreimage(preimage);
+  }
+  for (const elements of recording.lists) {
+    interpreter.addKnownList(elements);
+  }
+  interpreter.setQueuedYields(recording.queuedYields);
+  return interpreter;
+}
+
+/**
+ * Feeds the recorded requests to the interpreter (by default, a new one), and throws if one of its
+ * responses is not the recorded one. It can be used to benchmark the interpreter without a device.
+ */
+export function replaySession(
+  recording: SessionRecording,
+  interpreter: ClientCommandInterpreter = createSessionInterpreter(recording)
+): void {
+  recording.clientCommands.forEach(([request, expected], i) => {
+    const response = interpreter.execute(request);
+    if (!response.equals(expected)) {
+      throw new Error(
+        `Unexpected response to the client command at position ${i}: ` +
+          request.toString('hex')
+      );
+    }
+  });
+}
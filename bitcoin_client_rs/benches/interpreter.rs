@@ -0,0 +1,143 @@
+//! Benchmarks the client-side commands that the device requests while signing a PSBT, for PSBTs
+//! with an increasing number of inputs.
+
+use core::convert::TryFrom;
+
+use bitcoin::{
+    consensus::encode::{self, VarInt},
+    hashes::{sha256, Hash},
+};
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion};
+
+use ledger_bitcoin_client::interpreter::{get_merkleized_map_commitment, ClientCommandInterpreter};
+
+const GET_PREIMAGE: u8 = 0x40;
+const GET_MERKLE_LEAF_PROOF: u8 = 0x41;
+const GET_MERKLE_LEAF_INDEX: u8 = 0x42;
+const GET_MORE_ELEMENTS: u8 = 0xA0;
+
+fn element_hash(element: &[u8]) -> [u8; 32] {
+    let mut preimage = vec![0x00];
+    preimage.extend_from_slice(element);
+    sha256::Hash::hash(&preimage).into_inner()
+}
+
+/// Returns a map similar to a PSBT input map, with a non-witness utxo, a witness utxo, a sighash
+/// type and a bip32 derivation.
+fn input_map(i: u32) -> Vec<(Vec<u8>, Vec<u8>)> {
+    let mut pubkey = vec![0x02];
+    pubkey.extend_from_slice(&sha256::Hash::hash(&i.to_le_bytes()).into_inner());
+
+    let mut bip32_derivation_key = vec![0x06];
+    bip32_derivation_key.extend_from_slice(&pubkey);
+
+    vec![
+        (vec![0x00], vec![i as u8; 400]),
+        (vec![0x01], vec![i as u8; 31]),
+        (vec![0x03], 1u32.to_le_bytes().to_vec()),
+        (bip32_derivation_key, vec![i as u8; 24]),
+        (vec![0x0e], vec![i as u8; 32]),
+        (vec![0x0f], i.to_le_bytes().to_vec()),
+    ]
+}
+
+struct Session {
+    inputs_root: [u8; 32],
+    inputs: Vec<(Vec<(Vec<u8>, Vec<u8>)>, [u8; 32], [u8; 32])>,
+}
+
+fn prepare(n_inputs: u32) -> (ClientCommandInterpreter, Session) {
+    let mut interpreter = ClientCommandInterpreter::new();
+
+    let mut commitments = Vec::new();
+    let mut inputs = Vec::new();
+    for i in 0..n_inputs {
+        let map = input_map(i);
+        interpreter.add_known_mapping(&map);
+        let commitment = get_merkleized_map_commitment(&map);
+
+        let keys_root = <[u8; 32]>::try_from(&commitment[1..33]).unwrap();
+        let values_root = <[u8; 32]>::try_from(&commitment[33..65]).unwrap();
+        commitments.push(commitment);
+        inputs.push((map, keys_root, values_root));
+    }
+    let inputs_root = interpreter.add_known_list(&commitments);
+
+    (
+        interpreter,
+        Session {
+            inputs_root,
+            inputs,
+        },
+    )
+}
+
+fn execute(interpreter: &mut ClientCommandInterpreter, request: Vec<u8>) -> Vec<u8> {
+    let response = interpreter.execute(request).unwrap();
+    black_box(&response);
+    response
+}
+
+/// Fetches the element with the given index from a Merkleized list, as the device does.
+fn get_leaf_element(
+    interpreter: &mut ClientCommandInterpreter,
+    root: &[u8; 32],
+    size: usize,
+    index: usize,
+) {
+    let mut request = vec![GET_MERKLE_LEAF_PROOF];
+    request.extend_from_slice(root);
+    request.extend(encode::serialize(&VarInt(size as u64)));
+    request.extend(encode::serialize(&VarInt(index as u64)));
+    let response = execute(interpreter, request);
+
+    let (proof_len, n_response_elements) = (response[32], response[33]);
+    if proof_len > n_response_elements {
+        execute(interpreter, vec![GET_MORE_ELEMENTS]);
+    }
+
+    let mut request = vec![GET_PREIMAGE, 0x00];
+    request.extend_from_slice(&response[..32]);
+    let response = execute(interpreter, request);
+
+    let (preimage_len, read): (VarInt, usize) = encode::deserialize_partial(&response).unwrap();
+    let mut received = response[read] as u64;
+    while received < preimage_len.0 {
+        let response = execute(interpreter, vec![GET_MORE_ELEMENTS]);
+        received += response[0] as u64;
+    }
+}
+
+/// Simulates the requests for one pass over the inputs of the PSBT: for each input, the device
+/// gets its commitment, then looks up and fetches each of its values.
+fn sign_pass(interpreter: &mut ClientCommandInterpreter, session: &Session) {
+    let n_inputs = session.inputs.len();
+    for (i, (map, keys_root, values_root)) in session.inputs.iter().enumerate() {
+        get_leaf_element(interpreter, &session.inputs_root, n_inputs, i);
+
+        for (key, _) in map {
+            let mut request = vec![GET_MERKLE_LEAF_INDEX];
+            request.extend_from_slice(keys_root);
+            request.extend_from_slice(&element_hash(key));
+            let response = execute(interpreter, request);
+
+            let leaf_index: VarInt = encode::deserialize(&response[1..]).unwrap();
+            get_leaf_element(interpreter, values_root, map.len(), leaf_index.0 as usize);
+        }
+    }
+}
+
+fn bench_sign_psbt(c: &mut Criterion) {
+    let mut group = c.benchmark_group("sign_psbt_client_commands");
+    group.sample_size(10);
+    for n_inputs in [10, 100, 1000] {
+        let (mut interpreter, session) = prepare(n_inputs);
+        group.bench_with_input(BenchmarkId::from_parameter(n_inputs), &session, |b, s| {
+            b.iter(|| sign_pass(&mut interpreter, s))
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_sign_psbt);
+criterion_main!(benches);
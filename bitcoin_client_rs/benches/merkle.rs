@@ -0,0 +1,50 @@
+//! Benchmarks the construction of the Merkle trees of the client and their proofs, for trees with
+//! an increasing number of leaves. To compare two revisions, run
+//! `cargo bench --bench merkle -- --save-baseline before` on the first one, then
+//! `cargo bench --bench merkle -- --baseline before` on the second one.
+
+#[allow(dead_code)]
+#[path = "../src/merkle.rs"]
+mod merkle;
+
+use bitcoin::hashes::{sha256, Hash};
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+use merkle::MerkleTree;
+
+fn leaves(n_leaves: u32) -> Vec<[u8; 32]> {
+    (0..n_leaves)
+        .map(|i| sha256::Hash::hash(&i.to_le_bytes()).into_inner())
+        .collect()
+}
+
+fn bench_merkle_tree(c: &mut Criterion) {
+    let mut group = c.benchmark_group("merkle_tree_new");
+    for n_leaves in [16, 256, 4096] {
+        let leaves = leaves(n_leaves);
+        group.throughput(Throughput::Elements(n_leaves as u64));
+        group.bench_with_input(
+            BenchmarkId::from_parameter(n_leaves),
+            &leaves,
+            |b, leaves| b.iter(|| MerkleTree::new(black_box(leaves.clone()))),
+        );
+    }
+    group.finish();
+
+    let mut group = c.benchmark_group("merkle_tree_proofs");
+    for n_leaves in [16, 256, 4096] {
+        let tree = MerkleTree::new(leaves(n_leaves));
+        group.throughput(Throughput::Elements(n_leaves as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(n_leaves), &tree, |b, tree| {
+            b.iter(|| {
+                for i in 0..tree.size() {
+                    black_box(tree.get_leaf_proof(i));
+                }
+            })
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_merkle_tree);
+criterion_main!(benches);
@@ -0,0 +1,31 @@
+//! Benchmarks the interpreter on the client commands of the sessions recorded with the Python
+//! client (see `SessionRecording` in its apdu_trace module). More recordings can be given in the
+//! SESSION_RECORDINGS environment variable, separated by commas.
+
+#[allow(dead_code)]
+#[path = "../tests/utils/session.rs"]
+mod session;
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+
+use session::SessionRecording;
+
+fn bench_replay(c: &mut Criterion) {
+    let mut paths = vec!["../tests/sessions/sign_psbt_sh_wpkh.json".to_string()];
+    if let Ok(more) = std::env::var("SESSION_RECORDINGS") {
+        paths.extend(more.split(',').map(String::from));
+    }
+
+    let mut group = c.benchmark_group("replay_session");
+    for path in paths {
+        let recording = SessionRecording::load(&path);
+        group.throughput(Throughput::Elements(recording.client_commands.len() as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(&path), &recording, |b, r| {
+            b.iter(|| r.replay(&mut r.new_interpreter()))
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_replay);
+criterion_main!(benches);
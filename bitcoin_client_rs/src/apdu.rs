@@ -4,6 +4,80 @@ use core::fmt::Debug;
 // p2 encodes the protocol version implemented
 pub const CURRENT_PROTOCOL_VERSION: u8 = 1;
 
+// version 2 of the protocol only changes SIGN_PSBT, which queues the YIELD messages in the responses
+pub const QUEUED_YIELDS_PROTOCOL_VERSION: u8 = 2;
+
+// version 4 of the protocol references the hashes already exchanged in GET_MERKLE_LEAF_PROOF_REFS, on
+// apps with app_feature::HASH_REFS (version 3 only changes SIGN_MESSAGE)
+pub const HASH_REFS_PROTOCOL_VERSION: u8 = 4;
+
+// version 5 of the protocol announces the values read next with ANNOUNCE_ACCESS_PLAN, on apps with
+// app_feature::ACCESS_PLANS
+pub const ACCESS_PLAN_PROTOCOL_VERSION: u8 = 5;
+
+// version 6 of the protocol streams the leaves of Merkle trees with STREAM_MERKLE_TREE, on apps with
+// app_feature::TREE_STREAMS
+pub const TREE_STREAM_PROTOCOL_VERSION: u8 = 6;
+
+/// Returns the highest version of the protocol of SIGN_PSBT supported by both the client and the
+/// app with the given features; each version packs more data in the responses to the client
+/// commands, saving round trips.
+pub fn sign_psbt_protocol_version(features: u32) -> u8 {
+    if features & app_feature::TREE_STREAMS != 0 {
+        TREE_STREAM_PROTOCOL_VERSION
+    } else if features & app_feature::ACCESS_PLANS != 0 {
+        ACCESS_PLAN_PROTOCOL_VERSION
+    } else if features & app_feature::HASH_REFS != 0 {
+        HASH_REFS_PROTOCOL_VERSION
+    } else if features & app_feature::QUEUED_YIELDS != 0 {
+        QUEUED_YIELDS_PROTOCOL_VERSION
+    } else {
+        CURRENT_PROTOCOL_VERSION
+    }
+}
+
+/// Bits of the feature bitmap returned by GET_APP_FEATURES.
+pub mod app_feature {
+    /// The app uses the GET_MERKLE_LEAF_PROOFS client command
+    pub const MERKLE_LEAF_PROOFS: u32 = 1 << 0;
+    /// GET_WALLET_ADDRESSES is supported
+    pub const GET_WALLET_ADDRESSES: u32 = 1 << 1;
+    /// GET_EXTENDED_PUBKEYS is supported
+    pub const GET_EXTENDED_PUBKEYS: u32 = 1 << 2;
+    /// OPEN_WALLET_SESSION is supported
+    pub const WALLET_SESSIONS: u32 = 1 << 3;
+    /// SIGN_PSBT supports version 2 of the protocol
+    pub const QUEUED_YIELDS: u32 = 1 << 4;
+    /// The app uses the GET_MERKLE_LEAF_ELEMENTS client command
+    pub const MERKLE_LEAF_ELEMENTS: u32 = 1 << 5;
+    /// CONTINUE accepts extended-length APDUs
+    pub const EXTENDED_APDUS: u32 = 1 << 6;
+    /// SIGN_MESSAGE supports version 3 of the protocol
+    pub const HASHED_MESSAGES: u32 = 1 << 7;
+    /// SIGN_MESSAGES is supported
+    pub const SIGN_MESSAGES: u32 = 1 << 8;
+    /// REGISTER_PAYEE_LIST is supported
+    pub const PAYEE_LISTS: u32 = 1 << 9;
+    /// SIGN_PSBT supports more than 512 inputs
+    pub const OFFLOADED_RECORDS: u32 = 1 << 10;
+    /// SIGN_PSBT accepts additional wallet policies
+    pub const MULTI_WALLET_SIGNING: u32 = 1 << 11;
+    /// SIGN_PSBT can sign a subset of the inputs
+    pub const INPUT_SUBSETS: u32 = 1 << 12;
+    /// SIGN_PSBT sessions can be resumed
+    pub const RESUMABLE_SIGNING: u32 = 1 << 13;
+    /// REGISTER_WALLET returns the compiled policy, that OPEN_WALLET_SESSION accepts
+    pub const COMPILED_POLICIES: u32 = 1 << 14;
+    /// With version 4 of the protocol, the hashes already exchanged are referenced by an index
+    pub const HASH_REFS: u32 = 1 << 15;
+    /// With version 5 of the protocol, the values read next from the PSBT maps are announced
+    pub const ACCESS_PLANS: u32 = 1 << 16;
+    /// SIGN_PSBT_BATCH is supported
+    pub const PSBT_BATCHES: u32 = 1 << 17;
+    /// With version 6 of the protocol, the keys of the small PSBT maps are streamed without proofs
+    pub const TREE_STREAMS: u32 = 1 << 18;
+}
+
 #[derive(Copy, Clone, Debug, PartialEq, Eq)]
 #[repr(u8)]
 pub enum Cla {
@@ -21,9 +95,28 @@ pub enum BitcoinCommandCode {
     GetWalletAddress = 0x03,
     SignPSBT = 0x04,
     GetMasterFingerprint = 0x05,
+    GetAppFeatures = 0x09,
     SignMessage = 0x10,
 }
 
+impl TryFrom<u8> for BitcoinCommandCode {
+    type Error = ();
+
+    fn try_from(value: u8) -> Result<Self, Self::Error> {
+        match value {
+            0x00 => Ok(BitcoinCommandCode::GetExtendedPubkey),
+            0x01 => Ok(BitcoinCommandCode::GetVersion),
+            0x02 => Ok(BitcoinCommandCode::RegisterWallet),
+            0x03 => Ok(BitcoinCommandCode::GetWalletAddress),
+            0x04 => Ok(BitcoinCommandCode::SignPSBT),
+            0x05 => Ok(BitcoinCommandCode::GetMasterFingerprint),
+            0x09 => Ok(BitcoinCommandCode::GetAppFeatures),
+            0x10 => Ok(BitcoinCommandCode::SignMessage),
+            _ => Err(()),
+        }
+    }
+}
+
 #[derive(Copy, Clone, Debug, PartialEq, Eq)]
 #[repr(u8)]
 pub enum FrameworkCommandCode {
@@ -37,6 +130,15 @@ pub enum ClientCommandCode {
     GetPreimage = 0x40,
     GetMerkleLeafProof = 0x41,
     GetMerkleLeafIndex = 0x42,
+    GetMerkleLeafProofs = 0x43,
+    GetMerkleLeafElements = 0x44,
+    GetMerkleLeafProofRefs = 0x45,
+    AnnounceAccessPlan = 0x46,
+    GetAccessPlanData = 0x47,
+    StreamMerkleTree = 0x48,
+    GetTreeStreamData = 0x49,
+    PutRecord = 0x50,
+    GetRecord = 0x51,
     GetMoreElements = 0xA0,
 }
 
@@ -49,6 +151,15 @@ impl TryFrom<u8> for ClientCommandCode {
             0x40 => Ok(ClientCommandCode::GetPreimage),
             0x41 => Ok(ClientCommandCode::GetMerkleLeafProof),
             0x42 => Ok(ClientCommandCode::GetMerkleLeafIndex),
+            0x43 => Ok(ClientCommandCode::GetMerkleLeafProofs),
+            0x44 => Ok(ClientCommandCode::GetMerkleLeafElements),
+            0x45 => Ok(ClientCommandCode::GetMerkleLeafProofRefs),
+            0x46 => Ok(ClientCommandCode::AnnounceAccessPlan),
+            0x47 => Ok(ClientCommandCode::GetAccessPlanData),
+            0x48 => Ok(ClientCommandCode::StreamMerkleTree),
+            0x49 => Ok(ClientCommandCode::GetTreeStreamData),
+            0x50 => Ok(ClientCommandCode::PutRecord),
+            0x51 => Ok(ClientCommandCode::GetRecord),
             0xA0 => Ok(ClientCommandCode::GetMoreElements),
             _ => Err(()),
         }
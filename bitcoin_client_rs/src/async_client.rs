@@ -1,7 +1,13 @@
 use core::fmt::Debug;
 use core::str::FromStr;
+use std::collections::VecDeque;
+use std::sync::Arc;
 
 use async_trait::async_trait;
+use futures::{
+    future::join_all,
+    stream::{self, LocalBoxStream, StreamExt},
+};
 
 use bitcoin::{
     consensus::encode::{deserialize_partial, VarInt},
@@ -15,11 +21,14 @@ use bitcoin::{
 };
 
 use crate::{
-    apdu::{APDUCommand, StatusWord},
+    apdu::{
+        app_feature, sign_psbt_protocol_version, APDUCommand, BitcoinCommandCode, StatusWord,
+        CURRENT_PROTOCOL_VERSION, QUEUED_YIELDS_PROTOCOL_VERSION,
+    },
     command,
     error::BitcoinClientError,
-    interpreter::{get_merkleized_map_commitment, ClientCommandInterpreter},
-    psbt::*,
+    interpreter::{ClientCommandInterpreter, InterpreterError, ReadSeek, StreamedMerkleTree},
+    merkleized_psbt::MerkleizedPsbt,
     wallet::WalletPolicy,
 };
 
@@ -105,6 +114,31 @@ impl<T: Transport> BitcoinClient<T> {
         Ok((name, version, flags))
     }
 
+    /// Returns the highest protocol version and the bitmap of the features supported by the app
+    /// (see `apdu::app_feature`). Apps that predate GET_APP_FEATURES are reported as supporting
+    /// version 1 of the protocol, and none of the features.
+    pub async fn get_app_features(&self) -> Result<(u8, u32), BitcoinClientError<T::Error>> {
+        let cmd = command::get_app_features();
+        match self.make_request(&cmd, None).await {
+            Ok(data) => {
+                if data.len() != 5 {
+                    return Err(BitcoinClientError::UnexpectedResult {
+                        command: cmd.ins,
+                        data,
+                    });
+                }
+                let mut features = [0u8; 4];
+                features.copy_from_slice(&data[1..5]);
+                Ok((data[0], u32::from_be_bytes(features)))
+            }
+            Err(BitcoinClientError::Device {
+                status: StatusWord::InsNotSupported,
+                ..
+            }) => Ok((CURRENT_PROTOCOL_VERSION, 0)),
+            Err(e) => Err(e),
+        }
+    }
+
     /// Retrieve the master fingerprint.
     pub async fn get_master_fingerprint(
         &self,
@@ -139,12 +173,7 @@ impl<T: Transport> BitcoinClient<T> {
         wallet: &WalletPolicy,
     ) -> Result<([u8; 32], [u8; 32]), BitcoinClientError<T::Error>> {
         let cmd = command::register_wallet(wallet);
-        let mut intpr = ClientCommandInterpreter::new();
-        intpr.add_known_preimage(wallet.serialize());
-        let keys: Vec<String> = wallet.keys.iter().map(|k| k.to_string()).collect();
-        intpr.add_known_list(&keys);
-        //necessary for version 1 of the protocol (introduced in version 2.1.0)
-        intpr.add_known_preimage(wallet.descriptor_template.as_bytes().to_vec());
+        let mut intpr = ClientCommandInterpreter::with_known_data([Arc::new(wallet.known_data())]);
         self.make_request(&cmd, Some(&mut intpr))
             .await
             .and_then(|data| {
@@ -173,12 +202,7 @@ impl<T: Transport> BitcoinClient<T> {
         address_index: u32,
         display: bool,
     ) -> Result<bitcoin::Address, BitcoinClientError<T::Error>> {
-        let mut intpr = ClientCommandInterpreter::new();
-        intpr.add_known_preimage(wallet.serialize());
-        let keys: Vec<String> = wallet.keys.iter().map(|k| k.to_string()).collect();
-        intpr.add_known_list(&keys);
-        // necessary for version 1 of the protocol (introduced in version 2.1.0)
-        intpr.add_known_preimage(wallet.descriptor_template.as_bytes().to_vec());
+        let mut intpr = ClientCommandInterpreter::with_known_data([Arc::new(wallet.known_data())]);
         let cmd = command::get_wallet_address(wallet, wallet_hmac, change, address_index, display);
         self.make_request(&cmd, Some(&mut intpr))
             .await
@@ -201,63 +225,39 @@ impl<T: Transport> BitcoinClient<T> {
         wallet: &WalletPolicy,
         wallet_hmac: Option<&[u8; 32]>,
     ) -> Result<Vec<(usize, PublicKey, EcdsaSig)>, BitcoinClientError<T::Error>> {
-        let mut intpr = ClientCommandInterpreter::new();
-        intpr.add_known_preimage(wallet.serialize());
-        let keys: Vec<String> = wallet.keys.iter().map(|k| k.to_string()).collect();
-        intpr.add_known_list(&keys);
-        // necessary for version 1 of the protocol (introduced in version 2.1.0)
-        intpr.add_known_preimage(wallet.descriptor_template.as_bytes().to_vec());
+        let psbt = MerkleizedPsbt::new(psbt, wallet).ok_or(BitcoinClientError::InvalidPsbt)?;
+        self.sign_merkleized_psbt(&psbt, wallet, wallet_hmac).await
+    }
 
-        let global_map: Vec<(Vec<u8>, Vec<u8>)> = get_v2_global_pairs(psbt)
-            .into_iter()
-            .map(deserialize_pairs)
-            .collect();
-        intpr.add_known_mapping(&global_map);
-        let global_mapping_commitment = get_merkleized_map_commitment(&global_map);
-
-        let mut input_commitments: Vec<Vec<u8>> = Vec::with_capacity(psbt.inputs.len());
-        for (index, input) in psbt.inputs.iter().enumerate() {
-            let txin = psbt
-                .unsigned_tx
-                .input
-                .get(index)
-                .ok_or(BitcoinClientError::InvalidPsbt)?;
-            let input_map: Vec<(Vec<u8>, Vec<u8>)> = get_v2_input_pairs(input, txin)
-                .into_iter()
-                .map(deserialize_pairs)
-                .collect();
-            intpr.add_known_mapping(&input_map);
-            input_commitments.push(get_merkleized_map_commitment(&input_map));
-        }
-        let input_commitments_root = intpr.add_known_list(&input_commitments);
-
-        let mut output_commitments: Vec<Vec<u8>> = Vec::with_capacity(psbt.outputs.len());
-        for (index, output) in psbt.outputs.iter().enumerate() {
-            let txout = psbt
-                .unsigned_tx
-                .output
-                .get(index)
-                .ok_or(BitcoinClientError::InvalidPsbt)?;
-            let output_map: Vec<(Vec<u8>, Vec<u8>)> = get_v2_output_pairs(output, txout)
-                .into_iter()
-                .map(deserialize_pairs)
-                .collect();
-            intpr.add_known_mapping(&output_map);
-            output_commitments.push(get_merkleized_map_commitment(&output_map));
-        }
-        let output_commitments_root = intpr.add_known_list(&output_commitments);
-
-        let cmd = command::sign_psbt(
-            &global_mapping_commitment,
-            psbt.inputs.len(),
-            &input_commitments_root,
-            psbt.outputs.len(),
-            &output_commitments_root,
-            wallet,
-            wallet_hmac,
-        );
+    /// Signs a PSBT that was already merkleized for the given wallet policy, which avoids
+    /// merkleizing it again when signing it with several devices.
+    /// Signature requires explicit approval from the user.
+    #[allow(clippy::type_complexity)]
+    pub async fn sign_merkleized_psbt(
+        &self,
+        psbt: &MerkleizedPsbt,
+        wallet: &WalletPolicy,
+        wallet_hmac: Option<&[u8; 32]>,
+    ) -> Result<Vec<(usize, PublicKey, EcdsaSig)>, BitcoinClientError<T::Error>> {
+        let mut intpr = psbt.interpreter();
+
+        // with version 2 of the protocol, the signatures are queued in the responses, saving a
+        // round trip for each of them; the later versions pack more of the PSBT in each response
+        let (_, features) = self.get_app_features().await?;
+        let protocol_version = sign_psbt_protocol_version(features);
+        intpr.set_queued_yields(protocol_version >= QUEUED_YIELDS_PROTOCOL_VERSION);
 
-        self.make_request(&cmd, Some(&mut intpr)).await?;
+        let cmd = psbt.sign_psbt_command(wallet, wallet_hmac, protocol_version);
+
+        let data = self.make_request(&cmd, Some(&mut intpr)).await?;
+        if protocol_version >= QUEUED_YIELDS_PROTOCOL_VERSION
+            && !intpr.extract_queued_yields(&data)?.is_empty()
+        {
+            return Err(BitcoinClientError::UnexpectedResult {
+                command: cmd.ins,
+                data,
+            });
+        }
 
         let results = intpr.yielded();
         if results.iter().any(|res| res.len() <= 1) {
@@ -270,45 +270,80 @@ impl<T: Transport> BitcoinClient<T> {
             });
         }
 
-        let mut signatures = Vec::new();
-        for result in results {
-            let (input_index, i1): (VarInt, usize) =
-                deserialize_partial(&result).map_err(|_| BitcoinClientError::UnexpectedResult {
-                    command: cmd.ins,
-                    data: result.clone(),
-                })?;
-
-            let key_byte = result.get(i1).ok_or(BitcoinClientError::UnexpectedResult {
-                command: cmd.ins,
-                data: result.clone(),
-            })?;
-            let key_len = u8::from_le_bytes([*key_byte]) as usize;
+        results
+            .into_iter()
+            .map(|result| parse_signature_result(cmd.ins, result))
+            .collect()
+    }
 
-            if i1 + 1 + key_len > result.len() {
-                return Err(BitcoinClientError::UnexpectedResult {
-                    command: cmd.ins,
-                    data: result.clone(),
-                });
-            }
+    /// Like sign_psbt, but returns a stream of the signatures, whose items are produced as soon as
+    /// the device yields them, instead of after the last input is signed.
+    /// The stream ends after the final response of the device, or after the first error. It is not
+    /// Send, and is meant to be polled by the task that processes the signatures.
+    #[allow(clippy::type_complexity)]
+    pub async fn sign_psbt_stream(
+        &self,
+        psbt: &Psbt,
+        wallet: &WalletPolicy,
+        wallet_hmac: Option<&[u8; 32]>,
+    ) -> Result<
+        LocalBoxStream<'_, Result<(usize, PublicKey, EcdsaSig), BitcoinClientError<T::Error>>>,
+        BitcoinClientError<T::Error>,
+    > {
+        let psbt = MerkleizedPsbt::new(psbt, wallet).ok_or(BitcoinClientError::InvalidPsbt)?;
+        self.sign_merkleized_psbt_stream(&psbt, wallet, wallet_hmac)
+            .await
+    }
 
-            let key = PublicKey::from_slice(&result[i1 + 1..i1 + 1 + key_len]).map_err(|_| {
-                BitcoinClientError::UnexpectedResult {
-                    command: cmd.ins,
-                    data: result.clone(),
+    /// Like sign_merkleized_psbt, but returns a stream of the signatures, as sign_psbt_stream.
+    #[allow(clippy::type_complexity)]
+    pub async fn sign_merkleized_psbt_stream(
+        &self,
+        psbt: &MerkleizedPsbt,
+        wallet: &WalletPolicy,
+        wallet_hmac: Option<&[u8; 32]>,
+    ) -> Result<
+        LocalBoxStream<'_, Result<(usize, PublicKey, EcdsaSig), BitcoinClientError<T::Error>>>,
+        BitcoinClientError<T::Error>,
+    > {
+        let mut intpr = psbt.interpreter();
+
+        // with version 2 of the protocol, the signatures are queued in the responses, saving a
+        // round trip for each of them; the later versions pack more of the PSBT in each response
+        let (_, features) = self.get_app_features().await?;
+        let protocol_version = sign_psbt_protocol_version(features);
+        intpr.set_queued_yields(protocol_version >= QUEUED_YIELDS_PROTOCOL_VERSION);
+
+        let cmd = psbt.sign_psbt_command(wallet, wallet_hmac, protocol_version);
+
+        let state = SignPsbtStreamState {
+            client: self,
+            intpr,
+            ins: cmd.ins,
+            queued_yields: protocol_version >= QUEUED_YIELDS_PROTOCOL_VERSION,
+            next_request: Some(cmd),
+            results: VecDeque::new(),
+        };
+
+        Ok(stream::unfold(state, |mut state| async move {
+            loop {
+                if let Some(result) = state.results.pop_front() {
+                    let signature = parse_signature_result(state.ins, result);
+                    if signature.is_err() {
+                        state.next_request = None;
+                        state.results.clear();
+                    }
+                    return Some((signature, state));
                 }
-            })?;
 
-            let sig = EcdsaSig::from_slice(&result[i1 + 1 + key_len..]).map_err(|_| {
-                BitcoinClientError::UnexpectedResult {
-                    command: cmd.ins,
-                    data: result.clone(),
+                let req = state.next_request.take()?;
+                if let Err(e) = state.exchange(&req).await {
+                    state.results.clear();
+                    return Some((Err(e), state));
                 }
-            })?;
-
-            signatures.push((input_index.0 as usize, key, sig));
-        }
-
-        Ok(signatures)
+            }
+        })
+        .boxed_local())
     }
 
     /// Sign a message with the key derived with the given derivation path.
@@ -321,7 +356,35 @@ impl<T: Transport> BitcoinClient<T> {
         let chunks: Vec<&[u8]> = message.chunks(64).collect();
         let mut intpr = ClientCommandInterpreter::new();
         let message_commitment_root = intpr.add_known_list(&chunks);
-        let cmd = command::sign_message(message.len(), &message_commitment_root, path);
+        self.sign_message_with(message.len(), &message_commitment_root, path, intpr)
+            .await
+    }
+
+    /// Same as `sign_message`, for the message read from `reader`, from its current position to
+    /// its end, like a `File`. The message is not kept in memory: its chunks are read again from
+    /// `reader` when the device requests them, so that large files can be signed.
+    /// The reads are blocking.
+    pub async fn sign_message_from_reader(
+        &self,
+        reader: impl ReadSeek + 'static,
+        path: &DerivationPath,
+    ) -> Result<(u8, Signature), BitcoinClientError<T::Error>> {
+        let tree = StreamedMerkleTree::new(reader, 64).map_err(InterpreterError::from)?;
+        let message_length = tree.stream_len() as usize;
+        let mut intpr = ClientCommandInterpreter::new();
+        let message_commitment_root = intpr.add_known_stream(tree);
+        self.sign_message_with(message_length, &message_commitment_root, path, intpr)
+            .await
+    }
+
+    async fn sign_message_with(
+        &self,
+        message_length: usize,
+        message_commitment_root: &[u8; 32],
+        path: &DerivationPath,
+        mut intpr: ClientCommandInterpreter,
+    ) -> Result<(u8, Signature), BitcoinClientError<T::Error>> {
+        let cmd = command::sign_message(message_length, message_commitment_root, path);
         self.make_request(&cmd, Some(&mut intpr))
             .await
             .and_then(|data| {
@@ -338,6 +401,190 @@ impl<T: Transport> BitcoinClient<T> {
     }
 }
 
+/// The state of the stream returned by sign_merkleized_psbt_stream.
+struct SignPsbtStreamState<'a, T: Transport> {
+    client: &'a BitcoinClient<T>,
+    intpr: ClientCommandInterpreter,
+    ins: u8,
+    queued_yields: bool,
+    // the next APDU to send to the device, or None after its final response
+    next_request: Option<APDUCommand>,
+    // the results yielded by the device, that were not produced by the stream yet
+    results: VecDeque<Vec<u8>>,
+}
+
+impl<'a, T: Transport> SignPsbtStreamState<'a, T> {
+    /// Sends the request to the device, and interprets its response; the yielded results are
+    /// queued, and next_request is set to the following request, if any.
+    async fn exchange(&mut self, req: &APDUCommand) -> Result<(), BitcoinClientError<T::Error>> {
+        let (sw, data) = self
+            .client
+            .transport
+            .exchange(req)
+            .await
+            .map_err(BitcoinClientError::Transport)?;
+
+        if sw == StatusWord::InterruptedExecution {
+            let response = self.intpr.execute(data)?;
+            self.next_request = Some(command::continue_interrupted(response));
+        } else if sw != StatusWord::OK {
+            return Err(BitcoinClientError::Device {
+                status: sw,
+                command: self.ins,
+            });
+        } else if self.queued_yields && !self.intpr.extract_queued_yields(&data)?.is_empty() {
+            return Err(BitcoinClientError::UnexpectedResult {
+                command: self.ins,
+                data,
+            });
+        }
+
+        self.results.extend(self.intpr.take_yielded());
+        Ok(())
+    }
+}
+
+/// Parses a result yielded by the device during SIGN_PSBT: the index of the input, followed by
+/// the length of the pubkey, the pubkey and the signature.
+#[allow(clippy::type_complexity)]
+fn parse_signature_result<E: Debug>(
+    ins: u8,
+    result: Vec<u8>,
+) -> Result<(usize, PublicKey, EcdsaSig), BitcoinClientError<E>> {
+    if result.len() <= 1 {
+        return Err(BitcoinClientError::UnexpectedResult {
+            command: ins,
+            data: result,
+        });
+    }
+
+    let (input_index, i1): (VarInt, usize) =
+        deserialize_partial(&result).map_err(|_| BitcoinClientError::UnexpectedResult {
+            command: ins,
+            data: result.clone(),
+        })?;
+
+    let key_byte = result.get(i1).ok_or(BitcoinClientError::UnexpectedResult {
+        command: ins,
+        data: result.clone(),
+    })?;
+    let key_len = u8::from_le_bytes([*key_byte]) as usize;
+
+    if i1 + 1 + key_len > result.len() {
+        return Err(BitcoinClientError::UnexpectedResult {
+            command: ins,
+            data: result.clone(),
+        });
+    }
+
+    let key = PublicKey::from_slice(&result[i1 + 1..i1 + 1 + key_len]).map_err(|_| {
+        BitcoinClientError::UnexpectedResult {
+            command: ins,
+            data: result.clone(),
+        }
+    })?;
+
+    let sig = EcdsaSig::from_slice(&result[i1 + 1 + key_len..]).map_err(|_| {
+        BitcoinClientError::UnexpectedResult {
+            command: ins,
+            data: result.clone(),
+        }
+    })?;
+
+    Ok((input_index.0 as usize, key, sig))
+}
+
+/// Signs a PSBT with several devices at the same time, for example the cosigners of a multisig
+/// wallet policy. Each device is given with the hmac of the registration of the wallet policy on
+/// it, if any.
+/// The PSBT is merkleized only once, and all the requests of the devices are served from the same
+/// known data. The signatures returned by the devices are added to the partial signatures of the
+/// PSBT.
+pub async fn sign_psbt_with_devices<T: Transport>(
+    signers: &[(&BitcoinClient<T>, Option<&[u8; 32]>)],
+    psbt: &mut Psbt,
+    wallet: &WalletPolicy,
+) -> Result<(), BitcoinClientError<T::Error>> {
+    let merkleized_psbt =
+        MerkleizedPsbt::new(psbt, wallet).ok_or(BitcoinClientError::InvalidPsbt)?;
+
+    let results = join_all(
+        signers
+            .iter()
+            .map(|(client, hmac)| client.sign_merkleized_psbt(&merkleized_psbt, wallet, *hmac)),
+    )
+    .await;
+
+    for result in results {
+        for (index, key, sig) in result? {
+            psbt.inputs
+                .get_mut(index)
+                .ok_or(BitcoinClientError::InvalidPsbt)?
+                .partial_sigs
+                .insert(key, sig);
+        }
+    }
+    Ok(())
+}
+
+/// Signs a PSBT with several devices with the same seed at the same time, each signing a disjoint
+/// range of the inputs, which divides the signing time of PSBTs with many internal inputs. Each
+/// device validates the whole transaction with its user.
+/// The devices must support `app_feature::INPUT_SUBSETS`; otherwise, the command fails with
+/// `StatusWord::NotSupported` before any of them is used. The signatures are added to the partial
+/// signatures of the PSBT.
+pub async fn sign_psbt_sharded<T: Transport>(
+    clients: &[&BitcoinClient<T>],
+    psbt: &mut Psbt,
+    wallet: &WalletPolicy,
+    wallet_hmac: Option<&[u8; 32]>,
+) -> Result<(), BitcoinClientError<T::Error>> {
+    for client in clients {
+        let (_, features) = client.get_app_features().await?;
+        if features & app_feature::INPUT_SUBSETS == 0 {
+            return Err(BitcoinClientError::Device {
+                command: BitcoinCommandCode::SignPSBT as u8,
+                status: StatusWord::NotSupported,
+            });
+        }
+    }
+
+    let merkleized_psbt =
+        MerkleizedPsbt::new(psbt, wallet).ok_or(BitcoinClientError::InvalidPsbt)?;
+
+    let n_inputs = psbt.inputs.len();
+    let n_shards = clients.len().min(n_inputs);
+    let mut shards = Vec::with_capacity(n_shards);
+    for k in 0..n_shards {
+        let indexes: Vec<usize> =
+            (n_inputs * k / n_shards..n_inputs * (k + 1) / n_shards).collect();
+        shards.push(
+            merkleized_psbt
+                .with_input_subset(&indexes)
+                .ok_or(BitcoinClientError::InvalidPsbt)?,
+        );
+    }
+
+    let results = join_all(
+        clients
+            .iter()
+            .zip(shards.iter())
+            .map(|(client, shard)| client.sign_merkleized_psbt(shard, wallet, wallet_hmac)),
+    )
+    .await;
+
+    for result in results {
+        for (index, key, sig) in result? {
+            psbt.inputs
+                .get_mut(index)
+                .ok_or(BitcoinClientError::InvalidPsbt)?
+                .partial_sigs
+                .insert(key, sig);
+        }
+    }
+    Ok(())
+}
+
 /// Asynchronous communication layer between the bitcoin client and the Ledger device.
 #[async_trait]
 pub trait Transport {
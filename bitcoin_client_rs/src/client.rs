@@ -1,5 +1,6 @@
 use core::fmt::Debug;
 use core::str::FromStr;
+use std::sync::Arc;
 
 use bitcoin::{
     consensus::encode::{deserialize_partial, VarInt},
@@ -13,11 +14,14 @@ use bitcoin::{
 };
 
 use crate::{
-    apdu::{APDUCommand, StatusWord},
+    apdu::{
+        sign_psbt_protocol_version, APDUCommand, StatusWord, CURRENT_PROTOCOL_VERSION,
+        QUEUED_YIELDS_PROTOCOL_VERSION,
+    },
     command,
     error::BitcoinClientError,
-    interpreter::{get_merkleized_map_commitment, ClientCommandInterpreter},
-    psbt::*,
+    interpreter::{ClientCommandInterpreter, InterpreterError, ReadSeek, StreamedMerkleTree},
+    merkleized_psbt::MerkleizedPsbt,
     wallet::WalletPolicy,
 };
 
@@ -98,6 +102,31 @@ impl<T: Transport> BitcoinClient<T> {
         Ok((name, version, flags))
     }
 
+    /// Returns the highest protocol version and the bitmap of the features supported by the app
+    /// (see `apdu::app_feature`). Apps that predate GET_APP_FEATURES are reported as supporting
+    /// version 1 of the protocol, and none of the features.
+    pub fn get_app_features(&self) -> Result<(u8, u32), BitcoinClientError<T::Error>> {
+        let cmd = command::get_app_features();
+        match self.make_request(&cmd, None) {
+            Ok(data) => {
+                if data.len() != 5 {
+                    return Err(BitcoinClientError::UnexpectedResult {
+                        command: cmd.ins,
+                        data,
+                    });
+                }
+                let mut features = [0u8; 4];
+                features.copy_from_slice(&data[1..5]);
+                Ok((data[0], u32::from_be_bytes(features)))
+            }
+            Err(BitcoinClientError::Device {
+                status: StatusWord::InsNotSupported,
+                ..
+            }) => Ok((CURRENT_PROTOCOL_VERSION, 0)),
+            Err(e) => Err(e),
+        }
+    }
+
     /// Retrieve the master fingerprint.
     pub fn get_master_fingerprint(&self) -> Result<Fingerprint, BitcoinClientError<T::Error>> {
         let cmd = command::get_master_fingerprint();
@@ -130,12 +159,7 @@ impl<T: Transport> BitcoinClient<T> {
         wallet: &WalletPolicy,
     ) -> Result<([u8; 32], [u8; 32]), BitcoinClientError<T::Error>> {
         let cmd = command::register_wallet(wallet);
-        let mut intpr = ClientCommandInterpreter::new();
-        intpr.add_known_preimage(wallet.serialize());
-        let keys: Vec<String> = wallet.keys.iter().map(|k| k.to_string()).collect();
-        intpr.add_known_list(&keys);
-        // necessary for version 1 of the protocol (introduced in version 2.1.0)
-        intpr.add_known_preimage(wallet.descriptor_template.as_bytes().to_vec());
+        let mut intpr = ClientCommandInterpreter::with_known_data([Arc::new(wallet.known_data())]);
         self.make_request(&cmd, Some(&mut intpr)).and_then(|data| {
             if data.len() < 64 {
                 Err(BitcoinClientError::UnexpectedResult {
@@ -162,12 +186,7 @@ impl<T: Transport> BitcoinClient<T> {
         address_index: u32,
         display: bool,
     ) -> Result<bitcoin::Address, BitcoinClientError<T::Error>> {
-        let mut intpr = ClientCommandInterpreter::new();
-        intpr.add_known_preimage(wallet.serialize());
-        let keys: Vec<String> = wallet.keys.iter().map(|k| k.to_string()).collect();
-        intpr.add_known_list(&keys);
-        // necessary for version 1 of the protocol (introduced in version 2.1.0)
-        intpr.add_known_preimage(wallet.descriptor_template.as_bytes().to_vec());
+        let mut intpr = ClientCommandInterpreter::with_known_data([Arc::new(wallet.known_data())]);
         let cmd = command::get_wallet_address(wallet, wallet_hmac, change, address_index, display);
         self.make_request(&cmd, Some(&mut intpr)).and_then(|data| {
             bitcoin::Address::from_str(&String::from_utf8_lossy(&data)).map_err(|_| {
@@ -188,63 +207,39 @@ impl<T: Transport> BitcoinClient<T> {
         wallet: &WalletPolicy,
         wallet_hmac: Option<&[u8; 32]>,
     ) -> Result<Vec<(usize, PublicKey, EcdsaSig)>, BitcoinClientError<T::Error>> {
-        let mut intpr = ClientCommandInterpreter::new();
-        intpr.add_known_preimage(wallet.serialize());
-        let keys: Vec<String> = wallet.keys.iter().map(|k| k.to_string()).collect();
-        intpr.add_known_list(&keys);
-        // necessary for version 1 of the protocol (introduced in version 2.1.0)
-        intpr.add_known_preimage(wallet.descriptor_template.as_bytes().to_vec());
-
-        let global_map: Vec<(Vec<u8>, Vec<u8>)> = get_v2_global_pairs(psbt)
-            .into_iter()
-            .map(deserialize_pairs)
-            .collect();
-        intpr.add_known_mapping(&global_map);
-        let global_mapping_commitment = get_merkleized_map_commitment(&global_map);
-
-        let mut input_commitments: Vec<Vec<u8>> = Vec::with_capacity(psbt.inputs.len());
-        for (index, input) in psbt.inputs.iter().enumerate() {
-            let txin = psbt
-                .unsigned_tx
-                .input
-                .get(index)
-                .ok_or(BitcoinClientError::InvalidPsbt)?;
-            let input_map: Vec<(Vec<u8>, Vec<u8>)> = get_v2_input_pairs(input, txin)
-                .into_iter()
-                .map(deserialize_pairs)
-                .collect();
-            intpr.add_known_mapping(&input_map);
-            input_commitments.push(get_merkleized_map_commitment(&input_map));
-        }
-        let input_commitments_root = intpr.add_known_list(&input_commitments);
-
-        let mut output_commitments: Vec<Vec<u8>> = Vec::with_capacity(psbt.outputs.len());
-        for (index, output) in psbt.outputs.iter().enumerate() {
-            let txout = psbt
-                .unsigned_tx
-                .output
-                .get(index)
-                .ok_or(BitcoinClientError::InvalidPsbt)?;
-            let output_map: Vec<(Vec<u8>, Vec<u8>)> = get_v2_output_pairs(output, txout)
-                .into_iter()
-                .map(deserialize_pairs)
-                .collect();
-            intpr.add_known_mapping(&output_map);
-            output_commitments.push(get_merkleized_map_commitment(&output_map));
-        }
-        let output_commitments_root = intpr.add_known_list(&output_commitments);
+        let psbt = MerkleizedPsbt::new(psbt, wallet).ok_or(BitcoinClientError::InvalidPsbt)?;
+        self.sign_merkleized_psbt(&psbt, wallet, wallet_hmac)
+    }
 
-        let cmd = command::sign_psbt(
-            &global_mapping_commitment,
-            psbt.inputs.len(),
-            &input_commitments_root,
-            psbt.outputs.len(),
-            &output_commitments_root,
-            wallet,
-            wallet_hmac,
-        );
+    /// Signs a PSBT that was already merkleized for the given wallet policy, which avoids
+    /// merkleizing it again when signing it with several devices.
+    /// Signature requires explicit approval from the user.
+    #[allow(clippy::type_complexity)]
+    pub fn sign_merkleized_psbt(
+        &self,
+        psbt: &MerkleizedPsbt,
+        wallet: &WalletPolicy,
+        wallet_hmac: Option<&[u8; 32]>,
+    ) -> Result<Vec<(usize, PublicKey, EcdsaSig)>, BitcoinClientError<T::Error>> {
+        let mut intpr = psbt.interpreter();
+
+        // with version 2 of the protocol, the signatures are queued in the responses, saving a
+        // round trip for each of them; the later versions pack more of the PSBT in each response
+        let (_, features) = self.get_app_features()?;
+        let protocol_version = sign_psbt_protocol_version(features);
+        intpr.set_queued_yields(protocol_version >= QUEUED_YIELDS_PROTOCOL_VERSION);
 
-        self.make_request(&cmd, Some(&mut intpr))?;
+        let cmd = psbt.sign_psbt_command(wallet, wallet_hmac, protocol_version);
+
+        let data = self.make_request(&cmd, Some(&mut intpr))?;
+        if protocol_version >= QUEUED_YIELDS_PROTOCOL_VERSION
+            && !intpr.extract_queued_yields(&data)?.is_empty()
+        {
+            return Err(BitcoinClientError::UnexpectedResult {
+                command: cmd.ins,
+                data,
+            });
+        }
 
         let results = intpr.yielded();
         if results.iter().any(|res| res.len() <= 1) {
@@ -308,7 +303,32 @@ impl<T: Transport> BitcoinClient<T> {
         let chunks: Vec<&[u8]> = message.chunks(64).collect();
         let mut intpr = ClientCommandInterpreter::new();
         let message_commitment_root = intpr.add_known_list(&chunks);
-        let cmd = command::sign_message(message.len(), &message_commitment_root, path);
+        self.sign_message_with(message.len(), &message_commitment_root, path, intpr)
+    }
+
+    /// Same as `sign_message`, for the message read from `reader`, from its current position to
+    /// its end, like a `File`. The message is not kept in memory: its chunks are read again from
+    /// `reader` when the device requests them, so that large files can be signed.
+    pub fn sign_message_from_reader(
+        &self,
+        reader: impl ReadSeek + 'static,
+        path: &DerivationPath,
+    ) -> Result<(u8, Signature), BitcoinClientError<T::Error>> {
+        let tree = StreamedMerkleTree::new(reader, 64).map_err(InterpreterError::from)?;
+        let message_length = tree.stream_len() as usize;
+        let mut intpr = ClientCommandInterpreter::new();
+        let message_commitment_root = intpr.add_known_stream(tree);
+        self.sign_message_with(message_length, &message_commitment_root, path, intpr)
+    }
+
+    fn sign_message_with(
+        &self,
+        message_length: usize,
+        message_commitment_root: &[u8; 32],
+        path: &DerivationPath,
+        mut intpr: ClientCommandInterpreter,
+    ) -> Result<(u8, Signature), BitcoinClientError<T::Error>> {
+        let cmd = command::sign_message(message_length, message_commitment_root, path);
         self.make_request(&cmd, Some(&mut intpr)).and_then(|data| {
             Ok((
                 data[0],
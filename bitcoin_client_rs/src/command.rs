@@ -29,6 +29,15 @@ pub fn get_master_fingerprint() -> APDUCommand {
     }
 }
 
+/// Creates the APDU Command to retrieve the protocol version and features supported by the app.
+pub fn get_app_features() -> APDUCommand {
+    APDUCommand {
+        cla: apdu::Cla::Bitcoin as u8,
+        ins: apdu::BitcoinCommandCode::GetAppFeatures as u8,
+        ..Default::default()
+    }
+}
+
 /// Creates the APDU command required to get the extended pubkey with the given derivation path.
 pub fn get_extended_pubkey(path: &DerivationPath, display: bool) -> APDUCommand {
     let child_numbers: &[ChildNumber] = path.as_ref();
@@ -95,6 +104,7 @@ pub fn sign_psbt(
     output_commitments_root: &[u8; 32],
     policy: &WalletPolicy,
     hmac: Option<&[u8; 32]>,
+    protocol_version: u8,
 ) -> APDUCommand {
     let mut data: Vec<u8> = Vec::new();
     data.extend_from_slice(global_mapping_commitment);
@@ -107,6 +117,7 @@ pub fn sign_psbt(
     APDUCommand {
         cla: apdu::Cla::Bitcoin as u8,
         ins: apdu::BitcoinCommandCode::SignPSBT as u8,
+        p2: protocol_version,
         data,
         ..Default::default()
     }
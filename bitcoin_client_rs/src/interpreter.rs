@@ -1,5 +1,7 @@
 use core::convert::TryFrom;
 use core::fmt::Debug;
+use std::collections::HashMap;
+use std::sync::Arc;
 
 use bitcoin::{
     consensus::encode::{self, VarInt},
@@ -8,33 +10,22 @@ use bitcoin::{
 
 use crate::{apdu::ClientCommandCode, merkle::MerkleTree};
 
-/// Interpreter for the client-side commands.
-/// This struct keeps has methods to keep track of:
-///   - known preimages
-///   - known Merkle trees from lists of elements
-/// Moreover, it containes the state that is relevant for the interpreted client side commands:
-///   - a queue of bytes that contains any bytes that could not fit in a response from the
-///     GET_PREIMAGE client command (when a preimage is too long to fit in a single message) or the
-///     GET_MERKLE_LEAF_PROOF command (which returns a Merkle proof, which might be too long to fit
-///     in a single message). The data in the queue is returned in one (or more) successive
-///     GET_MORE_ELEMENTS commands from the hardware wallet.
-/// Finally, it keeps track of the yielded values (that is, the values sent from the hardware
-/// wallet with a YIELD client command).
-pub struct ClientCommandInterpreter {
-    yielded: Vec<Vec<u8>>,
-    queue: Vec<Vec<u8>>,
-    known_preimages: Vec<([u8; 32], Vec<u8>)>,
-    trees: Vec<MerkleTree>,
+pub use crate::merkle::{ReadSeek, StreamedMerkleTree};
+
+/// Preimages and Merkle trees known to the client, that the hardware wallet can request.
+/// Once shared in an `Arc`, it is immutable, and it can be used by any number of interpreters at
+/// the same time, for example the data of a wallet policy by all the PSBTs signed with it, or the
+/// data of a PSBT by all the devices signing it.
+#[derive(Clone, Default)]
+pub struct KnownData {
+    preimages: HashMap<[u8; 32], Vec<u8>>,
+    /// Known Merkle trees, keyed by their root hash.
+    trees: HashMap<[u8; 32], MerkleTree>,
 }
 
-impl ClientCommandInterpreter {
+impl KnownData {
     pub fn new() -> Self {
-        Self {
-            yielded: Vec::new(),
-            queue: Vec::new(),
-            known_preimages: Vec::new(),
-            trees: Vec::new(),
-        }
+        Self::default()
     }
 
     /// Adds a preimage to the list of known preimages.
@@ -44,7 +35,7 @@ impl ClientCommandInterpreter {
         let mut engine = sha256::Hash::engine();
         engine.input(&element);
         let hash = sha256::Hash::from_engine(engine).into_inner();
-        self.known_preimages.push((hash, element));
+        self.preimages.entry(hash).or_insert(element);
     }
 
     /// Adds a known Merkleized list.
@@ -53,22 +44,31 @@ impl ClientCommandInterpreter {
     /// Moreover, adds all the leafs (after adding the b'\0' prefix) to the list of known preimages.
     /// If `el` is one of `elements`, the client must respond with b'\0' + `el` when a GET_PREIMAGE
     /// client command is sent with `sha256(b'\0' + el)`.
-    /// Moreover, the commands GET_MERKLE_LEAF_INDEX and GET_MERKLE_LEAF_PROOF must correctly answer
-    /// queries relative to the Merkle whose root is `mt_root`.
+    /// Moreover, the commands GET_MERKLE_LEAF_INDEX, GET_MERKLE_LEAF_PROOF and GET_MERKLE_LEAF_PROOFS
+    /// must correctly answer queries relative to the Merkle whose root is `mt_root`.
     pub fn add_known_list(&mut self, elements: &[impl AsRef<[u8]>]) -> [u8; 32] {
+        self.add_known_elements(elements.iter().map(|element| element.as_ref()))
+    }
+
+    /// Same as `add_known_list`, for the elements returned by an iterator.
+    fn add_known_elements<'a>(
+        &mut self,
+        elements: impl ExactSizeIterator<Item = &'a [u8]>,
+    ) -> [u8; 32] {
         let mut leaves = Vec::with_capacity(elements.len());
         for element in elements {
-            let mut preimage = vec![0x00];
-            preimage.extend_from_slice(element.as_ref());
+            let mut preimage = Vec::with_capacity(1 + element.len());
+            preimage.push(0x00);
+            preimage.extend_from_slice(element);
             let mut engine = sha256::Hash::engine();
             engine.input(&preimage);
             let hash = sha256::Hash::from_engine(engine).into_inner();
-            self.known_preimages.push((hash, preimage));
+            self.preimages.entry(hash).or_insert(preimage);
             leaves.push(hash);
         }
         let tree = MerkleTree::new(leaves);
         let root_hash = *tree.root_hash();
-        self.trees.push(tree);
+        self.trees.entry(root_hash).or_insert(tree);
         root_hash
     }
 
@@ -76,41 +76,288 @@ impl ClientCommandInterpreter {
     /// of a mapping of bytes to bytes.
     /// Adds the Merkle tree of the list of keys, and the Merkle tree of the list of corresponding
     /// values, with the same semantics as the `add_known_list` applied separately to the two lists.
+    /// Returns the commitment of the mapping, as computed by `get_merkleized_map_commitment`.
+    pub fn add_known_mapping(&mut self, mapping: &[(Vec<u8>, Vec<u8>)]) -> Vec<u8> {
+        self.add_known_pairs(
+            mapping
+                .iter()
+                .map(|(key, value)| (key.as_slice(), value.as_slice())),
+        )
+    }
+
+    /// Same as `add_known_mapping`, for the (key, value) pairs returned by an iterator, that are
+    /// borrowed: only the preimages are copied.
+    pub fn add_known_pairs<'a>(
+        &mut self,
+        pairs: impl IntoIterator<Item = (&'a [u8], &'a [u8])>,
+    ) -> Vec<u8> {
+        let mut sorted: Vec<(&[u8], &[u8])> = pairs.into_iter().collect();
+        sorted.sort_by(|(k1, _), (k2, _)| k1.cmp(k2));
+
+        let mut commitment = encode::serialize(&VarInt(sorted.len() as u64));
+        commitment.extend(self.add_known_elements(sorted.iter().map(|(key, _)| *key)));
+        commitment.extend(self.add_known_elements(sorted.iter().map(|(_, value)| *value)));
+        commitment
+    }
+
+    /// Adds the preimages and Merkle trees of `other`, for example computed in another thread.
+    pub fn merge(&mut self, other: KnownData) {
+        for (hash, preimage) in other.preimages {
+            self.preimages.entry(hash).or_insert(preimage);
+        }
+        for (root, tree) in other.trees {
+            self.trees.entry(root).or_insert(tree);
+        }
+    }
+}
+
+/// Returns the preimage of `hash` in the first of `known` that has it.
+fn find_preimage<'a>(known: &'a [Arc<KnownData>], hash: &[u8; 32]) -> Option<&'a Vec<u8>> {
+    known.iter().find_map(|k| k.preimages.get(hash))
+}
+
+/// Returns the streamed Merkle tree with the given root, if any.
+fn find_stream<'a>(
+    streams: &'a mut [StreamedMerkleTree],
+    root: &[u8],
+) -> Option<&'a mut StreamedMerkleTree> {
+    streams.iter_mut().find(|s| s.root_hash()[..] == *root)
+}
+
+/// Returns the Merkle tree with the given root in the first of `known` that has it.
+fn find_tree<'a>(known: &'a [Arc<KnownData>], root: &[u8]) -> Option<&'a MerkleTree> {
+    let root = hash_from_slice(root);
+    known.iter().find_map(|k| k.trees.get(&root))
+}
+
+/// Interpreter for the client-side commands.
+/// This struct keeps has methods to keep track of:
+///   - known preimages
+///   - known Merkle trees from lists of elements
+/// Moreover, it containes the state that is relevant for the interpreted client side commands:
+///   - a queue of bytes that contains any bytes that could not fit in a response from the
+///     GET_PREIMAGE client command (when a preimage is too long to fit in a single message) or the
+///     GET_MERKLE_LEAF_PROOF command (which returns a Merkle proof, which might be too long to fit
+///     in a single message). The data in the queue is returned in one (or more) successive
+///     GET_MORE_ELEMENTS commands from the hardware wallet.
+///   - the records stored by the hardware wallet with the PUT_RECORD client command, and returned
+///     with GET_RECORD.
+///   - the table of hash references of GET_MERKLE_LEAF_PROOF_REFS, and the data of the current
+///     access plan and tree stream, returned with GET_ACCESS_PLAN_DATA and GET_TREE_STREAM_DATA, in
+///     versions 4 to 6 of the protocol.
+/// Finally, it keeps track of the yielded values (that is, the values sent from the hardware
+/// wallet with a YIELD client command).
+/// The known preimages and trees are a list of shared `KnownData`, that is not copied by `fork`
+/// nor by `with_known_data`: only the state of the session is specific to each interpreter.
+/// The streamed Merkle trees added with `add_known_stream` are specific to each interpreter too.
+pub struct ClientCommandInterpreter {
+    yielded: Vec<Vec<u8>>,
+    queued_yields: bool,
+    queue: ElementsQueue,
+    /// The known preimages and trees, searched in order. The first one is extended by the
+    /// `add_known_*` methods, and copied first if it is shared.
+    known: Vec<Arc<KnownData>>,
+    /// Responses to GET_MERKLE_LEAF_PROOF, with the concatenated proof elements that do not fit the
+    /// response, keyed by (root, leaf index): the hardware wallet requests the same leaves many
+    /// times.
+    leaf_proofs: HashMap<([u8; 32], usize), (Vec<u8>, Vec<u8>)>,
+    /// Records stored with PUT_RECORD, keyed by their index.
+    records: HashMap<u64, Vec<u8>>,
+    hash_refs: HashRefTable,
+    /// The data of the access plan announced with ANNOUNCE_ACCESS_PLAN that was not returned yet.
+    access_plan: PendingData,
+    /// The data of the tree stream started with STREAM_MERKLE_TREE that was not returned yet.
+    tree_stream: PendingData,
+    /// The Merkle trees of the chunks of streams, that are read when the hardware wallet requests
+    /// them.
+    streams: Vec<StreamedMerkleTree>,
+}
+
+impl ClientCommandInterpreter {
+    pub fn new() -> Self {
+        Self::with_known_data(Vec::new())
+    }
+
+    /// Returns a new interpreter that knows the preimages and Merkle trees of `known`, without
+    /// copying them.
+    pub fn with_known_data(known: impl IntoIterator<Item = Arc<KnownData>>) -> Self {
+        let mut all_known = vec![Arc::new(KnownData::new())];
+        all_known.extend(known);
+        Self {
+            yielded: Vec::new(),
+            queued_yields: false,
+            queue: ElementsQueue::default(),
+            known: all_known,
+            leaf_proofs: HashMap::new(),
+            records: HashMap::new(),
+            hash_refs: HashRefTable::default(),
+            access_plan: PendingData::default(),
+            tree_stream: PendingData::default(),
+            streams: Vec::new(),
+        }
+    }
+
+    /// Returns a new interpreter that knows the same preimages and Merkle trees, without copying
+    /// them, and with an empty state.
+    pub fn fork(&self) -> Self {
+        Self {
+            yielded: Vec::new(),
+            queued_yields: self.queued_yields,
+            queue: ElementsQueue::default(),
+            known: self.known.clone(),
+            leaf_proofs: HashMap::new(),
+            records: HashMap::new(),
+            hash_refs: HashRefTable::default(),
+            access_plan: PendingData::default(),
+            tree_stream: PendingData::default(),
+            streams: Vec::new(),
+        }
+    }
+
+    /// Adds a preimage to the list of known preimages, see `KnownData::add_known_preimage`.
+    pub fn add_known_preimage(&mut self, element: Vec<u8>) {
+        Arc::make_mut(&mut self.known[0]).add_known_preimage(element)
+    }
+
+    /// Adds a known Merkleized list, see `KnownData::add_known_list`.
+    pub fn add_known_list(&mut self, elements: &[impl AsRef<[u8]>]) -> [u8; 32] {
+        Arc::make_mut(&mut self.known[0]).add_known_list(elements)
+    }
+
+    /// Adds the known Merkle trees of a mapping, see `KnownData::add_known_mapping`.
     pub fn add_known_mapping(&mut self, mapping: &[(Vec<u8>, Vec<u8>)]) {
-        let mut sorted: Vec<&(Vec<u8>, Vec<u8>)> = mapping.iter().collect();
-        sorted.sort_by(|(k1, _), (k2, _)| k1.as_slice().cmp(k2));
-
-        let mut keys = Vec::with_capacity(sorted.len());
-        let mut values = Vec::with_capacity(sorted.len());
-        for (key, value) in sorted {
-            keys.push(key.as_slice());
-            values.push(value.as_slice());
+        Arc::make_mut(&mut self.known[0]).add_known_mapping(mapping);
+    }
+
+    /// Adds a known Merkleized list whose elements are the chunks of a stream, and returns its
+    /// root. The client answers the same queries as for `add_known_list` applied to the list of
+    /// chunks, but the chunks are read again from the stream when needed instead of being kept in
+    /// memory. The preimage of a leaf is only known after the leaf was returned by a
+    /// GET_MERKLE_LEAF_PROOF or GET_MERKLE_LEAF_ELEMENTS command, which is how the hardware wallet
+    /// requests the elements of a Merkleized list.
+    pub fn add_known_stream(&mut self, tree: StreamedMerkleTree) -> [u8; 32] {
+        let root = *tree.root_hash();
+        self.streams.push(tree);
+        root
+    }
+
+    /// If `queued_yields` is true, the responses from the hardware wallet are expected to start
+    /// with YIELD messages prefixed by their length, as in version 2 of the protocol for SIGN_PSBT.
+    pub fn set_queued_yields(&mut self, queued_yields: bool) {
+        self.queued_yields = queued_yields;
+    }
+
+    /// Removes the YIELD messages queued at the beginning of a response from the hardware wallet,
+    /// each encoded as the YIELD command code, followed by a 1-byte length and the message, and
+    /// adds them to the yielded values. Returns the rest of the response.
+    pub fn extract_queued_yields(&mut self, data: &[u8]) -> Result<Vec<u8>, InterpreterError> {
+        Ok(self.split_queued_yields(data)?.to_vec())
+    }
+
+    /// Like `extract_queued_yields`, but returns the rest of the response without copying it.
+    fn split_queued_yields<'a>(
+        &mut self,
+        mut data: &'a [u8],
+    ) -> Result<&'a [u8], InterpreterError> {
+        while !data.is_empty() && data[0] == ClientCommandCode::Yield as u8 {
+            if data.len() < 2 || data.len() < 2 + data[1] as usize {
+                return Err(InterpreterError::UnsupportedRequest(
+                    ClientCommandCode::Yield as u8,
+                ));
+            }
+            let msg_len = data[1] as usize;
+            self.yielded.push(data[2..2 + msg_len].to_vec());
+            data = &data[2 + msg_len..];
         }
-        self.add_known_list(&keys);
-        self.add_known_list(&values);
+        Ok(data)
     }
 
     // Interprets the client command requested by the hardware wallet, returns the appropriate
     // response to transmit back and updates interpreter internal states.
     pub fn execute(&mut self, command: Vec<u8>) -> Result<Vec<u8>, InterpreterError> {
+        let mut response = Vec::new();
+        self.execute_into(&command, &mut response)?;
+        Ok(response)
+    }
+
+    /// Like `execute`, but writes the response in `response`, replacing its content. When the
+    /// same buffer is reused for all the commands of a session, its capacity is reused too, and no
+    /// response is allocated once it is large enough.
+    pub fn execute_into(
+        &mut self,
+        command: &[u8],
+        response: &mut Vec<u8>,
+    ) -> Result<(), InterpreterError> {
+        response.clear();
+        let command = if self.queued_yields {
+            let command = self.split_queued_yields(command)?;
+            if command.is_empty() {
+                // the interruption only contained queued YIELD messages
+                return Ok(());
+            }
+            command
+        } else {
+            command
+        };
         if command.is_empty() {
             return Err(InterpreterError::EmptyInput);
         }
+        let request = &command[1..];
         match ClientCommandCode::try_from(command[0]) {
             Ok(ClientCommandCode::Yield) => {
-                self.yielded.push(command[1..].to_vec());
-                Ok(Vec::new())
-            }
-            Ok(ClientCommandCode::GetPreimage) => {
-                get_preimage_command(&mut self.queue, &self.known_preimages, &command[1..])
+                self.yielded.push(request.to_vec());
+                Ok(())
             }
-            Ok(ClientCommandCode::GetMerkleLeafProof) => {
-                get_merkle_leaf_proof(&mut self.queue, &self.trees, &command[1..])
+            Ok(ClientCommandCode::GetPreimage) => get_preimage_command(
+                &mut self.queue,
+                &self.known,
+                &self.streams,
+                request,
+                response,
+            ),
+            Ok(ClientCommandCode::GetMerkleLeafProof) => get_merkle_leaf_proof(
+                &mut self.queue,
+                &self.known,
+                &mut self.streams,
+                &mut self.leaf_proofs,
+                request,
+                response,
+            ),
+            Ok(ClientCommandCode::GetMerkleLeafProofs) => {
+                get_merkle_leaf_proofs(&mut self.queue, &self.known, request, response)
             }
+            Ok(ClientCommandCode::GetMerkleLeafElements) => get_merkle_leaf_elements(
+                &mut self.queue,
+                &self.known,
+                &mut self.streams,
+                request,
+                response,
+            ),
             Ok(ClientCommandCode::GetMerkleLeafIndex) => {
-                get_merkle_leaf_index(&self.trees, &command[1..])
+                get_merkle_leaf_index(&self.known, &mut self.streams, request, response)
+            }
+            Ok(ClientCommandCode::GetMerkleLeafProofRefs) => get_merkle_leaf_proof_refs(
+                &mut self.queue,
+                &self.known,
+                &mut self.hash_refs,
+                request,
+                response,
+            ),
+            Ok(ClientCommandCode::AnnounceAccessPlan) => {
+                announce_access_plan(&mut self.access_plan, &self.known, request)
+            }
+            Ok(ClientCommandCode::GetAccessPlanData) => {
+                get_pending_data(&mut self.access_plan, request, response)
+            }
+            Ok(ClientCommandCode::StreamMerkleTree) => {
+                stream_merkle_tree(&mut self.tree_stream, &self.known, request, response)
+            }
+            Ok(ClientCommandCode::GetTreeStreamData) => {
+                get_pending_data(&mut self.tree_stream, request, response)
             }
-            Ok(ClientCommandCode::GetMoreElements) => get_more_elements(&mut self.queue),
+            Ok(ClientCommandCode::PutRecord) => put_record(&mut self.records, request),
+            Ok(ClientCommandCode::GetRecord) => get_record(&self.records, request, response),
+            Ok(ClientCommandCode::GetMoreElements) => get_more_elements(&mut self.queue, response),
             Err(()) => Err(InterpreterError::UnknownCommand(command[0])),
         }
     }
@@ -119,22 +366,194 @@ impl ClientCommandInterpreter {
     pub fn yielded(self) -> Vec<Vec<u8>> {
         self.yielded
     }
+
+    /// Returns the results yielded since the last call, and removes them from the interpreter.
+    pub fn take_yielded(&mut self) -> Vec<Vec<u8>> {
+        std::mem::take(&mut self.yielded)
+    }
+}
+
+/// The elements that did not fit in a response, returned with GET_MORE_ELEMENTS. They all have the
+/// same length, and are stored contiguously, so that no allocation is made for each of them.
+#[derive(Default)]
+struct ElementsQueue {
+    element_len: usize,
+    data: Vec<u8>,
+    /// Offset in `data` of the first element still in the queue.
+    start: usize,
+}
+
+impl ElementsQueue {
+    fn is_empty(&self) -> bool {
+        self.start == self.data.len()
+    }
+
+    /// Adds the concatenated `elements`, of `element_len` bytes each, at the end of the queue.
+    /// Fails if the queue contains elements of a different length.
+    fn extend(&mut self, element_len: usize, elements: &[u8]) -> Result<(), InterpreterError> {
+        if elements.is_empty() {
+            return Ok(());
+        }
+        if self.is_empty() {
+            self.data.clear();
+            self.start = 0;
+            self.element_len = element_len;
+        } else if self.element_len != element_len {
+            return Err(InterpreterError::UnexpectedQueue);
+        }
+        self.data.extend_from_slice(elements);
+        Ok(())
+    }
+
+    /// Removes up to `max_elements` elements from the front of the queue, and appends them to
+    /// `out`. Returns the number of elements removed.
+    fn pop_into(&mut self, max_elements: usize, out: &mut Vec<u8>) -> usize {
+        let n_elements = core::cmp::min(
+            max_elements,
+            (self.data.len() - self.start) / self.element_len,
+        );
+        let end = self.start + n_elements * self.element_len;
+        out.extend_from_slice(&self.data[self.start..end]);
+        self.start = end;
+        n_elements
+    }
+}
+
+/// Maximum length of the data of a response, sent as a short APDU.
+const MAX_RESPONSE_LEN: usize = 255;
+
+/// Number of entries of the table of hash references.
+const HASH_REFS_SIZE: usize = 16;
+
+/// Number of hashes of each proof, closest to the leaf, that are never stored in the table of hash
+/// references: they are below the nodes kept by the hardware wallet after verifying a proof.
+const HASH_REFS_FRONTIER_LEVELS: usize = 3;
+
+/// Reference of a Merkle root sent in full in a GET_MERKLE_LEAF_PROOF_REFS request.
+const HASH_REF_NONE: u8 = 0xFF;
+
+/// The table of the hashes exchanged in the GET_MERKLE_LEAF_PROOF_REFS commands of an APDU, kept
+/// identically by the hardware wallet, which references its entries by their index.
+/// In each exchange, the hashes are used in this order: the Merkle root, the referenced proof
+/// hashes, then the proof hashes sent in full. Using a hash that is in the table marks its entry as
+/// the most recently used; otherwise, a hash sent in full replaces the least recently used entry
+/// (the empty entries first, with the lowest index first) among the ones not used yet in the same
+/// exchange, or it is not stored if all of them were.
+#[derive(Default)]
+struct HashRefTable {
+    hashes: [Option<[u8; 32]>; HASH_REFS_SIZE],
+    /// The time each entry was last used, or 0 if it is empty.
+    last_used: [u64; HASH_REFS_SIZE],
+    clock: u64,
+    /// The time of the start of the current exchange.
+    exchange_start: u64,
+}
+
+impl HashRefTable {
+    fn start_exchange(&mut self) {
+        self.exchange_start = self.clock;
+    }
+
+    fn find(&self, hash: &[u8; 32]) -> Option<usize> {
+        self.hashes
+            .iter()
+            .position(|entry| entry.as_ref() == Some(hash))
+    }
+
+    /// Marks the entry with the given index as the most recently used, and returns its hash.
+    fn use_entry(&mut self, index: usize) -> Result<[u8; 32], InterpreterError> {
+        let hash = self
+            .hashes
+            .get(index)
+            .copied()
+            .flatten()
+            .ok_or(InterpreterError::InvalidHashRef)?;
+        self.clock += 1;
+        self.last_used[index] = self.clock;
+        Ok(hash)
+    }
+
+    /// Uses the entry of `hash`, storing it first if it is not in the table and an entry can be
+    /// replaced.
+    fn add(&mut self, hash: &[u8; 32]) {
+        let index = match self.find(hash) {
+            Some(index) => index,
+            None => {
+                // min_by_key returns the first of the entries used the least recently
+                let candidate = (0..HASH_REFS_SIZE)
+                    .filter(|&i| self.last_used[i] <= self.exchange_start)
+                    .min_by_key(|&i| self.last_used[i]);
+                match candidate {
+                    Some(index) => {
+                        self.hashes[index] = Some(*hash);
+                        index
+                    }
+                    None => return,
+                }
+            }
+        };
+        self.clock += 1;
+        self.last_used[index] = self.clock;
+    }
+}
+
+/// The data of an access plan or of a tree stream, that the hardware wallet reads in order, in as
+/// few responses as possible.
+#[derive(Default)]
+struct PendingData {
+    data: Vec<u8>,
+    /// Offset in `data` of the first byte that was not returned yet.
+    start: usize,
+}
+
+impl PendingData {
+    /// Replaces the data, discarding the bytes of the previous one that were not returned.
+    fn reset(&mut self, data: Vec<u8>) {
+        self.data = data;
+        self.start = 0;
+    }
+
+    fn is_empty(&self) -> bool {
+        self.start == self.data.len()
+    }
+
+    /// Appends to `response` the next bytes of the data that fit in it, prefixed by their number.
+    fn take_chunk(&mut self, response: &mut Vec<u8>) {
+        // the number takes 3 bytes if it is larger than 252
+        let mut n_bytes = MAX_RESPONSE_LEN - 1;
+        if n_bytes > 0xFC {
+            n_bytes = MAX_RESPONSE_LEN - 3;
+        }
+        n_bytes = core::cmp::min(n_bytes, self.data.len() - self.start);
+
+        response.extend(encode::serialize(&VarInt(n_bytes as u64)));
+        response.extend_from_slice(&self.data[self.start..self.start + n_bytes]);
+        self.start += n_bytes;
+    }
+}
+
+/// Converts a slice of 32 bytes, whose length was already checked, to a hash.
+fn hash_from_slice(hash: &[u8]) -> [u8; 32] {
+    <[u8; 32]>::try_from(hash).expect("hash must be 32 bytes long")
 }
 
 fn get_preimage_command(
-    queue: &mut Vec<Vec<u8>>,
-    known_preimages: &[([u8; 32], Vec<u8>)],
+    queue: &mut ElementsQueue,
+    known: &[Arc<KnownData>],
+    streams: &[StreamedMerkleTree],
     request: &[u8],
-) -> Result<Vec<u8>, InterpreterError> {
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
     if request.len() != 33 || request[0] != b'\0' {
         return Err(InterpreterError::UnsupportedRequest(
             ClientCommandCode::GetPreimage as u8,
         ));
     };
 
-    let (_, preimage) = known_preimages
-        .iter()
-        .find(|(hash, _)| hash == &request[1..])
+    let hash = hash_from_slice(&request[1..]);
+    // the leaves of the streams are not stored, but the last leaf that was read can be returned
+    let preimage = find_preimage(known, &hash)
+        .or_else(|| streams.iter().find_map(|s| s.find_preimage(&hash)))
         .ok_or(InterpreterError::UnknownHash)?;
 
     let preimage_len_out = encode::serialize(&VarInt(preimage.len() as u64));
@@ -149,23 +568,22 @@ fn get_preimage_command(
         preimage.len()
     };
 
-    if payload_size < preimage.len() {
-        for byte in &preimage[payload_size..] {
-            queue.push(vec![*byte]);
-        }
-    }
+    queue.extend(1, &preimage[payload_size..])?;
 
-    let mut response = preimage_len_out;
+    response.extend_from_slice(&preimage_len_out);
     response.extend_from_slice(&(payload_size as u8).to_be_bytes());
     response.extend_from_slice(&preimage[..payload_size]);
-    Ok(response)
+    Ok(())
 }
 
 fn get_merkle_leaf_proof(
-    queue: &mut Vec<Vec<u8>>,
-    trees: &[MerkleTree],
+    queue: &mut ElementsQueue,
+    known: &[Arc<KnownData>],
+    streams: &mut [StreamedMerkleTree],
+    leaf_proofs: &mut HashMap<([u8; 32], usize), (Vec<u8>, Vec<u8>)>,
     request: &[u8],
-) -> Result<Vec<u8>, InterpreterError> {
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
     if !queue.is_empty() {
         return Err(InterpreterError::UnexpectedQueue);
     } else if request.len() < 34 {
@@ -185,45 +603,241 @@ fn get_merkle_leaf_proof(
         InterpreterError::UnsupportedRequest(ClientCommandCode::GetMerkleLeafProof as u8)
     })?;
 
-    let tree = trees
-        .iter()
-        .find(|tree| tree.root_hash() == root)
-        .ok_or(InterpreterError::UnknownHash)?;
+    let tree = match find_tree(known, root) {
+        Some(tree) => tree,
+        None => {
+            let stream = find_stream(streams, root).ok_or(InterpreterError::UnknownHash)?;
+            return get_streamed_leaf_proof(queue, stream, tree_size, leaf_index, response);
+        }
+    };
 
     if leaf_index >= tree_size || tree_size.0 != tree.size() as u64 {
         return Err(InterpreterError::InvalidIndexOrSize);
     }
 
-    let proof = tree
-        .get_leaf_proof(leaf_index.0 as usize)
+    let key = (*tree.root_hash(), leaf_index.0 as usize);
+    if !leaf_proofs.contains_key(&key) {
+        let proof = tree
+            .get_leaf_proof(leaf_index.0 as usize)
+            .ok_or(InterpreterError::InvalidIndexOrSize)?;
+
+        let len_proof = proof.len();
+        let mut first_part_proof = Vec::new();
+        let mut leftover_elements = Vec::new();
+        let mut n_response_elements = 0;
+        for (i, p) in proof.into_iter().enumerate() {
+            // how many elements we can fit in 255 - 32 - 1 - 1 = 221 bytes ?
+            // response: 6 array of 32 bytes.
+            if i < 6 {
+                first_part_proof.extend_from_slice(&p);
+                n_response_elements += 1;
+            } else {
+                leftover_elements.extend_from_slice(&p);
+            }
+        }
+
+        let mut response = tree.get_leaf(leaf_index.0 as usize).unwrap().to_vec();
+        response.extend_from_slice(&(len_proof as u8).to_be_bytes());
+        response.extend_from_slice(&(n_response_elements as u8).to_be_bytes());
+        response.extend_from_slice(&first_part_proof);
+        leaf_proofs.insert(key, (response, leftover_elements));
+    }
+
+    let (cached_response, leftover_elements) = &leaf_proofs[&key];
+
+    // Add to the queue any proof elements that do not fit the response
+    queue.extend(32, leftover_elements)?;
+    response.extend_from_slice(cached_response);
+    Ok(())
+}
+
+/// Same as `get_merkle_leaf_proof` for a streamed Merkle tree, whose responses are not kept.
+fn get_streamed_leaf_proof(
+    queue: &mut ElementsQueue,
+    stream: &mut StreamedMerkleTree,
+    tree_size: VarInt,
+    leaf_index: VarInt,
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
+    if leaf_index >= tree_size || tree_size.0 != stream.size() as u64 {
+        return Err(InterpreterError::InvalidIndexOrSize);
+    }
+
+    let leaf_index = leaf_index.0 as usize;
+    let proof = stream
+        .get_leaf_proof(leaf_index)?
+        .ok_or(InterpreterError::InvalidIndexOrSize)?;
+    let leaf = stream
+        .get_leaf(leaf_index)?
         .ok_or(InterpreterError::InvalidIndexOrSize)?;
 
-    let len_proof = proof.len();
-    let mut first_part_proof = Vec::new();
-    let mut n_response_elements = 0;
-    for (i, p) in proof.into_iter().enumerate() {
-        // how many elements we can fit in 255 - 32 - 1 - 1 = 221 bytes ?
-        // response: 6 array of 32 bytes.
-        if i < 6 {
-            first_part_proof.extend(p);
-            n_response_elements += 1;
+    // as many elements as fit in 255 - 32 - 1 - 1 = 221 bytes
+    let n_response_elements = core::cmp::min(proof.len(), 6);
+    response.extend_from_slice(&leaf);
+    response.push(proof.len() as u8);
+    response.push(n_response_elements as u8);
+    for (i, p) in proof.iter().enumerate() {
+        if i < n_response_elements {
+            response.extend_from_slice(p);
         } else {
             // Add to the queue any proof elements that do not fit the response
-            queue.push(p);
+            queue.extend(32, p)?;
         }
     }
+    Ok(())
+}
+
+fn get_merkle_leaf_proofs(
+    queue: &mut ElementsQueue,
+    known: &[Arc<KnownData>],
+    request: &[u8],
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
+    if !queue.is_empty() {
+        return Err(InterpreterError::UnexpectedQueue);
+    } else if request.len() < 35 {
+        return Err(InterpreterError::UnsupportedRequest(
+            ClientCommandCode::GetMerkleLeafProofs as u8,
+        ));
+    };
+
+    let root = &request[0..32];
+    let unsupported =
+        |_| InterpreterError::UnsupportedRequest(ClientCommandCode::GetMerkleLeafProofs as u8);
+    let (tree_size, read1): (VarInt, usize) =
+        encode::deserialize_partial(&request[32..]).map_err(unsupported)?;
+    let (first_leaf_index, read2): (VarInt, usize) =
+        encode::deserialize_partial(&request[32 + read1..]).map_err(unsupported)?;
+
+    // deserialize consumes the entire vector.
+    let n_leaves: VarInt =
+        encode::deserialize(&request[32 + read1 + read2..]).map_err(unsupported)?;
+
+    let tree = find_tree(known, root).ok_or(InterpreterError::UnknownHash)?;
+
+    if n_leaves.0 == 0
+        || first_leaf_index.0.saturating_add(n_leaves.0) > tree_size.0
+        || tree_size.0 != tree.size() as u64
+    {
+        return Err(InterpreterError::InvalidIndexOrSize);
+    }
+
+    let proof = tree
+        .get_leaves_multiproof(first_leaf_index.0 as usize, n_leaves.0 as usize)
+        .ok_or(InterpreterError::InvalidIndexOrSize)?;
+
+    // how many elements we can fit in 255 - 1 - 1 = 253 bytes ?
+    // response: 7 array of 32 bytes.
+    let len_proof = proof.len();
+    let n_response_elements = core::cmp::min(len_proof, 7);
 
-    let mut response = tree.get_leaf(leaf_index.0 as usize).unwrap().to_vec();
     response.extend_from_slice(&(len_proof as u8).to_be_bytes());
     response.extend_from_slice(&(n_response_elements as u8).to_be_bytes());
-    response.extend_from_slice(&first_part_proof);
-    Ok(response)
+    for (i, p) in proof.iter().enumerate() {
+        if i < n_response_elements {
+            response.extend_from_slice(p);
+        } else {
+            // Add to the queue any proof elements that do not fit the response
+            queue.extend(32, p)?;
+        }
+    }
+    Ok(())
+}
+
+fn get_merkle_leaf_elements(
+    queue: &mut ElementsQueue,
+    known: &[Arc<KnownData>],
+    streams: &mut [StreamedMerkleTree],
+    request: &[u8],
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
+    if !queue.is_empty() {
+        return Err(InterpreterError::UnexpectedQueue);
+    } else if request.len() < 34 {
+        return Err(InterpreterError::UnsupportedRequest(
+            ClientCommandCode::GetMerkleLeafElements as u8,
+        ));
+    };
+
+    let root = &request[0..32];
+    let unsupported =
+        || InterpreterError::UnsupportedRequest(ClientCommandCode::GetMerkleLeafElements as u8);
+    let (tree_size, mut read): (VarInt, usize) =
+        encode::deserialize_partial(&request[32..]).map_err(|_| unsupported())?;
+    read += 32;
+
+    let n_leaves = *request.get(read).ok_or_else(unsupported)?;
+    read += 1;
+    let mut leaf_indexes = Vec::with_capacity(n_leaves as usize);
+    for _ in 0..n_leaves {
+        let (leaf_index, r): (VarInt, usize) =
+            encode::deserialize_partial(&request[read..]).map_err(|_| unsupported())?;
+        leaf_indexes.push(leaf_index.0 as usize);
+        read += r;
+    }
+    if read != request.len() {
+        return Err(unsupported());
+    }
+
+    let data: Vec<u8> = match find_tree(known, root) {
+        Some(tree) => {
+            if tree_size.0 != tree.size() as u64 {
+                return Err(InterpreterError::InvalidIndexOrSize);
+            }
+
+            let mut data = tree
+                .get_leaf_set_multiproof(&leaf_indexes)
+                .ok_or(InterpreterError::InvalidIndexOrSize)?
+                .concat();
+            for leaf_index in leaf_indexes {
+                let preimage = find_preimage(known, tree.get_leaf(leaf_index).unwrap())
+                    .ok_or(InterpreterError::UnknownHash)?;
+                data.extend(encode::serialize(&VarInt(preimage.len() as u64)));
+                data.extend_from_slice(preimage);
+            }
+            data
+        }
+        None => {
+            let stream = find_stream(streams, root).ok_or(InterpreterError::UnknownHash)?;
+            if tree_size.0 != stream.size() as u64 {
+                return Err(InterpreterError::InvalidIndexOrSize);
+            }
+
+            let mut data = stream
+                .get_leaf_set_multiproof(&leaf_indexes)?
+                .ok_or(InterpreterError::InvalidIndexOrSize)?
+                .concat();
+            for leaf_index in leaf_indexes {
+                let leaf = stream.get_leaf(leaf_index)?.unwrap();
+                let preimage = stream.find_preimage(&leaf).unwrap();
+                data.extend(encode::serialize(&VarInt(preimage.len() as u64)));
+                data.extend_from_slice(preimage);
+            }
+            data
+        }
+    };
+
+    let data_len_out = encode::serialize(&VarInt(data.len() as u64));
+
+    // We can send at most 255 - len(data_len_out) - 1 bytes in a single message;
+    // the rest will be stored for GET_MORE_ELEMENTS
+    let max_payload_size = 255 - data_len_out.len() - 1;
+    let payload_size = std::cmp::min(max_payload_size, data.len());
+
+    queue.extend(1, &data[payload_size..])?;
+
+    response.extend_from_slice(&data_len_out);
+    response.extend_from_slice(&(payload_size as u8).to_be_bytes());
+    response.extend_from_slice(&data[..payload_size]);
+    Ok(())
 }
 
 fn get_merkle_leaf_index(
-    trees: &[MerkleTree],
+    known: &[Arc<KnownData>],
+    streams: &mut [StreamedMerkleTree],
     request: &[u8],
-) -> Result<Vec<u8>, InterpreterError> {
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
     if request.len() < 64 {
         return Err(InterpreterError::UnsupportedRequest(
             ClientCommandCode::GetMerkleLeafIndex as u8,
@@ -232,45 +846,288 @@ fn get_merkle_leaf_index(
     let root = &request[0..32];
     let hash = &request[32..64];
 
-    let tree = trees
-        .iter()
-        .find(|tree| tree.root_hash() == root)
-        .ok_or(InterpreterError::UnknownHash)?;
-
-    let leaf_index = tree
-        .get_leaf_index(hash)
-        .ok_or(InterpreterError::UnknownHash)?;
+    let leaf_index = match find_tree(known, root) {
+        Some(tree) => tree.get_leaf_index(hash),
+        None => find_stream(streams, root)
+            .ok_or(InterpreterError::UnknownHash)?
+            .get_leaf_index(hash)?,
+    }
+    .ok_or(InterpreterError::UnknownHash)?;
 
-    let mut response = 1_u8.to_be_bytes().to_vec();
+    response.extend_from_slice(&1_u8.to_be_bytes());
     response.extend(encode::serialize(&VarInt(leaf_index as u64)));
-    Ok(response)
+    Ok(())
 }
 
-fn get_more_elements(queue: &mut Vec<Vec<u8>>) -> Result<Vec<u8>, InterpreterError> {
-    if queue.is_empty() {
-        return Err(InterpreterError::UnexpectedQueue);
+fn get_merkle_leaf_proof_refs(
+    queue: &mut ElementsQueue,
+    known: &[Arc<KnownData>],
+    hash_refs: &mut HashRefTable,
+    request: &[u8],
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
+    let unsupported =
+        || InterpreterError::UnsupportedRequest(ClientCommandCode::GetMerkleLeafProofRefs as u8);
+
+    hash_refs.start_exchange();
+
+    let root_ref = *request.first().ok_or_else(unsupported)?;
+    let mut read = 1;
+    let root = if root_ref == HASH_REF_NONE {
+        let root = request.get(1..33).ok_or_else(unsupported)?;
+        let root = hash_from_slice(root);
+        hash_refs.add(&root);
+        read += 32;
+        root
+    } else {
+        hash_refs.use_entry(root_ref as usize)?
+    };
+    let (tree_size, r): (VarInt, usize) =
+        encode::deserialize_partial(&request[read..]).map_err(|_| unsupported())?;
+    read += r;
+    let (leaf_index, r): (VarInt, usize) =
+        encode::deserialize_partial(&request[read..]).map_err(|_| unsupported())?;
+    read += r;
+    let n_known = *request.get(read).ok_or_else(unsupported)? as usize;
+    if read + 1 != request.len() {
+        return Err(unsupported());
     }
 
-    // The queue must contain only element of the same length.
-    let element_length = queue[0].len();
-    if queue.iter().any(|e| e.len() != element_length) {
+    let tree = find_tree(known, &root).ok_or(InterpreterError::UnknownHash)?;
+
+    if leaf_index >= tree_size || tree_size.0 != tree.size() as u64 {
+        return Err(InterpreterError::InvalidIndexOrSize);
+    }
+    if !queue.is_empty() {
         return Err(InterpreterError::UnexpectedQueue);
     }
 
-    let mut response_elements = Vec::new();
-    let mut n_added_elements = 0;
-    for element in queue.iter() {
-        if response_elements.len() + element_length <= 253 {
-            response_elements.extend_from_slice(element);
-            n_added_elements += 1;
+    let mut proof = tree
+        .get_leaf_proof(leaf_index.0 as usize)
+        .ok_or(InterpreterError::InvalidIndexOrSize)?;
+    if n_known > proof.len() {
+        return Err(InterpreterError::InvalidIndexOrSize);
+    }
+    // the hardware wallet already knows the node at the level of the last n_known hashes
+    proof.truncate(proof.len() - n_known);
+
+    // the last hashes of the proof that are in the table are referenced; they are the ones closer to
+    // the root, shared with the proofs of the neighbouring leaves
+    let mut refs = Vec::new();
+    while refs.len() < proof.len() {
+        match hash_refs.find(&proof[proof.len() - 1 - refs.len()]) {
+            Some(index) => refs.push(index as u8),
+            None => break,
+        }
+    }
+    refs.reverse();
+
+    let full_proof = &proof[..proof.len() - refs.len()];
+    for index in &refs {
+        hash_refs.use_entry(*index as usize)?;
+    }
+    for hash in full_proof.iter().skip(HASH_REFS_FRONTIER_LEVELS) {
+        hash_refs.add(hash);
+    }
+
+    // how many elements we can fit in the rest of the response
+    let n_response_elements = core::cmp::min(
+        (MAX_RESPONSE_LEN - 32 - 1 - 1 - refs.len() - 1) / 32,
+        full_proof.len(),
+    );
+
+    response.extend_from_slice(tree.get_leaf(leaf_index.0 as usize).unwrap());
+    response.push(proof.len() as u8);
+    response.push(refs.len() as u8);
+    response.extend_from_slice(&refs);
+    response.push(n_response_elements as u8);
+    for (i, p) in full_proof.iter().enumerate() {
+        if i < n_response_elements {
+            response.extend_from_slice(p);
+        } else {
+            // Add to the queue any proof elements that do not fit the response
+            queue.extend(32, p)?;
+        }
+    }
+    Ok(())
+}
+
+/// Returns the Merkle tree with the given root, checking its size.
+fn find_tree_with_size<'a>(
+    known: &'a [Arc<KnownData>],
+    root: &[u8],
+    size: u64,
+) -> Result<&'a MerkleTree, InterpreterError> {
+    let tree = find_tree(known, root).ok_or(InterpreterError::UnknownMerkleRoot)?;
+    if tree.size() as u64 != size {
+        return Err(InterpreterError::InvalidIndexOrSize);
+    }
+    Ok(tree)
+}
+
+fn announce_access_plan(
+    plan: &mut PendingData,
+    known: &[Arc<KnownData>],
+    request: &[u8],
+) -> Result<(), InterpreterError> {
+    let unsupported =
+        || InterpreterError::UnsupportedRequest(ClientCommandCode::AnnounceAccessPlan as u8);
+
+    let maps_root = request.get(0..32).ok_or_else(unsupported)?;
+    let (n_maps, mut read): (VarInt, usize) =
+        encode::deserialize_partial(&request[32..]).map_err(|_| unsupported())?;
+    read += 32;
+    let n_keys = *request.get(read).ok_or_else(unsupported)?;
+    read += 1;
+    let mut keys = Vec::with_capacity(n_keys as usize);
+    for _ in 0..n_keys {
+        let key_len = *request.get(read).ok_or_else(unsupported)? as usize;
+        let key = request
+            .get(read + 1..read + 1 + key_len)
+            .ok_or_else(unsupported)?;
+        keys.push(key);
+        read += 1 + key_len;
+    }
+    if read != request.len() {
+        return Err(unsupported());
+    }
+
+    let maps_tree = find_tree_with_size(known, maps_root, n_maps.0)?;
+
+    let mut data = Vec::new();
+    for i in 0..maps_tree.size() {
+        let commitment = find_preimage(known, maps_tree.get_leaf(i).unwrap())
+            .ok_or(InterpreterError::UnknownHash)?;
+        // the leaf preimage is the map commitment, prefixed by 0x00
+        let (map_size, r): (VarInt, usize) = commitment
+            .get(1..)
+            .and_then(|c| encode::deserialize_partial(c).ok())
+            .ok_or(InterpreterError::UnknownHash)?;
+        if commitment.len() != 1 + r + 64 {
+            return Err(InterpreterError::UnknownHash);
+        }
+        let keys_tree = find_tree_with_size(known, &commitment[1 + r..33 + r], map_size.0)?;
+        let values_tree = find_tree_with_size(known, &commitment[33 + r..], map_size.0)?;
+
+        for key in &keys {
+            let mut engine = sha256::Hash::engine();
+            engine.input(&[0x00]);
+            engine.input(key);
+            let key_hash = sha256::Hash::from_engine(engine).into_inner();
+            // nothing for the keys that are not in the map
+            let index = match keys_tree.get_leaf_index(&key_hash) {
+                Some(index) => index,
+                None => continue,
+            };
+
+            let preimage = find_preimage(known, values_tree.get_leaf(index).unwrap())
+                .ok_or(InterpreterError::UnknownHash)?;
+            data.extend(encode::serialize(&VarInt(preimage.len() as u64)));
+            data.extend_from_slice(preimage);
+            data.extend(values_tree.get_leaf_proof(index).unwrap().concat());
         }
     }
-    *queue = queue[n_added_elements..].to_vec();
 
-    let mut response = (n_added_elements as u8).to_be_bytes().to_vec();
-    response.extend((element_length as u8).to_be_bytes());
-    response.extend(response_elements);
-    Ok(response)
+    // the data of the previous plan, if any, is discarded
+    plan.reset(data);
+    Ok(())
+}
+
+fn stream_merkle_tree(
+    stream: &mut PendingData,
+    known: &[Arc<KnownData>],
+    request: &[u8],
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
+    let unsupported =
+        || InterpreterError::UnsupportedRequest(ClientCommandCode::StreamMerkleTree as u8);
+
+    let root = request.get(0..32).ok_or_else(unsupported)?;
+    // deserialize consumes the entire vector.
+    let tree_size: VarInt = encode::deserialize(&request[32..]).map_err(|_| unsupported())?;
+
+    if tree_size.0 == 0 {
+        return Err(InterpreterError::InvalidIndexOrSize);
+    }
+    let tree = find_tree_with_size(known, root, tree_size.0)?;
+
+    let mut data = Vec::new();
+    for i in 0..tree.size() {
+        let preimage =
+            find_preimage(known, tree.get_leaf(i).unwrap()).ok_or(InterpreterError::UnknownHash)?;
+        data.extend(encode::serialize(&VarInt(preimage.len() as u64)));
+        data.extend_from_slice(preimage);
+    }
+
+    // the data of the previous stream, if any, is discarded
+    stream.reset(data);
+    stream.take_chunk(response);
+    Ok(())
+}
+
+fn get_pending_data(
+    pending: &mut PendingData,
+    request: &[u8],
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
+    if !request.is_empty() {
+        return Err(InterpreterError::InvalidRequestLength);
+    }
+    if pending.is_empty() {
+        return Err(InterpreterError::NoPendingData);
+    }
+    pending.take_chunk(response);
+    Ok(())
+}
+
+fn put_record(records: &mut HashMap<u64, Vec<u8>>, request: &[u8]) -> Result<(), InterpreterError> {
+    let unsupported = || InterpreterError::UnsupportedRequest(ClientCommandCode::PutRecord as u8);
+    let (index, read): (VarInt, usize) =
+        encode::deserialize_partial(request).map_err(|_| unsupported())?;
+    let record_len = *request.get(read).ok_or_else(unsupported)? as usize;
+    let record = &request[read + 1..];
+    if record.len() != record_len {
+        return Err(unsupported());
+    }
+
+    records.insert(index.0, record.to_vec());
+    Ok(())
+}
+
+fn get_record(
+    records: &HashMap<u64, Vec<u8>>,
+    request: &[u8],
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
+    let unsupported = || InterpreterError::UnsupportedRequest(ClientCommandCode::GetRecord as u8);
+    let (index, read): (VarInt, usize) =
+        encode::deserialize_partial(request).map_err(|_| unsupported())?;
+    if read != request.len() {
+        return Err(unsupported());
+    }
+
+    let record = records
+        .get(&index.0)
+        .ok_or(InterpreterError::UnknownRecord)?;
+    response.push(record.len() as u8);
+    response.extend_from_slice(record);
+    Ok(())
+}
+
+fn get_more_elements(
+    queue: &mut ElementsQueue,
+    response: &mut Vec<u8>,
+) -> Result<(), InterpreterError> {
+    if queue.is_empty() {
+        return Err(InterpreterError::UnexpectedQueue);
+    }
+
+    // as many elements as fit in 255 - 1 - 1 = 253 bytes
+    let element_length = queue.element_len;
+    response.extend_from_slice(&[0, element_length as u8]);
+    let n_added_elements = queue.pop_into(253 / element_length, response);
+    response[0] = n_added_elements as u8;
+    Ok(())
 }
 
 /// Returns a serialized Merkleized map commitment, encoded as the concatenation of:
@@ -312,4 +1169,16 @@ pub enum InterpreterError {
     UnknownHash,
     UnknownMerkleRoot,
     UnexpectedQueue,
+    UnknownRecord,
+    InvalidHashRef,
+    InvalidRequestLength,
+    NoPendingData,
+    /// Reading a stream added with `add_known_stream` failed.
+    Io(std::io::Error),
+}
+
+impl From<std::io::Error> for InterpreterError {
+    fn from(e: std::io::Error) -> InterpreterError {
+        InterpreterError::Io(e)
+    }
 }
@@ -1,15 +1,20 @@
 mod command;
-mod interpreter;
+#[doc(hidden)]
+pub mod interpreter;
 mod merkle;
+mod merkleized_psbt;
 mod psbt;
 
 pub mod apdu;
 pub mod client;
 pub mod error;
+pub mod trace;
 pub mod wallet;
 
 #[cfg(feature = "async")]
 pub mod async_client;
 
 pub use client::{BitcoinClient, Transport};
+pub use interpreter::KnownData;
+pub use merkleized_psbt::MerkleizedPsbt;
 pub use wallet::{WalletPolicy, WalletPubKey};
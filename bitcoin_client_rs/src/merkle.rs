@@ -1,3 +1,7 @@
+use core::convert::TryFrom;
+use std::collections::HashMap;
+use std::io::{self, Read, Seek, SeekFrom};
+
 use bitcoin::hashes::{sha256, Hash, HashEngine};
 
 ///! This implementation of Merkle Trees makes usage of a
@@ -10,161 +14,410 @@ use bitcoin::hashes::{sha256, Hash, HashEngine};
 ///!  - get_merkle_leaf_index: provide the index of the leaf with hash.
 
 /// MerkleTree is containing a merkle tree generated from a list of items.
+///
+/// The tree is stored as the array of the hashes of each of its levels, from the leaves to the
+/// root: the node with index j of a level is the parent of the nodes 2j and 2j + 1 of the level
+/// below, or the same node as 2j if it is the last one and has no sibling. This is the same tree
+/// as the one whose left subtree is the complete subtree with the largest power of 2 leaves
+/// strictly smaller than the number of leaves.
+#[derive(Clone)]
 pub struct MerkleTree {
-    root: Tree,
-    leaves: Vec<[u8; 32]>,
+    /// Hashes of each level; the first one is the leaves, the last one only has the root.
+    levels: Vec<Vec<[u8; 32]>>,
+    /// Index of the first leaf with each value.
+    leaf_indexes: HashMap<[u8; 32], usize>,
 }
 
 impl MerkleTree {
     pub fn new(leaves: Vec<[u8; 32]>) -> Self {
+        let mut leaf_indexes = HashMap::with_capacity(leaves.len());
+        for (i, leaf) in leaves.iter().enumerate() {
+            leaf_indexes.entry(*leaf).or_insert(i);
+        }
+
+        let mut levels = vec![leaves];
+        while levels.last().unwrap().len() > 1 {
+            let level = levels.last().unwrap();
+            let parents = level
+                .chunks(2)
+                .map(|pair| match pair {
+                    [left, right] => combine_hashes(left, right),
+                    [single] => *single,
+                    _ => unreachable!(),
+                })
+                .collect();
+            levels.push(parents);
+        }
+
         Self {
-            root: Tree::new(&leaves, 0, leaves.len()),
-            leaves,
+            levels,
+            leaf_indexes,
         }
     }
 
+    fn leaves(&self) -> &[[u8; 32]] {
+        &self.levels[0]
+    }
+
     pub fn size(&self) -> usize {
-        self.leaves.len()
+        self.leaves().len()
     }
 
     /// Returns the root hash of the Merkle tree.
     pub fn root_hash(&self) -> &[u8; 32] {
-        match &self.root {
-            Tree::Node { value, .. } => value,
-            Tree::Leaf(idx) => &self.leaves[*idx],
-        }
+        &self.levels.last().unwrap()[0]
     }
 
     /// Returns the leaf value at index i.
     pub fn get_leaf(&self, i: usize) -> Option<&[u8; 32]> {
-        self.leaves.get(i)
+        self.leaves().get(i)
     }
 
     /// Get position of the leaf in the tree.
     pub fn get_leaf_index(&self, val: &[u8]) -> Option<usize> {
-        self.leaves.iter().position(|v| v == val)
+        let val = <[u8; 32]>::try_from(val).ok()?;
+        self.leaf_indexes.get(&val).copied()
     }
 
-    // Get Merkle proof of a leaf with the given index.
-    pub fn get_leaf_proof(&self, index: usize) -> Option<Vec<Vec<u8>>> {
-        if index >= self.leaves.len() {
+    // Get Merkle proof of a leaf with the given index, from the leaf to the root.
+    pub fn get_leaf_proof(&self, index: usize) -> Option<Vec<[u8; 32]>> {
+        if index >= self.size() {
+            // Out of bound
+            return None;
+        }
+
+        let mut proof = Vec::with_capacity(self.levels.len() - 1);
+        let mut j = index;
+        for level in &self.levels[..self.levels.len() - 1] {
+            // the last node of a level has no sibling if the level has an odd number of nodes
+            if let Some(sibling) = level.get(j ^ 1) {
+                proof.push(*sibling);
+            }
+            j /= 2;
+        }
+        Some(proof)
+    }
+
+    /// Get the multiproof of the consecutive leaves with indexes first_index, ...,
+    /// first_index + n_leaves - 1: the hashes, in left-to-right order, of the requested leaves and
+    /// of the maximal subtrees that do not contain any of the requested leaves.
+    pub fn get_leaves_multiproof(
+        &self,
+        first_index: usize,
+        n_leaves: usize,
+    ) -> Option<Vec<[u8; 32]>> {
+        if n_leaves == 0 || first_index.checked_add(n_leaves)? > self.size() {
             // Out of bound
             None
         } else {
-            Some(self.root.get_proof(&self.leaves, index))
+            let end = first_index + n_leaves;
+            let mut proof = Vec::new();
+            self.get_multiproof(
+                self.levels.len() - 1,
+                0,
+                &|begin, size| begin < end && first_index < begin + size,
+                &mut proof,
+            );
+            Some(proof)
+        }
+    }
+
+    /// Get the multiproof of the leaves with the given strictly increasing indexes, in the same
+    /// format as `get_leaves_multiproof`.
+    pub fn get_leaf_set_multiproof(&self, indexes: &[usize]) -> Option<Vec<[u8; 32]>> {
+        if indexes.is_empty()
+            || *indexes.last()? >= self.size()
+            || indexes.windows(2).any(|w| w[0] >= w[1])
+        {
+            // Out of bound, or not strictly increasing
+            None
+        } else {
+            let mut proof = Vec::new();
+            self.get_multiproof(
+                self.levels.len() - 1,
+                0,
+                &|begin, size| {
+                    // the first requested index not before the subtree
+                    let k = indexes.partition_point(|&i| i < begin);
+                    k < indexes.len() && indexes[k] < begin + size
+                },
+                &mut proof,
+            );
+            Some(proof)
+        }
+    }
+
+    /// Append to `proof` the multiproof of the requested leaves of the subtree of the node with
+    /// index j of the given level, where `is_requested(begin, size)` tells if any of the leaves
+    /// with index in [begin, begin + size) is requested.
+    fn get_multiproof(
+        &self,
+        level: usize,
+        j: usize,
+        is_requested: &dyn Fn(usize, usize) -> bool,
+        proof: &mut Vec<[u8; 32]>,
+    ) {
+        let begin = j << level;
+        let size = core::cmp::min(1 << level, self.size() - begin);
+        if level == 0 || !is_requested(begin, size) {
+            proof.push(self.levels[level][j]);
+        } else if 2 * j + 1 < self.levels[level - 1].len() {
+            self.get_multiproof(level - 1, 2 * j, is_requested, proof);
+            self.get_multiproof(level - 1, 2 * j + 1, is_requested, proof);
+        } else {
+            // the node is the same as its only child
+            self.get_multiproof(level - 1, 2 * j, is_requested, proof);
         }
     }
 }
 
-/// Tree is either a Node with children trees or a Leaf with only a given value.
-enum Tree {
-    Node {
-        value: [u8; 32],
-        left: Box<Tree>,
-        right: Box<Tree>,
-        height: usize,
-    },
-    // index of the leaf in the leaves array
-    Leaf(usize),
+/// A seekable source of bytes, whose chunks are the leaves of a `StreamedMerkleTree`.
+pub trait ReadSeek: Read + Seek + Send {}
+
+impl<T: Read + Seek + Send> ReadSeek for T {}
+
+/// StreamedMerkleTree is the Merkle tree of the list of chunks of a seekable stream, read from its
+/// current position to its end. Each chunk is `chunk_size` bytes long, except possibly the last
+/// one. The tree is the same as the `MerkleTree` of the element hashes of the chunks, but neither
+/// the chunks nor the leaves are kept in memory.
+///
+/// The root is computed in a single pass over the stream, keeping only the roots of the complete
+/// subtrees read so far. Leaves and proofs are computed on demand by reading the chunks again from
+/// the stream. The last computed node of each level is kept, so that proving all the leaves in
+/// increasing order (as in SIGN_MESSAGE) costs O(n log n) hashes in total.
+///
+/// The stream must not be modified while the tree is in use.
+pub struct StreamedMerkleTree {
+    stream: Box<dyn ReadSeek>,
+    chunk_size: usize,
+    stream_start: u64,
+    stream_len: u64,
+    n_leaves: usize,
+    root: [u8; 32],
+    /// For each level, the index and the value of the last computed node.
+    cached_nodes: Vec<Option<(usize, [u8; 32])>>,
+    /// The hash and the preimage (with the b'\0' prefix) of the last leaf returned by `get_leaf`.
+    last_leaf: Option<([u8; 32], Vec<u8>)>,
 }
 
-impl Tree {
-    fn new(leaves: &[[u8; 32]], start: usize, size: usize) -> Self {
-        if size == 1 {
-            return Tree::Leaf(start);
+impl StreamedMerkleTree {
+    /// Reads `stream` from its current position to its end, and returns the tree of its chunks of
+    /// `chunk_size` bytes. The root of the tree of an empty stream is all zeros.
+    pub fn new(stream: impl ReadSeek + 'static, chunk_size: usize) -> io::Result<Self> {
+        assert!(chunk_size > 0, "The chunk size must be positive");
+
+        let mut stream: Box<dyn ReadSeek> = Box::new(stream);
+        let stream_start = stream.seek(SeekFrom::Current(0))?;
+        let stream_len = stream.seek(SeekFrom::End(0))? - stream_start;
+        let n_leaves = ((stream_len + chunk_size as u64 - 1) / chunk_size as u64) as usize;
+        let depth = n_leaves.next_power_of_two().trailing_zeros() as usize;
+
+        let mut tree = Self {
+            stream,
+            chunk_size,
+            stream_start,
+            stream_len,
+            n_leaves,
+            root: [0; 32],
+            cached_nodes: vec![None; depth + 1],
+            last_leaf: None,
+        };
+        if n_leaves > 0 {
+            tree.root = tree.get_node(depth, 0)?;
         }
+        Ok(tree)
+    }
 
-        let lchild_size = largest_power_of_2_less_than(size);
-        let lchild = Tree::new(leaves, start, lchild_size);
-        let rchild = Tree::new(leaves, start + lchild_size, size - lchild_size);
+    pub fn size(&self) -> usize {
+        self.n_leaves
+    }
 
-        let mut input = vec![0x01];
-        input.extend_from_slice(lchild.value(leaves));
-        input.extend_from_slice(rchild.value(leaves));
+    /// Returns the number of bytes of the stream.
+    pub fn stream_len(&self) -> u64 {
+        self.stream_len
+    }
 
-        let mut engine = sha256::Hash::engine();
-        engine.input(input.as_slice());
-        let value = sha256::Hash::from_engine(engine).into_inner();
-        Tree::Node {
-            height: lchild.height() + 1,
-            left: Box::new(lchild),
-            right: Box::new(rchild),
-            value,
+    /// Returns the root hash of the Merkle tree.
+    pub fn root_hash(&self) -> &[u8; 32] {
+        &self.root
+    }
+
+    /// Returns the level of the root, where the leaves are the level 0.
+    fn depth(&self) -> usize {
+        self.cached_nodes.len() - 1
+    }
+
+    /// Reads the chunk with index i from the stream, and returns its preimage, prefixed by b'\0'.
+    fn read_chunk_preimage(&mut self, i: usize) -> io::Result<Vec<u8>> {
+        let offset = i as u64 * self.chunk_size as u64;
+        let chunk_len = core::cmp::min(self.chunk_size as u64, self.stream_len - offset) as usize;
+        let mut preimage = vec![0; 1 + chunk_len];
+        self.stream
+            .seek(SeekFrom::Start(self.stream_start + offset))?;
+        self.stream.read_exact(&mut preimage[1..])?;
+        Ok(preimage)
+    }
+
+    /// Returns the root of the subtree of the leaves with indexes begin, ..., end - 1, reading
+    /// their chunks in a single pass.
+    fn range_root(&mut self, begin: usize, end: usize) -> io::Result<[u8; 32]> {
+        let offset = begin as u64 * self.chunk_size as u64;
+        self.stream
+            .seek(SeekFrom::Start(self.stream_start + offset))?;
+        let mut remaining = core::cmp::min(
+            (end - begin) as u64 * self.chunk_size as u64,
+            self.stream_len - offset,
+        );
+
+        // (height, root) of the complete subtrees of the chunks read so far, from left to right
+        let mut frontier: Vec<(u32, [u8; 32])> = Vec::new();
+        let mut chunk = vec![0; self.chunk_size];
+        while remaining > 0 {
+            let chunk_len = core::cmp::min(self.chunk_size as u64, remaining) as usize;
+            self.stream.read_exact(&mut chunk[..chunk_len])?;
+            remaining -= chunk_len as u64;
+
+            let mut engine = sha256::Hash::engine();
+            engine.input(&[0x00]);
+            engine.input(&chunk[..chunk_len]);
+            let (mut height, mut value) = (0, sha256::Hash::from_engine(engine).into_inner());
+            while let Some(&(h, left)) = frontier.last() {
+                if h != height {
+                    break;
+                }
+                frontier.pop();
+                value = combine_hashes(&left, &value);
+                height += 1;
+            }
+            frontier.push((height, value));
+        }
+
+        // the remaining subtrees have decreasing sizes, and are merged from the right
+        let (_, mut value) = frontier.pop().unwrap();
+        while let Some((_, left)) = frontier.pop() {
+            value = combine_hashes(&left, &value);
         }
+        Ok(value)
     }
 
-    fn value<'a>(&'a self, leaves: &'a [[u8; 32]]) -> &'a [u8; 32] {
-        match self {
-            Self::Node { value, .. } => value,
-            Self::Leaf(idx) => &leaves[*idx],
+    /// Returns the node with index j of the given level, with the same layout as `MerkleTree`.
+    fn get_node(&mut self, level: usize, j: usize) -> io::Result<[u8; 32]> {
+        match self.cached_nodes[level] {
+            Some((index, value)) if index == j => Ok(value),
+            _ => {
+                let end = core::cmp::min((j + 1) << level, self.n_leaves);
+                let value = self.range_root(j << level, end)?;
+                self.cached_nodes[level] = Some((j, value));
+                Ok(value)
+            }
         }
     }
 
-    fn height(&self) -> usize {
-        match self {
-            Self::Node { height, .. } => *height,
-            Self::Leaf(_) => 0,
+    /// Returns the leaf value at index i, reading its chunk from the stream; until the next call,
+    /// `find_preimage` returns the preimage of the leaf.
+    pub fn get_leaf(&mut self, i: usize) -> io::Result<Option<[u8; 32]>> {
+        if i >= self.n_leaves {
+            return Ok(None);
         }
+        let preimage = self.read_chunk_preimage(i)?;
+        let mut engine = sha256::Hash::engine();
+        engine.input(&preimage);
+        let hash = sha256::Hash::from_engine(engine).into_inner();
+        self.last_leaf = Some((hash, preimage));
+        Ok(Some(hash))
     }
 
-    /// get the merkle proof of a leaf with the given index in the leaves array.
-    fn get_proof(&self, leaves: &[[u8; 32]], index: usize) -> Vec<Vec<u8>> {
-        match self {
-            Self::Leaf(_) => Vec::new(),
-            Self::Node { left, right, .. } => {
-                let (mut proof, sibling) = if index < pow2(left.height()) {
-                    (left.get_proof(leaves, index), right)
-                } else {
-                    (right.get_proof(leaves, index - pow2(left.height())), left)
-                };
-                match **sibling {
-                    Self::Node { value, .. } => proof.push(value.to_vec()),
-                    Self::Leaf(idx) => proof.push(leaves[idx].to_vec()),
-                }
-                proof
+    /// Returns the preimage of `hash` if it is the last leaf returned by `get_leaf`: the preimages
+    /// of the other leaves are not kept.
+    pub fn find_preimage(&self, hash: &[u8; 32]) -> Option<&Vec<u8>> {
+        match &self.last_leaf {
+            Some((leaf, preimage)) if leaf == hash => Some(preimage),
+            _ => None,
+        }
+    }
+
+    /// Get position of the first leaf with the given value, reading the whole stream.
+    pub fn get_leaf_index(&mut self, val: &[u8]) -> io::Result<Option<usize>> {
+        for i in 0..self.n_leaves {
+            let preimage = self.read_chunk_preimage(i)?;
+            let mut engine = sha256::Hash::engine();
+            engine.input(&preimage);
+            if sha256::Hash::from_engine(engine).into_inner()[..] == *val {
+                return Ok(Some(i));
             }
         }
+        Ok(None)
     }
-}
 
-/// Return floor(log_2(n)) for a positive integer `n`.
-fn floor_lg(n: usize) -> usize {
-    assert!(n > 0);
+    /// Get Merkle proof of a leaf with the given index, from the leaf to the root, as in
+    /// `MerkleTree::get_leaf_proof`.
+    pub fn get_leaf_proof(&mut self, index: usize) -> io::Result<Option<Vec<[u8; 32]>>> {
+        if index >= self.n_leaves {
+            // Out of bound
+            return Ok(None);
+        }
 
-    let mut r = 0;
-    let mut t = 1;
-    while 2 * t <= n {
-        t *= 2;
-        r += 1;
+        let mut proof = Vec::with_capacity(self.depth());
+        for level in 0..self.depth() {
+            let sibling = (index >> level) ^ 1;
+            if sibling << level < self.n_leaves {
+                proof.push(self.get_node(level, sibling)?);
+            }
+        }
+        Ok(Some(proof))
     }
-    r
-}
 
-fn pow2(n: usize) -> usize {
-    let mut p = 1;
-    for _i in 0..n {
-        p *= 2
+    /// Get the multiproof of the leaves with the given strictly increasing indexes, as in
+    /// `MerkleTree::get_leaf_set_multiproof`.
+    pub fn get_leaf_set_multiproof(
+        &mut self,
+        indexes: &[usize],
+    ) -> io::Result<Option<Vec<[u8; 32]>>> {
+        if indexes.is_empty()
+            || *indexes.last().unwrap() >= self.n_leaves
+            || indexes.windows(2).any(|w| w[0] >= w[1])
+        {
+            // Out of bound, or not strictly increasing
+            return Ok(None);
+        }
+
+        let mut proof = Vec::new();
+        self.get_multiproof(self.depth(), 0, indexes, &mut proof)?;
+        Ok(Some(proof))
     }
-    p
-}
 
-/// For a positive integer `n`, returns `True` is `n` is a perfect power of 2, `False` otherwise.
-fn is_power_of_2(n: usize) -> bool {
-    assert!(n >= 1);
-    n & (n - 1) == 0
+    /// Same as `MerkleTree::get_multiproof`, for the requested leaves with the given indexes.
+    fn get_multiproof(
+        &mut self,
+        level: usize,
+        j: usize,
+        indexes: &[usize],
+        proof: &mut Vec<[u8; 32]>,
+    ) -> io::Result<()> {
+        let begin = j << level;
+        let end = core::cmp::min((j + 1) << level, self.n_leaves);
+        // the first requested index not before the subtree
+        let k = indexes.partition_point(|&i| i < begin);
+        if level == 0 || k == indexes.len() || indexes[k] >= end {
+            proof.push(self.get_node(level, j)?);
+        } else if (2 * j + 1) << (level - 1) < self.n_leaves {
+            self.get_multiproof(level - 1, 2 * j, indexes, proof)?;
+            self.get_multiproof(level - 1, 2 * j + 1, indexes, proof)?;
+        } else {
+            // the node is the same as its only child
+            self.get_multiproof(level - 1, 2 * j, indexes, proof)?;
+        }
+        Ok(())
+    }
 }
 
-/// For an integer `n` which is at least 2, returns the largest exact power of 2 that is strictly less than `n`.
-fn largest_power_of_2_less_than(n: usize) -> usize {
-    if n == 2 {
-        return 1;
-    }
-    assert!(n > 1);
-    if is_power_of_2(n) {
-        n / 2
-    } else {
-        1 << floor_lg(n)
-    }
+/// Returns the hash of an internal node of the tree, with the given children.
+fn combine_hashes(left: &[u8; 32], right: &[u8; 32]) -> [u8; 32] {
+    let mut engine = sha256::Hash::engine();
+    engine.input(&[0x01]);
+    engine.input(left);
+    engine.input(right);
+    sha256::Hash::from_engine(engine).into_inner()
 }
 
 #[cfg(test)]
@@ -199,15 +452,9 @@ mod tests {
 
         let tree = MerkleTree::new(leaves[0..3].to_vec());
 
-        assert_eq!(
-            tree.get_leaf_proof(0),
-            Some(vec![leaves[1].to_vec(), leaves[2].to_vec()])
-        );
+        assert_eq!(tree.get_leaf_proof(0), Some(vec![leaves[1], leaves[2]]));
 
-        assert_eq!(
-            tree.get_leaf_proof(1),
-            Some(vec![leaves[0].to_vec(), leaves[2].to_vec()])
-        );
+        assert_eq!(tree.get_leaf_proof(1), Some(vec![leaves[0], leaves[2]]));
 
         let mut input = vec![0x01];
         input.extend_from_slice(&leaves[0]);
@@ -216,8 +463,192 @@ mod tests {
         let mut engine = sha256::Hash::engine();
         engine.input(input.as_slice());
         let value = sha256::Hash::from_engine(engine).into_inner();
-        assert_eq!(tree.get_leaf_proof(2), Some(vec![value.to_vec()]));
+        assert_eq!(tree.get_leaf_proof(2), Some(vec![value]));
 
         let _tree = MerkleTree::new(leaves.to_vec());
     }
+
+    /// Returns the root of the tree with the given leaves, as defined recursively.
+    fn reference_root(leaves: &[[u8; 32]]) -> [u8; 32] {
+        if leaves.len() == 1 {
+            return leaves[0];
+        }
+        let lchild_size = leaves.len().next_power_of_two() / 2;
+        combine_hashes(
+            &reference_root(&leaves[..lchild_size]),
+            &reference_root(&leaves[lchild_size..]),
+        )
+    }
+
+    /// Returns the root computed from a leaf and its proof, from the leaf to the root.
+    fn root_from_proof(leaf: &[u8; 32], index: usize, size: usize, proof: &[[u8; 32]]) -> [u8; 32] {
+        if size == 1 {
+            assert!(proof.is_empty());
+            return *leaf;
+        }
+        let lchild_size = size.next_power_of_two() / 2;
+        let (sibling, rest) = proof.split_last().unwrap();
+        if index < lchild_size {
+            combine_hashes(&root_from_proof(leaf, index, lchild_size, rest), sibling)
+        } else {
+            let right = root_from_proof(leaf, index - lchild_size, size - lchild_size, rest);
+            combine_hashes(sibling, &right)
+        }
+    }
+
+    #[test]
+    fn test_merkle_tree_levels() {
+        for size in 1..40u8 {
+            let leaves: Vec<[u8; 32]> = (0..size).map(|i| [i; 32]).collect();
+            let tree = MerkleTree::new(leaves.clone());
+
+            assert_eq!(tree.size(), size as usize);
+            assert_eq!(*tree.root_hash(), reference_root(&leaves));
+            for (i, leaf) in leaves.iter().enumerate() {
+                let proof = tree.get_leaf_proof(i).unwrap();
+                assert_eq!(
+                    root_from_proof(leaf, i, leaves.len(), &proof),
+                    *tree.root_hash()
+                );
+            }
+            assert_eq!(tree.get_leaf_proof(size as usize), None);
+
+            // all the leaves are their own multiproof
+            assert_eq!(tree.get_leaves_multiproof(0, size as usize), Some(leaves));
+        }
+    }
+
+    #[test]
+    fn test_merkle_tree_leaf_index() {
+        let leaves: Vec<[u8; 32]> = vec![[0; 32], [1; 32], [2; 32], [1; 32]];
+        let tree = MerkleTree::new(leaves);
+
+        assert_eq!(tree.get_leaf_index(&[0; 32]), Some(0));
+        // the first leaf with the given value is returned
+        assert_eq!(tree.get_leaf_index(&[1; 32]), Some(1));
+        assert_eq!(tree.get_leaf_index(&[2; 32]), Some(2));
+        assert_eq!(tree.get_leaf_index(&[3; 32]), None);
+        assert_eq!(tree.get_leaf_index(&[1; 31]), None);
+    }
+
+    #[test]
+    fn test_merkle_tree_multiproof() {
+        let leaves: Vec<[u8; 32]> = (0..5u8).map(|i| [i; 32]).collect();
+        let tree = MerkleTree::new(leaves.clone());
+
+        let combine = |left: &[u8], right: &[u8]| {
+            let mut engine = sha256::Hash::engine();
+            engine.input(&[0x01]);
+            engine.input(left);
+            engine.input(right);
+            sha256::Hash::from_engine(engine).into_inner()
+        };
+
+        // a single leaf has the same multiproof as its proof, together with the leaf itself
+        assert_eq!(
+            tree.get_leaves_multiproof(4, 1),
+            Some(vec![tree.get_leaf_proof(4).unwrap()[0], leaves[4]])
+        );
+
+        assert_eq!(
+            tree.get_leaves_multiproof(1, 2),
+            Some(vec![leaves[0], leaves[1], leaves[2], leaves[3], leaves[4],])
+        );
+
+        assert_eq!(
+            tree.get_leaves_multiproof(2, 2),
+            Some(vec![
+                combine(&leaves[0], &leaves[1]),
+                leaves[2],
+                leaves[3],
+                leaves[4],
+            ])
+        );
+
+        assert_eq!(tree.get_leaves_multiproof(4, 2), None);
+        assert_eq!(tree.get_leaves_multiproof(0, 0), None);
+    }
+
+    #[test]
+    fn test_merkle_tree_leaf_set_multiproof() {
+        let leaves: Vec<[u8; 32]> = (0..5u8).map(|i| [i; 32]).collect();
+        let tree = MerkleTree::new(leaves.clone());
+
+        // consecutive leaves have the same multiproof as the range
+        assert_eq!(
+            tree.get_leaf_set_multiproof(&[2, 3]),
+            tree.get_leaves_multiproof(2, 2)
+        );
+        assert_eq!(
+            tree.get_leaf_set_multiproof(&[4]),
+            tree.get_leaves_multiproof(4, 1)
+        );
+
+        assert_eq!(
+            tree.get_leaf_set_multiproof(&[0, 4]),
+            Some(vec![
+                leaves[0],
+                leaves[1],
+                tree.get_leaf_proof(0).unwrap()[1],
+                leaves[4],
+            ])
+        );
+
+        assert_eq!(tree.get_leaf_set_multiproof(&[]), None);
+        assert_eq!(tree.get_leaf_set_multiproof(&[1, 5]), None);
+        assert_eq!(tree.get_leaf_set_multiproof(&[3, 3]), None);
+        assert_eq!(tree.get_leaf_set_multiproof(&[3, 1]), None);
+    }
+
+    #[test]
+    fn test_streamed_merkle_tree() {
+        for size in [1, 2, 3, 5, 8, 13, 64, 100] {
+            // the last chunk is shorter
+            let data: Vec<u8> = (0..size * 7 - 3).map(|i| i as u8).collect();
+            let chunks: Vec<&[u8]> = data.chunks(7).collect();
+            let leaves: Vec<[u8; 32]> = chunks
+                .iter()
+                .map(|chunk| {
+                    let mut engine = sha256::Hash::engine();
+                    engine.input(&[0x00]);
+                    engine.input(chunk);
+                    sha256::Hash::from_engine(engine).into_inner()
+                })
+                .collect();
+            let tree = MerkleTree::new(leaves.clone());
+
+            // the stream is read from its current position
+            let mut stream = std::io::Cursor::new([&[0xAA; 5], &data[..]].concat());
+            stream.set_position(5);
+            let mut streamed = StreamedMerkleTree::new(stream, 7).unwrap();
+
+            assert_eq!(streamed.size(), size);
+            assert_eq!(streamed.stream_len(), data.len() as u64);
+            assert_eq!(streamed.root_hash(), tree.root_hash());
+            for i in 0..size {
+                assert_eq!(streamed.get_leaf_proof(i).unwrap(), tree.get_leaf_proof(i));
+                assert_eq!(streamed.get_leaf(i).unwrap(), Some(leaves[i]));
+                assert_eq!(
+                    streamed.find_preimage(&leaves[i]),
+                    Some(&[&[0x00], chunks[i]].concat())
+                );
+                assert_eq!(
+                    streamed.get_leaf_set_multiproof(&[i]).unwrap(),
+                    tree.get_leaf_set_multiproof(&[i])
+                );
+            }
+            assert_eq!(
+                streamed.get_leaf_index(&leaves[size - 1]).unwrap(),
+                Some(size - 1)
+            );
+            assert_eq!(streamed.get_leaf_proof(size).unwrap(), None);
+            assert_eq!(streamed.get_leaf(size).unwrap(), None);
+
+            let indexes: Vec<usize> = (0..size).step_by(3).collect();
+            assert_eq!(
+                streamed.get_leaf_set_multiproof(&indexes).unwrap(),
+                tree.get_leaf_set_multiproof(&indexes)
+            );
+        }
+    }
 }
@@ -0,0 +1,206 @@
+use std::sync::Arc;
+
+use bitcoin::{
+    consensus::encode::{serialize, VarInt},
+    util::psbt::PartiallySignedTransaction as Psbt,
+};
+
+use crate::{
+    apdu::APDUCommand,
+    command,
+    interpreter::{ClientCommandInterpreter, KnownData},
+    psbt::*,
+    wallet::WalletPolicy,
+};
+
+/// Proprietary global key of the subset of the inputs to sign; see the documentation of SIGN_PSBT.
+const PSBT_LEDGER_GLOBAL_INPUT_SUBSET: [u8; 9] = *b"\xfc\x06LEDGER\x02";
+
+/// MerkleizedPsbt contains the Merkleized map commitments of a PSBT, and the client interpreter
+/// knowing all the Merkle trees and preimages that the device requests while signing it with a
+/// given wallet policy.
+/// It is computed once, and can then be used to sign the PSBT with several devices, possibly at the
+/// same time: each signing session has its own interpreter, sharing the known data. The known data
+/// of the wallet policy can be shared with the other PSBTs signed with it.
+pub struct MerkleizedPsbt {
+    /// The known data of the PSBT, then the one of the wallet policy, then the one of the global
+    /// map with an input subset, if any.
+    known: Vec<Arc<KnownData>>,
+    global_map: PsbtMapPairs,
+    global_mapping_commitment: Vec<u8>,
+    n_inputs: usize,
+    input_commitments_root: [u8; 32],
+    n_outputs: usize,
+    output_commitments_root: [u8; 32],
+}
+
+impl MerkleizedPsbt {
+    /// Merkleizes a PSBT for signing with the given wallet policy.
+    /// Returns None if the inputs or outputs of the PSBT do not match its unsigned transaction.
+    pub fn new(psbt: &Psbt, wallet: &WalletPolicy) -> Option<Self> {
+        Self::with_wallet_data(psbt, Arc::new(wallet.known_data()))
+    }
+
+    /// Like `new`, with the known data of the wallet policy returned by
+    /// `WalletPolicy::known_data`, that is not computed again.
+    pub fn with_wallet_data(psbt: &Psbt, wallet_data: Arc<KnownData>) -> Option<Self> {
+        let mut known = KnownData::new();
+
+        if psbt.unsigned_tx.input.len() < psbt.inputs.len()
+            || psbt.unsigned_tx.output.len() < psbt.outputs.len()
+        {
+            return None;
+        }
+
+        let mut global_map = PsbtMapPairs::new();
+        write_v2_global_pairs(&mut global_map, psbt);
+        let global_mapping_commitment = known.add_known_pairs(global_map.iter());
+
+        let input_commitments = add_known_maps(
+            &mut known,
+            &psbt.inputs,
+            &psbt.unsigned_tx.input,
+            write_v2_input_pairs,
+        );
+        let input_commitments_root = known.add_known_list(&input_commitments);
+
+        let output_commitments = add_known_maps(
+            &mut known,
+            &psbt.outputs,
+            &psbt.unsigned_tx.output,
+            write_v2_output_pairs,
+        );
+        let output_commitments_root = known.add_known_list(&output_commitments);
+
+        Some(Self {
+            known: vec![Arc::new(known), wallet_data],
+            global_map,
+            global_mapping_commitment,
+            n_inputs: psbt.inputs.len(),
+            input_commitments_root,
+            n_outputs: psbt.outputs.len(),
+            output_commitments_root,
+        })
+    }
+
+    /// Returns a copy of the PSBT whose global map restricts the inputs signed by the device to
+    /// `input_indexes` (see `apdu::app_feature::INPUT_SUBSETS`), for example to split the signing
+    /// of a PSBT with many inputs among several devices with the same seed. The known data of the
+    /// input and output maps is shared, not copied.
+    /// Returns None if `input_indexes` is empty, or if one of them is not the index of an input.
+    pub fn with_input_subset(&self, input_indexes: &[usize]) -> Option<Self> {
+        let mut indexes = input_indexes.to_vec();
+        indexes.sort_unstable();
+        indexes.dedup();
+        if indexes.last().map_or(true, |last| *last >= self.n_inputs) {
+            return None;
+        }
+
+        let mut known = KnownData::new();
+        let elements: Vec<[u8; 4]> = indexes.iter().map(|i| (*i as u32).to_le_bytes()).collect();
+        let subset_root = known.add_known_list(&elements);
+
+        let mut value = serialize(&VarInt(indexes.len() as u64));
+        value.extend_from_slice(&subset_root);
+        let mut global_map = PsbtMapPairs::new();
+        for (key, value) in self.global_map.iter() {
+            if key != &PSBT_LEDGER_GLOBAL_INPUT_SUBSET[..] {
+                global_map.push(key, value);
+            }
+        }
+        global_map.push(&PSBT_LEDGER_GLOBAL_INPUT_SUBSET, &value);
+        let global_mapping_commitment = known.add_known_pairs(global_map.iter());
+
+        let mut known_data = self.known[..2].to_vec();
+        known_data.push(Arc::new(known));
+        Some(Self {
+            known: known_data,
+            global_map,
+            global_mapping_commitment,
+            n_inputs: self.n_inputs,
+            input_commitments_root: self.input_commitments_root,
+            n_outputs: self.n_outputs,
+            output_commitments_root: self.output_commitments_root,
+        })
+    }
+
+    /// Returns a new interpreter for a signing session of the PSBT.
+    pub(crate) fn interpreter(&self) -> ClientCommandInterpreter {
+        ClientCommandInterpreter::with_known_data(self.known.iter().cloned())
+    }
+
+    /// Returns the SIGN_PSBT command for the PSBT.
+    pub(crate) fn sign_psbt_command(
+        &self,
+        wallet: &WalletPolicy,
+        wallet_hmac: Option<&[u8; 32]>,
+        protocol_version: u8,
+    ) -> APDUCommand {
+        command::sign_psbt(
+            &self.global_mapping_commitment,
+            self.n_inputs,
+            &self.input_commitments_root,
+            self.n_outputs,
+            &self.output_commitments_root,
+            wallet,
+            wallet_hmac,
+            protocol_version,
+        )
+    }
+}
+
+/// Adds the known Merkle trees of the map of each of `items`, written by `write_pairs` with the
+/// matching element of `txs`, and returns their commitments. The pairs of all the maps are written
+/// in the same reused buffer.
+#[cfg(not(feature = "parallel"))]
+fn add_known_maps<T, X>(
+    known: &mut KnownData,
+    items: &[T],
+    txs: &[X],
+    write_pairs: fn(&mut PsbtMapPairs, &T, &X),
+) -> Vec<Vec<u8>> {
+    let mut pairs = PsbtMapPairs::new();
+    items
+        .iter()
+        .zip(txs)
+        .map(|(item, tx)| {
+            pairs.clear();
+            write_pairs(&mut pairs, item, tx);
+            known.add_known_pairs(pairs.iter())
+        })
+        .collect()
+}
+
+/// Adds the known Merkle trees of the map of each of `items`, written by `write_pairs` with the
+/// matching element of `txs`, and returns their commitments.
+/// The maps are hashed concurrently in the rayon thread pool, each in its own `KnownData`, that are
+/// then merged; each thread reuses the same buffer for the pairs of its maps.
+#[cfg(feature = "parallel")]
+fn add_known_maps<T: Sync, X: Sync>(
+    known: &mut KnownData,
+    items: &[T],
+    txs: &[X],
+    write_pairs: fn(&mut PsbtMapPairs, &T, &X),
+) -> Vec<Vec<u8>> {
+    use rayon::prelude::*;
+
+    let merkleized: Vec<(KnownData, Vec<u8>)> = items
+        .par_iter()
+        .zip(txs)
+        .map_init(PsbtMapPairs::new, |pairs, (item, tx)| {
+            pairs.clear();
+            write_pairs(pairs, item, tx);
+            let mut map_known = KnownData::new();
+            let commitment = map_known.add_known_pairs(pairs.iter());
+            (map_known, commitment)
+        })
+        .collect();
+
+    merkleized
+        .into_iter()
+        .map(|(map_known, commitment)| {
+            known.merge(map_known);
+            commitment
+        })
+        .collect()
+}
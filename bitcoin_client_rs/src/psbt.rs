@@ -5,32 +5,100 @@
 /// rust-bitcoin currently support V0.
 use bitcoin::{
     blockdata::transaction::{TxIn, TxOut},
-    consensus::encode::{deserialize, serialize, VarInt},
-    util::psbt::{raw, Input, Output, Psbt},
+    consensus::encode::{Encodable, VarInt},
+    util::psbt::{Input, Output, Psbt},
 };
 
+/// The key/value pairs of a PSBT map, serialized one after the other in a single buffer, without
+/// an allocation per key or value. The key of a pair is its type followed by its key data, as in
+/// the serialized PSBT without its length prefix. The buffer can be cleared and reused for the
+/// next map.
+#[derive(Clone, Debug, Default)]
+pub struct PsbtMapPairs {
+    buffer: Vec<u8>,
+    /// The offsets in `buffer` of the key, of the value and of the end of each pair.
+    pairs: Vec<(usize, usize, usize)>,
+}
+
+impl PsbtMapPairs {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Removes all the pairs, keeping the allocated memory.
+    pub fn clear(&mut self) {
+        self.buffer.clear();
+        self.pairs.clear();
+    }
+
+    /// Returns the (key, value) pairs, in the order they were added.
+    pub fn iter(&self) -> impl Iterator<Item = (&[u8], &[u8])> + '_ {
+        self.pairs
+            .iter()
+            .map(move |&(key, value, end)| (&self.buffer[key..value], &self.buffer[value..end]))
+    }
+
+    /// Adds a pair with the given key (including its type) and value.
+    pub fn push(&mut self, key: &[u8], value: &[u8]) {
+        let start = self.buffer.len();
+        self.buffer.extend_from_slice(key);
+        let value_start = self.buffer.len();
+        self.buffer.extend_from_slice(value);
+        self.pairs.push((start, value_start, self.buffer.len()));
+    }
+
+    /// Adds a pair of the given type, whose key data and value are appended to the buffer by
+    /// `write_key` and `write_value`.
+    fn push_with(
+        &mut self,
+        type_value: u8,
+        write_key: impl FnOnce(&mut Vec<u8>),
+        write_value: impl FnOnce(&mut Vec<u8>),
+    ) {
+        let start = self.buffer.len();
+        self.buffer.push(type_value);
+        write_key(&mut self.buffer);
+        let value_start = self.buffer.len();
+        write_value(&mut self.buffer);
+        self.pairs.push((start, value_start, self.buffer.len()));
+    }
+}
+
+/// Appends the consensus encoding of `data` to `buffer`.
+fn encode_into<T: Encodable + ?Sized>(buffer: &mut Vec<u8>, data: &T) {
+    data.consensus_encode(buffer)
+        .expect("in-memory writers don't error");
+}
+
 #[rustfmt::skip]
 macro_rules! impl_psbt_get_pair {
     ($rv:ident.push($slf:ident.$unkeyed_name:ident, $unkeyed_typeval:ident)) => {
         if let Some(ref $unkeyed_name) = $slf.$unkeyed_name {
-            $rv.push(bitcoin::util::psbt::raw::Pair {
-                key: bitcoin::util::psbt::raw::Key {
-                    type_value: $unkeyed_typeval,
-                    key: vec![],
-                },
-                value: bitcoin::util::psbt::serialize::Serialize::serialize($unkeyed_name),
+            $rv.push_with($unkeyed_typeval, |_| {}, |buffer| {
+                buffer.extend(bitcoin::util::psbt::serialize::Serialize::serialize($unkeyed_name))
+            });
+        }
+    };
+    // the values whose PSBT serialization is their consensus encoding, written in place
+    ($rv:ident.push_encoded($slf:ident.$unkeyed_name:ident, $unkeyed_typeval:ident)) => {
+        if let Some(ref $unkeyed_name) = $slf.$unkeyed_name {
+            $rv.push_with($unkeyed_typeval, |_| {}, |buffer| encode_into(buffer, $unkeyed_name));
+        }
+    };
+    ($rv:ident.push_script($slf:ident.$unkeyed_name:ident, $unkeyed_typeval:ident)) => {
+        if let Some(ref $unkeyed_name) = $slf.$unkeyed_name {
+            $rv.push_with($unkeyed_typeval, |_| {}, |buffer| {
+                buffer.extend_from_slice($unkeyed_name.as_bytes())
             });
         }
     };
     ($rv:ident.push_map($slf:ident.$keyed_name:ident, $keyed_typeval:ident)) => {
         for (key, val) in &$slf.$keyed_name {
-            $rv.push(bitcoin::util::psbt::raw::Pair {
-                key: bitcoin::util::psbt::raw::Key {
-                    type_value: $keyed_typeval,
-                    key: bitcoin::util::psbt::serialize::Serialize::serialize(key),
-                },
-                value: bitcoin::util::psbt::serialize::Serialize::serialize(val),
-            });
+            $rv.push_with(
+                $keyed_typeval,
+                |buffer| buffer.extend(bitcoin::util::psbt::serialize::Serialize::serialize(key)),
+                |buffer| buffer.extend(bitcoin::util::psbt::serialize::Serialize::serialize(val)),
+            );
         }
     };
 }
@@ -52,81 +120,67 @@ const PSBT_GLOBAL_OUTPUT_COUNT: u8 = 0x05;
 /// Type: Version Number PSBT_GLOBAL_VERSION = 0xFB
 const PSBT_GLOBAL_VERSION: u8 = 0xFB;
 
-pub fn get_v2_global_pairs(psbt: &Psbt) -> Vec<raw::Pair> {
-    let mut rv: Vec<raw::Pair> = Default::default();
-
+/// Appends the pairs of the global map in version 2 of `psbt` to `pairs`.
+pub fn write_v2_global_pairs(pairs: &mut PsbtMapPairs, psbt: &Psbt) {
     for (xpub, (fingerprint, derivation)) in &psbt.xpub {
-        rv.push(raw::Pair {
-            key: raw::Key {
-                type_value: PSBT_GLOBAL_XPUB,
-                key: xpub.encode().to_vec(),
-            },
-            value: {
-                let mut ret = Vec::with_capacity(4 + derivation.len() * 4);
-                ret.extend(fingerprint.as_bytes());
+        pairs.push_with(
+            PSBT_GLOBAL_XPUB,
+            |buffer| buffer.extend_from_slice(&xpub.encode()),
+            |buffer| {
+                buffer.extend_from_slice(fingerprint.as_bytes());
                 derivation
                     .into_iter()
-                    .for_each(|n| ret.extend(&u32::from(*n).to_le_bytes()));
-                ret
+                    .for_each(|n| buffer.extend_from_slice(&u32::from(*n).to_le_bytes()));
             },
-        });
-    }
-
-    rv.push(raw::Pair {
-        key: raw::Key {
-            type_value: PSBT_GLOBAL_FALLBACK_LOCKTIME,
-            key: vec![],
-        },
-        value: serialize(&psbt.unsigned_tx.lock_time),
-    });
-
-    rv.push(raw::Pair {
-        key: raw::Key {
-            type_value: PSBT_GLOBAL_INPUT_COUNT,
-            key: vec![],
-        },
-        value: serialize(&VarInt(psbt.inputs.len() as u64)),
-    });
-
-    rv.push(raw::Pair {
-        key: raw::Key {
-            type_value: PSBT_GLOBAL_OUTPUT_COUNT,
-            key: vec![],
-        },
-        value: serialize(&VarInt(psbt.outputs.len() as u64)),
-    });
-
-    rv.push(raw::Pair {
-        key: raw::Key {
-            type_value: PSBT_GLOBAL_TX_VERSION,
-            key: vec![],
-        },
-        value: (psbt.unsigned_tx.version as u32).to_le_bytes().to_vec(),
-    });
-
-    rv.push(raw::Pair {
-        key: raw::Key {
-            type_value: PSBT_GLOBAL_VERSION,
-            key: vec![],
-        },
-        value: 2_u32.to_le_bytes().to_vec(),
-    });
+        );
+    }
+
+    pairs.push_with(
+        PSBT_GLOBAL_FALLBACK_LOCKTIME,
+        |_| {},
+        |buffer| encode_into(buffer, &psbt.unsigned_tx.lock_time),
+    );
+
+    pairs.push_with(
+        PSBT_GLOBAL_INPUT_COUNT,
+        |_| {},
+        |buffer| encode_into(buffer, &VarInt(psbt.inputs.len() as u64)),
+    );
+
+    pairs.push_with(
+        PSBT_GLOBAL_OUTPUT_COUNT,
+        |_| {},
+        |buffer| encode_into(buffer, &VarInt(psbt.outputs.len() as u64)),
+    );
+
+    pairs.push_with(
+        PSBT_GLOBAL_TX_VERSION,
+        |_| {},
+        |buffer| buffer.extend_from_slice(&(psbt.unsigned_tx.version as u32).to_le_bytes()),
+    );
+
+    pairs.push_with(
+        PSBT_GLOBAL_VERSION,
+        |_| {},
+        |buffer| buffer.extend_from_slice(&2_u32.to_le_bytes()),
+    );
 
     for (key, value) in psbt.proprietary.iter() {
-        rv.push(raw::Pair {
-            key: key.to_key(),
-            value: value.clone(),
-        });
+        let key = key.to_key();
+        pairs.push_with(
+            key.type_value,
+            |buffer| buffer.extend_from_slice(&key.key),
+            |buffer| buffer.extend_from_slice(value),
+        );
     }
 
     for (key, value) in psbt.unknown.iter() {
-        rv.push(raw::Pair {
-            key: key.clone(),
-            value: value.clone(),
-        });
+        pairs.push_with(
+            key.type_value,
+            |buffer| buffer.extend_from_slice(&key.key),
+            |buffer| buffer.extend_from_slice(value),
+        );
     }
-
-    rv
 }
 
 /// Type: Non-Witness UTXO PSBT_IN_NON_WITNESS_UTXO = 0x00
@@ -177,124 +231,118 @@ const PSBT_IN_TAP_INTERNAL_KEY: u8 = 0x17;
 /// Type: Taproot Merkle Root PSBT_IN_TAP_MERKLE_ROOT = 0x18
 const PSBT_IN_TAP_MERKLE_ROOT: u8 = 0x18;
 
-pub fn get_v2_input_pairs(input: &Input, txin: &TxIn) -> Vec<raw::Pair> {
-    let mut rv: Vec<raw::Pair> = Default::default();
-
+/// Appends the pairs of the map in version 2 of `input`, spent by `txin`, to `pairs`.
+pub fn write_v2_input_pairs(pairs: &mut PsbtMapPairs, input: &Input, txin: &TxIn) {
     impl_psbt_get_pair! {
-        rv.push(input.non_witness_utxo, PSBT_IN_NON_WITNESS_UTXO)
+        pairs.push_encoded(input.non_witness_utxo, PSBT_IN_NON_WITNESS_UTXO)
     }
 
     impl_psbt_get_pair! {
-        rv.push(input.witness_utxo, PSBT_IN_WITNESS_UTXO)
+        pairs.push_encoded(input.witness_utxo, PSBT_IN_WITNESS_UTXO)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(input.partial_sigs, PSBT_IN_PARTIAL_SIG)
+        pairs.push_map(input.partial_sigs, PSBT_IN_PARTIAL_SIG)
     }
 
     impl_psbt_get_pair! {
-        rv.push(input.sighash_type, PSBT_IN_SIGHASH_TYPE)
+        pairs.push(input.sighash_type, PSBT_IN_SIGHASH_TYPE)
     }
 
     impl_psbt_get_pair! {
-        rv.push(input.redeem_script, PSBT_IN_REDEEM_SCRIPT)
+        pairs.push_script(input.redeem_script, PSBT_IN_REDEEM_SCRIPT)
     }
 
     impl_psbt_get_pair! {
-        rv.push(input.witness_script, PSBT_IN_WITNESS_SCRIPT)
+        pairs.push_script(input.witness_script, PSBT_IN_WITNESS_SCRIPT)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(input.bip32_derivation, PSBT_IN_BIP32_DERIVATION)
+        pairs.push_map(input.bip32_derivation, PSBT_IN_BIP32_DERIVATION)
     }
 
     impl_psbt_get_pair! {
-        rv.push(input.final_script_sig, PSBT_IN_FINAL_SCRIPTSIG)
-    }
-
-    rv.push(raw::Pair {
-        key: raw::Key {
-            type_value: PSBT_IN_PREVIOUS_TXID,
-            key: vec![],
-        },
-        value: serialize(&txin.previous_output.txid),
-    });
-
-    rv.push(raw::Pair {
-        key: raw::Key {
-            type_value: PSBT_IN_OUTPUT_INDEX,
-            key: vec![],
-        },
-        value: serialize(&txin.previous_output.vout),
-    });
-
-    rv.push(raw::Pair {
-        key: raw::Key {
-            type_value: PSBT_IN_SEQUENCE,
-            key: vec![],
-        },
-        value: serialize(&txin.sequence),
-    });
+        pairs.push_script(input.final_script_sig, PSBT_IN_FINAL_SCRIPTSIG)
+    }
+
+    pairs.push_with(
+        PSBT_IN_PREVIOUS_TXID,
+        |_| {},
+        |buffer| encode_into(buffer, &txin.previous_output.txid),
+    );
+
+    pairs.push_with(
+        PSBT_IN_OUTPUT_INDEX,
+        |_| {},
+        |buffer| encode_into(buffer, &txin.previous_output.vout),
+    );
+
+    pairs.push_with(
+        PSBT_IN_SEQUENCE,
+        |_| {},
+        |buffer| encode_into(buffer, &txin.sequence),
+    );
 
     impl_psbt_get_pair! {
-        rv.push(input.final_script_witness, PSBT_IN_FINAL_SCRIPTWITNESS)
+        pairs.push_encoded(input.final_script_witness, PSBT_IN_FINAL_SCRIPTWITNESS)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(input.ripemd160_preimages, PSBT_IN_RIPEMD160)
+        pairs.push_map(input.ripemd160_preimages, PSBT_IN_RIPEMD160)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(input.sha256_preimages, PSBT_IN_SHA256)
+        pairs.push_map(input.sha256_preimages, PSBT_IN_SHA256)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(input.hash160_preimages, PSBT_IN_HASH160)
+        pairs.push_map(input.hash160_preimages, PSBT_IN_HASH160)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(input.hash256_preimages, PSBT_IN_HASH256)
+        pairs.push_map(input.hash256_preimages, PSBT_IN_HASH256)
     }
 
     impl_psbt_get_pair! {
-        rv.push(input.tap_key_sig, PSBT_IN_TAP_KEY_SIG)
+        pairs.push(input.tap_key_sig, PSBT_IN_TAP_KEY_SIG)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(input.tap_script_sigs, PSBT_IN_TAP_SCRIPT_SIG)
+        pairs.push_map(input.tap_script_sigs, PSBT_IN_TAP_SCRIPT_SIG)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(input.tap_scripts, PSBT_IN_TAP_LEAF_SCRIPT)
+        pairs.push_map(input.tap_scripts, PSBT_IN_TAP_LEAF_SCRIPT)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(input.tap_key_origins, PSBT_IN_TAP_BIP32_DERIVATION)
+        pairs.push_map(input.tap_key_origins, PSBT_IN_TAP_BIP32_DERIVATION)
     }
 
     impl_psbt_get_pair! {
-        rv.push(input.tap_internal_key, PSBT_IN_TAP_INTERNAL_KEY)
+        pairs.push(input.tap_internal_key, PSBT_IN_TAP_INTERNAL_KEY)
     }
 
     impl_psbt_get_pair! {
-        rv.push(input.tap_merkle_root, PSBT_IN_TAP_MERKLE_ROOT)
+        pairs.push(input.tap_merkle_root, PSBT_IN_TAP_MERKLE_ROOT)
     }
 
     for (key, value) in input.proprietary.iter() {
-        rv.push(raw::Pair {
-            key: key.to_key(),
-            value: value.clone(),
-        });
+        let key = key.to_key();
+        pairs.push_with(
+            key.type_value,
+            |buffer| buffer.extend_from_slice(&key.key),
+            |buffer| buffer.extend_from_slice(value),
+        );
     }
 
     for (key, value) in input.unknown.iter() {
-        rv.push(raw::Pair {
-            key: key.clone(),
-            value: value.clone(),
-        });
+        pairs.push_with(
+            key.type_value,
+            |buffer| buffer.extend_from_slice(&key.key),
+            |buffer| buffer.extend_from_slice(value),
+        );
     }
-
-    rv
 }
 
 /// Type: Redeem Script PSBT_OUT_REDEEM_SCRIPT = 0x00
@@ -314,66 +362,58 @@ const PSBT_OUT_TAP_TREE: u8 = 0x06;
 /// Type: Taproot Key BIP 32 Derivation Path PSBT_OUT_TAP_BIP32_DERIVATION = 0x07
 const PSBT_OUT_TAP_BIP32_DERIVATION: u8 = 0x07;
 
-pub fn get_v2_output_pairs(output: &Output, txout: &TxOut) -> Vec<raw::Pair> {
-    let mut rv: Vec<raw::Pair> = Default::default();
-
+/// Appends the pairs of the map in version 2 of `output`, for `txout`, to `pairs`.
+pub fn write_v2_output_pairs(pairs: &mut PsbtMapPairs, output: &Output, txout: &TxOut) {
     impl_psbt_get_pair! {
-        rv.push(output.redeem_script, PSBT_OUT_REDEEM_SCRIPT)
+        pairs.push_script(output.redeem_script, PSBT_OUT_REDEEM_SCRIPT)
     }
 
     impl_psbt_get_pair! {
-        rv.push(output.witness_script, PSBT_OUT_WITNESS_SCRIPT)
+        pairs.push_script(output.witness_script, PSBT_OUT_WITNESS_SCRIPT)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(output.bip32_derivation, PSBT_OUT_BIP32_DERIVATION)
+        pairs.push_map(output.bip32_derivation, PSBT_OUT_BIP32_DERIVATION)
     }
 
-    rv.push(raw::Pair {
-        key: raw::Key {
-            type_value: PSBT_OUT_AMOUNT,
-            key: vec![],
-        },
-        value: txout.value.to_le_bytes().to_vec(),
-    });
+    pairs.push_with(
+        PSBT_OUT_AMOUNT,
+        |_| {},
+        |buffer| buffer.extend_from_slice(&txout.value.to_le_bytes()),
+    );
 
-    rv.push(raw::Pair {
-        key: raw::Key {
-            type_value: PSBT_OUT_SCRIPT,
-            key: vec![],
-        },
-        value: txout.script_pubkey.as_bytes().to_vec(),
-    });
+    pairs.push_with(
+        PSBT_OUT_SCRIPT,
+        |_| {},
+        |buffer| buffer.extend_from_slice(txout.script_pubkey.as_bytes()),
+    );
 
     impl_psbt_get_pair! {
-        rv.push(output.tap_internal_key, PSBT_OUT_TAP_INTERNAL_KEY)
+        pairs.push(output.tap_internal_key, PSBT_OUT_TAP_INTERNAL_KEY)
     }
 
     impl_psbt_get_pair! {
-        rv.push(output.tap_tree, PSBT_OUT_TAP_TREE)
+        pairs.push(output.tap_tree, PSBT_OUT_TAP_TREE)
     }
 
     impl_psbt_get_pair! {
-        rv.push_map(output.tap_key_origins, PSBT_OUT_TAP_BIP32_DERIVATION)
+        pairs.push_map(output.tap_key_origins, PSBT_OUT_TAP_BIP32_DERIVATION)
     }
 
     for (key, value) in output.proprietary.iter() {
-        rv.push(raw::Pair {
-            key: key.to_key(),
-            value: value.clone(),
-        });
+        let key = key.to_key();
+        pairs.push_with(
+            key.type_value,
+            |buffer| buffer.extend_from_slice(&key.key),
+            |buffer| buffer.extend_from_slice(value),
+        );
     }
 
     for (key, value) in output.unknown.iter() {
-        rv.push(raw::Pair {
-            key: key.clone(),
-            value: value.clone(),
-        });
+        pairs.push_with(
+            key.type_value,
+            |buffer| buffer.extend_from_slice(&key.key),
+            |buffer| buffer.extend_from_slice(value),
+        );
     }
-
-    rv
-}
-
-pub fn deserialize_pairs(pair: raw::Pair) -> (Vec<u8>, Vec<u8>) {
-    (deserialize(&serialize(&pair.key)).unwrap(), pair.value)
 }
@@ -0,0 +1,258 @@
+//! Instrumentation of the APDUs exchanged with the device.
+//!
+//! A [TracingTransport] wraps the transport of a client, and reports each APDU exchange to a
+//! [Tracer]. The [TraceCollector] records them, in order to compute statistics on the signing
+//! sessions, or to export a trace in the format of the recorded exchanges of the tests, that can
+//! be replayed.
+use core::convert::TryFrom;
+use std::collections::BTreeMap;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+
+#[cfg(feature = "async")]
+use async_trait::async_trait;
+use bitcoin::hashes::hex::ToHex;
+
+#[cfg(feature = "async")]
+use crate::async_client;
+use crate::{
+    apdu::{
+        APDUCommand, BitcoinCommandCode, Cla, ClientCommandCode, FrameworkCommandCode, StatusWord,
+    },
+    client,
+};
+
+/// An APDU sent to the device, with its response.
+#[derive(Clone, Debug)]
+pub struct ApduExchange {
+    pub cla: u8,
+    pub ins: u8,
+    /// For the CONTINUE_INTERRUPTED APDUs, the client command that the APDU responds to.
+    pub client_command: Option<ClientCommandCode>,
+    /// The encoded APDU.
+    pub request: Vec<u8>,
+    /// The response data, without the status word.
+    pub response: Vec<u8>,
+    pub status: StatusWord,
+    /// Time from sending the APDU to receiving its response.
+    pub device_time: Duration,
+    /// Time spent by the host since the previous response of the device, executing the client
+    /// command; zero for the first APDU of a command.
+    pub host_time: Duration,
+}
+
+impl ApduExchange {
+    /// The name of the client command if any, otherwise the name of the instruction.
+    pub fn name(&self) -> String {
+        if let Some(client_command) = self.client_command {
+            return format!("{:?}", client_command);
+        }
+        if self.cla == Cla::Bitcoin as u8 || self.cla == Cla::Default as u8 {
+            if let Ok(ins) = BitcoinCommandCode::try_from(self.ins) {
+                return format!("{:?}", ins);
+            }
+        }
+        format!("{:02x}{:02x}", self.cla, self.ins)
+    }
+}
+
+/// Receives each APDU exchange of a [TracingTransport].
+pub trait Tracer {
+    fn on_exchange(&self, exchange: &ApduExchange);
+}
+
+impl<R: Tracer + ?Sized> Tracer for &R {
+    fn on_exchange(&self, exchange: &ApduExchange) {
+        (**self).on_exchange(exchange)
+    }
+}
+
+impl<R: Tracer + ?Sized> Tracer for Arc<R> {
+    fn on_exchange(&self, exchange: &ApduExchange) {
+        (**self).on_exchange(exchange)
+    }
+}
+
+#[derive(Default)]
+struct TracingState {
+    // the client command requested by the last response, and the time it was received
+    pending_command: Option<ClientCommandCode>,
+    last_response: Option<Instant>,
+}
+
+/// Transport reporting the APDU exchanges of the wrapped transport to a [Tracer].
+pub struct TracingTransport<T, R> {
+    transport: T,
+    tracer: R,
+    state: Mutex<TracingState>,
+}
+
+impl<T, R: Tracer> TracingTransport<T, R> {
+    pub fn new(transport: T, tracer: R) -> Self {
+        Self {
+            transport,
+            tracer,
+            state: Mutex::new(TracingState::default()),
+        }
+    }
+
+    fn start(&self, command: &APDUCommand) -> (Instant, Option<ClientCommandCode>, Duration) {
+        let start = Instant::now();
+        let state = self.state.lock().unwrap();
+        if command.cla == Cla::Framework as u8
+            && command.ins == FrameworkCommandCode::ContinueInterrupted as u8
+        {
+            let host_time = state
+                .last_response
+                .map(|t| start.duration_since(t))
+                .unwrap_or_default();
+            (start, state.pending_command, host_time)
+        } else {
+            (start, None, Duration::default())
+        }
+    }
+
+    fn end(
+        &self,
+        command: &APDUCommand,
+        (start, client_command, host_time): (Instant, Option<ClientCommandCode>, Duration),
+        status: StatusWord,
+        response: &[u8],
+    ) {
+        let end = Instant::now();
+        {
+            let mut state = self.state.lock().unwrap();
+            state.pending_command = if status == StatusWord::InterruptedExecution {
+                response
+                    .first()
+                    .and_then(|c| ClientCommandCode::try_from(*c).ok())
+            } else {
+                None
+            };
+            state.last_response = Some(end);
+        }
+
+        self.tracer.on_exchange(&ApduExchange {
+            cla: command.cla,
+            ins: command.ins,
+            client_command,
+            request: command.encode(),
+            response: response.to_vec(),
+            status,
+            device_time: end.duration_since(start),
+            host_time,
+        });
+    }
+}
+
+impl<T: client::Transport, R: Tracer> client::Transport for TracingTransport<T, R> {
+    type Error = T::Error;
+    fn exchange(&self, command: &APDUCommand) -> Result<(StatusWord, Vec<u8>), Self::Error> {
+        let started = self.start(command);
+        let (status, response) = self.transport.exchange(command)?;
+        self.end(command, started, status, &response);
+        Ok((status, response))
+    }
+}
+
+#[cfg(feature = "async")]
+#[async_trait]
+impl<T, R> async_client::Transport for TracingTransport<T, R>
+where
+    T: async_client::Transport + Send + Sync,
+    R: Tracer + Send + Sync,
+{
+    type Error = T::Error;
+    async fn exchange(&self, command: &APDUCommand) -> Result<(StatusWord, Vec<u8>), Self::Error> {
+        let started = self.start(command);
+        let (status, response) = self.transport.exchange(command).await?;
+        self.end(command, started, status, &response);
+        Ok((status, response))
+    }
+}
+
+/// Statistics of the APDU exchanges of one type.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct CommandStats {
+    pub count: usize,
+    pub bytes_sent: usize,
+    /// Including the status words.
+    pub bytes_received: usize,
+    pub device_time: Duration,
+    pub host_time: Duration,
+}
+
+/// Returns the statistics of the exchanges, by name of the instruction or client command.
+pub fn histogram<'a, I: IntoIterator<Item = &'a ApduExchange>>(
+    exchanges: I,
+) -> BTreeMap<String, CommandStats> {
+    let mut res: BTreeMap<String, CommandStats> = BTreeMap::new();
+    for exchange in exchanges {
+        let stats = res.entry(exchange.name()).or_default();
+        stats.count += 1;
+        stats.bytes_sent += exchange.request.len();
+        stats.bytes_received += exchange.response.len() + 2;
+        stats.device_time += exchange.device_time;
+        stats.host_time += exchange.host_time;
+    }
+    res
+}
+
+/// Tracer recording all the APDU exchanges.
+/// It can be shared between the transports of several devices.
+#[derive(Default)]
+pub struct TraceCollector {
+    exchanges: Mutex<Vec<ApduExchange>>,
+}
+
+impl TraceCollector {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Returns the recorded exchanges.
+    pub fn exchanges(&self) -> Vec<ApduExchange> {
+        self.exchanges.lock().unwrap().clone()
+    }
+
+    /// Returns the recorded exchanges split by command: each session starts with a command,
+    /// followed by the exchanges of the client commands it requested.
+    pub fn sessions(&self) -> Vec<Vec<ApduExchange>> {
+        let mut res: Vec<Vec<ApduExchange>> = Vec::new();
+        for exchange in self.exchanges.lock().unwrap().iter() {
+            if exchange.client_command.is_none() || res.is_empty() {
+                res.push(Vec::new());
+            }
+            if let Some(session) = res.last_mut() {
+                session.push(exchange.clone());
+            }
+        }
+        res
+    }
+
+    /// Returns the statistics of all the recorded exchanges.
+    pub fn histogram(&self) -> BTreeMap<String, CommandStats> {
+        histogram(self.exchanges.lock().unwrap().iter())
+    }
+
+    /// Returns the recorded exchanges as a list of "=> <apdu>" and "<= <response><status word>"
+    /// strings, the format of the recorded exchanges in the tests data.
+    pub fn export(&self) -> Vec<String> {
+        let mut res = Vec::new();
+        for exchange in self.exchanges.lock().unwrap().iter() {
+            res.push(format!("=> {}", exchange.request.to_hex()));
+            res.push(format!(
+                "<= {}{:04x}",
+                exchange.response.to_hex(),
+                exchange.status as u16
+            ));
+        }
+        res
+    }
+}
+
+impl Tracer for TraceCollector {
+    fn on_exchange(&self, exchange: &ApduExchange) {
+        self.exchanges.lock().unwrap().push(exchange.clone());
+    }
+}
@@ -8,7 +8,7 @@ use bitcoin::{
     util::bip32::{DerivationPath, Error, ExtendedPubKey, Fingerprint, KeySource},
 };
 
-use crate::merkle::MerkleTree;
+use crate::{interpreter::KnownData, merkle::MerkleTree};
 
 #[derive(Copy, Clone, Debug, PartialEq, Eq)]
 pub enum Version {
@@ -145,6 +145,19 @@ impl WalletPolicy {
         engine.input(&self.serialize());
         sha256::Hash::from_engine(engine).into_inner()
     }
+
+    /// Returns the preimages and Merkle trees of the wallet policy that the device requests. They
+    /// can be computed once, and shared by all the requests using the wallet policy, for example
+    /// with `MerkleizedPsbt::with_wallet_data`.
+    pub fn known_data(&self) -> KnownData {
+        let mut known = KnownData::new();
+        known.add_known_preimage(self.serialize());
+        let keys: Vec<String> = self.keys.iter().map(|k| k.to_string()).collect();
+        known.add_known_list(&keys);
+        // necessary for version 1 of the protocol (introduced in version 2.1.0)
+        known.add_known_preimage(self.descriptor_template.as_bytes().to_vec());
+        known
+    }
 }
 
 #[derive(Debug)]
@@ -6,7 +6,8 @@ use bitcoin::{
     hashes::hex::{FromHex, ToHex},
     util::{bip32::DerivationPath, psbt::Psbt},
 };
-use ledger_bitcoin_client::{async_client, client, wallet};
+use futures::StreamExt;
+use ledger_bitcoin_client::{async_client, client, trace, wallet, MerkleizedPsbt};
 
 fn test_cases(path: &str) -> Vec<serde_json::Value> {
     let data = std::fs::read_to_string(path).expect("Unable to read file");
@@ -41,6 +42,41 @@ async fn test_get_version() {
     assert_eq!(flags, vec![0x00]);
 }
 
+#[tokio::test]
+async fn test_get_app_features() {
+    let exchanges: Vec<String> = vec!["=> e109000100".into(), "<= 02000000179000".into()];
+
+    let store = utils::RecordStore::new(&exchanges);
+    let (max_protocol_version, features) =
+        client::BitcoinClient::new(utils::TransportReplayer::new(store.clone()))
+            .get_app_features()
+            .unwrap();
+
+    assert_eq!(max_protocol_version, 2);
+    assert_eq!(features, 0x17);
+
+    let (max_protocol_version, features) =
+        async_client::BitcoinClient::new(utils::TransportReplayer::new(store.clone()))
+            .get_app_features()
+            .await
+            .unwrap();
+
+    assert_eq!(max_protocol_version, 2);
+    assert_eq!(features, 0x17);
+
+    // apps that predate GET_APP_FEATURES
+    let exchanges: Vec<String> = vec!["=> e109000100".into(), "<= 6d00".into()];
+
+    let store = utils::RecordStore::new(&exchanges);
+    let (max_protocol_version, features) =
+        client::BitcoinClient::new(utils::TransportReplayer::new(store.clone()))
+            .get_app_features()
+            .unwrap();
+
+    assert_eq!(max_protocol_version, 1);
+    assert_eq!(features, 0);
+}
+
 #[tokio::test]
 async fn test_sign_message() {
     let exchanges: Vec<String> = vec![
@@ -80,6 +116,30 @@ async fn test_sign_message() {
         "IL3u9GLAzgG5BdtSBqUe0Fo2Zx0UlKwSsYx2TbuVX0VULFgZYRBQCW0W7QOlsB/JgGwWNhl3eYYjXtdfyR7pM+Y=",
         base64::encode(sig)
     );
+
+    // the same message, read from a stream
+    let (header, ecdsa_sig) =
+        client::BitcoinClient::new(utils::TransportReplayer::new(store.clone()))
+            .sign_message_from_reader(std::io::Cursor::new(b"hello".to_vec()), &path)
+            .unwrap();
+    let mut sig = vec![header];
+    sig.extend(ecdsa_sig.serialize_compact());
+    assert_eq!(
+        "IL3u9GLAzgG5BdtSBqUe0Fo2Zx0UlKwSsYx2TbuVX0VULFgZYRBQCW0W7QOlsB/JgGwWNhl3eYYjXtdfyR7pM+Y=",
+        base64::encode(sig)
+    );
+
+    let (header, ecdsa_sig) =
+        async_client::BitcoinClient::new(utils::TransportReplayer::new(store.clone()))
+            .sign_message_from_reader(std::io::Cursor::new(b"hello".to_vec()), &path)
+            .await
+            .unwrap();
+    let mut sig = vec![header];
+    sig.extend(ecdsa_sig.serialize_compact());
+    assert_eq!(
+        "IL3u9GLAzgG5BdtSBqUe0Fo2Zx0UlKwSsYx2TbuVX0VULFgZYRBQCW0W7QOlsB/JgGwWNhl3eYYjXtdfyR7pM+Y=",
+        base64::encode(sig)
+    );
 }
 
 #[tokio::test]
@@ -314,9 +374,158 @@ async fn test_sign_psbt() {
             .sign_psbt(&psbt, &wallet, hmac.as_ref())
             .unwrap();
 
-        let _res = async_client::BitcoinClient::new(utils::TransportReplayer::new(store.clone()))
+        let res = async_client::BitcoinClient::new(utils::TransportReplayer::new(store.clone()))
             .sign_psbt(&psbt, &wallet, hmac.as_ref())
             .await
             .unwrap();
+
+        let streamed: Vec<_> =
+            async_client::BitcoinClient::new(utils::TransportReplayer::new(store.clone()))
+                .sign_psbt_stream(&psbt, &wallet, hmac.as_ref())
+                .await
+                .unwrap()
+                .map(|signature| signature.unwrap())
+                .collect()
+                .await;
+        assert_eq!(streamed, res);
+
+        // two devices replaying the same exchanges, driven at the same time
+        let device1 =
+            async_client::BitcoinClient::new(utils::TransportReplayer::new(store.clone()));
+        let device2 =
+            async_client::BitcoinClient::new(utils::TransportReplayer::new(store.clone()));
+        let mut signed_psbt = psbt.clone();
+        async_client::sign_psbt_with_devices(
+            &[(&device1, hmac.as_ref()), (&device2, hmac.as_ref())],
+            &mut signed_psbt,
+            &wallet,
+        )
+        .await
+        .unwrap();
+
+        for (index, key, sig) in res {
+            assert_eq!(signed_psbt.inputs[index].partial_sigs.get(&key), Some(&sig));
+        }
     }
 }
+
+#[tokio::test]
+async fn test_trace_sign_psbt() {
+    let case = &test_cases("./tests/data/sign_psbt.json")[0];
+    let exchanges: Vec<String> = case
+        .get("exchanges")
+        .map(|v| serde_json::from_value(v.clone()).unwrap())
+        .unwrap();
+    let policy: String = case
+        .get("policy")
+        .map(|v| serde_json::from_value(v.clone()).unwrap())
+        .unwrap();
+    let keys_str: Vec<String> = case
+        .get("keys")
+        .map(|v| serde_json::from_value(v.clone()).unwrap())
+        .unwrap();
+    let keys: Vec<wallet::WalletPubKey> = keys_str
+        .iter()
+        .map(|s| wallet::WalletPubKey::from_str(s).unwrap())
+        .collect();
+    let psbt_str: String = case
+        .get("psbt")
+        .map(|v| serde_json::from_value(v.clone()).unwrap())
+        .unwrap();
+    let psbt: Psbt = deserialize(&base64::decode(&psbt_str).unwrap()).unwrap();
+    let wallet = wallet::WalletPolicy::new("".to_string(), wallet::Version::V2, policy, keys);
+
+    let collector = trace::TraceCollector::new();
+    let store = utils::RecordStore::new(&exchanges);
+    let res = client::BitcoinClient::new(trace::TracingTransport::new(
+        utils::TransportReplayer::new(store),
+        &collector,
+    ))
+    .sign_psbt(&psbt, &wallet, None)
+    .unwrap();
+
+    let names: Vec<String> = collector
+        .sessions()
+        .iter()
+        .map(|session| session[0].name())
+        .collect();
+    assert_eq!(names, vec!["GetAppFeatures", "SignPSBT"]);
+
+    let histogram = collector.histogram();
+    assert_eq!(histogram["SignPSBT"].count, 1);
+    assert!(histogram["GetPreimage"].count > 0);
+    assert_eq!(
+        histogram.values().map(|stats| stats.count).sum::<usize>(),
+        exchanges.len() / 2
+    );
+
+    // the exported trace is the recorded one, and can be replayed
+    let exported = collector.export();
+    assert_eq!(
+        exported
+            .iter()
+            .map(|e| e.replace(" ", ""))
+            .collect::<Vec<String>>(),
+        exchanges
+            .iter()
+            .map(|e| e.replace(" ", ""))
+            .collect::<Vec<String>>()
+    );
+
+    let replayed = async_client::BitcoinClient::new(trace::TracingTransport::new(
+        utils::TransportReplayer::new(utils::RecordStore::new(&exported)),
+        trace::TraceCollector::new(),
+    ))
+    .sign_psbt(&psbt, &wallet, None)
+    .await
+    .unwrap();
+    assert_eq!(replayed, res);
+}
+
+#[test]
+fn test_replay_session_recording() {
+    // recorded by the Python client, see `SessionRecording` in its apdu_trace module
+    let recording =
+        utils::session::SessionRecording::load("../tests/sessions/sign_psbt_sh_wpkh.json");
+    assert!(!recording.client_commands.is_empty());
+    recording.replay(&mut recording.new_interpreter());
+}
+
+#[test]
+fn test_replay_protocol_v6_client_commands() {
+    // the client commands of the versions 4 to 6 of the protocol of SIGN_PSBT, answered by the
+    // Python client: GET_MERKLE_LEAF_PROOF_REFS, and the access plans and the tree streams
+    let recording =
+        utils::session::SessionRecording::load("../tests/sessions/client_commands_v6.json");
+    recording.replay(&mut recording.new_interpreter());
+}
+
+#[test]
+fn test_merkleized_psbt_with_input_subset() {
+    let case = &test_cases("./tests/data/sign_psbt.json")[0];
+    let policy: String = case
+        .get("policy")
+        .map(|v| serde_json::from_value(v.clone()).unwrap())
+        .unwrap();
+    let keys_str: Vec<String> = case
+        .get("keys")
+        .map(|v| serde_json::from_value(v.clone()).unwrap())
+        .unwrap();
+    let keys: Vec<wallet::WalletPubKey> = keys_str
+        .iter()
+        .map(|s| wallet::WalletPubKey::from_str(s).unwrap())
+        .collect();
+    let psbt_str: String = case
+        .get("psbt")
+        .map(|v| serde_json::from_value(v.clone()).unwrap())
+        .unwrap();
+    let psbt: Psbt = deserialize(&base64::decode(&psbt_str).unwrap()).unwrap();
+    let wallet = wallet::WalletPolicy::new("".to_string(), wallet::Version::V2, policy, keys);
+
+    let merkleized_psbt = MerkleizedPsbt::new(&psbt, &wallet).unwrap();
+    assert!(merkleized_psbt.with_input_subset(&[]).is_none());
+    assert!(merkleized_psbt
+        .with_input_subset(&[psbt.inputs.len()])
+        .is_none());
+    assert!(merkleized_psbt.with_input_subset(&[0]).is_some());
+}
@@ -1,3 +1,5 @@
+pub mod session;
+
 use core::convert::TryFrom;
 use std::sync::atomic::{AtomicUsize, Ordering};
 
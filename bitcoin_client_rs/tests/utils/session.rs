@@ -0,0 +1,87 @@
+//! Replay of the session recordings exported by `SessionRecording.export` in the Python client:
+//! the requests of the device are fed to an interpreter knowing the recorded data, that must
+//! answer with the recorded responses of the host.
+
+use bitcoin::hashes::hex::FromHex;
+use serde::Deserialize;
+
+use ledger_bitcoin_client::interpreter::ClientCommandInterpreter;
+
+/// The only maximum length of the responses of the interpreter.
+const MAX_RESPONSE_LEN: usize = 255;
+
+#[derive(Deserialize)]
+struct RawSessionRecording {
+    queued_yields: bool,
+    max_response_len: usize,
+    preimages: Vec<String>,
+    lists: Vec<Vec<String>>,
+    client_commands: Vec<(String, String)>,
+}
+
+pub struct SessionRecording {
+    pub queued_yields: bool,
+    pub preimages: Vec<Vec<u8>>,
+    pub lists: Vec<Vec<Vec<u8>>>,
+    /// The requests of the device, with the responses of the host.
+    pub client_commands: Vec<(Vec<u8>, Vec<u8>)>,
+}
+
+fn from_hex(s: &str) -> Vec<u8> {
+    Vec::from_hex(s).expect("Wrong session recording")
+}
+
+impl SessionRecording {
+    pub fn load(path: &str) -> SessionRecording {
+        let data = std::fs::read_to_string(path).expect("Unable to read file");
+        let raw: RawSessionRecording =
+            serde_json::from_str(&data).expect("Wrong session recording");
+        assert_eq!(
+            raw.max_response_len, MAX_RESPONSE_LEN,
+            "Unsupported max_response_len"
+        );
+        SessionRecording {
+            queued_yields: raw.queued_yields,
+            preimages: raw.preimages.iter().map(|p| from_hex(p)).collect(),
+            lists: raw
+                .lists
+                .iter()
+                .map(|elements| elements.iter().map(|el| from_hex(el)).collect())
+                .collect(),
+            client_commands: raw
+                .client_commands
+                .iter()
+                .map(|(req, res)| (from_hex(req), from_hex(res)))
+                .collect(),
+        }
+    }
+
+    /// Returns a new interpreter with the known data and the settings of the recorded one.
+    pub fn new_interpreter(&self) -> ClientCommandInterpreter {
+        let mut interpreter = ClientCommandInterpreter::new();
+        for preimage in &self.preimages {
+            interpreter.add_known_preimage(preimage.clone());
+        }
+        for elements in &self.lists {
+            interpreter.add_known_list(elements);
+        }
+        interpreter.set_queued_yields(self.queued_yields);
+        interpreter
+    }
+
+    /// Feeds the recorded requests to `interpreter`, and panics if a response is not the recorded
+    /// one.
+    pub fn replay(&self, interpreter: &mut ClientCommandInterpreter) {
+        let mut response = Vec::new();
+        for (i, (request, expected)) in self.client_commands.iter().enumerate() {
+            interpreter
+                .execute_into(request, &mut response)
+                .expect("Interpreter error");
+            assert_eq!(
+                &response, expected,
+                "Unexpected response to the client command at position {}",
+                i
+            );
+        }
+    }
+}
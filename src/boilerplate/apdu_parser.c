@@ -23,8 +23,29 @@
 #include "offsets.h"
 
 bool apdu_parser(command_t *cmd, uint8_t *buf, size_t buf_len) {
-    // Check minimum length and Lc field of APDU command
-    if (buf_len < OFFSET_CDATA || buf_len - OFFSET_CDATA != buf[OFFSET_LC]) {
+    // Check minimum length of APDU command
+    if (buf_len < OFFSET_CDATA) {
+        return false;
+    }
+
+    size_t data_offset;
+    if (buf_len > OFFSET_CDATA && buf[OFFSET_LC] == 0) {
+        // Extended-length APDU: <CLA> <INS> <P1> <P2> <0x00> <Lc : 2> <data : Lc>, with Lc > 0
+        if (buf_len < OFFSET_EXTENDED_CDATA) {
+            return false;
+        }
+        cmd->lc = (uint16_t) (buf[OFFSET_EXTENDED_LC] << 8 | buf[OFFSET_EXTENDED_LC + 1]);
+        if (cmd->lc == 0) {
+            return false;
+        }
+        data_offset = OFFSET_EXTENDED_CDATA;
+    } else {
+        cmd->lc = buf[OFFSET_LC];
+        data_offset = OFFSET_CDATA;
+    }
+
+    // Check Lc field of APDU command
+    if (buf_len - data_offset != cmd->lc) {
         return false;
     }
 
@@ -32,8 +53,7 @@ bool apdu_parser(command_t *cmd, uint8_t *buf, size_t buf_len) {
     cmd->ins = buf[OFFSET_INS];
     cmd->p1 = buf[OFFSET_P1];
     cmd->p2 = buf[OFFSET_P2];
-    cmd->lc = buf[OFFSET_LC];
-    cmd->data = (buf[OFFSET_LC] > 0) ? buf + OFFSET_CDATA : NULL;
+    cmd->data = (cmd->lc > 0) ? buf + data_offset : NULL;
 
     return true;
 }
@@ -12,7 +12,7 @@ typedef struct {
     uint8_t ins;    /// Instruction code
     uint8_t p1;     /// Instruction parameter 1
     uint8_t p2;     /// Instruction parameter 2
-    uint8_t lc;     /// Length of command data
+    uint16_t lc;    /// Length of command data
     uint8_t *data;  /// Command data
 } command_t;
 
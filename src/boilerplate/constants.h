@@ -9,3 +9,14 @@
  * Framework instruction to continue execution after an interruption.
  */
 #define INS_CONTINUE 0x01
+
+/**
+ * Highest protocol version accepted in the P2 field of the APDUs.
+ */
+#define MAX_PROTOCOL_VERSION 7
+
+/**
+ * Maximum length of the data of an extended-length CONTINUE APDU, in builds with
+ * HAVE_EXTENDED_APDUS: the IO buffer must be at least 7 bytes longer.
+ */
+#define MAX_EXTENDED_APDU_DATA_LEN 512
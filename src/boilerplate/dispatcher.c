@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "dispatcher.h"
 #include "constants.h"
@@ -25,6 +26,8 @@
 #include "sw.h"
 
 #include "common/buffer.h"
+#include "perf_counters.h"
+#include "trace.h"
 
 extern dispatcher_context_t G_dispatcher_context;
 
@@ -35,18 +38,40 @@ struct {
     void (*termination_cb)(void);
     uint16_t sw;
     bool had_ux_flow;  // set to true if there was any UX flow during the APDU processing
+#ifdef HAVE_BACKGROUND_TASKS
+    background_task_step_t background_task_step;  // NULL if no background task was started
+    void *background_task_state;
+    size_t background_task_state_size;
+    int background_task_result;  // result of the last step, or 0 if no step was run yet
+#endif
 } G_dispatcher_state;
 
 static void add_to_response(const void *rdata, size_t rdata_len) {
     io_add_to_response(rdata, rdata_len);
 }
 
+static size_t get_response_space() {
+    if (G_output_len >= IO_APDU_BUFFER_SIZE - 2) {
+        return 0;
+    }
+    return IO_APDU_BUFFER_SIZE - 2 - G_output_len;
+}
+
 static void finalize_response(uint16_t sw) {
+    if (sw == SW_OK) {
+        TRACE_INFO(TRACE_EVENT_RESPONSE, sw);
+    } else if (sw != SW_INTERRUPTED_EXECUTION) {
+        TRACE_ERROR(TRACE_EVENT_ERROR, sw);
+    }
+
     G_dispatcher_state.sw = sw;
     io_finalize_response(sw);
 }
 
 static void send_response() {
+#ifdef HAVE_PERF_COUNTERS
+    perf_counters_add_response(G_output_len);
+#endif
     io_confirm_response();
 }
 
@@ -55,6 +80,46 @@ static void set_ui_dirty() {
     G_dispatcher_state.had_ux_flow = true;
 }
 
+#ifdef HAVE_BACKGROUND_TASKS
+static void start_background_task(background_task_step_t step, void *state, size_t state_size) {
+    G_dispatcher_state.background_task_step = step;
+    G_dispatcher_state.background_task_state = state;
+    G_dispatcher_state.background_task_state_size = state_size;
+    G_dispatcher_state.background_task_result = 0;
+}
+
+static void run_background_step() {
+    if (G_dispatcher_state.background_task_step != NULL &&
+        G_dispatcher_state.background_task_result == 0) {
+        G_dispatcher_state.background_task_result =
+            G_dispatcher_state.background_task_step(G_dispatcher_state.background_task_state);
+    }
+}
+
+static int complete_background_task() {
+    if (G_dispatcher_state.background_task_step == NULL) {
+        return -1;
+    }
+
+    while (G_dispatcher_state.background_task_result == 0) {
+        run_background_step();
+    }
+    return G_dispatcher_state.background_task_result;
+}
+
+// Wipes the state of the background task, and forgets it
+static void clear_background_task() {
+    if (G_dispatcher_state.background_task_state != NULL) {
+        explicit_bzero(G_dispatcher_state.background_task_state,
+                       G_dispatcher_state.background_task_state_size);
+    }
+    G_dispatcher_state.background_task_step = NULL;
+    G_dispatcher_state.background_task_state = NULL;
+    G_dispatcher_state.background_task_state_size = 0;
+    G_dispatcher_state.background_task_result = 0;
+}
+#endif
+
 // TODO: refactor code in common with the main apdu loop
 static int process_interruption(dispatcher_context_t *dc) {
     command_t cmd;
@@ -65,6 +130,13 @@ static int process_interruption(dispatcher_context_t *dc) {
 
     io_start_interruption_timeout();
 
+#ifdef HAVE_PERF_COUNTERS
+    // the response starts with the code of the client command
+    perf_counters_begin_interruption(G_io_apdu_buffer[0], G_output_len);
+#endif
+    // the response starts with the code of the client command
+    TRACE_DEBUG(TRACE_EVENT_INTERRUPTION, G_io_apdu_buffer[0]);
+
     // Receive command bytes in G_io_apdu_buffer
     if ((input_len = io_exchange(CHANNEL_APDU, G_output_len)) < 0) {
         return -1;
@@ -72,6 +144,10 @@ static int process_interruption(dispatcher_context_t *dc) {
 
     io_clear_interruption_timeout();
 
+#ifdef HAVE_PERF_COUNTERS
+    perf_counters_end_interruption(input_len);
+#endif
+
     G_output_len = 0;
 
     // As we are not yet returning anything here, we communicate to io_exchange that the apdu
@@ -118,16 +194,27 @@ void apdu_dispatcher(command_descriptor_t const cmd_descriptors[],
 
     G_dispatcher_state.termination_cb = termination_cb;
     G_dispatcher_state.sw = 0;
+#ifdef HAVE_BACKGROUND_TASKS
+    // a task left by a command that did not terminate normally is forgotten
+    G_dispatcher_state.background_task_step = NULL;
+    G_dispatcher_state.background_task_state = NULL;
+#endif
 
     G_dispatcher_context.add_to_response = add_to_response;
+    G_dispatcher_context.get_response_space = get_response_space;
     G_dispatcher_context.finalize_response = finalize_response;
     G_dispatcher_context.send_response = send_response;
     G_dispatcher_context.set_ui_dirty = set_ui_dirty;
     G_dispatcher_context.process_interruption = process_interruption;
+#ifdef HAVE_BACKGROUND_TASKS
+    G_dispatcher_context.start_background_task = start_background_task;
+    G_dispatcher_context.complete_background_task = complete_background_task;
+    G_dispatcher_context.run_background_step = run_background_step;
+#endif
 
     G_dispatcher_context.read_buffer = buffer_create(cmd->data, cmd->lc);
 
-    if (cmd->p1 != 0 || cmd->p2 > 1) {
+    if (cmd->p1 != 0 || cmd->p2 > MAX_PROTOCOL_VERSION) {
         io_send_sw(SW_WRONG_P1P2);
         return;
     }
@@ -158,7 +245,23 @@ void apdu_dispatcher(command_descriptor_t const cmd_descriptors[],
         }
 
         io_start_processing_timeout();
+#ifdef HAVE_PERF_COUNTERS
+        perf_counters_begin(cmd->ins, 5 + cmd->lc);
+#endif
+        TRACE_INFO(TRACE_EVENT_COMMAND, cmd->ins);
+#ifdef HAVE_STACK_PROFILING
+        stack_profiling_begin();
+#endif
         handler(&G_dispatcher_context, cmd->p2);
+#ifdef HAVE_BACKGROUND_TASKS
+        clear_background_task();
+#endif
+#ifdef HAVE_STACK_PROFILING
+        stack_profiling_end(cmd->ins);
+#endif
+#ifdef HAVE_PERF_COUNTERS
+        perf_counters_end(cmd->ins);
+#endif
     }
 
     // Here a response (either success or error) should have been send.
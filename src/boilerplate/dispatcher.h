@@ -12,6 +12,17 @@ typedef struct dispatcher_context_s dispatcher_context_t;
 
 typedef void (*command_handler_t)(dispatcher_context_t *, uint8_t p2);
 
+#ifdef HAVE_BACKGROUND_TASKS
+/**
+ * A step of a background task, run while the device is waiting for the user during a UX flow. It
+ * must only do a small amount of deterministic work, without any exchange with the client nor UX
+ * flow.
+ *
+ * Returns 1 if the task is complete, 0 if more steps are needed, or -1 on failure.
+ */
+typedef int (*background_task_step_t)(void *state);
+#endif
+
 /**
  * TODO: docs
  */
@@ -20,9 +31,21 @@ struct dispatcher_context_s {
 
     void (*set_ui_dirty)();
     void (*add_to_response)(const void *rdata, size_t rdata_len);
+    size_t (*get_response_space)(void);  // bytes that can still be added to the response
     void (*finalize_response)(uint16_t sw);
     void (*send_response)(void);
     int (*process_interruption)(dispatcher_context_t *dispatcher_context);
+#ifdef HAVE_BACKGROUND_TASKS
+    // Starts a background task, replacing the current one, if any. Its steps are run on each tick
+    // while a UX flow waits for the user. The state must not be on the stack of the handler, as
+    // its state_size bytes are wiped after the handler returns; therefore, it can hold secrets.
+    void (*start_background_task)(background_task_step_t step, void *state, size_t state_size);
+    // Runs the remaining steps of the background task, if any; returns the result of its last
+    // step, or -1 if no task was started.
+    int (*complete_background_task)(void);
+    // Runs the next step of the background task, if it is not complete yet; called by the UX
+    void (*run_background_step)(void);
+#endif
 };
 
 static inline void SEND_SW(struct dispatcher_context_s *dc, uint16_t sw) {
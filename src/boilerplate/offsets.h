@@ -24,3 +24,11 @@
  * Offset of command data.
  */
 #define OFFSET_CDATA 5
+/**
+ * Offset of command data length in extended-length APDUs, where the byte at OFFSET_LC is 0.
+ */
+#define OFFSET_EXTENDED_LC 5
+/**
+ * Offset of command data in extended-length APDUs.
+ */
+#define OFFSET_EXTENDED_CDATA 7
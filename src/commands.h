@@ -9,5 +9,42 @@ typedef enum {
     GET_WALLET_ADDRESS = 0x03,
     SIGN_PSBT = 0x04,
     GET_MASTER_FINGERPRINT = 0x05,
+    OPEN_WALLET_SESSION = 0x06,
+    GET_WALLET_ADDRESSES = 0x07,
+    GET_EXTENDED_PUBKEYS = 0x08,
+    GET_APP_FEATURES = 0x09,
     SIGN_MESSAGE = 0x10,
+    SIGN_MESSAGES = 0x11,
+    REGISTER_PAYEE_LIST = 0x12,  // only in builds with HAVE_PAYEE_LISTS
+    SIGN_PSBT_BATCH = 0x13,      // only in builds with HAVE_PSBT_BATCHES
+    GET_PERF_COUNTERS = 0xF0,    // only in builds with HAVE_PERF_COUNTERS
+    GET_TRACE = 0xF1,            // only in builds with HAVE_TRACE
+    SIGN_PSBT_DRY_RUN = 0xF2,    // only in builds with HAVE_SIGN_PSBT_DRY_RUN
 } command_e;
+
+/**
+ * Bits of the feature bitmap returned by GET_APP_FEATURES.
+ */
+typedef enum {
+    APP_FEATURE_MERKLE_LEAF_PROOFS = 1 << 0,    // the GET_MERKLE_LEAF_PROOFS client command is used
+    APP_FEATURE_GET_WALLET_ADDRESSES = 1 << 1,  // GET_WALLET_ADDRESSES is supported
+    APP_FEATURE_GET_EXTENDED_PUBKEYS = 1 << 2,  // GET_EXTENDED_PUBKEYS is supported
+    APP_FEATURE_WALLET_SESSIONS = 1 << 3,       // OPEN_WALLET_SESSION is supported
+    APP_FEATURE_QUEUED_YIELDS = 1 << 4,         // SIGN_PSBT supports version 2 of the protocol
+    APP_FEATURE_MERKLE_LEAF_ELEMENTS = 1 << 5,  // the GET_MERKLE_LEAF_ELEMENTS command is used
+    APP_FEATURE_EXTENDED_APDUS = 1 << 6,        // CONTINUE accepts extended-length APDUs
+    APP_FEATURE_HASHED_MESSAGES = 1 << 7,       // SIGN_MESSAGE supports version 3 of the protocol
+    APP_FEATURE_SIGN_MESSAGES = 1 << 8,         // SIGN_MESSAGES is supported
+    APP_FEATURE_PAYEE_LISTS = 1 << 9,           // REGISTER_PAYEE_LIST is supported
+    APP_FEATURE_OFFLOADED_RECORDS = 1 << 10,    // SIGN_PSBT supports more than 512 inputs
+    APP_FEATURE_MULTI_WALLET_SIGNING = 1 << 11, // SIGN_PSBT accepts additional wallet policies
+    APP_FEATURE_INPUT_SUBSETS = 1 << 12,        // SIGN_PSBT can sign a subset of the inputs
+    APP_FEATURE_RESUMABLE_SIGNING = 1 << 13,    // SIGN_PSBT sessions can be resumed
+    APP_FEATURE_COMPILED_POLICIES = 1 << 14,    // REGISTER_WALLET returns the compiled policy
+    APP_FEATURE_HASH_REFS = 1 << 15,            // version 4 of the protocol references hashes
+    APP_FEATURE_ACCESS_PLANS = 1 << 16,         // version 5 of the protocol announces access plans
+    APP_FEATURE_PSBT_BATCHES = 1 << 17,         // SIGN_PSBT_BATCH is supported
+    APP_FEATURE_TREE_STREAMS = 1 << 18,         // version 6 of the protocol streams Merkle trees
+    APP_FEATURE_PROGRESS_EVENTS = 1 << 19,      // version 7 of the protocol reports the progress
+    APP_FEATURE_WALLET_REGISTRY = 1 << 20,      // REGISTER_WALLET can store the wallet on the device
+} app_feature_e;
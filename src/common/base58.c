@@ -54,139 +54,183 @@ char const BASE58_ALPHABET[] = {
     'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z'             //
 };
 
-int base58_decode(const char *in, size_t in_len, uint8_t *out, size_t out_len) {
-#ifdef USE_CXRAM_SECTION
-    // allocate buffers inside the cxram section; safe as there are no syscalls here
-    uint8_t *tmp = get_cxram_buffer();                          // MAX_DEC_INPUT_SIZE bytes buffer
-    uint8_t *buffer = get_cxram_buffer() + MAX_DEC_INPUT_SIZE;  // MAX_DEC_INPUT_SIZE bytes buffer
-#else
-    uint8_t tmp[MAX_DEC_INPUT_SIZE] = {0};
-    uint8_t buffer[MAX_DEC_INPUT_SIZE] = {0};
-#endif
+// The codec works on limbs of 32-bit words: the binary data is split in base 2^32 words, while the
+// base58 string is split in base 58^5 limbs (groups of 5 base58 digits); 58^5 < 2^32.
+#define BASE58_LIMB       656356768u  // 58^5
+#define BASE58_LIMB_CHARS 5
+
+// number of base 2^32 words needed for a decoded string of MAX_DEC_INPUT_SIZE chars
+#define DEC_N_WORDS ((MAX_DEC_INPUT_SIZE * 586 / 100 + 31) / 32 + 1)
+// number of base 58^5 limbs needed for an encoded input of MAX_ENC_INPUT_SIZE bytes
+#define ENC_N_LIMBS ((MAX_ENC_INPUT_SIZE * 138 / 100 + 1) / BASE58_LIMB_CHARS + 1)
+
+// words is a buffer of DEC_N_WORDS words
+static int base58_decode_with_buffer(const char *in,
+                                     size_t in_len,
+                                     uint8_t *out,
+                                     size_t out_len,
+                                     uint32_t *words) {
 
-    memset(tmp, 0, MAX_DEC_INPUT_SIZE);
-    memset(buffer, 0, MAX_DEC_INPUT_SIZE);
+    size_t zero_count = 0;
+    while (zero_count < in_len && in[zero_count] == BASE58_ALPHABET[0]) {
+        ++zero_count;
+    }
 
-    uint8_t j;
-    uint8_t start_at;
-    uint8_t zero_count = 0;
+    // little-endian base 2^32 representation of the number; only the first n_words are used
+    size_t n_words = 0;
 
-    if (in_len > MAX_DEC_INPUT_SIZE || in_len < 2) {
-        return -1;
+    // the first limb is shorter if the number of remaining digits is not a multiple of 5
+    size_t limb_len = (in_len - zero_count) % BASE58_LIMB_CHARS;
+    if (limb_len == 0) {
+        limb_len = BASE58_LIMB_CHARS;
     }
 
-    memmove(tmp, in, in_len);
+    for (size_t i = zero_count; i < in_len; i += limb_len, limb_len = BASE58_LIMB_CHARS) {
+        uint32_t limb = 0;
+        uint32_t multiplier = 1;
+        for (size_t k = i; k < i + limb_len; k++) {
+            // uses a trimmed version of BASE58_TABLE to save space, while staying functionally
+            // equivalent
+            int pos_trimmed = (in[k]) - 49;
+            if (pos_trimmed < 0 || pos_trimmed >= (int) sizeof(BASE58_TABLE_TRIMMED)) {
+                return -1;
+            }
 
-    // uses a trimmed version of BASE58_TABLE to save space, while staying functionally equivalent
-    for (uint8_t i = 0; i < in_len; i++) {
-        int pos_trimmed = (in[i]) - 49;
-        if (pos_trimmed < 0 || pos_trimmed >= (int) sizeof(BASE58_TABLE_TRIMMED)) {
-            return -1;
-        }
+            uint8_t digit = BASE58_TABLE_TRIMMED[pos_trimmed];
+            if (digit == 0xFF) {
+                return -1;
+            }
 
-        tmp[i] = BASE58_TABLE_TRIMMED[pos_trimmed];
+            limb = limb * 58 + digit;
+            multiplier *= 58;
+        }
 
-        if (tmp[i] == 0xFF) {
-            return -1;
+        // words = words * 58^limb_len + limb
+        uint32_t carry = limb;
+        for (size_t k = 0; k < n_words; k++) {
+            uint64_t t = (uint64_t) words[k] * multiplier + carry;
+            words[k] = (uint32_t) t;
+            carry = (uint32_t) (t >> 32);
+        }
+        if (carry != 0) {
+            words[n_words++] = carry;
         }
     }
 
-    // // original code for reference
-    // for (uint8_t i = 0; i < in_len; i++) {
-    //     if (in[i] >= sizeof(BASE58_TABLE)) {
-    //         return -1;
-    //     }
-
-    //     tmp[i] = BASE58_TABLE[(int) in[i]];
+    // number of significant bytes in the most significant word
+    size_t top_bytes = 0;
+    if (n_words > 0) {
+        for (uint32_t w = words[n_words - 1]; w != 0; w >>= 8) {
+            ++top_bytes;
+        }
+    }
 
-    //     if (tmp[i] == 0xFF) {
-    //         return -1;
-    //     }
-    // }
+    size_t length = zero_count + (n_words > 0 ? 4 * (n_words - 1) + top_bytes : 0);
 
-    while ((zero_count < in_len) && (tmp[zero_count] == 0)) {
-        ++zero_count;
+    if (out_len < length) {
+        return -1;
     }
 
-    j = in_len;
-    start_at = zero_count;
-    while (start_at < in_len) {
-        uint16_t remainder = 0;
-        for (uint8_t div_loop = start_at; div_loop < in_len; div_loop++) {
-            uint16_t digit256 = (uint16_t) (tmp[div_loop] & 0xFF);
-            uint16_t tmp_div = remainder * 58 + digit256;
-            tmp[div_loop] = (uint8_t) (tmp_div / 256);
-            remainder = tmp_div % 256;
-        }
+    memset(out, 0, zero_count);
 
-        if (tmp[start_at] == 0) {
-            ++start_at;
+    // write the words in big-endian order, starting from the end of the output
+    size_t pos = length;
+    for (size_t k = 0; k < n_words; k++) {
+        uint32_t w = words[k];
+        for (size_t b = 0; b < 4 && pos > zero_count; b++) {
+            out[--pos] = (uint8_t) w;
+            w >>= 8;
         }
-
-        buffer[--j] = (uint8_t) remainder;
-    }
-
-    while ((j < in_len) && (buffer[j] == 0)) {
-        ++j;
     }
 
-    int length = in_len - (j - zero_count);
+    return length;
+}
 
-    if ((int) out_len < length) {
+int base58_decode(const char *in, size_t in_len, uint8_t *out, size_t out_len) {
+    if (in_len > MAX_DEC_INPUT_SIZE || in_len < 2) {
         return -1;
     }
 
-    memmove(out, buffer + j - zero_count, length);
-
-    return length;
+#ifdef USE_CXRAM_SECTION
+    // allocate the buffer inside the cxram section; safe as there are no syscalls here
+    size_t mark = cxram_mark();
+    uint32_t *words = (uint32_t *) cxram_alloc(DEC_N_WORDS * sizeof(uint32_t));
+    if (words == NULL) {
+        return -1;
+    }
+    int res = base58_decode_with_buffer(in, in_len, out, out_len, words);
+    cxram_release(mark);
+    return res;
+#else
+    uint32_t words[DEC_N_WORDS];
+    return base58_decode_with_buffer(in, in_len, out, out_len, words);
+#endif
 }
 
 int base58_encode(const uint8_t *in, size_t in_len, char *out, size_t out_len) {
-    uint8_t buffer[MAX_ENC_INPUT_SIZE * 138 / 100 + 1] = {0};
-    size_t i, j;
-    size_t stop_at;
-    size_t zero_count = 0;
-    size_t output_size;
+    // little-endian base 58^5 representation of the number; only the first n_limbs are used
+    uint32_t limbs[ENC_N_LIMBS];
+    size_t n_limbs = 0;
 
     if (in_len > MAX_ENC_INPUT_SIZE) {
         return -1;
     }
 
+    size_t zero_count = 0;
     while ((zero_count < in_len) && (in[zero_count] == 0)) {
         ++zero_count;
     }
 
-    output_size = (in_len - zero_count) * 138 / 100 + 1;
-    stop_at = output_size - 1;
-    for (size_t start_at = zero_count; start_at < in_len; start_at++) {
-        unsigned int carry = in[start_at];
-        for (j = output_size - 1; (int) j >= 0; j--) {
-            carry += 256 * buffer[j];
-            buffer[j] = carry % 58;
-            carry /= 58;
-
-            if (j <= stop_at - 1 && carry == 0) {
-                break;
-            }
+    // the first word is shorter if the number of remaining bytes is not a multiple of 4
+    size_t word_len = (in_len - zero_count) % 4;
+    if (word_len == 0) {
+        word_len = 4;
+    }
+
+    for (size_t i = zero_count; i < in_len; i += word_len, word_len = 4) {
+        uint32_t word = 0;
+        for (size_t k = i; k < i + word_len; k++) {
+            word = (word << 8) | in[k];
+        }
+
+        // limbs = limbs * 2^(8*word_len) + word
+        uint32_t carry = word;
+        for (size_t k = 0; k < n_limbs; k++) {
+            uint64_t t = ((uint64_t) limbs[k] << (8 * word_len)) + carry;
+            limbs[k] = (uint32_t) (t % BASE58_LIMB);
+            carry = (uint32_t) (t / BASE58_LIMB);
+        }
+        while (carry != 0) {
+            limbs[n_limbs++] = carry % BASE58_LIMB;
+            carry /= BASE58_LIMB;
         }
-        stop_at = j;
     }
 
-    j = 0;
-    while (j < output_size && buffer[j] == 0) {
-        j += 1;
+    // number of significant digits in the most significant limb
+    size_t top_chars = 0;
+    if (n_limbs > 0) {
+        for (uint32_t l = limbs[n_limbs - 1]; l != 0; l /= 58) {
+            ++top_chars;
+        }
     }
 
-    if (out_len < zero_count + output_size - j) {
+    size_t length = zero_count + (n_limbs > 0 ? BASE58_LIMB_CHARS * (n_limbs - 1) + top_chars : 0);
+
+    if (out_len < length) {
         return -1;
     }
 
     memset(out, BASE58_ALPHABET[0], zero_count);
 
-    i = zero_count;
-    while (j < output_size) {
-        out[i++] = BASE58_ALPHABET[buffer[j++]];
+    // write the digits of each limb, starting from the end of the output
+    size_t pos = length;
+    for (size_t k = 0; k < n_limbs; k++) {
+        uint32_t l = limbs[k];
+        for (size_t d = 0; d < BASE58_LIMB_CHARS && pos > zero_count; d++) {
+            out[--pos] = BASE58_ALPHABET[l % 58];
+            l /= 58;
+        }
     }
 
-    return i;
+    return length;
 }
@@ -170,6 +170,17 @@ bool buffer_read_bytes(buffer_t *buffer, uint8_t *out, size_t n) {
     return true;
 }
 
+bool buffer_borrow_bytes(buffer_t *buffer, size_t n, const uint8_t **out) {
+    if (buffer->size - buffer->offset < n) {
+        return false;
+    }
+
+    *out = buffer->ptr + buffer->offset;
+    buffer_seek_cur(buffer, n);
+
+    return true;
+}
+
 bool buffer_write_u8(buffer_t *buffer, uint8_t value) {
     if (!buffer_can_read(buffer, 1)) {
         return false;
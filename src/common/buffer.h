@@ -222,6 +222,24 @@ bool buffer_read_bip32_path(buffer_t *buffer, uint32_t *out, size_t out_len);
  */
 bool buffer_read_bytes(buffer_t *buffer, uint8_t *out, size_t n);
 
+/**
+ * Consumes n bytes from the buffer in place, without copying them: on success, out points to the
+ * first of the n bytes inside the buffer, and the buffer is advanced past them.
+ * The pointer is only valid as long as the memory of the buffer is not overwritten; for the read
+ * buffer of the dispatcher, that is until the next interruption.
+ *
+ * @param[in,out]  buffer
+ *   Pointer to input buffer struct.
+ * @param[in]      n
+ *   Number of bytes to consume from buffer.
+ * @param[out]     out
+ *   Pointer to the first consumed byte.
+ *
+ * @return true if success, false otherwise.
+ *
+ */
+bool buffer_borrow_bytes(buffer_t *buffer, size_t n, const uint8_t **out);
+
 /**
  * Write a uint8_t into a buffer.
  *
@@ -16,7 +16,7 @@
  *****************************************************************************/
 
 #include <stdint.h>   // uint*_t
-#include <string.h>   // memset, explicit_bzero
+#include <string.h>   // memcpy
 #include <stdbool.h>  // bool
 
 #include "buffer.h"
@@ -24,7 +24,6 @@
 
 #include "merkle.h"
 
-#include "cx_ram.h"
 #include "debug-helpers/debug.h"
 
 void merkle_compute_element_hash(const uint8_t *in, size_t in_len, uint8_t out[static 32]) {
@@ -36,71 +35,89 @@ void merkle_compute_element_hash(const uint8_t *in, size_t in_len, uint8_t out[s
     crypto_hash_update(&hash.header, in, in_len);
 
     crypto_hash_digest(&hash.header, out, 32);
-}
-
-// void merkle_combine_hashes(const uint8_t left[static 32],
-//                            const uint8_t right[static 32],
-//                            uint8_t out[static 32]) {
-//     PRINT_STACK_POINTER();
 
-//     cx_sha256_t hash;
-//     cx_sha256_init(&hash);
-
-//     // H(0x01 | left | right)
-//     crypto_hash_update_u8(&hash.header, 0x01);
-//     crypto_hash_update(&hash.header, left, 32);
-//     crypto_hash_update(&hash.header, right, 32);
+    PERF_COUNTER_ADD(sha256_compressions, SHA256_COMPRESSIONS(1 + in_len));
+}
 
-//     crypto_hash_digest(&hash.header, out, 32);
-// }
+// Length of the preimage of the hash of an internal node: 0x01 | left | right
+#define MERKLE_NODE_PREIMAGE_LEN (1 + 32 + 32)
 
-// implementation using the cxram section, in order to save ram
+// The preimage is built in a single buffer, so that it is hashed with a single call to
+// cx_hash_sha256, rather than with separate calls to initialize, update and finalize a context.
 void merkle_combine_hashes(const uint8_t left[static 32],
                            const uint8_t right[static 32],
                            uint8_t out[static 32]) {
     PRINT_STACK_POINTER();
 
-    cx_sha256_init_no_throw(&G_cx.sha256);
+    // H(0x01 | left | right)
+    uint8_t preimage[MERKLE_NODE_PREIMAGE_LEN];
+    preimage[0] = 0x01;
+    memcpy(preimage + 1, left, 32);
+    memcpy(preimage + 1 + 32, right, 32);
 
-    uint8_t prefix = 0x01;
-    cx_sha256_update(&G_cx.sha256, &prefix, 1);
+    cx_hash_sha256(preimage, sizeof(preimage), out, 32);
 
-    cx_sha256_update(&G_cx.sha256, left, 32);
-    cx_sha256_update(&G_cx.sha256, right, 32);
+    PERF_COUNTER_ADD(sha256_compressions, SHA256_COMPRESSIONS(MERKLE_NODE_PREIMAGE_LEN));
+}
+
+void merkle_climb_path(uint8_t cur_hash[static 32],
+                       const uint8_t *siblings,
+                       size_t n_siblings,
+                       uint32_t directions,
+                       size_t depth) {
+    PRINT_STACK_POINTER();
 
-    cx_sha256_final(&G_cx.sha256, out);
-    explicit_bzero(&G_cx.sha256, sizeof(cx_sha256_t));
+    // the same preimage buffer is used for all the levels
+    uint8_t preimage[MERKLE_NODE_PREIMAGE_LEN];
+    preimage[0] = 0x01;
+    for (size_t k = 0; k < n_siblings; k++) {
+        const uint8_t *sibling_hash = siblings + 32 * k;
+        if ((directions >> (depth - 1 - k)) & 1) {
+            // the current node is the right child
+            memcpy(preimage + 1, sibling_hash, 32);
+            memcpy(preimage + 1 + 32, cur_hash, 32);
+        } else {
+            memcpy(preimage + 1, cur_hash, 32);
+            memcpy(preimage + 1 + 32, sibling_hash, 32);
+        }
+        cx_hash_sha256(preimage, sizeof(preimage), cur_hash, 32);
+    }
+
+    PERF_COUNTER_ADD(sha256_compressions,
+                     n_siblings * SHA256_COMPRESSIONS(MERKLE_NODE_PREIMAGE_LEN));
 }
 
-// TODO: make this O(log n), or possibly O(1). Currently O(log^2 n).
-int merkle_get_ith_direction(size_t size, size_t index, size_t i) {
-    if (size <= 1 || index >= size) {
+int merkle_get_directions(size_t size, size_t index, uint32_t *directions) {
+    if (size == 0 || index >= size || size > UINT32_MAX) {
         return -1;
     }
 
-    uint8_t n_directions = 0;
+    uint32_t result = 0;
+    int n_directions = 0;
     while (size > 1) {
-        uint8_t depth = ceil_lg(size);
-
         // bitmask of the direction from the current node, where 0 = left, 1 = right;
         // also the number of leaves of the left subtree
-        uint32_t mask = 1 << (depth - 1);
+        uint32_t mask = 1U << (ceil_lg(size) - 1);
 
-        uint8_t is_right_child = (index & mask) != 0 ? 1 : 0;
-
-        if (n_directions == i) {
-            return is_right_child;
-        }
-
-        ++n_directions;
-
-        if (is_right_child) {
+        if (index & mask) {
+            result |= 1U << n_directions;
             size -= mask;
             index -= mask;
         } else {
             size = mask;
         }
+        ++n_directions;
     }
 
-    return -1;
-}
\ No newline at end of file
+    *directions = result;
+    return n_directions;
+}
+
+int merkle_get_ith_direction(size_t size, size_t index, size_t i) {
+    uint32_t directions;
+    int n_directions = merkle_get_directions(size, index, &directions);
+    if (n_directions < 0 || i >= (size_t) n_directions) {
+        return -1;
+    }
+    return (directions >> i) & 1;
+}
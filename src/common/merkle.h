@@ -2,6 +2,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // TODO: RFC6962 defines the empty list hash as sha256(b''); while we're using 0 here. Should we
 // change?
@@ -57,28 +58,120 @@ void merkle_combine_hashes(const uint8_t left[static 32],
                            const uint8_t right[static 32],
                            uint8_t out[static 32]);
 
+/**
+ * Climbs n_siblings levels of a Merkle tree, starting from a node at the given depth: at each
+ * level, the current hash is combined with the hash of its sibling, in the order given by the
+ * directions.
+ * Used to verify Merkle proofs, whose sibling hashes are received in chunks.
+ *
+ * @param[in,out] cur_hash
+ *   The hash of the starting node; replaced with the hash of its ancestor n_siblings levels up.
+ * @param[in] siblings
+ *   The n_siblings hashes of the siblings, 32 bytes each, contiguous, starting from the lowest
+ *   level; they can be used in place in the read buffer.
+ * @param[in] n_siblings
+ *   The number of levels to climb; it must not be larger than depth.
+ * @param[in] directions
+ *   The directions from the root to the leaf, as computed by merkle_get_directions.
+ * @param[in] depth
+ *   The depth of the starting node.
+ */
+void merkle_climb_path(uint8_t cur_hash[static 32],
+                       const uint8_t *siblings,
+                       size_t n_siblings,
+                       uint32_t directions,
+                       size_t depth);
+
 // inlined to save on stack depth
 static inline uint8_t ceil_lg(uint32_t n) {
-    uint8_t r = 0;
-    uint32_t t = 1;
-    while (t < n) {
-        t = 2 * t;
-        ++r;
-    }
-    return r;
+    return n <= 1 ? 0 : 32 - __builtin_clz(n - 1);
 }
 
+/**
+ * Computes all the directions from the root to the leaf with the given index in a Merkle tree of
+ * the given size. Bit i of the result is the i-th direction, where 0 = left and 1 = right, and the
+ * direction with i = 0 is the one taken at the root.
+ *
+ * @param[in] size
+ *   The number of leaves of the Merkle tree.
+ * @param[in] index
+ *   The index of the leaf.
+ * @param[out] directions
+ *   Pointer to the bitmap of the directions.
+ *
+ * @return the number of directions (that is, the depth of the leaf) on success; -1 on error.
+ */
+int merkle_get_directions(size_t size, size_t index, uint32_t *directions);
+
 // Returns the ith member of the directions array for the leaf with the given index in a Merkle tree
 // of the given size. Returns -1 on error.
 int merkle_get_ith_direction(size_t size, size_t index, size_t i);
 
+/**
+ * Single-byte keys with a key type smaller than this value have their position recorded while all
+ * the keys of a merkleized map are enumerated. This covers all the non-proprietary PSBT key types
+ * without key data.
+ */
+#define MAP_KEY_INDEX_SIZE 0x19
+
+/**
+ * Marker in the key index table for a key that is present, but whose index is too large to be
+ * recorded.
+ */
+#define MAP_KEY_INDEX_NOT_RECORDED 0xFF
+
 /**
  * Represents the Merkleized version of a key-value map, holding the number of elements, the root of
  * the Merkle tree of the sorted list of keys, and the root of the Merkle tree of the values (sorted
  * by their correpsonding key).
+ *
+ * Once all the keys were enumerated (and verified), the key index table contains the position of
+ * the single-byte keys, so that their values can be fetched without asking the client for their
+ * index.
  */
 typedef struct {
     uint64_t size;
     uint8_t keys_root[32];
     uint8_t values_root[32];
-} merkleized_map_commitment_t;
\ No newline at end of file
+
+    bool has_key_index;  // true if key_index was filled while enumerating all the keys
+    // For each key type t < MAP_KEY_INDEX_SIZE, 0 if the single-byte key {t} is not in the map;
+    // otherwise, 1 + its index (or MAP_KEY_INDEX_NOT_RECORDED if it does not fit in a byte).
+    uint8_t key_index[MAP_KEY_INDEX_SIZE];
+} merkleized_map_commitment_t;
+
+/**
+ * Records the position of a key in the key index table of a merkleized map, while enumerating
+ * its keys.
+ */
+static inline void merkleized_map_record_key_index(merkleized_map_commitment_t *map,
+                                                   const uint8_t *key,
+                                                   size_t key_len,
+                                                   size_t index) {
+    if (key_len == 1 && key[0] < MAP_KEY_INDEX_SIZE) {
+        map->key_index[key[0]] =
+            index < MAP_KEY_INDEX_NOT_RECORDED - 1 ? index + 1 : MAP_KEY_INDEX_NOT_RECORDED;
+    }
+}
+
+/**
+ * Looks up a key in the key index table of a merkleized map.
+ *
+ * @return the index of the key if it is known; -1 if the key is known not to be in the map; -2 if
+ * the table does not have this information, and the index must be requested to the client.
+ */
+static inline int merkleized_map_find_key_index(const merkleized_map_commitment_t *map,
+                                                const uint8_t *key,
+                                                size_t key_len) {
+    if (!map->has_key_index || key_len != 1 || key[0] >= MAP_KEY_INDEX_SIZE) {
+        return -2;
+    }
+
+    uint8_t entry = map->key_index[key[0]];
+    if (entry == 0) {
+        return -1;
+    } else if (entry == MAP_KEY_INDEX_NOT_RECORDED) {
+        return -2;
+    }
+    return entry - 1;
+}
\ No newline at end of file
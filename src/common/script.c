@@ -65,8 +65,12 @@ int get_script_type(const uint8_t script[], size_t script_len) {
 
 #ifndef SKIP_FOR_CMOCKA
 
-// TODO: add unit tests
-int get_script_address(const uint8_t script[], size_t script_len, char *out, size_t out_len) {
+// hrp is the state of the checksum for COIN_NATIVE_SEGWIT_PREFIX
+static int get_script_address_with_hrp(const uint8_t script[],
+                                       size_t script_len,
+                                       const bech32_hrp_state *hrp,
+                                       char *out,
+                                       size_t out_len) {
     int script_type = get_script_type(script, script_len);
     int addr_len;
     switch (script_type) {
@@ -94,8 +98,7 @@ int get_script_address(const uint8_t script[], size_t script_len, char *out, siz
                 return -1;
             }
 
-            int ret =
-                segwit_addr_encode(out, COIN_NATIVE_SEGWIT_PREFIX, version, script + 2, prog_len);
+            int ret = segwit_addr_encode_with_hrp(out, hrp, version, script + 2, prog_len);
 
             if (ret != 1) {
                 return -1;  // should never happen
@@ -113,6 +116,40 @@ int get_script_address(const uint8_t script[], size_t script_len, char *out, siz
     return addr_len;
 }
 
+// TODO: add unit tests
+int get_script_address(const uint8_t script[], size_t script_len, char *out, size_t out_len) {
+    bech32_hrp_state hrp;
+    if (!bech32_hrp_init(&hrp, COIN_NATIVE_SEGWIT_PREFIX)) {
+        return -1;  // should never happen
+    }
+    return get_script_address_with_hrp(script, script_len, &hrp, out, out_len);
+}
+
+int get_script_addresses(const uint8_t *const scripts[],
+                         const size_t script_lens[],
+                         size_t n_scripts,
+                         char *out,
+                         size_t out_stride,
+                         int out_lens[]) {
+    bech32_hrp_state hrp;
+    if (!bech32_hrp_init(&hrp, COIN_NATIVE_SEGWIT_PREFIX)) {
+        return -1;  // should never happen
+    }
+
+    int result = 0;
+    for (size_t i = 0; i < n_scripts; i++) {
+        out_lens[i] = get_script_address_with_hrp(scripts[i],
+                                                  script_lens[i],
+                                                  &hrp,
+                                                  out + i * out_stride,
+                                                  out_stride);
+        if (out_lens[i] < 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
 #endif
 
 int format_opscript_script(const uint8_t script[],
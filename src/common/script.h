@@ -197,6 +197,26 @@ int get_script_type(const uint8_t script[], size_t script_len);
  */
 int get_script_address(const uint8_t script[], size_t script_len, char *out, size_t out_len);
 
+/**
+ * Computes the addresses of several scripts, as get_script_address; the state of the checksum of
+ * the segwit prefix is only computed once for the whole batch.
+ *
+ * @param scripts the scriptPubKeys
+ * @param script_lens the length of each script
+ * @param n_scripts the number of scripts
+ * @param out the output buffer, of n_scripts * out_stride bytes; the address of the i-th script
+ * is written at offset i * out_stride, with its termination character
+ * @param out_stride the space available for each address
+ * @param out_lens receives the length of each address, or -1 if it could not be computed
+ * @return 0 if all the addresses were computed, -1 otherwise.
+ */
+int get_script_addresses(const uint8_t *const scripts[],
+                         const size_t script_lens[],
+                         size_t n_scripts,
+                         char *out,
+                         size_t out_stride,
+                         int out_lens[]);
+
 #endif
 
 // the longest OP_RETURN description "OP_RETURN 0x" followed by 160 hexadecimal characters
@@ -27,14 +27,21 @@
 
 #include "segwit_addr.h"
 
+/* XOR of the generators 0x3b6a57b2, 0x26508e6d, 0x1ea119fa, 0x3d4233dd, 0x2a1462b3 selected by
+ * each bit of the index, so that a step of the checksum is a single lookup. */
+static const uint32_t bech32_generator_table[32] = {
+    0x00000000, 0x3b6a57b2, 0x26508e6d, 0x1d3ad9df,
+    0x1ea119fa, 0x25cb4e48, 0x38f19797, 0x039bc025,
+    0x3d4233dd, 0x0628646f, 0x1b12bdb0, 0x2078ea02,
+    0x23e32a27, 0x18897d95, 0x05b3a44a, 0x3ed9f3f8,
+    0x2a1462b3, 0x117e3501, 0x0c44ecde, 0x372ebb6c,
+    0x34b57b49, 0x0fdf2cfb, 0x12e5f524, 0x298fa296,
+    0x1756516e, 0x2c3c06dc, 0x3106df03, 0x0a6c88b1,
+    0x09f74894, 0x329d1f26, 0x2fa7c6f9, 0x14cd914b
+};
+
 static uint32_t bech32_polymod_step(uint32_t pre) {
-    uint8_t b = pre >> 25;
-    return ((pre & 0x1FFFFFF) << 5) ^
-        (-((b >> 0) & 1) & 0x3b6a57b2UL) ^
-        (-((b >> 1) & 1) & 0x26508e6dUL) ^
-        (-((b >> 2) & 1) & 0x1ea119faUL) ^
-        (-((b >> 3) & 1) & 0x3d4233ddUL) ^
-        (-((b >> 4) & 1) & 0x2a1462b3UL);
+    return ((pre & 0x1FFFFFF) << 5) ^ bech32_generator_table[pre >> 25];
 }
 
 static uint32_t bech32_final_constant(bech32_encoding enc) {
@@ -57,7 +64,7 @@ static const int8_t charset_rev[128] = {
      1,  0,  3, 16, 11, 28, 12, 14,  6,  4,  2, -1, -1, -1, -1, -1
 };
 
-int bech32_encode(char *output, const char *hrp, const uint8_t *data, size_t data_len, bech32_encoding enc) {
+int bech32_hrp_init(bech32_hrp_state *state, const char *hrp) {
     uint32_t chk = 1;
     size_t i = 0;
     while (hrp[i] != 0) {
@@ -70,12 +77,22 @@ int bech32_encode(char *output, const char *hrp, const uint8_t *data, size_t dat
         chk = bech32_polymod_step(chk) ^ (ch >> 5);
         ++i;
     }
-    if (i + 7 + data_len > 90) return 0;
     chk = bech32_polymod_step(chk);
-    while (*hrp != 0) {
-        chk = bech32_polymod_step(chk) ^ (*hrp & 0x1f);
-        *(output++) = *(hrp++);
+    for (size_t k = 0; k < i; ++k) {
+        chk = bech32_polymod_step(chk) ^ (hrp[k] & 0x1f);
     }
+    state->hrp = hrp;
+    state->hrp_len = i;
+    state->chk = chk;
+    return 1;
+}
+
+static int bech32_encode_with_hrp(char *output, const bech32_hrp_state *hrp, const uint8_t *data, size_t data_len, bech32_encoding enc) {
+    uint32_t chk = hrp->chk;
+    size_t i;
+    if (hrp->hrp_len + 7 + data_len > 90) return 0;
+    memcpy(output, hrp->hrp, hrp->hrp_len);
+    output += hrp->hrp_len;
     *(output++) = '1';
     for (i = 0; i < data_len; ++i) {
         if (*data >> 5) return 0;
@@ -93,6 +110,12 @@ int bech32_encode(char *output, const char *hrp, const uint8_t *data, size_t dat
     return 1;
 }
 
+int bech32_encode(char *output, const char *hrp, const uint8_t *data, size_t data_len, bech32_encoding enc) {
+    bech32_hrp_state state;
+    if (!bech32_hrp_init(&state, hrp)) return 0;
+    return bech32_encode_with_hrp(output, &state, data, data_len, enc);
+}
+
 bech32_encoding bech32_decode(char* hrp, uint8_t *data, size_t *data_len, const char *input) {
     uint32_t chk = 1;
     size_t i;
@@ -178,7 +201,23 @@ static int convert_bits(uint8_t* out, size_t* outlen, int outbits, const uint8_t
     return 1;
 }
 
-int segwit_addr_encode(char *output, const char *hrp, int witver, const uint8_t *witprog, size_t witprog_len) {
+/* Same as convert_bits(out, outlen, 5, in, inlen, 8, 1), but each group of 5 bytes is split in
+ * 8 values at once. */
+static void convert_bits_8_to_5(uint8_t* out, size_t* outlen, const uint8_t* in, size_t inlen) {
+    while (inlen >= 5) {
+        uint64_t val = ((uint64_t)in[0] << 32) | ((uint64_t)in[1] << 24) | ((uint64_t)in[2] << 16) |
+            ((uint64_t)in[3] << 8) | in[4];
+        for (int k = 0; k < 8; ++k) {
+            out[(*outlen)++] = (val >> (35 - 5 * k)) & 0x1f;
+        }
+        in += 5;
+        inlen -= 5;
+    }
+    /* the remaining bytes start at a group boundary */
+    convert_bits(out, outlen, 5, in, inlen, 8, 1);
+}
+
+int segwit_addr_encode_with_hrp(char *output, const bech32_hrp_state *hrp, int witver, const uint8_t *witprog, size_t witprog_len) {
     uint8_t data[65];
     size_t datalen = 0;
     bech32_encoding enc = BECH32_ENCODING_BECH32;
@@ -187,9 +226,15 @@ int segwit_addr_encode(char *output, const char *hrp, int witver, const uint8_t
     if (witprog_len < 2 || witprog_len > 40) return 0;
     if (witver > 0) enc = BECH32_ENCODING_BECH32M;
     data[0] = witver;
-    convert_bits(data + 1, &datalen, 5, witprog, witprog_len, 8, 1);
+    convert_bits_8_to_5(data + 1, &datalen, witprog, witprog_len);
     ++datalen;
-    return bech32_encode(output, hrp, data, datalen, enc);
+    return bech32_encode_with_hrp(output, hrp, data, datalen, enc);
+}
+
+int segwit_addr_encode(char *output, const char *hrp, int witver, const uint8_t *witprog, size_t witprog_len) {
+    bech32_hrp_state state;
+    if (!bech32_hrp_init(&state, hrp)) return 0;
+    return segwit_addr_encode_with_hrp(output, &state, witver, witprog, witprog_len);
 }
 
 int segwit_addr_decode(int* witver, uint8_t* witdata, size_t* witdata_len, const char* hrp, const char* addr) {
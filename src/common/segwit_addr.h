@@ -24,8 +24,25 @@
 #ifndef _SEGWIT_ADDR_H_
 #define _SEGWIT_ADDR_H_ 1
 
+#include <stddef.h>
 #include <stdint.h>
 
+/** State of the checksum after the human readable part, shared by all the
+ *  Bech32 strings with the same human readable part. */
+typedef struct {
+    const char *hrp;  /* the null-terminated human readable part */
+    size_t hrp_len;
+    uint32_t chk;
+} bech32_hrp_state;
+
+/** Precompute the state of the checksum for a human readable part
+ *
+ *  Out: state: Pointer to the state to initialize; it keeps a pointer to hrp,
+ *              that must stay valid while the state is used.
+ *  In:  hrp:   Pointer to the null-terminated human readable part.
+ *  Returns 1 if successful.
+ */
+int bech32_hrp_init(bech32_hrp_state *state, const char *hrp);
 
 /** Encode a SegWit address
  *
@@ -46,6 +63,20 @@ int segwit_addr_encode(
     size_t prog_len
 );
 
+/** Encode a SegWit address with a precomputed human readable part
+ *
+ *  Same as segwit_addr_encode, with the state returned by bech32_hrp_init for
+ *  the human readable part; it saves hashing the human readable part again when
+ *  encoding many addresses.
+ */
+int segwit_addr_encode_with_hrp(
+    char *output,
+    const bech32_hrp_state *hrp,
+    int ver,
+    const uint8_t *prog,
+    size_t prog_len
+);
+
 /** Decode a SegWit address
  *
  *  Out: ver:      Pointer to an int that will be updated to contain the witness
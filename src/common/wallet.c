@@ -27,40 +27,6 @@ typedef struct {
     const char *name;
 } token_descriptor_t;
 
-static const token_descriptor_t KNOWN_TOKENS[] = {
-    {.type = TOKEN_SH, .name = "sh"},
-    {.type = TOKEN_WSH, .name = "wsh"},
-    {.type = TOKEN_PKH, .name = "pkh"},
-    {.type = TOKEN_WPKH, .name = "wpkh"},
-    {.type = TOKEN_MULTI, .name = "multi"},
-    {.type = TOKEN_MULTI_A, .name = "multi_a"},
-    {.type = TOKEN_SORTEDMULTI, .name = "sortedmulti"},
-    {.type = TOKEN_SORTEDMULTI_A, .name = "sortedmulti_a"},
-    {.type = TOKEN_TR, .name = "tr"},
-
-    // miniscript tokens (except wrappers)
-    {.type = TOKEN_0, .name = "0"},
-    {.type = TOKEN_1, .name = "1"},
-    {.type = TOKEN_PK, .name = "pk"},
-    {.type = TOKEN_PK_K, .name = "pk_k"},
-    {.type = TOKEN_PK_H, .name = "pk_h"},
-    {.type = TOKEN_OLDER, .name = "older"},
-    {.type = TOKEN_AFTER, .name = "after"},
-    {.type = TOKEN_SHA256, .name = "sha256"},
-    {.type = TOKEN_HASH256, .name = "hash256"},
-    {.type = TOKEN_RIPEMD160, .name = "ripemd160"},
-    {.type = TOKEN_HASH160, .name = "hash160"},
-    {.type = TOKEN_ANDOR, .name = "andor"},
-    {.type = TOKEN_AND_V, .name = "and_v"},
-    {.type = TOKEN_AND_B, .name = "and_b"},
-    {.type = TOKEN_AND_N, .name = "and_n"},
-    {.type = TOKEN_OR_B, .name = "or_b"},
-    {.type = TOKEN_OR_C, .name = "or_c"},
-    {.type = TOKEN_OR_D, .name = "or_d"},
-    {.type = TOKEN_OR_I, .name = "or_i"},
-    {.type = TOKEN_THRESH, .name = "thresh"},
-};
-
 // lookup table for characters that represent a valid miniscript wrapper fragment
 const bool is_valid_miniscript_wrapper[] = {
     1,  // "a"
@@ -178,7 +144,51 @@ static uint8_t lowercase_hex_to_int(char c) {
     return (uint8_t) (is_digit(c) ? c - '0' : c - 'a' + 10);
 }
 
+// The state of a descriptor template being parsed by parse_descriptor_template_stream.
+typedef struct {
+    buffer_t window;  // the buffer read by the parser, with the bytes of the template in data
+    uint8_t data[DESCRIPTOR_TEMPLATE_WINDOW_SIZE];
+    descriptor_template_read_callback_t read;
+    void *read_state;
+    size_t bytes_remaining;  // the bytes of the template that were not read in the window yet
+    bool has_error;          // whether the read callback failed
+} template_stream_t;
+
+// the descriptor template being streamed, if any
+static template_stream_t *current_template_stream = NULL;
+
+/**
+ * If in_buf is the window of the descriptor template being streamed, and less than
+ * DESCRIPTOR_TEMPLATE_LOOKAHEAD bytes can be read from it, moves the unread bytes at the beginning
+ * of the window and fills the rest of it with the next bytes of the template. It is called before
+ * reading or peeking from the descriptor template; it does nothing for a template in a buffer.
+ */
+static void refill_input(buffer_t *in_buf) {
+    template_stream_t *stream = current_template_stream;
+    if (stream == NULL || in_buf != &stream->window || stream->bytes_remaining == 0 ||
+        buffer_can_read(in_buf, DESCRIPTOR_TEMPLATE_LOOKAHEAD)) {
+        return;
+    }
+
+    size_t n_unread = in_buf->size - in_buf->offset;
+    memmove(stream->data, stream->data + in_buf->offset, n_unread);
+
+    size_t n_read = MIN(sizeof(stream->data) - n_unread, stream->bytes_remaining);
+    if (0 > stream->read(stream->read_state, stream->data + n_unread, n_read)) {
+        // the parser fails, as the unread bytes are not enough for the next element
+        stream->has_error = true;
+        stream->bytes_remaining = 0;
+        n_read = 0;
+    }
+    stream->bytes_remaining -= n_read;
+
+    in_buf->offset = 0;
+    in_buf->size = n_unread + n_read;
+}
+
 static bool consume_character(buffer_t *in_buf, char expected) {
+    refill_input(in_buf);
+
     char c;
     if (!buffer_peek(in_buf, (uint8_t *) &c) || c != expected) {
         return false;
@@ -188,6 +198,8 @@ static bool consume_character(buffer_t *in_buf, char expected) {
 }
 
 static bool consume_characters(buffer_t *in_buf, const char *expected, size_t len) {
+    refill_input(in_buf);
+
     char c;
     for (size_t i = 0; i < len; i++) {
         if (!buffer_peek_n(in_buf, i, (uint8_t *) &c) || c != expected[i]) {
@@ -205,6 +217,8 @@ static bool consume_characters(buffer_t *in_buf, const char *expected, size_t le
  * - the next character is _not_ in [a-zAZ0-9_]
  */
 static size_t read_token(buffer_t *buffer, char *out, size_t out_len) {
+    refill_input(buffer);
+
     size_t word_len = 0;
     char c;
     while (word_len < out_len && buffer_peek(buffer, (uint8_t *) &c) &&
@@ -215,9 +229,130 @@ static size_t read_token(buffer_t *buffer, char *out, size_t out_len) {
     return word_len;
 }
 
+#define TOKEN_DESCRIPTOR(token_type, token_name) \
+    ((token_descriptor_t){.type = token_type, .name = token_name})
+
+/**
+ * Returns the only known token that a word of length word_len can be, as told by its length and at
+ * most two of its characters; the type is TOKEN_INVALID if there is none. The word must still be
+ * compared with the name of the returned token.
+ *
+ * This replaces a linear search among all the tokens, as parse_script calls it for each fragment
+ * of the descriptor template. When adding a token, add it to the case of its length, and make sure
+ * that the characters that are switched on still tell apart all the tokens of that length.
+ */
+static token_descriptor_t get_token_candidate(const char *word, size_t word_len) {
+    switch (word_len) {
+        case 1:
+            switch (word[0]) {
+                case '0':
+                    return TOKEN_DESCRIPTOR(TOKEN_0, "0");
+                case '1':
+                    return TOKEN_DESCRIPTOR(TOKEN_1, "1");
+            }
+            break;
+        case 2:
+            switch (word[0]) {
+                case 's':
+                    return TOKEN_DESCRIPTOR(TOKEN_SH, "sh");
+                case 't':
+                    return TOKEN_DESCRIPTOR(TOKEN_TR, "tr");
+                case 'p':
+                    return TOKEN_DESCRIPTOR(TOKEN_PK, "pk");
+            }
+            break;
+        case 3:
+            switch (word[0]) {
+                case 'w':
+                    return TOKEN_DESCRIPTOR(TOKEN_WSH, "wsh");
+                case 'p':
+                    return TOKEN_DESCRIPTOR(TOKEN_PKH, "pkh");
+            }
+            break;
+        case 4:
+            switch (word[0]) {
+                case 'w':
+                    return TOKEN_DESCRIPTOR(TOKEN_WPKH, "wpkh");
+                case 'p':
+                    // pk_k, pk_h
+                    switch (word[3]) {
+                        case 'k':
+                            return TOKEN_DESCRIPTOR(TOKEN_PK_K, "pk_k");
+                        case 'h':
+                            return TOKEN_DESCRIPTOR(TOKEN_PK_H, "pk_h");
+                    }
+                    break;
+                case 'o':
+                    // or_b, or_c, or_d, or_i
+                    switch (word[3]) {
+                        case 'b':
+                            return TOKEN_DESCRIPTOR(TOKEN_OR_B, "or_b");
+                        case 'c':
+                            return TOKEN_DESCRIPTOR(TOKEN_OR_C, "or_c");
+                        case 'd':
+                            return TOKEN_DESCRIPTOR(TOKEN_OR_D, "or_d");
+                        case 'i':
+                            return TOKEN_DESCRIPTOR(TOKEN_OR_I, "or_i");
+                    }
+                    break;
+            }
+            break;
+        case 5:
+            switch (word[0]) {
+                case 'm':
+                    return TOKEN_DESCRIPTOR(TOKEN_MULTI, "multi");
+                case 'o':
+                    return TOKEN_DESCRIPTOR(TOKEN_OLDER, "older");
+                case 'a':
+                    if (word[1] == 'f') {
+                        return TOKEN_DESCRIPTOR(TOKEN_AFTER, "after");
+                    }
+                    // andor, and_v, and_b, and_n
+                    switch (word[4]) {
+                        case 'r':
+                            return TOKEN_DESCRIPTOR(TOKEN_ANDOR, "andor");
+                        case 'v':
+                            return TOKEN_DESCRIPTOR(TOKEN_AND_V, "and_v");
+                        case 'b':
+                            return TOKEN_DESCRIPTOR(TOKEN_AND_B, "and_b");
+                        case 'n':
+                            return TOKEN_DESCRIPTOR(TOKEN_AND_N, "and_n");
+                    }
+                    break;
+            }
+            break;
+        case 6:
+            switch (word[0]) {
+                case 's':
+                    return TOKEN_DESCRIPTOR(TOKEN_SHA256, "sha256");
+                case 't':
+                    return TOKEN_DESCRIPTOR(TOKEN_THRESH, "thresh");
+            }
+            break;
+        case 7:
+            // multi_a, hash256, hash160
+            switch (word[4]) {
+                case 'i':
+                    return TOKEN_DESCRIPTOR(TOKEN_MULTI_A, "multi_a");
+                case '2':
+                    return TOKEN_DESCRIPTOR(TOKEN_HASH256, "hash256");
+                case '1':
+                    return TOKEN_DESCRIPTOR(TOKEN_HASH160, "hash160");
+            }
+            break;
+        case 9:
+            return TOKEN_DESCRIPTOR(TOKEN_RIPEMD160, "ripemd160");
+        case 11:
+            return TOKEN_DESCRIPTOR(TOKEN_SORTEDMULTI, "sortedmulti");
+        case 13:
+            return TOKEN_DESCRIPTOR(TOKEN_SORTEDMULTI_A, "sortedmulti_a");
+    }
+    return TOKEN_DESCRIPTOR(TOKEN_INVALID, "");
+}
+
 /**
  * Read the next word from buffer (or up to MAX_TOKEN_LENGTH characters), and
- * returns the index of this word in KNOWN_TOKENS if found; TOKEN_INVALID otherwise.
+ * returns the type of the token with this name if any; TOKEN_INVALID otherwise.
  */
 static PolicyNodeType parse_token(buffer_t *buffer) {
     char word[MAX_TOKEN_LENGTH + 1];
@@ -225,12 +360,11 @@ static PolicyNodeType parse_token(buffer_t *buffer) {
     size_t word_len = read_token(buffer, word, MAX_TOKEN_LENGTH);
     word[word_len] = '\0';
 
-    for (unsigned int i = 0; i < sizeof(KNOWN_TOKENS) / sizeof(KNOWN_TOKENS[0]); i++) {
-        if (strncmp((const char *) PIC(KNOWN_TOKENS[i].name), word, MAX_TOKEN_LENGTH) == 0) {
-            return ((const token_descriptor_t *) PIC(&KNOWN_TOKENS[i]))->type;
-        }
+    token_descriptor_t candidate = get_token_candidate(word, word_len);
+    if (candidate.type == TOKEN_INVALID || strcmp(candidate.name, word) != 0) {
+        return TOKEN_INVALID;
     }
-    return TOKEN_INVALID;
+    return candidate.type;
 }
 
 /**
@@ -240,6 +374,8 @@ static PolicyNodeType parse_token(buffer_t *buffer) {
  * The read number is saved into *out on success.
  */
 static int parse_unsigned_decimal(buffer_t *buffer, uint32_t *out) {
+    refill_input(buffer);
+
     uint8_t c;
     size_t result = 0;
     int digits_read = 0;
@@ -275,6 +411,8 @@ static int parse_unsigned_decimal(buffer_t *buffer, uint32_t *out) {
  * 2*n characters can be read.
  */
 static int buffer_read_hex_hash(buffer_t *buffer, uint8_t *out, size_t n) {
+    refill_input(buffer);
+
     if (!buffer_can_read(buffer, 2 * n)) {
         return -1;
     }
@@ -405,6 +543,8 @@ int parse_policy_map_key_info(buffer_t *buffer, policy_map_key_info_t *out, int
 }
 
 static int parse_placeholder(buffer_t *in_buf, int version, policy_node_key_placeholder_t *out) {
+    refill_input(in_buf);
+
     char c;
     if (!buffer_read_u8(in_buf, (uint8_t *) &c) || c != '@') {
         return WITH_ERROR(-1, "Expected key placeholder starting with '@'");
@@ -510,8 +650,10 @@ static int parse_child_scripts(buffer_t *in_buf,
     return 0;
 }
 
+#ifndef SIMPLE_POLICIES_ONLY
 // forward-declaration, since it's used in parse_script
 static int parse_tree(buffer_t *in_buf, buffer_t *out_buf, int version, size_t depth);
+#endif
 
 /**
  * Parses a SCRIPT expression from the in_buf buffer, allocating the nodes and variables in out_buf.
@@ -522,6 +664,9 @@ static int parse_script(buffer_t *in_buf,
                         int version,
                         size_t depth,
                         unsigned int context_flags) {
+    refill_input(in_buf);
+
+#ifndef SIMPLE_POLICIES_ONLY
     int n_wrappers = 0;
 
     policy_node_t *outermost_node = (policy_node_t *) buffer_get_cur(out_buf);
@@ -599,6 +744,7 @@ static int parse_script(buffer_t *in_buf,
             n_wrappers = 0;  // it was not a wrapper
         }
     }
+#endif
 
     // We read the token, we'll do different parsing based on what token we find
     PolicyNodeType token = parse_token(in_buf);
@@ -616,6 +762,23 @@ static int parse_script(buffer_t *in_buf,
         }
     }
 
+#ifdef SIMPLE_POLICIES_ONLY
+    // whitelist of the tokens of the single-signature and multisig policies, the only ones that
+    // are compiled in
+    switch (token) {
+        case TOKEN_PKH:
+        case TOKEN_WPKH:
+        case TOKEN_SH:
+        case TOKEN_WSH:
+        case TOKEN_TR:
+        case TOKEN_MULTI:
+        case TOKEN_SORTEDMULTI:
+            break;
+        default:
+            return WITH_ERROR(-1, "Token not supported in this build");
+    }
+#endif
+
     if (context_flags & CONTEXT_WITHIN_SH) {
         // whitelist of allowed tokens within sh; in particular, no miniscript
         switch (token) {
@@ -657,6 +820,7 @@ static int parse_script(buffer_t *in_buf,
     policy_node_t *parsed_node;
 
     switch (token) {
+#ifndef SIMPLE_POLICIES_ONLY
         case TOKEN_0:
         case TOKEN_1: {
             policy_node_constant_t *node =
@@ -690,6 +854,7 @@ static int parse_script(buffer_t *in_buf,
 
             break;
         }
+#endif
         case TOKEN_SH:
         case TOKEN_WSH: {
             if (token == TOKEN_SH) {
@@ -730,6 +895,7 @@ static int parse_script(buffer_t *in_buf,
 
             break;
         }
+#ifndef SIMPLE_POLICIES_ONLY
         case TOKEN_SHA256:
         case TOKEN_HASH256: {
             policy_node_with_hash_256_t *node =
@@ -1261,15 +1427,15 @@ static int parse_script(buffer_t *in_buf,
             }
 
             node->n = 0;
-            node->scriptlist =
+            policy_node_scriptlist_t *cur =
                 (policy_node_scriptlist_t *) buffer_alloc(out_buf,
                                                           sizeof(policy_node_scriptlist_t),
                                                           true);
-            if (node->scriptlist == NULL) {
+            if (cur == NULL) {
                 return WITH_ERROR(-1, "Out of memory");
             }
-            policy_node_scriptlist_t *cur = node->scriptlist;
-            cur->next = NULL;
+            init_relative_ptr(&node->scriptlist, cur);
+            cur->next.offset = 0;
 
             int count_z = 0;
             int count_o = 0;
@@ -1318,16 +1484,17 @@ static int parse_script(buffer_t *in_buf,
 
                 // peek, if next character is ',', consume it and exit
                 if (consume_character(in_buf, ',')) {
-                    cur->next =
+                    policy_node_scriptlist_t *next =
                         (policy_node_scriptlist_t *) buffer_alloc(out_buf,
                                                                   sizeof(policy_node_scriptlist_t),
                                                                   true);
-                    if (cur->next == NULL) {
+                    if (next == NULL) {
                         return WITH_ERROR(-1, "Out of memory");
                     }
 
-                    cur = cur->next;
-                    cur->next = NULL;
+                    init_relative_ptr(&cur->next, next);
+                    cur = next;
+                    cur->next.offset = 0;
                 } else {
                     // no more scripts to parse
                     break;
@@ -1349,6 +1516,7 @@ static int parse_script(buffer_t *in_buf,
 
             break;
         }
+#endif
         case TOKEN_PK:
         case TOKEN_PKH:
         case TOKEN_PK_K:
@@ -1362,12 +1530,13 @@ static int parse_script(buffer_t *in_buf,
                 return WITH_ERROR(-1, "Out of memory");
             }
 
-            node->key_placeholder = (policy_node_key_placeholder_t *)
+            policy_node_key_placeholder_t *key_placeholder = (policy_node_key_placeholder_t *)
                 buffer_alloc(out_buf, sizeof(policy_node_key_placeholder_t), true);
 
-            if (node->key_placeholder == NULL) {
+            if (key_placeholder == NULL) {
                 return WITH_ERROR(-1, "Out of memory");
             }
+            init_relative_ptr(&node->key_placeholder, key_placeholder);
 
             if (token == TOKEN_WPKH) {
                 if (depth > 0 && ((context_flags & CONTEXT_WITHIN_SH) == 0)) {
@@ -1379,7 +1548,7 @@ static int parse_script(buffer_t *in_buf,
 
             node->base.type = token;
 
-            if (0 > parse_placeholder(in_buf, version, node->key_placeholder)) {
+            if (0 > parse_placeholder(in_buf, version, key_placeholder)) {
                 return WITH_ERROR(-1, "Couldn't parse key placeholder");
             }
 
@@ -1442,27 +1611,31 @@ static int parse_script(buffer_t *in_buf,
                 return WITH_ERROR(-1, "Out of memory");
             }
 
-            node->key_placeholder = (policy_node_key_placeholder_t *)
+            policy_node_key_placeholder_t *key_placeholder = (policy_node_key_placeholder_t *)
                 buffer_alloc(out_buf, sizeof(policy_node_key_placeholder_t), true);
 
-            if (node->key_placeholder == NULL) {
+            if (key_placeholder == NULL) {
                 return WITH_ERROR(-1, "Out of memory");
             }
+            init_relative_ptr(&node->key_placeholder, key_placeholder);
 
-            if (0 > parse_placeholder(in_buf, version, node->key_placeholder)) {
+            if (0 > parse_placeholder(in_buf, version, key_placeholder)) {
                 return WITH_ERROR(-1, "Couldn't parse key placeholder");
             }
 
+            refill_input(in_buf);
+
             uint8_t c;
             if (!buffer_peek(in_buf, &c)) {
                 return WITH_ERROR(-1, "buffer exhausted too early while parsing tr");
             }
+#ifndef SIMPLE_POLICIES_ONLY
             if (c == ',') {
                 // Parse a TREE node
                 buffer_seek_cur(in_buf, 1);  // skip ','
 
                 buffer_alloc(out_buf, 0, true);  // ensure alignment of current pointer
-                node->tree = (policy_node_tree_t *) buffer_get_cur(out_buf);
+                init_relative_ptr(&node->tree, buffer_get_cur(out_buf));
 
                 if (0 > parse_tree(in_buf, out_buf, version, depth + 1)) {
                     return WITH_ERROR(-1, "Failed to parse TREE expression");
@@ -1472,8 +1645,15 @@ static int parse_script(buffer_t *in_buf,
                 if (c != ')') {
                     return WITH_ERROR(-1, "Failed to parse tr");
                 }
-                node->tree = NULL;
+                node->tree.offset = 0;
             }
+#else
+            // the taptrees are not compiled in, only tr(KP)
+            if (c != ')') {
+                return WITH_ERROR(-1, "Taproot scripts are not supported in this build");
+            }
+            node->tree.offset = 0;
+#endif
 
             parsed_node = (policy_node_t *) node;
 
@@ -1483,6 +1663,7 @@ static int parse_script(buffer_t *in_buf,
 
             break;
         }
+#ifndef SIMPLE_POLICIES_ONLY
         case TOKEN_OLDER:
         case TOKEN_AFTER: {
             policy_node_with_uint32_t *node =
@@ -1513,6 +1694,7 @@ static int parse_script(buffer_t *in_buf,
 
             break;
         }
+#endif
         case TOKEN_MULTI:
         case TOKEN_MULTI_A:
         case TOKEN_SORTEDMULTI:
@@ -1550,10 +1732,12 @@ static int parse_script(buffer_t *in_buf,
             // We allocate the array of key indices at the current position in the output buffer
             // (on success)
             buffer_alloc(out_buf, 0, true);  // ensure alignment of current pointer
-            node->key_placeholders = (policy_node_key_placeholder_t *) buffer_get_cur(out_buf);
+            init_relative_ptr(&node->key_placeholders, buffer_get_cur(out_buf));
 
             node->n = 0;
             while (true) {
+                refill_input(in_buf);
+
                 uint8_t c;
                 // If the next character is a ')', we exit and leave it in the buffer
                 if (buffer_peek(in_buf, &c) && c == ')') {
@@ -1583,7 +1767,10 @@ static int parse_script(buffer_t *in_buf,
             }
 
             // check integrity of k and n
-            if (!(1 <= node->k && node->k <= node->n && node->n <= MAX_PUBKEYS_PER_MULTISIG)) {
+            int16_t max_n = (token == TOKEN_MULTI_A || token == TOKEN_SORTEDMULTI_A)
+                                ? MAX_PUBKEYS_PER_MULTI_A
+                                : MAX_PUBKEYS_PER_MULTISIG;
+            if (!(1 <= node->k && node->k <= node->n && node->n <= max_n)) {
                 return WITH_ERROR(-1, "Invalid k and/or n");
             }
 
@@ -1612,10 +1799,12 @@ static int parse_script(buffer_t *in_buf,
         }
     }
 
+    refill_input(in_buf);
     if (depth == 0 && buffer_can_read(in_buf, 1)) {
         return WITH_ERROR(-1, "Input buffer too long");
     }
 
+#ifndef SIMPLE_POLICIES_ONLY
     // if there was one or more wrappers, the script of the most internal node must point
     // to the parsed node
     if (inner_wrapper != NULL) {
@@ -1789,56 +1978,93 @@ static int parse_script(buffer_t *in_buf,
                 return WITH_ERROR(-1, "unreachable code reached");
         }
     }
+#else
+    (void) parsed_node;  // only needed for the wrappers
+#endif
 
     return 0;
 }
 
+#ifndef SIMPLE_POLICIES_ONLY
 // Parses a TREE expression inside tr()
 // `depth` here refers to the depth inside the policy, therefore it starts at 1 for the taptree
+// The tree is parsed iteratively, keeping the inner nodes on the path to the current subtree in a
+// bounded array, so that the stack usage does not depend on the depth of the tree; the recursion
+// is only in the SCRIPT of each leaf.
 static int parse_tree(buffer_t *in_buf, buffer_t *out_buf, int version, size_t depth) {
     // out_buf must be aligned before calling this function
 
-    if (depth > MAX_TAPTREE_POLICY_DEPTH) {
-        return WITH_ERROR(-1, "Taptree policy depth limit exceeded");
-    }
+    // the inner nodes on the path to the current subtree, and whether it is their right subtree
+    policy_node_tree_t *path[MAX_TAPTREE_POLICY_DEPTH];
+    bool is_right_subtree[MAX_TAPTREE_POLICY_DEPTH];
+    size_t path_len = 0;
 
-    if (!buffer_is_cur_aligned(out_buf)) {
-        return WITH_ERROR(-1, "out_buf not aligned");
-    }
+    while (true) {
+        // parse the TREE starting at the current position, at depth `depth + path_len`
+        if (depth + path_len > MAX_TAPTREE_POLICY_DEPTH) {
+            return WITH_ERROR(-1, "Taptree policy depth limit exceeded");
+        }
 
-    policy_node_tree_t *tree_node =
-        (policy_node_tree_t *) buffer_alloc(out_buf, sizeof(policy_node_tree_t), true);
+        if (!buffer_is_cur_aligned(out_buf)) {
+            return WITH_ERROR(-1, "out_buf not aligned");
+        }
 
-    if (tree_node == NULL) {
-        return WITH_ERROR(-1, "Out of memory");
-    }
+        policy_node_tree_t *tree_node =
+            (policy_node_tree_t *) buffer_alloc(out_buf, sizeof(policy_node_tree_t), true);
 
-    uint8_t c;
+        if (tree_node == NULL) {
+            return WITH_ERROR(-1, "Out of memory");
+        }
 
-    // the first character must be a '{'
-    if (!buffer_peek(in_buf, &c)) {
-        return WITH_ERROR(-1, "buffer ended too early");
-    }
+        refill_input(in_buf);
+
+        uint8_t c;
+
+        // the first character must be a '{'
+        if (!buffer_peek(in_buf, &c)) {
+            return WITH_ERROR(-1, "buffer ended too early");
+        }
+
+        if (c == '{') {
+            // a {TREE,TREE}: its first TREE expression is parsed next
+            tree_node->is_leaf = false;
+            buffer_seek_cur(in_buf, 1);  // skip '{'
+
+            buffer_alloc(out_buf, 0, true);  // ensure alignment of current pointer
+            init_relative_ptr(&tree_node->left_tree, buffer_get_cur(out_buf));
+
+            // cannot overflow, as depth >= 1 and depth + path_len <= MAX_TAPTREE_POLICY_DEPTH
+            path[path_len] = tree_node;
+            is_right_subtree[path_len] = false;
+            ++path_len;
+            continue;
+        }
 
-    if (c != '{') {
         // parse a SCRIPT
         tree_node->is_leaf = true;
 
         buffer_alloc(out_buf, 0, true);  // ensure alignment of current pointer
         init_relative_ptr(&tree_node->script, buffer_get_cur(out_buf));
-        if (0 > parse_script(in_buf, out_buf, version, depth + 1, CONTEXT_WITHIN_TR)) {
+        if (0 > parse_script(in_buf,
+                             out_buf,
+                             version,
+                             depth + path_len + 1,
+                             CONTEXT_WITHIN_TR)) {
             return -1;
         }
-    } else {
-        // parse a {TREE,TREE}
-        tree_node->is_leaf = false;
-        buffer_seek_cur(in_buf, 1);  // skip '{'
 
-        // parse first TREE expression
-        buffer_alloc(out_buf, 0, true);  // ensure alignment of current pointer
-        init_relative_ptr(&tree_node->left_tree, buffer_get_cur(out_buf));
-        if (0 > parse_tree(in_buf, out_buf, version, depth + 1)) {
-            return -1;
+        // close the {TREE,TREE} whose second TREE expression is complete, until one whose first
+        // TREE expression is complete, whose second TREE expression is parsed next
+        while (path_len > 0 && is_right_subtree[path_len - 1]) {
+            // the next character must be a '}'
+            if (!consume_character(in_buf, '}')) {
+                return WITH_ERROR(-1, "Expected a '}'");
+            }
+            --path_len;
+        }
+
+        if (path_len == 0) {
+            return 0;
         }
 
         // the next character must be a comma
@@ -1846,21 +2072,12 @@ static int parse_tree(buffer_t *in_buf, buffer_t *out_buf, int version, size_t d
             return WITH_ERROR(-1, "Expected a comma");
         }
 
-        // parse the second TREE expression
         buffer_alloc(out_buf, 0, true);  // ensure alignment of current pointer
-        init_relative_ptr(&tree_node->right_tree, buffer_get_cur(out_buf));
-        if (0 > parse_tree(in_buf, out_buf, version, depth + 1)) {
-            return -1;
-        }
-
-        // the next character must be a '}'
-        if (!consume_character(in_buf, '}')) {
-            return WITH_ERROR(-1, "Expected a '}'");
-        }
+        init_relative_ptr(&path[path_len - 1]->right_tree, buffer_get_cur(out_buf));
+        is_right_subtree[path_len - 1] = true;
     }
-
-    return 0;
 }
+#endif
 
 int parse_descriptor_template(buffer_t *in_buf, void *out, size_t out_len, int version) {
     if ((unsigned long) out % 4 != 0) {
@@ -1876,6 +2093,29 @@ int parse_descriptor_template(buffer_t *in_buf, void *out, size_t out_len, int v
     return parse_script(in_buf, &out_buf, version, 0, 0);
 }
 
+int parse_descriptor_template_stream(descriptor_template_read_callback_t read,
+                                     void *read_state,
+                                     size_t template_len,
+                                     void *out,
+                                     size_t out_len,
+                                     int version) {
+    template_stream_t stream = {.read = read,
+                                .read_state = read_state,
+                                .bytes_remaining = template_len,
+                                .has_error = false};
+    stream.window = buffer_create(stream.data, 0);  // filled on the first read
+
+    current_template_stream = &stream;
+    int res = parse_descriptor_template(&stream.window, out, out_len, version);
+    current_template_stream = NULL;
+
+    if (stream.has_error) {
+        return WITH_ERROR(-1, "Failed reading the descriptor template");
+    }
+    return res;
+}
+
+#ifndef SIMPLE_POLICIES_ONLY
 /**
  * Convenience function that returns a + b, except:
  * - returns -1 if any of a and b is negative
@@ -1906,91 +2146,128 @@ static int16_t maxcheck(int16_t a, int16_t b) {
 // Maximum supported value for n in a thresh miniscript operator (technical limitation)
 #define MAX_N_IN_THRESH 128
 
-// Separated from the main function as it is stack-intensive, therefore we allocate large buffers
-// into the CXRAM section. There is some repeated work ()
-static int compute_thresh_ops(const policy_node_thresh_t *node, miniscript_ops_t *out) {
-#ifdef USE_CXRAM_SECTION
-    // allocate buffers inside the cxram section; safe as there are no syscalls here
-    uint16_t *sats = (uint16_t *) get_cxram_buffer();
-    uint16_t *next_sats =
-        (uint16_t *) (get_cxram_buffer() + sizeof(uint16_t) * (MAX_N_IN_THRESH + 1 + 1));
-#else
-    uint16_t sats[MAX_N_IN_THRESH + 1 + 1] = {0};
-    uint16_t next_sats[MAX_N_IN_THRESH + 1 + 1] = {0};  // it temporarily uses an extra element
-#endif
-
-    if (node->n > MAX_N_IN_THRESH) return -1;
+/**
+ * Updates the costs of a thresh after adding its child of index `n_children`, whose satisfaction
+ * and dissatisfaction costs are `sat` and `dsat`. `sats[j]` is the cost with j of the children
+ * added so far satisfied, and the others dissatisfied; only the costs for j from 0 to k are
+ * kept, as the others never contribute to the costs of the thresh.
+ */
+static void add_thresh_child_costs(int16_t *sats,
+                                   int k,
+                                   int n_children,
+                                   int16_t sat,
+                                   int16_t dsat) {
+    // computed in place, from the largest j, as sats[j] depends on sats[j] and sats[j - 1]
+    if (n_children < k) {
+        sats[n_children + 1] = sumcheck(sats[n_children], sat);
+    }
+    for (int j = n_children < k ? n_children : k; j >= 1; j--) {
+        sats[j] = maxcheck(sumcheck(sats[j], dsat), sumcheck(sats[j - 1], sat));
+    }
+    sats[0] = sumcheck(sats[0], dsat);
+}
 
-    policy_node_scriptlist_t *cur = node->scriptlist;
+/**
+ * Computes the properties of a thresh in a single pass over its children, analyzing each of them
+ * only once. `ops_sats` and `ss_sats` must have room for k + 1 costs, and are kept while the
+ * children are analyzed.
+ */
+static int compute_thresh_ext_info_with_buffers(const policy_node_thresh_t *node,
+                                                policy_node_ext_info_t *out,
+                                                int16_t *ops_sats,
+                                                int16_t *ss_sats) {
+    const policy_node_scriptlist_t *cur = r_policy_node_scriptlist(&node->scriptlist);
 
-    out->count = 0;
+    int count_s = 0;
+    int count_e = 0;
+    int count_m = 0;
+    size_t children_scriptsize = 0;
+    int n_children = 0;
 
-    sats[0] = 0;
-    int sats_size = 1;
+    ops_sats[0] = 0;
+    ss_sats[0] = 0;
 
     while (cur != NULL) {
         policy_node_ext_info_t t;
         if (0 > compute_miniscript_policy_ext_info(resolve_node_ptr(&cur->script), &t)) return -1;
 
-        out->count += t.ops.count + 1;
+        if (t.e) {
+            ++count_e;
+        }
+        if (t.s) {
+            ++count_s;
+        }
+        if (t.m) {
+            ++count_m;
+        }
+        cur = r_policy_node_scriptlist(&cur->next);
+
+        out->g |= t.g;
+        out->h |= t.h;
+        out->i |= t.i;
+        out->j |= t.j;
+
+        out->k &= t.k;  // if any child doesn't have k, thresh doesn't have k
 
-        next_sats[0] = sumcheck(sats[0], t.ops.dsat);
-        for (int j = 1; j < sats_size; j++) {
-            next_sats[j] =
-                maxcheck(sumcheck(sats[j], t.ops.dsat), sumcheck(sats[j - 1], t.ops.sat));
+        // if any two children have mixed timelocks, thresh doesn't have k
+        if (node->k >= 2 &&
+            ((t.g & out->h) || (t.h & out->g) || (t.i & out->j) || (t.j & out->i))) {
+            out->k = 0;
         }
-        next_sats[sats_size] = sumcheck(sats[sats_size - 1], t.ops.sat);
 
-        ++sats_size;
-        memmove(sats, next_sats, sats_size * sizeof(sats[0]));
+        children_scriptsize += t.script_size;
 
-        cur = cur->next;
+        out->ops.count += t.ops.count + 1;
+        add_thresh_child_costs(ops_sats, node->k, n_children, t.ops.sat, t.ops.dsat);
+        add_thresh_child_costs(ss_sats, node->k, n_children, t.ss.sat, t.ss.dsat);
+
+        ++n_children;
     }
 
-    out->sat = sats[node->k];
-    out->dsat = sats[0];
-    return 0;
-}
+    int count_not_s = node->n - count_s;
 
-// Separated from the main function as it is stack-intensive, therefore we allocate large buffers
-// into the CXRAM section. There is some repeated work ()
-static int compute_thresh_stacksize(const policy_node_thresh_t *node, miniscript_stacksize_t *out) {
-#ifdef USE_CXRAM_SECTION
-    // allocate buffers inside the cxram section; safe as there are no syscalls here
-    uint16_t *sats = (uint16_t *) get_cxram_buffer();
-    uint16_t *next_sats =
-        (uint16_t *) (get_cxram_buffer() + sizeof(uint16_t) * (MAX_N_IN_THRESH + 1 + 1));
-#else
-    uint16_t sats[MAX_N_IN_THRESH + 1 + 1] = {0};
-    uint16_t next_sats[MAX_N_IN_THRESH + 1 + 1] = {0};  // it temporarily uses an extra element
-#endif
+    out->s = count_not_s <= node->k - 1 ? 1 : 0;
+    out->e = count_s == node->n ? 1 : 0;
 
-    if (node->n > MAX_N_IN_THRESH) return -1;
+    out->m = (count_e == node->n && count_not_s <= node->k) ? 1 : 0;
 
-    policy_node_scriptlist_t *cur = node->scriptlist;
+    out->x = 0;
 
-    sats[0] = 0;
-    int sats_size = 1;
+    out->script_size = children_scriptsize + n_children + get_push_script_size(node->k);
 
-    while (cur != NULL) {
-        policy_node_ext_info_t t;
-        if (0 > compute_miniscript_policy_ext_info(resolve_node_ptr(&cur->script), &t)) return -1;
+    out->ops.sat = ops_sats[node->k];
+    out->ops.dsat = ops_sats[0];
+    out->ss.sat = ss_sats[node->k];
+    out->ss.dsat = ss_sats[0];
 
-        next_sats[0] = sumcheck(sats[0], t.ss.dsat);
-        for (int j = 1; j < sats_size; j++) {
-            next_sats[j] = maxcheck(sumcheck(sats[j], t.ss.dsat), sumcheck(sats[j - 1], t.ss.sat));
-        }
-        next_sats[sats_size] = sumcheck(sats[sats_size - 1], t.ss.sat);
+    return 0;
+}
 
-        ++sats_size;
-        memmove(sats, next_sats, sats_size * sizeof(sats[0]));
+// Separated from the main function as it is stack-intensive, therefore the costs are allocated
+// into the CXRAM section if available.
+static int compute_thresh_ext_info(const policy_node_thresh_t *node, policy_node_ext_info_t *out) {
+    if (node->n > MAX_N_IN_THRESH || node->k < 1 || node->k > node->n) return -1;
 
-        cur = cur->next;
+#ifdef USE_CXRAM_SECTION
+    // allocate buffers inside the cxram section; safe as there are no syscalls here. The costs of
+    // a thresh are kept while its children are analyzed, so nested thresh use consecutive buffers.
+    size_t mark = cxram_mark();
+    size_t costs_size = sizeof(int16_t) * (node->k + 1);
+    int16_t *ops_sats = (int16_t *) cxram_alloc(costs_size);
+    int16_t *ss_sats = (int16_t *) cxram_alloc(costs_size);
+    if (ops_sats == NULL || ss_sats == NULL) {
+        cxram_release(mark);
+        return WITH_ERROR(-1, "Nested thresh too large");
     }
 
-    out->sat = sats[node->k];
-    out->dsat = sats[0];
-    return 0;
+    int res = compute_thresh_ext_info_with_buffers(node, out, ops_sats, ss_sats);
+    cxram_release(mark);
+    return res;
+#else
+    int16_t ops_sats[MAX_N_IN_THRESH + 1];
+    int16_t ss_sats[MAX_N_IN_THRESH + 1];
+    return compute_thresh_ext_info_with_buffers(node, out, ops_sats, ss_sats);
+#endif
 }
 
 int compute_miniscript_policy_ext_info(const policy_node_t *policy_node,
@@ -2422,63 +2699,7 @@ int compute_miniscript_policy_ext_info(const policy_node_t *policy_node,
         }
         case TOKEN_THRESH: {
             const policy_node_thresh_t *node = (const policy_node_thresh_t *) policy_node;
-
-            policy_node_scriptlist_t *cur = node->scriptlist;
-
-            int count_s = 0;
-            int count_e = 0;
-            int count_m = 0;
-            size_t children_scriptsize = 0;
-            size_t n_children = 0;
-            while (cur != NULL) {
-                ++n_children;
-
-                policy_node_ext_info_t t;
-                if (0 > compute_miniscript_policy_ext_info(resolve_node_ptr(&cur->script), &t))
-                    return -1;
-
-                if (t.e) {
-                    ++count_e;
-                }
-                if (t.s) {
-                    ++count_s;
-                }
-                if (t.m) {
-                    ++count_m;
-                }
-                cur = cur->next;
-
-                out->g |= t.g;
-                out->h |= t.h;
-                out->i |= t.i;
-                out->j |= t.j;
-
-                out->k &= t.k;  // if any child doesn't have k, thresh doesn't have k
-
-                // if any two children have mixed timelocks, thresh doesn't have k
-                if (node->k >= 2 &&
-                    ((t.g & out->h) || (t.h & out->g) || (t.i & out->j) || (t.j & out->i))) {
-                    out->k = 0;
-                }
-
-                children_scriptsize += t.script_size;
-            }
-
-            int count_not_s = node->n - count_s;
-
-            out->s = count_not_s <= node->k - 1 ? 1 : 0;
-            out->e = count_s == node->n ? 1 : 0;
-
-            out->m = (count_e == node->n && count_not_s <= node->k) ? 1 : 0;
-
-            out->x = 0;
-
-            out->script_size = children_scriptsize + n_children + get_push_script_size(node->k);
-
-            if (0 > compute_thresh_ops(node, &out->ops)) return -1;
-            if (0 > compute_thresh_stacksize(node, &out->ss)) return -1;
-
-            return 0;
+            return compute_thresh_ext_info(node, out);
         }
         case TOKEN_A: {
             const policy_node_with_script_t *node = (const policy_node_with_script_t *) policy_node;
@@ -2706,6 +2927,7 @@ int compute_miniscript_policy_ext_info(const policy_node_t *policy_node,
             return -1;
     }
 }
+#endif
 
 #ifndef SKIP_FOR_CMOCKA
 
@@ -16,6 +16,11 @@
 // bitcoin-core supports up to 20, but we limit to 16 as bigger pushes require special handling.
 #define MAX_PUBKEYS_PER_MULTISIG 16
 
+// The maximum number of keys supported for multi_a and sortedmulti_a, as in BIP-387. The keys are
+// derived and pushed one at a time, so in practice the limit is the memory reserved for the parsed
+// policy (MAX_WALLET_POLICY_BYTES).
+#define MAX_PUBKEYS_PER_MULTI_A 999
+
 #define WALLET_POLICY_VERSION_V1 1  // the legacy version of the first release
 #define WALLET_POLICY_VERSION_V2 2  // the current full version
 
@@ -44,6 +49,12 @@
 #define MAX_WALLET_POLICY_BYTES           768
 #endif
 
+// Size of the window of the descriptor template that is kept in memory when it is streamed, and
+// minimum number of bytes that the parser can look ahead in the window, which is enough for the
+// longest element that is read at once (the 64 hexadecimal characters of a 32-byte hash).
+#define DESCRIPTOR_TEMPLATE_WINDOW_SIZE 96
+#define DESCRIPTOR_TEMPLATE_LOOKAHEAD   64
+
 #define MAX_DESCRIPTOR_TEMPLATE_LENGTH \
     MAX(MAX_DESCRIPTOR_TEMPLATE_LENGTH_V1, MAX_DESCRIPTOR_TEMPLATE_LENGTH_V2)
 
@@ -71,8 +82,10 @@
 #define MAX_WALLET_POLICY_SERIALIZED_LENGTH \
     MAX(MAX_WALLET_POLICY_SERIALIZED_LENGTH_V1, MAX_WALLET_POLICY_SERIALIZED_LENGTH_V2)
 
-// maximum depth of a taproot tree that we support
-#define MAX_TAPTREE_POLICY_DEPTH 4
+// maximum depth of a taproot tree that we support, counting its root as 1; therefore, the tapleaves
+// are at most at depth MAX_TAPTREE_POLICY_DEPTH - 1 in the sense of BIP-0341. Neither the parsing
+// nor the hashing of the tree recurse on its depth.
+#define MAX_TAPTREE_POLICY_DEPTH 9
 
 typedef struct {
     uint32_t master_key_derivation[MAX_BIP32_PATH_STEPS];
@@ -205,9 +218,11 @@ typedef struct policy_node_ext_info_s {
 // The various structures used to represent the wallet policy abstract syntax tree contain a lot
 // pointers; using a regular pointer would make each of them 4 bytes long, moreover causing
 // additional loss of memory due to padding. Instead, we use a 2-bytes relative pointer to point to
-// policy_nodes, representing a non-negative offset from the position of the structure itself.
-// This reduces the memory utilization of those pointers, and moreover it allows to reduce padding
-// in other structures, as they no longer contain 32-bit pointers.
+// policy_nodes, key placeholders and the other structures of the tree, representing a
+// non-negative offset from the position of the structure itself. This reduces the memory
+// utilization of those pointers, and moreover it allows to reduce padding in other structures, as
+// they no longer contain 32-bit pointers.
+// As no structure points to itself, a relative pointer with offset 0 is a null pointer.
 typedef struct ptr_rel_s {
     uint16_t offset;
 } ptr_rel_t;
@@ -263,7 +278,7 @@ typedef policy_node_with_script3_t policy_node_with_scripts_t;
 // 4 bytes
 typedef struct {
     struct policy_node_s base;
-    policy_node_key_placeholder_t *key_placeholder;
+    ptr_rel_t key_placeholder;  // pointer to a policy_node_key_placeholder_t
 } policy_node_with_key_t;
 
 // 8 bytes
@@ -272,28 +287,26 @@ typedef struct {
     uint32_t n;
 } policy_node_with_uint32_t;
 
-// 12 bytes
+// 8 bytes
 typedef struct {
-    struct policy_node_s base;  // type is TOKEN_MULTI or TOKEN_SORTEDMULTI
-    int16_t k;                  // threshold
-    int16_t n;                  // number of keys
-    policy_node_key_placeholder_t
-        *key_placeholders;  // pointer to array of exactly n key placeholders
+    struct policy_node_s base;   // type is TOKEN_MULTI or TOKEN_SORTEDMULTI
+    int16_t k;                   // threshold
+    int16_t n;                   // number of keys
+    ptr_rel_t key_placeholders;  // pointer to array of exactly n key placeholders
 } policy_node_multisig_t;
 
-// 8 bytes
+// 4 bytes
 typedef struct policy_node_scriptlist_s {
-    struct policy_node_scriptlist_s *next;
+    ptr_rel_t next;  // pointer to the next policy_node_scriptlist_s; null for the last one
     ptr_rel_t script;
 } policy_node_scriptlist_t;
 
-// 12 bytes, (+ 8 bytes for every script)
+// 8 bytes, (+ 4 bytes for every script)
 typedef struct {
     struct policy_node_s base;  // type is TOKEN_THRESH
     int16_t k;                  // threshold
     int16_t n;                  // number of child scripts
-    policy_node_scriptlist_t
-        *scriptlist;  // pointer to array of exactly n pointers to child scripts
+    ptr_rel_t scriptlist;       // pointer to a list of exactly n pointers to child scripts
 } policy_node_thresh_t;
 
 typedef struct {
@@ -319,10 +332,11 @@ typedef struct policy_node_tree_s {
     };
 } policy_node_tree_t;
 
+// 6 bytes
 typedef struct {
     struct policy_node_s base;
-    policy_node_key_placeholder_t *key_placeholder;
-    policy_node_tree_t *tree;  // NULL if tr(KP)
+    ptr_rel_t key_placeholder;  // pointer to a policy_node_key_placeholder_t
+    ptr_rel_t tree;             // pointer to a policy_node_tree_t; null if tr(KP)
 } policy_node_tr_t;
 
 // The following helpers function simplifies dealing with relative pointers to scripts
@@ -337,6 +351,28 @@ static inline const policy_node_t *resolve_node_ptr(const ptr_rel_t *ptr) {
     return (const void *) ((const uint8_t *) ptr + ptr->offset);
 }
 
+// Converts a relative pointer that might be null to the corresponding absolute pointer, or NULL
+static inline const void *resolve_nullable_ptr(const ptr_rel_t *ptr) {
+    return ptr->offset == 0 ? NULL : resolve_ptr(ptr);
+}
+
+// Typed versions of resolve_ptr for the relative pointers that do not point to a policy_node_t
+
+static inline const policy_node_key_placeholder_t *r_policy_node_key_placeholder(
+    const ptr_rel_t *ptr) {
+    return (const policy_node_key_placeholder_t *) resolve_ptr(ptr);
+}
+
+// Returns NULL for the null pointer of a tr(KP)
+static inline const policy_node_tree_t *r_policy_node_tree(const ptr_rel_t *ptr) {
+    return (const policy_node_tree_t *) resolve_nullable_ptr(ptr);
+}
+
+// Returns NULL for the null pointer after the last element of the list
+static inline const policy_node_scriptlist_t *r_policy_node_scriptlist(const ptr_rel_t *ptr) {
+    return (const policy_node_scriptlist_t *) resolve_nullable_ptr(ptr);
+}
+
 // Initializes a relative pointer so that it points to node.
 // IMPORTANT: the assumption is that node is located in memory at an address larger than
 // relative_ptr, and at an offset smaller than 65536. No error is detected otherwise, therefore this
@@ -392,6 +428,30 @@ int parse_policy_map_key_info(buffer_t *buffer, policy_map_key_info_t *out, int
  */
 int parse_descriptor_template(buffer_t *in_buf, void *out, size_t out_len, int version);
 
+/**
+ * Callback that reads the next bytes of a descriptor template being streamed; it must read exactly
+ * out_len bytes, as the caller never asks for more than the bytes that are left.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+typedef int (*descriptor_template_read_callback_t)(void *state, uint8_t *out, size_t out_len);
+
+/**
+ * Like parse_descriptor_template, but the descriptor template of length template_len is read
+ * incrementally with the read callback, instead of being loaded in a buffer. Only a window of
+ * DESCRIPTOR_TEMPLATE_WINDOW_SIZE bytes of the template is kept in memory while parsing.
+ *
+ * @return 0 on success; -1 in case of parsing error, if the read callback fails, if the output
+ * buffer is unaligned, or if it is too small.
+ */
+int parse_descriptor_template_stream(descriptor_template_read_callback_t read,
+                                     void *read_state,
+                                     size_t template_len,
+                                     void *out,
+                                     size_t out_len,
+                                     int version);
+
+#ifndef SIMPLE_POLICIES_ONLY
 /**
  * Computes additional properties of the given miniscript, to detect malleability and other security
  * properties to assess if the miniscript is sane.
@@ -402,6 +462,7 @@ int parse_descriptor_template(buffer_t *in_buf, void *out, size_t out_len, int v
  */
 int compute_miniscript_policy_ext_info(const policy_node_t *policy_node,
                                        policy_node_ext_info_t *out);
+#endif
 
 #ifndef SKIP_FOR_CMOCKA
 
@@ -14,7 +14,7 @@
  *   16-bit unsigned integer to write in output byte buffer as Big Endian.
  *
  */
-void write_u16_be(const uint8_t *ptr, size_t offset, uint16_t value);
+void write_u16_be(uint8_t *ptr, size_t offset, uint16_t value);
 
 /**
  * Write 32-bit unsigned integer value as Big Endian.
@@ -37,10 +37,22 @@
 #define MAX_SERIALIZED_PUBKEY_LENGTH 113
 
 /**
- * Maximum number of inputs supported while signing a transaction.
+ * Maximum number of inputs supported while signing a transaction, if they are all tracked in
+ * memory. In builds with HAVE_OFFLOADED_RECORDS, larger transactions are supported, and the records
+ * of their inputs are kept by the client.
  */
 #define MAX_N_INPUTS_CAN_SIGN 512
 
+/**
+ * Maximum number of messages signed with a single SIGN_MESSAGES command.
+ */
+#define MAX_N_SIGNED_MESSAGES 1000
+
+/**
+ * Maximum number of payees of a payee list registered with REGISTER_PAYEE_LIST.
+ */
+#define MAX_N_PAYEES 1000
+
 // SIGHASH flags
 #define SIGHASH_DEFAULT      0x00000000
 #define SIGHASH_ALL          0x00000001
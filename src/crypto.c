@@ -73,10 +73,22 @@ static const uint8_t secp256k1_sqr_exponent[] = {
     0x3f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
     0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xbf, 0xff, 0xff, 0x0c};
 
-/* BIP0341 tags for computing the tagged hashes when tweaking public keys */
-static const uint8_t BIP0341_taptweak_tag[] = {'T', 'a', 'p', 'T', 'w', 'e', 'a', 'k'};
-static const uint8_t BIP0341_tapbranch_tag[] = {'T', 'a', 'p', 'B', 'r', 'a', 'n', 'c', 'h'};
-static const uint8_t BIP0341_tapleaf_tag[] = {'T', 'a', 'p', 'L', 'e', 'a', 'f'};
+/*
+ * SHA256 of the BIP0341 tags, that the tagged hashes start with twice; precomputing them saves
+ * hashing the tag on every tagged hash.
+ */
+static const uint8_t BIP0341_tapleaf_tag_hash[32] = {
+    0xae, 0xea, 0x8f, 0xdc, 0x42, 0x08, 0x98, 0x31, 0x05, 0x73, 0x4b, 0x58, 0x08, 0x1d, 0x1e, 0x26,
+    0x38, 0xd3, 0x5f, 0x1c, 0xb5, 0x40, 0x08, 0xd4, 0xd3, 0x57, 0xca, 0x03, 0xbe, 0x78, 0xe9, 0xee};
+static const uint8_t BIP0341_tapbranch_tag_hash[32] = {
+    0x19, 0x41, 0xa1, 0xf2, 0xe5, 0x6e, 0xb9, 0x5f, 0xa2, 0xa9, 0xf1, 0x94, 0xbe, 0x5c, 0x01, 0xf7,
+    0x21, 0x6f, 0x33, 0xed, 0x82, 0xb0, 0x91, 0x46, 0x34, 0x90, 0xd0, 0x5b, 0xf5, 0x16, 0xa0, 0x15};
+static const uint8_t BIP0341_taptweak_tag_hash[32] = {
+    0xe8, 0x0f, 0xe1, 0x63, 0x9c, 0x9c, 0xa0, 0x50, 0xe3, 0xaf, 0x1b, 0x39, 0xc1, 0x43, 0xc6, 0x3e,
+    0x42, 0x9c, 0xbc, 0xeb, 0x15, 0xd9, 0x40, 0xfb, 0xb5, 0xc5, 0xa1, 0xf4, 0xaf, 0x57, 0xc5, 0xe9};
+static const uint8_t BIP0341_tapsighash_tag_hash[32] = {
+    0xf4, 0x0a, 0x48, 0xdf, 0x4b, 0x2a, 0x70, 0xc8, 0xb4, 0x92, 0x4b, 0xf2, 0x65, 0x46, 0x61, 0xed,
+    0x3d, 0x95, 0xfd, 0x66, 0xa3, 0x13, 0xeb, 0x87, 0x23, 0x75, 0x97, 0xc6, 0x28, 0xe4, 0xa0, 0x31};
 
 static int secp256k1_point(const uint8_t scalar[static 32], uint8_t out[static 65]);
 
@@ -95,6 +107,8 @@ int crypto_derive_private_key(cx_ecfp_private_key_t *private_key,
                               uint8_t bip32_path_len) {
     uint8_t raw_private_key[32] = {0};
 
+    PERF_COUNTER_INC(seed_derivations);
+
     int ret = 0;
     BEGIN_TRY {
         TRY {
@@ -124,28 +138,26 @@ int crypto_derive_private_key(cx_ecfp_private_key_t *private_key,
     return ret;
 }
 
-int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
-                 uint32_t index,
-                 serialized_extended_pubkey_t *child) {
-    PRINT_STACK_POINTER();
-
-    if (index >= BIP32_FIRST_HARDENED_CHILD) {
-        return -1;  // can only derive unhardened children
-    }
-
-    if (parent->depth == 255) {
-        return -2;  // maximum derivation depth reached
-    }
+// Computes the chain code and the point of the unhardened child with the given index of a pubkey,
+// given in compressed and uncompressed form. child_chain_code can equal parent_chain_code, but
+// child_uncompressed_pubkey must not overlap the parent's pubkey.
+static int ckdpub_point(const uint8_t parent_chain_code[static 32],
+                        const uint8_t parent_compressed_pubkey[static 33],
+                        const uint8_t parent_uncompressed_pubkey[static 65],
+                        uint32_t index,
+                        uint8_t child_uncompressed_pubkey[static 65],
+                        uint8_t child_chain_code[static 32]) {
+    PERF_COUNTER_INC(bip32_ckdpub);
 
     uint8_t I[64];
 
     {  // make sure that heavy memory allocations are freed as soon as possible
 
         uint8_t tmp[33 + 4];
-        memcpy(tmp, parent->compressed_pubkey, 33);
+        memcpy(tmp, parent_compressed_pubkey, 33);
         write_u32_be(tmp, 33, index);
 
-        cx_hmac_sha512(parent->chain_code, 32, tmp, sizeof(tmp), I, 64);
+        cx_hmac_sha512(parent_chain_code, 32, tmp, sizeof(tmp), I, 64);
     }
 
     uint8_t *I_L = &I[0];
@@ -156,42 +168,245 @@ int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
         return -1;
     }
 
+    // compute point(I_L)
+    uint8_t P[65];
+    secp256k1_point(I_L, P);
+
+    // add K_par
+    if (cx_ecfp_add_point(CX_CURVE_SECP256K1,
+                          child_uncompressed_pubkey,
+                          P,
+                          parent_uncompressed_pubkey,
+                          65) == 0) {
+        return -3;  // the point at infinity is not a valid child pubkey (should never happen in
+                    // practice)
+    }
+
+    memcpy(child_chain_code, I_R, 32);
+    return 0;
+}
+
+int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
+                 uint32_t index,
+                 serialized_extended_pubkey_t *child) {
+    PRINT_STACK_POINTER();
+
+    if (index >= BIP32_FIRST_HARDENED_CHILD) {
+        return -1;  // can only derive unhardened children
+    }
+
+    if (parent->depth == 255) {
+        return -2;  // maximum derivation depth reached
+    }
+
+    uint32_t parent_fingerprint = crypto_get_key_fingerprint(parent->compressed_pubkey);
+
     uint8_t child_uncompressed_pubkey[65];
 
     {  // make sure that heavy memory allocations are freed as soon as possible
-        // compute point(I_L)
-        uint8_t P[65];
-        secp256k1_point(I_L, P);
-
         uint8_t K_par[65];
         crypto_get_uncompressed_pubkey(parent->compressed_pubkey, K_par);
 
-        // add K_par
-        if (cx_ecfp_add_point(CX_CURVE_SECP256K1,
-                              child_uncompressed_pubkey,
-                              P,
-                              K_par,
-                              sizeof(child_uncompressed_pubkey)) == 0) {
-            return -3;  // the point at infinity is not a valid child pubkey (should never happen in
-                        // practice)
+        int ret = ckdpub_point(parent->chain_code,
+                               parent->compressed_pubkey,
+                               K_par,
+                               index,
+                               child_uncompressed_pubkey,
+                               child->chain_code);
+        if (ret < 0) {
+            return ret;
         }
     }
 
     memmove(child->version, parent->version, 4);
     child->depth = parent->depth + 1;
 
-    uint32_t parent_fingerprint = crypto_get_key_fingerprint(parent->compressed_pubkey);
-
     write_u32_be(child->parent_fingerprint, 0, parent_fingerprint);
     write_u32_be(child->child_number, 0, index);
 
-    memcpy(child->chain_code, I_R, 32);
-
     crypto_get_compressed_pubkey(child_uncompressed_pubkey, child->compressed_pubkey);
 
     return 0;
 }
 
+int bip32_expand_pubkey(const serialized_extended_pubkey_t *pubkey,
+                        expanded_extended_pubkey_t *out) {
+    if (0 > crypto_get_uncompressed_pubkey(pubkey->compressed_pubkey, out->uncompressed_pubkey)) {
+        return -1;
+    }
+    memcpy(out->version, pubkey->version, 4);
+    out->depth = pubkey->depth;
+    memcpy(out->parent_fingerprint, pubkey->parent_fingerprint, 4);
+    memcpy(out->child_number, pubkey->child_number, 4);
+    memcpy(out->chain_code, pubkey->chain_code, 32);
+    out->has_fingerprint = false;
+    return 0;
+}
+
+int bip32_CKDpub_expanded(expanded_extended_pubkey_t *parent,
+                          uint32_t index,
+                          expanded_extended_pubkey_t *child) {
+    PRINT_STACK_POINTER();
+
+    if (index >= BIP32_FIRST_HARDENED_CHILD) {
+        return -1;  // can only derive unhardened children
+    }
+
+    if (parent->depth == 255) {
+        return -2;  // maximum derivation depth reached
+    }
+
+    uint8_t parent_compressed_pubkey[33];
+    crypto_get_compressed_pubkey(parent->uncompressed_pubkey, parent_compressed_pubkey);
+
+    if (!parent->has_fingerprint) {
+        parent->fingerprint = crypto_get_key_fingerprint(parent_compressed_pubkey);
+        parent->has_fingerprint = true;
+    }
+    uint32_t parent_fingerprint = parent->fingerprint;
+
+    uint8_t child_uncompressed_pubkey[65];
+    int ret = ckdpub_point(parent->chain_code,
+                           parent_compressed_pubkey,
+                           parent->uncompressed_pubkey,
+                           index,
+                           child_uncompressed_pubkey,
+                           child->chain_code);
+    if (ret < 0) {
+        return ret;
+    }
+
+    memcpy(child->uncompressed_pubkey, child_uncompressed_pubkey, 65);
+    memmove(child->version, parent->version, 4);
+    child->depth = parent->depth + 1;
+    write_u32_be(child->parent_fingerprint, 0, parent_fingerprint);
+    write_u32_be(child->child_number, 0, index);
+    child->has_fingerprint = false;
+
+    return 0;
+}
+
+void bip32_serialize_expanded_pubkey(const expanded_extended_pubkey_t *pubkey,
+                                     serialized_extended_pubkey_t *out) {
+    memcpy(out->version, pubkey->version, 4);
+    out->depth = pubkey->depth;
+    memcpy(out->parent_fingerprint, pubkey->parent_fingerprint, 4);
+    memcpy(out->child_number, pubkey->child_number, 4);
+    memcpy(out->chain_code, pubkey->chain_code, 32);
+    crypto_get_compressed_pubkey(pubkey->uncompressed_pubkey, out->compressed_pubkey);
+}
+
+int bip32_CKDpriv(const uint8_t parent_privkey[static 32],
+                  const uint8_t parent_chain_code[static 32],
+                  const uint8_t parent_compressed_pubkey[static 33],
+                  uint32_t index,
+                  uint8_t child_privkey[static 32],
+                  uint8_t child_chain_code[static 32],
+                  uint8_t *child_compressed_pubkey) {
+    PRINT_STACK_POINTER();
+
+    uint8_t I[64];
+
+    int ret = 0;
+    BEGIN_TRY {
+        TRY {
+            {  // make sure that heavy memory allocations are freed as soon as possible
+                uint8_t tmp[33 + 4];
+                if (index >= BIP32_FIRST_HARDENED_CHILD) {
+                    // hardened child: the data is 0x00 || k_par || ser32(index)
+                    tmp[0] = 0x00;
+                    memcpy(tmp + 1, parent_privkey, 32);
+                } else {
+                    memcpy(tmp, parent_compressed_pubkey, 33);
+                }
+                write_u32_be(tmp, 33, index);
+
+                cx_hmac_sha512(parent_chain_code, 32, tmp, sizeof(tmp), I, 64);
+                explicit_bzero(tmp, sizeof(tmp));
+            }
+
+            uint8_t *I_L = &I[0];
+            uint8_t *I_R = &I[32];
+
+            // fail if I_L is not smaller than the group order n, but the probability is < 1/2^128
+            if (cx_math_cmp(I_L, secp256k1_n, 32) >= 0) {
+                CLOSE_TRY;
+                ret = -1;
+                goto end;
+            }
+
+            // k_child = I_L + k_par (mod n)
+            cx_math_addm(child_privkey, I_L, parent_privkey, secp256k1_n, 32);
+
+            if (cx_math_is_zero(child_privkey, 32)) {
+                CLOSE_TRY;
+                ret = -1;  // invalid child key (should never happen in practice)
+                goto end;
+            }
+
+            memcpy(child_chain_code, I_R, 32);
+
+            if (child_compressed_pubkey != NULL &&
+                crypto_get_compressed_pubkey_from_privkey(child_privkey, child_compressed_pubkey) <
+                    0) {
+                CLOSE_TRY;
+                ret = -1;
+                goto end;
+            }
+        }
+        CATCH_ALL {
+            ret = -1;
+        }
+        FINALLY {
+        end:
+            explicit_bzero(I, sizeof(I));
+        }
+    }
+    END_TRY;
+
+    return ret;
+}
+
+bool crypto_derive_bip32_node(bip32_node_t *node, const uint32_t *path, uint8_t path_len) {
+    if (!node->is_valid || node->path_len > path_len ||
+        memcmp(node->path, path, node->path_len * sizeof(uint32_t)) != 0) {
+        node->is_valid = false;
+
+        cx_ecfp_private_key_t private_key = {0};
+        bool result = false;
+        if (0 == crypto_derive_private_key(&private_key, node->chain_code, path, path_len)) {
+            memcpy(node->privkey, private_key.d, 32);
+            result = crypto_get_compressed_pubkey_from_privkey(node->privkey,
+                                                               node->compressed_pubkey) >= 0;
+        }
+        explicit_bzero(&private_key, sizeof(private_key));
+        if (!result) {
+            return false;
+        }
+    } else {
+        node->is_valid = false;
+
+        for (uint8_t i = node->path_len; i < path_len; i++) {
+            // the pubkey is needed for the fingerprint, and to derive non-hardened children
+            bool needs_pubkey = i == path_len - 1 || path[i + 1] < BIP32_FIRST_HARDENED_CHILD;
+            if (0 > bip32_CKDpriv(node->privkey,
+                                  node->chain_code,
+                                  node->compressed_pubkey,
+                                  path[i],
+                                  node->privkey,
+                                  node->chain_code,
+                                  needs_pubkey ? node->compressed_pubkey : NULL)) {
+                return false;
+            }
+        }
+    }
+
+    memcpy(node->path, path, path_len * sizeof(uint32_t));
+    node->path_len = path_len;
+    node->is_valid = true;
+    return true;
+}
+
 #if defined(TARGET_NANOS)
 /** Missing in LNS SDK, we implement it using the cxram section if needed. */
 static size_t cx_hash_ripemd160(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len) {
@@ -325,11 +540,34 @@ uint32_t crypto_get_key_fingerprint(const uint8_t pub_key[static 33]) {
     return read_u32_be(key_rip, 0);
 }
 
+// Lazily computed master key fingerprint; only meaningful if has_master_key_fingerprint is true.
+static bool has_master_key_fingerprint;
+static uint32_t master_key_fingerprint;
+
+void crypto_clear_master_key_fingerprint_cache() {
+    has_master_key_fingerprint = false;
+    master_key_fingerprint = 0;
+}
+
 uint32_t crypto_get_master_key_fingerprint() {
+    bool is_unlocked = os_global_pin_is_validated() == BOLOS_UX_OK;
+    if (!is_unlocked) {
+        // never reuse a value across a lock of the device
+        crypto_clear_master_key_fingerprint_cache();
+    } else if (has_master_key_fingerprint) {
+        return master_key_fingerprint;
+    }
+
     uint8_t master_pub_key[33];
     uint32_t bip32_path[] = {};
-    crypto_get_compressed_pubkey_at_path(bip32_path, 0, master_pub_key, NULL);
-    return crypto_get_key_fingerprint(master_pub_key);
+    bool success = crypto_get_compressed_pubkey_at_path(bip32_path, 0, master_pub_key, NULL);
+
+    uint32_t fingerprint = crypto_get_key_fingerprint(master_pub_key);
+    if (success && is_unlocked) {
+        master_key_fingerprint = fingerprint;
+        has_master_key_fingerprint = true;
+    }
+    return fingerprint;
 }
 
 void crypto_derive_symmetric_key(const char *label, size_t label_len, uint8_t key[static 32]) {
@@ -341,6 +579,7 @@ void crypto_derive_symmetric_key(const char *label, size_t label_len, uint8_t ke
 
     memcpy(label_copy, label, label_len);
 
+    PERF_COUNTER_INC(seed_derivations);
     os_perso_derive_node_with_seed_key(HDW_SLIP21,
                                        CX_CURVE_SECP256K1,
                                        (uint32_t *) label_copy,
@@ -366,35 +605,58 @@ int get_serialized_extended_pubkey_at_path(const uint32_t bip32_path[],
         // here we reuse the storage for the parent keys that we will later use
         // for the response, in order to save memory
 
-        uint8_t parent_pubkey[33];
-        crypto_get_compressed_pubkey_at_path(bip32_path, bip32_path_len - 1, parent_pubkey, NULL);
+        if (bip32_path_len == 1) {
+            parent_fingerprint = crypto_get_master_key_fingerprint();
+        } else {
+            uint8_t parent_pubkey[33];
+            crypto_get_compressed_pubkey_at_path(bip32_path,
+                                                 bip32_path_len - 1,
+                                                 parent_pubkey,
+                                                 NULL);
 
-        parent_fingerprint = crypto_get_key_fingerprint(parent_pubkey);
+            parent_fingerprint = crypto_get_key_fingerprint(parent_pubkey);
+        }
         child_number = bip32_path[bip32_path_len - 1];
     }
 
-    struct {
-        serialized_extended_pubkey_t ext_pubkey;
-        uint8_t checksum[4];
-    } ext_pubkey_check;  // extended pubkey and checksum
-
-    serialized_extended_pubkey_t *ext_pubkey = &ext_pubkey_check.ext_pubkey;
+    serialized_extended_pubkey_t ext_pubkey;
 
-    write_u32_be(ext_pubkey->version, 0, bip32_pubkey_version);
-    ext_pubkey->depth = bip32_path_len;
-    write_u32_be(ext_pubkey->parent_fingerprint, 0, parent_fingerprint);
-    write_u32_be(ext_pubkey->child_number, 0, child_number);
+    write_u32_be(ext_pubkey.version, 0, bip32_pubkey_version);
+    ext_pubkey.depth = bip32_path_len;
+    write_u32_be(ext_pubkey.parent_fingerprint, 0, parent_fingerprint);
+    write_u32_be(ext_pubkey.child_number, 0, child_number);
 
     crypto_get_compressed_pubkey_at_path(bip32_path,
                                          bip32_path_len,
-                                         ext_pubkey->compressed_pubkey,
-                                         ext_pubkey->chain_code);
-    crypto_get_checksum((uint8_t *) ext_pubkey, 78, ext_pubkey_check.checksum);
+                                         ext_pubkey.compressed_pubkey,
+                                         ext_pubkey.chain_code);
 
     if (out_pubkey != NULL) {
-        memcpy(out_pubkey, &ext_pubkey_check.ext_pubkey, sizeof(ext_pubkey_check.ext_pubkey));
+        memcpy(out_pubkey, &ext_pubkey, sizeof(serialized_extended_pubkey_t));
     }
 
+    return crypto_serialize_extended_pubkey(&ext_pubkey, out_xpub);
+}
+
+int crypto_get_compressed_pubkey_from_privkey(const uint8_t privkey[static 32],
+                                              uint8_t compressed_pubkey[static 33]) {
+    uint8_t P[65];
+    if (secp256k1_point(privkey, P) == 0) {
+        return -1;  // point at infinity
+    }
+    return crypto_get_compressed_pubkey(P, compressed_pubkey);
+}
+
+int crypto_serialize_extended_pubkey(const serialized_extended_pubkey_t *ext_pubkey,
+                                     char out_xpub[static MAX_SERIALIZED_PUBKEY_LENGTH + 1]) {
+    struct {
+        serialized_extended_pubkey_t ext_pubkey;
+        uint8_t checksum[4];
+    } ext_pubkey_check;  // extended pubkey and checksum
+
+    memcpy(&ext_pubkey_check.ext_pubkey, ext_pubkey, sizeof(serialized_extended_pubkey_t));
+    crypto_get_checksum((uint8_t *) ext_pubkey, 78, ext_pubkey_check.checksum);
+
     int serialized_pubkey_len = base58_encode((uint8_t *) &ext_pubkey_check,
                                               78 + 4,
                                               out_xpub,
@@ -433,15 +695,33 @@ int crypto_ecdsa_sign_sha256_hash_with_key(const uint32_t bip32_path[],
                                            uint8_t out[static MAX_DER_SIG_LEN],
                                            uint32_t *info) {
     cx_ecfp_private_key_t private_key = {0};
+
+    int sig_len = -1;
+    if (0 == crypto_derive_private_key(&private_key, NULL, bip32_path, bip32_path_len)) {
+        sig_len =
+            crypto_ecdsa_sign_sha256_hash_with_private_key(&private_key, hash, pubkey, out, info);
+    }
+
+    explicit_bzero(&private_key, sizeof(private_key));
+
+    return sig_len;
+}
+
+int crypto_ecdsa_sign_sha256_hash_with_private_key(const cx_ecfp_private_key_t *private_key,
+                                                   const uint8_t hash[static 32],
+                                                   uint8_t *pubkey,
+                                                   uint8_t out[static MAX_DER_SIG_LEN],
+                                                   uint32_t *info) {
     cx_ecfp_public_key_t public_key;
     uint32_t info_internal = 0;
 
+    PERF_COUNTER_INC(ecdsa_signatures);
+
     int sig_len = 0;
     bool error = false;
     BEGIN_TRY {
         TRY {
-            crypto_derive_private_key(&private_key, NULL, bip32_path, bip32_path_len);
-            sig_len = cx_ecdsa_sign(&private_key,
+            sig_len = cx_ecdsa_sign(private_key,
                                     CX_RND_RFC6979,
                                     CX_SHA256,
                                     hash,
@@ -451,7 +731,10 @@ int crypto_ecdsa_sign_sha256_hash_with_key(const uint32_t bip32_path[],
                                     &info_internal);
 
             // generate corresponding public key
-            cx_ecfp_generate_pair(CX_CURVE_256K1, &public_key, &private_key, 1);
+            cx_ecfp_generate_pair(CX_CURVE_256K1,
+                                  &public_key,
+                                  (cx_ecfp_private_key_t *) private_key,
+                                  1);
 
             if (pubkey != NULL) {
                 // compute compressed public key
@@ -464,7 +747,7 @@ int crypto_ecdsa_sign_sha256_hash_with_key(const uint32_t bip32_path[],
             error = true;
         }
         FINALLY {
-            explicit_bzero(&private_key, sizeof(private_key));
+            explicit_bzero(&public_key, sizeof(public_key));
         }
     }
     END_TRY;
@@ -481,6 +764,14 @@ int crypto_ecdsa_sign_sha256_hash_with_key(const uint32_t bip32_path[],
     return sig_len;
 }
 
+// Initializes the tagged hash whose tag has the given SHA256
+static void crypto_tr_tagged_hash_init_from_tag_hash(cx_sha256_t *hash_context,
+                                                     const uint8_t tag_hash[static 32]) {
+    cx_sha256_init(hash_context);
+    crypto_hash_update(&hash_context->header, tag_hash, 32);
+    crypto_hash_update(&hash_context->header, tag_hash, 32);
+}
+
 void crypto_tr_tagged_hash_init(cx_sha256_t *hash_context, const uint8_t *tag, uint16_t tag_len) {
     // we recycle the input to save memory (will reinit later)
     cx_sha256_init(hash_context);
@@ -489,13 +780,15 @@ void crypto_tr_tagged_hash_init(cx_sha256_t *hash_context, const uint8_t *tag, u
     crypto_hash_update(&hash_context->header, tag, tag_len);
     crypto_hash_digest(&hash_context->header, hashtag, sizeof(hashtag));
 
-    cx_sha256_init(hash_context);
-    crypto_hash_update(&hash_context->header, hashtag, sizeof(hashtag));
-    crypto_hash_update(&hash_context->header, hashtag, sizeof(hashtag));
+    crypto_tr_tagged_hash_init_from_tag_hash(hash_context, hashtag);
 }
 
 void crypto_tr_tapleaf_hash_init(cx_sha256_t *hash_context) {
-    crypto_tr_tagged_hash_init(hash_context, BIP0341_tapleaf_tag, sizeof(BIP0341_tapleaf_tag));
+    crypto_tr_tagged_hash_init_from_tag_hash(hash_context, BIP0341_tapleaf_tag_hash);
+}
+
+void crypto_tr_tapsighash_init(cx_sha256_t *hash_context) {
+    crypto_tr_tagged_hash_init_from_tag_hash(hash_context, BIP0341_tapsighash_tag_hash);
 }
 
 static int crypto_tr_lift_x(const uint8_t x[static 32], uint8_t out[static 65]) {
@@ -532,20 +825,17 @@ static int crypto_tr_lift_x(const uint8_t x[static 32], uint8_t out[static 65])
     return 0;
 }
 
-// Computes a tagged hash according to BIP-340.
+// Computes a tagged hash according to BIP-340, for the tag whose SHA256 is given.
 // If data2_len > 0, then data2 must be non-NULL and the `data` and `data2` arrays are concatenated.
 // Somewhat weird signature, but this helps to optimize stack usage.
-static void __attribute__((noinline)) crypto_tr_tagged_hash(const uint8_t *tag,
-                                                            uint16_t tag_len,
+static void __attribute__((noinline)) crypto_tr_tagged_hash(const uint8_t tag_hash[static 32],
                                                             const uint8_t *data,
                                                             uint16_t data_len,
                                                             const uint8_t *data2,
                                                             uint16_t data2_len,
                                                             uint8_t out[static 32]) {
     cx_sha256_t hash_context;
-    cx_sha256_init(&hash_context);
-
-    crypto_tr_tagged_hash_init(&hash_context, tag, tag_len);
+    crypto_tr_tagged_hash_init_from_tag_hash(&hash_context, tag_hash);
 
     crypto_hash_update(&hash_context.header, data, data_len);
     if (data2_len > 0) crypto_hash_update(&hash_context.header, data2, data2_len);
@@ -556,16 +846,14 @@ void crypto_tr_combine_taptree_hashes(const uint8_t left_h[static 32],
                                       const uint8_t right_h[static 32],
                                       uint8_t out[static 32]) {
     if (memcmp(left_h, right_h, 32) < 0) {
-        crypto_tr_tagged_hash(BIP0341_tapbranch_tag,
-                              sizeof(BIP0341_tapbranch_tag),
+        crypto_tr_tagged_hash(BIP0341_tapbranch_tag_hash,
                               left_h,
                               32,
                               right_h,
                               32,
                               out);
     } else {
-        crypto_tr_tagged_hash(BIP0341_tapbranch_tag,
-                              sizeof(BIP0341_tapbranch_tag),
+        crypto_tr_tagged_hash(BIP0341_tapbranch_tag_hash,
                               right_h,
                               32,
                               left_h,
@@ -582,8 +870,7 @@ int crypto_tr_tweak_pubkey(const uint8_t pubkey[static 32],
                            uint8_t out[static 32]) {
     uint8_t t[32];
 
-    crypto_tr_tagged_hash(BIP0341_taptweak_tag,
-                          sizeof(BIP0341_taptweak_tag),
+    crypto_tr_tagged_hash(BIP0341_taptweak_tag_hash,
                           pubkey,
                           32,
                           h,
@@ -636,8 +923,7 @@ int crypto_tr_tweak_seckey(const uint8_t seckey[static 32],
             }
 
             uint8_t t[32];
-            crypto_tr_tagged_hash(BIP0341_taptweak_tag,
-                                  sizeof(BIP0341_taptweak_tag),
+            crypto_tr_tagged_hash(BIP0341_taptweak_tag_hash,
                                   &P[1],  // P[1:33] is x(P)
                                   32,
                                   h,
@@ -11,6 +11,7 @@
 #include "./common/bip32.h"
 #include "./common/varint.h"
 #include "./common/write.h"
+#include "./perf_counters.h"
 
 /**
  * A serialized extended pubkey according to BIP32 specifications.
@@ -30,6 +31,23 @@ typedef struct {
     uint8_t checksum[4];
 } serialized_extended_pubkey_check_t;
 
+/**
+ * An extended pubkey with its pubkey as an uncompressed point, used to derive chains of children
+ * with bip32_CKDpub_expanded: the pubkey of the parent is not decompressed at each derivation, and
+ * its fingerprint is only computed once. The serialized form is produced with
+ * bip32_serialize_expanded_pubkey.
+ */
+typedef struct {
+    uint8_t version[4];
+    uint8_t depth;
+    uint8_t parent_fingerprint[4];
+    uint8_t child_number[4];
+    uint8_t chain_code[32];
+    uint8_t uncompressed_pubkey[65];
+    bool has_fingerprint;  // whether fingerprint is computed; it is only done for the parents
+    uint32_t fingerprint;  // the fingerprint of the pubkey, if has_fingerprint
+} expanded_extended_pubkey_t;
+
 /**
  * Derive private key given BIP32 path.
  * It must be wrapped in a TRY block that wipes the output private key in the FINALLY block.
@@ -69,6 +87,111 @@ int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
                  uint32_t index,
                  serialized_extended_pubkey_t *child);
 
+/**
+ * Converts a serialized extended pubkey to an expanded_extended_pubkey_t, which requires
+ * decompressing its pubkey.
+ *
+ * @param[in]  pubkey
+ *   Pointer to the serialized extended pubkey.
+ * @param[out] out
+ *   Pointer to the output expanded extended pubkey.
+ *
+ * @return 0 if success, a negative number if the pubkey is not a valid point.
+ */
+int bip32_expand_pubkey(const serialized_extended_pubkey_t *pubkey,
+                        expanded_extended_pubkey_t *out);
+
+/**
+ * Like bip32_CKDpub, with expanded extended pubkeys: the child's point is computed from the
+ * parent's uncompressed point, and the parent's fingerprint is computed on the first derivation
+ * only, and kept in the parent.
+ *
+ * @param[in,out] parent
+ *   Pointer to the expanded extended pubkey of the parent; its fingerprint is computed if needed.
+ * @param[in]  index
+ *   Index of the child to derive. It MUST be not hardened, that is, strictly less than 0x80000000.
+ * @param[out] child
+ *   Pointer to the output struct for the child's expanded extended pubkey. It can equal parent,
+ * which in that case is overwritten.
+ *
+ * @return 0 if success, a negative number on failure.
+ */
+int bip32_CKDpub_expanded(expanded_extended_pubkey_t *parent,
+                          uint32_t index,
+                          expanded_extended_pubkey_t *child);
+
+/**
+ * Computes the serialized form of an expanded extended pubkey.
+ *
+ * @param[in]  pubkey
+ *   Pointer to the expanded extended pubkey.
+ * @param[out] out
+ *   Pointer to the output serialized extended pubkey.
+ */
+void bip32_serialize_expanded_pubkey(const expanded_extended_pubkey_t *pubkey,
+                                     serialized_extended_pubkey_t *out);
+
+/**
+ * Generates the child extended private key, from a parent extended private key and index, as in
+ * the CKDpriv function of BIP-32. For non-hardened indexes, the compressed pubkey of the parent is
+ * required as input, since callers usually know it already.
+ *
+ * @param[in]  parent_privkey
+ *   Pointer to the 32-byte private key of the parent.
+ * @param[in]  parent_chain_code
+ *   Pointer to the 32-byte chain code of the parent.
+ * @param[in]  parent_compressed_pubkey
+ *   Pointer to the 33-byte compressed pubkey of the parent. Not used for hardened indexes.
+ * @param[in]  index
+ *   Index of the child to derive.
+ * @param[out] child_privkey
+ *   Pointer to a 32-byte array to receive the child's private key. It can equal parent_privkey.
+ * @param[out] child_chain_code
+ *   Pointer to a 32-byte array to receive the child's chain code. It can equal parent_chain_code.
+ * @param[out] child_compressed_pubkey
+ *   Either NULL, or a pointer to a 33-byte array to receive the child's compressed pubkey. It can
+ * equal parent_compressed_pubkey. Computing the pubkey requires a scalar multiplication, therefore
+ * it should be NULL if not needed.
+ *
+ * @return 0 if success, a negative number on failure. On failure, the content of the output arrays
+ * is undefined, and they must be wiped by the caller.
+ */
+int bip32_CKDpriv(const uint8_t parent_privkey[static 32],
+                  const uint8_t parent_chain_code[static 32],
+                  const uint8_t parent_compressed_pubkey[static 33],
+                  uint32_t index,
+                  uint8_t child_privkey[static 32],
+                  uint8_t child_chain_code[static 32],
+                  uint8_t *child_compressed_pubkey);
+
+/**
+ * A node of the BIP-32 tree, kept while deriving keys at multiple paths so that the derivation
+ * steps shared with the previous path are not repeated.
+ */
+typedef struct {
+    bool is_valid;
+    uint8_t path_len;
+    uint32_t path[MAX_BIP32_PATH_STEPS];
+    uint8_t privkey[32];
+    uint8_t chain_code[32];
+    uint8_t compressed_pubkey[33];
+} bip32_node_t;
+
+/**
+ * Updates node to the node at the given path. If the path of node is a prefix of the given path,
+ * only the missing steps are derived; otherwise, the node is derived from the seed.
+ *
+ * @param[in,out] node
+ *   Pointer to the node; if its is_valid field is false, the node is derived from the seed.
+ * @param[in]  path
+ *   Pointer to the BIP32 path of the node to derive.
+ * @param[in]  path_len
+ *   Number of steps of the path, at most MAX_BIP32_PATH_STEPS.
+ *
+ * @return false on failure. The caller must wipe node in all cases.
+ */
+bool crypto_derive_bip32_node(bip32_node_t *node, const uint32_t *path, uint8_t path_len);
+
 /**
  * Convenience wrapper for cx_hash to add some data to an initialized hash context.
  *
@@ -82,6 +205,7 @@ int bip32_CKDpub(const serialized_extended_pubkey_t *parent,
  * @return the return value of cx_hash.
  */
 static inline int crypto_hash_update(cx_hash_t *hash_context, const void *in, size_t in_len) {
+    PERF_COUNTER_ADD(hashed_bytes, in_len);
     return cx_hash(hash_context, 0, in, in_len, NULL, 0);
 }
 
@@ -167,6 +291,104 @@ static inline int crypto_hash_update_u32(cx_hash_t *hash_context, uint32_t data)
     return crypto_hash_update(hash_context, &buf, sizeof(buf));
 }
 
+// Size of the pending buffer of a crypto_hash_writer_t, one block of SHA-256
+#define CRYPTO_HASH_WRITER_BUFFER_SIZE 64
+
+/**
+ * Buffered writer to a hash context: the updates are accumulated in a buffer, which is only passed
+ * to cx_hash when it is full, when the writer is flushed, or when the hash is finalized. It saves a
+ * syscall for each of the many updates of a few bytes of the sighashes and of the scripts.
+ *
+ * Until the writer is flushed, all the updates of the hash context must go through the writer. The
+ * context must be flushed before being copied or passed to functions that update it directly.
+ */
+typedef struct {
+    cx_hash_t *hash_context;
+    size_t len;  // number of pending bytes in buffer
+    uint8_t buffer[CRYPTO_HASH_WRITER_BUFFER_SIZE];
+} crypto_hash_writer_t;
+
+/**
+ * Initializes a writer to the given hash context, which must already be initialized.
+ */
+static inline void crypto_hash_writer_init(crypto_hash_writer_t *writer, cx_hash_t *hash_context) {
+    writer->hash_context = hash_context;
+    writer->len = 0;
+}
+
+/**
+ * Passes the pending bytes of the writer to its hash context.
+ */
+static inline void crypto_hash_writer_flush(crypto_hash_writer_t *writer) {
+    if (writer->len > 0) {
+        crypto_hash_update(writer->hash_context, writer->buffer, writer->len);
+        writer->len = 0;
+    }
+}
+
+/**
+ * Adds some data to the hash of the writer.
+ */
+static inline void crypto_hash_writer_update(crypto_hash_writer_t *writer,
+                                             const void *in,
+                                             size_t in_len) {
+    if (in_len > sizeof(writer->buffer) - writer->len) {
+        crypto_hash_writer_flush(writer);
+        if (in_len >= sizeof(writer->buffer)) {
+            crypto_hash_update(writer->hash_context, in, in_len);
+            return;
+        }
+    }
+    memcpy(writer->buffer + writer->len, in, in_len);
+    writer->len += in_len;
+}
+
+/**
+ * Adds an uint8_t to the hash of the writer.
+ */
+static inline void crypto_hash_writer_update_u8(crypto_hash_writer_t *writer, uint8_t data) {
+    crypto_hash_writer_update(writer, &data, 1);
+}
+
+/**
+ * Adds an uint16_t to the hash of the writer, encoded in big-endian.
+ */
+static inline void crypto_hash_writer_update_u16(crypto_hash_writer_t *writer, uint16_t data) {
+    uint8_t buf[2];
+    write_u16_be(buf, 0, data);
+    crypto_hash_writer_update(writer, buf, sizeof(buf));
+}
+
+/**
+ * Adds an uint32_t to the hash of the writer, encoded in big-endian.
+ */
+static inline void crypto_hash_writer_update_u32(crypto_hash_writer_t *writer, uint32_t data) {
+    uint8_t buf[4];
+    write_u32_be(buf, 0, data);
+    crypto_hash_writer_update(writer, buf, sizeof(buf));
+}
+
+/**
+ * Adds an uint64_t to the hash of the writer, serialized as a bitcoin-style varint.
+ */
+static inline void crypto_hash_writer_update_varint(crypto_hash_writer_t *writer, uint64_t data) {
+    uint8_t buf[9];
+    int len = varint_write(buf, 0, data);
+    crypto_hash_writer_update(writer, buf, len);
+}
+
+/**
+ * Flushes the writer, and computes the final hash of its hash context.
+ *
+ * @return the return value of cx_hash.
+ */
+static inline int crypto_hash_writer_digest(crypto_hash_writer_t *writer,
+                                            uint8_t *out,
+                                            size_t out_len) {
+    crypto_hash_writer_flush(writer);
+    return crypto_hash_digest(writer->hash_context, out, out_len);
+}
+
 /**
  * Computes RIPEMD160(in).
  *
@@ -189,7 +411,7 @@ void crypto_ripemd160(const uint8_t *in, uint16_t inlen, uint8_t out[static 20])
  * @param[out] out
  *   Pointer to the 160-bit (20 bytes) output array.
  */
-void crypto_hash160(const uint8_t *in, uint16_t in_len, uint8_t *out);
+void crypto_hash160(const uint8_t *in, uint16_t in_len, uint8_t out[static 20]);
 
 /**
  * Computes the 33-bytes compressed public key from the uncompressed 65-bytes public key.
@@ -266,11 +488,45 @@ uint32_t crypto_get_key_fingerprint(const uint8_t pub_key[static 33]);
 
 /**
  * Computes the fingerprint of the master key as per BIP32.
+ * The result is cached after the first successful computation, and the cache is cleared if the
+ * device is found to be locked.
  *
  * @return the fingerprint of the master key.
  */
 uint32_t crypto_get_master_key_fingerprint();
 
+/**
+ * Clears the cached fingerprint of the master key, if any.
+ */
+void crypto_clear_master_key_fingerprint_cache();
+
+/**
+ * Computes the compressed public key corresponding to a private key.
+ *
+ * @param[in]  privkey
+ *   Pointer to the 32-byte private key.
+ * @param[out] compressed_pubkey
+ *   Pointer to a 33-byte array to receive the compressed public key.
+ *
+ * @return 0 if success, a negative number on failure.
+ */
+int crypto_get_compressed_pubkey_from_privkey(const uint8_t privkey[static 32],
+                                              uint8_t compressed_pubkey[static 33]);
+
+/**
+ * Computes the base58check encoding of a serialized extended pubkey.
+ *
+ * @param[in]  ext_pubkey
+ *   Pointer to the serialized extended pubkey.
+ * @param[out] out_xpub
+ *   Pointer to the output buffer, which must be long enough to contain the result
+ * (including the terminating null character).
+ *
+ * @return the length of the output pubkey (not including the null character), or -1 on error.
+ */
+int crypto_serialize_extended_pubkey(const serialized_extended_pubkey_t *ext_pubkey,
+                                     char out_xpub[static MAX_SERIALIZED_PUBKEY_LENGTH + 1]);
+
 /**
  * Computes the base58check-encoded extended pubkey at a given path.
  *
@@ -356,6 +612,31 @@ int crypto_ecdsa_sign_sha256_hash_with_key(const uint32_t bip32_path[],
                                            uint8_t out[static MAX_DER_SIG_LEN],
                                            uint32_t *info);
 
+/**
+ * Like crypto_ecdsa_sign_sha256_hash_with_key, but signs with the given private key instead of
+ * deriving it from a BIP-32 path.
+ *
+ * @param[in]  private_key
+ *   Pointer to the private key used for signing.
+ * @param[in]  hash
+ *   Pointer to a 32-byte SHA-256 hash digest.
+ * @param[out]  pubkey
+ *   Either NULL, or a pointer to a 33-bytes array that will receive the compressed pubkey
+ * corresponding to the private key used for signing.
+ * @param[out]  out
+ *   The pointer to the output array to contain the signature, that must be of length
+ * `MAX_DER_SIG_LEN`.
+ * @param[out]  info
+ *   Pointer to contain the `info` variable returned by `cx_ecdsa_sign`, or `NULL` if not needed.
+ *
+ * @return the length of the signature on success, or -1 in case of error.
+ */
+int crypto_ecdsa_sign_sha256_hash_with_private_key(const cx_ecfp_private_key_t *private_key,
+                                                   const uint8_t hash[static 32],
+                                                   uint8_t *pubkey,
+                                                   uint8_t out[static MAX_DER_SIG_LEN],
+                                                   uint32_t *info);
+
 /**
  * Initializes the "tagged" SHA256 hash with the given tag, as defined by BIP-0340.
  *
@@ -376,6 +657,14 @@ void crypto_tr_tagged_hash_init(cx_sha256_t *hash_context, const uint8_t *tag, u
  */
 void crypto_tr_tapleaf_hash_init(cx_sha256_t *hash_context);
 
+/**
+ * Initializes the "tagged" SHA256 hash with tag "TapSighash", used for taproot sighashes.
+ *
+ * @param[out]  hash_context
+ *   Pointer to a sha256 hash context.
+ */
+void crypto_tr_tapsighash_init(cx_sha256_t *hash_context);
+
 /**
  * Computes the tagged hash with tagged hash of a tapbranch, given the hashes for the children.
  *
@@ -1,4 +1,7 @@
 #include <stdint.h>
+#include <string.h>
+
+#include "os.h"
 
 #include "cxram_stash.h"
 #include "cx_ram.h"
@@ -11,8 +14,36 @@ union cx_u G_cx;
 
 #ifdef USE_CXRAM_SECTION
 
+// Number of bytes of the cxram section allocated with cxram_alloc
+static size_t G_cxram_used = 0;
+
 uint8_t *get_cxram_buffer() {
     return (uint8_t *) &G_cx;
 }
 
+size_t cxram_mark(void) {
+    return G_cxram_used;
+}
+
+uint8_t *cxram_alloc(size_t size) {
+    size_t aligned_size = (size + CXRAM_ALIGNMENT - 1) & ~((size_t) CXRAM_ALIGNMENT - 1);
+    if (aligned_size < size || aligned_size > CXRAM_BUFFER_SIZE - G_cxram_used) {
+        PRINTF("Not enough space in the cxram section\n");
+        return NULL;
+    }
+
+    uint8_t *buffer = get_cxram_buffer() + G_cxram_used;
+    G_cxram_used += aligned_size;
+    return buffer;
+}
+
+void cxram_release(size_t mark) {
+    if (mark >= G_cxram_used) {
+        return;
+    }
+
+    explicit_bzero(get_cxram_buffer() + mark, G_cxram_used - mark);
+    G_cxram_used = mark;
+}
+
 #endif
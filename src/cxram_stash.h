@@ -1,17 +1,52 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 /*
  * Due to lack of available stack on NanoS, we make use of a 1K RAM region that is shared between
  * applications and bolos, and used as temporary memory for cryptographic computations.
  *
  * If USE_CXRAM_SECTION is not set, we don't define this functions; a local buffer in stack must be
  * used instead.
+ *
+ * Buffers are allocated in the section in a stack-like fashion with cxram_alloc, and released
+ * with cxram_release, so that nested functions can use it at the same time. The content of the
+ * section is clobbered by the cryptographic functions that use G_cx (for example cx_hash_sha256,
+ * merkle_combine_hashes or crypto_ripemd160): the owner of a buffer must not call any of them,
+ * directly or not, until the buffer is released. Therefore, the section can only hold temporary
+ * data, and not caches that outlive such calls.
  */
 
+#ifdef USE_CXRAM_SECTION
+#define CXRAM_BUFFER_SIZE 1024
+
+// Alignment of the buffers allocated with cxram_alloc.
+#define CXRAM_ALIGNMENT 4
+
 /**
  * Returns the address of the 1K cxram section.
  */
-
-#ifdef USE_CXRAM_SECTION
 uint8_t *get_cxram_buffer();
-#endif
\ No newline at end of file
+
+/**
+ * Returns the number of bytes of the cxram section currently allocated, to be passed to
+ * cxram_release in order to release all the buffers allocated from now on.
+ */
+size_t cxram_mark(void);
+
+/**
+ * Allocates a buffer of the given size in the cxram section, aligned to CXRAM_ALIGNMENT bytes.
+ * Returns NULL if there is not enough space left.
+ */
+uint8_t *cxram_alloc(size_t size);
+
+/**
+ * Wipes and releases all the buffers allocated after the given mark was taken.
+ */
+void cxram_release(size_t mark);
+
+// Declares a pointer `name` to a `type` allocated in the cxram section; it is NULL if there is not
+// enough space left.
+#define CXRAM_ALLOC(type, name) type *name = (type *) cxram_alloc(sizeof(type))
+#endif
@@ -15,6 +15,31 @@ void print_stack_pointer(const char *file, int line, const char *func_name);
 #define PRINT_STACK_POINTER()
 #endif
 
+/**
+ * Stack profiling, only compiled in builds with HAVE_STACK_PROFILING (make STACK_PROFILING=1); the
+ * reports are printed with PRINTF, therefore DEBUG must be enabled as well.
+ *
+ * The dispatcher paints the free part of the stack before invoking each handler, and, when the
+ * handler returns, scans it to find how deep the stack went. Functions starting with
+ * STACK_PROFILING_FRAME() are tracked, so that the chain of such frames that was active at the
+ * deepest point is reported as well.
+ */
+#ifdef HAVE_STACK_PROFILING
+void stack_profiling_begin(void);
+void stack_profiling_end(uint8_t ins);
+
+const char *stack_profiling_push_frame(const char *func_name);
+void stack_profiling_pop_frame(const char *const *frame);
+
+// Tracks the current function until it returns; must be the first statement of the function.
+#define STACK_PROFILING_FRAME()                                                              \
+    const char *stack_profiling_frame_ __attribute__((cleanup(stack_profiling_pop_frame), \
+                                                      unused)) =                            \
+        stack_profiling_push_frame(__func__)
+#else
+#define STACK_PROFILING_FRAME()
+#endif
+
 static inline int print_error_info(const char *error_msg,
                                    const char *filename,
                                    int line,
@@ -0,0 +1,153 @@
+#ifdef HAVE_STACK_PROFILING
+
+#include <stdint.h>
+
+#include "os.h"
+
+#include "debug.h"
+
+// Pattern painted on the free part of the stack
+#define STACK_PROFILING_PATTERN 0xA5A5A5A5
+
+// Words left untouched below the stack pointer of stack_profiling_begin
+#define STACK_PROFILING_MARGIN 16
+
+// Maximum depth of the tracked chain of frames
+#define STACK_PROFILING_MAX_FRAMES 16
+
+// Number of distinct INS whose maximum depth is kept
+#define STACK_PROFILING_MAX_COMMANDS 16
+
+// Placed by the linker script of the SDK at the lowest address of the stack
+extern unsigned int app_stack_canary;
+
+typedef struct {
+    uint8_t ins;
+    uint16_t max_used;
+} stack_profiling_command_t;
+
+static uint32_t *G_stack_profiling_start_sp;
+
+static const char *G_stack_profiling_frames[STACK_PROFILING_MAX_FRAMES];
+static int G_stack_profiling_n_frames;
+
+static const char *G_stack_profiling_deepest_frames[STACK_PROFILING_MAX_FRAMES];
+static int G_stack_profiling_deepest_n_frames;
+static uint32_t *G_stack_profiling_deepest_frame_sp;
+
+static stack_profiling_command_t G_stack_profiling_commands[STACK_PROFILING_MAX_COMMANDS];
+static int G_stack_profiling_n_commands;
+
+// Returns an address in the frame of a callee, therefore below the stack pointer of the caller
+static uint32_t *__attribute__((noinline)) get_stack_pointer() {
+    uint32_t stack_top = 0;
+    // Returning an address on the stack is unusual, so we disable the warning
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wreturn-stack-address"
+    return &stack_top;
+#pragma GCC diagnostic pop
+}
+
+static uint32_t *get_stack_bottom() {
+    // the first word is the canary of the SDK, that must not be overwritten
+    return (uint32_t *) &app_stack_canary + 1;
+}
+
+void stack_profiling_begin(void) {
+    uint32_t *sp = get_stack_pointer();
+
+    G_stack_profiling_start_sp = sp;
+    G_stack_profiling_n_frames = 0;
+    G_stack_profiling_deepest_n_frames = 0;
+    G_stack_profiling_deepest_frame_sp = sp;
+
+    // not using memset, as its own frame would be below the stack pointer
+    for (volatile uint32_t *p = get_stack_bottom(); p < sp - STACK_PROFILING_MARGIN; p++) {
+        *p = STACK_PROFILING_PATTERN;
+    }
+}
+
+static void update_command_max(uint8_t ins, uint16_t used) {
+    for (int i = 0; i < G_stack_profiling_n_commands; i++) {
+        if (G_stack_profiling_commands[i].ins == ins) {
+            if (used > G_stack_profiling_commands[i].max_used) {
+                G_stack_profiling_commands[i].max_used = used;
+            }
+            return;
+        }
+    }
+    if (G_stack_profiling_n_commands < STACK_PROFILING_MAX_COMMANDS) {
+        G_stack_profiling_commands[G_stack_profiling_n_commands].ins = ins;
+        G_stack_profiling_commands[G_stack_profiling_n_commands].max_used = used;
+        ++G_stack_profiling_n_commands;
+    }
+}
+
+static uint16_t get_command_max(uint8_t ins) {
+    for (int i = 0; i < G_stack_profiling_n_commands; i++) {
+        if (G_stack_profiling_commands[i].ins == ins) {
+            return G_stack_profiling_commands[i].max_used;
+        }
+    }
+    return 0;
+}
+
+void stack_profiling_end(uint8_t ins) {
+    uint32_t *bottom = get_stack_bottom();
+    uint32_t *lowest = bottom;
+    while (lowest < G_stack_profiling_start_sp && *lowest == STACK_PROFILING_PATTERN) {
+        ++lowest;
+    }
+
+    uint16_t used = (uint16_t) ((uint8_t *) G_stack_profiling_start_sp - (uint8_t *) lowest);
+    uint16_t free = (uint16_t) ((uint8_t *) lowest - (uint8_t *) bottom);
+
+    update_command_max(ins, used);
+
+    PRINTF("STACK PROFILE INS %02x: %d bytes used (max %d), %d bytes free\n",
+           ins,
+           (int) used,
+           (int) get_command_max(ins),
+           (int) free);
+    if (G_stack_profiling_deepest_n_frames > 0) {
+        PRINTF("STACK PROFILE deepest frames (%d bytes):\n",
+               (int) ((uint8_t *) G_stack_profiling_start_sp -
+                      (uint8_t *) G_stack_profiling_deepest_frame_sp));
+        for (int i = 0;
+             i < G_stack_profiling_deepest_n_frames && i < STACK_PROFILING_MAX_FRAMES;
+             i++) {
+            PRINTF("  %s\n", G_stack_profiling_deepest_frames[i]);
+        }
+        if (G_stack_profiling_deepest_n_frames > STACK_PROFILING_MAX_FRAMES) {
+            PRINTF("  ...\n");
+        }
+    }
+}
+
+const char *stack_profiling_push_frame(const char *func_name) {
+    uint32_t *sp = get_stack_pointer();
+
+    if (G_stack_profiling_n_frames < STACK_PROFILING_MAX_FRAMES) {
+        G_stack_profiling_frames[G_stack_profiling_n_frames] = func_name;
+    }
+    ++G_stack_profiling_n_frames;
+
+    if (sp < G_stack_profiling_deepest_frame_sp) {
+        G_stack_profiling_deepest_frame_sp = sp;
+        G_stack_profiling_deepest_n_frames = G_stack_profiling_n_frames;
+        for (int i = 0; i < G_stack_profiling_n_frames && i < STACK_PROFILING_MAX_FRAMES; i++) {
+            G_stack_profiling_deepest_frames[i] = G_stack_profiling_frames[i];
+        }
+    }
+    return func_name;
+}
+
+void stack_profiling_pop_frame(const char *const *frame) {
+    (void) frame;
+
+    if (G_stack_profiling_n_frames > 0) {
+        --G_stack_profiling_n_frames;
+    }
+}
+
+#endif
@@ -8,6 +8,15 @@
 // Response: empty
 #define CCMD_YIELD 0x10
 
+// Used to report the progress of a command to the host; it is never sent as an interruption of its
+// own, but only queued in the responses as the YIELD messages of version 2 of the protocol
+// Message : <CCMD_PROGRESS : 1> <msg_len : 1> <phase : 1> <n_done : varint> <n_total : varint>
+#define CCMD_PROGRESS 0x11
+
+// Maximum length of the request of any of the client commands below; commands that queue YIELD
+// messages in the response always leave enough space for it.
+#define MAX_CLIENT_COMMAND_REQUEST_LEN (1 + 32 + 32)  // CCMD_GET_MERKLE_LEAF_INDEX
+
 /* MERKLE PROOFS */
 
 // Request : <GET_PREIMAGE : 1> <hash_type : 1> <hash : 32>
@@ -25,6 +34,83 @@
 // Response: <is_found(0 or 1) : 1> <leaf_index : 4>
 #define CCMD_GET_MERKLE_LEAF_INDEX 0x42
 
+// Request : <CCMD_GET_MERKLE_LEAF_PROOFS : 1> <merkle_root : 32> <tree_size : varint>
+//           <first_leaf_index : varint> <n_leaves : varint>
+// Response: <proof_size : 1> <n_proof_elements : 1> <proof_hash 1 : 32> ... <proof_hash
+//           n_proof_elements : 32>
+//           The multiproof contains, in left-to-right order, the hashes of the requested leaves and
+//           of the maximal subtrees not containing any requested leaf.
+//           If n_proof_elements < proof_size, then subsequent elements will be given as responses
+//           of CCMD_GET_MORE_ELEMENTS.
+#define CCMD_GET_MERKLE_LEAF_PROOFS 0x43
+
+// Request : <CCMD_GET_MERKLE_LEAF_ELEMENTS : 1> <merkle_root : 32> <tree_size : varint>
+//           <n_leaves : 1> <leaf_index 1 : varint> ... <leaf_index n_leaves : varint>
+// Response: <data_len : varint> <n_bytes : 1> <data : n_bytes>
+//           The leaf indexes are strictly increasing. The data is the multiproof of the requested
+//           leaves (as for CCMD_GET_MERKLE_LEAF_PROOFS, without its length), followed by
+//           <preimage_len : varint> <preimage : preimage_len> for each of the requested leaves.
+//           If n_bytes < data_len, the rest of the data will be given as 1-byte elements in the
+//           responses of CCMD_GET_MORE_ELEMENTS.
+#define CCMD_GET_MERKLE_LEAF_ELEMENTS 0x44
+
+// Used instead of CCMD_GET_MERKLE_LEAF_PROOF if the client keeps the table of hash references (see
+// hash_refs.h).
+// Request : <CCMD_GET_MERKLE_LEAF_PROOF_REFS : 1> <root_ref : 1> [<merkle_root : 32>]
+//           <tree_size : varint> <leaf_index : varint> <n_known : 1>
+//           The merkle_root is only present if root_ref is HASH_REF_NONE. The last n_known hashes
+//           of the proof are known by the HWW (see merkle_frontier.h), and are not sent.
+// Response: <leaf_hash : 32> <proof_size : 1> <n_refs : 1> <ref 1 : 1> ... <ref n_refs : 1>
+//           <n_proof_elements : 1> <proof_hash 1 : 32> ... <proof_hash n_proof_elements : 32>
+//           The references are the last n_refs hashes of the proof; the other ones are sent in
+//           full, and if n_proof_elements < proof_size - n_refs, subsequent ones will be given as
+//           responses of CCMD_GET_MORE_ELEMENTS.
+#define CCMD_GET_MERKLE_LEAF_PROOF_REFS 0x45
+
+// Used to announce the values that the HWW is going to read next (see access_plan.h); it replaces
+// the previous access plan, if any.
+// Request : <CCMD_ANNOUNCE_ACCESS_PLAN : 1> <maps_root : 32> <n_maps : varint> <n_keys : 1>
+//           <key_len 1 : 1> <key 1 : key_len 1> ... <key_len n : 1> <key n : key_len n>
+// Response: empty
+//           The data of the plan is, for each of the n_maps merkleized maps of the list with root
+//           maps_root, in order, and for each of the keys that is in the map, in order:
+//           <preimage_len : varint> <preimage : preimage_len> <proof_hash 1 : 32> ...
+//           <proof_hash proof_size : 32>, that is, the preimage of the leaf of the value, followed
+//           by its proof from the leaf to the root.
+#define CCMD_ANNOUNCE_ACCESS_PLAN 0x46
+
+// Used to get the next bytes of the data of the current access plan.
+// Request : <CCMD_GET_ACCESS_PLAN_DATA : 1>
+// Response: <n_bytes : varint> <data : n_bytes>
+#define CCMD_GET_ACCESS_PLAN_DATA 0x47
+
+// Used to start the stream of all the leaves of a Merkle tree, without proofs (see tree_stream.h);
+// it replaces the previous stream, if any.
+// Request : <CCMD_STREAM_MERKLE_TREE : 1> <merkle_root : 32> <tree_size : varint>
+// Response: <n_bytes : varint> <data : n_bytes>
+//           The data of the stream is, for each of the tree_size leaves of the tree, in order:
+//           <preimage_len : varint> <preimage : preimage_len>, where the preimage of the leaf is
+//           0x00 followed by the element; the response contains the first bytes of the data.
+#define CCMD_STREAM_MERKLE_TREE 0x48
+
+// Used to get the next bytes of the data of the current tree stream.
+// Request : <CCMD_GET_TREE_STREAM_DATA : 1>
+// Response: <n_bytes : varint> <data : n_bytes>
+#define CCMD_GET_TREE_STREAM_DATA 0x49
+
+/* OFFLOADED STATE */
+
+// Used to store a record on the host; it replaces the record with the same index, if any. Records
+// are opaque to the host, and only last for the current command.
+// Request : <CCMD_PUT_RECORD : 1> <record_index : varint> <record_len : 1> <record : record_len>
+// Response: empty
+#define CCMD_PUT_RECORD 0x50
+
+// Used to get back a record stored with CCMD_PUT_RECORD during the current command.
+// Request : <CCMD_GET_RECORD : 1> <record_index : varint>
+// Response: <record_len : 1> <record : record_len>
+#define CCMD_GET_RECORD 0x51
+
 /* GENERIC/MULTIPURPOSE */
 
 // Used to get additional elements from the host when the required response from an interruption did
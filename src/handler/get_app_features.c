@@ -0,0 +1,72 @@
+/*****************************************************************************
+ *   Ledger App Bitcoin.
+ *   (c) 2021 Ledger SAS.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *****************************************************************************/
+
+#include <stdint.h>
+
+#include "boilerplate/constants.h"
+#include "boilerplate/dispatcher.h"
+#include "boilerplate/sw.h"
+#include "common/write.h"
+#include "../commands.h"
+
+#include "handlers.h"
+
+void handler_get_app_features(dispatcher_context_t *dc, uint8_t p2) {
+    (void) p2;
+
+    uint32_t features = APP_FEATURE_MERKLE_LEAF_PROOFS | APP_FEATURE_GET_WALLET_ADDRESSES |
+                        APP_FEATURE_GET_EXTENDED_PUBKEYS | APP_FEATURE_QUEUED_YIELDS |
+                        APP_FEATURE_MERKLE_LEAF_ELEMENTS | APP_FEATURE_HASHED_MESSAGES |
+                        APP_FEATURE_SIGN_MESSAGES | APP_FEATURE_INPUT_SUBSETS |
+                        APP_FEATURE_RESUMABLE_SIGNING | APP_FEATURE_PROGRESS_EVENTS;
+#ifdef HAVE_WALLET_SESSIONS
+    features |= APP_FEATURE_WALLET_SESSIONS | APP_FEATURE_COMPILED_POLICIES;
+#endif
+#ifdef HAVE_EXTENDED_APDUS
+    features |= APP_FEATURE_EXTENDED_APDUS;
+#endif
+#ifdef HAVE_HASH_REFS
+    features |= APP_FEATURE_HASH_REFS;
+#endif
+#ifdef HAVE_ACCESS_PLANS
+    features |= APP_FEATURE_ACCESS_PLANS;
+#endif
+#ifdef HAVE_TREE_STREAMS
+    features |= APP_FEATURE_TREE_STREAMS;
+#endif
+#ifdef HAVE_PAYEE_LISTS
+    features |= APP_FEATURE_PAYEE_LISTS;
+#endif
+#ifdef HAVE_OFFLOADED_RECORDS
+    features |= APP_FEATURE_OFFLOADED_RECORDS;
+#endif
+#ifdef HAVE_MULTI_WALLET_SIGNING
+    features |= APP_FEATURE_MULTI_WALLET_SIGNING;
+#endif
+#ifdef HAVE_PSBT_BATCHES
+    features |= APP_FEATURE_PSBT_BATCHES;
+#endif
+#ifdef HAVE_WALLET_REGISTRY
+    features |= APP_FEATURE_WALLET_REGISTRY;
+#endif
+
+    uint8_t response[1 + 4];
+    response[0] = MAX_PROTOCOL_VERSION;
+    write_u32_be(response, 1, features);
+
+    SEND_RESPONSE(dc, response, sizeof(response), SW_OK);
+}
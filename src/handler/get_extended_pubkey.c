@@ -16,19 +16,27 @@
  *****************************************************************************/
 
 #include <stdint.h>
+#include <string.h>
 
 #include "boilerplate/io.h"
 #include "boilerplate/dispatcher.h"
 #include "boilerplate/sw.h"
 #include "../common/bip32.h"
+#include "../common/buffer.h"
+#include "../common/write.h"
 #include "../commands.h"
 #include "../constants.h"
 #include "../crypto.h"
 #include "../ui/display.h"
 #include "../ui/menu.h"
 
+#include "client_commands.h"
+
 #define H 0x80000000ul
 
+// Maximum length of the serialized paths of a GET_EXTENDED_PUBKEYS request
+#define MAX_GET_EXTENDED_PUBKEYS_DATA_LEN 255
+
 static bool is_path_safe_for_pubkey_export(const uint32_t bip32_path[],
                                            size_t bip32_path_len,
                                            const uint32_t coin_types[],
@@ -176,3 +184,143 @@ void handler_get_extended_pubkey(dispatcher_context_t *dc, uint8_t p2) {
 
     SEND_RESPONSE(dc, serialized_pubkey_str, strlen(serialized_pubkey_str), SW_OK);
 }
+
+/**
+ * Computes the extended pubkeys at the n_paths paths serialized in paths_buf and yields each of
+ * them to the client, reusing node across consecutive paths.
+ *
+ * Returns true on success; otherwise, it sends the status word and returns false. The caller must
+ * wipe node in all cases.
+ */
+static bool yield_extended_pubkeys(dispatcher_context_t *dc,
+                                   buffer_t *paths_buf,
+                                   uint8_t n_paths,
+                                   bip32_node_t *node) {
+    for (uint8_t i = 0; i < n_paths; i++) {
+        uint8_t bip32_path_len;
+        uint32_t bip32_path[MAX_BIP32_PATH_STEPS];
+        if (!buffer_read_u8(paths_buf, &bip32_path_len) ||
+            !buffer_read_bip32_path(paths_buf, bip32_path, bip32_path_len)) {
+            SEND_SW(dc, SW_BAD_STATE);  // should never happen, the paths were already validated
+            return false;
+        }
+
+        // all the safe paths have at least 2 steps
+        if (!crypto_derive_bip32_node(node, bip32_path, bip32_path_len - 1)) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return false;
+        }
+
+        serialized_extended_pubkey_t ext_pubkey;
+        write_u32_be(ext_pubkey.version, 0, BIP32_PUBKEY_VERSION);
+        ext_pubkey.depth = bip32_path_len;
+        write_u32_be(ext_pubkey.parent_fingerprint,
+                     0,
+                     crypto_get_key_fingerprint(node->compressed_pubkey));
+        write_u32_be(ext_pubkey.child_number, 0, bip32_path[bip32_path_len - 1]);
+
+        uint8_t child_privkey[32];
+        int ret = bip32_CKDpriv(node->privkey,
+                                node->chain_code,
+                                node->compressed_pubkey,
+                                bip32_path[bip32_path_len - 1],
+                                child_privkey,
+                                ext_pubkey.chain_code,
+                                ext_pubkey.compressed_pubkey);
+        explicit_bzero(child_privkey, sizeof(child_privkey));
+        if (ret < 0) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return false;
+        }
+
+        char serialized_pubkey_str[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+        int serialized_pubkey_len = crypto_serialize_extended_pubkey(&ext_pubkey,
+                                                                     serialized_pubkey_str);
+        if (serialized_pubkey_len < 0) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return false;
+        }
+
+        // yield the extended pubkey
+        uint8_t cmd = CCMD_YIELD;
+        dc->add_to_response(&cmd, 1);
+        dc->add_to_response(serialized_pubkey_str, serialized_pubkey_len);
+        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+
+        if (dc->process_interruption(dc) < 0) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return false;
+        }
+    }
+    return true;
+}
+
+void handler_get_extended_pubkeys(dispatcher_context_t *dc, uint8_t p2) {
+    (void) p2;
+
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    uint8_t n_paths;
+    if (!buffer_read_u8(&dc->read_buffer, &n_paths)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (n_paths == 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    // The read buffer is overwritten by the responses to the interruptions; therefore, we keep a
+    // copy of the serialized paths, after validating all of them.
+    uint8_t paths_data[MAX_GET_EXTENDED_PUBKEYS_DATA_LEN];
+    size_t paths_data_len = dc->read_buffer.size - dc->read_buffer.offset;
+    if (paths_data_len > sizeof(paths_data)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+    memcpy(paths_data, dc->read_buffer.ptr + dc->read_buffer.offset, paths_data_len);
+
+    uint32_t coin_types[2] = {BIP44_COIN_TYPE, BIP44_COIN_TYPE_2};
+    for (uint8_t i = 0; i < n_paths; i++) {
+        uint8_t bip32_path_len;
+        uint32_t bip32_path[MAX_BIP32_PATH_STEPS];
+        if (!buffer_read_u8(&dc->read_buffer, &bip32_path_len)) {
+            SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+            return;
+        }
+
+        if (bip32_path_len > MAX_BIP32_PATH_STEPS) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+
+        if (!buffer_read_bip32_path(&dc->read_buffer, bip32_path, bip32_path_len)) {
+            SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+            return;
+        }
+
+        // pubkeys are not shown on screen, therefore only safe paths can be exported
+        if (!is_path_safe_for_pubkey_export(bip32_path, bip32_path_len, coin_types, 2)) {
+            SEND_SW(dc, SW_NOT_SUPPORTED);
+            return;
+        }
+    }
+
+    buffer_t paths_buf = buffer_create(paths_data, paths_data_len);
+
+    bip32_node_t node;
+    node.is_valid = false;
+    bool result = yield_extended_pubkeys(dc, &paths_buf, n_paths, &node);
+    explicit_bzero(&node, sizeof(node));
+
+    if (result) {
+        SEND_SW(dc, SW_OK);
+    }
+}
@@ -0,0 +1,37 @@
+/*****************************************************************************
+ *   Ledger App Bitcoin.
+ *   (c) 2021 Ledger SAS.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *****************************************************************************/
+
+#ifdef HAVE_PERF_COUNTERS
+
+#include <stdint.h>
+
+#include "boilerplate/dispatcher.h"
+#include "boilerplate/sw.h"
+#include "../perf_counters.h"
+
+#include "handlers.h"
+
+void handler_get_perf_counters(dispatcher_context_t *dc, uint8_t p2) {
+    (void) p2;
+
+    uint8_t response[PERF_COUNTERS_SERIALIZED_LEN];
+    perf_counters_serialize(response);
+
+    SEND_RESPONSE(dc, response, sizeof(response), SW_OK);
+}
+
+#endif
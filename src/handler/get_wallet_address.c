@@ -16,6 +16,7 @@
  *****************************************************************************/
 
 #include <stdint.h>
+#include <string.h>
 
 #include "boilerplate/io.h"
 #include "boilerplate/sw.h"
@@ -38,63 +39,63 @@
 #include "lib/policy.h"
 #include "lib/get_preimage.h"
 #include "lib/get_merkle_leaf_element.h"
+#include "lib/wallet_registry.h"
+#include "lib/wallet_session.h"
 
 #include "handlers.h"
 #include "client_commands.h"
 
-void handler_get_wallet_address(dispatcher_context_t *dc, uint8_t p2) {
-    (void) p2;
-
-    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
-
-    // Device must be unlocked
-    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
-        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
-        return;
-    }
-
-    uint8_t display_address;
-
-    uint32_t address_index;
-    uint8_t is_change;
-
-    uint8_t wallet_id[32];
-    uint8_t wallet_hmac[32];
-
-    bool is_wallet_canonical;
-    int address_type;
-
-    policy_map_wallet_header_t wallet_header;
-
-    union {
-        uint8_t bytes[MAX_WALLET_POLICY_BYTES];
-        policy_node_t parsed;
-    } wallet_policy_map;
-
-    if (!buffer_read_u8(&dc->read_buffer, &display_address) ||
-        !buffer_read_bytes(&dc->read_buffer, wallet_id, 32) ||
-        !buffer_read_bytes(&dc->read_buffer, wallet_hmac, 32)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return;
-    }
-
-    // change
-    if (!buffer_read_u8(&dc->read_buffer, &is_change)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return;
+// Number of addresses of GET_WALLET_ADDRESSES whose scripts are computed before being encoded
+// together with get_script_addresses; only a single one on Nano S, in order to save stack, unless
+// miniscript is compiled out.
+#if defined(TARGET_NANOS) && defined(SIMPLE_POLICIES_ONLY)
+#define WALLET_ADDRESSES_BATCH 2
+#elif defined(TARGET_NANOS)
+#define WALLET_ADDRESSES_BATCH 1
+#else
+#define WALLET_ADDRESSES_BATCH 4
+#endif
+
+/**
+ * Fetches and parses the wallet policy with the given id, and verifies that addresses on the given
+ * change branch up to max_address_index can be returned for it: either the wallet is registered and
+ * the hmac is correct, or it is a canonical wallet and max_address_index is within the standard
+ * range. If an open wallet session matches the wallet id and hmac, its stored policy is used; so
+ * is a wallet policy with the given id in the registry of the device, whatever the hmac.
+ *
+ * Returns true on success; otherwise, it sends the status word and returns false.
+ */
+static bool __attribute__((noinline))
+get_verified_wallet_policy(dispatcher_context_t *dc,
+                           const uint8_t wallet_id[static 32],
+                           const uint8_t wallet_hmac[static 32],
+                           uint8_t is_change,
+                           uint32_t max_address_index,
+                           policy_map_wallet_header_t *wallet_header,
+                           uint8_t wallet_policy_map_bytes[static MAX_WALLET_POLICY_BYTES],
+                           bool *is_wallet_canonical) {
+    // true if the wallet policy is taken from the open wallet session
+    bool is_session_wallet = false;
+
+#ifdef HAVE_WALLET_SESSIONS
+    const wallet_session_t *session = wallet_session_get(wallet_id, wallet_hmac);
+#ifdef HAVE_WALLET_REGISTRY
+    if (session == NULL) {
+        // a wallet policy stored in the registry, with the user's approval, is used whatever the
+        // hmac
+        session = wallet_registry_get(wallet_id);
     }
-    if (is_change != 0 && is_change != 1) {
-        SEND_SW(dc, SW_INCORRECT_DATA);
-        return;
+#endif
+    if (session != NULL) {
+        // the policy was already fetched, parsed and its hmac verified when opening the session,
+        // or when storing it in the registry
+        memcpy(wallet_header, &session->wallet_header, sizeof(policy_map_wallet_header_t));
+        memcpy(wallet_policy_map_bytes, session->wallet_policy_map_bytes, MAX_WALLET_POLICY_BYTES);
+        is_session_wallet = true;
     }
+#endif
 
-    // address index
-    if (!buffer_read_u32(&dc->read_buffer, &address_index, BE)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return;
-    }
-
-    {
+    if (!is_session_wallet) {
         uint8_t serialized_wallet_policy[MAX_WALLET_POLICY_SERIALIZED_LENGTH];
 
         // Fetch the serialized wallet policy from the client
@@ -104,21 +105,20 @@ void handler_get_wallet_address(dispatcher_context_t *dc, uint8_t p2) {
                                                              sizeof(serialized_wallet_policy));
         if (serialized_wallet_policy_len < 0) {
             SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return false;
         }
 
         buffer_t serialized_wallet_policy_buf =
             buffer_create(serialized_wallet_policy, serialized_wallet_policy_len);
 
-        uint8_t policy_map_descriptor[MAX_DESCRIPTOR_TEMPLATE_LENGTH];
         if (0 > read_and_parse_wallet_policy(dc,
                                              &serialized_wallet_policy_buf,
-                                             &wallet_header,
-                                             policy_map_descriptor,
-                                             wallet_policy_map.bytes,
-                                             sizeof(wallet_policy_map.bytes))) {
+                                             wallet_header,
+                                             NULL,
+                                             wallet_policy_map_bytes,
+                                             MAX_WALLET_POLICY_BYTES)) {
             SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return false;
         }
     }
 
@@ -128,19 +128,21 @@ void handler_get_wallet_address(dispatcher_context_t *dc, uint8_t p2) {
         hmac_or = hmac_or | wallet_hmac[i];
     }
 
-    if (hmac_or == 0) {
+    if (is_session_wallet) {
+        *is_wallet_canonical = false;
+    } else if (hmac_or == 0) {
         // No hmac, verify that the policy is a canonical one that is allowed by default
-        address_type = get_policy_address_type(&wallet_policy_map.parsed);
+        int address_type = get_policy_address_type((const policy_node_t *) wallet_policy_map_bytes);
         if (address_type == -1) {
             PRINTF("Non-standard policy, and no hmac provided\n");
             SEND_SW(dc, SW_SIGNATURE_FAIL);
-            return;
+            return false;
         }
 
-        if (wallet_header.n_keys != 1) {
+        if (wallet_header->n_keys != 1) {
             PRINTF("Standard wallets must have exactly 1 key\n");
             SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return false;
         }
 
         // we check if the key is indeed internal
@@ -148,28 +150,28 @@ void handler_get_wallet_address(dispatcher_context_t *dc, uint8_t p2) {
 
         uint8_t key_info_str[MAX_POLICY_KEY_INFO_LEN];
         int key_info_len = call_get_merkle_leaf_element(dc,
-                                                        wallet_header.keys_info_merkle_root,
-                                                        wallet_header.n_keys,
+                                                        wallet_header->keys_info_merkle_root,
+                                                        wallet_header->n_keys,
                                                         0,  // only one key
                                                         key_info_str,
                                                         sizeof(key_info_str));
         if (key_info_len < 0) {
             SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return false;
         }
 
         // Make a sub-buffer for the pubkey info
         buffer_t key_info_buffer = buffer_create(key_info_str, key_info_len);
 
         policy_map_key_info_t key_info;
-        if (parse_policy_map_key_info(&key_info_buffer, &key_info, wallet_header.version) == -1) {
+        if (parse_policy_map_key_info(&key_info_buffer, &key_info, wallet_header->version) == -1) {
             SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return false;
         }
 
         if (read_u32_be(key_info.master_key_fingerprint, 0) != master_key_fingerprint) {
             SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return false;
         }
 
         // generate pubkey and check if it matches
@@ -183,12 +185,12 @@ void handler_get_wallet_address(dispatcher_context_t *dc, uint8_t p2) {
         if (serialized_pubkey_len == -1) {
             PRINTF("Failed to derive pubkey\n");
             SEND_SW(dc, SW_BAD_STATE);
-            return;
+            return false;
         }
 
         if (strncmp(key_info.ext_pubkey, pubkey_derived, MAX_SERIALIZED_PUBKEY_LENGTH) != 0) {
             SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return false;
         }
 
         // check if derivation path is indeed standard
@@ -198,7 +200,7 @@ void handler_get_wallet_address(dispatcher_context_t *dc, uint8_t p2) {
 
         if (key_info.master_key_derivation_len != 3) {
             SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return false;
         }
 
         uint32_t coin_types[2] = {BIP44_COIN_TYPE, BIP44_COIN_TYPE_2};
@@ -208,45 +210,110 @@ void handler_get_wallet_address(dispatcher_context_t *dc, uint8_t p2) {
             bip32_path[i] = key_info.master_key_derivation[i];
         }
         bip32_path[3] = is_change ? 1 : 0;
-        bip32_path[4] = address_index;
+        bip32_path[4] = max_address_index;
 
         if (!is_address_path_standard(bip32_path, 5, bip44_purpose, coin_types, 2, -1)) {
             SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return false;
         }
 
-        is_wallet_canonical = true;
+        *is_wallet_canonical = true;
     } else {
         // Verify hmac
 
         if (!check_wallet_hmac(wallet_id, wallet_hmac)) {
             PRINTF("Incorrect hmac\n");
             SEND_SW(dc, SW_SIGNATURE_FAIL);
-            return;
+            return false;
         }
 
-        is_wallet_canonical = false;
+        *is_wallet_canonical = false;
     }
 
     // Swap feature: check that wallet is canonical
-    if (G_swap_state.called_from_swap && !is_wallet_canonical) {
+    if (G_swap_state.called_from_swap && !*is_wallet_canonical) {
         PRINTF("Must be a canonical wallet for swap feature\n");
         SEND_SW(dc, SW_INCORRECT_DATA);
-        return;
+        return false;
     }
 
     {
         uint8_t computed_wallet_id[32];
         // Compute the wallet id (sha256 of the serialization)
-        get_policy_wallet_id(&wallet_header, computed_wallet_id);
+        get_policy_wallet_id(wallet_header, computed_wallet_id);
 
-        if (memcmp(wallet_id, computed_wallet_id, sizeof(wallet_id)) != 0) {
+        if (memcmp(wallet_id, computed_wallet_id, sizeof(computed_wallet_id)) != 0) {
             PRINTF("Mismatching wallet policy id\n");
             SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+            return false;
         }
     }
 
+    return true;
+}
+
+void handler_get_wallet_address(dispatcher_context_t *dc, uint8_t p2) {
+    (void) p2;
+
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    uint8_t display_address;
+
+    uint32_t address_index;
+    uint8_t is_change;
+
+    uint8_t wallet_id[32];
+    uint8_t wallet_hmac[32];
+
+    bool is_wallet_canonical;
+
+    policy_map_wallet_header_t wallet_header;
+
+    union {
+        uint8_t bytes[MAX_WALLET_POLICY_BYTES];
+        policy_node_t parsed;
+    } wallet_policy_map;
+
+    if (!buffer_read_u8(&dc->read_buffer, &display_address) ||
+        !buffer_read_bytes(&dc->read_buffer, wallet_id, 32) ||
+        !buffer_read_bytes(&dc->read_buffer, wallet_hmac, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    // change
+    if (!buffer_read_u8(&dc->read_buffer, &is_change)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+    if (is_change != 0 && is_change != 1) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    // address index
+    if (!buffer_read_u32(&dc->read_buffer, &address_index, BE)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (!get_verified_wallet_policy(dc,
+                                    wallet_id,
+                                    wallet_hmac,
+                                    is_change,
+                                    address_index,
+                                    &wallet_header,
+                                    wallet_policy_map.bytes,
+                                    &is_wallet_canonical)) {
+        return;
+    }
+
     {
         uint8_t script[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
 
@@ -288,3 +355,122 @@ void handler_get_wallet_address(dispatcher_context_t *dc, uint8_t p2) {
         SEND_RESPONSE(dc, address, address_len, SW_OK);
     }
 }
+
+void handler_get_wallet_addresses(dispatcher_context_t *dc, uint8_t p2) {
+    (void) p2;
+
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    uint8_t is_change;
+    uint32_t first_address_index;
+    uint32_t n_addresses;
+
+    uint8_t wallet_id[32];
+    uint8_t wallet_hmac[32];
+
+    bool is_wallet_canonical;
+
+    policy_map_wallet_header_t wallet_header;
+
+    union {
+        uint8_t bytes[MAX_WALLET_POLICY_BYTES];
+        policy_node_t parsed;
+    } wallet_policy_map;
+
+    if (!buffer_read_bytes(&dc->read_buffer, wallet_id, 32) ||
+        !buffer_read_bytes(&dc->read_buffer, wallet_hmac, 32) ||
+        !buffer_read_u8(&dc->read_buffer, &is_change) ||
+        !buffer_read_u32(&dc->read_buffer, &first_address_index, BE) ||
+        !buffer_read_u32(&dc->read_buffer, &n_addresses, BE)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (is_change != 0 && is_change != 1) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    // all the address indexes must be non-hardened
+    if (n_addresses == 0 || first_address_index >= BIP32_FIRST_HARDENED_CHILD ||
+        n_addresses > BIP32_FIRST_HARDENED_CHILD - first_address_index) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    if (!get_verified_wallet_policy(dc,
+                                    wallet_id,
+                                    wallet_hmac,
+                                    is_change,
+                                    first_address_index + n_addresses - 1,
+                                    &wallet_header,
+                                    wallet_policy_map.bytes,
+                                    &is_wallet_canonical)) {
+        return;
+    }
+
+    // the keys information and their /<change> children are only derived for the first address
+    derived_pubkeys_cache_t derived_pubkeys_cache;
+    memset(&derived_pubkeys_cache, 0, sizeof(derived_pubkeys_cache));
+
+    for (uint32_t i = 0; i < n_addresses; i += WALLET_ADDRESSES_BATCH) {
+        size_t batch_size = MIN(WALLET_ADDRESSES_BATCH, n_addresses - i);
+
+        uint8_t scripts[WALLET_ADDRESSES_BATCH][MAX_PREVOUT_SCRIPTPUBKEY_LEN];
+        const uint8_t *script_ptrs[WALLET_ADDRESSES_BATCH];
+        size_t script_lens[WALLET_ADDRESSES_BATCH];
+        for (size_t k = 0; k < batch_size; k++) {
+            int script_len = get_wallet_script(
+                dc,
+                &wallet_policy_map.parsed,
+                &(wallet_derivation_info_t){.wallet_version = wallet_header.version,
+                                            .keys_merkle_root = wallet_header.keys_info_merkle_root,
+                                            .n_keys = wallet_header.n_keys,
+                                            .change = is_change,
+                                            .address_index = first_address_index + i + k,
+                                            .cache = &derived_pubkeys_cache},
+                scripts[k]);
+            if (script_len < 0) {
+                PRINTF("Couldn't produce wallet script\n");
+                SEND_SW(dc, SW_BAD_STATE);  // unexpected
+                return;
+            }
+            script_ptrs[k] = scripts[k];
+            script_lens[k] = (size_t) script_len;
+        }
+
+        char addresses[WALLET_ADDRESSES_BATCH][MAX_ADDRESS_LENGTH_STR + 1];  // null-terminated
+        int address_lens[WALLET_ADDRESSES_BATCH];
+        if (get_script_addresses(script_ptrs,
+                                 script_lens,
+                                 batch_size,
+                                 addresses[0],
+                                 sizeof(addresses[0]),
+                                 address_lens) < 0) {
+            PRINTF("Could not produce address\n");
+            SEND_SW(dc, SW_BAD_STATE);  // unexpected
+            return;
+        }
+
+        for (size_t k = 0; k < batch_size; k++) {
+            // yield the address
+            uint8_t cmd = CCMD_YIELD;
+            dc->add_to_response(&cmd, 1);
+            dc->add_to_response(addresses[k], address_lens[k]);
+            dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+
+            if (dc->process_interruption(dc) < 0) {
+                SEND_SW(dc, SW_BAD_STATE);
+                return;
+            }
+        }
+    }
+
+    SEND_SW(dc, SW_OK);
+}
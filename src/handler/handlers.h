@@ -2,9 +2,31 @@
 
 #include "../boilerplate/dispatcher.h"
 
+void handler_get_app_features(dispatcher_context_t *dispatcher_context, uint8_t p2);
 void handler_get_extended_pubkey(dispatcher_context_t *dispatcher_context, uint8_t p2);
+void handler_get_extended_pubkeys(dispatcher_context_t *dispatcher_context, uint8_t p2);
 void handler_get_master_fingerprint(dispatcher_context_t *dispatcher_context, uint8_t p2);
 void handler_get_wallet_address(dispatcher_context_t *dispatcher_context, uint8_t p2);
+void handler_get_wallet_addresses(dispatcher_context_t *dispatcher_context, uint8_t p2);
 void handler_register_wallet(dispatcher_context_t *dispatcher_context, uint8_t p2);
+#ifdef HAVE_PAYEE_LISTS
+void handler_register_payee_list(dispatcher_context_t *dispatcher_context, uint8_t p2);
+#endif
 void handler_sign_message(dispatcher_context_t *dispatcher_context, uint8_t p2);
+void handler_sign_messages(dispatcher_context_t *dispatcher_context, uint8_t p2);
 void handler_sign_psbt(dispatcher_context_t *dispatcher_context, uint8_t p2);
+#ifdef HAVE_PSBT_BATCHES
+void handler_sign_psbt_batch(dispatcher_context_t *dispatcher_context, uint8_t p2);
+#endif
+#ifdef HAVE_WALLET_SESSIONS
+void handler_open_wallet_session(dispatcher_context_t *dispatcher_context, uint8_t p2);
+#endif
+#ifdef HAVE_SIGN_PSBT_DRY_RUN
+void handler_sign_psbt_dry_run(dispatcher_context_t *dispatcher_context, uint8_t p2);
+#endif
+#ifdef HAVE_PERF_COUNTERS
+void handler_get_perf_counters(dispatcher_context_t *dispatcher_context, uint8_t p2);
+#endif
+#ifdef HAVE_TRACE
+void handler_get_trace(dispatcher_context_t *dispatcher_context, uint8_t p2);
+#endif
@@ -0,0 +1,203 @@
+#include <string.h>
+
+#include "os.h"
+
+#include "access_plan.h"
+
+#include "../../common/buffer.h"
+#include "../../common/varint.h"
+#include "../../boilerplate/sw.h"
+#include "../client_commands.h"
+#include "get_merkle_leaf_index.h"
+
+#include "debug-helpers/debug.h"
+
+#ifdef HAVE_ACCESS_PLANS
+
+access_plan_t G_access_plan;
+
+void access_plan_reset(uint8_t protocol_version) {
+    explicit_bzero(&G_access_plan, sizeof(G_access_plan));
+    G_access_plan.is_enabled = protocol_version >= ACCESS_PLAN_PROTOCOL_VERSION;
+}
+
+int call_announce_access_plan(dispatcher_context_t *dc,
+                              const uint8_t maps_root[static 32],
+                              uint32_t n_maps,
+                              const uint8_t *const keys[],
+                              const uint8_t key_lens[],
+                              size_t n_keys) {
+    // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    if (!G_access_plan.is_enabled || n_keys == 0 || n_keys > ACCESS_PLAN_MAX_KEYS) {
+        return -1;
+    }
+
+    // the data of the previous plan, if any, is discarded
+    G_access_plan.offset = 0;
+    G_access_plan.n_available = 0;
+
+    {  // make sure memory is deallocated as soon as possible
+        uint8_t tmp[9];
+        tmp[0] = CCMD_ANNOUNCE_ACCESS_PLAN;
+        dc->add_to_response(tmp, 1);
+
+        dc->add_to_response(maps_root, 32);
+
+        int n_maps_len = varint_write(tmp, 0, n_maps);
+        dc->add_to_response(tmp, n_maps_len);
+
+        tmp[0] = (uint8_t) n_keys;
+        dc->add_to_response(tmp, 1);
+
+        for (size_t i = 0; i < n_keys; i++) {
+            dc->add_to_response(&key_lens[i], 1);
+            dc->add_to_response(keys[i], key_lens[i]);
+        }
+
+        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+    }
+
+    if (dc->process_interruption(dc) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the next len bytes of the data of the plan, requesting more bytes to the client if
+// necessary.
+static int read_plan_data(dispatcher_context_t *dc, uint8_t *out, size_t len) {
+    while (len > 0) {
+        if (G_access_plan.n_available == 0) {
+            uint8_t req_more[] = {CCMD_GET_ACCESS_PLAN_DATA};
+            SET_RESPONSE(dc, req_more, sizeof(req_more), SW_INTERRUPTED_EXECUTION);
+            if (dc->process_interruption(dc) < 0) {
+                return -1;
+            }
+
+            // Parse response to CCMD_GET_ACCESS_PLAN_DATA
+            uint64_t n_bytes;
+            if (!buffer_read_varint(&dc->read_buffer, &n_bytes) || n_bytes == 0 ||
+                n_bytes > ACCESS_PLAN_BUFFER_SIZE ||
+                !buffer_read_bytes(&dc->read_buffer, G_access_plan.buffer, (size_t) n_bytes)) {
+                PRINTF("Invalid access plan data\n");
+                return -1;
+            }
+            G_access_plan.offset = 0;
+            G_access_plan.n_available = (uint16_t) n_bytes;
+        }
+
+        size_t chunk_len = len < G_access_plan.n_available ? len : G_access_plan.n_available;
+        memcpy(out, G_access_plan.buffer + G_access_plan.offset, chunk_len);
+        out += chunk_len;
+        len -= chunk_len;
+        G_access_plan.offset += chunk_len;
+        G_access_plan.n_available -= chunk_len;
+    }
+    return 0;
+}
+
+// Reads a Bitcoin-style varint from the data of the plan.
+static int read_plan_data_varint(dispatcher_context_t *dc, uint64_t *out) {
+    uint8_t data[9];
+    if (read_plan_data(dc, data, 1) < 0) {
+        return -1;
+    }
+
+    size_t len = data[0] < 0xFD ? 1 : data[0] == 0xFD ? 3 : data[0] == 0xFE ? 5 : 9;
+    if (read_plan_data(dc, data + 1, len - 1) < 0 || varint_read(data, len, out) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the value of the leaf with the given index of the values tree of the map, followed by its
+// Merkle proof, and verifies it. Returns the length of the value, or -1 on failure.
+static int read_planned_value(dispatcher_context_t *dc,
+                              const merkleized_map_commitment_t *map,
+                              uint32_t leaf_index,
+                              uint8_t *out,
+                              size_t out_len) {
+    uint64_t preimage_len;
+    uint8_t prefix;
+    if (read_plan_data_varint(dc, &preimage_len) < 0 || preimage_len == 0 ||
+        read_plan_data(dc, &prefix, 1) < 0 || prefix != 0x00) {
+        return -1;
+    }
+
+    if (preimage_len - 1 > out_len) {
+        PRINTF("Output buffer too short\n");
+        return -1;
+    }
+
+    size_t value_len = (size_t) (preimage_len - 1);
+    if (read_plan_data(dc, out, value_len) < 0) {
+        return -1;
+    }
+
+    uint32_t directions;
+    int n_directions = merkle_get_directions(map->size, leaf_index, &directions);
+    if (n_directions < 0) {
+        return -1;
+    }
+
+    uint8_t cur_hash[32];
+    merkle_compute_element_hash(out, value_len, cur_hash);
+
+    // the proof is climbed one sibling at a time, as it is read
+    for (int cur_step = 0; cur_step < n_directions; cur_step++) {
+        uint8_t sibling[32];
+        if (read_plan_data(dc, sibling, 32) < 0) {
+            return -1;
+        }
+        merkle_climb_path(cur_hash, sibling, 1, directions, n_directions - cur_step);
+    }
+
+    if (memcmp(map->values_root, cur_hash, 32) != 0) {
+        PRINTF("Merkle root mismatch");
+        return -1;
+    }
+    return (int) value_len;
+}
+
+int call_get_planned_map_values(dispatcher_context_t *dc,
+                                const merkleized_map_commitment_t *map,
+                                merkleized_map_value_request_t requests[],
+                                size_t n_requests) {
+    // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    if (!G_access_plan.is_enabled || n_requests > ACCESS_PLAN_MAX_KEYS || map->size > UINT32_MAX) {
+        return -1;
+    }
+
+    int n_found = 0;
+    for (size_t i = 0; i < n_requests; i++) {
+        requests[i].value_len = -1;
+
+        if (requests[i].out_len < 0) {
+            return -1;
+        }
+
+        // the index is usually known from the keys enumerated when the map was fetched
+        int index =
+            call_get_merkleized_map_key_index(dc, map, requests[i].key, requests[i].key_len);
+        if (index < 0) {
+            continue;  // key not found; there is no data for it in the plan
+        }
+
+        requests[i].value_len = read_planned_value(dc,
+                                                   map,
+                                                   (uint32_t) index,
+                                                   requests[i].out,
+                                                   (size_t) requests[i].out_len);
+        if (requests[i].value_len < 0) {
+            // the rest of the data of the plan can not be trusted to be in sync
+            G_access_plan.n_available = 0;
+            return -1;
+        }
+        ++n_found;
+    }
+    return n_found;
+}
+
+#endif
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../boilerplate/constants.h"
+#include "../../boilerplate/dispatcher.h"
+#include "../../common/merkle.h"
+
+#include "get_merkleized_map_value.h"
+
+#ifdef HAVE_ACCESS_PLANS
+
+// Version of the protocol (P2 of the command) from which the client accepts the access plans.
+#define ACCESS_PLAN_PROTOCOL_VERSION 5
+
+// Maximum number of keys of an access plan.
+#define ACCESS_PLAN_MAX_KEYS 4
+
+// Size of the buffer of the data of the access plan; it fits the data of any response, including
+// the extended-length ones.
+#define ACCESS_PLAN_BUFFER_SIZE MAX_EXTENDED_APDU_DATA_LEN
+
+/**
+ * An access plan announces to the client, in a single CCMD_ANNOUNCE_ACCESS_PLAN request, the values
+ * that the device is going to read next: the values of the same keys in each of the merkleized maps
+ * of a list, in order (for example, the previous txid and the witness utxo of each input of the
+ * PSBT). The client answers with a stream of the values and of their Merkle proofs, that the device
+ * reads with CCMD_GET_ACCESS_PLAN_DATA requests: each response is filled with as many bytes as
+ * possible, instead of one round trip per value.
+ *
+ * The stream is independent of the other client commands, that can be interleaved with the
+ * requests of its data; therefore, the bytes not consumed yet are copied from the response.
+ * Each value is verified against the values root of its map, so the data of the plan is as good as
+ * the responses of call_get_merkleized_map_values.
+ */
+typedef struct {
+    bool is_enabled;       // true if the client supports the access plans in the current command
+    uint16_t offset;       // position of the first byte of the buffer not consumed yet
+    uint16_t n_available;  // number of bytes of the buffer not consumed yet
+    uint8_t buffer[ACCESS_PLAN_BUFFER_SIZE];
+} access_plan_t;
+
+extern access_plan_t G_access_plan;
+
+/**
+ * Forgets the current access plan, if any; it is called before processing each command, with the
+ * protocol version of the command.
+ */
+void access_plan_reset(uint8_t protocol_version);
+
+static inline bool access_plan_is_enabled(void) {
+    return G_access_plan.is_enabled;
+}
+
+/**
+ * Announces the access plan of the values of the given keys in each of the merkleized maps of a
+ * list, replacing the previous one, if any.
+ *
+ * @param[in] dispatcher_context
+ *   Pointer to the dispatcher context.
+ * @param[in] maps_root
+ *   The root of the Merkle tree of the list of the merkleized map commitments.
+ * @param[in] n_maps
+ *   The number of maps of the list.
+ * @param[in] keys
+ *   The keys whose values are read in each map.
+ * @param[in] key_lens
+ *   The length of each of the keys.
+ * @param[in] n_keys
+ *   The number of keys; it must be between 1 and ACCESS_PLAN_MAX_KEYS.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int call_announce_access_plan(dispatcher_context_t *dispatcher_context,
+                              const uint8_t maps_root[static 32],
+                              uint32_t n_maps,
+                              const uint8_t *const keys[],
+                              const uint8_t key_lens[],
+                              size_t n_keys);
+
+/**
+ * Reads from the current access plan the values of the next map of the list, as
+ * call_get_merkleized_map_values. The maps must be read in order, each of them exactly once, and the
+ * requested keys must be the ones of the plan, in the same order.
+ *
+ * The outputs are only valid if the return value is not negative.
+ *
+ * @return the number of values found on success, a negative number on failure, including if a
+ * value does not fit in its output buffer.
+ */
+int call_get_planned_map_values(dispatcher_context_t *dispatcher_context,
+                                const merkleized_map_commitment_t *map,
+                                merkleized_map_value_request_t requests[],
+                                size_t n_requests);
+
+#endif
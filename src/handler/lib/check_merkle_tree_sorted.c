@@ -2,6 +2,7 @@
 
 #include "check_merkle_tree_sorted.h"
 #include "get_merkle_leaf_element.h"
+#include "tree_stream.h"
 
 #include "../../common/merkle.h"
 
@@ -15,40 +16,83 @@ int call_check_merkle_tree_sorted_with_callback(dispatcher_context_t *dispatcher
                                                 const uint8_t root[static 32],
                                                 size_t size,
                                                 merkle_tree_elements_callback_t callback,
-                                                const merkleized_map_commitment_t *map_commitment) {
+                                                merkleized_map_commitment_t *map_commitment) {
     // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
     int prev_el_len = 0;
     uint8_t prev_el[MAX_CHECK_MERKLE_TREE_SORTED_PREIMAGE_SIZE];
 
+    if (map_commitment != NULL) {
+        map_commitment->has_key_index = false;
+        memset(map_commitment->key_index, 0, sizeof(map_commitment->key_index));
+    }
+
+#ifdef HAVE_TREE_STREAMS
+    // small trees are streamed without proofs when possible; the root is verified at the end
+    bool is_streamed = tree_stream_is_available(size);
+    if (is_streamed && call_start_tree_stream(dispatcher_context, root, size) < 0) {
+        return -1;
+    }
+#endif
+
+    int ret = 0;
     for (size_t cur_el_idx = 0; cur_el_idx < size; cur_el_idx++) {
         uint8_t cur_el[MAX_CHECK_MERKLE_TREE_SORTED_PREIMAGE_SIZE];
-        int cur_el_len = call_get_merkle_leaf_element(dispatcher_context,
+        int cur_el_len;
+#ifdef HAVE_TREE_STREAMS
+        if (is_streamed) {
+            cur_el_len = call_read_tree_stream_element(dispatcher_context, cur_el, sizeof(cur_el));
+        } else
+#endif
+        {
+            cur_el_len = call_get_merkle_leaf_element(dispatcher_context,
                                                       root,
                                                       size,
                                                       cur_el_idx,
                                                       cur_el,
                                                       sizeof(cur_el));
+        }
 
         if (cur_el_len < 0) {
-            return -1;
+            ret = -1;
+            break;
         }
 
         if (cur_el_idx > 0 && compare_byte_arrays(prev_el, prev_el_len, cur_el, cur_el_len) >= 0) {
             // elements are not in (strict) lexicographical order
             PRINTF("Keys not in order\n");
-            return -1;
+            ret = -1;
+            break;
         }
 
         memcpy(prev_el, cur_el, cur_el_len);
         prev_el_len = cur_el_len;
 
+        if (map_commitment != NULL) {
+            merkleized_map_record_key_index(map_commitment, cur_el, cur_el_len, cur_el_idx);
+        }
+
         if (callback != NULL) {
-            // call callback with data
+            // call callback with data; when streamed, the element is only verified at the end, and
+            // the whole flow fails if it is not
             buffer_t buf = buffer_create(cur_el, cur_el_len);
             callback(dispatcher_context, callback_state, map_commitment, cur_el_idx, &buf);
         }
     }
+
+#ifdef HAVE_TREE_STREAMS
+    if (is_streamed && tree_stream_finish() < 0) {
+        ret = -1;
+    }
+#endif
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (map_commitment != NULL) {
+        map_commitment->has_key_index = true;
+    }
     return 0;
 }
 
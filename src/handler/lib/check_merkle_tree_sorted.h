@@ -20,6 +20,13 @@ typedef void (*merkle_tree_elements_callback_t)(struct dispatcher_context_s *,
  * callback to a non-NULL function is given, it is called once for each of the elements of the
  * Merkle tree, in lexicographical order.
  *
+ * With HAVE_TREE_STREAMS, small trees are streamed without proofs if the client supports it (see
+ * tree_stream.h): the callback might then be called with elements that are only verified once all
+ * of them were read, and the flow fails if they are not valid.
+ *
+ * If map_commitment is not NULL, root must be the root of its keys; the key index table of the map
+ * is filled while the keys are enumerated.
+ *
  * Returns 0 on success, or a negative number on failure.
  */
 int call_check_merkle_tree_sorted_with_callback(dispatcher_context_t *dispatcher_context,
@@ -27,7 +34,7 @@ int call_check_merkle_tree_sorted_with_callback(dispatcher_context_t *dispatcher
                                                 const uint8_t root[static 32],
                                                 size_t size,
                                                 merkle_tree_elements_callback_t callback,
-                                                const merkleized_map_commitment_t *map_commitment);
+                                                merkleized_map_commitment_t *map_commitment);
 
 /**
  * Convenience function to call the get_merkle_tree_sorted flow, with a void callback.
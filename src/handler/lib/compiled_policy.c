@@ -0,0 +1,48 @@
+#include <string.h>
+
+#include "os.h"
+#include "cx.h"
+
+#include "compiled_policy.h"
+#include "policy.h"
+
+#ifdef HAVE_WALLET_SESSIONS
+
+size_t compiled_policy_get_tree_len(const uint8_t *policy_map_bytes, size_t policy_map_bytes_len) {
+    size_t tree_len = policy_map_bytes_len;
+    while (tree_len > 0 && policy_map_bytes[tree_len - 1] == 0) {
+        --tree_len;
+    }
+    return tree_len;
+}
+
+bool compiled_policy_compute_header(const uint8_t wallet_id[static 32],
+                                    const uint8_t *tree,
+                                    size_t tree_len,
+                                    uint8_t header[static COMPILED_POLICY_HEADER_LEN]) {
+    uint8_t tree_hash[32];
+    cx_hash_sha256(tree, tree_len, tree_hash, 32);
+
+    header[0] = COMPILED_POLICY_FORMAT_VERSION;
+    return compute_compiled_policy_hmac(wallet_id, tree_hash, header + 1);
+}
+
+bool compiled_policy_check_header(const uint8_t wallet_id[static 32],
+                                  const uint8_t *tree,
+                                  size_t tree_len,
+                                  const uint8_t header[static COMPILED_POLICY_HEADER_LEN]) {
+    if (header[0] != COMPILED_POLICY_FORMAT_VERSION) {
+        return false;
+    }
+
+    uint8_t expected_header[COMPILED_POLICY_HEADER_LEN];
+    if (!compiled_policy_compute_header(wallet_id, tree, tree_len, expected_header)) {
+        return false;
+    }
+
+    bool result = os_secure_memcmp((void *) (expected_header + 1), (void *) (header + 1), 32) == 0;
+    explicit_bzero(expected_header, sizeof(expected_header));
+    return result;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAVE_WALLET_SESSIONS
+
+// Version of the format of the compiled policies
+#define COMPILED_POLICY_FORMAT_VERSION 1
+
+// Length of the header of a compiled policy: the format version and the hmac
+#define COMPILED_POLICY_HEADER_LEN (1 + 32)
+
+/**
+ * A compiled policy is the abstract syntax tree of a registered wallet policy, as produced by
+ * parse_descriptor_template, prefixed with a header that authenticates it for the wallet id. It is
+ * returned by REGISTER_WALLET, and loaded by OPEN_WALLET_SESSION instead of parsing the descriptor
+ * template again. As the tree only contains relative pointers, it can be used at any address.
+ *
+ * The trailing zero bytes of the tree are not part of the compiled policy; therefore, the tree must
+ * be parsed in a zeroed buffer, and it is loaded in a zeroed buffer.
+ */
+
+/**
+ * Returns the length of the tree in policy_map_bytes, without its trailing zero bytes.
+ */
+size_t compiled_policy_get_tree_len(const uint8_t *policy_map_bytes, size_t policy_map_bytes_len);
+
+/**
+ * Computes the header of the compiled policy of the given tree.
+ *
+ * @return true on success, false otherwise.
+ */
+bool compiled_policy_compute_header(const uint8_t wallet_id[static 32],
+                                    const uint8_t *tree,
+                                    size_t tree_len,
+                                    uint8_t header[static COMPILED_POLICY_HEADER_LEN]);
+
+/**
+ * Checks, in constant time, that the header authenticates the tree for the given wallet id, with
+ * the current version of the app.
+ *
+ * @return true if the compiled policy is valid, false otherwise.
+ */
+bool compiled_policy_check_header(const uint8_t wallet_id[static 32],
+                                  const uint8_t *tree,
+                                  size_t tree_len,
+                                  const uint8_t header[static COMPILED_POLICY_HEADER_LEN]);
+
+#endif
@@ -1,5 +1,6 @@
 #include "get_merkle_leaf_element.h"
 
+#include "get_merkle_leaf_elements.h"
 #include "get_merkle_leaf_hash.h"
 #include "get_merkle_preimage.h"
 
@@ -11,6 +12,14 @@ int call_get_merkle_leaf_element(dispatcher_context_t *dispatcher_context,
                                  size_t out_ptr_len) {
     // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
+#ifdef USE_SINGLE_ROUND_TRIP_LEAF_ELEMENTS
+    merkle_leaf_element_request_t request = {leaf_index, out_ptr, out_ptr_len, -1};
+    if (0 >
+        call_get_merkle_leaf_elements(dispatcher_context, merkle_root, tree_size, &request, 1)) {
+        return -1;
+    }
+    return request.element_len;
+#else
     uint8_t leaf_hash[32];
 
     int res = call_get_merkle_leaf_hash(dispatcher_context,
@@ -22,4 +31,5 @@ int call_get_merkle_leaf_element(dispatcher_context_t *dispatcher_context,
         return res;
     }
     return call_get_merkle_preimage(dispatcher_context, leaf_hash, out_ptr, out_ptr_len);
+#endif
 }
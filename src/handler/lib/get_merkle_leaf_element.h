@@ -3,7 +3,14 @@
 #include "../../boilerplate/dispatcher.h"
 
 /**
- * TODO: docs
+ * Requests the element of a leaf of a Merkle tree to the client, and verifies it against the root.
+ * In builds with USE_SINGLE_ROUND_TRIP_LEAF_ELEMENTS, the proof and the element are received in a
+ * single response stream of CCMD_GET_MERKLE_LEAF_ELEMENTS, which only takes more than one round
+ * trip if they do not fit in one response; otherwise, the leaf hash is obtained with
+ * call_get_merkle_leaf_hash, and its preimage with call_get_merkle_preimage.
+ *
+ * @return the length of the element on success, a negative number on failure, including if the
+ * element does not fit in the output buffer.
  */
 int call_get_merkle_leaf_element(dispatcher_context_t *dispatcher_context,
                                  const uint8_t merkle_root[static 32],
@@ -0,0 +1,233 @@
+#include <string.h>
+
+#include "get_merkle_leaf_elements.h"
+
+#include "../../common/buffer.h"
+#include "../../common/merkle.h"
+#include "../../common/varint.h"
+#include "../../boilerplate/sw.h"
+#include "../client_commands.h"
+
+#include "debug-helpers/debug.h"
+
+typedef struct {
+    dispatcher_context_t *dc;
+    merkle_leaf_element_request_t *requests;
+    size_t n_requests;
+    size_t next_request;  // the first request whose leaf was not reached yet by the multiproof
+    uint8_t leaf_hashes[MAX_MERKLE_LEAF_ELEMENTS_BATCH][32];
+    uint64_t bytes_remaining;  // number of bytes of the data not received yet
+    uint8_t n_available;       // number of bytes of the data still to be consumed in the read_buffer
+} leaf_elements_state_t;
+
+// Reads the next len bytes of the data, requesting more bytes to the client if necessary.
+static int read_data(leaf_elements_state_t *state, uint8_t *out, size_t len) {
+    dispatcher_context_t *dc = state->dc;
+
+    while (len > 0) {
+        if (state->n_available == 0) {
+            if (state->bytes_remaining == 0) {
+                PRINTF("Data shorter than expected\n");
+                return -1;
+            }
+
+            uint8_t req_more[] = {CCMD_GET_MORE_ELEMENTS};
+            SET_RESPONSE(dc, req_more, sizeof(req_more), SW_INTERRUPTED_EXECUTION);
+            if (dc->process_interruption(dc) < 0) {
+                return -1;
+            }
+
+            // Parse response to CCMD_GET_MORE_ELEMENTS
+            uint8_t n_bytes, elements_len;
+            if (!buffer_read_u8(&dc->read_buffer, &n_bytes) ||
+                !buffer_read_u8(&dc->read_buffer, &elements_len) ||
+                !buffer_can_read(&dc->read_buffer, (size_t) n_bytes * elements_len)) {
+                return -1;
+            }
+
+            if (elements_len != 1 || n_bytes == 0 || n_bytes > state->bytes_remaining) {
+                return -1;
+            }
+
+            state->n_available = n_bytes;
+            state->bytes_remaining -= n_bytes;
+        }
+
+        size_t chunk_len = len < state->n_available ? len : state->n_available;
+        if (!buffer_read_bytes(&dc->read_buffer, out, chunk_len)) {
+            return -1;
+        }
+        out += chunk_len;
+        len -= chunk_len;
+        state->n_available -= chunk_len;
+    }
+    return 0;
+}
+
+// Reads a Bitcoin-style varint from the data.
+static int read_data_varint(leaf_elements_state_t *state, uint64_t *out) {
+    uint8_t data[9];
+    if (read_data(state, data, 1) < 0) {
+        return -1;
+    }
+
+    size_t len = data[0] < 0xFD ? 1 : data[0] == 0xFD ? 3 : data[0] == 0xFE ? 5 : 9;
+    if (read_data(state, data + 1, len - 1) < 0 || varint_read(data, len, out) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Computes the hash of the subtree whose leaves have indexes begin, ..., begin + size - 1,
+// consuming the elements of the multiproof in left-to-right order, and storing the hashes of the
+// requested leaves. The recursion depth is at most ceil_lg(tree_size).
+static int compute_subtree_hash(leaf_elements_state_t *state,
+                                uint32_t begin,
+                                uint32_t size,
+                                uint8_t out[static 32]) {
+    // the leaves of the requests before next_request are all before begin
+    if (state->next_request >= state->n_requests ||
+        state->requests[state->next_request].leaf_index >= begin + size) {
+        // no requested leaf in this subtree
+        return read_data(state, out, 32);
+    }
+
+    if (size == 1) {
+        // this is the leaf of the next request
+        if (read_data(state, out, 32) < 0) {
+            return -1;
+        }
+        memcpy(state->leaf_hashes[state->next_request++], out, 32);
+        return 0;
+    }
+
+    // number of leaves of the left subtree: largest power of 2 strictly smaller than size
+    uint32_t left_size = 1 << (ceil_lg(size) - 1);
+
+    uint8_t left_hash[32];
+    if (compute_subtree_hash(state, begin, left_size, left_hash) < 0 ||
+        compute_subtree_hash(state, begin + left_size, size - left_size, out) < 0) {
+        return -1;
+    }
+
+    merkle_combine_hashes(left_hash, out, out);
+    return 0;
+}
+
+// Reads the preimage of the leaf of the i-th request, and checks it against the leaf hash.
+static int read_element(leaf_elements_state_t *state, size_t i) {
+    merkle_leaf_element_request_t *request = &state->requests[i];
+
+    uint64_t preimage_len;
+    uint8_t prefix;
+    if (read_data_varint(state, &preimage_len) < 0 || preimage_len == 0 ||
+        read_data(state, &prefix, 1) < 0 || prefix != 0x00) {
+        return -1;
+    }
+
+    if (preimage_len - 1 > request->out_len) {
+        PRINTF("Output buffer too short\n");
+        return -1;
+    }
+
+    size_t element_len = (size_t) (preimage_len - 1);
+    if (read_data(state, request->out, element_len) < 0) {
+        return -1;
+    }
+
+    uint8_t element_hash[32];
+    merkle_compute_element_hash(request->out, element_len, element_hash);
+    if (memcmp(element_hash, state->leaf_hashes[i], 32) != 0) {
+        PRINTF("Hash mismatch.\n");
+        return -1;
+    }
+
+    request->element_len = (int) element_len;
+    return 0;
+}
+
+int call_get_merkle_leaf_elements(dispatcher_context_t *dc,
+                                  const uint8_t merkle_root[static 32],
+                                  uint32_t tree_size,
+                                  merkle_leaf_element_request_t requests[],
+                                  size_t n_requests) {
+    // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    PRINT_STACK_POINTER();
+
+    if (n_requests == 0 || n_requests > MAX_MERKLE_LEAF_ELEMENTS_BATCH) {
+        return -1;
+    }
+    for (size_t i = 0; i < n_requests; i++) {
+        if (requests[i].leaf_index >= tree_size ||
+            (i > 0 && requests[i].leaf_index <= requests[i - 1].leaf_index)) {
+            return -1;
+        }
+    }
+
+    {  // make sure memory is deallocated as soon as possible
+        uint8_t tmp[9];
+        tmp[0] = CCMD_GET_MERKLE_LEAF_ELEMENTS;
+        dc->add_to_response(tmp, 1);
+
+        dc->add_to_response(merkle_root, 32);
+
+        int tree_size_len = varint_write(tmp, 0, tree_size);
+        dc->add_to_response(tmp, tree_size_len);
+
+        tmp[0] = (uint8_t) n_requests;
+        dc->add_to_response(tmp, 1);
+
+        for (size_t i = 0; i < n_requests; i++) {
+            int leaf_index_len = varint_write(tmp, 0, requests[i].leaf_index);
+            dc->add_to_response(tmp, leaf_index_len);
+        }
+
+        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+    }
+
+    if (dc->process_interruption(dc) < 0) {
+        return -1;
+    }
+
+    leaf_elements_state_t state = {.dc = dc,
+                                   .requests = requests,
+                                   .n_requests = n_requests,
+                                   .next_request = 0};
+
+    uint64_t data_len;
+    if (!buffer_read_varint(&dc->read_buffer, &data_len) ||
+        !buffer_read_u8(&dc->read_buffer, &state.n_available) ||
+        !buffer_can_read(&dc->read_buffer, state.n_available)) {
+        return -1;
+    }
+
+    if (state.n_available > data_len) {
+        PRINTF("Received more data than expected.\n");
+        return -1;
+    }
+    state.bytes_remaining = data_len - state.n_available;
+
+    uint8_t root[32];
+    if (compute_subtree_hash(&state, 0, tree_size, root) < 0) {
+        return -1;
+    }
+
+    if (memcmp(merkle_root, root, 32) != 0) {
+        PRINTF("Merkle root mismatch");
+        return -1;
+    }
+
+    for (size_t i = 0; i < n_requests; i++) {
+        if (read_element(&state, i) < 0) {
+            return -1;
+        }
+    }
+
+    if (state.n_available != 0 || state.bytes_remaining != 0) {
+        PRINTF("Data longer than expected\n");
+        return -1;
+    }
+
+    return 0;
+}
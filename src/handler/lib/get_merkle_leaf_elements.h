@@ -0,0 +1,46 @@
+#pragma once
+
+#include "../../boilerplate/dispatcher.h"
+
+// Maximum number of leaf elements that can be requested with a single call_get_merkle_leaf_elements.
+#define MAX_MERKLE_LEAF_ELEMENTS_BATCH 4
+
+// One of the leaves requested with call_get_merkle_leaf_elements.
+typedef struct {
+    uint32_t leaf_index;  // the index of the leaf in the Merkle tree
+    uint8_t *out;         // the buffer receiving the element (without the 0x00 prefix of its leaf)
+    size_t out_len;       // the length of the out buffer
+    int element_len;      // on success, receives the length of the element
+} merkle_leaf_element_request_t;
+
+/**
+ * In this flow, the HWW sends a CCMD_GET_MERKLE_LEAF_ELEMENTS command in order to obtain the
+ * elements of several leaves of a Merkle tree in a single response stream. The client responds
+ * with the multiproof of the requested leaves, that is verified in a single pass, followed by the
+ * preimages of the leaf hashes, which are checked against the leaf hashes of the multiproof.
+ * Compared to a call_get_merkle_leaf_element for each leaf, the internal nodes shared by the proofs
+ * are only sent and hashed once, and there is a single round trip unless the data does not fit in
+ * one response.
+ *
+ * The outputs are only valid if the return value is not negative.
+ *
+ * @param[in] dispatcher_context
+ *   Pointer to the dispatcher context.
+ * @param[in] merkle_root
+ *   The root of the Merkle tree.
+ * @param[in] tree_size
+ *   The number of leaves of the Merkle tree.
+ * @param[in,out] requests
+ *   The requested leaves, with strictly increasing leaf indexes smaller than tree_size; the
+ *   element_len of each of them is filled on success.
+ * @param[in] n_requests
+ *   The number of requested leaves; it must be between 1 and MAX_MERKLE_LEAF_ELEMENTS_BATCH.
+ *
+ * @return 0 on success, a negative number on failure, including if an element does not fit in its
+ * output buffer.
+ */
+int call_get_merkle_leaf_elements(dispatcher_context_t *dispatcher_context,
+                                  const uint8_t merkle_root[static 32],
+                                  uint32_t tree_size,
+                                  merkle_leaf_element_request_t requests[],
+                                  size_t n_requests);
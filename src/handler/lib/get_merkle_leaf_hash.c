@@ -8,9 +8,171 @@
 #include "../../common/varint.h"
 #include "../../boilerplate/sw.h"
 #include "../client_commands.h"
+#include "hash_refs.h"
+#include "merkle_frontier.h"
 
 #include "debug-helpers/debug.h"
 
+#ifdef HAVE_HASH_REFS
+// As call_get_merkle_leaf_hash, with the GET_MERKLE_LEAF_PROOF_REFS request. The proof stops at the
+// deepest ancestor of the leaf kept in the Merkle frontier, if any.
+static int call_get_merkle_leaf_hash_with_refs(dispatcher_context_t *dc,
+                                               const uint8_t merkle_root[static 32],
+                                               uint32_t tree_size,
+                                               uint32_t leaf_index,
+                                               uint8_t out[static 32]) {
+    // bitmap of the directions from the root to the leaf, computed once for the whole proof
+    uint32_t directions;
+    int n_directions = merkle_get_directions(tree_size, leaf_index, &directions);
+    if (n_directions < 0) {
+        return -1;
+    }
+
+    // the proof is verified up to the hash of this ancestor, which is the root if n_known is 0
+    uint8_t known_hash[32];
+    int n_known =
+        merkle_frontier_find(merkle_root, tree_size, directions, n_directions, known_hash);
+
+    hash_refs_start_exchange();
+
+    {
+        int root_ref = hash_refs_find(merkle_root);
+
+        uint8_t tmp[9];
+        tmp[0] = CCMD_GET_MERKLE_LEAF_PROOF_REFS;
+        tmp[1] = root_ref >= 0 ? (uint8_t) root_ref : HASH_REF_NONE;
+        dc->add_to_response(tmp, 2);
+
+        if (root_ref >= 0) {
+            hash_refs_use((uint8_t) root_ref);
+        } else {
+            dc->add_to_response(merkle_root, 32);
+            hash_refs_add(merkle_root);
+        }
+
+        int tree_size_len = varint_write(tmp, 0, tree_size);
+        dc->add_to_response(tmp, tree_size_len);
+
+        int leaf_index_len = varint_write(tmp, 0, leaf_index);
+        dc->add_to_response(tmp, leaf_index_len);
+
+        tmp[0] = (uint8_t) n_known;
+        dc->add_to_response(tmp, 1);
+
+        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+    }
+
+    if (dc->process_interruption(dc) < 0) {
+        return -1;
+    }
+
+    uint8_t cur_hash[32];
+    uint8_t proof_size;
+    uint8_t n_refs;
+    if (!buffer_read_bytes(&dc->read_buffer, cur_hash, 32) ||
+        !buffer_read_u8(&dc->read_buffer, &proof_size) ||
+        !buffer_read_u8(&dc->read_buffer, &n_refs) || n_refs > proof_size) {
+        return -1;
+    }
+
+    if (proof_size != n_directions - n_known) {
+        PRINTF("Wrong length of the Merkle proof.\n");
+        return -1;
+    }
+
+    // the referenced hashes are the last ones of the proof; they are used before the ones sent in
+    // full, and their entries are not replaced during this exchange
+    const uint8_t *refs;
+    if (!buffer_borrow_bytes(&dc->read_buffer, n_refs, &refs)) {
+        return -1;
+    }
+    uint8_t ref_indexes[32];  // proof_size <= n_directions <= 32
+    memcpy(ref_indexes, refs, n_refs);
+    for (int i = 0; i < n_refs; i++) {
+        if (hash_refs_use(ref_indexes[i]) == NULL) {
+            PRINTF("Invalid hash reference.\n");
+            return -1;
+        }
+    }
+
+    memcpy(out, cur_hash, 32);
+
+    // the ancestor to keep in the Merkle frontier, if the proof is valid
+    int frontier_depth = n_directions - MERKLE_FRONTIER_LEVELS;
+    uint8_t frontier_hash[32];
+
+    int n_full = proof_size - n_refs;
+    int cur_step = 0;
+    uint8_t n_proof_elements;
+    if (!buffer_read_u8(&dc->read_buffer, &n_proof_elements)) {
+        return -1;
+    }
+    while (true) {
+        const uint8_t *sibling_hashes;
+        if (cur_step + n_proof_elements > n_full ||
+            !buffer_borrow_bytes(&dc->read_buffer,
+                                 32 * (size_t) n_proof_elements,
+                                 &sibling_hashes)) {
+            hash_refs_clear();
+            return -1;
+        }
+
+        for (int i = 0; i < n_proof_elements; i++) {
+            merkle_climb_path(cur_hash,
+                              sibling_hashes + 32 * i,
+                              1,
+                              directions,
+                              n_directions - cur_step);
+            // the hashes below the level of the Merkle frontier are not shared by many proofs
+            if (cur_step >= MERKLE_FRONTIER_LEVELS) {
+                hash_refs_add(sibling_hashes + 32 * i);
+            }
+            if (++cur_step == n_directions - frontier_depth) {
+                memcpy(frontier_hash, cur_hash, 32);
+            }
+        }
+
+        if (cur_step == n_full) {
+            break;
+        }
+
+        uint8_t req_more[] = {CCMD_GET_MORE_ELEMENTS};
+        SET_RESPONSE(dc, req_more, sizeof(req_more), SW_INTERRUPTED_EXECUTION);
+        uint8_t elements_len;
+        if (dc->process_interruption(dc) < 0 ||
+            !buffer_read_u8(&dc->read_buffer, &n_proof_elements) ||
+            !buffer_read_u8(&dc->read_buffer, &elements_len) || elements_len != 32) {
+            hash_refs_clear();
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < n_refs; i++) {
+        // the entries are valid, as they were checked above
+        merkle_climb_path(cur_hash,
+                          G_hash_refs.entries[ref_indexes[i]].hash,
+                          1,
+                          directions,
+                          n_directions - cur_step);
+        if (++cur_step == n_directions - frontier_depth) {
+            memcpy(frontier_hash, cur_hash, 32);
+        }
+    }
+
+    if (memcmp(known_hash, cur_hash, 32) != 0) {
+        PRINTF("Merkle root mismatch");
+        hash_refs_clear();
+        return -1;
+    }
+
+    // the ancestor was verified; it is only kept if the proof climbed to it
+    if (frontier_depth > n_known) {
+        merkle_frontier_add(merkle_root, tree_size, directions, frontier_depth, frontier_hash);
+    }
+    return 0;
+}
+#endif
+
 // Reads the inputs and sends the GET_MERKLE_LEAF_PROOF request.
 int call_get_merkle_leaf_hash(dispatcher_context_t *dc,
                               const uint8_t merkle_root[static 32],
@@ -21,6 +183,12 @@ int call_get_merkle_leaf_hash(dispatcher_context_t *dc,
 
     PRINT_STACK_POINTER();
 
+#ifdef HAVE_HASH_REFS
+    if (hash_refs_is_enabled()) {
+        return call_get_merkle_leaf_hash_with_refs(dc, merkle_root, tree_size, leaf_index, out);
+    }
+#endif
+
     {  // make sure memory is deallocated as soon as possible
         uint8_t tmp[9];
         tmp[0] = CCMD_GET_MERKLE_LEAF_PROOF;
@@ -63,6 +231,14 @@ int call_get_merkle_leaf_hash(dispatcher_context_t *dc,
             return -1;
         }
 
+        // bitmap of the directions from the root to the leaf, computed once for the whole proof
+        uint32_t directions;
+        int n_directions = merkle_get_directions(tree_size, leaf_index, &directions);
+        if (n_directions < 0 || proof_size > n_directions) {
+            PRINTF("Merkle proof too long.\n");
+            return -1;
+        }
+
         // Copy leaf hash to output (although it is not verified yet)
         memcpy(out, cur_hash, 32);
 
@@ -70,24 +246,16 @@ int call_get_merkle_leaf_hash(dispatcher_context_t *dc,
         cur_step = 0;
 
         while (true) {
-            int end_step = cur_step + n_proof_elements;
-            for (; cur_step < end_step; cur_step++) {
-                // we use the memory in the buffer directly, to avoid copying the hash unnecessarily
-                const uint8_t *sibling_hash = dc->read_buffer.ptr + dc->read_buffer.offset;
-
-                int i = proof_size - cur_step - 1;
-                int direction = merkle_get_ith_direction(tree_size, leaf_index, i);
-
-                if (direction == 0) {
-                    merkle_combine_hashes(cur_hash, sibling_hash, cur_hash);
-                } else if (direction == 1) {
-                    merkle_combine_hashes(sibling_hash, cur_hash, cur_hash);
-                } else {
-                    return -1;  // unexpected, proof too long?
-                }
-
-                buffer_seek_cur(&dc->read_buffer, 32);  // consume the bytes of the sibling hash
-            }
+            // we use the memory in the buffer directly, to avoid copying the hashes unnecessarily
+            const uint8_t *sibling_hashes;
+            buffer_borrow_bytes(&dc->read_buffer, 32 * (size_t) n_proof_elements, &sibling_hashes);
+
+            merkle_climb_path(cur_hash,
+                              sibling_hashes,
+                              n_proof_elements,
+                              directions,
+                              proof_size - cur_step);
+            cur_step += n_proof_elements;
 
             if (cur_step == proof_size) {
                 break;
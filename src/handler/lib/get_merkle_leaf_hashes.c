@@ -0,0 +1,173 @@
+#include <string.h>
+
+#include "get_merkle_leaf_hashes.h"
+
+#include "../../common/buffer.h"
+#include "../../common/merkle.h"
+#include "../../common/varint.h"
+#include "../../boilerplate/sw.h"
+#include "../client_commands.h"
+
+#include "debug-helpers/debug.h"
+
+typedef struct {
+    dispatcher_context_t *dc;
+    uint32_t first_leaf_index;
+    uint32_t n_leaves;
+    uint8_t (*out)[32];
+    uint8_t proof_size;   // total number of elements of the multiproof
+    uint8_t n_read;       // number of elements of the multiproof consumed so far
+    uint8_t n_available;  // number of elements still to be consumed in the read_buffer
+} multiproof_state_t;
+
+// Reads the next element of the multiproof, requesting more elements to the client if necessary.
+static int read_next_element(multiproof_state_t *state, uint8_t out[static 32]) {
+    dispatcher_context_t *dc = state->dc;
+
+    if (state->n_read >= state->proof_size) {
+        PRINTF("Multiproof shorter than expected\n");
+        return -1;
+    }
+
+    if (state->n_available == 0) {
+        uint8_t req_more[] = {CCMD_GET_MORE_ELEMENTS};
+        SET_RESPONSE(dc, req_more, sizeof(req_more), SW_INTERRUPTED_EXECUTION);
+        if (dc->process_interruption(dc) < 0) {
+            return -1;
+        }
+
+        // Parse response to CCMD_GET_MORE_ELEMENTS
+        uint8_t elements_len;
+        if (!buffer_read_u8(&dc->read_buffer, &state->n_available) ||
+            !buffer_read_u8(&dc->read_buffer, &elements_len) ||
+            !buffer_can_read(&dc->read_buffer, (size_t) state->n_available * elements_len)) {
+            return -1;
+        }
+
+        if (elements_len != 32 || state->n_available == 0 ||
+            state->n_read + state->n_available > state->proof_size) {
+            return -1;
+        }
+    }
+
+    if (!buffer_read_bytes(&dc->read_buffer, out, 32)) {
+        return -1;
+    }
+    --state->n_available;
+    ++state->n_read;
+    return 0;
+}
+
+// Computes the hash of the subtree whose leaves have indexes begin, ..., begin + size - 1,
+// consuming the elements of the multiproof in left-to-right order. Subtrees not containing any of
+// the requested leaves are taken directly from the multiproof; the others are recomputed.
+// The recursion depth is at most ceil_lg(tree_size).
+static int compute_subtree_hash(multiproof_state_t *state,
+                                uint32_t begin,
+                                uint32_t size,
+                                uint8_t out[static 32]) {
+    uint32_t first = state->first_leaf_index;
+    uint32_t end = first + state->n_leaves;
+
+    if (begin >= end || begin + size <= first) {
+        // no requested leaf in this subtree
+        return read_next_element(state, out);
+    }
+
+    if (size == 1) {
+        // this is one of the requested leaves
+        if (read_next_element(state, out) < 0) {
+            return -1;
+        }
+        memcpy(state->out[begin - first], out, 32);
+        return 0;
+    }
+
+    // number of leaves of the left subtree: largest power of 2 strictly smaller than size
+    uint32_t left_size = 1 << (ceil_lg(size) - 1);
+
+    uint8_t left_hash[32];
+    if (compute_subtree_hash(state, begin, left_size, left_hash) < 0 ||
+        compute_subtree_hash(state, begin + left_size, size - left_size, out) < 0) {
+        return -1;
+    }
+
+    merkle_combine_hashes(left_hash, out, out);
+    return 0;
+}
+
+int call_get_merkle_leaf_hashes(dispatcher_context_t *dc,
+                                const uint8_t merkle_root[static 32],
+                                uint32_t tree_size,
+                                uint32_t first_leaf_index,
+                                uint32_t n_leaves,
+                                uint8_t out[][32]) {
+    // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    PRINT_STACK_POINTER();
+
+    if (n_leaves == 0 || n_leaves > MAX_MERKLE_LEAF_HASHES_BATCH ||
+        first_leaf_index >= tree_size || n_leaves > tree_size - first_leaf_index) {
+        return -1;
+    }
+
+    {  // make sure memory is deallocated as soon as possible
+        uint8_t tmp[9];
+        tmp[0] = CCMD_GET_MERKLE_LEAF_PROOFS;
+        dc->add_to_response(tmp, 1);
+
+        dc->add_to_response(merkle_root, 32);
+
+        int tree_size_len = varint_write(tmp, 0, tree_size);
+        dc->add_to_response(tmp, tree_size_len);
+
+        int first_leaf_index_len = varint_write(tmp, 0, first_leaf_index);
+        dc->add_to_response(tmp, first_leaf_index_len);
+
+        int n_leaves_len = varint_write(tmp, 0, n_leaves);
+        dc->add_to_response(tmp, n_leaves_len);
+
+        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+    }
+
+    if (dc->process_interruption(dc) < 0) {
+        return -1;
+    }
+
+    multiproof_state_t state = {.dc = dc,
+                                .first_leaf_index = first_leaf_index,
+                                .n_leaves = n_leaves,
+                                .out = out,
+                                .n_read = 0};
+
+    if (!buffer_read_u8(&dc->read_buffer, &state.proof_size) ||
+        !buffer_read_u8(&dc->read_buffer, &state.n_available)) {
+        return -1;
+    }
+
+    if (state.n_available > state.proof_size) {
+        PRINTF("Received more proof data than expected.\n");
+        return -1;
+    }
+
+    if (!buffer_can_read(&dc->read_buffer, 32 * (size_t) state.n_available)) {
+        return -1;
+    }
+
+    uint8_t root[32];
+    if (compute_subtree_hash(&state, 0, tree_size, root) < 0) {
+        return -1;
+    }
+
+    if (state.n_read != state.proof_size) {
+        PRINTF("Multiproof longer than expected\n");
+        return -1;
+    }
+
+    if (memcmp(merkle_root, root, 32) != 0) {
+        PRINTF("Merkle root mismatch");
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "../../boilerplate/dispatcher.h"
+
+// Maximum number of consecutive leaf hashes that can be requested with a single
+// call_get_merkle_leaf_hashes. Each leaf hash takes 32 bytes in the caller's output buffer.
+#ifdef TARGET_NANOS
+#define MAX_MERKLE_LEAF_HASHES_BATCH 4
+#else
+#define MAX_MERKLE_LEAF_HASHES_BATCH 8
+#endif
+
+/**
+ * In this flow, the HWW sends a CCMD_GET_MERKLE_LEAF_PROOFS command in order to obtain the leaf
+ * hashes of the leaves with indexes first_leaf_index, first_leaf_index + 1, ...,
+ * first_leaf_index + n_leaves - 1 in the Merkle tree with the given root and size. The client
+ * responds with a multiproof, that is, the hashes of the minimal set of subtrees covering the
+ * whole tree (which includes the requested leaves), in left-to-right order. Internal nodes
+ * shared by the proofs of the individual leaves are therefore only computed once, and the proof
+ * is verified in a single pass.
+ *
+ * The output is only valid if the return value is not negative.
+ *
+ * @param[in] dispatcher_context
+ *   Pointer to the dispatcher context.
+ * @param[in] merkle_root
+ *   The root of the Merkle tree.
+ * @param[in] tree_size
+ *   The number of leaves of the Merkle tree.
+ * @param[in] first_leaf_index
+ *   The index of the first requested leaf.
+ * @param[in] n_leaves
+ *   The number of requested leaves; it must be between 1 and MAX_MERKLE_LEAF_HASHES_BATCH, and
+ *   first_leaf_index + n_leaves must not be bigger than tree_size.
+ * @param[out] out
+ *   Array where the n_leaves leaf hashes are stored.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int call_get_merkle_leaf_hashes(dispatcher_context_t *dispatcher_context,
+                                const uint8_t merkle_root[static 32],
+                                uint32_t tree_size,
+                                uint32_t first_leaf_index,
+                                uint32_t n_leaves,
+                                uint8_t out[][32]);
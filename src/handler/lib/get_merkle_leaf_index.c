@@ -2,6 +2,7 @@
 
 #include "../../boilerplate/sw.h"
 #include "get_merkle_leaf_hash.h"
+#include "get_merkle_leaf_index.h"
 
 #include "../client_commands.h"
 
@@ -36,7 +37,7 @@ int call_get_merkle_leaf_index(dispatcher_context_t *dispatcher_context,
     }
 
     if (!found) {
-        return -3;
+        return MERKLE_LEAF_INDEX_NOT_FOUND;
     }
 
     // Ask the host for the leaf hash with that index
@@ -53,3 +54,23 @@ int call_get_merkle_leaf_index(dispatcher_context_t *dispatcher_context,
 
     return index;
 }
+
+int call_get_merkleized_map_key_index(dispatcher_context_t *dispatcher_context,
+                                      const merkleized_map_commitment_t *map,
+                                      const uint8_t *key,
+                                      int key_len) {
+    // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    int index = merkleized_map_find_key_index(map, key, key_len);
+    if (index != -2) {
+        return index;  // either the index, or -1 if the key is known to be missing
+    }
+
+    uint8_t key_merkle_hash[32];
+    merkle_compute_element_hash(key, key_len, key_merkle_hash);
+
+    return call_get_merkle_leaf_index(dispatcher_context,
+                                      map->size,
+                                      map->keys_root,
+                                      key_merkle_hash);
+}
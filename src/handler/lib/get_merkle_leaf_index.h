@@ -1,11 +1,32 @@
 #pragma once
 
 #include "../../boilerplate/dispatcher.h"
+#include "../../common/merkle.h"
+
+// Returned by call_get_merkle_leaf_index if the client reports that the leaf is not in the tree
+#define MERKLE_LEAF_INDEX_NOT_FOUND (-6)
 
 /**
- * TODO: docs
+ * Requests the client the index of the leaf with the given hash in the Merkle tree with the given
+ * root and size, and verifies it with a proof of the leaf at that index.
+ *
+ * Returns the index; MERKLE_LEAF_INDEX_NOT_FOUND if the client reports that the leaf is not in the
+ * tree, or another negative number in case of failure: -3 if the interruption failed, -1 or -2 if
+ * the response is malformed, -4 or -5 if the proof could not be obtained or does not match.
  */
 int call_get_merkle_leaf_index(dispatcher_context_t *dispatcher_context,
                                size_t size,
                                const uint8_t root[static 32],
-                               const uint8_t leaf_hash[static 32]);
\ No newline at end of file
+                               const uint8_t leaf_hash[static 32]);
+
+/**
+ * Returns the index of the given key in a merkleized map. Single-byte keys are looked up in the key
+ * index table of the map, if it was recorded while enumerating the keys; otherwise, the index is
+ * requested to the client with call_get_merkle_leaf_index.
+ *
+ * Returns a negative number if the key is not found, or in case of failure.
+ */
+int call_get_merkleized_map_key_index(dispatcher_context_t *dispatcher_context,
+                                      const merkleized_map_commitment_t *map,
+                                      const uint8_t *key,
+                                      int key_len);
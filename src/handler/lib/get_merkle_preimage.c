@@ -10,9 +10,78 @@
 #include "debug-helpers/debug.h"
 
 #include "cxram_stash.h"
+#include "preimage_cache.h"
 
 // TODO: refactor common code with stream_preimage.c
 
+// Receives the preimage, whose first partial_data_len bytes are at data_ptr, and checks its hash
+// using the given hash context. The preimage is written in out_buffer, without its first byte.
+static int receive_and_check_preimage(dispatcher_context_t *dispatcher_context,
+                                      const uint8_t hash[static 32],
+                                      const uint8_t *data_ptr,
+                                      uint8_t partial_data_len,
+                                      uint64_t preimage_len,
+                                      buffer_t *out_buffer,
+                                      cx_sha256_t *hash_context) {
+    cx_sha256_init(hash_context);
+
+    // update hash
+    crypto_hash_update(&hash_context->header, data_ptr, partial_data_len);
+
+    // write bytes to output
+    buffer_write_bytes(out_buffer, data_ptr + 1, partial_data_len - 1);  // we skip the first byte
+
+    size_t bytes_remaining = (size_t) preimage_len - partial_data_len;
+
+    while (bytes_remaining > 0) {
+        uint8_t get_more_elements_req[] = {CCMD_GET_MORE_ELEMENTS};
+        SET_RESPONSE(dispatcher_context, get_more_elements_req, 1, SW_INTERRUPTED_EXECUTION);
+        if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
+            return -6;
+        }
+
+        // Parse response to CCMD_GET_MORE_ELEMENTS
+        uint8_t n_bytes, elements_len;
+        if (!buffer_read_u8(&dispatcher_context->read_buffer, &n_bytes) ||
+            !buffer_read_u8(&dispatcher_context->read_buffer, &elements_len) ||
+            !buffer_can_read(&dispatcher_context->read_buffer, (size_t) n_bytes * elements_len)) {
+            return -7;
+        }
+
+        if (elements_len != 1) {
+            PRINTF("Elements should be single bytes\n");
+            return -8;
+        }
+
+        if (n_bytes > bytes_remaining) {
+            PRINTF("Received more bytes than expected.\n");
+            return -9;
+        }
+
+        // the bytes are used in place, in the read buffer
+        buffer_borrow_bytes(&dispatcher_context->read_buffer, n_bytes, &data_ptr);
+
+        // update hash
+        crypto_hash_update(&hash_context->header, data_ptr, n_bytes);
+
+        // write bytes to output
+        buffer_write_bytes(out_buffer, data_ptr, n_bytes);
+
+        bytes_remaining -= n_bytes;
+    }
+
+    // hack: we pass the address of the final accumulator inside cx_sha256_t, so we don't need
+    // an additional variable in the stack to store the final hash.
+    crypto_hash_digest(&hash_context->header, (uint8_t *) &hash_context->acc, 32);
+
+    if (memcmp(hash_context->acc, hash, 32) != 0) {
+        PRINTF("Hash mismatch.\n");
+        return -10;
+    }
+
+    return 0;
+}
+
 int call_get_merkle_preimage(dispatcher_context_t *dispatcher_context,
                              const uint8_t hash[static 32],
                              uint8_t *out_ptr,
@@ -21,6 +90,13 @@ int call_get_merkle_preimage(dispatcher_context_t *dispatcher_context,
 
     PRINT_STACK_POINTER();
 
+#ifdef HAVE_PREIMAGE_CACHE
+    int cached_len = preimage_cache_get(hash, out_ptr, out_ptr_len);
+    if (cached_len >= 0) {
+        return cached_len;
+    }
+#endif
+
     uint8_t cmd = CCMD_GET_PREIMAGE;
     dispatcher_context->add_to_response(&cmd, 1);
 
@@ -38,9 +114,10 @@ int call_get_merkle_preimage(dispatcher_context_t *dispatcher_context,
 
     uint8_t partial_data_len;
 
+    const uint8_t *data_ptr;
     if (!buffer_read_varint(&dispatcher_context->read_buffer, &preimage_len) ||
         !buffer_read_u8(&dispatcher_context->read_buffer, &partial_data_len) ||
-        !buffer_can_read(&dispatcher_context->read_buffer, partial_data_len)) {
+        !buffer_borrow_bytes(&dispatcher_context->read_buffer, partial_data_len, &data_ptr)) {
         return -2;
     }
 
@@ -57,75 +134,41 @@ int call_get_merkle_preimage(dispatcher_context_t *dispatcher_context,
         return -5;
     }
 
-    uint8_t *data_ptr =
-        dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset;
+    buffer_t out_buffer = buffer_create(out_ptr, out_ptr_len);
 
 #ifdef USE_CXRAM_SECTION
     // allocate buffers inside the cxram section to save memory
     // this is safe as there are no syscalls here that use the cxram
-    cx_sha256_t *hash_context = (cx_sha256_t *) get_cxram_buffer();
+    size_t mark = cxram_mark();
+    CXRAM_ALLOC(cx_sha256_t, hash_context);
+    if (hash_context == NULL) {
+        return -1;
+    }
+    int res = receive_and_check_preimage(dispatcher_context,
+                                         hash,
+                                         data_ptr,
+                                         partial_data_len,
+                                         preimage_len,
+                                         &out_buffer,
+                                         hash_context);
+    cxram_release(mark);
 #else
-    cx_sha256_t hash_context_obj;
-    cx_sha256_t *hash_context = &hash_context_obj;
+    cx_sha256_t hash_context;
+    int res = receive_and_check_preimage(dispatcher_context,
+                                         hash,
+                                         data_ptr,
+                                         partial_data_len,
+                                         preimage_len,
+                                         &out_buffer,
+                                         &hash_context);
 #endif
-
-    cx_sha256_init(hash_context);
-
-    // update hash
-    crypto_hash_update(&hash_context->header, data_ptr, partial_data_len);
-
-    buffer_t out_buffer = buffer_create(out_ptr, out_ptr_len);
-
-    // write bytes to output
-    buffer_write_bytes(&out_buffer, data_ptr + 1, partial_data_len - 1);  // we skip the first byte
-
-    size_t bytes_remaining = (size_t) preimage_len - partial_data_len;
-
-    while (bytes_remaining > 0) {
-        uint8_t get_more_elements_req[] = {CCMD_GET_MORE_ELEMENTS};
-        SET_RESPONSE(dispatcher_context, get_more_elements_req, 1, SW_INTERRUPTED_EXECUTION);
-        if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
-            return -6;
-        }
-
-        // Parse response to CCMD_GET_MORE_ELEMENTS
-        uint8_t n_bytes, elements_len;
-        if (!buffer_read_u8(&dispatcher_context->read_buffer, &n_bytes) ||
-            !buffer_read_u8(&dispatcher_context->read_buffer, &elements_len) ||
-            !buffer_can_read(&dispatcher_context->read_buffer, (size_t) n_bytes * elements_len)) {
-            return -7;
-        }
-
-        if (elements_len != 1) {
-            PRINTF("Elements should be single bytes\n");
-            return -8;
-        }
-
-        if (n_bytes > bytes_remaining) {
-            PRINTF("Received more bytes than expected.\n");
-            return -9;
-        }
-
-        // update hash
-        crypto_hash_update(
-            &hash_context->header,
-            dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset,
-            n_bytes);
-
-        // write bytes to output
-        buffer_write_bytes(&out_buffer, data_ptr, n_bytes);
-
-        bytes_remaining -= n_bytes;
+    if (res < 0) {
+        return res;
     }
 
-    // hack: we pass the address of the final accumulator inside cx_sha256_t, so we don't need
-    // an additional variable in the stack to store the final hash.
-    crypto_hash_digest(&hash_context->header, (uint8_t *) &hash_context->acc, 32);
-
-    if (memcmp(hash_context->acc, hash, 32) != 0) {
-        PRINTF("Hash mismatch.\n");
-        return -10;
-    }
+#ifdef HAVE_PREIMAGE_CACHE
+    preimage_cache_add(hash, out_ptr, (size_t) (preimage_len - 1));
+#endif
 
     return (int) (preimage_len - 1);
 }
\ No newline at end of file
@@ -7,6 +7,8 @@
  * The client must respond with a the preimage (at most 254 bytes), prefixed by its length.
  * The flow fails with SW_WRONG_DATA_LENGTH if the response is too short; it will fail with
  * SW_INCORRECT_DATA if the computed hash does not match.
+ * In builds with HAVE_PREIMAGE_CACHE, short preimages already verified while processing the same
+ * command are returned from the preimage cache, without any interruption.
  *
  * Returns the length of the preimage on success, or a negative number in case of failure.
  */
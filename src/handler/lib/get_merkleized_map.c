@@ -2,29 +2,24 @@
 
 #include "get_merkleized_map.h"
 
-#include "get_merkle_leaf_element.h"
+#include "get_merkle_leaf_hash.h"
+#include "get_merkle_preimage.h"
 #include "check_merkle_tree_sorted.h"
+#include "map_commitment_cache.h"
 
 #include "../../common/buffer.h"
 
-int call_get_merkleized_map_with_callback(dispatcher_context_t *dispatcher_context,
-                                          void *callback_state,
-                                          const uint8_t root[static 32],
-                                          int size,
-                                          int index,
-                                          merkle_tree_elements_callback_t callback,
-                                          merkleized_map_commitment_t *out_ptr) {
-    // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
-
+// fetches and parses the preimage of leaf_hash as a merkleized map commitment
+static int get_merkleized_map_commitment(dispatcher_context_t *dispatcher_context,
+                                         const uint8_t leaf_hash[static 32],
+                                         merkleized_map_commitment_t *out_ptr) {
     uint8_t raw_output[9 + 2 * 32];  // maximum size of serialized result (9 bytes for the varint,
                                      // and the 2 Merkle roots)
 
-    int el_len = call_get_merkle_leaf_element(dispatcher_context,
-                                              root,
-                                              size,
-                                              index,
-                                              raw_output,
-                                              sizeof(raw_output));
+    out_ptr->has_key_index = false;
+
+    int el_len =
+        call_get_merkle_preimage(dispatcher_context, leaf_hash, raw_output, sizeof(raw_output));
     if (el_len < 0) {
         return -1;
     }
@@ -36,10 +31,96 @@ int call_get_merkleized_map_with_callback(dispatcher_context_t *dispatcher_conte
         return -1;
     }
 
+    return 0;
+}
+
+int call_get_merkleized_map_from_leaf_hash_with_callback(dispatcher_context_t *dispatcher_context,
+                                                         void *callback_state,
+                                                         const uint8_t leaf_hash[static 32],
+                                                         merkle_tree_elements_callback_t callback,
+                                                         merkleized_map_commitment_t *out_ptr) {
+    // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    if (0 > get_merkleized_map_commitment(dispatcher_context, leaf_hash, out_ptr)) {
+        return -1;
+    }
+
     return call_check_merkle_tree_sorted_with_callback(dispatcher_context,
                                                        callback_state,
                                                        out_ptr->keys_root,
                                                        out_ptr->size,
                                                        callback,
                                                        out_ptr);
-}
\ No newline at end of file
+}
+
+int call_get_merkleized_map_with_callback(dispatcher_context_t *dispatcher_context,
+                                          void *callback_state,
+                                          const uint8_t root[static 32],
+                                          int size,
+                                          int index,
+                                          merkle_tree_elements_callback_t callback,
+                                          merkleized_map_commitment_t *out_ptr) {
+    // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+#ifdef HAVE_MAP_COMMITMENT_CACHE
+    if (map_commitment_cache_get(root, size, index, out_ptr)) {
+        // without a callback, the keys are only enumerated if they were not verified yet
+        if (callback == NULL && out_ptr->has_key_index) {
+            return 0;
+        }
+        if (0 > call_check_merkle_tree_sorted_with_callback(dispatcher_context,
+                                                            callback_state,
+                                                            out_ptr->keys_root,
+                                                            out_ptr->size,
+                                                            callback,
+                                                            out_ptr)) {
+            return -1;
+        }
+        map_commitment_cache_add(root, size, index, out_ptr);
+        return 0;
+    }
+#endif
+
+    uint8_t leaf_hash[32];
+
+    if (0 > call_get_merkle_leaf_hash(dispatcher_context, root, size, index, leaf_hash)) {
+        return -1;
+    }
+
+    if (0 > call_get_merkleized_map_from_leaf_hash_with_callback(dispatcher_context,
+                                                                 callback_state,
+                                                                 leaf_hash,
+                                                                 callback,
+                                                                 out_ptr)) {
+        return -1;
+    }
+
+#ifdef HAVE_MAP_COMMITMENT_CACHE
+    map_commitment_cache_add(root, size, index, out_ptr);
+#endif
+    return 0;
+}
+
+int call_get_merkleized_map_unchecked(dispatcher_context_t *dispatcher_context,
+                                      const uint8_t root[static 32],
+                                      int size,
+                                      int index,
+                                      merkleized_map_commitment_t *out_ptr) {
+#ifdef HAVE_MAP_COMMITMENT_CACHE
+    if (map_commitment_cache_get(root, size, index, out_ptr)) {
+        return 0;
+    }
+#endif
+
+    uint8_t leaf_hash[32];
+
+    if (0 > call_get_merkle_leaf_hash(dispatcher_context, root, size, index, leaf_hash) ||
+        0 > get_merkleized_map_commitment(dispatcher_context, leaf_hash, out_ptr)) {
+        return -1;
+    }
+
+#ifdef HAVE_MAP_COMMITMENT_CACHE
+    map_commitment_cache_add(root, size, index, out_ptr);
+#endif
+    return 0;
+}
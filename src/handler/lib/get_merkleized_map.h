@@ -6,7 +6,28 @@
 #include "check_merkle_tree_sorted.h"
 
 /**
- * TODO: docs
+ * Fetches the merkleized map commitment whose hash (as a Merkle tree leaf) is leaf_hash, and checks
+ * that the keys are sorted, calling the callback for each of the keys.
+ * This is useful when the leaf hash is already known and verified, for example if it was obtained
+ * with call_get_merkle_leaf_hashes.
+ *
+ * Returns a negative number on failure.
+ */
+int call_get_merkleized_map_from_leaf_hash_with_callback(dispatcher_context_t *dispatcher_context,
+                                                         void *callback_state,
+                                                         const uint8_t leaf_hash[static 32],
+                                                         merkle_tree_elements_callback_t callback,
+                                                         merkleized_map_commitment_t *out_ptr);
+
+/**
+ * Fetches the merkleized map commitment at position `index` of the Merkle tree with the given root
+ * and size, and checks that the keys are sorted, calling the callback for each of the keys.
+ *
+ * In builds with HAVE_MAP_COMMITMENT_CACHE, the commitments already verified while processing the
+ * same command are not fetched again; without a callback, their keys are not enumerated again
+ * either.
+ *
+ * Returns a negative number on failure.
  */
 int call_get_merkleized_map_with_callback(dispatcher_context_t *dispatcher_context,
                                           void *callback_state,
@@ -16,6 +37,19 @@ int call_get_merkleized_map_with_callback(dispatcher_context_t *dispatcher_conte
                                           merkle_tree_elements_callback_t callback,
                                           merkleized_map_commitment_t *out_ptr);
 
+/**
+ * Like call_get_merkleized_map, but it does not check that the keys of the map are sorted, which
+ * saves streaming all the keys from the host. Therefore, values obtained from the map might not be
+ * unique for their key, and must only be used as hints that are validated independently.
+ *
+ * Returns a negative number on failure.
+ */
+int call_get_merkleized_map_unchecked(dispatcher_context_t *dispatcher_context,
+                                      const uint8_t root[static 32],
+                                      int size,
+                                      int index,
+                                      merkleized_map_commitment_t *out_ptr);
+
 /**
  * Convenience function to call the call_get_merkleized_map flow.
  */
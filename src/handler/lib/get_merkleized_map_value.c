@@ -13,11 +13,7 @@ int call_get_merkleized_map_value(dispatcher_context_t *dispatcher_context,
                                   int out_len) {
     // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
-    uint8_t key_merkle_hash[32];
-    merkle_compute_element_hash(key, key_len, key_merkle_hash);
-
-    int index =
-        call_get_merkle_leaf_index(dispatcher_context, map->size, map->keys_root, key_merkle_hash);
+    int index = call_get_merkleized_map_key_index(dispatcher_context, map, key, key_len);
 
     if (index < 0) {
         PRINTF("Key not found, or incorrect data.\n");
@@ -30,4 +26,70 @@ int call_get_merkleized_map_value(dispatcher_context_t *dispatcher_context,
                                         index,
                                         out,
                                         out_len);
-}
\ No newline at end of file
+}
+
+int call_get_merkleized_map_values(dispatcher_context_t *dispatcher_context,
+                                   const merkleized_map_commitment_t *map,
+                                   merkleized_map_value_request_t requests[],
+                                   size_t n_requests) {
+    // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    if (n_requests > MAX_MERKLEIZED_MAP_VALUES_BATCH || map->size > UINT32_MAX) {
+        return -1;
+    }
+
+    // the requests of the keys that are found, sorted by index
+    merkle_leaf_element_request_t leaves[MAX_MERKLEIZED_MAP_VALUES_BATCH];
+    size_t leaf_requests[MAX_MERKLEIZED_MAP_VALUES_BATCH];  // the request of each leaf
+    size_t n_leaves = 0;
+
+    for (size_t i = 0; i < n_requests; i++) {
+        requests[i].value_len = -1;
+
+        if (requests[i].out_len < 0) {
+            return -1;
+        }
+
+        int index = call_get_merkleized_map_key_index(dispatcher_context,
+                                                      map,
+                                                      requests[i].key,
+                                                      requests[i].key_len);
+        if (index < 0) {
+            continue;  // key not found
+        }
+
+        // insertion in the sorted leaves
+        size_t pos = n_leaves;
+        while (pos > 0 && leaves[pos - 1].leaf_index >= (uint32_t) index) {
+            if (leaves[pos - 1].leaf_index == (uint32_t) index) {
+                PRINTF("Repeated key.\n");
+                return -1;
+            }
+            leaves[pos] = leaves[pos - 1];
+            leaf_requests[pos] = leaf_requests[pos - 1];
+            --pos;
+        }
+        leaves[pos].leaf_index = (uint32_t) index;
+        leaves[pos].out = requests[i].out;
+        leaves[pos].out_len = (size_t) requests[i].out_len;
+        leaf_requests[pos] = i;
+        ++n_leaves;
+    }
+
+    if (n_leaves == 0) {
+        return 0;
+    }
+
+    if (0 > call_get_merkle_leaf_elements(dispatcher_context,
+                                          map->values_root,
+                                          (uint32_t) map->size,
+                                          leaves,
+                                          n_leaves)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n_leaves; i++) {
+        requests[leaf_requests[i]].value_len = leaves[i].element_len;
+    }
+    return (int) n_leaves;
+}
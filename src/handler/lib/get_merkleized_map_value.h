@@ -4,6 +4,8 @@
 #include "../../common/merkle.h"
 #include "../../common/read.h"
 
+#include "get_merkle_leaf_elements.h"
+
 /**
  * Given a commitment to a merkleized key-value map, this flow finds out the index of the element
  * corresponding to the key, then fetches the corresponding element and verifies that its hash and
@@ -23,6 +25,35 @@ int call_get_merkleized_map_value(dispatcher_context_t *dispatcher_context,
                                   uint8_t *out,
                                   int out_len);
 
+// Maximum number of values that can be requested with a single call_get_merkleized_map_values.
+#define MAX_MERKLEIZED_MAP_VALUES_BATCH MAX_MERKLE_LEAF_ELEMENTS_BATCH
+
+// One of the values requested with call_get_merkleized_map_values.
+typedef struct {
+    const uint8_t *key;  // the key of the value
+    int key_len;         // the length of the key
+    uint8_t *out;        // the buffer receiving the value
+    int out_len;         // the length of the out buffer
+    int value_len;       // receives the length of the value, or -1 if the key is not in the map
+} merkleized_map_value_request_t;
+
+/**
+ * Like call_get_merkleized_map_value, but fetches the values of several keys of the same map.
+ * After the indexes of the keys are found, all the values are fetched with a single
+ * CCMD_GET_MERKLE_LEAF_ELEMENTS client command.
+ *
+ * A key that is not found is not an error: the value_len of its request is set to -1, and the
+ * caller decides whether the key is mandatory.
+ *
+ * Returns a negative number if any of the values is too long to fit into its output buffer, if the
+ * same key is requested twice, or if any of the proofs failed. Returns the number of keys found on
+ * success.
+ */
+int call_get_merkleized_map_values(dispatcher_context_t *dispatcher_context,
+                                   const merkleized_map_commitment_t *map,
+                                   merkleized_map_value_request_t requests[],
+                                   size_t n_requests);
+
 /**
  * Convenience shortcut to read a little-endian unsigned 32-bit int.
  * TODO: more docs
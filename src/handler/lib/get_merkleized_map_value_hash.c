@@ -12,11 +12,7 @@ int call_get_merkleized_map_value_hash(dispatcher_context_t *dispatcher_context,
                                        uint8_t out[static 32]) {
     // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
-    uint8_t key_merkle_hash[32];
-    merkle_compute_element_hash(key, key_len, key_merkle_hash);
-
-    int index =
-        call_get_merkle_leaf_index(dispatcher_context, map->size, map->keys_root, key_merkle_hash);
+    int index = call_get_merkleized_map_key_index(dispatcher_context, map, key, key_len);
     if (index < 0) {
         PRINTF("Key not found, or incorrect data.\n");
         return -1;
@@ -27,9 +27,10 @@ int call_get_preimage(dispatcher_context_t *dispatcher_context,
 
     uint8_t partial_data_len;
 
+    const uint8_t *data_ptr;
     if (!buffer_read_varint(&dispatcher_context->read_buffer, &preimage_len_u64) ||
         !buffer_read_u8(&dispatcher_context->read_buffer, &partial_data_len) ||
-        !buffer_can_read(&dispatcher_context->read_buffer, partial_data_len)) {
+        !buffer_borrow_bytes(&dispatcher_context->read_buffer, partial_data_len, &data_ptr)) {
         return -2;
     }
     uint32_t preimage_len = (uint32_t) preimage_len_u64;
@@ -45,9 +46,6 @@ int call_get_preimage(dispatcher_context_t *dispatcher_context,
 
     buffer_t buffer_out = buffer_create(out, out_len);
 
-    uint8_t *data_ptr =
-        dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset;
-
     cx_sha256_t hash_context;
     cx_sha256_init(&hash_context);
     // update hash
@@ -86,8 +84,8 @@ int call_get_preimage(dispatcher_context_t *dispatcher_context,
             return -8;
         }
 
-        uint8_t *data_ptr =
-            dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset;
+        // the bytes are used in place, in the read buffer
+        buffer_borrow_bytes(&dispatcher_context->read_buffer, n_bytes, &data_ptr);
 
         // update hash
         crypto_hash_update(&hash_context.header, data_ptr, n_bytes);
@@ -0,0 +1,66 @@
+#include <string.h>
+
+#include "os.h"
+
+#include "hash_refs.h"
+
+#ifdef HAVE_HASH_REFS
+
+hash_refs_t G_hash_refs;
+
+void hash_refs_reset(uint8_t protocol_version) {
+    explicit_bzero(&G_hash_refs, sizeof(G_hash_refs));
+    G_hash_refs.is_enabled = protocol_version >= HASH_REFS_PROTOCOL_VERSION;
+}
+
+void hash_refs_clear(void) {
+    explicit_bzero(G_hash_refs.entries, sizeof(G_hash_refs.entries));
+}
+
+void hash_refs_start_exchange(void) {
+    G_hash_refs.exchange_start = G_hash_refs.clock;
+}
+
+int hash_refs_find(const uint8_t hash[static 32]) {
+    for (int i = 0; i < HASH_REFS_TABLE_SIZE; i++) {
+        const hash_ref_entry_t *entry = &G_hash_refs.entries[i];
+        if (entry->last_used != 0 && memcmp(entry->hash, hash, 32) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const uint8_t *hash_refs_use(uint8_t index) {
+    if (index >= HASH_REFS_TABLE_SIZE || G_hash_refs.entries[index].last_used == 0) {
+        return NULL;
+    }
+    G_hash_refs.entries[index].last_used = ++G_hash_refs.clock;
+    return G_hash_refs.entries[index].hash;
+}
+
+void hash_refs_add(const uint8_t hash[static 32]) {
+    int index = hash_refs_find(hash);
+    if (index >= 0) {
+        hash_refs_use((uint8_t) index);
+        return;
+    }
+
+    // the least recently used entry among the ones not used in the current exchange
+    hash_ref_entry_t *victim = NULL;
+    for (int i = 0; i < HASH_REFS_TABLE_SIZE; i++) {
+        hash_ref_entry_t *entry = &G_hash_refs.entries[i];
+        if (entry->last_used <= G_hash_refs.exchange_start &&
+            (victim == NULL || entry->last_used < victim->last_used)) {
+            victim = entry;
+        }
+    }
+    if (victim == NULL) {
+        return;
+    }
+
+    memcpy(victim->hash, hash, 32);
+    victim->last_used = ++G_hash_refs.clock;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAVE_HASH_REFS
+
+// Number of entries of the table of hash references.
+#define HASH_REFS_TABLE_SIZE 16
+
+// Reference used in the requests when a hash is sent in full instead.
+#define HASH_REF_NONE 0xFF
+
+// Version of the protocol (P2 of the command) from which the client keeps the table.
+#define HASH_REFS_PROTOCOL_VERSION 4
+
+/**
+ * A small table of the 32-byte hashes exchanged in the CCMD_GET_MERKLE_LEAF_PROOF_REFS client
+ * commands of the current command, kept identically by the device and the client, so that the
+ * Merkle roots and the proof hashes that were already exchanged are referenced by their index.
+ *
+ * In each exchange, the hashes are used in this order: the Merkle root, the referenced proof
+ * hashes, then the proof hashes sent in full. Using a hash that is in the table marks its entry as
+ * the most recently used; otherwise, a hash sent in full replaces the least recently used entry
+ * (the empty entries first, with the lowest index first) among the entries not used yet in the
+ * same exchange, or it is not stored if all of them were. Therefore, the entries referenced in an
+ * exchange are not replaced before the proof is verified. The first MERKLE_FRONTIER_LEVELS proof
+ * hashes, the closest to the leaf, are never stored.
+ *
+ * The device stores the proof hashes before the proof is verified; if the verification fails, the
+ * table is emptied, so that the references only resolve to hashes of verified proofs, or to Merkle
+ * roots chosen by the device.
+ */
+typedef struct {
+    uint8_t hash[32];
+    uint32_t last_used;  // 0 if the entry is empty
+} hash_ref_entry_t;
+
+typedef struct {
+    bool is_enabled;          // true if the client supports the references in the current command
+    uint32_t clock;           // the last value of last_used
+    uint32_t exchange_start;  // the value of clock at the start of the current exchange
+    hash_ref_entry_t entries[HASH_REFS_TABLE_SIZE];
+} hash_refs_t;
+
+extern hash_refs_t G_hash_refs;
+
+/**
+ * Empties the table; it is called before processing each command, with the protocol version of the
+ * command.
+ */
+void hash_refs_reset(uint8_t protocol_version);
+
+/**
+ * Empties the table, without disabling it; called when a proof fails to verify.
+ */
+void hash_refs_clear(void);
+
+static inline bool hash_refs_is_enabled(void) {
+    return G_hash_refs.is_enabled;
+}
+
+/**
+ * Starts a new exchange: the entries used from now on are not replaced until the next one.
+ */
+void hash_refs_start_exchange(void);
+
+/**
+ * Looks up a hash in the table, without using it.
+ *
+ * @return the index of its entry if found, or -1 otherwise.
+ */
+int hash_refs_find(const uint8_t hash[static 32]);
+
+/**
+ * Uses the entry with the given index.
+ *
+ * @return a pointer to the hash of the entry, or NULL if the index is not valid or the entry is
+ * empty.
+ */
+const uint8_t *hash_refs_use(uint8_t index);
+
+/**
+ * Uses a hash sent in full: its entry if it is in the table, or a new entry otherwise.
+ */
+void hash_refs_add(const uint8_t hash[static 32]);
+
+#endif
@@ -0,0 +1,59 @@
+#include <string.h>
+
+#include "os.h"
+
+#include "map_commitment_cache.h"
+
+#ifdef HAVE_MAP_COMMITMENT_CACHE
+
+map_commitment_cache_t G_map_commitment_cache;
+
+void map_commitment_cache_reset(void) {
+    explicit_bzero(&G_map_commitment_cache, sizeof(G_map_commitment_cache));
+}
+
+static map_commitment_cache_entry_t *find_entry(const uint8_t root[static 32],
+                                                uint32_t size,
+                                                uint32_t index) {
+    for (size_t i = 0; i < G_map_commitment_cache.n_entries; i++) {
+        map_commitment_cache_entry_t *entry = &G_map_commitment_cache.entries[i];
+        if (entry->index == index && entry->size == size && memcmp(entry->root, root, 32) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+bool map_commitment_cache_get(const uint8_t root[static 32],
+                              uint32_t size,
+                              uint32_t index,
+                              merkleized_map_commitment_t *out) {
+    const map_commitment_cache_entry_t *entry = find_entry(root, size, index);
+    if (entry == NULL) {
+        return false;
+    }
+    memcpy(out, &entry->map, sizeof(merkleized_map_commitment_t));
+    return true;
+}
+
+void map_commitment_cache_add(const uint8_t root[static 32],
+                              uint32_t size,
+                              uint32_t index,
+                              const merkleized_map_commitment_t *map) {
+    map_commitment_cache_entry_t *entry = find_entry(root, size, index);
+    if (entry == NULL) {
+        if (G_map_commitment_cache.n_entries < MAP_COMMITMENT_CACHE_SIZE) {
+            entry = &G_map_commitment_cache.entries[G_map_commitment_cache.n_entries++];
+        } else {
+            entry = &G_map_commitment_cache.entries[G_map_commitment_cache.next];
+            G_map_commitment_cache.next =
+                (G_map_commitment_cache.next + 1) % MAP_COMMITMENT_CACHE_SIZE;
+        }
+        memcpy(entry->root, root, 32);
+        entry->size = size;
+        entry->index = index;
+    }
+    memcpy(&entry->map, map, sizeof(merkleized_map_commitment_t));
+}
+
+#endif
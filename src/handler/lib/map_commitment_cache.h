@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../common/merkle.h"
+
+#ifdef HAVE_MAP_COMMITMENT_CACHE
+
+// Number of map commitments kept in the cache; when it is full, the oldest one is replaced.
+#define MAP_COMMITMENT_CACHE_SIZE 8
+
+/**
+ * A small cache of the merkleized map commitments already fetched and verified while processing
+ * the current command, identified by the Merkle tree that contains them (like the inputs or the
+ * outputs of a PSBT) and by their index in it, so that the maps read in several phases of SIGN_PSBT
+ * are not fetched and proven again. The commitments are public data.
+ *
+ * The key index table of a map is kept with its commitment; it is only filled once the keys were
+ * verified to be sorted (see call_check_merkle_tree_sorted_with_callback), in which case the keys
+ * are not enumerated again either.
+ */
+typedef struct {
+    uint8_t root[32];  // root of the Merkle tree of the commitments
+    uint32_t size;     // size of the Merkle tree of the commitments
+    uint32_t index;    // index of the commitment in the Merkle tree
+    merkleized_map_commitment_t map;
+} map_commitment_cache_entry_t;
+
+typedef struct {
+    map_commitment_cache_entry_t entries[MAP_COMMITMENT_CACHE_SIZE];
+    uint8_t n_entries;
+    uint8_t next;  // index of the entry to replace when the cache is full
+} map_commitment_cache_t;
+
+extern map_commitment_cache_t G_map_commitment_cache;
+
+/**
+ * Empties the cache; it is called before processing each command.
+ */
+void map_commitment_cache_reset(void);
+
+/**
+ * Looks up the commitment of the map at position `index` of the Merkle tree with the given root and
+ * size.
+ *
+ * @param[out] out
+ *   Pointer to the commitment, filled if it is in the cache; its key index table is filled if the
+ *   keys of the map were verified to be sorted.
+ *
+ * @return true if the commitment is in the cache, false otherwise.
+ */
+bool map_commitment_cache_get(const uint8_t root[static 32],
+                              uint32_t size,
+                              uint32_t index,
+                              merkleized_map_commitment_t *out);
+
+/**
+ * Adds the verified commitment of the map at position `index` of the Merkle tree with the given
+ * root and size, replacing the entry of the same map if it is already in the cache.
+ */
+void map_commitment_cache_add(const uint8_t root[static 32],
+                              uint32_t size,
+                              uint32_t index,
+                              const merkleized_map_commitment_t *map);
+
+#endif
@@ -0,0 +1,73 @@
+#include <string.h>
+
+#include "os.h"
+
+#include "merkle_frontier.h"
+
+#ifdef HAVE_HASH_REFS
+
+merkle_frontier_t G_merkle_frontier;
+
+// The first `depth` directions, that identify the ancestor at that depth
+static inline uint32_t directions_prefix(uint32_t directions, int depth) {
+    return directions & ((1U << depth) - 1);
+}
+
+void merkle_frontier_reset(void) {
+    explicit_bzero(&G_merkle_frontier, sizeof(G_merkle_frontier));
+}
+
+int merkle_frontier_find(const uint8_t root[static 32],
+                         uint32_t tree_size,
+                         uint32_t directions,
+                         int leaf_depth,
+                         uint8_t hash[static 32]) {
+    merkle_frontier_entry_t *best = NULL;
+    for (int i = 0; i < MERKLE_FRONTIER_SIZE; i++) {
+        merkle_frontier_entry_t *entry = &G_merkle_frontier.entries[i];
+        if (entry->depth == 0 || entry->depth >= leaf_depth || entry->tree_size != tree_size ||
+            (best != NULL && entry->depth <= best->depth) ||
+            entry->directions != directions_prefix(directions, entry->depth) ||
+            memcmp(entry->root, root, 32) != 0) {
+            continue;
+        }
+        best = entry;
+    }
+
+    if (best == NULL) {
+        memcpy(hash, root, 32);
+        return 0;
+    }
+    best->last_used = ++G_merkle_frontier.clock;
+    memcpy(hash, best->hash, 32);
+    return best->depth;
+}
+
+void merkle_frontier_add(const uint8_t root[static 32],
+                         uint32_t tree_size,
+                         uint32_t directions,
+                         int depth,
+                         const uint8_t hash[static 32]) {
+    merkle_frontier_entry_t *victim = &G_merkle_frontier.entries[0];
+    for (int i = 0; i < MERKLE_FRONTIER_SIZE; i++) {
+        merkle_frontier_entry_t *entry = &G_merkle_frontier.entries[i];
+        if (entry->depth == depth && entry->tree_size == tree_size &&
+            entry->directions == directions_prefix(directions, depth) &&
+            memcmp(entry->root, root, 32) == 0) {
+            victim = entry;  // already kept
+            break;
+        }
+        if (entry->last_used < victim->last_used) {
+            victim = entry;
+        }
+    }
+
+    memcpy(victim->root, root, 32);
+    victim->tree_size = tree_size;
+    victim->directions = directions_prefix(directions, depth);
+    victim->depth = (uint8_t) depth;
+    memcpy(victim->hash, hash, 32);
+    victim->last_used = ++G_merkle_frontier.clock;
+}
+
+#endif
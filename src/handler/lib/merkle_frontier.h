@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAVE_HASH_REFS
+
+// Number of verified nodes kept; when it is full, the least recently used one is replaced.
+#define MERKLE_FRONTIER_SIZE 8
+
+// Number of levels between a kept node and the deepest leaves below it: each node kept after
+// verifying a proof is the ancestor of up to 2^MERKLE_FRONTIER_LEVELS consecutive leaves.
+#define MERKLE_FRONTIER_LEVELS 3
+
+/**
+ * A small cache of the internal nodes of the Merkle trees verified while processing the current
+ * command, so that the proofs of the next leaves below them can stop at their level, instead of
+ * climbing up to the root. Each node is identified by the root and the size of its tree, its
+ * depth and the directions from the root.
+ *
+ * As the nodes are only added after the proof that contains them is verified, a node in the cache
+ * is as good as the root of its tree.
+ */
+typedef struct {
+    uint8_t root[32];
+    uint32_t tree_size;
+    uint32_t directions;  // the first `depth` directions from the root, as in merkle_get_directions
+    uint8_t depth;        // 0 if the entry is empty
+    uint8_t hash[32];
+    uint32_t last_used;
+} merkle_frontier_entry_t;
+
+typedef struct {
+    uint32_t clock;  // the last value of last_used
+    merkle_frontier_entry_t entries[MERKLE_FRONTIER_SIZE];
+} merkle_frontier_t;
+
+extern merkle_frontier_t G_merkle_frontier;
+
+/**
+ * Empties the cache; it is called before processing each command.
+ */
+void merkle_frontier_reset(void);
+
+/**
+ * Finds the deepest kept ancestor of a leaf.
+ *
+ * @param[in] root
+ *   The root of the Merkle tree.
+ * @param[in] tree_size
+ *   The number of leaves of the Merkle tree.
+ * @param[in] directions
+ *   The directions from the root to the leaf, as computed by merkle_get_directions.
+ * @param[in] leaf_depth
+ *   The depth of the leaf.
+ * @param[out] hash
+ *   The hash of the ancestor, or the root if no ancestor is kept.
+ *
+ * @return the depth of the ancestor, or 0 if no ancestor is kept.
+ */
+int merkle_frontier_find(const uint8_t root[static 32],
+                         uint32_t tree_size,
+                         uint32_t directions,
+                         int leaf_depth,
+                         uint8_t hash[static 32]);
+
+/**
+ * Adds a node, that must be verified, to the cache.
+ *
+ * @param[in] root
+ *   The root of the Merkle tree.
+ * @param[in] tree_size
+ *   The number of leaves of the Merkle tree.
+ * @param[in] directions
+ *   The directions from the root to the node, or to any leaf below it.
+ * @param[in] depth
+ *   The depth of the node; it must be between 1 and 31.
+ * @param[in] hash
+ *   The hash of the node.
+ */
+void merkle_frontier_add(const uint8_t root[static 32],
+                         uint32_t tree_size,
+                         uint32_t directions,
+                         int depth,
+                         const uint8_t hash[static 32]);
+
+#endif
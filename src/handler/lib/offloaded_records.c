@@ -0,0 +1,141 @@
+#include <string.h>
+
+#include "os.h"
+#include "cx.h"
+
+#include "offloaded_records.h"
+
+#include "../../boilerplate/sw.h"
+#include "../../common/varint.h"
+#include "../../common/write.h"
+#include "../../crypto.h"
+#include "../client_commands.h"
+
+#ifdef HAVE_OFFLOADED_RECORDS
+
+/**
+ * The label used to derive the symmetric key from which the keys of the sessions are derived.
+ */
+#define OFFLOADED_RECORDS_SLIP0021_LABEL "\0LEDGER-Offloaded records"
+#define OFFLOADED_RECORDS_SLIP0021_LABEL_LEN \
+    (sizeof(OFFLOADED_RECORDS_SLIP0021_LABEL) - 1)  // sizeof counts the terminating 0
+
+bool offloaded_records_open(offloaded_records_session_t *session) {
+    uint8_t key[32];
+    uint8_t nonce[32];
+
+    bool result = false;
+    BEGIN_TRY {
+        TRY {
+            crypto_derive_symmetric_key(OFFLOADED_RECORDS_SLIP0021_LABEL,
+                                        OFFLOADED_RECORDS_SLIP0021_LABEL_LEN,
+                                        key);
+
+            // the key of the session is unpredictable to the client even if the nonce is not
+            cx_rng_no_throw(nonce, sizeof(nonce));
+            cx_hmac_sha256(key, sizeof(key), nonce, sizeof(nonce), session->key, 32);
+            result = true;
+        }
+        FINALLY {
+            explicit_bzero(key, sizeof(key));
+        }
+    }
+    END_TRY;
+
+    return result;
+}
+
+void offloaded_records_close(offloaded_records_session_t *session) {
+    explicit_bzero(session->key, sizeof(session->key));
+}
+
+static void compute_record_hmac(const offloaded_records_session_t *session,
+                                uint32_t index,
+                                const uint8_t *data,
+                                size_t data_len,
+                                uint8_t hmac[static OFFLOADED_RECORD_HMAC_LEN]) {
+    uint8_t msg[4 + MAX_OFFLOADED_RECORD_DATA_LEN];
+    write_u32_be(msg, 0, index);
+    memcpy(msg + 4, data, data_len);
+
+    cx_hmac_sha256(session->key,
+                   sizeof(session->key),
+                   msg,
+                   4 + data_len,
+                   hmac,
+                   OFFLOADED_RECORD_HMAC_LEN);
+}
+
+int call_put_offloaded_record(dispatcher_context_t *dispatcher_context,
+                              const offloaded_records_session_t *session,
+                              uint32_t index,
+                              const uint8_t *data,
+                              size_t data_len) {
+    if (data_len > MAX_OFFLOADED_RECORD_DATA_LEN) {
+        return -1;
+    }
+
+    uint8_t hmac[OFFLOADED_RECORD_HMAC_LEN];
+    compute_record_hmac(session, index, data, data_len, hmac);
+
+    uint8_t req[1 + 9 + 1];
+    req[0] = CCMD_PUT_RECORD;
+    int varint_len = varint_write(req, 1, index);
+    req[1 + varint_len] = (uint8_t) (data_len + OFFLOADED_RECORD_HMAC_LEN);
+
+    dispatcher_context->add_to_response(req, 1 + varint_len + 1);
+    dispatcher_context->add_to_response(data, data_len);
+    dispatcher_context->add_to_response(hmac, sizeof(hmac));
+    dispatcher_context->finalize_response(SW_INTERRUPTED_EXECUTION);
+
+    if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
+        return -2;
+    }
+
+    // the response is empty
+    if (buffer_can_read(&dispatcher_context->read_buffer, 1)) {
+        return -3;
+    }
+    return 0;
+}
+
+int call_get_offloaded_record(dispatcher_context_t *dispatcher_context,
+                              const offloaded_records_session_t *session,
+                              uint32_t index,
+                              uint8_t *out,
+                              size_t data_len) {
+    if (data_len > MAX_OFFLOADED_RECORD_DATA_LEN) {
+        return -1;
+    }
+
+    uint8_t req[1 + 9];
+    req[0] = CCMD_GET_RECORD;
+    int varint_len = varint_write(req, 1, index);
+
+    SET_RESPONSE(dispatcher_context, req, 1 + varint_len, SW_INTERRUPTED_EXECUTION);
+    if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
+        return -2;
+    }
+
+    uint8_t record_len;
+    uint8_t received_hmac[OFFLOADED_RECORD_HMAC_LEN];
+    if (!buffer_read_u8(&dispatcher_context->read_buffer, &record_len) ||
+        record_len != data_len + OFFLOADED_RECORD_HMAC_LEN ||
+        !buffer_read_bytes(&dispatcher_context->read_buffer, out, data_len) ||
+        !buffer_read_bytes(&dispatcher_context->read_buffer,
+                           received_hmac,
+                           sizeof(received_hmac))) {
+        return -3;
+    }
+
+    uint8_t correct_hmac[OFFLOADED_RECORD_HMAC_LEN];
+    compute_record_hmac(session, index, out, data_len, correct_hmac);
+
+    if (os_secure_memcmp(received_hmac, correct_hmac, sizeof(correct_hmac)) != 0) {
+        memset(out, 0, data_len);
+        return -4;
+    }
+    return 0;
+}
+
+#endif
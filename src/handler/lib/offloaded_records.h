@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../boilerplate/dispatcher.h"
+
+#ifdef HAVE_OFFLOADED_RECORDS
+
+// Maximum length of the data of an offloaded record
+#define MAX_OFFLOADED_RECORD_DATA_LEN 32
+
+// Length of the hmac appended to the data of each offloaded record
+#define OFFLOADED_RECORD_HMAC_LEN 32
+
+/**
+ * Offloaded records are small pieces of the state of a command that do not fit in memory, and are
+ * kept by the client instead: they are sent with CCMD_PUT_RECORD, and requested back with
+ * CCMD_GET_RECORD. Each record is identified by an index, and authenticated by an hmac of its index
+ * and data with the key of the session, that is derived from the symmetric key of the
+ * OFFLOADED_RECORDS_SLIP0021_LABEL label and a random nonce.
+ * Therefore, the records of a session can not be forged, swapped, or replayed in another session.
+ *
+ * IMPORTANT: the session contains a secret, and must be wiped with offloaded_records_close after
+ * use.
+ */
+typedef struct {
+    uint8_t key[32];
+} offloaded_records_session_t;
+
+/**
+ * Starts a new session of offloaded records, with a fresh key.
+ *
+ * @param[out] session
+ *   Pointer to the session to initialize.
+ *
+ * @return true on success, false otherwise.
+ */
+bool offloaded_records_open(offloaded_records_session_t *session);
+
+/**
+ * Wipes the key of the session.
+ *
+ * @param[in,out] session
+ *   Pointer to the session to close.
+ */
+void offloaded_records_close(offloaded_records_session_t *session);
+
+/**
+ * Sends a record to the client with CCMD_PUT_RECORD; it replaces the record with the same index,
+ * if any.
+ *
+ * @param[in] dispatcher_context
+ *   Pointer to the dispatcher context.
+ * @param[in] session
+ *   Pointer to the session of the record.
+ * @param[in] index
+ *   The index of the record.
+ * @param[in] data
+ *   The data of the record.
+ * @param[in] data_len
+ *   The length of data; it must be at most MAX_OFFLOADED_RECORD_DATA_LEN.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int call_put_offloaded_record(dispatcher_context_t *dispatcher_context,
+                              const offloaded_records_session_t *session,
+                              uint32_t index,
+                              const uint8_t *data,
+                              size_t data_len);
+
+/**
+ * Requests a record to the client with CCMD_GET_RECORD, and verifies it.
+ *
+ * @param[in] dispatcher_context
+ *   Pointer to the dispatcher context.
+ * @param[in] session
+ *   Pointer to the session of the record.
+ * @param[in] index
+ *   The index of the record.
+ * @param[out] out
+ *   Pointer to a buffer of data_len bytes that receives the data of the record.
+ * @param[in] data_len
+ *   The length of the data of the record; it must be at most MAX_OFFLOADED_RECORD_DATA_LEN.
+ *
+ * @return 0 on success, a negative number on failure, including if the record was not sent in the
+ * same session, with the same index and length.
+ */
+int call_get_offloaded_record(dispatcher_context_t *dispatcher_context,
+                              const offloaded_records_session_t *session,
+                              uint32_t index,
+                              uint8_t *out,
+                              size_t data_len);
+
+#endif
@@ -0,0 +1,64 @@
+#include <string.h>
+
+#include "os.h"
+#include "cx.h"
+
+#include "payee_list.h"
+
+#include "../../common/varint.h"
+#include "../../crypto.h"
+
+#ifdef HAVE_PAYEE_LISTS
+
+/**
+ * The label used to derive the symmetric key used to register/verify payee lists on device.
+ */
+#define PAYEE_LIST_SLIP0021_LABEL "\0LEDGER-Payee list"
+#define PAYEE_LIST_SLIP0021_LABEL_LEN \
+    (sizeof(PAYEE_LIST_SLIP0021_LABEL) - 1)  // sizeof counts the terminating 0
+
+void get_payee_list_id(uint32_t n_payees,
+                       const uint8_t payees_root[static 32],
+                       uint8_t payee_list_id[static 32]) {
+    uint8_t serialization[9 + 32];
+    int varint_len = varint_write(serialization, 0, n_payees);
+    memcpy(serialization + varint_len, payees_root, 32);
+
+    cx_hash_sha256(serialization, varint_len + 32, payee_list_id, 32);
+}
+
+bool compute_payee_list_hmac(const uint8_t payee_list_id[static 32],
+                             uint8_t payee_list_hmac[static 32]) {
+    uint8_t key[32];
+
+    bool result = false;
+    BEGIN_TRY {
+        TRY {
+            crypto_derive_symmetric_key(PAYEE_LIST_SLIP0021_LABEL,
+                                        PAYEE_LIST_SLIP0021_LABEL_LEN,
+                                        key);
+
+            cx_hmac_sha256(key, sizeof(key), payee_list_id, 32, payee_list_hmac, 32);
+            result = true;
+        }
+        FINALLY {
+            explicit_bzero(key, sizeof(key));
+        }
+    }
+    END_TRY;
+
+    return result;
+}
+
+bool check_payee_list_hmac(const uint8_t payee_list_id[static 32],
+                           const uint8_t payee_list_hmac[static 32]) {
+    uint8_t correct_hmac[32];
+
+    bool result = compute_payee_list_hmac(payee_list_id, correct_hmac) &&
+                  os_secure_memcmp((void *) payee_list_hmac, (void *) correct_hmac, 32) == 0;
+
+    explicit_bzero(correct_hmac, sizeof(correct_hmac));
+    return result;
+}
+
+#endif
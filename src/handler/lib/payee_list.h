@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef HAVE_PAYEE_LISTS
+
+/**
+ * A payee list is a Merkle tree of scriptPubKeys, approved once by the user with
+ * REGISTER_PAYEE_LIST. Its id is the SHA-256 of its serialization:
+ *   <n_payees : varint> <payees_root : 32>
+ * and it is authenticated by an hmac of the id, with a symmetric key distinct from the one of the
+ * wallet policies.
+ */
+
+/**
+ * Computes the id of the payee list with the given number of payees and Merkle root.
+ *
+ * @param[in] n_payees
+ *   The number of scriptPubKeys in the list.
+ * @param[in] payees_root
+ *   The Merkle root of the scriptPubKeys.
+ * @param[out] payee_list_id
+ *   Pointer to a 32-byte array that will receive the id of the payee list.
+ */
+void get_payee_list_id(uint32_t n_payees,
+                       const uint8_t payees_root[static 32],
+                       uint8_t payee_list_id[static 32]);
+
+/**
+ * Computes the hmac of a registered payee list, using the symmetric key derived with the
+ * PAYEE_LIST_SLIP0021_LABEL label according to SLIP-0021.
+ *
+ * @param[in] payee_list_id
+ *   Pointer to the 32-byte id of the payee list.
+ * @param[out] payee_list_hmac
+ *   Pointer to a 32-byte array that will receive the hmac.
+ *
+ * @return true on success, false otherwise.
+ */
+bool compute_payee_list_hmac(const uint8_t payee_list_id[static 32],
+                             uint8_t payee_list_hmac[static 32]);
+
+/**
+ * Verifies in constant time that payee_list_hmac is the hmac of the given payee list id.
+ *
+ * @param[in] payee_list_id
+ *   Pointer to the 32-byte id of the payee list.
+ * @param[in] payee_list_hmac
+ *   Pointer to the 32-byte hmac to verify.
+ *
+ * @return true if the hmac is valid, false otherwise.
+ */
+bool check_payee_list_hmac(const uint8_t payee_list_id[static 32],
+                           const uint8_t payee_list_hmac[static 32]);
+
+#endif
@@ -4,9 +4,11 @@
 
 #include "../lib/get_merkle_leaf_element.h"
 #include "../lib/get_preimage.h"
+#include "../lib/preimage_reader.h"
+#include "../lib/scratch_arena.h"
+#include "../lib/wallet_session.h"
 #include "../../crypto.h"
 #include "../../common/base58.h"
-#include "../../common/bitvector.h"
 #include "../../common/script.h"
 #include "../../common/segwit_addr.h"
 #include "../../common/wallet.h"
@@ -46,9 +48,24 @@ typedef struct {
                          // processing
 
     cx_hash_t *hash_context;
-    uint8_t hash[32];  // when a node is popped, the hash is computed here
+    crypto_hash_writer_t hash_writer;  // writer to hash_context, if not NULL
+    uint8_t hash[32];                  // when a node is popped, the hash is computed here
+
+    // if not NULL, the script is compiled into this template instead of being produced
+    script_template_t *script_template;
+    int script_template_run;  // position in the template of the header of the last run of
+                              // constant bytes; -1 if the last instruction is not a run
 } policy_parser_state_t;
 
+// Instructions of a script template. A byte smaller than SCRIPT_TEMPLATE_PUSH_PK is the header of a
+// run, and it is followed by that many constant bytes of the script. The other instructions are
+// followed by a pointer to a policy_node_key_placeholder_t, or to a policy_node_multisig_t for
+// SCRIPT_TEMPLATE_PUSH_SORTED_PKS.
+#define SCRIPT_TEMPLATE_PUSH_PK         0x80  // like CMD_CODE_PUSH_PK
+#define SCRIPT_TEMPLATE_PUSH_PKH        0x81  // like CMD_CODE_PUSH_PKH
+#define SCRIPT_TEMPLATE_PUSH_SORTED_PKS 0x82  // the keys of a sortedmulti or sortedmulti_a
+#define SCRIPT_TEMPLATE_MAX_RUN         (SCRIPT_TEMPLATE_PUSH_PK - 1)
+
 // comparator for pointers to arrays of equal length
 static int cmp_arrays(const void *a, const void *b, size_t length) {
     const uint8_t *key_a = (const uint8_t *) a;
@@ -129,6 +146,7 @@ static const uint8_t fragment_whitelist_tapscript[] = {TOKEN_PK,
                                                        TOKEN_MULTI_A,
                                                        TOKEN_SORTEDMULTI_A};
 
+#ifndef SIMPLE_POLICIES_ONLY
 static const generic_processor_command_t commands_0[] = {{CMD_CODE_OP_V, OP_0}, {CMD_CODE_END, 0}};
 static const generic_processor_command_t commands_1[] = {{CMD_CODE_OP_V, OP_1}, {CMD_CODE_END, 0}};
 static const generic_processor_command_t commands_pk_k[] = {{CMD_CODE_PUSH_PK, 0},
@@ -284,22 +302,65 @@ static const generic_processor_command_t commands_u[] = {{CMD_CODE_OP, OP_IF},
                                                          {CMD_CODE_OP, OP_0},
                                                          {CMD_CODE_OP_V, OP_ENDIF},
                                                          {CMD_CODE_END, 0}};
+#endif
+
+static int read_descriptor_template_callback(void *state, uint8_t *out, size_t out_len) {
+    return preimage_reader_read((preimage_reader_t *) state, out, out_len);
+}
+
+// Parses the descriptor template of a V2 wallet policy while it is streamed from the client.
+static int stream_and_parse_descriptor_template(dispatcher_context_t *dispatcher_context,
+                                                const policy_map_wallet_header_t *wallet_header,
+                                                uint8_t *policy_map_bytes,
+                                                size_t policy_map_bytes_len) {
+    preimage_reader_t reader;
+    const uint8_t *hash = wallet_header->descriptor_template_sha256;
+    int descriptor_template_len = preimage_reader_init(&reader, dispatcher_context, hash);
+    if (descriptor_template_len < 0 ||
+        (size_t) descriptor_template_len != wallet_header->descriptor_template_len) {
+        return WITH_ERROR(-1, "Failed getting wallet policy descriptor template");
+    }
+
+    if (0 > parse_descriptor_template_stream(read_descriptor_template_callback,
+                                             &reader,
+                                             descriptor_template_len,
+                                             policy_map_bytes,
+                                             policy_map_bytes_len,
+                                             wallet_header->version)) {
+        return WITH_ERROR(-1, "Failed parsing descriptor template");
+    }
+
+    // the parsed policy is only valid if the descriptor template matches its hash
+    if (0 > preimage_reader_finish(&reader, hash)) {
+        return WITH_ERROR(-1, "Failed getting wallet policy descriptor template");
+    }
+    return 0;
+}
 
-int read_and_parse_wallet_policy(
-    dispatcher_context_t *dispatcher_context,
-    buffer_t *buf,
-    policy_map_wallet_header_t *wallet_header,
-    uint8_t policy_map_descriptor_template[static MAX_DESCRIPTOR_TEMPLATE_LENGTH],
-    uint8_t *policy_map_bytes,
-    size_t policy_map_bytes_len) {
+int read_and_parse_wallet_policy(dispatcher_context_t *dispatcher_context,
+                                 buffer_t *buf,
+                                 policy_map_wallet_header_t *wallet_header,
+                                 uint8_t *policy_map_descriptor_template,
+                                 uint8_t *policy_map_bytes,
+                                 size_t policy_map_bytes_len) {
     if ((read_wallet_policy_header(buf, wallet_header)) < 0) {
         return WITH_ERROR(-1, "Failed reading wallet policy header");
     }
 
     if (wallet_header->version == WALLET_POLICY_VERSION_V1) {
-        memcpy(policy_map_descriptor_template,
-               wallet_header->descriptor_template,
-               wallet_header->descriptor_template_len);
+        if (policy_map_descriptor_template == NULL) {
+            // parsed in place, in the header
+            policy_map_descriptor_template = (uint8_t *) wallet_header->descriptor_template;
+        } else {
+            memcpy(policy_map_descriptor_template,
+                   wallet_header->descriptor_template,
+                   wallet_header->descriptor_template_len);
+        }
+    } else if (policy_map_descriptor_template == NULL) {
+        return stream_and_parse_descriptor_template(dispatcher_context,
+                                                    wallet_header,
+                                                    policy_map_bytes,
+                                                    policy_map_bytes_len);
     } else {
         // if V2, stream and parse descriptor template from client first
         int descriptor_template_len = call_get_preimage(dispatcher_context,
@@ -387,6 +448,15 @@ static int __attribute__((noinline)) get_extended_pubkey(dispatcher_context_t *d
                                                          serialized_extended_pubkey_t *out) {
     PRINT_STACK_POINTER();
 
+#ifdef HAVE_WALLET_SESSIONS
+    const wallet_session_key_t *session_key =
+        wallet_session_get_key(wdi->keys_merkle_root, wdi->n_keys, (uint32_t) key_index);
+    if (session_key != NULL) {
+        memcpy(out, &session_key->ext_pubkey, sizeof(session_key->ext_pubkey));
+        return session_key->has_wildcard ? 1 : 0;
+    }
+#endif
+
     policy_map_key_info_t key_info;
 
     {
@@ -427,12 +497,108 @@ static int __attribute__((noinline)) get_extended_pubkey(dispatcher_context_t *d
     return key_info.has_wildcard ? 1 : 0;
 }
 
+// Returns the cache of wdi, after resetting it if its entries are for a different vector of keys
+static derived_pubkeys_cache_t *get_cache(const wallet_derivation_info_t *wdi) {
+    derived_pubkeys_cache_t *cache = wdi->cache;
+
+    if (memcmp(cache->keys_merkle_root, wdi->keys_merkle_root, 32) != 0) {
+        // cached entries are for a different vector of keys; reset the cache
+        memset(cache, 0, sizeof(derived_pubkeys_cache_t));
+        memcpy(cache->keys_merkle_root, wdi->keys_merkle_root, 32);
+    }
+    return cache;
+}
+
+// Returns the cache entry for the key information with the given index, fetching and decoding the
+// key information if the entry is not in the cache; returns NULL on error.
+static cached_key_info_t *get_cached_key_info(dispatcher_context_t *dispatcher_context,
+                                              const wallet_derivation_info_t *wdi,
+                                              int16_t key_index) {
+    derived_pubkeys_cache_t *cache = get_cache(wdi);
+
+    for (int i = 0; i < MAX_CACHED_KEY_INFOS; i++) {
+        if (cache->entries[i].is_valid && cache->entries[i].key_index == key_index) {
+            return &cache->entries[i];
+        }
+    }
+
+    cached_key_info_t *entry = &cache->entries[cache->next_slot];
+    cache->next_slot = (cache->next_slot + 1) % MAX_CACHED_KEY_INFOS;
+
+    entry->is_valid = false;
+    if (0 > get_extended_pubkey(dispatcher_context, wdi, key_index, &entry->ext_pubkey)) {
+        return NULL;
+    }
+    entry->key_index = key_index;
+    entry->has_child[0] = false;
+    entry->has_child[1] = false;
+    entry->is_valid = true;
+    return entry;
+}
+
 static int get_derived_pubkey(dispatcher_context_t *dispatcher_context,
                               const wallet_derivation_info_t *wdi,
                               const policy_node_key_placeholder_t *key_placeholder,
                               uint8_t out[static 33]) {
     PRINT_STACK_POINTER();
 
+    uint32_t change_step = wdi->change ? key_placeholder->num_second : key_placeholder->num_first;
+
+    if (wdi->cache != NULL) {
+        derived_pubkeys_cache_t *cache = get_cache(wdi);
+        if (!cache->has_derived_address || cache->derived_change != wdi->change ||
+            cache->derived_address_index != wdi->address_index) {
+            cache->has_derived_address = true;
+            cache->derived_change = wdi->change;
+            cache->derived_address_index = wdi->address_index;
+            cache->n_derived_pubkeys = 0;
+        }
+        for (int i = 0; i < cache->n_derived_pubkeys; i++) {
+            const cached_derived_pubkey_t *derived = &cache->derived_pubkeys[i];
+            if (derived->key_index == key_placeholder->key_index &&
+                derived->change_step == change_step) {
+                memcpy(out, derived->pubkey, 33);
+                return 0;
+            }
+        }
+
+        cached_key_info_t *entry =
+            get_cached_key_info(dispatcher_context, wdi, key_placeholder->key_index);
+        if (entry == NULL) {
+            return -1;
+        }
+
+        int slot = wdi->change ? 1 : 0;
+        if (!entry->has_child[slot] || entry->child_num[slot] != change_step) {
+            entry->has_child[slot] = false;
+            if (0 > bip32_expand_pubkey(&entry->ext_pubkey, &entry->children[slot]) ||
+                0 > bip32_CKDpub_expanded(&entry->children[slot],
+                                          change_step,
+                                          &entry->children[slot])) {
+                return -1;
+            }
+            entry->child_num[slot] = change_step;
+            entry->has_child[slot] = true;
+        }
+
+        // only the /<address_index> step is left; the cached child is not decompressed again, and
+        // its fingerprint is only computed once
+        expanded_extended_pubkey_t child;
+        if (0 > bip32_CKDpub_expanded(&entry->children[slot], wdi->address_index, &child)) {
+            return -1;
+        }
+        crypto_get_compressed_pubkey(child.uncompressed_pubkey, out);
+
+        if (cache->n_derived_pubkeys < MAX_CACHED_DERIVED_PUBKEYS) {
+            cached_derived_pubkey_t *derived = &cache->derived_pubkeys[cache->n_derived_pubkeys++];
+            derived->key_index = key_placeholder->key_index;
+            derived->change_step = change_step;
+            memcpy(derived->pubkey, out, 33);
+        }
+
+        return 0;
+    }
+
     serialized_extended_pubkey_t ext_pubkey;
 
     int ret = get_extended_pubkey(dispatcher_context, wdi, key_placeholder->key_index, &ext_pubkey);
@@ -442,9 +608,7 @@ static int get_derived_pubkey(dispatcher_context_t *dispatcher_context,
 
     // we derive the /<change>/<address_index> child of this pubkey
     // we reuse the same memory of ext_pubkey
-    bip32_CKDpub(&ext_pubkey,
-                 wdi->change ? key_placeholder->num_second : key_placeholder->num_first,
-                 &ext_pubkey);
+    bip32_CKDpub(&ext_pubkey, change_step, &ext_pubkey);
     bip32_CKDpub(&ext_pubkey, wdi->address_index, &ext_pubkey);
 
     memcpy(out, ext_pubkey.compressed_pubkey, 33);
@@ -452,11 +616,100 @@ static int get_derived_pubkey(dispatcher_context_t *dispatcher_context,
     return 0;
 }
 
+// Looks up the value computed for the given taproot node at the change and address index of wdi.
+// On a hit, the entry becomes the most recently used, and true is returned.
+static bool get_cached_taproot_hash(const wallet_derivation_info_t *wdi,
+                                    const void *node,
+                                    uint8_t out[static 32]) {
+    if (wdi->cache == NULL) {
+        return false;
+    }
+
+    cached_taproot_hash_t *entries = get_cache(wdi)->taproot_hashes;
+    for (int i = 0; i < MAX_CACHED_TAPROOT_HASHES; i++) {
+        if (entries[i].node == node && entries[i].change == wdi->change &&
+            entries[i].address_index == wdi->address_index) {
+            cached_taproot_hash_t entry = entries[i];
+            memmove(&entries[1], &entries[0], i * sizeof(cached_taproot_hash_t));
+            entries[0] = entry;
+
+            memcpy(out, entry.hash, 32);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Stores the value computed for the given taproot node as the most recently used entry, evicting
+// the least recently used one if the cache is full.
+static void cache_taproot_hash(const wallet_derivation_info_t *wdi,
+                               const void *node,
+                               const uint8_t hash[static 32]) {
+    if (wdi->cache == NULL) {
+        return;
+    }
+
+    cached_taproot_hash_t *entries = get_cache(wdi)->taproot_hashes;
+    memmove(&entries[1],
+            &entries[0],
+            (MAX_CACHED_TAPROOT_HASHES - 1) * sizeof(cached_taproot_hash_t));
+    entries[0].node = node;
+    entries[0].change = wdi->change;
+    entries[0].address_index = wdi->address_index;
+    memcpy(entries[0].hash, hash, 32);
+}
+
+// Appends the given constant bytes to the template being compiled, extending its last run if
+// possible. If the template is full, its code_len is set beyond SCRIPT_TEMPLATE_SIZE.
+static void script_template_append(policy_parser_state_t *state,
+                                   const uint8_t *data,
+                                   size_t data_len) {
+    script_template_t *script_template = state->script_template;
+    for (size_t i = 0; i < data_len; i++) {
+        bool new_run = state->script_template_run < 0 ||
+                       script_template->code[state->script_template_run] == SCRIPT_TEMPLATE_MAX_RUN;
+        if (script_template->code_len + (new_run ? 2 : 1) > SCRIPT_TEMPLATE_SIZE) {
+            script_template->code_len = SCRIPT_TEMPLATE_SIZE + 1;
+            return;
+        }
+        if (new_run) {
+            state->script_template_run = script_template->code_len;
+            script_template->code[script_template->code_len++] = 0;
+        }
+        ++script_template->code[state->script_template_run];
+        script_template->code[script_template->code_len++] = data[i];
+    }
+}
+
+// Appends an instruction pushing pubkeys to the template being compiled; `ptr` is the key
+// placeholder, or the multisig node, whose pubkeys are pushed. `script_len` is the number of bytes
+// of the script produced by the instruction.
+static void script_template_append_pubkeys(policy_parser_state_t *state,
+                                           uint8_t instruction,
+                                           const void *ptr,
+                                           size_t script_len) {
+    script_template_t *script_template = state->script_template;
+
+    state->nodes[state->node_stack_eos].length += script_len;
+
+    if (script_template->code_len + 1 + sizeof(ptr) > SCRIPT_TEMPLATE_SIZE) {
+        script_template->code_len = SCRIPT_TEMPLATE_SIZE + 1;
+        return;
+    }
+    script_template->code[script_template->code_len++] = instruction;
+    memcpy(&script_template->code[script_template->code_len], &ptr, sizeof(ptr));
+    script_template->code_len += sizeof(ptr);
+    state->script_template_run = -1;
+}
+
 static void update_output(policy_parser_state_t *state, const uint8_t *data, size_t data_len) {
     policy_parser_node_state_t *node = &state->nodes[state->node_stack_eos];
     node->length += data_len;
     if (state->hash_context != NULL) {
-        crypto_hash_update(state->hash_context, data, data_len);
+        crypto_hash_writer_update(&state->hash_writer, data, data_len);
+    }
+    if (state->script_template != NULL) {
+        script_template_append(state, data, data_len);
     }
 }
 
@@ -512,6 +765,143 @@ static void update_output_op_v(policy_parser_state_t *state, uint8_t op) {
     }
 }
 
+// Derives the pubkey for a key placeholder of the script being produced. If the script is not
+// hashed, only its length is computed, which does not depend on the pubkeys; therefore, the
+// derivation is skipped and a placeholder pubkey is returned instead.
+static int derive_script_pubkey(policy_parser_state_t *state,
+                                const policy_node_key_placeholder_t *key_placeholder,
+                                uint8_t out[static 33]) {
+    if (state->hash_context == NULL) {
+        memset(out, 0, 33);
+        out[0] = 0x02;
+        return 0;
+    }
+
+    return get_derived_pubkey(state->dispatcher_context, state->wdi, key_placeholder, out);
+}
+
+// Outputs the push of the pubkey for a key placeholder: the compressed pubkey, or the x-only pubkey
+// within taproot; if `hash160` is true, the hash160 of the compressed pubkey instead.
+static int update_output_pubkey(policy_parser_state_t *state,
+                                const policy_node_key_placeholder_t *key_placeholder,
+                                bool hash160) {
+    if (state->script_template != NULL) {
+        if (hash160) {
+            script_template_append_pubkeys(state, SCRIPT_TEMPLATE_PUSH_PKH, key_placeholder, 21);
+        } else {
+            script_template_append_pubkeys(state,
+                                           SCRIPT_TEMPLATE_PUSH_PK,
+                                           key_placeholder,
+                                           state->is_taproot ? 33 : 34);
+        }
+        return 0;
+    }
+
+    uint8_t compressed_pubkey[33];
+    if (-1 == derive_script_pubkey(state, key_placeholder, compressed_pubkey)) {
+        return -1;
+    }
+
+    if (hash160) {
+        crypto_hash160(compressed_pubkey, 33, compressed_pubkey);  // reuse memory
+
+        update_output_u8(state, 20);  // PUSH 20 bytes
+        update_output(state, compressed_pubkey, 20);
+    } else if (!state->is_taproot) {
+        update_output_u8(state, 33);  // PUSH 33 bytes
+        update_output(state, compressed_pubkey, 33);
+    } else {
+        // x-only pubkey if within taproot
+        update_output_u8(state, 32);  // PUSH 32 bytes
+        update_output(state, compressed_pubkey + 1, 32);
+    }
+    return 0;
+}
+
+// Compares two pubkeys in the order of a sortedmulti, or of a sortedmulti_a if x_only is true (as
+// x-only pubkeys ignore the first byte), breaking ties with the index of their key placeholders.
+static int cmp_sorted_pubkeys(const uint8_t pubkey_a[static 33],
+                              int index_a,
+                              const uint8_t pubkey_b[static 33],
+                              int index_b,
+                              bool x_only) {
+    int cmp =
+        x_only ? cmp_arrays(pubkey_a + 1, pubkey_b + 1, 32) : cmp_arrays(pubkey_a, pubkey_b, 33);
+    return cmp != 0 ? cmp : index_a - index_b;
+}
+
+// Outputs the pushes of the pubkeys of a sortedmulti or sortedmulti_a, in lexicographic order; for
+// sortedmulti_a, each x-only pubkey is followed by OP_CHECKSIG or OP_CHECKSIGADD.
+static int update_output_sorted_pubkeys(policy_parser_state_t *state,
+                                        const policy_node_multisig_t *policy) {
+    bool is_multi_a = policy->base.type == TOKEN_SORTEDMULTI_A;
+
+    if (state->script_template != NULL) {
+        // 34 bytes per key: push of 33 bytes, or push of 32 bytes and one opcode
+        script_template_append_pubkeys(state,
+                                       SCRIPT_TEMPLATE_PUSH_SORTED_PKS,
+                                       policy,
+                                       34 * policy->n);
+        return 0;
+    }
+
+    // sortedmulti is problematic, especially for very large wallets: we don't have enough memory
+    // to keep all the keys in memory. Therefore, we use a slow method that only needs the last
+    // pushed key: at each iteration, we derive all the keys again, and push the lexicographically
+    // smallest key that is larger than the last one (basically, like in selection sort). This
+    // means quadratic communication with the client, and a quadratic number of pubkey derivations
+    // as well, which are quite slow; but it allows multi_a with many keys, with constant memory.
+    // Keys are compared together with the index of their key placeholder, in order to break ties.
+
+    const policy_node_key_placeholder_t *key_placeholders =
+        r_policy_node_key_placeholder(&policy->key_placeholders);
+    uint8_t last_pubkey[33];
+    int last_index = -1;  // -1 before the first key is pushed
+
+    for (int i = 0; i < policy->n; i++) {
+        uint8_t compressed_pubkey[33];
+        int smallest_pubkey_index = -1;
+
+        for (int j = 0; j < policy->n; j++) {
+            uint8_t cur_pubkey[33];
+            if (-1 == derive_script_pubkey(state, &key_placeholders[j], cur_pubkey)) {
+                return -1;
+            }
+
+            if (last_index >= 0 &&
+                0 >= cmp_sorted_pubkeys(cur_pubkey, j, last_pubkey, last_index, is_multi_a)) {
+                continue;  // already pushed
+            }
+
+            if (smallest_pubkey_index < 0 || cmp_sorted_pubkeys(cur_pubkey,
+                                                                j,
+                                                                compressed_pubkey,
+                                                                smallest_pubkey_index,
+                                                                is_multi_a) < 0) {
+                memcpy(compressed_pubkey, cur_pubkey, 33);
+                smallest_pubkey_index = j;
+            }
+        }
+
+        memcpy(last_pubkey, compressed_pubkey, 33);
+        last_index = smallest_pubkey_index;
+
+        if (!is_multi_a) {
+            // push <i-th pubkey> (33 = 0x21 bytes)
+            update_output_u8(state, 0x21);
+            update_output(state, compressed_pubkey, 33);
+        } else {
+            // push <i-th pubkey> as x-only key (32 = 0x20 bytes)
+            update_output_u8(state, 0x20);
+            update_output(state, compressed_pubkey + 1, 32);
+
+            update_output_u8(state, i == 0 ? OP_CHECKSIG : OP_CHECKSIGADD);
+        }
+    }
+    return 0;
+}
+
+#ifndef SIMPLE_POLICIES_ONLY
 static int process_generic_node(policy_parser_state_t *state, const void *arg) {
     policy_parser_node_state_t *node = &state->nodes[state->node_stack_eos];
 
@@ -537,41 +927,17 @@ static int process_generic_node(policy_parser_state_t *state, const void *arg) {
                 update_output_op_v(state, cmd_data);
                 break;
             }
-            case CMD_CODE_PUSH_PK: {
-                const policy_node_with_key_t *policy =
-                    (const policy_node_with_key_t *) node->policy_node;
-                uint8_t compressed_pubkey[33];
-                if (-1 == get_derived_pubkey(state->dispatcher_context,
-                                             state->wdi,
-                                             policy->key_placeholder,
-                                             compressed_pubkey)) {
-                    return -1;
-                }
-
-                if (!state->is_taproot) {
-                    update_output_u8(state, 33);  // PUSH 33 bytes
-                    update_output(state, compressed_pubkey, 33);
-                } else {
-                    // x-only pubkey if within taproot
-                    update_output_u8(state, 32);  // PUSH 32 bytes
-                    update_output(state, compressed_pubkey + 1, 32);
-                }
-                break;
-            }
+            case CMD_CODE_PUSH_PK:
             case CMD_CODE_PUSH_PKH: {
                 const policy_node_with_key_t *policy =
                     (const policy_node_with_key_t *) node->policy_node;
-                uint8_t compressed_pubkey[33];
-                if (-1 == get_derived_pubkey(state->dispatcher_context,
-                                             state->wdi,
-                                             policy->key_placeholder,
-                                             compressed_pubkey)) {
+                const policy_node_key_placeholder_t *key_placeholder =
+                    r_policy_node_key_placeholder(&policy->key_placeholder);
+                if (-1 == update_output_pubkey(state,
+                                               key_placeholder,
+                                               cmd_code == CMD_CODE_PUSH_PKH)) {
                     return -1;
                 }
-                crypto_hash160(compressed_pubkey, 33, compressed_pubkey);  // reuse memory
-
-                update_output_u8(state, 20);  // PUSH 20 bytes
-                update_output(state, compressed_pubkey, 20);
                 break;
             }
             case CMD_CODE_PUSH_UINT32: {
@@ -622,6 +988,7 @@ static int process_generic_node(policy_parser_state_t *state, const void *arg) {
         return 0;
     }
 }
+#endif
 
 static int process_pkh_wpkh_node(policy_parser_state_t *state, const void *arg) {
     UNUSED(arg);
@@ -635,37 +1002,31 @@ static int process_pkh_wpkh_node(policy_parser_state_t *state, const void *arg)
     }
 
     policy_node_with_key_t *policy = (policy_node_with_key_t *) node->policy_node;
+    const policy_node_key_placeholder_t *key_placeholder =
+        r_policy_node_key_placeholder(&policy->key_placeholder);
 
-    uint8_t compressed_pubkey[33];
-
-    if (-1 == get_derived_pubkey(state->dispatcher_context,
-                                 state->wdi,
-                                 policy->key_placeholder,
-                                 compressed_pubkey)) {
-        return -1;
-    } else if (policy->base.type == TOKEN_PKH) {
+    if (policy->base.type == TOKEN_PKH) {
         update_output_u8(state, OP_DUP);
         update_output_u8(state, OP_HASH160);
 
-        update_output_u8(state, 20);  // PUSH 20 bytes
-
-        crypto_hash160(compressed_pubkey, 33, compressed_pubkey);  // reuse memory
-        update_output(state, compressed_pubkey, 20);
+        if (-1 == update_output_pubkey(state, key_placeholder, true)) {
+            return -1;
+        }
 
         update_output_u8(state, OP_EQUALVERIFY);
         update_output_op_v(state, OP_CHECKSIG);
     } else {  // policy->base.type == TOKEN_WPKH
         update_output_u8(state, OP_0);
 
-        update_output_u8(state, 20);  // PUSH 20 bytes
-
-        crypto_hash160(compressed_pubkey, 33, compressed_pubkey);  // reuse memory
-        update_output(state, compressed_pubkey, 20);
+        if (-1 == update_output_pubkey(state, key_placeholder, true)) {
+            return -1;
+        }
     }
 
     return 1;
 }
 
+#ifndef SIMPLE_POLICIES_ONLY
 static int process_thresh_node(policy_parser_state_t *state, const void *arg) {
     UNUSED(arg);
 
@@ -682,9 +1043,9 @@ static int process_thresh_node(policy_parser_state_t *state, const void *arg) {
 
     if (node->step < policy->n) {
         // find the current child node
-        policy_node_scriptlist_t *cur = policy->scriptlist;
+        const policy_node_scriptlist_t *cur = r_policy_node_scriptlist(&policy->scriptlist);
         for (size_t i = 0; i < node->step; i++) {
-            cur = cur->next;
+            cur = r_policy_node_scriptlist(&cur->next);
         }
 
         // process child node
@@ -707,6 +1068,7 @@ static int process_thresh_node(policy_parser_state_t *state, const void *arg) {
         return 1;
     }
 }
+#endif
 
 static int process_multi_sortedmulti_node(policy_parser_state_t *state, const void *arg) {
     UNUSED(arg);
@@ -724,58 +1086,17 @@ static int process_multi_sortedmulti_node(policy_parser_state_t *state, const vo
 
     update_output_u8(state, 0x50 + policy->k);  // OP_k
 
-    // bitvector of used keys (only relevant for sorting keys in SORTEDMULTI)
-    uint8_t used[BITVECTOR_REAL_SIZE(MAX_PUBKEYS_PER_MULTISIG)];
-    memset(used, 0, sizeof(used));
-
-    for (int i = 0; i < policy->n; i++) {
-        uint8_t compressed_pubkey[33];
-
-        if (policy->base.type == TOKEN_MULTI) {
-            if (-1 == get_derived_pubkey(state->dispatcher_context,
-                                         state->wdi,
-                                         &policy->key_placeholders[i],
-                                         compressed_pubkey)) {
+    if (policy->base.type == TOKEN_MULTI) {
+        const policy_node_key_placeholder_t *key_placeholders =
+            r_policy_node_key_placeholder(&policy->key_placeholders);
+        for (int i = 0; i < policy->n; i++) {
+            // push <i-th pubkey> (33 = 0x21 bytes)
+            if (-1 == update_output_pubkey(state, &key_placeholders[i], false)) {
                 return -1;
             }
-        } else {
-            // sortedmulti is problematic, especially for very large wallets: we don't have enough
-            // memory on Nano S to keep all the keys in memory. Therefore, we use a slow method: at
-            // each iteration, find the lexicographically smallest key that was not already used
-            // (basically, like in insertion sort). This means quadratic communication with the
-            // client, and a quadratic number of pubkey derivations as well, which are quite slow.
-            // Performance might become an issue for very large multisig wallets, but this allows us
-            // to remove any limitation on the supported number of pubkeys, and to keep the code
-            // simple.
-            // Should speed be reported as an issue in practice, sorting could be done in-memory for
-            // non-Nano S devices, instead (requiring 33*MAX_PUBKEYS_PER_MULTISIG > 500 bytes more
-            // memory).
-
-            int smallest_pubkey_index = -1;
-            memset(compressed_pubkey, 0xFF, sizeof(compressed_pubkey));  // init to largest value
-
-            for (int j = 0; j < policy->n; j++) {
-                if (!bitvector_get(used, j)) {
-                    uint8_t cur_pubkey[33];
-                    if (-1 == get_derived_pubkey(state->dispatcher_context,
-                                                 state->wdi,
-                                                 &policy->key_placeholders[j],
-                                                 cur_pubkey)) {
-                        return -1;
-                    }
-
-                    if (cmp_arrays(compressed_pubkey, cur_pubkey, 33) > 0) {
-                        memcpy(compressed_pubkey, cur_pubkey, 33);
-                        smallest_pubkey_index = j;
-                    }
-                }
-            }
-            bitvector_set(used, smallest_pubkey_index, true);  // mark the key as used
         }
-
-        // push <i-th pubkey> (33 = 0x21 bytes)
-        update_output_u8(state, 0x21);
-        update_output(state, compressed_pubkey, 33);
+    } else if (-1 == update_output_sorted_pubkeys(state, policy)) {
+        return -1;
     }
 
     update_output_u8(state, 0x50 + policy->n);    // OP_n
@@ -784,6 +1105,7 @@ static int process_multi_sortedmulti_node(policy_parser_state_t *state, const vo
     return 1;
 }
 
+#ifndef SIMPLE_POLICIES_ONLY
 static int process_multi_a_sortedmulti_a_node(policy_parser_state_t *state, const void *arg) {
     UNUSED(arg);
 
@@ -792,78 +1114,42 @@ static int process_multi_a_sortedmulti_a_node(policy_parser_state_t *state, cons
     policy_parser_node_state_t *node = &state->nodes[state->node_stack_eos];
     const policy_node_multisig_t *policy = (const policy_node_multisig_t *) node->policy_node;
 
-    if (policy->k > 16) {
-        return WITH_ERROR(-1, "Implemented only for k <= 16");
-    }
-
     // <pk_1> OP_CHECKSIG <pk_2> OP_CHECKSIGADD ... <pk_n> OP_CHECKSIGADD <k> OP_NUMEQUAL
 
-    // bitvector of used keys (only relevant for sorting keys in SORTEDMULTI)
-    uint8_t used[BITVECTOR_REAL_SIZE(MAX_PUBKEYS_PER_MULTISIG)];
-    memset(used, 0, sizeof(memset));
-
-    for (int i = 0; i < policy->n; i++) {
-        uint8_t compressed_pubkey[33];
-
-        if (policy->base.type == TOKEN_MULTI_A) {
-            if (-1 == get_derived_pubkey(state->dispatcher_context,
-                                         state->wdi,
-                                         &policy->key_placeholders[i],
-                                         compressed_pubkey)) {
+    if (policy->base.type == TOKEN_MULTI_A) {
+        const policy_node_key_placeholder_t *key_placeholders =
+            r_policy_node_key_placeholder(&policy->key_placeholders);
+        for (int i = 0; i < policy->n; i++) {
+            // push <i-th pubkey> as x-only key (32 = 0x20 bytes)
+            if (-1 == update_output_pubkey(state, &key_placeholders[i], false)) {
                 return -1;
             }
-        } else {
-            // Inefficient O(n^2) sorting; check process_multi_sortedmulti_node for the motivation.
-
-            int smallest_pubkey_index = -1;
-            memset(compressed_pubkey, 0xFF, sizeof(compressed_pubkey));  // init to largest value
-
-            for (int j = 0; j < policy->n; j++) {
-                if (!bitvector_get(used, j)) {
-                    uint8_t cur_pubkey[33];
-                    if (-1 == get_derived_pubkey(state->dispatcher_context,
-                                                 state->wdi,
-                                                 &policy->key_placeholders[j],
-                                                 cur_pubkey)) {
-                        return -1;
-                    }
-
-                    // x-only pubkeys must be compared ignoring the first byte
-                    if (cmp_arrays(compressed_pubkey + 1, cur_pubkey + 1, 32) > 0) {
-                        memcpy(compressed_pubkey, cur_pubkey, 33);
-                        smallest_pubkey_index = j;
-                    }
-                }
-            }
-            bitvector_set(used, smallest_pubkey_index, true);  // mark the key as used
-        }
-
-        // push <i-th pubkey> as x-only key (32 = 0x20 bytes)
-        update_output_u8(state, 0x20);
-        update_output(state, compressed_pubkey + 1, 32);
 
-        if (i == 0) {
-            update_output_u8(state, OP_CHECKSIG);
-        } else {
-            update_output_u8(state, OP_CHECKSIGADD);
+            if (i == 0) {
+                update_output_u8(state, OP_CHECKSIG);
+            } else {
+                update_output_u8(state, OP_CHECKSIGADD);
+            }
         }
+    } else if (-1 == update_output_sorted_pubkeys(state, policy)) {
+        return -1;
     }
 
-    update_output_u8(state, 0x50 + policy->k);  // <k>
-    update_output_op_v(state, OP_NUMEQUAL);     // OP_NUMEQUAL
+    update_output_push_u32(state, policy->k);  // <k>
+    update_output_op_v(state, OP_NUMEQUAL);    // OP_NUMEQUAL
 
     return 1;
 }
 
-static int __attribute__((noinline)) compute_tapleaf_hash(dispatcher_context_t *dispatcher_context,
-                                                          const wallet_derivation_info_t *wdi,
-                                                          const policy_node_t *script_policy,
-                                                          uint8_t out[static 32]) {
+static int __attribute__((noinline)) hash_tapleaf(dispatcher_context_t *dispatcher_context,
+                                                  const wallet_derivation_info_t *wdi,
+                                                  const policy_node_t *script_policy,
+                                                  uint8_t out[static 32]) {
     cx_sha256_t hash_context;
     crypto_tr_tapleaf_hash_init(&hash_context);
 
-    // we compute the tapscript once just to compute its length
-    // this avoids having to store the script in memory
+    // we compute the tapscript once just to compute its length, which does not require deriving
+    // any pubkey; this avoids having to store the script in memory
     int tapscript_len = get_wallet_internal_script_hash(dispatcher_context,
                                                         script_policy,
                                                         wdi,
@@ -889,29 +1175,102 @@ static int __attribute__((noinline)) compute_tapleaf_hash(dispatcher_context_t *
     return 0;
 }
 
-// Separated from compute_taptree_hash to optimize its stack usage
-static int __attribute__((noinline))
-compute_and_combine_taptree_child_hashes(dispatcher_context_t *dc,
-                                         const wallet_derivation_info_t *wdi,
-                                         const policy_node_tree_t *tree,
-                                         uint8_t out[static 32]) {
-    uint8_t left_h[32], right_h[32];
-    if (0 > compute_taptree_hash(dc, wdi, resolve_ptr(&tree->left_tree), left_h)) return -1;
-    if (0 > compute_taptree_hash(dc, wdi, resolve_ptr(&tree->right_tree), right_h)) return -1;
-    crypto_tr_combine_taptree_hashes(left_h, right_h, out);
+int compute_tapleaf_hash(dispatcher_context_t *dispatcher_context,
+                         const wallet_derivation_info_t *wdi,
+                         const policy_node_t *script_policy,
+                         uint8_t out[static 32]) {
+    if (get_cached_taproot_hash(wdi, script_policy, out)) {
+        return 0;
+    }
+
+    if (0 > hash_tapleaf(dispatcher_context, wdi, script_policy, out)) {
+        return -1;
+    }
+
+    cache_taproot_hash(wdi, script_policy, out);
     return 0;
 }
 
-// See taproot_tree_helper in BIP-0341
-int __attribute__((noinline)) compute_taptree_hash(dispatcher_context_t *dc,
-                                                   const wallet_derivation_info_t *wdi,
-                                                   const policy_node_tree_t *tree,
-                                                   uint8_t out[static 32]) {
-    if (tree->is_leaf)
-        return compute_tapleaf_hash(dc, wdi, resolve_node_ptr(&tree->script), out);
-    else
-        return compute_and_combine_taptree_child_hashes(dc, wdi, tree, out);
+// See taproot_tree_helper in BIP-0341. The tree is traversed iteratively, with an explicit stack
+// of the hashes of the subtrees, so that the stack usage does not depend on the depth of the tree.
+static int __attribute__((noinline)) compute_subtree_hash_with_stack(
+    dispatcher_context_t *dc,
+    const wallet_derivation_info_t *wdi,
+    const policy_node_tree_t *tree,
+    taptree_hash_stack_t *st) {
+    size_t path_len = 0;
+    const policy_node_tree_t *node = tree;
+
+    while (true) {
+        // descend to the leftmost leaf of the current subtree
+        while (!node->is_leaf) {
+            if (path_len >= MAX_TAPTREE_POLICY_DEPTH) {
+                // should never happen, as the depth is checked when parsing the policy
+                return WITH_ERROR(-1, "Taptree policy depth limit exceeded");
+            }
+            st->path[path_len] = node;
+            st->is_right_subtree[path_len] = false;
+            ++path_len;
+            node = resolve_ptr(&node->left_tree);
+        }
+
+        if (0 > hash_tapleaf(dc, wdi, resolve_node_ptr(&node->script), st->hash)) {
+            return -1;
+        }
+
+        // combine the hash with the ones of the left siblings, up to the first inner node whose
+        // right subtree is still to be hashed
+        while (path_len > 0 && st->is_right_subtree[path_len - 1]) {
+            crypto_tr_combine_taptree_hashes(st->left_hashes[path_len - 1], st->hash, st->hash);
+            --path_len;
+        }
+
+        if (path_len == 0) {
+            return 0;
+        }
+
+        memcpy(st->left_hashes[path_len - 1], st->hash, 32);
+        st->is_right_subtree[path_len - 1] = true;
+        node = resolve_ptr(&st->path[path_len - 1]->right_tree);
+    }
+}
+
+static int compute_subtree_hash(dispatcher_context_t *dc,
+                                const wallet_derivation_info_t *wdi,
+                                const policy_node_tree_t *tree,
+                                uint8_t out[static 32]) {
+    SCRATCH_MARK(mark);
+    SCRATCH_ALLOC(taptree_hash_stack_t, st);
+    if (st == NULL) {
+        return WITH_ERROR(-1, "Out of memory");  // should never happen
+    }
+
+    int ret = compute_subtree_hash_with_stack(dc, wdi, tree, st);
+    if (ret == 0) {
+        memcpy(out, st->hash, 32);
+    }
+
+    SCRATCH_RELEASE(mark);
+    return ret;
+}
+
+int compute_taptree_hash(dispatcher_context_t *dc,
+                         const wallet_derivation_info_t *wdi,
+                         const policy_node_tree_t *tree,
+                         uint8_t out[static 32]) {
+    // only the hash of the root is cached, as the hashes of the subtrees are not needed elsewhere
+    if (get_cached_taproot_hash(wdi, tree, out)) {
+        return 0;
+    }
+
+    if (0 > compute_subtree_hash(dc, wdi, tree, out)) {
+        return -1;
+    }
+
+    cache_taproot_hash(wdi, tree, out);
+    return 0;
 }
+#endif
 
 #pragma GCC diagnostic push
 // make sure that the compiler gives an error if any PolicyNodeType is missed
@@ -931,7 +1290,7 @@ int get_wallet_script(dispatcher_context_t *dispatcher_context,
         policy_node_with_key_t *pkh_policy = (policy_node_with_key_t *) policy;
         if (0 > get_derived_pubkey(dispatcher_context,
                                    wdi,
-                                   pkh_policy->key_placeholder,
+                                   r_policy_node_key_placeholder(&pkh_policy->key_placeholder),
                                    compressed_pubkey)) {
             return -1;
         }
@@ -950,7 +1309,7 @@ int get_wallet_script(dispatcher_context_t *dispatcher_context,
         policy_node_with_key_t *wpkh_policy = (policy_node_with_key_t *) policy;
         if (0 > get_derived_pubkey(dispatcher_context,
                                    wdi,
-                                   wpkh_policy->key_placeholder,
+                                   r_policy_node_key_placeholder(&wpkh_policy->key_placeholder),
                                    compressed_pubkey)) {
             return -1;
         }
@@ -1026,30 +1385,45 @@ int get_wallet_script(dispatcher_context_t *dispatcher_context,
     } else if (policy->type == TOKEN_TR) {
         policy_node_tr_t *tr_policy = (policy_node_tr_t *) policy;
 
+        out[0] = OP_1;
+        out[1] = 32;  // PUSH 32 bytes
+
+        // the cached value for the tr node is the x-only output key
+        if (get_cached_taproot_hash(wdi, policy, out + 2)) {
+            return 34;
+        }
+
         uint8_t compressed_pubkey[33];
 
         if (0 > get_derived_pubkey(dispatcher_context,
                                    wdi,
-                                   tr_policy->key_placeholder,
+                                   r_policy_node_key_placeholder(&tr_policy->key_placeholder),
                                    compressed_pubkey)) {
             return -1;
         }
 
-        out[0] = OP_1;
-        out[1] = 32;  // PUSH 32 bytes
-
         // uint8_t h[32];
         uint8_t *h = out + 2;  // hack: re-use the output array to save memory
 
         int h_length = 0;
-        if (tr_policy->tree != NULL) {
-            compute_taptree_hash(dispatcher_context, wdi, tr_policy->tree, h);
+        const policy_node_tree_t *tree = r_policy_node_tree(&tr_policy->tree);
+        if (tree != NULL) {
+#ifndef SIMPLE_POLICIES_ONLY
+            if (0 > compute_taptree_hash(dispatcher_context, wdi, tree, h)) {
+                return -1;
+            }
             h_length = 32;
+#else
+            // never parsed in this build
+            return -1;
+#endif
         }
 
         uint8_t parity;
         crypto_tr_tweak_pubkey(compressed_pubkey + 1, h, h_length, &parity, out + 2);
 
+        cache_taproot_hash(wdi, policy, out + 2);
+
         return 34;
     }
 
@@ -1057,11 +1431,14 @@ int get_wallet_script(dispatcher_context_t *dispatcher_context,
     return -1;
 }
 
-int get_wallet_internal_script_hash(dispatcher_context_t *dispatcher_context,
-                                    const policy_node_t *policy,
-                                    const wallet_derivation_info_t *wdi,
-                                    internal_script_type_e script_type,
-                                    cx_hash_t *hash_context) {
+// Produces an internal script by walking the policy; if script_template is not NULL, the script is
+// compiled into it instead, and hash_context must be NULL.
+static int process_internal_script(dispatcher_context_t *dispatcher_context,
+                                   const policy_node_t *policy,
+                                   const wallet_derivation_info_t *wdi,
+                                   internal_script_type_e script_type,
+                                   cx_hash_t *hash_context,
+                                   script_template_t *script_template) {
     const uint8_t *whitelist;
     size_t whitelist_len;
     switch (script_type) {
@@ -1090,7 +1467,10 @@ int get_wallet_internal_script_hash(dispatcher_context_t *dispatcher_context,
                                    .wdi = wdi,
                                    .is_taproot = (script_type == WRAPPED_SCRIPT_TYPE_TAPSCRIPT),
                                    .node_stack_eos = 0,
-                                   .hash_context = hash_context};
+                                   .hash_context = hash_context,
+                                   .script_template = script_template,
+                                   .script_template_run = -1};
+    crypto_hash_writer_init(&state.hash_writer, hash_context);
 
     state.nodes[0] =
         (policy_parser_node_state_t){.length = 0, .flags = 0, .step = 0, .policy_node = policy};
@@ -1115,6 +1495,7 @@ int get_wallet_internal_script_hash(dispatcher_context_t *dispatcher_context,
         }
 
         switch (node->policy_node->type) {
+#ifndef SIMPLE_POLICIES_ONLY
             case TOKEN_0:
                 ret = execute_processor(&state, process_generic_node, commands_0);
                 break;
@@ -1130,10 +1511,12 @@ int get_wallet_internal_script_hash(dispatcher_context_t *dispatcher_context,
             case TOKEN_PK:
                 ret = execute_processor(&state, process_generic_node, commands_pk);
                 break;
+#endif
             case TOKEN_PKH:
             case TOKEN_WPKH:
                 ret = execute_processor(&state, process_pkh_wpkh_node, NULL);
                 break;
+#ifndef SIMPLE_POLICIES_ONLY
             case TOKEN_OLDER:
                 ret = execute_processor(&state, process_generic_node, commands_older);
                 break;
@@ -1183,11 +1566,13 @@ int get_wallet_internal_script_hash(dispatcher_context_t *dispatcher_context,
             case TOKEN_THRESH:
                 ret = execute_processor(&state, process_thresh_node, NULL);
                 break;
+#endif
 
             case TOKEN_MULTI:
             case TOKEN_SORTEDMULTI:
                 ret = execute_processor(&state, process_multi_sortedmulti_node, NULL);
                 break;
+#ifndef SIMPLE_POLICIES_ONLY
             case TOKEN_MULTI_A:
             case TOKEN_SORTEDMULTI_A:
                 ret = execute_processor(&state, process_multi_a_sortedmulti_a_node, NULL);
@@ -1222,6 +1607,42 @@ int get_wallet_internal_script_hash(dispatcher_context_t *dispatcher_context,
             case TOKEN_U:
                 ret = execute_processor(&state, process_generic_node, commands_u);
                 break;
+#else
+            case TOKEN_0:
+            case TOKEN_1:
+            case TOKEN_PK_K:
+            case TOKEN_PK_H:
+            case TOKEN_PK:
+            case TOKEN_OLDER:
+            case TOKEN_AFTER:
+            case TOKEN_SHA256:
+            case TOKEN_HASH256:
+            case TOKEN_RIPEMD160:
+            case TOKEN_HASH160:
+            case TOKEN_ANDOR:
+            case TOKEN_AND_V:
+            case TOKEN_AND_B:
+            case TOKEN_AND_N:
+            case TOKEN_OR_B:
+            case TOKEN_OR_C:
+            case TOKEN_OR_D:
+            case TOKEN_OR_I:
+            case TOKEN_THRESH:
+            case TOKEN_MULTI_A:
+            case TOKEN_SORTEDMULTI_A:
+            case TOKEN_A:
+            case TOKEN_S:
+            case TOKEN_C:
+            case TOKEN_T:
+            case TOKEN_D:
+            case TOKEN_V:
+            case TOKEN_J:
+            case TOKEN_N:
+            case TOKEN_L:
+            case TOKEN_U:
+                PRINTF("Miniscript is not supported in this build: %d\n", node->policy_node->type);
+                return -1;
+#endif
             case TOKEN_TR:
             case TOKEN_SH:
             case TOKEN_WSH:
@@ -1239,9 +1660,132 @@ int get_wallet_internal_script_hash(dispatcher_context_t *dispatcher_context,
         return WITH_ERROR(ret, "Processor failed");
     }
 
+    if (hash_context != NULL) {
+        crypto_hash_writer_flush(&state.hash_writer);
+    }
     return ret;
 }
 
+// Returns the template of the internal script, compiling it if it is not in the cache of wdi;
+// returns NULL if there is no cache, or if the script can not be compiled.
+static const script_template_t *get_script_template(dispatcher_context_t *dispatcher_context,
+                                                    const policy_node_t *policy,
+                                                    const wallet_derivation_info_t *wdi,
+                                                    internal_script_type_e script_type) {
+    if (wdi->cache == NULL) {
+        return NULL;
+    }
+
+    derived_pubkeys_cache_t *cache = get_cache(wdi);
+    for (int i = 0; i < MAX_CACHED_SCRIPT_TEMPLATES; i++) {
+        const script_template_t *script_template = &cache->script_templates[i];
+        if (script_template->node == policy && script_template->script_type == script_type) {
+            return script_template->script_len >= 0 ? script_template : NULL;
+        }
+    }
+
+    script_template_t *script_template = &cache->script_templates[cache->next_script_template];
+    cache->next_script_template = (cache->next_script_template + 1) % MAX_CACHED_SCRIPT_TEMPLATES;
+
+    script_template->node = policy;
+    script_template->script_type = script_type;
+    script_template->code_len = 0;
+    int script_len = process_internal_script(dispatcher_context,
+                                             policy,
+                                             wdi,
+                                             script_type,
+                                             NULL,
+                                             script_template);
+    if (script_len < 0 || script_template->code_len > SCRIPT_TEMPLATE_SIZE) {
+        // templates too large to compile are remembered, while errors are reported again by the
+        // walk of the policy
+        script_template->node = script_len < 0 ? NULL : policy;
+        script_template->script_len = -1;
+        return NULL;
+    }
+    script_template->script_len = script_len;
+    return script_template;
+}
+
+// Produces the internal script from its template, only deriving the pubkeys
+static int run_script_template(dispatcher_context_t *dispatcher_context,
+                               const wallet_derivation_info_t *wdi,
+                               const script_template_t *script_template,
+                               cx_hash_t *hash_context) {
+    if (hash_context == NULL) {
+        return script_template->script_len;
+    }
+
+    policy_parser_state_t state = {
+        .dispatcher_context = dispatcher_context,
+        .wdi = wdi,
+        .is_taproot = (script_template->script_type == WRAPPED_SCRIPT_TYPE_TAPSCRIPT),
+        .node_stack_eos = 0,
+        .hash_context = hash_context,
+        .script_template = NULL,
+        .script_template_run = -1};
+    crypto_hash_writer_init(&state.hash_writer, hash_context);
+
+    state.nodes[0] =
+        (policy_parser_node_state_t){.length = 0, .flags = 0, .step = 0, .policy_node = NULL};
+
+    size_t pos = 0;
+    while (pos < script_template->code_len) {
+        uint8_t instruction = script_template->code[pos++];
+        if (instruction <= SCRIPT_TEMPLATE_MAX_RUN) {
+            // constant bytes, hashed as they are
+            update_output(&state, &script_template->code[pos], instruction);
+            pos += instruction;
+            continue;
+        }
+
+        const void *ptr;
+        memcpy(&ptr, &script_template->code[pos], sizeof(ptr));
+        pos += sizeof(ptr);
+
+        int ret;
+        switch (instruction) {
+            case SCRIPT_TEMPLATE_PUSH_PK:
+            case SCRIPT_TEMPLATE_PUSH_PKH:
+                ret = update_output_pubkey(&state,
+                                           (const policy_node_key_placeholder_t *) ptr,
+                                           instruction == SCRIPT_TEMPLATE_PUSH_PKH);
+                break;
+            case SCRIPT_TEMPLATE_PUSH_SORTED_PKS:
+                ret = update_output_sorted_pubkeys(&state, (const policy_node_multisig_t *) ptr);
+                break;
+            default:
+                PRINTF("Unexpected script template instruction: %d\n", instruction);
+                return -1;
+        }
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
+    crypto_hash_writer_flush(&state.hash_writer);
+    return state.nodes[0].length;
+}
+
+int get_wallet_internal_script_hash(dispatcher_context_t *dispatcher_context,
+                                    const policy_node_t *policy,
+                                    const wallet_derivation_info_t *wdi,
+                                    internal_script_type_e script_type,
+                                    cx_hash_t *hash_context) {
+    const script_template_t *script_template =
+        get_script_template(dispatcher_context, policy, wdi, script_type);
+    if (script_template != NULL) {
+        return run_script_template(dispatcher_context, wdi, script_template, hash_context);
+    }
+
+    return process_internal_script(dispatcher_context,
+                                   policy,
+                                   wdi,
+                                   script_type,
+                                   hash_context,
+                                   NULL);
+}
+
 #pragma GCC diagnostic pop
 
 int get_policy_address_type(const policy_node_t *policy) {
@@ -1265,19 +1809,48 @@ int get_policy_address_type(const policy_node_t *policy) {
     }
 }
 
-bool compute_wallet_hmac(const uint8_t wallet_id[static 32], uint8_t wallet_hmac[static 32]) {
-    uint8_t key[32];
+// SLIP-0021 key for the wallet_hmac, derived once per session of the app; only meaningful if
+// has_wallet_hmac_key is true.
+static bool has_wallet_hmac_key;
+static uint8_t wallet_hmac_key[32];
+
+void clear_wallet_hmac_key_cache() {
+    explicit_bzero(wallet_hmac_key, sizeof(wallet_hmac_key));
+    has_wallet_hmac_key = false;
+}
+
+// Computes the hmac of msg with the SLIP-0021 key of the wallet policies.
+static bool compute_wallet_hmac_with_cached_key(const uint8_t *msg,
+                                                size_t msg_len,
+                                                uint8_t wallet_hmac[static 32]) {
+    bool is_unlocked = os_global_pin_is_validated() == BOLOS_UX_OK;
+    if (!is_unlocked) {
+        // never keep the key across a lock of the device
+        clear_wallet_hmac_key_cache();
+    }
 
     bool result = false;
     BEGIN_TRY {
         TRY {
-            crypto_derive_symmetric_key(WALLET_SLIP0021_LABEL, WALLET_SLIP0021_LABEL_LEN, key);
+            if (!has_wallet_hmac_key) {
+                crypto_derive_symmetric_key(WALLET_SLIP0021_LABEL,
+                                            WALLET_SLIP0021_LABEL_LEN,
+                                            wallet_hmac_key);
+                has_wallet_hmac_key = is_unlocked;
+            }
 
-            cx_hmac_sha256(key, sizeof(key), wallet_id, 32, wallet_hmac, 32);
+            cx_hmac_sha256(wallet_hmac_key,
+                           sizeof(wallet_hmac_key),
+                           msg,
+                           msg_len,
+                           wallet_hmac,
+                           32);
             result = true;
         }
         FINALLY {
-            explicit_bzero(key, sizeof(key));
+            if (!has_wallet_hmac_key) {
+                explicit_bzero(wallet_hmac_key, sizeof(wallet_hmac_key));
+            }
         }
     }
     END_TRY;
@@ -1285,27 +1858,41 @@ bool compute_wallet_hmac(const uint8_t wallet_id[static 32], uint8_t wallet_hmac
     return result;
 }
 
+bool compute_wallet_hmac(const uint8_t wallet_id[static 32], uint8_t wallet_hmac[static 32]) {
+    return compute_wallet_hmac_with_cached_key(wallet_id, 32, wallet_hmac);
+}
+
+#ifdef HAVE_WALLET_SESSIONS
+// The message is longer than the 32-byte wallet ids, therefore its hmac can never be the
+// wallet_hmac of a wallet policy.
+#define COMPILED_POLICY_TAG     "CompiledPolicy"
+#define COMPILED_POLICY_TAG_LEN (sizeof(COMPILED_POLICY_TAG) - 1)  // without the terminating 0
+#define APPVERSION_LEN          (sizeof(APPVERSION) - 1)
+
+bool compute_compiled_policy_hmac(const uint8_t wallet_id[static 32],
+                                  const uint8_t policy_hash[static 32],
+                                  uint8_t hmac[static 32]) {
+    uint8_t msg[COMPILED_POLICY_TAG_LEN + APPVERSION_LEN + 32 + 32];
+    memcpy(msg, COMPILED_POLICY_TAG, COMPILED_POLICY_TAG_LEN);
+    memcpy(msg + COMPILED_POLICY_TAG_LEN, APPVERSION, APPVERSION_LEN);
+    memcpy(msg + COMPILED_POLICY_TAG_LEN + APPVERSION_LEN, wallet_id, 32);
+    memcpy(msg + COMPILED_POLICY_TAG_LEN + APPVERSION_LEN + 32, policy_hash, 32);
+    return compute_wallet_hmac_with_cached_key(msg, sizeof(msg), hmac);
+}
+#endif
+
 bool check_wallet_hmac(const uint8_t wallet_id[static 32], const uint8_t wallet_hmac[static 32]) {
-    uint8_t key[32];
     uint8_t correct_hmac[32];
 
-    bool result = false;
-    BEGIN_TRY {
-        TRY {
-            crypto_derive_symmetric_key(WALLET_SLIP0021_LABEL, WALLET_SLIP0021_LABEL_LEN, key);
+    if (!compute_wallet_hmac_with_cached_key(wallet_id, 32, correct_hmac)) {
+        return false;
+    }
 
-            cx_hmac_sha256(key, sizeof(key), wallet_id, 32, correct_hmac, 32);
+    // It is important to use a constant-time function to compare the hmac,
+    // to avoid timing-attack that could be exploited to extract it.
+    bool result = os_secure_memcmp((void *) wallet_hmac, (void *) correct_hmac, 32) == 0;
 
-            // It is important to use a constant-time function to compare the hmac,
-            // to avoid timing-attack that could be exploited to extract it.
-            result = os_secure_memcmp((void *) wallet_hmac, (void *) correct_hmac, 32) == 0;
-        }
-        FINALLY {
-            explicit_bzero(key, sizeof(key));
-            explicit_bzero(correct_hmac, sizeof(correct_hmac));
-        }
-    }
-    END_TRY;
+    explicit_bzero(correct_hmac, sizeof(correct_hmac));
 
     return result;
 }
@@ -1314,48 +1901,47 @@ bool check_wallet_hmac(const uint8_t wallet_id[static 32], const uint8_t wallet_
 // make sure that the compiler gives an error if any PolicyNodeType is missed
 #pragma GCC diagnostic error "-Wswitch-enum"
 
-static int get_key_placeholder_by_index_in_tree(const policy_node_tree_t *tree,
-                                                unsigned int i,
-                                                const policy_node_t **out_tapleaf_ptr,
-                                                policy_node_key_placeholder_t *out_placeholder) {
+// Called for each key placeholder of a policy, with the script of the tapleaf it is in, or NULL
+typedef void (*key_placeholder_visitor_t)(void *visitor_state,
+                                          const policy_node_key_placeholder_t *placeholder,
+                                          const policy_node_t *tapleaf_ptr);
+
+// Calls visit for each key placeholder of the policy, in order; tapleaf_ptr is the script of the
+// tapleaf the policy is in, or NULL. Returns the number of placeholders, or -1 on error.
+static int walk_key_placeholders(const policy_node_t *policy,
+                                 const policy_node_t *tapleaf_ptr,
+                                 key_placeholder_visitor_t visit,
+                                 void *visitor_state);
+
+static int walk_key_placeholders_in_tree(const policy_node_tree_t *tree,
+                                         key_placeholder_visitor_t visit,
+                                         void *visitor_state) {
     if (tree->is_leaf) {
-        int ret =
-            get_key_placeholder_by_index(resolve_node_ptr(&tree->script), i, NULL, out_placeholder);
-        if (ret >= 0 && out_tapleaf_ptr != NULL && i < (unsigned) ret) {
-            *out_tapleaf_ptr = resolve_ptr(&tree->script);
-        }
-        return ret;
+        return walk_key_placeholders(resolve_node_ptr(&tree->script),
+                                     resolve_node_ptr(&tree->script),
+                                     visit,
+                                     visitor_state);
     } else {
-        int ret1 = get_key_placeholder_by_index_in_tree(
+        int ret1 = walk_key_placeholders_in_tree(
             (policy_node_tree_t *) resolve_ptr(&tree->left_tree),
-            i,
-            out_tapleaf_ptr,
-            out_placeholder);
+            visit,
+            visitor_state);
         if (ret1 < 0) return -1;
 
-        bool found = i < (unsigned int) ret1;
-
-        int ret2 = get_key_placeholder_by_index_in_tree(
+        int ret2 = walk_key_placeholders_in_tree(
             (policy_node_tree_t *) resolve_ptr(&tree->right_tree),
-            found ? 0 : i - ret1,
-            found ? NULL : out_tapleaf_ptr,
-            found ? NULL : out_placeholder);
+            visit,
+            visitor_state);
         if (ret2 < 0) return -1;
 
         return ret1 + ret2;
     }
 }
 
-int get_key_placeholder_by_index(const policy_node_t *policy,
-                                 unsigned int i,
-                                 const policy_node_t **out_tapleaf_ptr,
-                                 policy_node_key_placeholder_t *out_placeholder) {
-    // make sure that out_placeholder is a valid pointer, if the output is not needed
-    policy_node_key_placeholder_t tmp;
-    if (out_placeholder == NULL) {
-        out_placeholder = &tmp;
-    }
-
+static int walk_key_placeholders(const policy_node_t *policy,
+                                 const policy_node_t *tapleaf_ptr,
+                                 key_placeholder_visitor_t visit,
+                                 void *visitor_state) {
     switch (policy->type) {
         // terminal nodes with absolutely no keys
         case TOKEN_0:
@@ -1374,26 +1960,19 @@ int get_key_placeholder_by_index(const policy_node_t *policy,
         case TOKEN_PK:
         case TOKEN_PKH:
         case TOKEN_WPKH: {
-            if (i == 0) {
-                memcpy(out_placeholder,
-                       ((policy_node_with_key_t *) policy)->key_placeholder,
-                       sizeof(policy_node_key_placeholder_t));
-            }
+            const policy_node_with_key_t *node = (const policy_node_with_key_t *) policy;
+            visit(visitor_state,
+                  r_policy_node_key_placeholder(&node->key_placeholder),
+                  tapleaf_ptr);
             return 1;
         }
         case TOKEN_TR: {
-            if (i == 0) {
-                memcpy(out_placeholder,
-                       ((policy_node_tr_t *) policy)->key_placeholder,
-                       sizeof(policy_node_key_placeholder_t));
-            }
-            if (((policy_node_tr_t *) policy)->tree != NULL) {
-                int ret_tree = get_key_placeholder_by_index_in_tree(
-                    ((policy_node_tr_t *) policy)->tree,
-                    i == 0 ? 0 : i - 1,
-                    i == 0 ? NULL : out_tapleaf_ptr,
-                    i == 0 ? NULL : out_placeholder);  // if i == 0, we already found it; so we
-                                                       // recur with out_placeholder set to NULL
+            const policy_node_tr_t *node = (const policy_node_tr_t *) policy;
+            visit(visitor_state, r_policy_node_key_placeholder(&node->key_placeholder), NULL);
+
+            const policy_node_tree_t *tree = r_policy_node_tree(&node->tree);
+            if (tree != NULL) {
+                int ret_tree = walk_key_placeholders_in_tree(tree, visit, visitor_state);
                 if (ret_tree < 0) {
                     return -1;
                 }
@@ -1409,13 +1988,12 @@ int get_key_placeholder_by_index(const policy_node_t *policy,
         case TOKEN_SORTEDMULTI:
         case TOKEN_SORTEDMULTI_A: {
             const policy_node_multisig_t *node = (const policy_node_multisig_t *) policy;
+            const policy_node_key_placeholder_t *placeholders =
+                r_policy_node_key_placeholder(&node->key_placeholders);
 
-            if (i < (unsigned int) node->n) {
-                memcpy(out_placeholder,
-                       &node->key_placeholders[i],
-                       sizeof(policy_node_key_placeholder_t));
+            for (int i = 0; i < node->n; i++) {
+                visit(visitor_state, &placeholders[i], tapleaf_ptr);
             }
-
             return node->n;
         }
 
@@ -1432,11 +2010,11 @@ int get_key_placeholder_by_index(const policy_node_t *policy,
         case TOKEN_N:
         case TOKEN_L:
         case TOKEN_U: {
-            return get_key_placeholder_by_index(
+            return walk_key_placeholders(
                 resolve_node_ptr(&((const policy_node_with_script_t *) policy)->script),
-                i,
-                out_tapleaf_ptr,
-                out_placeholder);
+                tapleaf_ptr,
+                visit,
+                visitor_state);
         }
 
         // nodes with exactly two child scripts
@@ -1448,63 +2026,43 @@ int get_key_placeholder_by_index(const policy_node_t *policy,
         case TOKEN_OR_D:
         case TOKEN_OR_I: {
             const policy_node_with_script2_t *node = (const policy_node_with_script2_t *) policy;
-            int ret1 = get_key_placeholder_by_index(resolve_node_ptr(&node->scripts[0]),
-                                                    i,
-                                                    out_tapleaf_ptr,
-                                                    out_placeholder);
-            if (ret1 < 0) return -1;
-
-            bool found = i < (unsigned int) ret1;
-            int ret2 = get_key_placeholder_by_index(resolve_node_ptr(&node->scripts[1]),
-                                                    found ? 0 : i - ret1,
-                                                    found ? NULL : out_tapleaf_ptr,
-                                                    found ? NULL : out_placeholder);
-            if (ret2 < 0) return -1;
-
-            return ret1 + ret2;
+            int ret = 0;
+            for (int script_idx = 0; script_idx < 2; script_idx++) {
+                const policy_node_t *child = resolve_node_ptr(&node->scripts[script_idx]);
+                int ret_partial = walk_key_placeholders(child, tapleaf_ptr, visit, visitor_state);
+                if (ret_partial < 0) return -1;
+                ret += ret_partial;
+            }
+            return ret;
         }
 
         // nodes with exactly three child scripts
         case TOKEN_ANDOR: {
             const policy_node_with_script3_t *node = (const policy_node_with_script3_t *) policy;
-            int ret1 = get_key_placeholder_by_index(resolve_node_ptr(&node->scripts[0]),
-                                                    i,
-                                                    out_tapleaf_ptr,
-                                                    out_placeholder);
-            if (ret1 < 0) return -1;
-
-            bool found = i < (unsigned int) ret1;
-            int ret2 = get_key_placeholder_by_index(resolve_node_ptr(&node->scripts[1]),
-                                                    found ? 0 : i - ret1,
-                                                    found ? NULL : out_tapleaf_ptr,
-                                                    found ? NULL : out_placeholder);
-            if (ret2 < 0) return -1;
-
-            found = i < (unsigned int) (ret1 + ret2);
-            int ret3 = get_key_placeholder_by_index(resolve_node_ptr(&node->scripts[2]),
-                                                    found ? 0 : i - ret1 - ret2,
-                                                    found ? NULL : out_tapleaf_ptr,
-                                                    found ? NULL : out_placeholder);
-            if (ret3 < 0) return -1;
-            return ret1 + ret2 + ret3;
+            int ret = 0;
+            for (int script_idx = 0; script_idx < 3; script_idx++) {
+                const policy_node_t *child = resolve_node_ptr(&node->scripts[script_idx]);
+                int ret_partial = walk_key_placeholders(child, tapleaf_ptr, visit, visitor_state);
+                if (ret_partial < 0) return -1;
+                ret += ret_partial;
+            }
+            return ret;
         }
 
         // nodes with multiple child scripts
         case TOKEN_THRESH: {
             const policy_node_thresh_t *node = (const policy_node_thresh_t *) policy;
-            bool found;
             int ret = 0;
-            policy_node_scriptlist_t *cur_child = node->scriptlist;
+            const policy_node_scriptlist_t *cur_child = r_policy_node_scriptlist(&node->scriptlist);
             for (int script_idx = 0; script_idx < node->n; script_idx++) {
-                found = i < (unsigned int) ret;
-                int ret_partial = get_key_placeholder_by_index(resolve_node_ptr(&cur_child->script),
-                                                               found ? 0 : i - ret,
-                                                               found ? NULL : out_tapleaf_ptr,
-                                                               found ? NULL : out_placeholder);
+                int ret_partial = walk_key_placeholders(resolve_node_ptr(&cur_child->script),
+                                                        tapleaf_ptr,
+                                                        visit,
+                                                        visitor_state);
                 if (ret_partial < 0) return -1;
 
                 ret += ret_partial;
-                cur_child = cur_child->next;
+                cur_child = r_policy_node_scriptlist(&cur_child->next);
             }
             return ret;
         }
@@ -1520,26 +2078,110 @@ int get_key_placeholder_by_index(const policy_node_t *policy,
     return -1;
 }
 
+typedef struct {
+    unsigned int i;       // index of the wanted placeholder
+    unsigned int n_seen;  // number of placeholders visited so far
+    const policy_node_t **out_tapleaf_ptr;
+    policy_node_key_placeholder_t *out_placeholder;
+} placeholder_by_index_state_t;
+
+static void placeholder_by_index_visitor(void *visitor_state,
+                                         const policy_node_key_placeholder_t *placeholder,
+                                         const policy_node_t *tapleaf_ptr) {
+    placeholder_by_index_state_t *state = (placeholder_by_index_state_t *) visitor_state;
+    if (state->n_seen++ != state->i) {
+        return;
+    }
+    if (state->out_placeholder != NULL) {
+        memcpy(state->out_placeholder, placeholder, sizeof(policy_node_key_placeholder_t));
+    }
+    if (state->out_tapleaf_ptr != NULL && tapleaf_ptr != NULL) {
+        *state->out_tapleaf_ptr = tapleaf_ptr;
+    }
+}
+
+int get_key_placeholder_by_index(const policy_node_t *policy,
+                                 unsigned int i,
+                                 const policy_node_t **out_tapleaf_ptr,
+                                 policy_node_key_placeholder_t *out_placeholder) {
+    placeholder_by_index_state_t state = {.i = i,
+                                          .n_seen = 0,
+                                          .out_tapleaf_ptr = out_tapleaf_ptr,
+                                          .out_placeholder = out_placeholder};
+    return walk_key_placeholders(policy, NULL, placeholder_by_index_visitor, &state);
+}
+
+static void placeholders_table_visitor(void *visitor_state,
+                                       const policy_node_key_placeholder_t *placeholder,
+                                       const policy_node_t *tapleaf_ptr) {
+    key_placeholders_table_t *table = (key_placeholders_table_t *) visitor_state;
+    if (table->n_placeholders < MAX_KEY_PLACEHOLDERS_TABLE_SIZE) {
+        table->entries[table->n_placeholders].placeholder = placeholder;
+        table->entries[table->n_placeholders].tapleaf_ptr = tapleaf_ptr;
+    }
+    ++table->n_placeholders;
+}
+
+int build_key_placeholders_table(const policy_node_t *policy, key_placeholders_table_t *table) {
+    table->policy = NULL;
+    table->n_placeholders = 0;
+    if (walk_key_placeholders(policy, NULL, placeholders_table_visitor, table) < 0) {
+        return -1;
+    }
+    table->policy = policy;
+    return (int) table->n_placeholders;
+}
+
+int get_key_placeholder_from_table(const key_placeholders_table_t *table,
+                                   unsigned int i,
+                                   const policy_node_t **out_tapleaf_ptr,
+                                   policy_node_key_placeholder_t *out_placeholder) {
+    if (table->policy == NULL) {
+        return -1;
+    }
+    if (i >= MAX_KEY_PLACEHOLDERS_TABLE_SIZE) {
+        // not in the table; rarely needed, as policies with so many placeholders are unusual
+        return get_key_placeholder_by_index(table->policy, i, out_tapleaf_ptr, out_placeholder);
+    }
+    if (i < table->n_placeholders) {
+        if (out_placeholder != NULL) {
+            memcpy(out_placeholder,
+                   table->entries[i].placeholder,
+                   sizeof(policy_node_key_placeholder_t));
+        }
+        if (out_tapleaf_ptr != NULL && table->entries[i].tapleaf_ptr != NULL) {
+            *out_tapleaf_ptr = table->entries[i].tapleaf_ptr;
+        }
+    }
+    return (int) table->n_placeholders;
+}
+
 // Utility function to extract the i-th xpub from the keys information vector
 static int get_xpub_from_merkle_tree(dispatcher_context_t *dispatcher_context,
                                      int wallet_version,
                                      const uint8_t keys_merkle_root[static 32],
                                      uint32_t n_keys,
+                                     const policy_key_info_string_t key_infos[],
                                      uint32_t index,
                                      char out[static MAX_SERIALIZED_PUBKEY_LENGTH + 1]) {
     char key_info_str[MAX_POLICY_KEY_INFO_LEN];
-    int key_info_len = call_get_merkle_leaf_element(dispatcher_context,
-                                                    keys_merkle_root,
-                                                    n_keys,
-                                                    index,
-                                                    (uint8_t *) key_info_str,
-                                                    sizeof(key_info_str));
-    if (key_info_len == -1) {
-        return WITH_ERROR(-1, "Failed to retrieve key info");
-    }
+    buffer_t key_info_buffer;
+    if (key_infos != NULL) {
+        key_info_buffer = buffer_create((void *) key_infos[index].str, key_infos[index].len);
+    } else {
+        int key_info_len = call_get_merkle_leaf_element(dispatcher_context,
+                                                        keys_merkle_root,
+                                                        n_keys,
+                                                        index,
+                                                        (uint8_t *) key_info_str,
+                                                        sizeof(key_info_str));
+        if (key_info_len == -1) {
+            return WITH_ERROR(-1, "Failed to retrieve key info");
+        }
 
-    // Make a sub-buffer for the pubkey info
-    buffer_t key_info_buffer = buffer_create(key_info_str, key_info_len);
+        // Make a sub-buffer for the pubkey info
+        key_info_buffer = buffer_create(key_info_str, key_info_len);
+    }
 
     policy_map_key_info_t key_info;
     if (parse_policy_map_key_info(&key_info_buffer, &key_info, wallet_version) == -1) {
@@ -1553,7 +2195,9 @@ int is_policy_sane(dispatcher_context_t *dispatcher_context,
                    const policy_node_t *policy,
                    int wallet_version,
                    const uint8_t keys_merkle_root[static 32],
-                   uint32_t n_keys) {
+                   uint32_t n_keys,
+                   const policy_key_info_string_t key_infos[]) {
+#ifndef SIMPLE_POLICIES_ONLY
     if (policy->type == TOKEN_WSH) {
         const policy_node_t *inner =
             resolve_node_ptr(&((const policy_node_with_script_t *) policy)->script);
@@ -1606,6 +2250,7 @@ int is_policy_sane(dispatcher_context_t *dispatcher_context,
             }
         }
     }
+#endif
 
     // check that all the xpubs are different
     for (unsigned int i = 0; i < n_keys - 1; i++) {  // no point in running this for the last key
@@ -1614,6 +2259,7 @@ int is_policy_sane(dispatcher_context_t *dispatcher_context,
                                           wallet_version,
                                           keys_merkle_root,
                                           n_keys,
+                                          key_infos,
                                           i,
                                           xpub_i)) {
             return -1;
@@ -1625,6 +2271,7 @@ int is_policy_sane(dispatcher_context_t *dispatcher_context,
                                               wallet_version,
                                               keys_merkle_root,
                                               n_keys,
+                                              key_infos,
                                               j,
                                               xpub_j)) {
                 return -1;
@@ -2,6 +2,7 @@
 
 #include "../../boilerplate/dispatcher.h"
 #include "../../common/wallet.h"
+#include "../../crypto.h"
 
 /**
  * Parses a serialized wallet policy, saving the wallet header, the policy map descriptor and the
@@ -15,7 +16,9 @@
  * @param wallet_header Pointer to policy_map_wallet_header_t that will receive the policy map
  * header
  * @param policy_map_descriptor_template Pointer to a buffer of MAX_DESCRIPTOR_TEMPLATE_LENGTH bytes
- * that will contain the descriptor template as a string
+ * that will contain the descriptor template as a string, or NULL if it is not needed; in that case,
+ * the descriptor template of a V2 wallet policy is streamed from the client while it is parsed, and
+ * only a window of DESCRIPTOR_TEMPLATE_WINDOW_SIZE bytes of it is kept in memory
  * @param policy_map_bytes Pointer to an array of bytes that will be used for the parsed abstract
  * syntax tree
  * @param policy_map_bytes_len Length of policy_map_bytes in bytes.
@@ -26,7 +29,7 @@ int read_and_parse_wallet_policy(
     dispatcher_context_t *dispatcher_context,
     buffer_t *buf,
     policy_map_wallet_header_t *wallet_header,
-    uint8_t policy_map_descriptor[static MAX_DESCRIPTOR_TEMPLATE_LENGTH],
+    uint8_t *policy_map_descriptor,
     uint8_t *policy_map_bytes,
     size_t policy_map_bytes_len);
 
@@ -37,6 +40,103 @@ typedef enum {
     WRAPPED_SCRIPT_TYPE_TAPSCRIPT
 } internal_script_type_e;
 
+// on Nano S, the builds without miniscript have room for a larger cache
+#if defined(TARGET_NANOS) && defined(SIMPLE_POLICIES_ONLY)
+#define MAX_CACHED_KEY_INFOS 2
+#elif defined(TARGET_NANOS)
+#define MAX_CACHED_KEY_INFOS 1
+#else
+#define MAX_CACHED_KEY_INFOS 4
+#endif
+
+// Cached derivations for one key information of a wallet policy
+typedef struct {
+    bool is_valid;
+    int16_t key_index;  // the index of the key information in the keys of the wallet policy
+    bool has_child[2];
+    uint32_t child_num[2];  // the derivation steps of the cached children
+    serialized_extended_pubkey_t ext_pubkey;  // the decoded xpub of the key information
+    expanded_extended_pubkey_t children[2];    // the /<child_num[i]> children of ext_pubkey
+} cached_key_info_t;
+
+#if defined(TARGET_NANOS) && defined(SIMPLE_POLICIES_ONLY)
+#define MAX_CACHED_DERIVED_PUBKEYS 4
+#elif defined(TARGET_NANOS)
+#define MAX_CACHED_DERIVED_PUBKEYS 2
+#else
+#define MAX_CACHED_DERIVED_PUBKEYS 8
+#endif
+
+// A pubkey derived for a key placeholder at the change and address index of the derived pubkeys
+// of the cache
+typedef struct {
+    int16_t key_index;     // the index of the key information in the keys of the wallet policy
+    uint32_t change_step;  // the /<change> derivation step of the key placeholder
+    uint8_t pubkey[33];    // the compressed pubkey
+} cached_derived_pubkey_t;
+
+#ifdef TARGET_NANOS
+#define MAX_CACHED_TAPROOT_HASHES 2
+#else
+#define MAX_CACHED_TAPROOT_HASHES 8
+#endif
+
+// A 32-byte value computed for a node of a taproot policy at a certain change and address index:
+// the x-only output key for a tr node, the taptree hash for the root of a taptree, or the tapleaf
+// hash for the script of a tapleaf.
+typedef struct {
+    const void *node;  // the node the value is computed for; NULL if the entry is not valid
+    bool change;
+    uint32_t address_index;
+    uint8_t hash[32];
+} cached_taproot_hash_t;
+
+#ifdef TARGET_NANOS
+#define MAX_CACHED_SCRIPT_TEMPLATES 1
+#define SCRIPT_TEMPLATE_SIZE        96
+#else
+#define MAX_CACHED_SCRIPT_TEMPLATES 4
+#define SCRIPT_TEMPLATE_SIZE        128
+#endif
+
+// An internal script of a wallet policy (the script of a sh or wsh, or a tapscript), compiled into
+// a flat template of runs of constant bytes and of slots for the pubkeys, that are the only part
+// of the script depending on the change and address index.
+typedef struct {
+    const void *node;     // the root of the compiled script; NULL if the entry is not valid
+    uint8_t script_type;  // the internal_script_type_e the script is compiled for
+    int32_t script_len;   // the length of the script; -1 if the script could not be compiled
+    uint16_t code_len;    // the bytes used in code
+    uint8_t code[SCRIPT_TEMPLATE_SIZE];
+} script_template_t;
+
+/**
+ * A small cache of the decoded xpubs of the key informations of a wallet policy, and of their
+ * /<change> children. It avoids fetching and decoding the same key information, and repeating the
+ * same BIP-32 derivation step, every time a pubkey is derived for a different address index.
+ * The pubkeys derived for the current address are kept as well, as the same key is often used in
+ * several leaves of a taptree.
+ * It also keeps the last taproot output keys, taptree hashes and tapleaf hashes, as inputs and
+ * outputs at the same address are common when signing, and the templates of the internal scripts
+ * of the policy, so that each script is only produced once by walking the policy.
+ * It must be zeroed before use, and it only contains public data.
+ */
+typedef struct {
+    uint8_t keys_merkle_root[32];  // the Merkle root of the keys of the cached key informations
+    uint8_t next_slot;             // the entry to replace when the cache is full
+    cached_key_info_t entries[MAX_CACHED_KEY_INFOS];
+    // the pubkeys derived for a single change and address index, shared by all the leaves of a
+    // taptree and by the internal key; they are dropped when a different address is derived
+    bool has_derived_address;
+    bool derived_change;
+    size_t derived_address_index;
+    uint8_t n_derived_pubkeys;
+    cached_derived_pubkey_t derived_pubkeys[MAX_CACHED_DERIVED_PUBKEYS];
+    cached_taproot_hash_t taproot_hashes[MAX_CACHED_TAPROOT_HASHES];  // most recently used first
+    script_template_t script_templates[MAX_CACHED_SCRIPT_TEMPLATES];
+    uint8_t next_script_template;  // the script template to replace when all are used
+} derived_pubkeys_cache_t;
+
 // Bundles together some parameters relative to a call to
 // get_wallet_script or get_wallet_internal_script_hash
 typedef struct {
@@ -47,8 +147,22 @@ typedef struct {
     uint32_t n_keys;        // The number of key information placeholders in the policy
     size_t address_index;   // The address index to use in the derivation
     bool change;            // whether a change address or a receive address is derived
+    derived_pubkeys_cache_t *cache;  // If not NULL, the cache used when deriving pubkeys
 } wallet_derivation_info_t;
 
+#ifndef SIMPLE_POLICIES_ONLY
+/**
+ * The state of the post-order traversal of a taptree by compute_taptree_hash: the inner nodes on
+ * the path from the root to the current subtree and, for those whose left subtree was already
+ * hashed, the hash of their left subtree. It is allocated in the scratch arena, if enabled.
+ */
+typedef struct {
+    const policy_node_tree_t *path[MAX_TAPTREE_POLICY_DEPTH];
+    bool is_right_subtree[MAX_TAPTREE_POLICY_DEPTH];
+    uint8_t left_hashes[MAX_TAPTREE_POLICY_DEPTH][32];
+    uint8_t hash[32];
+} taptree_hash_stack_t;
+
 /**
  * Computes the hash of a taptree, to be used as tweak for the internal key per BIP-0341;
  * The returned hash is the second value in the tuple returned by taproot_tree_helper in
@@ -70,6 +184,26 @@ int compute_taptree_hash(dispatcher_context_t *dispatcher_context,
                          const policy_node_tree_t *tree,
                          uint8_t out[static 32]);
 
+/**
+ * Computes the BIP-0341 tapleaf hash of a tapscript, assuming leaf_version 0xC0.
+ *
+ * @param[in] dispatcher_context
+ *   Pointer to the dispatcher context
+ * @param[in] wdi
+ *   Pointer to a wallet_derivation_info_t structure containing multiple other parameters
+ * @param[in] script_policy
+ *   Pointer to the root node of the tapscript
+ * @param[out] out
+ *   A buffer of 32 bytes to receive the output
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int compute_tapleaf_hash(dispatcher_context_t *dispatcher_context,
+                         const wallet_derivation_info_t *wdi,
+                         const policy_node_t *script_policy,
+                         uint8_t out[static 32]);
+#endif
+
 /**
  * Computes the script corresponding to a wallet policy, for a certain change and address index.
  *
@@ -102,7 +236,8 @@ int get_wallet_script(dispatcher_context_t *dispatcher_context,
  *   Pointer to a wallet_derivation_info_t structure containing multiple other parameters
  * @param[out] hash_context
  *   A pointer to an already initialized hash context that will be updated with the bytes from the
- * produced script. If NULL, it is ignored.
+ * produced script. If NULL, it is ignored; as the length of the script does not depend on the
+ * pubkeys, they are not derived in that case.
  *
  * @return the length of the script on success; a negative number in case of error.
  *
@@ -148,6 +283,31 @@ bool compute_wallet_hmac(const uint8_t wallet_id[static 32], uint8_t wallet_hmac
  */
 bool check_wallet_hmac(const uint8_t wallet_id[static 32], const uint8_t wallet_hmac[static 32]);
 
+#ifdef HAVE_WALLET_SESSIONS
+/**
+ * Computes the hmac authenticating a compiled policy, with the same SLIP-0021 key as the
+ * wallet_hmac. The hmac commits to the version of the app, as the layout of the compiled policy
+ * depends on it.
+ *
+ * @param[in] wallet_id
+ *   Pointer to the a 32-bytes array containing the 32-byte wallet policy id.
+ * @param[in] policy_hash
+ *   Pointer to the a 32-bytes array containing the sha256 hash of the compiled policy.
+ * @param[out] hmac
+ *   Pointer to the a 32-bytes array that will contain the hmac.
+ * @return true on success, false otherwise.
+ */
+bool compute_compiled_policy_hmac(const uint8_t wallet_id[static 32],
+                                  const uint8_t policy_hash[static 32],
+                                  uint8_t hmac[static 32]);
+#endif
+
+/**
+ * Clears the SLIP-0021 key of the wallet_hmac, if cached. The key is kept after the first use
+ * while the device is unlocked, and is cleared automatically if the device is locked.
+ */
+void clear_wallet_hmac_key_cache();
+
 /**
  * Copies the i-th placeholder (indexing from 0) of the given policy into `out_placeholder` (if not
  * null).
@@ -168,6 +328,55 @@ int get_key_placeholder_by_index(const policy_node_t *policy,
                                  const policy_node_t **out_tapleaf_ptr,
                                  policy_node_key_placeholder_t *out_placeholder);
 
+#ifdef TARGET_NANOS
+#define MAX_KEY_PLACEHOLDERS_TABLE_SIZE 4
+#else
+#define MAX_KEY_PLACEHOLDERS_TABLE_SIZE 16
+#endif
+
+/**
+ * The key placeholders of a wallet policy, in order, flattened with a single walk of the policy so
+ * that each of them is found in constant time. Only the first MAX_KEY_PLACEHOLDERS_TABLE_SIZE
+ * placeholders are kept; the following ones are searched in the policy.
+ * The entries point inside the policy, which must not be moved while the table is used.
+ */
+typedef struct {
+    const policy_node_t *policy;  // NULL if the table was not built
+    unsigned int n_placeholders;  // the number of placeholders in the policy
+    struct {
+        const policy_node_key_placeholder_t *placeholder;
+        const policy_node_t *tapleaf_ptr;  // the tapleaf's script, or NULL if not in a tapleaf
+    } entries[MAX_KEY_PLACEHOLDERS_TABLE_SIZE];
+} key_placeholders_table_t;
+
+/**
+ * Builds the table of the key placeholders of the given policy.
+ *
+ * @param[in] policy
+ *   Pointer to the root node of the policy
+ * @param[out] table
+ *   Pointer to the table to fill.
+ * @return the number of placeholders in the policy on success; -1 in case of error.
+ */
+int build_key_placeholders_table(const policy_node_t *policy, key_placeholders_table_t *table);
+
+/**
+ * Equivalent to get_key_placeholder_by_index for the policy of the table, in constant time for the
+ * placeholders kept in the table.
+ *
+ * @return the number of placeholders in the policy on success; -1 in case of error.
+ */
+int get_key_placeholder_from_table(const key_placeholders_table_t *table,
+                                   unsigned int i,
+                                   const policy_node_t **out_tapleaf_ptr,
+                                   policy_node_key_placeholder_t *out_placeholder);
+
+// The key information string of a key of a wallet policy, as received from the client.
+typedef struct {
+    size_t len;
+    char str[MAX_POLICY_KEY_INFO_LEN + 1];  // null-terminated
+} policy_key_info_string_t;
+
 /**
  * Checks if a wallet policy is sane, verifying that pubkeys are never repeated and (if miniscript)
  * that the miniscript is "sane".
@@ -181,10 +390,14 @@ int get_key_placeholder_by_index(const policy_node_t *policy,
  *   The root of the Merkle tree of the vector of keys information in the wallet policy
  * @param[in] n_keys
  *   The number of keys in the vector of keys
+ * @param[in] key_infos
+ *   If not NULL, the n_keys key information strings, already retrieved from the Merkle tree;
+ *   otherwise, they are requested to the client
  * @return 0 on success; -1 in case of error.
  */
 int is_policy_sane(dispatcher_context_t *dispatcher_context,
                    const policy_node_t *policy,
                    int wallet_version,
                    const uint8_t keys_merkle_root[static 32],
-                   uint32_t n_keys);
\ No newline at end of file
+                   uint32_t n_keys,
+                   const policy_key_info_string_t key_infos[]);
\ No newline at end of file
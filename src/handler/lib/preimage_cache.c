@@ -0,0 +1,47 @@
+#include <string.h>
+
+#include "os.h"
+
+#include "preimage_cache.h"
+
+#ifdef HAVE_PREIMAGE_CACHE
+
+preimage_cache_t G_preimage_cache;
+
+void preimage_cache_reset(void) {
+    explicit_bzero(&G_preimage_cache, sizeof(G_preimage_cache));
+}
+
+int preimage_cache_get(const uint8_t hash[static 32], uint8_t *out, size_t out_len) {
+    for (size_t i = 0; i < G_preimage_cache.n_entries; i++) {
+        const preimage_cache_entry_t *entry = &G_preimage_cache.entries[i];
+        if (memcmp(entry->hash, hash, 32) == 0) {
+            if (entry->len > out_len) {
+                return -1;
+            }
+            memcpy(out, entry->data, entry->len);
+            return entry->len;
+        }
+    }
+    return -1;
+}
+
+void preimage_cache_add(const uint8_t hash[static 32], const uint8_t *data, size_t len) {
+    if (len > PREIMAGE_CACHE_MAX_LEN) {
+        return;
+    }
+
+    preimage_cache_entry_t *entry;
+    if (G_preimage_cache.n_entries < PREIMAGE_CACHE_SIZE) {
+        entry = &G_preimage_cache.entries[G_preimage_cache.n_entries++];
+    } else {
+        entry = &G_preimage_cache.entries[G_preimage_cache.next];
+        G_preimage_cache.next = (G_preimage_cache.next + 1) % PREIMAGE_CACHE_SIZE;
+    }
+
+    memcpy(entry->hash, hash, 32);
+    memcpy(entry->data, data, len);
+    entry->len = (uint8_t) len;
+}
+
+#endif
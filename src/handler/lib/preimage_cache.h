@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HAVE_PREIMAGE_CACHE
+
+// Number of preimages kept in the cache; when it is full, the oldest one is replaced.
+#define PREIMAGE_CACHE_SIZE 8
+
+// Maximum length of the preimages kept in the cache.
+#define PREIMAGE_CACHE_MAX_LEN 64
+
+/**
+ * A small content-addressed cache of the Merkle leaf elements already received and verified by
+ * call_get_merkle_preimage while processing the current command, so that the elements requested
+ * repeatedly (like the keys of the merkleized maps of the PSBT) are only fetched once.
+ * As the entries are identified by the hash of the leaves, a hit is as good as a verified response
+ * from the client.
+ */
+typedef struct {
+    uint8_t hash[32];  // sha256 of the Merkle leaf, that is, of 0x00 followed by the element
+    uint8_t len;       // length of the element
+    uint8_t data[PREIMAGE_CACHE_MAX_LEN];
+} preimage_cache_entry_t;
+
+typedef struct {
+    preimage_cache_entry_t entries[PREIMAGE_CACHE_SIZE];
+    uint8_t n_entries;
+    uint8_t next;  // index of the entry to replace when the cache is full
+} preimage_cache_t;
+
+extern preimage_cache_t G_preimage_cache;
+
+/**
+ * Empties the cache; it is called before processing each command.
+ */
+void preimage_cache_reset(void);
+
+/**
+ * Looks up the element of the Merkle leaf with the given hash.
+ *
+ * @param[in] hash
+ *   The hash of the Merkle leaf.
+ * @param[out] out
+ *   Pointer to the buffer receiving the element.
+ * @param[in] out_len
+ *   The length of the out buffer.
+ *
+ * @return the length of the element if found, or -1 if it is not in the cache or does not fit in
+ * the output buffer.
+ */
+int preimage_cache_get(const uint8_t hash[static 32], uint8_t *out, size_t out_len);
+
+/**
+ * Adds the element of a verified Merkle leaf to the cache, if it is not longer than
+ * PREIMAGE_CACHE_MAX_LEN; otherwise, it does nothing.
+ *
+ * @param[in] hash
+ *   The hash of the Merkle leaf.
+ * @param[in] data
+ *   The element, whose leaf hash was already verified to be `hash`.
+ * @param[in] len
+ *   The length of the element.
+ */
+void preimage_cache_add(const uint8_t hash[static 32], const uint8_t *data, size_t len);
+
+#endif
@@ -0,0 +1,124 @@
+#include <string.h>
+
+#include "../../boilerplate/sw.h"
+#include "preimage_reader.h"
+
+#include "../client_commands.h"
+
+int preimage_reader_init(preimage_reader_t *reader,
+                         dispatcher_context_t *dispatcher_context,
+                         const uint8_t hash[static 32]) {
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    reader->dispatcher_context = dispatcher_context;
+
+    uint8_t cmd = CCMD_GET_PREIMAGE;
+    dispatcher_context->add_to_response(&cmd, 1);
+    uint8_t zero = 0;
+    dispatcher_context->add_to_response(&zero, 1);
+    dispatcher_context->add_to_response(hash, 32);
+    dispatcher_context->finalize_response(SW_INTERRUPTED_EXECUTION);
+
+    if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
+        return -1;
+    }
+
+    uint64_t preimage_len_u64;
+    uint8_t partial_data_len;
+    const uint8_t *data_ptr;
+    if (!buffer_read_varint(&dispatcher_context->read_buffer, &preimage_len_u64) ||
+        !buffer_read_u8(&dispatcher_context->read_buffer, &partial_data_len) ||
+        !buffer_borrow_bytes(&dispatcher_context->read_buffer, partial_data_len, &data_ptr)) {
+        return -2;
+    }
+
+    if (preimage_len_u64 > INT32_MAX || partial_data_len > preimage_len_u64) {
+        return -3;
+    }
+
+    cx_sha256_init(&reader->hash_context);
+    crypto_hash_update(&reader->hash_context.header, data_ptr, partial_data_len);
+
+    reader->chunk = buffer_create((uint8_t *) data_ptr, partial_data_len);
+    reader->bytes_remaining = (size_t) preimage_len_u64 - partial_data_len;
+    return (int) preimage_len_u64;
+}
+
+// Requests the next bytes of the pre-image to the host. Returns 0 on success, a negative number on
+// error.
+static int preimage_reader_get_more_elements(preimage_reader_t *reader) {
+    dispatcher_context_t *dispatcher_context = reader->dispatcher_context;
+
+    uint8_t get_more_elements_req[] = {CCMD_GET_MORE_ELEMENTS};
+    SET_RESPONSE(dispatcher_context,
+                 get_more_elements_req,
+                 sizeof(get_more_elements_req),
+                 SW_INTERRUPTED_EXECUTION);
+    if (dispatcher_context->process_interruption(dispatcher_context) < 0) {
+        return -1;
+    }
+
+    // Parse response to CCMD_GET_MORE_ELEMENTS
+    uint8_t n_bytes, elements_len;
+    if (!buffer_read_u8(&dispatcher_context->read_buffer, &n_bytes) ||
+        !buffer_read_u8(&dispatcher_context->read_buffer, &elements_len) ||
+        !buffer_can_read(&dispatcher_context->read_buffer, (size_t) n_bytes * elements_len)) {
+        return -2;
+    }
+
+    if (elements_len != 1) {
+        PRINTF("Elements should be single bytes\n");
+        return -3;
+    }
+
+    if (n_bytes == 0 || n_bytes > reader->bytes_remaining) {
+        PRINTF("Received an unexpected number of bytes.\n");
+        return -4;
+    }
+
+    // the bytes are used in place, in the read buffer
+    const uint8_t *data_ptr;
+    buffer_borrow_bytes(&dispatcher_context->read_buffer, n_bytes, &data_ptr);
+
+    crypto_hash_update(&reader->hash_context.header, data_ptr, n_bytes);
+
+    reader->chunk = buffer_create((uint8_t *) data_ptr, n_bytes);
+    reader->bytes_remaining -= n_bytes;
+    return 0;
+}
+
+int preimage_reader_read(preimage_reader_t *reader, uint8_t *out, size_t out_len) {
+    while (out_len > 0) {
+        if (!buffer_can_read(&reader->chunk, 1)) {
+            if (reader->bytes_remaining == 0) {
+                PRINTF("Pre-image too short.\n");
+                return -1;
+            }
+            if (0 > preimage_reader_get_more_elements(reader)) {
+                return -2;
+            }
+        }
+
+        size_t n = MIN(out_len, reader->chunk.size - reader->chunk.offset);
+        buffer_read_bytes(&reader->chunk, out, n);
+        out += n;
+        out_len -= n;
+    }
+    return 0;
+}
+
+int preimage_reader_finish(preimage_reader_t *reader, const uint8_t hash[static 32]) {
+    if (buffer_can_read(&reader->chunk, 1) || reader->bytes_remaining > 0) {
+        PRINTF("Pre-image not read entirely.\n");
+        return -1;
+    }
+
+    uint8_t computed_hash[32];
+    crypto_hash_digest(&reader->hash_context.header, computed_hash, 32);
+
+    if (memcmp(computed_hash, hash, 32) != 0) {
+        PRINTF("Hash mismatch.\n");
+        return -2;
+    }
+    return 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "../../boilerplate/dispatcher.h"
+#include "../../crypto.h"
+
+/**
+ * The state of a pre-image that is read incrementally from the host, like with call_get_preimage,
+ * but without keeping it all in memory. The bytes received from the host are used in place in the
+ * read buffer of the dispatcher; therefore, no other interruption can be processed until the
+ * reader is finished.
+ */
+typedef struct {
+    dispatcher_context_t *dispatcher_context;
+    cx_sha256_t hash_context;  // the hash of the bytes received so far
+    buffer_t chunk;            // the bytes of the last response from the host that were not read
+    size_t bytes_remaining;    // the bytes that were not received from the host yet
+} preimage_reader_t;
+
+/**
+ * Given a sha256 hash, requests the corresponding pre-image to the host, and initializes the reader
+ * with the first part of it.
+ *
+ * Returns a negative number on error, or the preimage length on success.
+ */
+int preimage_reader_init(preimage_reader_t *reader,
+                         dispatcher_context_t *dispatcher_context,
+                         const uint8_t hash[static 32]);
+
+/**
+ * Reads the next out_len bytes of the pre-image, requesting more bytes to the host if needed.
+ *
+ * Returns 0 on success, a negative number on error, including if the pre-image is shorter.
+ */
+int preimage_reader_read(preimage_reader_t *reader, uint8_t *out, size_t out_len);
+
+/**
+ * Validates that all the pre-image was read, and that its SHA256 does indeed match the expected
+ * hash. The data that was read must not be trusted before this function succeeds.
+ *
+ * Returns 0 on success, a negative number on error.
+ */
+int preimage_reader_finish(preimage_reader_t *reader, const uint8_t hash[static 32]);
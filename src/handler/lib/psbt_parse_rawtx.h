@@ -4,21 +4,36 @@
 #include "../../common/merkle.h"
 #include "../../constants.h"
 
+// Maximum number of outputs whose value and scriptPubKey can be extracted in a single parsing
+#ifdef TARGET_NANOS
+#define MAX_PARSED_VOUTS 2
+#else
+#define MAX_PARSED_VOUTS 8
+#endif
+
+typedef struct {
+    uint64_t value;                 // will contain the value of the requested output
+    unsigned int scriptpubkey_len;  // will contain the len of the scriptPubKey
+    uint8_t scriptpubkey[MAX_PREVOUT_SCRIPTPUBKEY_LEN];  // will contain the scriptPubKey
+} txid_parser_vout_t;
+
 typedef struct {
-    uint64_t vout_value;                 // will contain the value of the requested output
-    unsigned int vout_scriptpubkey_len;  // will contain the len of the scriptPubKey
-    uint8_t vout_scriptpubkey[MAX_PREVOUT_SCRIPTPUBKEY_LEN];  // will contain the scriptPubKey
-    uint8_t txid[32];                                         // will contain the computed txid
+    unsigned int n_vouts;                     // number of requested outputs
+    uint32_t vout_indexes[MAX_PARSED_VOUTS];  // indexes of the requested outputs; must be distinct
+    txid_parser_vout_t vouts[MAX_PARSED_VOUTS];  // will contain the requested outputs, in order
+    uint8_t txid[32];                            // will contain the computed txid
 } txid_parser_outputs_t;
 
 /**
  * Given a commitment to a merkleized map and a key, this flow parses it as a serialized bitcoin
- * transaction, computes the transaction id and optionally keeps track of the vout amunt and
- * scriptPubkey of one of the outputs.
+ * transaction, computes the transaction id and keeps track of the vout amount and scriptPubkey of
+ * the outputs whose indexes are in outputs->vout_indexes. The caller must set outputs->n_vouts and
+ * outputs->vout_indexes; n_vouts can be 0 if only the txid is needed.
+ *
+ * Returns a negative number on failure, including if any of the requested outputs does not exist.
  */
 int call_psbt_parse_rawtx(dispatcher_context_t *dispatcher_context,
                           const merkleized_map_commitment_t *map,
                           const uint8_t *key,
                           int key_len,
-                          int output_index,
                           txid_parser_outputs_t *outputs);
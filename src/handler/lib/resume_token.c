@@ -0,0 +1,44 @@
+#include <string.h>
+
+#include "os.h"
+#include "cx.h"
+
+#include "resume_token.h"
+
+#define RESUME_TOKEN_TAG     "ResumeToken"
+#define RESUME_TOKEN_TAG_LEN (sizeof(RESUME_TOKEN_TAG) - 1)  // sizeof counts the terminating 0
+
+static bool has_resume_token_key = false;
+static uint8_t resume_token_key[32];
+
+void resume_token_compute(const uint8_t session_hash[static 32],
+                          uint8_t token[static RESUME_TOKEN_LEN]) {
+    if (!has_resume_token_key) {
+        cx_rng_no_throw(resume_token_key, sizeof(resume_token_key));
+        has_resume_token_key = true;
+    }
+
+    uint8_t msg[RESUME_TOKEN_TAG_LEN + 32];
+    memcpy(msg, RESUME_TOKEN_TAG, RESUME_TOKEN_TAG_LEN);
+    memcpy(msg + RESUME_TOKEN_TAG_LEN, session_hash, 32);
+
+    uint8_t hmac[32];
+    cx_hmac_sha256(resume_token_key, sizeof(resume_token_key), msg, sizeof(msg), hmac, 32);
+    memcpy(token, hmac, RESUME_TOKEN_LEN);
+}
+
+bool resume_token_check(const uint8_t session_hash[static 32],
+                        const uint8_t token[static RESUME_TOKEN_LEN]) {
+    if (!has_resume_token_key) {
+        return false;  // no token was issued yet
+    }
+
+    uint8_t expected_token[RESUME_TOKEN_LEN];
+    resume_token_compute(session_hash, expected_token);
+    return os_secure_memcmp((void *) expected_token, (void *) token, RESUME_TOKEN_LEN) == 0;
+}
+
+void resume_token_clear_key(void) {
+    explicit_bzero(resume_token_key, sizeof(resume_token_key));
+    has_resume_token_key = false;
+}
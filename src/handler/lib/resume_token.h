@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Length of the tokens that allow to resume an interrupted SIGN_PSBT
+#define RESUME_TOKEN_LEN 16
+
+/**
+ * Computes the token of a SIGN_PSBT session: the (truncated) hmac of the hash of its request, with a
+ * random key that is generated at the first use, and kept in memory until the app exits. Therefore,
+ * the tokens are only valid while the app is running.
+ *
+ * @param[in] session_hash
+ *   The hash of the request of the session.
+ * @param[out] token
+ *   Receives the token of the session.
+ */
+void resume_token_compute(const uint8_t session_hash[static 32],
+                          uint8_t token[static RESUME_TOKEN_LEN]);
+
+/**
+ * Checks, in constant time, if a token was issued for the session with the given request hash.
+ *
+ * @return true if the token is valid, false otherwise.
+ */
+bool resume_token_check(const uint8_t session_hash[static 32],
+                        const uint8_t token[static RESUME_TOKEN_LEN]);
+
+/**
+ * Wipes the key of the tokens, which invalidates all the tokens issued so far.
+ */
+void resume_token_clear_key(void);
@@ -0,0 +1,43 @@
+#include <string.h>
+
+#include "os.h"
+
+#include "scratch_arena.h"
+
+#include "debug-helpers/debug.h"
+
+#ifdef HAVE_SCRATCH_ARENA
+
+scratch_arena_t G_scratch_arena;
+
+void scratch_arena_reset(void) {
+    explicit_bzero(&G_scratch_arena, sizeof(G_scratch_arena));
+}
+
+scratch_arena_mark_t scratch_arena_mark(void) {
+    return G_scratch_arena.used;
+}
+
+void *scratch_arena_alloc(size_t size) {
+    size_t aligned_size = SCRATCH_ARENA_ALIGNED_SIZE(size);
+    if (aligned_size < size || aligned_size > SCRATCH_ARENA_SIZE - G_scratch_arena.used) {
+        PRINTF("Scratch arena exhausted\n");
+        return NULL;
+    }
+
+    // the memory after G_scratch_arena.used is always zero, as released memory is wiped
+    uint8_t *buffer = &G_scratch_arena.data[G_scratch_arena.used];
+    G_scratch_arena.used += aligned_size;
+    return buffer;
+}
+
+void scratch_arena_release(scratch_arena_mark_t mark) {
+    if (mark >= G_scratch_arena.used) {
+        return;
+    }
+
+    explicit_bzero(&G_scratch_arena.data[mark], G_scratch_arena.used - mark);
+    G_scratch_arena.used = mark;
+}
+
+#endif
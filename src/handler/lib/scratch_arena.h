@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_SCRATCH_ARENA
+
+// Size of the scratch arena; it must fit the largest set of buffers that are allocated in it at
+// the same time.
+#define SCRATCH_ARENA_SIZE 5120
+
+// Alignment of the buffers allocated in the scratch arena.
+#define SCRATCH_ARENA_ALIGNMENT 8
+
+// Number of bytes used in the scratch arena by a buffer of the given size.
+#define SCRATCH_ARENA_ALIGNED_SIZE(size) \
+    (((size) + SCRATCH_ARENA_ALIGNMENT - 1) & ~((size_t) SCRATCH_ARENA_ALIGNMENT - 1))
+
+/**
+ * A static bump allocator for the large buffers used while processing a command, that would
+ * otherwise be local variables taking a substantial part of the stack.
+ * Buffers are allocated in a stack-like fashion: a scope takes a mark with scratch_arena_mark,
+ * and releases all the buffers allocated after it with scratch_arena_release. Released memory is
+ * always wiped, therefore the arena can hold secrets.
+ */
+typedef struct {
+    size_t used;  // number of bytes currently allocated
+    uint8_t data[SCRATCH_ARENA_SIZE] __attribute__((aligned(SCRATCH_ARENA_ALIGNMENT)));
+} scratch_arena_t;
+
+// A position in the scratch arena, as returned by scratch_arena_mark.
+typedef size_t scratch_arena_mark_t;
+
+extern scratch_arena_t G_scratch_arena;
+
+/**
+ * Wipes the arena and releases all its buffers; it is called before processing each command.
+ */
+void scratch_arena_reset(void);
+
+/**
+ * Returns the current position in the arena, to be passed to scratch_arena_release in order to
+ * release all the buffers allocated from now on.
+ */
+scratch_arena_mark_t scratch_arena_mark(void);
+
+/**
+ * Allocates a zeroed buffer in the arena.
+ *
+ * @param[in] size
+ *   The size of the buffer.
+ *
+ * @return a pointer to the buffer, aligned to SCRATCH_ARENA_ALIGNMENT bytes, or NULL if there is
+ * not enough space left in the arena.
+ */
+void *scratch_arena_alloc(size_t size);
+
+/**
+ * Wipes and releases all the buffers allocated after the given mark was taken.
+ *
+ * @param[in] mark
+ *   A mark returned by scratch_arena_mark, not older than the last release.
+ */
+void scratch_arena_release(scratch_arena_mark_t mark);
+
+// Declares a pointer `name` to a zeroed `type` allocated in the scratch arena; it is NULL if there
+// is not enough space left.
+#define SCRATCH_ALLOC(type, name) type *name = (type *) scratch_arena_alloc(sizeof(type))
+
+#define SCRATCH_MARK(mark)    scratch_arena_mark_t mark = scratch_arena_mark()
+#define SCRATCH_RELEASE(mark) scratch_arena_release(mark)
+
+#else
+
+// Without the scratch arena, the buffers are local variables: they are never NULL, and they are
+// released when leaving the scope, without wiping them.
+#define SCRATCH_ALLOC(type, name) \
+    type name##_storage;          \
+    type *name = (type *) memset(&name##_storage, 0, sizeof(type))
+
+#define SCRATCH_MARK(mark)    (void) 0
+#define SCRATCH_RELEASE(mark) (void) 0
+
+#endif
@@ -28,9 +28,10 @@ int call_stream_preimage(dispatcher_context_t *dispatcher_context,
 
     uint8_t partial_data_len;
 
+    const uint8_t *data_ptr;
     if (!buffer_read_varint(&dispatcher_context->read_buffer, &preimage_len_u64) ||
         !buffer_read_u8(&dispatcher_context->read_buffer, &partial_data_len) ||
-        !buffer_can_read(&dispatcher_context->read_buffer, partial_data_len)) {
+        !buffer_borrow_bytes(&dispatcher_context->read_buffer, partial_data_len, &data_ptr)) {
         return -2;
     }
     uint32_t preimage_len = (uint32_t) preimage_len_u64;
@@ -48,16 +49,13 @@ int call_stream_preimage(dispatcher_context_t *dispatcher_context,
         len_callback(preimage_len - 1, callback_state);
     }
 
-    uint8_t *data_ptr =
-        dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset;
-
     cx_sha256_t hash_context;
     cx_sha256_init(&hash_context);
     // update hash
     crypto_hash_update(&hash_context.header, data_ptr, partial_data_len);
 
-    // call callback with data
-    buffer_t initial_buf = buffer_create(data_ptr + 1, partial_data_len - 1);  // skip 0x00 prefix
+    // call callback with data, skipping the 0x00 prefix
+    buffer_t initial_buf = buffer_create((uint8_t *) data_ptr + 1, partial_data_len - 1);
     callback(&initial_buf, callback_state);
 
     size_t bytes_remaining = (size_t) preimage_len - partial_data_len;
@@ -90,14 +88,14 @@ int call_stream_preimage(dispatcher_context_t *dispatcher_context,
             return -8;
         }
 
-        uint8_t *data_ptr =
-            dispatcher_context->read_buffer.ptr + dispatcher_context->read_buffer.offset;
+        // the bytes are used in place, in the read buffer
+        buffer_borrow_bytes(&dispatcher_context->read_buffer, n_bytes, &data_ptr);
 
         // update hash
         crypto_hash_update(&hash_context.header, data_ptr, n_bytes);
 
         // call callback with data
-        buffer_t buf = buffer_create(data_ptr, n_bytes);
+        buffer_t buf = buffer_create((uint8_t *) data_ptr, n_bytes);
         callback(&buf, callback_state);
 
         bytes_remaining -= n_bytes;
@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "os.h"
+
+#include "tree_stream.h"
+
+#include "../../common/buffer.h"
+#include "../../common/merkle.h"
+#include "../../common/varint.h"
+#include "../../boilerplate/sw.h"
+#include "../client_commands.h"
+
+#include "debug-helpers/debug.h"
+
+#ifdef HAVE_TREE_STREAMS
+
+tree_stream_t G_tree_stream;
+
+void tree_stream_reset(uint8_t protocol_version) {
+    explicit_bzero(&G_tree_stream, sizeof(G_tree_stream));
+    G_tree_stream.is_enabled = protocol_version >= TREE_STREAM_PROTOCOL_VERSION;
+}
+
+// Parses a response with the next bytes of the stream, to CCMD_STREAM_MERKLE_TREE or to
+// CCMD_GET_TREE_STREAM_DATA.
+static int read_stream_response(dispatcher_context_t *dc) {
+    uint64_t n_bytes;
+    if (!buffer_read_varint(&dc->read_buffer, &n_bytes) || n_bytes == 0 ||
+        n_bytes > TREE_STREAM_BUFFER_SIZE ||
+        !buffer_read_bytes(&dc->read_buffer, G_tree_stream.buffer, (size_t) n_bytes)) {
+        PRINTF("Invalid tree stream data\n");
+        return -1;
+    }
+    G_tree_stream.offset = 0;
+    G_tree_stream.n_available = (uint16_t) n_bytes;
+    return 0;
+}
+
+int call_start_tree_stream(dispatcher_context_t *dc, const uint8_t root[static 32], size_t size) {
+    // LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    if (!tree_stream_is_available(size)) {
+        return -1;
+    }
+
+    memcpy(G_tree_stream.root, root, 32);
+    G_tree_stream.size = (uint32_t) size;
+    G_tree_stream.n_read = 0;
+    G_tree_stream.n_subtrees = 0;
+    G_tree_stream.offset = 0;
+    G_tree_stream.n_available = 0;
+    G_tree_stream.in_progress = true;
+
+    {  // make sure memory is deallocated as soon as possible
+        uint8_t tmp[9];
+        tmp[0] = CCMD_STREAM_MERKLE_TREE;
+        dc->add_to_response(tmp, 1);
+
+        dc->add_to_response(root, 32);
+
+        int size_len = varint_write(tmp, 0, size);
+        dc->add_to_response(tmp, size_len);
+
+        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+    }
+
+    if (dc->process_interruption(dc) < 0 || read_stream_response(dc) < 0) {
+        G_tree_stream.in_progress = false;
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the next len bytes of the data of the stream, requesting more bytes to the client if
+// necessary.
+static int read_stream_data(dispatcher_context_t *dc, uint8_t *out, size_t len) {
+    while (len > 0) {
+        if (G_tree_stream.n_available == 0) {
+            uint8_t req_more[] = {CCMD_GET_TREE_STREAM_DATA};
+            SET_RESPONSE(dc, req_more, sizeof(req_more), SW_INTERRUPTED_EXECUTION);
+            if (dc->process_interruption(dc) < 0 || read_stream_response(dc) < 0) {
+                return -1;
+            }
+        }
+
+        size_t chunk_len = len < G_tree_stream.n_available ? len : G_tree_stream.n_available;
+        memcpy(out, G_tree_stream.buffer + G_tree_stream.offset, chunk_len);
+        out += chunk_len;
+        len -= chunk_len;
+        G_tree_stream.offset += chunk_len;
+        G_tree_stream.n_available -= chunk_len;
+    }
+    return 0;
+}
+
+// Reads a Bitcoin-style varint from the data of the stream.
+static int read_stream_data_varint(dispatcher_context_t *dc, uint64_t *out) {
+    uint8_t data[9];
+    if (read_stream_data(dc, data, 1) < 0) {
+        return -1;
+    }
+
+    size_t len = data[0] < 0xFD ? 1 : data[0] == 0xFD ? 3 : data[0] == 0xFE ? 5 : 9;
+    if (read_stream_data(dc, data + 1, len - 1) < 0 || varint_read(data, len, out) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Adds the hash of the next leaf, merging the complete subtrees of the same level: the subtrees
+// read so far are those of the binary decomposition of n_read, as in the tree of the leaves.
+static void add_leaf_hash(const uint8_t leaf_hash[static 32]) {
+    uint8_t cur_hash[32];
+    uint8_t cur_level = 0;
+    memcpy(cur_hash, leaf_hash, 32);
+
+    uint8_t n = G_tree_stream.n_subtrees;
+    while (n > 0 && G_tree_stream.subtree_levels[n - 1] == cur_level) {
+        merkle_combine_hashes(G_tree_stream.subtree_roots[n - 1], cur_hash, cur_hash);
+        --n;
+        ++cur_level;
+    }
+
+    memcpy(G_tree_stream.subtree_roots[n], cur_hash, 32);
+    G_tree_stream.subtree_levels[n] = cur_level;
+    G_tree_stream.n_subtrees = n + 1;
+}
+
+int call_read_tree_stream_element(dispatcher_context_t *dc, uint8_t *out, size_t out_len) {
+    if (!G_tree_stream.in_progress || G_tree_stream.n_read >= G_tree_stream.size) {
+        return -1;
+    }
+
+    uint64_t preimage_len;
+    uint8_t prefix;
+    if (read_stream_data_varint(dc, &preimage_len) < 0 || preimage_len == 0 ||
+        read_stream_data(dc, &prefix, 1) < 0 || prefix != 0x00) {
+        return -1;
+    }
+
+    if (preimage_len - 1 > out_len) {
+        PRINTF("Output buffer too short\n");
+        return -1;
+    }
+
+    size_t element_len = (size_t) (preimage_len - 1);
+    if (read_stream_data(dc, out, element_len) < 0) {
+        return -1;
+    }
+
+    uint8_t leaf_hash[32];
+    merkle_compute_element_hash(out, element_len, leaf_hash);
+    add_leaf_hash(leaf_hash);
+    ++G_tree_stream.n_read;
+
+    return (int) element_len;
+}
+
+int tree_stream_finish(void) {
+    if (!G_tree_stream.in_progress) {
+        return -1;
+    }
+    G_tree_stream.in_progress = false;
+
+    if (G_tree_stream.n_read != G_tree_stream.size || G_tree_stream.n_available != 0) {
+        PRINTF("Tree stream not entirely consumed\n");
+        return -1;
+    }
+
+    // the complete subtrees, from right to left, are the right children of the path to the root
+    uint8_t cur_hash[32];
+    int n = G_tree_stream.n_subtrees;
+    memcpy(cur_hash, G_tree_stream.subtree_roots[n - 1], 32);
+    for (int i = n - 2; i >= 0; i--) {
+        merkle_combine_hashes(G_tree_stream.subtree_roots[i], cur_hash, cur_hash);
+    }
+
+    if (memcmp(G_tree_stream.root, cur_hash, 32) != 0) {
+        PRINTF("Merkle root mismatch");
+        return -1;
+    }
+    return 0;
+}
+
+#endif
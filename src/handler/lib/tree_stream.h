@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../boilerplate/constants.h"
+#include "../../boilerplate/dispatcher.h"
+
+#ifdef HAVE_TREE_STREAMS
+
+// Version of the protocol (P2 of the command) from which the client accepts the tree streams.
+#define TREE_STREAM_PROTOCOL_VERSION 6
+
+// Trees with up to 2^TREE_STREAM_MAX_LEVELS leaves are streamed; larger trees are enumerated one
+// leaf at a time, with their proofs.
+#define TREE_STREAM_MAX_LEVELS 8
+
+// Size of the buffer of the data of the stream; it fits the data of any response, including the
+// extended-length ones.
+#define TREE_STREAM_BUFFER_SIZE MAX_EXTENDED_APDU_DATA_LEN
+
+/**
+ * A tree stream enumerates all the leaves of a Merkle tree without any proof: after a single
+ * CCMD_STREAM_MERKLE_TREE request, the client sends the preimages of all the leaves, in order, that
+ * the device reads from the responses of CCMD_GET_TREE_STREAM_DATA requests, filled with as many
+ * bytes as possible. The device rebuilds the root from the leaf hashes as they are read, keeping
+ * the root of each of the maximal complete subtrees read so far (at most one per level), and
+ * compares it with the expected root once all the leaves are read.
+ *
+ * Therefore, unlike the responses of call_get_merkle_leaf_element, the leaves returned by
+ * call_read_tree_stream_element are only verified when tree_stream_finish succeeds; the caller
+ * must fail if it does not.
+ *
+ * The stream is independent of the other client commands, that can be interleaved with the
+ * requests of its data; therefore, the bytes not consumed yet are copied from the response. Only
+ * one stream can be in progress at a time.
+ */
+typedef struct {
+    bool is_enabled;       // true if the client supports the tree streams in the current command
+    bool in_progress;      // true between call_start_tree_stream and tree_stream_finish
+    uint8_t root[32];      // the expected root of the tree
+    uint32_t size;         // the number of leaves of the tree
+    uint32_t n_read;       // the number of leaves read so far
+    uint8_t n_subtrees;    // the number of complete subtrees read so far
+    uint16_t offset;       // position of the first byte of the buffer not consumed yet
+    uint16_t n_available;  // number of bytes of the buffer not consumed yet
+    // root and level of the complete subtrees read so far, from left to right
+    uint8_t subtree_roots[TREE_STREAM_MAX_LEVELS + 1][32];
+    uint8_t subtree_levels[TREE_STREAM_MAX_LEVELS + 1];
+    uint8_t buffer[TREE_STREAM_BUFFER_SIZE];
+} tree_stream_t;
+
+extern tree_stream_t G_tree_stream;
+
+/**
+ * Forgets the current stream, if any; it is called before processing each command, with the
+ * protocol version of the command.
+ */
+void tree_stream_reset(uint8_t protocol_version);
+
+/**
+ * Returns true if a tree with the given size can be streamed now: the client supports the tree
+ * streams, no other stream is in progress, and the tree is not empty nor too large.
+ */
+static inline bool tree_stream_is_available(size_t size) {
+    return G_tree_stream.is_enabled && !G_tree_stream.in_progress && size > 0 &&
+           size <= (1U << TREE_STREAM_MAX_LEVELS);
+}
+
+/**
+ * Starts the stream of the leaves of the Merkle tree with the given root and size.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+int call_start_tree_stream(dispatcher_context_t *dispatcher_context,
+                           const uint8_t root[static 32],
+                           size_t size);
+
+/**
+ * Reads the next leaf element of the current stream, without the 0x00 prefix of its preimage.
+ *
+ * @return the length of the element on success, a negative number on failure, including if the
+ * element does not fit in the output buffer or if all the leaves were already read.
+ */
+int call_read_tree_stream_element(dispatcher_context_t *dispatcher_context,
+                                  uint8_t *out,
+                                  size_t out_len);
+
+/**
+ * Ends the current stream, that can be called even if the enumeration was interrupted by an error.
+ *
+ * @return 0 if all the leaves were read, the data of the stream was entirely consumed, and the root
+ * of the leaves matches the expected root; a negative number otherwise.
+ */
+int tree_stream_finish(void);
+
+#endif
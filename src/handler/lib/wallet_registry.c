@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "os.h"
+
+#include "../../crypto.h"
+
+#include "wallet_registry.h"
+
+#ifdef HAVE_WALLET_REGISTRY
+
+// placed in flash by the linker script of the SDK, zeroed when the app is installed
+const wallet_registry_entry_t N_wallet_registry_real[WALLET_REGISTRY_MAX_WALLETS];
+#define N_wallet_registry ((const volatile wallet_registry_entry_t *) PIC(N_wallet_registry_real))
+
+/**
+ * Returns the index of the entry with the given wallet id, or -1 if there is none.
+ */
+static int find_entry(const uint8_t wallet_id[static 32]) {
+    for (int i = 0; i < WALLET_REGISTRY_MAX_WALLETS; i++) {
+        const wallet_registry_entry_t *entry =
+            (const wallet_registry_entry_t *) &N_wallet_registry[i];
+        if (entry->sequence != 0 && memcmp(entry->wallet.wallet_id, wallet_id, 32) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool wallet_registry_store(void) {
+    if (!G_wallet_session.is_open ||
+        G_wallet_session.n_keys_decoded != G_wallet_session.wallet_header.n_keys) {
+        return false;
+    }
+
+    // the entry with the same wallet id, or else an empty entry, or else the oldest one
+    int index = find_entry(G_wallet_session.wallet_id);
+    int oldest_index = 0;
+    uint32_t max_sequence = 0;
+    for (int i = 0; i < WALLET_REGISTRY_MAX_WALLETS; i++) {
+        uint32_t sequence = N_wallet_registry[i].sequence;
+        if (sequence < N_wallet_registry[oldest_index].sequence) {
+            oldest_index = i;
+        }
+        max_sequence = MAX(max_sequence, sequence);
+    }
+    if (index < 0) {
+        index = oldest_index;
+    }
+    if (max_sequence == UINT32_MAX) {
+        return false;
+    }
+
+    volatile wallet_registry_entry_t *entry =
+        (volatile wallet_registry_entry_t *) &N_wallet_registry[index];
+
+    // the entry is marked as empty while it is written, so that it is never used if interrupted
+    uint32_t sequence = 0;
+    uint32_t master_key_fingerprint = crypto_get_master_key_fingerprint();
+    nvm_write((void *) &entry->sequence, &sequence, sizeof(sequence));
+    nvm_write((void *) &entry->master_key_fingerprint,
+              &master_key_fingerprint,
+              sizeof(master_key_fingerprint));
+    nvm_write((void *) &entry->wallet, &G_wallet_session, sizeof(G_wallet_session));
+
+    sequence = max_sequence + 1;
+    nvm_write((void *) &entry->sequence, &sequence, sizeof(sequence));
+    return true;
+}
+
+const wallet_session_t *wallet_registry_get(const uint8_t wallet_id[static 32]) {
+    int index = find_entry(wallet_id);
+    if (index < 0) {
+        return NULL;
+    }
+
+    // entries stored with another seed, for example with a temporary passphrase, are ignored
+    const wallet_registry_entry_t *entry =
+        (const wallet_registry_entry_t *) &N_wallet_registry[index];
+    if (entry->master_key_fingerprint != crypto_get_master_key_fingerprint()) {
+        return NULL;
+    }
+
+    if (G_wallet_session.is_open) {
+        if (memcmp(G_wallet_session.wallet_id, wallet_id, sizeof(G_wallet_session.wallet_id)) ==
+            0) {
+            return &G_wallet_session;
+        }
+        // the session opened for another wallet is kept
+        return &entry->wallet;
+    }
+
+    // the stored entry has the hmac of the registered wallet policy, so that the session only
+    // matches that hmac
+    memcpy(&G_wallet_session, &entry->wallet, sizeof(G_wallet_session));
+    return &G_wallet_session;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "wallet_session.h"
+
+#ifdef HAVE_WALLET_REGISTRY
+
+// Maximum number of wallet policies stored in the registry
+#define WALLET_REGISTRY_MAX_WALLETS 4
+
+/**
+ * An entry of the registry in flash: a registered wallet policy stored by REGISTER_WALLET after the
+ * user's approval, as parsed and decoded for a wallet session. The sequence number orders the
+ * entries by time of storage, so that the oldest one is replaced when the registry is full.
+ */
+typedef struct {
+    uint32_t sequence;                // 0 if the entry is empty
+    uint32_t master_key_fingerprint;  // the fingerprint of the seed used when storing the entry
+    wallet_session_t wallet;
+} wallet_registry_entry_t;
+
+/**
+ * Stores the wallet policy of the open wallet session in the registry, replacing the entry with the
+ * same wallet id if any, or else the oldest entry if the registry is full. All the keys of the
+ * wallet policy must be decoded in the session.
+ *
+ * @return true on success, false otherwise.
+ */
+bool wallet_registry_store(void);
+
+/**
+ * Returns the wallet policy with the given id, if it is stored in the registry for the current
+ * seed. The stored wallet policy is loaded in the wallet session, with the hmac computed when it was
+ * registered, if no session is open; if a session is open for another wallet, it is kept, and the
+ * entry is returned as stored in flash. If the open session has the same wallet id, it is returned.
+ *
+ * @param[in] wallet_id
+ *   The id of the wallet.
+ *
+ * @return a pointer to the stored wallet policy, or NULL if it is not in the registry.
+ */
+const wallet_session_t *wallet_registry_get(const uint8_t wallet_id[static 32]);
+
+#endif
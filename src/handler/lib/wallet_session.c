@@ -0,0 +1,69 @@
+#include <string.h>
+
+#include "os.h"
+
+#include "../../common/base58.h"
+
+#include "wallet_session.h"
+
+#ifdef HAVE_WALLET_SESSIONS
+
+wallet_session_t G_wallet_session;
+
+void wallet_session_close(void) {
+    explicit_bzero(&G_wallet_session, sizeof(G_wallet_session));
+}
+
+const wallet_session_t *wallet_session_get(const uint8_t wallet_id[static 32],
+                                           const uint8_t wallet_hmac[static 32]) {
+    if (!G_wallet_session.is_open ||
+        memcmp(G_wallet_session.wallet_id, wallet_id, sizeof(G_wallet_session.wallet_id)) != 0) {
+        return NULL;
+    }
+
+    // constant-time comparison, as for any other check of the hmac
+    if (os_secure_memcmp((void *) G_wallet_session.wallet_hmac,
+                         (void *) wallet_hmac,
+                         sizeof(G_wallet_session.wallet_hmac)) != 0) {
+        return NULL;
+    }
+
+    return &G_wallet_session;
+}
+
+int wallet_session_decode_key(const policy_map_key_info_t *key_info, wallet_session_key_t *key) {
+    serialized_extended_pubkey_check_t decoded_pubkey_check;
+    if (base58_decode(key_info->ext_pubkey,
+                      strlen(key_info->ext_pubkey),
+                      (uint8_t *) &decoded_pubkey_check,
+                      sizeof(decoded_pubkey_check)) == -1) {
+        return -1;
+    }
+    memcpy(&key->ext_pubkey,
+           &decoded_pubkey_check.serialized_extended_pubkey,
+           sizeof(key->ext_pubkey));
+
+    memcpy(key->master_key_derivation,
+           key_info->master_key_derivation,
+           sizeof(key->master_key_derivation));
+    memcpy(key->master_key_fingerprint,
+           key_info->master_key_fingerprint,
+           sizeof(key->master_key_fingerprint));
+    key->master_key_derivation_len = key_info->master_key_derivation_len;
+    key->has_key_origin = key_info->has_key_origin;
+    key->has_wildcard = key_info->has_wildcard;
+    return 0;
+}
+
+const wallet_session_key_t *wallet_session_get_key(const uint8_t keys_merkle_root[static 32],
+                                                   size_t n_keys,
+                                                   uint32_t key_index) {
+    if (!G_wallet_session.is_open || key_index >= G_wallet_session.n_keys_decoded ||
+        n_keys != G_wallet_session.wallet_header.n_keys ||
+        memcmp(G_wallet_session.wallet_header.keys_info_merkle_root, keys_merkle_root, 32) != 0) {
+        return NULL;
+    }
+    return &G_wallet_session.keys[key_index];
+}
+
+#endif
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../common/wallet.h"
+#include "../../crypto.h"
+
+#ifdef HAVE_WALLET_SESSIONS
+
+// Maximum number of keys of a wallet session whose key information is kept decoded; the keys with
+// a larger index are fetched and parsed for each use.
+#define WALLET_SESSION_MAX_KEYS 8
+
+/**
+ * The key information of a key of a wallet session, as parsed by parse_policy_map_key_info, with
+ * the extended pubkey decoded. Whether the key is internal is checked once, when opening the
+ * session, by deriving the extended pubkey at its origin.
+ */
+typedef struct {
+    serialized_extended_pubkey_t ext_pubkey;
+    uint32_t master_key_derivation[MAX_BIP32_PATH_STEPS];
+    uint8_t master_key_fingerprint[4];
+    uint8_t master_key_derivation_len;
+    uint8_t has_key_origin;
+    uint8_t has_wildcard;
+    uint8_t is_internal;  // 1 if the key has our master fingerprint and is derived from our seed
+} wallet_session_key_t;
+
+/**
+ * A registered wallet policy that was parsed and verified by OPEN_WALLET_SESSION, and is kept in
+ * memory until the app exits or another session is opened.
+ * The pair (wallet_id, wallet_hmac) acts as the handle of the session: commands that receive the
+ * same pair use the stored policy instead of fetching, parsing and verifying it again.
+ */
+typedef struct {
+    bool is_open;
+    uint8_t wallet_id[32];
+    uint8_t wallet_hmac[32];
+    policy_map_wallet_header_t wallet_header;
+    union {
+        uint8_t wallet_policy_map_bytes[MAX_WALLET_POLICY_BYTES];
+        policy_node_t wallet_policy_map;
+    };
+    // the first n_keys_decoded keys of the wallet policy; the keys are resolved with an array
+    // lookup, instead of a Merkle proof and a parse
+    uint8_t n_keys_decoded;
+    wallet_session_key_t keys[WALLET_SESSION_MAX_KEYS];
+} wallet_session_t;
+
+extern wallet_session_t G_wallet_session;
+
+/**
+ * Closes the current wallet session, if any, and wipes its content.
+ */
+void wallet_session_close(void);
+
+/**
+ * Returns the open wallet session for the given wallet id and hmac, or NULL if there is none.
+ *
+ * @param[in] wallet_id
+ *   The id of the wallet.
+ * @param[in] wallet_hmac
+ *   The hmac of the registered wallet.
+ *
+ * @return a pointer to the session, or NULL if no open session matches both wallet_id and
+ * wallet_hmac.
+ */
+const wallet_session_t *wallet_session_get(const uint8_t wallet_id[static 32],
+                                           const uint8_t wallet_hmac[static 32]);
+
+/**
+ * Decodes the key information of a key, as parsed by parse_policy_map_key_info, for a wallet
+ * session; whether the key is internal is not set.
+ *
+ * @param[in] key_info
+ *   The parsed key information.
+ * @param[out] key
+ *   The decoded key information.
+ *
+ * @return 0 on success, -1 if the extended pubkey is not valid.
+ */
+int wallet_session_decode_key(const policy_map_key_info_t *key_info, wallet_session_key_t *key);
+
+/**
+ * Returns the decoded key information of a key of the open wallet session, if the vector of keys
+ * information of the session is the one with the given Merkle root and size. As the session's keys
+ * were verified against that root, any command fetching the same key would get the same data.
+ *
+ * @param[in] keys_merkle_root
+ *   The Merkle root of the vector of keys information.
+ * @param[in] n_keys
+ *   The number of keys.
+ * @param[in] key_index
+ *   The index of the key.
+ *
+ * @return a pointer to the key information, or NULL if there is no matching session, or if the
+ * key is not kept decoded.
+ */
+const wallet_session_key_t *wallet_session_get_key(const uint8_t keys_merkle_root[static 32],
+                                                   size_t n_keys,
+                                                   uint32_t key_index);
+
+#endif
@@ -0,0 +1,263 @@
+/*****************************************************************************
+ *   Ledger App Bitcoin.
+ *   (c) 2021 Ledger SAS.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *****************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "os.h"
+
+#include "boilerplate/dispatcher.h"
+#include "boilerplate/sw.h"
+#include "../common/buffer.h"
+#include "../common/read.h"
+#include "../common/wallet.h"
+#include "../crypto.h"
+
+#include "lib/compiled_policy.h"
+#include "lib/policy.h"
+#include "lib/get_merkle_leaf_element.h"
+#include "lib/get_preimage.h"
+#include "lib/preimage_reader.h"
+#include "lib/wallet_session.h"
+
+#include "handlers.h"
+
+#ifdef HAVE_WALLET_SESSIONS
+
+/**
+ * Fetches, parses and decodes the key information of the first WALLET_SESSION_MAX_KEYS keys of the
+ * wallet policy of the session.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int __attribute__((noinline)) load_session_keys(dispatcher_context_t *dc) {
+    const policy_map_wallet_header_t *header = &G_wallet_session.wallet_header;
+
+    size_t n_keys = MIN(header->n_keys, WALLET_SESSION_MAX_KEYS);
+    for (size_t i = 0; i < n_keys; i++) {
+        policy_map_key_info_t key_info;
+        {
+            char key_info_str[MAX_POLICY_KEY_INFO_LEN];
+            int key_info_len = call_get_merkle_leaf_element(dc,
+                                                            header->keys_info_merkle_root,
+                                                            header->n_keys,
+                                                            i,
+                                                            (uint8_t *) key_info_str,
+                                                            sizeof(key_info_str));
+            if (key_info_len < 0) {
+                return -1;
+            }
+
+            buffer_t key_info_buffer = buffer_create(key_info_str, key_info_len);
+            if (parse_policy_map_key_info(&key_info_buffer, &key_info, header->version) == -1) {
+                return -1;
+            }
+        }
+
+        if (0 > wallet_session_decode_key(&key_info, &G_wallet_session.keys[i])) {
+            return -1;
+        }
+    }
+    G_wallet_session.n_keys_decoded = (uint8_t) n_keys;
+    return 0;
+}
+
+/**
+ * Derives the extended pubkey at the origin of each decoded key of the session that has the
+ * fingerprint of our master key, so that the commands using the session know which keys are
+ * internal without deriving them again.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int __attribute__((noinline)) check_session_keys_internal(void) {
+    uint32_t master_key_fingerprint = crypto_get_master_key_fingerprint();
+
+    for (size_t i = 0; i < G_wallet_session.n_keys_decoded; i++) {
+        wallet_session_key_t *key = &G_wallet_session.keys[i];
+        if (read_u32_be(key->master_key_fingerprint, 0) != master_key_fingerprint) {
+            continue;
+        }
+
+        // it could be a collision on the fingerprint; we verify that we can actually generate
+        // the same pubkey
+        char pubkey_derived[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+        serialized_extended_pubkey_t ext_pubkey;
+        if (-1 == get_serialized_extended_pubkey_at_path(key->master_key_derivation,
+                                                         key->master_key_derivation_len,
+                                                         BIP32_PUBKEY_VERSION,
+                                                         pubkey_derived,
+                                                         &ext_pubkey)) {
+            return -1;
+        }
+        key->is_internal = memcmp(&ext_pubkey, &key->ext_pubkey, sizeof(ext_pubkey)) == 0;
+    }
+    return 0;
+}
+
+/**
+ * Fetches the compiled policy with the given hash from the client, and loads its tree in the
+ * session if it is authenticated for the wallet id. The header of the wallet policy is read from
+ * serialized_wallet_policy_buf.
+ *
+ * @return true if the compiled policy was loaded, false otherwise; on failure, the tree of the
+ * session must be wiped.
+ */
+static bool __attribute__((noinline))
+load_compiled_policy(dispatcher_context_t *dc,
+                     const uint8_t wallet_id[static 32],
+                     const uint8_t compiled_policy_hash[static 32],
+                     buffer_t *serialized_wallet_policy_buf) {
+    if (0 > read_wallet_policy_header(serialized_wallet_policy_buf,
+                                      &G_wallet_session.wallet_header)) {
+        return false;
+    }
+
+    preimage_reader_t reader;
+    int compiled_policy_len = preimage_reader_init(&reader, dc, compiled_policy_hash);
+    if (compiled_policy_len < COMPILED_POLICY_HEADER_LEN ||
+        (size_t) compiled_policy_len >
+            COMPILED_POLICY_HEADER_LEN + sizeof(G_wallet_session.wallet_policy_map_bytes)) {
+        return false;
+    }
+
+    // the session is zeroed, as required to load the tree
+    uint8_t header[COMPILED_POLICY_HEADER_LEN];
+    size_t tree_len = compiled_policy_len - COMPILED_POLICY_HEADER_LEN;
+    if (0 > preimage_reader_read(&reader, header, sizeof(header)) ||
+        0 > preimage_reader_read(&reader, G_wallet_session.wallet_policy_map_bytes, tree_len) ||
+        0 > preimage_reader_finish(&reader, compiled_policy_hash)) {
+        return false;
+    }
+
+    // fails if the compiled policy was produced by a different version of the app
+    return compiled_policy_check_header(wallet_id,
+                                        G_wallet_session.wallet_policy_map_bytes,
+                                        tree_len,
+                                        header);
+}
+
+void handler_open_wallet_session(dispatcher_context_t *dc, uint8_t p2) {
+    (void) p2;
+
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    uint8_t wallet_id[32];
+    uint8_t wallet_hmac[32];
+
+    if (!buffer_read_bytes(&dc->read_buffer, wallet_id, 32) ||
+        !buffer_read_bytes(&dc->read_buffer, wallet_hmac, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    // the hash of the compiled policy returned by REGISTER_WALLET is optional
+    uint8_t compiled_policy_hash[32];
+    bool has_compiled_policy = buffer_can_read(&dc->read_buffer, 1);
+    if (has_compiled_policy && !buffer_read_bytes(&dc->read_buffer, compiled_policy_hash, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    // any previous session is closed, even if opening the new one fails
+    wallet_session_close();
+
+    // the binary OR of all the hmac bytes (so == 0 iff the hmac is identically 0)
+    uint8_t hmac_or = 0;
+    for (int i = 0; i < 32; i++) {
+        hmac_or = hmac_or | wallet_hmac[i];
+    }
+
+    if (hmac_or == 0) {
+        PRINTF("Sessions are only supported for registered wallets\n");
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    if (!check_wallet_hmac(wallet_id, wallet_hmac)) {
+        PRINTF("Incorrect hmac\n");
+        SEND_SW(dc, SW_SIGNATURE_FAIL);
+        return;
+    }
+
+    {
+        uint8_t serialized_wallet_policy[MAX_WALLET_POLICY_SERIALIZED_LENGTH];
+
+        // Fetch the serialized wallet policy from the client; this also checks that it matches the
+        // wallet_id
+        int serialized_wallet_policy_len = call_get_preimage(dc,
+                                                             wallet_id,
+                                                             serialized_wallet_policy,
+                                                             sizeof(serialized_wallet_policy));
+        if (serialized_wallet_policy_len < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+
+        buffer_t serialized_wallet_policy_buf =
+            buffer_create(serialized_wallet_policy, serialized_wallet_policy_len);
+
+        bool is_loaded = false;
+        if (has_compiled_policy) {
+            buffer_t buf = serialized_wallet_policy_buf;
+            is_loaded = load_compiled_policy(dc, wallet_id, compiled_policy_hash, &buf);
+            if (!is_loaded) {
+                // the descriptor template is parsed instead
+                PRINTF("Invalid compiled policy\n");
+                explicit_bzero(G_wallet_session.wallet_policy_map_bytes,
+                               sizeof(G_wallet_session.wallet_policy_map_bytes));
+            }
+        }
+
+        if (!is_loaded &&
+            0 > read_and_parse_wallet_policy(dc,
+                                             &serialized_wallet_policy_buf,
+                                             &G_wallet_session.wallet_header,
+                                            NULL,
+                                            G_wallet_session.wallet_policy_map_bytes,
+                                            sizeof(G_wallet_session.wallet_policy_map_bytes))) {
+            wallet_session_close();
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+    }
+
+    if (0 > load_session_keys(dc)) {
+        wallet_session_close();
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    if (0 > check_session_keys_internal()) {
+        wallet_session_close();
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    memcpy(G_wallet_session.wallet_id, wallet_id, sizeof(wallet_id));
+    memcpy(G_wallet_session.wallet_hmac, wallet_hmac, sizeof(wallet_hmac));
+    G_wallet_session.is_open = true;
+
+    SEND_SW(dc, SW_OK);
+}
+
+#endif
@@ -0,0 +1,107 @@
+/*****************************************************************************
+ *   Ledger App Bitcoin.
+ *   (c) 2021 Ledger SAS.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *****************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "os.h"
+
+#include "boilerplate/dispatcher.h"
+#include "boilerplate/sw.h"
+#include "../common/buffer.h"
+#include "../common/script.h"
+#include "../constants.h"
+#include "../ui/display.h"
+
+#include "lib/get_merkle_leaf_element.h"
+#include "lib/payee_list.h"
+
+#include "handlers.h"
+
+#ifdef HAVE_PAYEE_LISTS
+
+void handler_register_payee_list(dispatcher_context_t *dc, uint8_t p2) {
+    (void) p2;
+
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    uint64_t n_payees;
+    uint8_t payees_root[32];
+    if (!buffer_read_varint(&dc->read_buffer, &n_payees) ||
+        !buffer_read_bytes(&dc->read_buffer, payees_root, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (n_payees == 0 || n_payees > MAX_N_PAYEES) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    if (!ui_display_register_payee_list(dc, (uint32_t) n_payees)) {
+        SEND_SW(dc, SW_DENY);
+        return;
+    }
+
+    for (uint32_t i = 0; i < (uint32_t) n_payees; i++) {
+        uint8_t script[MAX_OUTPUT_SCRIPTPUBKEY_LEN];
+        int script_len = call_get_merkle_leaf_element(dc,
+                                                      payees_root,
+                                                      (uint32_t) n_payees,
+                                                      i,
+                                                      script,
+                                                      sizeof(script));
+        if (script_len < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+
+        // only scripts with an address can be payees; in particular, OP_RETURN outputs can't
+        char address[MAX_ADDRESS_LENGTH_STR + 1];
+        if (get_script_address(script, script_len, address, sizeof(address)) < 0) {
+            PRINTF("Payee %u has no address\n", i);
+            SEND_SW(dc, SW_NOT_SUPPORTED);
+            return;
+        }
+
+        if (!ui_display_payee(dc, i + 1, address)) {
+            SEND_SW(dc, SW_DENY);
+            return;
+        }
+    }
+
+    struct {
+        uint8_t payee_list_id[32];
+        uint8_t hmac[32];
+    } response;
+
+    get_payee_list_id((uint32_t) n_payees, payees_root, response.payee_list_id);
+    if (!compute_payee_list_hmac(response.payee_list_id, response.hmac)) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+
+    SEND_RESPONSE(dc, &response, sizeof(response), SW_OK);
+}
+
+#endif
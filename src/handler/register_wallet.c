@@ -35,16 +35,54 @@
 #include "../ui/display.h"
 #include "../ui/menu.h"
 
-#include "lib/get_merkle_leaf_element.h"
+#include "lib/compiled_policy.h"
+#include "lib/get_merkle_leaf_elements.h"
 #include "lib/get_preimage.h"
 #include "lib/policy.h"
+#include "lib/scratch_arena.h"
+#include "lib/wallet_registry.h"
 
 #include "client_commands.h"
 
 #include "handlers.h"
 
+#ifdef HAVE_SCRATCH_ARENA
+// Maximum number of keys of the wallet policies whose key informations are all retrieved once, and
+// kept in the scratch arena for the whole registration. The key informations of larger policies
+// are retrieved again for the sanity checks and when shown to the user.
+#define MAX_REGISTERED_KEY_INFOS MAX_PUBKEYS_PER_MULTISIG
+
+typedef struct {
+    policy_key_info_string_t key_infos[MAX_REGISTERED_KEY_INFOS];
+} registered_key_infos_t;
+#endif
+
+// Flags of the optional last byte of the request
+#define REGISTER_WALLET_FLAG_COMPILED_POLICY 1  // the compiled policy is returned with YIELD
+#define REGISTER_WALLET_FLAG_STORE           2  // the wallet is stored in the registry of the device
+
+// Maximum number of bytes of the compiled policy in each YIELD
+#define COMPILED_POLICY_YIELD_CHUNK_LEN 224
+
 static bool is_policy_acceptable(const policy_node_t *policy);
 static bool is_policy_name_acceptable(const char *name, size_t name_len);
+static int get_key_infos(dispatcher_context_t *dc,
+                         const policy_map_wallet_header_t *wallet_header,
+                         uint32_t first_index,
+                         size_t n,
+                         policy_key_info_string_t out[]);
+#ifdef HAVE_WALLET_SESSIONS
+static bool yield_compiled_policy(dispatcher_context_t *dc,
+                                  const uint8_t wallet_id[static 32],
+                                  const uint8_t *policy_map_bytes);
+#endif
+#ifdef HAVE_WALLET_REGISTRY
+static bool store_wallet(dispatcher_context_t *dc,
+                         const policy_map_wallet_header_t *wallet_header,
+                         const uint8_t wallet_id[static 32],
+                         const uint8_t wallet_hmac[static 32],
+                         const uint8_t *policy_map_bytes);
+#endif
 
 /**
  * Validates the input, initializes the hash context and starts accumulating the wallet header in
@@ -77,6 +115,36 @@ void handler_register_wallet(dispatcher_context_t *dc, uint8_t p2) {
         return;
     }
 
+    // the optional flags follow the policy; they are read first, as the request is overwritten by
+    // the first client command
+    uint8_t flags = 0;
+    if (dc->read_buffer.size - dc->read_buffer.offset == serialized_policy_map_len + 1) {
+        flags = dc->read_buffer.ptr[dc->read_buffer.size - 1];
+        if ((flags & ~(REGISTER_WALLET_FLAG_COMPILED_POLICY | REGISTER_WALLET_FLAG_STORE)) != 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+#ifndef HAVE_WALLET_SESSIONS
+        if ((flags & REGISTER_WALLET_FLAG_COMPILED_POLICY) != 0) {
+            // only used by OPEN_WALLET_SESSION
+            SEND_SW(dc, SW_NOT_SUPPORTED);
+            return;
+        }
+#endif
+#ifndef HAVE_WALLET_REGISTRY
+        if ((flags & REGISTER_WALLET_FLAG_STORE) != 0) {
+            SEND_SW(dc, SW_NOT_SUPPORTED);
+            return;
+        }
+#endif
+    }
+#ifdef HAVE_WALLET_REGISTRY
+    bool is_stored = (flags & REGISTER_WALLET_FLAG_STORE) != 0;
+#endif
+
+    // zeroed, as the trailing zero bytes are not part of the compiled policy
+    memset(policy_map.bytes, 0, sizeof(policy_map.bytes));
+
     uint8_t policy_map_descriptor[MAX_DESCRIPTOR_TEMPLATE_LENGTH];
     if (0 > read_and_parse_wallet_policy(dc,
                                          &dc->read_buffer,
@@ -105,12 +173,42 @@ void handler_register_wallet(dispatcher_context_t *dc, uint8_t p2) {
         return;
     }
 
+#ifdef HAVE_WALLET_REGISTRY
+    // all the keys of a stored wallet policy are kept decoded, so that they are never fetched
+    if (is_stored && wallet_header.n_keys > WALLET_SESSION_MAX_KEYS) {
+        PRINTF("Too many keys to store the wallet policy\n");
+
+        SEND_SW(dc, SW_NOT_SUPPORTED);
+        return;
+    }
+#endif
+
+    // the key informations of the policy, if they all fit in the scratch arena
+    const policy_key_info_string_t *key_infos = NULL;
+#ifdef HAVE_SCRATCH_ARENA
+    if (wallet_header.n_keys <= MAX_REGISTERED_KEY_INFOS) {
+        SCRATCH_ALLOC(registered_key_infos_t, registered_key_infos);
+        if (registered_key_infos != NULL) {
+            for (size_t i = 0; i < wallet_header.n_keys; i += MAX_MERKLE_LEAF_ELEMENTS_BATCH) {
+                size_t n = MIN(MAX_MERKLE_LEAF_ELEMENTS_BATCH, wallet_header.n_keys - i);
+                if (0 >
+                    get_key_infos(dc, &wallet_header, i, n, &registered_key_infos->key_infos[i])) {
+                    SEND_SW(dc, SW_INCORRECT_DATA);
+                    return;
+                }
+            }
+            key_infos = registered_key_infos->key_infos;
+        }
+    }
+#endif
+
     // make sure that the policy is sane (especially if it contains miniscript)
     if (0 > is_policy_sane(dc,
                            &policy_map.parsed,
                            wallet_header.version,
                            wallet_header.keys_info_merkle_root,
-                           wallet_header.n_keys)) {
+                           wallet_header.n_keys,
+                           key_infos)) {
         PRINTF("Policy is not sane\n");
 
         SEND_SW(dc, SW_NOT_SUPPORTED);
@@ -124,29 +222,41 @@ void handler_register_wallet(dispatcher_context_t *dc, uint8_t p2) {
 
     uint32_t master_key_fingerprint = crypto_get_master_key_fingerprint();
 
+#ifdef HAVE_WALLET_REGISTRY
+    // the wallet policy to store is built in the wallet session, that is not open until then
+    if (is_stored) {
+        wallet_session_close();
+    }
+#endif
+
+    // if the key informations are not cached, they are retrieved in batches
+    policy_key_info_string_t key_infos_batch[MAX_MERKLE_LEAF_ELEMENTS_BATCH];
+
     for (size_t cosigner_index = 0; cosigner_index < wallet_header.n_keys; cosigner_index++) {
         /**
          * Receives and parses the next pubkey info.
          * Asks the user to validate the pubkey info.
          */
 
-        uint8_t next_pubkey_info[MAX_POLICY_KEY_INFO_LEN + 1];
-        int pubkey_info_len = call_get_merkle_leaf_element(dc,
-                                                           wallet_header.keys_info_merkle_root,
-                                                           wallet_header.n_keys,
-                                                           cosigner_index,
-                                                           next_pubkey_info,
-                                                           MAX_POLICY_KEY_INFO_LEN);
-
-        if (pubkey_info_len < 0) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return;
+        const policy_key_info_string_t *next_pubkey_info;
+        if (key_infos != NULL) {
+            next_pubkey_info = &key_infos[cosigner_index];
+        } else {
+            size_t batch_index = cosigner_index % MAX_MERKLE_LEAF_ELEMENTS_BATCH;
+            if (batch_index == 0) {
+                size_t n =
+                    MIN(MAX_MERKLE_LEAF_ELEMENTS_BATCH, wallet_header.n_keys - cosigner_index);
+                if (0 > get_key_infos(dc, &wallet_header, cosigner_index, n, key_infos_batch)) {
+                    SEND_SW(dc, SW_INCORRECT_DATA);
+                    return;
+                }
+            }
+            next_pubkey_info = &key_infos_batch[batch_index];
         }
 
-        next_pubkey_info[pubkey_info_len] = 0;
-
         // Make a sub-buffer for the pubkey info
-        buffer_t key_info_buffer = buffer_create(next_pubkey_info, pubkey_info_len);
+        buffer_t key_info_buffer =
+            buffer_create((void *) next_pubkey_info->str, next_pubkey_info->len);
 
         policy_map_key_info_t key_info;
         if (parse_policy_map_key_info(&key_info_buffer, &key_info, wallet_header.version) == -1) {
@@ -185,12 +295,23 @@ void handler_register_wallet(dispatcher_context_t *dc, uint8_t p2) {
             }
         }
 
+#ifdef HAVE_WALLET_REGISTRY
+        if (is_stored) {
+            wallet_session_key_t *key = &G_wallet_session.keys[cosigner_index];
+            if (0 > wallet_session_decode_key(&key_info, key)) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return;
+            }
+            key->is_internal = is_key_internal;
+        }
+#endif
+
         // TODO: it would be sensible to validate the pubkey (at least syntactically + validate
         // checksum)
         //       Currently we are showing to the user whichever string is passed by the host.
 
         if (!ui_display_policy_map_cosigner_pubkey(dc,
-                                                   (char *) next_pubkey_info,
+                                                   next_pubkey_info->str,
                                                    cosigner_index,  // 1-indexed for the UI
                                                    wallet_header.n_keys,
                                                    is_key_internal)) {
@@ -230,14 +351,141 @@ void handler_register_wallet(dispatcher_context_t *dc, uint8_t p2) {
 
     compute_wallet_hmac(wallet_id, response.hmac);
 
+#ifdef HAVE_WALLET_REGISTRY
+    if (is_stored &&
+        !store_wallet(dc, &wallet_header, wallet_id, response.hmac, policy_map.bytes)) {
+        return;
+    }
+#endif
+
+#ifdef HAVE_WALLET_SESSIONS
+    if ((flags & REGISTER_WALLET_FLAG_COMPILED_POLICY) != 0 &&
+        !yield_compiled_policy(dc, wallet_id, policy_map.bytes)) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return;
+    }
+#endif
+
     SEND_RESPONSE(dc, &response, sizeof(response), SW_OK);
 }
 
+#ifdef HAVE_WALLET_SESSIONS
+/**
+ * Sends the compiled policy of the registered wallet policy to the client, in one or more YIELD
+ * client commands whose data, concatenated, is the compiled policy.
+ *
+ * @return true on success, false on failure.
+ */
+static bool yield_compiled_policy(dispatcher_context_t *dc,
+                                  const uint8_t wallet_id[static 32],
+                                  const uint8_t *policy_map_bytes) {
+    size_t tree_len = compiled_policy_get_tree_len(policy_map_bytes, MAX_WALLET_POLICY_BYTES);
+
+    uint8_t header[COMPILED_POLICY_HEADER_LEN];
+    if (!compiled_policy_compute_header(wallet_id, policy_map_bytes, tree_len, header)) {
+        return false;
+    }
+
+    // the header is sent with the first bytes of the tree
+    size_t offset = 0;
+    size_t total_len = sizeof(header) + tree_len;
+    while (offset < total_len) {
+        size_t chunk_len = MIN(COMPILED_POLICY_YIELD_CHUNK_LEN, total_len - offset);
+
+        uint8_t cmd = CCMD_YIELD;
+        dc->add_to_response(&cmd, 1);
+        if (offset < sizeof(header)) {
+            dc->add_to_response(header + offset, sizeof(header) - offset);
+            dc->add_to_response(policy_map_bytes, chunk_len - (sizeof(header) - offset));
+        } else {
+            dc->add_to_response(policy_map_bytes + offset - sizeof(header), chunk_len);
+        }
+        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+
+        if (dc->process_interruption(dc) < 0) {
+            return false;
+        }
+        offset += chunk_len;
+    }
+    return true;
+}
+#endif
+
+#ifdef HAVE_WALLET_REGISTRY
+/**
+ * Asks the user to store the registered wallet policy on the device, then stores it in the
+ * registry; the keys of the wallet policy must already be decoded in the wallet session. On
+ * success, the stored wallet policy is also the open wallet session.
+ *
+ * Returns true on success; otherwise, it sends the status word and returns false.
+ */
+static bool store_wallet(dispatcher_context_t *dc,
+                         const policy_map_wallet_header_t *wallet_header,
+                         const uint8_t wallet_id[static 32],
+                         const uint8_t wallet_hmac[static 32],
+                         const uint8_t *policy_map_bytes) {
+    if (!ui_confirm_store_wallet(dc, wallet_header)) {
+        wallet_session_close();
+        SEND_SW(dc, SW_DENY);
+        return false;
+    }
+
+    memcpy(G_wallet_session.wallet_id, wallet_id, sizeof(G_wallet_session.wallet_id));
+    memcpy(G_wallet_session.wallet_hmac, wallet_hmac, sizeof(G_wallet_session.wallet_hmac));
+    memcpy(&G_wallet_session.wallet_header, wallet_header, sizeof(G_wallet_session.wallet_header));
+    memcpy(G_wallet_session.wallet_policy_map_bytes,
+           policy_map_bytes,
+           sizeof(G_wallet_session.wallet_policy_map_bytes));
+    G_wallet_session.n_keys_decoded = wallet_header->n_keys;
+    G_wallet_session.is_open = true;
+
+    if (!wallet_registry_store()) {
+        wallet_session_close();
+        SEND_SW(dc, SW_BAD_STATE);
+        return false;
+    }
+    return true;
+}
+#endif
+
 static bool is_policy_acceptable(const policy_node_t *policy) {
     return policy->type == TOKEN_PKH || policy->type == TOKEN_WPKH || policy->type == TOKEN_SH ||
            policy->type == TOKEN_WSH || policy->type == TOKEN_TR;
 }
 
+/**
+ * Retrieves the key informations of the policy from first_index to first_index + n - 1 with a
+ * single request to the client, where n is at most MAX_MERKLE_LEAF_ELEMENTS_BATCH.
+ *
+ * @return 0 on success, a negative number on failure.
+ */
+static int get_key_infos(dispatcher_context_t *dc,
+                         const policy_map_wallet_header_t *wallet_header,
+                         uint32_t first_index,
+                         size_t n,
+                         policy_key_info_string_t out[]) {
+    merkle_leaf_element_request_t requests[MAX_MERKLE_LEAF_ELEMENTS_BATCH];
+    for (size_t i = 0; i < n; i++) {
+        requests[i].leaf_index = first_index + i;
+        requests[i].out = (uint8_t *) out[i].str;
+        requests[i].out_len = MAX_POLICY_KEY_INFO_LEN;
+    }
+
+    if (0 > call_get_merkle_leaf_elements(dc,
+                                          wallet_header->keys_info_merkle_root,
+                                          wallet_header->n_keys,
+                                          requests,
+                                          n)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        out[i].len = requests[i].element_len;
+        out[i].str[out[i].len] = 0;
+    }
+    return 0;
+}
+
 static bool is_policy_name_acceptable(const char *name, size_t name_len) {
     // between 1 and MAX_WALLET_NAME_LENGTH characters
     if (name_len == 0 || name_len > MAX_WALLET_NAME_LENGTH) return false;
@@ -27,6 +27,8 @@
 #include "../ui/display.h"
 #include "../ui/menu.h"
 #include "lib/get_merkle_leaf_element.h"
+#include "lib/stream_preimage.h"
+#include "client_commands.h"
 
 #include "handlers.h"
 
@@ -34,13 +36,141 @@ static unsigned char const BSM_SIGN_MAGIC[] = {'\x18', 'B', 'i', 't', 'c', 'o',
                                                'S',    'i', 'g', 'n', 'e', 'd', ' ', 'M', 'e',
                                                's',    's', 'a', 'g', 'e', ':', '\n'};
 
-void handler_sign_message(dispatcher_context_t *dc, uint8_t p2) {
-    (void) p2;
+// Starting from this version of the protocol, the message is committed to with its hash, instead
+// of the Merkle root of its chunks.
+#define HASHED_MESSAGE_PROTOCOL_VERSION 3
+
+typedef struct {
+    cx_sha256_t msg_hash_context;    // used to compute sha256(message)
+    cx_sha256_t bsm_digest_context;  // used to compute the Bitcoin Message Signing digest
+    uint64_t message_length;         // the message length in the command
+    uint64_t bytes_hashed;           // number of bytes of the message received so far
+} message_hash_state_t;
+
+static void hash_message_chunk(message_hash_state_t *state, const uint8_t *chunk, size_t len) {
+    crypto_hash_update(&state->msg_hash_context.header, chunk, len);
+    crypto_hash_update(&state->bsm_digest_context.header, chunk, len);
+    state->bytes_hashed += len;
+}
+
+static void message_preimage_callback(buffer_t *data, void *callback_state) {
+    message_hash_state_t *state = (message_hash_state_t *) callback_state;
+
+    size_t len = data->size - data->offset;
+    if (state->bytes_hashed + len > state->message_length) {
+        // too long; the length is checked once the whole preimage is received
+        state->bytes_hashed = state->message_length + 1;
+        return;
+    }
+    hash_message_chunk(state, buffer_get_cur(data), len);
+}
+
+// Receives the message as the preimage of message_hash with GET_PREIMAGE, streaming it in the
+// largest chunks the client sends.
+static int hash_message_from_preimage(dispatcher_context_t *dc,
+                                      const uint8_t message_hash[static 32],
+                                      message_hash_state_t *state) {
+    int len = call_stream_preimage(dc, message_hash, NULL, message_preimage_callback, state);
+    if (len < 0 || (uint64_t) len != state->message_length ||
+        state->bytes_hashed != state->message_length) {
+        return -1;
+    }
+    return 0;
+}
+
+// Receives the message as the list of its 64-byte chunks, committed to in message_merkle_root.
+static int hash_message_from_merkle_tree(dispatcher_context_t *dc,
+                                         const uint8_t message_merkle_root[static 32],
+                                         message_hash_state_t *state) {
+    size_t n_chunks = (state->message_length + 63) / 64;
+    for (unsigned int i = 0; i < n_chunks; i++) {
+        uint8_t message_chunk[64];
+        int chunk_len = call_get_merkle_leaf_element(dc,
+                                                     message_merkle_root,
+                                                     n_chunks,
+                                                     i,
+                                                     message_chunk,
+                                                     sizeof(message_chunk));
+
+        if (chunk_len < 0 || (chunk_len != 64 && i != n_chunks - 1)) {
+            return -1;
+        }
+
+        hash_message_chunk(state, message_chunk, chunk_len);
+    }
+    return 0;
+}
+
+/**
+ * Receives the message committed to in message_commitment, as specified by the protocol version
+ * p2, and computes its SHA256 hash and its Bitcoin Message Signing digest.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int compute_message_digests(dispatcher_context_t *dc,
+                                   uint8_t p2,
+                                   uint64_t message_length,
+                                   const uint8_t message_commitment[static 32],
+                                   uint8_t message_hash[static 32],
+                                   uint8_t bsm_digest[static 32]) {
+    message_hash_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.message_length = message_length;
+    cx_sha256_init(&state.msg_hash_context);
+    cx_sha256_init(&state.bsm_digest_context);
+
+    crypto_hash_update(&state.bsm_digest_context.header, BSM_SIGN_MAGIC, sizeof(BSM_SIGN_MAGIC));
+    crypto_hash_update_varint(&state.bsm_digest_context.header, message_length);
 
+    int res = p2 >= HASHED_MESSAGE_PROTOCOL_VERSION
+                  ? hash_message_from_preimage(dc, message_commitment, &state)
+                  : hash_message_from_merkle_tree(dc, message_commitment, &state);
+    if (res < 0) {
+        return -1;
+    }
+
+    crypto_hash_digest(&state.msg_hash_context.header, message_hash, 32);
+    crypto_hash_digest(&state.bsm_digest_context.header, bsm_digest, 32);
+    cx_hash_sha256(bsm_digest, 32, bsm_digest, 32);
+    return 0;
+}
+
+/**
+ * Converts a DER-encoded signature to the standard Bitcoin format, always 65 bytes long.
+ *
+ * Returns 0 on success, -1 if the signature is malformed.
+ */
+static int format_message_signature(const uint8_t sig[static MAX_DER_SIG_LEN],
+                                    uint32_t info,
+                                    uint8_t result[static 65]) {
+    memset(result, 0, 65);
+
+    // # Format signature into standard bitcoin format
+    int r_length = sig[3];
+    int s_length = sig[4 + r_length + 1];
+
+    if (r_length > 33 || s_length > 33) {
+        return -1;  // can never happen
+    }
+
+    // Write s, r, and the first byte in reverse order, as the two loops will underflow by 1
+    // byte (that needs to be discarded) when s_length and r_length (respectively) are equal
+    // to 33.
+    for (int i = s_length - 1; i >= 0; --i) {
+        result[1 + 32 + 32 - s_length + i] = sig[4 + r_length + 2 + i];
+    }
+    for (int i = r_length - 1; i >= 0; --i) {
+        result[1 + 32 - r_length + i] = sig[4 + i];
+    }
+    result[0] = 27 + 4 + ((info & CX_ECCINFO_PARITY_ODD) ? 1 : 0);
+    return 0;
+}
+
+void handler_sign_message(dispatcher_context_t *dc, uint8_t p2) {
     uint8_t bip32_path_len;
     uint32_t bip32_path[MAX_BIP32_PATH_STEPS];
     uint64_t message_length;
-    uint8_t message_merkle_root[32];
+    uint8_t message_commitment[32];  // the Merkle root of the chunks, or the hash of the message
 
     // Device must be unlocked
     if (os_global_pin_is_validated() != BOLOS_UX_OK) {
@@ -51,7 +181,7 @@ void handler_sign_message(dispatcher_context_t *dc, uint8_t p2) {
     if (!buffer_read_u8(&dc->read_buffer, &bip32_path_len) ||
         !buffer_read_bip32_path(&dc->read_buffer, bip32_path, bip32_path_len) ||
         !buffer_read_varint(&dc->read_buffer, &message_length) ||
-        !buffer_read_bytes(&dc->read_buffer, message_merkle_root, 32)) {
+        !buffer_read_bytes(&dc->read_buffer, message_commitment, 32)) {
         SEND_SW(dc, SW_WRONG_DATA_LENGTH);
         return;
     }
@@ -66,39 +196,17 @@ void handler_sign_message(dispatcher_context_t *dc, uint8_t p2) {
         bip32_path_format(bip32_path, bip32_path_len, path_str, sizeof(path_str));
     }
 
-    cx_sha256_t msg_hash_context;    // used to compute sha256(message)
-    cx_sha256_t bsm_digest_context;  // used to compute the Bitcoin Message Signing digest
-    cx_sha256_init(&msg_hash_context);
-    cx_sha256_init(&bsm_digest_context);
-
-    crypto_hash_update(&bsm_digest_context.header, BSM_SIGN_MAGIC, sizeof(BSM_SIGN_MAGIC));
-    crypto_hash_update_varint(&bsm_digest_context.header, message_length);
-
-    size_t n_chunks = (message_length + 63) / 64;
-    for (unsigned int i = 0; i < n_chunks; i++) {
-        uint8_t message_chunk[64];
-        int chunk_len = call_get_merkle_leaf_element(dc,
-                                                     message_merkle_root,
-                                                     n_chunks,
-                                                     i,
-                                                     message_chunk,
-                                                     sizeof(message_chunk));
-
-        if (chunk_len < 0 || (chunk_len != 64 && i != n_chunks - 1)) {
-            SEND_SW(dc, SW_BAD_STATE);  // should never happen
-            return;
-        }
-
-        crypto_hash_update(&msg_hash_context.header, message_chunk, chunk_len);
-        crypto_hash_update(&bsm_digest_context.header, message_chunk, chunk_len);
-    }
-
     uint8_t message_hash[32];
     uint8_t bsm_digest[32];
-
-    crypto_hash_digest(&msg_hash_context.header, message_hash, 32);
-    crypto_hash_digest(&bsm_digest_context.header, bsm_digest, 32);
-    cx_hash_sha256(bsm_digest, 32, bsm_digest, 32);
+    if (compute_message_digests(dc,
+                                p2,
+                                message_length,
+                                message_commitment,
+                                message_hash,
+                                bsm_digest) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);  // should never happen
+        return;
+    }
 
     char message_hash_str[64 + 1];
     for (int i = 0; i < 32; i++) {
@@ -125,32 +233,203 @@ void handler_sign_message(dispatcher_context_t *dc, uint8_t p2) {
         return;
     }
 
-    {
-        // convert signature to the standard Bitcoin format, always 65 bytes long
+    uint8_t result[65];
+    if (format_message_signature(sig, info, result) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);  // can never happen
+        return;
+    }
+
+    SEND_RESPONSE(dc, result, sizeof(result), SW_OK);
+}
 
-        uint8_t result[65];
-        memset(result, 0, sizeof(result));
+// Maximum length of an element of the list of messages of SIGN_MESSAGES: the BIP32 path, the
+// message length and the message commitment
+#define MAX_SIGN_MESSAGES_ENTRY_LEN (1 + 4 * MAX_BIP32_PATH_STEPS + 9 + 32)
 
-        // # Format signature into standard bitcoin format
-        int r_length = sig[3];
-        int s_length = sig[4 + r_length + 1];
+/**
+ * Signs the message of the given element of the list of SIGN_MESSAGES with the key at its path,
+ * deriving it from account_node, and yields the signature to the client.
+ *
+ * Returns true on success; otherwise, it sends the status word and returns false.
+ */
+static bool sign_messages_entry_and_yield(dispatcher_context_t *dc,
+                                          uint8_t p2,
+                                          const bip32_node_t *account_node,
+                                          const uint8_t *entry,
+                                          size_t entry_len) {
+    buffer_t entry_buf = buffer_create((void *) entry, entry_len);
 
-        if (r_length > 33 || s_length > 33) {
-            SEND_SW(dc, SW_BAD_STATE);  // can never happen
-            return;
-        }
+    uint8_t bip32_path_len;
+    uint32_t bip32_path[MAX_BIP32_PATH_STEPS];
+    uint64_t message_length;
+    uint8_t message_commitment[32];
+    if (!buffer_read_u8(&entry_buf, &bip32_path_len) || bip32_path_len > MAX_BIP32_PATH_STEPS ||
+        !buffer_read_bip32_path(&entry_buf, bip32_path, bip32_path_len) ||
+        !buffer_read_varint(&entry_buf, &message_length) ||
+        !buffer_read_bytes(&entry_buf, message_commitment, 32) || buffer_can_read(&entry_buf, 1)) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+    // all the keys are derived from the account that the user approved
+    if (message_length >= (1LL << 32) || bip32_path_len < account_node->path_len ||
+        memcmp(bip32_path, account_node->path, account_node->path_len * sizeof(uint32_t)) != 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+    uint8_t message_hash[32];  // unused
+    uint8_t bsm_digest[32];
+    if (compute_message_digests(dc,
+                                p2,
+                                message_length,
+                                message_commitment,
+                                message_hash,
+                                bsm_digest) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);  // should never happen
+        return false;
+    }
+
+    uint8_t sig[MAX_DER_SIG_LEN];
+    uint32_t info;
+    int sig_len = -1;
 
-        // Write s, r, and the first byte in reverse order, as the two loops will underflow by 1
-        // byte (that needs to be discarded) when s_length and r_length (respectively) are equal
-        // to 33.
-        for (int i = s_length - 1; i >= 0; --i) {
-            result[1 + 32 + 32 - s_length + i] = sig[4 + r_length + 2 + i];
+    bip32_node_t node;
+    memcpy(&node, account_node, sizeof(node));
+    cx_ecfp_private_key_t private_key = {0};
+    if (crypto_derive_bip32_node(&node, bip32_path, bip32_path_len) &&
+        CX_OK == cx_ecfp_init_private_key_no_throw(CX_CURVE_256K1,
+                                                   node.privkey,
+                                                   sizeof(node.privkey),
+                                                   &private_key)) {
+        sig_len = crypto_ecdsa_sign_sha256_hash_with_private_key(&private_key,
+                                                                 bsm_digest,
+                                                                 NULL,
+                                                                 sig,
+                                                                 &info);
+    }
+    explicit_bzero(&private_key, sizeof(private_key));
+    explicit_bzero(&node, sizeof(node));
+
+    uint8_t result[65];
+    if (sig_len < 0 || format_message_signature(sig, info, result) < 0) {
+        // unexpected error when signing
+        SEND_SW(dc, SW_BAD_STATE);
+        return false;
+    }
+
+    uint8_t cmd = CCMD_YIELD;
+    dc->add_to_response(&cmd, 1);
+    dc->add_to_response(result, sizeof(result));
+    dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+
+    if (dc->process_interruption(dc) < 0) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Signs the n_messages messages of the list committed to in messages_root, yielding their
+ * signatures in order. The account node is derived once, and then reused for all the messages.
+ *
+ * Returns true on success; otherwise, it sends the status word and returns false. The caller must
+ * wipe account_node in all cases.
+ */
+static bool sign_messages_and_yield(dispatcher_context_t *dc,
+                                    uint8_t p2,
+                                    const uint32_t *account_path,
+                                    uint8_t account_path_len,
+                                    uint32_t n_messages,
+                                    const uint8_t messages_root[static 32],
+                                    bip32_node_t *account_node) {
+    if (!crypto_derive_bip32_node(account_node, account_path, account_path_len)) {
+        SEND_SW(dc, SW_BAD_STATE);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n_messages; i++) {
+        uint8_t entry[MAX_SIGN_MESSAGES_ENTRY_LEN];
+        int entry_len = call_get_merkle_leaf_element(dc,
+                                                     messages_root,
+                                                     n_messages,
+                                                     i,
+                                                     entry,
+                                                     sizeof(entry));
+        if (entry_len < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return false;
         }
-        for (int i = r_length - 1; i >= 0; --i) {
-            result[1 + 32 - r_length + i] = sig[4 + i];
+
+        if (!sign_messages_entry_and_yield(dc, p2, account_node, entry, entry_len)) {
+            return false;
         }
-        result[0] = 27 + 4 + ((info & CX_ECCINFO_PARITY_ODD) ? 1 : 0);
+    }
+    return true;
+}
+
+void handler_sign_messages(dispatcher_context_t *dc, uint8_t p2) {
+    uint8_t account_path_len;
+    uint32_t account_path[MAX_BIP32_PATH_STEPS];
+    uint64_t n_messages;
+    uint8_t messages_root[32];
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    if (!buffer_read_u8(&dc->read_buffer, &account_path_len)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (account_path_len > MAX_BIP32_PATH_STEPS) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    if (!buffer_read_bip32_path(&dc->read_buffer, account_path, account_path_len) ||
+        !buffer_read_varint(&dc->read_buffer, &n_messages) ||
+        !buffer_read_bytes(&dc->read_buffer, messages_root, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (n_messages == 0 || n_messages > MAX_N_SIGNED_MESSAGES) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+
+    char path_str[MAX_SERIALIZED_BIP32_PATH_LENGTH + 1] = "(Master key)";
+    if (account_path_len > 0) {
+        bip32_path_format(account_path, account_path_len, path_str, sizeof(path_str));
+    }
+
+    char messages_root_str[64 + 1];
+    for (int i = 0; i < 32; i++) {
+        snprintf(messages_root_str + 2 * i, 3, "%02X", messages_root[i]);
+    }
+
+    if (!ui_display_messages_root(dc, path_str, (uint32_t) n_messages, messages_root_str)) {
+        SEND_SW(dc, SW_DENY);
+        return;
+    }
+
+    bip32_node_t account_node;
+    account_node.is_valid = false;
+    bool result = sign_messages_and_yield(dc,
+                                          p2,
+                                          account_path,
+                                          account_path_len,
+                                          (uint32_t) n_messages,
+                                          messages_root,
+                                          &account_node);
+    explicit_bzero(&account_node, sizeof(account_node));
 
-        SEND_RESPONSE(dc, result, sizeof(result), SW_OK);
+    if (result) {
+        SEND_SW(dc, SW_OK);
     }
 }
@@ -31,27 +31,99 @@
 #include "../commands.h"
 #include "../constants.h"
 #include "../crypto.h"
+#include "../trace.h"
+#include "../debug-helpers/debug.h"
 #include "../ui/display.h"
 #include "../ui/menu.h"
 
 #include "client_commands.h"
 
 #include "lib/policy.h"
+#include "lib/access_plan.h"
 #include "lib/check_merkle_tree_sorted.h"
 #include "lib/get_preimage.h"
 #include "lib/get_merkleized_map.h"
 #include "lib/get_merkleized_map_value.h"
 #include "lib/get_merkle_leaf_element.h"
+#include "lib/get_merkle_leaf_elements.h"
+#include "lib/get_merkle_leaf_hashes.h"
+#include "lib/get_merkle_leaf_index.h"
+#include "lib/map_commitment_cache.h"
+#include "lib/offloaded_records.h"
+#include "lib/payee_list.h"
 #include "lib/psbt_parse_rawtx.h"
+#include "lib/resume_token.h"
+#include "lib/scratch_arena.h"
+#include "lib/wallet_registry.h"
+#include "lib/wallet_session.h"
 
 #include "handlers.h"
 
 #include "sign_psbt/compare_wallet_script_at_path.h"
 #include "sign_psbt/extract_bip32_derivation.h"
+#include "sign_psbt/singlesig_wallet.h"
 #include "sign_psbt/update_hashes_with_map_value.h"
 
 #include "../swap/swap_globals.h"
 
+// Proprietary PSBT keys (see BIP-174) with which the client can send hints on the derivation of the
+// internal inputs and outputs: <0xFC> <identifier_len = 6> <"LEDGER"> <subtype>, with no keydata.
+#define PSBT_LEDGER_PROPRIETARY_KEY_LEN 9
+#define PSBT_LEDGER_PROPRIETARY_KEY(subtype) \
+    { PSBT_GLOBAL_PROPRIETARY, 6, 'L', 'E', 'D', 'G', 'E', 'R', (subtype) }
+
+// Global key, with an empty value: if present, every input or output map with a derivation of the
+// wallet policy has a PSBT_LEDGER_IN_OUT_DERIVATION_HINT, and the other BIP32 derivations are
+// ignored.
+#define PSBT_LEDGER_GLOBAL_DERIVATION_HINTS 0x00
+// Global key, with value <n_payees : varint> <payees_root : 32> <payee_list_hmac : 32>: a payee
+// list registered with REGISTER_PAYEE_LIST. The external outputs whose scriptPubKey is in the list
+// are validated together, with a single screen.
+#define PSBT_LEDGER_GLOBAL_PAYEE_LIST 0x01
+// Global key, with value <n_selected : varint> <selected_root : 32>: the root of a Merkle tree of
+// the 4-byte little-endian indexes of the inputs to sign, in strictly increasing order. The other
+// internal inputs are validated as usual, but not signed.
+#define PSBT_LEDGER_GLOBAL_INPUT_SUBSET 0x02
+// Input or output key, with value <is_change : 1> <address_index : 4 (little-endian)>: the path of
+// the wallet policy's scripts that the input or output is claimed to match.
+#define PSBT_LEDGER_IN_OUT_DERIVATION_HINT 0x00
+
+// Maximum number of PSBT_{IN,OUT}_BIP32_DERIVATION values of an input or output that are fetched
+// together with a single GET_MERKLE_LEAF_ELEMENTS, after all the keys of its map are enumerated.
+#if defined(TARGET_NANOS) && defined(SIMPLE_POLICIES_ONLY)
+#define MAX_DEFERRED_DERIVATIONS 2
+#elif defined(TARGET_NANOS)
+#define MAX_DEFERRED_DERIVATIONS 1
+#else
+#define MAX_DEFERRED_DERIVATIONS MAX_MERKLE_LEAF_ELEMENTS_BATCH
+#endif
+
+// Maximum number of wallet policies whose internal inputs are signed with a single SIGN_PSBT: the
+// wallet of the request, and the additional wallets that follow it.
+#ifdef HAVE_MULTI_WALLET_SIGNING
+#define MAX_N_WALLETS_CAN_SIGN 2
+#else
+#define MAX_N_WALLETS_CAN_SIGN 1
+#endif
+
+#ifdef HAVE_PSBT_BATCHES
+// Maximum number of PSBTs of a SIGN_PSBT_BATCH request
+#define MAX_PSBT_BATCH_SIZE 64
+
+// Maximum length of the commitments of a PSBT in the list of a SIGN_PSBT_BATCH request
+#define MAX_PSBT_COMMITMENTS_LEN (3 * 9 + 4 * 32)
+#endif
+
+// the wallet of each internal input is kept in a single bit
+_Static_assert(MAX_N_WALLETS_CAN_SIGN <= 2, "Too many wallets for the bitvector of the inputs");
+
+// A PSBT_{IN,OUT}_{TAP}?_BIP32_DERIVATION key whose value was not fetched yet
+typedef struct {
+    uint32_t index;      // the index of the key in the map
+    uint8_t key_type;    // the PSBT key type
+    uint8_t pubkey[33];  // the compressed pubkey in the keydata, or the x-only pubkey for taproot
+} deferred_derivation_t;
+
 // common info that applies to either the current input or the current output
 typedef struct {
     merkleized_map_commitment_t map;
@@ -61,10 +133,22 @@ typedef struct {
                                    // PSBT_{IN,OUT}_TAP_BIP32_DERIVATION is not the correct length.
 
     bool placeholder_found;  // Set to true if a matching placeholder is found in the input info
+    // The index of the matching placeholder in the array of the placeholders being matched, or -1
+    // if the derivation is from the derivation hint
+    int matched_placeholder;
 
     bool is_change;
     int address_index;
 
+    // Set to true if the map has a PSBT_LEDGER_IN_OUT_DERIVATION_HINT, whose index is
+    // derivation_hint_index
+    bool has_derivation_hint;
+    int derivation_hint_index;
+
+    // The BIP32 derivations whose values are fetched after the keys are enumerated
+    uint8_t n_deferred_derivations;
+    deferred_derivation_t deferred_derivations[MAX_DEFERRED_DERIVATIONS];
+
     // For an output, its scriptPubKey
     // for an input, the prevout's scriptPubKey (either from the non-witness-utxo, or from the
     // witness-utxo)
@@ -93,6 +177,8 @@ typedef struct {
     size_t script_len;
 
     uint32_t sighash_type;
+
+    int segwit_version;  // -1 for legacy inputs
 } input_info_t;
 
 typedef struct {
@@ -101,6 +187,7 @@ typedef struct {
 } output_info_t;
 
 typedef struct {
+    unsigned int wallet_index;  // the index of the wallet of the placeholder in the wallets
     policy_node_key_placeholder_t placeholder;
     int cur_index;
     uint32_t fingerprint;
@@ -111,6 +198,145 @@ typedef struct {
     uint8_t tapleaf_hash[32];  // only used for tapscripts
 } placeholder_info_t;
 
+// The sighash of the last signature of an input, reused for its next placeholders: it only depends
+// on the input for legacy and segwit v0 inputs, and also on whether it is a script path spend and
+// on the leaf hash for taproot inputs
+typedef struct {
+    bool is_valid;
+    bool is_tapscript;
+    uint8_t tapleaf_hash[32];
+    uint8_t sighash[32];
+} input_sighash_cache_t;
+
+// The private keys of the internal placeholder being used for signing, derived once per placeholder
+// so that each input only requires the final unhardened derivation step.
+// IMPORTANT: it contains secrets, and must be wiped with explicit_bzero after use.
+typedef struct {
+    // private key at the path in the key origin; the chain code and pubkey are in the
+    // placeholder_info_t's pubkey
+    uint8_t account_privkey[32];
+
+    // nodes at the /<NUM_a> (index 0) and /<NUM_b> (index 1) paths, derived when first needed;
+    // if has_change_pubkey is set, the chain code and pubkey were already derived from the xpub of
+    // the account, and only the private key is derived from account_privkey
+    bool has_change_node[2];
+    bool has_change_pubkey[2];
+    uint8_t change_privkey[2][32];
+    uint8_t change_chain_code[2][32];
+    uint8_t change_pubkey[2][33];
+
+    // BIP-340 signing key of the last input signed with schnorr for this placeholder, after the
+    // BIP-341 tweak for key-path spends, and the corresponding x-only pubkey. Since the taptree
+    // hash only depends on the derivation, it is reused for all the inputs at the same
+    // /<change>/<address_index>.
+    bool has_schnorr_key;
+    bool schnorr_key_is_change;
+    uint32_t schnorr_key_address_index;
+    uint8_t schnorr_seckey[32];
+    uint8_t schnorr_xonly_pubkey[32];
+} placeholder_signing_keys_t;
+
+#ifdef HAVE_BACKGROUND_TASKS
+// The public /<change> nodes of the first internal placeholder, derived from the xpub of the
+// account by a background task while the user reviews the transaction, so that deriving the
+// signing keys after the approval does not compute their pubkeys. It only contains public data: no
+// private key is derived before the user approves the transaction.
+typedef struct {
+    placeholder_info_t placeholder_info;  // the placeholder found in preprocess_inputs
+    bool needs_change_node[2];            // whether internal inputs are at /<NUM_a> or /<NUM_b>
+    bool has_change_node[2];
+    int n_steps_done;
+    serialized_extended_pubkey_t change_nodes[2];
+} signing_keys_prefetch_t;
+#endif
+
+// Maximum number of internal inputs whose derivation info is kept from the preprocessing to the
+// signing phase; for the following internal inputs, it is extracted again when signing.
+#ifdef TARGET_NANOS
+#define MAX_INTERNAL_INPUT_RECORDS 8
+#else
+#define MAX_INTERNAL_INPUT_RECORDS 64
+#endif
+
+// Maximum number of internal placeholders that are used together when signing; each internal
+// input map is fetched once for each batch of placeholders.
+#ifdef TARGET_NANOS
+#define MAX_SIGNING_PLACEHOLDERS_BATCH 1
+#else
+#define MAX_SIGNING_PLACEHOLDERS_BATCH 4
+#endif
+
+#ifdef TARGET_NANOS
+#define LEGACY_SIGHASH_MAX_CACHED_INPUTS  1
+#define LEGACY_SIGHASH_OUTPUTS_CACHE_SIZE 64
+#else
+#define LEGACY_SIGHASH_MAX_CACHED_INPUTS  24
+#define LEGACY_SIGHASH_OUTPUTS_CACHE_SIZE 256
+#endif
+
+// The derivation of an internal input, as detected in preprocess_inputs
+typedef struct {
+    uint32_t address_index;
+    bool is_change;
+    uint8_t wallet_index;  // the index of the wallet of the input in the wallets
+} internal_input_record_t;
+
+// The records of the first internal inputs, in the order of the inputs
+typedef struct {
+    unsigned int n_records;
+    internal_input_record_t records[MAX_INTERNAL_INPUT_RECORDS];
+} internal_input_records_t;
+
+#ifdef HAVE_GROUPED_SIGNING_ORDER
+// The order in which the internal inputs of a wallet are signed, with the position of the record of
+// each input in the internal_input_records_t
+typedef struct {
+    unsigned int n_inputs;
+    uint16_t input_index[MAX_INTERNAL_INPUT_RECORDS];
+    uint8_t record_index[MAX_INTERNAL_INPUT_RECORDS];
+} signing_order_t;
+#endif
+
+// The data of an input that is part of the legacy sighash, except for the scriptCode
+typedef struct {
+    uint8_t prevout[32 + 4];  // prevout hash and output index
+    uint8_t nSequence[4];
+} legacy_input_record_t;
+
+// Parts of the legacy sighash preimage that are shared by all the legacy inputs, so that they are
+// not requested again from the host for each input being signed.
+typedef struct {
+    bool is_initialized;
+
+    // hash context updated with nVersion, the number of inputs, and the first prefix_n_inputs
+    // inputs with an empty scriptCode; inputs are signed in increasing order, therefore it can be
+    // extended from one input to the next.
+    cx_sha256_t prefix_context;
+    unsigned int prefix_n_inputs;
+
+    // records of the last inputs of the transaction (valid after the first sighash is computed)
+    bool has_cached_inputs;
+    unsigned int first_cached_input;
+    legacy_input_record_t cached_inputs[LEGACY_SIGHASH_MAX_CACHED_INPUTS];
+
+    // serialization of the number of outputs and of all the outputs, filled in process_outputs;
+    // 0 if not yet computed, -1 if too long to be cached
+    int outputs_len;
+    uint8_t outputs[LEGACY_SIGHASH_OUTPUTS_CACHE_SIZE];
+} legacy_sighash_cache_t;
+
+#ifdef HAVE_SIGHASH_MIDSTATES
+// The hash context of the sighash of the last segwit input of a given version that was signed,
+// after absorbing the start of its preimage, that only depends on the sighash type: nVersion,
+// hashPrevouts and hashSequence for BIP143; the tag, the sighash type, nVersion, nLocktime and the
+// tx-wide hashes for BIP341. The next inputs with the same sighash type start from a copy of it.
+typedef struct {
+    bool is_valid;
+    uint32_t sighash_type;
+    cx_sha256_t context;
+} sighash_midstate_t;
+#endif
+
 // Cache for partial hashes during segwit signing (avoid quadratic hashing for segwit transactions)
 typedef struct {
     uint8_t sha_prevouts[32];
@@ -118,8 +344,119 @@ typedef struct {
     uint8_t sha_scriptpubkeys[32];
     uint8_t sha_sequences[32];
     uint8_t sha_outputs[32];
+#ifdef HAVE_SIGHASH_MIDSTATES
+    sighash_midstate_t sighash_midstates[2];  // for segwit version 0 and 1
+#endif
 } segwit_hashes_t;
 
+// Number of outputs, starting from the first one, whose hash is kept for the inputs signed with
+// SIGHASH_SINGLE; each of these inputs commits to the output with the same index.
+#ifdef TARGET_NANOS
+#define SINGLE_OUTPUT_HASHES_CACHE_SIZE 1
+#else
+#define SINGLE_OUTPUT_HASHES_CACHE_SIZE 8
+#endif
+
+// The hashes of the outputs that are needed by the inputs signed with SIGHASH_SINGLE, computed in
+// process_outputs, so that the outputs are not fetched again when signing
+typedef struct {
+    uint32_t needed;  // bit i is set if input i has SIGHASH_SINGLE, for i < the size of the cache
+    uint32_t cached;  // bit i is set if hashes[i] is computed
+    uint8_t hashes[SINGLE_OUTPUT_HASHES_CACHE_SIZE][32];  // SHA256 of the serialization of output i
+} single_output_hashes_t;
+
+_Static_assert(SINGLE_OUTPUT_HASHES_CACHE_SIZE <= 32, "The bitmaps of the cache are too small");
+
+#ifdef USE_SINGLE_PASS_SEGWIT_HASHES
+// Hash contexts for the tx-wide hashes that only depend on the inputs; they are accumulated while
+// preprocessing the inputs, in order to avoid another pass over all the inputs before signing
+typedef struct {
+    cx_sha256_t sha_prevouts_context;
+    cx_sha256_t sha_amounts_context;
+    cx_sha256_t sha_scriptpubkeys_context;
+    cx_sha256_t sha_sequences_context;
+} inputs_hashes_contexts_t;
+#endif
+
+// Number of scriptPubKeys of internal inputs and outputs whose derivation is kept, so that the
+// wallet's script is not derived again for other inputs or outputs with the same scriptPubKey.
+#ifdef TARGET_NANOS
+#define INTERNAL_SCRIPTS_CACHE_SIZE 2
+#else
+#define INTERNAL_SCRIPTS_CACHE_SIZE 8
+#endif
+
+// A scriptPubKey that was verified to be the wallet's script at the given change and address index
+typedef struct {
+    bool is_valid;
+    bool is_change;
+    uint8_t wallet_index;  // the index of the wallet in the wallets
+    uint32_t address_index;
+    uint8_t script_hash[32];  // sha256 of the scriptPubKey
+} internal_script_t;
+
+// The most recently verified internal scriptPubKeys, most recently used first
+typedef struct {
+    internal_script_t entries[INTERNAL_SCRIPTS_CACHE_SIZE];
+} internal_scripts_cache_t;
+
+// The outputs extracted when parsing the non-witness-utxo of an input; they include the outputs
+// spent by the following inputs that spend the same previous transaction, so that each previous
+// transaction is streamed and hashed only once for all of them.
+typedef struct {
+    bool is_valid;
+    txid_parser_outputs_t outputs;
+} prevtx_outputs_cache_t;
+
+// A wallet policy whose internal inputs are signed
+typedef struct {
+    union {
+        uint8_t policy_map_bytes[MAX_WALLET_POLICY_BYTES];
+        policy_node_t policy_map;
+    };
+
+    int header_version;
+    uint8_t header_keys_info_merkle_root[32];
+    size_t header_n_keys;
+
+    bool is_canonical;
+
+    // the key placeholders of policy_map, built once after parsing the policy
+    key_placeholders_table_t key_placeholders;
+
+#ifdef HAVE_SINGLESIG_FAST_PATH
+    // for canonical single-signature wallets, the scripts of the inputs and outputs are computed
+    // from the account's pubkey instead of walking the policy; selected in preprocess_inputs
+    bool use_singlesig_wallet;
+    singlesig_wallet_t singlesig_wallet;
+#endif
+} sign_psbt_wallet_t;
+
+// Version of the protocol (P2 of the command) from which the progress of each phase is reported to
+// the client
+#define PROGRESS_PROTOCOL_VERSION 7
+
+// The phases of SIGN_PSBT reported in the CCMD_PROGRESS messages
+typedef enum {
+    PROGRESS_PHASE_INPUTS = 1,         // preprocess_inputs; the items are the inputs
+    PROGRESS_PHASE_SEGWIT_HASHES = 2,  // compute_segwit_hashes; the items are the inputs
+    PROGRESS_PHASE_OUTPUTS = 3,        // process_outputs; the items are the outputs
+    PROGRESS_PHASE_SIGNING = 4,        // sign_transaction; the items are the internal inputs
+} progress_phase_e;
+
+#ifdef HAVE_SIGN_PSBT_DRY_RUN
+// The phases of SIGN_PSBT whose ticks are returned by SIGN_PSBT_DRY_RUN
+typedef enum {
+    SIGN_PSBT_PHASE_INIT,     // init_global_state, including the verification of the wallets
+    SIGN_PSBT_PHASE_INPUTS,   // preprocess_inputs
+    SIGN_PSBT_PHASE_OUTPUTS,  // process_outputs and the confirmation of the transaction
+    SIGN_PSBT_PHASE_SIGNING,  // sign_transaction, only computing the sighashes
+    SIGN_PSBT_N_PHASES
+} sign_psbt_phase_e;
+
+extern uint16_t G_ticks;
+#endif
+
 typedef struct {
     uint32_t master_key_fingerprint;
     uint32_t tx_version;
@@ -137,18 +474,47 @@ typedef struct {
 
     uint64_t change_outputs_total_value;
 
-    bool is_wallet_canonical;
+    // set if the global map has PSBT_LEDGER_GLOBAL_DERIVATION_HINTS
+    bool has_derivation_hints;
+
+    // indexes in the global map of the PSBT_GLOBAL_TX_VERSION and PSBT_GLOBAL_FALLBACK_LOCKTIME
+    // keys, or -1 if missing
+    int tx_version_key_index;
+    int fallback_locktime_key_index;
+
+#ifdef HAVE_OFFLOADED_RECORDS
+    // if there are more than MAX_N_INPUTS_CAN_SIGN inputs, the session of the offloaded records of
+    // the inputs; NULL otherwise
+    const offloaded_records_session_t *offloaded_input_records;
+#endif
+
+#ifdef HAVE_PAYEE_LISTS
+    // index in the global map of the PSBT_LEDGER_GLOBAL_PAYEE_LIST key, or -1 if missing
+    int payee_list_key_index;
+    // set if the global map has a PSBT_LEDGER_GLOBAL_PAYEE_LIST with a valid hmac
+    bool has_payee_list;
+    uint32_t payee_list_size;
+    uint8_t payee_list_root[32];
+
+    int payee_outputs_count;            // count of external outputs to a payee of the list
+    uint64_t payee_outputs_total_value;  // total value of the outputs to a payee of the list
+#endif
+
+    // index in the global map of the PSBT_LEDGER_GLOBAL_INPUT_SUBSET key, or -1 if missing
+    int input_subset_key_index;
+    // set if only the inputs in the subset of the PSBT_LEDGER_GLOBAL_INPUT_SUBSET are signed
+    bool has_input_subset;
+    uint32_t input_subset_size;
+    uint8_t input_subset_root[32];
 
     uint8_t p2;
 
-    union {
-        uint8_t wallet_policy_map_bytes[MAX_WALLET_POLICY_BYTES];
-        policy_node_t wallet_policy_map;
-    };
+    // the wallet of the request, followed by the additional wallets, if any
+    unsigned int n_wallets;
+    sign_psbt_wallet_t wallets[MAX_N_WALLETS_CAN_SIGN];
 
-    int wallet_header_version;
-    uint8_t wallet_header_keys_info_merkle_root[32];
-    size_t wallet_header_n_keys;
+    // true if all the wallets are taproot policies
+    bool are_wallets_taproot;
 
     // if any segwitv0 input is missing the non-witness-utxo, we show a warning
     bool show_missing_nonwitnessutxo_warning;
@@ -156,12 +522,142 @@ typedef struct {
     // if any of the internal inputs has non-default sighash, we show a warning
     bool show_nondefault_sighash_warning;
 
+    // set if the request has the optional fields to resume an interrupted session; the token of
+    // the session is then yielded after the user approves the transaction
+    bool is_resumable;
+    // set if the request has the token of a session approved by the user, that is not asked to
+    // approve the same transaction again
+    bool is_resumed;
+    uint8_t session_hash[32];  // hash of the request, without the fields to resume the session
+    // number of signatures received by the client before the interruption, that are skipped
+    uint32_t n_signatures_to_skip;
+    uint32_t n_signatures;  // number of signatures yielded or skipped so far
+
+#ifdef HAVE_SIGN_PSBT_DRY_RUN
+    // set in SIGN_PSBT_DRY_RUN, that processes the PSBT as if approved, without signing it
+    bool is_dry_run;
+    uint16_t phase_start_tick;                 // G_ticks when the current phase started
+    uint16_t phase_ticks[SIGN_PSBT_N_PHASES];  // ticks of each of the phases
+#endif
+
+#ifdef HAVE_PSBT_BATCHES
+    // set if the PSBT is part of a SIGN_PSBT_BATCH request; its signatures are then yielded with
+    // the index of the PSBT in the batch, and the transactions are confirmed all at once
+    bool is_batch;
+    uint32_t batch_index;
+#endif
+
+    unsigned int internal_inputs_count;  // count of the inputs detected as internal
+
+#if MAX_N_WALLETS_CAN_SIGN > 1
+    // bit i is set if the input i is internal to the second wallet; if the records of the inputs
+    // are offloaded, the wallet is in the record instead
+    uint8_t second_wallet_inputs[BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)];
+#endif
+
+#ifndef USE_SINGLE_PASS_SEGWIT_HASHES
+    // if any of the internal inputs is a taproot input, sha_amounts and sha_scriptpubkeys are
+    // needed for the BIP341 sighash
+    bool has_internal_segwitv1_inputs;
+#endif
+
+    // if any of the internal inputs is a legacy or a P2SH input, as detected from its scriptPubKey
+    bool has_internal_legacy_inputs;
+
+    // the hashes of the outputs for the inputs signed with SIGHASH_SINGLE; never NULL
+    single_output_hashes_t *single_output_hashes;
+
     int external_outputs_count;  // count of external outputs that are shown to the user
     int change_count;            // count of outputs compatible with change outputs
+
+    // cache of the derivations of the wallet policies' keys, shared by all the inputs and outputs;
+    // it only keeps the keys of one wallet at a time
+    derived_pubkeys_cache_t derived_pubkeys_cache;
+
+    // outputs of the last previous transaction parsed from a non-witness-utxo
+    prevtx_outputs_cache_t prevtx_outputs_cache;
+
+    // scriptPubKeys of the inputs and outputs already verified to be internal
+    internal_scripts_cache_t internal_scripts_cache;
+
+#ifdef HAVE_BACKGROUND_TASKS
+    signing_keys_prefetch_t *signing_keys_prefetch;
+#endif
 } sign_psbt_state_t;
 
-/* BIP0341 tags for computing the tagged hashes when computing he sighash */
-static const uint8_t BIP0341_sighash_tag[] = {'T', 'a', 'p', 'S', 'i', 'g', 'h', 'a', 's', 'h'};
+#ifdef HAVE_SIGN_PSBT_DRY_RUN
+// In a dry run, records the ticks of the phase that ends now, and starts the next one
+static void end_dry_run_phase(sign_psbt_state_t *st, sign_psbt_phase_e phase) {
+    if (st->is_dry_run) {
+        st->phase_ticks[phase] = G_ticks - st->phase_start_tick;
+        st->phase_start_tick = G_ticks;
+    }
+}
+#define END_DRY_RUN_PHASE(st, phase) end_dry_run_phase((st), (phase))
+#else
+#define END_DRY_RUN_PHASE(st, phase)
+#endif
+
+/**
+ * From version 7 of the protocol, queues a CCMD_PROGRESS message in the response, as the YIELD
+ * messages of the signatures, reporting that n_done of the n_total items of the phase are
+ * processed.
+ * The messages at the start and at the end of a phase (is_boundary) are always sent, in an
+ * interruption of their own if there is not enough space left in the response for the next client
+ * command, while the other ones are dropped in that case.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
+static bool __attribute__((noinline)) yield_progress(dispatcher_context_t *dc,
+                                                     const sign_psbt_state_t *st,
+                                                     progress_phase_e phase,
+                                                     uint32_t n_done,
+                                                     uint32_t n_total,
+                                                     bool is_boundary) {
+    if (st->p2 < PROGRESS_PROTOCOL_VERSION) {
+        return true;
+    }
+
+    uint8_t msg[2 + 1 + 5 + 5];
+    msg[0] = CCMD_PROGRESS;
+    msg[2] = (uint8_t) phase;
+    size_t msg_len = 3;
+    msg_len += varint_write(msg, msg_len, n_done);
+    msg_len += varint_write(msg, msg_len, n_total);
+    msg[1] = (uint8_t) (msg_len - 2);
+
+    if (dc->get_response_space() < msg_len + MAX_CLIENT_COMMAND_REQUEST_LEN) {
+        if (!is_boundary) {
+            return true;
+        }
+
+        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+        if (dc->process_interruption(dc) < 0) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return false;
+        }
+    }
+
+    dc->add_to_response(msg, msg_len);
+    return true;
+}
+
+// Returns true if the PSBT is part of a SIGN_PSBT_BATCH request
+static inline bool is_batch_psbt(const sign_psbt_state_t *st) {
+#ifdef HAVE_PSBT_BATCHES
+    return st->is_batch;
+#else
+    (void) st;
+    return false;
+#endif
+}
+
+// Leaf hashes of a batch of consecutive inputs, fetched with a single multiproof
+typedef struct {
+    unsigned int first_index;  // index of the input corresponding to hashes[0]
+    unsigned int n_hashes;     // number of valid hashes; 0 if nothing was fetched yet
+    uint8_t hashes[MAX_MERKLE_LEAF_HASHES_BATCH][32];
+} inputs_leaf_hashes_batch_t;
 
 /*
 Current assumptions during signing:
@@ -177,12 +673,15 @@ the right paths to identify internal inputs/outputs.
 */
 
 // HELPER FUNCTIONS
-// Updates the hash_context with the output of given index
-// returns -1 on error. 0 on success.
-static int hash_output_n(dispatcher_context_t *dc,
-                         sign_psbt_state_t *st,
-                         cx_hash_t *hash_context,
-                         unsigned int index) {
+// Maximum length of the network serialization of an output (the scriptPubKey's length is 1 byte)
+#define MAX_SERIALIZED_OUTPUT_LEN (8 + 1 + MAX_OUTPUT_SCRIPTPUBKEY_LEN)
+
+// Computes the network serialization of the output of given index
+// returns -1 on error, the length of the serialization on success.
+static int serialize_output_n(dispatcher_context_t *dc,
+                              sign_psbt_state_t *st,
+                              unsigned int index,
+                              uint8_t out[static MAX_SERIALIZED_OUTPUT_LEN]) {
     if (index >= st->n_outputs) {
         return -1;
     }
@@ -195,48 +694,81 @@ static int hash_output_n(dispatcher_context_t *dc,
         return -1;
     }
 
-    // get output's amount
-    uint8_t amount_raw[8];
-    if (8 != call_get_merkleized_map_value(dc,
-                                           &ith_map,
-                                           (uint8_t[]){PSBT_OUT_AMOUNT},
-                                           1,
-                                           amount_raw,
-                                           8)) {
+    // get output's amount and scriptPubKey
+    merkleized_map_value_request_t requests[] = {
+        {(uint8_t[]){PSBT_OUT_AMOUNT}, 1, out, 8},
+        {(uint8_t[]){PSBT_OUT_SCRIPT}, 1, out + 8 + 1, MAX_OUTPUT_SCRIPTPUBKEY_LEN}};
+    if (0 > call_get_merkleized_map_values(dc, &ith_map, requests, 2) ||
+        requests[0].value_len != 8 || requests[1].value_len < 0) {
         return -1;
     }
 
-    crypto_hash_update(hash_context, amount_raw, 8);
-
-    // get output's scriptPubKey
+    int out_script_len = requests[1].value_len;
+    out[8] = (uint8_t) out_script_len;  // a 1-byte varint, as out_script_len < 0xFD
+    return 8 + 1 + out_script_len;
+}
 
-    uint8_t out_script[MAX_OUTPUT_SCRIPTPUBKEY_LEN];
-    int out_script_len = call_get_merkleized_map_value(dc,
-                                                       &ith_map,
-                                                       (uint8_t[]){PSBT_OUT_SCRIPT},
-                                                       1,
-                                                       out_script,
-                                                       sizeof(out_script));
-    if (out_script_len == -1) {
+// Updates the hash_context with the output of given index
+// returns -1 on error. 0 on success.
+static int hash_output_n(dispatcher_context_t *dc,
+                         sign_psbt_state_t *st,
+                         cx_hash_t *hash_context,
+                         unsigned int index) {
+    uint8_t serialized_output[MAX_SERIALIZED_OUTPUT_LEN];
+    int serialized_output_len = serialize_output_n(dc, st, index, serialized_output);
+    if (serialized_output_len < 0) {
         return -1;
     }
 
-    crypto_hash_update_varint(hash_context, out_script_len);
-    crypto_hash_update(hash_context, out_script, out_script_len);
+    crypto_hash_update(hash_context, serialized_output, serialized_output_len);
     return 0;
 }
 
-// Updates the hash_context with the network serialization of all the outputs
+// Computes the SHA256 of the serialization of the output of given index, for an input signed with
+// SIGHASH_SINGLE; the output is only fetched again if its hash was not kept in process_outputs.
 // returns -1 on error. 0 on success.
-static int hash_outputs(dispatcher_context_t *dc, sign_psbt_state_t *st, cx_hash_t *hash_context) {
-    for (unsigned int i = 0; i < st->n_outputs; i++) {
-        if (hash_output_n(dc, st, hash_context, i)) {
-            return -1;
-        }
+static int get_single_output_hash(dispatcher_context_t *dc,
+                                  sign_psbt_state_t *st,
+                                  unsigned int index,
+                                  uint8_t out[static 32]) {
+    const single_output_hashes_t *single_output_hashes = st->single_output_hashes;
+    if (index < SINGLE_OUTPUT_HASHES_CACHE_SIZE && (single_output_hashes->cached >> index) & 1) {
+        memcpy(out, single_output_hashes->hashes[index], 32);
+        return 0;
     }
+
+    cx_sha256_t sha_output_context;
+    cx_sha256_init(&sha_output_context);
+    if (hash_output_n(dc, st, &sha_output_context.header, index) == -1) {
+        return -1;
+    }
+    crypto_hash_digest(&sha_output_context.header, out, 32);
     return 0;
 }
 
+// Gets the outpoint (32-byte prevout hash, 4-byte output index) and the nSequence of an input
+// with a single request of the values to the client.
+// returns false on error, true on success.
+static bool get_input_outpoint_and_sequence(dispatcher_context_t *dc,
+                                            const merkleized_map_commitment_t *input_map,
+                                            uint8_t prevout[static 32 + 4],
+                                            uint8_t nSequence[static 4]) {
+    merkleized_map_value_request_t requests[] = {
+        {(uint8_t[]){PSBT_IN_PREVIOUS_TXID}, 1, prevout, 32},
+        {(uint8_t[]){PSBT_IN_OUTPUT_INDEX}, 1, prevout + 32, 4},
+        {(uint8_t[]){PSBT_IN_SEQUENCE}, 1, nSequence, 4}};
+    if (0 > call_get_merkleized_map_values(dc, input_map, requests, 3) ||
+        requests[0].value_len != 32 || requests[1].value_len != 4) {
+        return false;
+    }
+
+    if (requests[2].value_len != 4) {
+        // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
+        memset(nSequence, 0xFF, 4);
+    }
+    return true;
+}
+
 static int get_segwit_version(const uint8_t scriptPubKey[], int scriptPubKey_len) {
     if (scriptPubKey_len <= 1) {
         return -1;
@@ -251,20 +783,79 @@ static int get_segwit_version(const uint8_t scriptPubKey[], int scriptPubKey_len
     return -1;
 }
 
+/**
+ * Looks at the inputs following the one with index input_index, appending to outputs->vout_indexes
+ * the output indexes spent by the ones that spend the transaction with the given txid. It stops at
+ * the first input that spends a different transaction, or when MAX_PARSED_VOUTS outputs are
+ * requested.
+ *
+ * The input maps are not validated, as the results are only used as hints: cached outputs are only
+ * used for inputs whose prevout txid and output index match.
+ */
+static void __attribute__((noinline)) add_next_inputs_prevouts(dispatcher_context_t *dc,
+                                                               sign_psbt_state_t *st,
+                                                               unsigned int input_index,
+                                                               const uint8_t txid[static 32],
+                                                               txid_parser_outputs_t *outputs) {
+    STACK_PROFILING_FRAME();
+
+    for (unsigned int i = input_index + 1;
+         i < st->n_inputs && outputs->n_vouts < MAX_PARSED_VOUTS;
+         i++) {
+        merkleized_map_commitment_t ith_map;
+        uint8_t ith_prevout_hash[32];
+        uint32_t ith_prevout_n;
+
+        if (0 > call_get_merkleized_map_unchecked(dc, st->inputs_root, st->n_inputs, i, &ith_map) ||
+            32 != call_get_merkleized_map_value(dc,
+                                                &ith_map,
+                                                (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
+                                                1,
+                                                ith_prevout_hash,
+                                                32) ||
+            memcmp(ith_prevout_hash, txid, 32) != 0 ||
+            4 != call_get_merkleized_map_value_u32_le(dc,
+                                                      &ith_map,
+                                                      (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
+                                                      1,
+                                                      &ith_prevout_n)) {
+            break;
+        }
+
+        bool is_new = true;
+        for (unsigned int j = 0; j < outputs->n_vouts; j++) {
+            if (outputs->vout_indexes[j] == ith_prevout_n) {
+                is_new = false;
+                break;
+            }
+        }
+        if (is_new) {
+            outputs->vout_indexes[outputs->n_vouts++] = ith_prevout_n;
+        }
+    }
+}
+
 /*
  Convenience function to get the amount and scriptpubkey from the non-witness-utxo of a certain
  input in a PSBTv2.
- If expected_prevout_hash is not NULL, the function fails if the txid computed from the
- non-witness-utxo does not match the one pointed by expected_prevout_hash. Returns -1 on failure, 0
- on success.
+ The function fails if the txid computed from the non-witness-utxo does not match the prevout hash
+ of the input; if expected_prevout_hash is not NULL, it is used as the prevout hash, otherwise it is
+ fetched from the input map.
+ The outputs of the parsed transaction that are spent by the following inputs are kept in
+ st->prevtx_outputs_cache, and reused without parsing the transaction again.
+ Returns -1 on failure, 0 on success.
 */
 static int __attribute__((noinline)) get_amount_scriptpubkey_from_psbt_nonwitness(
     dispatcher_context_t *dc,
+    sign_psbt_state_t *st,
+    unsigned int input_index,
     const merkleized_map_commitment_t *input_map,
     uint64_t *amount,
     uint8_t scriptPubKey[static MAX_PREVOUT_SCRIPTPUBKEY_LEN],
     size_t *scriptPubKey_len,
     const uint8_t *expected_prevout_hash) {
+    STACK_PROFILING_FRAME();
+
     // If there is no witness-utxo, it must be the case that this is a legacy input.
     // In this case, we can only retrieve the prevout amount and scriptPubKey by parsing
     // the non-witness-utxo
@@ -279,31 +870,95 @@ static int __attribute__((noinline)) get_amount_scriptpubkey_from_psbt_nonwitnes
         return -1;
     }
 
-    txid_parser_outputs_t parser_outputs;
-    // request non-witness utxo, and get the prevout's value and scriptpubkey
-    int res = call_psbt_parse_rawtx(dc,
-                                    input_map,
-                                    (uint8_t[]){PSBT_IN_NON_WITNESS_UTXO},
-                                    1,
-                                    prevout_n,
-                                    &parser_outputs);
-    if (res < 0) {
-        PRINTF("Parsing rawtx failed\n");
+    uint8_t prevout_hash[32];
+    if (expected_prevout_hash != NULL) {
+        memcpy(prevout_hash, expected_prevout_hash, 32);
+    } else if (32 != call_get_merkleized_map_value(dc,
+                                                   input_map,
+                                                   (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
+                                                   1,
+                                                   prevout_hash,
+                                                   32)) {
         return -1;
     }
 
-    // if expected_prevout_hash is given, check that it matches the txid obtained from the parser
-    if (expected_prevout_hash != NULL &&
-        memcmp(parser_outputs.txid, expected_prevout_hash, 32) != 0) {
-        PRINTF("Prevout hash did not match non-witness-utxo transaction hash\n");
+    prevtx_outputs_cache_t *cache = &st->prevtx_outputs_cache;
 
+    int vout_pos = -1;
+    if (cache->is_valid && memcmp(cache->outputs.txid, prevout_hash, 32) == 0) {
+        for (unsigned int i = 0; i < cache->outputs.n_vouts; i++) {
+            if (cache->outputs.vout_indexes[i] == prevout_n) {
+                vout_pos = i;
+                break;
+            }
+        }
+    }
+
+    if (vout_pos == -1) {
+        cache->is_valid = false;
+        cache->outputs.n_vouts = 1;
+        cache->outputs.vout_indexes[0] = prevout_n;
+
+        add_next_inputs_prevouts(dc, st, input_index, prevout_hash, &cache->outputs);
+
+        // request non-witness utxo, and get the prevout's value and scriptpubkey
+        int res = call_psbt_parse_rawtx(dc,
+                                        input_map,
+                                        (uint8_t[]){PSBT_IN_NON_WITNESS_UTXO},
+                                        1,
+                                        &cache->outputs);
+        if (res < 0) {
+            PRINTF("Parsing rawtx failed\n");
+            return -1;
+        }
+
+        // check that the prevout hash matches the txid obtained from the parser
+        if (memcmp(cache->outputs.txid, prevout_hash, 32) != 0) {
+            PRINTF("Prevout hash did not match non-witness-utxo transaction hash\n");
+
+            return -1;
+        }
+
+        cache->is_valid = true;
+        vout_pos = 0;
+    }
+
+    const txid_parser_vout_t *vout = &cache->outputs.vouts[vout_pos];
+    *amount = vout->value;
+    *scriptPubKey_len = vout->scriptpubkey_len;
+    memcpy(scriptPubKey, vout->scriptpubkey, vout->scriptpubkey_len);
+
+    return 0;
+}
+
+// Maximum length of the value of a PSBT_IN_WITNESS_UTXO
+#define MAX_WITNESS_UTXO_LEN (8 + 1 + MAX_PREVOUT_SCRIPTPUBKEY_LEN)
+
+/*
+ Parses the amount and scriptpubkey from the value of the witness-utxo of an input.
+ Returns -1 on failure (including if wit_utxo_len is negative), 0 on success.
+*/
+static int parse_witness_utxo(const uint8_t raw_witnessUtxo[static MAX_WITNESS_UTXO_LEN],
+                              int wit_utxo_len,
+                              uint64_t *amount,
+                              uint8_t scriptPubKey[static MAX_PREVOUT_SCRIPTPUBKEY_LEN],
+                              size_t *scriptPubKey_len) {
+    if (wit_utxo_len < 9) {
+        return -1;
+    }
+    int wit_utxo_scriptPubkey_len = raw_witnessUtxo[8];
+
+    if (wit_utxo_len != 8 + 1 + wit_utxo_scriptPubkey_len) {
+        PRINTF("Length mismatch for witness utxo's scriptPubKey\n");
         return -1;
     }
 
-    *amount = parser_outputs.vout_value;
-    *scriptPubKey_len = parser_outputs.vout_scriptpubkey_len;
-    memcpy(scriptPubKey, parser_outputs.vout_scriptpubkey, parser_outputs.vout_scriptpubkey_len);
+    const uint8_t *wit_utxo_scriptPubkey = raw_witnessUtxo + 9;
+    uint64_t wit_utxo_prevout_amount = read_u64_le(&raw_witnessUtxo[0], 0);
 
+    *amount = wit_utxo_prevout_amount;
+    *scriptPubKey_len = wit_utxo_scriptPubkey_len;
+    memcpy(scriptPubKey, wit_utxo_scriptPubkey, wit_utxo_scriptPubkey_len);
     return 0;
 }
 
@@ -318,7 +973,9 @@ get_amount_scriptpubkey_from_psbt_witness(dispatcher_context_t *dc,
                                           uint64_t *amount,
                                           uint8_t scriptPubKey[static MAX_PREVOUT_SCRIPTPUBKEY_LEN],
                                           size_t *scriptPubKey_len) {
-    uint8_t raw_witnessUtxo[8 + 1 + MAX_PREVOUT_SCRIPTPUBKEY_LEN];
+    STACK_PROFILING_FRAME();
+
+    uint8_t raw_witnessUtxo[MAX_WITNESS_UTXO_LEN];
 
     int wit_utxo_len = call_get_merkleized_map_value(dc,
                                                      input_map,
@@ -327,23 +984,11 @@ get_amount_scriptpubkey_from_psbt_witness(dispatcher_context_t *dc,
                                                      raw_witnessUtxo,
                                                      sizeof(raw_witnessUtxo));
 
-    if (wit_utxo_len < 0) {
-        return -1;
-    }
-    int wit_utxo_scriptPubkey_len = raw_witnessUtxo[8];
-
-    if (wit_utxo_len != 8 + 1 + wit_utxo_scriptPubkey_len) {
-        PRINTF("Length mismatch for witness utxo's scriptPubKey\n");
-        return -1;
-    }
-
-    uint8_t *wit_utxo_scriptPubkey = raw_witnessUtxo + 9;
-    uint64_t wit_utxo_prevout_amount = read_u64_le(&raw_witnessUtxo[0], 0);
-
-    *amount = wit_utxo_prevout_amount;
-    *scriptPubKey_len = wit_utxo_scriptPubkey_len;
-    memcpy(scriptPubKey, wit_utxo_scriptPubkey, wit_utxo_scriptPubkey_len);
-    return 0;
+    return parse_witness_utxo(raw_witnessUtxo,
+                              wit_utxo_len,
+                              amount,
+                              scriptPubKey,
+                              scriptPubKey_len);
 }
 
 /*
@@ -354,6 +999,8 @@ get_amount_scriptpubkey_from_psbt_witness(dispatcher_context_t *dc,
 */
 static int get_amount_scriptpubkey_from_psbt(
     dispatcher_context_t *dc,
+    sign_psbt_state_t *st,
+    unsigned int input_index,
     const merkleized_map_commitment_t *input_map,
     uint64_t *amount,
     uint8_t scriptPubKey[static MAX_PREVOUT_SCRIPTPUBKEY_LEN],
@@ -368,6 +1015,8 @@ static int get_amount_scriptpubkey_from_psbt(
     }
 
     return get_amount_scriptpubkey_from_psbt_nonwitness(dc,
+                                                        st,
+                                                        input_index,
                                                         input_map,
                                                         amount,
                                                         scriptPubKey,
@@ -375,11 +1024,102 @@ static int get_amount_scriptpubkey_from_psbt(
                                                         NULL);
 }
 
+// Checks if the derivation in a PSBT_{IN|OUT}_{TAP}?_BIP32_DERIVATION field matches the given
+// internal placeholder; if so, fills the change and address index in in_out.
+// Returns 1 if it matches, 0 if it does not, -1 on error.
+static int match_placeholder_bip32_derivation(const placeholder_info_t *placeholder_info,
+                                              const uint32_t *fpt_der,
+                                              int der_len,
+                                              const uint8_t *bip32_derivation_pubkey,
+                                              bool is_tap,
+                                              in_out_info_t *in_out) {
+    if (fpt_der[0] == placeholder_info->fingerprint &&
+        der_len == placeholder_info->key_derivation_length + 2) {
+        for (int i = 0; i < placeholder_info->key_derivation_length; i++) {
+            if (placeholder_info->key_derivation[i] != fpt_der[1 + i]) {
+                return 0;
+            }
+        }
+
+        uint32_t change = fpt_der[1 + der_len - 2];
+        uint32_t addr_index = fpt_der[1 + der_len - 1];
+
+        // check that we can indeed derive the same key from the current placeholder; the
+        // /<change> child is not compressed and decompressed again between the two steps
+        uint8_t compressed_pubkey[33];
+        {
+            expanded_extended_pubkey_t pubkey;
+            if (0 > bip32_expand_pubkey(&placeholder_info->pubkey, &pubkey)) return -1;
+            if (0 > bip32_CKDpub_expanded(&pubkey, change, &pubkey)) return -1;
+            if (0 > bip32_CKDpub_expanded(&pubkey, addr_index, &pubkey)) return -1;
+            crypto_get_compressed_pubkey(pubkey.uncompressed_pubkey, compressed_pubkey);
+        }
+
+        int pk_offset = is_tap ? 1 : 0;
+        int key_len = is_tap ? 32 : 33;
+        if (memcmp(compressed_pubkey + pk_offset, bip32_derivation_pubkey, key_len) != 0) {
+            return 0;
+        }
+
+        // check if the 'change' derivation step is indeed coherent with placeholder
+        if (change == placeholder_info->placeholder.num_first) {
+            in_out->is_change = false;
+            in_out->address_index = addr_index;
+        } else if (change == placeholder_info->placeholder.num_second) {
+            in_out->is_change = true;
+            in_out->address_index = addr_index;
+        } else {
+            return 0;
+        }
+
+        in_out->placeholder_found = true;
+        return 1;
+    }
+    return 0;
+}
+
+// Checks that the derivation of a PSBT_{IN|OUT}_{TAP}?_BIP32_DERIVATION field has a supported
+// length, and matches it against each of the n_placeholders internal placeholders in the
+// placeholder_info array. Returns 1 if one matches, 0 if none does, -1 on error.
+static int match_placeholders_bip32_derivation(const placeholder_info_t *placeholder_info,
+                                               size_t n_placeholders,
+                                               const uint32_t *fpt_der,
+                                               int der_len,
+                                               const uint8_t *bip32_derivation_pubkey,
+                                               bool is_tap,
+                                               in_out_info_t *in_out) {
+    if (der_len < 2 || der_len > MAX_BIP32_PATH_STEPS) {
+        PRINTF("BIP32_DERIVATION path too long\n");
+        return -1;
+    }
+
+    // if this derivation path matches one of the internal placeholders,
+    // we use it to detect whether the current input is change or not,
+    // and store its address index
+    for (size_t k = 0; k < n_placeholders; k++) {
+        int res = match_placeholder_bip32_derivation(&placeholder_info[k],
+                                                     fpt_der,
+                                                     der_len,
+                                                     bip32_derivation_pubkey,
+                                                     is_tap,
+                                                     in_out);
+        if (res == 1) {
+            in_out->matched_placeholder = (int) k;
+        }
+        if (res != 0) {
+            return res;
+        }
+    }
+    return 0;
+}
+
 // Convenience function to share common logic when processing all the
-// PSBT_{IN|OUT}_{TAP}?_BIP32_DERIVATION fields.
+// PSBT_{IN|OUT}_{TAP}?_BIP32_DERIVATION fields. The derivation is fetched once, and matched against
+// each of the n_placeholders internal placeholders in the placeholder_info array.
 static int read_change_and_index_from_psbt_bip32_derivation(
     dispatcher_context_t *dc,
-    placeholder_info_t *placeholder_info,
+    const placeholder_info_t *placeholder_info,
+    size_t n_placeholders,
     in_out_info_t *in_out,
     int psbt_key_type,
     buffer_t *data,
@@ -416,63 +1156,263 @@ static int read_change_and_index_from_psbt_bip32_derivation(
         return -1;
     }
 
-    if (der_len < 2 || der_len > MAX_BIP32_PATH_STEPS) {
-        PRINTF("BIP32_DERIVATION path too long\n");
+    return match_placeholders_bip32_derivation(placeholder_info,
+                                               n_placeholders,
+                                               fpt_der,
+                                               der_len,
+                                               bip32_derivation_pubkey,
+                                               is_tap,
+                                               in_out);
+}
+
+// Like read_change_and_index_from_psbt_bip32_derivation, but the value of a non-taproot
+// derivation (or of a taproot one, if defer_tap is true) is not fetched: it is deferred to
+// process_deferred_derivations if there is space left in in_out.
+static int read_or_defer_psbt_bip32_derivation(dispatcher_context_t *dc,
+                                               const placeholder_info_t *placeholder_info,
+                                               size_t n_placeholders,
+                                               in_out_info_t *in_out,
+                                               int psbt_key_type,
+                                               bool defer_tap,
+                                               buffer_t *data,
+                                               const merkleized_map_commitment_t *map_commitment,
+                                               int index) {
+    bool is_tap = psbt_key_type == PSBT_IN_TAP_BIP32_DERIVATION ||
+                  psbt_key_type == PSBT_OUT_TAP_BIP32_DERIVATION;
+
+    if ((is_tap && !defer_tap) || in_out->n_deferred_derivations >= MAX_DEFERRED_DERIVATIONS) {
+        return read_change_and_index_from_psbt_bip32_derivation(dc,
+                                                                placeholder_info,
+                                                                n_placeholders,
+                                                                in_out,
+                                                                psbt_key_type,
+                                                                data,
+                                                                map_commitment,
+                                                                index);
+    }
+
+    deferred_derivation_t *deferred = &in_out->deferred_derivations[in_out->n_deferred_derivations];
+    if (!buffer_read_bytes(data, deferred->pubkey, is_tap ? 32 : 33) || buffer_can_read(data, 1)) {
+        PRINTF("Unexpected pubkey length\n");
+        in_out->unexpected_pubkey_error = true;
         return -1;
     }
+    deferred->index = (uint32_t) index;
+    deferred->key_type = (uint8_t) psbt_key_type;
+    ++in_out->n_deferred_derivations;
+    return 0;
+}
 
-    // if this derivation path matches the internal placeholder,
-    // we use it to detect whether the current input is change or not,
-    // and store its address index
-    if (fpt_der[0] == placeholder_info->fingerprint &&
-        der_len == placeholder_info->key_derivation_length + 2) {
-        for (int i = 0; i < placeholder_info->key_derivation_length; i++) {
-            if (placeholder_info->key_derivation[i] != fpt_der[1 + i]) {
-                return 0;
-            }
+/**
+ * Fetches the values of the BIP32 derivations deferred by read_or_defer_psbt_bip32_derivation,
+ * and matches them against the n_placeholders internal placeholders, unless a matching placeholder
+ * was already found. The non-taproot ones are fetched with a single GET_MERKLE_LEAF_ELEMENTS; the
+ * taproot ones are parsed while streaming, as they can be very large.
+ *
+ * @return 0 on success (whether a placeholder matched or not), -1 on error.
+ */
+static int __attribute__((noinline))
+process_deferred_derivations(dispatcher_context_t *dc,
+                             const placeholder_info_t *placeholder_info,
+                             size_t n_placeholders,
+                             in_out_info_t *in_out) {
+    size_t n_deferred = in_out->n_deferred_derivations;
+    if (n_deferred == 0 || in_out->placeholder_found) {
+        return 0;
+    }
+
+    uint8_t values[MAX_DEFERRED_DERIVATIONS][4 * (1 + MAX_BIP32_PATH_STEPS)];
+    merkle_leaf_element_request_t requests[MAX_DEFERRED_DERIVATIONS];
+    const deferred_derivation_t *requested[MAX_DEFERRED_DERIVATIONS];
+    size_t n_requests = 0;
+    for (size_t k = 0; k < n_deferred; k++) {
+        const deferred_derivation_t *deferred = &in_out->deferred_derivations[k];
+        if (deferred->key_type == PSBT_IN_TAP_BIP32_DERIVATION ||
+            deferred->key_type == PSBT_OUT_TAP_BIP32_DERIVATION) {
+            continue;
         }
+        requests[n_requests].leaf_index = deferred->index;
+        requests[n_requests].out = values[n_requests];
+        requests[n_requests].out_len = sizeof(values[n_requests]);
+        requested[n_requests] = deferred;
+        ++n_requests;
+    }
 
-        uint32_t change = fpt_der[1 + der_len - 2];
-        uint32_t addr_index = fpt_der[1 + der_len - 1];
+    if (n_requests > 0 &&
+        0 > call_get_merkle_leaf_elements(dc,
+                                          in_out->map.values_root,
+                                          in_out->map.size,
+                                          requests,
+                                          n_requests)) {
+        PRINTF("Failed to read BIP32_DERIVATION\n");
+        return -1;
+    }
 
-        // check that we can indeed derive the same key from the current placeholder
-        serialized_extended_pubkey_t pubkey;
-        if (0 > bip32_CKDpub(&placeholder_info->pubkey, change, &pubkey)) return -1;
-        if (0 > bip32_CKDpub(&pubkey, addr_index, &pubkey)) return -1;
+    uint32_t fpt_der[1 + MAX_BIP32_PATH_STEPS];
+    for (size_t k = 0; k < n_requests; k++) {
+        int value_len = requests[k].element_len;
+        if (value_len < 4 || value_len % 4 != 0) {
+            PRINTF("Invalid BIP32_DERIVATION\n");
+            return -1;
+        }
 
-        int pk_offset = is_tap ? 1 : 0;
-        if (memcmp(pubkey.compressed_pubkey + pk_offset, bip32_derivation_pubkey, key_len) != 0) {
-            return 0;
+        fpt_der[0] = read_u32_be(values[k], 0);
+        for (int i = 1; i < value_len / 4; i++) {
+            fpt_der[i] = read_u32_le(values[k], 4 * i);
         }
 
-        // check if the 'change' derivation step is indeed coherent with placeholder
-        if (change == placeholder_info->placeholder.num_first) {
-            in_out->is_change = false;
-            in_out->address_index = addr_index;
-        } else if (change == placeholder_info->placeholder.num_second) {
-            in_out->is_change = true;
-            in_out->address_index = addr_index;
-        } else {
-            return 0;
+        int res = match_placeholders_bip32_derivation(placeholder_info,
+                                                      n_placeholders,
+                                                      fpt_der,
+                                                      value_len / 4 - 1,
+                                                      requested[k]->pubkey,
+                                                      false,
+                                                      in_out);
+        if (res != 0) {
+            return res < 0 ? -1 : 0;
         }
+    }
 
-        in_out->placeholder_found = true;
-        return 1;
+    if (n_requests == n_deferred) {
+        return 0;
+    }
+
+    for (size_t k = 0; k < n_deferred; k++) {
+        const deferred_derivation_t *deferred = &in_out->deferred_derivations[k];
+        if (deferred->key_type != PSBT_IN_TAP_BIP32_DERIVATION &&
+            deferred->key_type != PSBT_OUT_TAP_BIP32_DERIVATION) {
+            continue;
+        }
+
+        int der_len = extract_bip32_derivation(dc,
+                                               deferred->key_type,
+                                               in_out->map.values_root,
+                                               in_out->map.size,
+                                               deferred->index,
+                                               fpt_der);
+        if (der_len < 0) {
+            PRINTF("Failed to read BIP32_DERIVATION\n");
+            return -1;
+        }
+
+        int res = match_placeholders_bip32_derivation(placeholder_info,
+                                                      n_placeholders,
+                                                      fpt_der,
+                                                      der_len,
+                                                      deferred->pubkey,
+                                                      true,
+                                                      in_out);
+        if (res != 0) {
+            return res < 0 ? -1 : 0;
+        }
     }
     return 0;
 }
 
 /**
- * Verifies if a certain input/output is internal (that is, controlled by the wallet being used for
- * signing). This uses the state of sign_psbt and is not meant as a general-purpose function;
+ * Verifies if a certain input/output is internal (that is, controlled by the wallet with the given
+ * index). This uses the state of sign_psbt and is not meant as a general-purpose function;
  * rather, it avoids some substantial code duplication and removes complexity from sign_psbt.
+ * The caller must have checked that a derivation was found for the input/output, and that it is on
+ * the change path for an output; script_hash is the SHA-256 of its scriptPubKey.
+ *
+ * The pubkeys are derived from the /<change> node of each key, that is kept in the derived pubkeys
+ * cache, and each pubkey at the change and address index is only derived once for all the
+ * placeholders of the policy.
  *
  * @return 1 if the given input/output is internal; 0 if external; -1 on error.
  */
 static int is_in_out_internal(dispatcher_context_t *dispatcher_context,
-                              const sign_psbt_state_t *state,
+                              sign_psbt_state_t *state,
+                              unsigned int wallet_index,
                               const in_out_info_t *in_out_info,
-                              bool is_input) {
+                              const uint8_t script_hash[static 32]) {
+    // if the same scriptPubKey was already verified at the same path, there is no need to derive
+    // the wallet's script again
+    internal_script_t *entries = state->internal_scripts_cache.entries;
+    for (int i = 0; i < INTERNAL_SCRIPTS_CACHE_SIZE; i++) {
+        if (entries[i].is_valid && entries[i].wallet_index == wallet_index &&
+            entries[i].is_change == in_out_info->is_change &&
+            entries[i].address_index == (uint32_t) in_out_info->address_index &&
+            memcmp(entries[i].script_hash, script_hash, 32) == 0) {
+            internal_script_t entry = entries[i];
+            memmove(&entries[1], &entries[0], i * sizeof(internal_script_t));
+            entries[0] = entry;
+            return 1;
+        }
+    }
+
+    sign_psbt_wallet_t *wallet = &state->wallets[wallet_index];
+
+    int res;
+#ifdef HAVE_SINGLESIG_FAST_PATH
+    if (wallet->use_singlesig_wallet) {
+        uint8_t wallet_script[MAX_SINGLESIG_SCRIPT_LEN];
+        int wallet_script_len = singlesig_wallet_get_script(&wallet->singlesig_wallet,
+                                                            in_out_info->is_change,
+                                                            in_out_info->address_index,
+                                                            wallet_script);
+        if (wallet_script_len < 0) {
+            return -1;
+        }
+        res = wallet_script_len == (int) in_out_info->scriptPubKey_len &&
+              memcmp(wallet_script, in_out_info->scriptPubKey, wallet_script_len) == 0;
+    } else
+#endif
+    {
+        res = compare_wallet_script_at_path(dispatcher_context,
+                                            in_out_info->is_change,
+                                            in_out_info->address_index,
+                                            &wallet->policy_map,
+                                            wallet->header_version,
+                                            wallet->header_keys_info_merkle_root,
+                                            wallet->header_n_keys,
+                                            in_out_info->scriptPubKey,
+                                            in_out_info->scriptPubKey_len,
+                                            &state->derived_pubkeys_cache);
+    }
+
+    if (res == 1) {
+        // the least recently used entry is evicted if the cache is full
+        memmove(&entries[1],
+                &entries[0],
+                (INTERNAL_SCRIPTS_CACHE_SIZE - 1) * sizeof(internal_script_t));
+        entries[0].is_valid = true;
+        entries[0].wallet_index = (uint8_t) wallet_index;
+        entries[0].is_change = in_out_info->is_change;
+        entries[0].address_index = (uint32_t) in_out_info->address_index;
+        memcpy(entries[0].script_hash, script_hash, 32);
+    }
+    return res;
+}
+
+// Returns true if the two internal placeholders have the same key origin and the same
+// /<NUM_a;NUM_b> steps, so that a BIP32 derivation matches either both of them or none of them.
+static bool have_same_derivations(const placeholder_info_t *a, const placeholder_info_t *b) {
+    return a->fingerprint == b->fingerprint &&
+           a->key_derivation_length == b->key_derivation_length &&
+           memcmp(a->key_derivation,
+                  b->key_derivation,
+                  a->key_derivation_length * sizeof(a->key_derivation[0])) == 0 &&
+           a->placeholder.num_first == b->placeholder.num_first &&
+           a->placeholder.num_second == b->placeholder.num_second;
+}
+
+/**
+ * Finds the wallet that a certain input/output is internal to. The placeholder_info array has the
+ * first internal placeholder of each wallet, that the BIP32 derivations of the input/output were
+ * matched against; only the wallets whose placeholder has the same derivations as the matching one
+ * are checked, while all of them are checked for a derivation hint.
+ *
+ * @return 1 if the given input/output is internal, and *wallet_index is set to the index of its
+ * wallet; 0 if external; -1 on error.
+ */
+static int find_in_out_wallet(dispatcher_context_t *dc,
+                              sign_psbt_state_t *st,
+                              const placeholder_info_t placeholder_info[],
+                              const in_out_info_t *in_out_info,
+                              bool is_input,
+                              unsigned int *wallet_index) {
     // If we did not find any info about the pubkey associated to the placeholder we're considering,
     // then it's external
     if (!in_out_info->placeholder_found) {
@@ -484,117 +1424,423 @@ static int is_in_out_internal(dispatcher_context_t *dispatcher_context,
         return 0;
     }
 
-    return compare_wallet_script_at_path(dispatcher_context,
-                                         in_out_info->is_change,
-                                         in_out_info->address_index,
-                                         &state->wallet_policy_map,
-                                         state->wallet_header_version,
-                                         state->wallet_header_keys_info_merkle_root,
-                                         state->wallet_header_n_keys,
-                                         in_out_info->scriptPubKey,
-                                         in_out_info->scriptPubKey_len);
+    // computed once for all the wallets
+    uint8_t script_hash[32];
+    cx_hash_sha256(in_out_info->scriptPubKey, in_out_info->scriptPubKey_len, script_hash, 32);
+
+    for (unsigned int i = 0; i < st->n_wallets; i++) {
+        if (in_out_info->matched_placeholder >= 0 &&
+            !have_same_derivations(&placeholder_info[i],
+                                   &placeholder_info[in_out_info->matched_placeholder])) {
+            continue;
+        }
+
+        int res = is_in_out_internal(dc, st, i, in_out_info, script_hash);
+        if (res != 0) {
+            *wallet_index = i;
+            return res;
+        }
+    }
+    return 0;
 }
 
-static bool __attribute__((noinline))
-init_global_state(dispatcher_context_t *dc, sign_psbt_state_t *st) {
-    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+// Returns true if the key in data, whose key type was already read, is the
+// PSBT_LEDGER_PROPRIETARY_KEY with the given subtype.
+static bool is_ledger_proprietary_key(uint8_t key_type, const buffer_t *data, uint8_t subtype) {
+    const uint8_t expected_key[PSBT_LEDGER_PROPRIETARY_KEY_LEN] =
+        PSBT_LEDGER_PROPRIETARY_KEY(subtype);
+    size_t len = PSBT_LEDGER_PROPRIETARY_KEY_LEN - 1;  // excluding the key type
+    return key_type == expected_key[0] && data->size - data->offset == len &&
+           memcmp(data->ptr + data->offset, expected_key + 1, len) == 0;
+}
 
-    merkleized_map_commitment_t global_map;
-    if (!buffer_read_varint(&dc->read_buffer, &global_map.size)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return false;
+/**
+ * If the map of the input or output has a PSBT_LEDGER_IN_OUT_DERIVATION_HINT, and no derivation was
+ * found yet, fetches the hint and fills the change and address index. The hint is not trusted:
+ * is_in_out_internal still checks that the scriptPubKey is the one of a wallet policy at that
+ * path, therefore a wrong hint can only make an internal input or output look external.
+ *
+ * @return 0 on success (including if there is no hint), -1 on error.
+ */
+static int process_derivation_hint(dispatcher_context_t *dc, in_out_info_t *in_out) {
+    if (!in_out->has_derivation_hint || in_out->placeholder_found) {
+        return 0;
     }
 
-    if (!buffer_read_bytes(&dc->read_buffer, global_map.keys_root, 32) ||
-        !buffer_read_bytes(&dc->read_buffer, global_map.values_root, 32)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return false;
+    uint8_t hint[1 + 4];
+    if ((int) sizeof(hint) != call_get_merkle_leaf_element(dc,
+                                                           in_out->map.values_root,
+                                                           in_out->map.size,
+                                                           in_out->derivation_hint_index,
+                                                           hint,
+                                                           sizeof(hint))) {
+        PRINTF("Invalid derivation hint\n");
+        return -1;
     }
 
-    // we already know n_inputs and n_outputs, so we skip reading from the global map
+    uint32_t address_index = read_u32_le(hint, 1);
+    if (hint[0] > 1 || address_index >= BIP32_FIRST_HARDENED_CHILD) {
+        PRINTF("Invalid derivation hint\n");
+        return -1;
+    }
 
-    uint64_t n_inputs_u64;
-    if (!buffer_read_varint(&dc->read_buffer, &n_inputs_u64) ||
-        !buffer_read_bytes(&dc->read_buffer, st->inputs_root, 32)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return false;
+    in_out->is_change = hint[0] == 1;
+    in_out->address_index = (int) address_index;
+    in_out->placeholder_found = true;
+    in_out->matched_placeholder = -1;
+    return 0;
+}
+
+/**
+ * Callback to process all the keys of the global map.
+ * Keeps track if the client sends derivation hints for the inputs and outputs, and of the indexes
+ * of the keys whose values are fetched by fetch_global_values.
+ */
+static void global_keys_callback(dispatcher_context_t *dc,
+                                 sign_psbt_state_t *st,
+                                 const merkleized_map_commitment_t *map_commitment,
+                                 int i,
+                                 buffer_t *data) {
+    (void) dc;
+    (void) map_commitment;
+    (void) i;
+
+    uint8_t key_type;
+    if (!buffer_read_u8(data, &key_type)) {
+        return;
+    }
+    if (!buffer_can_read(data, 1)) {  // no keydata
+        if (key_type == PSBT_GLOBAL_TX_VERSION) {
+            st->tx_version_key_index = i;
+        } else if (key_type == PSBT_GLOBAL_FALLBACK_LOCKTIME) {
+            st->fallback_locktime_key_index = i;
+        }
+    }
+    if (is_ledger_proprietary_key(key_type, data, PSBT_LEDGER_GLOBAL_DERIVATION_HINTS)) {
+        st->has_derivation_hints = true;
+    }
+#ifdef HAVE_PAYEE_LISTS
+    if (is_ledger_proprietary_key(key_type, data, PSBT_LEDGER_GLOBAL_PAYEE_LIST)) {
+        st->payee_list_key_index = i;
+    }
+#endif
+    if (is_ledger_proprietary_key(key_type, data, PSBT_LEDGER_GLOBAL_INPUT_SUBSET)) {
+        st->input_subset_key_index = i;
     }
+}
 
-    if (n_inputs_u64 > MAX_N_INPUTS_CAN_SIGN) {
-        PRINTF("At most %d inputs are supported\n", MAX_N_INPUTS_CAN_SIGN);
-        SEND_SW(dc, SW_NOT_SUPPORTED);
-        return false;
+// The values of the global map that are used by the app
+typedef struct {
+    uint8_t tx_version[4];
+    uint8_t fallback_locktime[4];
+#ifdef HAVE_PAYEE_LISTS
+    uint8_t payee_list[9 + 32 + 32];
+#endif
+    uint8_t input_subset[9 + 32];
+
+    // the length of each value, or -1 if its key is not in the global map
+    int tx_version_len;
+    int fallback_locktime_len;
+#ifdef HAVE_PAYEE_LISTS
+    int payee_list_len;
+#endif
+    int input_subset_len;
+} global_values_t;
+
+/**
+ * Fetches all the values of the global map that are used by the app with a single
+ * call_get_merkle_leaf_elements, using the indexes of their keys found by global_keys_callback;
+ * therefore, the keys are not looked up again one by one.
+ *
+ * @return 0 on success, -1 on error, including if a value is too long.
+ */
+static int __attribute__((noinline))
+fetch_global_values(dispatcher_context_t *dc,
+                    const sign_psbt_state_t *st,
+                    const merkleized_map_commitment_t *global_map,
+                    global_values_t *values) {
+    // the keys are sorted, so the leaf indexes are strictly increasing in this order
+    const struct {
+        int key_index;
+        uint8_t *out;
+        size_t out_len;
+        int *value_len;
+    } fields[] = {
+        {st->tx_version_key_index,
+         values->tx_version,
+         sizeof(values->tx_version),
+         &values->tx_version_len},
+        {st->fallback_locktime_key_index,
+         values->fallback_locktime,
+         sizeof(values->fallback_locktime),
+         &values->fallback_locktime_len},
+#ifdef HAVE_PAYEE_LISTS
+        // in swap mode, the payee list is ignored
+        {G_swap_state.called_from_swap ? -1 : st->payee_list_key_index,
+         values->payee_list,
+         sizeof(values->payee_list),
+         &values->payee_list_len},
+#endif
+        {st->input_subset_key_index,
+         values->input_subset,
+         sizeof(values->input_subset),
+         &values->input_subset_len},
+    };
+    _Static_assert(sizeof(fields) / sizeof(fields[0]) <= MAX_MERKLE_LEAF_ELEMENTS_BATCH,
+                   "The global values do not fit in a batch");
+
+    merkle_leaf_element_request_t requests[MAX_MERKLE_LEAF_ELEMENTS_BATCH];
+    int *value_lens[MAX_MERKLE_LEAF_ELEMENTS_BATCH];
+    size_t n_requests = 0;
+    for (size_t j = 0; j < sizeof(fields) / sizeof(fields[0]); j++) {
+        *fields[j].value_len = -1;
+        if (fields[j].key_index >= 0) {
+            requests[n_requests].leaf_index = (uint32_t) fields[j].key_index;
+            requests[n_requests].out = fields[j].out;
+            requests[n_requests].out_len = fields[j].out_len;
+            value_lens[n_requests] = fields[j].value_len;
+            ++n_requests;
+        }
     }
-    st->n_inputs = (unsigned int) n_inputs_u64;
 
-    uint64_t n_outputs_u64;
-    if (!buffer_read_varint(&dc->read_buffer, &n_outputs_u64) ||
-        !buffer_read_bytes(&dc->read_buffer, st->outputs_root, 32)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return false;
+    if (n_requests == 0) {
+        return 0;
     }
-    st->n_outputs = (unsigned int) n_outputs_u64;
 
-    policy_map_wallet_header_t wallet_header;
+    if (global_map->size > UINT32_MAX) {
+        return -1;
+    }
+    if (0 > call_get_merkle_leaf_elements(dc,
+                                          global_map->values_root,
+                                          (uint32_t) global_map->size,
+                                          requests,
+                                          n_requests)) {
+        return -1;
+    }
 
-    uint8_t wallet_hmac[32];
-    uint8_t wallet_id[32];
-    if (!buffer_read_bytes(&dc->read_buffer, wallet_id, 32) ||
-        !buffer_read_bytes(&dc->read_buffer, wallet_hmac, 32)) {
-        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
-        return false;
+    for (size_t k = 0; k < n_requests; k++) {
+        *value_lens[k] = requests[k].element_len;
     }
+    return 0;
+}
 
-    {  // process global map
-        // Check integrity of the global map
-        if (call_check_merkle_tree_sorted(dc, global_map.keys_root, (size_t) global_map.size) < 0) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return false;
+/**
+ * Parses the value of the PSBT_LEDGER_GLOBAL_INPUT_SUBSET, if present, and verifies that the
+ * indexes in the subset are strictly increasing, and smaller than the number of inputs.
+ *
+ * @return 0 on success (including if there is no subset), -1 on error.
+ */
+static int __attribute__((noinline)) init_input_subset(dispatcher_context_t *dc,
+                                                       sign_psbt_state_t *st,
+                                                       const global_values_t *values) {
+    st->has_input_subset = false;
+    if (values->input_subset_len < 0) {
+        return 0;
+    }
+
+    buffer_t value_buf = buffer_create((void *) values->input_subset, values->input_subset_len);
+    uint64_t n_selected;
+    if (!buffer_read_varint(&value_buf, &n_selected) || n_selected == 0 ||
+        n_selected > st->n_inputs || !buffer_read_bytes(&value_buf, st->input_subset_root, 32) ||
+        buffer_can_read(&value_buf, 1)) {
+        PRINTF("Invalid input subset\n");
+        return -1;
+    }
+    st->input_subset_size = (uint32_t) n_selected;
+
+    // the indexes are fetched in batches; while signing, they are fetched again one at a time
+    int64_t prev_index = -1;
+    for (uint32_t i = 0; i < st->input_subset_size; i += MAX_MERKLE_LEAF_ELEMENTS_BATCH) {
+        uint8_t elements[MAX_MERKLE_LEAF_ELEMENTS_BATCH][4];
+        merkle_leaf_element_request_t requests[MAX_MERKLE_LEAF_ELEMENTS_BATCH];
+        size_t n_requests = MIN(MAX_MERKLE_LEAF_ELEMENTS_BATCH, st->input_subset_size - i);
+        for (size_t k = 0; k < n_requests; k++) {
+            requests[k].leaf_index = i + k;
+            requests[k].out = elements[k];
+            requests[k].out_len = sizeof(elements[k]);
+        }
+        if (0 > call_get_merkle_leaf_elements(dc,
+                                              st->input_subset_root,
+                                              st->input_subset_size,
+                                              requests,
+                                              n_requests)) {
+            return -1;
+        }
+        for (size_t k = 0; k < n_requests; k++) {
+            if (requests[k].element_len != 4) {
+                return -1;
+            }
+            int64_t index = read_u32_le(elements[k], 0);
+            if (index <= prev_index || index >= st->n_inputs) {
+                PRINTF("Invalid index in the input subset\n");
+                return -1;
+            }
+            prev_index = index;
         }
+    }
 
-        uint8_t raw_result[9];  // max size for a varint
-        int result_len;
+    st->has_input_subset = true;
+    return 0;
+}
 
-        // Read tx version
-        result_len = call_get_merkleized_map_value(dc,
-                                                   &global_map,
-                                                   (uint8_t[]){PSBT_GLOBAL_TX_VERSION},
-                                                   1,
-                                                   raw_result,
-                                                   sizeof(raw_result));
-        if (result_len != 4) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return false;
-        }
-        st->tx_version = read_u32_le(raw_result, 0);
+// Position in the input subset while the inputs are signed in increasing order
+typedef struct {
+    uint32_t next_position;  // position in the subset of the next index to fetch
+    int64_t last_index;      // the last index fetched from the subset, or -1
+} input_subset_cursor_t;
 
-        // Read fallback locktime.
-        // Unlike BIP-0370 recommendation, we use the fallback locktime as-is, ignoring each input's
-        // preferred height/block locktime. If that's relevant, the client must set the fallback
-        // locktime to the appropriate value before calling sign_psbt.
-        result_len = call_get_merkleized_map_value(dc,
-                                                   &global_map,
-                                                   (uint8_t[]){PSBT_GLOBAL_FALLBACK_LOCKTIME},
-                                                   1,
-                                                   raw_result,
-                                                   sizeof(raw_result));
-        if (result_len == -1) {
-            st->locktime = 0;
-        } else if (result_len != 4) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return false;
-        } else {
-            st->locktime = read_u32_le(raw_result, 0);
+/**
+ * Checks if an input is in the PSBT_LEDGER_GLOBAL_INPUT_SUBSET, fetching the indexes of the subset
+ * up to input_index. The calls for the same cursor must have increasing input indexes.
+ *
+ * @return 1 if the input is in the subset (or if there is no subset), 0 if not, -1 on error.
+ */
+static int is_input_in_subset(dispatcher_context_t *dc,
+                              const sign_psbt_state_t *st,
+                              input_subset_cursor_t *cursor,
+                              unsigned int input_index) {
+    if (!st->has_input_subset) {
+        return 1;
+    }
+
+    while (cursor->last_index < (int64_t) input_index) {
+        if (cursor->next_position >= st->input_subset_size) {
+            return 0;
         }
+        uint8_t element[4];
+        if (4 != call_get_merkle_leaf_element(dc,
+                                              st->input_subset_root,
+                                              st->input_subset_size,
+                                              cursor->next_position,
+                                              element,
+                                              sizeof(element))) {
+            return -1;
+        }
+        cursor->last_index = read_u32_le(element, 0);
+        ++cursor->next_position;
+    }
+    return cursor->last_index == (int64_t) input_index;
+}
+
+#ifdef HAVE_PAYEE_LISTS
+/**
+ * Parses the value of the PSBT_LEDGER_GLOBAL_PAYEE_LIST, if present, and verifies its hmac.
+ *
+ * @return 0 on success (including if there is no payee list), -1 on error.
+ */
+static int __attribute__((noinline)) init_payee_list(sign_psbt_state_t *st,
+                                                     const global_values_t *values) {
+    st->has_payee_list = false;
+    if (values->payee_list_len < 0) {
+        // not fetched in swap mode, where the only external output is checked against the swap
+        // parameters
+        return 0;
+    }
+
+    buffer_t value_buf = buffer_create((void *) values->payee_list, values->payee_list_len);
+    uint64_t n_payees;
+    uint8_t payee_list_hmac[32];
+    if (!buffer_read_varint(&value_buf, &n_payees) || n_payees == 0 || n_payees > MAX_N_PAYEES ||
+        !buffer_read_bytes(&value_buf, st->payee_list_root, 32) ||
+        !buffer_read_bytes(&value_buf, payee_list_hmac, 32) || buffer_can_read(&value_buf, 1)) {
+        PRINTF("Invalid payee list\n");
+        return -1;
+    }
+
+    uint8_t payee_list_id[32];
+    get_payee_list_id((uint32_t) n_payees, st->payee_list_root, payee_list_id);
+    if (!check_payee_list_hmac(payee_list_id, payee_list_hmac)) {
+        PRINTF("Incorrect payee list hmac\n");
+        return -1;
+    }
+
+    st->payee_list_size = (uint32_t) n_payees;
+    st->has_payee_list = true;
+    return 0;
+}
+
+/**
+ * Checks if the scriptPubKey of an external output is in the registered payee list. The client
+ * can only hide a payee, in which case the output is shown as any other external output.
+ *
+ * @return 1 if the output is to a payee of the list, 0 if it is not, -1 on failure.
+ */
+static int is_output_to_payee(dispatcher_context_t *dc,
+                              const sign_psbt_state_t *st,
+                              const output_info_t *output) {
+    if (!st->has_payee_list) {
+        return 0;
     }
 
+    uint8_t leaf_hash[32];
+    merkle_compute_element_hash(output->in_out.scriptPubKey,
+                                output->in_out.scriptPubKey_len,
+                                leaf_hash);
+    int index =
+        call_get_merkle_leaf_index(dc, st->payee_list_size, st->payee_list_root, leaf_hash);
+    if (index == MERKLE_LEAF_INDEX_NOT_FOUND) {
+        return 0;
+    }
+    return index >= 0 ? 1 : -1;
+}
+#endif
+
+// With derivation hints, the BIP32 derivations are not fetched; only the length of the pubkey in
+// their key is checked.
+static bool is_bip32_derivation_pubkey_len_valid(bool is_tap, const buffer_t *data) {
+    return data->size - data->offset == (is_tap ? 32 : 33);
+}
+
+/**
+ * Loads in wallet the wallet policy with the given id, either from the open wallet session, from
+ * the registry of the device or from the client. The hmac of a registered wallet policy is
+ * verified unless it is stored in the registry, while a standard one (with an hmac of 32 zero
+ * bytes) must be a canonical single-signature policy. Unless the session is
+ * resumed, the user is asked to authorize spending from a registered wallet policy.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
+static bool __attribute__((noinline)) init_wallet(dispatcher_context_t *dc,
+                                                  const uint8_t wallet_id[static 32],
+                                                  const uint8_t wallet_hmac[static 32],
+                                                  bool is_resumed,
+                                                  sign_psbt_wallet_t *wallet) {
+    STACK_PROFILING_FRAME();
+
+    policy_map_wallet_header_t wallet_header;
+
     uint8_t hmac_or =
         0;  // the binary OR of all the hmac bytes (so == 0 iff the hmac is identically 0)
     for (int i = 0; i < 32; i++) {
         hmac_or = hmac_or | wallet_hmac[i];
     }
 
-    if (hmac_or != 0) {
+    // true if the wallet policy is taken from the open wallet session
+    bool is_session_wallet = false;
+
+#ifdef HAVE_WALLET_SESSIONS
+    const wallet_session_t *session = wallet_session_get(wallet_id, wallet_hmac);
+#ifdef HAVE_WALLET_REGISTRY
+    if (session == NULL) {
+        // a wallet policy stored in the registry, with the user's approval, is used whatever the
+        // hmac
+        session = wallet_registry_get(wallet_id);
+    }
+#endif
+    if (session != NULL) {
+        // the policy was already fetched, parsed and its hmac verified when opening the session,
+        // or when storing it in the registry
+        memcpy(&wallet_header, &session->wallet_header, sizeof(wallet_header));
+        memcpy(wallet->policy_map_bytes,
+               session->wallet_policy_map_bytes,
+               sizeof(wallet->policy_map_bytes));
+        is_session_wallet = true;
+    }
+#endif
+
+    if (is_session_wallet) {
+        wallet->is_canonical = false;
+    } else if (hmac_or != 0) {
         // Verify hmac
         if (!check_wallet_hmac(wallet_id, wallet_hmac)) {
             PRINTF("Incorrect hmac\n");
@@ -602,53 +1848,59 @@ init_global_state(dispatcher_context_t *dc, sign_psbt_state_t *st) {
             return false;
         }
 
-        st->is_wallet_canonical = false;
+        wallet->is_canonical = false;
     } else {
-        st->is_wallet_canonical = true;
+        wallet->is_canonical = true;
     }
 
     {
-        // Fetch the serialized wallet policy from the client
-        uint8_t serialized_wallet_policy[MAX_WALLET_POLICY_SERIALIZED_LENGTH];
-        int serialized_wallet_policy_len = call_get_preimage(dc,
-                                                             wallet_id,
-                                                             serialized_wallet_policy,
-                                                             sizeof(serialized_wallet_policy));
-        if (serialized_wallet_policy_len < 0) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return false;
-        }
+        if (!is_session_wallet) {
+            // Fetch the serialized wallet policy from the client
+            uint8_t serialized_wallet_policy[MAX_WALLET_POLICY_SERIALIZED_LENGTH];
+            int serialized_wallet_policy_len = call_get_preimage(dc,
+                                                                 wallet_id,
+                                                                 serialized_wallet_policy,
+                                                                 sizeof(serialized_wallet_policy));
+            if (serialized_wallet_policy_len < 0) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return false;
+            }
 
-        buffer_t serialized_wallet_policy_buf =
-            buffer_create(serialized_wallet_policy, serialized_wallet_policy_len);
+            buffer_t serialized_wallet_policy_buf =
+                buffer_create(serialized_wallet_policy, serialized_wallet_policy_len);
+
+            if (0 > read_and_parse_wallet_policy(dc,
+                                                 &serialized_wallet_policy_buf,
+                                                 &wallet_header,
+                                                 NULL,
+                                                 wallet->policy_map_bytes,
+                                                 sizeof(wallet->policy_map_bytes))) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return false;
+            }
+        }
 
-        uint8_t policy_map_descriptor[MAX_DESCRIPTOR_TEMPLATE_LENGTH];
-        if (0 > read_and_parse_wallet_policy(dc,
-                                             &serialized_wallet_policy_buf,
-                                             &wallet_header,
-                                             policy_map_descriptor,
-                                             st->wallet_policy_map_bytes,
-                                             sizeof(st->wallet_policy_map_bytes))) {
+        if (0 > build_key_placeholders_table(&wallet->policy_map, &wallet->key_placeholders)) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
         }
 
-        st->wallet_header_version = wallet_header.version;
-        memcpy(st->wallet_header_keys_info_merkle_root,
+        wallet->header_version = wallet_header.version;
+        memcpy(wallet->header_keys_info_merkle_root,
                wallet_header.keys_info_merkle_root,
                sizeof(wallet_header.keys_info_merkle_root));
-        st->wallet_header_n_keys = wallet_header.n_keys;
+        wallet->header_n_keys = wallet_header.n_keys;
 
-        if (st->is_wallet_canonical) {
+        if (wallet->is_canonical) {
             // verify that the policy is indeed a canonical one that is allowed by default
 
-            if (st->wallet_header_n_keys != 1) {
+            if (wallet->header_n_keys != 1) {
                 PRINTF("Non-standard policy, it should only have 1 key\n");
                 SEND_SW(dc, SW_INCORRECT_DATA);
                 return false;
             }
 
-            int address_type = get_policy_address_type(&st->wallet_policy_map);
+            int address_type = get_policy_address_type(&wallet->policy_map);
             if (address_type == -1) {
                 PRINTF("Non-standard policy, and no hmac provided\n");
                 SEND_SW(dc, SW_INCORRECT_DATA);
@@ -672,8 +1924,8 @@ init_global_state(dispatcher_context_t *dc, sign_psbt_state_t *st) {
 
                 int key_info_len =
                     call_get_merkle_leaf_element(dc,
-                                                 st->wallet_header_keys_info_merkle_root,
-                                                 st->wallet_header_n_keys,
+                                                 wallet->header_keys_info_merkle_root,
+                                                 wallet->header_n_keys,
                                                  0,
                                                  (uint8_t *) key_info_str,
                                                  sizeof(key_info_str));
@@ -686,7 +1938,7 @@ init_global_state(dispatcher_context_t *dc, sign_psbt_state_t *st) {
 
                 if (parse_policy_map_key_info(&key_info_buffer,
                                               &key_info,
-                                              st->wallet_header_version) == -1) {
+                                              wallet->header_version) == -1) {
                     SEND_SW(dc, SW_INCORRECT_DATA);
                     return false;
                 }
@@ -706,62 +1958,347 @@ init_global_state(dispatcher_context_t *dc, sign_psbt_state_t *st) {
     }
 
     // Swap feature: check that wallet is canonical
-    if (G_swap_state.called_from_swap && !st->is_wallet_canonical) {
+    if (G_swap_state.called_from_swap && !wallet->is_canonical) {
         PRINTF("Must be a canonical wallet for swap feature\n");
         SEND_SW(dc, SW_INCORRECT_DATA);
         return false;
     }
 
     // If it's not a canonical wallet, ask the user for confirmation, and abort if they deny
-    if (!st->is_wallet_canonical && !ui_authorize_wallet_spend(dc, wallet_header.name)) {
+    if (!wallet->is_canonical && !is_resumed &&
+        !ui_authorize_wallet_spend(dc, wallet_header.name)) {
         SEND_SW(dc, SW_DENY);
         return false;
     }
 
-    st->master_key_fingerprint = crypto_get_master_key_fingerprint();
-
     return true;
 }
 
+/**
+ * Reads the commitments of a PSBT: the commitment of its global map, then the number and the Merkle
+ * root of the commitments of its input maps and of its output maps.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
 static bool __attribute__((noinline))
-fill_placeholder_info_if_internal(dispatcher_context_t *dc,
-                                  sign_psbt_state_t *st,
-                                  placeholder_info_t *placeholder_info) {
-    policy_map_key_info_t key_info;
-    {
-        uint8_t key_info_str[MAX_POLICY_KEY_INFO_LEN];
-        int key_info_len = call_get_merkle_leaf_element(dc,
-                                                        st->wallet_header_keys_info_merkle_root,
-                                                        st->wallet_header_n_keys,
-                                                        placeholder_info->placeholder.key_index,
-                                                        key_info_str,
-                                                        sizeof(key_info_str));
+read_psbt_commitments(dispatcher_context_t *dc,
+                      buffer_t *buffer,
+                      sign_psbt_state_t *st,
+                      merkleized_map_commitment_t *global_map) {
+    if (!buffer_read_varint(buffer, &global_map->size)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return false;
+    }
 
-        if (key_info_len < 0) {
-            SEND_SW(dc, SW_BAD_STATE);  // should never happen
-            return false;
-        }
+    if (!buffer_read_bytes(buffer, global_map->keys_root, 32) ||
+        !buffer_read_bytes(buffer, global_map->values_root, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return false;
+    }
 
-        // Make a sub-buffer for the pubkey info
-        buffer_t key_info_buffer = buffer_create(key_info_str, key_info_len);
+    // we already know n_inputs and n_outputs, so we skip reading from the global map
 
-        if (parse_policy_map_key_info(&key_info_buffer, &key_info, st->wallet_header_version) ==
-            -1) {
-            SEND_SW(dc, SW_BAD_STATE);  // should never happen
-            return false;
-        }
+    uint64_t n_inputs_u64;
+    if (!buffer_read_varint(buffer, &n_inputs_u64) ||
+        !buffer_read_bytes(buffer, st->inputs_root, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return false;
     }
 
-    uint32_t fpr = read_u32_be(key_info.master_key_fingerprint, 0);
-    if (fpr != st->master_key_fingerprint) {
+#ifdef HAVE_OFFLOADED_RECORDS
+    // beyond MAX_N_INPUTS_CAN_SIGN inputs, the records of the inputs are offloaded to the client
+    if (n_inputs_u64 > UINT32_MAX) {
+        SEND_SW(dc, SW_NOT_SUPPORTED);
+        return false;
+    }
+#else
+    if (n_inputs_u64 > MAX_N_INPUTS_CAN_SIGN) {
+        PRINTF("At most %d inputs are supported\n", MAX_N_INPUTS_CAN_SIGN);
+        SEND_SW(dc, SW_NOT_SUPPORTED);
         return false;
     }
+#endif
+    st->n_inputs = (unsigned int) n_inputs_u64;
 
-    {
-        // it could be a collision on the fingerprint; we verify that we can actually generate
-        // the same pubkey
-        char pubkey_derived[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
-        int serialized_pubkey_len =
+    uint64_t n_outputs_u64;
+    if (!buffer_read_varint(buffer, &n_outputs_u64) ||
+        !buffer_read_bytes(buffer, st->outputs_root, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return false;
+    }
+    st->n_outputs = (unsigned int) n_outputs_u64;
+
+    return true;
+}
+
+/**
+ * Verifies the keys of the global map, and reads the values that are needed from it.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
+static bool __attribute__((noinline))
+process_global_map(dispatcher_context_t *dc,
+                   sign_psbt_state_t *st,
+                   merkleized_map_commitment_t *global_map) {
+    // Check integrity of the global map
+    st->has_derivation_hints = false;
+    st->tx_version_key_index = -1;
+    st->fallback_locktime_key_index = -1;
+#ifdef HAVE_PAYEE_LISTS
+    st->payee_list_key_index = -1;
+#endif
+    st->input_subset_key_index = -1;
+    if (call_check_merkle_tree_sorted_with_callback(
+            dc,
+            (void *) st,
+            global_map->keys_root,
+            (size_t) global_map->size,
+            (merkle_tree_elements_callback_t) global_keys_callback,
+            global_map) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+    // all the values that are needed are fetched at once, without looking up their keys
+    global_values_t global_values;
+    if (fetch_global_values(dc, st, global_map, &global_values) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+#ifdef HAVE_PAYEE_LISTS
+    if (init_payee_list(st, &global_values) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+#endif
+
+    if (init_input_subset(dc, st, &global_values) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+    // Read tx version
+    if (global_values.tx_version_len != 4) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+    st->tx_version = read_u32_le(global_values.tx_version, 0);
+
+    // Read fallback locktime.
+    // Unlike BIP-0370 recommendation, we use the fallback locktime as-is, ignoring each input's
+    // preferred height/block locktime. If that's relevant, the client must set the fallback
+    // locktime to the appropriate value before calling sign_psbt.
+    if (global_values.fallback_locktime_len == -1) {
+        st->locktime = 0;
+    } else if (global_values.fallback_locktime_len != 4) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    } else {
+        st->locktime = read_u32_le(global_values.fallback_locktime, 0);
+    }
+
+    return true;
+}
+
+static bool __attribute__((noinline))
+init_global_state(dispatcher_context_t *dc, sign_psbt_state_t *st) {
+    STACK_PROFILING_FRAME();
+
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    merkleized_map_commitment_t global_map;
+    if (!read_psbt_commitments(dc, &dc->read_buffer, st, &global_map)) return false;
+
+    // the wallet of the request, followed by the optional additional wallets
+    uint8_t wallet_ids[MAX_N_WALLETS_CAN_SIGN][32];
+    uint8_t wallet_hmacs[MAX_N_WALLETS_CAN_SIGN][32];
+    if (!buffer_read_bytes(&dc->read_buffer, wallet_ids[0], 32) ||
+        !buffer_read_bytes(&dc->read_buffer, wallet_hmacs[0], 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return false;
+    }
+    st->n_wallets = 1;
+
+    if (buffer_can_read(&dc->read_buffer, 1)) {
+        // the ids and hmacs of the additional wallets do not fit in the APDU; the request only
+        // contains the hash of their concatenation, whose preimage is requested to the client
+        uint64_t n_additional_wallets;
+        uint8_t additional_wallets_hash[32];
+        if (!buffer_read_varint(&dc->read_buffer, &n_additional_wallets) ||
+            !buffer_read_bytes(&dc->read_buffer, additional_wallets_hash, 32)) {
+            SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+            return false;
+        }
+
+        if (n_additional_wallets > MAX_N_WALLETS_CAN_SIGN - 1) {
+            PRINTF("At most %d wallets are supported\n", MAX_N_WALLETS_CAN_SIGN);
+            SEND_SW(dc, SW_NOT_SUPPORTED);
+            return false;
+        }
+
+#if MAX_N_WALLETS_CAN_SIGN > 1
+        if (n_additional_wallets > 0) {
+            uint8_t additional_wallets[(MAX_N_WALLETS_CAN_SIGN - 1) * 64];
+            int additional_wallets_len = call_get_preimage(dc,
+                                                           additional_wallets_hash,
+                                                           additional_wallets,
+                                                           sizeof(additional_wallets));
+            if (additional_wallets_len != 64 * (int) n_additional_wallets) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return false;
+            }
+
+            for (unsigned int i = 1; i <= (unsigned int) n_additional_wallets; i++) {
+                memcpy(wallet_ids[i], additional_wallets + 64 * (i - 1), 32);
+                memcpy(wallet_hmacs[i], additional_wallets + 64 * (i - 1) + 32, 32);
+
+                for (unsigned int j = 0; j < i; j++) {
+                    if (memcmp(wallet_ids[i], wallet_ids[j], 32) == 0) {
+                        PRINTF("Repeated wallet policy\n");
+                        SEND_SW(dc, SW_INCORRECT_DATA);
+                        return false;
+                    }
+                }
+            }
+        }
+#endif
+        st->n_wallets += (unsigned int) n_additional_wallets;
+    }
+
+    st->is_resumable = false;
+    st->is_resumed = false;
+    if (buffer_can_read(&dc->read_buffer, 1)) {
+        // the token of the session is bound to the rest of the request, which commits to the
+        // whole transaction, including its fee
+        size_t request_len = dc->read_buffer.offset;
+
+        uint64_t n_received_signatures;
+        uint8_t token[RESUME_TOKEN_LEN];
+        if (!buffer_read_varint(&dc->read_buffer, &n_received_signatures) ||
+            n_received_signatures > UINT32_MAX ||
+            !buffer_read_bytes(&dc->read_buffer, token, RESUME_TOKEN_LEN)) {
+            SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+            return false;
+        }
+
+        cx_sha256_t session_context;
+        cx_sha256_init(&session_context);
+        crypto_hash_update(&session_context.header, &st->p2, 1);
+        crypto_hash_update(&session_context.header, dc->read_buffer.ptr, request_len);
+        crypto_hash_digest(&session_context.header, st->session_hash, 32);
+
+        // Swap feature: the transaction is approved in the exchange app for a single command
+        if (!G_swap_state.called_from_swap) {
+            st->is_resumable = true;
+            // with an invalid token (for example, issued before the app was restarted), the
+            // session starts from scratch
+            if (resume_token_check(st->session_hash, token)) {
+                st->is_resumed = true;
+                st->n_signatures_to_skip = (uint32_t) n_received_signatures;
+            }
+        }
+    }
+
+#ifdef HAVE_SIGN_PSBT_DRY_RUN
+    // a dry run behaves as an approved session, that shows no prompt, and computes all the
+    // sighashes; it yields no resume token, as nothing is signed
+    if (st->is_dry_run) {
+        st->is_resumable = false;
+        st->is_resumed = true;
+        st->n_signatures_to_skip = 0;
+    }
+#endif
+
+    if (!process_global_map(dc, st, &global_map)) return false;
+
+    // Swap feature: only a single canonical wallet is allowed
+    if (G_swap_state.called_from_swap && st->n_wallets != 1) {
+        PRINTF("Must be a single wallet for swap feature\n");
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+    st->are_wallets_taproot = true;
+    for (unsigned int i = 0; i < st->n_wallets; i++) {
+        if (!init_wallet(dc, wallet_ids[i], wallet_hmacs[i], st->is_resumed, &st->wallets[i]))
+            return false;
+
+        if (st->wallets[i].policy_map.type != TOKEN_TR) {
+            st->are_wallets_taproot = false;
+        }
+    }
+
+    st->master_key_fingerprint = crypto_get_master_key_fingerprint();
+
+    return true;
+}
+
+static bool __attribute__((noinline))
+fill_placeholder_info_if_internal(dispatcher_context_t *dc,
+                                  sign_psbt_state_t *st,
+                                  placeholder_info_t *placeholder_info) {
+    STACK_PROFILING_FRAME();
+
+    const sign_psbt_wallet_t *wallet = &st->wallets[placeholder_info->wallet_index];
+
+#ifdef HAVE_WALLET_SESSIONS
+    // the keys kept in the open wallet session were already checked when opening it
+    const wallet_session_key_t *session_key =
+        wallet_session_get_key(wallet->header_keys_info_merkle_root,
+                               wallet->header_n_keys,
+                               placeholder_info->placeholder.key_index);
+    if (session_key != NULL) {
+        if (!session_key->is_internal) {
+            return false;
+        }
+
+        memcpy(&placeholder_info->pubkey,
+               &session_key->ext_pubkey,
+               sizeof(placeholder_info->pubkey));
+        placeholder_info->key_derivation_length = session_key->master_key_derivation_len;
+        for (int i = 0; i < session_key->master_key_derivation_len; i++) {
+            placeholder_info->key_derivation[i] = session_key->master_key_derivation[i];
+        }
+        placeholder_info->fingerprint = read_u32_be(session_key->master_key_fingerprint, 0);
+        return true;
+    }
+#endif
+
+    policy_map_key_info_t key_info;
+    {
+        uint8_t key_info_str[MAX_POLICY_KEY_INFO_LEN];
+        int key_info_len = call_get_merkle_leaf_element(dc,
+                                                        wallet->header_keys_info_merkle_root,
+                                                        wallet->header_n_keys,
+                                                        placeholder_info->placeholder.key_index,
+                                                        key_info_str,
+                                                        sizeof(key_info_str));
+
+        if (key_info_len < 0) {
+            SEND_SW(dc, SW_BAD_STATE);  // should never happen
+            return false;
+        }
+
+        // Make a sub-buffer for the pubkey info
+        buffer_t key_info_buffer = buffer_create(key_info_str, key_info_len);
+
+        if (parse_policy_map_key_info(&key_info_buffer, &key_info, wallet->header_version) == -1) {
+            SEND_SW(dc, SW_BAD_STATE);  // should never happen
+            return false;
+        }
+    }
+
+    uint32_t fpr = read_u32_be(key_info.master_key_fingerprint, 0);
+    if (fpr != st->master_key_fingerprint) {
+        return false;
+    }
+
+    {
+        // it could be a collision on the fingerprint; we verify that we can actually generate
+        // the same pubkey
+        char pubkey_derived[MAX_SERIALIZED_PUBKEY_LENGTH + 1];
+        int serialized_pubkey_len =
             get_serialized_extended_pubkey_at_path(key_info.master_key_derivation,
                                                    key_info.master_key_derivation_len,
                                                    BIP32_PUBKEY_VERSION,
@@ -787,18 +2324,23 @@ fill_placeholder_info_if_internal(dispatcher_context_t *dc,
     return true;
 }
 
-// finds the first placeholder that corresponds to an internal key
+// finds the first placeholder of the wallet with the given index that corresponds to an internal
+// key
 static bool find_first_internal_key_placeholder(dispatcher_context_t *dc,
                                                 sign_psbt_state_t *st,
+                                                unsigned int wallet_index,
                                                 placeholder_info_t *placeholder_info) {
+    const key_placeholders_table_t *key_placeholders = &st->wallets[wallet_index].key_placeholders;
+
+    placeholder_info->wallet_index = wallet_index;
     placeholder_info->cur_index = 0;
 
     // find and parse our registered key info in the wallet
     while (true) {
-        int n_key_placeholders = get_key_placeholder_by_index(&st->wallet_policy_map,
-                                                              placeholder_info->cur_index,
-                                                              NULL,
-                                                              &placeholder_info->placeholder);
+        int n_key_placeholders = get_key_placeholder_from_table(key_placeholders,
+                                                                placeholder_info->cur_index,
+                                                                NULL,
+                                                                &placeholder_info->placeholder);
         if (n_key_placeholders < 0) {
             SEND_SW(dc, SW_BAD_STATE);  // should never happen
             return false;
@@ -823,7 +2365,11 @@ static bool find_first_internal_key_placeholder(dispatcher_context_t *dc,
 }
 
 typedef struct {
-    placeholder_info_t *placeholder_info;
+    placeholder_info_t *placeholder_info;  // array of n_placeholders internal placeholders
+    size_t n_placeholders;  // if 0, the BIP32 derivations are not processed
+    bool use_derivation_hints;  // if true, the derivation hint is used instead of the BIP32
+                                // derivations
+    bool defer_tap_derivations;  // if true, the taproot BIP32 derivations are deferred too
     input_info_t *input;
 } input_keys_callback_data_t;
 
@@ -848,51 +2394,397 @@ static void input_keys_callback(dispatcher_context_t *dc,
             callback_data->input->has_redeemScript = true;
         } else if (key_type == PSBT_IN_SIGHASH_TYPE) {
             callback_data->input->has_sighash_type = true;
+        } else if (callback_data->use_derivation_hints &&
+                   is_ledger_proprietary_key(key_type, data, PSBT_LEDGER_IN_OUT_DERIVATION_HINT)) {
+            callback_data->input->in_out.has_derivation_hint = true;
+            callback_data->input->in_out.derivation_hint_index = i;
         } else if ((key_type == PSBT_IN_BIP32_DERIVATION ||
                     key_type == PSBT_IN_TAP_BIP32_DERIVATION) &&
+                   callback_data->n_placeholders > 0 &&
                    !callback_data->input->in_out.placeholder_found) {
-            if (0 >
-                read_change_and_index_from_psbt_bip32_derivation(dc,
-                                                                 callback_data->placeholder_info,
-                                                                 &callback_data->input->in_out,
-                                                                 key_type,
-                                                                 data,
-                                                                 map_commitment,
-                                                                 i)) {
+            if (callback_data->use_derivation_hints) {
+                if (!is_bip32_derivation_pubkey_len_valid(key_type == PSBT_IN_TAP_BIP32_DERIVATION,
+                                                          data)) {
+                    callback_data->input->in_out.unexpected_pubkey_error = true;
+                }
+            } else if (0 > read_or_defer_psbt_bip32_derivation(
+                               dc,
+                               callback_data->placeholder_info,
+                               callback_data->n_placeholders,
+                               &callback_data->input->in_out,
+                               key_type,
+                               callback_data->defer_tap_derivations,
+                               data,
+                               map_commitment,
+                               i)) {
                 callback_data->input->in_out.unexpected_pubkey_error = true;
             }
         }
     }
 }
 
+/**
+ * Fetches the map commitment of the input with the given index, calling the callback for each of
+ * its keys (if not NULL).
+ * When iterating over the inputs in order, the leaf hashes are fetched and verified in batches of
+ * consecutive inputs, which saves a GET_MERKLE_LEAF_PROOF round trip per input.
+ *
+ * Returns a negative number on failure.
+ */
+static int get_input_map_batched(dispatcher_context_t *dc,
+                                 sign_psbt_state_t *st,
+                                 inputs_leaf_hashes_batch_t *batch,
+                                 unsigned int index,
+                                 void *callback_state,
+                                 merkle_tree_elements_callback_t callback,
+                                 merkleized_map_commitment_t *out_ptr) {
+    if (batch->n_hashes == 0 || index < batch->first_index ||
+        index >= batch->first_index + batch->n_hashes) {
+        unsigned int n_hashes = MIN(MAX_MERKLE_LEAF_HASHES_BATCH, st->n_inputs - index);
+        if (0 > call_get_merkle_leaf_hashes(dc,
+                                            st->inputs_root,
+                                            st->n_inputs,
+                                            index,
+                                            n_hashes,
+                                            batch->hashes)) {
+            batch->n_hashes = 0;
+            return -1;
+        }
+        batch->first_index = index;
+        batch->n_hashes = n_hashes;
+    }
+
+    if (0 > call_get_merkleized_map_from_leaf_hash_with_callback(
+                dc,
+                callback_state,
+                batch->hashes[index - batch->first_index],
+                callback,
+                out_ptr)) {
+        return -1;
+    }
+
+#ifdef HAVE_MAP_COMMITMENT_CACHE
+    // the leaf hash was verified in the batch, the map is kept for the next phases
+    map_commitment_cache_add(st->inputs_root, st->n_inputs, index, out_ptr);
+#endif
+    return 0;
+}
+
+#ifdef USE_SINGLE_PASS_SEGWIT_HASHES
+/**
+ * Adds the input's data to the tx-wide hashes of the inputs. The prevout amount and scriptPubKey of
+ * the input must already be known.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
+static bool __attribute__((noinline)) update_inputs_hashes(dispatcher_context_t *dc,
+                                                           inputs_hashes_contexts_t *contexts,
+                                                           const input_info_t *input,
+                                                           const uint8_t prevout_hash[static 32]) {
+    STACK_PROFILING_FRAME();
+
+    crypto_hash_update(&contexts->sha_prevouts_context.header, prevout_hash, 32);
+
+    uint8_t prevout_n_raw[4];
+    if (4 != call_get_merkleized_map_value(dc,
+                                           &input->in_out.map,
+                                           (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
+                                           1,
+                                           prevout_n_raw,
+                                           4)) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+    crypto_hash_update(&contexts->sha_prevouts_context.header, prevout_n_raw, 4);
+
+    uint8_t nSequence_raw[4];
+    if (4 != call_get_merkleized_map_value(dc,
+                                           &input->in_out.map,
+                                           (uint8_t[]){PSBT_IN_SEQUENCE},
+                                           1,
+                                           nSequence_raw,
+                                           4)) {
+        // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
+        memset(nSequence_raw, 0xFF, 4);
+    }
+
+    crypto_hash_update(&contexts->sha_sequences_context.header, nSequence_raw, 4);
+
+    uint8_t amount_le[8];
+    write_u64_le(amount_le, 0, input->prevout_amount);
+    crypto_hash_update(&contexts->sha_amounts_context.header, amount_le, 8);
+
+    crypto_hash_update_varint(&contexts->sha_scriptpubkeys_context.header,
+                              input->in_out.scriptPubKey_len);
+    crypto_hash_update(&contexts->sha_scriptpubkeys_context.header,
+                       input->in_out.scriptPubKey,
+                       input->in_out.scriptPubKey_len);
+
+    return true;
+}
+#endif
+
+#ifdef HAVE_OFFLOADED_RECORDS
+// The offloaded record of an input is: <flags : 1> <address_index : 4, little endian>
+#define OFFLOADED_INPUT_RECORD_LEN              5
+#define OFFLOADED_INPUT_RECORD_IS_INTERNAL      0x01
+#define OFFLOADED_INPUT_RECORD_IS_CHANGE        0x02
+#define OFFLOADED_INPUT_RECORD_IS_SECOND_WALLET 0x04
+
+/**
+ * Sends to the client the record of an input, as detected in preprocess_inputs.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
+static bool put_offloaded_input_record(dispatcher_context_t *dc,
+                                       const sign_psbt_state_t *st,
+                                       unsigned int input_index,
+                                       bool is_internal,
+                                       unsigned int wallet_index,
+                                       const in_out_info_t *in_out) {
+    uint8_t record[OFFLOADED_INPUT_RECORD_LEN] = {0};
+    if (is_internal) {
+        record[0] = OFFLOADED_INPUT_RECORD_IS_INTERNAL;
+        if (in_out->is_change) {
+            record[0] |= OFFLOADED_INPUT_RECORD_IS_CHANGE;
+        }
+        if (wallet_index == 1) {
+            record[0] |= OFFLOADED_INPUT_RECORD_IS_SECOND_WALLET;
+        }
+        write_u32_le(record, 1, in_out->address_index);
+    }
+
+    if (0 > call_put_offloaded_record(dc,
+                                      st->offloaded_input_records,
+                                      input_index,
+                                      record,
+                                      sizeof(record))) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+    return true;
+}
+#endif
+
+/**
+ * Looks up if an input was detected as internal in preprocess_inputs, and its derivation if it was
+ * recorded; *has_record is set accordingly. *internal_input_index is the number of internal inputs
+ * before this one, and it is incremented if the input is internal. For an internal input,
+ * *wallet_index is set to the index of its wallet.
+ *
+ * Returns 1 if the input is internal, 0 if it is external, or -1 (after sending the status word) on
+ * failure.
+ */
+static int get_internal_input_record(
+    dispatcher_context_t *dc,
+    const sign_psbt_state_t *st,
+    const uint8_t internal_inputs[static BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)],
+    const internal_input_records_t *internal_input_records,
+    unsigned int input_index,
+    unsigned int *internal_input_index,
+    unsigned int *wallet_index,
+    internal_input_record_t *record,
+    bool *has_record) {
+    *has_record = false;
+    *wallet_index = 0;
+
+#ifdef HAVE_OFFLOADED_RECORDS
+    if (st->offloaded_input_records != NULL) {
+        uint8_t offloaded_record[OFFLOADED_INPUT_RECORD_LEN];
+        if (0 > call_get_offloaded_record(dc,
+                                          st->offloaded_input_records,
+                                          input_index,
+                                          offloaded_record,
+                                          sizeof(offloaded_record))) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return -1;
+        }
+        if (!(offloaded_record[0] & OFFLOADED_INPUT_RECORD_IS_INTERNAL)) {
+            return 0;
+        }
+        record->is_change = (offloaded_record[0] & OFFLOADED_INPUT_RECORD_IS_CHANGE) != 0;
+        record->address_index = read_u32_le(offloaded_record, 1);
+        if (offloaded_record[0] & OFFLOADED_INPUT_RECORD_IS_SECOND_WALLET) {
+            if (st->n_wallets < 2) {
+                SEND_SW(dc, SW_BAD_STATE);  // should never happen, as the record is authenticated
+                return -1;
+            }
+            *wallet_index = 1;
+        }
+        *has_record = true;
+        ++*internal_input_index;
+        return 1;
+    }
+#else
+    (void) dc;
+    (void) st;
+#endif
+
+    if (!bitvector_get(internal_inputs, input_index)) {
+        return 0;
+    }
+#if MAX_N_WALLETS_CAN_SIGN > 1
+    if (bitvector_get(st->second_wallet_inputs, input_index)) {
+        *wallet_index = 1;
+    }
+#endif
+    if (*internal_input_index < internal_input_records->n_records) {
+        *record = internal_input_records->records[*internal_input_index];
+        *has_record = true;
+    }
+    ++*internal_input_index;
+    return 1;
+}
+
+/**
+ * Fetches the values of the map of an input that are used by preprocess_inputs: the previous txid,
+ * if needs_prevout_hash is true, and the amount and scriptPubKey of the witness utxo, if the input
+ * has one. If the access plan of the inputs was announced, both values are read from it instead,
+ * whether they are used or not.
+ *
+ * Returns -1 on failure, 0 on success.
+ */
+static int __attribute__((noinline))
+fetch_input_values(dispatcher_context_t *dc,
+                   const input_info_t *input,
+                   bool needs_prevout_hash,
+                   uint8_t prevout_hash[static 32],
+                   uint64_t *wit_utxo_amount,
+                   uint8_t wit_utxo_scriptPubKey[static MAX_PREVOUT_SCRIPTPUBKEY_LEN],
+                   size_t *wit_utxo_scriptPubKey_len) {
+    STACK_PROFILING_FRAME();
+
+#ifdef HAVE_ACCESS_PLANS
+    if (access_plan_is_enabled()) {
+        // the keys of the access plan announced in preprocess_inputs, in the same order
+        uint8_t raw_witnessUtxo[MAX_WITNESS_UTXO_LEN];
+        merkleized_map_value_request_t requests[] = {
+            {(uint8_t[]){PSBT_IN_PREVIOUS_TXID}, 1, prevout_hash, 32},
+            {(uint8_t[]){PSBT_IN_WITNESS_UTXO}, 1, raw_witnessUtxo, sizeof(raw_witnessUtxo)}};
+        if (0 > call_get_planned_map_values(dc, &input->in_out.map, requests, 2) ||
+            (needs_prevout_hash && requests[0].value_len < 0)) {
+            return -1;
+        }
+        if (input->has_witnessUtxo) {
+            return parse_witness_utxo(raw_witnessUtxo,
+                                      requests[1].value_len,
+                                      wit_utxo_amount,
+                                      wit_utxo_scriptPubKey,
+                                      wit_utxo_scriptPubKey_len);
+        }
+        return 0;
+    }
+#endif
+
+    if (needs_prevout_hash && 0 > call_get_merkleized_map_value(dc,
+                                                                &input->in_out.map,
+                                                                (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
+                                                                1,
+                                                                prevout_hash,
+                                                                32)) {
+        return -1;
+    }
+    if (input->has_witnessUtxo) {
+        return get_amount_scriptpubkey_from_psbt_witness(dc,
+                                                         &input->in_out.map,
+                                                         wit_utxo_amount,
+                                                         wit_utxo_scriptPubKey,
+                                                         wit_utxo_scriptPubKey_len);
+    }
+    return 0;
+}
+
 static bool __attribute__((noinline))
 preprocess_inputs(dispatcher_context_t *dc,
                   sign_psbt_state_t *st,
-                  uint8_t internal_inputs[static BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)]) {
+                  uint8_t internal_inputs[static BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)],
+                  internal_input_records_t *internal_input_records,
+                  segwit_hashes_t *hashes) {
+    STACK_PROFILING_FRAME();
+
     LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
     memset(internal_inputs, 0, BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN));
+    internal_input_records->n_records = 0;
+
+#ifdef USE_SINGLE_PASS_SEGWIT_HASHES
+    inputs_hashes_contexts_t inputs_hashes_contexts;
+    cx_sha256_init(&inputs_hashes_contexts.sha_prevouts_context);
+    cx_sha256_init(&inputs_hashes_contexts.sha_amounts_context);
+    cx_sha256_init(&inputs_hashes_contexts.sha_scriptpubkeys_context);
+    cx_sha256_init(&inputs_hashes_contexts.sha_sequences_context);
+#else
+    (void) hashes;
+#endif
+
+    // the first internal placeholder of each wallet, that the derivations are matched against
+    placeholder_info_t placeholder_info[MAX_N_WALLETS_CAN_SIGN];
+    memset(placeholder_info, 0, sizeof(placeholder_info));
+
+    for (unsigned int i = 0; i < st->n_wallets; i++) {
+        if (!find_first_internal_key_placeholder(dc, st, i, &placeholder_info[i])) return false;
+
+#ifdef HAVE_SINGLESIG_FAST_PATH
+        // the account's pubkey was verified to match the one in the key information
+        sign_psbt_wallet_t *wallet = &st->wallets[i];
+        wallet->use_singlesig_wallet =
+            wallet->is_canonical && singlesig_wallet_init(&wallet->singlesig_wallet,
+                                                          &wallet->policy_map,
+                                                          &placeholder_info[i].pubkey);
+#endif
+    }
 
-    placeholder_info_t placeholder_info;
-    memset(&placeholder_info, 0, sizeof(placeholder_info));
-
-    if (!find_first_internal_key_placeholder(dc, st, &placeholder_info)) return false;
+    inputs_leaf_hashes_batch_t leaf_hashes_batch = {.n_hashes = 0};
+
+    // For taproot policies, all the internal inputs are signed with BIP-341 sighashes, which commit
+    // to the amounts and scriptPubKeys of all the inputs: the witness utxos are enough, and the
+    // non-witness utxos are not validated for the inputs that have both. The taproot BIP32
+    // derivations are only fetched after the scriptPubKey is known.
+    bool is_taproot_policy = st->are_wallets_taproot;
+
+#ifdef HAVE_ACCESS_PLANS
+    // the values of each input are read from a single stream (see fetch_input_values)
+    if (access_plan_is_enabled() &&
+        0 > call_announce_access_plan(
+                dc,
+                st->inputs_root,
+                st->n_inputs,
+                (const uint8_t *const[]){(uint8_t[]){PSBT_IN_PREVIOUS_TXID},
+                                         (uint8_t[]){PSBT_IN_WITNESS_UTXO}},
+                (const uint8_t[]){1, 1},
+                2)) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+#endif
 
     // process each input
     for (unsigned int cur_input_index = 0; cur_input_index < st->n_inputs; cur_input_index++) {
+        if (!yield_progress(dc,
+                            st,
+                            PROGRESS_PHASE_INPUTS,
+                            cur_input_index,
+                            st->n_inputs,
+                            cur_input_index == 0))
+            return false;
+
         input_info_t input;
         memset(&input, 0, sizeof(input));
 
-        input_keys_callback_data_t callback_data = {.input = &input,
-                                                    .placeholder_info = &placeholder_info};
-        int res = call_get_merkleized_map_with_callback(
-            dc,
-            (void *) &callback_data,
-            st->inputs_root,
-            st->n_inputs,
-            cur_input_index,
-            (merkle_tree_elements_callback_t) input_keys_callback,
-            &input.in_out.map);
+        input_keys_callback_data_t callback_data = {
+            .input = &input,
+            .placeholder_info = placeholder_info,
+            .n_placeholders = st->n_wallets,
+            .use_derivation_hints = st->has_derivation_hints,
+            .defer_tap_derivations = is_taproot_policy};
+        int res = get_input_map_batched(dc,
+                                        st,
+                                        &leaf_hashes_batch,
+                                        cur_input_index,
+                                        (void *) &callback_data,
+                                        (merkle_tree_elements_callback_t) input_keys_callback,
+                                        &input.in_out.map);
         if (res < 0) {
             PRINTF("Failed to process input map\n");
             SEND_SW(dc, SW_INCORRECT_DATA);
@@ -914,23 +2806,39 @@ preprocess_inputs(dispatcher_context_t *dc,
 
         // validate non-witness utxo (if present) and witness utxo (if present)
 
-        if (input.has_nonWitnessUtxo) {
-            uint8_t prevout_hash[32];
+        bool uses_nonwitness_utxo =
+            input.has_nonWitnessUtxo && !(is_taproot_policy && input.has_witnessUtxo);
 
-            // check if the prevout_hash of the transaction matches the computed one from the
-            // non-witness utxo
-            if (0 > call_get_merkleized_map_value(dc,
-                                                  &input.in_out.map,
-                                                  (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
-                                                  1,
-                                                  prevout_hash,
-                                                  sizeof(prevout_hash))) {
-                SEND_SW(dc, SW_INCORRECT_DATA);
-                return false;
-            }
+        uint8_t prevout_hash[32];
+
+#ifdef USE_SINGLE_PASS_SEGWIT_HASHES
+        bool needs_prevout_hash = true;  // always needed for the tx-wide hashes
+#else
+        bool needs_prevout_hash = uses_nonwitness_utxo;
+#endif
+
+        size_t wit_utxo_scriptPubkey_len;
+        uint8_t wit_utxo_scriptPubkey[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
+        uint64_t wit_utxo_prevout_amount;
+
+        if (0 > fetch_input_values(dc,
+                                   &input,
+                                   needs_prevout_hash,
+                                   prevout_hash,
+                                   &wit_utxo_prevout_amount,
+                                   wit_utxo_scriptPubkey,
+                                   &wit_utxo_scriptPubkey_len)) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return false;
+        }
 
-            // request non-witness utxo, and get the prevout's value and scriptpubkey
+        if (uses_nonwitness_utxo) {
+            // request non-witness utxo, and get the prevout's value and scriptpubkey; this also
+            // checks that the prevout_hash of the transaction matches the computed one from the
+            // non-witness utxo
             if (0 > get_amount_scriptpubkey_from_psbt_nonwitness(dc,
+                                                                 st,
+                                                                 cur_input_index,
                                                                  &input.in_out.map,
                                                                  &input.prevout_amount,
                                                                  input.in_out.scriptPubKey,
@@ -944,20 +2852,7 @@ preprocess_inputs(dispatcher_context_t *dc,
         }
 
         if (input.has_witnessUtxo) {
-            size_t wit_utxo_scriptPubkey_len;
-            uint8_t wit_utxo_scriptPubkey[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
-            uint64_t wit_utxo_prevout_amount;
-
-            if (0 > get_amount_scriptpubkey_from_psbt_witness(dc,
-                                                              &input.in_out.map,
-                                                              &wit_utxo_prevout_amount,
-                                                              wit_utxo_scriptPubkey,
-                                                              &wit_utxo_scriptPubkey_len)) {
-                SEND_SW(dc, SW_INCORRECT_DATA);
-                return false;
-            };
-
-            if (input.has_nonWitnessUtxo) {
+            if (uses_nonwitness_utxo) {
                 // we already know the scriptPubKey, but we double check that it matches
                 if (input.in_out.scriptPubKey_len != wit_utxo_scriptPubkey_len ||
                     memcmp(input.in_out.scriptPubKey,
@@ -980,24 +2875,94 @@ preprocess_inputs(dispatcher_context_t *dc,
             }
         }
 
+#ifdef USE_SINGLE_PASS_SEGWIT_HASHES
+        if (!update_inputs_hashes(dc, &inputs_hashes_contexts, &input, prevout_hash)) {
+            return false;
+        }
+#endif
+
+        // the derivations are only processed if the scriptPubKey could be one of the wallets'
+        bool has_wallet_script_shape = false;
+        for (unsigned int i = 0; i < st->n_wallets; i++) {
+            if (has_policy_script_shape(&st->wallets[i].policy_map,
+                                        input.in_out.scriptPubKey,
+                                        input.in_out.scriptPubKey_len)) {
+                has_wallet_script_shape = true;
+                break;
+            }
+        }
+
+        if (has_wallet_script_shape &&
+            (process_deferred_derivations(dc, placeholder_info, st->n_wallets, &input.in_out) < 0 ||
+             process_derivation_hint(dc, &input.in_out) < 0)) {
+            PRINTF("Failed to process input map\n");
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return false;
+        }
+
         // check if the input is internal; if not, continue
 
-        int is_internal = is_in_out_internal(dc, st, &input.in_out, true);
+        unsigned int wallet_index = 0;
+        int is_internal =
+            find_in_out_wallet(dc, st, placeholder_info, &input.in_out, true, &wallet_index);
         if (is_internal < 0) {
             PRINTF("Error checking if input %d is internal\n", cur_input_index);
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
-        } else if (is_internal == 0) {
-            PRINTF("INPUT %d is external\n", cur_input_index);
-            continue;
         }
 
-        bitvector_set(internal_inputs, cur_input_index, 1);
+#ifdef HAVE_OFFLOADED_RECORDS
+        if (st->offloaded_input_records != NULL) {
+            if (!put_offloaded_input_record(dc,
+                                            st,
+                                            cur_input_index,
+                                            is_internal == 1,
+                                            wallet_index,
+                                            &input.in_out)) {
+                return false;
+            }
+        } else {
+            bitvector_set(internal_inputs, cur_input_index, is_internal);
+#if MAX_N_WALLETS_CAN_SIGN > 1
+            bitvector_set(st->second_wallet_inputs, cur_input_index, wallet_index == 1);
+#endif
+        }
+#else
+        bitvector_set(internal_inputs, cur_input_index, is_internal);
+#if MAX_N_WALLETS_CAN_SIGN > 1
+        bitvector_set(st->second_wallet_inputs, cur_input_index, wallet_index == 1);
+#endif
+#endif
+
+        if (is_internal == 0) {
+            PRINTF("INPUT %d is external\n", cur_input_index);
+            continue;
+        }
+
+        ++st->internal_inputs_count;
         st->internal_inputs_total_value += input.prevout_amount;
 
+        if (internal_input_records->n_records < MAX_INTERNAL_INPUT_RECORDS) {
+            internal_input_record_t *record =
+                &internal_input_records->records[internal_input_records->n_records++];
+            record->address_index = input.in_out.address_index;
+            record->is_change = input.in_out.is_change;
+            record->wallet_index = (uint8_t) wallet_index;
+        }
+
         int segwit_version =
             get_segwit_version(input.in_out.scriptPubKey, input.in_out.scriptPubKey_len);
 
+        if (segwit_version == -1) {
+            st->has_internal_legacy_inputs = true;
+        }
+
+#ifndef USE_SINGLE_PASS_SEGWIT_HASHES
+        if (segwit_version == 1) {
+            st->has_internal_segwitv1_inputs = true;
+        }
+#endif
+
         // For legacy inputs, the non-witness utxo must be present
         if (segwit_version == -1 && !input.has_nonWitnessUtxo) {
             PRINTF("Non-witness utxo missing for legacy input\n");
@@ -1062,23 +3027,53 @@ preprocess_inputs(dispatcher_context_t *dc,
             SEND_SW(dc, SW_NOT_SUPPORTED);
             return false;
         }
+
+        if ((input.sighash_type & SIGHASH_SINGLE) == SIGHASH_SINGLE &&
+            cur_input_index < SINGLE_OUTPUT_HASHES_CACHE_SIZE) {
+            st->single_output_hashes->needed |= 1U << cur_input_index;
+        }
     }
 
+    if (!yield_progress(dc, st, PROGRESS_PHASE_INPUTS, st->n_inputs, st->n_inputs, true))
+        return false;
+
+#ifdef USE_SINGLE_PASS_SEGWIT_HASHES
+    crypto_hash_digest(&inputs_hashes_contexts.sha_prevouts_context.header,
+                       hashes->sha_prevouts,
+                       32);
+    crypto_hash_digest(&inputs_hashes_contexts.sha_amounts_context.header,
+                       hashes->sha_amounts,
+                       32);
+    crypto_hash_digest(&inputs_hashes_contexts.sha_scriptpubkeys_context.header,
+                       hashes->sha_scriptpubkeys,
+                       32);
+    crypto_hash_digest(&inputs_hashes_contexts.sha_sequences_context.header,
+                       hashes->sha_sequences,
+                       32);
+#endif
+
+#ifdef HAVE_BACKGROUND_TASKS
+    // the public /<change> nodes of the recorded internal inputs are derived in the background,
+    // for the placeholder of the first wallet
+    signing_keys_prefetch_t *prefetch = st->signing_keys_prefetch;
+    memcpy(&prefetch->placeholder_info, &placeholder_info[0], sizeof(placeholder_info_t));
+    for (unsigned int i = 0; i < internal_input_records->n_records; i++) {
+        if (internal_input_records->records[i].wallet_index == 0) {
+            prefetch->needs_change_node[internal_input_records->records[i].is_change ? 1 : 0] =
+                true;
+        }
+    }
+#endif
+
     return true;
 }
 
-static bool __attribute__((noinline))
-show_alerts(dispatcher_context_t *dc,
-            sign_psbt_state_t *st,
-            const uint8_t internal_inputs[static BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)]) {
+static bool __attribute__((noinline)) show_alerts(dispatcher_context_t *dc, sign_psbt_state_t *st) {
+    STACK_PROFILING_FRAME();
+
     LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
-    size_t count_external_inputs = 0;
-    for (unsigned int i = 0; i < st->n_inputs; i++) {
-        if (!bitvector_get(internal_inputs, i)) {
-            ++count_external_inputs;
-        }
-    }
+    size_t count_external_inputs = st->n_inputs - st->internal_inputs_count;
 
     // If there are external inputs, it is unsafe to sign, therefore we warn the user
     if (count_external_inputs > 0) {
@@ -1096,22 +3091,33 @@ show_alerts(dispatcher_context_t *dc,
             }
 
             // some internal and some external inputs, warn the user first
-            if (!ui_warn_external_inputs(dc)) {
+            if (!st->is_resumed && !ui_warn_external_inputs(dc)) {
                 SEND_SW(dc, SW_DENY);
                 return false;
             }
         }
     }
 
+    // Swap feature: the transaction was already approved in the exchange app, and no warning is
+    // shown; therefore, the transactions that would need one are rejected
+    if (G_swap_state.called_from_swap &&
+        (st->show_missing_nonwitnessutxo_warning || st->show_nondefault_sighash_warning)) {
+        PRINTF("Unverified inputs or non-default sighash not allowed in swap transactions\n");
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
     // If any segwitv0 input is missing the non-witness-utxo, we warn the user and ask for
     // confirmation
-    if (st->show_missing_nonwitnessutxo_warning && !ui_warn_unverified_segwit_inputs(dc)) {
+    if (st->show_missing_nonwitnessutxo_warning && !st->is_resumed &&
+        !ui_warn_unverified_segwit_inputs(dc)) {
         SEND_SW(dc, SW_DENY);
         return false;
     }
 
     // If any input has non-default sighash, we warn the user
-    if (st->show_nondefault_sighash_warning && !ui_warn_nondefault_sighash(dc)) {
+    if (st->show_nondefault_sighash_warning && !st->is_resumed &&
+        !ui_warn_nondefault_sighash(dc)) {
         SEND_SW(dc, SW_DENY);
         return false;
     }
@@ -1120,7 +3126,10 @@ show_alerts(dispatcher_context_t *dc,
 }
 
 typedef struct {
-    placeholder_info_t *placeholder_info;
+    placeholder_info_t *placeholder_info;  // array of n_placeholders internal placeholders
+    size_t n_placeholders;
+    bool use_derivation_hints;  // if true, the derivation hint is used instead of the BIP32
+                                // derivations
     output_info_t *output;
 } output_keys_callback_data_t;
 
@@ -1138,16 +3147,28 @@ static void output_keys_callback(dispatcher_context_t *dc,
         uint8_t key_type;
         buffer_read_u8(data, &key_type);
 
-        if ((key_type == PSBT_OUT_BIP32_DERIVATION || key_type == PSBT_OUT_TAP_BIP32_DERIVATION) &&
-            !callback_data->output->in_out.placeholder_found) {
-            if (0 >
-                read_change_and_index_from_psbt_bip32_derivation(dc,
-                                                                 callback_data->placeholder_info,
-                                                                 &callback_data->output->in_out,
-                                                                 key_type,
-                                                                 data,
-                                                                 map_commitment,
-                                                                 i)) {
+        if (callback_data->use_derivation_hints &&
+            is_ledger_proprietary_key(key_type, data, PSBT_LEDGER_IN_OUT_DERIVATION_HINT)) {
+            callback_data->output->in_out.has_derivation_hint = true;
+            callback_data->output->in_out.derivation_hint_index = i;
+        } else if ((key_type == PSBT_OUT_BIP32_DERIVATION ||
+                    key_type == PSBT_OUT_TAP_BIP32_DERIVATION) &&
+                   !callback_data->output->in_out.placeholder_found) {
+            if (callback_data->use_derivation_hints) {
+                if (!is_bip32_derivation_pubkey_len_valid(key_type == PSBT_OUT_TAP_BIP32_DERIVATION,
+                                                          data)) {
+                    callback_data->output->in_out.unexpected_pubkey_error = true;
+                }
+            } else if (0 > read_or_defer_psbt_bip32_derivation(
+                               dc,
+                               callback_data->placeholder_info,
+                               callback_data->n_placeholders,
+                               &callback_data->output->in_out,
+                               key_type,
+                               false,
+                               data,
+                               map_commitment,
+                               i)) {
                 callback_data->output->in_out.unexpected_pubkey_error = true;
             }
         }
@@ -1158,6 +3179,8 @@ static bool __attribute__((noinline)) display_output(dispatcher_context_t *dc,
                                                      sign_psbt_state_t *st,
                                                      int cur_output_index,
                                                      const output_info_t *output) {
+    STACK_PROFILING_FRAME();
+
     (void) cur_output_index;
 
     // show this output's address
@@ -1196,7 +3219,7 @@ static bool __attribute__((noinline)) display_output(dispatcher_context_t *dc,
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
         }
-    } else {
+    } else if (!st->is_resumed) {
         // Show address to the user
         if (!ui_validate_output(dc,
                                 st->external_outputs_count,
@@ -1210,8 +3233,21 @@ static bool __attribute__((noinline)) display_output(dispatcher_context_t *dc,
     return true;
 }
 
+/**
+ * Verifies the outputs, and computes sha_outputs in hashes. As the serialization of each output
+ * is known at this point, the serialization of all the outputs for the legacy sighash is also
+ * stored in legacy_sighash_cache if it fits, so that the outputs are not fetched again when
+ * signing.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
 static bool __attribute__((noinline))
-process_outputs(dispatcher_context_t *dc, sign_psbt_state_t *st) {
+process_outputs(dispatcher_context_t *dc,
+                sign_psbt_state_t *st,
+                segwit_hashes_t *hashes,
+                legacy_sighash_cache_t *legacy_sighash_cache) {
+    STACK_PROFILING_FRAME();
+
     /** OUTPUTS VERIFICATION FLOW
      *
      *  For each output, check if it's a change address.
@@ -1220,17 +3256,61 @@ process_outputs(dispatcher_context_t *dc, sign_psbt_state_t *st) {
 
     LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
-    placeholder_info_t placeholder_info;
-    memset(&placeholder_info, 0, sizeof(placeholder_info));
+    // the first internal placeholder of each wallet, that the derivations are matched against
+    placeholder_info_t placeholder_info[MAX_N_WALLETS_CAN_SIGN];
+    memset(placeholder_info, 0, sizeof(placeholder_info));
+
+    for (unsigned int i = 0; i < st->n_wallets; i++) {
+        if (!find_first_internal_key_placeholder(dc, st, i, &placeholder_info[i])) return false;
+    }
+
+#ifdef HAVE_ACCESS_PLANS
+    // the amount and the script of each output are read from a single stream
+    if (access_plan_is_enabled() &&
+        0 > call_announce_access_plan(
+                dc,
+                st->outputs_root,
+                st->n_outputs,
+                (const uint8_t *const[]){(uint8_t[]){PSBT_OUT_AMOUNT},
+                                         (uint8_t[]){PSBT_OUT_SCRIPT}},
+                (const uint8_t[]){1, 1},
+                2)) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+#endif
+
+    cx_sha256_t sha_outputs_context;
+    cx_sha256_init(&sha_outputs_context);
 
-    if (!find_first_internal_key_placeholder(dc, st, &placeholder_info)) return false;
+    // the outputs are serialized in the legacy sighash cache, as long as they fit
+    buffer_t legacy_outputs_buf =
+        buffer_create(legacy_sighash_cache->outputs, sizeof(legacy_sighash_cache->outputs));
+    {
+        uint8_t n_outputs_varint[9];
+        int n_outputs_varint_len = varint_write(n_outputs_varint, 0, st->n_outputs);
+        if (!buffer_write_bytes(&legacy_outputs_buf, n_outputs_varint, n_outputs_varint_len)) {
+            legacy_sighash_cache->outputs_len = -1;  // too long to be cached
+        }
+    }
 
     for (unsigned int cur_output_index = 0; cur_output_index < st->n_outputs; cur_output_index++) {
+        if (!yield_progress(dc,
+                            st,
+                            PROGRESS_PHASE_OUTPUTS,
+                            cur_output_index,
+                            st->n_outputs,
+                            cur_output_index == 0))
+            return false;
+
         output_info_t output;
         memset(&output, 0, sizeof(output));
 
-        output_keys_callback_data_t callback_data = {.output = &output,
-                                                     .placeholder_info = &placeholder_info};
+        output_keys_callback_data_t callback_data = {
+            .output = &output,
+            .placeholder_info = placeholder_info,
+            .n_placeholders = st->n_wallets,
+            .use_derivation_hints = st->has_derivation_hints};
         int res = call_get_merkleized_map_with_callback(
             dc,
             (void *) &callback_data,
@@ -1239,7 +3319,9 @@ process_outputs(dispatcher_context_t *dc, sign_psbt_state_t *st) {
             cur_output_index,
             (merkle_tree_elements_callback_t) output_keys_callback,
             &output.in_out.map);
-        if (res < 0) {
+        if (res < 0 ||
+            0 > process_deferred_derivations(dc, placeholder_info, st->n_wallets, &output.in_out) ||
+            process_derivation_hint(dc, &output.in_out) < 0) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
         }
@@ -1253,48 +3335,103 @@ process_outputs(dispatcher_context_t *dc, sign_psbt_state_t *st) {
         // read output amount and scriptpubkey
 
         uint8_t raw_result[8];
-
-        // Read the output's amount
-        int result_len = call_get_merkleized_map_value(dc,
-                                                       &output.in_out.map,
-                                                       (uint8_t[]){PSBT_OUT_AMOUNT},
-                                                       1,
-                                                       raw_result,
-                                                       sizeof(raw_result));
-        if (result_len != 8) {
+        merkleized_map_value_request_t requests[] = {
+            {(uint8_t[]){PSBT_OUT_AMOUNT}, 1, raw_result, sizeof(raw_result)},
+            {(uint8_t[]){PSBT_OUT_SCRIPT},
+             1,
+             output.in_out.scriptPubKey,
+             sizeof(output.in_out.scriptPubKey)}};
+        int n_values;
+#ifdef HAVE_ACCESS_PLANS
+        if (access_plan_is_enabled()) {
+            // the keys of the access plan announced above, in the same order
+            n_values = call_get_planned_map_values(dc, &output.in_out.map, requests, 2);
+        } else
+#endif
+        {
+            n_values = call_get_merkleized_map_values(dc, &output.in_out.map, requests, 2);
+        }
+        if (0 > n_values || requests[0].value_len != 8 || requests[1].value_len < 0) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
         }
+
         uint64_t value = read_u64_le(raw_result, 0);
 
         output.value = value;
         st->outputs_total_value += value;
 
-        // Read the output's scriptPubKey
-        result_len = call_get_merkleized_map_value(dc,
-                                                   &output.in_out.map,
-                                                   (uint8_t[]){PSBT_OUT_SCRIPT},
-                                                   1,
-                                                   output.in_out.scriptPubKey,
-                                                   sizeof(output.in_out.scriptPubKey));
-
-        if (result_len == -1 || result_len > (int) sizeof(output.in_out.scriptPubKey)) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return false;
+        output.in_out.scriptPubKey_len = requests[1].value_len;
+
+        // add the network serialization of the output to sha_outputs and to the legacy outputs
+        uint8_t script_len_varint[9];
+        int script_len_varint_len =
+            varint_write(script_len_varint, 0, output.in_out.scriptPubKey_len);
+
+        crypto_hash_update(&sha_outputs_context.header, raw_result, 8);
+        crypto_hash_update(&sha_outputs_context.header, script_len_varint, script_len_varint_len);
+        crypto_hash_update(&sha_outputs_context.header,
+                           output.in_out.scriptPubKey,
+                           output.in_out.scriptPubKey_len);
+
+        single_output_hashes_t *single_output_hashes = st->single_output_hashes;
+        if (cur_output_index < SINGLE_OUTPUT_HASHES_CACHE_SIZE &&
+            (single_output_hashes->needed >> cur_output_index) & 1) {
+            cx_sha256_t output_context;
+            cx_sha256_init(&output_context);
+            crypto_hash_update(&output_context.header, raw_result, 8);
+            crypto_hash_update(&output_context.header, script_len_varint, script_len_varint_len);
+            crypto_hash_update(&output_context.header,
+                               output.in_out.scriptPubKey,
+                               output.in_out.scriptPubKey_len);
+            crypto_hash_digest(&output_context.header,
+                               single_output_hashes->hashes[cur_output_index],
+                               32);
+            single_output_hashes->cached |= 1U << cur_output_index;
         }
 
-        output.in_out.scriptPubKey_len = result_len;
+        if (legacy_sighash_cache->outputs_len == 0 &&
+            !(buffer_write_bytes(&legacy_outputs_buf, raw_result, 8) &&
+              buffer_write_bytes(&legacy_outputs_buf, script_len_varint, script_len_varint_len) &&
+              buffer_write_bytes(&legacy_outputs_buf,
+                                 output.in_out.scriptPubKey,
+                                 output.in_out.scriptPubKey_len))) {
+            legacy_sighash_cache->outputs_len = -1;  // too long to be cached
+        }
 
-        int is_internal = is_in_out_internal(dc, st, &output.in_out, false);
+        // change outputs can be internal to any of the wallets
+        unsigned int wallet_index;
+        int is_internal =
+            find_in_out_wallet(dc, st, placeholder_info, &output.in_out, false, &wallet_index);
+#ifdef HAVE_PAYEE_LISTS
+        int is_payee = is_internal == 0 ? is_output_to_payee(dc, st, &output) : 0;
+#endif
 
         if (is_internal < 0) {
             PRINTF("Error checking if output %d is internal\n", cur_output_index);
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
+#ifdef HAVE_PAYEE_LISTS
+        } else if (is_payee < 0) {
+            PRINTF("Error checking if output %d is to a payee\n", cur_output_index);
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return false;
+        } else if (is_payee == 1) {
+            // external output to a registered payee, validated together with the others
+            st->payee_outputs_total_value += output.value;
+            ++st->payee_outputs_count;
+#endif
         } else if (is_internal == 0) {
             // external output, user needs to validate
             ++st->external_outputs_count;
 
+            if (G_swap_state.called_from_swap && st->external_outputs_count > 1) {
+                // Swap feature: fail early, without processing the remaining outputs
+                PRINTF("Swap transaction must have exactly 1 external output\n");
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return false;
+            }
+
             if (!display_output(dc, st, cur_output_index, &output)) return false;
 
         } else {
@@ -1305,11 +3442,22 @@ process_outputs(dispatcher_context_t *dc, sign_psbt_state_t *st) {
         }
     }
 
+    crypto_hash_digest(&sha_outputs_context.header, hashes->sha_outputs, 32);
+
+    if (legacy_sighash_cache->outputs_len == 0) {
+        legacy_sighash_cache->outputs_len = (int) legacy_outputs_buf.offset;
+    }
+
+    if (!yield_progress(dc, st, PROGRESS_PHASE_OUTPUTS, st->n_outputs, st->n_outputs, true))
+        return false;
+
     return true;
 }
 
 static bool __attribute__((noinline))
 confirm_transaction(dispatcher_context_t *dc, sign_psbt_state_t *st) {
+    STACK_PROFILING_FRAME();
+
     LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
     if (st->inputs_total_value < st->outputs_total_value) {
@@ -1330,6 +3478,11 @@ confirm_transaction(dispatcher_context_t *dc, sign_psbt_state_t *st) {
 
     uint64_t fee = st->inputs_total_value - st->outputs_total_value;
 
+    if (is_batch_psbt(st)) {
+        // the transactions of a batch are confirmed all at once, after all of them were reviewed
+        return true;
+    }
+
     if (G_swap_state.called_from_swap) {
         // Swap feature: check total amount and fees are as expected; moreover, only one external
         // output
@@ -1350,7 +3503,18 @@ confirm_transaction(dispatcher_context_t *dc, sign_psbt_state_t *st) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
         }
-    } else {
+    } else if (!st->is_resumed) {
+#ifdef HAVE_PAYEE_LISTS
+        if (st->payee_outputs_count > 0 &&
+            !ui_validate_payee_outputs(dc,
+                                       (uint32_t) st->payee_outputs_count,
+                                       COIN_COINID_SHORT,
+                                       st->payee_outputs_total_value)) {
+            SEND_SW(dc, SW_DENY);
+            return false;
+        }
+#endif
+
         // Show final user validation UI
         if (!ui_validate_transaction(dc, COIN_COINID_SHORT, fee)) {
             SEND_SW(dc, SW_DENY);
@@ -1361,168 +3525,306 @@ confirm_transaction(dispatcher_context_t *dc, sign_psbt_state_t *st) {
     return true;
 }
 
+// Gets the prevout and nSequence of the input with the given index, either from the cache or from
+// the host; the input_map can be passed if already known, or NULL.
+static bool __attribute__((noinline))
+get_legacy_input_record(dispatcher_context_t *dc,
+                        sign_psbt_state_t *st,
+                        legacy_sighash_cache_t *cache,
+                        unsigned int index,
+                        const merkleized_map_commitment_t *input_map,
+                        legacy_input_record_t *out) {
+    STACK_PROFILING_FRAME();
+
+    bool is_cacheable = index >= cache->first_cached_input;
+    if (is_cacheable && cache->has_cached_inputs) {
+        memcpy(out, &cache->cached_inputs[index - cache->first_cached_input], sizeof(*out));
+        return true;
+    }
+
+    merkleized_map_commitment_t ith_map;
+    if (input_map == NULL) {
+        if (0 > call_get_merkleized_map(dc, st->inputs_root, st->n_inputs, index, &ith_map)) {
+            return false;
+        }
+        input_map = &ith_map;
+    }
+
+    // get prevout hash, output index and sequence for the input
+    if (!get_input_outpoint_and_sequence(dc, input_map, out->prevout, out->nSequence)) {
+        return false;
+    }
+
+    if (is_cacheable) {
+        memcpy(&cache->cached_inputs[index - cache->first_cached_input], out, sizeof(*out));
+    }
+    return true;
+}
+
+// Updates the hash with an input with empty scriptCode
+static void hash_legacy_input_record(crypto_hash_writer_t *writer,
+                                     const legacy_input_record_t *record) {
+    crypto_hash_writer_update(writer, record->prevout, sizeof(record->prevout));
+    crypto_hash_writer_update_u8(writer, 0x00);  // empty scriptcode
+    crypto_hash_writer_update(writer, record->nSequence, sizeof(record->nSequence));
+}
+
+// Updates the hash with the serialization of the number of outputs and all the outputs
+static bool __attribute__((noinline)) hash_legacy_outputs(dispatcher_context_t *dc,
+                                                          sign_psbt_state_t *st,
+                                                          legacy_sighash_cache_t *cache,
+                                                          crypto_hash_writer_t *writer) {
+    STACK_PROFILING_FRAME();
+
+    if (cache->outputs_len > 0) {
+        crypto_hash_writer_update(writer, cache->outputs, cache->outputs_len);
+        return true;
+    }
+
+    crypto_hash_writer_update_varint(writer, st->n_outputs);
+
+    // we try to cache the serialized outputs the first time they are computed
+    bool is_caching = cache->outputs_len == 0;
+    buffer_t outputs_buf = buffer_create(cache->outputs, sizeof(cache->outputs));
+    if (is_caching) {
+        uint8_t n_outputs_varint[9];
+        int n_outputs_varint_len = varint_write(n_outputs_varint, 0, st->n_outputs);
+        is_caching = buffer_write_bytes(&outputs_buf, n_outputs_varint, n_outputs_varint_len);
+    }
+
+    for (unsigned int i = 0; i < st->n_outputs; i++) {
+        uint8_t serialized_output[MAX_SERIALIZED_OUTPUT_LEN];
+        int serialized_output_len = serialize_output_n(dc, st, i, serialized_output);
+        if (serialized_output_len < 0) {
+            return false;
+        }
+
+        crypto_hash_writer_update(writer, serialized_output, serialized_output_len);
+
+        if (is_caching) {
+            is_caching =
+                buffer_write_bytes(&outputs_buf, serialized_output, serialized_output_len);
+        }
+    }
+
+    cache->outputs_len = is_caching ? (int) outputs_buf.offset : -1;
+    return true;
+}
+
 static bool __attribute__((noinline)) compute_sighash_legacy(dispatcher_context_t *dc,
                                                              sign_psbt_state_t *st,
+                                                             legacy_sighash_cache_t *cache,
                                                              input_info_t *input,
                                                              unsigned int cur_input_index,
                                                              uint8_t sighash[static 32]) {
-    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+    STACK_PROFILING_FRAME();
 
-    cx_sha256_t sighash_context;
-    cx_sha256_init(&sighash_context);
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
     uint8_t tmp[4];
-    write_u32_le(tmp, 0, st->tx_version);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
 
-    crypto_hash_update_varint(&sighash_context.header, st->n_inputs);
+    if (!cache->is_initialized || cur_input_index < cache->prefix_n_inputs) {
+        cx_sha256_init(&cache->prefix_context);
 
-    for (unsigned int i = 0; i < st->n_inputs; i++) {
-        // get this input's map
-        merkleized_map_commitment_t ith_map;
+        write_u32_le(tmp, 0, st->tx_version);
+        crypto_hash_update(&cache->prefix_context.header, tmp, 4);
 
-        if (i != cur_input_index) {
-            int res = call_get_merkleized_map(dc, st->inputs_root, st->n_inputs, i, &ith_map);
-            if (res < 0) {
-                SEND_SW(dc, SW_INCORRECT_DATA);
-                return false;
-            }
-        } else {
-            // Avoid requesting the same map unnecessarily
-            // (might be removed once a caching mechanism is implemented)
-            memcpy(&ith_map, &input->in_out.map, sizeof(input->in_out.map));
-        }
+        crypto_hash_update_varint(&cache->prefix_context.header, st->n_inputs);
 
-        // get prevout hash and output index for the i-th input
-        uint8_t ith_prevout_hash[32];
-        if (32 != call_get_merkleized_map_value(dc,
-                                                &ith_map,
-                                                (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
-                                                1,
-                                                ith_prevout_hash,
-                                                32)) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return false;
+        cache->prefix_n_inputs = 0;
+
+        if (!cache->is_initialized) {
+            cache->first_cached_input = st->n_inputs > LEGACY_SIGHASH_MAX_CACHED_INPUTS
+                                            ? st->n_inputs - LEGACY_SIGHASH_MAX_CACHED_INPUTS
+                                            : 0;
+            cache->is_initialized = true;
         }
+    }
 
-        crypto_hash_update(&sighash_context.header, ith_prevout_hash, 32);
+    legacy_input_record_t record;
 
-        uint8_t ith_prevout_n_raw[4];
-        if (4 != call_get_merkleized_map_value(dc,
-                                               &ith_map,
-                                               (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
-                                               1,
-                                               ith_prevout_n_raw,
-                                               4)) {
+    // extend the prefix up to the current input
+    crypto_hash_writer_t writer;
+    crypto_hash_writer_init(&writer, &cache->prefix_context.header);
+    while (cache->prefix_n_inputs < cur_input_index) {
+        if (!get_legacy_input_record(dc, st, cache, cache->prefix_n_inputs, NULL, &record)) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
         }
+        hash_legacy_input_record(&writer, &record);
+        ++cache->prefix_n_inputs;
+    }
+    crypto_hash_writer_flush(&writer);
 
-        crypto_hash_update(&sighash_context.header, ith_prevout_n_raw, 4);
+    cx_sha256_t sighash_context;
+    memcpy(&sighash_context, &cache->prefix_context, sizeof(sighash_context));
+    crypto_hash_writer_init(&writer, &sighash_context.header);
 
-        if (i != cur_input_index) {
-            // empty scriptcode
-            crypto_hash_update_u8(&sighash_context.header, 0x00);
-        } else {
-            if (!input->has_redeemScript) {
-                // P2PKH, the script_code is the prevout's scriptPubKey
-                crypto_hash_update_varint(&sighash_context.header, input->in_out.scriptPubKey_len);
-                crypto_hash_update(&sighash_context.header,
-                                   input->in_out.scriptPubKey,
-                                   input->in_out.scriptPubKey_len);
-            } else {
-                // P2SH, the script_code is the redeemScript
-
-                // update sighash_context with the length-prefixed redeem script
-                int redeemScript_len =
-                    update_hashes_with_map_value(dc,
-                                                 &input->in_out.map,
-                                                 (uint8_t[]){PSBT_IN_REDEEM_SCRIPT},
-                                                 1,
-                                                 NULL,
-                                                 &sighash_context.header);
+    // current input
+    if (!get_legacy_input_record(dc, st, cache, cur_input_index, &input->in_out.map, &record)) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
 
-                if (redeemScript_len < 0) {
-                    PRINTF("Error fetching redeemScript\n");
-                    SEND_SW(dc, SW_INCORRECT_DATA);
-                    return false;
-                }
-            }
-        }
+    crypto_hash_writer_update(&writer, record.prevout, sizeof(record.prevout));
 
-        uint8_t ith_nSequence_raw[4];
-        if (4 != call_get_merkleized_map_value(dc,
-                                               &ith_map,
-                                               (uint8_t[]){PSBT_IN_SEQUENCE},
-                                               1,
-                                               ith_nSequence_raw,
-                                               4)) {
-            // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
-            memset(ith_nSequence_raw, 0xFF, 4);
+    if (!input->has_redeemScript) {
+        // P2PKH, the script_code is the prevout's scriptPubKey
+        crypto_hash_writer_update_varint(&writer, input->in_out.scriptPubKey_len);
+        crypto_hash_writer_update(&writer,
+                           input->in_out.scriptPubKey,
+                           input->in_out.scriptPubKey_len);
+    } else {
+        // P2SH, the script_code is the redeemScript
+
+        // update sighash_context with the length-prefixed redeem script
+        crypto_hash_writer_flush(&writer);
+        int redeemScript_len = update_hashes_with_map_value(dc,
+                                                            &input->in_out.map,
+                                                            (uint8_t[]){PSBT_IN_REDEEM_SCRIPT},
+                                                            1,
+                                                            NULL,
+                                                            &sighash_context.header);
+
+        if (redeemScript_len < 0) {
+            PRINTF("Error fetching redeemScript\n");
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return false;
         }
+    }
 
-        crypto_hash_update(&sighash_context.header, ith_nSequence_raw, 4);
+    crypto_hash_writer_update(&writer, record.nSequence, sizeof(record.nSequence));
+
+    // the inputs after the current one
+    for (unsigned int i = cur_input_index + 1; i < st->n_inputs; i++) {
+        if (!get_legacy_input_record(dc, st, cache, i, NULL, &record)) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return false;
+        }
+        hash_legacy_input_record(&writer, &record);
     }
 
+    // at this point, all the inputs were visited at least once, so all the cacheable records
+    // are in the cache
+    cache->has_cached_inputs = true;
+
     // outputs
-    crypto_hash_update_varint(&sighash_context.header, st->n_outputs);
-    if (hash_outputs(dc, st, &sighash_context.header) == -1) {
+    if (!hash_legacy_outputs(dc, st, cache, &writer)) {
         SEND_SW(dc, SW_INCORRECT_DATA);
         return false;
     }
 
     // nLocktime
     write_u32_le(tmp, 0, st->locktime);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
+    crypto_hash_writer_update(&writer, tmp, 4);
 
     // hash type
     write_u32_le(tmp, 0, input->sighash_type);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
+    crypto_hash_writer_update(&writer, tmp, 4);
 
     // compute sighash
-    crypto_hash_digest(&sighash_context.header, sighash, 32);
+    crypto_hash_writer_digest(&writer, sighash, 32);
     cx_hash_sha256(sighash, 32, sighash, 32);
 
     return true;
 }
 
-static bool __attribute__((noinline)) compute_sighash_segwitv0(dispatcher_context_t *dc,
-                                                               sign_psbt_state_t *st,
-                                                               segwit_hashes_t *hashes,
-                                                               input_info_t *input,
-                                                               unsigned int cur_input_index,
-                                                               uint8_t sighash[static 32]) {
-    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
-
-    cx_sha256_t sighash_context;
-    cx_sha256_init(&sighash_context);
+// Initializes sighash_context with the start of the sighash preimage of the segwit inputs of the
+// given version that only depends on the sighash type, up to the outpoint for BIP143, and up to the
+// spend type for BIP341.
+static void init_segwit_sighash_context(const sign_psbt_state_t *st,
+                                        segwit_hashes_t *hashes,
+                                        int segwit_version,
+                                        uint32_t sighash_type,
+                                        cx_sha256_t *sighash_context) {
+#ifdef HAVE_SIGHASH_MIDSTATES
+    sighash_midstate_t *midstate = &hashes->sighash_midstates[segwit_version];
+    if (midstate->is_valid && midstate->sighash_type == sighash_type) {
+        memcpy(sighash_context, &midstate->context, sizeof(cx_sha256_t));
+        return;
+    }
+#endif
 
-    uint8_t tmp[8];
-    uint8_t sighash_byte = (uint8_t) (input->sighash_type & 0xFF);
+    uint8_t tmp[32];
+    uint8_t sighash_byte = (uint8_t) (sighash_type & 0xFF);
 
-    // nVersion
-    write_u32_le(tmp, 0, st->tx_version);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
+    crypto_hash_writer_t writer;
+    if (segwit_version == 0) {
+        cx_sha256_init(sighash_context);
+        crypto_hash_writer_init(&writer, &sighash_context->header);
 
-    {
-        uint8_t dbl_hash[32];
+        // nVersion
+        write_u32_le(tmp, 0, st->tx_version);
+        crypto_hash_writer_update(&writer, tmp, 4);
 
-        memset(dbl_hash, 0, 32);
+        memset(tmp, 0, 32);
         // add to hash: hashPrevouts = sha256(sha_prevouts)
         if (!(sighash_byte & SIGHASH_ANYONECANPAY)) {
-            cx_hash_sha256(hashes->sha_prevouts, 32, dbl_hash, 32);
+            cx_hash_sha256(hashes->sha_prevouts, 32, tmp, 32);
         }
+        crypto_hash_writer_update(&writer, tmp, 32);
 
-        crypto_hash_update(&sighash_context.header, dbl_hash, 32);
-
-        memset(dbl_hash, 0, 32);
+        memset(tmp, 0, 32);
         // add to hash: hashSequence sha256(sha_sequences)
         if (!(sighash_byte & SIGHASH_ANYONECANPAY) && (sighash_byte & 0x1f) != SIGHASH_SINGLE &&
             (sighash_byte & 0x1f) != SIGHASH_NONE) {
-            cx_hash_sha256(hashes->sha_sequences, 32, dbl_hash, 32);
+            cx_hash_sha256(hashes->sha_sequences, 32, tmp, 32);
+        }
+        crypto_hash_writer_update(&writer, tmp, 32);
+    } else {
+        crypto_tr_tapsighash_init(sighash_context);
+        crypto_hash_writer_init(&writer, &sighash_context->header);
+        // the first 0x00 byte is not part of SigMsg
+        crypto_hash_writer_update_u8(&writer, 0x00);
+
+        // hash type
+        crypto_hash_writer_update_u8(&writer, sighash_byte);
+
+        // nVersion
+        write_u32_le(tmp, 0, st->tx_version);
+        crypto_hash_writer_update(&writer, tmp, 4);
+
+        // nLocktime
+        write_u32_le(tmp, 0, st->locktime);
+        crypto_hash_writer_update(&writer, tmp, 4);
+
+        if ((sighash_byte & 0x80) != SIGHASH_ANYONECANPAY) {
+            crypto_hash_writer_update(&writer, hashes->sha_prevouts, 32);
+            crypto_hash_writer_update(&writer, hashes->sha_amounts, 32);
+            crypto_hash_writer_update(&writer, hashes->sha_scriptpubkeys, 32);
+            crypto_hash_writer_update(&writer, hashes->sha_sequences, 32);
+        }
+
+        if ((sighash_byte & 3) != SIGHASH_NONE && (sighash_byte & 3) != SIGHASH_SINGLE) {
+            crypto_hash_writer_update(&writer, hashes->sha_outputs, 32);
         }
-        crypto_hash_update(&sighash_context.header, dbl_hash, 32);
     }
+    crypto_hash_writer_flush(&writer);
+
+#ifdef HAVE_SIGHASH_MIDSTATES
+    memcpy(&midstate->context, sighash_context, sizeof(cx_sha256_t));
+    midstate->sighash_type = sighash_type;
+    midstate->is_valid = true;
+#endif
+}
+
+static bool __attribute__((noinline)) compute_sighash_segwitv0(dispatcher_context_t *dc,
+                                                               sign_psbt_state_t *st,
+                                                               segwit_hashes_t *hashes,
+                                                               input_info_t *input,
+                                                               unsigned int cur_input_index,
+                                                               uint8_t sighash[static 32]) {
+    STACK_PROFILING_FRAME();
+
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    cx_sha256_t sighash_context;
+    init_segwit_sighash_context(st, hashes, 0, input->sighash_type, &sighash_context);
+    crypto_hash_writer_t writer;
+    crypto_hash_writer_init(&writer, &sighash_context.header);
+
+    uint8_t tmp[8];
+    uint8_t sighash_byte = (uint8_t) (input->sighash_type & 0xFF);
 
     {
         // outpoint (32-byte prevout hash, 4-byte index)
@@ -1539,7 +3841,7 @@ static bool __attribute__((noinline)) compute_sighash_segwitv0(dispatcher_contex
             return false;
         }
 
-        crypto_hash_update(&sighash_context.header, prevout_hash, 32);
+        crypto_hash_writer_update(&writer, prevout_hash, 32);
 
         uint8_t prevout_n_raw[4];
         if (4 != call_get_merkleized_map_value(dc,
@@ -1552,15 +3854,15 @@ static bool __attribute__((noinline)) compute_sighash_segwitv0(dispatcher_contex
             return false;
         }
 
-        crypto_hash_update(&sighash_context.header, prevout_n_raw, 4);
+        crypto_hash_writer_update(&writer, prevout_n_raw, 4);
     }
 
     // scriptCode
     if (is_p2wpkh(input->script, input->script_len)) {
         // P2WPKH(script[2:22])
-        crypto_hash_update_u32(&sighash_context.header, 0x1976a914);
-        crypto_hash_update(&sighash_context.header, input->script + 2, 20);
-        crypto_hash_update_u16(&sighash_context.header, 0x88ac);
+        crypto_hash_writer_update_u32(&writer, 0x1976a914);
+        crypto_hash_writer_update(&writer, input->script + 2, 20);
+        crypto_hash_writer_update_u16(&writer, 0x88ac);
     } else if (is_p2wsh(input->script, input->script_len)) {
         // P2WSH
 
@@ -1568,6 +3870,7 @@ static bool __attribute__((noinline)) compute_sighash_segwitv0(dispatcher_contex
         // and also compute sha256(witnessScript)
         cx_sha256_t witnessScript_hash_context;
         cx_sha256_init(&witnessScript_hash_context);
+        crypto_hash_writer_flush(&writer);
 
         int witnessScript_len = update_hashes_with_map_value(dc,
                                                              &input->in_out.map,
@@ -1599,25 +3902,9 @@ static bool __attribute__((noinline)) compute_sighash_segwitv0(dispatcher_contex
         return false;
     }
 
-    {
-        // input value, taken from the WITNESS_UTXO field
-        uint8_t witness_utxo[8 + 1 + MAX_PREVOUT_SCRIPTPUBKEY_LEN];
-
-        int witness_utxo_len = call_get_merkleized_map_value(dc,
-                                                             &input->in_out.map,
-                                                             (uint8_t[]){PSBT_IN_WITNESS_UTXO},
-                                                             1,
-                                                             witness_utxo,
-                                                             sizeof(witness_utxo));
-        if (witness_utxo_len < 8) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return false;
-        }
-
-        crypto_hash_update(&sighash_context.header,
-                           witness_utxo,
-                           8);  // only the first 8 bytes (amount)
-    }
+    // input value, taken from the WITNESS_UTXO field in prepare_transaction_input
+    write_u64_le(tmp, 0, input->prevout_amount);
+    crypto_hash_writer_update(&writer, tmp, 8);
 
     // nSequence
     {
@@ -1631,7 +3918,7 @@ static bool __attribute__((noinline)) compute_sighash_segwitv0(dispatcher_contex
             // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
             memset(nSequence_raw, 0xFF, 4);
         }
-        crypto_hash_update(&sighash_context.header, nSequence_raw, 4);
+        crypto_hash_writer_update(&writer, nSequence_raw, 4);
     }
 
     {
@@ -1644,28 +3931,25 @@ static bool __attribute__((noinline)) compute_sighash_segwitv0(dispatcher_contex
             cx_hash_sha256(hashes->sha_outputs, 32, hashOutputs, 32);
 
         } else if ((sighash_byte & 0x1f) == SIGHASH_SINGLE && cur_input_index < st->n_outputs) {
-            cx_sha256_t sha_output_context;
-            cx_sha256_init(&sha_output_context);
-            if (hash_output_n(dc, st, &sha_output_context.header, cur_input_index) == -1) {
+            if (get_single_output_hash(dc, st, cur_input_index, hashOutputs) == -1) {
                 SEND_SW(dc, SW_INCORRECT_DATA);
                 return false;
             }
-            crypto_hash_digest(&sha_output_context.header, hashOutputs, 32);
             cx_hash_sha256(hashOutputs, 32, hashOutputs, 32);
         }
-        crypto_hash_update(&sighash_context.header, hashOutputs, 32);
+        crypto_hash_writer_update(&writer, hashOutputs, 32);
     }
 
     // nLocktime
     write_u32_le(tmp, 0, st->locktime);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
+    crypto_hash_writer_update(&writer, tmp, 4);
 
     // sighash type
     write_u32_le(tmp, 0, input->sighash_type);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
+    crypto_hash_writer_update(&writer, tmp, 4);
 
     // compute sighash
-    crypto_hash_digest(&sighash_context.header, sighash, 32);
+    crypto_hash_writer_digest(&writer, sighash, 32);
     cx_hash_sha256(sighash, 32, sighash, 32);
 
     return true;
@@ -1678,44 +3962,24 @@ static bool __attribute__((noinline)) compute_sighash_segwitv1(dispatcher_contex
                                                                unsigned int cur_input_index,
                                                                placeholder_info_t *placeholder_info,
                                                                uint8_t sighash[static 32]) {
+    STACK_PROFILING_FRAME();
+
     LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
     cx_sha256_t sighash_context;
-    crypto_tr_tagged_hash_init(&sighash_context, BIP0341_sighash_tag, sizeof(BIP0341_sighash_tag));
-    // the first 0x00 byte is not part of SigMsg
-    crypto_hash_update_u8(&sighash_context.header, 0x00);
+    init_segwit_sighash_context(st, hashes, 1, input->sighash_type, &sighash_context);
+    crypto_hash_writer_t writer;
+    crypto_hash_writer_init(&writer, &sighash_context.header);
 
-    uint8_t tmp[MAX(32, 8 + 1 + MAX_PREVOUT_SCRIPTPUBKEY_LEN)];
-
-    // hash type
+    uint8_t tmp[32];
     uint8_t sighash_byte = (uint8_t) (input->sighash_type & 0xFF);
-    crypto_hash_update_u8(&sighash_context.header, sighash_byte);
-
-    // nVersion
-    write_u32_le(tmp, 0, st->tx_version);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
-
-    // nLocktime
-    write_u32_le(tmp, 0, st->locktime);
-    crypto_hash_update(&sighash_context.header, tmp, 4);
-
-    if ((sighash_byte & 0x80) != SIGHASH_ANYONECANPAY) {
-        crypto_hash_update(&sighash_context.header, hashes->sha_prevouts, 32);
-        crypto_hash_update(&sighash_context.header, hashes->sha_amounts, 32);
-        crypto_hash_update(&sighash_context.header, hashes->sha_scriptpubkeys, 32);
-        crypto_hash_update(&sighash_context.header, hashes->sha_sequences, 32);
-    }
-
-    if ((sighash_byte & 3) != SIGHASH_NONE && (sighash_byte & 3) != SIGHASH_SINGLE) {
-        crypto_hash_update(&sighash_context.header, hashes->sha_outputs, 32);
-    }
 
     // ext_flag
     uint8_t ext_flag = placeholder_info->is_tapscript ? 1 : 0;
     // annex is not supported
     const uint8_t annex_present = 0;
     uint8_t spend_type = ext_flag * 2 + annex_present;
-    crypto_hash_update_u8(&sighash_context.header, spend_type);
+    crypto_hash_writer_update_u8(&writer, spend_type);
 
     if ((sighash_byte & 0x80) == SIGHASH_ANYONECANPAY) {
         // outpoint (hash)
@@ -1728,7 +3992,7 @@ static bool __attribute__((noinline)) compute_sighash_segwitv1(dispatcher_contex
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
         }
-        crypto_hash_update(&sighash_context.header, tmp, 32);
+        crypto_hash_writer_update(&writer, tmp, 32);
 
         // outpoint (output index)
         if (4 != call_get_merkleized_map_value(dc,
@@ -1740,25 +4004,16 @@ static bool __attribute__((noinline)) compute_sighash_segwitv1(dispatcher_contex
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
         }
-        crypto_hash_update(&sighash_context.header, tmp, 4);
-
-        if (8 > call_get_merkleized_map_value(dc,
-                                              &input->in_out.map,
-                                              (uint8_t[]){PSBT_IN_WITNESS_UTXO},
-                                              1,
-                                              tmp,
-                                              8 + 1 + MAX_PREVOUT_SCRIPTPUBKEY_LEN)) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return false;
-        }
+        crypto_hash_writer_update(&writer, tmp, 4);
 
-        // amount
-        crypto_hash_update(&sighash_context.header, tmp, 8);
+        // amount, taken from the WITNESS_UTXO field in prepare_transaction_input
+        write_u64_le(tmp, 0, input->prevout_amount);
+        crypto_hash_writer_update(&writer, tmp, 8);
 
         // scriptPubKey
-        crypto_hash_update_varint(&sighash_context.header, input->in_out.scriptPubKey_len);
+        crypto_hash_writer_update_varint(&writer, input->in_out.scriptPubKey_len);
 
-        crypto_hash_update(&sighash_context.header,
+        crypto_hash_writer_update(&writer,
                            input->in_out.scriptPubKey,
                            input->in_out.scriptPubKey_len);
 
@@ -1772,37 +4027,33 @@ static bool __attribute__((noinline)) compute_sighash_segwitv1(dispatcher_contex
             // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
             memset(tmp, 0xFF, 4);
         }
-        crypto_hash_update(&sighash_context.header, tmp, 4);
+        crypto_hash_writer_update(&writer, tmp, 4);
     } else {
         // input_index
         write_u32_le(tmp, 0, cur_input_index);
-        crypto_hash_update(&sighash_context.header, tmp, 4);
+        crypto_hash_writer_update(&writer, tmp, 4);
     }
 
     // no annex
 
     if ((sighash_byte & 3) == SIGHASH_SINGLE) {
         // compute sha_output
-        cx_sha256_t sha_output_context;
-        cx_sha256_init(&sha_output_context);
-
-        if (hash_output_n(dc, st, &sha_output_context.header, cur_input_index) == -1) {
+        if (get_single_output_hash(dc, st, cur_input_index, tmp) == -1) {
             SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
         }
-        crypto_hash_digest(&sha_output_context.header, tmp, 32);
 
-        crypto_hash_update(&sighash_context.header, tmp, 32);
+        crypto_hash_writer_update(&writer, tmp, 32);
     }
 
     if (placeholder_info->is_tapscript) {
         // If spending a tapscript, append the Common Signature Message Extension per BIP-0342
-        crypto_hash_update(&sighash_context.header, placeholder_info->tapleaf_hash, 32);
-        crypto_hash_update_u8(&sighash_context.header, 0x00);         // key_version
-        crypto_hash_update_u32(&sighash_context.header, 0xffffffff);  // no OP_CODESEPARATOR
+        crypto_hash_writer_update(&writer, placeholder_info->tapleaf_hash, 32);
+        crypto_hash_writer_update_u8(&writer, 0x00);         // key_version
+        crypto_hash_writer_update_u32(&writer, 0xffffffff);  // no OP_CODESEPARATOR
     }
 
-    crypto_hash_digest(&sighash_context.header, sighash, 32);
+    crypto_hash_writer_digest(&writer, sighash, 32);
 
     return true;
 }
@@ -1815,20 +4066,50 @@ static bool __attribute__((noinline)) yield_signature(dispatcher_context_t *dc,
                                                       uint8_t *tapleaf_hash,
                                                       uint8_t *sig,
                                                       size_t sig_len) {
-    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+    STACK_PROFILING_FRAME();
 
-    // yield signature
-    uint8_t cmd = CCMD_YIELD;
-    dc->add_to_response(&cmd, 1);
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
-    uint8_t buf[9];
-    int input_index_varint_len = varint_write(buf, 0, cur_input_index);
-    dc->add_to_response(&buf, input_index_varint_len);
+    uint8_t buf[18];
+    int input_index_varint_len = 0;
+#ifdef HAVE_PSBT_BATCHES
+    // in a batch, the index of the input is preceded by the index of its PSBT
+    if (st->is_batch) {
+        input_index_varint_len = varint_write(buf, 0, st->batch_index);
+    }
+#endif
+    input_index_varint_len += varint_write(buf, input_index_varint_len, cur_input_index);
 
     // for tapscript signatures, we concatenate the (x-only) pubkey with the tapleaf hash
     uint8_t augm_pubkey_len = pubkey_len + (tapleaf_hash != NULL ? 32 : 0);
 
     // the pubkey is not output in version 0 of the protocol
+    size_t msg_len = input_index_varint_len + (st->p2 >= 1 ? 1 + augm_pubkey_len : 0) + sig_len;
+
+    uint8_t cmd = CCMD_YIELD;
+    if (st->p2 >= 2) {
+        // Since version 2 of the protocol, the YIELD message is queued with its length in the
+        // response, and sent together with the next interruption, or with the final response.
+        // If there is not enough space left for the next client command, the queued messages are
+        // sent first in an interruption of their own.
+        if (dc->get_response_space() < 2 + msg_len + MAX_CLIENT_COMMAND_REQUEST_LEN) {
+            dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+
+            if (dc->process_interruption(dc) < 0) {
+                SEND_SW(dc, SW_BAD_STATE);
+                return false;
+            }
+        }
+
+        uint8_t msg_len_byte = (uint8_t) msg_len;
+        dc->add_to_response(&cmd, 1);
+        dc->add_to_response(&msg_len_byte, 1);
+    } else {
+        dc->add_to_response(&cmd, 1);
+    }
+
+    dc->add_to_response(&buf, input_index_varint_len);
+
     if (st->p2 >= 1) {
         dc->add_to_response(&augm_pubkey_len, 1);
         dc->add_to_response(pubkey, pubkey_len);
@@ -1840,45 +4121,230 @@ static bool __attribute__((noinline)) yield_signature(dispatcher_context_t *dc,
 
     dc->add_to_response(sig, sig_len);
 
-    dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+    if (st->p2 < 2) {
+        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
 
-    if (dc->process_interruption(dc) < 0) {
-        SEND_SW(dc, SW_BAD_STATE);
-        return false;
+        if (dc->process_interruption(dc) < 0) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return false;
+        }
     }
     return true;
 }
 
-static bool __attribute__((noinline))
-sign_sighash_ecdsa_and_yield(dispatcher_context_t *dc,
-                             sign_psbt_state_t *st,
-                             placeholder_info_t *placeholder_info,
-                             input_info_t *input,
-                             unsigned int cur_input_index,
-                             uint8_t sighash[static 32]) {
-    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+/**
+ * Yields the token of the session, that the client can send to resume the session without a new
+ * approval of the user if the command is interrupted while signing. It is yielded like the
+ * signatures, before any of them.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
+static bool __attribute__((noinline)) yield_resume_token(dispatcher_context_t *dc,
+                                                         const sign_psbt_state_t *st) {
+    uint8_t token[RESUME_TOKEN_LEN];
+    resume_token_compute(st->session_hash, token);
+
+    uint8_t cmd = CCMD_YIELD;
+    dc->add_to_response(&cmd, 1);
+    if (st->p2 >= 2) {
+        // queued with its length, as the signatures; the response only has the progress messages
+        // queued since the last interruption, that leave enough space for it
+        uint8_t msg_len_byte = RESUME_TOKEN_LEN;
+        dc->add_to_response(&msg_len_byte, 1);
+    }
+    dc->add_to_response(token, RESUME_TOKEN_LEN);
+
+    if (st->p2 < 2) {
+        dc->finalize_response(SW_INTERRUPTED_EXECUTION);
+
+        if (dc->process_interruption(dc) < 0) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Derives the private key of the account in the key origin of the given internal placeholder. The
+ * corresponding chain code and pubkey are the ones in placeholder_info->pubkey.
+ *
+ * Returns false on failure. The caller must wipe signing_keys in all cases.
+ */
+static bool __attribute__((noinline))
+derive_placeholder_signing_keys(const placeholder_info_t *placeholder_info,
+                                placeholder_signing_keys_t *signing_keys) {
+    STACK_PROFILING_FRAME();
+
+    cx_ecfp_private_key_t private_key = {0};
+
+    bool result = false;
+    if (0 == crypto_derive_private_key(&private_key,
+                                       NULL,
+                                       placeholder_info->key_derivation,
+                                       placeholder_info->key_derivation_length)) {
+        memcpy(signing_keys->account_privkey, private_key.d, 32);
+        result = true;
+    }
+
+    explicit_bzero(&private_key, sizeof(private_key));
+    return result;
+}
+
+/**
+ * Derives the /<change> node of the account in signing_keys (index 0 for /<NUM_a>, 1 for /<NUM_b>),
+ * unless it was already derived; its pubkey is not computed if it is already known.
+ *
+ * Returns false on failure. The caller must wipe signing_keys in all cases.
+ */
+static bool derive_change_node(placeholder_signing_keys_t *signing_keys,
+                               const placeholder_info_t *placeholder_info,
+                               int change) {
+    if (!signing_keys->has_change_node[change]) {
+        if (0 > bip32_CKDpriv(signing_keys->account_privkey,
+                              placeholder_info->pubkey.chain_code,
+                              placeholder_info->pubkey.compressed_pubkey,
+                              change ? placeholder_info->placeholder.num_second
+                                     : placeholder_info->placeholder.num_first,
+                              signing_keys->change_privkey[change],
+                              signing_keys->change_chain_code[change],
+                              signing_keys->has_change_pubkey[change]
+                                  ? NULL
+                                  : signing_keys->change_pubkey[change])) {
+            return false;
+        }
+        signing_keys->has_change_node[change] = true;
+    }
+    return true;
+}
+
+#ifdef HAVE_BACKGROUND_TASKS
+// Step of the background task that derives the public /<change> nodes of the first internal
+// placeholder from the xpub of the account: each of the two nodes, if needed.
+static int signing_keys_prefetch_step(void *state) {
+    signing_keys_prefetch_t *prefetch = (signing_keys_prefetch_t *) state;
+
+    int change = prefetch->n_steps_done++;
+    if (prefetch->needs_change_node[change]) {
+        const placeholder_info_t *placeholder_info = &prefetch->placeholder_info;
+        if (0 > bip32_CKDpub(&placeholder_info->pubkey,
+                             change ? placeholder_info->placeholder.num_second
+                                    : placeholder_info->placeholder.num_first,
+                             &prefetch->change_nodes[change])) {
+            return -1;
+        }
+        prefetch->has_change_node[change] = true;
+    }
+    return change == 1 ? 1 : 0;
+}
+
+/**
+ * If the background task derived the public /<change> nodes of the given placeholder, copies them
+ * to signing_keys; the remaining steps of the task are run first, if any.
+ */
+static void take_prefetched_change_nodes(dispatcher_context_t *dc,
+                                         sign_psbt_state_t *st,
+                                         int placeholder_index,
+                                         const placeholder_info_t *placeholder_info,
+                                         placeholder_signing_keys_t *signing_keys) {
+    signing_keys_prefetch_t *prefetch = st->signing_keys_prefetch;
+    if (prefetch->placeholder_info.wallet_index != placeholder_info->wallet_index ||
+        prefetch->placeholder_info.cur_index != placeholder_index ||
+        prefetch->placeholder_info.key_derivation_length !=
+            placeholder_info->key_derivation_length ||
+        memcmp(prefetch->placeholder_info.key_derivation,
+               placeholder_info->key_derivation,
+               sizeof(placeholder_info->key_derivation)) != 0 ||
+        dc->complete_background_task() != 1) {
+        return;
+    }
 
-    uint32_t sign_path[MAX_BIP32_PATH_STEPS];
-    for (int i = 0; i < placeholder_info->key_derivation_length; i++) {
-        sign_path[i] = placeholder_info->key_derivation[i];
+    for (int change = 0; change < 2; change++) {
+        if (prefetch->has_change_node[change]) {
+            memcpy(signing_keys->change_chain_code[change],
+                   prefetch->change_nodes[change].chain_code,
+                   32);
+            memcpy(signing_keys->change_pubkey[change],
+                   prefetch->change_nodes[change].compressed_pubkey,
+                   33);
+            signing_keys->has_change_pubkey[change] = true;
+        }
+    }
+    prefetch->placeholder_info.cur_index = -1;  // the nodes can only be taken once
+}
+#endif
+
+/**
+ * Derives the private key used to sign the given input, that is, the /<change>/<address_index>
+ * child of the account's private key in signing_keys. The /<change> node is derived only once for
+ * each change and kept in signing_keys.
+ *
+ * Returns false on failure. The caller must wipe private_key in all cases.
+ */
+static bool derive_input_private_key(placeholder_signing_keys_t *signing_keys,
+                                     const placeholder_info_t *placeholder_info,
+                                     const input_info_t *input,
+                                     cx_ecfp_private_key_t *private_key) {
+    int change = input->in_out.is_change ? 1 : 0;
+
+    if (!derive_change_node(signing_keys, placeholder_info, change)) {
+        return false;
+    }
+
+    uint8_t privkey[32];
+    uint8_t chain_code[32];  // unused
+    int ret = bip32_CKDpriv(signing_keys->change_privkey[change],
+                            signing_keys->change_chain_code[change],
+                            signing_keys->change_pubkey[change],
+                            input->in_out.address_index,
+                            privkey,
+                            chain_code,
+                            NULL);
+    if (ret == 0 && CX_OK != cx_ecfp_init_private_key_no_throw(CX_CURVE_256K1,
+                                                               privkey,
+                                                               sizeof(privkey),
+                                                               private_key)) {
+        ret = -1;
     }
-    sign_path[placeholder_info->key_derivation_length] =
-        input->in_out.is_change ? placeholder_info->placeholder.num_second
-                                : placeholder_info->placeholder.num_first;
-    sign_path[placeholder_info->key_derivation_length + 1] = input->in_out.address_index;
 
-    int sign_path_len = placeholder_info->key_derivation_length + 2;
+    explicit_bzero(privkey, sizeof(privkey));
+    explicit_bzero(chain_code, sizeof(chain_code));
+    return ret == 0;
+}
+
+static bool __attribute__((noinline))
+sign_sighash_ecdsa_and_yield(dispatcher_context_t *dc,
+                             sign_psbt_state_t *st,
+                             placeholder_info_t *placeholder_info,
+                             placeholder_signing_keys_t *signing_keys,
+                             input_info_t *input,
+                             unsigned int cur_input_index,
+                             uint8_t sighash[static 32]) {
+    STACK_PROFILING_FRAME();
+
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+#ifdef HAVE_SIGN_PSBT_DRY_RUN
+    // the sighash is computed, but nothing is signed nor yielded
+    if (st->is_dry_run) return true;
+#endif
 
     uint8_t sig[MAX_DER_SIG_LEN + 1];  // extra byte for the appended sighash-type
 
     uint8_t pubkey[33];
 
-    int sig_len = crypto_ecdsa_sign_sha256_hash_with_key(sign_path,
-                                                         sign_path_len,
-                                                         sighash,
-                                                         pubkey,
-                                                         sig,
-                                                         NULL);
+    int sig_len = -1;
+
+    cx_ecfp_private_key_t private_key = {0};
+    if (derive_input_private_key(signing_keys, placeholder_info, input, &private_key)) {
+        sig_len = crypto_ecdsa_sign_sha256_hash_with_private_key(&private_key,
+                                                                 sighash,
+                                                                 pubkey,
+                                                                 sig,
+                                                                 NULL);
+    }
+    explicit_bzero(&private_key, sizeof(private_key));
+
     if (sig_len < 0) {
         // unexpected error when signing
         SEND_SW(dc, SW_BAD_STATE);
@@ -1894,29 +4360,31 @@ sign_sighash_ecdsa_and_yield(dispatcher_context_t *dc,
     return true;
 }
 
+/**
+ * Computes the BIP-340 signing key for the given input and its x-only pubkey, and stores them in
+ * signing_keys. For key-path spends, the key is tweaked per BIP-341 (and BIP-86 if there is no
+ * taptree). If the last key stored in signing_keys is for the same derivation, it is reused.
+ *
+ * Returns false on failure. The caller must wipe signing_keys in all cases.
+ */
 static bool __attribute__((noinline))
-sign_sighash_schnorr_and_yield(dispatcher_context_t *dc,
-                               sign_psbt_state_t *st,
-                               placeholder_info_t *placeholder_info,
-                               input_info_t *input,
-                               unsigned int cur_input_index,
-                               uint8_t sighash[static 32]) {
-    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
-
-    if (st->wallet_policy_map.type != TOKEN_TR) {
-        SEND_SW(dc, SW_BAD_STATE);  // should never happen
-        return false;
+derive_input_schnorr_key(sign_psbt_state_t *st,
+                         placeholder_info_t *placeholder_info,
+                         placeholder_signing_keys_t *signing_keys,
+                         const input_info_t *input) {
+    STACK_PROFILING_FRAME();
+
+    if (signing_keys->has_schnorr_key &&
+        signing_keys->schnorr_key_is_change == input->in_out.is_change &&
+        signing_keys->schnorr_key_address_index == input->in_out.address_index) {
+        return true;
     }
 
-    uint8_t sig[64 + 1];  // extra byte for the appended sighash-type, possibly
-    size_t sig_len = 0;
-
-    cx_ecfp_public_key_t pubkey_tweaked;  // Pubkey corresponding to the key used for signing
-
-    uint8_t *tapleaf_hash = NULL;
+    signing_keys->has_schnorr_key = false;
 
     bool error = false;
     cx_ecfp_private_key_t private_key = {0};
+    cx_ecfp_public_key_t pubkey;
 
     // IMPORTANT: Since we do not use any syscall that might throw an exception, it is safe to avoid
     // using the TRY/CATCH block to ensure zeroing sensitive data.
@@ -1926,27 +4394,16 @@ sign_sighash_schnorr_and_yield(dispatcher_context_t *dc,
         uint8_t *seckey =
             private_key.d;  // convenience alias (entirely within the private_key struct)
 
-        uint32_t sign_path[MAX_BIP32_PATH_STEPS];
-
-        for (int i = 0; i < placeholder_info->key_derivation_length; i++) {
-            sign_path[i] = placeholder_info->key_derivation[i];
-        }
-        sign_path[placeholder_info->key_derivation_length] =
-            input->in_out.is_change ? placeholder_info->placeholder.num_second
-                                    : placeholder_info->placeholder.num_first;
-        sign_path[placeholder_info->key_derivation_length + 1] = input->in_out.address_index;
-
-        int sign_path_len = placeholder_info->key_derivation_length + 2;
-
-        if (0 > crypto_derive_private_key(&private_key, NULL, sign_path, sign_path_len)) {
+        if (!derive_input_private_key(signing_keys, placeholder_info, input, &private_key)) {
             error = true;
             break;
         }
 
-        policy_node_tr_t *policy = (policy_node_tr_t *) &st->wallet_policy_map;
+        policy_node_tr_t *policy =
+            (policy_node_tr_t *) &st->wallets[placeholder_info->wallet_index].policy_map;
 
         if (!placeholder_info->is_tapscript) {
-            if (policy->tree == NULL) {
+            if (r_policy_node_tree(&policy->tree) == NULL) {
                 // tweak as specified in BIP-86 and BIP-386
                 crypto_tr_tweak_seckey(seckey, (uint8_t[]){}, 0, seckey);
             } else {
@@ -1955,33 +4412,76 @@ sign_sighash_schnorr_and_yield(dispatcher_context_t *dc,
                 // reduce stack usage.
                 crypto_tr_tweak_seckey(seckey, input->taptree_hash, 32, seckey);
             }
-        } else {
-            // tapscript, we need to yield the tapleaf hash together with the pubkey
-            tapleaf_hash = placeholder_info->tapleaf_hash;
         }
 
         // generate corresponding public key
-        unsigned int err =
-            cx_ecfp_generate_pair_no_throw(CX_CURVE_256K1, &pubkey_tweaked, &private_key, 1);
-        if (err != CX_OK) {
+        if (CX_OK != cx_ecfp_generate_pair_no_throw(CX_CURVE_256K1, &pubkey, &private_key, 1)) {
             error = true;
             break;
         }
 
-        err = cx_ecschnorr_sign_no_throw(&private_key,
-                                         CX_ECSCHNORR_BIP0340 | CX_RND_TRNG,
-                                         CX_SHA256,
-                                         sighash,
-                                         32,
-                                         sig,
-                                         &sig_len);
-        if (err != CX_OK) {
-            error = true;
-        }
+        memcpy(signing_keys->schnorr_seckey, seckey, 32);
+        memcpy(signing_keys->schnorr_xonly_pubkey, pubkey.W + 1, 32);  // x-coordinate only
+        signing_keys->schnorr_key_is_change = input->in_out.is_change;
+        signing_keys->schnorr_key_address_index = input->in_out.address_index;
+        signing_keys->has_schnorr_key = true;
     } while (false);
 
     explicit_bzero(&private_key, sizeof(private_key));
 
+    return !error;
+}
+
+static bool __attribute__((noinline))
+sign_sighash_schnorr_and_yield(dispatcher_context_t *dc,
+                               sign_psbt_state_t *st,
+                               placeholder_info_t *placeholder_info,
+                               placeholder_signing_keys_t *signing_keys,
+                               input_info_t *input,
+                               unsigned int cur_input_index,
+                               uint8_t sighash[static 32]) {
+    STACK_PROFILING_FRAME();
+
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    if (st->wallets[placeholder_info->wallet_index].policy_map.type != TOKEN_TR) {
+        SEND_SW(dc, SW_BAD_STATE);  // should never happen
+        return false;
+    }
+
+#ifdef HAVE_SIGN_PSBT_DRY_RUN
+    // the sighash is computed, but nothing is signed nor yielded
+    if (st->is_dry_run) return true;
+#endif
+
+    uint8_t sig[64 + 1];  // extra byte for the appended sighash-type, possibly
+    size_t sig_len = 0;
+
+    // for tapscripts, we need to yield the tapleaf hash together with the pubkey
+    uint8_t *tapleaf_hash = placeholder_info->is_tapscript ? placeholder_info->tapleaf_hash : NULL;
+
+    PERF_COUNTER_INC(schnorr_signatures);
+
+    bool error = false;
+    cx_ecfp_private_key_t private_key = {0};
+
+    if (!derive_input_schnorr_key(st, placeholder_info, signing_keys, input) ||
+        CX_OK != cx_ecfp_init_private_key_no_throw(CX_CURVE_256K1,
+                                                   signing_keys->schnorr_seckey,
+                                                   sizeof(signing_keys->schnorr_seckey),
+                                                   &private_key) ||
+        CX_OK != cx_ecschnorr_sign_no_throw(&private_key,
+                                            CX_ECSCHNORR_BIP0340 | CX_RND_TRNG,
+                                            CX_SHA256,
+                                            sighash,
+                                            32,
+                                            sig,
+                                            &sig_len)) {
+        error = true;
+    }
+
+    explicit_bzero(&private_key, sizeof(private_key));
+
     if (error) {
         // unexpected error when signing
         SEND_SW(dc, SW_BAD_STATE);
@@ -2004,7 +4504,7 @@ sign_sighash_schnorr_and_yield(dispatcher_context_t *dc,
     if (!yield_signature(dc,
                          st,
                          cur_input_index,
-                         pubkey_tweaked.W + 1,  // x-only pubkey, hence take only the x-coordinate
+                         signing_keys->schnorr_xonly_pubkey,
                          32,
                          tapleaf_hash,
                          sig,
@@ -2014,8 +4514,19 @@ sign_sighash_schnorr_and_yield(dispatcher_context_t *dc,
     return true;
 }
 
+#ifndef USE_SINGLE_PASS_SEGWIT_HASHES
+/**
+ * Computes the tx-wide hashes in segwit_hashes_t that only depend on the inputs. sha_outputs was
+ * already computed in process_outputs. sha_amounts and sha_scriptpubkeys are left uninitialized if
+ * none of the internal inputs is a taproot input. If USE_SINGLE_PASS_SEGWIT_HASHES is defined,
+ * these hashes are computed in preprocess_inputs instead, and this function does not exist.
+ */
 static bool __attribute__((noinline))
 compute_segwit_hashes(dispatcher_context_t *dc, sign_psbt_state_t *st, segwit_hashes_t *hashes) {
+    STACK_PROFILING_FRAME();
+
+    if (!yield_progress(dc, st, PROGRESS_PHASE_SEGWIT_HASHES, 0, st->n_inputs, true)) return false;
+
     {
         // compute sha_prevouts and sha_sequences
         cx_sha256_t sha_prevouts_context, sha_sequences_context;
@@ -2024,54 +4535,28 @@ compute_segwit_hashes(dispatcher_context_t *dc, sign_psbt_state_t *st, segwit_ha
         cx_sha256_init(&sha_prevouts_context);
         cx_sha256_init(&sha_sequences_context);
 
+        inputs_leaf_hashes_batch_t leaf_hashes_batch = {.n_hashes = 0};
+
         for (unsigned int i = 0; i < st->n_inputs; i++) {
             // get this input's map
             merkleized_map_commitment_t ith_map;
 
-            int res = call_get_merkleized_map(dc, st->inputs_root, st->n_inputs, i, &ith_map);
+            int res =
+                get_input_map_batched(dc, st, &leaf_hashes_batch, i, NULL, NULL, &ith_map);
             if (res < 0) {
                 SEND_SW(dc, SW_INCORRECT_DATA);
                 return false;
             }
 
-            // get prevout hash and output index for the i-th input
-            uint8_t ith_prevout_hash[32];
-            if (32 != call_get_merkleized_map_value(dc,
-                                                    &ith_map,
-                                                    (uint8_t[]){PSBT_IN_PREVIOUS_TXID},
-                                                    1,
-                                                    ith_prevout_hash,
-                                                    32)) {
-                SEND_SW(dc, SW_INCORRECT_DATA);
-                return false;
-            }
-
-            crypto_hash_update(&sha_prevouts_context.header, ith_prevout_hash, 32);
-
-            uint8_t ith_prevout_n_raw[4];
-            if (4 != call_get_merkleized_map_value(dc,
-                                                   &ith_map,
-                                                   (uint8_t[]){PSBT_IN_OUTPUT_INDEX},
-                                                   1,
-                                                   ith_prevout_n_raw,
-                                                   4)) {
+            // get prevout hash, output index and sequence for the i-th input
+            uint8_t ith_prevout[32 + 4];
+            uint8_t ith_nSequence_raw[4];
+            if (!get_input_outpoint_and_sequence(dc, &ith_map, ith_prevout, ith_nSequence_raw)) {
                 SEND_SW(dc, SW_INCORRECT_DATA);
                 return false;
             }
 
-            crypto_hash_update(&sha_prevouts_context.header, ith_prevout_n_raw, 4);
-
-            uint8_t ith_nSequence_raw[4];
-            if (4 != call_get_merkleized_map_value(dc,
-                                                   &ith_map,
-                                                   (uint8_t[]){PSBT_IN_SEQUENCE},
-                                                   1,
-                                                   ith_nSequence_raw,
-                                                   4)) {
-                // if no PSBT_IN_SEQUENCE is present, we must assume nSequence 0xFFFFFFFF
-                memset(ith_nSequence_raw, 0xFF, 4);
-            }
-
+            crypto_hash_update(&sha_prevouts_context.header, ith_prevout, 32 + 4);
             crypto_hash_update(&sha_sequences_context.header, ith_nSequence_raw, 4);
         }
 
@@ -2079,33 +4564,23 @@ compute_segwit_hashes(dispatcher_context_t *dc, sign_psbt_state_t *st, segwit_ha
         crypto_hash_digest(&sha_sequences_context.header, hashes->sha_sequences, 32);
     }
 
-    {
-        // compute sha_outputs
-        cx_sha256_t sha_outputs_context;
-        cx_sha256_init(&sha_outputs_context);
-
-        if (hash_outputs(dc, st, &sha_outputs_context.header) == -1) {
-            SEND_SW(dc, SW_INCORRECT_DATA);
-            return false;
-        }
-
-        crypto_hash_digest(&sha_outputs_context.header, hashes->sha_outputs, 32);
-    }
-
-    {
-        // compute sha_amounts and sha_scriptpubkeys
-        // TODO: could be skipped if there are no segwitv1 inputs to sign
+    if (st->has_internal_segwitv1_inputs) {
+        // compute sha_amounts and sha_scriptpubkeys; they are only used in the BIP341 sighash,
+        // therefore they are not needed if there are no segwitv1 inputs to sign
 
         cx_sha256_t sha_amounts_context, sha_scriptpubkeys_context;
 
         cx_sha256_init(&sha_amounts_context);
         cx_sha256_init(&sha_scriptpubkeys_context);
 
+        inputs_leaf_hashes_batch_t leaf_hashes_batch = {.n_hashes = 0};
+
         for (unsigned int i = 0; i < st->n_inputs; i++) {
             // get this input's map
             merkleized_map_commitment_t ith_map;
 
-            int res = call_get_merkleized_map(dc, st->inputs_root, st->n_inputs, i, &ith_map);
+            int res =
+                get_input_map_batched(dc, st, &leaf_hashes_batch, i, NULL, NULL, &ith_map);
             if (res < 0) {
                 SEND_SW(dc, SW_INCORRECT_DATA);
                 return false;
@@ -2116,6 +4591,8 @@ compute_segwit_hashes(dispatcher_context_t *dc, sign_psbt_state_t *st, segwit_ha
             size_t in_scriptPubKey_len;
 
             if (0 > get_amount_scriptpubkey_from_psbt(dc,
+                                                      st,
+                                                      i,
                                                       &ith_map,
                                                       &in_amount,
                                                       in_scriptPubKey,
@@ -2138,15 +4615,26 @@ compute_segwit_hashes(dispatcher_context_t *dc, sign_psbt_state_t *st, segwit_ha
         crypto_hash_digest(&sha_scriptpubkeys_context.header, hashes->sha_scriptpubkeys, 32);
     }
 
+    if (!yield_progress(dc, st, PROGRESS_PHASE_SEGWIT_HASHES, st->n_inputs, st->n_inputs, true))
+        return false;
+
     return true;
 }
+#endif
+
+/**
+ * Fetches the data of the input that does not depend on the placeholder used for signing: the
+ * sighash type, the prevout's scriptPubKey and, for segwit inputs, the script used when signing and
+ * the segwit version.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
+static bool __attribute__((noinline)) prepare_transaction_input(dispatcher_context_t *dc,
+                                                                sign_psbt_state_t *st,
+                                                                input_info_t *input,
+                                                                unsigned int cur_input_index) {
+    STACK_PROFILING_FRAME();
 
-static bool __attribute__((noinline)) sign_transaction_input(dispatcher_context_t *dc,
-                                                             sign_psbt_state_t *st,
-                                                             segwit_hashes_t *hashes,
-                                                             placeholder_info_t *placeholder_info,
-                                                             input_info_t *input,
-                                                             unsigned int cur_input_index) {
     LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
     // if the psbt does not specify the sighash flag for this input, the default
@@ -2171,10 +4659,11 @@ static bool __attribute__((noinline)) sign_transaction_input(dispatcher_context_
 
         // sign_non_witness(non_witness_utxo.vout[psbt.tx.input_[i].prevout.n].scriptPubKey, i)
 
-        uint64_t tmp;  // unused
         if (0 > get_amount_scriptpubkey_from_psbt_nonwitness(dc,
+                                                             st,
+                                                             cur_input_index,
                                                              &input->in_out.map,
-                                                             &tmp,
+                                                             &input->prevout_amount,
                                                              input->in_out.scriptPubKey,
                                                              &input->in_out.scriptPubKey_len,
                                                              NULL)) {
@@ -2187,302 +4676,714 @@ static bool __attribute__((noinline)) sign_transaction_input(dispatcher_context_
             input->sighash_type = SIGHASH_ALL;
         }
 
-        uint8_t sighash[32];
-        if (!compute_sighash_legacy(dc, st, input, cur_input_index, sighash)) return false;
+        input->segwit_version = -1;
+        return true;
+    }
 
-        if (!sign_sighash_ecdsa_and_yield(dc,
-                                          st,
-                                          placeholder_info,
-                                          input,
-                                          cur_input_index,
-                                          sighash))
+    if (0 > get_amount_scriptpubkey_from_psbt_witness(dc,
+                                                      &input->in_out.map,
+                                                      &input->prevout_amount,
+                                                      input->in_out.scriptPubKey,
+                                                      &input->in_out.scriptPubKey_len)) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+    if (input->has_redeemScript) {
+        // Get redeemScript
+        // The redeemScript cannot be longer than standard scriptPubKeys for
+        // wrapped segwit transactions that we support
+        uint8_t redeemScript[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
+
+        int redeemScript_length = call_get_merkleized_map_value(dc,
+                                                                &input->in_out.map,
+                                                                (uint8_t[]){PSBT_IN_REDEEM_SCRIPT},
+                                                                1,
+                                                                redeemScript,
+                                                                sizeof(redeemScript));
+        if (redeemScript_length < 0) {
+            PRINTF("Error fetching redeem script\n");
+            SEND_SW(dc, SW_INCORRECT_DATA);
             return false;
-    } else {
-        int segwit_version;
+        }
 
-        {
-            uint64_t amount;
-            if (0 > get_amount_scriptpubkey_from_psbt_witness(dc,
-                                                              &input->in_out.map,
-                                                              &amount,
-                                                              input->in_out.scriptPubKey,
-                                                              &input->in_out.scriptPubKey_len)) {
-                SEND_SW(dc, SW_INCORRECT_DATA);
-                return false;
-            }
+        uint8_t p2sh_redeemscript[2 + 20 + 1];
+        p2sh_redeemscript[0] = 0xa9;
+        p2sh_redeemscript[1] = 0x14;
+        crypto_hash160(redeemScript, redeemScript_length, p2sh_redeemscript + 2);
+        p2sh_redeemscript[22] = 0x87;
 
-            if (input->has_redeemScript) {
-                // Get redeemScript
-                // The redeemScript cannot be longer than standard scriptPubKeys for
-                // wrapped segwit transactions that we support
-                uint8_t redeemScript[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
+        if (input->in_out.scriptPubKey_len != 23 ||
+            memcmp(input->in_out.scriptPubKey, p2sh_redeemscript, 23) != 0) {
+            PRINTF("witnessUtxo's scriptPubKey does not match redeemScript\n");
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return false;
+        }
 
-                int redeemScript_length =
-                    call_get_merkleized_map_value(dc,
-                                                  &input->in_out.map,
-                                                  (uint8_t[]){PSBT_IN_REDEEM_SCRIPT},
-                                                  1,
-                                                  redeemScript,
-                                                  sizeof(redeemScript));
-                if (redeemScript_length < 0) {
-                    PRINTF("Error fetching redeem script\n");
-                    SEND_SW(dc, SW_INCORRECT_DATA);
-                    return false;
-                }
+        input->script_len = redeemScript_length;
+        memcpy(input->script, redeemScript, redeemScript_length);
+        input->segwit_version = get_segwit_version(redeemScript, redeemScript_length);
+    } else {
+        input->script_len = input->in_out.scriptPubKey_len;
+        memcpy(input->script, input->in_out.scriptPubKey, input->in_out.scriptPubKey_len);
 
-                uint8_t p2sh_redeemscript[2 + 20 + 1];
-                p2sh_redeemscript[0] = 0xa9;
-                p2sh_redeemscript[1] = 0x14;
-                crypto_hash160(redeemScript, redeemScript_length, p2sh_redeemscript + 2);
-                p2sh_redeemscript[22] = 0x87;
+        input->segwit_version =
+            get_segwit_version(input->in_out.scriptPubKey, input->in_out.scriptPubKey_len);
+    }
 
-                if (input->in_out.scriptPubKey_len != 23 ||
-                    memcmp(input->in_out.scriptPubKey, p2sh_redeemscript, 23) != 0) {
-                    PRINTF("witnessUtxo's scriptPubKey does not match redeemScript\n");
-                    SEND_SW(dc, SW_INCORRECT_DATA);
-                    return false;
-                }
+    if (input->segwit_version > 1) {
+        PRINTF("Segwit version not supported: %d\n", input->segwit_version);
+        SEND_SW(dc, SW_NOT_SUPPORTED);
+        return false;
+    } else if (input->segwit_version == 0) {
+        if (!input->has_sighash_type) {
+            // segwitv0 inputs default to SIGHASH_ALL
+            input->sighash_type = SIGHASH_ALL;
+        }
+    } else if (input->segwit_version == 1) {
+        if (!input->has_sighash_type) {
+            // segwitv1 inputs default to SIGHASH_DEFAULT
+            input->sighash_type = SIGHASH_DEFAULT;
+        }
+    } else {
+        SEND_SW(dc, SW_BAD_STATE);  // can't happen
+        return false;
+    }
 
-                input->script_len = redeemScript_length;
-                memcpy(input->script, redeemScript, redeemScript_length);
-                segwit_version = get_segwit_version(redeemScript, redeemScript_length);
-            } else {
-                input->script_len = input->in_out.scriptPubKey_len;
-                memcpy(input->script, input->in_out.scriptPubKey, input->in_out.scriptPubKey_len);
+    return true;
+}
 
-                segwit_version =
-                    get_segwit_version(input->in_out.scriptPubKey, input->in_out.scriptPubKey_len);
-            }
+/**
+ * Signs the given input, already prepared with prepare_transaction_input, with the key of the given
+ * internal placeholder. The sighash is only computed if it is not the one in sighash_cache, which
+ * is updated; it must be invalidated before signing the first placeholder of each input.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
+static bool __attribute__((noinline))
+sign_transaction_input(dispatcher_context_t *dc,
+                       sign_psbt_state_t *st,
+                       segwit_hashes_t *hashes,
+                       placeholder_info_t *placeholder_info,
+                       placeholder_signing_keys_t *signing_keys,
+                       legacy_sighash_cache_t *legacy_sighash_cache,
+                       input_sighash_cache_t *sighash_cache,
+                       input_info_t *input,
+                       unsigned int cur_input_index) {
+    STACK_PROFILING_FRAME();
 
-            if (segwit_version > 1) {
-                PRINTF("Segwit version not supported: %d\n", segwit_version);
-                SEND_SW(dc, SW_NOT_SUPPORTED);
-                return false;
-            }
-        }
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
-        uint8_t sighash[32];
-        if (segwit_version == 0) {
-            if (!input->has_sighash_type) {
-                // segwitv0 inputs default to SIGHASH_ALL
-                input->sighash_type = SIGHASH_ALL;
-            }
+    TRACE_DEBUG(TRACE_EVENT_SIGN_INPUT, cur_input_index);
 
-            if (!compute_sighash_segwitv0(dc, st, hashes, input, cur_input_index, sighash))
-                return false;
+    // the sighash of the previous placeholder is reused if it has the same leaf hash, if any
+    bool has_sighash =
+        sighash_cache->is_valid &&
+        (input->segwit_version != 1 ||
+         (sighash_cache->is_tapscript == placeholder_info->is_tapscript &&
+          (!placeholder_info->is_tapscript ||
+           memcmp(sighash_cache->tapleaf_hash, placeholder_info->tapleaf_hash, 32) == 0)));
 
-            if (!sign_sighash_ecdsa_and_yield(dc,
-                                              st,
-                                              placeholder_info,
-                                              input,
-                                              cur_input_index,
-                                              sighash))
-                return false;
-        } else if (segwit_version == 1) {
-            if (!input->has_sighash_type) {
-                // segwitv0 inputs default to SIGHASH_DEFAULT
-                input->sighash_type = SIGHASH_DEFAULT;
-            }
+    uint8_t *sighash = sighash_cache->sighash;
+    if (input->segwit_version == -1) {
+        if (!has_sighash &&
+            !compute_sighash_legacy(dc, st, legacy_sighash_cache, input, cur_input_index, sighash))
+            return false;
 
-            if (!compute_sighash_segwitv1(dc,
+        if (!sign_sighash_ecdsa_and_yield(dc,
                                           st,
-                                          hashes,
+                                          placeholder_info,
+                                          signing_keys,
                                           input,
                                           cur_input_index,
-                                          placeholder_info,
                                           sighash))
-                return false;
+            return false;
+    } else if (input->segwit_version == 0) {
+        if (!has_sighash &&
+            !compute_sighash_segwitv0(dc, st, hashes, input, cur_input_index, sighash))
+            return false;
 
-            policy_node_tr_t *policy = (policy_node_tr_t *) &st->wallet_policy_map;
-            if (!placeholder_info->is_tapscript && policy->tree != NULL) {
-                // keypath spend, we compute the taptree hash so that we find it ready
-                // later in sign_sighash_schnorr_and_yield (which has less available stack).
-                if (0 > compute_taptree_hash(
-                            dc,
-                            &(wallet_derivation_info_t){
-                                .address_index = input->in_out.address_index,
-                                .change = input->in_out.is_change ? 1 : 0,
-                                .keys_merkle_root = st->wallet_header_keys_info_merkle_root,
-                                .n_keys = st->wallet_header_n_keys,
-                                .wallet_version = st->wallet_header_version},
-                            policy->tree,
-                            input->taptree_hash)) {
-                    PRINTF("Error while computing taptree hash\n");
-                    return false;
-                }
-            }
+        if (!sign_sighash_ecdsa_and_yield(dc,
+                                          st,
+                                          placeholder_info,
+                                          signing_keys,
+                                          input,
+                                          cur_input_index,
+                                          sighash))
+            return false;
+    } else if (input->segwit_version == 1) {
+        if (!has_sighash && !compute_sighash_segwitv1(dc,
+                                                      st,
+                                                      hashes,
+                                                      input,
+                                                      cur_input_index,
+                                                      placeholder_info,
+                                                      sighash))
+            return false;
 
-            if (!sign_sighash_schnorr_and_yield(dc,
-                                                st,
-                                                placeholder_info,
-                                                input,
-                                                cur_input_index,
-                                                sighash))
+        sighash_cache->is_tapscript = placeholder_info->is_tapscript;
+        memcpy(sighash_cache->tapleaf_hash, placeholder_info->tapleaf_hash, 32);
+
+#ifndef SIMPLE_POLICIES_ONLY
+        const sign_psbt_wallet_t *wallet = &st->wallets[placeholder_info->wallet_index];
+        const policy_node_tr_t *policy = (const policy_node_tr_t *) &wallet->policy_map;
+        const policy_node_tree_t *tree = r_policy_node_tree(&policy->tree);
+        if (!placeholder_info->is_tapscript && tree != NULL) {
+            // keypath spend, we compute the taptree hash so that we find it ready
+            // later in sign_sighash_schnorr_and_yield (which has less available stack).
+            if (0 > compute_taptree_hash(
+                        dc,
+                        &(wallet_derivation_info_t){
+                            .address_index = input->in_out.address_index,
+                            .change = input->in_out.is_change ? 1 : 0,
+                            .keys_merkle_root = wallet->header_keys_info_merkle_root,
+                            .n_keys = wallet->header_n_keys,
+                            .wallet_version = wallet->header_version,
+                            .cache = &st->derived_pubkeys_cache},
+                        tree,
+                        input->taptree_hash)) {
+                PRINTF("Error while computing taptree hash\n");
                 return false;
-
-        } else {
-            SEND_SW(dc, SW_BAD_STATE);  // can't happen
-            return false;
+            }
         }
+#endif
+
+        if (!sign_sighash_schnorr_and_yield(dc,
+                                            st,
+                                            placeholder_info,
+                                            signing_keys,
+                                            input,
+                                            cur_input_index,
+                                            sighash))
+            return false;
+    } else {
+        SEND_SW(dc, SW_BAD_STATE);  // can't happen
+        return false;
     }
+
+    sighash_cache->is_valid = true;
     return true;
 }
 
+#ifndef SIMPLE_POLICIES_ONLY
 static bool __attribute__((noinline))
 fill_taproot_placeholder_info(dispatcher_context_t *dc,
                               sign_psbt_state_t *st,
                               const input_info_t *input,
                               const policy_node_t *tapleaf_ptr,
                               placeholder_info_t *placeholder_info) {
-    uint32_t change = input->in_out.is_change ? placeholder_info->placeholder.num_second
-                                              : placeholder_info->placeholder.num_first;
-    uint32_t address_index = input->in_out.address_index;
-
-    cx_sha256_t hash_context;
-    crypto_tr_tapleaf_hash_init(&hash_context);
-
-    // we compute the tapscript once just to compute its length
-    // this avoids having to store it
-    int tapscript_len = get_wallet_internal_script_hash(
-        dc,
-        tapleaf_ptr,
-        &(wallet_derivation_info_t){.wallet_version = st->wallet_header_version,
-                                    .keys_merkle_root = st->wallet_header_keys_info_merkle_root,
-                                    .n_keys = st->wallet_header_n_keys,
-                                    .change = change,
-                                    .address_index = address_index},
-        WRAPPED_SCRIPT_TYPE_TAPSCRIPT,
-        NULL);
-    if (tapscript_len < 0) {
-        PRINTF("Failed to compute tapleaf script\n");
+    STACK_PROFILING_FRAME();
+
+    const sign_psbt_wallet_t *wallet = &st->wallets[placeholder_info->wallet_index];
+
+    if (0 > compute_tapleaf_hash(
+                dc,
+                &(wallet_derivation_info_t){
+                    .wallet_version = wallet->header_version,
+                    .keys_merkle_root = wallet->header_keys_info_merkle_root,
+                    .n_keys = wallet->header_n_keys,
+                    .change = input->in_out.is_change,
+                    .address_index = input->in_out.address_index,
+                    .cache = &st->derived_pubkeys_cache},
+                tapleaf_ptr,
+                placeholder_info->tapleaf_hash)) {
+        PRINTF("Failed to compute tapleaf hash\n");
         return false;
     }
 
-    crypto_hash_update_u8(&hash_context.header, 0xC0);
-    crypto_hash_update_varint(&hash_context.header, tapscript_len);
-
-    // we compute it again to get add the actual script code to the hash computation
-    if (0 >
-        get_wallet_internal_script_hash(
-            dc,
-            tapleaf_ptr,
-            &(wallet_derivation_info_t){.wallet_version = st->wallet_header_version,
-                                        .keys_merkle_root = st->wallet_header_keys_info_merkle_root,
-                                        .n_keys = st->wallet_header_n_keys,
-                                        .change = change,
-                                        .address_index = address_index},
-            WRAPPED_SCRIPT_TYPE_TAPSCRIPT,
-            &hash_context.header)) {
-        return false;  // should never happen!
-    }
-    crypto_hash_digest(&hash_context.header, placeholder_info->tapleaf_hash, 32);
-
     return true;
 }
+#endif
 
+// A batch of internal placeholders that are used together for signing, so that each internal
+// input map is only fetched once per batch.
+// IMPORTANT: it contains secrets, and must be wiped with explicit_bzero after use.
+typedef struct {
+    size_t n_placeholders;
+    placeholder_info_t placeholder_info[MAX_SIGNING_PLACEHOLDERS_BATCH];
+    const policy_node_t *tapleaf_ptr[MAX_SIGNING_PLACEHOLDERS_BATCH];  // NULL if not in a tapleaf
+    placeholder_signing_keys_t signing_keys[MAX_SIGNING_PLACEHOLDERS_BATCH];
+    input_sighash_cache_t sighash_cache;  // for the input being signed
+} signing_placeholders_batch_t;
+
+#ifdef HAVE_SCRATCH_ARENA
+#ifdef HAVE_BACKGROUND_TASKS
+#define SIGNING_KEYS_PREFETCH_ARENA_SIZE SCRATCH_ARENA_ALIGNED_SIZE(sizeof(signing_keys_prefetch_t))
+#else
+#define SIGNING_KEYS_PREFETCH_ARENA_SIZE 0
+#endif
+#ifdef HAVE_OFFLOADED_RECORDS
+#define OFFLOADED_RECORDS_ARENA_SIZE SCRATCH_ARENA_ALIGNED_SIZE(sizeof(offloaded_records_session_t))
+#else
+#define OFFLOADED_RECORDS_ARENA_SIZE 0
+#endif
+#ifdef HAVE_GROUPED_SIGNING_ORDER
+#define SIGNING_ORDER_ARENA_SIZE SCRATCH_ARENA_ALIGNED_SIZE(sizeof(signing_order_t))
+#else
+#define SIGNING_ORDER_ARENA_SIZE 0
+#endif
+#ifndef SIMPLE_POLICIES_ONLY
+#define TAPTREE_HASH_ARENA_SIZE SCRATCH_ARENA_ALIGNED_SIZE(sizeof(taptree_hash_stack_t))
+#else
+#define TAPTREE_HASH_ARENA_SIZE 0
+#endif
+
+// all the buffers of handler_sign_psbt in the scratch arena are allocated at the same time while
+// signing the inputs, when the taptree hash of the keypath spends is computed
+_Static_assert(SCRATCH_ARENA_ALIGNED_SIZE(sizeof(internal_input_records_t)) +
+                       SCRATCH_ARENA_ALIGNED_SIZE(sizeof(legacy_sighash_cache_t)) +
+                       SIGNING_KEYS_PREFETCH_ARENA_SIZE + OFFLOADED_RECORDS_ARENA_SIZE +
+                       SIGNING_ORDER_ARENA_SIZE +
+                       SCRATCH_ARENA_ALIGNED_SIZE(sizeof(single_output_hashes_t)) +
+                       SCRATCH_ARENA_ALIGNED_SIZE(sizeof(signing_placeholders_batch_t)) +
+                       SCRATCH_ARENA_ALIGNED_SIZE(sizeof(input_info_t)) + TAPTREE_HASH_ARENA_SIZE <=
+                   SCRATCH_ARENA_SIZE,
+               "The scratch arena is too small for SIGN_PSBT");
+#endif
+
+/**
+ * Fills the batch with the next internal placeholders of the wallet with the given index, starting
+ * from the one with index *placeholder_index, and derives their signing keys. On return,
+ * *placeholder_index is the index of the first placeholder that was not processed yet. If no
+ * internal placeholder is left, the batch is empty.
+ *
+ * Returns false (after sending the status word) on failure. The caller must wipe the batch in all
+ * cases.
+ */
 static bool __attribute__((noinline))
-sign_transaction(dispatcher_context_t *dc,
-                 sign_psbt_state_t *st,
-                 const uint8_t internal_inputs[static BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)]) {
-    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+fill_signing_placeholders_batch(dispatcher_context_t *dc,
+                                sign_psbt_state_t *st,
+                                unsigned int wallet_index,
+                                int *placeholder_index,
+                                signing_placeholders_batch_t *batch) {
+    STACK_PROFILING_FRAME();
 
-    int placeholder_index = 0;
+    const key_placeholders_table_t *key_placeholders = &st->wallets[wallet_index].key_placeholders;
 
-    segwit_hashes_t hashes;
+    batch->n_placeholders = 0;
 
-    // compute all the tx-wide hashes
-    // while this is redundant for legacy transactions, we do it here in order to
-    // avoid doing it in places that have more stack limitations
-    if (!compute_segwit_hashes(dc, st, &hashes)) return false;
-
-    // Iterate over all the placeholders that correspond to keys owned by us
-    while (true) {
-        placeholder_info_t placeholder_info;
-        memset(&placeholder_info, 0, sizeof(placeholder_info));
+    // Iterate over the placeholders that correspond to keys owned by us
+    while (batch->n_placeholders < MAX_SIGNING_PLACEHOLDERS_BATCH) {
+        placeholder_info_t *placeholder_info = &batch->placeholder_info[batch->n_placeholders];
+        memset(placeholder_info, 0, sizeof(placeholder_info_t));
+        placeholder_info->wallet_index = wallet_index;
 
         const policy_node_t *tapleaf_ptr = NULL;
-        int n_key_placeholders = get_key_placeholder_by_index(&st->wallet_policy_map,
-                                                              placeholder_index,
-                                                              &tapleaf_ptr,
-                                                              &placeholder_info.placeholder);
+        int n_key_placeholders = get_key_placeholder_from_table(key_placeholders,
+                                                                *placeholder_index,
+                                                                &tapleaf_ptr,
+                                                                &placeholder_info->placeholder);
 
         if (n_key_placeholders < 0) {
             SEND_SW(dc, SW_BAD_STATE);  // should never happen
             return false;
         }
 
-        if (placeholder_index >= n_key_placeholders) {
+        if (*placeholder_index >= n_key_placeholders) {
             // all placeholders were processed
             break;
         }
 
+        ++*placeholder_index;
+
         if (tapleaf_ptr != NULL) {
-            // get_key_placeholder_by_index returns the pointer to the tapleaf only if the key being
-            // spent is indeed in a tapleaf
-            placeholder_info.is_tapscript = true;
+            // get_key_placeholder_from_table returns the pointer to the tapleaf only if the key
+            // being spent is indeed in a tapleaf
+            placeholder_info->is_tapscript = true;
         }
 
-        if (fill_placeholder_info_if_internal(dc, st, &placeholder_info) == true) {
-            for (unsigned int i = 0; i < st->n_inputs; i++)
-                if (bitvector_get(internal_inputs, i)) {
-                    input_info_t input;
-                    memset(&input, 0, sizeof(input));
+        if (fill_placeholder_info_if_internal(dc, st, placeholder_info) == true) {
+            placeholder_signing_keys_t *signing_keys =
+                &batch->signing_keys[batch->n_placeholders];
+            memset(signing_keys, 0, sizeof(placeholder_signing_keys_t));
 
-                    input_keys_callback_data_t callback_data = {
-                        .input = &input,
-                        .placeholder_info = &placeholder_info};
-                    int res = call_get_merkleized_map_with_callback(
-                        dc,
-                        (void *) &callback_data,
-                        st->inputs_root,
-                        st->n_inputs,
-                        i,
-                        (merkle_tree_elements_callback_t) input_keys_callback,
-                        &input.in_out.map);
-                    if (res < 0) {
-                        SEND_SW(dc, SW_INCORRECT_DATA);
-                        return false;
-                    }
+            // the private keys are only derived after the user approved the transaction
+            if (!derive_placeholder_signing_keys(placeholder_info, signing_keys)) {
+                SEND_SW(dc, SW_BAD_STATE);
+                return false;
+            }
+#ifdef HAVE_BACKGROUND_TASKS
+            take_prefetched_change_nodes(dc,
+                                         st,
+                                         *placeholder_index - 1,
+                                         placeholder_info,
+                                         signing_keys);
+#endif
+
+            batch->tapleaf_ptr[batch->n_placeholders] = tapleaf_ptr;
+            ++batch->n_placeholders;
+        }
+    }
 
-                    if (tapleaf_ptr != NULL && !fill_taproot_placeholder_info(dc,
-                                                                              st,
-                                                                              &input,
-                                                                              tapleaf_ptr,
-                                                                              &placeholder_info))
-                        return false;
+    return true;
+}
 
-                    if (!sign_transaction_input(dc, st, &hashes, &placeholder_info, &input, i))
-                        return false;
-                }
+// Signs an internal input of the wallet with the keys of all the internal placeholders in the
+// batch, after fetching its map; record is the derivation of the input, if has_record is true.
+static bool __attribute__((noinline))
+sign_internal_input(dispatcher_context_t *dc,
+                    sign_psbt_state_t *st,
+                    segwit_hashes_t *hashes,
+                    signing_placeholders_batch_t *batch,
+                    legacy_sighash_cache_t *legacy_sighash_cache,
+                    input_info_t *input,
+                    unsigned int input_index,
+                    const internal_input_record_t *record,
+                    bool has_record) {
+    // in a resumed session, the inputs whose signatures were all received are skipped without
+    // fetching their map; there is one signature per placeholder of the batch
+    if (st->n_signatures + batch->n_placeholders <= st->n_signatures_to_skip) {
+        st->n_signatures += batch->n_placeholders;
+        return true;
+    }
+
+    memset(input, 0, sizeof(input_info_t));
+
+    // if the derivation of the input is known from preprocess_inputs, there is no need to process
+    // the BIP32 derivations in the input map again
+    if (has_record) {
+        input->in_out.is_change = record->is_change;
+        input->in_out.address_index = record->address_index;
+        input->in_out.placeholder_found = true;
+    }
+
+    input_keys_callback_data_t callback_data = {
+        .input = input,
+        .placeholder_info = batch->placeholder_info,
+        .n_placeholders = has_record ? 0 : batch->n_placeholders,
+        .use_derivation_hints = st->has_derivation_hints};
+    int res = call_get_merkleized_map_with_callback(
+        dc,
+        (void *) &callback_data,
+        st->inputs_root,
+        st->n_inputs,
+        input_index,
+        (merkle_tree_elements_callback_t) input_keys_callback,
+        &input->in_out.map);
+    if (res < 0 ||
+        process_deferred_derivations(dc,
+                                     callback_data.placeholder_info,
+                                     callback_data.n_placeholders,
+                                     &input->in_out) < 0 ||
+        process_derivation_hint(dc, &input->in_out) < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+    if (!prepare_transaction_input(dc, st, input, input_index)) return false;
+
+    batch->sighash_cache.is_valid = false;
+    for (size_t k = 0; k < batch->n_placeholders; k++) {
+        if (st->n_signatures++ < st->n_signatures_to_skip) continue;
+
+#ifndef SIMPLE_POLICIES_ONLY
+        if (batch->tapleaf_ptr[k] != NULL &&
+            !fill_taproot_placeholder_info(dc,
+                                           st,
+                                           input,
+                                           batch->tapleaf_ptr[k],
+                                           &batch->placeholder_info[k]))
+            return false;
+#endif
+
+        if (!sign_transaction_input(dc,
+                                    st,
+                                    hashes,
+                                    &batch->placeholder_info[k],
+                                    &batch->signing_keys[k],
+                                    legacy_sighash_cache,
+                                    &batch->sighash_cache,
+                                    input,
+                                    input_index))
+            return false;
+    }
+    return true;
+}
+
+#ifdef HAVE_GROUPED_SIGNING_ORDER
+/**
+ * Plans the order in which the selected internal inputs of the wallet with the given index are
+ * signed: the inputs with the same derivation are signed one after the other, so that the pubkeys
+ * and the taproot hashes of their address are only derived once in the derived pubkeys cache; the
+ * groups, and the inputs of each group, are in the order of their first input. The order only
+ * depends on the request, so that the signatures to skip in a resumed session are the same.
+ *
+ * It is only planned if the derivations of all the internal inputs are recorded in memory, and if
+ * none of them is a legacy input, whose sighash prefix is only extended for increasing indexes.
+ *
+ * Returns 1 if the order is planned, 0 if the inputs must be signed in their order, or -1 (after
+ * sending the status word) on failure.
+ */
+static int __attribute__((noinline))
+plan_signing_order(dispatcher_context_t *dc,
+                   const sign_psbt_state_t *st,
+                   unsigned int wallet_index,
+                   const uint8_t internal_inputs[static BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)],
+                   const internal_input_records_t *internal_input_records,
+                   signing_order_t *order) {
+#ifdef HAVE_OFFLOADED_RECORDS
+    if (st->offloaded_input_records != NULL) return 0;
+#endif
+    if (st->has_internal_legacy_inputs ||
+        st->internal_inputs_count > internal_input_records->n_records)
+        return 0;
+
+    order->n_inputs = 0;
+    input_subset_cursor_t subset_cursor = {.next_position = 0, .last_index = -1};
+    unsigned int internal_input_index = 0;
+    for (unsigned int i = 0; i < st->n_inputs; i++) {
+        if (!bitvector_get(internal_inputs, i)) continue;
+
+        const internal_input_record_t *record =
+            &internal_input_records->records[internal_input_index++];
+        if (record->wallet_index != wallet_index) continue;
+
+        int is_selected = is_input_in_subset(dc, st, &subset_cursor, i);
+        if (is_selected < 0) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return -1;
+        }
+        if (is_selected == 0) continue;
+
+        // insert the input after the last one with the same derivation, if any
+        unsigned int pos = order->n_inputs;
+        for (unsigned int j = order->n_inputs; j > 0; j--) {
+            const internal_input_record_t *other =
+                &internal_input_records->records[order->record_index[j - 1]];
+            if (other->is_change == record->is_change &&
+                other->address_index == record->address_index) {
+                pos = j;
+                break;
+            }
         }
+        memmove(&order->input_index[pos + 1],
+                &order->input_index[pos],
+                (order->n_inputs - pos) * sizeof(order->input_index[0]));
+        memmove(&order->record_index[pos + 1],
+                &order->record_index[pos],
+                (order->n_inputs - pos) * sizeof(order->record_index[0]));
+        order->input_index[pos] = (uint16_t) i;
+        order->record_index[pos] = (uint8_t) (internal_input_index - 1);
+        ++order->n_inputs;
+    }
+    return 1;
+}
+#endif
 
-        ++placeholder_index;
+// Signs all the internal inputs of the wallet with the given index with the keys of all the
+// internal placeholders in the batch. Each input map is fetched only once, and all the placeholders
+// are evaluated against it.
+static bool __attribute__((noinline)) sign_placeholders_batch(
+    dispatcher_context_t *dc,
+    sign_psbt_state_t *st,
+    unsigned int wallet_index,
+    const uint8_t internal_inputs[static BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)],
+    const internal_input_records_t *internal_input_records,
+    segwit_hashes_t *hashes,
+    signing_placeholders_batch_t *batch,
+    legacy_sighash_cache_t *legacy_sighash_cache) {
+    STACK_PROFILING_FRAME();
+
+    SCRATCH_ALLOC(input_info_t, input);
+    if (input == NULL) {
+        SEND_SW(dc, SW_BAD_STATE);  // should never happen
+        return false;
+    }
+
+#ifdef HAVE_GROUPED_SIGNING_ORDER
+    SCRATCH_ALLOC(signing_order_t, order);
+    if (order == NULL) {
+        SEND_SW(dc, SW_BAD_STATE);  // should never happen
+        return false;
+    }
+
+    int is_planned =
+        plan_signing_order(dc, st, wallet_index, internal_inputs, internal_input_records, order);
+    if (is_planned < 0) return false;
+    if (is_planned == 1) {
+        // the signatures are yielded with the index of each input, in whatever order
+        for (unsigned int k = 0; k < order->n_inputs; k++) {
+            if (!sign_internal_input(dc,
+                                     st,
+                                     hashes,
+                                     batch,
+                                     legacy_sighash_cache,
+                                     input,
+                                     order->input_index[k],
+                                     &internal_input_records->records[order->record_index[k]],
+                                     true))
+                return false;
+        }
+        return true;
+    }
+#endif
+
+    input_subset_cursor_t subset_cursor = {.next_position = 0, .last_index = -1};
+    unsigned int internal_input_index = 0;
+    for (unsigned int i = 0; i < st->n_inputs; i++) {
+        internal_input_record_t record;
+        bool has_record;
+        unsigned int input_wallet_index;
+        int is_internal = get_internal_input_record(dc,
+                                                    st,
+                                                    internal_inputs,
+                                                    internal_input_records,
+                                                    i,
+                                                    &internal_input_index,
+                                                    &input_wallet_index,
+                                                    &record,
+                                                    &has_record);
+        if (is_internal < 0) return false;
+
+        if (is_internal == 1 && input_wallet_index == wallet_index) {
+            int is_selected = is_input_in_subset(dc, st, &subset_cursor, i);
+            if (is_selected < 0) {
+                SEND_SW(dc, SW_INCORRECT_DATA);
+                return false;
+            }
+            if (is_selected == 0) continue;
+
+            if (!sign_internal_input(dc,
+                                     st,
+                                     hashes,
+                                     batch,
+                                     legacy_sighash_cache,
+                                     input,
+                                     i,
+                                     &record,
+                                     has_record))
+                return false;
+        }
     }
 
     return true;
 }
 
-void handler_sign_psbt(dispatcher_context_t *dc, uint8_t p2) {
+static bool __attribute__((noinline))
+sign_transaction(dispatcher_context_t *dc,
+                 sign_psbt_state_t *st,
+                 const uint8_t internal_inputs[static BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)],
+                 const internal_input_records_t *internal_input_records,
+                 segwit_hashes_t *hashes,
+                 legacy_sighash_cache_t *legacy_sighash_cache) {
+    STACK_PROFILING_FRAME();
+
     LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
-    sign_psbt_state_t st;
-    memset(&st, 0, sizeof(st));
+#ifndef USE_SINGLE_PASS_SEGWIT_HASHES
+    // compute all the tx-wide hashes
+    // while this is redundant for legacy transactions, we do it here in order to
+    // avoid doing it in places that have more stack limitations
+    if (!compute_segwit_hashes(dc, st, hashes)) return false;
+#endif
+
+    if (!yield_progress(dc,
+                        st,
+                        PROGRESS_PHASE_SIGNING,
+                        0,
+                        st->internal_inputs_count,
+                        true))
+        return false;
 
-    // Device must be unlocked
-    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
-        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
-        return;
+    SCRATCH_MARK(mark);
+    SCRATCH_ALLOC(signing_placeholders_batch_t, batch);
+    if (batch == NULL) {
+        SEND_SW(dc, SW_BAD_STATE);  // should never happen
+        return false;
     }
 
-    st.p2 = p2;
+    bool result = true;
+    for (unsigned int wallet_index = 0; result && wallet_index < st->n_wallets; wallet_index++) {
+        int placeholder_index = 0;
+        do {
+            result =
+                fill_signing_placeholders_batch(dc, st, wallet_index, &placeholder_index, batch);
+            if (result && batch->n_placeholders > 0) {
+                result = sign_placeholders_batch(dc,
+                                                 st,
+                                                 wallet_index,
+                                                 internal_inputs,
+                                                 internal_input_records,
+                                                 hashes,
+                                                 batch,
+                                                 legacy_sighash_cache);
+            }
+        } while (result && batch->n_placeholders == MAX_SIGNING_PLACEHOLDERS_BATCH);
+    }
 
-    // read APDU inputs, intialize global state and read global PSBT map
-    if (!init_global_state(dc, &st)) return;
+    explicit_bzero(batch, sizeof(signing_placeholders_batch_t));
+    SCRATCH_RELEASE(mark);
+
+    return result && yield_progress(dc,
+                                    st,
+                                    PROGRESS_PHASE_SIGNING,
+                                    st->internal_inputs_count,
+                                    st->internal_inputs_count,
+                                    true);
+}
+
+/**
+ * Verifies the transaction of a PSBT whose global state is initialized, asks the user to confirm
+ * it, then yields the signatures of its internal inputs. If is_review is set, it returns after the
+ * transaction is verified and its outputs are shown to the user, without signing it.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
+static bool __attribute__((noinline))
+process_psbt(dispatcher_context_t *dc, sign_psbt_state_t *st, bool is_review) {
+    STACK_PROFILING_FRAME();
 
     // bitmap to keep track of which inputs are internal
     uint8_t internal_inputs[BITVECTOR_REAL_SIZE(MAX_N_INPUTS_CAN_SIGN)];
     memset(internal_inputs, 0, sizeof(internal_inputs));
 
+    // derivation info of the internal inputs, kept from the preprocessing for the signing phase
+    SCRATCH_ALLOC(internal_input_records_t, internal_input_records);
+
+    // tx-wide hashes, used when signing segwit inputs
+    segwit_hashes_t hashes;
+#ifdef HAVE_SIGHASH_MIDSTATES
+    memset(hashes.sighash_midstates, 0, sizeof(hashes.sighash_midstates));
+#endif
+
+    // shared by all the legacy inputs, for all the placeholders; the outputs are cached in it
+    // while processing them
+    SCRATCH_ALLOC(legacy_sighash_cache_t, legacy_sighash_cache);
+
+#ifdef HAVE_BACKGROUND_TASKS
+    // not on the stack, as the dispatcher wipes it after the command terminates
+    SCRATCH_ALLOC(signing_keys_prefetch_t, signing_keys_prefetch);
+    st->signing_keys_prefetch = signing_keys_prefetch;
+    if (signing_keys_prefetch == NULL) {
+        SEND_SW(dc, SW_BAD_STATE);  // should never happen
+        return false;
+    }
+#endif
+
+    // the hashes of the outputs for the inputs signed with SIGHASH_SINGLE
+    SCRATCH_ALLOC(single_output_hashes_t, single_output_hashes);
+    st->single_output_hashes = single_output_hashes;
+
+    // the buffers in the scratch arena are released when the next command is processed
+    if (internal_input_records == NULL || legacy_sighash_cache == NULL ||
+        single_output_hashes == NULL) {
+        SEND_SW(dc, SW_BAD_STATE);  // should never happen
+        return false;
+    }
+
+#ifdef HAVE_OFFLOADED_RECORDS
+    // the inputs are too many to keep track of them in memory, their records are kept by the
+    // client; in the scratch arena, as the key of the session must be wiped after the command
+    SCRATCH_ALLOC(offloaded_records_session_t, offloaded_input_records);
+    if (st->n_inputs > MAX_N_INPUTS_CAN_SIGN) {
+        if (offloaded_input_records == NULL || !offloaded_records_open(offloaded_input_records)) {
+            SEND_SW(dc, SW_BAD_STATE);
+            return false;
+        }
+        st->offloaded_input_records = offloaded_input_records;
+    }
+#endif
+
     /** Inputs verification flow
      *
      *  Go though all the inputs:
@@ -2491,7 +5392,19 @@ void handler_sign_psbt(dispatcher_context_t *dc, uint8_t p2) {
      *  - detect internal inputs that should be signed, and if there are external inputs or unusual
      * sighashes
      */
-    if (!preprocess_inputs(dc, &st, internal_inputs)) return;
+    if (!preprocess_inputs(dc, st, internal_inputs, internal_input_records, &hashes)) return false;
+
+    END_DRY_RUN_PHASE(st, SIGN_PSBT_PHASE_INPUTS);
+
+#ifdef HAVE_BACKGROUND_TASKS
+    // the public nodes of the signing keys are derived while the user reviews the transaction;
+    // not in a batch, as the transactions are signed after all of them were reviewed
+    if (internal_input_records->n_records > 0 && !is_batch_psbt(st)) {
+        dc->start_background_task(signing_keys_prefetch_step,
+                                  st->signing_keys_prefetch,
+                                  sizeof(signing_keys_prefetch_t));
+    }
+#endif
 
     /** INPUT VERIFICATION ALERTS
      *
@@ -2500,27 +5413,65 @@ void handler_sign_psbt(dispatcher_context_t *dc, uint8_t p2) {
      * - external inputs
      * - non-default sighash types
      */
-    if (!show_alerts(dc, &st, internal_inputs)) return;
+    if (!show_alerts(dc, st)) return false;
 
     /** OUTPUTS VERIFICATION FLOW
      *
      *  For each output, check if it's a change address.
      *  Show each output that is not a change address to the user for verification.
      */
-    if (!process_outputs(dc, &st)) return;
+    if (!process_outputs(dc, st, &hashes, legacy_sighash_cache)) return false;
 
     /** TANSACTION CONFIRMATION
      *
      *  Show summary info to the user (transaction fees), ask for final confirmation
      */
-    if (!confirm_transaction(dc, &st)) return;
+    if (!confirm_transaction(dc, st)) return false;
+
+    END_DRY_RUN_PHASE(st, SIGN_PSBT_PHASE_OUTPUTS);
+
+    if (is_review) return true;
+
+    if (st->is_resumable && !yield_resume_token(dc, st)) return false;
 
     /** SIGNING FLOW
      *
-     * For each internal placeholder, and for each internal input, sign using the
-     * appropriate algorithm.
+     * For each internal input, and for each internal placeholder, sign using the
+     * appropriate algorithm. The placeholders are processed in batches, and each input map is
+     * fetched once per batch.
      */
-    if (!sign_transaction(dc, &st, internal_inputs)) return;
+    if (!sign_transaction(dc,
+                          st,
+                          internal_inputs,
+                          internal_input_records,
+                          &hashes,
+                          legacy_sighash_cache))
+        return false;
+
+    END_DRY_RUN_PHASE(st, SIGN_PSBT_PHASE_SIGNING);
+
+    return true;
+}
+
+void handler_sign_psbt(dispatcher_context_t *dc, uint8_t p2) {
+    STACK_PROFILING_FRAME();
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    sign_psbt_state_t st;
+    memset(&st, 0, sizeof(st));
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    st.p2 = p2;
+
+    // read APDU inputs, intialize global state and read global PSBT map
+    if (!init_global_state(dc, &st)) return;
+
+    if (!process_psbt(dc, &st, false)) return;
 
     // Only if called from swap, the app should terminate after sending the response
     if (G_swap_state.called_from_swap) {
@@ -2529,3 +5480,258 @@ void handler_sign_psbt(dispatcher_context_t *dc, uint8_t p2) {
 
     SEND_SW(dc, SW_OK);
 }
+
+#ifdef HAVE_SIGN_PSBT_DRY_RUN
+void handler_sign_psbt_dry_run(dispatcher_context_t *dc, uint8_t p2) {
+    STACK_PROFILING_FRAME();
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    sign_psbt_state_t st;
+    memset(&st, 0, sizeof(st));
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    st.p2 = p2;
+    st.is_dry_run = true;
+    st.phase_start_tick = G_ticks;
+
+    if (!init_global_state(dc, &st)) return;
+
+    END_DRY_RUN_PHASE(&st, SIGN_PSBT_PHASE_INIT);
+
+    if (!process_psbt(dc, &st, false)) return;
+
+    // the ticks of each phase, followed by the counters of the command so far
+    uint8_t response[2 * SIGN_PSBT_N_PHASES + PERF_COUNTERS_SERIALIZED_LEN];
+    for (int i = 0; i < SIGN_PSBT_N_PHASES; i++) {
+        write_u16_be(response, 2 * i, st.phase_ticks[i]);
+    }
+    perf_counters_serialize(response + 2 * SIGN_PSBT_N_PHASES);
+
+    SEND_RESPONSE(dc, response, sizeof(response), SW_OK);
+}
+#endif
+
+#ifdef HAVE_PSBT_BATCHES
+
+// The list of the commitments of the PSBTs of a SIGN_PSBT_BATCH request, and the wallet policy
+// that signs all of them
+typedef struct {
+    uint32_t n_psbts;
+    uint8_t psbts_root[32];  // merkle root of the vector of the commitments of the PSBTs
+    uint8_t wallet_id[32];
+    uint8_t wallet_hmac[32];
+} psbt_batch_t;
+
+/**
+ * Clears the fields of the state that depend on the transaction, before processing the next PSBT
+ * of a batch. The wallet policy and the caches of its scripts and of the derivations of its keys
+ * are kept, as all the PSBTs of the batch are signed by the same wallet policy.
+ */
+static void reset_batch_psbt_state(sign_psbt_state_t *st) {
+    st->inputs_total_value = 0;
+    st->outputs_total_value = 0;
+    st->internal_inputs_total_value = 0;
+    st->change_outputs_total_value = 0;
+#ifdef HAVE_OFFLOADED_RECORDS
+    st->offloaded_input_records = NULL;
+#endif
+#ifdef HAVE_PAYEE_LISTS
+    st->payee_outputs_count = 0;
+    st->payee_outputs_total_value = 0;
+#endif
+    st->show_missing_nonwitnessutxo_warning = false;
+    st->show_nondefault_sighash_warning = false;
+    st->n_signatures = 0;
+    st->internal_inputs_count = 0;
+#if MAX_N_WALLETS_CAN_SIGN > 1
+    memset(st->second_wallet_inputs, 0, sizeof(st->second_wallet_inputs));
+#endif
+#ifndef USE_SINGLE_PASS_SEGWIT_HASHES
+    st->has_internal_segwitv1_inputs = false;
+#endif
+    st->has_internal_legacy_inputs = false;
+    st->external_outputs_count = 0;
+    st->change_count = 0;
+    st->prevtx_outputs_cache.is_valid = false;
+}
+
+/**
+ * Initializes the state for the PSBT with the given index in a batch, whose commitments are
+ * fetched from the list of the request. If is_approved is set, the user already approved the whole
+ * batch: as in a resumed session, the transaction is not shown again.
+ *
+ * Returns false (after sending the status word) on failure.
+ */
+static bool __attribute__((noinline)) init_batch_psbt_state(dispatcher_context_t *dc,
+                                                            sign_psbt_state_t *st,
+                                                            const psbt_batch_t *batch,
+                                                            uint32_t index,
+                                                            bool is_approved) {
+    STACK_PROFILING_FRAME();
+
+    reset_batch_psbt_state(st);
+    st->batch_index = index;
+    st->is_resumed = is_approved;
+
+    uint8_t commitments[MAX_PSBT_COMMITMENTS_LEN];
+    int commitments_len = call_get_merkle_leaf_element(dc,
+                                                       batch->psbts_root,
+                                                       batch->n_psbts,
+                                                       index,
+                                                       commitments,
+                                                       sizeof(commitments));
+    if (commitments_len < 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+    buffer_t commitments_buffer = buffer_create(commitments, (size_t) commitments_len);
+    merkleized_map_commitment_t global_map;
+    if (!read_psbt_commitments(dc, &commitments_buffer, st, &global_map)) return false;
+    if (buffer_can_read(&commitments_buffer, 1)) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return false;
+    }
+
+    // the records of the inputs are not offloaded to the client in a batch
+    if (st->n_inputs > MAX_N_INPUTS_CAN_SIGN) {
+        PRINTF("At most %d inputs are supported in a batch\n", MAX_N_INPUTS_CAN_SIGN);
+        SEND_SW(dc, SW_NOT_SUPPORTED);
+        return false;
+    }
+
+    if (!process_global_map(dc, st, &global_map)) return false;
+
+    // the wallet policy is only initialized (and authorized by the user) for the first PSBT
+    if (st->n_wallets == 0) {
+        if (!init_wallet(dc, batch->wallet_id, batch->wallet_hmac, false, &st->wallets[0])) {
+            return false;
+        }
+        st->n_wallets = 1;
+        st->are_wallets_taproot = st->wallets[0].policy_map.type == TOKEN_TR;
+        st->master_key_fingerprint = crypto_get_master_key_fingerprint();
+    }
+
+    return true;
+}
+
+// Adds value to *total; returns false if the sum overflows
+static bool add_to_batch_total(uint64_t *total, uint64_t value) {
+    if (*total + value < *total) {
+        return false;
+    }
+    *total += value;
+    return true;
+}
+
+void handler_sign_psbt_batch(dispatcher_context_t *dc, uint8_t p2) {
+    STACK_PROFILING_FRAME();
+    LOG_PROCESSOR(__FILE__, __LINE__, __func__);
+
+    // Device must be unlocked
+    if (os_global_pin_is_validated() != BOLOS_UX_OK) {
+        SEND_SW(dc, SW_SECURITY_STATUS_NOT_SATISFIED);
+        return;
+    }
+
+    psbt_batch_t batch;
+    uint64_t n_psbts;
+    if (!buffer_read_varint(&dc->read_buffer, &n_psbts) ||
+        !buffer_read_bytes(&dc->read_buffer, batch.psbts_root, 32) ||
+        !buffer_read_bytes(&dc->read_buffer, batch.wallet_id, 32) ||
+        !buffer_read_bytes(&dc->read_buffer, batch.wallet_hmac, 32)) {
+        SEND_SW(dc, SW_WRONG_DATA_LENGTH);
+        return;
+    }
+
+    if (n_psbts == 0) {
+        SEND_SW(dc, SW_INCORRECT_DATA);
+        return;
+    }
+    if (n_psbts > MAX_PSBT_BATCH_SIZE) {
+        PRINTF("At most %d PSBTs are supported in a batch\n", MAX_PSBT_BATCH_SIZE);
+        SEND_SW(dc, SW_NOT_SUPPORTED);
+        return;
+    }
+    batch.n_psbts = (uint32_t) n_psbts;
+
+    sign_psbt_state_t st;
+    memset(&st, 0, sizeof(st));
+    st.p2 = p2;
+    st.is_batch = true;
+
+    /** BATCH VERIFICATION FLOW
+     *
+     * Each transaction is verified as in SIGN_PSBT: the warnings and the external outputs are
+     * shown to the user, while the amounts and the fees are accumulated for the final confirmation.
+     */
+    uint64_t total_amount = 0;
+    uint64_t total_fee = 0;
+#ifdef HAVE_PAYEE_LISTS
+    uint32_t payee_outputs_count = 0;
+    uint64_t payee_outputs_total_value = 0;
+#endif
+    for (uint32_t i = 0; i < batch.n_psbts; i++) {
+        SCRATCH_MARK(mark);
+        bool is_valid =
+            init_batch_psbt_state(dc, &st, &batch, i, false) && process_psbt(dc, &st, true);
+        SCRATCH_RELEASE(mark);
+        if (!is_valid) return;
+
+        // the fee is not negative, as checked in confirm_transaction
+        if (!add_to_batch_total(&total_amount,
+                                st.outputs_total_value - st.change_outputs_total_value) ||
+            !add_to_batch_total(&total_fee, st.inputs_total_value - st.outputs_total_value)) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+#ifdef HAVE_PAYEE_LISTS
+        payee_outputs_count += (uint32_t) st.payee_outputs_count;
+        if (!add_to_batch_total(&payee_outputs_total_value, st.payee_outputs_total_value)) {
+            SEND_SW(dc, SW_INCORRECT_DATA);
+            return;
+        }
+#endif
+    }
+
+    /** BATCH CONFIRMATION
+     *
+     * Show the totals of all the transactions, ask for final confirmation
+     */
+#ifdef HAVE_PAYEE_LISTS
+    if (payee_outputs_count > 0 && !ui_validate_payee_outputs(dc,
+                                                              payee_outputs_count,
+                                                              COIN_COINID_SHORT,
+                                                              payee_outputs_total_value)) {
+        SEND_SW(dc, SW_DENY);
+        return;
+    }
+#endif
+
+    if (!ui_validate_psbt_batch(dc, batch.n_psbts, COIN_COINID_SHORT, total_amount, total_fee)) {
+        SEND_SW(dc, SW_DENY);
+        return;
+    }
+
+    /** BATCH SIGNING FLOW
+     *
+     * Each transaction is verified again and signed, without showing it to the user; as all the
+     * data is committed by the request, it is the same transaction that was approved.
+     */
+    for (uint32_t i = 0; i < batch.n_psbts; i++) {
+        SCRATCH_MARK(mark);
+        bool is_signed =
+            init_batch_psbt_state(dc, &st, &batch, i, true) && process_psbt(dc, &st, false);
+        SCRATCH_RELEASE(mark);
+        if (!is_signed) return;
+    }
+
+    SEND_SW(dc, SW_OK);
+}
+
+#endif
@@ -7,6 +7,79 @@
 #include "../lib/policy.h"
 
 #include "../../common/read.h"
+#include "../../common/script.h"
+#include "../../crypto.h"
+
+bool has_policy_script_shape(const policy_node_t *policy,
+                             const uint8_t script[],
+                             size_t script_len) {
+    switch (policy->type) {
+        case TOKEN_PKH:
+            return script_len == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 &&
+                   script[2] == 20 && script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG;
+        case TOKEN_WPKH:
+            return script_len == 22 && script[0] == OP_0 && script[1] == 20;
+        case TOKEN_SH:
+            return script_len == 23 && script[0] == OP_HASH160 && script[1] == 20 &&
+                   script[22] == OP_EQUAL;
+        case TOKEN_WSH:
+            return script_len == 34 && script[0] == OP_0 && script[1] == 32;
+        case TOKEN_TR:
+            return script_len == 34 && script[0] == OP_1 && script[1] == 32;
+        default:
+            return false;
+    }
+}
+
+// For sh, sh(wsh) and wsh policies, compares the hash in the expected script with the hash of the
+// wallet's internal script, which is streamed into the hash context without being produced in a
+// buffer. The expected script must have the shape of the policy's scripts.
+static int compare_wallet_script_hash(dispatcher_context_t *dispatcher_context,
+                                      const policy_node_t *policy,
+                                      const wallet_derivation_info_t *wdi,
+                                      const uint8_t expected_script[]) {
+    internal_script_type_e script_type;
+    const policy_node_t *core_policy =
+        resolve_node_ptr(&((const policy_node_with_script_t *) policy)->script);
+    if (policy->type == TOKEN_WSH) {
+        script_type = WRAPPED_SCRIPT_TYPE_WSH;
+    } else if (core_policy->type == TOKEN_WSH) {
+        script_type = WRAPPED_SCRIPT_TYPE_SH_WSH;
+        core_policy = resolve_node_ptr(&((const policy_node_with_script_t *) core_policy)->script);
+    } else {
+        script_type = WRAPPED_SCRIPT_TYPE_SH;
+    }
+
+    cx_sha256_t hash_context;
+    cx_sha256_init(&hash_context);
+    if (0 > get_wallet_internal_script_hash(dispatcher_context,
+                                            core_policy,
+                                            wdi,
+                                            script_type,
+                                            &hash_context.header)) {
+        return -1;
+    }
+
+    uint8_t script_hash[32];
+    crypto_hash_digest(&hash_context.header, script_hash, 32);
+
+    if (script_type == WRAPPED_SCRIPT_TYPE_WSH) {
+        return memcmp(script_hash, expected_script + 2, 32) == 0 ? 1 : 0;
+    }
+
+    if (script_type == WRAPPED_SCRIPT_TYPE_SH_WSH) {
+        // the redeem script is the segwit v0 script with the witness script's hash
+        cx_sha256_init(&hash_context);
+        crypto_hash_update_u8(&hash_context.header, OP_0);
+        crypto_hash_update_u8(&hash_context.header, 32);  // PUSH 32 bytes
+        crypto_hash_update(&hash_context.header, script_hash, 32);
+        crypto_hash_digest(&hash_context.header, script_hash, 32);
+    }
+
+    uint8_t redeem_script_hash[20];
+    crypto_ripemd160(script_hash, 32, redeem_script_hash);
+    return memcmp(redeem_script_hash, expected_script + 2, 20) == 0 ? 1 : 0;
+}
 
 int compare_wallet_script_at_path(dispatcher_context_t *dispatcher_context,
                                   uint32_t change,
@@ -16,20 +89,32 @@ int compare_wallet_script_at_path(dispatcher_context_t *dispatcher_context,
                                   const uint8_t keys_merkle_root[static 32],
                                   uint32_t n_keys,
                                   const uint8_t expected_script[],
-                                  size_t expected_script_len) {
+                                  size_t expected_script_len,
+                                  derived_pubkeys_cache_t *cache) {
     LOG_PROCESSOR(__FILE__, __LINE__, __func__);
 
+    if (!has_policy_script_shape(policy, expected_script, expected_script_len)) {
+        return 0;
+    }
+
+    const wallet_derivation_info_t wdi = {.wallet_version = wallet_version,
+                                          .keys_merkle_root = keys_merkle_root,
+                                          .n_keys = n_keys,
+                                          .change = change,
+                                          .address_index = address_index,
+                                          .cache = cache};
+
+    if (policy->type == TOKEN_SH || policy->type == TOKEN_WSH) {
+        int res = compare_wallet_script_hash(dispatcher_context, policy, &wdi, expected_script);
+        if (res < 0) {
+            PRINTF("Failed to get wallet script hash\n");
+        }
+        return res;
+    }
+
     // derive wallet's scriptPubKey, check if it matches the expected one
     uint8_t wallet_script[MAX_PREVOUT_SCRIPTPUBKEY_LEN];
-    int wallet_script_len =
-        get_wallet_script(dispatcher_context,
-                          policy,
-                          &(wallet_derivation_info_t){.wallet_version = wallet_version,
-                                                      .keys_merkle_root = keys_merkle_root,
-                                                      .n_keys = n_keys,
-                                                      .change = change,
-                                                      .address_index = address_index},
-                          wallet_script);
+    int wallet_script_len = get_wallet_script(dispatcher_context, policy, &wdi, wallet_script);
     if (wallet_script_len < 0) {
         PRINTF("Failed to get wallet script\n");
         return -1;  // shouldn't happen
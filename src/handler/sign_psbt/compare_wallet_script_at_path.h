@@ -3,9 +3,27 @@
 #include "../../boilerplate/dispatcher.h"
 #include "../../common/merkle.h"
 #include "../../common/wallet.h"
+#include "../lib/policy.h"
 
 /**
- * TODO
+ * Checks the parts of a script that only depend on the type of the top-level policy: its length,
+ * and the opcodes around the hash or the key. If they do not match, the script can not be one of
+ * the wallet's scripts, and there is no need to derive any key.
+ *
+ * @return true if the script has the shape of the policy's scripts, false otherwise.
+ */
+bool has_policy_script_shape(const policy_node_t *policy,
+                             const uint8_t script[],
+                             size_t script_len);
+
+/**
+ * Derives the script of the wallet policy at the given change and address index, and compares it
+ * with the expected one. If `cache` is not NULL, it is used to reuse pubkey derivations across
+ * calls.
+ * An expected script of a different type than the policy's scripts is rejected before deriving any
+ * key; for sh and wsh policies, only the hash of the internal script is computed and compared.
+ *
+ * @return 1 if the scripts match, 0 if they don't, -1 on error.
  */
 int compare_wallet_script_at_path(dispatcher_context_t *dispatcher_context,
                                   uint32_t change,
@@ -15,4 +33,5 @@ int compare_wallet_script_at_path(dispatcher_context_t *dispatcher_context,
                                   const uint8_t keys_merkle_root[static 32],
                                   uint32_t n_keys,
                                   const uint8_t expected_script[],
-                                  size_t expected_script_len);
\ No newline at end of file
+                                  size_t expected_script_len,
+                                  derived_pubkeys_cache_t *cache);
\ No newline at end of file
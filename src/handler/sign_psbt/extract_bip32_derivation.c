@@ -6,74 +6,120 @@
 #include "../lib/stream_merkle_leaf_element.h"
 
 #include "../../common/psbt.h"
-#include "../../common/read.h"
 #include "../../common/varint.h"
 
+// The value is parsed byte by byte while it is streamed, without keeping it in memory:
+// - for the taproot fields, the varint with the number of leaf hashes, and the leaf hashes, are
+//   skipped;
+// - the fingerprint (big-endian) and each step of the derivation (little-endian) are accumulated
+//   directly in the output.
+typedef enum {
+    FPT_DER_STATE_N_HASHES,  // reading the varint with the number of leaf hashes (taproot only)
+    FPT_DER_STATE_HASHES,    // skipping the leaf hashes (taproot only)
+    FPT_DER_STATE_FPT_DER,   // reading the fingerprint and the derivation steps
+} fpt_der_parser_state_e;
+
 typedef struct {
-    int psbt_key_type;
-    uint8_t *out;
-    int total_data_length;
-    int out_data_length;  // set to -1 before it's computed on the first call of
-                          // fpt_der_data_callback
+    bool is_tap;
+    uint32_t *out;
+    size_t total_data_length;
+    size_t bytes_read;        // number of bytes of the value streamed so far
+    size_t out_data_length;   // length of the fingerprint and derivation; computed once known
+    size_t fpt_der_position;  // number of bytes of the fingerprint and derivation read so far
+    fpt_der_parser_state_e state;
+    uint8_t n_hashes_varint[9];
+    uint8_t n_hashes_varint_len;
+    uint64_t hashes_left_bytes;
     int result;
 } fpt_der_callback_data_t;
 
-static void fpt_der_data_len_callback(size_t data_length, void *callback_state) {
-    ((fpt_der_callback_data_t *) callback_state)->total_data_length = data_length;
+// Sets the length of the fingerprint and derivation, once the number of bytes before it is known.
+static void set_out_data_length(fpt_der_callback_data_t *cs, size_t prefix_len) {
+    if (cs->total_data_length < prefix_len) {
+        PRINTF("Unexpected: BIP32 derivation too short\n");
+        cs->result = -1;
+        return;
+    }
+
+    size_t out_data_length = cs->total_data_length - prefix_len;
+    if (out_data_length < 4 || out_data_length % 4 != 0 ||
+        out_data_length > 4 * (1 + MAX_BIP32_PATH_STEPS)) {
+        PRINTF("Unexpected BIP32 derivation length in psbt\n");
+        cs->result = -1;
+        return;
+    }
+    cs->out_data_length = out_data_length;
+    cs->state = FPT_DER_STATE_FPT_DER;
 }
 
-static void fpt_der_data_callback(buffer_t *data, void *callback_state) {
+static void fpt_der_data_len_callback(size_t data_length, void *callback_state) {
     fpt_der_callback_data_t *cs = (fpt_der_callback_data_t *) callback_state;
 
-    if (cs->result < 0) return;  // an error already happened, ignore the rest
+    cs->total_data_length = data_length;
+    if (!cs->is_tap) {
+        // the entire value is the fingerprint and derivation
+        set_out_data_length(cs, 0);
+    }
+}
 
-    // on the first call, compute the length the fingerprint + derivation part of the message.
-    // - if non-taproot, then it's the entire message;
-    // - if taproot, it's the message after the hashes are removed.
-    if (cs->out_data_length == -1) {
-        bool is_tap = cs->psbt_key_type == PSBT_IN_TAP_BIP32_DERIVATION ||
-                      cs->psbt_key_type == PSBT_OUT_TAP_BIP32_DERIVATION;
+static void process_byte(fpt_der_callback_data_t *cs, uint8_t byte) {
+    switch (cs->state) {
+        case FPT_DER_STATE_N_HASHES: {
+            cs->n_hashes_varint[cs->n_hashes_varint_len++] = byte;
 
-        if (!is_tap) {
-            cs->out_data_length = cs->total_data_length;
-        } else {
-            uint64_t n_hashes;
-            if ((!buffer_read_varint(data, &n_hashes)) ||
-                (cs->total_data_length < varint_size(n_hashes) + 32 * (int) n_hashes)) {
-                PRINTF("Unexpected: initial callback message too short\n");
-                cs->result = -1;
+            uint8_t prefix = cs->n_hashes_varint[0];
+            size_t varint_len = prefix < 0xFD ? 1 : prefix == 0xFD ? 3 : prefix == 0xFE ? 5 : 9;
+            if (cs->n_hashes_varint_len < varint_len) {
                 return;
             }
 
-            int out_data_length =
-                cs->total_data_length - varint_size(n_hashes) - 32 * (int) n_hashes;
-
-            if (out_data_length > 4 * (1 + MAX_BIP32_PATH_STEPS)) {
-                PRINTF("BIP32 derivation longer than supported in psbt derivation\n");
+            uint64_t n_hashes;
+            if (varint_read(cs->n_hashes_varint, varint_len, &n_hashes) < 0 ||
+                n_hashes > cs->total_data_length / 32) {
+                PRINTF("Unexpected: too many leaf hashes\n");
                 cs->result = -1;
                 return;
             }
-            cs->out_data_length = out_data_length;
+            cs->hashes_left_bytes = 32 * n_hashes;
+            set_out_data_length(cs, varint_len + (size_t) cs->hashes_left_bytes);
+            if (cs->result >= 0 && cs->hashes_left_bytes > 0) {
+                cs->state = FPT_DER_STATE_HASHES;
+            }
+            return;
+        }
+        case FPT_DER_STATE_HASHES:
+            if (--cs->hashes_left_bytes == 0) {
+                cs->state = FPT_DER_STATE_FPT_DER;
+            }
+            return;
+        case FPT_DER_STATE_FPT_DER: {
+            size_t word = cs->fpt_der_position / 4;
+            size_t byte_index = cs->fpt_der_position % 4;
+            if (byte_index == 0) {
+                cs->out[word] = 0;
+            }
+            if (word == 0) {
+                // the fingerprint is big-endian
+                cs->out[word] |= (uint32_t) byte << (8 * (3 - byte_index));
+            } else {
+                cs->out[word] |= (uint32_t) byte << (8 * byte_index);
+            }
+            ++cs->fpt_der_position;
+            return;
         }
     }
+}
+
+static void fpt_der_data_callback(buffer_t *data, void *callback_state) {
+    fpt_der_callback_data_t *cs = (fpt_der_callback_data_t *) callback_state;
 
-    // then, keep exactly the last cs->out_data_length streamed bytes; as they might be streamed
-    // across multiple messages, we need to handle it appropriately
-
-    if (data->size >= (size_t) cs->out_data_length) {
-        // only keep the last suffix of length cs->out_data_length
-        // discard any pre-existing data from previous calls
-        buffer_seek_end(data, cs->out_data_length);
-        buffer_read_bytes(data, cs->out, cs->out_data_length);
-    } else {
-        buffer_seek_set(data, 0);
-        // We need to concatenate the new data we are reading with any previously read data.
-        // Since we can only read data->size bytes, only the last d = out_data_length - data->size
-        // previous bytes are kept; they move from position out_data_length - d + 1 to position 0.
-        int d = cs->out_data_length - data->size;
-        memmove(cs->out, &cs->out[cs->out_data_length - d + 1], d);
-        // starting at position d, we read the entire data
-        buffer_read_bytes(data, &cs->out[d], data->size);
+    uint8_t byte;
+    while (cs->result >= 0 && buffer_read_u8(data, &byte)) {
+        if (cs->bytes_read++ >= cs->total_data_length) {
+            cs->result = -1;  // should never happen
+            return;
+        }
+        process_byte(cs, byte);
     }
 }
 
@@ -84,15 +130,12 @@ int extract_bip32_derivation(dispatcher_context_t *dc,
                              int index,
                              uint32_t out[static 1 + MAX_BIP32_PATH_STEPS]) {
     fpt_der_callback_data_t callback_state;
+    memset(&callback_state, 0, sizeof(callback_state));
 
-    // we could recycle out instead of creating a new array, but we rather keep the code
-    // clean, as this is not used in memory-critical parts.
-    uint8_t out_bytes[4 * (1 + MAX_BIP32_PATH_STEPS)];
-
-    callback_state.psbt_key_type = psbt_key_type;
-    callback_state.out = out_bytes;
-    callback_state.out_data_length = -1;
-    callback_state.result = 0;
+    callback_state.is_tap = psbt_key_type == PSBT_IN_TAP_BIP32_DERIVATION ||
+                            psbt_key_type == PSBT_OUT_TAP_BIP32_DERIVATION;
+    callback_state.out = out;
+    callback_state.state = FPT_DER_STATE_N_HASHES;
 
     int len = call_stream_merkle_leaf_element(dc,
                                               values_root,
@@ -102,19 +145,11 @@ int extract_bip32_derivation(dispatcher_context_t *dc,
                                               fpt_der_data_callback,
                                               &callback_state);
 
-    if (len < 0 || callback_state.result < 0 || callback_state.out_data_length < 4 ||
-        callback_state.out_data_length % 4 != 0) {
+    if (len < 0 || callback_state.result < 0 || callback_state.out_data_length == 0 ||
+        callback_state.fpt_der_position != callback_state.out_data_length) {
         PRINTF("Unexpected error while reading a BIP32 derivation\n");
         return -1;
     }
 
-    for (int i = 0; i < callback_state.out_data_length / 4; i++) {
-        if (i == 0) {
-            out[i] = read_u32_be(out_bytes, 4 * i);
-        } else {
-            out[i] = read_u32_le(out_bytes, 4 * i);
-        }
-    }
-
-    return (callback_state.out_data_length / 4) - 1;
-}
\ No newline at end of file
+    return (int) (callback_state.out_data_length / 4) - 1;
+}
@@ -0,0 +1,100 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "singlesig_wallet.h"
+
+#include "../lib/policy.h"
+
+#include "../../common/bip32.h"
+#include "../../common/script.h"
+
+#ifdef HAVE_SINGLESIG_FAST_PATH
+
+bool singlesig_wallet_init(singlesig_wallet_t *wallet,
+                           const policy_node_t *policy,
+                           const serialized_extended_pubkey_t *account_pubkey) {
+    memset(wallet, 0, sizeof(singlesig_wallet_t));
+
+    int address_type = get_policy_address_type(policy);
+    if (address_type < 0) {
+        return false;
+    }
+
+    // a tr policy with a taptree has more than one key placeholder
+    policy_node_key_placeholder_t placeholder;
+    if (get_key_placeholder_by_index(policy, 0, NULL, &placeholder) != 1) {
+        return false;
+    }
+
+    wallet->address_type = address_type;
+    wallet->change_steps[0] = placeholder.num_first;
+    wallet->change_steps[1] = placeholder.num_second;
+    memcpy(&wallet->account_pubkey, account_pubkey, sizeof(serialized_extended_pubkey_t));
+    return true;
+}
+
+int singlesig_wallet_get_script(singlesig_wallet_t *wallet,
+                                bool change,
+                                uint32_t address_index,
+                                uint8_t out[static MAX_SINGLESIG_SCRIPT_LEN]) {
+    int c = change ? 1 : 0;
+    if (!wallet->has_change_node[c]) {
+        if (0 > bip32_expand_pubkey(&wallet->account_pubkey, &wallet->change_nodes[c]) ||
+            0 > bip32_CKDpub_expanded(&wallet->change_nodes[c],
+                                      wallet->change_steps[c],
+                                      &wallet->change_nodes[c])) {
+            return -1;
+        }
+        wallet->has_change_node[c] = true;
+    }
+
+    uint8_t pubkey[33];
+    {
+        expanded_extended_pubkey_t child;
+        if (0 > bip32_CKDpub_expanded(&wallet->change_nodes[c], address_index, &child)) {
+            return -1;
+        }
+        crypto_get_compressed_pubkey(child.uncompressed_pubkey, pubkey);
+    }
+
+    switch (wallet->address_type) {
+        case ADDRESS_TYPE_LEGACY:
+            out[0] = OP_DUP;
+            out[1] = OP_HASH160;
+            out[2] = 20;
+            crypto_hash160(pubkey, 33, out + 3);
+            out[23] = OP_EQUALVERIFY;
+            out[24] = OP_CHECKSIG;
+            return 25;
+        case ADDRESS_TYPE_WIT:
+            out[0] = OP_0;
+            out[1] = 20;
+            crypto_hash160(pubkey, 33, out + 2);
+            return 22;
+        case ADDRESS_TYPE_SH_WIT: {
+            uint8_t redeem_script[22];
+            redeem_script[0] = OP_0;
+            redeem_script[1] = 20;
+            crypto_hash160(pubkey, 33, redeem_script + 2);
+
+            out[0] = OP_HASH160;
+            out[1] = 20;
+            crypto_hash160(redeem_script, sizeof(redeem_script), out + 2);
+            out[22] = OP_EQUAL;
+            return 23;
+        }
+        case ADDRESS_TYPE_TR: {
+            uint8_t parity;
+            out[0] = OP_1;
+            out[1] = 32;
+            if (0 > crypto_tr_tweak_pubkey(pubkey + 1, (uint8_t[]){}, 0, &parity, out + 2)) {
+                return -1;
+            }
+            return 34;
+        }
+        default:
+            return -1;
+    }
+}
+
+#endif
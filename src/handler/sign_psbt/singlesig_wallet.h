@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../common/wallet.h"
+#include "../../crypto.h"
+
+#ifdef HAVE_SINGLESIG_FAST_PATH
+
+// Maximum length of the scriptPubKey of a single-signature wallet (taproot)
+#define MAX_SINGLESIG_SCRIPT_LEN 34
+
+/**
+ * The account of a canonical single-signature wallet policy, that is pkh, sh(wpkh), wpkh or tr
+ * without a taptree. Its scripts are computed directly from the derived pubkeys, without walking
+ * the policy nor fetching its key information. The /<change> nodes are derived once, and kept
+ * expanded so that the address derivations do not decompress them.
+ * It only contains public data.
+ */
+typedef struct {
+    int address_type;          // ADDRESS_TYPE_LEGACY, ADDRESS_TYPE_WIT, ADDRESS_TYPE_SH_WIT or
+                               // ADDRESS_TYPE_TR
+    uint32_t change_steps[2];  // the /<NUM_a> and /<NUM_b> steps of the key placeholder
+    serialized_extended_pubkey_t account_pubkey;
+    bool has_change_node[2];
+    expanded_extended_pubkey_t change_nodes[2];
+} singlesig_wallet_t;
+
+/**
+ * Initializes the single-signature wallet for the given policy.
+ *
+ * @param[out] wallet
+ *   Pointer to the single-signature wallet to initialize.
+ * @param[in] policy
+ *   Pointer to the root node of the wallet policy.
+ * @param[in] account_pubkey
+ *   The extended pubkey of the key information of the policy, as derived by the device.
+ *
+ * @return true on success; false if the policy is not a single-signature one.
+ */
+bool singlesig_wallet_init(singlesig_wallet_t *wallet,
+                           const policy_node_t *policy,
+                           const serialized_extended_pubkey_t *account_pubkey);
+
+/**
+ * Computes the scriptPubKey of the single-signature wallet at the given change and address index.
+ *
+ * @return the length of the scriptPubKey on success, or -1 on error.
+ */
+int singlesig_wallet_get_script(singlesig_wallet_t *wallet,
+                                bool change,
+                                uint32_t address_index,
+                                uint8_t out[static MAX_SINGLESIG_SCRIPT_LEN]);
+
+#endif
@@ -30,11 +30,22 @@
 #include "boilerplate/apdu_parser.h"
 #include "boilerplate/constants.h"
 #include "boilerplate/dispatcher.h"
+#include "boilerplate/offsets.h"
 
 #include "debug-helpers/debug.h"
 
 #include "handler/handlers.h"
+#include "handler/lib/access_plan.h"
+#include "handler/lib/tree_stream.h"
+#include "handler/lib/hash_refs.h"
+#include "handler/lib/merkle_frontier.h"
+#include "handler/lib/map_commitment_cache.h"
+#include "handler/lib/policy.h"
+#include "handler/lib/preimage_cache.h"
+#include "handler/lib/resume_token.h"
+#include "handler/lib/scratch_arena.h"
 #include "commands.h"
+#include "crypto.h"
 
 #include "common/wallet.h"
 
@@ -74,11 +85,21 @@ const command_descriptor_t COMMAND_DESCRIPTORS[] = {
         .ins = GET_EXTENDED_PUBKEY,
         .handler = (command_handler_t)handler_get_extended_pubkey
     },
+    {
+        .cla = CLA_APP,
+        .ins = GET_EXTENDED_PUBKEYS,
+        .handler = (command_handler_t)handler_get_extended_pubkeys
+    },
     {
         .cla = CLA_APP,
         .ins = GET_WALLET_ADDRESS,
         .handler = (command_handler_t)handler_get_wallet_address
     },
+    {
+        .cla = CLA_APP,
+        .ins = GET_WALLET_ADDRESSES,
+        .handler = (command_handler_t)handler_get_wallet_addresses
+    },
     {
         .cla = CLA_APP,
         .ins = REGISTER_WALLET,
@@ -94,11 +115,63 @@ const command_descriptor_t COMMAND_DESCRIPTORS[] = {
         .ins = GET_MASTER_FINGERPRINT,
         .handler = (command_handler_t)handler_get_master_fingerprint
     },
+    {
+        .cla = CLA_APP,
+        .ins = GET_APP_FEATURES,
+        .handler = (command_handler_t)handler_get_app_features
+    },
     {
         .cla = CLA_APP,
         .ins = SIGN_MESSAGE,
         .handler = (command_handler_t)handler_sign_message
     },
+    {
+        .cla = CLA_APP,
+        .ins = SIGN_MESSAGES,
+        .handler = (command_handler_t)handler_sign_messages
+    },
+#ifdef HAVE_PAYEE_LISTS
+    {
+        .cla = CLA_APP,
+        .ins = REGISTER_PAYEE_LIST,
+        .handler = (command_handler_t)handler_register_payee_list
+    },
+#endif
+#ifdef HAVE_PSBT_BATCHES
+    {
+        .cla = CLA_APP,
+        .ins = SIGN_PSBT_BATCH,
+        .handler = (command_handler_t)handler_sign_psbt_batch
+    },
+#endif
+#ifdef HAVE_WALLET_SESSIONS
+    {
+        .cla = CLA_APP,
+        .ins = OPEN_WALLET_SESSION,
+        .handler = (command_handler_t)handler_open_wallet_session
+    },
+#endif
+#ifdef HAVE_PERF_COUNTERS
+    {
+        .cla = CLA_APP,
+        .ins = GET_PERF_COUNTERS,
+        .handler = (command_handler_t)handler_get_perf_counters
+    },
+#endif
+#ifdef HAVE_TRACE
+    {
+        .cla = CLA_APP,
+        .ins = GET_TRACE,
+        .handler = (command_handler_t)handler_get_trace
+    },
+#endif
+#ifdef HAVE_SIGN_PSBT_DRY_RUN
+    {
+        .cla = CLA_APP,
+        .ins = SIGN_PSBT_DRY_RUN,
+        .handler = (command_handler_t)handler_sign_psbt_dry_run
+    },
+#endif
 };
 // clang-format on
 
@@ -156,10 +229,42 @@ void app_main() {
             }
         }
 
-        // Dispatch structured APDU command to handler
+#ifdef HAVE_PREIMAGE_CACHE
+        // the cached preimages are only reused within the same command
+        preimage_cache_reset();
+#endif
+
+#ifdef HAVE_MAP_COMMITMENT_CACHE
+        // the commitments of the maps of the PSBTs are only reused within the same command
+        map_commitment_cache_reset();
+#endif
+
+#ifdef HAVE_HASH_REFS
+        // the client starts a new table for each command
+        hash_refs_reset(cmd.p2);
+        merkle_frontier_reset();
+#endif
+
+#ifdef HAVE_ACCESS_PLANS
+        // the client forgets the access plan at the end of each command
+        access_plan_reset(cmd.p2);
+#endif
+
+#ifdef HAVE_TREE_STREAMS
+        // likewise, the client forgets the tree stream at the end of each command
+        tree_stream_reset(cmd.p2);
+#endif
+
+#ifdef HAVE_SCRATCH_ARENA
+        // the buffers of the previous command are released
+        scratch_arena_reset();
+#endif
+
+        // Dispatch structured APDU command to handler. In swap mode there is no main menu to go
+        // back to, as the app exits after signing.
         apdu_dispatcher(COMMAND_DESCRIPTORS,
                         sizeof(COMMAND_DESCRIPTORS) / sizeof(COMMAND_DESCRIPTORS[0]),
-                        ui_menu_main,
+                        G_swap_state.called_from_swap ? NULL : ui_menu_main,
                         &cmd);
 
         if (G_swap_state.called_from_swap && G_swap_state.should_exit) {
@@ -172,6 +277,9 @@ void app_main() {
  * Exit the application and go back to the dashboard.
  */
 void app_exit() {
+    clear_wallet_hmac_key_cache();
+    resume_token_clear_key();
+
     BEGIN_TRY_L(exit) {
         TRY_L(exit) {
             os_sched_exit(-1);
@@ -191,6 +299,10 @@ static void initialize_app_globals() {
     // of G_swap_state).
     G_swap_state.called_from_swap = false;
     G_swap_state.should_exit = false;
+
+    crypto_clear_master_key_fingerprint_cache();
+    clear_wallet_hmac_key_cache();
+    resume_token_clear_key();
 }
 
 /**
@@ -205,6 +317,10 @@ void coin_main() {
 
     _Static_assert(sizeof(cx_sha256_t) <= 108, "cx_sha256_t too large");
     _Static_assert(sizeof(policy_map_key_info_t) <= 156, "policy_map_key_info_t too large");
+#ifdef HAVE_EXTENDED_APDUS
+    _Static_assert(IO_APDU_BUFFER_SIZE >= OFFSET_EXTENDED_CDATA + MAX_EXTENDED_APDU_DATA_LEN,
+                   "IO buffer too small for extended-length APDUs");
+#endif
 
 #if defined(HAVE_PRINT_STACK_POINTER) && defined(HAVE_BOLOS_APP_STACK_CANARY)
     PRINTF("STACK CANARY ADDRESS: %08x\n", &app_stack_canary);
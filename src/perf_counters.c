@@ -0,0 +1,137 @@
+/*****************************************************************************
+ *   Ledger App Bitcoin.
+ *   (c) 2021 Ledger SAS.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *****************************************************************************/
+
+#ifdef HAVE_PERF_COUNTERS
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "perf_counters.h"
+#include "commands.h"
+#include "common/write.h"
+#include "handler/client_commands.h"
+
+extern uint16_t G_ticks;
+
+perf_counters_t G_perf_counters;
+
+// true while a handler other than GET_PERF_COUNTERS is running
+static bool G_perf_counters_active;
+
+// G_ticks when the last interruption started
+static uint16_t G_perf_interruption_start_tick;
+
+void perf_counters_begin(uint8_t ins, uint32_t apdu_len) {
+    if (ins == GET_PERF_COUNTERS) {
+        return;
+    }
+
+    memset(&G_perf_counters, 0, sizeof(G_perf_counters));
+    G_perf_counters.ins = ins;
+    G_perf_counters.start_tick = G_ticks;
+    G_perf_counters.bytes_in = apdu_len;
+    G_perf_counters_active = true;
+}
+
+void perf_counters_end(uint8_t ins) {
+    if (ins == GET_PERF_COUNTERS) {
+        return;
+    }
+
+    G_perf_counters.total_ticks = G_ticks - G_perf_counters.start_tick;
+    G_perf_counters_active = false;
+}
+
+void perf_counters_add_response(uint32_t response_len) {
+    if (G_perf_counters_active) {
+        G_perf_counters.bytes_out += response_len;
+    }
+}
+
+static int get_client_command_index(uint8_t ccmd) {
+    switch (ccmd) {
+        case CCMD_YIELD:
+            return 0;
+        case CCMD_GET_PREIMAGE:
+            return 1;
+        case CCMD_GET_MERKLE_LEAF_PROOF:
+        case CCMD_GET_MERKLE_LEAF_PROOF_REFS:
+            return 2;
+        case CCMD_GET_MERKLE_LEAF_INDEX:
+            return 3;
+        case CCMD_GET_MERKLE_LEAF_PROOFS:
+            return 4;
+        case CCMD_GET_MERKLE_LEAF_ELEMENTS:
+        case CCMD_STREAM_MERKLE_TREE:
+            return 5;
+        case CCMD_GET_MORE_ELEMENTS:
+        case CCMD_GET_ACCESS_PLAN_DATA:
+        case CCMD_GET_TREE_STREAM_DATA:
+            return 6;
+        default:
+            return -1;
+    }
+}
+
+void perf_counters_begin_interruption(uint8_t ccmd, uint32_t request_len) {
+    int index = get_client_command_index(ccmd);
+    if (index >= 0) {
+        ++G_perf_counters.interruptions[index];
+    }
+    G_perf_counters.bytes_out += request_len;
+    G_perf_interruption_start_tick = G_ticks;
+}
+
+void perf_counters_end_interruption(uint32_t apdu_len) {
+    G_perf_counters.interruption_ticks += G_ticks - G_perf_interruption_start_tick;
+    G_perf_counters.bytes_in += apdu_len;
+}
+
+void perf_counters_serialize(uint8_t out[static PERF_COUNTERS_SERIALIZED_LEN]) {
+    const perf_counters_t *c = &G_perf_counters;
+
+    size_t pos = 0;
+    out[pos++] = c->ins;
+    write_u16_be(out, pos, c->start_tick);
+    pos += 2;
+    write_u16_be(out, pos, c->total_ticks);
+    pos += 2;
+    write_u16_be(out, pos, c->interruption_ticks);
+    pos += 2;
+    write_u32_be(out, pos, c->bytes_in);
+    pos += 4;
+    write_u32_be(out, pos, c->bytes_out);
+    pos += 4;
+    for (int i = 0; i < PERF_N_CLIENT_COMMANDS; i++) {
+        write_u16_be(out, pos, c->interruptions[i]);
+        pos += 2;
+    }
+    write_u32_be(out, pos, c->sha256_compressions);
+    pos += 4;
+    write_u32_be(out, pos, c->hashed_bytes);
+    pos += 4;
+    write_u16_be(out, pos, c->bip32_ckdpub);
+    pos += 2;
+    write_u16_be(out, pos, c->seed_derivations);
+    pos += 2;
+    write_u16_be(out, pos, c->ecdsa_signatures);
+    pos += 2;
+    write_u16_be(out, pos, c->schnorr_signatures);
+}
+
+#endif
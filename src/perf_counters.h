@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Performance counters of the last invocation of a command handler, only compiled in builds with
+ * HAVE_PERF_COUNTERS (make PERF_COUNTERS=1). They are returned by the GET_PERF_COUNTERS command,
+ * so that benchmarks can tell the time spent computing on the device from the time spent waiting
+ * for the host.
+ *
+ * Timestamps are in ticks (about 100 ms), as counted by G_ticks.
+ */
+
+// Number of client commands whose interruptions are counted separately
+#define PERF_N_CLIENT_COMMANDS 7
+
+typedef struct {
+    uint8_t ins;                  // INS of the command
+    uint16_t start_tick;          // G_ticks when the handler was invoked
+    uint16_t total_ticks;         // ticks from the invocation of the handler to its return
+    uint16_t interruption_ticks;  // ticks spent waiting for the responses of the client commands
+    uint32_t bytes_in;            // bytes of the APDUs received, including CONTINUE
+    uint32_t bytes_out;           // bytes of the responses sent, including the status words
+    // interruptions for YIELD, GET_PREIMAGE, GET_MERKLE_LEAF_PROOF, GET_MERKLE_LEAF_INDEX,
+    // GET_MERKLE_LEAF_PROOFS, GET_MERKLE_LEAF_ELEMENTS and GET_MORE_ELEMENTS, in this order
+    uint16_t interruptions[PERF_N_CLIENT_COMMANDS];
+    uint32_t sha256_compressions;  // SHA-256 compressions of the Merkle tree hashes
+    uint32_t hashed_bytes;         // bytes hashed with crypto_hash_update, for any hash function
+    uint16_t bip32_ckdpub;         // calls to bip32_CKDpub
+    uint16_t seed_derivations;     // keys derived from the seed
+    uint16_t ecdsa_signatures;
+    uint16_t schnorr_signatures;
+} perf_counters_t;
+
+// Length of the response of GET_PERF_COUNTERS
+#define PERF_COUNTERS_SERIALIZED_LEN \
+    (1 + 2 + 2 + 2 + 4 + 4 + 2 * PERF_N_CLIENT_COMMANDS + 4 + 4 + 4 * 2)
+
+#ifdef HAVE_PERF_COUNTERS
+
+extern perf_counters_t G_perf_counters;
+
+/**
+ * Resets the counters before the invocation of the handler of the command with the given INS;
+ * `apdu_len` is the length of the received APDU. Does nothing for GET_PERF_COUNTERS itself, so
+ * that it returns the counters of the previous command.
+ */
+void perf_counters_begin(uint8_t ins, uint32_t apdu_len);
+
+// Records the duration of the handler; to be called when it returns.
+void perf_counters_end(uint8_t ins);
+
+// Counts the bytes of a response sent while a handler is running, including the status word.
+void perf_counters_add_response(uint32_t response_len);
+
+// Counts an interruption, before the request of the client command `ccmd` (of `request_len`
+// bytes, including the status word) is sent to the host.
+void perf_counters_begin_interruption(uint8_t ccmd, uint32_t request_len);
+
+// Records the end of an interruption, when the CONTINUE APDU of `apdu_len` bytes is received.
+void perf_counters_end_interruption(uint32_t apdu_len);
+
+/**
+ * Serializes the counters as in the response of GET_PERF_COUNTERS, with all the integers in
+ * big-endian; `out` must be at least PERF_COUNTERS_SERIALIZED_LEN bytes long.
+ */
+void perf_counters_serialize(uint8_t out[static PERF_COUNTERS_SERIALIZED_LEN]);
+
+#define PERF_COUNTER_ADD(name, n) (G_perf_counters.name += (n))
+
+#else
+
+#define PERF_COUNTER_ADD(name, n)
+
+#endif
+
+#define PERF_COUNTER_INC(name) PERF_COUNTER_ADD(name, 1)
+
+// SHA-256 compressions to hash a message of n bytes, including the padding
+#define SHA256_COMPRESSIONS(n) (((n) + 8) / 64 + 1)
@@ -21,6 +21,65 @@
 #define P2_CASHADDR      0x03
 #define P2_TAPROOT       0x04  // bech32m
 
+// Each supported address format has its own builder, computing the address from the compressed
+// public key with a single HASH160 (two for wrapped segwit), or a single taptweak for taproot.
+// They write the null-terminated address to address, and return false on failure.
+
+static bool build_legacy_address(const uint8_t compressed_pub_key[static 33],
+                                 uint32_t version,
+                                 char* address,
+                                 size_t max_address_length) {
+    uint8_t pubkey_hash[20];
+    crypto_hash160(compressed_pub_key, 33, pubkey_hash);
+    int address_length =
+        base58_encode_address(pubkey_hash, version, address, max_address_length - 1);
+    if (address_length < 0) {
+        return false;
+    }
+    address[address_length] = 0;
+    return true;
+}
+
+static bool build_wrapped_segwit_address(const uint8_t compressed_pub_key[static 33],
+                                         uint32_t version,
+                                         char* address,
+                                         size_t max_address_length) {
+    uint8_t script[22];
+    script[0] = 0x00;
+    script[1] = 0x14;
+    crypto_hash160(compressed_pub_key, 33, script + 2);
+
+    uint8_t script_hash[20];
+    crypto_hash160(script, sizeof(script), script_hash);
+    int address_length =
+        base58_encode_address(script_hash, version, address, max_address_length - 1);
+    if (address_length < 0) {
+        return false;
+    }
+    address[address_length] = 0;
+    return true;
+}
+
+static bool build_native_segwit_address(const uint8_t compressed_pub_key[static 33],
+                                        const char* hrp,
+                                        char* address) {
+    uint8_t pubkey_hash[20];
+    crypto_hash160(compressed_pub_key, 33, pubkey_hash);
+    return segwit_addr_encode(address, hrp, 0, pubkey_hash, sizeof(pubkey_hash)) != 0;
+}
+
+static bool build_taproot_address(const uint8_t compressed_pub_key[static 33],
+                                  const char* hrp,
+                                  char* address) {
+    uint8_t tweaked_key[32];
+    uint8_t parity;
+    if (crypto_tr_tweak_pubkey(compressed_pub_key + 1, (uint8_t[]){}, 0, &parity, tweaked_key) <
+        0) {
+        return false;
+    }
+    return segwit_addr_encode(address, hrp, 1, tweaked_key, sizeof(tweaked_key)) != 0;
+}
+
 bool get_address_from_compressed_public_key(unsigned char format,
                                             unsigned char* compressed_pub_key,
                                             unsigned short payToAddressVersion,
@@ -28,64 +87,27 @@ bool get_address_from_compressed_public_key(unsigned char format,
                                             const char* native_segwit_prefix,
                                             char* address,
                                             unsigned char max_address_length) {
-    int address_length;
-
-    // clang-format off
-    if (format == P2_LEGACY) {
-        // clang-format on
-        uint8_t tmp[20];
-        crypto_hash160(compressed_pub_key, 33, tmp);
-        address_length =
-            base58_encode_address(tmp, payToAddressVersion, address, max_address_length - 1);
-        if (address_length < 0) {
-            return false;
-        }
-        address[address_length] = 0;
-    } else {
-        uint8_t script[22];
-        script[0] = 0x00;
-        script[1] = 0x14;
-        crypto_hash160(compressed_pub_key,  // IN
-                       33,                  // INLEN
-                       script + 2           // OUT
-        );
-        if (format == P2_SEGWIT) {
-            // wrapped segwit
-            uint8_t tmp[20];
-            crypto_hash160(script, 22, tmp);
-            // wrapped segwit
-            address_length =
-                base58_encode_address(tmp, payToScriptHashVersion, address, max_address_length - 1);
-            if (address_length < 0) {
-                return false;
-            }
-            address[address_length] = 0;
-        } else {  // native segwit or taproot
+    switch (format) {
+        case P2_LEGACY:
+            return build_legacy_address(compressed_pub_key,
+                                        payToAddressVersion,
+                                        address,
+                                        max_address_length);
+        case P2_SEGWIT:
+            return build_wrapped_segwit_address(compressed_pub_key,
+                                                payToScriptHashVersion,
+                                                address,
+                                                max_address_length);
+        case P2_NATIVE_SEGWIT:
+            if (!native_segwit_prefix) return false;
+            return build_native_segwit_address(compressed_pub_key, native_segwit_prefix, address);
+        case P2_TAPROOT:
             if (!native_segwit_prefix) return false;
-            if (format == P2_NATIVE_SEGWIT) {
-                if (!segwit_addr_encode(address, native_segwit_prefix, 0, script + 2, 20)) {
-                    return false;
-                }
-            } else if (format == P2_TAPROOT) {
-                uint8_t tweaked_key[32];
-
-                uint8_t parity;
-                crypto_tr_tweak_pubkey(compressed_pub_key + 1,
-                                       (uint8_t[]){},
-                                       0,
-                                       &parity,
-                                       tweaked_key);
-
-                if (!segwit_addr_encode(address, native_segwit_prefix, 1, tweaked_key, 32)) {
-                    return false;
-                }
-            } else {
-                PRINTF("Expected native segwit or taproot address\n");
-                return false;
-            }
-        }
+            return build_taproot_address(compressed_pub_key, native_segwit_prefix, address);
+        default:
+            PRINTF("Unsupported address format\n");
+            return false;
     }
-    return true;
 }
 
 static int os_strcmp(const char* s1, const char* s2) {
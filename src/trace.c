@@ -0,0 +1,59 @@
+/*****************************************************************************
+ *   Ledger App Bitcoin.
+ *   (c) 2021 Ledger SAS.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *****************************************************************************/
+
+#ifdef HAVE_TRACE
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "trace.h"
+#include "common/write.h"
+
+extern uint16_t G_ticks;
+
+static trace_entry_t G_trace_entries[TRACE_BUFFER_SIZE];
+
+// total number of events recorded; the next one is stored at G_trace_n_recorded % TRACE_BUFFER_SIZE
+static uint32_t G_trace_n_recorded;
+
+void trace_record(uint8_t event, uint32_t arg) {
+    trace_entry_t *entry = &G_trace_entries[G_trace_n_recorded % TRACE_BUFFER_SIZE];
+    entry->tick = G_ticks;
+    entry->event = event;
+    entry->arg = arg;
+    ++G_trace_n_recorded;
+}
+
+size_t trace_serialize(uint8_t out[static TRACE_SERIALIZED_LEN]) {
+    uint32_t n_entries =
+        G_trace_n_recorded < TRACE_BUFFER_SIZE ? G_trace_n_recorded : TRACE_BUFFER_SIZE;
+
+    size_t pos = 0;
+    write_u32_be(out, pos, G_trace_n_recorded);
+    pos += 4;
+    for (uint32_t i = G_trace_n_recorded - n_entries; i < G_trace_n_recorded; i++) {
+        const trace_entry_t *entry = &G_trace_entries[i % TRACE_BUFFER_SIZE];
+        write_u16_be(out, pos, entry->tick);
+        pos += 2;
+        out[pos++] = entry->event;
+        write_u32_be(out, pos, entry->arg);
+        pos += 4;
+    }
+    return pos;
+}
+
+#endif
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Leveled binary tracing, only compiled in builds with HAVE_TRACE (make TRACE_LEVEL=<n>, with n
+ * from 1 to 3). Unlike PRINTF, recording an event does not format anything: it only stores the
+ * event code, the tick counter and a 32-bit argument in a ring buffer in RAM, therefore builds with
+ * tracing enabled can still be profiled meaningfully. The last TRACE_BUFFER_SIZE events are
+ * returned by the GET_TRACE command.
+ *
+ * The TRACE_ERROR, TRACE_INFO and TRACE_DEBUG macros compile to nothing (and their arguments are
+ * not evaluated) for the levels above TRACE_LEVEL. Events never contain any private data.
+ */
+
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO  2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 0
+#endif
+
+// Number of events kept in the ring buffer
+#define TRACE_BUFFER_SIZE 32
+
+typedef enum {
+    TRACE_EVENT_COMMAND = 0x01,       // a command handler is invoked; arg: INS
+    TRACE_EVENT_RESPONSE = 0x02,      // the final response is SW_OK; arg: status word
+    TRACE_EVENT_ERROR = 0x03,         // the final response is an error; arg: status word
+    TRACE_EVENT_INTERRUPTION = 0x04,  // a client command is sent; arg: code of the client command
+    TRACE_EVENT_SIGN_INPUT = 0x10,    // SIGN_PSBT signs an input; arg: index of the input
+} trace_event_e;
+
+typedef struct {
+    uint16_t tick;  // G_ticks when the event was recorded (a tick is about 100 ms)
+    uint8_t event;  // a trace_event_e
+    uint32_t arg;
+} trace_entry_t;
+
+// Length of the response of GET_TRACE
+#define TRACE_SERIALIZED_LEN (4 + (2 + 1 + 4) * TRACE_BUFFER_SIZE)
+
+#ifdef HAVE_TRACE
+
+// Records an event in the ring buffer, overwriting the oldest one if it is full.
+void trace_record(uint8_t event, uint32_t arg);
+
+/**
+ * Serializes the trace as in the response of GET_TRACE, with all the integers in big-endian:
+ * the total number of events recorded since the app started, followed by the events still in the
+ * ring buffer, oldest first. `out` must be at least TRACE_SERIALIZED_LEN bytes long.
+ *
+ * @return the length of the serialized trace.
+ */
+size_t trace_serialize(uint8_t out[static TRACE_SERIALIZED_LEN]);
+
+#endif
+
+#if defined(HAVE_TRACE) && TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(event, arg) trace_record((event), (arg))
+#else
+#define TRACE_ERROR(event, arg)
+#endif
+
+#if defined(HAVE_TRACE) && TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(event, arg) trace_record((event), (arg))
+#else
+#define TRACE_INFO(event, arg)
+#endif
+
+#if defined(HAVE_TRACE) && TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(event, arg) trace_record((event), (arg))
+#else
+#define TRACE_DEBUG(event, arg)
+#endif
@@ -50,6 +50,12 @@ typedef struct {
     char hash_hex[64 + 1];
 } ui_path_and_hash_state_t;
 
+typedef struct {
+    char bip32_path_str[MAX_SERIALIZED_BIP32_PATH_LENGTH + 1];
+    char n_messages[sizeof("4294967295")];
+    char hash_hex[64 + 1];
+} ui_path_count_and_hash_state_t;
+
 typedef struct {
     char wallet_name[MAX_WALLET_NAME_LENGTH + 1];
 
@@ -75,6 +81,19 @@ typedef struct {
     char fee[MAX_AMOUNT_LENGTH + 1];
 } ui_validate_transaction_state_t;
 
+typedef struct {
+    char count[sizeof("4294967295")];
+    char index[sizeof("Payee #4294967295")];
+    char address[MAX_ADDRESS_LENGTH_STR + 1];
+    char amount[MAX_AMOUNT_LENGTH + 1];
+} ui_payee_list_state_t;
+
+typedef struct {
+    char count[sizeof("4294967295")];
+    char amount[MAX_AMOUNT_LENGTH + 1];
+    char fee[MAX_AMOUNT_LENGTH + 1];
+} ui_psbt_batch_state_t;
+
 /**
  * Union of all the states for each of the UI screens, in order to save memory.
  */
@@ -82,10 +101,13 @@ typedef union {
     ui_path_and_pubkey_state_t path_and_pubkey;
     ui_path_and_address_state_t path_and_address;
     ui_path_and_hash_state_t path_and_hash;
+    ui_path_count_and_hash_state_t path_count_and_hash;
     ui_wallet_state_t wallet;
     ui_cosigner_pubkey_and_index_state_t cosigner_pubkey_and_index;
     ui_validate_output_state_t validate_output;
     ui_validate_transaction_state_t validate_transaction;
+    ui_payee_list_state_t payee_list;
+    ui_psbt_batch_state_t psbt_batch;
 } ui_state_t;
 
 ui_state_t g_ui_state;
@@ -267,6 +289,89 @@ UX_STEP_CB(ux_accept_and_send_step,
            set_ux_flow_response(true),
            {&C_icon_validate_14, "Accept", "and send"});
 
+// Step with wallet icon and "Register payee list"
+UX_STEP_NOCB(ux_display_register_payee_list_step,
+             pnn,
+             {
+                 &C_icon_wallet,
+                 "Register",
+                 "payee list",
+             });
+
+// Step with "Payees" and the number of payees of a payee list
+UX_STEP_NOCB(ux_display_payees_count_step,
+             bnnn_paging,
+             {
+                 .title = "Payees",
+                 .text = g_ui_state.payee_list.count,
+             });
+
+// Step with the index and the address of a payee
+UX_STEP_NOCB(ux_display_payee_address_step,
+             bnnn_paging,
+             {
+                 .title = g_ui_state.payee_list.index,
+                 .text = g_ui_state.payee_list.address,
+             });
+
+// Step with eye icon and "Review registered payees"
+UX_STEP_NOCB(ux_review_payee_outputs_step,
+             pnn,
+             {
+                 &C_icon_eye,
+                 "Review",
+                 "registered payees",
+             });
+
+// Step with "Outputs" and the number of outputs to registered payees
+UX_STEP_NOCB(ux_display_payee_outputs_count_step,
+             bnnn_paging,
+             {
+                 .title = "Outputs",
+                 .text = g_ui_state.payee_list.count,
+             });
+
+// Step with "Total amount" and the total amount of the outputs to registered payees
+UX_STEP_NOCB(ux_display_payee_outputs_amount_step,
+             bnnn_paging,
+             {
+                 .title = "Total amount",
+                 .text = g_ui_state.payee_list.amount,
+             });
+
+// Step with eye icon and "Confirm batch of transactions"
+UX_STEP_NOCB(ux_confirm_psbt_batch_step,
+             pnn,
+             {
+                 &C_icon_eye,
+                 "Confirm batch",
+                 "of transactions",
+             });
+
+// Step with "Transactions" and the number of transactions of the batch
+UX_STEP_NOCB(ux_display_psbt_batch_count_step,
+             bnnn_paging,
+             {
+                 .title = "Transactions",
+                 .text = g_ui_state.psbt_batch.count,
+             });
+
+// Step with "Total amount" and the total amount sent by the transactions of the batch
+UX_STEP_NOCB(ux_display_psbt_batch_amount_step,
+             bnnn_paging,
+             {
+                 .title = "Total amount",
+                 .text = g_ui_state.psbt_batch.amount,
+             });
+
+// Step with "Total fees" and the total fees of the transactions of the batch
+UX_STEP_NOCB(ux_display_psbt_batch_fees_step,
+             bnnn_paging,
+             {
+                 .title = "Total fees",
+                 .text = g_ui_state.psbt_batch.fee,
+             });
+
 // Step with wallet icon and "Register wallet"
 UX_STEP_NOCB(ux_display_register_wallet_step,
              pb,
@@ -293,6 +398,15 @@ UX_STEP_NOCB(ux_display_spend_from_registered_wallet_step,
                  "known wallet",
              });
 
+// Step with wallet icon and "Store wallet on device"
+UX_STEP_NOCB(ux_display_store_wallet_step,
+             pnn,
+             {
+                 &C_icon_wallet,
+                 "Store wallet",
+                 "on device",
+             });
+
 // Step with "Wallet name:", followed by the wallet name
 UX_STEP_NOCB(ux_display_wallet_name_step,
              bnnn_paging,
@@ -342,6 +456,55 @@ UX_FLOW(ux_sign_message_flow,
         &ux_sign_message_accept_new,
         &ux_display_reject_step);
 
+UX_STEP_NOCB(ux_sign_messages_step,
+             pnn,
+             {
+                 &C_icon_certificate,
+                 "Sign",
+                 "messages",
+             });
+
+UX_STEP_NOCB(ux_messages_sign_display_path_step,
+             bnnn_paging,
+             {
+                 .title = "Account",
+                 .text = g_ui_state.path_count_and_hash.bip32_path_str,
+             });
+
+UX_STEP_NOCB(ux_messages_count_step,
+             bnnn_paging,
+             {
+                 .title = "Messages",
+                 .text = g_ui_state.path_count_and_hash.n_messages,
+             });
+
+UX_STEP_NOCB(ux_messages_root_step,
+             bnnn_paging,
+             {
+                 .title = "Messages root",
+                 .text = g_ui_state.path_count_and_hash.hash_hex,
+             });
+
+UX_STEP_CB(ux_sign_messages_accept,
+           pbb,
+           set_ux_flow_response(true),
+           {&C_icon_validate_14, "Sign", "messages"});
+
+// FLOW to display the account path, the number and the Merkle root of the messages to sign:
+// #1 screen: certificate icon + "Sign messages"
+// #2 screen: display the account BIP32 Path
+// #3 screen: display the number of messages
+// #4 screen: display the Merkle root of the messages
+// #5 screen: "Sign messages" and approve button
+// #6 screen: reject button
+UX_FLOW(ux_sign_messages_flow,
+        &ux_sign_messages_step,
+        &ux_messages_sign_display_path_step,
+        &ux_messages_count_step,
+        &ux_messages_root_step,
+        &ux_sign_messages_accept,
+        &ux_display_reject_step);
+
 // FLOW to display BIP32 path and pubkey:
 // #1 screen: eye icon + "Confirm Pubkey"
 // #2 screen: display BIP32 Path
@@ -458,6 +621,17 @@ UX_FLOW(ux_display_spend_from_wallet_flow,
         &ux_display_approve_step,
         &ux_display_reject_step);
 
+// FLOW to store a registered wallet in the registry of the device:
+// #1 screen: wallet icon + "Store wallet on device"
+// #2 screen: wallet name
+// #3 screen: approve button
+// #4 screen: reject button
+UX_FLOW(ux_display_store_wallet_flow,
+        &ux_display_store_wallet_step,
+        &ux_display_wallet_name_step,
+        &ux_display_approve_step,
+        &ux_display_reject_step);
+
 // FLOW to warn about external inputs
 // #1 screen: warning icon + "There are external inputs"
 // #2 screen: crossmark icon + "Reject if not sure" (user can reject here)
@@ -504,6 +678,39 @@ UX_FLOW(ux_display_output_address_amount_flow,
         &ux_display_approve_step,
         &ux_display_reject_step);
 
+// FLOW to display the header of a payee list:
+// #1 screen: wallet icon + "Register payee list"
+// #2 screen: number of payees
+// #3 screen: approve button
+// #4 screen: reject button
+UX_FLOW(ux_display_register_payee_list_flow,
+        &ux_display_register_payee_list_step,
+        &ux_display_payees_count_step,
+        &ux_display_approve_step,
+        &ux_display_reject_step);
+
+// FLOW to display a payee of a payee list:
+// #1 screen: payee index and address (paginated)
+// #2 screen: approve button
+// #3 screen: reject button
+UX_FLOW(ux_display_payee_flow,
+        &ux_display_payee_address_step,
+        &ux_display_approve_step,
+        &ux_display_reject_step);
+
+// FLOW to validate all the outputs to the payees of a registered payee list at once
+// #1 screen: eye icon + "Review registered payees"
+// #2 screen: number of outputs
+// #3 screen: total amount of the outputs
+// #4 screen: approve button
+// #5 screen: reject button
+UX_FLOW(ux_display_payee_outputs_flow,
+        &ux_review_payee_outputs_step,
+        &ux_display_payee_outputs_count_step,
+        &ux_display_payee_outputs_amount_step,
+        &ux_display_approve_step,
+        &ux_display_reject_step);
+
 // Finalize see the transaction fees and finally accept signing
 // #1 screen: eye icon + "Confirm Transaction"
 // #2 screen: fee amount
@@ -515,6 +722,21 @@ UX_FLOW(ux_accept_transaction_flow,
         &ux_accept_and_send_step,
         &ux_display_reject_step);
 
+// Finalize a batch of transactions, after all their outputs were validated
+// #1 screen: eye icon + "Confirm batch of transactions"
+// #2 screen: number of transactions
+// #3 screen: total amount sent
+// #4 screen: total fees
+// #5 screen: "Accept and send", with approve button
+// #6 screen: reject button
+UX_FLOW(ux_accept_psbt_batch_flow,
+        &ux_confirm_psbt_batch_step,
+        &ux_display_psbt_batch_count_step,
+        &ux_display_psbt_batch_amount_step,
+        &ux_display_psbt_batch_fees_step,
+        &ux_accept_and_send_step,
+        &ux_display_reject_step);
+
 // Process UI events until the current flow terminates; does not handle any APDU exchange
 // This method also sets the UI state as "dirty" so that the dispatcher refreshes resets the UI
 // at the end of the command handler.
@@ -531,6 +753,12 @@ bool io_ui_process(dispatcher_context_t *context) {
     do {
         io_seproxyhal_spi_recv(G_io_seproxyhal_spi_buffer, sizeof(G_io_seproxyhal_spi_buffer), 0);
         io_seproxyhal_handle_event();
+#ifdef HAVE_BACKGROUND_TASKS
+        if (G_io_seproxyhal_spi_buffer[0] == SEPROXYHAL_TAG_TICKER_EVENT) {
+            // the user is reading the screen: a good time for the handler's background work
+            context->run_background_step();
+        }
+#endif
         io_seproxyhal_general_status();
     } while (io_seproxyhal_spi_is_status_sent() && !g_ux_flow_ended);
 
@@ -571,6 +799,21 @@ bool ui_display_message_hash(dispatcher_context_t *context,
     return io_ui_process(context);
 }
 
+bool ui_display_messages_root(dispatcher_context_t *context,
+                              const char *bip32_path_str,
+                              uint32_t n_messages,
+                              const char *messages_root) {
+    ui_path_count_and_hash_state_t *state = (ui_path_count_and_hash_state_t *) &g_ui_state;
+
+    strncpy(state->bip32_path_str, bip32_path_str, sizeof(state->bip32_path_str));
+    snprintf(state->n_messages, sizeof(state->n_messages), "%u", n_messages);
+    strncpy(state->hash_hex, messages_root, sizeof(state->hash_hex));
+
+    ux_flow_init(0, ux_sign_messages_flow, NULL);
+
+    return io_ui_process(context);
+}
+
 bool ui_display_register_wallet(dispatcher_context_t *context,
                                 const policy_map_wallet_header_t *wallet_header,
                                 const char *policy_descriptor) {
@@ -642,6 +885,18 @@ bool ui_authorize_wallet_spend(dispatcher_context_t *context, const char *wallet
     return io_ui_process(context);
 }
 
+bool ui_confirm_store_wallet(dispatcher_context_t *context,
+                             const policy_map_wallet_header_t *wallet_header) {
+    ui_wallet_state_t *state = (ui_wallet_state_t *) &g_ui_state;
+
+    strncpy(state->wallet_name, wallet_header->name, sizeof(state->wallet_name));
+    state->wallet_name[wallet_header->name_len] = 0;
+
+    ux_flow_init(0, ux_display_store_wallet_flow, NULL);
+
+    return io_ui_process(context);
+}
+
 bool ui_warn_external_inputs(dispatcher_context_t *context) {
     ux_flow_init(0, ux_display_warning_external_inputs_flow, NULL);
 
@@ -677,6 +932,41 @@ bool ui_validate_output(dispatcher_context_t *context,
     return io_ui_process(context);
 }
 
+bool ui_display_register_payee_list(dispatcher_context_t *context, uint32_t n_payees) {
+    ui_payee_list_state_t *state = (ui_payee_list_state_t *) &g_ui_state;
+
+    snprintf(state->count, sizeof(state->count), "%u", n_payees);
+
+    ux_flow_init(0, ux_display_register_payee_list_flow, NULL);
+
+    return io_ui_process(context);
+}
+
+bool ui_display_payee(dispatcher_context_t *context, uint32_t index, const char *address) {
+    ui_payee_list_state_t *state = (ui_payee_list_state_t *) &g_ui_state;
+
+    snprintf(state->index, sizeof(state->index), "Payee #%u", index);
+    strncpy(state->address, address, sizeof(state->address));
+
+    ux_flow_init(0, ux_display_payee_flow, NULL);
+
+    return io_ui_process(context);
+}
+
+bool ui_validate_payee_outputs(dispatcher_context_t *context,
+                               uint32_t n_outputs,
+                               const char *coin_name,
+                               uint64_t total_amount) {
+    ui_payee_list_state_t *state = (ui_payee_list_state_t *) &g_ui_state;
+
+    snprintf(state->count, sizeof(state->count), "%u", n_outputs);
+    format_sats_amount(coin_name, total_amount, state->amount);
+
+    ux_flow_init(0, ux_display_payee_outputs_flow, NULL);
+
+    return io_ui_process(context);
+}
+
 bool ui_validate_transaction(dispatcher_context_t *context, const char *coin_name, uint64_t fee) {
     ui_validate_transaction_state_t *state = (ui_validate_transaction_state_t *) &g_ui_state;
 
@@ -686,3 +976,19 @@ bool ui_validate_transaction(dispatcher_context_t *context, const char *coin_nam
 
     return io_ui_process(context);
 }
+
+bool ui_validate_psbt_batch(dispatcher_context_t *context,
+                            uint32_t n_psbts,
+                            const char *coin_name,
+                            uint64_t total_amount,
+                            uint64_t total_fee) {
+    ui_psbt_batch_state_t *state = (ui_psbt_batch_state_t *) &g_ui_state;
+
+    snprintf(state->count, sizeof(state->count), "%u", n_psbts);
+    format_sats_amount(coin_name, total_amount, state->amount);
+    format_sats_amount(coin_name, total_fee, state->fee);
+
+    ux_flow_init(0, ux_accept_psbt_batch_flow, NULL);
+
+    return io_ui_process(context);
+}
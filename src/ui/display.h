@@ -25,6 +25,15 @@ bool ui_display_message_hash(dispatcher_context_t *context,
                              const char *bip32_path_str,
                              const char *message_hash);
 
+/**
+ * Displays the account path, the number of messages and the Merkle root of the list of messages,
+ * and asks the confirmation to sign all of them.
+ */
+bool ui_display_messages_root(dispatcher_context_t *context,
+                              const char *bip32_path_str,
+                              uint32_t n_messages,
+                              const char *messages_root);
+
 bool ui_display_address(dispatcher_context_t *dispatcher_context,
                         const char *address,
                         bool is_path_suspicious,
@@ -48,6 +57,9 @@ bool ui_display_unusual_path(dispatcher_context_t *context, const char *bip32_pa
 
 bool ui_authorize_wallet_spend(dispatcher_context_t *context, const char *wallet_name);
 
+bool ui_confirm_store_wallet(dispatcher_context_t *context,
+                             const policy_map_wallet_header_t *wallet_header);
+
 bool ui_warn_external_inputs(dispatcher_context_t *context);
 
 bool ui_warn_unverified_segwit_inputs(dispatcher_context_t *context);
@@ -60,4 +72,34 @@ bool ui_validate_output(dispatcher_context_t *context,
                         const char *coin_name,
                         uint64_t amount);
 
+/**
+ * Displays the number of payees of a payee list, and asks the confirmation to register it.
+ */
+bool ui_display_register_payee_list(dispatcher_context_t *context, uint32_t n_payees);
+
+/**
+ * Displays the address of the payee with the given (1-based) index of a payee list being
+ * registered, and asks the confirmation.
+ */
+bool ui_display_payee(dispatcher_context_t *context, uint32_t index, const char *address);
+
+/**
+ * Displays the number and the total amount of the outputs to the payees of a registered payee
+ * list, and asks the confirmation of all of them at once.
+ */
+bool ui_validate_payee_outputs(dispatcher_context_t *context,
+                               uint32_t n_outputs,
+                               const char *coin_name,
+                               uint64_t total_amount);
+
 bool ui_validate_transaction(dispatcher_context_t *context, const char *coin_name, uint64_t fee);
+
+/**
+ * Displays the number of transactions of a batch, the total amount that they send and their total
+ * fees, and asks the confirmation to sign all of them.
+ */
+bool ui_validate_psbt_batch(dispatcher_context_t *context,
+                            uint32_t n_psbts,
+                            const char *coin_name,
+                            uint64_t total_amount,
+                            uint64_t total_fee);
@@ -5,6 +5,13 @@
 from typing import Tuple, Optional
 import hashlib
 
+# The keys and the signatures are computed and verified with libsecp256k1 if coincurve is installed,
+# which is much faster than the reference implementation below.
+try:
+    from coincurve import PublicKeyXOnly
+except ImportError:
+    PublicKeyXOnly = None
+
 p = 0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEFFFFFC2F
 n = 0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141
 
@@ -86,6 +93,8 @@ def pubkey_gen(seckey: bytes) -> bytes:
     d0 = int_from_bytes(seckey)
     if not (1 <= d0 <= n - 1):
         raise ValueError('The secret key must be an integer in the range 1..n-1.')
+    if PublicKeyXOnly is not None:
+        return PublicKeyXOnly.from_secret(seckey).format()
     P = point_mul(G, d0)
     assert P is not None
     return bytes_from_point(P)
@@ -121,6 +130,12 @@ def schnorr_verify(msg: bytes, pubkey: bytes, sig: bytes) -> bool:
         raise ValueError('The public key must be a 32-byte array.')
     if len(sig) != 64:
         raise ValueError('The signature must be a 64-byte array.')
+    if PublicKeyXOnly is not None:
+        try:
+            return PublicKeyXOnly(pubkey).verify(sig, msg)
+        except ValueError:
+            # not the x-coordinate of a point of the curve
+            return False
     P = lift_x(pubkey)
     r = int_from_bytes(sig[0:32])
     s = int_from_bytes(sig[32:64])
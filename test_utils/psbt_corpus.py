@@ -0,0 +1,236 @@
+"""
+A versioned corpus of large synthetic PSBTs, for the benchmarks of the scaling of SIGN_PSBT.
+
+Each entry of the corpus is generated by txmaker.createPsbt from a random generator seeded with the version of the
+corpus and the name of the entry, so that the same version of the corpus is always the same set of PSBTs. As the
+largest PSBTs take a while to generate, the corpus is cached in a folder, and only the missing ones are generated:
+
+    python -m test_utils.psbt_corpus OUTPUT_DIR [--max-inputs N] [--only NAME [NAME ...]]
+
+writes each entry of the corpus to OUTPUT_DIR/v<CORPUS_VERSION>/<name>.psbt (in base64), and a manifest.json
+describing them. CORPUS_VERSION must be increased whenever a change of this file or of txmaker changes the PSBTs.
+"""
+
+import argparse
+import base64
+import json
+import random
+
+from dataclasses import dataclass, field
+from hashlib import sha256
+from pathlib import Path
+from typing import Dict, List, Optional
+
+from embit.bip32 import HDKey
+from embit.networks import NETWORKS
+
+from bitcoin_client.ledger_bitcoin import WalletPolicy
+from bitcoin_client.ledger_bitcoin.psbt import PSBT
+
+from . import txmaker
+
+
+CORPUS_VERSION = 1
+
+
+def get_cosigner_key_info(index: int) -> str:
+    """Returns the key information of a (deterministic) cosigner for the multisig wallets."""
+    master = HDKey.from_seed(sha256(f"cosigner {index}".encode()).digest())
+    fpr = master.derive("m/0'").fingerprint
+    xpub = master.derive("m/48'/1'/0'/2'").to_public().to_base58(version=NETWORKS["test"]["xpub"])
+    return f"[{fpr.hex()}/48'/1'/0'/2']{xpub}"
+
+
+INTERNAL_MULTISIG_KEY_INFO = "[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK"
+
+WALLETS: Dict[str, WalletPolicy] = {
+    "pkh": WalletPolicy(
+        "",
+        "pkh(@0/**)",
+        [
+            "[f5acc2fd/44'/1'/0']tpubDCwYjpDhUdPGP5rS3wgNg13mTrrjBuG8V9VpWbyptX6TRPbNoZVXsoVUSkCjmQ8jJycjuDKBb9eataSymXakTTaGifxR6kmVsfFehH1ZgJT"
+        ],
+    ),
+    "wpkh": WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    ),
+    "tr": WalletPolicy(
+        "",
+        "tr(@0/**)",
+        [
+            "[f5acc2fd/86'/1'/0']tpubDDKYE6BREvDsSWMazgHoyQWiJwYaDDYPbCFjYxN3HFXJP5fokeiK4hwK5tTLBNEDBwrDXn8cQ4v9b2xdW62Xr5yxoQdMu1v6c7UDXYVH27U"
+        ],
+    ),
+    "sortedmulti_2of3": WalletPolicy(
+        "Multisig 2 of 3",
+        "wsh(sortedmulti(2,@0/**,@1/**,@2/**))",
+        [INTERNAL_MULTISIG_KEY_INFO, get_cosigner_key_info(1), get_cosigner_key_info(2)],
+    ),
+    "miniscript_decaying": WalletPolicy(
+        "Decaying 2 of 2",
+        "wsh(or_d(multi(2,@0/**,@1/**),and_v(v:pkh(@2/**),older(65535))))",
+        [INTERNAL_MULTISIG_KEY_INFO, get_cosigner_key_info(1), get_cosigner_key_info(2)],
+    ),
+    # the wallets of the external inputs, whose keys are not ours
+    "external_pkh": WalletPolicy("", "pkh(@0/**)", [get_cosigner_key_info(3)]),
+    "external_tr": WalletPolicy("", "tr(@0/**)", [get_cosigner_key_info(4)]),
+}
+
+
+@dataclass
+class CorpusEntry:
+    """The description of a PSBT of the corpus; see txmaker.createPsbt for the options."""
+
+    name: str
+    wallet: str
+    n_inputs: int
+    n_outputs: int
+    # the wallets of the external inputs, that are used in turn for one input out of `external_period`
+    external_wallets: List[str] = field(default_factory=list)
+    external_period: int = 4
+    n_prevout_txs: Optional[int] = None
+    prevout_n_inputs: Optional[int] = None
+    n_foreign_derivations: int = 0
+
+    def is_internal(self, input_index: int) -> bool:
+        return len(self.external_wallets) == 0 or input_index % self.external_period != self.external_period - 1
+
+    @property
+    def n_internal_inputs(self) -> int:
+        return sum(1 for i in range(self.n_inputs) if self.is_internal(i))
+
+
+def _make_entries() -> List[CorpusEntry]:
+    entries: List[CorpusEntry] = []
+    for wallet in ["pkh", "wpkh", "tr", "sortedmulti_2of3", "miniscript_decaying"]:
+        for n_inputs in [10, 100, 500, 2000]:
+            entries.append(CorpusEntry(f"{wallet}_{n_inputs}to2", wallet, n_inputs, 2))
+
+    for n_inputs in [100, 500]:
+        entries += [
+            CorpusEntry(f"wpkh_{n_inputs}to2_external", "wpkh", n_inputs, 2,
+                        external_wallets=["external_pkh", "external_tr"]),
+            CorpusEntry(f"wpkh_{n_inputs}to2_shared_prevouts", "wpkh", n_inputs, 2,
+                        n_prevout_txs=max(1, n_inputs // 50)),
+            CorpusEntry(f"pkh_{n_inputs}to2_large_prevouts", "pkh", n_inputs, 2, prevout_n_inputs=50),
+            CorpusEntry(f"wpkh_{n_inputs}to10_foreign_derivations", "wpkh", n_inputs, 10, n_foreign_derivations=15),
+            CorpusEntry(f"tr_{n_inputs}to10_foreign_derivations", "tr", n_inputs, 10, n_foreign_derivations=15),
+        ]
+    return entries
+
+
+CORPUS: Dict[str, CorpusEntry] = {entry.name: entry for entry in _make_entries()}
+
+
+def generate_psbt(entry: CorpusEntry) -> PSBT:
+    """Generates the PSBT of an entry of the corpus, always the same for the same CORPUS_VERSION."""
+
+    random.seed(f"{CORPUS_VERSION}/{entry.name}")
+
+    wallet = WALLETS[entry.wallet]
+    input_wallet = [
+        None if entry.is_internal(i)
+        else WALLETS[entry.external_wallets[(i // entry.external_period) % len(entry.external_wallets)]]
+        for i in range(entry.n_inputs)
+    ]
+
+    in_amounts = [100_000 + 10_000 * i for i in range(entry.n_inputs)]
+    fees = 10_000
+    out_amounts = [(sum(in_amounts) - fees) // entry.n_outputs] * entry.n_outputs
+
+    # the first output is a change output
+    return txmaker.createPsbt(wallet, in_amounts, out_amounts, [i == 0 for i in range(entry.n_outputs)],
+                              input_wallet=input_wallet, n_prevout_txs=entry.n_prevout_txs,
+                              prevout_n_inputs=entry.prevout_n_inputs,
+                              n_foreign_derivations=entry.n_foreign_derivations)
+
+
+def _manifest_entry(entry: CorpusEntry, psbt_b64: str) -> dict:
+    return {
+        "version": CORPUS_VERSION,
+        "wallet": entry.wallet,
+        "n_inputs": entry.n_inputs,
+        "n_outputs": entry.n_outputs,
+        "n_internal_inputs": entry.n_internal_inputs,
+        "sha256": sha256(psbt_b64.encode()).hexdigest(),
+        "size": len(base64.b64decode(psbt_b64)),
+    }
+
+
+def _version_dir(corpus_dir: Path) -> Path:
+    return Path(corpus_dir) / f"v{CORPUS_VERSION}"
+
+
+def _read_manifest(corpus_dir: Path) -> Dict[str, dict]:
+    path = _version_dir(corpus_dir) / "manifest.json"
+    if not path.exists():
+        return {}
+    with open(path, "r") as f:
+        return json.load(f)
+
+
+def _write_manifest(corpus_dir: Path, manifest: Dict[str, dict]) -> None:
+    with open(_version_dir(corpus_dir) / "manifest.json", "w") as f:
+        json.dump(manifest, f, indent=2, sort_keys=True)
+
+
+def _load_cached(corpus_dir: Path, entry: CorpusEntry, manifest: Dict[str, dict]) -> Optional[str]:
+    path = _version_dir(corpus_dir) / f"{entry.name}.psbt"
+    description = manifest.get(entry.name)
+    if description is None or description["version"] != CORPUS_VERSION or not path.exists():
+        return None
+
+    psbt_b64 = path.read_text().strip()
+    if sha256(psbt_b64.encode()).hexdigest() != description["sha256"]:
+        return None
+    return psbt_b64
+
+
+def load_corpus_entry(corpus_dir: Path, name: str) -> PSBT:
+    """Returns the PSBT of the entry `name` of the corpus cached in corpus_dir, generating it (and adding it to the
+    cache) if it is missing, or if it is from another version of the corpus."""
+
+    entry = CORPUS[name]
+    manifest = _read_manifest(corpus_dir)
+
+    psbt_b64 = _load_cached(corpus_dir, entry, manifest)
+    if psbt_b64 is None:
+        psbt_b64 = generate_psbt(entry).serialize()
+
+        _version_dir(corpus_dir).mkdir(parents=True, exist_ok=True)
+        (_version_dir(corpus_dir) / f"{entry.name}.psbt").write_text(psbt_b64 + "\n")
+        # the manifest is read again, in case other entries were added meanwhile
+        manifest = _read_manifest(corpus_dir)
+        manifest[entry.name] = _manifest_entry(entry, psbt_b64)
+        _write_manifest(corpus_dir, manifest)
+
+    psbt = PSBT()
+    psbt.deserialize(psbt_b64)
+    return psbt
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generates the corpus of large PSBTs of the benchmarks.")
+    parser.add_argument("output_dir", type=Path, help="the folder of the corpus")
+    parser.add_argument("--max-inputs", type=int, default=None,
+                        help="only generate the entries with at most this number of inputs")
+    parser.add_argument("--only", nargs="+", default=None, choices=list(CORPUS), metavar="NAME",
+                        help="only generate the given entries")
+    args = parser.parse_args()
+
+    for entry in CORPUS.values():
+        if args.only is not None and entry.name not in args.only:
+            continue
+        if args.max_inputs is not None and entry.n_inputs > args.max_inputs:
+            continue
+
+        load_corpus_entry(args.output_dir, entry.name)
+        print(f"{entry.name}: {_read_manifest(args.output_dir)[entry.name]['size']} bytes")
+
+
+if __name__ == "__main__":
+    main()
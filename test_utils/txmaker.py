@@ -1,6 +1,9 @@
-from random import randint
+import re
+from functools import lru_cache
+from hashlib import sha256
+from random import randint, sample
 
-from typing import List, Tuple, Optional
+from typing import Dict, List, Tuple, Optional
 from bitcoin_client.ledger_bitcoin import WalletPolicy, WalletType
 from bitcoin_client.ledger_bitcoin.key import KeyOriginInfo, parse_path, get_taproot_output_key
 from bitcoin_client.ledger_bitcoin.psbt import PSBT, PartiallySignedInput, PartiallySignedOutput
@@ -40,14 +43,19 @@ def random_txid() -> bytes:
     return random_bytes(32)
 
 
-def getScriptPubkeyFromWallet(wallet: WalletPolicy, change: bool, address_index: int) -> Script:
-    descriptor_str = wallet.descriptor_template
+# The derivations are cached, as the large PSBTs derive the same keys and scripts many times: the descriptors and the
+# extended keys are only parsed once, and the hardened derivations from the master key are only done once per account.
+
+@lru_cache(maxsize=None)
+def _parse_wallet_descriptor(descriptor_template: str, keys_info: Tuple[str, ...], version: WalletType,
+                             change: bool) -> Descriptor:
+    descriptor_str = descriptor_template
 
     # Iterate in reverse order, as strings identifying a small-index key (like @1) can be a
     # prefix of substrings identifying a large-index key (like @12), but not the other way around
     # A more structural parsing would be more robust
-    for i, key_info_str in enumerate(reversed(wallet.keys_info)):
-        if wallet.version == WalletType.WALLET_POLICY_V1 and key_info_str[-3:] != "/**":
+    for i, key_info_str in enumerate(reversed(keys_info)):
+        if version == WalletType.WALLET_POLICY_V1 and key_info_str[-3:] != "/**":
             raise ValueError("All the keys must have wildcard (/**)")
 
         if f"@{i}" not in descriptor_str:
@@ -58,7 +66,75 @@ def getScriptPubkeyFromWallet(wallet: WalletPolicy, change: bool, address_index:
     # by doing the text substitution of '/**' at the end, this works for either V1 or V2
     descriptor_str = descriptor_str.replace("/**", f"/{1 if change else 0}/*")
 
-    return Descriptor.from_string(descriptor_str).derive(address_index).script_pubkey()
+    return Descriptor.from_string(descriptor_str)
+
+
+def getDescriptorFromWallet(wallet: WalletPolicy, change: bool, address_index: int) -> Descriptor:
+    return _parse_wallet_descriptor(
+        wallet.descriptor_template, tuple(wallet.keys_info), wallet.version, bool(change)).derive(address_index)
+
+
+@lru_cache(maxsize=1 << 16)
+def _get_script_pubkey(descriptor_template: str, keys_info: Tuple[str, ...], version: WalletType, change: bool,
+                       address_index: int) -> bytes:
+    descriptor = _parse_wallet_descriptor(descriptor_template, keys_info, version, change)
+    return descriptor.derive(address_index).script_pubkey().data
+
+
+def getScriptPubkeyFromWallet(wallet: WalletPolicy, change: bool, address_index: int) -> Script:
+    return Script(_get_script_pubkey(
+        wallet.descriptor_template, tuple(wallet.keys_info), wallet.version, bool(change), address_index))
+
+
+@lru_cache(maxsize=None)
+def _parse_xpub(xpub: str) -> HDKey:
+    return HDKey.from_string(xpub)
+
+
+def getKeyPathsFromWallet(wallet: WalletPolicy, change: bool, address_index: int) -> Dict[bytes, KeyOriginInfo]:
+    """Returns the keys of all the cosigners of a multisig wallet for the given change/address_index, with their
+    key origin information."""
+
+    result: Dict[bytes, KeyOriginInfo] = {}
+    for key_info in wallet.keys_info:
+        key_origin = key_info[1:key_info.index("]")]
+        xpub = _parse_xpub(key_info[key_info.index("]") + 1:].replace("/**", ""))
+        key: bytes = xpub.derive([int(change), address_index]).key.sec()
+        path = parse_path(f"m{key_origin[8:]}/{int(change)}/{address_index}")
+        result[key] = KeyOriginInfo(bytes.fromhex(key_origin[:8]), path)
+    return result
+
+
+@lru_cache(maxsize=None)
+def _derive_master_key(path_str: str) -> HDKey:
+    return master_key.derive(path_str)
+
+
+def derivePubkey(path_str: str) -> bytes:
+    """Returns the compressed public key of the speculos seed at the given path, whose last two steps (the change and
+    the address index) are unhardened."""
+
+    account_path, change, address_index = path_str.rsplit("/", 2)
+    return _derive_master_key(account_path).derive([int(change), int(address_index)]).key.sec()
+
+
+@lru_cache(maxsize=None)
+def _get_foreign_key(index: int) -> Tuple[bytes, bytes]:
+    seed = sha256(f"foreign key {index}".encode()).digest()
+    return seed[:4], HDKey.from_seed(seed).key.sec()
+
+
+def addForeignDerivations(psbt_map, is_taproot: bool, n_derivations: int, change: int, address_index: int) -> None:
+    """Adds to an input or an output of a PSBT the derivations of `n_derivations` keys of other fingerprints, that
+    the app must ignore. The keys are deterministic, and only derived once."""
+
+    for j in range(n_derivations):
+        fingerprint, key = _get_foreign_key(j)
+        path = parse_path(f"m/48'/1'/{j}'/2'/{change}/{address_index}")
+        if is_taproot:
+            psbt_map.tap_bip32_paths[key[1:]] = (list(), KeyOriginInfo(fingerprint, path))
+        else:
+            psbt_map.hd_keypaths[key] = KeyOriginInfo(fingerprint, path)
 
 
 def createFakeWalletTransaction(n_inputs: int, n_outputs: int, output_amount: int, wallet: WalletPolicy) -> Tuple[CTransaction, int, int, int]:
@@ -67,17 +143,34 @@ def createFakeWalletTransaction(n_inputs: int, n_outputs: int, output_amount: in
     Each output of the transaction is a spend to wallet (possibly to a change address); the change/address_index of the
     derivation of the selected output are also returned.
     """
-    assert n_inputs > 0 and n_outputs > 0
+    tx, [(selected_output_index, selected_output_change, selected_output_address_index)] = \
+        createFakeSharedTransaction(n_inputs, n_outputs, [(output_amount, wallet)], wallet)
+    return tx, selected_output_index, selected_output_change, selected_output_address_index
+
+
+def createFakeSharedTransaction(n_inputs: int, n_outputs: int, selected_outputs: List[Tuple[int, WalletPolicy]],
+                                wallet: WalletPolicy) -> Tuple[CTransaction, List[Tuple[int, int, int]]]:
+    """
+    Like createFakeWalletTransaction, but with a distinct random output for each of the selected_outputs, with its
+    amount and its wallet; the other outputs are spends to wallet. The index and the change/address_index of the
+    derivation of each selected output are returned, in the same order.
+    """
+    assert n_inputs > 0 and n_outputs >= len(selected_outputs) > 0
+
+    if len(selected_outputs) == 1:
+        selected_indexes = [randint(0, n_outputs - 1)]
+    else:
+        selected_indexes = sample(range(n_outputs), len(selected_outputs))
+    selected_derivations = [(randint(0, 1), randint(0, 10_000)) for _ in selected_outputs]
 
-    selected_output_index = randint(0, n_outputs - 1)
-    selected_output_change = randint(0, 1)
-    selected_output_address_index = randint(0, 10_000)
+    selected: Dict[int, int] = {output_index: k for k, output_index in enumerate(selected_indexes)}
 
     vout: List[CTxOut] = []
     for i in range(n_outputs):
-        if i == selected_output_index:
-            scriptPubKey: bytes = getScriptPubkeyFromWallet(
-                wallet, selected_output_change, selected_output_address_index).data
+        if i in selected:
+            k = selected[i]
+            output_amount, output_wallet = selected_outputs[k]
+            scriptPubKey: bytes = getScriptPubkeyFromWallet(output_wallet, *selected_derivations[k]).data
             vout.append(CTxOut(output_amount, scriptPubKey))
         else:
             # could use any other script for the other outputs; doesn't really matter
@@ -113,22 +206,21 @@ def createFakeWalletTransaction(n_inputs: int, n_outputs: int, output_amount: in
 
     tx.rehash()
 
-    return tx, selected_output_index, selected_output_change, selected_output_address_index
-
+    return tx, [(output_index, *selected_derivations[k]) for k, output_index in enumerate(selected_indexes)]
 
-def createPsbt(wallet: WalletPolicy, input_amounts: List[int], output_amounts: List[int], output_is_change: List[bool], output_wallet: Optional[List[Optional[WalletPolicy]]] = None) -> PSBT:
-    if output_wallet is None:
-        output_wallet = [None] * len(output_amounts)
 
-    assert len(output_amounts) == len(output_is_change)
-    assert len(output_amounts) == len(output_wallet)
-    assert sum(output_amounts) <= sum(input_amounts)
+def _get_wallet_script_kind(wallet: WalletPolicy) -> Tuple[bool, bool, bool, bool]:
+    """Returns is_legacy, is_segwitv0, is_taproot and is_wsh for a wallet supported by createPsbt."""
 
-    # TODO: add support for wrapped segwit wallets
+    # multisig and miniscript wallets are only supported as wsh(...) policies, whose keys are all @i/**
+    is_wsh = wallet.version == WalletType.WALLET_POLICY_V2 and wallet.descriptor_template.startswith("wsh(") and \
+        re.search(r"@\d+(?!\d|/\*\*)", wallet.descriptor_template) is None
 
-    if wallet.n_keys != 1:
-        raise NotImplementedError("Only 1-key wallets supported")
-    if wallet.version == WalletType.WALLET_POLICY_V1:
+    if wallet.n_keys != 1 and not is_wsh:
+        raise NotImplementedError("Only 1-key wallets and wsh wallets supported")
+    if is_wsh:
+        pass  # the keys are not checked, the cosigners' keys are derived from the xpubs
+    elif wallet.version == WalletType.WALLET_POLICY_V1:
         if wallet.descriptor_template not in ["pkh(@0)", "wpkh(@0)", "tr(@0)"]:
             raise NotImplementedError("Unsupported policy type")
     elif wallet.version == WalletType.WALLET_POLICY_V2:
@@ -138,27 +230,73 @@ def createPsbt(wallet: WalletPolicy, input_amounts: List[int], output_amounts: L
         raise ValueError(
             f"Unknown wallet policy version: {wallet.version}")
 
+    # simplification; good enough for the scripts we support now, but will need more work
+    is_legacy = wallet.descriptor_template.startswith("pkh(")
+    is_segwitv0 = wallet.descriptor_template.startswith(
+        "wpkh(") or wallet.descriptor_template.startswith("sh(wpkh(") or is_wsh
+    is_taproot = wallet.descriptor_template.startswith("tr(")
+
+    return is_legacy, is_segwitv0, is_taproot, is_wsh
+
+
+def createPsbt(wallet: WalletPolicy, input_amounts: List[int], output_amounts: List[int], output_is_change: List[bool],
+               output_wallet: Optional[List[Optional[WalletPolicy]]] = None, *,
+               input_wallet: Optional[List[Optional[WalletPolicy]]] = None, n_prevout_txs: Optional[int] = None,
+               prevout_n_inputs: Optional[int] = None, n_foreign_derivations: int = 0) -> PSBT:
+    """
+    Creates a PSBT spending inputs of wallet, with the given amounts. The keyword arguments make larger and more varied
+    PSBTs, for example for the corpus of psbt_corpus:
+    - input_wallet: the wallet of each input, if not wallet; the inputs of the other wallets are external ones;
+    - n_prevout_txs: the number of previous transactions, whose outputs are shared by the inputs, instead of one each;
+    - prevout_n_inputs: the number of inputs of each previous transaction, instead of a random one between 1 and 10,
+      which sets the size of the non-witness UTXOs;
+    - n_foreign_derivations: the number of derivations of keys of other fingerprints added to each input and change
+      output.
+    """
+    if output_wallet is None:
+        output_wallet = [None] * len(output_amounts)
+    if input_wallet is None:
+        input_wallet = [None] * len(input_amounts)
+
+    assert len(output_amounts) == len(output_is_change)
+    assert len(output_amounts) == len(output_wallet)
+    assert len(input_amounts) == len(input_wallet)
+    assert sum(output_amounts) <= sum(input_amounts)
+
+    # TODO: add support for wrapped segwit wallets
+
+    is_legacy, is_segwitv0, is_taproot, is_multisig = _get_wallet_script_kind(wallet)
+
+    input_wallets: List[WalletPolicy] = [w if w is not None else wallet for w in input_wallet]
+
     vin: List[CTxIn] = [CTxIn() for _ in input_amounts]
     vout: List[CTxOut] = [CTxOut() for _ in output_amounts]
 
     # create some credible prevout transactions
-    prevouts: List[CTransaction] = []
-    prevout_ns: List[int] = []
-    prevout_path_change: List[int] = []
-    prevout_path_addr_idx: List[int] = []
-    for i, prevout_amount in enumerate(input_amounts):
-        n_inputs = randint(1, 10)
-        n_outputs = randint(1, 10)
-        prevout, idx, is_change, addr_idx = createFakeWalletTransaction(
-            n_inputs, n_outputs, prevout_amount, wallet)
-        prevouts.append(prevout)
-        prevout_ns.append(idx)
-        prevout_path_change.append(is_change)
-        prevout_path_addr_idx.append(addr_idx)
-
-        vin[i].prevout = COutPoint(prevout.sha256, idx)
-        vin[i].scriptSig = b''
-        vin[i].nSequence = 0
+    if n_prevout_txs is None:
+        prevout_groups = [[i] for i in range(len(input_amounts))]
+    else:
+        prevout_groups = [list(range(k, len(input_amounts), n_prevout_txs))
+                          for k in range(min(n_prevout_txs, len(input_amounts)))]
+
+    prevouts: List[CTransaction] = [CTransaction() for _ in input_amounts]
+    prevout_ns: List[int] = [0] * len(input_amounts)
+    prevout_path_change: List[int] = [0] * len(input_amounts)
+    prevout_path_addr_idx: List[int] = [0] * len(input_amounts)
+    for group in prevout_groups:
+        n_inputs = randint(1, 10) if prevout_n_inputs is None else prevout_n_inputs
+        n_outputs = randint(1, 10) if len(group) == 1 else len(group) + randint(0, 9)
+        prevout, selected = createFakeSharedTransaction(
+            n_inputs, n_outputs, [(input_amounts[i], input_wallets[i]) for i in group], wallet)
+        for i, (idx, is_change, addr_idx) in zip(group, selected):
+            prevouts[i] = prevout
+            prevout_ns[i] = idx
+            prevout_path_change[i] = is_change
+            prevout_path_addr_idx[i] = addr_idx
+
+            vin[i].prevout = COutPoint(prevout.sha256, idx)
+            vin[i].scriptSig = b''
+            vin[i].nSequence = 0
 
     psbt = PSBT()
     psbt.version = 0
@@ -171,36 +309,47 @@ def createPsbt(wallet: WalletPolicy, input_amounts: List[int], output_amounts: L
     psbt.inputs = [PartiallySignedInput(0) for _ in input_amounts]
     psbt.outputs = [PartiallySignedOutput(0) for _ in output_amounts]
 
-    # simplification; good enough for the scripts we support now, but will need more work
-    is_legacy = wallet.descriptor_template.startswith("pkh(")
-    is_segwitv0 = wallet.descriptor_template.startswith(
-        "wpkh(") or wallet.descriptor_template.startswith("sh(wpkh(")
-    is_taproot = wallet.descriptor_template.startswith("tr(")
-
     key_origin = wallet.keys_info[0][1:wallet.keys_info[0].index("]")]
 
     for i in range(len(input_amounts)):
-        if is_legacy or is_segwitv0:
+        input_wallet_i = input_wallets[i]
+        in_is_legacy, in_is_segwitv0, in_is_taproot, in_is_wsh = _get_wallet_script_kind(input_wallet_i)
+
+        if in_is_legacy or in_is_segwitv0:
             # add non-witness UTXO
             psbt.inputs[i].non_witness_utxo = prevouts[i]
-        if is_segwitv0 or is_taproot:
+        if in_is_segwitv0 or in_is_taproot:
             # add witness UTXO
             psbt.inputs[i].witness_utxo = prevouts[i].vout[prevout_ns[i]]
 
-        path_str = f"m{key_origin[8:]}/{prevout_path_change[i]}/{prevout_path_addr_idx[i]}"
-        path = parse_path(path_str)
-        input_key: bytes = master_key.derive(path_str).key.sec()
+        addForeignDerivations(psbt.inputs[i], in_is_taproot, n_foreign_derivations,
+                              prevout_path_change[i], prevout_path_addr_idx[i])
+
+        if in_is_wsh:
+            psbt.inputs[i].witness_script = getDescriptorFromWallet(
+                input_wallet_i, prevout_path_change[i], prevout_path_addr_idx[i]).witness_script().data
+            psbt.inputs[i].hd_keypaths.update(getKeyPathsFromWallet(
+                input_wallet_i, prevout_path_change[i], prevout_path_addr_idx[i]))
+            continue
+
+        if input_wallet_i is not wallet:
+            # the key of an external input is derived from its xpub, as it might not be ours
+            [(input_key, input_key_origin)] = getKeyPathsFromWallet(
+                input_wallet_i, prevout_path_change[i], prevout_path_addr_idx[i]).items()
+        else:
+            path_str = f"m{key_origin[8:]}/{prevout_path_change[i]}/{prevout_path_addr_idx[i]}"
+            input_key = derivePubkey(path_str)
+            input_key_origin = KeyOriginInfo(master_key_fpr, parse_path(path_str))
 
         assert len(input_key) == 33
 
         # add key and path info
-        if is_legacy or is_segwitv0:
-            psbt.inputs[i].hd_keypaths[input_key] = KeyOriginInfo(
-                master_key_fpr, path)
-        elif is_taproot:
+        if in_is_legacy or in_is_segwitv0:
+            psbt.inputs[i].hd_keypaths[input_key] = input_key_origin
+        elif in_is_taproot:
             tweaked_key = get_taproot_output_key(input_key)
             psbt.inputs[i].tap_bip32_paths[tweaked_key] = (
-                list(), KeyOriginInfo(master_key_fpr, path))
+                list(), input_key_origin)
         else:
             raise RuntimeError("Unexpected state: unknown transaction type")
 
@@ -215,9 +364,15 @@ def createPsbt(wallet: WalletPolicy, input_amounts: List[int], output_amounts: L
         tx.vout[i].nValue = output_amount
 
         if output_is_change[i]:
+            addForeignDerivations(psbt.outputs[i], is_taproot, n_foreign_derivations, 1, i)
+
+        if output_is_change[i] and is_multisig:
+            psbt.outputs[i].witness_script = getDescriptorFromWallet(wallet, True, i).witness_script().data
+            psbt.outputs[i].hd_keypaths.update(getKeyPathsFromWallet(wallet, True, i))
+        elif output_is_change[i]:
             path_str = f"m{key_origin[8:]}/1/{i}"
             path = parse_path(path_str)
-            output_key: bytes = master_key.derive(path_str).key.sec()
+            output_key: bytes = derivePubkey(path_str)
 
             # add key and path information for change output
             if is_legacy or is_segwitv0:
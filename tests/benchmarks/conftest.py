@@ -0,0 +1,52 @@
+import json
+import os
+
+from pathlib import Path
+from typing import Dict
+
+import pytest
+
+"""
+Fixtures of the benchmarks. They can be configured with the following environment variables:
+
+BENCHMARK_BUDGETS: the JSON file of the budgets of each scenario. Default: budgets.json in this folder
+
+BENCHMARK_TOLERANCE: the fraction by which a measure can exceed its budget before the benchmark fails. Default: 0.1
+
+BENCHMARK_RESULTS: the JSON file where the measures of all the scenarios that were run are written. Default:
+                   benchmark_results.json in the current folder
+
+BENCHMARK_CORPUS: the folder where the corpus of large PSBTs of test_utils/psbt_corpus.py is cached; the missing
+                  PSBTs are generated in it. Default: corpus in this folder
+"""
+
+
+benchmarks_root: Path = Path(__file__).parent
+
+
+@pytest.fixture(scope="session")
+def benchmark_budgets() -> Dict[str, dict]:
+    path = os.getenv("BENCHMARK_BUDGETS", str(benchmarks_root / "budgets.json"))
+    with open(path, "r") as f:
+        return json.load(f)
+
+
+@pytest.fixture(scope="session")
+def benchmark_tolerance() -> float:
+    return float(os.getenv("BENCHMARK_TOLERANCE", "0.1"))
+
+
+@pytest.fixture(scope="session")
+def benchmark_corpus_dir() -> Path:
+    return Path(os.getenv("BENCHMARK_CORPUS", str(benchmarks_root / "corpus")))
+
+
+@pytest.fixture(scope="session")
+def benchmark_results() -> Dict[str, dict]:
+    results: Dict[str, dict] = {}
+
+    yield results
+
+    if len(results) > 0:
+        with open(os.getenv("BENCHMARK_RESULTS", "benchmark_results.json"), "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
@@ -0,0 +1,213 @@
+import hmac
+import os
+import time
+
+from decimal import Decimal
+from hashlib import sha256
+from typing import Callable, Dict, List, Optional, Tuple, Union
+
+import pytest
+
+from bitcoin_client.ledger_bitcoin import Client, TransportClient
+from bitcoin_client.ledger_bitcoin.psbt import PSBT
+from bitcoin_client.ledger_bitcoin.wallet import WalletPolicy
+from speculos.client import SpeculosClient
+
+from test_utils import SpeculosGlobals, count_internal_keys, get_internal_xpub
+from test_utils.speculos import automation
+
+from ..conftest import AuthServiceProxy, create_new_wallet, generate_blocks, get_unique_wallet_name, get_wallet_rpc
+from ..conftest import testnet_to_regtest_addr as T
+from .test_benchmark_sign_psbt import check_budget
+
+"""
+End-to-end throughput of the app against bitcoind, on the regtest setup of the test_e2e_*.py tests.
+
+For each wallet type, the whole workflow of a spend is run in a loop: funding an address of the wallet, creating a PSBT
+with bitcoind, signing it with the device, finalizing it (with the signatures of the cosigners in bitcoind, if any) and
+broadcasting it. Each scenario reports the signatures and the addresses per second, and the percentiles of the latency
+of each phase; the measures are checked against the budgets like the other benchmarks (see conftest.py), so budgets
+can be set on the latencies.
+
+The number of spends of each scenario is E2E_ITERATIONS (default: 5), and the number of addresses whose derivation is
+timed is E2E_ADDRESSES (default: 20); an acceptance run of a new firmware should use larger values.
+"""
+
+
+PHASES = ["fund", "create_psbt", "sign", "finalize", "broadcast", "total"]
+
+
+def percentile(values: List[float], p: float) -> float:
+    """Returns the p-th percentile of values, with the nearest-rank method."""
+    ordered = sorted(values)
+    rank = max(1, -(-len(ordered) * p // 100))  # ceil(len * p / 100)
+    return ordered[int(rank) - 1]
+
+
+def latency_stats(values: List[float]) -> Dict[str, float]:
+    return {
+        "p50": percentile(values, 50),
+        "p90": percentile(values, 90),
+        "p99": percentile(values, 99),
+        "max": max(values),
+    }
+
+
+def import_wallet_in_core(rpc: AuthServiceProxy, wallet_policy: WalletPolicy) -> AuthServiceProxy:
+    """Creates a watch-only wallet in bitcoind with the receive and change descriptors of wallet_policy."""
+
+    descriptors = []
+    for change in [False, True]:
+        descriptor_info = rpc.getdescriptorinfo(wallet_policy.get_descriptor(change=change))
+        descriptors.append({
+            "desc": descriptor_info["descriptor"],
+            "active": True,
+            "internal": change,
+            "timestamp": "now"
+        })
+
+    wallet_name = get_unique_wallet_name()
+    rpc.createwallet(wallet_name=wallet_name, disable_private_keys=True, descriptors=True)
+    wallet_rpc = get_wallet_rpc(wallet_name)
+    wallet_rpc.importdescriptors(descriptors)
+    return wallet_rpc
+
+
+def get_wallet(wallet_type: str, speculos_globals: SpeculosGlobals) -> Tuple[WalletPolicy, List[str]]:
+    """Returns the wallet policy of wallet_type, and the names of the wallets in bitcoind of its other cosigners."""
+
+    fpr = speculos_globals.master_key_fingerprint.hex()
+
+    def internal_key_info(path: str) -> str:
+        return f"[{fpr}/{path}]{get_internal_xpub(speculos_globals.seed, path)}"
+
+    if wallet_type == "wpkh":
+        return WalletPolicy("", "wpkh(@0/**)", [internal_key_info("84'/1'/0'")]), []
+    elif wallet_type == "tr":
+        return WalletPolicy("", "tr(@0/**)", [internal_key_info("86'/1'/0'")]), []
+    elif wallet_type == "sortedmulti_2of2":
+        core_wallet_name, core_xpub = create_new_wallet()
+        return WalletPolicy(
+            name="Cold storage",
+            descriptor_template="wsh(sortedmulti(2,@0/**,@1/**))",
+            keys_info=[internal_key_info("48'/1'/0'/2'"), core_xpub],
+        ), [core_wallet_name]
+    elif wallet_type == "miniscript_or_d":
+        _, core_xpub = create_new_wallet()
+        return WalletPolicy(
+            name="Joint account",
+            descriptor_template="wsh(or_d(pk(@0/**),pkh(@1/**)))",
+            keys_info=[internal_key_info("499'/1'/0'"), core_xpub],
+        ), []
+    else:
+        raise ValueError(f"Unknown wallet type: {wallet_type}")
+
+
+def timed(fn: Callable, latencies: List[float]):
+    start = time.monotonic()
+    result = fn()
+    latencies.append(time.monotonic() - start)
+    return result
+
+
+@pytest.mark.parametrize("wallet_type", ["wpkh", "tr", "sortedmulti_2of2", "miniscript_or_d"])
+def test_benchmark_e2e_throughput(rpc: AuthServiceProxy, rpc_test_wallet: AuthServiceProxy, client: Client,
+                                  speculos_globals: SpeculosGlobals, comm: Union[TransportClient, SpeculosClient],
+                                  wallet_type: str, benchmark_budgets: Dict[str, dict], benchmark_tolerance: float,
+                                  benchmark_results: Dict[str, dict]):
+    n_iterations = int(os.getenv("E2E_ITERATIONS", "5"))
+    n_addresses = int(os.getenv("E2E_ADDRESSES", "20"))
+
+    wallet_policy, core_wallet_names = get_wallet(wallet_type, speculos_globals)
+
+    wallet_hmac: Optional[bytes] = None
+    if wallet_policy.name != "":
+        with automation(comm, "automations/register_wallet_accept.json"):
+            wallet_id, wallet_hmac = client.register_wallet(wallet_policy)
+        assert hmac.compare_digest(
+            hmac.new(speculos_globals.wallet_registration_key, wallet_id, sha256).digest(),
+            wallet_hmac,
+        )
+
+    wallet_rpc = import_wallet_in_core(rpc, wallet_policy)
+
+    # ==> derive addresses, checking the first one against bitcoind
+
+    address_latencies: List[float] = []
+    addresses = [
+        timed(lambda: client.get_wallet_address(wallet_policy, wallet_hmac, 0, i, False), address_latencies)
+        for i in range(n_addresses)
+    ]
+    receive_descriptor = rpc.getdescriptorinfo(wallet_policy.get_descriptor(change=False))["descriptor"]
+    assert T(addresses[0]) == rpc.deriveaddresses(receive_descriptor, [0, 0])[0]
+
+    # ==> spend in a loop
+
+    latencies: Dict[str, List[float]] = {phase: [] for phase in PHASES}
+    n_internal_keys = count_internal_keys(speculos_globals.seed, "test", wallet_policy)
+    n_signatures = 0
+
+    with automation(comm, "automations/sign_with_wallet_accept.json"):
+        for i in range(n_iterations):
+            start = time.monotonic()
+
+            def fund():
+                rpc_test_wallet.sendtoaddress(T(addresses[i % n_addresses]), "0.1")
+                generate_blocks(1)
+
+            timed(fund, latencies["fund"])
+
+            def create_psbt() -> str:
+                return wallet_rpc.walletcreatefundedpsbt(
+                    outputs={rpc_test_wallet.getnewaddress(): Decimal("0.01")},
+                    options={"fee_rate": 10}
+                )["psbt"]
+
+            psbt_b64 = timed(create_psbt, latencies["create_psbt"])
+
+            psbt = PSBT()
+            psbt.deserialize(psbt_b64)
+            hww_sigs = timed(lambda: client.sign_psbt(psbt, wallet_policy, wallet_hmac), latencies["sign"])
+            assert len(hww_sigs) == n_internal_keys * len(psbt.inputs)
+            n_signatures += len(hww_sigs)
+
+            def finalize() -> str:
+                for input_index, part_sig in hww_sigs:
+                    if part_sig.tapleaf_hash is None and len(part_sig.pubkey) == 32:
+                        psbt.inputs[input_index].tap_key_sig = part_sig.signature
+                    elif part_sig.tapleaf_hash is None:
+                        psbt.inputs[input_index].partial_sigs[part_sig.pubkey] = part_sig.signature
+                    else:
+                        psbt.inputs[input_index].tap_script_sigs[(part_sig.pubkey, part_sig.tapleaf_hash)] = \
+                            part_sig.signature
+
+                partial_psbts = [psbt.serialize()]
+                for core_wallet_name in core_wallet_names:
+                    partial_psbts.append(get_wallet_rpc(core_wallet_name).walletprocesspsbt(psbt_b64)["psbt"])
+
+                result = rpc.finalizepsbt(rpc.combinepsbt(partial_psbts))
+                assert result["complete"] == True
+                return result["hex"]
+
+            rawtx = timed(finalize, latencies["finalize"])
+
+            # would fail if the transaction is rejected
+            timed(lambda: rpc.sendrawtransaction(rawtx), latencies["broadcast"])
+
+            latencies["total"].append(time.monotonic() - start)
+
+    measures = {
+        "iterations": n_iterations,
+        "signatures_per_second": n_signatures / sum(latencies["sign"]),
+        "addresses_per_second": n_addresses / sum(address_latencies),
+        "latency": {
+            "address": latency_stats(address_latencies),
+            **{phase: latency_stats(values) for phase, values in latencies.items()},
+        },
+    }
+
+    name = f"e2e_{wallet_type}"
+    benchmark_results[name] = measures
+
+    failures = check_budget(measures, benchmark_budgets.get(name, {}), benchmark_tolerance)
+    assert len(failures) == 0, f"Scenario {name} is over budget: " + "; ".join(failures)
@@ -0,0 +1,228 @@
+import hmac
+import random
+import time
+
+from hashlib import sha256
+from pathlib import Path
+from typing import Callable, Dict, List, Optional, Union
+
+import pytest
+
+from bitcoin_client.ledger_bitcoin import Client, TransportClient, WalletPolicy, createClient
+from bitcoin_client.ledger_bitcoin.apdu_trace import TraceCollector, TracingTransportClient
+from bitcoin_client.ledger_bitcoin.client_command import ClientCommandCode
+from bitcoin_client.ledger_bitcoin.command_builder import AppFeature
+from bitcoin_client.ledger_bitcoin.common import Chain
+from bitcoin_client.ledger_bitcoin.psbt import PSBT
+from speculos.client import SpeculosClient
+
+from test_utils import SpeculosGlobals, has_automation, psbt_corpus, txmaker
+from test_utils.psbt_corpus import get_cosigner_key_info
+
+"""
+Benchmarks of the signing of PSBTs of increasing size, measuring the APDUs exchanged with the app and the time spent.
+
+The measures of each scenario are written to the BENCHMARK_RESULTS file, and compared to the budgets in the
+BENCHMARK_BUDGETS file (see conftest.py); a benchmark fails if a measure exceeds its budget by more than the
+tolerance, which catches the protocol regressions (for example, a number of client commands quadratic in the number of
+inputs) that the functional tests would not notice.
+"""
+
+
+# the first number of inputs that is only tested with --enableslowtests
+SLOW_N_INPUTS = 100
+
+# the maximum number of inputs of SIGN_PSBT, if the app does not support AppFeature.OFFLOADED_RECORDS
+MAX_N_INPUTS_WITHOUT_OFFLOADED_RECORDS = 512
+
+
+def get_sortedmulti_wallet(threshold: int, n_keys: int) -> WalletPolicy:
+    internal_key_info = "[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK"
+
+    keys_placeholders = ",".join(f"@{i}/**" for i in range(n_keys))
+    return WalletPolicy(
+        name=f"Multisig {threshold} of {n_keys}",
+        descriptor_template=f"wsh(sortedmulti({threshold},{keys_placeholders}))",
+        keys_info=[internal_key_info] + [get_cosigner_key_info(i) for i in range(1, n_keys)],
+    )
+
+
+WALLETS: Dict[str, WalletPolicy] = {
+    "wpkh": WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    ),
+    "tr": WalletPolicy(
+        "",
+        "tr(@0/**)",
+        [
+            "[f5acc2fd/86'/1'/0']tpubDDKYE6BREvDsSWMazgHoyQWiJwYaDDYPbCFjYxN3HFXJP5fokeiK4hwK5tTLBNEDBwrDXn8cQ4v9b2xdW62Xr5yxoQdMu1v6c7UDXYVH27U"
+        ],
+    ),
+    "sortedmulti_2of3": get_sortedmulti_wallet(2, 3),
+    "sortedmulti_5of7": get_sortedmulti_wallet(5, 7),
+}
+
+
+def scenario_id(wallet_type: str, n_inputs: int, n_outputs: int) -> str:
+    return f"{wallet_type}_{n_inputs}to{n_outputs}"
+
+
+def get_wallet_hmac(wallet: WalletPolicy, speculos_globals: SpeculosGlobals) -> Optional[bytes]:
+    # the default wallets are not registered; the others are signed with the hmac that the registration would return
+    if wallet.name == "":
+        return None
+    return hmac.new(speculos_globals.wallet_registration_key, wallet.id, sha256).digest()
+
+
+def measure(comm: Union[TransportClient, SpeculosClient], sign: Callable[[Client], list]) -> dict:
+    """Runs `sign` with a client tracing the APDUs, and returns the measures of the SIGN_PSBT command."""
+
+    collector = TraceCollector()
+    client = createClient(TracingTransportClient(comm, collector), chain=Chain.TEST)
+
+    # only count the exchanges of the signing, not the ones of createClient
+    n_exchanges_before = len(collector.exchanges)
+
+    start = time.monotonic()
+    sign(client)
+    wall_time = time.monotonic() - start
+
+    collector.exchanges = collector.exchanges[n_exchanges_before:]
+    histogram = collector.histogram()
+
+    client_commands = [c.name for c in ClientCommandCode]
+    return {
+        "apdus": sum(stats.count for stats in histogram.values()),
+        "interruptions": {name: stats.count for name, stats in histogram.items() if name in client_commands},
+        "bytes_sent": sum(stats.bytes_sent for stats in histogram.values()),
+        "bytes_received": sum(stats.bytes_received for stats in histogram.values()),
+        "wall_time": wall_time,
+        "device_time": sum(stats.device_time for stats in histogram.values()),
+        "host_time": sum(stats.host_time for stats in histogram.values()),
+    }
+
+
+def check_budget(measures: dict, budget: dict, tolerance: float, prefix: str = "") -> List[str]:
+    """Returns the description of each measure exceeding its budget by more than the tolerance. Only the measures
+    that have a budget are checked."""
+
+    failures: List[str] = []
+    for name, limit in budget.items():
+        value = measures.get(name, 0)
+        if isinstance(limit, dict):
+            failures += check_budget(value if isinstance(value, dict) else {}, limit, tolerance, f"{prefix}{name}.")
+        elif value > limit * (1 + tolerance):
+            failures.append(f"{prefix}{name}: {value} exceeds the budget {limit}")
+    return failures
+
+
+def run_scenario(name: str, comm, sign: Callable[[Client], list], benchmark_budgets: Dict[str, dict],
+                 benchmark_tolerance: float, benchmark_results: Dict[str, dict]):
+    measures = measure(comm, sign)
+    benchmark_results[name] = measures
+
+    failures = check_budget(measures, benchmark_budgets.get(name, {}), benchmark_tolerance)
+    assert len(failures) == 0, f"Scenario {name} is over budget: " + "; ".join(failures)
+
+
+SCENARIOS = [
+    (wallet_type, n_inputs, n_outputs)
+    for wallet_type in WALLETS
+    for n_inputs in [1, 10, 100, 500]
+    for n_outputs in [2, 10]
+]
+
+
+@pytest.mark.parametrize("wallet_type,n_inputs,n_outputs", SCENARIOS,
+                         ids=[scenario_id(*scenario) for scenario in SCENARIOS])
+@has_automation("automations/sign_with_wallet_accept.json")
+def test_benchmark_sign_psbt(comm: Union[TransportClient, SpeculosClient], speculos_globals: SpeculosGlobals,
+                             enable_slow_tests: bool, wallet_type: str, n_inputs: int, n_outputs: int,
+                             benchmark_budgets: Dict[str, dict], benchmark_tolerance: float,
+                             benchmark_results: Dict[str, dict]):
+    if n_inputs >= SLOW_N_INPUTS and not enable_slow_tests:
+        pytest.skip()
+
+    name = scenario_id(wallet_type, n_inputs, n_outputs)
+
+    # the same PSBT for each run of a scenario, independently of the other tests that are run
+    random.seed(name)
+
+    wallet = WALLETS[wallet_type]
+    wallet_hmac = get_wallet_hmac(wallet, speculos_globals)
+
+    in_amounts = [100_000 + 10_000 * i for i in range(n_inputs)]
+    fees = 10_000
+    out_amounts = [(sum(in_amounts) - fees) // n_outputs] * n_outputs
+
+    # the first output is a change output
+    psbt = txmaker.createPsbt(wallet, in_amounts, out_amounts, [i == 0 for i in range(n_outputs)])
+
+    def sign(client: Client) -> list:
+        result = client.sign_psbt(psbt, wallet, wallet_hmac)
+        assert len(result) == n_inputs
+        return result
+
+    run_scenario(name, comm, sign, benchmark_budgets, benchmark_tolerance, benchmark_results)
+
+
+@has_automation("automations/sign_with_wallet_accept.json")
+def test_benchmark_sign_psbt_tr_script_pk(comm: Union[TransportClient, SpeculosClient],
+                                          benchmark_budgets: Dict[str, dict], benchmark_tolerance: float,
+                                          benchmark_results: Dict[str, dict]):
+    # txmaker can not make PSBTs for taproot script trees; this is the PSBT of test_sign_psbt_tr_script_pk_sighash_all
+
+    wallet = WalletPolicy(
+        name="Taproot foreign internal key, and our script key",
+        descriptor_template="tr(@0/**,pk(@1/**))",
+        keys_info=[
+            "[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF",
+            "[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK",
+        ],
+    )
+
+    wallet_hmac = bytes.fromhex(
+        "dae925660e20859ed8833025d46444483ce264fdb77e34569aabe9d590da8fb7"
+    )
+
+    psbt = PSBT()
+    psbt.deserialize("cHNidP8BAFICAAAAAR/BzFdxy4OGDMVtlLz+2ThgjBf2NmJDW0HpxE/8/TFCAQAAAAD9////ATkFAAAAAAAAFgAUqo7zdMr638p2kC3bXPYcYLv9nYUAAAAAAAEBK0wGAAAAAAAAIlEg/AoQ0wjH5BtLvDZC+P2KwomFOxznVaDG0NSV8D2fLaQBAwQBAAAAIhXBUBcQi+zqje3FMAuyI4azqzA2esJi+c5eWDJuuD46IvUjIGsW6MH5efpMwPBbajAK//+UFFm28g3nfeVbAWDvjkysrMAhFlAXEIvs6o3txTALsiOGs6swNnrCYvnOXlgybrg+OiL1HQB2IjpuMAAAgAEAAIAAAACAAgAAgAAAAAAAAAAAIRZrFujB+Xn6TMDwW2owCv//lBRZtvIN533lWwFg745MrD0BCS7aAzYX4hDuf30ON4pASuocSLVqoQMCK+z3dG5HAKT1rML9MAAAgAEAAIAAAACAAgAAgAAAAAAAAAAAARcgUBcQi+zqje3FMAuyI4azqzA2esJi+c5eWDJuuD46IvUBGCAJLtoDNhfiEO5/fQ43ikBK6hxItWqhAwIr7Pd0bkcApAAA")
+
+    def sign(client: Client) -> list:
+        result = client.sign_psbt(psbt, wallet, wallet_hmac)
+        assert len(result) == 1
+        return result
+
+    run_scenario("tr_script_pk_1to1", comm, sign, benchmark_budgets, benchmark_tolerance, benchmark_results)
+
+
+@pytest.mark.parametrize("name", list(psbt_corpus.CORPUS))
+@has_automation("automations/sign_with_wallet_accept.json")
+def test_benchmark_sign_psbt_corpus(comm: Union[TransportClient, SpeculosClient], speculos_globals: SpeculosGlobals,
+                                    enable_slow_tests: bool, name: str, benchmark_corpus_dir: Path,
+                                    benchmark_budgets: Dict[str, dict], benchmark_tolerance: float,
+                                    benchmark_results: Dict[str, dict]):
+    entry = psbt_corpus.CORPUS[name]
+    if entry.n_inputs >= SLOW_N_INPUTS and not enable_slow_tests:
+        pytest.skip()
+
+    if entry.n_inputs > MAX_N_INPUTS_WITHOUT_OFFLOADED_RECORDS:
+        _, features = createClient(comm, chain=Chain.TEST).get_app_features()
+        if AppFeature.OFFLOADED_RECORDS not in features:
+            pytest.skip("The app does not support PSBTs with more than 512 inputs")
+
+    wallet = psbt_corpus.WALLETS[entry.wallet]
+    wallet_hmac = get_wallet_hmac(wallet, speculos_globals)
+
+    psbt = psbt_corpus.load_corpus_entry(benchmark_corpus_dir, name)
+
+    def sign(client: Client) -> list:
+        result = client.sign_psbt(psbt, wallet, wallet_hmac)
+        assert len(result) == entry.n_internal_inputs
+        return result
+
+    run_scenario(f"corpus_{name}", comm, sign, benchmark_budgets, benchmark_tolerance, benchmark_results)
@@ -0,0 +1,215 @@
+import os
+import random
+import re
+import resource
+import time
+
+from pathlib import Path
+from typing import Callable, Dict, List, Optional, Tuple, Union
+
+import pytest
+
+from bitcoin_client.ledger_bitcoin import Client, TransportClient, WalletPolicy, createClient
+from bitcoin_client.ledger_bitcoin.client_base import _app_info_cache
+from bitcoin_client.ledger_bitcoin.command_builder import BitcoinInsType
+from bitcoin_client.ledger_bitcoin.common import Chain
+from speculos.client import SpeculosClient
+
+from test_utils import SpeculosGlobals, txmaker
+from test_utils.psbt_corpus import INTERNAL_MULTISIG_KEY_INFO, WALLETS, get_cosigner_key_info
+from test_utils.speculos import automation
+
+from .test_benchmark_e2e import latency_stats
+from .test_benchmark_sign_psbt import check_budget, get_wallet_hmac
+
+"""
+Soak test of a long-running session with the app: a random mix of get_wallet_address, sign_psbt, sign_message and
+get_extended_pubkey is sent to the same device for SOAK_DURATION seconds (default: 60), in order to catch the
+regressions that only show over time, like the leaks or the stale entries of the caches, and the slowdowns.
+
+The commands are split in windows of SOAK_WINDOW commands (default: 100). For each command, the soak scenario reports
+the latency of each window, and the drift of the latency: the ratio between the median latency of the last window and
+the one of the first window. It also reports the size of the caches of the client after each window, and the maximum
+resident memory of the test process.
+
+If SOAK_SPECULOS_LOG is the file where the output of Speculos is written, and the app is built with
+STACK_PROFILING=1 DEBUG=1, the stack profiles printed by the app are parsed, and the high-water mark of the stack of
+each command is reported for each window as well.
+
+The scenario only runs with --enableslowtests. Its measures are checked against the budgets like the other benchmarks
+(see conftest.py); for example, a budget on "drift" fails the soak if a command becomes slower over time.
+"""
+
+
+# the number of multisig wallets used in turn, so that the caches of the wallets are not only hit
+N_MULTISIG_WALLETS = 8
+
+STACK_PROFILE_RE = re.compile(r"STACK PROFILE INS ([0-9a-f]{2}): (\d+) bytes used \(max (\d+)\), (\d+) bytes free")
+
+
+def ins_name(ins: int) -> str:
+    try:
+        return BitcoinInsType(ins).name.lower()
+    except ValueError:
+        return f"ins_{ins:02x}"
+
+
+class StackProfileReader:
+    """Reads the stack profiles printed by the app since the last call, from the output of Speculos."""
+
+    def __init__(self, log_path: Optional[str]):
+        self.log_path = Path(log_path) if log_path else None
+        self.offset = self.log_path.stat().st_size if self.log_path and self.log_path.exists() else 0
+
+    def read(self) -> List[Tuple[int, int, int]]:
+        """Returns the INS, the bytes used and the bytes free of each new stack profile."""
+
+        if self.log_path is None or not self.log_path.exists():
+            return []
+        with open(self.log_path, "r", errors="replace") as f:
+            f.seek(self.offset)
+            text = f.read()
+            self.offset = f.tell()
+        return [(int(ins, 16), int(used), int(free)) for ins, used, _, free in STACK_PROFILE_RE.findall(text)]
+
+
+def get_multisig_wallet(index: int) -> WalletPolicy:
+    return WalletPolicy(
+        name=f"Soak {index}",
+        descriptor_template="wsh(sortedmulti(2,@0/**,@1/**,@2/**))",
+        keys_info=[INTERNAL_MULTISIG_KEY_INFO, get_cosigner_key_info(2 * index + 1),
+                   get_cosigner_key_info(2 * index + 2)],
+    )
+
+
+def make_commands(client: Client, comm, speculos_globals: SpeculosGlobals) -> Dict[str, Callable[[], None]]:
+    """Returns a random instance of each of the commands of the soak."""
+
+    wallets = [WALLETS["wpkh"], WALLETS["tr"]] + [get_multisig_wallet(i) for i in range(N_MULTISIG_WALLETS)]
+
+    def get_wallet_address():
+        wallet = random.choice(wallets)
+        client.get_wallet_address(wallet, get_wallet_hmac(wallet, speculos_globals), random.randint(0, 1),
+                                  random.randint(0, 10_000), False)
+
+    def sign_psbt():
+        wallet = random.choice(wallets)
+        n_inputs = random.randint(1, 4)
+        in_amounts = [100_000 + 10_000 * i for i in range(n_inputs)]
+        out_amounts = [(sum(in_amounts) - 10_000) // 2] * 2
+        psbt = txmaker.createPsbt(wallet, in_amounts, out_amounts, [True, False])
+        with automation(comm, "automations/sign_with_wallet_accept.json"):
+            result = client.sign_psbt(psbt, wallet, get_wallet_hmac(wallet, speculos_globals))
+        assert len(result) == n_inputs
+
+    def sign_message():
+        message = "".join(random.choice("abcdefghijklmnopqrstuvwxyz ") for _ in range(random.randint(1, 200)))
+        with automation(comm, "automations/sign_message_accept.json"):
+            client.sign_message(message, f"m/44'/1'/0'/0/{random.randint(0, 100)}")
+
+    def get_extended_pubkey():
+        path = random.choice(["m/44'/1'/0'", "m/84'/1'/0'", "m/86'/1'/0'", "m/48'/1'/0'/2'"])
+        client.get_extended_pubkey(path, False)
+
+    return {
+        "get_wallet_address": get_wallet_address,
+        "sign_psbt": sign_psbt,
+        "sign_message": sign_message,
+        "get_extended_pubkey": get_extended_pubkey,
+    }
+
+
+# the relative frequency of each command
+COMMAND_WEIGHTS = {
+    "get_wallet_address": 4,
+    "sign_psbt": 2,
+    "sign_message": 1,
+    "get_extended_pubkey": 3,
+}
+
+
+def test_benchmark_soak(comm: Union[TransportClient, SpeculosClient], speculos_globals: SpeculosGlobals,
+                        enable_slow_tests: bool, benchmark_budgets: Dict[str, dict], benchmark_tolerance: float,
+                        benchmark_results: Dict[str, dict]):
+    if not enable_slow_tests:
+        pytest.skip()
+
+    duration = float(os.getenv("SOAK_DURATION", "60"))
+    window_size = int(os.getenv("SOAK_WINDOW", "100"))
+
+    random.seed(os.getenv("SOAK_SEED", "soak"))
+
+    client = createClient(comm, chain=Chain.TEST)
+    commands = make_commands(client, comm, speculos_globals)
+    names = list(COMMAND_WEIGHTS)
+    weights = [COMMAND_WEIGHTS[name] for name in names]
+
+    stack_reader = StackProfileReader(os.getenv("SOAK_SPECULOS_LOG"))
+
+    windows: List[dict] = []
+    latencies: Dict[str, List[float]] = {name: [] for name in names}
+    stack: Dict[str, Dict[str, int]] = {}
+
+    def close_window():
+        wallet_cache = getattr(client, "_wallet_cache", None)
+        windows.append({
+            "latency": {name: latency_stats(values) for name, values in latencies.items() if len(values) > 0},
+            "stack": stack.copy(),
+            "wallet_cache_entries": len(wallet_cache) if wallet_cache is not None else 0,
+            "app_info_cache_entries": len(_app_info_cache),
+        })
+        for values in latencies.values():
+            values.clear()
+        stack.clear()
+
+    n_commands = 0
+    end = time.monotonic() + duration
+    while time.monotonic() < end:
+        name = random.choices(names, weights)[0]
+
+        start = time.monotonic()
+        commands[name]()
+        latencies[name].append(time.monotonic() - start)
+        n_commands += 1
+
+        for ins, used, free in stack_reader.read():
+            profile = stack.setdefault(ins_name(ins), {"max_used": 0, "min_free": free})
+            profile["max_used"] = max(profile["max_used"], used)
+            profile["min_free"] = min(profile["min_free"], free)
+
+        if n_commands % window_size == 0:
+            close_window()
+
+    if n_commands % window_size != 0 or len(windows) == 0:
+        close_window()
+
+    # the latency drift of each command, comparing its median latency in the last and in the first windows
+    drift: Dict[str, float] = {}
+    for name in names:
+        medians = [window["latency"][name]["p50"] for window in windows if name in window["latency"]]
+        if len(medians) >= 2 and medians[0] > 0:
+            drift[name] = medians[-1] / medians[0]
+
+    measures = {
+        "commands": n_commands,
+        "drift": drift,
+        "max_wallet_cache_entries": max(window["wallet_cache_entries"] for window in windows),
+        "max_app_info_cache_entries": max(window["app_info_cache_entries"] for window in windows),
+        # in kilobytes on Linux
+        "max_stack_used": {
+            name: max(window["stack"][name]["max_used"] for window in windows if name in window["stack"])
+            for name in {name for window in windows for name in window["stack"]}
+        },
+        "max_rss": resource.getrusage(resource.RUSAGE_SELF).ru_maxrss,
+        "windows": windows,
+    }
+
+    # the cache of the wallet policies is bounded
+    wallet_cache = getattr(client, "_wallet_cache", None)
+    if wallet_cache is not None:
+        assert measures["max_wallet_cache_entries"] <= wallet_cache.max_wallets
+
+    benchmark_results["soak"] = measures
+
+    failures = check_budget(measures, benchmark_budgets.get("soak", {}), benchmark_tolerance)
+    assert len(failures) == 0, "Scenario soak is over budget: " + "; ".join(failures)
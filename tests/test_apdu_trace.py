@@ -0,0 +1,123 @@
+import io
+
+from pathlib import Path
+from typing import Union
+
+from bitcoin_client.ledger_bitcoin import TransportClient, WalletPolicy, createClient, invalidate_app_info
+from bitcoin_client.ledger_bitcoin.apdu_trace import (
+    ReplayTransportClient, SessionRecording, TraceCollector, TracingTransportClient, load_trace
+)
+from bitcoin_client.ledger_bitcoin.command_builder import QUEUED_YIELDS_PROTOCOL_VERSION
+from bitcoin_client.ledger_bitcoin.common import Chain
+from bitcoin_client.ledger_bitcoin.merkleized_psbt import MerkleizedPsbt
+from speculos.client import SpeculosClient
+
+from test_utils import has_automation
+
+
+tests_root: Path = Path(__file__).parent
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_apdu_trace_sign_psbt(comm: Union[TransportClient, SpeculosClient]):
+    collector = TraceCollector()
+    client = createClient(TracingTransportClient(comm, collector), chain=Chain.TEST)
+
+    psbt = open(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt", "r").read()
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    result = client.sign_psbt(psbt, wallet, None)
+
+    # GET_VERSION (from createClient), GET_APP_FEATURES, then SIGN_PSBT with its client commands
+    sessions = collector.sessions()
+    assert [session[0].name for session in sessions] == ["GET_VERSION", "GET_APP_FEATURES", "SIGN_PSBT"]
+
+    histogram = collector.histogram()
+    assert histogram["SIGN_PSBT"].count == 1
+    assert histogram["GET_PREIMAGE"].count > 0
+    assert histogram["GET_MERKLE_LEAF_PROOF"].count > 0
+    assert sum(stats.count for stats in histogram.values()) == len(collector.exchanges)
+
+    # the exported trace can be replayed without the device
+    f = io.StringIO()
+    collector.export(f)
+    f.seek(0)
+
+    replay_client = createClient(ReplayTransportClient(load_trace(f)), chain=Chain.TEST)
+    assert replay_client.sign_psbt(psbt, wallet, None) == result
+
+
+def test_apdu_trace_create_client_cache(comm: Union[TransportClient, SpeculosClient]):
+    collector = TraceCollector()
+    transport_client = TracingTransportClient(comm, collector)
+
+    paths = ["m/84'/1'/0'", "m/86'/1'/0'"]
+    results = [createClient(transport_client, chain=Chain.TEST).get_extended_pubkeys(paths) for _ in range(3)]
+    assert results[0] == results[1] == results[2]
+
+    # the app and its features are only queried by the first client of the transport
+    assert [exchange.name for exchange in collector.exchanges] == [
+        "GET_VERSION", "GET_APP_FEATURES", "GET_EXTENDED_PUBKEYS", "GET_EXTENDED_PUBKEYS", "GET_EXTENDED_PUBKEYS"
+    ]
+
+    # once invalidated, the app is queried again
+    invalidate_app_info(transport_client)
+    createClient(transport_client, chain=Chain.TEST).get_extended_pubkeys(paths)
+    assert [exchange.name for exchange in collector.exchanges[5:]] == [
+        "GET_VERSION", "GET_APP_FEATURES", "GET_EXTENDED_PUBKEYS"
+    ]
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_apdu_trace_session_recording(comm: Union[TransportClient, SpeculosClient]):
+    collector = TraceCollector()
+    client = createClient(TracingTransportClient(comm, collector), chain=Chain.TEST)
+
+    psbt = open(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt", "r").read()
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    merkleized_psbt = MerkleizedPsbt(psbt, wallet)
+    client.sign_psbt(merkleized_psbt, wallet, None)
+
+    # the settings of the interpreter are the ones of the session: the protocol version is the p2 of SIGN_PSBT
+    session = collector.sessions()[-1]
+    interpreter = merkleized_psbt.new_client_interpreter()
+    interpreter.queued_yields = session[0].request[3] >= QUEUED_YIELDS_PROTOCOL_VERSION
+    recording = SessionRecording.record(session, interpreter)
+    assert len(recording.client_commands) == len(session) - 1
+
+    f = io.StringIO()
+    recording.export(f)
+    f.seek(0)
+
+    SessionRecording.load(f).replay()
+
+
+def test_session_recording_replay():
+    # the recording replayed by the tests of the Rust and JS clients
+    with open(f"{tests_root}/sessions/sign_psbt_sh_wpkh.json", "r") as f:
+        recording = SessionRecording.load(f)
+
+    recording.replay()
+
+
+def test_session_recording_replay_protocol_v6():
+    # the client commands of the versions 4 to 6 of the protocol of SIGN_PSBT, replayed by the tests of the Rust client
+    with open(f"{tests_root}/sessions/client_commands_v6.json", "r") as f:
+        recording = SessionRecording.load(f)
+
+    recording.replay()
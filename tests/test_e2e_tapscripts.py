@@ -289,3 +289,37 @@ def test_e2e_tapscript_large(rpc, rpc_test_wallet, client: Client, speculos_glob
         keys_info=keys_info)
 
     run_test_e2e(wallet_policy, [core_wallet_name], rpc, rpc_test_wallet, client, speculos_globals, comm)
+
+
+def test_e2e_tapscript_sortedmulti_a_large(rpc, rpc_test_wallet, client: Client, speculos_globals: SpeculosGlobals, comm: Union[TransportClient, SpeculosClient], model):
+    # tr(foreign_key,sortedmulti_a(18,...)) with 20 keys, more than the limit of multi and sortedmulti, and a
+    # threshold that does not fit in a small integer opcode
+
+    # Takes more memory than Nano S can handle
+    if (model == "nanos"):
+        pytest.skip("Not supported on Nano S due to memory limitations")
+
+    _, internal_key_xpub_orig = create_new_wallet()
+    keys_info = [internal_key_xpub_orig]
+
+    core_wallet_names = []
+    for i in range(19):
+        core_wallet_name_i, core_xpub_orig = create_new_wallet()
+        if i < 17:
+            # bitcoin-core signs with 17 of the external keys, and the hww with the other one
+            core_wallet_names.append(core_wallet_name_i)
+        keys_info.append(core_xpub_orig)
+
+    path = "499'/1'/0'"
+    internal_xpub = get_internal_xpub(speculos_globals.seed, path)
+
+    # our key is key @10
+    keys_info.insert(10, f"[{speculos_globals.master_key_fingerprint.hex()}/{path}]{internal_xpub}")
+
+    keys_placeholders = ",".join(f"@{i}/**" for i in range(1, 21))
+    wallet_policy = WalletPolicy(
+        name="Large sortedmulti_a",
+        descriptor_template=f"tr(@0/**,sortedmulti_a(18,{keys_placeholders}))",
+        keys_info=keys_info)
+
+    run_test_e2e(wallet_policy, core_wallet_names, rpc, rpc_test_wallet, client, speculos_globals, comm)
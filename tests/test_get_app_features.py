@@ -0,0 +1,22 @@
+from bitcoin_client.ledger_bitcoin import Client
+from bitcoin_client.ledger_bitcoin.command_builder import AppFeature
+
+
+def test_get_app_features(client: Client, model):
+    max_protocol_version, features = client.get_app_features()
+
+    assert max_protocol_version == 7
+
+    for feature in [AppFeature.MERKLE_LEAF_PROOFS, AppFeature.GET_WALLET_ADDRESSES,
+                    AppFeature.GET_EXTENDED_PUBKEYS, AppFeature.QUEUED_YIELDS,
+                    AppFeature.MERKLE_LEAF_ELEMENTS, AppFeature.PROGRESS_EVENTS]:
+        assert feature in features
+
+    # wallet sessions are not supported on Nano S
+    assert (AppFeature.WALLET_SESSIONS in features) == (model != "nanos")
+
+    # extended-length APDUs are not supported on Nano S
+    assert (AppFeature.EXTENDED_APDUS in features) == (model != "nanos")
+
+    # batches of PSBTs are not supported on Nano S
+    assert (AppFeature.PSBT_BATCHES in features) == (model != "nanos")
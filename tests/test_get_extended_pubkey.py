@@ -144,3 +144,32 @@ def test_get_extended_pubkey_non_standard_reject(client: Client, comm: SpeculosC
         )
 
     x.join()
+
+
+def test_get_extended_pubkeys(client: Client):
+    paths = [
+        "m/44'/1'/0'",
+        "m/44'/1'/10'",
+        "m/44'/1'/2'/1/42",
+        "m/84'/1'/0'",
+        "m/84'/1'/1'",
+        "m/84'/1'/2'/0/10",
+        "m/48'/1'/4'/1'/0/7",
+        "m/86'/1'/4'/1/12",
+        "m/86'/1'/4'/1/2/3/4/5",
+        "m/45'/1'/0'",
+        "m/45'/1'/0'/1",
+    ]
+
+    expected = [client.get_extended_pubkey(path=path, display=False) for path in paths]
+
+    assert client.get_extended_pubkeys(paths) == expected
+
+    # same paths, in a different order
+    assert client.get_extended_pubkeys(paths[::-1]) == expected[::-1]
+
+
+def test_get_extended_pubkeys_nonstandard(client: Client):
+    # if any of the paths is not standard, the app rejects immediately
+    with pytest.raises(NotSupportedError):
+        client.get_extended_pubkeys(["m/44'/1'/0'", "m/44'/10'/0'"])
@@ -1,4 +1,4 @@
-from bitcoin_client.ledger_bitcoin import Client, AddressType, MultisigWallet, WalletPolicy
+from bitcoin_client.ledger_bitcoin import Chain, Client, AddressType, MultisigWallet, WalletAddressDeriver, WalletPolicy
 from bitcoin_client.ledger_bitcoin.exception.errors import IncorrectDataError
 
 
@@ -33,6 +33,30 @@ def test_get_wallet_address_singlesig_wit(client: Client):
     assert client.get_wallet_address(wallet, None, 1, 15, False) == "tb1qlrvzyx8jcjfj2xuy69du9trtxnsvjuped7e289"
 
 
+def test_get_wallet_address_singlesig_wit_cached_wallet(client: Client):
+    # the data of the wallet policy is cached by the client, and recomputed if the policy changes
+    def make_wallet() -> WalletPolicy:
+        return WalletPolicy(
+            name="",
+            descriptor_template="wpkh(@0/**)",
+            keys_info=[
+                f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P",
+            ],
+        )
+
+    wallet = make_wallet()
+    assert client.get_wallet_address(wallet, None, 0,  0, False) == "tb1qzdr7s2sr0dwmkwx033r4nujzk86u0cy6fmzfjk"
+    assert client.get_wallet_address(make_wallet(), None, 1, 15, False) == "tb1qlrvzyx8jcjfj2xuy69du9trtxnsvjuped7e289"
+
+    wallet_id = wallet.id
+    wallet.descriptor_template = "sh(wpkh(@0/**))"
+    wallet.keys_info = [
+        f"[f5acc2fd/49'/1'/0']tpubDC871vGLAiKPcwAw22EjhKVLk5L98UGXBEcGR8gpcigLQVDDfgcYW24QBEyTHTSFEjgJgbaHU8CdRi9vmG4cPm1kPLmZhJEP17FMBdNheh3",
+    ]
+    assert wallet.id != wallet_id
+    assert client.get_wallet_address(wallet, None, 0,  0, False) == "2MyHkbusvLomaarGYMqyq7q9pSBYJRwWcsw"
+
+
 def test_get_wallet_address_singlesig_sh_wit(client: Client):
     # wrapped segwit addresses (P2SH-P2WPKH)
     wallet = WalletPolicy(
@@ -231,3 +255,45 @@ def test_get_wallet_address_tr_script_sortedmulti(client: Client):
 
     res = client.get_wallet_address(wallet, wallet_hmac, 0, 0, False)
     assert res == "tb1pdzk72dnvz3246474p4m5a97u43h6ykt2qcjrrhk6y0fkg8hx2mvswwgvv7"
+
+
+def test_get_wallet_addresses_singlesig_wit(client: Client):
+    wallet = WalletPolicy(
+        name="",
+        descriptor_template="wpkh(@0/**)",
+        keys_info=[
+            f"[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P",
+        ],
+    )
+
+    res = client.get_wallet_addresses(wallet, None, 1, 13, 5)
+    assert len(res) == 5
+    assert res[2] == "tb1qlrvzyx8jcjfj2xuy69du9trtxnsvjuped7e289"
+    assert res == [client.get_wallet_address(wallet, None, 1, i, False) for i in range(13, 18)]
+    assert res == WalletAddressDeriver(wallet, Chain.TEST).get_addresses(1, 13, 5)
+
+
+def test_get_wallet_addresses_multisig_wit(client: Client):
+    wallet = MultisigWallet(
+        name="Cold storage",
+        address_type=AddressType.WIT,
+        threshold=2,
+        keys_info=[
+            f"[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF",
+            f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK",
+        ],
+    )
+    wallet_hmac = bytes.fromhex(
+        "d7c7a60b4ab4a14c1bf8901ba627d72140b2fb907f2b4e35d2e693bce9fbb371"
+    )
+
+    res = client.get_wallet_addresses(wallet, wallet_hmac, 0, 0, 3)
+    assert res[0] == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
+    assert res == [client.get_wallet_address(wallet, wallet_hmac, 0, i, False) for i in range(3)]
+    assert res == WalletAddressDeriver(wallet, Chain.TEST).get_addresses(0, 0, 3)
+
+    # empty ranges and hardened address indexes are rejected
+    with pytest.raises(IncorrectDataError):
+        client.get_wallet_addresses(wallet, wallet_hmac, 0, 0, 0)
+    with pytest.raises(IncorrectDataError):
+        client.get_wallet_addresses(wallet, wallet_hmac, 0, 0x7FFFFFFF, 2)
@@ -0,0 +1,131 @@
+import hmac
+
+from hashlib import sha256
+from pathlib import Path
+
+from bitcoin_client.ledger_bitcoin import Client, AddressType, MultisigWallet, PartialSignature
+from bitcoin_client.ledger_bitcoin.exception.errors import IncorrectDataError, SignatureFailError
+from bitcoin_client.ledger_bitcoin.psbt import PSBT
+
+from test_utils import has_automation
+
+import pytest
+
+tests_root: Path = Path(__file__).parent
+
+
+wallet = MultisigWallet(
+    name="Cold storage",
+    address_type=AddressType.WIT,
+    threshold=2,
+    keys_info=[
+        f"[76223a6e/48'/1'/0'/2']tpubDE7NQymr4AFtewpAsWtnreyq9ghkzQBXpCZjWLFVRAvnbf7vya2eMTvT2fPapNqL8SuVvLQdbUbMfWLVDCZKnsEBqp6UK93QEzL8Ck23AwF",
+        f"[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK",
+    ],
+)
+wallet_hmac = bytes.fromhex(
+    "d7c7a60b4ab4a14c1bf8901ba627d72140b2fb907f2b4e35d2e693bce9fbb371"
+)
+
+
+def test_open_wallet_session(client: Client, model):
+    if model == "nanos":
+        pytest.skip("Wallet sessions are not supported on Nano S")
+
+    client.open_wallet_session(wallet, wallet_hmac)
+
+    res = client.get_wallet_address(wallet, wallet_hmac, 0, 0, False)
+    assert res == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
+
+    # a wrong hmac does not match the session, and is still rejected
+    with pytest.raises(SignatureFailError):
+        client.get_wallet_address(wallet, b'\x01' * 32, 0, 0, False)
+
+
+def test_open_wallet_session_fail(client: Client, model):
+    if model == "nanos":
+        pytest.skip("Wallet sessions are not supported on Nano S")
+
+    with pytest.raises(SignatureFailError):
+        client.open_wallet_session(wallet, b'\x01' * 32)
+
+    # default wallets do not have sessions
+    with pytest.raises(IncorrectDataError):
+        client.open_wallet_session(wallet, b'\x00' * 32)
+
+
+@has_automation("automations/register_wallet_accept.json")
+def test_open_wallet_session_compiled_policy(client: Client, model):
+    if model == "nanos":
+        pytest.skip("Compiled policies are not supported on Nano S")
+
+    wallet_id, hmac, compiled_policy = client.register_wallet_with_compiled_policy(wallet)
+
+    assert wallet_id == wallet.id
+    assert hmac == wallet_hmac
+
+    client.open_wallet_session(wallet, wallet_hmac, compiled_policy)
+
+    res = client.get_wallet_address(wallet, wallet_hmac, 0, 0, False)
+    assert res == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
+
+    # an invalid compiled policy is ignored, and the wallet policy is parsed instead
+    tampered_policy = compiled_policy[:-1] + bytes([compiled_policy[-1] ^ 1])
+    client.open_wallet_session(wallet, wallet_hmac, tampered_policy)
+
+    res = client.get_wallet_address(wallet, wallet_hmac, 0, 0, False)
+    assert res == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
+
+
+@has_automation("automations/sign_with_wallet_accept.json")
+def test_open_wallet_session_sign_psbt(client: Client, model):
+    if model == "nanos":
+        pytest.skip("Wallet sessions are not supported on Nano S")
+
+    client.open_wallet_session(wallet, wallet_hmac)
+
+    # the internal key is found among the keys of the session, with the same signature as without it
+    psbt = PSBT()
+    psbt.deserialize(open(f"{tests_root}/psbt/multisig/wsh-2of2.psbt", "r").read())
+
+    result = client.sign_psbt(psbt, wallet, wallet_hmac)
+
+    assert result == [(
+        0,
+        PartialSignature(
+            pubkey=bytes.fromhex("036b16e8c1f979fa4cc0f05b6a300affff941459b6f20de77de55b0160ef8e4cac"),
+            signature=bytes.fromhex(
+                "304402206ab297c83ab66e573723892061d827c5ac0150e2044fed7ed34742fedbcfb26e0220319cdf4eaddff63fc308cdf53e225ea034024ef96de03fd0939b6deeea1e8bd301"
+            )
+        )
+    )]
+
+
+
+@has_automation("automations/register_wallet_store_accept.json")
+def test_register_and_store_wallet(client: Client, speculos_globals, model):
+    if model == "nanos":
+        pytest.skip("Storing wallets is not supported on Nano S")
+
+    # a different name than the wallet of the other tests, as the stored wallet policy is kept on the device
+    stored_wallet = MultisigWallet(
+        name="Stored wallet",
+        address_type=AddressType.WIT,
+        threshold=2,
+        keys_info=wallet.keys_info,
+    )
+
+    wallet_id, stored_wallet_hmac = client.register_and_store_wallet(stored_wallet)
+
+    assert wallet_id == stored_wallet.id
+    assert hmac.compare_digest(
+        hmac.new(speculos_globals.wallet_registration_key, wallet_id, sha256).digest(),
+        stored_wallet_hmac,
+    )
+
+    # the stored wallet policy is loaded by its id, whatever the hmac
+    res = client.get_wallet_address(stored_wallet, None, 0, 0, False)
+    assert res == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
+
+    res = client.get_wallet_address(stored_wallet, b'\x01' * 32, 0, 0, False)
+    assert res == "tb1qmyauyzn08cduzdqweexgna2spwd0rndj55fsrkefry2cpuyt4cpsn2pg28"
@@ -1,7 +1,9 @@
+import asyncio
 import base64
 import pytest
 
 import threading
+from concurrent.futures import ProcessPoolExecutor
 
 from decimal import Decimal
 
@@ -9,10 +11,16 @@ from typing import List
 
 from pathlib import Path
 
-from bitcoin_client.ledger_bitcoin import Client, WalletPolicy, MultisigWallet, AddressType, PartialSignature
+from bitcoin_client.ledger_bitcoin import (AsyncNewClient, Client, ExecutorTransportClient, WalletPolicy, MultisigWallet,
+                                          AddressType, PartialSignature, ProgressPhase, SignPsbtProgress)
 from bitcoin_client.ledger_bitcoin.exception.errors import IncorrectDataError, NotSupportedError
 
+from bitcoin_client.ledger_bitcoin.merkleized_psbt import MerkleizedPsbt
+from bitcoin_client.ledger_bitcoin.parallel_signing import sign_psbt_sharded, sign_psbt_with_devices
 from bitcoin_client.ledger_bitcoin.psbt import PSBT
+from bitcoin_client.ledger_bitcoin.raw_psbt import RawPsbt
+from bitcoin_client.ledger_bitcoin.signature_verification import (InvalidSignatureError, SighashCache,
+                                                                   verify_partial_signatures)
 from bitcoin_client.ledger_bitcoin.wallet import AddressType
 from speculos.client import SpeculosClient
 
@@ -256,6 +264,361 @@ def test_sign_psbt_singlesig_wpkh_2to2(client: Client):
     )]
 
 
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_with_devices_singlesig_wpkh_2to2(client: Client):
+    # same as test_sign_psbt_singlesig_wpkh_2to2, but the signatures are added to the PSBT by sign_psbt_with_devices
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    signed_psbt = asyncio.run(sign_psbt_with_devices([(client, None)], psbt, wallet))
+
+    assert signed_psbt.inputs[0].partial_sigs == {
+        bytes.fromhex("03455ee7cedc97b0ba435b80066fc92c963a34c600317981d135330c4ee43ac7a3"): bytes.fromhex(
+            "304402206b3e877655f08c6e7b1b74d6d893a82cdf799f68a5ae7cecae63a71b0339e5ce022019b94aa3fb6635956e109f3d89c996b1bfbbaf3c619134b5a302badfaf52180e01"
+        )
+    }
+    assert signed_psbt.inputs[1].partial_sigs == {
+        bytes.fromhex("0271b5b779ad870838587797bcf6f0c7aec5abe76a709d724f48d2e26cf874f0a0"): bytes.fromhex(
+            "3045022100e2e98e4f8c70274f10145c89a5d86e216d0376bdf9f42f829e4315ea67d79d210220743589fd4f55e540540a976a5af58acd610fa5e188a5096dfe7d36baf3afb94001"
+        )
+    }
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_async_client_singlesig_wpkh_2to2(client: Client):
+    # same as test_sign_psbt_singlesig_wpkh_2to2, but with the asynchronous client; the other commands awaited at the
+    # same time are run after the signing session
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    async def run():
+        async_client = AsyncNewClient(ExecutorTransportClient(client.transport_client), chain=client.chain)
+        return await asyncio.gather(
+            async_client.sign_psbt(psbt, wallet, None),
+            async_client.get_master_fingerprint(),
+            async_client.get_extended_pubkey("m/84'/1'/0'"),
+        )
+
+    result, fingerprint, xpub = asyncio.run(run())
+
+    assert result == client.sign_psbt(psbt, wallet, None)
+    assert fingerprint == client.get_master_fingerprint()
+    assert xpub == client.get_extended_pubkey("m/84'/1'/0'")
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_input_subset_singlesig_wpkh_2to2(client: Client):
+    # same as test_sign_psbt_singlesig_wpkh_2to2, but only the second input is in the subset of inputs to sign
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    merkleized_psbt = MerkleizedPsbt(psbt, wallet).with_input_subset([1])
+
+    result = client.sign_psbt(merkleized_psbt, wallet, None)
+
+    assert result == [(
+        1,
+        PartialSignature(
+            pubkey=bytes.fromhex("0271b5b779ad870838587797bcf6f0c7aec5abe76a709d724f48d2e26cf874f0a0"),
+            signature=bytes.fromhex(
+                "3045022100e2e98e4f8c70274f10145c89a5d86e216d0376bdf9f42f829e4315ea67d79d210220743589fd4f55e540540a976a5af58acd610fa5e188a5096dfe7d36baf3afb94001"
+            ),
+        )
+    )]
+
+    # with a single device, the only shard has all the inputs
+    signed_psbt = asyncio.run(sign_psbt_sharded([client], psbt, wallet, None))
+    assert all(len(psbt_in.partial_sigs) == 1 for psbt_in in signed_psbt.inputs)
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_resume_singlesig_wpkh_2to2(client: Client):
+    # a session is resumed as if it was interrupted after the first signature; the user does not approve it again
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    progress = SignPsbtProgress()
+    result = client.sign_psbt(psbt, wallet, None, progress=progress)
+
+    assert len(result) == 2
+    assert progress.token is not None and len(progress.token) == 16
+
+    token = progress.token
+    progress.yielded = progress.yielded[:1]
+
+    assert client.sign_psbt(psbt, wallet, None, progress=progress) == result
+    assert progress.token == token
+
+    # a wrong token starts a new session, that yields all the signatures again
+    progress = SignPsbtProgress(token=bytes(16), yielded=progress.yielded[:1])
+    assert client.sign_psbt(psbt, wallet, None, progress=progress) == result
+    assert progress.token == token
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_merkleized_retry_singlesig_wpkh_2to2(client: Client):
+    # the same MerkleizedPsbt is signed twice; before the second time, a signature is added to an input and only
+    # the trees of that input are recomputed
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    merkleized_psbt = MerkleizedPsbt(psbt, wallet)
+
+    result = client.sign_psbt(merkleized_psbt, wallet, None)
+
+    _, sig0 = result[0]
+    merkleized_psbt.psbt.inputs[0].partial_sigs[sig0.pubkey] = sig0.signature
+    merkleized_psbt.update_input(0)
+
+    assert merkleized_psbt.input_commitments_root == MerkleizedPsbt(merkleized_psbt.psbt, wallet).input_commitments_root
+
+    assert client.sign_psbt(merkleized_psbt, wallet, None) == result
+
+
+def test_sign_psbt_singlesig_wpkh_2to2_protocol_v1(client: Client):
+    # Same as test_sign_psbt_singlesig_wpkh_2to2, but using version 1 of the protocol, where each
+    # signature is returned in its own YIELD interruption rather than being queued.
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    result_v2 = client.sign_psbt(psbt, wallet, None)
+
+    client._sign_psbt_protocol_version = 1
+    try:
+        result_v1 = client.sign_psbt(psbt, wallet, None)
+    finally:
+        del client._sign_psbt_protocol_version
+
+    assert len(result_v2) == 2
+    assert result_v1 == result_v2
+
+
+def test_sign_psbt_singlesig_wpkh_2to2_speculative(client: Client):
+    # Same as test_sign_psbt_singlesig_wpkh_2to2, but computing in advance the responses to the
+    # predicted client commands
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    result = client.sign_psbt(psbt, wallet, None)
+
+    client.speculative = True
+    try:
+        result_speculative = client.sign_psbt(psbt, wallet, None)
+    finally:
+        client.speculative = False
+
+    assert result_speculative == result
+
+
+def test_sign_psbt_singlesig_wpkh_2to2_progress(client: Client):
+    # Same as test_sign_psbt_singlesig_wpkh_2to2, but reporting the progress of each phase
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    result = client.sign_psbt(psbt, wallet, None)
+
+    events = []
+    client.on_progress = lambda phase, n_done, n_total: events.append((phase, n_done, n_total))
+    try:
+        result_progress = client.sign_psbt(psbt, wallet, None)
+    finally:
+        client.on_progress = None
+
+    assert result_progress == result
+
+    n_inputs = len(psbt.inputs)
+    n_outputs = len(psbt.outputs)
+    # the segwit hashes are only computed in a phase of their own on Nano S
+    phases = [phase for phase, _, _ in events]
+    assert phases == sorted(phases)
+    for phase, n_total in [(ProgressPhase.INPUTS, n_inputs), (ProgressPhase.OUTPUTS, n_outputs),
+                           (ProgressPhase.SIGNING, 2)]:
+        phase_events = [(n_done, total) for p, n_done, total in events if p == phase]
+        assert phase_events[0] == (0, n_total)
+        assert phase_events[-1] == (n_total, n_total)
+
+
+def test_sign_psbt_singlesig_wpkh_2to2_parallel_merkleization(client: Client):
+    # Same as test_sign_psbt_singlesig_wpkh_2to2, but hashing the input and output maps in a pool of processes
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    with ProcessPoolExecutor(max_workers=2) as executor:
+        merkleized_psbt = MerkleizedPsbt(psbt, wallet, executor=executor)
+
+    sequential = MerkleizedPsbt(psbt, wallet)
+    assert merkleized_psbt.input_commitments_root == sequential.input_commitments_root
+    assert merkleized_psbt.output_commitments_root == sequential.output_commitments_root
+
+    assert client.sign_psbt(merkleized_psbt, wallet, None) == client.sign_psbt(psbt, wallet, None)
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_singlesig_wpkh_2to2_raw_psbt(client: Client):
+    # Same as test_sign_psbt_singlesig_wpkh_2to2, but reading the PSBT as raw key/value maps
+
+    psbt_path = f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt"
+    psbt = open_psbt_from_file(psbt_path)
+    raw_psbt = RawPsbt.from_file(psbt_path)
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    merkleized_psbt = MerkleizedPsbt(raw_psbt, wallet)
+    expected = MerkleizedPsbt(psbt, wallet)
+    assert merkleized_psbt.global_map_commitment == expected.global_map_commitment
+    assert merkleized_psbt.input_commitments_root == expected.input_commitments_root
+    assert merkleized_psbt.output_commitments_root == expected.output_commitments_root
+
+    assert client.sign_psbt(raw_psbt, wallet, None) == client.sign_psbt(psbt, wallet, None)
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_singlesig_wpkh_2to2_verify_signatures(client: Client):
+    # Same as test_sign_psbt_singlesig_wpkh_2to2, verifying the signatures on the host, also in a pool of processes
+
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    client.verify_signatures = True
+    try:
+        result = client.sign_psbt(psbt, wallet, None)
+        assert len(result) == 2
+
+        with ProcessPoolExecutor(max_workers=2) as executor:
+            client.verify_signatures = executor
+            assert client.sign_psbt(psbt, wallet, None) == result
+    finally:
+        client.verify_signatures = False
+
+
+def test_verify_partial_signatures():
+    # the signatures of test_sign_psbt_singlesig_wpkh_2to2, and a signature of each input for the sighash of the other
+    psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt")
+
+    signatures = [(
+        0,
+        PartialSignature(
+            pubkey=bytes.fromhex("03455ee7cedc97b0ba435b80066fc92c963a34c600317981d135330c4ee43ac7a3"),
+            signature=bytes.fromhex(
+                "304402206b3e877655f08c6e7b1b74d6d893a82cdf799f68a5ae7cecae63a71b0339e5ce022019b94aa3fb6635956e109f3d89c996b1bfbbaf3c619134b5a302badfaf52180e01"
+            )
+        )
+    ), (
+        1,
+        PartialSignature(
+            pubkey=bytes.fromhex("0271b5b779ad870838587797bcf6f0c7aec5abe76a709d724f48d2e26cf874f0a0"),
+            signature=bytes.fromhex(
+                "3045022100e2e98e4f8c70274f10145c89a5d86e216d0376bdf9f42f829e4315ea67d79d210220743589fd4f55e540540a976a5af58acd610fa5e188a5096dfe7d36baf3afb94001"
+            ),
+        )
+    )]
+
+    verify_partial_signatures(psbt, signatures)
+    verify_partial_signatures(RawPsbt.from_bytes(psbt.serialize()), signatures)
+
+    with pytest.raises(InvalidSignatureError) as e:
+        verify_partial_signatures(psbt, [(0, signatures[1][1]), (1, signatures[0][1])])
+    assert e.value.input_index == 0
+
+    # the taproot sighashes of test_sign_psbt_taproot_1to2_sighash_all and test_sign_psbt_taproot_1to2_sighash_default
+    for psbt_file_name, sighash_type, sighash in [
+        ("tr-1to2-sighash-all", 0x01, "7A999E5AD6F53EA6448E7026061D3B4523F957999C430A5A492DFACE74AE31B6"),
+        ("tr-1to2-sighash-default", 0x00, "75C96FB06A12DB4CD011D8C95A5995DB758A4F2837A22F30F0F579619A4466F3"),
+    ]:
+        psbt = open_psbt_from_file(f"{tests_root}/psbt/singlesig/{psbt_file_name}.psbt")
+        merkleized_psbt = MerkleizedPsbt(psbt, WalletPolicy("", "tr(@0/**)", [
+            "[f5acc2fd/86'/1'/0']tpubDDKYE6BREvDsSWMazgHoyQWiJwYaDDYPbCFjYxN3HFXJP5fokeiK4hwK5tTLBNEDBwrDXn8cQ4v9b2xdW62Xr5yxoQdMu1v6c7UDXYVH27U"
+        ]))
+        sighash_cache = SighashCache(merkleized_psbt.global_map, merkleized_psbt.input_maps,
+                                     merkleized_psbt.output_maps)
+        assert sighash_cache.taproot(0, sighash_type) == bytes.fromhex(sighash)
+
+
 @has_automation("automations/sign_with_default_wallet_missing_nonwitnessutxo_accept.json")
 def test_sign_psbt_singlesig_wpkh_2to2_missing_nonwitnessutxo(client: Client):
     # Same as the previous test, but the non-witness-utxo is missing.
@@ -602,6 +965,109 @@ def test_sign_psbt_singlesig_wpkh_512to256(client: Client, enable_slow_tests: bo
     assert len(result) == n_inputs
 
 
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_singlesig_tr_1500to2(client: Client, model, enable_slow_tests: bool):
+    # PSBT for a transaction with more inputs than the app can keep track of; their records are kept
+    # by the client with the PUT_RECORD and GET_RECORD client commands
+    # Very slow test (esp. with DEBUG enabled), so disabled unless the --enableslowtests option is used
+
+    if not enable_slow_tests:
+        pytest.skip()
+
+    if model == "nanos":
+        pytest.skip("Offloaded records are not supported on Nano S")
+
+    n_inputs = 1500
+    n_outputs = 2
+
+    wallet = WalletPolicy(
+        "",
+        "tr(@0/**)",
+        [
+            "[f5acc2fd/86'/1'/0']tpubDDKYE6BREvDsSWMazgHoyQWiJwYaDDYPbCFjYxN3HFXJP5fokeiK4hwK5tTLBNEDBwrDXn8cQ4v9b2xdW62Xr5yxoQdMu1v6c7UDXYVH27U"
+        ],
+    )
+
+    psbt = txmaker.createPsbt(
+        wallet,
+        [10000 + 10000 * i for i in range(n_inputs)],
+        [999 + 99 * i for i in range(n_outputs)],
+        [i == 1 for i in range(n_outputs)]
+    )
+
+    result = client.sign_psbt(psbt, wallet, None)
+
+    assert len(result) == n_inputs
+
+
+@has_automation("automations/sign_with_default_wallet_accept.json")
+def test_sign_psbt_multiple_wallets(client: Client, model):
+    # PSBT spending the inputs of two different wallet policies, signed with a single SIGN_PSBT
+
+    if model == "nanos":
+        pytest.skip("Signing with multiple wallets is not supported on Nano S")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    other_wallet = WalletPolicy(
+        "",
+        "pkh(@0/**)",
+        [
+            "[f5acc2fd/44'/1'/0']tpubDCwYjpDhUdPGP5rS3wgNg13mTrrjBuG8V9VpWbyptX6TRPbNoZVXsoVUSkCjmQ8jJycjuDKBb9eataSymXakTTaGifxR6kmVsfFehH1ZgJT"
+        ],
+    )
+
+    psbt = txmaker.createPsbt(wallet, [100000, 50000], [60000, 80000], [False, True])
+    other_psbt = txmaker.createPsbt(other_wallet, [30000], [20000], [False])
+
+    # append the input of the other wallet
+    psbt.tx.vin += other_psbt.tx.vin
+    psbt.inputs += other_psbt.inputs
+
+    result = client.sign_psbt(psbt, wallet, None, additional_wallets=[(other_wallet, None)])
+
+    assert sorted(input_index for input_index, _ in result) == [0, 1, 2]
+
+    # the same wallet can not be used twice
+    with pytest.raises(IncorrectDataError):
+        client.sign_psbt(psbt, wallet, None, additional_wallets=[(wallet, None)])
+
+
+@has_automation("automations/sign_psbt_batch_accept.json")
+def test_sign_psbt_batch(client: Client, model):
+    # Several PSBTs of the same wallet policy, signed with a single SIGN_PSBT_BATCH and a single
+    # confirmation of their totals
+
+    if model == "nanos":
+        pytest.skip("Batches of PSBTs are not supported on Nano S")
+
+    wallet = WalletPolicy(
+        "",
+        "wpkh(@0/**)",
+        [
+            "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8upEp7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P"
+        ],
+    )
+
+    psbts = [
+        open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-1to2.psbt"),
+        open_psbt_from_file(f"{tests_root}/psbt/singlesig/wpkh-2to2.psbt"),
+    ]
+
+    result = client.sign_psbt_batch(psbts, wallet, None)
+
+    # the signatures are the same as with SIGN_PSBT, in the order of the PSBTs
+    expected = [(i, input_index, sig) for i, psbt in enumerate(psbts)
+                for input_index, sig in client.sign_psbt(psbt, wallet, None)]
+    assert result == expected
+
+
 def test_sign_psbt_fail_11_changes(client: Client):
     # PSBT for transaction with 11 change addresses; the limit is 10, so it must fail with NotSupportedError
     # before any user interaction
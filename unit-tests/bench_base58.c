@@ -0,0 +1,232 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <cmocka.h>
+
+#include "common/base58.h"
+
+// Benchmark of the base58 codec against the previous byte-at-a-time implementation, which is kept
+// here as a reference. The outputs of the two implementations are also compared.
+
+#define N_ITERATIONS 2000
+
+// length of a serialized extended pubkey with its checksum, and of its base58 encoding
+#define XPUB_LEN     82
+#define XPUB_STR_LEN 111
+
+static const char LEGACY_ALPHABET[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
+
+static int legacy_base58_decode(const char *in, size_t in_len, uint8_t *out, size_t out_len) {
+    uint8_t tmp[MAX_DEC_INPUT_SIZE] = {0};
+    uint8_t buffer[MAX_DEC_INPUT_SIZE] = {0};
+    uint8_t j;
+    uint8_t start_at;
+    uint8_t zero_count = 0;
+
+    if (in_len > MAX_DEC_INPUT_SIZE || in_len < 2) {
+        return -1;
+    }
+
+    for (uint8_t i = 0; i < in_len; i++) {
+        const char *p = memchr(LEGACY_ALPHABET, in[i], sizeof(LEGACY_ALPHABET) - 1);
+        if (in[i] == '\0' || p == NULL) {
+            return -1;
+        }
+        tmp[i] = (uint8_t) (p - LEGACY_ALPHABET);
+    }
+
+    while ((zero_count < in_len) && (tmp[zero_count] == 0)) {
+        ++zero_count;
+    }
+
+    j = in_len;
+    start_at = zero_count;
+    while (start_at < in_len) {
+        uint16_t remainder = 0;
+        for (uint8_t div_loop = start_at; div_loop < in_len; div_loop++) {
+            uint16_t digit256 = (uint16_t) (tmp[div_loop] & 0xFF);
+            uint16_t tmp_div = remainder * 58 + digit256;
+            tmp[div_loop] = (uint8_t) (tmp_div / 256);
+            remainder = tmp_div % 256;
+        }
+
+        if (tmp[start_at] == 0) {
+            ++start_at;
+        }
+
+        buffer[--j] = (uint8_t) remainder;
+    }
+
+    while ((j < in_len) && (buffer[j] == 0)) {
+        ++j;
+    }
+
+    int length = in_len - (j - zero_count);
+
+    if ((int) out_len < length) {
+        return -1;
+    }
+
+    memmove(out, buffer + j - zero_count, length);
+
+    return length;
+}
+
+static int legacy_base58_encode(const uint8_t *in, size_t in_len, char *out, size_t out_len) {
+    uint8_t buffer[MAX_ENC_INPUT_SIZE * 138 / 100 + 1] = {0};
+    size_t i, j;
+    size_t stop_at;
+    size_t zero_count = 0;
+    size_t output_size;
+
+    if (in_len > MAX_ENC_INPUT_SIZE) {
+        return -1;
+    }
+
+    while ((zero_count < in_len) && (in[zero_count] == 0)) {
+        ++zero_count;
+    }
+
+    output_size = (in_len - zero_count) * 138 / 100 + 1;
+    stop_at = output_size - 1;
+    for (size_t start_at = zero_count; start_at < in_len; start_at++) {
+        unsigned int carry = in[start_at];
+        for (j = output_size - 1; (int) j >= 0; j--) {
+            carry += 256 * buffer[j];
+            buffer[j] = carry % 58;
+            carry /= 58;
+
+            if (j <= stop_at - 1 && carry == 0) {
+                break;
+            }
+        }
+        stop_at = j;
+    }
+
+    j = 0;
+    while (j < output_size && buffer[j] == 0) {
+        j += 1;
+    }
+
+    if (out_len < zero_count + output_size - j) {
+        return -1;
+    }
+
+    memset(out, LEGACY_ALPHABET[0], zero_count);
+
+    i = zero_count;
+    while (j < output_size) {
+        out[i++] = LEGACY_ALPHABET[buffer[j++]];
+    }
+
+    return i;
+}
+
+// simple deterministic pseudo-random generator, so that runs are reproducible
+static uint32_t rng_state = 0x12345678;
+
+static uint8_t rand_byte(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (uint8_t) rng_state;
+}
+
+static void test_base58_matches_legacy(void **state) {
+    (void) state;
+
+    for (int iter = 0; iter < N_ITERATIONS; iter++) {
+        uint8_t in[MAX_ENC_INPUT_SIZE];
+        size_t in_len = 2 + iter % (MAX_ENC_INPUT_SIZE - 1);
+        for (size_t i = 0; i < in_len; i++) {
+            in[i] = rand_byte();
+        }
+        // exercise leading zeros
+        for (size_t i = 0; i < (size_t) (iter % 4) && i < in_len; i++) {
+            in[i] = 0;
+        }
+
+        char enc[MAX_DEC_INPUT_SIZE];
+        char enc_legacy[MAX_DEC_INPUT_SIZE];
+        int enc_len = base58_encode(in, in_len, enc, sizeof(enc));
+        int enc_legacy_len = legacy_base58_encode(in, in_len, enc_legacy, sizeof(enc_legacy));
+        assert_int_equal(enc_len, enc_legacy_len);
+        assert_memory_equal(enc, enc_legacy, enc_len);
+
+        if (enc_len > MAX_DEC_INPUT_SIZE || enc_len < 2) {
+            continue;
+        }
+
+        uint8_t dec[MAX_DEC_INPUT_SIZE];
+        uint8_t dec_legacy[MAX_DEC_INPUT_SIZE];
+        int dec_len = base58_decode(enc, enc_len, dec, sizeof(dec));
+        int dec_legacy_len = legacy_base58_decode(enc, enc_len, dec_legacy, sizeof(dec_legacy));
+        assert_int_equal(dec_len, dec_legacy_len);
+        assert_int_equal(dec_len, in_len);
+        assert_memory_equal(dec, dec_legacy, dec_len);
+        assert_memory_equal(dec, in, in_len);
+    }
+}
+
+static double elapsed_us(clock_t start) {
+    return (double) (clock() - start) * 1000000.0 / CLOCKS_PER_SEC / N_ITERATIONS;
+}
+
+static void test_base58_benchmark_xpub(void **state) {
+    (void) state;
+
+    uint8_t xpub[XPUB_LEN];
+    for (size_t i = 0; i < sizeof(xpub); i++) {
+        xpub[i] = rand_byte();
+    }
+
+    char xpub_str[XPUB_STR_LEN + 1];
+    int xpub_str_len = base58_encode(xpub, sizeof(xpub), xpub_str, sizeof(xpub_str));
+    assert_true(xpub_str_len > 0);
+
+    uint8_t dec[MAX_DEC_INPUT_SIZE];
+    char enc[MAX_DEC_INPUT_SIZE];
+    // accumulate the results, so that the calls are not optimized away
+    volatile int sink = 0;
+
+    clock_t start = clock();
+    for (int i = 0; i < N_ITERATIONS; i++) {
+        sink += legacy_base58_decode(xpub_str, xpub_str_len, dec, sizeof(dec));
+    }
+    double legacy_decode_us = elapsed_us(start);
+
+    start = clock();
+    for (int i = 0; i < N_ITERATIONS; i++) {
+        sink += base58_decode(xpub_str, xpub_str_len, dec, sizeof(dec));
+    }
+    double decode_us = elapsed_us(start);
+
+    start = clock();
+    for (int i = 0; i < N_ITERATIONS; i++) {
+        sink += legacy_base58_encode(xpub, sizeof(xpub), enc, sizeof(enc));
+    }
+    double legacy_encode_us = elapsed_us(start);
+
+    start = clock();
+    for (int i = 0; i < N_ITERATIONS; i++) {
+        sink += base58_encode(xpub, sizeof(xpub), enc, sizeof(enc));
+    }
+    double encode_us = elapsed_us(start);
+
+    printf("xpub decode: legacy %.2f us, limbs %.2f us\n", legacy_decode_us, decode_us);
+    printf("xpub encode: legacy %.2f us, limbs %.2f us\n", legacy_encode_us, encode_us);
+    (void) sink;
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {cmocka_unit_test(test_base58_matches_legacy),
+                                       cmocka_unit_test(test_base58_benchmark_xpub)};
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
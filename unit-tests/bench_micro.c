@@ -0,0 +1,328 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <cmocka.h>
+
+// missing definitions to make it compile without the SDK
+unsigned int pic(unsigned int linked_address) {
+    return linked_address;
+}
+
+#ifndef PRINTF
+#define PRINTF(...) printf(__VA_ARGS__)
+#endif
+#define PIC(x) (x)
+
+#include "common/base58.h"
+#include "common/buffer.h"
+#include "common/merkle.h"
+#include "common/script.h"
+#include "common/segwit_addr.h"
+#include "common/wallet.h"
+
+// Microbenchmarks of the parsers and encoders that run for each wallet policy, key, address or
+// PSBT field handled by the app. Each benchmark checks the result on a realistic input, then
+// reports the average time per call. They are built with the optimization flags in the
+// BENCH_OPTIMIZATION CMake variable, in order to compare -O2 with the -Os of the device builds.
+
+#define N_ITERATIONS 20000
+
+// accumulates the results, so that the calls are not optimized away
+static volatile int sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+#define BENCHMARK(name, statement)                                               \
+    do {                                                                         \
+        double start = now_ns();                                                 \
+        for (int iter = 0; iter < N_ITERATIONS; iter++) {                        \
+            statement;                                                           \
+        }                                                                        \
+        printf("%-48s %10.1f ns/op\n", name, (now_ns() - start) / N_ITERATIONS); \
+    } while (0)
+
+#define MAX_WALLET_POLICY_MEMORY_SIZE 1024
+
+static int parse_policy(const char *descriptor_template, uint8_t *out, size_t out_size) {
+    buffer_t descriptor_template_buf =
+        buffer_create((void *) descriptor_template, strlen(descriptor_template));
+
+    return parse_descriptor_template(&descriptor_template_buf,
+                                     out,
+                                     out_size,
+                                     WALLET_POLICY_VERSION_V2);
+}
+
+static void bench_parse_descriptor_template(void **state) {
+    (void) state;
+
+    static const char *const descriptor_templates[][2] = {
+        {"wpkh", "wpkh(@0/**)"},
+        {"sortedmulti 2-of-3", "wsh(sortedmulti(2,@0/**,@1/**,@2/**))"},
+        {"tapscripts", "tr(@0/**,{pk(@1/**),multi_a(2,@2/**,@3/**)})"},
+        {"decaying multisig",
+         "wsh(or_d(multi(3,@0/<0;1>/*,@1/<0;1>/*,@2/<0;1>/*),and_v(v:thresh(2,pkh(@0/<2;3>/*),a:"
+         "pkh(@1/<2;3>/*),a:pkh(@2/<2;3>/*)),older(65535))))"},
+    };
+
+    uint8_t out[MAX_WALLET_POLICY_MEMORY_SIZE];
+    for (size_t i = 0; i < sizeof(descriptor_templates) / sizeof(descriptor_templates[0]); i++) {
+        assert_int_equal(parse_policy(descriptor_templates[i][1], out, sizeof(out)), 0);
+
+        char name[64];
+        snprintf(name, sizeof(name), "parse_descriptor_template (%s)", descriptor_templates[i][0]);
+        BENCHMARK(name, sink += parse_policy(descriptor_templates[i][1], out, sizeof(out)));
+    }
+}
+
+static void bench_compute_miniscript_policy_ext_info(void **state) {
+    (void) state;
+
+    const char descriptor_template[] =
+        "wsh(or_d(multi(3,@0/<0;1>/*,@1/<0;1>/*,@2/<0;1>/*),and_v(v:thresh(2,pkh(@0/<2;3>/*),a:"
+        "pkh(@1/<2;3>/*),a:pkh(@2/<2;3>/*)),older(65535))))";
+
+    uint8_t out[MAX_WALLET_POLICY_MEMORY_SIZE];
+    assert_int_equal(parse_policy(descriptor_template, out, sizeof(out)), 0);
+
+    const policy_node_t *inner = resolve_node_ptr(&((policy_node_with_script_t *) out)->script);
+    policy_node_ext_info_t ext_info;
+    assert_int_equal(compute_miniscript_policy_ext_info(inner, &ext_info), 0);
+    assert_true(ext_info.s && ext_info.m && ext_info.k);
+
+    BENCHMARK("compute_miniscript_policy_ext_info (decaying)",
+              sink += compute_miniscript_policy_ext_info(inner, &ext_info));
+}
+
+static void bench_parse_policy_map_key_info(void **state) {
+    (void) state;
+
+    const char key_info_str[] =
+        "[f5acc2fd/48'/1'/0'/2']tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93"
+        "oourBssgUxuWz1jX5uhc1qaqFo9VsybY1J5FuedLfm4dK";
+
+    policy_map_key_info_t key_info;
+    buffer_t buf = buffer_create((void *) key_info_str, sizeof(key_info_str) - 1);
+    assert_int_equal(parse_policy_map_key_info(&buf, &key_info, WALLET_POLICY_VERSION_V2), 0);
+    assert_int_equal(key_info.master_key_derivation_len, 4);
+
+    BENCHMARK("parse_policy_map_key_info", {
+        buf = buffer_create((void *) key_info_str, sizeof(key_info_str) - 1);
+        sink += parse_policy_map_key_info(&buf, &key_info, WALLET_POLICY_VERSION_V2);
+    });
+}
+
+static void bench_base58(void **state) {
+    (void) state;
+
+    const char xpub_str[] =
+        "tpubDFAqEGNyad35aBCKUAXbQGDjdVhNueno5ZZVEn3sQbW5ci457gLR7HyTmHBg93oourBssgUxuWz1jX5uh"
+        "c1qaqFo9VsybY1J5FuedLfm4dK";
+
+    uint8_t xpub[82];
+    char enc[MAX_DEC_INPUT_SIZE];
+    assert_int_equal(base58_decode(xpub_str, sizeof(xpub_str) - 1, xpub, sizeof(xpub)),
+                     sizeof(xpub));
+    assert_int_equal(base58_encode(xpub, sizeof(xpub), enc, sizeof(enc)), sizeof(xpub_str) - 1);
+    assert_memory_equal(enc, xpub_str, sizeof(xpub_str) - 1);
+
+    BENCHMARK("base58_decode (xpub)",
+              sink += base58_decode(xpub_str, sizeof(xpub_str) - 1, xpub, sizeof(xpub)));
+    BENCHMARK("base58_encode (xpub)", sink += base58_encode(xpub, sizeof(xpub), enc, sizeof(enc)));
+}
+
+static void bench_segwit_addr_encode(void **state) {
+    (void) state;
+
+    uint8_t program[32];
+    for (size_t i = 0; i < sizeof(program); i++) {
+        program[i] = (uint8_t) (i * 37 + 11);
+    }
+
+    char address[73 + 2 + 1];
+    assert_int_equal(segwit_addr_encode(address, "bc", 0, program, 20), 1);
+    assert_int_equal(strlen(address), 42);
+    assert_int_equal(segwit_addr_encode(address, "bc", 1, program, 32), 1);
+    assert_int_equal(strlen(address), 62);
+
+    BENCHMARK("segwit_addr_encode (p2wpkh)",
+              sink += segwit_addr_encode(address, "bc", 0, program, 20));
+    BENCHMARK("segwit_addr_encode (p2tr)",
+              sink += segwit_addr_encode(address, "bc", 1, program, 32));
+}
+
+static void bench_segwit_addr_encode_batch(void **state) {
+    (void) state;
+
+    // test vectors of BIP-0173 and BIP-0350
+    const uint8_t p2wpkh_program[20] = {0x75, 0x1e, 0x76, 0xe8, 0x19, 0x91, 0x96, 0xd4, 0x54, 0x94,
+                                        0x1c, 0x45, 0xd1, 0xb3, 0xa3, 0x23, 0xf1, 0x43, 0x3b, 0xd6};
+    const uint8_t p2tr_program[32] = {0x79, 0xbe, 0x66, 0x7e, 0xf9, 0xdc, 0xbb, 0xac, 0x55, 0xa0,
+                                      0x62, 0x95, 0xce, 0x87, 0x0b, 0x07, 0x02, 0x9b, 0xfc, 0xdb,
+                                      0x2d, 0xce, 0x28, 0xd9, 0x59, 0xf2, 0x81, 0x5b, 0x16, 0xf8,
+                                      0x17, 0x98};
+
+    bech32_hrp_state hrp;
+    assert_int_equal(bech32_hrp_init(&hrp, "bc"), 1);
+    assert_int_equal(bech32_hrp_init(&hrp, "BC"), 0);
+    assert_int_equal(bech32_hrp_init(&hrp, "bc"), 1);
+
+    char addresses[4][73 + 2 + 1];
+    assert_int_equal(segwit_addr_encode_with_hrp(addresses[0], &hrp, 0, p2wpkh_program, 20), 1);
+    assert_string_equal(addresses[0], "bc1qw508d6qejxtdg4y5r3zarvary0c5xw7kv8f3t4");
+    assert_int_equal(segwit_addr_encode_with_hrp(addresses[1], &hrp, 1, p2tr_program, 32), 1);
+    assert_string_equal(addresses[1],
+                        "bc1p0xlxvlhemja6c4dqv22uapctqupfhlxm9h8z3k2e72q4k9hcz7vqzk5jj0");
+
+    // same results as segwit_addr_encode and, for programs that are not a multiple of 5 bytes,
+    // as the bit-by-bit conversion of the decoder
+    for (size_t len = 2; len <= 40; len++) {
+        uint8_t program[40], decoded[40];
+        for (size_t i = 0; i < len; i++) {
+            program[i] = (uint8_t) (i * 73 + len);
+        }
+        assert_int_equal(segwit_addr_encode(addresses[2], "tb", 1, program, len), 1);
+
+        int version;
+        size_t decoded_len;
+        assert_int_equal(segwit_addr_decode(&version, decoded, &decoded_len, "tb", addresses[2]),
+                         1);
+        assert_int_equal(version, 1);
+        assert_int_equal(decoded_len, len);
+        assert_memory_equal(decoded, program, len);
+    }
+
+    // a batch of 4 addresses, as for GET_WALLET_ADDRESSES
+    BENCHMARK("segwit_addr_encode_with_hrp (4 x p2tr)", {
+        bech32_hrp_init(&hrp, "bc");
+        for (int k = 0; k < 4; k++) {
+            sink += segwit_addr_encode_with_hrp(addresses[k], &hrp, 1, p2tr_program, 32);
+        }
+    });
+    BENCHMARK("segwit_addr_encode (4 x p2tr)", {
+        for (int k = 0; k < 4; k++) {
+            sink += segwit_addr_encode(addresses[k], "bc", 1, p2tr_program, 32);
+        }
+    });
+}
+
+static void bench_merkle_get_ith_direction(void **state) {
+    (void) state;
+
+    // directions of all the leaves of a tree of 512 inputs, as when checking the proofs of a PSBT
+    const size_t size = 512;
+    assert_int_equal(merkle_get_ith_direction(size, 0, 0), 0);
+    assert_int_equal(merkle_get_ith_direction(size, size - 1, 0), 1);
+
+    BENCHMARK("merkle_get_ith_direction (512 leaves)", {
+        size_t index = (size_t) iter % size;
+        for (size_t i = 0; i < 9; i++) {
+            sink += merkle_get_ith_direction(size, index, i);
+        }
+    });
+}
+
+static void bench_merkle_climb_path(void **state) {
+    (void) state;
+
+    // proof of a leaf of a tree of 512 inputs, as received for each field of an input of a PSBT
+    const size_t size = 512, index = 300;
+    uint8_t siblings[9 * 32];
+    for (size_t i = 0; i < sizeof(siblings); i++) {
+        siblings[i] = (uint8_t) i;
+    }
+    uint32_t directions;
+    assert_int_equal(merkle_get_directions(size, index, &directions), 9);
+
+    uint8_t expected[32] = {0x42}, hash[32] = {0x42};
+    for (size_t k = 0; k < 9; k++) {
+        if ((directions >> (8 - k)) & 1) {
+            merkle_combine_hashes(siblings + 32 * k, expected, expected);
+        } else {
+            merkle_combine_hashes(expected, siblings + 32 * k, expected);
+        }
+    }
+    merkle_climb_path(hash, siblings, 4, directions, 9);  // in two chunks, as in the proofs
+    merkle_climb_path(hash, siblings + 4 * 32, 5, directions, 5);
+    assert_memory_equal(hash, expected, 32);
+
+    BENCHMARK("merkle_climb_path (512 leaves)", {
+        merkle_climb_path(hash, siblings, 9, directions, 9);
+        sink += hash[0];
+    });
+}
+
+static void bench_buffer_read_varint(void **state) {
+    (void) state;
+
+    // varints of all the lengths, as found in transactions
+    const uint8_t data[] = {0x01, 0xfc, 0xfd, 0x00, 0x02, 0xfe, 0x00, 0x00, 0x01, 0x00,
+                            0xff, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00};
+
+    uint64_t value;
+    buffer_t buf = buffer_create((void *) data, sizeof(data));
+    for (int i = 0; i < 5; i++) {
+        assert_true(buffer_read_varint(&buf, &value));
+    }
+    assert_int_equal(value, 0x100000000ULL);
+
+    BENCHMARK("buffer_read_varint (5 varints)", {
+        buf = buffer_create((void *) data, sizeof(data));
+        for (int i = 0; i < 5; i++) {
+            sink += buffer_read_varint(&buf, &value);
+        }
+    });
+}
+
+static void bench_script(void **state) {
+    (void) state;
+
+    uint8_t p2wpkh[22] = {OP_0, 20};
+    uint8_t p2tr[34] = {OP_1, 32};
+    uint8_t p2pkh[25] = {OP_DUP, OP_HASH160, 20};
+    p2pkh[23] = OP_EQUALVERIFY;
+    p2pkh[24] = OP_CHECKSIG;
+    const uint8_t opreturn[] = {OP_RETURN, 5, 'h', 'e', 'l', 'l', 'o'};
+
+    assert_int_equal(get_script_type(p2wpkh, sizeof(p2wpkh)), SCRIPT_TYPE_P2WPKH);
+    assert_int_equal(get_script_type(p2tr, sizeof(p2tr)), SCRIPT_TYPE_P2TR);
+    assert_int_equal(get_script_type(p2pkh, sizeof(p2pkh)), SCRIPT_TYPE_P2PKH);
+
+    char desc[MAX_OPRETURN_OUTPUT_DESC_SIZE];
+    assert_int_equal(format_opscript_script(opreturn, sizeof(opreturn), desc),
+                     sizeof("OP_RETURN 0x68656c6c6f"));
+
+    BENCHMARK("get_script_type (p2wpkh, p2tr, p2pkh)", {
+        sink += get_script_type(p2wpkh, sizeof(p2wpkh));
+        sink += get_script_type(p2tr, sizeof(p2tr));
+        sink += get_script_type(p2pkh, sizeof(p2pkh));
+    });
+    BENCHMARK("get_push_script_size", sink += get_push_script_size((uint32_t) iter * 131));
+    BENCHMARK("format_opscript_script",
+              sink += format_opscript_script(opreturn, sizeof(opreturn), desc));
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {cmocka_unit_test(bench_parse_descriptor_template),
+                                       cmocka_unit_test(bench_compute_miniscript_policy_ext_info),
+                                       cmocka_unit_test(bench_parse_policy_map_key_info),
+                                       cmocka_unit_test(bench_base58),
+                                       cmocka_unit_test(bench_segwit_addr_encode),
+                                       cmocka_unit_test(bench_segwit_addr_encode_batch),
+                                       cmocka_unit_test(bench_merkle_get_ith_direction),
+                                       cmocka_unit_test(bench_merkle_climb_path),
+                                       cmocka_unit_test(bench_buffer_read_varint),
+                                       cmocka_unit_test(bench_script)};
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,878 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "os.h"
+#include "cx.h"
+
+#include "common/merkle.h"
+#include "common/varint.h"
+#include "handler/client_commands.h"
+
+#include "client.h"
+
+// Maximum length of the data of a short CONTINUE APDU
+#define MAX_SHORT_RESPONSE_LEN 255
+
+static void *checked_realloc(void *ptr, size_t size) {
+    void *result = realloc(ptr, size);
+    if (result == NULL) {
+        abort();
+    }
+    return result;
+}
+
+static size_t largest_power_of_2_less_than(size_t n) {
+    size_t p = 1;
+    while (2 * p < n) {
+        p *= 2;
+    }
+    return p;
+}
+
+void harness_merkle_root(const uint8_t leaves[][32], size_t n_leaves, uint8_t root[static 32]) {
+    if (n_leaves == 0) {
+        memset(root, 0, 32);
+        return;
+    }
+    if (n_leaves == 1) {
+        memcpy(root, leaves[0], 32);
+        return;
+    }
+
+    size_t p = largest_power_of_2_less_than(n_leaves);
+    uint8_t left[32], right[32];
+    harness_merkle_root(leaves, p, left);
+    harness_merkle_root(leaves + p, n_leaves - p, right);
+    merkle_combine_hashes(left, right, root);
+}
+
+// Appends the proof of the leaf with the given index to `proof`, from the bottom of the tree
+static size_t prove_leaf(const uint8_t leaves[][32],
+                         size_t n_leaves,
+                         size_t index,
+                         uint8_t proof[][32]) {
+    if (n_leaves == 1) {
+        return 0;
+    }
+
+    size_t p = largest_power_of_2_less_than(n_leaves);
+    size_t n;
+    if (index < p) {
+        n = prove_leaf(leaves, p, index, proof);
+        harness_merkle_root(leaves + p, n_leaves - p, proof[n]);
+    } else {
+        n = prove_leaf(leaves + p, n_leaves - p, index - p, proof);
+        harness_merkle_root(leaves, p, proof[n]);
+    }
+    return n + 1;
+}
+
+/**
+ * Appends to `proof`, in left-to-right order, the hashes of the leaves in [begin, end) and of the
+ * maximal subtrees that do not contain any of them.
+ */
+static size_t prove_leaves(const uint8_t leaves[][32],
+                           size_t n_leaves,
+                           size_t begin,
+                           size_t end,
+                           uint8_t proof[][32]) {
+    if (n_leaves == 1 || end == 0 || begin >= n_leaves) {
+        harness_merkle_root(leaves, n_leaves, proof[0]);
+        return 1;
+    }
+
+    size_t p = largest_power_of_2_less_than(n_leaves);
+    size_t n = prove_leaves(leaves, p, begin, end < p ? end : p, proof);
+    return n + prove_leaves(leaves + p,
+                            n_leaves - p,
+                            begin > p ? begin - p : 0,
+                            end > p ? end - p : 0,
+                            proof + n);
+}
+
+/**
+ * Appends to `proof`, in left-to-right order, the hashes of the leaves with the given strictly
+ * increasing indexes (relative to the subtree) and of the maximal subtrees that do not contain any
+ * of them.
+ */
+static size_t prove_leaf_set(const uint8_t leaves[][32],
+                             size_t n_leaves,
+                             const uint64_t indexes[],
+                             size_t n_indexes,
+                             size_t offset,
+                             uint8_t proof[][32]) {
+    if (n_leaves == 1 || n_indexes == 0) {
+        harness_merkle_root(leaves, n_leaves, proof[0]);
+        return 1;
+    }
+
+    size_t p = largest_power_of_2_less_than(n_leaves);
+    size_t n_left = 0;
+    while (n_left < n_indexes && indexes[n_left] - offset < p) {
+        ++n_left;
+    }
+    size_t n = prove_leaf_set(leaves, p, indexes, n_left, offset, proof);
+    return n + prove_leaf_set(leaves + p,
+                              n_leaves - p,
+                              indexes + n_left,
+                              n_indexes - n_left,
+                              offset + p,
+                              proof + n);
+}
+
+void harness_client_init(harness_client_t *client) {
+    memset(client, 0, sizeof(harness_client_t));
+    client->max_response_len = MAX_SHORT_RESPONSE_LEN;
+}
+
+void harness_client_free(harness_client_t *client) {
+    for (size_t i = 0; i < client->n_preimages; i++) {
+        free(client->preimages[i].data);
+    }
+    free(client->preimages);
+    for (size_t i = 0; i < client->n_trees; i++) {
+        free(client->trees[i].leaves);
+    }
+    free(client->trees);
+    free(client->queue);
+    for (size_t i = 0; i < client->n_yielded; i++) {
+        free(client->yielded[i].data);
+    }
+    free(client->yielded);
+    free(client->plan_data);
+    free(client->stream_data);
+    memset(client, 0, sizeof(harness_client_t));
+}
+
+void harness_client_reset_hash_refs(harness_client_t *client) {
+    memset(client->hash_refs, 0, sizeof(client->hash_refs));
+    memset(client->hash_refs_last_used, 0, sizeof(client->hash_refs_last_used));
+    client->hash_refs_clock = 0;
+    client->hash_refs_exchange_start = 0;
+
+    free(client->plan_data);
+    client->plan_data = NULL;
+    client->plan_len = 0;
+    client->plan_first = 0;
+
+    free(client->stream_data);
+    client->stream_data = NULL;
+    client->stream_len = 0;
+    client->stream_first = 0;
+}
+
+void harness_client_add_preimage(harness_client_t *client, const uint8_t *data, size_t len) {
+    client->preimages = checked_realloc(client->preimages,
+                                        (client->n_preimages + 1) * sizeof(harness_preimage_t));
+    harness_preimage_t *preimage = &client->preimages[client->n_preimages++];
+    cx_hash_sha256(data, len, preimage->hash, 32);
+    preimage->data = checked_realloc(NULL, len > 0 ? len : 1);
+    memcpy(preimage->data, data, len);
+    preimage->len = len;
+}
+
+void harness_client_add_tree(harness_client_t *client,
+                             const uint8_t leaves[][32],
+                             size_t n_leaves,
+                             uint8_t root[static 32]) {
+    client->trees =
+        checked_realloc(client->trees, (client->n_trees + 1) * sizeof(harness_tree_t));
+    harness_tree_t *tree = &client->trees[client->n_trees++];
+    tree->leaves = checked_realloc(NULL, (n_leaves > 0 ? n_leaves : 1) * 32);
+    memcpy(tree->leaves, leaves, n_leaves * 32);
+    tree->size = n_leaves;
+    harness_merkle_root(leaves, n_leaves, tree->root);
+    memcpy(root, tree->root, 32);
+}
+
+void harness_client_add_list(harness_client_t *client,
+                             const uint8_t *const elements[],
+                             const size_t element_lens[],
+                             size_t n_elements,
+                             uint8_t root[static 32]) {
+    uint8_t(*leaves)[32] = checked_realloc(NULL, (n_elements > 0 ? n_elements : 1) * 32);
+    for (size_t i = 0; i < n_elements; i++) {
+        uint8_t *preimage = checked_realloc(NULL, 1 + element_lens[i]);
+        preimage[0] = 0x00;
+        memcpy(preimage + 1, elements[i], element_lens[i]);
+        harness_client_add_preimage(client, preimage, 1 + element_lens[i]);
+        free(preimage);
+
+        merkle_compute_element_hash(elements[i], element_lens[i], leaves[i]);
+    }
+    harness_client_add_tree(client, (const uint8_t(*)[32]) leaves, n_elements, root);
+    free(leaves);
+}
+
+void harness_client_add_mapping(harness_client_t *client,
+                                const uint8_t *const keys[],
+                                const size_t key_lens[],
+                                const uint8_t *const values[],
+                                const size_t value_lens[],
+                                size_t n_keys,
+                                merkleized_map_commitment_t *out) {
+    memset(out, 0, sizeof(merkleized_map_commitment_t));
+    out->size = n_keys;
+    harness_client_add_list(client, keys, key_lens, n_keys, out->keys_root);
+    harness_client_add_list(client, values, value_lens, n_keys, out->values_root);
+}
+
+static const harness_tree_t *find_tree(const harness_client_t *client, const uint8_t root[32]) {
+    for (size_t i = 0; i < client->n_trees; i++) {
+        if (memcmp(client->trees[i].root, root, 32) == 0) {
+            return &client->trees[i];
+        }
+    }
+    return NULL;
+}
+
+static const harness_preimage_t *find_preimage(const harness_client_t *client,
+                                               const uint8_t hash[32]) {
+    for (size_t i = 0; i < client->n_preimages; i++) {
+        if (memcmp(client->preimages[i].hash, hash, 32) == 0) {
+            return &client->preimages[i];
+        }
+    }
+    return NULL;
+}
+
+static void queue_elements(harness_client_t *client,
+                           const uint8_t *elements,
+                           size_t el_len,
+                           size_t n_elements) {
+    if (n_elements == 0) {
+        return;
+    }
+    client->queue = checked_realloc(client->queue, n_elements * el_len);
+    memcpy(client->queue, elements, n_elements * el_len);
+    client->queue_el_len = el_len;
+    client->queue_len = n_elements;
+    client->queue_first = 0;
+}
+
+static bool is_queue_empty(const harness_client_t *client) {
+    return client->queue_first == client->queue_len;
+}
+
+static bool read_varint(const uint8_t *buf, size_t buf_len, size_t *pos, uint64_t *out) {
+    if (*pos >= buf_len) {
+        return false;
+    }
+    int len = varint_read(buf + *pos, buf_len - *pos, out);
+    if (len < 0) {
+        return false;
+    }
+    *pos += len;
+    return true;
+}
+
+static int execute_yield(harness_client_t *client, const uint8_t *request, size_t request_len) {
+    client->yielded =
+        checked_realloc(client->yielded, (client->n_yielded + 1) * sizeof(harness_yielded_t));
+    harness_yielded_t *yielded = &client->yielded[client->n_yielded++];
+    yielded->len = request_len - 1;
+    yielded->data = checked_realloc(NULL, request_len);
+    memcpy(yielded->data, request + 1, request_len - 1);
+    return 0;
+}
+
+static int execute_get_preimage(harness_client_t *client,
+                                const uint8_t *request,
+                                size_t request_len,
+                                uint8_t *response) {
+    if (request_len != 1 + 1 + 32 || request[1] != 0) {
+        return -1;
+    }
+
+    const harness_preimage_t *preimage = find_preimage(client, request + 2);
+    if (preimage == NULL) {
+        return -1;
+    }
+
+    int pos = varint_write(response, 0, preimage->len);
+
+    size_t payload_len = client->max_response_len - pos - 1;
+    if (payload_len > 255) {
+        payload_len = 255;  // the length is 1 byte
+    }
+    if (payload_len > preimage->len) {
+        payload_len = preimage->len;
+    }
+    response[pos++] = (uint8_t) payload_len;
+    memcpy(response + pos, preimage->data, payload_len);
+    pos += payload_len;
+
+    // the rest is returned one byte at a time by GET_MORE_ELEMENTS
+    queue_elements(client, preimage->data + payload_len, 1, preimage->len - payload_len);
+    return pos;
+}
+
+static int execute_get_merkle_leaf_proof(harness_client_t *client,
+                                         const uint8_t *request,
+                                         size_t request_len,
+                                         uint8_t *response) {
+    size_t pos = 1 + 32;
+    uint64_t tree_size, leaf_index;
+    if (request_len < pos || !read_varint(request, request_len, &pos, &tree_size) ||
+        !read_varint(request, request_len, &pos, &leaf_index) || pos != request_len) {
+        return -1;
+    }
+
+    const harness_tree_t *tree = find_tree(client, request + 1);
+    if (tree == NULL || tree->size != tree_size || leaf_index >= tree_size ||
+        !is_queue_empty(client)) {
+        return -1;
+    }
+
+    uint8_t proof[64][32];
+    size_t proof_size = prove_leaf((const uint8_t(*)[32]) tree->leaves,
+                                   tree->size,
+                                   (size_t) leaf_index,
+                                   proof);
+
+    size_t n_response_elements = (client->max_response_len - 32 - 1 - 1) / 32;
+    if (n_response_elements > proof_size) {
+        n_response_elements = proof_size;
+    }
+
+    memcpy(response, tree->leaves[leaf_index], 32);
+    response[32] = (uint8_t) proof_size;
+    response[33] = (uint8_t) n_response_elements;
+    memcpy(response + 34, proof, 32 * n_response_elements);
+
+    queue_elements(client, proof[n_response_elements], 32, proof_size - n_response_elements);
+    return 34 + 32 * n_response_elements;
+}
+
+static int find_hash_ref(const harness_client_t *client, const uint8_t hash[32]) {
+    for (int i = 0; i < HARNESS_HASH_REFS_SIZE; i++) {
+        if (client->hash_refs_last_used[i] != 0 && memcmp(client->hash_refs[i], hash, 32) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static const uint8_t *use_hash_ref(harness_client_t *client, size_t index) {
+    if (index >= HARNESS_HASH_REFS_SIZE || client->hash_refs_last_used[index] == 0) {
+        return NULL;
+    }
+    client->hash_refs_last_used[index] = ++client->hash_refs_clock;
+    return client->hash_refs[index];
+}
+
+static void add_hash_ref(harness_client_t *client, const uint8_t hash[32]) {
+    int index = find_hash_ref(client, hash);
+    if (index < 0) {
+        for (int i = 0; i < HARNESS_HASH_REFS_SIZE; i++) {
+            uint32_t last_used = client->hash_refs_last_used[i];
+            if (last_used <= client->hash_refs_exchange_start &&
+                (index < 0 || last_used < client->hash_refs_last_used[index])) {
+                index = i;
+            }
+        }
+        if (index < 0) {
+            return;  // all the entries were used in this exchange
+        }
+        memcpy(client->hash_refs[index], hash, 32);
+    }
+    client->hash_refs_last_used[index] = ++client->hash_refs_clock;
+}
+
+static int execute_get_merkle_leaf_proof_refs(harness_client_t *client,
+                                              const uint8_t *request,
+                                              size_t request_len,
+                                              uint8_t *response) {
+    client->hash_refs_exchange_start = client->hash_refs_clock;
+
+    if (request_len < 2) {
+        return -1;
+    }
+    const uint8_t *root;
+    size_t pos = 2;
+    if (request[1] == 0xFF) {
+        if (request_len < 2 + 32) {
+            return -1;
+        }
+        root = request + 2;
+        add_hash_ref(client, root);
+        pos += 32;
+    } else if ((root = use_hash_ref(client, request[1])) == NULL) {
+        return -1;
+    }
+
+    uint64_t tree_size, leaf_index;
+    if (!read_varint(request, request_len, &pos, &tree_size) ||
+        !read_varint(request, request_len, &pos, &leaf_index) || pos + 1 != request_len) {
+        return -1;
+    }
+    size_t n_known = request[pos];
+
+    const harness_tree_t *tree = find_tree(client, root);
+    if (tree == NULL || tree->size != tree_size || leaf_index >= tree_size ||
+        !is_queue_empty(client)) {
+        return -1;
+    }
+
+    uint8_t proof[64][32];
+    size_t proof_size = prove_leaf((const uint8_t(*)[32]) tree->leaves,
+                                   tree->size,
+                                   (size_t) leaf_index,
+                                   proof);
+    if (n_known > proof_size) {
+        return -1;
+    }
+    proof_size -= n_known;  // the hashes closest to the root are known by the device
+
+    // the longest suffix of the proof that is in the table is referenced
+    uint8_t refs[64];
+    size_t n_refs = 0;
+    while (n_refs < proof_size) {
+        int index = find_hash_ref(client, proof[proof_size - 1 - n_refs]);
+        if (index < 0) {
+            break;
+        }
+        refs[n_refs++] = (uint8_t) index;
+    }
+    for (size_t i = 0; i < n_refs / 2; i++) {
+        uint8_t tmp = refs[i];
+        refs[i] = refs[n_refs - 1 - i];
+        refs[n_refs - 1 - i] = tmp;
+    }
+
+    size_t n_full = proof_size - n_refs;
+    for (size_t i = 0; i < n_refs; i++) {
+        use_hash_ref(client, refs[i]);
+    }
+    for (size_t i = HARNESS_MERKLE_FRONTIER_LEVELS; i < n_full; i++) {
+        add_hash_ref(client, proof[i]);
+    }
+
+    size_t n_response_elements = (client->max_response_len - 32 - 1 - 1 - n_refs - 1) / 32;
+    if (n_response_elements > n_full) {
+        n_response_elements = n_full;
+    }
+
+    memcpy(response, tree->leaves[leaf_index], 32);
+    pos = 32;
+    response[pos++] = (uint8_t) proof_size;
+    response[pos++] = (uint8_t) n_refs;
+    memcpy(response + pos, refs, n_refs);
+    pos += n_refs;
+    response[pos++] = (uint8_t) n_response_elements;
+    memcpy(response + pos, proof, 32 * n_response_elements);
+    pos += 32 * n_response_elements;
+
+    queue_elements(client, proof[n_response_elements], 32, n_full - n_response_elements);
+    return pos;
+}
+
+static int execute_get_merkle_leaf_proofs(harness_client_t *client,
+                                          const uint8_t *request,
+                                          size_t request_len,
+                                          uint8_t *response) {
+    size_t pos = 1 + 32;
+    uint64_t tree_size, first_leaf_index, n_leaves;
+    if (request_len < pos || !read_varint(request, request_len, &pos, &tree_size) ||
+        !read_varint(request, request_len, &pos, &first_leaf_index) ||
+        !read_varint(request, request_len, &pos, &n_leaves) || pos != request_len) {
+        return -1;
+    }
+
+    const harness_tree_t *tree = find_tree(client, request + 1);
+    if (tree == NULL || tree->size != tree_size || n_leaves == 0 ||
+        first_leaf_index + n_leaves > tree_size || !is_queue_empty(client)) {
+        return -1;
+    }
+
+    // at most n_leaves + 2 * (depth of the tree) elements
+    uint8_t(*proof)[32] = checked_realloc(NULL, (n_leaves + 128) * 32);
+    size_t proof_size = prove_leaves((const uint8_t(*)[32]) tree->leaves,
+                                     tree->size,
+                                     (size_t) first_leaf_index,
+                                     (size_t) (first_leaf_index + n_leaves),
+                                     proof);
+
+    size_t n_response_elements = (client->max_response_len - 1 - 1) / 32;
+    if (n_response_elements > proof_size) {
+        n_response_elements = proof_size;
+    }
+
+    response[0] = (uint8_t) proof_size;
+    response[1] = (uint8_t) n_response_elements;
+    memcpy(response + 2, proof, 32 * n_response_elements);
+
+    queue_elements(client, proof[n_response_elements], 32, proof_size - n_response_elements);
+    free(proof);
+    return 2 + 32 * n_response_elements;
+}
+
+static int execute_get_merkle_leaf_elements(harness_client_t *client,
+                                            const uint8_t *request,
+                                            size_t request_len,
+                                            uint8_t *response) {
+    size_t pos = 1 + 32;
+    uint64_t tree_size, indexes[255];
+    if (request_len < pos + 1 || !read_varint(request, request_len, &pos, &tree_size) ||
+        pos >= request_len) {
+        return -1;
+    }
+    size_t n_leaves = request[pos++];
+    for (size_t i = 0; i < n_leaves; i++) {
+        if (!read_varint(request, request_len, &pos, &indexes[i])) {
+            return -1;
+        }
+    }
+
+    const harness_tree_t *tree = find_tree(client, request + 1);
+    if (pos != request_len || tree == NULL || tree->size != tree_size || n_leaves == 0 ||
+        indexes[n_leaves - 1] >= tree_size || !is_queue_empty(client)) {
+        return -1;
+    }
+    for (size_t i = 1; i < n_leaves; i++) {
+        if (indexes[i] <= indexes[i - 1]) {
+            return -1;
+        }
+    }
+
+    // the multiproof has at most n_leaves + 2 * (depth of the tree) elements
+    size_t data_size = (n_leaves + 128) * 32;
+    for (size_t i = 0; i < n_leaves; i++) {
+        const harness_preimage_t *preimage = find_preimage(client, tree->leaves[indexes[i]]);
+        if (preimage == NULL) {
+            return -1;
+        }
+        data_size += 9 + preimage->len;
+    }
+
+    uint8_t *data = checked_realloc(NULL, data_size);
+    size_t data_len =
+        32 * prove_leaf_set((const uint8_t(*)[32]) tree->leaves,
+                            tree->size,
+                            indexes,
+                            n_leaves,
+                            0,
+                            (uint8_t(*)[32]) data);
+    for (size_t i = 0; i < n_leaves; i++) {
+        const harness_preimage_t *preimage = find_preimage(client, tree->leaves[indexes[i]]);
+        data_len += varint_write(data, data_len, preimage->len);
+        memcpy(data + data_len, preimage->data, preimage->len);
+        data_len += preimage->len;
+    }
+
+    int response_len = varint_write(response, 0, data_len);
+
+    size_t payload_len = client->max_response_len - response_len - 1;
+    if (payload_len > 255) {
+        payload_len = 255;  // the length is 1 byte
+    }
+    if (payload_len > data_len) {
+        payload_len = data_len;
+    }
+    response[response_len++] = (uint8_t) payload_len;
+    memcpy(response + response_len, data, payload_len);
+    response_len += payload_len;
+
+    // the rest is returned one byte at a time by GET_MORE_ELEMENTS
+    queue_elements(client, data + payload_len, 1, data_len - payload_len);
+    free(data);
+    return response_len;
+}
+
+static int execute_get_merkle_leaf_index(harness_client_t *client,
+                                         const uint8_t *request,
+                                         size_t request_len,
+                                         uint8_t *response) {
+    if (request_len != 1 + 32 + 32) {
+        return -1;
+    }
+
+    const harness_tree_t *tree = find_tree(client, request + 1);
+    if (tree == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < tree->size; i++) {
+        if (memcmp(tree->leaves[i], request + 1 + 32, 32) == 0) {
+            response[0] = 1;
+            return 1 + varint_write(response, 1, i);
+        }
+    }
+    response[0] = 0;
+    response[1] = 0;
+    return 2;
+}
+
+// Appends to the data of the access plan the value of the key in the map with the given commitment
+// (the preimage of its leaf, then its proof), if the key is in the map.
+static int append_planned_value(harness_client_t *client,
+                                const uint8_t *commitment,
+                                size_t commitment_len,
+                                const uint8_t *key,
+                                size_t key_len) {
+    size_t pos = 0;
+    uint64_t map_size;
+    if (!read_varint(commitment, commitment_len, &pos, &map_size) ||
+        pos + 64 != commitment_len) {
+        return -1;
+    }
+    const harness_tree_t *keys_tree = find_tree(client, commitment + pos);
+    const harness_tree_t *values_tree = find_tree(client, commitment + pos + 32);
+    if (keys_tree == NULL || values_tree == NULL || keys_tree->size != map_size ||
+        values_tree->size != map_size) {
+        return -1;
+    }
+
+    uint8_t key_hash[32];
+    merkle_compute_element_hash(key, key_len, key_hash);
+    size_t index = 0;
+    while (index < map_size && memcmp(keys_tree->leaves[index], key_hash, 32) != 0) {
+        ++index;
+    }
+    if (index == map_size) {
+        return 0;  // nothing for the keys that are not in the map
+    }
+
+    const harness_preimage_t *preimage = find_preimage(client, values_tree->leaves[index]);
+    if (preimage == NULL) {
+        return -1;
+    }
+    uint8_t proof[64][32];
+    size_t proof_size =
+        prove_leaf((const uint8_t(*)[32]) values_tree->leaves, values_tree->size, index, proof);
+
+    client->plan_data =
+        checked_realloc(client->plan_data, client->plan_len + 9 + preimage->len + 32 * proof_size);
+    client->plan_len += varint_write(client->plan_data, client->plan_len, preimage->len);
+    memcpy(client->plan_data + client->plan_len, preimage->data, preimage->len);
+    client->plan_len += preimage->len;
+    memcpy(client->plan_data + client->plan_len, proof, 32 * proof_size);
+    client->plan_len += 32 * proof_size;
+    return 0;
+}
+
+static int execute_announce_access_plan(harness_client_t *client,
+                                        const uint8_t *request,
+                                        size_t request_len) {
+    size_t pos = 1 + 32;
+    uint64_t n_maps;
+    if (request_len < pos + 1 || !read_varint(request, request_len, &pos, &n_maps) ||
+        pos >= request_len) {
+        return -1;
+    }
+    size_t n_keys = request[pos++];
+    const uint8_t *keys[255];
+    size_t key_lens[255];
+    for (size_t k = 0; k < n_keys; k++) {
+        if (pos >= request_len || pos + 1 + request[pos] > request_len) {
+            return -1;
+        }
+        key_lens[k] = request[pos];
+        keys[k] = request + pos + 1;
+        pos += 1 + key_lens[k];
+    }
+
+    const harness_tree_t *maps_tree = find_tree(client, request + 1);
+    if (pos != request_len || maps_tree == NULL || maps_tree->size != n_maps) {
+        return -1;
+    }
+
+    // the data of the previous plan is discarded
+    free(client->plan_data);
+    client->plan_data = NULL;
+    client->plan_len = 0;
+    client->plan_first = 0;
+
+    for (size_t i = 0; i < n_maps; i++) {
+        const harness_preimage_t *map = find_preimage(client, maps_tree->leaves[i]);
+        if (map == NULL || map->len == 0 || map->data[0] != 0x00) {
+            return -1;
+        }
+        for (size_t k = 0; k < n_keys; k++) {
+            if (append_planned_value(client, map->data + 1, map->len - 1, keys[k], key_lens[k]) <
+                0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Writes in the response the next bytes of the data of an access plan or of a tree stream,
+// prefixed by their length, as many as fit; first is the index of the first byte not yet returned.
+static int write_data_chunk(const harness_client_t *client,
+                            const uint8_t *data,
+                            size_t len,
+                            size_t *first,
+                            uint8_t *response) {
+    if (*first == len) {
+        return -1;
+    }
+
+    // the length takes 3 bytes if the response is longer than 252 bytes
+    size_t n_bytes = client->max_response_len - 1;
+    if (n_bytes > 0xFC) {
+        n_bytes = client->max_response_len - 3;
+    }
+    if (n_bytes > len - *first) {
+        n_bytes = len - *first;
+    }
+    int pos = varint_write(response, 0, n_bytes);
+    memcpy(response + pos, data + *first, n_bytes);
+    *first += n_bytes;
+    return pos + n_bytes;
+}
+
+static int execute_get_access_plan_data(harness_client_t *client,
+                                        size_t request_len,
+                                        uint8_t *response) {
+    if (request_len != 1) {
+        return -1;
+    }
+    return write_data_chunk(client,
+                            client->plan_data,
+                            client->plan_len,
+                            &client->plan_first,
+                            response);
+}
+
+static int execute_stream_merkle_tree(harness_client_t *client,
+                                      const uint8_t *request,
+                                      size_t request_len,
+                                      uint8_t *response) {
+    size_t pos = 1 + 32;
+    uint64_t tree_size;
+    if (request_len < pos || !read_varint(request, request_len, &pos, &tree_size) ||
+        pos != request_len) {
+        return -1;
+    }
+
+    const harness_tree_t *tree = find_tree(client, request + 1);
+    if (tree == NULL || tree->size != tree_size) {
+        return -1;
+    }
+
+    // the data of the previous stream is discarded
+    free(client->stream_data);
+    client->stream_data = NULL;
+    client->stream_len = 0;
+    client->stream_first = 0;
+
+    for (size_t i = 0; i < tree->size; i++) {
+        const harness_preimage_t *leaf = find_preimage(client, tree->leaves[i]);
+        if (leaf == NULL) {
+            return -1;
+        }
+        client->stream_data =
+            checked_realloc(client->stream_data, client->stream_len + 9 + leaf->len);
+        client->stream_len += varint_write(client->stream_data, client->stream_len, leaf->len);
+        memcpy(client->stream_data + client->stream_len, leaf->data, leaf->len);
+        client->stream_len += leaf->len;
+    }
+
+    return write_data_chunk(client,
+                            client->stream_data,
+                            client->stream_len,
+                            &client->stream_first,
+                            response);
+}
+
+static int execute_get_tree_stream_data(harness_client_t *client,
+                                        size_t request_len,
+                                        uint8_t *response) {
+    if (request_len != 1) {
+        return -1;
+    }
+    return write_data_chunk(client,
+                            client->stream_data,
+                            client->stream_len,
+                            &client->stream_first,
+                            response);
+}
+
+static int execute_get_more_elements(harness_client_t *client,
+                                     size_t request_len,
+                                     uint8_t *response) {
+    if (request_len != 1 || is_queue_empty(client)) {
+        return -1;
+    }
+
+    size_t el_len = client->queue_el_len;
+    size_t n_elements = 0;
+    while (!is_queue_empty(client) && n_elements < 255 &&
+           (n_elements + 1) * el_len <= client->max_response_len - 2) {
+        memcpy(response + 2 + n_elements * el_len,
+               client->queue + client->queue_first * el_len,
+               el_len);
+        ++client->queue_first;
+        ++n_elements;
+    }
+
+    response[0] = (uint8_t) n_elements;
+    response[1] = (uint8_t) el_len;
+    return 2 + n_elements * el_len;
+}
+
+int harness_client_execute(harness_client_t *client,
+                           const uint8_t *request,
+                           size_t request_len,
+                           uint8_t *response,
+                           size_t response_size) {
+    if (response_size < client->max_response_len) {
+        return -1;
+    }
+
+    if (client->queued_yields) {
+        while (request_len > 0 && request[0] == CCMD_YIELD) {
+            if (request_len < 2 || request_len < 2 + (size_t) request[1]) {
+                return -1;
+            }
+            // the message is a YIELD request without its length
+            uint8_t message[1 + 255];
+            message[0] = CCMD_YIELD;
+            memcpy(message + 1, request + 2, request[1]);
+            execute_yield(client, message, 1 + request[1]);
+
+            request_len -= 2 + request[1];
+            request += 2 + request[1];
+        }
+        if (request_len == 0) {
+            return 0;
+        }
+    }
+
+    if (request_len == 0) {
+        return -1;
+    }
+
+    switch (request[0]) {
+        case CCMD_YIELD:
+            return execute_yield(client, request, request_len);
+        case CCMD_GET_PREIMAGE:
+            return execute_get_preimage(client, request, request_len, response);
+        case CCMD_GET_MERKLE_LEAF_PROOF:
+            return execute_get_merkle_leaf_proof(client, request, request_len, response);
+        case CCMD_GET_MERKLE_LEAF_PROOFS:
+            return execute_get_merkle_leaf_proofs(client, request, request_len, response);
+        case CCMD_GET_MERKLE_LEAF_PROOF_REFS:
+            return execute_get_merkle_leaf_proof_refs(client, request, request_len, response);
+        case CCMD_GET_MERKLE_LEAF_ELEMENTS:
+            return execute_get_merkle_leaf_elements(client, request, request_len, response);
+        case CCMD_GET_MERKLE_LEAF_INDEX:
+            return execute_get_merkle_leaf_index(client, request, request_len, response);
+        case CCMD_ANNOUNCE_ACCESS_PLAN:
+            return execute_announce_access_plan(client, request, request_len);
+        case CCMD_GET_ACCESS_PLAN_DATA:
+            return execute_get_access_plan_data(client, request_len, response);
+        case CCMD_STREAM_MERKLE_TREE:
+            return execute_stream_merkle_tree(client, request, request_len, response);
+        case CCMD_GET_TREE_STREAM_DATA:
+            return execute_get_tree_stream_data(client, request_len, response);
+        case CCMD_GET_MORE_ELEMENTS:
+            return execute_get_more_elements(client, request_len, response);
+        default:
+            return -1;
+    }
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common/merkle.h"
+
+/**
+ * In-process port of the client command interpreter of the Python client, answering the client
+ * commands of the handlers run in the host-native harness.
+ *
+ * The client knows a set of preimages and of Merkle trees; the elements that do not fit a response
+ * are queued for GET_MORE_ELEMENTS, and the messages of YIELD are recorded.
+ */
+
+typedef struct {
+    uint8_t hash[32];
+    uint8_t *data;
+    size_t len;
+} harness_preimage_t;
+
+typedef struct {
+    uint8_t root[32];
+    uint8_t (*leaves)[32];
+    size_t size;
+} harness_tree_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+} harness_yielded_t;
+
+// Number of entries of the table of the hash references of GET_MERKLE_LEAF_PROOF_REFS
+#define HARNESS_HASH_REFS_SIZE 16
+
+// Number of the lowest hashes of each proof that are not stored in the table of hash references
+#define HARNESS_MERKLE_FRONTIER_LEVELS 3
+
+typedef struct {
+    harness_preimage_t *preimages;
+    size_t n_preimages;
+
+    harness_tree_t *trees;
+    size_t n_trees;
+
+    // elements for GET_MORE_ELEMENTS, all of the same length
+    uint8_t *queue;
+    size_t queue_el_len;
+    size_t queue_len;    // number of queued elements
+    size_t queue_first;  // index of the first element not yet returned
+
+    harness_yielded_t *yielded;
+    size_t n_yielded;
+
+    // if true, the responses start with YIELD messages prefixed by their length (SIGN_PSBT v2)
+    bool queued_yields;
+
+    // maximum length of the responses: 255 by default, as for short APDUs; it can be raised up to
+    // MAX_EXTENDED_APDU_DATA_LEN, as for a device accepting extended-length APDUs
+    size_t max_response_len;
+
+    // the table of the hash references of the current command; last_used is 0 for empty entries
+    uint8_t hash_refs[HARNESS_HASH_REFS_SIZE][32];
+    uint32_t hash_refs_last_used[HARNESS_HASH_REFS_SIZE];
+    uint32_t hash_refs_clock;
+    uint32_t hash_refs_exchange_start;
+
+    // the data of the current access plan, returned by GET_ACCESS_PLAN_DATA
+    uint8_t *plan_data;
+    size_t plan_len;
+    size_t plan_first;  // index of the first byte not yet returned
+
+    // the data of the current tree stream, returned by STREAM_MERKLE_TREE and GET_TREE_STREAM_DATA
+    uint8_t *stream_data;
+    size_t stream_len;
+    size_t stream_first;  // index of the first byte not yet returned
+} harness_client_t;
+
+void harness_client_init(harness_client_t *client);
+
+void harness_client_free(harness_client_t *client);
+
+// Empties the table of the hash references and forgets the access plan and the tree stream, as at
+// the start of each command.
+void harness_client_reset_hash_refs(harness_client_t *client);
+
+// Adds a preimage, known by its sha256 hash.
+void harness_client_add_preimage(harness_client_t *client, const uint8_t *data, size_t len);
+
+// Adds the Merkle tree with the given leaf hashes, and returns its root in `root`.
+void harness_client_add_tree(harness_client_t *client,
+                             const uint8_t leaves[][32],
+                             size_t n_leaves,
+                             uint8_t root[static 32]);
+
+/**
+ * Adds the Merkle tree of the element hashes of a list of elements, and the preimages of its
+ * leaves; returns its root in `root`.
+ */
+void harness_client_add_list(harness_client_t *client,
+                             const uint8_t *const elements[],
+                             const size_t element_lens[],
+                             size_t n_elements,
+                             uint8_t root[static 32]);
+
+/**
+ * Adds a merkleized map with the given keys, which must be sorted in lexicographic order, and the
+ * corresponding values; fills its commitment in `out`.
+ */
+void harness_client_add_mapping(harness_client_t *client,
+                                const uint8_t *const keys[],
+                                const size_t key_lens[],
+                                const uint8_t *const values[],
+                                const size_t value_lens[],
+                                size_t n_keys,
+                                merkleized_map_commitment_t *out);
+
+/**
+ * Executes the client command requested in `request` (the response of an interruption, without
+ * the status word), and writes the data of the CONTINUE APDU in `response`.
+ *
+ * @return the length of the response, or -1 if the request is invalid or refers to unknown data.
+ */
+int harness_client_execute(harness_client_t *client,
+                           const uint8_t *request,
+                           size_t request_len,
+                           uint8_t *response,
+                           size_t response_size);
+
+// Computes the root of the Merkle tree of the given leaves, exactly as the device does.
+void harness_merkle_root(const uint8_t leaves[][32], size_t n_leaves, uint8_t root[static 32]);
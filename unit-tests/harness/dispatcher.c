@@ -0,0 +1,221 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boilerplate/constants.h"
+#include "boilerplate/dispatcher.h"
+#include "boilerplate/sw.h"
+#include "common/buffer.h"
+#include "handler/lib/access_plan.h"
+#include "handler/lib/tree_stream.h"
+#include "handler/lib/hash_refs.h"
+#include "handler/lib/merkle_frontier.h"
+#include "handler/lib/map_commitment_cache.h"
+#include "handler/lib/preimage_cache.h"
+
+#include "dispatcher.h"
+#include "sdk.h"
+
+static struct {
+    harness_client_t *client;
+
+    // response being built by the handler
+    uint8_t output[HARNESS_APDU_BUFFER_SIZE];
+    size_t output_len;
+    uint16_t sw;
+
+    // last response sent with send_response
+    harness_response_t response;
+    bool response_sent;
+
+    // data of the last CONTINUE APDU, which can be an extended-length APDU
+    uint8_t input[MAX_EXTENDED_APDU_DATA_LEN];
+    size_t input_len;
+
+    unsigned int n_interruptions;
+
+#ifdef HAVE_BACKGROUND_TASKS
+    // there is no ticker: the steps of the background task are all run when it is completed
+    background_task_step_t background_task_step;  // NULL if no background task was started
+    void *background_task_state;
+    int background_task_result;  // result of the last step, or 0 if no step was run yet
+#endif
+} G_harness;
+
+static dispatcher_context_t G_harness_dispatcher_context;
+
+static void add_to_response(const void *rdata, size_t rdata_len) {
+    if (G_harness.output_len + rdata_len > sizeof(G_harness.output) - 2) {
+        // the app would overflow G_io_apdu_buffer
+        abort();
+    }
+    memcpy(G_harness.output + G_harness.output_len, rdata, rdata_len);
+    G_harness.output_len += rdata_len;
+}
+
+static size_t get_response_space() {
+    return sizeof(G_harness.output) - 2 - G_harness.output_len;
+}
+
+static void finalize_response(uint16_t sw) {
+    G_harness.sw = sw;
+}
+
+static void send_response() {
+    memcpy(G_harness.response.data, G_harness.output, G_harness.output_len);
+    G_harness.response.len = G_harness.output_len;
+    G_harness.response.sw = G_harness.sw;
+    G_harness.response_sent = true;
+
+    G_harness.output_len = 0;
+}
+
+static void set_ui_dirty() {
+}
+
+static int process_interruption(dispatcher_context_t *dc) {
+    if (G_harness.sw != SW_INTERRUPTED_EXECUTION) {
+        return -1;
+    }
+
+    ++G_harness.n_interruptions;
+
+    int input_len = harness_client_execute(G_harness.client,
+                                           G_harness.output,
+                                           G_harness.output_len,
+                                           G_harness.input,
+                                           sizeof(G_harness.input));
+    G_harness.output_len = 0;
+    G_harness.sw = 0;
+
+    if (input_len < 0) {
+        // the Python client would raise an exception; the device gets no CONTINUE
+        return -1;
+    }
+
+    G_harness.input_len = input_len;
+    dc->read_buffer = buffer_create(G_harness.input, G_harness.input_len);
+    return 0;
+}
+
+#ifdef HAVE_BACKGROUND_TASKS
+static void start_background_task(background_task_step_t step, void *state, size_t state_size) {
+    (void) state_size;
+
+    G_harness.background_task_step = step;
+    G_harness.background_task_state = state;
+    G_harness.background_task_result = 0;
+}
+
+static void run_background_step() {
+    if (G_harness.background_task_step != NULL && G_harness.background_task_result == 0) {
+        G_harness.background_task_result =
+            G_harness.background_task_step(G_harness.background_task_state);
+    }
+}
+
+static int complete_background_task() {
+    if (G_harness.background_task_step == NULL) {
+        return -1;
+    }
+
+    while (G_harness.background_task_result == 0) {
+        run_background_step();
+    }
+    return G_harness.background_task_result;
+}
+#endif
+
+dispatcher_context_t *harness_dispatcher_init(harness_client_t *client) {
+    memset(&G_harness, 0, sizeof(G_harness));
+    G_harness.client = client;
+
+    harness_sdk_reset();
+
+#ifdef HAVE_PREIMAGE_CACHE
+    preimage_cache_reset();
+#endif
+#ifdef HAVE_MAP_COMMITMENT_CACHE
+    map_commitment_cache_reset();
+#endif
+#ifdef HAVE_HASH_REFS
+    // disabled, as for the commands of the protocol versions before HASH_REFS_PROTOCOL_VERSION
+    hash_refs_reset(0);
+    merkle_frontier_reset();
+#endif
+#ifdef HAVE_ACCESS_PLANS
+    access_plan_reset(0);
+#endif
+#ifdef HAVE_TREE_STREAMS
+    tree_stream_reset(0);
+#endif
+    harness_client_reset_hash_refs(client);
+
+    G_harness_dispatcher_context.add_to_response = add_to_response;
+    G_harness_dispatcher_context.get_response_space = get_response_space;
+    G_harness_dispatcher_context.finalize_response = finalize_response;
+    G_harness_dispatcher_context.send_response = send_response;
+    G_harness_dispatcher_context.set_ui_dirty = set_ui_dirty;
+    G_harness_dispatcher_context.process_interruption = process_interruption;
+#ifdef HAVE_BACKGROUND_TASKS
+    G_harness_dispatcher_context.start_background_task = start_background_task;
+    G_harness_dispatcher_context.complete_background_task = complete_background_task;
+    G_harness_dispatcher_context.run_background_step = run_background_step;
+#endif
+    return &G_harness_dispatcher_context;
+}
+
+uint16_t harness_run_handler(command_handler_t handler,
+                             uint8_t p2,
+                             const uint8_t *data,
+                             size_t data_len) {
+    if (data_len > 0) {
+        memcpy(G_harness.input, data, data_len);
+    }
+    G_harness.input_len = data_len;
+    G_harness_dispatcher_context.read_buffer = buffer_create(G_harness.input, data_len);
+
+    G_harness.output_len = 0;
+    G_harness.sw = 0;
+    G_harness.response_sent = false;
+
+#ifdef HAVE_PREIMAGE_CACHE
+    // as in the main loop of the app, the cache only lasts for one command
+    preimage_cache_reset();
+#endif
+#ifdef HAVE_MAP_COMMITMENT_CACHE
+    map_commitment_cache_reset();
+#endif
+#ifdef HAVE_HASH_REFS
+    hash_refs_reset(p2);
+    merkle_frontier_reset();
+#endif
+#ifdef HAVE_ACCESS_PLANS
+    access_plan_reset(p2);
+#endif
+#ifdef HAVE_TREE_STREAMS
+    tree_stream_reset(p2);
+#endif
+    harness_client_reset_hash_refs(G_harness.client);
+
+    handler(&G_harness_dispatcher_context, p2);
+
+#ifdef HAVE_BACKGROUND_TASKS
+    // the task is forgotten after the command; its state is not wiped, as it is on the stack of
+    // the handler without the scratch arena
+    G_harness.background_task_step = NULL;
+    G_harness.background_task_state = NULL;
+    G_harness.background_task_result = 0;
+#endif
+
+    return G_harness.response_sent ? G_harness.response.sw : 0;
+}
+
+const harness_response_t *harness_get_response(void) {
+    return &G_harness.response;
+}
+
+unsigned int harness_get_n_interruptions(void) {
+    return G_harness.n_interruptions;
+}
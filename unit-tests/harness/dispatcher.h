@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "boilerplate/dispatcher.h"
+
+#include "client.h"
+
+/**
+ * Host-native replacement of the dispatcher, running command handlers in-process: the
+ * interruptions are answered by a harness_client_t instead of being sent to the host.
+ */
+
+// Same size as G_io_apdu_buffer
+#define HARNESS_APDU_BUFFER_SIZE (5 + 255)
+
+typedef struct {
+    uint8_t data[HARNESS_APDU_BUFFER_SIZE];
+    size_t len;
+    uint16_t sw;
+} harness_response_t;
+
+/**
+ * Returns the dispatcher context to pass to the handlers (or to the functions of handler/lib),
+ * whose interruptions are answered by `client`.
+ */
+dispatcher_context_t *harness_dispatcher_init(harness_client_t *client);
+
+/**
+ * Runs `handler` with the given P2 and command data, using the dispatcher context returned by the
+ * last call to harness_dispatcher_init.
+ *
+ * @return the status word of the response of the handler, or 0 if it returned without sending one.
+ */
+uint16_t harness_run_handler(command_handler_t handler,
+                             uint8_t p2,
+                             const uint8_t *data,
+                             size_t data_len);
+
+// Returns the last response sent by the handler.
+const harness_response_t *harness_get_response(void);
+
+// Returns the number of interruptions since the last call to harness_dispatcher_init.
+unsigned int harness_get_n_interruptions(void);
@@ -0,0 +1,214 @@
+/*
+ * Software implementation of the HMAC functions of the SDK used by the app, for the host-native
+ * harness, with the SHA-512 they need for BIP32.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "os.h"
+#include "cx.h"
+
+typedef struct {
+    uint64_t h[8];
+    uint8_t block[128];
+    size_t blen;
+    uint64_t n_blocks;
+} sha512_t;
+
+static const uint64_t K[80] = {
+    0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc,
+    0x3956c25bf348b538, 0x59f111f1b605d019, 0x923f82a4af194f9b, 0xab1c5ed5da6d8118,
+    0xd807aa98a3030242, 0x12835b0145706fbe, 0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2,
+    0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235, 0xc19bf174cf692694,
+    0xe49b69c19ef14ad2, 0xefbe4786384f25e3, 0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65,
+    0x2de92c6f592b0275, 0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5,
+    0x983e5152ee66dfab, 0xa831c66d2db43210, 0xb00327c898fb213f, 0xbf597fc7beef0ee4,
+    0xc6e00bf33da88fc2, 0xd5a79147930aa725, 0x06ca6351e003826f, 0x142929670a0e6e70,
+    0x27b70a8546d22ffc, 0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 0x53380d139d95b3df,
+    0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6, 0x92722c851482353b,
+    0xa2bfe8a14cf10364, 0xa81a664bbc423001, 0xc24b8b70d0f89791, 0xc76c51a30654be30,
+    0xd192e819d6ef5218, 0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8,
+    0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 0x2748774cdf8eeb99, 0x34b0bcb5e19b48a8,
+    0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb, 0x5b9cca4f7763e373, 0x682e6ff3d6b2b8a3,
+    0x748f82ee5defb2fc, 0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+    0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915, 0xc67178f2e372532b,
+    0xca273eceea26619c, 0xd186b8c721c0c207, 0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178,
+    0x06f067aa72176fba, 0x0a637dc5a2c898a6, 0x113f9804bef90dae, 0x1b710b35131c471b,
+    0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc, 0x431d67c49c100d4c,
+    0x4cc5d4becb3e42b6, 0x597f299cfc657e2a, 0x5fcb6fab3ad6faec, 0x6c44198c4a475817};
+
+static const uint64_t H0[8] = {0x6a09e667f3bcc908,
+                               0xbb67ae8584caa73b,
+                               0x3c6ef372fe94f82b,
+                               0xa54ff53a5f1d36f1,
+                               0x510e527fade682d1,
+                               0x9b05688c2b3e6c1f,
+                               0x1f83d9abfb41bd6b,
+                               0x5be0cd19137e2179};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static void compress(sha512_t *ctx, const uint8_t block[static 128]) {
+    uint64_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = 0;
+        for (int j = 0; j < 8; j++) {
+            w[i] = (w[i] << 8) | block[8 * i + j];
+        }
+    }
+    for (int i = 16; i < 80; i++) {
+        uint64_t s0 = ROTR(w[i - 15], 1) ^ ROTR(w[i - 15], 8) ^ (w[i - 15] >> 7);
+        uint64_t s1 = ROTR(w[i - 2], 19) ^ ROTR(w[i - 2], 61) ^ (w[i - 2] >> 6);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint64_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3];
+    uint64_t e = ctx->h[4], f = ctx->h[5], g = ctx->h[6], hh = ctx->h[7];
+    for (int i = 0; i < 80; i++) {
+        uint64_t t1 = hh + (ROTR(e, 14) ^ ROTR(e, 18) ^ ROTR(e, 41)) + ((e & f) ^ (~e & g)) +
+                      K[i] + w[i];
+        uint64_t t2 = (ROTR(a, 28) ^ ROTR(a, 34) ^ ROTR(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    ctx->h[0] += a;
+    ctx->h[1] += b;
+    ctx->h[2] += c;
+    ctx->h[3] += d;
+    ctx->h[4] += e;
+    ctx->h[5] += f;
+    ctx->h[6] += g;
+    ctx->h[7] += hh;
+
+    ++ctx->n_blocks;
+}
+
+static void sha512_init(sha512_t *ctx) {
+    memset(ctx, 0, sizeof(sha512_t));
+    memcpy(ctx->h, H0, sizeof(H0));
+}
+
+static void sha512_update(sha512_t *ctx, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t n = 128 - ctx->blen;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ctx->block + ctx->blen, data, n);
+        ctx->blen += n;
+        data += n;
+        len -= n;
+        if (ctx->blen == 128) {
+            compress(ctx, ctx->block);
+            ctx->blen = 0;
+        }
+    }
+}
+
+static void sha512_final(sha512_t *ctx, uint8_t digest[static 64]) {
+    // the messages are short, the high 64 bits of the length are always 0
+    uint64_t bit_len = (ctx->n_blocks * 128 + ctx->blen) * 8;
+
+    uint8_t padding[128 + 16] = {0x80};
+    size_t padding_len = (ctx->blen < 112 ? 112 : 240) - ctx->blen;
+    for (int i = 0; i < 8; i++) {
+        padding[padding_len + 8 + i] = (uint8_t) (bit_len >> (56 - 8 * i));
+    }
+    sha512_update(ctx, padding, padding_len + 16);
+
+    for (int i = 0; i < 64; i++) {
+        digest[i] = (uint8_t) (ctx->h[i / 8] >> (56 - 8 * (i % 8)));
+    }
+}
+
+// Hashes the concatenation of data1 and data2
+typedef void (*hash_fn_t)(const uint8_t *data1,
+                          size_t len1,
+                          const uint8_t *data2,
+                          size_t len2,
+                          uint8_t *out);
+
+static void sha256_2(const uint8_t *data1,
+                     size_t len1,
+                     const uint8_t *data2,
+                     size_t len2,
+                     uint8_t *out) {
+    cx_sha256_t ctx;
+    cx_sha256_init_no_throw(&ctx);
+    cx_sha256_update(&ctx, data1, len1);
+    cx_sha256_update(&ctx, data2, len2);
+    cx_sha256_final(&ctx, out);
+}
+
+static void sha512_2(const uint8_t *data1,
+                     size_t len1,
+                     const uint8_t *data2,
+                     size_t len2,
+                     uint8_t *out) {
+    sha512_t ctx;
+    sha512_init(&ctx);
+    sha512_update(&ctx, data1, len1);
+    sha512_update(&ctx, data2, len2);
+    sha512_final(&ctx, out);
+}
+
+// HMAC with the hash function whose block is block_len bytes and whose digest is digest_len bytes
+static void hmac(hash_fn_t hash,
+                 size_t block_len,
+                 size_t digest_len,
+                 const uint8_t *key,
+                 size_t key_len,
+                 const uint8_t *in,
+                 size_t len,
+                 uint8_t *mac) {
+    uint8_t pad[128] = {0};
+    if (key_len > block_len) {
+        hash(key, key_len, NULL, 0, pad);
+    } else {
+        memcpy(pad, key, key_len);
+    }
+
+    uint8_t inner[64];
+    for (size_t i = 0; i < block_len; i++) {
+        pad[i] ^= 0x36;
+    }
+    hash(pad, block_len, in, len, inner);
+
+    for (size_t i = 0; i < block_len; i++) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+    hash(pad, block_len, inner, digest_len, mac);
+}
+
+int cx_hmac_sha256(const unsigned char *key,
+                   unsigned int key_len,
+                   const unsigned char *in,
+                   unsigned int len,
+                   unsigned char *mac,
+                   unsigned int mac_len) {
+    assert(mac_len >= 32);
+
+    hmac(sha256_2, 64, 32, key, key_len, in, len, mac);
+    return 32;
+}
+
+int cx_hmac_sha512(const unsigned char *key,
+                   unsigned int key_len,
+                   const unsigned char *in,
+                   unsigned int len,
+                   unsigned char *mac,
+                   unsigned int mac_len) {
+    assert(mac_len >= 64);
+
+    hmac(sha512_2, 128, 64, key, key_len, in, len, mac);
+    return 64;
+}
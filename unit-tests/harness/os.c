@@ -0,0 +1,166 @@
+/*
+ * Software implementation of the functions of the OS used by the app, for the host-native harness.
+ *
+ * The device is unlocked, and the keys are derived from the BIP-39 seed of the default mnemonic of
+ * Speculos (master key fingerprint f5acc2fd), so that the results can be compared with the tests
+ * of the app in tests/.
+ */
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "os.h"
+#include "cx.h"
+
+#include "sdk.h"
+
+// BIP-39 seed of "glory promote mansion idle axis finger extra february uncover one trip resource
+// lawn turtle enact monster seven myth punch hobby comfort wild raise skin"
+static const uint8_t SEED[64] = {
+    0xb1, 0x19, 0x97, 0xfa, 0xff, 0x42, 0x0a, 0x33, 0x1b, 0xb4, 0xa4, 0xff, 0xdc, 0x8b, 0xdc, 0x8b,
+    0xa7, 0xc0, 0x17, 0x32, 0xa9, 0x9a, 0x30, 0xd8, 0x3d, 0xbb, 0xeb, 0xd4, 0x69, 0x66, 0x6c, 0x84,
+    0xb4, 0x7d, 0x09, 0xd3, 0xf5, 0xf4, 0x72, 0xb3, 0xb9, 0x38, 0x4a, 0xc6, 0x34, 0xbe, 0xba, 0x2a,
+    0x44, 0x0b, 0xa3, 0x6e, 0xc7, 0x66, 0x11, 0x44, 0x13, 0x2f, 0x35, 0xe2, 0x06, 0x87, 0x35, 0x64};
+
+static const uint8_t SECP256K1_N[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe,
+    0xba, 0xae, 0xdc, 0xe6, 0xaf, 0x48, 0xa0, 0x3b, 0xbf, 0xd2, 0x5e, 0x8c, 0xd0, 0x36, 0x41, 0x41};
+
+static const uint8_t SECP256K1_G[65] = {
+    0x04, 0x79, 0xbe, 0x66, 0x7e, 0xf9, 0xdc, 0xbb, 0xac, 0x55, 0xa0, 0x62, 0x95, 0xce, 0x87,
+    0x0b, 0x07, 0x02, 0x9b, 0xfc, 0xdb, 0x2d, 0xce, 0x28, 0xd9, 0x59, 0xf2, 0x81, 0x5b, 0x16,
+    0xf8, 0x17, 0x98, 0x48, 0x3a, 0xda, 0x77, 0x26, 0xa3, 0xc4, 0x65, 0x5d, 0xa4, 0xfb, 0xfc,
+    0x0e, 0x11, 0x08, 0xa8, 0xfd, 0x17, 0xb4, 0x48, 0xa6, 0x85, 0x54, 0x19, 0x9c, 0x47, 0xd0,
+    0x8f, 0xfb, 0x10, 0xd4, 0xb8};
+
+static try_context_t *G_try_context;
+
+static uint64_t G_rng_state;
+
+void harness_sdk_reset(void) {
+    G_try_context = NULL;
+    G_rng_state = 0x9e3779b97f4a7c15;
+}
+
+try_context_t *try_context_get(void) {
+    return G_try_context;
+}
+
+try_context_t *try_context_set(try_context_t *context) {
+    try_context_t *previous = G_try_context;
+    G_try_context = context;
+    return previous;
+}
+
+void os_longjmp(unsigned int exception) {
+    longjmp(G_try_context->jmp_buf, exception);
+}
+
+bolos_bool_t os_global_pin_is_validated(void) {
+    return BOLOS_UX_OK;
+}
+
+char os_secure_memcmp(void *src1, void *src2, unsigned int length) {
+    const uint8_t *a = src1, *b = src2;
+    uint8_t diff = 0;
+    for (unsigned int i = 0; i < length; i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff != 0;
+}
+
+void nvm_write(void *dst_adr, void *src_adr, unsigned int src_len) {
+    // the variables in flash are constants, placed in read-only pages of the host
+    uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) dst_adr & ~(page_size - 1);
+    if (mprotect((void *) start,
+                 (uintptr_t) dst_adr + src_len - start,
+                 PROT_READ | PROT_WRITE) != 0) {
+        abort();
+    }
+
+    if (src_adr == NULL) {
+        memset(dst_adr, 0, src_len);
+    } else {
+        memmove(dst_adr, src_adr, src_len);
+    }
+}
+
+// The random numbers are deterministic (splitmix64), so that the runs can be reproduced
+void cx_rng_no_throw(uint8_t *buffer, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        G_rng_state += 0x9e3779b97f4a7c15;
+        uint64_t z = G_rng_state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        buffer[i] = (uint8_t) (z ^ (z >> 31));
+    }
+}
+
+void os_perso_derive_node_bip32(cx_curve_t curve,
+                                const unsigned int *path,
+                                unsigned int pathLength,
+                                unsigned char *privateKey,
+                                unsigned char *chain) {
+    if (curve != CX_CURVE_SECP256K1) {
+        THROW(INVALID_PARAMETER);
+    }
+
+    uint8_t node[64];  // private key, then chain code
+    cx_hmac_sha512((const uint8_t *) "Bitcoin seed", 12, SEED, sizeof(SEED), node, 64);
+
+    for (unsigned int i = 0; i < pathLength; i++) {
+        // 0x00 || private key for hardened children, compressed public key otherwise; then index
+        uint8_t data[33 + 4];
+        if (path[i] & 0x80000000) {
+            data[0] = 0x00;
+            memcpy(data + 1, node, 32);
+        } else {
+            uint8_t point[65];
+            memcpy(point, SECP256K1_G, sizeof(point));
+            cx_ecfp_scalar_mult(CX_CURVE_SECP256K1, point, sizeof(point), node, 32);
+            data[0] = 0x02 | (point[64] & 1);
+            memcpy(data + 1, point + 1, 32);
+        }
+        for (int j = 0; j < 4; j++) {
+            data[33 + j] = (uint8_t) (path[i] >> (24 - 8 * j));
+        }
+
+        uint8_t I[64];
+        cx_hmac_sha512(node + 32, 32, data, sizeof(data), I, 64);
+        cx_math_addm(node, I, node, SECP256K1_N, 32);
+        memcpy(node + 32, I + 32, 32);
+    }
+
+    if (privateKey != NULL) {
+        memcpy(privateKey, node, 32);
+    }
+    if (chain != NULL) {
+        memcpy(chain, node + 32, 32);
+    }
+}
+
+// Only SLIP-21 is supported; the path is the label, starting with a 0 byte
+void os_perso_derive_node_with_seed_key(unsigned int mode,
+                                        cx_curve_t curve,
+                                        const unsigned int *path,
+                                        unsigned int pathLength,
+                                        unsigned char *privateKey,
+                                        unsigned char *chain,
+                                        unsigned char *seed_key,
+                                        unsigned int seed_key_length) {
+    (void) curve;
+    (void) chain;
+    if (mode != HDW_SLIP21 || seed_key != NULL || seed_key_length != 0) {
+        THROW(INVALID_PARAMETER);
+    }
+
+    uint8_t node[64];  // derivation key, then symmetric key
+    cx_hmac_sha512((const uint8_t *) "Symmetric key seed", 18, SEED, sizeof(SEED), node, 64);
+    cx_hmac_sha512(node, 32, (const uint8_t *) path, pathLength, node, 64);
+    memcpy(privateKey, node + 32, 32);
+}
@@ -0,0 +1,148 @@
+/*
+ * Software implementation of the RIPEMD-160 functions of the SDK used by the app, for the
+ * host-native harness.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "os.h"
+#include "cx.h"
+#include "cx_ripemd160.h"
+
+// message word selection, rotations and constants of the left and of the right lines
+static const uint8_t R_L[80] = {0,  1, 2,  3,  4,  5,  6,  7,  8,  9,  10, 11, 12, 13, 14, 15,
+                                7,  4, 13, 1,  10, 6,  15, 3,  12, 0,  9,  5,  2,  14, 11, 8,
+                                3,  10, 14, 4, 9,  15, 8,  1,  2,  7,  0,  6,  13, 11, 5,  12,
+                                1,  9, 11, 10, 0,  8,  12, 4,  13, 3,  7,  15, 14, 5,  6,  2,
+                                4,  0, 5,  9,  7,  12, 2,  10, 14, 1,  3,  8,  11, 6,  15, 13};
+static const uint8_t R_R[80] = {5,  14, 7,  0,  9,  2,  11, 4,  13, 6,  15, 8,  1,  10, 3,  12,
+                                6,  11, 3,  7,  0,  13, 5,  10, 14, 15, 8,  12, 4,  9,  1,  2,
+                                15, 5,  1,  3,  7,  14, 6,  9,  11, 8,  12, 2,  10, 0,  4,  13,
+                                8,  6,  4,  1,  3,  11, 15, 0,  5,  12, 2,  13, 9,  7,  10, 14,
+                                12, 15, 10, 4,  1,  5,  8,  7,  6,  2,  13, 14, 0,  3,  9,  11};
+static const uint8_t S_L[80] = {11, 14, 15, 12, 5,  8,  7,  9,  11, 13, 14, 15, 6,  7,  9,  8,
+                                7,  6,  8,  13, 11, 9,  7,  15, 7,  12, 15, 9,  11, 7,  13, 12,
+                                11, 13, 6,  7,  14, 9,  13, 15, 14, 8,  13, 6,  5,  12, 7,  5,
+                                11, 12, 14, 15, 14, 15, 9,  8,  9,  14, 5,  6,  8,  6,  5,  12,
+                                9,  15, 5,  11, 6,  8,  13, 12, 5,  12, 13, 14, 11, 8,  5,  6};
+static const uint8_t S_R[80] = {8,  9,  9,  11, 13, 15, 15, 5,  7,  7,  8,  11, 14, 14, 12, 6,
+                                9,  13, 15, 7,  12, 8,  9,  11, 7,  7,  12, 7,  6,  15, 13, 11,
+                                9,  7,  15, 11, 8,  6,  6,  14, 12, 13, 5,  14, 13, 13, 7,  5,
+                                15, 5,  8,  11, 14, 14, 6,  14, 6,  9,  12, 9,  12, 5,  15, 8,
+                                8,  5,  12, 9,  12, 5,  14, 6,  8,  13, 6,  5,  15, 13, 11, 11};
+static const uint32_t K_L[5] = {0x00000000, 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xa953fd4e};
+static const uint32_t K_R[5] = {0x50a28be6, 0x5c4dd124, 0x6d703ef3, 0x7a6d76e9, 0x00000000};
+
+static const uint32_t H0[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static uint32_t f(int j, uint32_t x, uint32_t y, uint32_t z) {
+    switch (j / 16) {
+        case 0:
+            return x ^ y ^ z;
+        case 1:
+            return (x & y) | (~x & z);
+        case 2:
+            return (x | ~y) ^ z;
+        case 3:
+            return (x & z) | (y & ~z);
+        default:
+            return x ^ (y | ~z);
+    }
+}
+
+static uint32_t load_le(const uint8_t *p) {
+    return ((uint32_t) p[3] << 24) | ((uint32_t) p[2] << 16) | ((uint32_t) p[1] << 8) | p[0];
+}
+
+static void store_le(uint8_t *p, uint32_t x) {
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+// The accumulator is stored in little-endian in ctx->acc, so that it can be copied as the digest
+static void compress(cx_ripemd160_t *ctx, const uint8_t block[static 64]) {
+    uint32_t x[16];
+    for (int i = 0; i < 16; i++) {
+        x[i] = load_le(block + 4 * i);
+    }
+
+    uint32_t h[5];
+    for (int i = 0; i < 5; i++) {
+        h[i] = load_le(ctx->acc + 4 * i);
+    }
+
+    uint32_t al = h[0], bl = h[1], cl = h[2], dl = h[3], el = h[4];
+    uint32_t ar = h[0], br = h[1], cr = h[2], dr = h[3], er = h[4];
+    for (int j = 0; j < 80; j++) {
+        uint32_t t = ROTL(al + f(j, bl, cl, dl) + x[R_L[j]] + K_L[j / 16], S_L[j]) + el;
+        al = el;
+        el = dl;
+        dl = ROTL(cl, 10);
+        cl = bl;
+        bl = t;
+
+        t = ROTL(ar + f(79 - j, br, cr, dr) + x[R_R[j]] + K_R[j / 16], S_R[j]) + er;
+        ar = er;
+        er = dr;
+        dr = ROTL(cr, 10);
+        cr = br;
+        br = t;
+    }
+
+    store_le(ctx->acc + 0, h[1] + cl + dr);
+    store_le(ctx->acc + 4, h[2] + dl + er);
+    store_le(ctx->acc + 8, h[3] + el + ar);
+    store_le(ctx->acc + 12, h[4] + al + br);
+    store_le(ctx->acc + 16, h[0] + bl + cr);
+
+    ++ctx->header.counter;
+}
+
+cx_err_t cx_ripemd160_init_no_throw(cx_ripemd160_t *hash) {
+    memset(hash, 0, sizeof(cx_ripemd160_t));
+    hash->header.algo = CX_RIPEMD160;
+    for (int i = 0; i < 5; i++) {
+        store_le(hash->acc + 4 * i, H0[i]);
+    }
+    return CX_OK;
+}
+
+cx_err_t cx_ripemd160_update(cx_ripemd160_t *ctx, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t n = 64 - ctx->blen;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ctx->block + ctx->blen, data, n);
+        ctx->blen += n;
+        data += n;
+        len -= n;
+        if (ctx->blen == 64) {
+            compress(ctx, ctx->block);
+            ctx->blen = 0;
+        }
+    }
+    return CX_OK;
+}
+
+cx_err_t cx_ripemd160_final(cx_ripemd160_t *ctx, uint8_t *digest) {
+    uint64_t bit_len = ((uint64_t) ctx->header.counter * 64 + ctx->blen) * 8;
+
+    uint8_t padding[64 + 8] = {0x80};
+    size_t padding_len = (ctx->blen < 56 ? 56 : 120) - ctx->blen;
+    for (int i = 0; i < 8; i++) {
+        padding[padding_len + i] = (uint8_t) (bit_len >> (8 * i));
+    }
+    cx_ripemd160_update(ctx, padding, padding_len + 8);
+
+    // digest might overlap with the context
+    uint8_t result[CX_RIPEMD160_SIZE];
+    memcpy(result, ctx->acc, CX_RIPEMD160_SIZE);
+    memcpy(digest, result, CX_RIPEMD160_SIZE);
+    return CX_OK;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+/**
+ * State of the software implementation of the SDK in os.c: resets the exception context and the
+ * random number generator, as when the device is started. Called by harness_dispatcher_init.
+ */
+void harness_sdk_reset(void);
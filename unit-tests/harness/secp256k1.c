@@ -0,0 +1,773 @@
+/*
+ * Software implementation of the elliptic curve and modular arithmetic functions of the SDK used
+ * by the app, for the host-native harness. Only secp256k1 is supported, and the numbers are 32
+ * bytes long. The implementation is not constant-time: it must never be used with real keys.
+ *
+ * cx_ecdsa_sign produces the deterministic signatures of RFC 6979, with a low s, like the device.
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "os.h"
+#include "cx.h"
+
+// 256-bit integer, as 8 little-endian 32-bit limbs
+typedef struct {
+    uint32_t w[8];
+} u256_t;
+
+// Parameters of the Montgomery multiplication modulo m, with R = 2^256
+typedef struct {
+    u256_t m;
+    uint32_t m_inv;  // -m^-1 mod 2^32
+    u256_t r2;       // R^2 mod m
+    u256_t one;      // R mod m
+} mont_t;
+
+// Point in Jacobian coordinates, in the Montgomery domain modulo p; Z = 0 at infinity
+typedef struct {
+    u256_t x, y, z;
+} point_t;
+
+static const uint8_t P_BYTES[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xff, 0xff, 0xfc, 0x2f};
+
+static const uint8_t N_BYTES[32] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe,
+    0xba, 0xae, 0xdc, 0xe6, 0xaf, 0x48, 0xa0, 0x3b, 0xbf, 0xd2, 0x5e, 0x8c, 0xd0, 0x36, 0x41, 0x41};
+
+static const uint8_t G_BYTES[65] = {
+    0x04, 0x79, 0xbe, 0x66, 0x7e, 0xf9, 0xdc, 0xbb, 0xac, 0x55, 0xa0, 0x62, 0x95, 0xce, 0x87,
+    0x0b, 0x07, 0x02, 0x9b, 0xfc, 0xdb, 0x2d, 0xce, 0x28, 0xd9, 0x59, 0xf2, 0x81, 0x5b, 0x16,
+    0xf8, 0x17, 0x98, 0x48, 0x3a, 0xda, 0x77, 0x26, 0xa3, 0xc4, 0x65, 0x5d, 0xa4, 0xfb, 0xfc,
+    0x0e, 0x11, 0x08, 0xa8, 0xfd, 0x17, 0xb4, 0x48, 0xa6, 0x85, 0x54, 0x19, 0x9c, 0x47, 0xd0,
+    0x8f, 0xfb, 0x10, 0xd4, 0xb8};
+
+static void u256_from_be(u256_t *r, const uint8_t in[static 32]) {
+    for (int i = 0; i < 8; i++) {
+        const uint8_t *p = in + 4 * (7 - i);
+        r->w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+    }
+}
+
+static void u256_to_be(uint8_t out[static 32], const u256_t *a) {
+    for (int i = 0; i < 8; i++) {
+        uint8_t *p = out + 4 * (7 - i);
+        p[0] = a->w[i] >> 24;
+        p[1] = a->w[i] >> 16;
+        p[2] = a->w[i] >> 8;
+        p[3] = a->w[i];
+    }
+}
+
+static int u256_cmp(const u256_t *a, const u256_t *b) {
+    for (int i = 7; i >= 0; i--) {
+        if (a->w[i] != b->w[i]) {
+            return a->w[i] > b->w[i] ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+static bool u256_is_zero(const u256_t *a) {
+    uint32_t acc = 0;
+    for (int i = 0; i < 8; i++) {
+        acc |= a->w[i];
+    }
+    return acc == 0;
+}
+
+// r = a + b, returns the carry
+static uint32_t u256_add(u256_t *r, const u256_t *a, const u256_t *b) {
+    uint64_t carry = 0;
+    for (int i = 0; i < 8; i++) {
+        carry += (uint64_t) a->w[i] + b->w[i];
+        r->w[i] = (uint32_t) carry;
+        carry >>= 32;
+    }
+    return (uint32_t) carry;
+}
+
+// r = a - b, returns the borrow
+static uint32_t u256_sub(u256_t *r, const u256_t *a, const u256_t *b) {
+    int64_t borrow = 0;
+    for (int i = 0; i < 8; i++) {
+        borrow += (int64_t) a->w[i] - b->w[i];
+        r->w[i] = (uint32_t) borrow;
+        borrow >>= 32;
+    }
+    return borrow != 0;
+}
+
+// Reduces a number smaller than 2^256 modulo m; m > 2^255 for both moduli of the curve
+static void mod_reduce(u256_t *r, const u256_t *a, const u256_t *m) {
+    *r = *a;
+    if (u256_cmp(r, m) >= 0) {
+        u256_sub(r, r, m);
+    }
+}
+
+// r = a + b mod m, for a, b < m
+static void mod_add(u256_t *r, const u256_t *a, const u256_t *b, const u256_t *m) {
+    uint32_t carry = u256_add(r, a, b);
+    if (carry || u256_cmp(r, m) >= 0) {
+        u256_sub(r, r, m);
+    }
+}
+
+// r = a - b mod m, for a, b < m
+static void mod_sub(u256_t *r, const u256_t *a, const u256_t *b, const u256_t *m) {
+    if (u256_sub(r, a, b)) {
+        u256_add(r, r, m);
+    }
+}
+
+static void mont_init(mont_t *ctx, const u256_t *m) {
+    assert(m->w[0] & 1);
+
+    ctx->m = *m;
+
+    // Newton iteration for m^-1 mod 2^32; each step doubles the number of correct bits
+    uint32_t inv = m->w[0];
+    for (int i = 0; i < 5; i++) {
+        inv *= 2 - m->w[0] * inv;
+    }
+    ctx->m_inv = -inv;
+
+    // R mod m = 2^256 - m, as m > 2^255; R^2 mod m is R mod m doubled 256 times
+    u256_t zero = {0};
+    u256_sub(&ctx->one, &zero, m);
+    ctx->r2 = ctx->one;
+    for (int i = 0; i < 256; i++) {
+        mod_add(&ctx->r2, &ctx->r2, &ctx->r2, m);
+    }
+}
+
+// r = a * b * R^-1 mod m, for a, b < m (CIOS method)
+static void mont_mul(u256_t *r, const u256_t *a, const u256_t *b, const mont_t *ctx) {
+    uint32_t t[10] = {0};
+    for (int i = 0; i < 8; i++) {
+        uint64_t carry = 0;
+        for (int j = 0; j < 8; j++) {
+            carry += t[j] + (uint64_t) a->w[j] * b->w[i];
+            t[j] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        carry += t[8];
+        t[8] = (uint32_t) carry;
+        t[9] = (uint32_t) (carry >> 32);
+
+        uint32_t q = t[0] * ctx->m_inv;
+        carry = (t[0] + (uint64_t) q * ctx->m.w[0]) >> 32;
+        for (int j = 1; j < 8; j++) {
+            carry += t[j] + (uint64_t) q * ctx->m.w[j];
+            t[j - 1] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        carry += t[8];
+        t[7] = (uint32_t) carry;
+        t[8] = t[9] + (uint32_t) (carry >> 32);
+    }
+
+    memcpy(r->w, t, sizeof(r->w));
+    if (t[8] != 0 || u256_cmp(r, &ctx->m) >= 0) {
+        u256_sub(r, r, &ctx->m);
+    }
+}
+
+static void mont_to(u256_t *r, const u256_t *a, const mont_t *ctx) {
+    u256_t reduced;
+    mod_reduce(&reduced, a, &ctx->m);
+    mont_mul(r, &reduced, &ctx->r2, ctx);
+}
+
+static void mont_from(u256_t *r, const u256_t *a, const mont_t *ctx) {
+    u256_t one = {{1}};
+    mont_mul(r, a, &one, ctx);
+}
+
+// r = a^e, in the Montgomery domain; e is a big-endian number of e_len bytes
+static void mont_pow(u256_t *r,
+                     const u256_t *a,
+                     const uint8_t *e,
+                     size_t e_len,
+                     const mont_t *ctx) {
+    u256_t acc = ctx->one;
+    for (size_t i = 0; i < e_len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            mont_mul(&acc, &acc, &acc, ctx);
+            if ((e[i] >> bit) & 1) {
+                mont_mul(&acc, &acc, a, ctx);
+            }
+        }
+    }
+    *r = acc;
+}
+
+// r = a^-1, in the Montgomery domain, by Fermat's little theorem (m is prime)
+static void mont_inv(u256_t *r, const u256_t *a, const mont_t *ctx) {
+    u256_t two = {{2}}, exponent;
+    u256_sub(&exponent, &ctx->m, &two);
+    uint8_t e[32];
+    u256_to_be(e, &exponent);
+    mont_pow(r, a, e, sizeof(e), ctx);
+}
+
+// r = a * b mod m, for a, b < m, out of the Montgomery domain
+static void mod_mul(u256_t *r, const u256_t *a, const u256_t *b, const mont_t *ctx) {
+    u256_t t;
+    mont_mul(&t, a, b, ctx);
+    mont_mul(r, &t, &ctx->r2, ctx);
+}
+
+static const mont_t *field(void) {
+    static mont_t ctx;
+    static bool initialized = false;
+    if (!initialized) {
+        u256_t p;
+        u256_from_be(&p, P_BYTES);
+        mont_init(&ctx, &p);
+        initialized = true;
+    }
+    return &ctx;
+}
+
+static const mont_t *scalars(void) {
+    static mont_t ctx;
+    static bool initialized = false;
+    if (!initialized) {
+        u256_t n;
+        u256_from_be(&n, N_BYTES);
+        mont_init(&ctx, &n);
+        initialized = true;
+    }
+    return &ctx;
+}
+
+// Returns false if P is not the uncompressed encoding of a point of the curve
+static bool point_decode(point_t *r, const uint8_t P[static 65]) {
+    const mont_t *f = field();
+    if (P[0] != 0x04) {
+        return false;
+    }
+    u256_t x, y;
+    u256_from_be(&x, P + 1);
+    u256_from_be(&y, P + 33);
+    if (u256_cmp(&x, &f->m) >= 0 || u256_cmp(&y, &f->m) >= 0) {
+        return false;
+    }
+    mont_to(&r->x, &x, f);
+    mont_to(&r->y, &y, f);
+    r->z = f->one;
+
+    // y^2 = x^3 + 7
+    u256_t lhs, rhs, seven = {{7}}, seven_m;
+    mont_mul(&lhs, &r->y, &r->y, f);
+    mont_mul(&rhs, &r->x, &r->x, f);
+    mont_mul(&rhs, &rhs, &r->x, f);
+    mont_to(&seven_m, &seven, f);
+    mod_add(&rhs, &rhs, &seven_m, &f->m);
+    return u256_cmp(&lhs, &rhs) == 0;
+}
+
+// Returns false for the point at infinity, which has no encoding
+static bool point_encode(uint8_t out[static 65], const point_t *P) {
+    const mont_t *f = field();
+    if (u256_is_zero(&P->z)) {
+        return false;
+    }
+    u256_t z_inv, z_inv2, z_inv3, x, y;
+    mont_inv(&z_inv, &P->z, f);
+    mont_mul(&z_inv2, &z_inv, &z_inv, f);
+    mont_mul(&z_inv3, &z_inv2, &z_inv, f);
+    mont_mul(&x, &P->x, &z_inv2, f);
+    mont_mul(&y, &P->y, &z_inv3, f);
+    mont_from(&x, &x, f);
+    mont_from(&y, &y, f);
+    out[0] = 0x04;
+    u256_to_be(out + 1, &x);
+    u256_to_be(out + 33, &y);
+    return true;
+}
+
+static void point_double(point_t *r, const point_t *P) {
+    const mont_t *f = field();
+    const u256_t *m = &f->m;
+    if (u256_is_zero(&P->z) || u256_is_zero(&P->y)) {
+        memset(r, 0, sizeof(point_t));
+        return;
+    }
+    // dbl-2009-l, for a = 0
+    u256_t a, b, c, d, e, ff, t;
+    mont_mul(&a, &P->x, &P->x, f);
+    mont_mul(&b, &P->y, &P->y, f);
+    mont_mul(&c, &b, &b, f);
+    mod_add(&t, &P->x, &b, m);
+    mont_mul(&t, &t, &t, f);
+    mod_sub(&t, &t, &a, m);
+    mod_sub(&t, &t, &c, m);
+    mod_add(&d, &t, &t, m);
+    mod_add(&e, &a, &a, m);
+    mod_add(&e, &e, &a, m);
+    mont_mul(&ff, &e, &e, f);
+
+    point_t out;
+    mod_sub(&out.x, &ff, &d, m);
+    mod_sub(&out.x, &out.x, &d, m);
+    mod_sub(&t, &d, &out.x, m);
+    mont_mul(&t, &e, &t, f);
+    mod_add(&c, &c, &c, m);
+    mod_add(&c, &c, &c, m);
+    mod_add(&c, &c, &c, m);
+    mod_sub(&out.y, &t, &c, m);
+    mont_mul(&out.z, &P->y, &P->z, f);
+    mod_add(&out.z, &out.z, &out.z, m);
+    *r = out;
+}
+
+static void point_add(point_t *r, const point_t *P, const point_t *Q) {
+    const mont_t *f = field();
+    const u256_t *m = &f->m;
+    if (u256_is_zero(&P->z)) {
+        *r = *Q;
+        return;
+    }
+    if (u256_is_zero(&Q->z)) {
+        *r = *P;
+        return;
+    }
+    // add-2007-bl
+    u256_t z1z1, z2z2, u1, u2, s1, s2, h, i, j, rr, v, t;
+    mont_mul(&z1z1, &P->z, &P->z, f);
+    mont_mul(&z2z2, &Q->z, &Q->z, f);
+    mont_mul(&u1, &P->x, &z2z2, f);
+    mont_mul(&u2, &Q->x, &z1z1, f);
+    mont_mul(&s1, &P->y, &Q->z, f);
+    mont_mul(&s1, &s1, &z2z2, f);
+    mont_mul(&s2, &Q->y, &P->z, f);
+    mont_mul(&s2, &s2, &z1z1, f);
+    if (u256_cmp(&u1, &u2) == 0) {
+        if (u256_cmp(&s1, &s2) == 0) {
+            point_double(r, P);
+        } else {
+            memset(r, 0, sizeof(point_t));
+        }
+        return;
+    }
+    mod_sub(&h, &u2, &u1, m);
+    mod_add(&i, &h, &h, m);
+    mont_mul(&i, &i, &i, f);
+    mont_mul(&j, &h, &i, f);
+    mod_sub(&rr, &s2, &s1, m);
+    mod_add(&rr, &rr, &rr, m);
+    mont_mul(&v, &u1, &i, f);
+
+    point_t out;
+    mont_mul(&out.x, &rr, &rr, f);
+    mod_sub(&out.x, &out.x, &j, m);
+    mod_sub(&out.x, &out.x, &v, m);
+    mod_sub(&out.x, &out.x, &v, m);
+    mod_sub(&t, &v, &out.x, m);
+    mont_mul(&t, &rr, &t, f);
+    mont_mul(&s1, &s1, &j, f);
+    mod_add(&s1, &s1, &s1, m);
+    mod_sub(&out.y, &t, &s1, m);
+    mod_add(&t, &P->z, &Q->z, m);
+    mont_mul(&t, &t, &t, f);
+    mod_sub(&t, &t, &z1z1, m);
+    mod_sub(&t, &t, &z2z2, m);
+    mont_mul(&out.z, &t, &h, f);
+    *r = out;
+}
+
+// r = k * P, for a big-endian scalar k of k_len bytes
+static void point_mult(point_t *r, const point_t *P, const uint8_t *k, size_t k_len) {
+    point_t acc;
+    memset(&acc, 0, sizeof(acc));
+    for (size_t i = 0; i < k_len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            point_double(&acc, &acc);
+            if ((k[i] >> bit) & 1) {
+                point_add(&acc, &acc, P);
+            }
+        }
+    }
+    *r = acc;
+}
+
+static void generator_mult(uint8_t out[static 65], const uint8_t k[static 32]) {
+    point_t G, R;
+    point_decode(&G, G_BYTES);
+    point_mult(&R, &G, k, 32);
+    bool ok = point_encode(out, &R);
+    assert(ok);
+    (void) ok;
+}
+
+int cx_math_cmp(const unsigned char *a, const unsigned char *b, unsigned int len) {
+    int c = memcmp(a, b, len);
+    return c > 0 ? 1 : c < 0 ? -1 : 0;
+}
+
+int cx_math_is_zero(const unsigned char *a, unsigned int len) {
+    for (unsigned int i = 0; i < len; i++) {
+        if (a[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int cx_math_sub(unsigned char *r, const unsigned char *a, const unsigned char *b, unsigned int len) {
+    assert(len == 32);
+
+    u256_t x, y;
+    u256_from_be(&x, a);
+    u256_from_be(&y, b);
+    uint32_t borrow = u256_sub(&x, &x, &y);
+    u256_to_be(r, &x);
+    return (int) borrow;
+}
+
+void cx_math_addm(unsigned char *r,
+                  const unsigned char *a,
+                  const unsigned char *b,
+                  const unsigned char *m,
+                  unsigned int len) {
+    assert(len == 32);
+
+    u256_t x, y, mod;
+    u256_from_be(&mod, m);
+    u256_from_be(&x, a);
+    u256_from_be(&y, b);
+    mod_reduce(&x, &x, &mod);
+    mod_reduce(&y, &y, &mod);
+    mod_add(&x, &x, &y, &mod);
+    u256_to_be(r, &x);
+}
+
+void cx_math_multm(unsigned char *r,
+                   const unsigned char *a,
+                   const unsigned char *b,
+                   const unsigned char *m,
+                   unsigned int len) {
+    assert(len == 32);
+
+    mont_t ctx;
+    u256_t x, y, mod;
+    u256_from_be(&mod, m);
+    mont_init(&ctx, &mod);
+    u256_from_be(&x, a);
+    u256_from_be(&y, b);
+    mod_reduce(&x, &x, &mod);
+    mod_reduce(&y, &y, &mod);
+    mod_mul(&x, &x, &y, &ctx);
+    u256_to_be(r, &x);
+}
+
+void cx_math_powm(unsigned char *r,
+                  const unsigned char *a,
+                  const unsigned char *e,
+                  unsigned int len_e,
+                  const unsigned char *m,
+                  unsigned int len) {
+    assert(len == 32);
+
+    mont_t ctx;
+    u256_t x, mod;
+    u256_from_be(&mod, m);
+    mont_init(&ctx, &mod);
+    u256_from_be(&x, a);
+    mont_to(&x, &x, &ctx);
+    mont_pow(&x, &x, e, len_e, &ctx);
+    mont_from(&x, &x, &ctx);
+    u256_to_be(r, &x);
+}
+
+int cx_ecfp_add_point(cx_curve_t curve,
+                      unsigned char *R,
+                      const unsigned char *P,
+                      const unsigned char *Q,
+                      unsigned int X_len) {
+    assert(curve == CX_CURVE_SECP256K1 && X_len == 65);
+
+    point_t p, q;
+    if (!point_decode(&p, P) || !point_decode(&q, Q)) {
+        THROW(INVALID_PARAMETER);
+    }
+    point_add(&p, &p, &q);
+    return point_encode(R, &p) ? 65 : 0;
+}
+
+int cx_ecfp_scalar_mult(cx_curve_t curve,
+                        unsigned char *P,
+                        unsigned int P_len,
+                        const unsigned char *k,
+                        unsigned int k_len) {
+    assert(curve == CX_CURVE_SECP256K1 && P_len == 65);
+
+    point_t p;
+    if (!point_decode(&p, P)) {
+        THROW(INVALID_PARAMETER);
+    }
+    point_mult(&p, &p, k, k_len);
+    return point_encode(P, &p) ? 65 : 0;
+}
+
+cx_err_t cx_ecfp_init_private_key_no_throw(cx_curve_t curve,
+                                           const uint8_t *rawkey,
+                                           size_t key_len,
+                                           cx_ecfp_private_key_t *pvkey) {
+    if (curve != CX_CURVE_SECP256K1 || (rawkey != NULL && key_len != 32)) {
+        return CX_INVALID_PARAMETER;
+    }
+    pvkey->curve = curve;
+    pvkey->d_len = rawkey != NULL ? 32 : 0;
+    if (rawkey != NULL) {
+        memcpy(pvkey->d, rawkey, 32);
+    }
+    return CX_OK;
+}
+
+int cx_ecfp_init_private_key(cx_curve_t curve,
+                             const unsigned char *rawkey,
+                             unsigned int key_len,
+                             cx_ecfp_private_key_t *pvkey) {
+    if (cx_ecfp_init_private_key_no_throw(curve, rawkey, key_len, pvkey) != CX_OK) {
+        THROW(INVALID_PARAMETER);
+    }
+    return key_len;
+}
+
+cx_err_t cx_ecfp_generate_pair_no_throw(cx_curve_t curve,
+                                        cx_ecfp_public_key_t *pubkey,
+                                        cx_ecfp_private_key_t *privkey,
+                                        bool keepprivate) {
+    // the app always derives its keys, there is no randomly generated one
+    if (curve != CX_CURVE_SECP256K1 || !keepprivate || privkey->d_len != 32) {
+        return CX_INVALID_PARAMETER;
+    }
+    u256_t d;
+    u256_from_be(&d, privkey->d);
+    if (u256_is_zero(&d) || u256_cmp(&d, &scalars()->m) >= 0) {
+        return CX_INVALID_PARAMETER;
+    }
+    pubkey->curve = curve;
+    pubkey->W_len = 65;
+    generator_mult(pubkey->W, privkey->d);
+    return CX_OK;
+}
+
+int cx_ecfp_generate_pair(cx_curve_t curve,
+                          cx_ecfp_public_key_t *pubkey,
+                          cx_ecfp_private_key_t *privkey,
+                          int keepprivate) {
+    if (cx_ecfp_generate_pair_no_throw(curve, pubkey, privkey, keepprivate) != CX_OK) {
+        THROW(INVALID_PARAMETER);
+    }
+    return 0;
+}
+
+// Appends the DER encoding of the INTEGER a to out, and returns its length
+static size_t der_append_integer(uint8_t *out, const u256_t *a) {
+    uint8_t be[33] = {0};
+    u256_to_be(be + 1, a);
+    size_t start = 0;
+    while (start < 32 && be[start] == 0 && (be[start + 1] & 0x80) == 0) {
+        ++start;
+    }
+    out[0] = 0x02;
+    out[1] = (uint8_t) (33 - start);
+    memcpy(out + 2, be + start, 33 - start);
+    return 2 + 33 - start;
+}
+
+static void rfc6979_hmac(const uint8_t key[static 32],
+                         const uint8_t *data,
+                         size_t data_len,
+                         uint8_t out[static 32]) {
+    cx_hmac_sha256(key, 32, data, data_len, out, 32);
+}
+
+int cx_ecdsa_sign(const cx_ecfp_private_key_t *pvkey,
+                  int mode,
+                  cx_md_t hashID,
+                  const unsigned char *hash,
+                  unsigned int hash_len,
+                  unsigned char *sig,
+                  unsigned int sig_len,
+                  unsigned int *info) {
+    if ((mode & CX_MASK_RND) != CX_RND_RFC6979 || hashID != CX_SHA256 || hash_len != 32 ||
+        pvkey->d_len != 32 || sig_len < 72) {
+        THROW(INVALID_PARAMETER);
+    }
+
+    const mont_t *sc = scalars();
+    const u256_t *n = &sc->m;
+
+    u256_t d, h;
+    u256_from_be(&d, pvkey->d);
+    u256_from_be(&h, hash);
+    mod_reduce(&h, &h, n);
+    uint8_t h1[32];
+    u256_to_be(h1, &h);
+
+    // RFC 6979, section 3.2
+    uint8_t V[32], K[32], buf[32 + 1 + 32 + 32];
+    memset(V, 0x01, sizeof(V));
+    memset(K, 0x00, sizeof(K));
+    for (uint8_t step = 0; step < 2; step++) {
+        memcpy(buf, V, 32);
+        buf[32] = step;
+        memcpy(buf + 33, pvkey->d, 32);
+        memcpy(buf + 65, h1, 32);
+        rfc6979_hmac(K, buf, sizeof(buf), K);
+        rfc6979_hmac(K, V, 32, V);
+    }
+
+    u256_t k, r, s;
+    uint8_t R[65];
+    while (true) {
+        rfc6979_hmac(K, V, 32, V);
+        u256_from_be(&k, V);
+        if (!u256_is_zero(&k) && u256_cmp(&k, n) < 0) {
+            generator_mult(R, V);
+            u256_from_be(&r, R + 1);
+            *info = (R[64] & 1) ? CX_ECCINFO_PARITY_ODD : 0;
+            if (u256_cmp(&r, n) >= 0) {
+                *info |= CX_ECCINFO_xGTn;
+                u256_sub(&r, &r, n);
+            }
+            if (!u256_is_zero(&r)) {
+                // s = k^-1 (h + r d) mod n
+                u256_t k_inv, t;
+                mont_to(&k_inv, &k, sc);
+                mont_inv(&k_inv, &k_inv, sc);
+                mont_from(&k_inv, &k_inv, sc);
+                mod_mul(&t, &r, &d, sc);
+                mod_add(&t, &t, &h, n);
+                mod_mul(&s, &k_inv, &t, sc);
+                if (!u256_is_zero(&s)) {
+                    break;
+                }
+            }
+        }
+        memcpy(buf, V, 32);
+        buf[32] = 0x00;
+        rfc6979_hmac(K, buf, 33, K);
+        rfc6979_hmac(K, V, 32, V);
+    }
+
+    // canonical signature: s <= n / 2; negating s flips the parity of R
+    u256_t half_n;
+    for (int i = 0; i < 8; i++) {
+        half_n.w[i] = (n->w[i] >> 1) | (i < 7 ? n->w[i + 1] << 31 : 0);
+    }
+    if (u256_cmp(&s, &half_n) > 0) {
+        u256_sub(&s, n, &s);
+        *info ^= CX_ECCINFO_PARITY_ODD;
+    }
+
+    size_t len = 2;
+    len += der_append_integer(sig + len, &r);
+    len += der_append_integer(sig + len, &s);
+    sig[0] = 0x30;
+    sig[1] = (uint8_t) (len - 2);
+    return (int) len;
+}
+
+// BIP-340 tagged hash of the concatenation of data1, data2 and data3 (each 32 bytes, or NULL)
+static void tagged_hash(const char *tag,
+                        const uint8_t *data1,
+                        const uint8_t *data2,
+                        const uint8_t *data3,
+                        uint8_t out[static 32]) {
+    uint8_t tag_hash[32];
+    cx_hash_sha256((const uint8_t *) tag, strlen(tag), tag_hash, 32);
+
+    cx_sha256_t ctx;
+    cx_sha256_init_no_throw(&ctx);
+    cx_sha256_update(&ctx, tag_hash, 32);
+    cx_sha256_update(&ctx, tag_hash, 32);
+    cx_sha256_update(&ctx, data1, 32);
+    if (data2 != NULL) {
+        cx_sha256_update(&ctx, data2, 32);
+    }
+    if (data3 != NULL) {
+        cx_sha256_update(&ctx, data3, 32);
+    }
+    cx_sha256_final(&ctx, out);
+}
+
+cx_err_t cx_ecschnorr_sign_no_throw(const cx_ecfp_private_key_t *pvkey,
+                                    uint32_t mode,
+                                    cx_md_t hashID,
+                                    const uint8_t *msg,
+                                    size_t msg_len,
+                                    uint8_t *sig,
+                                    size_t *sig_len) {
+    if ((mode & CX_MASK_EC) != CX_ECSCHNORR_BIP0340 || hashID != CX_SHA256 || msg_len != 32 ||
+        pvkey->d_len != 32 || *sig_len < 64) {
+        return CX_INVALID_PARAMETER;
+    }
+
+    const mont_t *sc = scalars();
+    const u256_t *n = &sc->m;
+
+    u256_t d;
+    u256_from_be(&d, pvkey->d);
+    if (u256_is_zero(&d) || u256_cmp(&d, n) >= 0) {
+        return CX_INVALID_PARAMETER;
+    }
+
+    uint8_t P[65];
+    generator_mult(P, pvkey->d);
+    if (P[64] & 1) {
+        u256_sub(&d, n, &d);
+    }
+    uint8_t d_bytes[32];
+    u256_to_be(d_bytes, &d);
+
+    // the auxiliary random data, as with CX_RND_TRNG
+    uint8_t aux[32], t[32];
+    cx_rng_no_throw(aux, sizeof(aux));
+    tagged_hash("BIP0340/aux", aux, NULL, NULL, t);
+    for (int i = 0; i < 32; i++) {
+        t[i] ^= d_bytes[i];
+    }
+
+    uint8_t rand[32];
+    tagged_hash("BIP0340/nonce", t, P + 1, msg, rand);
+    u256_t k;
+    u256_from_be(&k, rand);
+    mod_reduce(&k, &k, n);
+    if (u256_is_zero(&k)) {
+        return CX_INVALID_PARAMETER;
+    }
+    uint8_t k_bytes[32], R[65];
+    u256_to_be(k_bytes, &k);
+    generator_mult(R, k_bytes);
+    if (R[64] & 1) {
+        u256_sub(&k, n, &k);
+    }
+
+    uint8_t e_bytes[32];
+    tagged_hash("BIP0340/challenge", R + 1, P + 1, msg, e_bytes);
+    u256_t e, s;
+    u256_from_be(&e, e_bytes);
+    mod_reduce(&e, &e, n);
+    mod_mul(&s, &e, &d, sc);
+    mod_add(&s, &s, &k, n);
+
+    memcpy(sig, R + 1, 32);
+    u256_to_be(sig + 32, &s);
+    *sig_len = 64;
+
+    explicit_bzero(d_bytes, sizeof(d_bytes));
+    explicit_bzero(k_bytes, sizeof(k_bytes));
+    return CX_OK;
+}
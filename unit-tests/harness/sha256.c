@@ -0,0 +1,171 @@
+/*
+ * Software implementation of the SHA-256 functions of the SDK used by the app, for the host-native
+ * harness. Only CX_SHA256 contexts are supported by cx_hash.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "os.h"
+#include "cx.h"
+#include "cx_ram.h"
+
+union cx_u G_cx;
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t H0[8] = {0x6a09e667,
+                               0xbb67ae85,
+                               0x3c6ef372,
+                               0xa54ff53a,
+                               0x510e527f,
+                               0x9b05688c,
+                               0x1f83d9ab,
+                               0x5be0cd19};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static uint32_t load_be(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void store_be(uint8_t *p, uint32_t x) {
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+// The accumulator is stored in big-endian in ctx->acc, so that it can be copied as the digest
+static void compress(cx_sha256_t *ctx, const uint8_t block[static 64]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = load_be(block + 4 * i);
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t h[8];
+    for (int i = 0; i < 8; i++) {
+        h[i] = load_be(ctx->acc + 4 * i);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] +
+                      w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    store_be(ctx->acc + 0, h[0] + a);
+    store_be(ctx->acc + 4, h[1] + b);
+    store_be(ctx->acc + 8, h[2] + c);
+    store_be(ctx->acc + 12, h[3] + d);
+    store_be(ctx->acc + 16, h[4] + e);
+    store_be(ctx->acc + 20, h[5] + f);
+    store_be(ctx->acc + 24, h[6] + g);
+    store_be(ctx->acc + 28, h[7] + hh);
+
+    ++ctx->header.counter;
+}
+
+cx_err_t cx_sha256_init_no_throw(cx_sha256_t *hash) {
+    memset(hash, 0, sizeof(cx_sha256_t));
+    hash->header.algo = CX_SHA256;
+    for (int i = 0; i < 8; i++) {
+        store_be(hash->acc + 4 * i, H0[i]);
+    }
+    return CX_OK;
+}
+
+int cx_sha256_init(cx_sha256_t *hash) {
+    cx_sha256_init_no_throw(hash);
+    return CX_SHA256;
+}
+
+cx_err_t cx_sha256_update(cx_sha256_t *ctx, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t n = 64 - ctx->blen;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ctx->block + ctx->blen, data, n);
+        ctx->blen += n;
+        data += n;
+        len -= n;
+        if (ctx->blen == 64) {
+            compress(ctx, ctx->block);
+            ctx->blen = 0;
+        }
+    }
+    return CX_OK;
+}
+
+cx_err_t cx_sha256_final(cx_sha256_t *ctx, uint8_t *digest) {
+    uint64_t bit_len = ((uint64_t) ctx->header.counter * 64 + ctx->blen) * 8;
+
+    uint8_t padding[64 + 8] = {0x80};
+    size_t padding_len = (ctx->blen < 56 ? 56 : 120) - ctx->blen;
+    for (int i = 0; i < 8; i++) {
+        padding[padding_len + i] = (uint8_t) (bit_len >> (56 - 8 * i));
+    }
+    cx_sha256_update(ctx, padding, padding_len + 8);
+
+    // digest might overlap with the context
+    uint8_t result[32];
+    memcpy(result, ctx->acc, 32);
+    memcpy(digest, result, 32);
+    return CX_OK;
+}
+
+int cx_hash(cx_hash_t *hash,
+            int mode,
+            const unsigned char *in,
+            unsigned int len,
+            unsigned char *out,
+            unsigned int out_len) {
+    assert(hash->algo == CX_SHA256);
+
+    cx_sha256_t *ctx = (cx_sha256_t *) hash;
+    cx_sha256_update(ctx, in, len);
+    if (mode & CX_LAST) {
+        assert(out == NULL || out_len >= 32);
+        uint8_t digest[32];
+        cx_sha256_final(ctx, digest);
+        if (out != NULL) {
+            memcpy(out, digest, 32);
+        }
+        return 32;
+    }
+    return 0;
+}
+
+int cx_hash_sha256(const unsigned char *in, unsigned int len, unsigned char *out, unsigned int out_len) {
+    assert(out_len >= 32);
+
+    cx_sha256_t ctx;
+    cx_sha256_init_no_throw(&ctx);
+    cx_sha256_update(&ctx, in, len);
+    cx_sha256_final(&ctx, out);
+    return 32;
+}
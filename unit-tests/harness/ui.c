@@ -0,0 +1,63 @@
+/*
+ * The screens of the app in the host-native harness: every screen is approved by the user. Only
+ * the ones of the handlers compiled in the harness are implemented.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ui/display.h"
+#include "swap/swap_globals.h"
+
+// the harness never runs the app as a library called from the Exchange app
+swap_globals_t G_swap_state;
+
+bool ui_display_wallet_address(dispatcher_context_t *context,
+                               const char *wallet_name,
+                               const char *address) {
+    (void) context;
+    (void) wallet_name;
+    (void) address;
+    return true;
+}
+
+bool ui_authorize_wallet_spend(dispatcher_context_t *context, const char *wallet_name) {
+    (void) context;
+    (void) wallet_name;
+    return true;
+}
+
+bool ui_warn_external_inputs(dispatcher_context_t *context) {
+    (void) context;
+    return true;
+}
+
+bool ui_warn_unverified_segwit_inputs(dispatcher_context_t *context) {
+    (void) context;
+    return true;
+}
+
+bool ui_warn_nondefault_sighash(dispatcher_context_t *context) {
+    (void) context;
+    return true;
+}
+
+bool ui_validate_output(dispatcher_context_t *context,
+                        int index,
+                        const char *address_or_description,
+                        const char *coin_name,
+                        uint64_t amount) {
+    (void) context;
+    (void) index;
+    (void) address_or_description;
+    (void) coin_name;
+    (void) amount;
+    return true;
+}
+
+bool ui_validate_transaction(dispatcher_context_t *context, const char *coin_name, uint64_t fee) {
+    (void) context;
+    (void) coin_name;
+    (void) fee;
+    return true;
+}
@@ -39,7 +39,7 @@
 /*                                   RAND                                  */
 /* ======================================================================= */
 
-// #include "lcx_rng.h"
+#include "lcx_rng.h"
 
 /* ======================================================================= */
 /*                                   HASH                                 */
@@ -61,7 +61,7 @@
 /*                                 HASH MAC                                */
 /* ======================================================================= */
 
-// #include "lcx_hmac.h"
+#include "lcx_hmac.h"
 
 /* ======================================================================= */
 /*                                  PKDF2                                  */
@@ -93,8 +93,8 @@
 
 #include "lcx_ecfp.h"
 
-// #include "lcx_ecdsa.h"
-// #include "lcx_ecschnorr.h"
+#include "lcx_ecdsa.h"
+#include "lcx_ecschnorr.h"
 // #include "lcx_eddsa.h"
 
 /* ======================================================================= */
@@ -113,7 +113,7 @@
 /*                                    MATH                                 */
 /* ======================================================================= */
 
-// #include "lcx_math.h"
+#include "lcx_math.h"
 
 /* ======================================================================= */
 /*                                    DEBUG                                */
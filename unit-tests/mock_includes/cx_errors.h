@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t cx_err_t;
+
+#define CX_OK 0x00000000
+#define CX_INVALID_PARAMETER 0xFFFFFF88
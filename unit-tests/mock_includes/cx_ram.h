@@ -0,0 +1,10 @@
+#pragma once
+
+#include "cx.h"
+
+// Subset of the union of the contexts in the cxram section used by the app
+union cx_u {
+    cx_sha256_t sha256;
+};
+
+extern union cx_u G_cx;
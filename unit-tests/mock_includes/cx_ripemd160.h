@@ -0,0 +1,7 @@
+#pragma once
+
+#include "cx.h"
+
+cx_err_t cx_ripemd160_update(cx_ripemd160_t *ctx, const uint8_t *data, size_t len);
+
+cx_err_t cx_ripemd160_final(cx_ripemd160_t *ctx, uint8_t *digest);
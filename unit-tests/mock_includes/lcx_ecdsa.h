@@ -0,0 +1,13 @@
+#pragma once
+
+#include "lcx_ecfp.h"
+#include "lcx_hash.h"
+
+int cx_ecdsa_sign(const cx_ecfp_private_key_t *pvkey,
+                  int mode,
+                  cx_md_t hashID,
+                  const unsigned char *hash,
+                  unsigned int hash_len,
+                  unsigned char *sig,
+                  unsigned int sig_len,
+                  unsigned int *info);
@@ -592,4 +592,18 @@ CXCALL int cx_ecfp_generate_pair2(
         PLENGTH(scc__cx_scc_struct_size_ecfp_privkey_from_curve__curve),
     int keepprivate, cx_md_t hashID);
 
+#include <stdbool.h>
+
+#include "cx_errors.h"
+
+cx_err_t cx_ecfp_init_private_key_no_throw(cx_curve_t curve,
+                                           const uint8_t *rawkey,
+                                           size_t key_len,
+                                           cx_ecfp_private_key_t *pvkey);
+
+cx_err_t cx_ecfp_generate_pair_no_throw(cx_curve_t curve,
+                                        cx_ecfp_public_key_t *pubkey,
+                                        cx_ecfp_private_key_t *privkey,
+                                        bool keepprivate);
+
 #endif
@@ -0,0 +1,28 @@
+#pragma once
+
+// Big-endian integers of len bytes; only the moduli of secp256k1 (p and n) are supported as m
+
+int cx_math_cmp(const unsigned char *a, const unsigned char *b, unsigned int len);
+
+int cx_math_is_zero(const unsigned char *a, unsigned int len);
+
+int cx_math_sub(unsigned char *r, const unsigned char *a, const unsigned char *b, unsigned int len);
+
+void cx_math_addm(unsigned char *r,
+                  const unsigned char *a,
+                  const unsigned char *b,
+                  const unsigned char *m,
+                  unsigned int len);
+
+void cx_math_multm(unsigned char *r,
+                   const unsigned char *a,
+                   const unsigned char *b,
+                   const unsigned char *m,
+                   unsigned int len);
+
+void cx_math_powm(unsigned char *r,
+                  const unsigned char *a,
+                  const unsigned char *e,
+                  unsigned int len_e,
+                  const unsigned char *m,
+                  unsigned int len);
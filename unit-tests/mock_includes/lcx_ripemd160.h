@@ -56,4 +56,8 @@ typedef struct cx_ripemd160_s cx_ripemd160_t;
 CXCALL int
 cx_ripemd160_init(cx_ripemd160_t *hash PLENGTH(sizeof(cx_ripemd160_t)));
 
+#include "cx_errors.h"
+
+cx_err_t cx_ripemd160_init_no_throw(cx_ripemd160_t *hash);
+
 #endif
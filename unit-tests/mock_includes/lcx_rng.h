@@ -0,0 +1,6 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+void cx_rng_no_throw(uint8_t *buffer, size_t len);
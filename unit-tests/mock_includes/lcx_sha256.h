@@ -77,4 +77,12 @@ CXCALL int cx_hash_sha256(const unsigned char WIDE *in PLENGTH(len),
                           unsigned int len, unsigned char *out PLENGTH(out_len),
                           unsigned int out_len);
 
+#include "cx_errors.h"
+
+cx_err_t cx_sha256_init_no_throw(cx_sha256_t *hash);
+
+cx_err_t cx_sha256_update(cx_sha256_t *ctx, const uint8_t *data, size_t len);
+
+cx_err_t cx_sha256_final(cx_sha256_t *ctx, uint8_t *digest);
+
 #endif
@@ -209,7 +209,8 @@ int setjmp(jmp_buf __jmpb);
 // depending on the execution address. Can be used even if code is executing at
 // the same place where it had been linked.
 #ifndef PIC
-#define PIC(x) pic((unsigned int)x)
+// the host builds are not position-independent
+#define PIC(x) ((void *) (x))
 unsigned int pic(unsigned int linked_address);
 #endif
 
@@ -918,7 +919,8 @@ typedef enum bolos_ux_e {
   BOLOS_UX_LAST_ID, // keep that one at the end
 } bolos_ux_t;
 
-typedef char bolos_bool_t;
+// char is unsigned on the devices, but not on the hosts
+typedef unsigned char bolos_bool_t;
 #define BOLOS_TRUE BOLOS_UX_OK
 #define BOLOS_FALSE BOLOS_UX_CANCEL
 
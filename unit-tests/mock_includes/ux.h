@@ -0,0 +1,4 @@
+#pragma once
+
+// Only the types used by the prototypes of boilerplate/io.h
+typedef struct bagl_element_s bagl_element_t;
@@ -33,8 +33,48 @@ static void test_apdu_parser(void **state) {
     assert_memory_equal(cmd.data, ((uint8_t[]){0x00, 0x01, 0x02, 0x03, 0x04}), cmd.lc);
 }
 
+static void test_apdu_parser_extended(void **state) {
+    (void) state;
+    // extended-length APDUs: Lc is 0, followed by the length on 2 bytes
+    uint8_t apdu_bad_min_len[] = {0xF8, 0x01, 0x00, 0x00, 0x00, 0x01};        // truncated length
+    uint8_t apdu_bad_zero_lc[] = {0xF8, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00};  // Lc = 0
+    uint8_t apdu_bad_lc[] = {0xF8, 0x01, 0x00, 0x00, 0x00, 0x01, 0x01, 0xAA};  // Lc = 257
+    uint8_t apdu[7 + 300] = {0xF8, 0x01, 0x00, 0x02, 0x00, 0x01, 0x2C};       // Lc = 300
+    for (int i = 0; i < 300; i++) {
+        apdu[7 + i] = (uint8_t) i;
+    }
+
+    command_t cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    assert_false(apdu_parser(&cmd, apdu_bad_min_len, sizeof(apdu_bad_min_len)));
+
+    memset(&cmd, 0, sizeof(cmd));
+    assert_false(apdu_parser(&cmd, apdu_bad_zero_lc, sizeof(apdu_bad_zero_lc)));
+
+    memset(&cmd, 0, sizeof(cmd));
+    assert_false(apdu_parser(&cmd, apdu_bad_lc, sizeof(apdu_bad_lc)));
+
+    memset(&cmd, 0, sizeof(cmd));
+    assert_true(apdu_parser(&cmd, apdu, sizeof(apdu)));
+    assert_int_equal(cmd.cla, 0xF8);
+    assert_int_equal(cmd.ins, 0x01);
+    assert_int_equal(cmd.p1, 0x00);
+    assert_int_equal(cmd.p2, 0x02);
+    assert_int_equal(cmd.lc, 300);
+    assert_ptr_equal(cmd.data, apdu + 7);
+
+    // a short APDU with no data is still valid
+    uint8_t apdu_no_data[] = {0xE1, 0x09, 0x00, 0x00, 0x00};
+    memset(&cmd, 0, sizeof(cmd));
+    assert_true(apdu_parser(&cmd, apdu_no_data, sizeof(apdu_no_data)));
+    assert_int_equal(cmd.lc, 0);
+    assert_null(cmd.data);
+}
+
 int main() {
-    const struct CMUnitTest tests[] = {cmocka_unit_test(test_apdu_parser)};
+    const struct CMUnitTest tests[] = {cmocka_unit_test(test_apdu_parser),
+                                       cmocka_unit_test(test_apdu_parser_extended)};
 
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
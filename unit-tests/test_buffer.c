@@ -159,6 +159,32 @@ static void test_buffer_read(void **state) {
     assert_false(buffer_read_varint(&buf_varint, &varint));
 }
 
+static void test_buffer_borrow_bytes(void **state) {
+    (void) state;
+
+    uint8_t temp[8] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08};
+    buffer_t buf = {.ptr = temp, .size = sizeof(temp), .offset = 0};
+
+    const uint8_t *borrowed = NULL;
+    assert_true(buffer_borrow_bytes(&buf, 0, &borrowed));  // borrow zero bytes
+    assert_ptr_equal(borrowed, temp);
+    assert_int_equal(buf.offset, 0);
+
+    assert_true(buffer_borrow_bytes(&buf, 3, &borrowed));
+    assert_ptr_equal(borrowed, temp);  // no copy: points inside the buffer
+    assert_int_equal(buf.offset, 3);
+
+    assert_true(buffer_borrow_bytes(&buf, 5, &borrowed));
+    assert_ptr_equal(borrowed, temp + 3);
+    assert_int_equal(buf.offset, 8);
+
+    borrowed = NULL;
+    assert_true(buffer_seek_set(&buf, 6));
+    assert_false(buffer_borrow_bytes(&buf, 3, &borrowed));  // only 2 bytes left
+    assert_null(borrowed);
+    assert_int_equal(buf.offset, 6);  // the buffer is not advanced on failure
+}
+
 static void test_buffer_peek(void **state) {
     (void) state;
 
@@ -487,6 +513,7 @@ int main() {
                                        cmocka_unit_test(test_buffer_seek),
                                        cmocka_unit_test(test_buffer_get_cur),
                                        cmocka_unit_test(test_buffer_read),
+                                       cmocka_unit_test(test_buffer_borrow_bytes),
                                        cmocka_unit_test(test_buffer_peek),
                                        cmocka_unit_test(test_buffer_peek_n),
                                        cmocka_unit_test(test_buffer_write),
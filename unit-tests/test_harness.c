@@ -0,0 +1,1417 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <cmocka.h>
+
+#include "boilerplate/constants.h"
+#include "boilerplate/sw.h"
+#include "common/merkle.h"
+#include "common/varint.h"
+#include "common/psbt.h"
+#include "common/write.h"
+#include "crypto.h"
+#include "handler/handlers.h"
+#include "handler/lib/access_plan.h"
+#include "handler/lib/check_merkle_tree_sorted.h"
+#include "handler/lib/get_merkle_leaf_element.h"
+#include "handler/lib/get_merkle_leaf_elements.h"
+#include "handler/lib/get_merkle_leaf_hash.h"
+#include "handler/lib/get_merkle_leaf_hashes.h"
+#include "handler/lib/get_merkle_leaf_index.h"
+#include "handler/lib/get_merkle_preimage.h"
+#include "handler/lib/get_merkleized_map.h"
+#include "handler/lib/get_merkleized_map_value.h"
+#include "handler/lib/get_preimage.h"
+#include "handler/lib/hash_refs.h"
+#include "handler/lib/map_commitment_cache.h"
+#include "handler/lib/merkle_frontier.h"
+#include "handler/lib/policy.h"
+#include "handler/lib/preimage_cache.h"
+#include "handler/lib/preimage_reader.h"
+#include "handler/lib/psbt_parse_rawtx.h"
+#include "handler/lib/tree_stream.h"
+#include "handler/lib/wallet_registry.h"
+#include "handler/lib/wallet_session.h"
+#include "handler/sign_psbt/extract_bip32_derivation.h"
+
+#include "harness/client.h"
+#include "harness/dispatcher.h"
+
+#define N_LEAVES 100
+
+static harness_client_t client;
+static dispatcher_context_t *dc;
+
+// element i of the test list is the byte string of length 1 + i % 50, filled with the value i
+static uint8_t elements_data[N_LEAVES][50];
+static const uint8_t *elements[N_LEAVES];
+static size_t element_lens[N_LEAVES];
+
+static int setup(void **state) {
+    (void) state;
+
+    harness_client_init(&client);
+    dc = harness_dispatcher_init(&client);
+
+    for (int i = 0; i < N_LEAVES; i++) {
+        element_lens[i] = 1 + i % 50;
+        memset(elements_data[i], i, element_lens[i]);
+        elements[i] = elements_data[i];
+    }
+    return 0;
+}
+
+static int teardown(void **state) {
+    (void) state;
+
+    harness_client_free(&client);
+    return 0;
+}
+
+static void test_get_preimage(void **state) {
+    (void) state;
+
+    // long enough to require GET_MORE_ELEMENTS
+    uint8_t preimage[600];
+    for (size_t i = 0; i < sizeof(preimage); i++) {
+        preimage[i] = (uint8_t) (i * 7);
+    }
+    harness_client_add_preimage(&client, preimage, sizeof(preimage));
+
+    uint8_t hash[32];
+    cx_hash_sha256(preimage, sizeof(preimage), hash, 32);
+
+    uint8_t out[sizeof(preimage)];
+    assert_int_equal(call_get_preimage(dc, hash, out, sizeof(out)), sizeof(preimage));
+    assert_memory_equal(out, preimage, sizeof(preimage));
+    assert_true(harness_get_n_interruptions() > 1);
+
+    // unknown preimage
+    hash[0] ^= 1;
+    assert_true(call_get_preimage(dc, hash, out, sizeof(out)) < 0);
+}
+
+static void test_preimage_reader(void **state) {
+    (void) state;
+
+    uint8_t preimage[600];
+    for (size_t i = 0; i < sizeof(preimage); i++) {
+        preimage[i] = (uint8_t) (i * 11);
+    }
+    harness_client_add_preimage(&client, preimage, sizeof(preimage));
+
+    uint8_t hash[32];
+    cx_hash_sha256(preimage, sizeof(preimage), hash, 32);
+
+    // read in pieces that do not match the responses of the client
+    preimage_reader_t reader;
+    assert_int_equal(preimage_reader_init(&reader, dc, hash), sizeof(preimage));
+    uint8_t out[sizeof(preimage)];
+    for (size_t offset = 0; offset < sizeof(preimage); offset += 37) {
+        size_t len = sizeof(preimage) - offset < 37 ? sizeof(preimage) - offset : 37;
+        assert_int_equal(preimage_reader_read(&reader, out + offset, len), 0);
+    }
+    assert_memory_equal(out, preimage, sizeof(preimage));
+    assert_int_equal(preimage_reader_finish(&reader, hash), 0);
+
+    // reading past the end fails
+    assert_int_equal(preimage_reader_init(&reader, dc, hash), sizeof(preimage));
+    assert_int_equal(preimage_reader_read(&reader, out, sizeof(preimage)), 0);
+    assert_true(preimage_reader_read(&reader, out, 1) < 0);
+
+    // the pre-image must be read entirely, and match the hash
+    assert_int_equal(preimage_reader_init(&reader, dc, hash), sizeof(preimage));
+    assert_int_equal(preimage_reader_read(&reader, out, sizeof(preimage) - 1), 0);
+    assert_true(preimage_reader_finish(&reader, hash) < 0);
+
+    assert_int_equal(preimage_reader_init(&reader, dc, hash), sizeof(preimage));
+    assert_int_equal(preimage_reader_read(&reader, out, sizeof(preimage)), 0);
+    uint8_t wrong_hash[32];
+    memcpy(wrong_hash, hash, 32);
+    wrong_hash[31] ^= 1;
+    assert_true(preimage_reader_finish(&reader, wrong_hash) < 0);
+
+    // unknown preimage
+    assert_true(preimage_reader_init(&reader, dc, wrong_hash) < 0);
+}
+
+static void test_get_merkle_leaf_element(void **state) {
+    (void) state;
+
+    uint8_t root[32];
+    harness_client_add_list(&client, elements, element_lens, N_LEAVES, root);
+
+    for (int i = 0; i < N_LEAVES; i++) {
+        uint8_t out[50];
+        assert_int_equal(call_get_merkle_leaf_element(dc, root, N_LEAVES, i, out, sizeof(out)),
+                         element_lens[i]);
+        assert_memory_equal(out, elements[i], element_lens[i]);
+    }
+
+    // wrong tree size
+    uint8_t out[50];
+    assert_true(call_get_merkle_leaf_element(dc, root, N_LEAVES + 1, 0, out, sizeof(out)) < 0);
+}
+
+static void test_get_merkle_leaf_elements(void **state) {
+    (void) state;
+
+    uint8_t root[32];
+    harness_client_add_list(&client, elements, element_lens, N_LEAVES, root);
+
+    // the data does not fit a single response, except for a tree of a single leaf
+    const uint32_t sets[][MAX_MERKLE_LEAF_ELEMENTS_BATCH] = {{0},
+                                                             {N_LEAVES - 1},
+                                                             {3, 4},
+                                                             {1, 49, 98},
+                                                             {48, 49, 97, 99},
+                                                             {10, 11, 12, 13}};
+    const size_t set_sizes[] = {1, 1, 2, 3, 4, 4};
+    for (size_t k = 0; k < sizeof(set_sizes) / sizeof(set_sizes[0]); k++) {
+        uint8_t out[MAX_MERKLE_LEAF_ELEMENTS_BATCH][50];
+        merkle_leaf_element_request_t requests[MAX_MERKLE_LEAF_ELEMENTS_BATCH];
+        for (size_t i = 0; i < set_sizes[k]; i++) {
+            requests[i] = (merkle_leaf_element_request_t){sets[k][i], out[i], sizeof(out[i]), -1};
+        }
+
+        assert_int_equal(call_get_merkle_leaf_elements(dc, root, N_LEAVES, requests, set_sizes[k]),
+                         0);
+        for (size_t i = 0; i < set_sizes[k]; i++) {
+            assert_int_equal(requests[i].element_len, element_lens[sets[k][i]]);
+            assert_memory_equal(out[i], elements[sets[k][i]], element_lens[sets[k][i]]);
+        }
+    }
+
+    // a single round trip if the data fits the response
+    uint8_t single_root[32];
+    harness_client_add_list(&client, &elements[2], &element_lens[2], 1, single_root);
+    uint8_t out[2][50];
+    merkle_leaf_element_request_t single_request = {0, out[0], sizeof(out[0]), -1};
+    unsigned int n_interruptions = harness_get_n_interruptions();
+    assert_int_equal(call_get_merkle_leaf_elements(dc, single_root, 1, &single_request, 1), 0);
+    assert_int_equal(harness_get_n_interruptions(), n_interruptions + 1);
+    assert_int_equal(single_request.element_len, element_lens[2]);
+    assert_memory_equal(out[0], elements[2], element_lens[2]);
+
+    merkle_leaf_element_request_t requests[] = {{5, out[0], sizeof(out[0]), -1},
+                                                {7, out[1], sizeof(out[1]), -1}};
+
+    // wrong tree size
+    assert_true(call_get_merkle_leaf_elements(dc, root, N_LEAVES + 1, requests, 2) < 0);
+
+    // wrong root
+    uint8_t wrong_root[32];
+    memcpy(wrong_root, root, 32);
+    wrong_root[0] ^= 1;
+    assert_true(call_get_merkle_leaf_elements(dc, wrong_root, N_LEAVES, requests, 2) < 0);
+
+    // output buffer too short
+    requests[1].out_len = element_lens[7] - 1;
+    assert_true(call_get_merkle_leaf_elements(dc, root, N_LEAVES, requests, 2) < 0);
+    requests[1].out_len = sizeof(out[1]);
+
+    // indexes not strictly increasing
+    requests[1].leaf_index = 5;
+    assert_true(call_get_merkle_leaf_elements(dc, root, N_LEAVES, requests, 2) < 0);
+}
+
+static void test_get_merkle_leaf_hashes(void **state) {
+    (void) state;
+
+    uint8_t leaves[N_LEAVES][32];
+    for (int i = 0; i < N_LEAVES; i++) {
+        merkle_compute_element_hash(elements[i], element_lens[i], leaves[i]);
+    }
+
+    uint8_t root[32];
+    harness_client_add_tree(&client, (const uint8_t(*)[32]) leaves, N_LEAVES, root);
+
+    for (int first = 0; first + MAX_MERKLE_LEAF_HASHES_BATCH <= N_LEAVES; first += 7) {
+        uint8_t out[MAX_MERKLE_LEAF_HASHES_BATCH][32];
+        assert_int_equal(
+            call_get_merkle_leaf_hashes(dc, root, N_LEAVES, first, MAX_MERKLE_LEAF_HASHES_BATCH, out),
+            0);
+        assert_memory_equal(out, leaves[first], sizeof(out));
+    }
+}
+
+static void test_hash_refs(void **state) {
+    (void) state;
+
+    uint8_t leaves[2][N_LEAVES][32];
+    uint8_t roots[2][32];
+    for (int t = 0; t < 2; t++) {
+        for (int i = 0; i < N_LEAVES; i++) {
+            merkle_compute_element_hash(elements[i], element_lens[i], leaves[t][i]);
+            leaves[t][i][0] ^= t;
+        }
+        harness_client_add_tree(&client, (const uint8_t(*)[32]) leaves[t], N_LEAVES, roots[t]);
+    }
+
+    // reads the leaves of the two trees alternately, as for the keys and values of a map
+    unsigned int n_interruptions[2];
+    for (int refs = 0; refs < 2; refs++) {
+        dc = harness_dispatcher_init(&client);
+        if (refs) {
+            hash_refs_reset(HASH_REFS_PROTOCOL_VERSION);
+        }
+        for (int i = 0; i < N_LEAVES; i++) {
+            for (int t = 0; t < 2; t++) {
+                uint8_t out[32];
+                assert_int_equal(call_get_merkle_leaf_hash(dc, roots[t], N_LEAVES, i, out), 0);
+                assert_memory_equal(out, leaves[t][i], 32);
+            }
+        }
+        n_interruptions[refs] = harness_get_n_interruptions();
+    }
+    // without references, the proofs with more than 6 hashes do not fit a single response
+    assert_true(n_interruptions[0] > 2 * N_LEAVES);
+    // with them, only the first proofs, and the few ones after the upper hashes of a tree were
+    // replaced, need a GET_MORE_ELEMENTS
+    assert_true(n_interruptions[1] < 2 * N_LEAVES + 8);
+
+    // without the kept nodes, the proofs climb to the root, referencing the hashes in the table: a
+    // reference to a wrong hash fails the proof, and empties the table of the device
+    merkle_frontier_reset();
+    uint8_t out[32];
+    assert_true(hash_refs_find(roots[0]) >= 0);
+    for (int i = 0; i < HASH_REFS_TABLE_SIZE; i++) {
+        if (memcmp(G_hash_refs.entries[i].hash, roots[0], 32) != 0) {
+            G_hash_refs.entries[i].hash[0] ^= 1;
+        }
+    }
+    assert_true(call_get_merkle_leaf_hash(dc, roots[0], N_LEAVES, N_LEAVES - 2, out) < 0);
+    assert_int_equal(hash_refs_find(roots[0]), -1);
+
+    // the references of the client to the entries of the device that were emptied are rejected
+    assert_true(call_get_merkle_leaf_hash(dc, roots[0], N_LEAVES, N_LEAVES - 3, out) < 0);
+
+    // once a proof is verified, the proofs of the next leaves stop at the level of their ancestor
+    // kept by the device
+    harness_client_reset_hash_refs(&client);
+    hash_refs_reset(HASH_REFS_PROTOCOL_VERSION);
+    uint32_t directions;
+    int n_directions = merkle_get_directions(N_LEAVES, N_LEAVES - 2, &directions);
+    uint8_t known_hash[32];
+    assert_int_equal(call_get_merkle_leaf_hash(dc, roots[0], N_LEAVES, N_LEAVES - 2, out), 0);
+    assert_true(merkle_frontier_find(roots[0], N_LEAVES, directions, n_directions, known_hash) > 0);
+
+    // a kept node with a wrong hash fails the proof
+    for (int i = 0; i < MERKLE_FRONTIER_SIZE; i++) {
+        G_merkle_frontier.entries[i].hash[0] ^= 1;
+    }
+    assert_true(call_get_merkle_leaf_hash(dc, roots[0], N_LEAVES, N_LEAVES - 1, out) < 0);
+}
+
+#define N_PLAN_MAPS 12
+
+static void test_access_plan(void **state) {
+    (void) state;
+
+    // maps with the keys 0x00 to 0x07, except the key 0x01 in one map out of three
+    uint8_t key_data[8], values_data[N_PLAN_MAPS][8][32];
+    const uint8_t *keys[8], *values[8];
+    size_t key_lens[8], value_lens[8];
+    merkleized_map_commitment_t maps[N_PLAN_MAPS];
+    uint8_t commitments_data[N_PLAN_MAPS][9 + 64];
+    const uint8_t *commitments[N_PLAN_MAPS];
+    size_t commitment_lens[N_PLAN_MAPS];
+    for (int i = 0; i < N_PLAN_MAPS; i++) {
+        size_t n_keys = 0;
+        for (int k = 0; k < 8; k++) {
+            if (k == 1 && i % 3 == 2) {
+                continue;
+            }
+            key_data[k] = k;
+            keys[n_keys] = &key_data[k];
+            key_lens[n_keys] = 1;
+            value_lens[n_keys] = k == 0 ? 32 : 8;
+            memset(values_data[i][k], 16 * i + k, 32);
+            values[n_keys] = values_data[i][k];
+            ++n_keys;
+        }
+        harness_client_add_mapping(&client, keys, key_lens, values, value_lens, n_keys, &maps[i]);
+
+        int pos = varint_write(commitments_data[i], 0, maps[i].size);
+        memcpy(commitments_data[i] + pos, maps[i].keys_root, 32);
+        memcpy(commitments_data[i] + pos + 32, maps[i].values_root, 32);
+        commitments[i] = commitments_data[i];
+        commitment_lens[i] = pos + 64;
+    }
+    uint8_t maps_root[32];
+    harness_client_add_list(&client, commitments, commitment_lens, N_PLAN_MAPS, maps_root);
+
+    const uint8_t *const plan_keys[] = {&key_data[0], &key_data[1]};
+    const uint8_t plan_key_lens[] = {1, 1};
+
+    // the plans are not used if the client does not support them
+    assert_true(call_announce_access_plan(dc, maps_root, N_PLAN_MAPS, plan_keys, plan_key_lens, 2) <
+                0);
+
+    // the values of the maps with and without the plan, with short and with extended responses;
+    // the indexes of the keys are only known for the even maps
+    unsigned int n_interruptions[2][2];
+    for (int extended = 0; extended < 2; extended++) {
+        client.max_response_len = extended ? MAX_EXTENDED_APDU_DATA_LEN : 255;
+        for (int plan = 0; plan < 2; plan++) {
+            dc = harness_dispatcher_init(&client);
+            if (plan) {
+                access_plan_reset(ACCESS_PLAN_PROTOCOL_VERSION);
+                assert_int_equal(call_announce_access_plan(dc,
+                                                           maps_root,
+                                                           N_PLAN_MAPS,
+                                                           plan_keys,
+                                                           plan_key_lens,
+                                                           2),
+                                 0);
+            }
+            for (int i = 0; i < N_PLAN_MAPS; i++) {
+                maps[i].has_key_index = false;
+                memset(maps[i].key_index, 0, sizeof(maps[i].key_index));
+                if (i % 2 == 0) {
+                    maps[i].has_key_index = true;
+                    for (int k = 0; k < 8; k++) {
+                        if (k != 1 || i % 3 != 2) {
+                            merkleized_map_record_key_index(&maps[i],
+                                                            &key_data[k],
+                                                            1,
+                                                            k - (k > 1 && i % 3 == 2));
+                        }
+                    }
+                }
+
+                uint8_t out[2][32];
+                merkleized_map_value_request_t requests[] = {{&key_data[0], 1, out[0], 32},
+                                                             {&key_data[1], 1, out[1], 32}};
+                int n_found = plan ? call_get_planned_map_values(dc, &maps[i], requests, 2)
+                                   : call_get_merkleized_map_values(dc, &maps[i], requests, 2);
+                assert_int_equal(n_found, i % 3 == 2 ? 1 : 2);
+                assert_int_equal(requests[0].value_len, 32);
+                assert_memory_equal(out[0], values_data[i][0], 32);
+                if (i % 3 == 2) {
+                    assert_int_equal(requests[1].value_len, -1);
+                } else {
+                    assert_int_equal(requests[1].value_len, 8);
+                    assert_memory_equal(out[1], values_data[i][1], 8);
+                }
+            }
+            n_interruptions[extended][plan] = harness_get_n_interruptions();
+        }
+    }
+    // with extended responses, each of them carries the values of more than one map
+    assert_true(n_interruptions[1][1] < n_interruptions[1][0]);
+
+    // a wrong value fails, as well as the values after it
+    dc = harness_dispatcher_init(&client);
+    access_plan_reset(ACCESS_PLAN_PROTOCOL_VERSION);
+    for (size_t i = 0; i < client.n_preimages; i++) {
+        harness_preimage_t *preimage = &client.preimages[i];
+        if (preimage->len == 1 + 8 && preimage->data[1] == 16 * 1 + 1) {
+            preimage->data[1] ^= 1;
+        }
+    }
+    assert_int_equal(
+        call_announce_access_plan(dc, maps_root, N_PLAN_MAPS, plan_keys, plan_key_lens, 2),
+        0);
+    uint8_t out[2][32];
+    merkleized_map_value_request_t requests[] = {{&key_data[0], 1, out[0], 32},
+                                                 {&key_data[1], 1, out[1], 32}};
+    assert_int_equal(call_get_planned_map_values(dc, &maps[0], requests, 2), 2);
+    assert_true(call_get_planned_map_values(dc, &maps[1], requests, 2) < 0);
+    assert_true(call_get_planned_map_values(dc, &maps[2], requests, 2) < 0);
+}
+
+// checks that the elements of the test list are enumerated in order
+static void check_sorted_callback(dispatcher_context_t *dc,
+                                  void *state,
+                                  const merkleized_map_commitment_t *map_commitment,
+                                  int index,
+                                  buffer_t *data) {
+    (void) dc;
+    (void) map_commitment;
+
+    int *n_elements = state;
+    assert_int_equal(index, *n_elements);
+    assert_int_equal(data->size, element_lens[index]);
+    assert_memory_equal(data->ptr, elements[index], element_lens[index]);
+    ++*n_elements;
+}
+
+static void test_tree_stream(void **state) {
+    (void) state;
+
+    // trees with one leaf, with complete trees and with incomplete ones
+    const size_t sizes[] = {1, 2, 3, 7, 64, N_LEAVES};
+    for (size_t t = 0; t < sizeof(sizes) / sizeof(sizes[0]); t++) {
+        uint8_t root[32];
+        harness_client_add_list(&client, elements, element_lens, sizes[t], root);
+
+        // the enumeration one leaf at a time, then streamed
+        unsigned int n_interruptions[2];
+        for (int streamed = 0; streamed < 2; streamed++) {
+            dc = harness_dispatcher_init(&client);
+            if (streamed) {
+                tree_stream_reset(TREE_STREAM_PROTOCOL_VERSION);
+            }
+            int n_elements = 0;
+            assert_int_equal(call_check_merkle_tree_sorted_with_callback(dc,
+                                                                         &n_elements,
+                                                                         root,
+                                                                         sizes[t],
+                                                                         check_sorted_callback,
+                                                                         NULL),
+                             0);
+            assert_int_equal(n_elements, sizes[t]);
+            n_interruptions[streamed] = harness_get_n_interruptions();
+        }
+        assert_true(n_interruptions[1] <= n_interruptions[0]);
+        if (sizes[t] > 2) {
+            assert_true(n_interruptions[1] < n_interruptions[0]);
+        }
+    }
+
+    // the leaves must be sorted
+    const uint8_t *unsorted[] = {elements[1], elements[0], elements[2]};
+    const size_t unsorted_lens[] = {element_lens[1], element_lens[0], element_lens[2]};
+    uint8_t unsorted_root[32];
+    harness_client_add_list(&client, unsorted, unsorted_lens, 3, unsorted_root);
+    dc = harness_dispatcher_init(&client);
+    tree_stream_reset(TREE_STREAM_PROTOCOL_VERSION);
+    assert_true(call_check_merkle_tree_sorted(dc, unsorted_root, 3) < 0);
+    // the stream is ended after a failure
+    assert_true(tree_stream_is_available(3));
+
+    // a wrong size fails, as the root does not match
+    uint8_t root[32];
+    harness_client_add_list(&client, elements, element_lens, 5, root);
+    dc = harness_dispatcher_init(&client);
+    tree_stream_reset(TREE_STREAM_PROTOCOL_VERSION);
+    assert_true(call_check_merkle_tree_sorted(dc, root, 4) < 0);
+
+    // a wrong leaf that is still sorted fails
+    for (size_t i = 0; i < client.n_preimages; i++) {
+        harness_preimage_t *preimage = &client.preimages[i];
+        if (preimage->len == 1 + element_lens[3] && preimage->data[1] == 3) {
+            preimage->data[preimage->len - 1] ^= 1;
+        }
+    }
+    dc = harness_dispatcher_init(&client);
+    tree_stream_reset(TREE_STREAM_PROTOCOL_VERSION);
+    assert_true(call_check_merkle_tree_sorted(dc, root, 5) < 0);
+}
+
+static void test_get_merkle_leaf_index(void **state) {
+    (void) state;
+
+    uint8_t root[32];
+    harness_client_add_list(&client, elements, element_lens, N_LEAVES, root);
+
+    for (int i = 0; i < N_LEAVES; i += 9) {
+        uint8_t leaf_hash[32];
+        merkle_compute_element_hash(elements[i], element_lens[i], leaf_hash);
+        assert_int_equal(call_get_merkle_leaf_index(dc, N_LEAVES, root, leaf_hash), i);
+    }
+
+    uint8_t missing[32] = {0};
+    assert_int_equal(call_get_merkle_leaf_index(dc, N_LEAVES, root, missing),
+                     MERKLE_LEAF_INDEX_NOT_FOUND);
+
+    // a failed interruption is not reported as a missing leaf
+    uint8_t unknown_root[32] = {0};
+    int res = call_get_merkle_leaf_index(dc, N_LEAVES, unknown_root, missing);
+    assert_true(res < 0);
+    assert_int_not_equal(res, MERKLE_LEAF_INDEX_NOT_FOUND);
+}
+
+static void test_get_merkleized_map_value(void **state) {
+    (void) state;
+
+    const uint8_t key0[] = {0x01}, key1[] = {0x02, 0xaa}, key2[] = {0x03};
+    const uint8_t value0[] = {0x10}, value1[] = {0x20, 0x21}, value2[] = {0x30, 0x31, 0x32};
+
+    const uint8_t *keys[] = {key0, key1, key2};
+    const size_t key_lens[] = {sizeof(key0), sizeof(key1), sizeof(key2)};
+    const uint8_t *values[] = {value0, value1, value2};
+    const size_t value_lens[] = {sizeof(value0), sizeof(value1), sizeof(value2)};
+
+    merkleized_map_commitment_t map;
+    harness_client_add_mapping(&client, keys, key_lens, values, value_lens, 3, &map);
+
+    uint8_t out[8];
+    assert_int_equal(call_get_merkleized_map_value(dc, &map, key1, sizeof(key1), out, sizeof(out)),
+                     sizeof(value1));
+    assert_memory_equal(out, value1, sizeof(value1));
+
+    assert_int_equal(call_get_merkleized_map_value(dc, &map, key2, sizeof(key2), out, sizeof(out)),
+                     sizeof(value2));
+    assert_memory_equal(out, value2, sizeof(value2));
+
+    const uint8_t missing_key[] = {0x04};
+    assert_true(
+        call_get_merkleized_map_value(dc, &map, missing_key, sizeof(missing_key), out, sizeof(out)) <
+        0);
+}
+
+static void test_get_merkleized_map_values(void **state) {
+    (void) state;
+
+    const uint8_t key0[] = {0x01}, key1[] = {0x02, 0xaa}, key2[] = {0x03};
+    const uint8_t value0[] = {0x10}, value1[] = {0x20, 0x21}, value2[] = {0x30, 0x31, 0x32};
+
+    const uint8_t *keys[] = {key0, key1, key2};
+    const size_t key_lens[] = {sizeof(key0), sizeof(key1), sizeof(key2)};
+    const uint8_t *values[] = {value0, value1, value2};
+    const size_t value_lens[] = {sizeof(value0), sizeof(value1), sizeof(value2)};
+
+    merkleized_map_commitment_t map;
+    harness_client_add_mapping(&client, keys, key_lens, values, value_lens, 3, &map);
+
+    // not in the order of the keys, and with a missing key
+    const uint8_t missing_key[] = {0x04};
+    uint8_t out[4][8];
+    merkleized_map_value_request_t requests[] = {{key2, sizeof(key2), out[0], sizeof(out[0])},
+                                                 {missing_key, sizeof(missing_key), out[1], 8},
+                                                 {key0, sizeof(key0), out[2], sizeof(out[2])},
+                                                 {key1, sizeof(key1), out[3], sizeof(out[3])}};
+    assert_int_equal(call_get_merkleized_map_values(dc, &map, requests, 4), 3);
+    assert_int_equal(requests[0].value_len, sizeof(value2));
+    assert_memory_equal(out[0], value2, sizeof(value2));
+    assert_int_equal(requests[1].value_len, -1);
+    assert_int_equal(requests[2].value_len, sizeof(value0));
+    assert_memory_equal(out[2], value0, sizeof(value0));
+    assert_int_equal(requests[3].value_len, sizeof(value1));
+    assert_memory_equal(out[3], value1, sizeof(value1));
+
+    // only missing keys
+    assert_int_equal(call_get_merkleized_map_values(dc, &map, &requests[1], 1), 0);
+    assert_int_equal(requests[1].value_len, -1);
+
+    // repeated key
+    requests[1].key = key0;
+    assert_true(call_get_merkleized_map_values(dc, &map, requests, 4) < 0);
+}
+
+static void test_extended_responses(void **state) {
+    (void) state;
+
+    uint8_t root[32];
+    harness_client_add_list(&client, elements, element_lens, N_LEAVES, root);
+
+    // the Merkle proofs of the leaves, with their elements, do not fit a short APDU
+    uint8_t out[50];
+    for (int i = 0; i < N_LEAVES; i++) {
+        assert_int_equal(call_get_merkle_leaf_element(dc, root, N_LEAVES, i, out, sizeof(out)),
+                         element_lens[i]);
+    }
+    assert_true(harness_get_n_interruptions() > N_LEAVES);
+
+    // the same data, if the responses can be sent as extended-length APDUs
+    client.max_response_len = MAX_EXTENDED_APDU_DATA_LEN;
+    dc = harness_dispatcher_init(&client);
+    for (int i = 0; i < N_LEAVES; i++) {
+        assert_int_equal(call_get_merkle_leaf_element(dc, root, N_LEAVES, i, out, sizeof(out)),
+                         element_lens[i]);
+        assert_memory_equal(out, elements[i], element_lens[i]);
+    }
+    // one GET_MERKLE_LEAF_ELEMENTS per element, that includes the Merkle proof, followed by a
+    // GET_MORE_ELEMENTS if the data is longer than 255 bytes, as its length in a response is 1 byte
+    unsigned int expected_n_interruptions = 0;
+    for (int i = 0; i < N_LEAVES; i++) {
+        uint32_t directions;
+        int depth = merkle_get_directions(N_LEAVES, i, &directions);
+        size_t data_len = 32 * (depth + 1) + 1 + 1 + element_lens[i];
+        expected_n_interruptions += (data_len + 254) / 255;
+    }
+    assert_int_equal(harness_get_n_interruptions(), expected_n_interruptions);
+}
+
+// Gets the element of a leaf with a Merkle proof and a preimage request, as
+// call_get_merkle_leaf_element does in the builds without USE_SINGLE_ROUND_TRIP_LEAF_ELEMENTS
+static int get_leaf_element_with_preimage(uint8_t root[static 32],
+                                          uint32_t leaf_index,
+                                          uint8_t *out,
+                                          size_t out_len) {
+    uint8_t leaf_hash[32];
+    if (call_get_merkle_leaf_hash(dc, root, N_LEAVES, leaf_index, leaf_hash) < 0) {
+        return -1;
+    }
+    return call_get_merkle_preimage(dc, leaf_hash, out, out_len);
+}
+
+static void test_preimage_cache(void **state) {
+    (void) state;
+
+    uint8_t root[32];
+    harness_client_add_list(&client, elements, element_lens, N_LEAVES, root);
+
+    uint8_t out[50];
+    assert_int_equal(get_leaf_element_with_preimage(root, 7, out, sizeof(out)),
+                     element_lens[7]);
+    unsigned int n_interruptions = harness_get_n_interruptions();
+
+    // the element is returned from the cache: only the Merkle proof is requested
+    memset(out, 0, sizeof(out));
+    assert_int_equal(get_leaf_element_with_preimage(root, 7, out, sizeof(out)),
+                     element_lens[7]);
+    assert_memory_equal(out, elements[7], element_lens[7]);
+    assert_int_equal(harness_get_n_interruptions(), 2 * n_interruptions - 1);
+
+    // a hit still fails if the output buffer is too short
+    assert_true(get_leaf_element_with_preimage(root, 7, out, element_lens[7] - 1) < 0);
+
+    // the oldest entries are replaced when the cache is full
+    for (int i = 0; i < PREIMAGE_CACHE_SIZE; i++) {
+        assert_int_equal(get_leaf_element_with_preimage(root, 10 + i, out, sizeof(out)),
+                         element_lens[10 + i]);
+    }
+    n_interruptions = harness_get_n_interruptions();
+    assert_int_equal(get_leaf_element_with_preimage(root, 7, out, sizeof(out)),
+                     element_lens[7]);
+    assert_memory_equal(out, elements[7], element_lens[7]);
+    assert_true(harness_get_n_interruptions() > n_interruptions + 1);
+
+    // the cache does not survive the command
+    dc = harness_dispatcher_init(&client);
+    assert_int_equal(get_leaf_element_with_preimage(root, 10 + PREIMAGE_CACHE_SIZE - 1,
+                                                    out, sizeof(out)),
+                     element_lens[10 + PREIMAGE_CACHE_SIZE - 1]);
+    assert_true(harness_get_n_interruptions() > 1);
+}
+
+static void test_map_commitment_cache(void **state) {
+    (void) state;
+
+    const uint8_t key0[] = {0x01}, key1[] = {0x02, 0xaa};
+    const uint8_t value0[] = {0x10};
+    const uint8_t *keys[] = {key0, key1};
+    const size_t key_lens[] = {sizeof(key0), sizeof(key1)};
+
+    // a list of the commitments of 3 maps, with different values
+    uint8_t commitments_data[3][9 + 2 * 32];
+    const uint8_t *commitments[3];
+    size_t commitment_lens[3];
+    merkleized_map_commitment_t maps[3];
+    for (int i = 0; i < 3; i++) {
+        uint8_t value[] = {0x20, (uint8_t) i};
+        const uint8_t *map_values[] = {value0, value};
+        const size_t map_value_lens[] = {sizeof(value0), sizeof(value)};
+        harness_client_add_mapping(&client,
+                                   keys,
+                                   key_lens,
+                                   map_values,
+                                   map_value_lens,
+                                   2,
+                                   &maps[i]);
+
+        int len = varint_write(commitments_data[i], 0, maps[i].size);
+        memcpy(commitments_data[i] + len, maps[i].keys_root, 32);
+        memcpy(commitments_data[i] + len + 32, maps[i].values_root, 32);
+        commitments[i] = commitments_data[i];
+        commitment_lens[i] = len + 2 * 32;
+    }
+
+    uint8_t root[32];
+    harness_client_add_list(&client, commitments, commitment_lens, 3, root);
+
+    // the commitment is fetched without enumerating the keys
+    merkleized_map_commitment_t map;
+    assert_int_equal(call_get_merkleized_map_unchecked(dc, root, 3, 1, &map), 0);
+    assert_memory_equal(map.values_root, maps[1].values_root, 32);
+    assert_false(map.has_key_index);
+    unsigned int n_interruptions = harness_get_n_interruptions();
+
+    // the cached commitment is used, but the keys are enumerated as they were not verified yet
+    assert_int_equal(call_get_merkleized_map(dc, root, 3, 1, &map), 0);
+    assert_true(map.has_key_index);
+    assert_true(harness_get_n_interruptions() > n_interruptions);
+
+    // then, nothing is requested from the client
+    n_interruptions = harness_get_n_interruptions();
+    memset(&map, 0, sizeof(map));
+    assert_int_equal(call_get_merkleized_map(dc, root, 3, 1, &map), 0);
+    assert_int_equal(map.size, 2);
+    assert_memory_equal(map.keys_root, maps[1].keys_root, 32);
+    assert_memory_equal(map.values_root, maps[1].values_root, 32);
+    assert_true(map.has_key_index);
+    assert_int_equal(harness_get_n_interruptions(), n_interruptions);
+    assert_int_equal(call_get_merkleized_map_unchecked(dc, root, 3, 1, &map), 0);
+    assert_int_equal(harness_get_n_interruptions(), n_interruptions);
+
+    // the maps are identified by their tree and their index
+    assert_int_equal(call_get_merkleized_map(dc, root, 3, 2, &map), 0);
+    assert_memory_equal(map.values_root, maps[2].values_root, 32);
+    assert_true(harness_get_n_interruptions() > n_interruptions);
+    n_interruptions = harness_get_n_interruptions();
+    assert_true(call_get_merkleized_map(dc, root, 2, 1, &map) < 0);
+    assert_true(harness_get_n_interruptions() > n_interruptions);
+
+    // the cache does not survive the command
+    dc = harness_dispatcher_init(&client);
+    assert_int_equal(call_get_merkleized_map(dc, root, 3, 1, &map), 0);
+    assert_true(harness_get_n_interruptions() > 0);
+}
+
+// Writes the value of a BIP32 derivation of a PSBT field with fingerprint 0xf5acc2fd and the given
+// derivation steps; for the taproot fields, it is prefixed by n_hashes leaf hashes.
+static size_t make_bip32_derivation(uint8_t *out,
+                                    bool is_tap,
+                                    int n_hashes,
+                                    const uint32_t *steps,
+                                    int n_steps) {
+    size_t len = 0;
+    if (is_tap) {
+        out[len++] = n_hashes;  // only for n_hashes < 0xFD
+        memset(out + len, 0x42, 32 * n_hashes);
+        len += 32 * n_hashes;
+    }
+    const uint8_t fpt[] = {0xf5, 0xac, 0xc2, 0xfd};
+    memcpy(out + len, fpt, 4);
+    len += 4;
+    for (int i = 0; i < n_steps; i++) {
+        for (int b = 0; b < 4; b++) {
+            out[len++] = (uint8_t) (steps[i] >> (8 * b));
+        }
+    }
+    return len;
+}
+
+static void test_extract_bip32_derivation(void **state) {
+    (void) state;
+
+    const uint32_t steps[MAX_BIP32_PATH_STEPS + 1] = {0x80000054, 0x80000001, 0x80000000, 1, 7};
+
+    static uint8_t values_data[7][1 + 32 * 10 + 4 * (2 + MAX_BIP32_PATH_STEPS)];
+    const uint8_t *values[7];
+    size_t value_lens[7];
+
+    value_lens[0] = make_bip32_derivation(values_data[0], false, 0, steps, 5);
+    value_lens[1] = make_bip32_derivation(values_data[1], true, 2, steps, 3);
+    // longer than a response, therefore streamed with GET_MORE_ELEMENTS
+    value_lens[2] = make_bip32_derivation(values_data[2], true, 10, steps, 5);
+    value_lens[3] = make_bip32_derivation(values_data[3], true, 0, steps, 2);
+    // the length is not a multiple of 4
+    value_lens[4] = make_bip32_derivation(values_data[4], false, 0, steps, 1) + 2;
+    // too many derivation steps
+    value_lens[5] =
+        make_bip32_derivation(values_data[5], false, 0, steps, MAX_BIP32_PATH_STEPS + 1);
+    // more leaf hashes than the length of the value
+    value_lens[6] = make_bip32_derivation(values_data[6], true, 2, steps, 0);
+    values_data[6][0] = 3;
+
+    for (int i = 0; i < 7; i++) {
+        values[i] = values_data[i];
+    }
+
+    uint8_t root[32];
+    harness_client_add_list(&client, values, value_lens, 7, root);
+
+    const struct {
+        int key_type;
+        int expected_len;
+    } cases[] = {{PSBT_IN_BIP32_DERIVATION, 5},
+                 {PSBT_IN_TAP_BIP32_DERIVATION, 3},
+                 {PSBT_OUT_TAP_BIP32_DERIVATION, 5},
+                 {PSBT_IN_TAP_BIP32_DERIVATION, 2},
+                 {PSBT_OUT_BIP32_DERIVATION, -1},
+                 {PSBT_IN_BIP32_DERIVATION, -1},
+                 {PSBT_IN_TAP_BIP32_DERIVATION, -1}};
+
+    for (int i = 0; i < 7; i++) {
+        uint32_t out[1 + MAX_BIP32_PATH_STEPS];
+        int res = extract_bip32_derivation(dc, cases[i].key_type, root, 7, i, out);
+        if (cases[i].expected_len < 0) {
+            assert_true(res < 0);
+            continue;
+        }
+        assert_int_equal(res, cases[i].expected_len);
+        assert_int_equal(out[0], 0xf5acc2fd);
+        for (int k = 0; k < res; k++) {
+            assert_int_equal(out[1 + k], steps[k]);
+        }
+    }
+
+    // a non-taproot value parsed as a taproot one
+    uint32_t out[1 + MAX_BIP32_PATH_STEPS];
+    assert_true(extract_bip32_derivation(dc, PSBT_IN_TAP_BIP32_DERIVATION, root, 7, 0, out) < 0);
+}
+
+static void put_bytes(uint8_t *out, size_t *len, const uint8_t *data, size_t n) {
+    memcpy(out + *len, data, n);
+    *len += n;
+}
+
+static void put_fill(uint8_t *out, size_t *len, uint8_t byte, size_t n) {
+    memset(out + *len, byte, n);
+    *len += n;
+}
+
+// Serializes a transaction with 2 inputs and 3 outputs; the scriptPubKey of the last output is
+// longer than MAX_PREVOUT_SCRIPTPUBKEY_LEN. Returns the length of the serialization.
+static size_t make_rawtx(uint8_t *out, bool segwit) {
+    size_t len = 0;
+
+    put_bytes(out, &len, (const uint8_t[]){0x02, 0x00, 0x00, 0x00}, 4);
+    if (segwit) {
+        put_bytes(out, &len, (const uint8_t[]){0x00, 0x01}, 2);
+    }
+
+    out[len++] = 2;
+    for (int i = 0; i < 32; i++) {
+        out[len++] = (uint8_t) i;
+    }
+    put_bytes(out, &len, (const uint8_t[]){0x01, 0x00, 0x00, 0x00, 0x00}, 5);
+    put_bytes(out, &len, (const uint8_t[]){0xfd, 0xff, 0xff, 0xff}, 4);
+    for (int i = 32; i < 64; i++) {
+        out[len++] = (uint8_t) i;
+    }
+    put_bytes(out, &len, (const uint8_t[]){0x00, 0x00, 0x00, 0x00, 0x17, 0x16}, 6);
+    put_fill(out, &len, 0x00, 22);
+    put_fill(out, &len, 0xff, 4);
+
+    out[len++] = 3;
+    put_bytes(out, &len, (const uint8_t[]){0x50, 0xc3, 0, 0, 0, 0, 0, 0}, 8);
+    put_bytes(out, &len, (const uint8_t[]){0x16, 0x00, 0x14}, 3);
+    put_fill(out, &len, 0xaa, 20);
+    put_bytes(out, &len, (const uint8_t[]){0x15, 0xcd, 0x5b, 0x07, 0, 0, 0, 0}, 8);
+    put_bytes(out, &len, (const uint8_t[]){0x22, 0x51, 0x20}, 3);
+    put_fill(out, &len, 0xbb, 32);
+    put_fill(out, &len, 0x00, 8);
+    put_bytes(out, &len, (const uint8_t[]){0x53, 0x6a, 0x4c, 0x50}, 4);
+    put_fill(out, &len, 0xcc, 80);
+
+    if (segwit) {
+        put_bytes(out, &len, (const uint8_t[]){0x02, 0x47}, 2);
+        put_fill(out, &len, 0x30, 71);
+        out[len++] = 0x21;
+        put_fill(out, &len, 0x02, 33);
+        out[len++] = 0x00;
+    }
+
+    put_bytes(out, &len, (const uint8_t[]){0x45, 0x23, 0x01, 0x00}, 4);
+    return len;
+}
+
+static void test_psbt_parse_rawtx(void **state) {
+    (void) state;
+
+    static const uint8_t expected_txid[32] = {
+        0x4b, 0x02, 0xd0, 0xe9, 0x84, 0x80, 0x2a, 0xcc, 0xfb, 0xf4, 0x99, 0x26, 0x8e, 0xd1, 0xfd,
+        0x24, 0x1a, 0xc1, 0x35, 0x2f, 0x1f, 0x42, 0xb3, 0x3f, 0xa2, 0xfe, 0xa4, 0x7b, 0x52, 0x5b,
+        0xe8, 0xf2};
+
+    static uint8_t txs[3][400];
+    size_t tx_lens[3];
+    tx_lens[0] = make_rawtx(txs[0], true);
+    tx_lens[1] = make_rawtx(txs[1], false);
+    // a truncated transaction
+    tx_lens[2] = make_rawtx(txs[2], false) - 1;
+    assert_int_equal(tx_lens[0], 391);
+    assert_int_equal(tx_lens[1], 281);
+
+    const uint8_t keys_data[3] = {0x00, 0x01, 0x02};
+    const uint8_t *keys[3] = {&keys_data[0], &keys_data[1], &keys_data[2]};
+    const size_t key_lens[3] = {1, 1, 1};
+    const uint8_t *values[3] = {txs[0], txs[1], txs[2]};
+
+    merkleized_map_commitment_t map;
+    harness_client_add_mapping(&client, keys, key_lens, values, tx_lens, 3, &map);
+
+    for (int i = 0; i < 2; i++) {
+        txid_parser_outputs_t outputs;
+        memset(&outputs, 0, sizeof(outputs));
+        outputs.n_vouts = 2;
+        outputs.vout_indexes[0] = 1;
+        outputs.vout_indexes[1] = 0;
+
+        assert_true(call_psbt_parse_rawtx(dc, &map, keys[i], 1, &outputs) >= 0);
+        assert_memory_equal(outputs.txid, expected_txid, 32);
+
+        assert_true(outputs.vouts[0].value == 123456789);
+        assert_int_equal(outputs.vouts[0].scriptpubkey_len, 34);
+        assert_int_equal(outputs.vouts[0].scriptpubkey[0], 0x51);
+        assert_int_equal(outputs.vouts[0].scriptpubkey[1], 0x20);
+        assert_int_equal(outputs.vouts[0].scriptpubkey[33], 0xbb);
+
+        assert_true(outputs.vouts[1].value == 50000);
+        assert_int_equal(outputs.vouts[1].scriptpubkey_len, 22);
+        assert_int_equal(outputs.vouts[1].scriptpubkey[0], 0x00);
+        assert_int_equal(outputs.vouts[1].scriptpubkey[1], 0x14);
+        assert_int_equal(outputs.vouts[1].scriptpubkey[21], 0xaa);
+    }
+
+    txid_parser_outputs_t outputs;
+
+    // only the txid
+    memset(&outputs, 0, sizeof(outputs));
+    assert_true(call_psbt_parse_rawtx(dc, &map, keys[0], 1, &outputs) >= 0);
+    assert_memory_equal(outputs.txid, expected_txid, 32);
+
+    // the scriptPubKey is too long
+    memset(&outputs, 0, sizeof(outputs));
+    outputs.n_vouts = 1;
+    outputs.vout_indexes[0] = 2;
+    assert_true(call_psbt_parse_rawtx(dc, &map, keys[0], 1, &outputs) < 0);
+
+    // the output does not exist
+    memset(&outputs, 0, sizeof(outputs));
+    outputs.n_vouts = 1;
+    outputs.vout_indexes[0] = 3;
+    assert_true(call_psbt_parse_rawtx(dc, &map, keys[0], 1, &outputs) < 0);
+
+    // the transaction is truncated
+    memset(&outputs, 0, sizeof(outputs));
+    assert_true(call_psbt_parse_rawtx(dc, &map, keys[2], 1, &outputs) < 0);
+}
+
+static void test_crypto_hash_writer(void **state) {
+    (void) state;
+
+    uint8_t data[300];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t) (i * 13);
+    }
+    uint8_t expected[32];
+    cx_hash_sha256(data, sizeof(data), expected, 32);
+
+    // the short updates that are only buffered, the ones that fill the buffer exactly, and the
+    // ones that are longer than the buffer
+    const size_t chunk_lens[] = {1, 2, 4, 8, 9, 32, 8, 63, 1, 64, 65, 43};
+    cx_sha256_t hash_context;
+    cx_sha256_init(&hash_context);
+    crypto_hash_writer_t writer;
+    crypto_hash_writer_init(&writer, &hash_context.header);
+    size_t pos = 0;
+    for (size_t i = 0; i < sizeof(chunk_lens) / sizeof(chunk_lens[0]); i++) {
+        crypto_hash_writer_update(&writer, data + pos, chunk_lens[i]);
+        assert_true(writer.len <= CRYPTO_HASH_WRITER_BUFFER_SIZE);
+        pos += chunk_lens[i];
+    }
+    assert_int_equal(pos, sizeof(data));
+
+    uint8_t digest[32];
+    crypto_hash_writer_digest(&writer, digest, 32);
+    assert_memory_equal(digest, expected, 32);
+
+    // the same with the convenience wrappers, and with direct updates after a flush
+    cx_sha256_init(&hash_context);
+    crypto_hash_writer_init(&writer, &hash_context.header);
+    crypto_hash_writer_update_u8(&writer, 0x01);
+    crypto_hash_writer_update_u16(&writer, 0x0203);
+    crypto_hash_writer_update_u32(&writer, 0x04050607);
+    crypto_hash_writer_flush(&writer);
+    crypto_hash_update_u8(&hash_context.header, 0x08);
+    crypto_hash_writer_update_varint(&writer, 0xFD);
+    crypto_hash_writer_digest(&writer, digest, 32);
+    const uint8_t serialized[] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0xFD, 0xFD, 0x00};
+    cx_hash_sha256(serialized, sizeof(serialized), expected, 32);
+    assert_memory_equal(digest, expected, 32);
+}
+
+static void test_run_handler(void **state) {
+    (void) state;
+
+    assert_int_equal(harness_run_handler(handler_get_app_features, 0, NULL, 0), SW_OK);
+
+    const harness_response_t *response = harness_get_response();
+    assert_int_equal(response->len, 1 + 4);
+    assert_int_equal(response->data[0], MAX_PROTOCOL_VERSION);
+    assert_int_equal(harness_get_n_interruptions(), 0);
+}
+
+// Decodes the hex string `hex` in `out`, and returns the number of bytes
+static size_t from_hex(const char *hex, uint8_t *out) {
+    size_t len = strlen(hex) / 2;
+    for (size_t i = 0; i < len; i++) {
+        unsigned int byte;
+        assert_int_equal(sscanf(hex + 2 * i, "%2x", &byte), 1);
+        out[i] = (uint8_t) byte;
+    }
+    return len;
+}
+
+typedef struct {
+    const char *key;
+    const char *value;
+} hex_map_entry_t;
+
+// Adds the merkleized map of the given entries, whose keys must be sorted, with hex keys and values
+static void add_hex_mapping(const hex_map_entry_t *entries,
+                            size_t n_entries,
+                            merkleized_map_commitment_t *out) {
+    static uint8_t data[2][8][256];
+    const uint8_t *keys[8], *values[8];
+    size_t key_lens[8], value_lens[8];
+    assert_true(n_entries <= 8);
+    for (size_t i = 0; i < n_entries; i++) {
+        key_lens[i] = from_hex(entries[i].key, data[0][i]);
+        value_lens[i] = from_hex(entries[i].value, data[1][i]);
+        keys[i] = data[0][i];
+        values[i] = data[1][i];
+    }
+    harness_client_add_mapping(&client, keys, key_lens, values, value_lens, n_entries, out);
+}
+
+typedef struct {
+    const hex_map_entry_t *entries;
+    size_t n_entries;
+} hex_map_t;
+
+#define HEX_MAP(entries) \
+    { (entries), sizeof(entries) / sizeof((entries)[0]) }
+
+// A default wallet policy of testnet, with the same key as in tests/
+typedef struct {
+    const char *descriptor_template;
+    const char *key_info;
+    const char *serialization;  // hex
+    const char *id;             // hex
+} test_wallet_t;
+
+static const test_wallet_t WPKH_WALLET = {
+    "wpkh(@0/**)",
+    "[f5acc2fd/84'/1'/0']tpubDCtKfsNyRhULjZ9XMS4VKKtVcPdVDi8MKUbcSD9MJDyjRu1A2ND5MiipozyyspBT9bg8up"
+    "Ep7a8EAgFxNxXn1d7QkdbL52Ty5jiSLcxPt1P",
+    "02000bc8974a0d8bdd29024b2ddb7a7fe8df1d9801b270f4e6c1e7e1011ae39e7c9b000144006386daf887e322e9"
+    "99231f37ba1dcc1863357a4bc21a78a623d7d2863f02",
+    "74e9dad05d709eb46f8cce7378ebafb45a75c7e83e0d2a63e02f492c8adc7293"};
+
+static const test_wallet_t PKH_WALLET = {
+    "pkh(@0/**)",
+    "[f5acc2fd/44'/1'/0']tpubDCwYjpDhUdPGP5rS3wgNg13mTrrjBuG8V9VpWbyptX6TRPbNoZVXsoVUSkCjmQ8jJycju"
+    "DKBb9eataSymXakTTaGifxR6kmVsfFehH1ZgJT",
+    "02000a364995f04a200bdcf089572f9a984c3bac20cf0e3a19158d4d15533ae12e110c01dd9922138f7a8f02c223"
+    "5fcfe719aa4738594e1a05bb12fe216bdcbcd67bb9f4",
+    "41ac41a616b4a2fad498268fe9c8a63b8854873839065de6fb2fabf1fbe89256"};
+
+// Adds the preimages and the Merkle tree of the keys of a wallet policy
+static void add_wallet(const test_wallet_t *wallet) {
+    uint8_t serialization[128];
+    size_t serialization_len = from_hex(wallet->serialization, serialization);
+    harness_client_add_preimage(&client, serialization, serialization_len);
+
+    harness_client_add_preimage(&client,
+                                (const uint8_t *) wallet->descriptor_template,
+                                strlen(wallet->descriptor_template));
+
+    const uint8_t *keys[1] = {(const uint8_t *) wallet->key_info};
+    const size_t key_lens[1] = {strlen(wallet->key_info)};
+    uint8_t keys_root[32];
+    harness_client_add_list(&client, keys, key_lens, 1, keys_root);
+}
+
+static void test_get_wallet_address(void **state) {
+    (void) state;
+
+    add_wallet(&WPKH_WALLET);
+
+    static const struct {
+        uint8_t change;
+        uint32_t address_index;
+        const char *address;
+    } cases[] = {
+        {0, 0, "tb1qzdr7s2sr0dwmkwx033r4nujzk86u0cy6fmzfjk"},
+        {1, 15, "tb1qlrvzyx8jcjfj2xuy69du9trtxnsvjuped7e289"},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        // display, wallet id, wallet hmac (none for the default wallet policies), change, index
+        uint8_t data[1 + 32 + 32 + 1 + 4] = {0};
+        from_hex(WPKH_WALLET.id, data + 1);
+        data[65] = cases[i].change;
+        write_u32_be(data, 66, cases[i].address_index);
+
+        assert_int_equal(harness_run_handler(handler_get_wallet_address, 0, data, sizeof(data)),
+                         SW_OK);
+
+        const harness_response_t *response = harness_get_response();
+        assert_int_equal(response->len, strlen(cases[i].address));
+        assert_memory_equal(response->data, cases[i].address, response->len);
+    }
+}
+
+/**
+ * Signs the PSBT with the given maps in version 2 with the given wallet policy and hmac (32 zero
+ * bytes for a default wallet policy), with version 1 of the protocol, and checks that the only
+ * message yielded by the command is the signature of the first input with the given pubkey.
+ */
+static void check_sign_psbt(const test_wallet_t *wallet,
+                            const uint8_t wallet_hmac[static 32],
+                            const hex_map_t *global_map,
+                            const hex_map_t *input_maps,
+                            size_t n_inputs,
+                            const hex_map_t *output_maps,
+                            size_t n_outputs,
+                            const char *pubkey,
+                            const char *signature) {
+    add_wallet(wallet);
+
+    merkleized_map_commitment_t global_commitment, commitments[8];
+    assert_true(n_inputs + n_outputs <= 8);
+    add_hex_mapping(global_map->entries, global_map->n_entries, &global_commitment);
+    for (size_t i = 0; i < n_inputs + n_outputs; i++) {
+        const hex_map_t *map = i < n_inputs ? &input_maps[i] : &output_maps[i - n_inputs];
+        add_hex_mapping(map->entries, map->n_entries, &commitments[i]);
+    }
+
+    // the lists of the serialized commitments of the inputs, then of the outputs
+    uint8_t serialized[8][1 + 32 + 32];
+    const uint8_t *elements[8];
+    size_t lens[8];
+    for (size_t i = 0; i < n_inputs + n_outputs; i++) {
+        serialized[i][0] = (uint8_t) commitments[i].size;
+        memcpy(serialized[i] + 1, commitments[i].keys_root, 32);
+        memcpy(serialized[i] + 1 + 32, commitments[i].values_root, 32);
+        elements[i] = serialized[i];
+        lens[i] = sizeof(serialized[i]);
+    }
+
+    uint8_t data[1 + 32 + 32 + 1 + 32 + 1 + 32 + 32 + 32] = {0};
+    size_t pos = 0;
+    data[pos++] = (uint8_t) global_commitment.size;
+    memcpy(data + pos, global_commitment.keys_root, 32);
+    memcpy(data + pos + 32, global_commitment.values_root, 32);
+    pos += 64;
+    data[pos++] = (uint8_t) n_inputs;
+    harness_client_add_list(&client, elements, lens, n_inputs, data + pos);
+    pos += 32;
+    data[pos++] = (uint8_t) n_outputs;
+    harness_client_add_list(&client, elements + n_inputs, lens + n_inputs, n_outputs, data + pos);
+    pos += 32;
+    pos += from_hex(wallet->id, data + pos);
+    memcpy(data + pos, wallet_hmac, 32);
+    pos += 32;
+    assert_int_equal(pos, sizeof(data));
+
+    // in version 1 of the protocol, each signature is yielded with its public key
+    size_t first_yielded = client.n_yielded;
+    assert_int_equal(harness_run_handler(handler_sign_psbt, 1, data, sizeof(data)), SW_OK);
+
+    uint8_t expected[1 + 1 + 33 + 72];
+    size_t expected_len = 0;
+    expected[expected_len++] = 0;  // input index
+    expected[expected_len++] = 33;
+    expected_len += from_hex(pubkey, expected + expected_len);
+    expected_len += from_hex(signature, expected + expected_len);
+
+    assert_int_equal(client.n_yielded, first_yielded + 1);
+    assert_int_equal(client.yielded[first_yielded].len, expected_len);
+    assert_memory_equal(client.yielded[first_yielded].data, expected, expected_len);
+}
+
+static void check_sign_psbt_wpkh(const uint8_t wallet_hmac[static 32]) {
+    // the maps in version 2 of tests/psbt/singlesig/wpkh-1to2.psbt
+    static const hex_map_entry_t global_map[] = {
+        {"02", "02000000"},
+        {"03", "00000000"},
+        {"04", "01"},
+        {"05", "02"},
+        {"fb", "02000000"},
+    };
+    static const hex_map_entry_t input_map[] = {
+        {"00",
+         "0200000001afbfae06590f741ff1af59b6ac461126336a4c4a82db553df6fefab737ac33f30100000000fdff"
+         "ffff027011010000000000220020fdee441c56e5b06d0df82c124c707014a5ca19658be0b9856bca16f1ed32"
+         "59f7a5f43000000000001600143af8429ad5954aa5ee8a33c983fd8a1e8679924b00000000"},
+        {"01", "a5f43000000000001600143af8429ad5954aa5ee8a33c983fd8a1e8679924b"},
+        {"0603ee2c3d98eb1f93c0a1aa8e5a4009b70eb7b44ead15f1666f136b012ad58d3068",
+         "f5acc2fd5400008001000080000000800100000008000000"},
+        {"0e", "7a2a997956c09f8ea7fd2819c1a987bb14e22bf9adcdaf20a89763722ceee264"},
+        {"0f", "01000000"},
+        {"10", "fdffffff"},
+    };
+    static const hex_map_entry_t output_map_0[] = {
+        {"03", "a0bb0d0000000000"},
+        {"04", "76a914344a0f48ca150ec2b903817660b9b68b13a6702688ac"},
+    };
+    static const hex_map_entry_t output_map_1[] = {
+        {"020229ec47727131ed2588a20c46eda9abb7daa6f49fd50bafe70b9c5aa6961c4ecc",
+         "f5acc2fd540000800100008000000080010000000a000000"},
+        {"03", "7438230000000000"},
+        {"04", "0014eb38fa9b8128f81f26e95edb0c5ffaea83690fe4"},
+    };
+
+    const hex_map_t global = HEX_MAP(global_map);
+    const hex_map_t inputs[] = {HEX_MAP(input_map)};
+    const hex_map_t outputs[] = {HEX_MAP(output_map_0), HEX_MAP(output_map_1)};
+    check_sign_psbt(&WPKH_WALLET,
+                    wallet_hmac,
+                    &global,
+                    inputs,
+                    1,
+                    outputs,
+                    2,
+                    "03ee2c3d98eb1f93c0a1aa8e5a4009b70eb7b44ead15f1666f136b012ad58d3068",
+                    "3045022100ab44f34dd7e87c9054591297a101e8500a0641d1d591878d0d23cf8096fa79e80220"
+                    "5d12d1062d925e27b57bdcf994ecf332ad0a8e67b8fe407bab2101255da632aa01");
+}
+
+static void check_sign_psbt_pkh(const uint8_t wallet_hmac[static 32]) {
+    // the maps in version 2 of tests/psbt/singlesig/pkh-1to1.psbt
+    static const hex_map_entry_t global_map[] = {
+        {"02", "02000000"},
+        {"03", "1a041d00"},
+        {"04", "01"},
+        {"05", "01"},
+        {"fb", "02000000"},
+    };
+    static const hex_map_entry_t input_map[] = {
+        {"00",
+         "0200000001ec230e53095256052a2428270eec0498944b10f6f1c578f431c23d0098b4ae5a01000000171600"
+         "14281539820e2de973ae41ba6004b431c921c4d86dfeffffff02727275000000000017a914c8b906af298c70"
+         "e603a28c3efc2fae19e6ab280f8740420f00000000001976a914cbae5b50cf939e6f531b8a6b7abd788fe14b"
+         "029788ac84f21c00"},
+        {"0602ee8608207e21028426f69e76447d7e3d5e077049f5e683c3136c2314762a4718",
+         "f5acc2fd2c00008001000080000000800000000000000000"},
+        {"0e", "5122c2cde6823e55754175b92c9c57a0a8e1ac83c38e1787fd3a1ff3348e9513"},
+        {"0f", "01000000"},
+        {"10", "fdffffff"},
+    };
+    static const hex_map_entry_t output_map[] = {
+        {"03", "78410f0000000000"},
+        {"04", "76a91413d7d58166946c3ec022934066d8c0d111d1bb4188ac"},
+    };
+
+    const hex_map_t global = HEX_MAP(global_map);
+    const hex_map_t inputs[] = {HEX_MAP(input_map)};
+    const hex_map_t outputs[] = {HEX_MAP(output_map)};
+    check_sign_psbt(&PKH_WALLET,
+                    wallet_hmac,
+                    &global,
+                    inputs,
+                    1,
+                    outputs,
+                    1,
+                    "02ee8608207e21028426f69e76447d7e3d5e077049f5e683c3136c2314762a4718",
+                    "3045022100e55b3ca788721aae8def2eadff710e524ffe8c9dec1764fdaa89584f9726e1960220"
+                    "12a30fbcf9e1a24df31a1010356b794ab8de438b4250684757ed5772402540f401");
+}
+
+static void test_sign_psbt(void **state) {
+    (void) state;
+
+    const uint8_t no_hmac[32] = {0};
+    check_sign_psbt_wpkh(no_hmac);
+}
+
+static void test_sign_psbt_legacy(void **state) {
+    (void) state;
+
+    const uint8_t no_hmac[32] = {0};
+    check_sign_psbt_pkh(no_hmac);
+}
+
+// Opens a wallet session for the given wallet policy, registered with the given hmac
+static void open_wallet_session(const test_wallet_t *wallet, const uint8_t wallet_hmac[static 32]) {
+    add_wallet(wallet);
+
+    uint8_t data[32 + 32];
+    from_hex(wallet->id, data);
+    memcpy(data + 32, wallet_hmac, 32);
+    assert_int_equal(harness_run_handler(handler_open_wallet_session, 0, data, sizeof(data)),
+                     SW_OK);
+}
+
+static void test_wallet_registry(void **state) {
+    (void) state;
+
+    uint8_t wpkh_id[32], wpkh_hmac[32], pkh_id[32], pkh_hmac[32];
+    from_hex(WPKH_WALLET.id, wpkh_id);
+    from_hex(PKH_WALLET.id, pkh_id);
+    assert_true(compute_wallet_hmac(wpkh_id, wpkh_hmac));
+    assert_true(compute_wallet_hmac(pkh_id, pkh_hmac));
+
+    // stores the wallet policy of a session in the registry, as REGISTER_WALLET does; the entry
+    // stays in the registry for the following tests
+    open_wallet_session(&WPKH_WALLET, wpkh_hmac);
+    assert_true(wallet_registry_store());
+
+    // the stored wallet policy is used whatever the hmac, and the session is kept
+    open_wallet_session(&PKH_WALLET, pkh_hmac);
+    uint8_t wrong_hmac[32];
+    memset(wrong_hmac, 0x5a, sizeof(wrong_hmac));
+    check_sign_psbt_wpkh(wrong_hmac);
+    assert_non_null(wallet_session_get(pkh_id, pkh_hmac));
+    assert_null(wallet_session_get(wpkh_id, wrong_hmac));
+    check_sign_psbt_pkh(pkh_hmac);
+
+    // with no open session, the stored wallet policy is loaded in the session with its own hmac
+    wallet_session_close();
+    check_sign_psbt_wpkh(wrong_hmac);
+    assert_non_null(wallet_session_get(wpkh_id, wpkh_hmac));
+    assert_null(wallet_session_get(wpkh_id, wrong_hmac));
+
+    wallet_session_close();
+}
+
+static void test_crypto_tr_tagged_hashes(void **state) {
+    (void) state;
+
+    // the tagged hashes with a precomputed tag hash match the ones with the tag
+    static const struct {
+        void (*init)(cx_sha256_t *hash_context);
+        const char *tag;
+    } cases[] = {{crypto_tr_tapleaf_hash_init, "TapLeaf"},
+                 {crypto_tr_tapsighash_init, "TapSighash"}};
+    const uint8_t data[] = {0xc0, 0x01, 0x51};
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        uint8_t digest[32], expected[32];
+        cx_sha256_t hash_context;
+
+        cases[i].init(&hash_context);
+        crypto_hash_update(&hash_context.header, data, sizeof(data));
+        crypto_hash_digest(&hash_context.header, digest, 32);
+
+        crypto_tr_tagged_hash_init(&hash_context,
+                                   (const uint8_t *) cases[i].tag,
+                                   strlen(cases[i].tag));
+        crypto_hash_update(&hash_context.header, data, sizeof(data));
+        crypto_hash_digest(&hash_context.header, expected, 32);
+
+        assert_memory_equal(digest, expected, 32);
+    }
+
+    // TapBranch of the sorted hashes, as computed by a reference implementation
+    uint8_t left[32], right[32], out[32], expected[32];
+    memset(left, 0x01, 32);
+    memset(right, 0x02, 32);
+    from_hex("05b83811bae869be3a9a878ebb3fcacb585a794c6005ad58aef4c14c33868bca", expected);
+    crypto_tr_combine_taptree_hashes(right, left, out);
+    assert_memory_equal(out, expected, 32);
+    crypto_tr_combine_taptree_hashes(left, right, out);
+    assert_memory_equal(out, expected, 32);
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_get_preimage, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_preimage_reader, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_get_merkle_leaf_element, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_get_merkle_leaf_elements, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_get_merkle_leaf_hashes, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_hash_refs, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_access_plan, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_tree_stream, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_get_merkle_leaf_index, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_get_merkleized_map_value, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_get_merkleized_map_values, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_extended_responses, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_preimage_cache, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_map_commitment_cache, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_extract_bip32_derivation, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_psbt_parse_rawtx, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_crypto_hash_writer, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_run_handler, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_get_wallet_address, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_sign_psbt, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_sign_psbt_legacy, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_crypto_tr_tagged_hashes, setup, teardown),
+        // last, as the registry is not cleared
+        cmocka_unit_test_setup_teardown(test_wallet_registry, setup, teardown)};
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
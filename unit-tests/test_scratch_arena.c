@@ -0,0 +1,86 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "handler/lib/scratch_arena.h"
+
+static bool is_zero(const uint8_t *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_scratch_arena_alloc(void **state) {
+    (void) state;
+
+    scratch_arena_reset();
+
+    uint8_t *a = scratch_arena_alloc(3);
+    uint8_t *b = scratch_arena_alloc(16);
+    assert_non_null(a);
+    assert_non_null(b);
+    assert_int_equal((uintptr_t) a % SCRATCH_ARENA_ALIGNMENT, 0);
+    assert_int_equal((uintptr_t) b % SCRATCH_ARENA_ALIGNMENT, 0);
+    assert_ptr_equal(b, a + SCRATCH_ARENA_ALIGNMENT);
+    assert_int_equal(scratch_arena_mark(), SCRATCH_ARENA_ALIGNMENT + 16);
+    assert_true(is_zero(a, 3));
+    assert_true(is_zero(b, 16));
+}
+
+static void test_scratch_arena_release(void **state) {
+    (void) state;
+
+    scratch_arena_reset();
+
+    uint8_t *a = scratch_arena_alloc(8);
+    memset(a, 0xAA, 8);
+
+    scratch_arena_mark_t mark = scratch_arena_mark();
+    uint8_t *b = scratch_arena_alloc(32);
+    memset(b, 0xBB, 32);
+    scratch_arena_release(mark);
+
+    // the released buffer is wiped, and its memory is reused; buffers before the mark are kept
+    assert_true(is_zero(b, 32));
+    assert_ptr_equal(scratch_arena_alloc(32), b);
+    assert_int_equal(a[0], 0xAA);
+
+    // releasing with a mark that is not older than the current position does nothing
+    scratch_arena_release(scratch_arena_mark());
+    assert_int_equal(scratch_arena_mark(), 8 + 32);
+}
+
+static void test_scratch_arena_exhausted(void **state) {
+    (void) state;
+
+    scratch_arena_reset();
+
+    assert_null(scratch_arena_alloc(SCRATCH_ARENA_SIZE + 1));
+    assert_null(scratch_arena_alloc(SIZE_MAX));
+
+    uint8_t *a = scratch_arena_alloc(SCRATCH_ARENA_SIZE - SCRATCH_ARENA_ALIGNMENT);
+    assert_non_null(a);
+    assert_null(scratch_arena_alloc(SCRATCH_ARENA_ALIGNMENT + 1));
+    assert_non_null(scratch_arena_alloc(SCRATCH_ARENA_ALIGNMENT));
+    assert_null(scratch_arena_alloc(1));
+
+    scratch_arena_reset();
+    assert_int_equal(scratch_arena_mark(), 0);
+    assert_true(is_zero(G_scratch_arena.data, SCRATCH_ARENA_SIZE));
+}
+
+int main() {
+    const struct CMUnitTest tests[] = {cmocka_unit_test(test_scratch_arena_alloc),
+                                       cmocka_unit_test(test_scratch_arena_release),
+                                       cmocka_unit_test(test_scratch_arena_exhausted)};
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
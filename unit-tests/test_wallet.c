@@ -53,7 +53,7 @@ static void test_parse_policy_map_singlesig_1(void **state) {
     policy_node_with_key_t *node_1 = (policy_node_with_key_t *) out;
 
     assert_int_equal(node_1->base.type, TOKEN_PKH);
-    check_key_placeholder(node_1->key_placeholder, 0, 0, 1);
+    check_key_placeholder(r_policy_node_key_placeholder(&node_1->key_placeholder), 0, 0, 1);
 }
 
 static void test_parse_policy_map_singlesig_2(void **state) {
@@ -71,7 +71,7 @@ static void test_parse_policy_map_singlesig_2(void **state) {
     policy_node_with_key_t *inner = (policy_node_with_key_t *) resolve_ptr(&root->script);
 
     assert_int_equal(inner->base.type, TOKEN_WPKH);
-    check_key_placeholder(inner->key_placeholder, 0, 0, 1);
+    check_key_placeholder(r_policy_node_key_placeholder(&inner->key_placeholder), 0, 0, 1);
 }
 
 static void test_parse_policy_map_singlesig_3(void **state) {
@@ -93,7 +93,7 @@ static void test_parse_policy_map_singlesig_3(void **state) {
     policy_node_with_key_t *inner = (policy_node_with_key_t *) resolve_ptr(&mid->script);
 
     assert_int_equal(inner->base.type, TOKEN_PKH);
-    check_key_placeholder(inner->key_placeholder, 0, 0, 1);
+    check_key_placeholder(r_policy_node_key_placeholder(&inner->key_placeholder), 0, 0, 1);
 }
 
 static void test_parse_policy_map_multisig_1(void **state) {
@@ -109,9 +109,11 @@ static void test_parse_policy_map_multisig_1(void **state) {
     assert_int_equal(node_1->base.type, TOKEN_SORTEDMULTI);
     assert_int_equal(node_1->k, 2);
     assert_int_equal(node_1->n, 3);
-    check_key_placeholder(&node_1->key_placeholders[0], 0, 0, 1);
-    check_key_placeholder(&node_1->key_placeholders[1], 1, 0, 1);
-    check_key_placeholder(&node_1->key_placeholders[2], 2, 0, 1);
+    const policy_node_key_placeholder_t *key_placeholders =
+        r_policy_node_key_placeholder(&node_1->key_placeholders);
+    check_key_placeholder(&key_placeholders[0], 0, 0, 1);
+    check_key_placeholder(&key_placeholders[1], 1, 0, 1);
+    check_key_placeholder(&key_placeholders[2], 2, 0, 1);
 }
 
 static void test_parse_policy_map_multisig_2(void **state) {
@@ -131,8 +133,10 @@ static void test_parse_policy_map_multisig_2(void **state) {
 
     assert_int_equal(inner->k, 3);
     assert_int_equal(inner->n, 5);
+    const policy_node_key_placeholder_t *key_placeholders =
+        r_policy_node_key_placeholder(&inner->key_placeholders);
     for (int i = 0; i < 5; i++) {
-        check_key_placeholder(&inner->key_placeholders[i], i, 0, 1);
+        check_key_placeholder(&key_placeholders[i], i, 0, 1);
     }
 }
 
@@ -157,8 +161,10 @@ static void test_parse_policy_map_multisig_3(void **state) {
 
     assert_int_equal(inner->k, 3);
     assert_int_equal(inner->n, 5);
+    const policy_node_key_placeholder_t *key_placeholders =
+        r_policy_node_key_placeholder(&inner->key_placeholders);
     for (int i = 0; i < 5; i++) {
-        check_key_placeholder(&inner->key_placeholders[i], i, 0, 1);
+        check_key_placeholder(&key_placeholders[i], i, 0, 1);
     }
 }
 
@@ -174,8 +180,8 @@ static void test_parse_policy_tr(void **state) {
     assert_int_equal(res, 0);
     policy_node_tr_t *root = (policy_node_tr_t *) out;
 
-    assert_ptr_equal(root->tree, NULL);
-    check_key_placeholder(root->key_placeholder, 0, 0, 1);
+    assert_ptr_equal(r_policy_node_tree(&root->tree), NULL);
+    check_key_placeholder(r_policy_node_key_placeholder(&root->key_placeholder), 0, 0, 1);
 
     // Simple tr with a TREE that is a simple script
     res = parse_policy("tr(@0/**,pk(@1/**))", out, sizeof(out));
@@ -183,14 +189,15 @@ static void test_parse_policy_tr(void **state) {
     assert_int_equal(res, 0);
     root = (policy_node_tr_t *) out;
 
-    check_key_placeholder(root->key_placeholder, 0, 0, 1);
+    check_key_placeholder(r_policy_node_key_placeholder(&root->key_placeholder), 0, 0, 1);
 
-    assert_int_equal(root->tree->is_leaf, true);
+    const policy_node_tree_t *taptree = r_policy_node_tree(&root->tree);
+    assert_int_equal(taptree->is_leaf, true);
 
-    policy_node_with_key_t *tapscript = (policy_node_with_key_t *) resolve_ptr(&root->tree->script);
+    policy_node_with_key_t *tapscript = (policy_node_with_key_t *) resolve_ptr(&taptree->script);
 
     assert_int_equal(tapscript->base.type, TOKEN_PK);
-    check_key_placeholder(tapscript->key_placeholder, 1, 0, 1);
+    check_key_placeholder(r_policy_node_key_placeholder(&tapscript->key_placeholder), 1, 0, 1);
 
     // Simple tr with a TREE with two tapleaves
     res = parse_policy("tr(@0/**,{pk(@1/**),pk(@2/<5;7>/*)})", out, sizeof(out));
@@ -198,9 +205,9 @@ static void test_parse_policy_tr(void **state) {
     assert_int_equal(res, 0);
     root = (policy_node_tr_t *) out;
 
-    check_key_placeholder(root->key_placeholder, 0, 0, 1);
+    check_key_placeholder(r_policy_node_key_placeholder(&root->key_placeholder), 0, 0, 1);
 
-    policy_node_tree_t *taptree = root->tree;
+    taptree = r_policy_node_tree(&root->tree);
 
     assert_int_equal(taptree->is_leaf, false);
 
@@ -210,7 +217,7 @@ static void test_parse_policy_tr(void **state) {
         (policy_node_with_key_t *) resolve_ptr(&taptree_left->script);
 
     assert_int_equal(tapscript_left->base.type, TOKEN_PK);
-    check_key_placeholder(tapscript_left->key_placeholder, 1, 0, 1);
+    check_key_placeholder(r_policy_node_key_placeholder(&tapscript_left->key_placeholder), 1, 0, 1);
 
     policy_node_tree_t *taptree_right = (policy_node_tree_t *) resolve_ptr(&taptree->right_tree);
     assert_int_equal(taptree_right->is_leaf, true);
@@ -218,7 +225,10 @@ static void test_parse_policy_tr(void **state) {
         (policy_node_with_key_t *) resolve_ptr(&taptree_right->script);
 
     assert_int_equal(tapscript_right->base.type, TOKEN_PK);
-    check_key_placeholder(tapscript_right->key_placeholder, 2, 5, 7);
+    check_key_placeholder(r_policy_node_key_placeholder(&tapscript_right->key_placeholder),
+                          2,
+                          5,
+                          7);
 }
 
 static void test_parse_policy_tr_multisig(void **state) {
@@ -236,11 +246,9 @@ static void test_parse_policy_tr_multisig(void **state) {
 
     policy_node_tr_t *root = (policy_node_tr_t *) out;
 
-    assert_int_equal(root->key_placeholder->key_index, 0);
-    assert_int_equal(root->key_placeholder->num_first, 0);
-    assert_int_equal(root->key_placeholder->num_second, 1);
+    check_key_placeholder(r_policy_node_key_placeholder(&root->key_placeholder), 0, 0, 1);
 
-    policy_node_tree_t *taptree = root->tree;
+    const policy_node_tree_t *taptree = r_policy_node_tree(&root->tree);
 
     assert_int_equal(taptree->is_leaf, false);
 
@@ -252,8 +260,10 @@ static void test_parse_policy_tr_multisig(void **state) {
     assert_int_equal(tapscript_left->base.type, TOKEN_MULTI_A);
     assert_int_equal(tapscript_left->k, 1);
     assert_int_equal(tapscript_left->n, 2);
-    check_key_placeholder(&tapscript_left->key_placeholders[0], 1, 0, 1);
-    check_key_placeholder(&tapscript_left->key_placeholders[1], 2, 0, 1);
+    const policy_node_key_placeholder_t *left_key_placeholders =
+        r_policy_node_key_placeholder(&tapscript_left->key_placeholders);
+    check_key_placeholder(&left_key_placeholders[0], 1, 0, 1);
+    check_key_placeholder(&left_key_placeholders[1], 2, 0, 1);
 
     policy_node_tree_t *taptree_right = (policy_node_tree_t *) resolve_ptr(&taptree->right_tree);
     assert_int_equal(taptree_right->is_leaf, true);
@@ -263,9 +273,133 @@ static void test_parse_policy_tr_multisig(void **state) {
     assert_int_equal(tapscript_right->base.type, TOKEN_SORTEDMULTI_A);
     assert_int_equal(tapscript_right->k, 2);
     assert_int_equal(tapscript_right->n, 3);
-    check_key_placeholder(&tapscript_right->key_placeholders[0], 3, 0, 1);
-    check_key_placeholder(&tapscript_right->key_placeholders[1], 4, 0, 1);
-    check_key_placeholder(&tapscript_right->key_placeholders[2], 5, 0, 1);
+    const policy_node_key_placeholder_t *right_key_placeholders =
+        r_policy_node_key_placeholder(&tapscript_right->key_placeholders);
+    check_key_placeholder(&right_key_placeholders[0], 3, 0, 1);
+    check_key_placeholder(&right_key_placeholders[1], 4, 0, 1);
+    check_key_placeholder(&right_key_placeholders[2], 5, 0, 1);
+}
+
+static void test_parse_policy_tr_multisig_large(void **state) {
+    (void) state;
+
+    uint8_t out[MAX_WALLET_POLICY_MEMORY_SIZE];
+
+    // more keys than supported for multi and sortedmulti
+    char descriptor_template[256];
+    int pos =
+        snprintf(descriptor_template, sizeof(descriptor_template), "tr(@0/**,sortedmulti_a(20");
+    for (int i = 1; i <= 30; i++) {
+        pos += snprintf(descriptor_template + pos, sizeof(descriptor_template) - pos, ",@%d/**", i);
+    }
+    snprintf(descriptor_template + pos, sizeof(descriptor_template) - pos, "))");
+
+    int res = parse_policy(descriptor_template, out, sizeof(out));
+    assert_int_equal(res, 0);
+
+    policy_node_tr_t *root = (policy_node_tr_t *) out;
+    policy_node_multisig_t *tapscript =
+        (policy_node_multisig_t *) resolve_ptr(&r_policy_node_tree(&root->tree)->script);
+
+    assert_int_equal(tapscript->base.type, TOKEN_SORTEDMULTI_A);
+    assert_int_equal(tapscript->k, 20);
+    assert_int_equal(tapscript->n, 30);
+    const policy_node_key_placeholder_t *key_placeholders =
+        r_policy_node_key_placeholder(&tapscript->key_placeholders);
+    check_key_placeholder(&key_placeholders[29], 30, 0, 1);
+
+    // the same keys in a multi are more than MAX_PUBKEYS_PER_MULTISIG
+    assert_true(0 > parse_policy("wsh(multi(2,@0/**,@1/**,@2/**,@3/**,@4/**,@5/**,@6/**,@7/**,"
+                                 "@8/**,@9/**,@10/**,@11/**,@12/**,@13/**,@14/**,@15/**,@16/**))",
+                                 out,
+                                 sizeof(out)));
+}
+
+// Writes to out a taptree with n_leaves leaves pk(@1/**), ..., pk(@n_leaves/**), where each inner
+// node has a leaf as its left child (or as its right child, if left_comb); therefore, its depth is
+// n_leaves - 1.
+static void make_comb_taptree(char *out, size_t out_len, int n_leaves, bool left_comb) {
+    int pos = snprintf(out, out_len, "tr(@0/**,");
+    if (left_comb) {
+        // {{{pk(@1/**),pk(@2/**)},pk(@3/**)},pk(@4/**)}
+        for (int i = 1; i < n_leaves; i++) {
+            pos += snprintf(out + pos, out_len - pos, "{");
+        }
+        pos += snprintf(out + pos, out_len - pos, "pk(@1/**)");
+        for (int i = 2; i <= n_leaves; i++) {
+            pos += snprintf(out + pos, out_len - pos, ",pk(@%d/**)}", i);
+        }
+    } else {
+        // {pk(@1/**),{pk(@2/**),{pk(@3/**),pk(@4/**)}}}
+        for (int i = 1; i < n_leaves; i++) {
+            pos += snprintf(out + pos, out_len - pos, "{pk(@%d/**),", i);
+        }
+        pos += snprintf(out + pos, out_len - pos, "pk(@%d/**)", n_leaves);
+        for (int i = 1; i < n_leaves; i++) {
+            pos += snprintf(out + pos, out_len - pos, "}");
+        }
+    }
+    snprintf(out + pos, out_len - pos, ")");
+}
+
+// Checks that the leaves of the taptree are pk(@first_key_index/**), ... in order, and returns
+// the key index after the last one
+static int check_taptree_leaves(const policy_node_tree_t *tree, int first_key_index) {
+    if (tree->is_leaf) {
+        const policy_node_with_key_t *script =
+            (const policy_node_with_key_t *) resolve_ptr(&tree->script);
+        assert_int_equal(script->base.type, TOKEN_PK);
+        check_key_placeholder(r_policy_node_key_placeholder(&script->key_placeholder),
+                              first_key_index,
+                              0,
+                              1);
+        return first_key_index + 1;
+    }
+    int next_key_index = check_taptree_leaves(resolve_ptr(&tree->left_tree), first_key_index);
+    return check_taptree_leaves(resolve_ptr(&tree->right_tree), next_key_index);
+}
+
+static void test_parse_policy_tr_deep(void **state) {
+    (void) state;
+
+    uint8_t out[4 * MAX_WALLET_POLICY_MEMORY_SIZE];
+    char descriptor_template[512];
+
+    // the tapleaves can be at depth MAX_TAPTREE_POLICY_DEPTH - 1, on either side of the tree
+    for (int left_comb = 0; left_comb <= 1; left_comb++) {
+        make_comb_taptree(descriptor_template,
+                          sizeof(descriptor_template),
+                          MAX_TAPTREE_POLICY_DEPTH,
+                          left_comb);
+        assert_int_equal(parse_policy(descriptor_template, out, sizeof(out)), 0);
+
+        policy_node_tr_t *root = (policy_node_tr_t *) out;
+        assert_int_equal(check_taptree_leaves(r_policy_node_tree(&root->tree), 1),
+                         MAX_TAPTREE_POLICY_DEPTH + 1);
+
+        // one more level is rejected
+        make_comb_taptree(descriptor_template,
+                          sizeof(descriptor_template),
+                          MAX_TAPTREE_POLICY_DEPTH + 1,
+                          left_comb);
+        assert_true(0 > parse_policy(descriptor_template, out, sizeof(out)));
+    }
+
+    // a balanced tree of depth 3
+    assert_int_equal(parse_policy("tr(@0/**,{{{pk(@1/**),pk(@2/**)},{pk(@3/**),pk(@4/**)}},"
+                                  "{{pk(@5/**),pk(@6/**)},{pk(@7/**),pk(@8/**)}}})",
+                                  out,
+                                  sizeof(out)),
+                     0);
+    policy_node_tr_t *root = (policy_node_tr_t *) out;
+    assert_int_equal(check_taptree_leaves(r_policy_node_tree(&root->tree), 1), 9);
+
+    // malformed trees
+    assert_true(0 > parse_policy("tr(@0/**,{pk(@1/**),pk(@2/**))", out, sizeof(out)));
+    assert_true(0 > parse_policy("tr(@0/**,{pk(@1/**)})", out, sizeof(out)));
+    assert_true(0 > parse_policy("tr(@0/**,{{pk(@1/**),pk(@2/**)}})", out, sizeof(out)));
+    assert_true(0 > parse_policy("tr(@0/**,{pk(@1/**),pk(@2/**),pk(@3/**)})", out, sizeof(out)));
+    assert_true(0 > parse_policy("tr(@0/**,{})", out, sizeof(out)));
 }
 
 static void test_failures(void **state) {
@@ -281,6 +415,14 @@ static void test_failures(void **state) {
 
     // unknown token
     assert_true(0 > parse_policy("yolo(@0/**)", out, sizeof(out)));
+
+    // unknown tokens with the length and some of the characters of a known token
+    assert_true(0 > parse_policy("wsh(pk_x(@0/**))", out, sizeof(out)));
+    assert_true(0 > parse_policy("wsh(or_x(pk(@0/**),pk(@1/**)))", out, sizeof(out)));
+    assert_true(0 > parse_policy("wsh(and_x(pk(@0/**),pk(@1/**)))", out, sizeof(out)));
+    assert_true(0 > parse_policy("wsh(multi_b(1,@0/**))", out, sizeof(out)));
+    assert_true(0 > parse_policy("wpkx(@0/**)", out, sizeof(out)));
+    assert_true(0 > parse_policy("tx(@0/**)", out, sizeof(out)));
     assert_true(0 > parse_policy("Pkh(@0/**)", out, sizeof(out)));  // case-sensitive
 
     // missing or invalid key identifier
@@ -401,6 +543,84 @@ static void Test(const char *ms, const char *hexscript, int mode, int opslimit,
     }
 }
 
+typedef struct {
+    const char *data;
+    size_t offset;
+    size_t fail_at;  // the read fails if it reaches this offset
+} template_reader_t;
+
+static int read_template(void *state, uint8_t *out, size_t out_len) {
+    template_reader_t *reader = (template_reader_t *) state;
+    assert_true(reader->offset + out_len <= strlen(reader->data));
+    if (reader->offset + out_len > reader->fail_at) {
+        return -1;
+    }
+    memcpy(out, reader->data + reader->offset, out_len);
+    reader->offset += out_len;
+    return 0;
+}
+
+static int parse_policy_stream(const char *descriptor_template,
+                               size_t fail_at,
+                               uint8_t *out,
+                               size_t out_size) {
+    template_reader_t reader = {.data = descriptor_template, .offset = 0, .fail_at = fail_at};
+    return parse_descriptor_template_stream(read_template,
+                                            &reader,
+                                            strlen(descriptor_template),
+                                            out,
+                                            out_size,
+                                            WALLET_POLICY_VERSION_V2);
+}
+
+static void test_parse_policy_stream(void **state) {
+    (void) state;
+
+    // the streamed templates must be parsed exactly like the same templates in a buffer
+    const char *descriptor_templates[] = {
+        "pkh(@0/**)",
+        "sh(wsh(sortedmulti(2,@0/**,@1/**,@2/**)))",
+        "tr(@0/**,{{pk(@1/<2;3>/*),multi_a(1,@2/**,@3/**)},sortedmulti_a(2,@4/**,@5/**,@6/**)})",
+        "wsh(thresh(2,c:pk_h(@0/**),s:sha256(e38990d0c7fc009880a9c07c23842e886c6bbdc964ce6bdd58"
+        "17ad357335ee6f),a:hash160(dd69735817e0e3f6f826a9238dc2e291184f0131)))",
+        "wsh(c:andor(ripemd160(6ad07d21fd5dfc646f0b30577045ce201616b9ba),pk_h(@0/**),and_v(v:"
+        "hash256(8a35d9ca92a48eaade6f53a64985e9e2afeb74dcf8acb4c3721e0dc7e4294b25),pk_h(@1/**))))",
+        "wsh(or_d(multi(2,@0/<0;1>/*,@1/<0;1>/*,@2/<0;1>/*),and_v(v:thresh(2,pkh(@0/<2;3>/*),a:"
+        "pkh(@1/<2;3>/*),a:pkh(@2/<2;3>/*)),older(65535))))",
+    };
+
+    for (size_t i = 0; i < sizeof(descriptor_templates) / sizeof(descriptor_templates[0]); i++) {
+        uint8_t out[MAX_WALLET_POLICY_MEMORY_SIZE];
+        uint8_t out_stream[MAX_WALLET_POLICY_MEMORY_SIZE];
+        memset(out, 0, sizeof(out));
+        memset(out_stream, 0, sizeof(out_stream));
+
+        assert_int_equal(parse_policy(descriptor_templates[i], out, sizeof(out)), 0);
+        assert_int_equal(
+            parse_policy_stream(descriptor_templates[i], SIZE_MAX, out_stream, sizeof(out_stream)),
+            0);
+        assert_memory_equal(out, out_stream, sizeof(out));
+    }
+
+    uint8_t out[MAX_WALLET_POLICY_MEMORY_SIZE];
+
+    // excess byte not allowed, also after the first window
+    assert_true(0 > parse_policy_stream("pkh(@0/**) ", SIZE_MAX, out, sizeof(out)));
+    char long_template[256];
+    snprintf(long_template, sizeof(long_template), "%s)", descriptor_templates[5]);
+    assert_true(0 > parse_policy_stream(long_template, SIZE_MAX, out, sizeof(out)));
+
+    // missing closing parenthesis
+    assert_true(0 > parse_policy_stream("pkh(@0/**", SIZE_MAX, out, sizeof(out)));
+
+    // the parsing fails if the template cannot be read, even after the first window
+    assert_true(0 > parse_policy_stream(descriptor_templates[5], 0, out, sizeof(out)));
+    assert_true(0 > parse_policy_stream(descriptor_templates[5],
+                                        DESCRIPTOR_TEMPLATE_WINDOW_SIZE + 1,
+                                        out,
+                                        sizeof(out)));
+}
+
 static void test_miniscript_types(void **state) {
     (void) state;
 
@@ -511,7 +731,10 @@ int main() {
         cmocka_unit_test(test_parse_policy_map_multisig_3),
         cmocka_unit_test(test_parse_policy_tr),
         cmocka_unit_test(test_parse_policy_tr_multisig),
+        cmocka_unit_test(test_parse_policy_tr_multisig_large),
+        cmocka_unit_test(test_parse_policy_tr_deep),
         cmocka_unit_test(test_failures),
+        cmocka_unit_test(test_parse_policy_stream),
         cmocka_unit_test(test_miniscript_types),
     };
 